@@ -21,6 +21,7 @@
 #include <string>
 #include <vector>
 #include <sstream>
+#include <chrono>
 
 #include "alertracker.h"
 #include "devicetracker.h"
@@ -32,16 +33,68 @@
 #include "kismet_json.h"
 #include "base64.h"
 
+// Rate limits run on a monotonic clock so they survive the wall clock jumping
+static int64_t alert_now_usec() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static bool alert_bucket_conforms(const std::atomic<int64_t>& in_tat,
+        int64_t in_tolerance, int64_t in_now) {
+    int64_t tat = in_tat.load(std::memory_order_relaxed);
+
+    return tat <= in_now || tat - in_now <= in_tolerance;
+}
+
+static bool alert_bucket_consume(std::atomic<int64_t>& in_tat, int64_t in_interval,
+        int64_t in_tolerance, int64_t in_now) {
+    int64_t tat = in_tat.load(std::memory_order_relaxed);
+
+    while (1) {
+        int64_t base = tat < in_now ? in_now : tat;
+
+        if (base - in_now > in_tolerance)
+            return false;
+
+        if (in_tat.compare_exchange_weak(tat, base + in_interval,
+                    std::memory_order_relaxed))
+            return true;
+    }
+}
+
 Alertracker::Alertracker(GlobalRegistry *in_globalreg) :
     Kis_Net_Httpd_CPPStream_Handler(in_globalreg) {
+
+    Httpd_RegisterRoute("GET", "/alerts/*");
+    Httpd_RegisterRoute("POST", "/alerts/definitions/define_alert");
+    Httpd_RegisterRoute("POST", "/alerts/raise_alert");
+
 	globalreg = in_globalreg;
 	next_alert_id = 0;
+    next_alert_cb_id = 0;
+    alert_version = 0;
+    num_backlog = 50;
 
     pthread_mutexattr_t mutexattr;
     pthread_mutexattr_init(&mutexattr);
     pthread_mutexattr_settype(&mutexattr, PTHREAD_MUTEX_RECURSIVE);
 	pthread_mutex_init(&alert_mutex, &mutexattr);
 
+    for (int i = 0; i < max_alert_refs; i++)
+        alert_rate_table[i] = NULL;
+
+    // The queue always holds one spent node for the producers to link behind
+    alert_queue_tail = new alert_queue_node;
+    alert_queue_tail->next = NULL;
+    alert_queue_tail->info = NULL;
+    alert_queue_tail->rec = NULL;
+    alert_queue_head = alert_queue_tail;
+
+    dispatch_sleeping = false;
+    dispatch_stop = false;
+
+    StartDispatchThread();
+
 	if (globalreg->kismet_config == NULL) {
 		fprintf(stderr, "FATAL OOPS:  Alertracker called with null config\n");
 		exit(1);
@@ -64,6 +117,11 @@ Alertracker::Alertracker(GlobalRegistry *in_globalreg) :
 		num_backlog = scantmp;
 	}
 
+    {
+        local_locker lock(&alert_mutex);
+        alert_backlog.set_capacity(num_backlog);
+    }
+
 	// Parse config file vector of all alerts
 	if (ParseAlertConfig(globalreg->kismet_config) < 0) {
 		_MSG("Failed to parse alert values from Kismet config file", MSGFLAG_FATAL);
@@ -77,6 +135,9 @@ Alertracker::Alertracker(GlobalRegistry *in_globalreg) :
     alert_timestamp_id =
         entrytracker->RegisterField("kismet.alert.timestamp",
                 TrackerDouble, "alert update timestamp");
+    alert_seq_id =
+        entrytracker->RegisterField("kismet.alert.sequence",
+                TrackerUInt64, "sequence of the next alert, for polling by sequence");
 
     shared_ptr<tracked_alert> alert_builder(new tracked_alert(globalreg, 0));
     alert_entry_id =
@@ -106,11 +167,24 @@ Alertracker::Alertracker(GlobalRegistry *in_globalreg) :
 }
 
 Alertracker::~Alertracker() {
+    // Deliver anything still queued before the backlog and callbacks go away
+    StopDispatchThread();
+
     pthread_mutex_lock(&alert_mutex);
 
     globalreg->RemoveGlobal("ALERTTRACKER");
     globalreg->alertracker = NULL;
 
+    for (int i = 0; i < max_alert_refs; i++) {
+        delete alert_rate_table[i].load();
+        alert_rate_table[i] = NULL;
+    }
+
+    delete alert_queue_tail;
+    alert_queue_tail = NULL;
+
+    alert_backlog.clear([](kis_alert_info *& a) { delete a; });
+
     pthread_mutex_destroy(&alert_mutex);
 }
 
@@ -139,6 +213,12 @@ int Alertracker::RegisterAlert(string in_header, string in_description,
         return -1;
     }
 
+    if (next_alert_id >= max_alert_refs) {
+        _MSG("Failed to register alert " + in_header + ", too many alerts are "
+                "registered", MSGFLAG_ERROR);
+        return -1;
+    }
+
     shared_alert_def arec = static_pointer_cast<tracked_alert_definition>(entrytracker->GetTrackedInstance(alert_def_id));
 
     arec->set_alert_ref(next_alert_id++);
@@ -155,6 +235,47 @@ int Alertracker::RegisterAlert(string in_header, string in_description,
 	alert_ref_map[arec->get_alert_ref()] = arec;
 
     alert_defs_vec.push_back(arec);
+    alert_version++;
+
+    alert_rate_rec *rrec = new alert_rate_rec;
+    rrec->def = arec;
+    rrec->header = arec->get_header();
+    rrec->phy = in_phy;
+    rrec->limit_interval = rrec->limit_tolerance = 0;
+    rrec->burst_interval = rrec->burst_tolerance = 0;
+    rrec->limit_tat = 0;
+    rrec->burst_tat = 0;
+
+    shared_ptr<KisMetrics> metrics =
+        globalreg->FetchGlobalAs<KisMetrics>("METRICS");
+
+    if (metrics != NULL) {
+        string labels = "alert=" + KisMetrics::label_escape(rrec->header);
+
+        rrec->metric_raised =
+            metrics->register_counter("kismet_alerts_raised", "alerts raised", labels);
+        rrec->metric_throttled =
+            metrics->register_counter("kismet_alerts_throttled",
+                    "alerts dropped by the rate and burst limits", labels);
+    } else {
+        rrec->metric_raised.reset(new kis_metric_counter());
+        rrec->metric_throttled.reset(new kis_metric_counter());
+    }
+
+    // A rate of 0 is unlimited; a burst of 0 only applies the main rate
+    if (in_rate > 0) {
+        int64_t unit_usec = (int64_t) alert_time_unit_conv[in_unit] * 1000000;
+        rrec->limit_interval = unit_usec / in_rate;
+        rrec->limit_tolerance = unit_usec - rrec->limit_interval;
+
+        if (in_burst > 0) {
+            unit_usec = (int64_t) alert_time_unit_conv[in_burstunit] * 1000000;
+            rrec->burst_interval = unit_usec / in_burst;
+            rrec->burst_tolerance = unit_usec - rrec->burst_interval;
+        }
+    }
+
+    alert_rate_table[arec->get_alert_ref()].store(rrec, std::memory_order_release);
 
 	return arec->get_alert_ref();
 }
@@ -168,71 +289,67 @@ int Alertracker::FetchAlertRef(string in_header) {
     return -1;
 }
 
-int Alertracker::CheckTimes(shared_alert_def arec) {
+int Alertracker::CheckTimes(alert_rate_rec *arec, bool in_consume) {
 	// Is this alert rate-limited?  If not, shortcut out and send it
-	if (arec->get_limit_rate() == 0) {
+    if (arec->limit_interval == 0)
 		return 1;
-	}
 
-	struct timeval now;
-	gettimeofday(&now, NULL);
+    int64_t now = alert_now_usec();
 
-	// If the last time we sent anything was longer than the main rate limit,
-	// then we reset back to empty
-	if (arec->get_time_last() < (now.tv_sec - 
-                alert_time_unit_conv[arec->get_limit_unit()])) {
-		arec->set_total_sent(0);
-		arec->set_burst_sent(0);
-		return 1;
-	}
+    if (!in_consume) {
+        if (!alert_bucket_conforms(arec->limit_tat, arec->limit_tolerance, now))
+            return 0;
 
-	// If the last time we sent anything was longer than the burst rate, we can
-	// reset the burst to 0
-	if (arec->get_time_last() < (now.tv_sec - 
-                alert_time_unit_conv[arec->get_burst_unit()])) {
-		arec->set_burst_sent(0);
-	}
+        if (arec->burst_interval != 0 &&
+                !alert_bucket_conforms(arec->burst_tat, arec->burst_tolerance, now))
+            return 0;
 
-	// If we're under the limit on both, we're good to go
-	if (arec->get_burst_sent() < arec->get_limit_burst() && 
-            arec->get_total_sent() < arec->get_limit_rate())
-		return 1;
+        return 1;
+    }
+
+    if (!alert_bucket_consume(arec->limit_tat, arec->limit_interval, 
+                arec->limit_tolerance, now))
+        return 0;
+
+    // Give the rate token back if the burst is exhausted
+    if (arec->burst_interval != 0 &&
+            !alert_bucket_consume(arec->burst_tat, arec->burst_interval,
+                arec->burst_tolerance, now)) {
+        arec->limit_tat.fetch_sub(arec->limit_interval, std::memory_order_relaxed);
+        return 0;
+    }
 
-	return 0;
+	return 1;
 }
 
 int Alertracker::PotentialAlert(int in_ref) {
-    local_locker lock(&alert_mutex);
+    alert_rate_rec *arec = FetchRateRec(in_ref);
 
-	map<int, shared_alert_def>::iterator aritr = alert_ref_map.find(in_ref);
-
-	if (aritr == alert_ref_map.end())
+    if (arec == NULL)
 		return 0;
 
-	shared_alert_def arec = aritr->second;
-
-	return CheckTimes(arec);
+	return CheckTimes(arec, false);
 }
 
 int Alertracker::RaiseAlert(int in_ref, kis_packet *in_pack,
 							mac_addr bssid, mac_addr source, mac_addr dest, 
 							mac_addr other, string in_channel, string in_text) {
-    local_locker lock(&alert_mutex);
-
-	map<int, shared_alert_def>::iterator aritr = alert_ref_map.find(in_ref);
+    alert_rate_rec *arec = FetchRateRec(in_ref);
 
-	if (aritr == alert_ref_map.end())
+    if (arec == NULL)
 		return -1;
 
-	shared_alert_def arec = aritr->second;
-
-	if (CheckTimes(arec) != 1)
+	if (CheckTimes(arec, true) != 1) {
+        arec->metric_throttled->inc();
 		return 0;
+    }
+
+    arec->metric_raised->inc();
 
 	kis_alert_info *info = new kis_alert_info;
 
-	info->header = arec->get_header();
-	info->phy = arec->get_phy();
+	info->header = arec->header;
+	info->phy = arec->phy;
 	gettimeofday(&(info->tm), NULL);
 
 	info->bssid = bssid;
@@ -244,18 +361,8 @@ int Alertracker::RaiseAlert(int in_ref, kis_packet *in_pack,
 
 	info->text = in_text;
 
-	// Increment and set the timers
-    arec->inc_burst_sent(1);
-    arec->inc_total_sent(1);
-    arec->set_time_last(ts_to_double(info->tm));
-
-	alert_backlog.push_back(info);
-	if ((int) alert_backlog.size() > num_backlog) {
-		delete alert_backlog[0];
-		alert_backlog.erase(alert_backlog.begin());
-	}
-
-	// Try to get the existing alert info
+	// Try to get the existing alert info; the packet is only ours, so this
+    // happens now, before the dispatcher can see the alert
 	if (in_pack != NULL)  {
 		kis_alert_component *acomp = 
 			(kis_alert_component *) in_pack->fetch(_PCM(PACK_COMP_ALERT));
@@ -270,12 +377,132 @@ int Alertracker::RaiseAlert(int in_ref, kis_packet *in_pack,
 		acomp->alert_vec.push_back(info);
 	}
 
-	// Send the text info
-	_MSG(info->header + " " + info->text, MSGFLAG_ALERT);
+    // The backlog, callbacks, and messagebus are the dispatcher's job
+    QueueAlert(info, arec);
 
 	return 1;
 }
 
+void Alertracker::QueueAlert(kis_alert_info *in_info, alert_rate_rec *in_rec) {
+    alert_queue_node *node = new alert_queue_node;
+    node->next.store(NULL, std::memory_order_relaxed);
+    node->info = in_info;
+    node->rec = in_rec;
+
+    alert_queue_node *prev = alert_queue_head.exchange(node, std::memory_order_acq_rel);
+    prev->next.store(node);
+
+    // The dispatcher only needs a poke when it's asleep; the timeout catches any
+    // wakeup we race with
+    if (dispatch_sleeping) {
+        std::lock_guard<std::mutex> lk(dispatch_mutex);
+        dispatch_cv.notify_one();
+    }
+}
+
+bool Alertracker::PopAlert(kis_alert_info **ret_info, alert_rate_rec **ret_rec) {
+    alert_queue_node *tail = alert_queue_tail;
+    alert_queue_node *next = tail->next.load(std::memory_order_acquire);
+
+    // Empty, or a producer hasn't finished linking its node yet
+    if (next == NULL)
+        return false;
+
+    // The popped node becomes the spent node at the tail
+    *ret_info = next->info;
+    *ret_rec = next->rec;
+    next->info = NULL;
+    next->rec = NULL;
+
+    alert_queue_tail = next;
+    delete tail;
+
+    return true;
+}
+
+void Alertracker::DispatchAlert(kis_alert_info *in_info, alert_rate_rec *in_rec) {
+    {
+        local_locker lock(&alert_mutex);
+
+        shared_alert_def def = in_rec->def;
+
+        def->inc_total_sent(1);
+        def->set_time_last(ts_to_double(in_info->tm));
+
+        // Alerts currently held against the burst limit
+        uint64_t burst_sent = 1;
+        if (in_rec->burst_interval != 0) {
+            int64_t held = in_rec->burst_tat.load(std::memory_order_relaxed) - 
+                alert_now_usec();
+
+            if (held > 0)
+                burst_sent = (held + in_rec->burst_interval - 1) / in_rec->burst_interval;
+        }
+        def->set_burst_sent(burst_sent);
+
+        kis_alert_info *evicted = NULL;
+        alert_backlog.push(in_info, ts_to_double(in_info->tm), &evicted);
+
+        alert_version++;
+
+        for (auto cb : alert_cb_map)
+            cb.second(in_info);
+
+        // Send the text info; the info can only be read under the lock, since
+        // the next alert can push it out of the backlog
+        _MSG(in_info->header + " " + in_info->text, MSGFLAG_ALERT);
+
+        // Released last; with no backlog, that's this alert
+        delete evicted;
+    }
+}
+
+void Alertracker::StartDispatchThread() {
+    dispatch_stop = false;
+    dispatch_thread = std::thread([this]() { DispatchThread(); });
+}
+
+void Alertracker::StopDispatchThread() {
+    if (!dispatch_thread.joinable())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lk(dispatch_mutex);
+        dispatch_stop = true;
+        dispatch_cv.notify_one();
+    }
+
+    dispatch_thread.join();
+}
+
+void Alertracker::DispatchThread() {
+    kis_alert_info *info;
+    alert_rate_rec *rec;
+
+    while (1) {
+        while (PopAlert(&info, &rec))
+            DispatchAlert(info, rec);
+
+        // Once we're told to stop, finish anything that's still being linked
+        // in and exit
+        if (dispatch_stop) {
+            if (alert_queue_head.load() == alert_queue_tail)
+                break;
+
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lk(dispatch_mutex);
+
+        dispatch_sleeping = true;
+
+        if (alert_queue_tail->next.load() == NULL && !dispatch_stop)
+            dispatch_cv.wait_for(lk, std::chrono::milliseconds(100));
+
+        dispatch_sleeping = false;
+    }
+}
+
 int Alertracker::ParseAlertStr(string alert_str, string *ret_name, 
 							   alert_time_unit *ret_limit_unit, int *ret_limit_rate,
 							   alert_time_unit *ret_limit_burst, 
@@ -415,6 +642,21 @@ int Alertracker::FindActivatedAlert(string in_header) {
     return -1;
 }
 
+int Alertracker::RegisterAlertCallback(function<void (kis_alert_info *)> in_cb) {
+    local_locker lock(&alert_mutex);
+
+    int id = next_alert_cb_id++;
+    alert_cb_map[id] = in_cb;
+
+    return id;
+}
+
+void Alertracker::RemoveAlertCallback(int in_id) {
+    local_locker lock(&alert_mutex);
+
+    alert_cb_map.erase(in_id);
+}
+
 bool Alertracker::Httpd_VerifyPath(const char *path, const char *method) {
     if (!Httpd_CanSerialize(path))
         return false;
@@ -430,7 +672,7 @@ bool Alertracker::Httpd_VerifyPath(const char *path, const char *method) {
                 return true;
             } else if (Httpd_StripSuffix(tokenurl[2]) == "all_alerts") {
                 return true;
-            } else if (tokenurl[2] == "last-time") {
+            } else if (tokenurl[2] == "last-time" || tokenurl[2] == "last-seq") {
                 if (tokenurl.size() < 5)
                     return false;
 
@@ -459,6 +701,18 @@ bool Alertracker::Httpd_VerifyPath(const char *path, const char *method) {
     return false;
 }
 
+bool Alertracker::Httpd_ETag(const char *path, uint64_t *etag) {
+    string stripped = Httpd_StripSuffix(path);
+
+    // Time-since lists carry the time they were generated, so they always change
+    if (stripped != "/alerts/definitions" && stripped != "/alerts/all_alerts")
+        return false;
+
+    *etag = alert_version;
+
+    return true;
+}
+
 void Alertracker::Httpd_CreateStreamResponse(
         Kis_Net_Httpd *httpd __attribute__((unused)),
         Kis_Net_Httpd_Connection *connection,
@@ -466,6 +720,8 @@ void Alertracker::Httpd_CreateStreamResponse(
         size_t *upload_data_size, std::stringstream &stream) {
 
     double since_time = 0;
+    uint64_t since_seq = 0;
+    bool by_seq = false;
     bool wrap = false;
 
     if (strcmp(method, "GET") != 0) {
@@ -492,6 +748,15 @@ void Alertracker::Httpd_CreateStreamResponse(
             ss >> since_time;
 
             wrap = true;
+        } else if (tokenurl[2] == "last-seq") {
+            if (tokenurl.size() < 5)
+                return;
+
+            std::stringstream ss(tokenurl[3]);
+            ss >> since_seq;
+
+            wrap = true;
+            by_seq = true;
         }
     }
 
@@ -509,18 +774,24 @@ void Alertracker::Httpd_CreateStreamResponse(
             SharedTrackerElement ts(globalreg->entrytracker->GetTrackedInstance(alert_timestamp_id));
             ts->set((double) ts_now_to_double());
             wrapper->add_map(ts);
+
+            SharedTrackerElement seq(globalreg->entrytracker->GetTrackedInstance(alert_seq_id));
+            seq->set((uint64_t) alert_backlog.get_next_seq());
+            wrapper->add_map(seq);
         } else {
             wrapper = msgvec;
         }
 
-        for (vector<kis_alert_info *>::iterator i = alert_backlog.begin();
-                i != alert_backlog.end(); ++i) {
-            if (since_time < ts_to_double((*i)->tm)) {
-                shared_ptr<tracked_alert> ta(new tracked_alert(globalreg, alert_entry_id));
-                ta->from_alert_info(*i);
-                msgvec->add_vector(ta);
-            }
-        }
+        auto add_fn = [this, msgvec](uint64_t, kis_alert_info *a) {
+            shared_ptr<tracked_alert> ta(new tracked_alert(globalreg, alert_entry_id));
+            ta->from_alert_info(a);
+            msgvec->add_vector(ta);
+        };
+
+        if (by_seq)
+            alert_backlog.for_each_from_seq(since_seq, add_fn);
+        else
+            alert_backlog.for_each_since_time(since_time, add_fn);
 
         Httpd_Serialize(path, stream, wrapper);
     }
@@ -546,13 +817,7 @@ int Alertracker::Httpd_PostComplete(Kis_Net_Httpd_Connection *concls) {
     SharedStructured structdata;
 
     try {
-        if (concls->variable_cache.find("msgpack") != concls->variable_cache.end()) {
-            structdata.reset(new StructuredMsgpack(Base64::decode(concls->variable_cache["msgpack"]->str())));
-        } else if (concls->variable_cache.find("json") != concls->variable_cache.end()) {
-            structdata.reset(new StructuredJson(concls->variable_cache["json"]->str()));
-        } else {
-            throw std::runtime_error("could not find data");
-        }
+        structdata = concls->FetchStructuredPost();
 
         if (stripped == "/alerts/definitions/define_alert") {
             string name = structdata->getKeyAsString("name");
@@ -28,12 +28,19 @@
 #include <vector>
 #include <algorithm>
 #include <string>
+#include <functional>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #include "globalregistry.h"
 #include "messagebus.h"
 #include "packetchain.h"
 #include "timetracker.h"
 #include "kis_net_microhttpd.h"
+#include "kis_metrics.h"
+#include "kis_backlog.h"
 
 // TODO:
 // - move packet_component to a tracked system & just use the converted
@@ -313,10 +320,12 @@ public:
     // Find a reference from a name
     int FetchAlertRef(string in_header);
 
-    // Will an alert succeed?
+    // Will an alert succeed?  Neither this nor RaiseAlert takes the alert mutex,
+    // so both are safe to call for every packet.
     int PotentialAlert(int in_ref);
 
-    // Raise an alert ...
+    // Raise an alert; it's attached to the packet immediately, and added to the
+    // backlog and sent to callbacks and the messagebus by the dispatch thread
     int RaiseAlert(int in_ref, kis_packet *in_pack,
                    mac_addr bssid, mac_addr source, mac_addr dest, mac_addr other,
                    string in_channel, string in_text);
@@ -340,6 +349,12 @@ public:
     // Find an activated alert
     int FindActivatedAlert(string in_header);
 
+    // Register a function to be called with every alert as it is raised; the
+    // callback runs on the alert dispatch thread with the alert mutex held.
+    // Returns an id for removing it.
+    int RegisterAlertCallback(function<void (kis_alert_info *)> in_cb);
+    void RemoveAlertCallback(int in_id);
+
     virtual bool Httpd_VerifyPath(const char *path, const char *method);
 
     virtual void Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd,
@@ -349,16 +364,87 @@ public:
 
     virtual int Httpd_PostComplete(Kis_Net_Httpd_Connection *concls);
 
+    virtual bool Httpd_StreamStructuredPost() { return true; }
+
+    // Alert lists and definitions are tagged with the alert version
+    virtual bool Httpd_ETag(const char *path, uint64_t *etag);
+
 protected:
     pthread_mutex_t alert_mutex;
 
+    // Bumped whenever an alert is registered or sent, which changes the
+    // definitions and the backlog; read without the lock for ETags
+    std::atomic<uint64_t> alert_version;
+
     shared_ptr<Packetchain> packetchain;
     shared_ptr<EntryTracker> entrytracker;
 
-    int alert_vec_id, alert_entry_id, alert_timestamp_id, alert_def_id;
+    int alert_vec_id, alert_entry_id, alert_timestamp_id, alert_def_id, alert_seq_id;
+
+    // Rate limits of a registered alert, indexed by alert ref so the packet path
+    // can find and throttle an alert without taking the alert mutex.
+    //
+    // Both limits are token buckets kept as a single atomic 'theoretical arrival
+    // time' each (GCRA): an alert conforms if the bucket tat is no more than
+    // tolerance past now, and sending one pushes tat forward by one interval.  A
+    // rate of N per unit allows N back to back, then one every unit/N.
+    struct alert_rate_rec {
+        shared_alert_def def;
+
+        // Copied from the definition, which can't be read without the lock
+        string header;
+        int phy;
+
+        // Usec; an interval of 0 is unlimited
+        int64_t limit_interval, limit_tolerance;
+        int64_t burst_interval, burst_tolerance;
+
+        std::atomic<int64_t> limit_tat, burst_tat;
+
+        // Alerts raised and held back by the rate limits, for /metrics
+        shared_ptr<kis_metric_counter> metric_raised, metric_throttled;
+    };
+
+    // Upper bound on registered alerts; the table is never resized, so a ref
+    // can be looked up while another alert is being registered
+    static const int max_alert_refs = 1024;
 
-    // Check and age times
-    int CheckTimes(shared_alert_def arec);
+    std::atomic<alert_rate_rec *> alert_rate_table[max_alert_refs];
+
+    alert_rate_rec *FetchRateRec(int in_ref) {
+        if (in_ref < 0 || in_ref >= max_alert_refs)
+            return NULL;
+        return alert_rate_table[in_ref].load(std::memory_order_acquire);
+    }
+
+    // Check and age times; consumes a token from both buckets if in_consume
+    int CheckTimes(alert_rate_rec *arec, bool in_consume);
+
+    // Raised alerts are queued for the dispatch thread, which adds them to the
+    // backlog, calls the alert callbacks, and sends them to the messagebus.
+    // The queue is an intrusive MPSC list (Vyukov); raising an alert is one
+    // atomic exchange, and only the dispatcher pops.
+    struct alert_queue_node {
+        std::atomic<alert_queue_node *> next;
+        kis_alert_info *info;
+        alert_rate_rec *rec;
+    };
+
+    std::atomic<alert_queue_node *> alert_queue_head;
+    alert_queue_node *alert_queue_tail;
+
+    void QueueAlert(kis_alert_info *in_info, alert_rate_rec *in_rec);
+    bool PopAlert(kis_alert_info **ret_info, alert_rate_rec **ret_rec);
+    void DispatchAlert(kis_alert_info *in_info, alert_rate_rec *in_rec);
+
+    void StartDispatchThread();
+    void StopDispatchThread();
+    void DispatchThread();
+
+    std::thread dispatch_thread;
+    std::mutex dispatch_mutex;
+    std::condition_variable dispatch_cv;
+    std::atomic<bool> dispatch_sleeping, dispatch_stop;
 
 	// Parse a foo/bar rate/unit option
 	int ParseRateUnit(string in_ru, alert_time_unit *ret_unit, int *ret_rate);
@@ -378,10 +464,14 @@ protected:
     int num_backlog;
 
     // Backlog of alerts to be sent
-    vector<kis_alert_info *> alert_backlog;
+    kis_backlog<kis_alert_info *> alert_backlog;
 
     // Alert configs we read before we know the alerts themselves
 	map<string, alert_conf_rec *> alert_conf_map;
+
+    // Listeners for raised alerts
+    int next_alert_cb_id;
+    map<int, function<void (kis_alert_info *)> > alert_cb_map;
 };
 
 #endif
@@ -0,0 +1,942 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "alertrules.h"
+#include "alertracker.h"
+#include "configfile.h"
+#include "devicetracker.h"
+#include "entrytracker.h"
+#include "kis_clock.h"
+#include "messagebus.h"
+#include "packet_ieee80211.h"
+#include "phy_80211.h"
+#include "util.h"
+
+// Windows kept per rule before the stale ones are thrown out
+#define ALERTRULE_MAX_WINDOWS       4096
+
+// Named 802.11 subtypes, and the type they belong to
+static const struct {
+    const char *name;
+    int type;
+    int subtype;
+} alertrule_subtypes[] = {
+    { "assoc_req", packet_management, packet_sub_association_req },
+    { "assoc_resp", packet_management, packet_sub_association_resp },
+    { "reassoc_req", packet_management, packet_sub_reassociation_req },
+    { "reassoc_resp", packet_management, packet_sub_reassociation_resp },
+    { "probe_req", packet_management, packet_sub_probe_req },
+    { "probe_resp", packet_management, packet_sub_probe_resp },
+    { "beacon", packet_management, packet_sub_beacon },
+    { "atim", packet_management, packet_sub_atim },
+    { "disassoc", packet_management, packet_sub_disassociation },
+    { "auth", packet_management, packet_sub_authentication },
+    { "deauth", packet_management, packet_sub_deauthentication },
+    { "action", packet_management, packet_sub_action },
+    { "block_ack_req", packet_phy, packet_sub_block_ack_req },
+    { "block_ack", packet_phy, packet_sub_block_ack },
+    { "pspoll", packet_phy, packet_sub_pspoll },
+    { "rts", packet_phy, packet_sub_rts },
+    { "cts", packet_phy, packet_sub_cts },
+    { "ack", packet_phy, packet_sub_ack },
+    { NULL, 0, 0 }
+};
+
+shared_ptr<AlertRules> AlertRules::create_alertrules(GlobalRegistry *in_globalreg) {
+    vector<string> defs = in_globalreg->kismet_config->FetchOptVec("alertrule");
+
+    if (defs.size() == 0)
+        return NULL;
+
+    shared_ptr<AlertRules> mon(new AlertRules(in_globalreg));
+    in_globalreg->RegisterLifetimeGlobal(mon);
+    in_globalreg->InsertGlobal("ALERT_RULES", mon);
+
+    GlobalRegistry *globalreg = in_globalreg;
+
+    for (auto d : defs) {
+        string err;
+
+        if (mon->AddRule(d, &err) < 0) {
+            _MSG("Invalid alertrule '" + d + "': " + err, MSGFLAG_FATAL);
+            globalreg->fatal_condition = 1;
+            return mon;
+        }
+    }
+
+    _MSG("Compiled " + IntToString(mon->rules.size()) + " alert rules into " +
+            IntToString(mon->predicates.size()) + " predicates", MSGFLAG_INFO);
+
+    globalreg->packetchain->RegisterHandler(&packet_hook, mon.get(),
+            CHAINPOS_CLASSIFIER, -40, "alert rules");
+
+    return mon;
+}
+
+AlertRules::AlertRules(GlobalRegistry *in_globalreg) :
+    Kis_Net_Httpd_CPPStream_Handler(in_globalreg) {
+
+    Httpd_RegisterRoute("GET", "/alerts/rules");
+
+    globalreg = in_globalreg;
+
+    packets = 0;
+
+    pack_comp_80211 = globalreg->packetchain->RegisterPacketComponent("PHY80211");
+    pack_comp_l1info = globalreg->packetchain->RegisterPacketComponent("RADIODATA");
+    pack_comp_common = globalreg->packetchain->RegisterPacketComponent("COMMON");
+
+    rules_id =
+        globalreg->entrytracker->RegisterField("kismet.alertrules",
+                TrackerMap, "alert rules");
+    rules_packets_id =
+        globalreg->entrytracker->RegisterField("kismet.alertrules.packets",
+                TrackerUInt64, "packets checked against the rules");
+    rules_list_id =
+        globalreg->entrytracker->RegisterField("kismet.alertrules.rule_list",
+                TrackerVector, "alert rules");
+    rule_id =
+        globalreg->entrytracker->RegisterField("kismet.alertrules.rule",
+                TrackerMap, "alert rule");
+    rule_name_id =
+        globalreg->entrytracker->RegisterField("kismet.alertrules.rule.name",
+                TrackerString, "alert raised by the rule");
+    rule_definition_id =
+        globalreg->entrytracker->RegisterField("kismet.alertrules.rule.definition",
+                TrackerString, "rule as configured");
+    rule_evaluated_id =
+        globalreg->entrytracker->RegisterField("kismet.alertrules.rule.evaluated",
+                TrackerUInt64, "packets checked against the rule");
+    rule_predicates_id =
+        globalreg->entrytracker->RegisterField("kismet.alertrules.rule.predicates",
+                TrackerUInt64, "predicates evaluated for the rule, not counting "
+                "ones already evaluated by another rule");
+    rule_matched_id =
+        globalreg->entrytracker->RegisterField("kismet.alertrules.rule.matched",
+                TrackerUInt64, "packets which matched the rule");
+    rule_raised_id =
+        globalreg->entrytracker->RegisterField("kismet.alertrules.rule.raised",
+                TrackerUInt64, "alerts raised by the rule");
+    rule_nsec_id =
+        globalreg->entrytracker->RegisterField("kismet.alertrules.rule.nsec",
+                TrackerUInt64, "total nanoseconds spent checking the rule");
+}
+
+AlertRules::~AlertRules() {
+    globalreg->RemoveGlobal("ALERT_RULES");
+
+    if (globalreg->packetchain != NULL)
+        globalreg->packetchain->RemoveHandler(&packet_hook, CHAINPOS_CLASSIFIER);
+
+    for (auto r : rules)
+        delete r;
+}
+
+// Split on commas outside of quotes, dropping the quotes
+static vector<string> alertrule_split(const string& in_str) {
+    vector<string> ret;
+    string cur;
+    bool quoted = false;
+
+    for (size_t x = 0; x < in_str.length(); x++) {
+        if (in_str[x] == '"') {
+            quoted = !quoted;
+            continue;
+        }
+
+        if (in_str[x] == ',' && !quoted) {
+            ret.push_back(cur);
+            cur = "";
+            continue;
+        }
+
+        cur += in_str[x];
+    }
+
+    ret.push_back(cur);
+
+    return ret;
+}
+
+int AlertRules::AddRule(const string& in_def, string *ret_err) {
+    size_t colon = in_def.find(':');
+
+    if (colon == string::npos || colon == 0) {
+        *ret_err = "expected NAME:predicates";
+        return -1;
+    }
+
+    alert_rule *rule = new alert_rule();
+
+    rule->name = in_def.substr(0, colon);
+    rule->definition = in_def.substr(colon + 1, in_def.length());
+    rule->phyid = KIS_PHY_ANY;
+    rule->threshold = 0;
+    rule->window_sec = 0;
+    rule->key = key_none;
+    rule->evaluated = 0;
+    rule->predicates_run = 0;
+    rule->matched = 0;
+    rule->raised = 0;
+    rule->nsec = 0;
+
+    int type = -1, subtype = -1;
+    bool dot11_only = false;
+
+    vector<rule_predicate> preds;
+
+    for (auto t : alertrule_split(rule->definition)) {
+        t = StrStrip(t);
+
+        if (t.length() == 0)
+            continue;
+
+        // Options of the rule rather than predicates
+        string lt = StrLower(t);
+
+        if (lt.find("text=") == 0) {
+            rule->text = t.substr(5, t.length());
+            continue;
+        }
+
+        if (lt.find("count=") == 0) {
+            unsigned long long n;
+            unsigned int w;
+            char unit = 's';
+
+            if (sscanf(lt.c_str() + 6, "%llu/%u%c", &n, &w, &unit) < 2 || n == 0 ||
+                    w == 0) {
+                *ret_err = "expected count=N/W";
+                delete rule;
+                return -1;
+            }
+
+            if (unit == 'm')
+                w *= 60;
+            else if (unit == 'h')
+                w *= 3600;
+            else if (unit != 's') {
+                *ret_err = "count window must be in s, m, or h";
+                delete rule;
+                return -1;
+            }
+
+            rule->threshold = n;
+            rule->window_sec = w;
+            continue;
+        }
+
+        if (lt.find("key=") == 0) {
+            string k = lt.substr(4, lt.length());
+
+            if (k == "source")
+                rule->key = key_source;
+            else if (k == "dest")
+                rule->key = key_dest;
+            else if (k == "bssid")
+                rule->key = key_bssid;
+            else if (k == "other")
+                rule->key = key_other;
+            else if (k == "none")
+                rule->key = key_none;
+            else {
+                *ret_err = "unknown key '" + k + "'";
+                delete rule;
+                return -1;
+            }
+
+            continue;
+        }
+
+        // Indexed fields; only ever equal
+        if (lt.find("phy=") == 0) {
+            Kis_Phy_Handler *phy =
+                globalreg->devicetracker->FetchPhyHandlerByName(t.substr(4, t.length()));
+
+            if (phy == NULL) {
+                *ret_err = "unknown phy '" + t.substr(4, t.length()) + "'";
+                delete rule;
+                return -1;
+            }
+
+            rule->phyid = phy->FetchPhyId();
+            continue;
+        }
+
+        if (lt.find("type=") == 0) {
+            string v = lt.substr(5, lt.length());
+
+            if (v == "mgmt" || v == "management" || v == "0")
+                type = packet_management;
+            else if (v == "ctrl" || v == "control" || v == "1")
+                type = packet_phy;
+            else if (v == "data" || v == "2")
+                type = packet_data;
+            else {
+                *ret_err = "unknown type '" + v + "'";
+                delete rule;
+                return -1;
+            }
+
+            dot11_only = true;
+            continue;
+        }
+
+        if (lt.find("subtype=") == 0) {
+            string v = lt.substr(8, lt.length());
+            unsigned int s;
+
+            subtype = -1;
+
+            for (unsigned int x = 0; alertrule_subtypes[x].name != NULL; x++) {
+                if (v == alertrule_subtypes[x].name) {
+                    if (type >= 0 && type != alertrule_subtypes[x].type) {
+                        *ret_err = "subtype '" + v + "' is not of that type";
+                        delete rule;
+                        return -1;
+                    }
+
+                    type = alertrule_subtypes[x].type;
+                    subtype = alertrule_subtypes[x].subtype;
+                    break;
+                }
+            }
+
+            if (subtype < 0) {
+                if (sscanf(v.c_str(), "%u", &s) != 1 || s > 15) {
+                    *ret_err = "unknown subtype '" + v + "'";
+                    delete rule;
+                    return -1;
+                }
+
+                subtype = s;
+            }
+
+            dot11_only = true;
+            continue;
+        }
+
+        rule_predicate p;
+
+        if (ParsePredicate(t, &p, ret_err) < 0) {
+            delete rule;
+            return -1;
+        }
+
+        if (p.field == field_bssid || p.field == field_other || p.field == field_ssid ||
+                p.field == field_reason || p.field == field_encrypted)
+            dot11_only = true;
+
+        preds.push_back(p);
+    }
+
+    if (rule->text.length() == 0) {
+        rule->text = "Alert rule " + rule->name + " matched";
+
+        if (rule->threshold != 0)
+            rule->text += " {count} times in " + UIntToString(rule->window_sec) +
+                " seconds";
+
+        rule->text += " for {source}";
+    }
+
+    // Every rule is activated against the config, so its rate can be set with
+    // alert= like any other
+    rule->alert_ref =
+        globalreg->alertracker->ActivateConfiguredAlert(rule->name,
+                "Alert rule from the config:  " + rule->definition, rule->phyid);
+
+    if (rule->alert_ref < 0) {
+        *ret_err = "could not register alert '" + rule->name + "'";
+        delete rule;
+        return -1;
+    }
+
+    for (auto p : preds)
+        rule->predicates.push_back(SharePredicate(p));
+
+    rules.push_back(rule);
+
+    // Index the rule in every bucket it could match
+    rule_index *index = &any_index;
+
+    if (rule->phyid != KIS_PHY_ANY)
+        index = &(phy_indexes[rule->phyid]);
+
+    for (int ty = 0; ty < 3; ty++) {
+        if (type >= 0 && ty != type)
+            continue;
+
+        for (int st = 0; st < 16; st++) {
+            if (subtype >= 0 && st != subtype)
+                continue;
+
+            index->buckets[(ty * 16) + st].push_back(rule);
+        }
+    }
+
+    if (!dot11_only)
+        index->buckets[num_buckets - 1].push_back(rule);
+
+    return 1;
+}
+
+int AlertRules::ParsePredicate(const string& in_pred, rule_predicate *ret_pred,
+        string *ret_err) {
+    size_t opos = in_pred.find_first_of("=!<>");
+
+    if (opos == string::npos || opos == 0) {
+        *ret_err = "expected a predicate, field op value, in '" + in_pred + "'";
+        return -1;
+    }
+
+    string fname = StrLower(StrStrip(in_pred.substr(0, opos)));
+    string op;
+
+    size_t vpos = opos;
+    while (vpos < in_pred.length() && strchr("=!<>", in_pred[vpos]) != NULL)
+        op += in_pred[vpos++];
+
+    string val = StrStrip(in_pred.substr(vpos, in_pred.length()));
+
+    static const std::map<string, rule_field> field_map = {
+        { "source", field_source }, { "dest", field_dest }, { "bssid", field_bssid },
+        { "other", field_other }, { "ssid", field_ssid }, { "channel", field_channel },
+        { "reason", field_reason }, { "encrypted", field_encrypted },
+        { "signal", field_signal }, { "freq", field_freq },
+        { "datarate", field_datarate }, { "size", field_size }
+    };
+
+    auto fi = field_map.find(fname);
+
+    if (fi != field_map.end()) {
+        ret_pred->field = fi->second;
+    } else {
+        *ret_err = "unknown field '" + fname + "'";
+        return -1;
+    }
+
+    if (op == "=" || op == "==")
+        ret_pred->op = op_eq;
+    else if (op == "!=")
+        ret_pred->op = op_ne;
+    else if (op == "<")
+        ret_pred->op = op_lt;
+    else if (op == "<=")
+        ret_pred->op = op_le;
+    else if (op == ">")
+        ret_pred->op = op_gt;
+    else if (op == ">=")
+        ret_pred->op = op_ge;
+    else {
+        *ret_err = "unknown operator '" + op + "'";
+        return -1;
+    }
+
+    bool ordered = ret_pred->field >= field_reason;
+
+    if (!ordered && ret_pred->op != op_eq && ret_pred->op != op_ne) {
+        *ret_err = "field '" + fname + "' can only be compared with = or !=";
+        return -1;
+    }
+
+    if (!ParseValue(ret_pred->field, val, ret_pred)) {
+        *ret_err = "invalid value '" + val + "' for field '" + fname + "'";
+        return -1;
+    }
+
+    return 1;
+}
+
+bool AlertRules::ParseValue(rule_field in_field, const string& in_val,
+        rule_predicate *ret_pred) {
+    ret_pred->num = 0;
+
+    switch (in_field) {
+        case field_source:
+        case field_dest:
+        case field_bssid:
+        case field_other:
+            // Masks are allowed, as in the rest of the config
+            ret_pred->mac = mac_addr(in_val.c_str());
+            return !ret_pred->mac.error;
+        case field_ssid:
+        case field_channel:
+            ret_pred->str = in_val;
+            return true;
+        case field_encrypted:
+            if (StrLower(in_val) == "true") {
+                ret_pred->num = 1;
+                return true;
+            } else if (StrLower(in_val) == "false") {
+                ret_pred->num = 0;
+                return true;
+            }
+            break;
+        default:
+            break;
+    }
+
+    char *end;
+    ret_pred->num = strtod(in_val.c_str(), &end);
+
+    return end != in_val.c_str() && *end == '\0';
+}
+
+size_t AlertRules::SharePredicate(const rule_predicate& in_pred) {
+    for (size_t x = 0; x < predicates.size(); x++) {
+        const rule_predicate& p = predicates[x];
+
+        if (p.field != in_pred.field || p.op != in_pred.op)
+            continue;
+
+        if (p.num != in_pred.num || p.str != in_pred.str)
+            continue;
+
+        if (p.mac.longmac != in_pred.mac.longmac || p.mac.longmask != in_pred.mac.longmask)
+            continue;
+
+        return x;
+    }
+
+    predicates.push_back(in_pred);
+
+    return predicates.size() - 1;
+}
+
+int AlertRules::packet_hook(CHAINCALL_PARMS) {
+    AlertRules *ar = (AlertRules *) auxdata;
+
+    rule_packet rpack;
+    int phyid;
+    unsigned int bucket;
+
+    ar->FetchPacket(in_pack, &rpack, &phyid, &bucket);
+
+    const vector<alert_rule *>& any_rules = ar->any_index.buckets[bucket];
+    const vector<alert_rule *> *phy_rules = NULL;
+
+    auto pi = ar->phy_indexes.find(phyid);
+    if (pi != ar->phy_indexes.end())
+        phy_rules = &(pi->second.buckets[bucket]);
+
+    if (any_rules.size() == 0 && (phy_rules == NULL || phy_rules->size() == 0))
+        return 1;
+
+    ar->packets++;
+
+    // Results of the shared predicates for this packet, -1 until evaluated
+    static thread_local vector<int8_t> cache;
+    cache.assign(ar->predicates.size(), -1);
+
+    for (auto r : any_rules)
+        ar->EvalRule(r, in_pack, rpack, cache);
+
+    if (phy_rules != NULL) {
+        for (auto r : *phy_rules)
+            ar->EvalRule(r, in_pack, rpack, cache);
+    }
+
+    return 1;
+}
+
+void AlertRules::FetchPacket(kis_packet *in_pack, rule_packet *ret_rpack, int *ret_phyid,
+        unsigned int *ret_bucket) {
+    ret_rpack->dot11 = ret_rpack->l1 = ret_rpack->common = false;
+    ret_rpack->reason = ret_rpack->encrypted = ret_rpack->signal = 0;
+    ret_rpack->freq = ret_rpack->datarate = ret_rpack->size = 0;
+
+    *ret_phyid = KIS_PHY_UNKNOWN;
+    *ret_bucket = num_buckets - 1;
+
+    kis_common_info *common = (kis_common_info *) in_pack->fetch(pack_comp_common);
+
+    if (common != NULL) {
+        ret_rpack->common = true;
+        *ret_phyid = common->phyid;
+
+        ret_rpack->source = common->source;
+        ret_rpack->dest = common->dest;
+        ret_rpack->channel = common->channel;
+        ret_rpack->freq = common->freq_khz / 1000;
+        ret_rpack->size = common->datasize;
+    }
+
+    dot11_packinfo *dot11info = (dot11_packinfo *) in_pack->fetch(pack_comp_80211);
+
+    if (dot11info != NULL && !dot11info->corrupt) {
+        ret_rpack->dot11 = true;
+
+        ret_rpack->source = dot11info->source_mac;
+        ret_rpack->dest = dot11info->dest_mac;
+        ret_rpack->bssid = dot11info->bssid_mac;
+        ret_rpack->other = dot11info->other_mac;
+        ret_rpack->ssid = dot11info->ssid;
+        ret_rpack->reason = dot11info->mgt_reason_code;
+        ret_rpack->encrypted = (dot11info->cryptset != 0);
+
+        if (dot11info->channel.length() != 0 && dot11info->channel != "0")
+            ret_rpack->channel = dot11info->channel;
+
+        if (dot11info->type >= packet_management && dot11info->type <= packet_data &&
+                dot11info->subtype >= 0 && dot11info->subtype < 16)
+            *ret_bucket = (dot11info->type * 16) + dot11info->subtype;
+    }
+
+    kis_layer1_packinfo *l1info =
+        (kis_layer1_packinfo *) in_pack->fetch(pack_comp_l1info);
+
+    if (l1info != NULL) {
+        ret_rpack->l1 = true;
+
+        if (l1info->signal_type == kis_l1_signal_type_dbm)
+            ret_rpack->signal = l1info->signal_dbm;
+        else
+            ret_rpack->signal = l1info->signal_rssi;
+
+        if (l1info->freq_khz != 0)
+            ret_rpack->freq = l1info->freq_khz / 1000;
+
+        // In Mbit/sec, from 100kbit/sec
+        ret_rpack->datarate = (double) l1info->datarate / 10;
+    }
+}
+
+bool AlertRules::EvalPredicate(const rule_predicate& in_pred,
+        const rule_packet& in_rpack) {
+    const mac_addr *mac = NULL;
+    const string *str = NULL;
+    double num = 0;
+
+    switch (in_pred.field) {
+        case field_source:
+            if (!in_rpack.dot11 && !in_rpack.common)
+                return false;
+            mac = &(in_rpack.source);
+            break;
+        case field_dest:
+            if (!in_rpack.dot11 && !in_rpack.common)
+                return false;
+            mac = &(in_rpack.dest);
+            break;
+        case field_bssid:
+            if (!in_rpack.dot11)
+                return false;
+            mac = &(in_rpack.bssid);
+            break;
+        case field_other:
+            if (!in_rpack.dot11)
+                return false;
+            mac = &(in_rpack.other);
+            break;
+        case field_ssid:
+            if (!in_rpack.dot11)
+                return false;
+            str = &(in_rpack.ssid);
+            break;
+        case field_channel:
+            if (!in_rpack.dot11 && !in_rpack.common)
+                return false;
+            str = &(in_rpack.channel);
+            break;
+        case field_reason:
+            if (!in_rpack.dot11)
+                return false;
+            num = in_rpack.reason;
+            break;
+        case field_encrypted:
+            if (!in_rpack.dot11)
+                return false;
+            num = in_rpack.encrypted;
+            break;
+        case field_signal:
+            if (!in_rpack.l1)
+                return false;
+            num = in_rpack.signal;
+            break;
+        case field_freq:
+            if (!in_rpack.l1 && !in_rpack.common)
+                return false;
+            num = in_rpack.freq;
+            break;
+        case field_datarate:
+            if (!in_rpack.l1)
+                return false;
+            num = in_rpack.datarate;
+            break;
+        case field_size:
+            if (!in_rpack.common)
+                return false;
+            num = in_rpack.size;
+            break;
+    }
+
+    if (mac != NULL) {
+        bool eq = (*mac == in_pred.mac);
+        return in_pred.op == op_eq ? eq : !eq;
+    }
+
+    if (str != NULL) {
+        bool eq = (*str == in_pred.str);
+        return in_pred.op == op_eq ? eq : !eq;
+    }
+
+    switch (in_pred.op) {
+        case op_eq:
+            return num == in_pred.num;
+        case op_ne:
+            return num != in_pred.num;
+        case op_lt:
+            return num < in_pred.num;
+        case op_le:
+            return num <= in_pred.num;
+        case op_gt:
+            return num > in_pred.num;
+        case op_ge:
+            return num >= in_pred.num;
+    }
+
+    return false;
+}
+
+void AlertRules::EvalRule(alert_rule *in_rule, kis_packet *in_pack,
+        const rule_packet& in_rpack, vector<int8_t>& in_cache) {
+    uint64_t start = KisClock::PreciseNsec();
+    uint64_t run = 0;
+    bool match = true;
+
+    for (auto p : in_rule->predicates) {
+        if (in_cache[p] < 0) {
+            in_cache[p] = EvalPredicate(predicates[p], in_rpack);
+            run++;
+        }
+
+        if (in_cache[p] == 0) {
+            match = false;
+            break;
+        }
+    }
+
+    uint64_t count = 1;
+    bool raise = match;
+
+    if (match && in_rule->threshold != 0) {
+        uint64_t k = 0;
+
+        switch (in_rule->key) {
+            case key_source:
+                k = in_rpack.source.longmac;
+                break;
+            case key_dest:
+                k = in_rpack.dest.longmac;
+                break;
+            case key_bssid:
+                k = in_rpack.bssid.longmac;
+                break;
+            case key_other:
+                k = in_rpack.other.longmac;
+                break;
+            case key_none:
+                break;
+        }
+
+        time_t now = in_pack->ts.tv_sec;
+        time_t w = in_rule->window_sec;
+
+        std::lock_guard<std::mutex> lk(in_rule->window_mutex);
+
+        if (in_rule->windows.size() > ALERTRULE_MAX_WINDOWS) {
+            for (auto i = in_rule->windows.begin(); i != in_rule->windows.end(); ) {
+                if (now - i->second.start >= 2 * w)
+                    i = in_rule->windows.erase(i);
+                else
+                    ++i;
+            }
+        }
+
+        auto wi = in_rule->windows.find(k);
+
+        if (wi == in_rule->windows.end()) {
+            rule_window nw;
+            nw.start = now;
+            nw.prev = 0;
+            nw.cur = 0;
+            wi = in_rule->windows.insert(std::make_pair(k, nw)).first;
+        }
+
+        rule_window& rw = wi->second;
+
+        // Sliding window, estimated from this window and the one before it
+        time_t elapsed = now - rw.start;
+
+        if (elapsed < 0 || elapsed >= 2 * w) {
+            rw.start = now;
+            rw.prev = 0;
+            rw.cur = 0;
+        } else if (elapsed >= w) {
+            rw.start += w;
+            rw.prev = rw.cur;
+            rw.cur = 0;
+        }
+
+        rw.cur++;
+
+        count = rw.cur + (rw.prev * (w - (now - rw.start))) / w;
+
+        raise = (count >= in_rule->threshold);
+
+        // Start counting over, so it takes another N matches to raise again
+        if (raise) {
+            rw.prev = 0;
+            rw.cur = 0;
+        }
+    }
+
+    if (raise && globalreg->alertracker->PotentialAlert(in_rule->alert_ref)) {
+        globalreg->alertracker->RaiseAlert(in_rule->alert_ref, in_pack,
+                in_rpack.bssid, in_rpack.source, in_rpack.dest, in_rpack.other,
+                in_rpack.channel, RuleText(in_rule, in_rpack, count));
+        in_rule->raised++;
+    }
+
+    in_rule->evaluated++;
+    in_rule->predicates_run += run;
+    if (match)
+        in_rule->matched++;
+    in_rule->nsec += KisClock::PreciseNsec() - start;
+}
+
+string AlertRules::RuleText(alert_rule *in_rule, const rule_packet& in_rpack,
+        uint64_t in_count) {
+    string ret;
+    const string& t = in_rule->text;
+
+    for (size_t x = 0; x < t.length(); x++) {
+        if (t[x] != '{') {
+            ret += t[x];
+            continue;
+        }
+
+        size_t end = t.find('}', x);
+
+        if (end == string::npos) {
+            ret += t.substr(x, t.length());
+            break;
+        }
+
+        string v = t.substr(x + 1, end - x - 1);
+
+        if (v == "source")
+            ret += in_rpack.source.Mac2String();
+        else if (v == "dest")
+            ret += in_rpack.dest.Mac2String();
+        else if (v == "bssid")
+            ret += in_rpack.bssid.Mac2String();
+        else if (v == "other")
+            ret += in_rpack.other.Mac2String();
+        else if (v == "ssid")
+            ret += in_rpack.ssid;
+        else if (v == "channel")
+            ret += in_rpack.channel;
+        else if (v == "count")
+            ret += UIntToString(in_count);
+        else
+            ret += t.substr(x, end - x + 1);
+
+        x = end;
+    }
+
+    return ret;
+}
+
+bool AlertRules::Httpd_VerifyPath(const char *path, const char *method) {
+    if (strcmp(method, "GET") != 0)
+        return false;
+
+    if (!Httpd_CanSerialize(path))
+        return false;
+
+    return Httpd_StripSuffix(path) == "/alerts/rules";
+}
+
+void AlertRules::Httpd_CreateStreamResponse(
+        Kis_Net_Httpd *httpd __attribute__((unused)),
+        Kis_Net_Httpd_Connection *connection __attribute__((unused)),
+        const char *path, const char *method,
+        const char *upload_data __attribute__((unused)),
+        size_t *upload_data_size __attribute__((unused)),
+        std::stringstream &stream) {
+
+    if (strcmp(method, "GET") != 0)
+        return;
+
+    if (!Httpd_CanSerialize(path) || Httpd_StripSuffix(path) != "/alerts/rules")
+        return;
+
+    SharedTrackerElement ret(new TrackerElement(TrackerMap, rules_id));
+    SharedTrackerElement e;
+
+    e.reset(new TrackerElement(TrackerUInt64, rules_packets_id));
+    e->set((uint64_t) packets);
+    ret->add_map(e);
+
+    SharedTrackerElement list(new TrackerElement(TrackerVector, rules_list_id));
+    ret->add_map(list);
+
+    for (auto r : rules) {
+        SharedTrackerElement rec(new TrackerElement(TrackerMap, rule_id));
+
+        e.reset(new TrackerElement(TrackerString, rule_name_id));
+        e->set(r->name);
+        rec->add_map(e);
+
+        e.reset(new TrackerElement(TrackerString, rule_definition_id));
+        e->set(r->definition);
+        rec->add_map(e);
+
+        e.reset(new TrackerElement(TrackerUInt64, rule_evaluated_id));
+        e->set((uint64_t) r->evaluated);
+        rec->add_map(e);
+
+        e.reset(new TrackerElement(TrackerUInt64, rule_predicates_id));
+        e->set((uint64_t) r->predicates_run);
+        rec->add_map(e);
+
+        e.reset(new TrackerElement(TrackerUInt64, rule_matched_id));
+        e->set((uint64_t) r->matched);
+        rec->add_map(e);
+
+        e.reset(new TrackerElement(TrackerUInt64, rule_raised_id));
+        e->set((uint64_t) r->raised);
+        rec->add_map(e);
+
+        e.reset(new TrackerElement(TrackerUInt64, rule_nsec_id));
+        e->set((uint64_t) r->nsec);
+        rec->add_map(e);
+
+        list->add_vector(rec);
+    }
+
+    Httpd_Serialize(path, stream, ret);
+}
+
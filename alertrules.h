@@ -0,0 +1,187 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __ALERTRULES_H__
+#define __ALERTRULES_H__
+
+#include "config.h"
+
+#include <stdint.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "globalregistry.h"
+#include "macaddr.h"
+#include "packetchain.h"
+#include "kis_net_microhttpd.h"
+
+// Alert rules from the config
+//
+// Alerts which only need to look at the fields of a frame, and possibly count
+// how often they match, are written as rules instead of code:
+//
+//  alertrule=NAME:predicate,predicate,...[,count=N/W][,key=..][,text=".."]
+//
+// A predicate compares a field of the packet to a value with one of
+// = != < <= > >=.  Every rule is compiled when the server starts into a list of
+// predicates shared by every rule, so a predicate used by several rules is only
+// evaluated once per packet; the phy, 802.11 type, and 802.11 subtype of a
+// rule are not evaluated at all, but used to index the rule, so a packet is
+// only ever checked against the rules which could match it.
+//
+// A rule with a count raises its alert when it has matched N times within W
+// (seconds, or with a suffix of s, m, or h) for the same key (the source,
+// dest, bssid, or other address, or the whole rule); otherwise it raises on
+// every match.  The rate of the alert itself is limited by the alert= options
+// like any other.
+//
+// The cost of every rule is counted and served at /alerts/rules.json
+class AlertRules : public LifetimeGlobal, public Kis_Net_Httpd_CPPStream_Handler {
+public:
+    // Returns NULL unless there are alert rules configured
+    static shared_ptr<AlertRules> create_alertrules(GlobalRegistry *in_globalreg);
+
+private:
+    AlertRules(GlobalRegistry *in_globalreg);
+
+public:
+    virtual ~AlertRules();
+
+    // Compile a rule definition, NAME:predicates; returns negative and the
+    // reason in ret_err if it could not be compiled
+    int AddRule(const string& in_def, string *ret_err);
+
+    virtual bool Httpd_VerifyPath(const char *path, const char *method);
+
+    virtual void Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd,
+            Kis_Net_Httpd_Connection *connection,
+            const char *url, const char *method, const char *upload_data,
+            size_t *upload_data_size, std::stringstream &stream);
+
+    static int packet_hook(CHAINCALL_PARMS);
+
+protected:
+    GlobalRegistry *globalreg;
+
+    enum rule_field {
+        field_source, field_dest, field_bssid, field_other,
+        field_ssid, field_channel,
+        field_reason, field_encrypted, field_signal, field_freq,
+        field_datarate, field_size
+    };
+
+    enum rule_op {
+        op_eq, op_ne, op_lt, op_le, op_gt, op_ge
+    };
+
+    enum rule_key {
+        key_none, key_source, key_dest, key_bssid, key_other
+    };
+
+    struct rule_predicate {
+        rule_field field;
+        rule_op op;
+
+        double num;
+        mac_addr mac;
+        string str;
+    };
+
+    // Fields of the packet the predicates compare, gathered once per packet
+    struct rule_packet {
+        bool dot11, l1, common;
+
+        mac_addr source, dest, bssid, other;
+        string ssid, channel;
+
+        double reason, encrypted, signal, freq, datarate, size;
+    };
+
+    struct rule_window {
+        time_t start;
+        uint64_t prev, cur;
+    };
+
+    struct alert_rule {
+        string name;
+        string definition;
+        string text;
+
+        int alert_ref;
+
+        // -1 for any phy
+        int phyid;
+
+        // Indices into the shared predicate list
+        vector<size_t> predicates;
+
+        // Matches needed within window_sec, 0 to raise on every match
+        uint64_t threshold;
+        unsigned int window_sec;
+        rule_key key;
+
+        std::mutex window_mutex;
+        std::unordered_map<uint64_t, rule_window> windows;
+
+        std::atomic<uint64_t> evaluated, predicates_run, matched, raised, nsec;
+    };
+
+    // 3 802.11 types of 16 subtypes, and one for everything which isn't 802.11
+    static const unsigned int num_buckets = 49;
+
+    struct rule_index {
+        vector<alert_rule *> buckets[num_buckets];
+    };
+
+    int ParsePredicate(const string& in_pred, rule_predicate *ret_pred, string *ret_err);
+    bool ParseValue(rule_field in_field, const string& in_val, rule_predicate *ret_pred);
+    size_t SharePredicate(const rule_predicate& in_pred);
+
+    void FetchPacket(kis_packet *in_pack, rule_packet *ret_rpack, int *ret_phyid,
+            unsigned int *ret_bucket);
+    bool EvalPredicate(const rule_predicate& in_pred, const rule_packet& in_rpack);
+
+    void EvalRule(alert_rule *in_rule, kis_packet *in_pack, const rule_packet& in_rpack,
+            vector<int8_t>& in_cache);
+
+    string RuleText(alert_rule *in_rule, const rule_packet& in_rpack, uint64_t in_count);
+
+    // Rules and predicates only change while the server starts, before
+    // there are packets
+    vector<alert_rule *> rules;
+    vector<rule_predicate> predicates;
+
+    rule_index any_index;
+    std::map<int, rule_index> phy_indexes;
+
+    int pack_comp_80211, pack_comp_l1info, pack_comp_common;
+
+    std::atomic<uint64_t> packets;
+
+    int rules_id, rules_packets_id, rules_list_id, rule_id, rule_name_id,
+        rule_definition_id, rule_evaluated_id, rule_predicates_id, rule_matched_id,
+        rule_raised_id, rule_nsec_id;
+};
+
+#endif
+
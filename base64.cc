@@ -77,3 +77,27 @@ string Base64::decode(string in_str) {
     return out;
 }
 
+string Base64::encode(string in_str) {
+    string out;
+    unsigned int i;
+
+    out.reserve(((in_str.length() + 2) / 3) * 4);
+
+    for (i = 0; i < in_str.length(); i += 3) {
+        unsigned int remain = in_str.length() - i;
+        uint32_t block = (unsigned char) in_str[i] << 16;
+
+        if (remain > 1)
+            block |= (unsigned char) in_str[i + 1] << 8;
+        if (remain > 2)
+            block |= (unsigned char) in_str[i + 2];
+
+        out += b64_values[(block >> 18) & 0x3F];
+        out += b64_values[(block >> 12) & 0x3F];
+        out += remain > 1 ? b64_values[(block >> 6) & 0x3F] : '=';
+        out += remain > 2 ? b64_values[block & 0x3F] : '=';
+    }
+
+    return out;
+}
+
@@ -0,0 +1,286 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include <chrono>
+
+#include "configfile.h"
+#include "getopt.h"
+#include "benchmark.h"
+#include "messagebus.h"
+#include "packetchain.h"
+#include "datasourcetracker.h"
+#include "devicetracker.h"
+
+static uint64_t benchmark_now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+shared_ptr<Benchmark> Benchmark::create_benchmark(GlobalRegistry *in_globalreg) {
+    const int bwc = in_globalreg->getopt_long_num++;
+    const int brwc = in_globalreg->getopt_long_num++;
+
+    struct option benchmark_long_options[] = {
+        { "benchmark", no_argument, 0, bwc },
+        { "benchmark-report", required_argument, 0, brwc },
+        { 0, 0, 0, 0 }
+    };
+
+    int option_idx = 0;
+    bool enabled = false;
+    string report_path;
+
+    optind = 0;
+
+    while (1) {
+        int r = getopt_long(in_globalreg->argc, in_globalreg->argv, "-",
+                benchmark_long_options, &option_idx);
+
+        if (r < 0) break;
+
+        if (r == bwc)
+            enabled = true;
+        else if (r == brwc)
+            report_path = optarg;
+    }
+
+    if (!enabled)
+        return NULL;
+
+    shared_ptr<Benchmark> mon(new Benchmark(in_globalreg, report_path));
+    in_globalreg->RegisterLifetimeGlobal(mon);
+    in_globalreg->InsertGlobal("BENCHMARK", mon);
+    return mon;
+}
+
+void Benchmark::usage(const char *name __attribute__((unused))) {
+    printf("\n");
+    printf(" *** Benchmark Options ***\n");
+    printf("     --benchmark              Replay the sources as fast as possible,\n"
+           "                              report throughput when they finish, \n"
+           "                              and exit.  Use with pcapfile sources\n"
+           "     --benchmark-report=file  Also write the results to a file as\n"
+           "                              JSON\n"
+          );
+}
+
+Benchmark::Benchmark(GlobalRegistry *in_globalreg, string in_report_path) {
+    globalreg = in_globalreg;
+    report_path = in_report_path;
+
+    first_ns = 0;
+    last_ns = 0;
+    num_packets = 0;
+
+    seen_running = false;
+    finished = false;
+
+    // A source which finished its file has to stay finished, and the disk
+    // shouldn't be part of the measurement
+    globalreg->kismet_config->SetOpt("retry_on_source_error", "false", 0);
+    globalreg->kismet_config->SetOpt("logtypes", "none", 0);
+
+    // Look for the capture binaries next to us as well, for build trees
+    string self = globalreg->argv[0];
+    size_t slash = self.find_last_of("/");
+
+    if (slash != string::npos) {
+        vector<string> bin_paths =
+            globalreg->kismet_config->FetchOptVec("capture_binary_path");
+        bin_paths.push_back(self.substr(0, slash));
+        globalreg->kismet_config->SetOptVec("capture_binary_path", bin_paths, 0);
+    }
+
+    globalreg->packetchain->EnableStageTiming(true);
+
+    // Count at the very end of the chain, once everything has seen the packet
+    pack_hook_id =
+        globalreg->packetchain->RegisterHandler([this](kis_packet *) -> int {
+                uint64_t now = benchmark_now_ns();
+                uint64_t zero = 0;
+
+                first_ns.compare_exchange_strong(zero, now);
+                last_ns = now;
+                num_packets++;
+
+                return 1;
+            }, CHAINPOS_LOGGING, 1000, "benchmark");
+
+    timer_id =
+        globalreg->timetracker->RegisterTimer(SERVER_TIMESLICES_SEC / 10, NULL, 1, this);
+
+    _MSG("Benchmark mode enabled; source retry and logging are disabled, and Kismet "
+            "will exit once all sources have finished", MSGFLAG_INFO);
+}
+
+Benchmark::~Benchmark() {
+    globalreg->RemoveGlobal("BENCHMARK");
+    globalreg->timetracker->RemoveTimer(timer_id);
+
+    if (globalreg->packetchain != NULL)
+        globalreg->packetchain->RemoveHandler(pack_hook_id, CHAINPOS_LOGGING);
+}
+
+class Benchmark_Source_Worker : public DST_Worker {
+public:
+    Benchmark_Source_Worker() {
+        num_sources = 0;
+        num_running = 0;
+    }
+
+    virtual void handle_datasource(shared_ptr<KisDatasource> in_src) {
+        num_sources++;
+
+        if (in_src->get_source_running())
+            num_running++;
+    }
+
+    unsigned int num_sources;
+    unsigned int num_running;
+};
+
+int Benchmark::timetracker_event(int eventid __attribute__((unused))) {
+    if (finished)
+        return 1;
+
+    shared_ptr<Datasourcetracker> datasourcetracker =
+        globalreg->FetchGlobalAs<Datasourcetracker>("DATASOURCETRACKER");
+
+    if (datasourcetracker == NULL)
+        return 1;
+
+    Benchmark_Source_Worker worker;
+    datasourcetracker->iterate_datasources(&worker);
+
+    if (worker.num_running != 0) {
+        seen_running = true;
+        return 1;
+    }
+
+    if (!seen_running || worker.num_sources == 0)
+        return 1;
+
+    finished = true;
+
+    // Everything the sources delivered has to be through the chain before we
+    // count it
+    globalreg->packetchain->StopPipeline();
+
+    Report();
+
+    globalreg->spindown = 1;
+
+    return 1;
+}
+
+void Benchmark::Report() {
+    static const struct {
+        int chainpos;
+        const char *name;
+    } stages[] = {
+        { CHAINPOS_POSTCAP, "postcap" },
+        { CHAINPOS_LLCDISSECT, "llcdissect" },
+        { CHAINPOS_DECRYPT, "decrypt" },
+        { CHAINPOS_DATADISSECT, "datadissect" },
+        { CHAINPOS_CLASSIFIER, "classifier" },
+        { CHAINPOS_TRACKER, "tracker" },
+        { CHAINPOS_LOGGING, "logging" },
+    };
+
+    uint64_t packets = num_packets;
+    double elapsed = (last_ns - first_ns) / 1000000000.0;
+
+    struct rusage ru;
+    long peak_rss_kb = 0;
+
+    if (getrusage(RUSAGE_SELF, &ru) == 0) {
+#ifdef SYS_DARWIN
+        // Darwin reports bytes, everyone else kilobytes
+        peak_rss_kb = ru.ru_maxrss / 1024;
+#else
+        peak_rss_kb = ru.ru_maxrss;
+#endif
+    }
+
+    int num_devices = 0;
+
+    if (globalreg->devicetracker != NULL)
+        num_devices = globalreg->devicetracker->FetchNumDevices(KIS_PHY_ANY);
+
+    // Printed directly so it isn't lost to --silent or the message queue
+    printf("\n*** KISMET BENCHMARK RESULTS ***\n");
+    printf("packets:       %lu\n", (unsigned long) packets);
+    printf("elapsed:       %.3f sec\n", elapsed);
+    printf("packets/sec:   %.0f\n", elapsed > 0 ? packets / elapsed : 0);
+    printf("devices:       %d\n", num_devices);
+    printf("peak rss:      %ld KB\n", peak_rss_kb);
+    printf("stage time     (usec/packet, total sec)\n");
+
+    for (auto s : stages) {
+        uint64_t count = globalreg->packetchain->FetchStageCount(s.chainpos);
+        uint64_t nsec = globalreg->packetchain->FetchStageNsec(s.chainpos);
+
+        printf("  %-12s %8.2f %10.3f\n", s.name,
+                count > 0 ? (nsec / 1000.0) / count : 0, nsec / 1000000000.0);
+    }
+
+    printf("\n");
+    fflush(stdout);
+
+    if (report_path == "")
+        return;
+
+    FILE *rf = fopen(report_path.c_str(), "w");
+
+    if (rf == NULL) {
+        fprintf(stderr, "ERROR: Could not write benchmark report '%s': %s\n",
+                report_path.c_str(), kis_strerror_r(errno).c_str());
+        return;
+    }
+
+    fprintf(rf, "{\n");
+    fprintf(rf, "  \"packets\": %lu,\n", (unsigned long) packets);
+    fprintf(rf, "  \"elapsed_sec\": %.6f,\n", elapsed);
+    fprintf(rf, "  \"packets_per_sec\": %.1f,\n", elapsed > 0 ? packets / elapsed : 0);
+    fprintf(rf, "  \"devices\": %d,\n", num_devices);
+    fprintf(rf, "  \"peak_rss_kb\": %ld,\n", peak_rss_kb);
+    fprintf(rf, "  \"stages\": {\n");
+
+    for (unsigned int x = 0; x < sizeof(stages) / sizeof(stages[0]); x++) {
+        uint64_t count = globalreg->packetchain->FetchStageCount(stages[x].chainpos);
+        uint64_t nsec = globalreg->packetchain->FetchStageNsec(stages[x].chainpos);
+
+        fprintf(rf, "    \"%s\": { \"usec_per_packet\": %.3f, \"total_sec\": %.6f }%s\n",
+                stages[x].name, count > 0 ? (nsec / 1000.0) / count : 0, 
+                nsec / 1000000000.0, 
+                x + 1 < sizeof(stages) / sizeof(stages[0]) ? "," : "");
+    }
+
+    fprintf(rf, "  }\n");
+    fprintf(rf, "}\n");
+
+    fclose(rf);
+}
+
@@ -0,0 +1,84 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __BENCHMARK_H__
+#define __BENCHMARK_H__
+
+#include "config.h"
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <string>
+
+#include "globalregistry.h"
+#include "timetracker.h"
+
+// Replay benchmark mode, enabled with --benchmark
+//
+// Sources (normally pcapfile sources given with -c) are replayed through the
+// whole server - datasource, packetchain, devicetracker - as fast as they can be
+// read.  Once every source has finished, the packet rate, time spent in each
+// packetchain stage, peak RSS and the number of devices are printed and Kismet
+// shuts down.
+//
+// To keep the run repeatable, benchmark mode turns off source retry and all log
+// files, and also searches for capture binaries next to the kismet binary so it
+// can be run from a build tree.
+//
+// --benchmark-report writes the same results as JSON, for the performance suite
+// (extra/perf_suite.py) to compare against a baseline.
+class Benchmark : public LifetimeGlobal, public TimetrackerEvent {
+public:
+    // Returns NULL unless --benchmark was given.  Must be created before the
+    // datasourcetracker and the log files read their config.
+    static shared_ptr<Benchmark> create_benchmark(GlobalRegistry *in_globalreg);
+
+    static void usage(const char *name);
+
+private:
+    Benchmark(GlobalRegistry *in_globalreg, string in_report_path);
+
+public:
+    virtual ~Benchmark();
+
+    // Checks if the sources have finished
+    virtual int timetracker_event(int eventid);
+
+protected:
+    GlobalRegistry *globalreg;
+
+    void Report();
+
+    // JSON copy of the report, if one was asked for
+    string report_path;
+
+    int pack_hook_id;
+
+    // Time of the first and last packet through the chain, in steady clock
+    // nanoseconds, and the number of packets
+    std::atomic<uint64_t> first_ns, last_ns;
+    std::atomic<uint64_t> num_packets;
+
+    // Have we seen a source running yet?
+    bool seen_running;
+    bool finished;
+};
+
+#endif
+
@@ -23,6 +23,42 @@
 #include "util.h"
 #include "buffer_handler.h"
 
+ssize_t CommonBuffer::write_vec(const struct iovec *in_vec, size_t in_cnt) {
+    size_t total = 0;
+
+    for (size_t x = 0; x < in_cnt; x++)
+        total += in_vec[x].iov_len;
+
+    if (total == 0)
+        return 0;
+
+    // Every writer but a lock-free buffer's single producer goes through the
+    // handler's write lock, so nothing lands between the blocks
+    ssize_t avail = available();
+
+    if (avail >= 0 && (size_t) avail < total)
+        return 0;
+
+    size_t written = 0;
+
+    for (size_t x = 0; x < in_cnt; x++) {
+        if (in_vec[x].iov_len == 0)
+            continue;
+
+        ssize_t r = write((unsigned char *) in_vec[x].iov_base, in_vec[x].iov_len);
+
+        if (r < 0)
+            return written;
+
+        written += r;
+
+        if ((size_t) r != in_vec[x].iov_len)
+            return written;
+    }
+
+    return written;
+}
+
 BufferHandlerGeneric::BufferHandlerGeneric() {
     read_buffer = NULL;
     write_buffer = NULL;
@@ -30,6 +66,9 @@ BufferHandlerGeneric::BufferHandlerGeneric() {
     rbuf_notify = NULL;
     wbuf_notify = NULL;
 
+    read_spsc = false;
+    write_spsc = false;
+
     // Initialize as recursive to allow multiple locks in a single thread
     pthread_mutexattr_t mutexattr;
     pthread_mutexattr_init(&mutexattr);
@@ -40,6 +79,11 @@ BufferHandlerGeneric::BufferHandlerGeneric() {
     pthread_mutex_init(&wbuf_locker, &mutexattr);
     pthread_mutex_init(&r_callback_locker, &mutexattr);
     pthread_mutex_init(&w_callback_locker, &mutexattr);
+
+    if (LockProfiler::IsEnabled()) {
+        LockProfiler::NameMutex(&rbuf_locker, "buffer_handler");
+        LockProfiler::NameMutex(&wbuf_locker, "buffer_handler");
+    }
 }
 
 BufferHandlerGeneric::~BufferHandlerGeneric() {
@@ -57,13 +101,18 @@ BufferHandlerGeneric::~BufferHandlerGeneric() {
     if (write_buffer)
         delete write_buffer;
 
+    if (LockProfiler::IsEnabled()) {
+        LockProfiler::ForgetMutex(&rbuf_locker);
+        LockProfiler::ForgetMutex(&wbuf_locker);
+    }
+
     pthread_mutex_destroy(&handler_locker);
     pthread_mutex_destroy(&r_callback_locker);
     pthread_mutex_destroy(&w_callback_locker);
 }
 
 ssize_t BufferHandlerGeneric::GetReadBufferSize() {
-    local_locker lock(&rbuf_locker);
+    local_locker lock(rbuf_lock());
 
     if (read_buffer)
         return read_buffer->size();
@@ -72,7 +121,7 @@ ssize_t BufferHandlerGeneric::GetReadBufferSize() {
 }
 
 ssize_t BufferHandlerGeneric::GetWriteBufferSize() {
-    local_locker lock(&wbuf_locker);
+    local_locker lock(wbuf_lock());
 
     if (write_buffer)
         return write_buffer->size();
@@ -81,7 +130,7 @@ ssize_t BufferHandlerGeneric::GetWriteBufferSize() {
 }
 
 size_t BufferHandlerGeneric::GetReadBufferUsed() {
-    local_locker lock(&rbuf_locker);
+    local_locker lock(rbuf_lock());
 
     if (read_buffer)
         return read_buffer->used();
@@ -90,7 +139,7 @@ size_t BufferHandlerGeneric::GetReadBufferUsed() {
 }
 
 size_t BufferHandlerGeneric::GetWriteBufferUsed() {
-    local_locker lock(&wbuf_locker);
+    local_locker lock(wbuf_lock());
 
     if (write_buffer)
         return write_buffer->used();
@@ -99,7 +148,7 @@ size_t BufferHandlerGeneric::GetWriteBufferUsed() {
 }
 
 ssize_t BufferHandlerGeneric::GetReadBufferAvailable() {
-    local_locker lock(&rbuf_locker);
+    local_locker lock(rbuf_lock());
 
     if (read_buffer)
         return read_buffer->available();
@@ -108,7 +157,7 @@ ssize_t BufferHandlerGeneric::GetReadBufferAvailable() {
 }
 
 ssize_t BufferHandlerGeneric::GetWriteBufferAvailable() {
-    local_locker lock(&wbuf_locker);
+    local_locker lock(wbuf_lock());
 
     if (write_buffer)
         return write_buffer->available();
@@ -117,7 +166,7 @@ ssize_t BufferHandlerGeneric::GetWriteBufferAvailable() {
 }
 
 ssize_t BufferHandlerGeneric::PeekReadBufferData(void **in_ptr, size_t in_sz) {
-    local_locker lock(&rbuf_locker);
+    local_locker lock(rbuf_lock());
 
     if (in_ptr == NULL)
         return 0;
@@ -129,7 +178,7 @@ ssize_t BufferHandlerGeneric::PeekReadBufferData(void **in_ptr, size_t in_sz) {
 }
 
 ssize_t BufferHandlerGeneric::PeekWriteBufferData(void **in_ptr, size_t in_sz) {
-    local_locker lock(&wbuf_locker);
+    local_locker lock(wbuf_lock());
 
     if (write_buffer)
         return write_buffer->peek((unsigned char **) in_ptr, in_sz);
@@ -138,7 +187,7 @@ ssize_t BufferHandlerGeneric::PeekWriteBufferData(void **in_ptr, size_t in_sz) {
 }
 
 ssize_t BufferHandlerGeneric::ZeroCopyPeekReadBufferData(void **in_ptr, size_t in_sz) {
-    local_locker lock(&rbuf_locker);
+    local_locker lock(rbuf_lock());
 
     if (in_ptr == NULL)
         return 0;
@@ -150,7 +199,7 @@ ssize_t BufferHandlerGeneric::ZeroCopyPeekReadBufferData(void **in_ptr, size_t i
 }
 
 ssize_t BufferHandlerGeneric::ZeroCopyPeekWriteBufferData(void **in_ptr, size_t in_sz) {
-    local_locker lock(&wbuf_locker);
+    local_locker lock(wbuf_lock());
 
     if (write_buffer)
         return write_buffer->zero_copy_peek((unsigned char **) in_ptr, in_sz);
@@ -158,8 +207,18 @@ ssize_t BufferHandlerGeneric::ZeroCopyPeekWriteBufferData(void **in_ptr, size_t
     return 0;
 }
 
+bool BufferHandlerGeneric::ZeroCopySegmentsWriteBufferData(
+        std::vector<std::pair<unsigned char *, size_t> > *ret_segments) {
+    local_locker lock(wbuf_lock());
+
+    if (write_buffer)
+        return write_buffer->zero_copy_segments(ret_segments);
+
+    return false;
+}
+
 void BufferHandlerGeneric::PeekFreeReadBufferData(void *in_ptr) {
-    local_locker lock(&rbuf_locker);
+    local_locker lock(rbuf_lock());
 
     if (read_buffer)
         return read_buffer->peek_free((unsigned char *) in_ptr);
@@ -168,7 +227,7 @@ void BufferHandlerGeneric::PeekFreeReadBufferData(void *in_ptr) {
 }
 
 void BufferHandlerGeneric::PeekFreeWriteBufferData(void *in_ptr) {
-    local_locker lock(&wbuf_locker);
+    local_locker lock(wbuf_lock());
 
     if (write_buffer)
         return write_buffer->peek_free((unsigned char *) in_ptr);
@@ -177,7 +236,7 @@ void BufferHandlerGeneric::PeekFreeWriteBufferData(void *in_ptr) {
 }
 
 size_t BufferHandlerGeneric::ConsumeReadBufferData(size_t in_sz) {
-    local_locker lock(&rbuf_locker);
+    local_locker lock(rbuf_lock());
     size_t sz;
 
     if (read_buffer) {
@@ -192,7 +251,7 @@ size_t BufferHandlerGeneric::ConsumeReadBufferData(size_t in_sz) {
 }
 
 size_t BufferHandlerGeneric::ConsumeWriteBufferData(size_t in_sz) {
-    local_locker lock(&wbuf_locker);
+    local_locker lock(wbuf_lock());
     size_t sz;
 
     if (write_buffer) {
@@ -213,7 +272,7 @@ size_t BufferHandlerGeneric::PutReadBufferData(void *in_ptr, size_t in_sz,
 
     {
         // Sub-context for locking so we don't lock read-op out
-        local_locker lock(&rbuf_locker);
+        local_locker lock(rbuf_lock());
 
         if (!read_buffer)
             return 0;
@@ -248,7 +307,7 @@ size_t BufferHandlerGeneric::PutWriteBufferData(void *in_ptr, size_t in_sz,
 
     {
         // Sub-context for locking so we don't lock read-op out
-        local_locker lock(&wbuf_locker);
+        local_locker lock(wbuf_lock());
 
         if (!write_buffer) {
             if (wbuf_notify)
@@ -281,8 +340,40 @@ size_t BufferHandlerGeneric::PutWriteBufferData(void *in_ptr, size_t in_sz,
     return ret;
 }
 
+size_t BufferHandlerGeneric::PutWriteBufferDataVec(const struct iovec *in_vec,
+        size_t in_cnt) {
+    size_t ret;
+
+    {
+        local_locker lock(wbuf_lock());
+
+        if (!write_buffer) {
+            if (wbuf_notify)
+                wbuf_notify->BufferError("No write buffer connected");
+
+            return 0;
+        }
+
+        ssize_t r = write_buffer->write_vec(in_vec, in_cnt);
+
+        ret = r < 0 ? 0 : r;
+    }
+
+    if (ret == 0)
+        return 0;
+
+    {
+        local_locker lock(&w_callback_locker);
+
+        if (wbuf_notify)
+            wbuf_notify->BufferAvailable(ret);
+    }
+
+    return ret;
+}
+
 ssize_t BufferHandlerGeneric::ReserveReadBufferData(void **in_ptr, size_t in_sz) {
-    local_locker lock(&rbuf_locker);
+    local_locker lock(rbuf_lock());
 
     if (read_buffer != NULL) {
         return read_buffer->reserve((unsigned char **) in_ptr, in_sz);
@@ -292,7 +383,7 @@ ssize_t BufferHandlerGeneric::ReserveReadBufferData(void **in_ptr, size_t in_sz)
 }
 
 ssize_t BufferHandlerGeneric::ReserveWriteBufferData(void **in_ptr, size_t in_sz) {
-    local_locker lock(&wbuf_locker);
+    local_locker lock(wbuf_lock());
 
     if (write_buffer != NULL) {
         return write_buffer->reserve((unsigned char **) in_ptr, in_sz);
@@ -302,7 +393,7 @@ ssize_t BufferHandlerGeneric::ReserveWriteBufferData(void **in_ptr, size_t in_sz
 }
 
 ssize_t BufferHandlerGeneric::ZeroCopyReserveReadBufferData(void **in_ptr, size_t in_sz) {
-    local_locker lock(&rbuf_locker);
+    local_locker lock(rbuf_lock());
 
     if (read_buffer != NULL) {
         return read_buffer->zero_copy_reserve((unsigned char **) in_ptr, in_sz);
@@ -312,7 +403,7 @@ ssize_t BufferHandlerGeneric::ZeroCopyReserveReadBufferData(void **in_ptr, size_
 }
 
 ssize_t BufferHandlerGeneric::ZeroCopyReserveWriteBufferData(void **in_ptr, size_t in_sz) {
-    local_locker lock(&wbuf_locker);
+    local_locker lock(wbuf_lock());
 
     if (write_buffer != NULL) {
         return write_buffer->zero_copy_reserve((unsigned char **) in_ptr, in_sz);
@@ -325,7 +416,7 @@ bool BufferHandlerGeneric::CommitReadBufferData(void *in_ptr, size_t in_sz) {
     bool s = false;
 
     {
-        local_locker lock(&rbuf_locker);
+        local_locker lock(rbuf_lock());
 
         if (read_buffer != NULL) {
             s = read_buffer->commit((unsigned char *) in_ptr, in_sz);
@@ -346,11 +437,18 @@ bool BufferHandlerGeneric::CommitReadBufferData(void *in_ptr, size_t in_sz) {
     return s;
 }
 
+void BufferHandlerGeneric::TriggerReadBufferAvailable(size_t in_amt) {
+    local_locker lock(&r_callback_locker);
+
+    if (rbuf_notify)
+        rbuf_notify->BufferAvailable(in_amt);
+}
+
 bool BufferHandlerGeneric::CommitWriteBufferData(void *in_ptr, size_t in_sz) {
     bool s = false;
 
     {
-        local_locker lock(&wbuf_locker);
+        local_locker lock(wbuf_lock());
 
         if (write_buffer != NULL) {
             s = write_buffer->commit((unsigned char *) in_ptr, in_sz);
@@ -476,6 +574,67 @@ BufferInterface::~BufferInterface() {
     }
 }
 
+BufferHandlerCapture::BufferHandlerCapture(CommonBuffer *in_write_buffer) {
+    write_buffer = in_write_buffer;
+    write_spsc = write_buffer != NULL && write_buffer->is_spsc();
+    max_capture = 0;
+}
+
+size_t BufferHandlerCapture::PutWriteBufferData(void *in_ptr, size_t in_sz, 
+        bool in_atomic) {
+    size_t ret = BufferHandlerGeneric::PutWriteBufferData(in_ptr, in_sz, in_atomic);
+
+    capture_data(in_ptr, ret);
+
+    return ret;
+}
+
+size_t BufferHandlerCapture::PutWriteBufferDataVec(const struct iovec *in_vec,
+        size_t in_cnt) {
+    size_t ret = BufferHandlerGeneric::PutWriteBufferDataVec(in_vec, in_cnt);
+
+    if (ret != 0) {
+        for (size_t x = 0; x < in_cnt; x++)
+            capture_data(in_vec[x].iov_base, in_vec[x].iov_len);
+    }
+
+    return ret;
+}
+
+bool BufferHandlerCapture::CommitWriteBufferData(void *in_ptr, size_t in_sz) {
+    // Copy it before the commit; the reserved block may be released by it
+    capture_data(in_ptr, in_sz);
+
+    return BufferHandlerGeneric::CommitWriteBufferData(in_ptr, in_sz);
+}
+
+void BufferHandlerCapture::start_capture(size_t in_max_capture) {
+    std::lock_guard<std::mutex> lk(capture_mutex);
+
+    max_capture = in_max_capture;
+    capture = std::make_shared<string>();
+}
+
+shared_ptr<string> BufferHandlerCapture::get_capture() {
+    std::lock_guard<std::mutex> lk(capture_mutex);
+
+    return capture;
+}
+
+void BufferHandlerCapture::capture_data(void *in_ptr, size_t in_sz) {
+    std::lock_guard<std::mutex> lk(capture_mutex);
+
+    if (capture == NULL || in_sz == 0)
+        return;
+
+    if (capture->length() + in_sz > max_capture) {
+        capture.reset();
+        return;
+    }
+
+    capture->append((const char *) in_ptr, in_sz);
+}
+
 BufferHandlerOStreambuf::~BufferHandlerOStreambuf() {
     if (rb_handler != NULL) {
         rb_handler->RemoveWriteBufferDrainCb();
@@ -22,11 +22,15 @@
 #include "config.h"
 
 #include <stdlib.h>
+#include <sys/uio.h>
 #include <string>
 #include <functional>
 #include <streambuf>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
 
 #include "util.h"
 
@@ -38,9 +42,21 @@ public:
     CommonBuffer() {
         write_reserved = false;
         peek_reserved = false;
+
+        // Buffers come and go with connections, so they're only named when
+        // they'll be profiled
+        if (LockProfiler::IsEnabled())
+            LockProfiler::NameMutex(&buffer_locker, "buffer_locker");
     }
 
-    virtual ~CommonBuffer() { };
+    virtual ~CommonBuffer() {
+        if (LockProfiler::IsEnabled())
+            LockProfiler::ForgetMutex(&buffer_locker);
+    };
+
+    // Is this buffer safe for one producer and one consumer thread without any
+    // external locking?  If so, the buffer handler doesn't lock it either.
+    virtual bool is_spsc() { return false; }
 
     // Clear all data (and free memory used, for dynamic buffers)
     virtual void clear() = 0;
@@ -89,6 +105,12 @@ public:
     // reservation system.
     virtual ssize_t write(unsigned char *data, size_t in_sz) = 0;
 
+    // Write several blocks one after another as a single record, such as a
+    // header, the data it describes, and a trailer, without assembling them
+    // first.  Nothing is written unless there is room for all of them.
+    // Returns the total written, which is 0 or the size of every block.
+    virtual ssize_t write_vec(const struct iovec *in_vec, size_t in_cnt);
+
     // Peek data.  If possible, this will be a zero-copy operation, if not, it will 
     // allocate a buffer.  Content is returned in the **data pointer, which will be
     // a buffer of at least the returned size;  Peeking may return less data
@@ -127,6 +149,15 @@ public:
     // Remove data from a buffer
     virtual size_t consume(size_t in_sz) = 0;
 
+    // List everything in the buffer as pointers into the buffer memory itself,
+    // for handing to an IO system which sends it by reference.  The segments
+    // are only valid until the buffer is next written, consumed, cleared, or
+    // destroyed.  Returns false if the buffer can't give out references to its
+    // memory.
+    virtual bool zero_copy_segments(std::vector<std::pair<unsigned char *, size_t> > *ret_segments __attribute__((unused))) {
+        return false;
+    }
+
 protected:
     // Mutex for all operations on the buffer
     std::recursive_timed_mutex buffer_locker;
@@ -187,6 +218,11 @@ public:
     virtual void PeekFreeReadBufferData(void *in_ptr);
     virtual void PeekFreeWriteBufferData(void *in_ptr);
 
+    // List the whole write buffer by reference, when the buffer supports it;
+    // see CommonBuffer::zero_copy_segments
+    virtual bool ZeroCopySegmentsWriteBufferData(
+            std::vector<std::pair<unsigned char *, size_t> > *ret_segments);
+
     // Consume data from the buffer.  Must not be called while there is pending 'peek'd 
     // data.
     //
@@ -203,6 +239,12 @@ public:
     virtual size_t PutReadBufferData(void *in_ptr, size_t in_sz, bool in_atomic);
     virtual size_t PutWriteBufferData(void *in_ptr, size_t in_sz, bool in_atomic);
 
+    // Place several blocks in the write buffer as one record, like writev(); 
+    // the buffer is locked and the callbacks are triggered once for all of
+    // them.  Always atomic, returns the total written or 0 if there was no
+    // room for the whole record
+    virtual size_t PutWriteBufferDataVec(const struct iovec *in_vec, size_t in_cnt);
+
     // Reserve space in the buffers; the returned pointer is suitable for direct
     // writing.  Whenever possible, this will be a zero-copy operation, however on
     // some buffer structures this may require copying of the data content to the
@@ -240,6 +282,10 @@ public:
     virtual bool CommitReadBufferData(void *in_ptr, size_t in_sz);
     virtual bool CommitWriteBufferData(void *in_ptr, size_t in_sz);
 
+    // Tell the read interface about data which reached the read buffer without
+    // going through this handler, such as a ring shared with another process
+    virtual void TriggerReadBufferAvailable(size_t in_amt);
+
     // Set interface callbacks to be called when we have data in the buffers
     virtual void SetReadBufferInterface(BufferInterface *in_interface);
     virtual void SetWriteBufferInterface(BufferInterface *in_interface);
@@ -281,6 +327,18 @@ protected:
     pthread_mutex_t handler_locker;
     pthread_mutex_t rbuf_locker;
     pthread_mutex_t wbuf_locker;
+
+    // Lock-free single producer / single consumer buffers don't need the buffer
+    // lock; a NULL lock is a no-op for local_locker
+    bool read_spsc, write_spsc;
+
+    pthread_mutex_t *rbuf_lock() {
+        return read_spsc ? NULL : &rbuf_locker;
+    }
+
+    pthread_mutex_t *wbuf_lock() {
+        return write_spsc ? NULL : &wbuf_locker;
+    }
     pthread_mutex_t r_callback_locker;
     pthread_mutex_t w_callback_locker;
 
@@ -290,7 +348,10 @@ protected:
     function<void (size_t)> writebuf_drain_cb;
 };
 
-template<class B> 
+// The write buffer type defaults to the read buffer type; a lock-free
+// RingbufSPSC can be used for either side where it has exactly one producer
+// and one consumer, ie BufferHandler<RingbufSPSC, RingbufV2>
+template<class B, class W = B> 
 class BufferHandler : public BufferHandlerGeneric {
 public:
     // For one-way buffers, define a buffer as having a size of zero
@@ -301,17 +362,49 @@ public:
             read_buffer = NULL;
 
         if (w_buffer_sz != 0)
-            write_buffer = new B(w_buffer_sz);
+            write_buffer = new W(w_buffer_sz);
         else
             write_buffer = NULL;
+
+        read_spsc = read_buffer != NULL && read_buffer->is_spsc();
+        write_spsc = write_buffer != NULL && write_buffer->is_spsc();
     }
 
-    BufferHandler(B *r_buf, B *w_buf) {
+    BufferHandler(B *r_buf, W *w_buf) {
         read_buffer = r_buf;
         write_buffer = w_buf;
+
+        read_spsc = read_buffer != NULL && read_buffer->is_spsc();
+        write_spsc = write_buffer != NULL && write_buffer->is_spsc();
     }
 };
 
+// A write-only buffer handler which can keep a copy of everything written to
+// it, so a response can be streamed to one client and remembered for others at
+// the same time.  Capturing starts with start_capture; a capture which grows
+// past its limit is dropped.  Takes ownership of the buffer.
+class BufferHandlerCapture : public BufferHandlerGeneric {
+public:
+    BufferHandlerCapture(CommonBuffer *in_write_buffer);
+
+    virtual size_t PutWriteBufferData(void *in_ptr, size_t in_sz, bool in_atomic);
+    virtual size_t PutWriteBufferDataVec(const struct iovec *in_vec, size_t in_cnt);
+    virtual bool CommitWriteBufferData(void *in_ptr, size_t in_sz);
+
+    void start_capture(size_t in_max_capture);
+
+    // Everything written since the capture started, or NULL if it wasn't
+    // started or outgrew the limit
+    shared_ptr<string> get_capture();
+
+protected:
+    void capture_data(void *in_ptr, size_t in_sz);
+
+    std::mutex capture_mutex;
+    shared_ptr<string> capture;
+    size_t max_capture;
+};
+
 // A C++ streambuf-compatible wrapper around a buf handler
 struct BufferHandlerOStreambuf : public std::streambuf {
     BufferHandlerOStreambuf(shared_ptr<BufferHandlerGeneric > in_rbhandler) :
@@ -27,6 +27,14 @@
 
 #include "config.h"
 
+#include <time.h>
+
+#ifdef SYS_LINUX
+#include <sys/timerfd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
 #include "msgpuck.h"
 #include "capture_framework.h"
 
@@ -47,11 +55,31 @@ int cf_parse_interface(char **ret_interface, char *definition) {
     return (colonpos - definition);
 }
 
+/* Find the comma which ends a flag value, skipping over any quoted section so 
+ * that values like blockedchannels="1,2,3" or filter="..." may contain commas;
+ * returns NULL if the value runs to the end of the definition */
+static char *cf_find_value_end(char *value) {
+    int quoted = 0;
+
+    while (*value != 0) {
+        if (*value == '"')
+            quoted = !quoted;
+        else if (*value == ',' && !quoted)
+            return value;
+
+        value++;
+    }
+
+    return NULL;
+}
+
 int cf_find_flag(char **ret_value, const char *flag, char *definition) {
     char *colonpos;
     char *flagpos;
     char *comma;
     char *equals;
+    char *value;
+    int value_len;
 
     colonpos = strstr(definition, ":");
 
@@ -75,23 +103,31 @@ int cf_find_flag(char **ret_value, const char *flag, char *definition) {
 
         /* Compare the flag */
         if (strncasecmp(flag, flagpos, (equals - flagpos)) == 0) {
+            value = equals + 1;
+
             /* Find the next comma */
-            comma = strstr(equals, ",");
+            comma = cf_find_value_end(value);
 
             /* If it's null we're the last flag, so use the total length after
              * the equals as the value */
             if (comma == NULL) {
-                *ret_value = equals + 1;
-                return strlen(equals) - 1;
+                value_len = strlen(value);
+            } else {
+                value_len = comma - value;
+            }
+
+            /* Strip the quotes from a quoted value */
+            if (value_len >= 2 && value[0] == '"' && value[value_len - 1] == '"') {
+                value++;
+                value_len -= 2;
             }
 
-            /* Otherwise return until the equals */
-            *ret_value = equals + 1;
-            return (comma - (equals + 1));
+            *ret_value = value;
+            return value_len;
         }
 
         /* Otherwise find the next comma and advance */
-        comma = strstr(flagpos, ",");
+        comma = cf_find_value_end(equals + 1);
 
         /* No comma, no more flags, nothing to find */
         if (comma == NULL) {
@@ -191,12 +227,24 @@ kis_capture_handler_t *cf_handler_init(const char *in_type) {
     ch->remote_host = NULL;
     ch->remote_port = 0;
 
+    ch->home_host = NULL;
+    ch->home_port = 0;
+    ch->redirect_host = NULL;
+    ch->redirect_port = 0;
+    ch->redirected = 0;
+
     ch->cli_sourcedef = NULL;
 
     ch->in_fd = -1;
     ch->out_fd = -1;
     ch->tcp_fd = -1;
 
+    ch->tls = 0;
+    ch->tls_ca = NULL;
+    ch->tls_verify = 1;
+    ch->tls_ctx = NULL;
+    ch->tls_conn = NULL;
+
     /* Disable retry by default */
     ch->remote_retry = 0;
 
@@ -245,6 +293,12 @@ kis_capture_handler_t *cf_handler_init(const char *in_type) {
 
     ch->spectrumconfig_cb = NULL;
 
+    ch->dropstats_cb = NULL;
+    ch->shed_cb = NULL;
+    ch->metadata_cb = NULL;
+
+    ch->muxchannel_cb = NULL;
+
     ch->capture_cb = NULL;
 
     ch->userdata = NULL;
@@ -258,6 +312,73 @@ kis_capture_handler_t *cf_handler_init(const char *in_type) {
     ch->channel_hop_shuffle = 0;
     ch->channel_hop_shuffle_spacing = 1;
 
+    /* Batching is enabled when we know the server supports it */
+    ch->batch_data = 0;
+    ch->batch_kvs = (simple_cap_proto_kv_t **) 
+        malloc(sizeof(simple_cap_proto_kv_t *) * CF_BATCH_MAX_PACKETS * 4);
+    ch->batch_kvs_len = 0;
+    ch->batch_bytes = 0;
+    ch->batch_packets = 0;
+
+    ch->compress_data = 0;
+    ch->compress_disabled = 0;
+    ch->zstream = NULL;
+    ch->zstream_reset = 0;
+
+    ch->resume_disabled = 0;
+    ch->resume_session = NULL;
+    ch->resume_uuid = NULL;
+    ch->resume_link = 0;
+    ch->resume_pending = 0;
+    ch->data_seq = 0;
+    ch->resume_buffer_max = CF_RESUME_BUFFER_DEFAULT;
+    ch->resume_buffer_used = 0;
+    ch->replay_head = NULL;
+    ch->replay_tail = NULL;
+    ch->replay_send = NULL;
+
+    ch->datagram_metadata = 0;
+    ch->datagram_snaplen = CF_DATAGRAM_SNAPLEN;
+    ch->datagram_fd = -1;
+    ch->datagram_token = NULL;
+    ch->datagram_seq = 0;
+    memset(&(ch->remote_addr), 0, sizeof(struct sockaddr_in));
+
+    ch->multiplex = 0;
+    ch->mux_parent = NULL;
+    ch->mux_channels = NULL;
+    ch->mux_next = NULL;
+    ch->mux_id = 0;
+    ch->mux_closed = 0;
+
+    ch->shed_frames = 0;
+    ch->metadata_only = 0;
+    ch->kernel_drops = 0;
+    ch->helper_drops = 0;
+    ch->reported_kernel_drops = 0;
+    ch->reported_helper_drops = 0;
+    ch->last_drops_check = 0;
+
+    ch->loop_wake_fd[0] = -1;
+    ch->loop_wake_fd[1] = -1;
+    ch->loop_epoll_fd = -1;
+    ch->loop_poll_len = 0;
+    ch->loop_sleep_usec = 0;
+    ch->wake_latency_usec = CF_WAKE_LATENCY_USEC;
+
+    ch->hop_switches = 0;
+    ch->hop_switch_total_usec = 0;
+    ch->hop_switch_max_usec = 0;
+    ch->hop_late = 0;
+    ch->reported_hop_switches = 0;
+
+    if (ch->batch_kvs == NULL) {
+        kis_simple_ringbuf_free(ch->in_ringbuf);
+        kis_simple_ringbuf_free(ch->out_ringbuf);
+        free(ch);
+        return NULL;
+    }
+
     return ch;
 }
 
@@ -283,21 +404,65 @@ void cf_handler_free(kis_capture_handler_t *caph) {
     if (caph->remote_host)
         free(caph->remote_host);
 
+    if (caph->home_host)
+        free(caph->home_host);
+
+    if (caph->redirect_host)
+        free(caph->redirect_host);
+
     if (caph->capsource_type)
         free(caph->capsource_type);
 
     if (caph->cli_sourcedef)
         free(caph->cli_sourcedef);
 
+    if (caph->tls_conn != NULL)
+        kis_tls_conn_free(caph->tls_conn);
+
     if (caph->tcp_fd >= 0)
         close(caph->tcp_fd);
 
+    if (caph->tls_ctx != NULL)
+        kis_tls_ctx_free(caph->tls_ctx);
+
+    if (caph->tls_ca != NULL)
+        free(caph->tls_ca);
+
     if (caph->in_ringbuf != NULL)
         kis_simple_ringbuf_free(caph->in_ringbuf);
 
     if (caph->out_ringbuf != NULL)
         kis_simple_ringbuf_free(caph->out_ringbuf);
 
+    for (szi = 0; szi < caph->batch_kvs_len; szi++)
+        free(caph->batch_kvs[szi]);
+
+    if (caph->batch_kvs != NULL)
+        free(caph->batch_kvs);
+
+    if (caph->zstream != NULL) {
+        deflateEnd(caph->zstream);
+        free(caph->zstream);
+    }
+
+    while (caph->replay_head != NULL) {
+        cf_replay_frame_t *rf = caph->replay_head;
+        caph->replay_head = rf->next;
+        free(rf);
+    }
+
+    if (caph->resume_session != NULL)
+        free(caph->resume_session);
+
+    if (caph->resume_uuid != NULL)
+        free(caph->resume_uuid);
+
+    if (caph->datagram_fd >= 0)
+        close(caph->datagram_fd);
+
+    if (caph->datagram_token != NULL)
+        free(caph->datagram_token);
+
     for (szi = 0; szi < caph->channel_hop_list_sz; szi++) {
         if (caph->channel_hop_list[szi] != NULL)
             free(caph->channel_hop_list[szi]);
@@ -325,6 +490,15 @@ void cf_handler_free(kis_capture_handler_t *caph) {
         caph->hopping_running = 0;
     }
 
+    if (caph->loop_epoll_fd >= 0)
+        close(caph->loop_epoll_fd);
+
+    if (caph->loop_wake_fd[0] >= 0)
+        close(caph->loop_wake_fd[0]);
+
+    if (caph->loop_wake_fd[1] >= 0 && caph->loop_wake_fd[1] != caph->loop_wake_fd[0])
+        close(caph->loop_wake_fd[1]);
+
     pthread_mutex_destroy(&(caph->out_ringbuf_lock));
     pthread_mutex_destroy(&(caph->handler_lock));
 }
@@ -532,6 +706,19 @@ int cf_handler_parse_opts(kis_capture_handler_t *caph, int argc, char *argv[]) {
 
     int retry = 1;
     int daemon = 0;
+    int batch = 0;
+    int checksum = 1;
+    int compress = 1;
+    int resume = 1;
+    unsigned long resume_buffer = CF_RESUME_BUFFER_DEFAULT;
+    int datagram = 0;
+    unsigned int datagram_snaplen = CF_DATAGRAM_SNAPLEN;
+    int multiplex = 0;
+    int shm_fds[3] = { -1, -1, -1 };
+    kis_shm_ring_t *shm_ring;
+    kis_simple_ringbuf_t *shm_ringbuf;
+    unsigned int x;
+    char tls_err[512];
 
     static struct option longopt[] = {
         { "in-fd", required_argument, 0, 1 },
@@ -541,6 +728,18 @@ int cf_handler_parse_opts(kis_capture_handler_t *caph, int argc, char *argv[]) {
         { "disable-retry", no_argument, 0, 5 },
         { "daemonize", no_argument, 0, 6},
         { "list", no_argument, 0, 7},
+        { "batch-data", no_argument, 0, 8},
+        { "disable-checksum", no_argument, 0, 9},
+        { "disable-compression", no_argument, 0, 10},
+        { "disable-resume", no_argument, 0, 11},
+        { "resume-buffer", required_argument, 0, 12},
+        { "datagram-metadata", no_argument, 0, 13},
+        { "datagram-snaplen", required_argument, 0, 14},
+        { "multiplex", no_argument, 0, 15},
+        { "shm-ring", required_argument, 0, 16},
+        { "tls", no_argument, 0, 17},
+        { "tls-ca", required_argument, 0, 18},
+        { "tls-no-verify", no_argument, 0, 19},
         { "help", no_argument, 0, 'h'},
         { 0, 0, 0, 0 }
     };
@@ -571,6 +770,9 @@ int cf_handler_parse_opts(kis_capture_handler_t *caph, int argc, char *argv[]) {
 
             caph->remote_host = strdup(parse_hname);
             caph->remote_port = parse_port;
+
+            caph->home_host = strdup(parse_hname);
+            caph->home_port = parse_port;
         } else if (r == 4) {
             caph->cli_sourcedef = strdup(optarg);
         } else if (r == 5) {
@@ -583,14 +785,81 @@ int cf_handler_parse_opts(kis_capture_handler_t *caph, int argc, char *argv[]) {
             cf_handler_list_devices(caph);
             cf_handler_free(caph);
             exit(1);
+        } else if (r == 8) {
+            batch = 1;
+        } else if (r == 9) {
+            checksum = 0;
+        } else if (r == 10) {
+            compress = 0;
+        } else if (r == 11) {
+            resume = 0;
+        } else if (r == 12) {
+            if (sscanf(optarg, "%lu", &resume_buffer) != 1 || resume_buffer < 1024) {
+                fprintf(stderr, "FATAL: Expected a resume buffer size of at least "
+                        "1024 kilobytes\n");
+                return -1;
+            }
+
+            resume_buffer *= 1024;
+        } else if (r == 13) {
+            datagram = 1;
+        } else if (r == 14) {
+            if (sscanf(optarg, "%u", &datagram_snaplen) != 1 || 
+                    datagram_snaplen < 32 || datagram_snaplen > 1024) {
+                fprintf(stderr, "FATAL: Expected a datagram snaplen between 32 "
+                        "and 1024 bytes\n");
+                return -1;
+            }
+        } else if (r == 15) {
+            multiplex = 1;
+        } else if (r == 16) {
+            if (sscanf(optarg, "%d,%d,%d", &(shm_fds[0]), &(shm_fds[1]), 
+                        &(shm_fds[2])) != 3) {
+                fprintf(stderr, "FATAL: Unable to parse shared memory ring descriptors\n");
+                return -1;
+            }
+        } else if (r == 17) {
+            caph->tls = 1;
+        } else if (r == 18) {
+            caph->tls = 1;
+            if (caph->tls_ca != NULL)
+                free(caph->tls_ca);
+            caph->tls_ca = strdup(optarg);
+        } else if (r == 19) {
+            caph->tls = 1;
+            caph->tls_verify = 0;
         }
     }
 
+    /* The server only offers a shared ring to a source with a helper of its
+     * own */
+    if (shm_fds[0] >= 0 && (caph->remote_host != NULL || multiplex)) {
+        fprintf(stderr, 
+                "WARNING: Ignoring --shm-ring option for a remote or multiplexed helper\n");
+
+        for (x = 0; x < 3; x++) {
+            if (shm_fds[x] >= 0)
+                close(shm_fds[x]);
+        }
+
+        shm_fds[0] = -1;
+    }
+
     if (caph->remote_host == NULL && caph->cli_sourcedef != NULL) {
         fprintf(stderr, 
                 "WARNING: Ignoring --source option when not connecting to a remote host\n");
     }
 
+    if (caph->remote_host == NULL && caph->tls) {
+        fprintf(stderr, 
+                "WARNING: Ignoring --tls options when not connecting to a remote host\n");
+    }
+
+    if (caph->remote_host != NULL && multiplex) {
+        fprintf(stderr, 
+                "WARNING: Ignoring --multiplex option when connecting to a remote host\n");
+    }
+
     if (caph->remote_host != NULL) {
         /* Must have a --source to present to the remote host */
         if (caph->cli_sourcedef == NULL) {
@@ -605,12 +874,84 @@ int cf_handler_parse_opts(kis_capture_handler_t *caph, int argc, char *argv[]) {
         /* Set daemon mode only when we have a remote host */
         caph->daemonize = daemon;
 
+        /* Remote servers may be older and not understand batched data, so
+         * only batch when asked to */
+        caph->batch_data = batch;
+
+        /* Compression is only used if the server offers it */
+        caph->compress_disabled = !compress;
+
+        /* Sessions are only resumed if the server offers them */
+        caph->resume_disabled = !resume;
+        caph->resume_buffer_max = resume_buffer;
+
+        /* Datagrams are only sent if the server accepts them */
+        caph->datagram_metadata = datagram;
+        caph->datagram_snaplen = datagram_snaplen;
+
+        if (caph->tls) {
+            caph->tls_ctx = kis_tls_client_ctx(caph->tls_ca, caph->tls_verify,
+                    tls_err, sizeof(tls_err));
+
+            if (caph->tls_ctx == NULL) {
+                fprintf(stderr, "FATAL: %s\n", tls_err);
+                return -1;
+            }
+
+            if (!caph->tls_verify)
+                fprintf(stderr, "WARNING: Not verifying the certificate of the remote "
+                        "server (--tls-no-verify)\n");
+
+            /* Metadata datagrams would bypass the TLS connection */
+            if (datagram) {
+                fprintf(stderr, "WARNING: Ignoring --datagram-metadata option with TLS\n");
+                caph->datagram_metadata = 0;
+            }
+        }
+
         return 2;
     }
 
     if (caph->in_fd == -1 || caph->out_fd == -1)
         return -1;
 
+    /* A local capture was launched by the server it talks to, which always
+     * understands batched data */
+    caph->batch_data = 1;
+
+    /* The server asks us not to checksum frames on a local pipe; network
+     * connections are always checksummed */
+    simple_cap_proto_set_checksum(checksum);
+
+    /* Only drivers which can set up a channel can be shared between sources */
+    if (multiplex) {
+        if (caph->muxchannel_cb == NULL) {
+            fprintf(stderr, "FATAL: This capture driver can not be shared between "
+                    "sources (--multiplex)\n");
+            return -1;
+        }
+
+        caph->multiplex = 1;
+    }
+
+    /* Write frames straight into the ring the server reads them from instead
+     * of the out pipe; the pipe stays open so each side sees the other exit */
+    if (shm_fds[0] >= 0) {
+        if ((shm_ring = kis_shm_ring_attach(shm_fds[0], shm_fds[1], shm_fds[2])) == NULL) {
+            fprintf(stderr, "FATAL: Unable to attach to shared memory ring\n");
+            return -1;
+        }
+
+        if ((shm_ringbuf = kis_simple_ringbuf_create_shm(shm_ring)) == NULL) {
+            fprintf(stderr, "FATAL: Unable to allocate shared memory ring\n");
+            kis_shm_ring_free(shm_ring);
+            return -1;
+        }
+
+        kis_simple_ringbuf_free(caph->out_ringbuf);
+        caph->out_ringbuf = shm_ringbuf;
+    }
+
     return 1;
 
 }
@@ -632,6 +973,30 @@ void cf_print_help(kis_capture_handler_t *caph, const char *argv0) {
                 "                             if there is an error; exit immediately\n"
                 " --daemonize                 Background the capture tool and enter daemon\n"
                 "                             mode.\n"
+                " --batch-data                Send multiple packets per frame to the remote\n"
+                "                             server; requires a server which supports\n"
+                "                             batched data.\n"
+                " --disable-compression       Do not compress batched data, even if the\n"
+                "                             remote server supports it.\n"
+                " --disable-resume            Do not resume the session with the remote\n"
+                "                             server after a lost connection; reopen the\n"
+                "                             source instead.\n"
+                " --resume-buffer [kb]        Buffer up to [kb] kilobytes of data to replay\n"
+                "                             when a session is resumed (default 8192).\n"
+                " --datagram-metadata         Send the signal, GPS, and headers of each\n"
+                "                             packet to the remote server in UDP datagrams\n"
+                "                             instead of full packets over TCP, for lower\n"
+                "                             latency over lossy links.\n"
+                " --datagram-snaplen [bytes]  Send the first [bytes] of each packet in a\n"
+                "                             datagram (default 256).\n"
+                " --tls                       Connect to the remote server with TLS; the\n"
+                "                             server certificate is checked against the\n"
+                "                             system CA certificates.\n"
+                " --tls-ca [file]             Connect with TLS, and check the server\n"
+                "                             certificate against the CA certificates in\n"
+                "                             the PEM [file].\n"
+                " --tls-no-verify             Connect with TLS without checking the server\n"
+                "                             certificate.\n"
                 " --list                      List supported devices detected\n",
                 argv0, argv0);
     }
@@ -671,6 +1036,31 @@ void cf_handler_set_capture_cb(kis_capture_handler_t *capf, cf_callback_capture
     pthread_mutex_unlock(&(capf->handler_lock));
 }
 
+void cf_handler_set_dropstats_cb(kis_capture_handler_t *capf, cf_callback_dropstats cb) {
+    pthread_mutex_lock(&(capf->handler_lock));
+    capf->dropstats_cb = cb;
+    pthread_mutex_unlock(&(capf->handler_lock));
+}
+
+void cf_handler_set_shed_cb(kis_capture_handler_t *capf, cf_callback_shed cb) {
+    pthread_mutex_lock(&(capf->handler_lock));
+    capf->shed_cb = cb;
+    pthread_mutex_unlock(&(capf->handler_lock));
+}
+
+void cf_handler_set_metadata_cb(kis_capture_handler_t *capf, cf_callback_metadata cb) {
+    pthread_mutex_lock(&(capf->handler_lock));
+    capf->metadata_cb = cb;
+    pthread_mutex_unlock(&(capf->handler_lock));
+}
+
+void cf_handler_set_muxchannel_cb(kis_capture_handler_t *capf, 
+        cf_callback_muxchannel cb) {
+    pthread_mutex_lock(&(capf->handler_lock));
+    capf->muxchannel_cb = cb;
+    pthread_mutex_unlock(&(capf->handler_lock));
+}
+
 void cf_handler_set_spectrumconfig_cb(kis_capture_handler_t *capf, 
         cf_callback_spectrumconfig cb) {
     pthread_mutex_lock(&(capf->handler_lock));
@@ -762,7 +1152,27 @@ void cf_handler_wait_ringbuffer(kis_capture_handler_t *caph) {
     pthread_mutex_unlock(&(caph->out_ringbuf_flush_cond_mutex));
 }
 
+static uint64_t cf_monotonic_usec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ((uint64_t) ts.tv_sec * 1000000L) + (ts.tv_nsec / 1000);
+}
+
+#ifdef SYS_LINUX
+static void cf_int_chanhop_close_timer(void *arg) {
+    close(*((int *) arg));
+}
+#endif
+
 /* Internal capture thread which drives channel hopping
+ *
+ * Hops are scheduled against the monotonic clock instead of sleeping the hop
+ * interval after each switch, so the time a channel change takes doesn't push
+ * every following hop later.  On Linux a timerfd wakes the thread; elsewhere it
+ * sleeps until the next deadline.  A switch which overruns the interval makes
+ * the next hop late but doesn't skip channels.
  */
 void *cf_int_chanhop_thread(void *arg) {
     kis_capture_handler_t *caph = (kis_capture_handler_t *) arg;
@@ -776,12 +1186,36 @@ void *cf_int_chanhop_thread(void *arg) {
     size_t hoppos = caph->channel_hop_offset;
     pthread_mutex_unlock(&(caph->handler_lock));
 
-    /* How long we're waiting until the next time */
-    unsigned int wait_sec = 0;
-    unsigned int wait_usec = 0;
+    /* Interval between hops, and the rate it was computed for */
+    uint64_t interval_usec = 0;
+    double interval_rate = 0;
+
+#ifndef SYS_LINUX
+    uint64_t deadline_usec = 0;
+#endif
+    uint64_t start_usec, switch_usec;
+    uint64_t missed;
 
     char errstr[STATUS_MAX];
 
+#ifdef SYS_LINUX
+    int timer_fd;
+    struct itimerspec tspec;
+
+    if ((timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) < 0) {
+        snprintf(errstr, STATUS_MAX, "failed to create channel hopping timer: %s",
+                strerror(errno));
+        cf_send_error(caph, errstr);
+
+        pthread_mutex_lock(&(caph->handler_lock));
+        caph->hopping_running = 0;
+        pthread_mutex_unlock(&(caph->handler_lock));
+        return NULL;
+    }
+
+    pthread_cleanup_push(cf_int_chanhop_close_timer, &timer_fd);
+#endif
+
     while (1) {
         pthread_mutex_lock(&(caph->handler_lock));
 
@@ -789,33 +1223,79 @@ void *cf_int_chanhop_thread(void *arg) {
         if (caph->channel_hop_rate == 0) {
             caph->hopping_running = 0;
             pthread_mutex_unlock(&(caph->handler_lock));
-            return NULL;
+            break;
         }
-       
-        wait_usec = 1000000L / caph->channel_hop_rate;
 
-        if (wait_usec < 50000) {
-            wait_sec = 0;
-            wait_usec = 50000;
-        } else if (wait_usec > 1000000L) {
-            wait_sec = wait_usec / 1000000L;
-            wait_usec = wait_usec % 1000000L;
+        /* (Re)arm the schedule when the rate changes */
+        if (caph->channel_hop_rate != interval_rate) {
+            interval_rate = caph->channel_hop_rate;
+            interval_usec = (uint64_t) (1000000.0f / interval_rate);
+
+            if (interval_usec < CF_HOP_MIN_USEC)
+                interval_usec = CF_HOP_MIN_USEC;
+
+#ifndef SYS_LINUX
+            deadline_usec = cf_monotonic_usec() + interval_usec;
+#else
+            tspec.it_interval.tv_sec = interval_usec / 1000000L;
+            tspec.it_interval.tv_nsec = (interval_usec % 1000000L) * 1000;
+            tspec.it_value = tspec.it_interval;
+
+            timerfd_settime(timer_fd, 0, &tspec, NULL);
+#endif
         }
 
         pthread_mutex_unlock(&(caph->handler_lock));
 
-        /* Sleep until the next wakeup */
-        sleep(wait_sec);
-        usleep(wait_usec);
+        /* Wait for the next hop */
+        missed = 0;
+#ifdef SYS_LINUX
+        {
+            uint64_t expirations = 0;
+
+            if (read(timer_fd, &expirations, sizeof(uint64_t)) != sizeof(uint64_t)) {
+                if (errno == EINTR)
+                    continue;
+
+                snprintf(errstr, STATUS_MAX, "failed to wait for channel hopping "
+                        "timer: %s", strerror(errno));
+                cf_send_error(caph, errstr);
+
+                pthread_mutex_lock(&(caph->handler_lock));
+                caph->hopping_running = 0;
+                pthread_mutex_unlock(&(caph->handler_lock));
+                break;
+            }
+
+            if (expirations > 1)
+                missed = expirations - 1;
+        }
+#else
+        start_usec = cf_monotonic_usec();
+
+        if (deadline_usec > start_usec)
+            usleep(deadline_usec - start_usec);
+
+        /* Keep to the schedule, unless we've fallen a whole interval behind */
+        deadline_usec += interval_usec;
+        start_usec = cf_monotonic_usec();
+
+        if (deadline_usec <= start_usec) {
+            missed = ((start_usec - deadline_usec) / interval_usec) + 1;
+            deadline_usec = start_usec + interval_usec;
+        }
+#endif
 
         pthread_mutex_lock(&caph->handler_lock);
 
         if (caph->channel_hop_rate == 0 || caph->chancontrol_cb == NULL) {
             caph->hopping_running = 0;
             pthread_mutex_unlock(&caph->handler_lock);
-            return NULL;
+            break;
         }
 
+        start_usec = cf_monotonic_usec();
+
         errstr[0] = 0;
         if ((caph->chancontrol_cb)(caph, 0, 
                     caph->custom_channel_hop_list[hoppos % caph->channel_hop_list_sz], 
@@ -824,9 +1304,17 @@ void *cf_int_chanhop_thread(void *arg) {
             caph->hopping_running = 0;
             pthread_mutex_unlock(&caph->handler_lock);
             cf_handler_spindown(caph);
-            return NULL;
+            break;
         }
 
+        switch_usec = cf_monotonic_usec() - start_usec;
+
+        caph->hop_switches++;
+        caph->hop_switch_total_usec += switch_usec;
+        if (switch_usec > caph->hop_switch_max_usec)
+            caph->hop_switch_max_usec = switch_usec;
+        caph->hop_late += missed;
+
         /* Increment by the shuffle amount */
         if (caph->channel_hop_shuffle)
             hoppos += caph->channel_hop_shuffle_spacing;
@@ -837,6 +1325,10 @@ void *cf_int_chanhop_thread(void *arg) {
 
     }
 
+#ifdef SYS_LINUX
+    pthread_cleanup_pop(1);
+#endif
+
     return NULL;
 }
 
@@ -865,6 +1357,217 @@ int cf_handler_launch_hopping_thread(kis_capture_handler_t *caph) {
     return 1;
 }
 
+/* Stop sending datagrams.  Must be called with out_ringbuf_lock held. */
+static void cf_close_datagram(kis_capture_handler_t *caph) {
+    if (caph->datagram_fd >= 0) {
+        close(caph->datagram_fd);
+        caph->datagram_fd = -1;
+    }
+
+    if (caph->datagram_token != NULL) {
+        free(caph->datagram_token);
+        caph->datagram_token = NULL;
+    }
+
+    caph->datagram_seq = 0;
+}
+
+/* Start sending datagrams to the remote server with the token it gave us.  
+ * Must be called with out_ringbuf_lock held. */
+static int cf_open_datagram(kis_capture_handler_t *caph, const char *token, 
+        size_t token_len) {
+    int fd;
+
+    cf_close_datagram(caph);
+
+    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        fprintf(stderr, "WARNING - Unable to create datagram socket: %s\n",
+                strerror(errno));
+        return -1;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    if (connect(fd, (struct sockaddr *) &(caph->remote_addr), 
+                sizeof(struct sockaddr_in)) < 0) {
+        fprintf(stderr, "WARNING - Unable to connect datagram socket: %s\n",
+                strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    caph->datagram_fd = fd;
+    caph->datagram_token = strndup(token, token_len);
+
+    return 1;
+}
+
+/* Free every frame held for replay.  Must be called with out_ringbuf_lock
+ * held. */
+static void cf_clear_replay(kis_capture_handler_t *caph) {
+    cf_replay_frame_t *rf;
+
+    while (caph->replay_head != NULL) {
+        rf = caph->replay_head;
+        caph->replay_head = rf->next;
+        free(rf);
+    }
+
+    caph->replay_tail = NULL;
+    caph->replay_send = NULL;
+    caph->resume_buffer_used = 0;
+
+    pthread_cond_signal(&(caph->out_ringbuf_flush_cond));
+}
+
+/* Forget the session and anything held for replay; the next connection opens 
+ * the source from scratch.  Must be called with out_ringbuf_lock held. */
+static void cf_end_session(kis_capture_handler_t *caph) {
+    cf_clear_replay(caph);
+
+    if (caph->resume_session != NULL) {
+        free(caph->resume_session);
+        caph->resume_session = NULL;
+    }
+
+    caph->resume_link = 0;
+    caph->resume_pending = 0;
+    caph->data_seq = 0;
+}
+
+/* Release the frames the server has acknowledged, up to and including seq.
+ * Must be called with out_ringbuf_lock held. */
+static void cf_ack_replay(kis_capture_handler_t *caph, uint32_t seq) {
+    cf_replay_frame_t *rf;
+
+    while (caph->replay_head != NULL && 
+            (int32_t) (caph->replay_head->seq - seq) <= 0) {
+        rf = caph->replay_head;
+        caph->replay_head = rf->next;
+
+        if (caph->replay_send == rf)
+            caph->replay_send = rf->next;
+
+        caph->resume_buffer_used -= rf->len;
+        free(rf);
+    }
+
+    if (caph->replay_head == NULL)
+        caph->replay_tail = NULL;
+
+    /* Signal to any waiting IO that the replay buffer has some headroom */
+    pthread_cond_signal(&(caph->out_ringbuf_flush_cond));
+}
+
+/* Copy frames which haven't been sent from the replay list into the write
+ * buffer, if the link is up.  Must be called with out_ringbuf_lock held. */
+static void cf_pump_replay(kis_capture_handler_t *caph) {
+    if (!caph->resume_link)
+        return;
+
+    while (caph->replay_send != NULL &&
+            kis_simple_ringbuf_available(caph->out_ringbuf) >= caph->replay_send->len) {
+        kis_simple_ringbuf_write(caph->out_ringbuf, caph->replay_send->data,
+                caph->replay_send->len);
+        caph->replay_send = caph->replay_send->next;
+    }
+}
+
+/* Sequence number for the next data frame; data frames aren't numbered 
+ * without a session.  Must be called with out_ringbuf_lock held. */
+static uint32_t cf_next_data_seq(kis_capture_handler_t *caph) {
+    if (caph->resume_session == NULL)
+        return 0;
+
+    /* 0 means unnumbered, skip it when wrapping */
+    if (caph->data_seq + 1 == 0)
+        return 1;
+
+    return caph->data_seq + 1;
+}
+
+/* Room for a data frame:  in the replay buffer during a session, otherwise in
+ * the write buffer.  Must be called with out_ringbuf_lock held. */
+static size_t cf_data_room(kis_capture_handler_t *caph) {
+    if (caph->resume_session == NULL)
+        return kis_simple_ringbuf_available(caph->out_ringbuf);
+
+    if (caph->resume_buffer_used >= caph->resume_buffer_max)
+        return 0;
+
+    return caph->resume_buffer_max - caph->resume_buffer_used;
+}
+
+/* Write a data frame, encoded with cf_next_data_seq, to the replay list during
+ * a session or straight to the write buffer otherwise.  The KVs are not freed.
+ * Must be called with out_ringbuf_lock held.
+ *
+ * Returns:
+ * -1   An error occurred
+ *  0   Insufficient space in buffer
+ *  1   Success
+ */
+static int cf_write_data_frame(kis_capture_handler_t *caph, simple_cap_proto_t *proto_hdr,
+        size_t proto_sz, simple_cap_proto_kv_t **in_kv_list, size_t in_kv_len) {
+    cf_replay_frame_t *rf;
+    size_t pos, kv_sz, i;
+
+    if (cf_data_room(caph) < proto_sz)
+        return 0;
+
+    if (caph->resume_session == NULL) {
+        kis_simple_ringbuf_write(caph->out_ringbuf, (uint8_t *) proto_hdr, 
+                sizeof(simple_cap_proto_t));
+
+        for (i = 0; i < in_kv_len; i++) {
+            simple_cap_proto_kv_t *kv = in_kv_list[i];
+
+            kis_simple_ringbuf_write(caph->out_ringbuf, (uint8_t *) kv,
+                    ntohl(kv->header.obj_sz) + sizeof(simple_cap_proto_kv_t));
+        }
+
+        return 1;
+    }
+
+    rf = (cf_replay_frame_t *) malloc(sizeof(cf_replay_frame_t) + proto_sz);
+
+    if (rf == NULL) {
+        fprintf(stderr, "FATAL: Unable to allocate replay frame\n");
+        return -1;
+    }
+
+    rf->next = NULL;
+    rf->seq = ntohl(proto_hdr->sequence_number);
+    rf->len = proto_sz;
+
+    memcpy(rf->data, proto_hdr, sizeof(simple_cap_proto_t));
+    pos = sizeof(simple_cap_proto_t);
+
+    for (i = 0; i < in_kv_len; i++) {
+        kv_sz = ntohl(in_kv_list[i]->header.obj_sz) + sizeof(simple_cap_proto_kv_t);
+        memcpy(rf->data + pos, in_kv_list[i], kv_sz);
+        pos += kv_sz;
+    }
+
+    if (caph->replay_tail != NULL)
+        caph->replay_tail->next = rf;
+    else
+        caph->replay_head = rf;
+
+    caph->replay_tail = rf;
+
+    if (caph->replay_send == NULL)
+        caph->replay_send = rf;
+
+    caph->resume_buffer_used += proto_sz;
+    caph->data_seq = rf->seq;
+
+    cf_pump_replay(caph);
+
+    return 1;
+}
+
 int cf_handle_rx_data(kis_capture_handler_t *caph) {
     size_t rb_available;
 
@@ -1060,42 +1763,163 @@ int cf_handle_rx_data(kis_capture_handler_t *caph) {
                 return -1;
             }
 
-            msgstr[0] = 0;
-            cbret = (*(caph->open_cb))(caph,
-                    ntohl(cap_proto_frame->header.sequence_number), nuldef,
-                    msgstr, &dlt, &uuid, cap_proto_frame,
-                    &interfaceparams, &spectrumparams);
+            /* Shed low-value frames instead of waiting when the write buffer
+             * backs up; the capture thread isn't running yet so this doesn't need
+             * the buffer lock */
+            {
+                char *bp_flag;
+                int bp_len;
 
-            cf_send_openresp(caph, ntohl(cap_proto_frame->header.sequence_number),
-                    cbret < 0 ? 0 : cbret, msgstr, dlt, uuid, interfaceparams,
-                    spectrumparams);
+                caph->shed_frames = 0;
 
-            if (nuldef != NULL)
-                free(nuldef);
+                if ((bp_len = cf_find_flag(&bp_flag, "backpressure", nuldef)) > 0) {
+                    if (bp_len == 4 && strncasecmp(bp_flag, "shed", 4) == 0)
+                        caph->shed_frames = 1;
+                }
+            }
 
-            if (uuid != NULL)
-                free(uuid);
+            /* Send metadata-only frames instead of whole frames */
+            {
+                char *meta_flag;
+                int meta_len;
 
-            if (interfaceparams != NULL)
-                cf_params_interface_free(interfaceparams);
+                caph->metadata_only = 0;
 
-            if (spectrumparams != NULL)
-                cf_params_spectrum_free(spectrumparams);
+                if ((meta_len = cf_find_flag(&meta_flag, "metadata", nuldef)) > 0) {
+                    if (meta_len == 4 && strncasecmp(meta_flag, "true", 4) == 0)
+                        caph->metadata_only = 1;
+                }
+            }
 
+            /* How long queued data may wait for the main loop before the loop
+             * is woken for it */
+            {
+                char *wl_flag;
+                int wl_len;
+                char *wl_str;
+                unsigned long wl_usec;
 
-            if (caph->remote_host) {
-                fprintf(stderr, "INFO - %s:%u starting capture...\n",
-                        caph->remote_host, caph->remote_port);
-            }
+                caph->wake_latency_usec = CF_WAKE_LATENCY_USEC;
 
-            if (cbret >= 0) {
-                cf_handler_launch_capture_thread(caph);
+                if ((wl_len = cf_find_flag(&wl_flag, "wakelatency", nuldef)) > 0) {
+                    wl_str = strndup(wl_flag, wl_len);
+
+                    if (sscanf(wl_str, "%lu", &wl_usec) == 1)
+                        caph->wake_latency_usec = wl_usec;
+                    else
+                        fprintf(stderr, "WARNING - Ignoring invalid wakelatency '%s'\n",
+                                wl_str);
+
+                    free(wl_str);
+                }
             }
 
-            pthread_mutex_unlock(&(caph->handler_lock));
-        }
+            /* Batch and compress data to a remote server which offers 
+             * compression; each open starts a new stream */
+            if (caph->remote_host != NULL && !caph->compress_disabled) {
+                simple_cap_proto_kv_t *comp_kv = NULL;
+                int comp_len;
 
-    } else if (strncasecmp(cap_proto_frame->header.type, "CONFIGURE", 16) == 0) {
+                comp_len = find_simple_cap_proto_kv(cap_proto_frame, 
+                        "COMPRESSION", &comp_kv);
+
+                pthread_mutex_lock(&(caph->out_ringbuf_lock));
+
+                caph->compress_data = 0;
+
+                if (comp_len >= 7 && 
+                        strncasecmp((char *) comp_kv->object, "deflate", 7) == 0) {
+                    if (cf_init_compression(caph) >= 0) {
+                        caph->compress_data = 1;
+                        caph->batch_data = 1;
+                    } else {
+                        fprintf(stderr, "WARNING - Unable to initialize compression, "
+                                "sending uncompressed data\n");
+                    }
+                }
+
+                pthread_mutex_unlock(&(caph->out_ringbuf_lock));
+            }
+
+            /* Keep a resumable session with a remote server which offers one;
+             * each open starts a new session */
+            if (caph->remote_host != NULL) {
+                simple_cap_proto_kv_t *resume_kv = NULL;
+                int resume_len;
+
+                resume_len = find_simple_cap_proto_kv(cap_proto_frame, 
+                        "RESUME", &resume_kv);
+
+                pthread_mutex_lock(&(caph->out_ringbuf_lock));
+
+                cf_end_session(caph);
+
+                if (resume_len > 0 && !caph->resume_disabled) {
+                    caph->resume_session = strndup((char *) resume_kv->object, resume_len);
+                    caph->resume_link = 1;
+                }
+
+                pthread_mutex_unlock(&(caph->out_ringbuf_lock));
+            }
+
+            /* Send packet metadata in datagrams if we were asked to and the
+             * server accepts them; each open gets a new token */
+            if (caph->remote_host != NULL) {
+                simple_cap_proto_kv_t *dgram_kv = NULL;
+                int dgram_len;
+
+                dgram_len = find_simple_cap_proto_kv(cap_proto_frame, 
+                        "DATAGRAM", &dgram_kv);
+
+                pthread_mutex_lock(&(caph->out_ringbuf_lock));
+
+                cf_close_datagram(caph);
+
+                if (dgram_len > 0 && caph->datagram_metadata) {
+                    if (cf_open_datagram(caph, (char *) dgram_kv->object, dgram_len) < 0)
+                        fprintf(stderr, "WARNING - Unable to send datagrams, sending "
+                                "full packets\n");
+                }
+
+                pthread_mutex_unlock(&(caph->out_ringbuf_lock));
+            }
+
+            msgstr[0] = 0;
+            cbret = (*(caph->open_cb))(caph,
+                    ntohl(cap_proto_frame->header.sequence_number), nuldef,
+                    msgstr, &dlt, &uuid, cap_proto_frame,
+                    &interfaceparams, &spectrumparams);
+
+            cf_send_openresp(caph, ntohl(cap_proto_frame->header.sequence_number),
+                    cbret < 0 ? 0 : cbret, msgstr, dlt, uuid, interfaceparams,
+                    spectrumparams);
+
+            if (nuldef != NULL)
+                free(nuldef);
+
+            if (uuid != NULL)
+                free(uuid);
+
+            if (interfaceparams != NULL)
+                cf_params_interface_free(interfaceparams);
+
+            if (spectrumparams != NULL)
+                cf_params_spectrum_free(spectrumparams);
+
+
+            if (caph->remote_host) {
+                fprintf(stderr, "INFO - %s:%u starting capture...\n",
+                        caph->remote_host, caph->remote_port);
+            }
+
+            if (cbret >= 0) {
+                cf_handler_launch_capture_thread(caph);
+            }
+
+            pthread_mutex_unlock(&(caph->handler_lock));
+        }
+
+    } else if (strncasecmp(cap_proto_frame->header.type, "CONFIGURE", 16) == 0) {
         char *cdef, *chanset_channel;
         double chanhop_rate;
         char **chanhop_channels;
@@ -1209,6 +2033,93 @@ int cf_handle_rx_data(kis_capture_handler_t *caph) {
             }
         }
 
+    } else if (strncasecmp(cap_proto_frame->header.type, "RESUMERESP", 16) == 0 ||
+            strncasecmp(cap_proto_frame->header.type, "DATAACK", 16) == 0) {
+        simple_cap_proto_kv_t *seq_kv = NULL;
+        uint32_t ack_seq;
+        unsigned int replay_count = 0;
+        int resumed = 0;
+        cf_replay_frame_t *rf;
+
+        pthread_mutex_unlock(&(caph->handler_lock));
+
+        if (find_simple_cap_proto_kv(cap_proto_frame, "DATASEQ", &seq_kv) != 
+                sizeof(uint32_t)) {
+            fprintf(stderr, "FATAL - Got %.16s with no DATASEQ\n", 
+                    cap_proto_frame->header.type);
+            free(frame_buf);
+            return -1;
+        }
+
+        memcpy(&ack_seq, seq_kv->object, sizeof(uint32_t));
+        ack_seq = ntohl(ack_seq);
+
+        pthread_mutex_lock(&(caph->out_ringbuf_lock));
+
+        cf_ack_replay(caph, ack_seq);
+
+        /* Replay everything the server didn't get, then carry on */
+        if (strncasecmp(cap_proto_frame->header.type, "RESUMERESP", 16) == 0) {
+            if (caph->resume_pending) {
+                caph->replay_send = caph->replay_head;
+                caph->resume_pending = 0;
+                caph->resume_link = 1;
+                resumed = 1;
+
+                for (rf = caph->replay_head; rf != NULL; rf = rf->next)
+                    replay_count++;
+
+                cf_pump_replay(caph);
+            }
+        }
+
+        pthread_mutex_unlock(&(caph->out_ringbuf_lock));
+
+        if (resumed) 
+            fprintf(stderr, "INFO - Resumed session with remote server, replaying "
+                    "%u frames\n", replay_count);
+
+        cbret = 1;
+    } else if (strncasecmp(cap_proto_frame->header.type, "REDIRECT", 16) == 0) {
+        simple_cap_proto_kv_t *redir_kv = NULL;
+        int redir_len;
+        char redir_host[513];
+        char *redir_str;
+        unsigned int redir_port;
+
+        pthread_mutex_unlock(&(caph->handler_lock));
+
+        redir_len = find_simple_cap_proto_kv(cap_proto_frame, "REDIRECT", &redir_kv);
+
+        if (redir_len <= 0) {
+            fprintf(stderr, "FATAL - Got REDIRECT with no REDIRECT KV\n");
+            free(frame_buf);
+            return -1;
+        }
+
+        redir_str = strndup((char *) redir_kv->object, redir_len);
+
+        if (sscanf(redir_str, "%512[^:]:%u", redir_host, &redir_port) != 2) {
+            fprintf(stderr, "FATAL - Got REDIRECT to invalid server '%s'\n", redir_str);
+            free(redir_str);
+            free(frame_buf);
+            return -1;
+        }
+
+        free(redir_str);
+
+        fprintf(stderr, "INFO - Remote server is redirecting this source to '%s:%u'\n",
+                redir_host, redir_port);
+
+        pthread_mutex_lock(&(caph->handler_lock));
+        if (caph->redirect_host != NULL)
+            free(caph->redirect_host);
+        caph->redirect_host = strdup(redir_host);
+        caph->redirect_port = redir_port;
+        pthread_mutex_unlock(&(caph->handler_lock));
+
+        /* Spin down this connection; the next one goes to the new server */
+        cbret = -1;
     } else if (strncasecmp(cap_proto_frame->header.type, "PING", 16) == 0) {
         caph->last_ping = time(NULL);
         cf_send_pong(caph);
@@ -1417,6 +2328,63 @@ int cf_get_SPECSET(uint64_t *ret_start_mhz, uint64_t *ret_end_mhz,
     return 1;
 }
 
+/* Start TLS on a new connection to the server, and wait up to 
+ * CF_TLS_HANDSHAKE_TIMEOUT seconds for the handshake; the connection is
+ * closed if it fails */
+static int cf_tls_handshake(kis_capture_handler_t *caph) {
+    fd_set rset, wset;
+    struct timeval tm;
+    time_t start = time(NULL);
+    int r;
+
+    caph->tls_conn = kis_tls_conn_new(caph->tls_ctx, caph->tcp_fd, 0, caph->remote_host);
+
+    if (caph->tls_conn == NULL) {
+        fprintf(stderr, "FATAL - Could not start TLS with remote host '%s:%u'\n",
+                caph->remote_host, caph->remote_port);
+        close(caph->tcp_fd);
+        caph->tcp_fd = -1;
+        return -1;
+    }
+
+    while ((r = kis_tls_handshake(caph->tls_conn)) == 0) {
+        if (time(NULL) - start > CF_TLS_HANDSHAKE_TIMEOUT)
+            break;
+
+        FD_ZERO(&rset);
+        FD_ZERO(&wset);
+
+        if (kis_tls_want_write(caph->tls_conn))
+            FD_SET(caph->tcp_fd, &wset);
+        else
+            FD_SET(caph->tcp_fd, &rset);
+
+        tm.tv_sec = 1;
+        tm.tv_usec = 0;
+
+        if (select(caph->tcp_fd + 1, &rset, &wset, NULL, &tm) < 0 && errno != EINTR)
+            break;
+    }
+
+    if (r != 1) {
+        fprintf(stderr, "FATAL - TLS handshake with remote host '%s:%u' failed: %s\n",
+                caph->remote_host, caph->remote_port,
+                r == 0 ? "timed out" : kis_tls_error(caph->tls_conn));
+
+        kis_tls_conn_free(caph->tls_conn);
+        caph->tls_conn = NULL;
+        close(caph->tcp_fd);
+        caph->tcp_fd = -1;
+        return -1;
+    }
+
+    fprintf(stderr, "INFO - TLS connection established%s, kernel offload %s\n",
+            kis_tls_resumed(caph->tls_conn) ? " (resumed session)" : "",
+            kis_tls_offload(caph->tls_conn));
+
+    return 1;
+}
+
 int cf_handler_remote_connect(kis_capture_handler_t *caph) {
     struct hostent *connect_host;
     struct sockaddr_in client_sock, local_sock;
@@ -1428,6 +2396,7 @@ int cf_handler_remote_connect(kis_capture_handler_t *caph) {
     char *uuid = NULL;
 
     int cbret;
+    int resuming;
 
     static int first = 1;
 
@@ -1441,13 +2410,34 @@ int cf_handler_remote_connect(kis_capture_handler_t *caph) {
     while (1) {
         if (first) {
             first = 0;
+        } else if (caph->redirect_host != NULL) {
+            /* Follow a redirect straight away */
+            free(caph->remote_host);
+            caph->remote_host = caph->redirect_host;
+            caph->remote_port = caph->redirect_port;
+            caph->redirect_host = NULL;
+            caph->redirected = 1;
         } else {
+            /* Lost the server we were redirected to; the one we started with
+             * knows where the source belongs now */
+            if (caph->redirected && caph->home_host != NULL) {
+                free(caph->remote_host);
+                caph->remote_host = strdup(caph->home_host);
+                caph->remote_port = caph->home_port;
+                caph->redirected = 0;
+            }
+
             fprintf(stderr, "INFO - Waiting 5 seconds before attempting to reconnect to remote "
                     "server...\n");
             sleep(5);
         }
 
         /* Close the fd if it's open */
+        if (caph->tls_conn != NULL) {
+            kis_tls_conn_free(caph->tls_conn);
+            caph->tls_conn = NULL;
+        }
+
         if (caph->tcp_fd >= 0) {
             close(caph->tcp_fd);
             caph->tcp_fd = -1;
@@ -1459,36 +2449,48 @@ int cf_handler_remote_connect(kis_capture_handler_t *caph) {
         /* Reset spindown */
         caph->spindown = 0;
 
-        /* Clear the buffers */
+        /* Clear the buffers; the capture thread is still running when a 
+         * session is being resumed, and anything held for replay is sent again
+         * from the start once the server says what it already has */
         kis_simple_ringbuf_clear(caph->in_ringbuf);
+
+        pthread_mutex_lock(&(caph->out_ringbuf_lock));
         kis_simple_ringbuf_clear(caph->out_ringbuf);
+        caph->replay_send = caph->replay_head;
+        caph->resume_link = 0;
+        resuming = caph->resume_session != NULL;
+        caph->resume_pending = resuming;
+        pthread_mutex_unlock(&(caph->out_ringbuf_lock));
 
-        /* Perform a local probe on the source to see if it's valid */
-        msgstr[0] = 0;
+        /* Perform a local probe on the source to see if it's valid; a resumed
+         * source is still open */
+        if (!resuming) {
+            msgstr[0] = 0;
 
-        cpi = NULL;
-        cps = NULL;
+            cpi = NULL;
+            cps = NULL;
 
-        cbret = (*(caph->probe_cb))(caph, 0, caph->cli_sourcedef, msgstr, &uuid, 
-                NULL, &cpi, &cps);
+            cbret = (*(caph->probe_cb))(caph, 0, caph->cli_sourcedef, msgstr, &uuid, 
+                    NULL, &cpi, &cps);
 
-        if (cpi != NULL)
-            cf_params_interface_free(cpi);
+            if (cpi != NULL)
+                cf_params_interface_free(cpi);
 
-        if (cps != NULL)
-            cf_params_spectrum_free(cps);
+            if (cps != NULL)
+                cf_params_spectrum_free(cps);
 
-        if (cbret <= 0) {
-            fprintf(stderr, "FATAL - Could not probe local source prior to connecting to the "
-                    "remote host: %s\n", msgstr);
+            if (cbret <= 0) {
+                fprintf(stderr, "FATAL - Could not probe local source prior to connecting "
+                        "to the remote host: %s\n", msgstr);
 
-            if (uuid)
-                free(uuid);
+                if (uuid)
+                    free(uuid);
 
-            if (caph->remote_retry)
-                continue;
-            else
-                return -1;
+                if (caph->remote_retry)
+                    continue;
+                else
+                    return -1;
+            }
         }
 
         if ((connect_host = gethostbyname(caph->remote_host)) == NULL) {
@@ -1564,14 +2566,37 @@ int cf_handler_remote_connect(kis_capture_handler_t *caph) {
 
         caph->tcp_fd = client_fd;
 
+        /* Datagrams go to the same address */
+        pthread_mutex_lock(&(caph->out_ringbuf_lock));
+        memcpy(&(caph->remote_addr), &client_sock, sizeof(struct sockaddr_in));
+        pthread_mutex_unlock(&(caph->out_ringbuf_lock));
+
         fprintf(stderr, "INFO - Connected to '%s:%u'...\n",
                 caph->remote_host, caph->remote_port);
-    
-        /* Send the NEWSOURCE command to the Kismet server */
-        cf_send_newsource(caph, uuid);
 
-        if (uuid)
-            free(uuid);
+        if (caph->tls && cf_tls_handshake(caph) < 0) {
+            if (uuid)
+                free(uuid);
+
+            if (caph->remote_retry)
+                continue;
+            else
+                return -1;
+        }
+    
+        if (resuming) {
+            fprintf(stderr, "INFO - Resuming session with remote server...\n");
+            cf_send_resume(caph);
+        } else {
+            /* Send the NEWSOURCE command to the Kismet server */
+            cf_send_newsource(caph, uuid);
+
+            /* Keep the UUID in case the session is resumed */
+            if (caph->resume_uuid != NULL)
+                free(caph->resume_uuid);
+            caph->resume_uuid = uuid;
+            uuid = NULL;
+        }
 
         /* We connected, break out */
         break;
@@ -1580,122 +2605,1032 @@ int cf_handler_remote_connect(kis_capture_handler_t *caph) {
     return 1;
 }
 
-int cf_handler_loop(kis_capture_handler_t *caph) {
-    fd_set rset, wset;
-    int max_fd;
-    int read_fd, write_fd;
-    struct timeval tm;
-    int spindown;
-    int ret;
-    int rv = 0;
+/* Collect the kernel drops and send the drop totals in a DROPS KV if they have
+ * changed since they were last reported.  Called from the main loop, at most
+ * once a second; if the write buffer is full the report waits for the next
+ * check. */
+static void cf_report_drops(kis_capture_handler_t *caph) {
+    uint64_t kernel_drops, helper_drops;
+    simple_cap_proto_kv_t **kv_pairs;
+    int changed;
 
-    /* If we're going into daemon mode, fork-exec and drop out here */
-    if (caph->daemonize) {
-        int pid = fork();
+    caph->last_drops_check = time(NULL);
 
-        if (pid < 0) {
-            fprintf(stderr, "FATAL:  Unable to fork child process: %s\n",
-                    strerror(errno));
-            cf_handler_free(caph);
-            exit(1);
-        } else if (pid > 0) {
-            fprintf(stderr, "INFO: Entering daemon mode...\n");
-            cf_handler_free(caph);
-            exit(0);
+    if (caph->dropstats_cb != NULL) {
+        if ((*(caph->dropstats_cb))(caph, &kernel_drops) >= 0) {
+            pthread_mutex_lock(&(caph->out_ringbuf_lock));
+            caph->kernel_drops = kernel_drops;
+            pthread_mutex_unlock(&(caph->out_ringbuf_lock));
         }
     }
 
-    /* Loop for reconnecting */
-    while (1) {
-        /* Try to connect to a remote service if we need to, this will loop
-         * automatically and only return a failure when it's completely failed */
-        if (cf_handler_remote_connect(caph) < 0) {
-            return -1;
-        }
-
-        if (caph->tcp_fd >= 0) {
-            read_fd = caph->tcp_fd;
-            write_fd = caph->tcp_fd;
-        } else {
-            /* Set our descriptors as nonblocking */
-            fcntl(caph->in_fd, F_SETFL, fcntl(caph->in_fd, F_GETFL, 0) | O_NONBLOCK);
-            fcntl(caph->out_fd, F_SETFL, fcntl(caph->out_fd, F_GETFL, 0) | O_NONBLOCK);
+    pthread_mutex_lock(&(caph->out_ringbuf_lock));
+    kernel_drops = caph->kernel_drops;
+    helper_drops = caph->helper_drops;
+    changed = kernel_drops != caph->reported_kernel_drops ||
+        helper_drops != caph->reported_helper_drops;
+    pthread_mutex_unlock(&(caph->out_ringbuf_lock));
 
-            read_fd = caph->in_fd;
-            write_fd = caph->out_fd;
-        }
+    if (!changed)
+        return;
 
-        /* Basic select loop using ring buffers; we fill in from the read descriptor
-         * and try to make frames; similarly we populate the outbound descriptor from
-         * anything that comes in from our IO thread */
-        while (1) {
-            FD_ZERO(&rset);
-            FD_ZERO(&wset);
+    kv_pairs = (simple_cap_proto_kv_t **) malloc(sizeof(simple_cap_proto_kv_t *));
 
-            /* Check shutdown state or if we're spinning down */
-            pthread_mutex_lock(&(caph->handler_lock));
+    if (kv_pairs == NULL)
+        return;
 
-            /* Hard shutdown */
-            if (caph->shutdown) {
-                fprintf(stderr, "FATAL: Shutting down main select loop\n");
-                pthread_mutex_unlock(&(caph->handler_lock));
-                rv = -1;
-                break;
-            }
+    kv_pairs[0] = encode_kv_drops(kernel_drops, helper_drops);
 
-            if (caph->last_ping != 0 && time(NULL) - caph->last_ping > 5) {
-                fprintf(stderr, "FATAL - Capture source did not get PING from Kismet for "
-                        "over 5 seconds; shutting down\n");
-                pthread_mutex_unlock(&(caph->handler_lock));
-                rv = -1;
-                break;
-            }
+    if (kv_pairs[0] == NULL) {
+        free(kv_pairs);
+        return;
+    }
 
-            /* Copy spindown state outside of lock */
-            spindown = caph->spindown;
+    if (cf_stream_packet(caph, "DATA", kv_pairs, 1) > 0) {
+        pthread_mutex_lock(&(caph->out_ringbuf_lock));
+        caph->reported_kernel_drops = kernel_drops;
+        caph->reported_helper_drops = helper_drops;
+        pthread_mutex_unlock(&(caph->out_ringbuf_lock));
+    }
+}
 
-            pthread_mutex_unlock(&(caph->handler_lock));
+/* Send the hop timing in a HOPSTATS KV if there have been hops since it was
+ * last reported.  Called alongside the drop report. */
+static void cf_report_hopstats(kis_capture_handler_t *caph) {
+    uint64_t switches, total_usec, max_usec, late;
+    simple_cap_proto_kv_t **kv_pairs;
 
-            /* Only set read sets if we're not spinning down */
-            if (spindown == 0) {
-                /* Only set rset if we're not spinning down */
-                FD_SET(read_fd, &rset);
-                max_fd = read_fd;
-            }
+    pthread_mutex_lock(&(caph->handler_lock));
+    switches = caph->hop_switches;
+    total_usec = caph->hop_switch_total_usec;
+    max_usec = caph->hop_switch_max_usec;
+    late = caph->hop_late;
+    pthread_mutex_unlock(&(caph->handler_lock));
 
-            /* Inspect the write buffer - do we have data? */
-            pthread_mutex_lock(&(caph->out_ringbuf_lock));
+    if (switches == caph->reported_hop_switches)
+        return;
 
-            if (kis_simple_ringbuf_used(caph->out_ringbuf) != 0) {
-                /* fprintf(stderr, "debug - capf - writebuffer has %lu\n", kis_simple_ringbuf_used(caph->out_ringbuf)); */
-                FD_SET(write_fd, &wset);
-                if (max_fd < write_fd)
-                    max_fd = write_fd;
-            } else if (spindown != 0) {
-                /* fprintf(stderr, "DEBUG - caphandler finished spinning down\n"); */
-                pthread_mutex_unlock(&(caph->out_ringbuf_lock));
-                rv = 0;
-                break;
-            }
+    kv_pairs = (simple_cap_proto_kv_t **) malloc(sizeof(simple_cap_proto_kv_t *));
 
-            pthread_mutex_unlock(&(caph->out_ringbuf_lock));
+    if (kv_pairs == NULL)
+        return;
 
-            tm.tv_sec = 0;
-            tm.tv_usec = 500000;
+    kv_pairs[0] = encode_kv_hopstats(switches, total_usec, max_usec, late);
 
-            if ((ret = select(max_fd + 1, &rset, &wset, NULL, &tm)) < 0) {
-                if (errno != EINTR && errno != EAGAIN) {
-                    fprintf(stderr, 
-                            "FATAL:  Error during select(): %s\n", strerror(errno));
-                    rv = -1;
+    if (kv_pairs[0] == NULL) {
+        free(kv_pairs);
+        return;
+    }
+
+    if (cf_stream_packet(caph, "DATA", kv_pairs, 1) > 0)
+        caph->reported_hop_switches = switches;
+}
+
+/* Find a multiplexed channel by id, opening it if it's new.  Frames for a
+ * channel which has closed are dropped, so returns NULL for it. */
+static kis_capture_handler_t *cf_mux_get_channel(kis_capture_handler_t *caph, 
+        uint32_t in_id) {
+    kis_capture_handler_t *ch;
+
+    for (ch = caph->mux_channels; ch != NULL; ch = ch->mux_next) {
+        if (ch->mux_id == in_id) {
+            if (ch->mux_closed != 0)
+                return NULL;
+
+            return ch;
+        }
+    }
+
+    if ((ch = cf_handler_init(caph->capsource_type)) == NULL) {
+        fprintf(stderr, "FATAL: Could not allocate handler for multiplexed channel\n");
+        return NULL;
+    }
+
+    ch->mux_parent = caph;
+    ch->mux_id = in_id;
+    ch->remote_capable = caph->remote_capable;
+    ch->batch_data = caph->batch_data;
+
+    ch->mux_next = caph->mux_channels;
+    caph->mux_channels = ch;
+
+    /* A channel the driver couldn't set up answers with an error and closes; 
+     * it's only released if it was set up */
+    if ((*(caph->muxchannel_cb))(ch, 0) < 0) {
+        cf_send_error(ch, "unable to set up multiplexed capture channel");
+        cf_handler_spindown(ch);
+    } else {
+        ch->muxchannel_cb = caph->muxchannel_cb;
+    }
+
+    return ch;
+}
+
+/* Stop a multiplexed channel; it's freed once its threads are gone */
+static void cf_mux_close_channel(kis_capture_handler_t *ch) {
+    if (ch->mux_closed != 0)
+        return;
+
+    pthread_mutex_lock(&(ch->handler_lock));
+    pthread_mutex_lock(&(ch->out_ringbuf_lock));
+
+    if (ch->capture_running) {
+        pthread_cancel(ch->capturethread);
+        ch->capture_running = 0;
+    }
+
+    if (ch->hopping_running) {
+        pthread_cancel(ch->hopthread);
+        ch->hopping_running = 0;
+    }
+
+    ch->shutdown = 1;
+    ch->mux_closed = time(NULL);
+
+    pthread_mutex_unlock(&(ch->out_ringbuf_lock));
+    pthread_mutex_unlock(&(ch->handler_lock));
+}
+
+static void cf_mux_free_channel(kis_capture_handler_t *ch) {
+    if (ch->muxchannel_cb != NULL)
+        (*(ch->muxchannel_cb))(ch, 1);
+
+    cf_handler_free(ch);
+    free(ch);
+}
+
+/* Flush any batch which has waited long enough, and wrap everything a channel
+ * has queued into the write buffer of the helper.  Shortens *latency_usec to 
+ * when the pending batch needs to go.
+ *
+ * Returns 0 once the channel is finished and should be closed. */
+static int cf_mux_service_channel(kis_capture_handler_t *caph, 
+        kis_capture_handler_t *ch, long *latency_usec) {
+    uint8_t mux_hdr[SIMPLE_CAP_PROTO_MUX_HDR_SZ];
+    uint8_t *frame, *copy;
+    void *peek_buf;
+    size_t used, peek_sz;
+    uint32_t frame_sz;
+    int spindown, finished, moved = 0;
+    time_t last_ping;
+
+    pthread_mutex_lock(&(ch->handler_lock));
+    spindown = ch->spindown;
+    last_ping = ch->last_ping;
+    pthread_mutex_unlock(&(ch->handler_lock));
+
+    if (last_ping != 0 && time(NULL) - last_ping > 5) {
+        fprintf(stderr, "ERROR - Multiplexed channel %u did not get PING from Kismet "
+                "for over 5 seconds; closing it\n", ch->mux_id);
+        return 0;
+    }
+
+    /* Let Kismet know about any new drops and hop timing */
+    if (spindown == 0 && time(NULL) != ch->last_drops_check) {
+        cf_report_drops(ch);
+        cf_report_hopstats(ch);
+    }
+
+    pthread_mutex_lock(&(ch->out_ringbuf_lock));
+
+    if (ch->batch_packets != 0) {
+        struct timeval now;
+        long batch_age;
+
+        gettimeofday(&now, NULL);
+        batch_age = (now.tv_sec - ch->batch_start.tv_sec) * 1000000L +
+            (now.tv_usec - ch->batch_start.tv_usec);
+
+        if (spindown != 0 || batch_age >= CF_BATCH_LATENCY_USEC) {
+            if (cf_flush_data_batch(ch) < 0) {
+                pthread_mutex_unlock(&(ch->out_ringbuf_lock));
+                fprintf(stderr, "ERROR - Unable to write batched data for multiplexed "
+                        "channel %u\n", ch->mux_id);
+                return 0;
+            }
+        } else if (CF_BATCH_LATENCY_USEC - batch_age < *latency_usec) {
+            *latency_usec = CF_BATCH_LATENCY_USEC - batch_age;
+        }
+    }
+
+    /* Frames are always queued whole, so anything in the buffer is a complete
+     * frame or the start of one the write buffer couldn't take */
+    while ((used = kis_simple_ringbuf_used(ch->out_ringbuf)) >= sizeof(simple_cap_proto_t)) {
+        copy = NULL;
+
+        peek_sz = kis_simple_ringbuf_peek_zc(ch->out_ringbuf, &peek_buf, used);
+        frame = (uint8_t *) peek_buf;
+
+        if (peek_sz >= sizeof(simple_cap_proto_t)) {
+            frame_sz = ntohl(((simple_cap_proto_t *) frame)->packet_sz);
+        } else {
+            simple_cap_proto_t hdr;
+            kis_simple_ringbuf_peek(ch->out_ringbuf, &hdr, sizeof(simple_cap_proto_t));
+            frame_sz = ntohl(hdr.packet_sz);
+        }
+
+        if (used < frame_sz)
+            break;
+
+        if (kis_simple_ringbuf_available(caph->out_ringbuf) < 
+                SIMPLE_CAP_PROTO_MUX_HDR_SZ + frame_sz)
+            break;
+
+        /* A frame split across the end of an unmirrored buffer has to be copied */
+        if (peek_sz < frame_sz) {
+            if ((copy = (uint8_t *) malloc(frame_sz)) == NULL)
+                break;
+
+            kis_simple_ringbuf_peek(ch->out_ringbuf, copy, frame_sz);
+            frame = copy;
+        }
+
+        encode_simple_cap_proto_mux(mux_hdr, ch->mux_id, frame, frame_sz);
+
+        kis_simple_ringbuf_write(caph->out_ringbuf, mux_hdr, SIMPLE_CAP_PROTO_MUX_HDR_SZ);
+        kis_simple_ringbuf_write(caph->out_ringbuf, frame, frame_sz);
+
+        kis_simple_ringbuf_read(ch->out_ringbuf, NULL, frame_sz);
+
+        if (copy != NULL)
+            free(copy);
+
+        moved = 1;
+    }
+
+    finished = spindown != 0 && ch->batch_packets == 0 &&
+        kis_simple_ringbuf_used(ch->out_ringbuf) == 0;
+
+    pthread_mutex_unlock(&(ch->out_ringbuf_lock));
+
+    /* Signal to any waiting IO that the buffer has some headroom */
+    if (moved)
+        pthread_cond_signal(&(ch->out_ringbuf_flush_cond));
+
+    return !finished;
+}
+
+/* Unwrap a MUX frame from the server into its channel, or close a channel
+ * 
+ * Returns:
+ * -1   Error, the helper can't continue
+ *  0   No complete frame in the buffer
+ *  1   Frame handled
+ */
+static int cf_mux_handle_rx(kis_capture_handler_t *caph) {
+    uint8_t hdr_buf[sizeof(simple_cap_proto_t)];
+    simple_cap_proto_frame_t *frame;
+    kis_capture_handler_t *ch;
+    uint8_t *frame_buf, *wrapped;
+    size_t rb_available, wrapped_sz;
+    uint32_t packet_sz, muxid;
+
+    rb_available = kis_simple_ringbuf_used(caph->in_ringbuf);
+
+    if (rb_available < sizeof(simple_cap_proto_t))
+        return 0;
+
+    if (kis_simple_ringbuf_peek(caph->in_ringbuf, hdr_buf, 
+                sizeof(simple_cap_proto_t)) != sizeof(simple_cap_proto_t))
+        return 0;
+
+    frame = (simple_cap_proto_frame_t *) hdr_buf;
+
+    if (ntohl(frame->header.signature) != KIS_CAP_SIMPLE_PROTO_SIG) {
+        fprintf(stderr, "FATAL: Invalid frame header received\n");
+        return -1;
+    }
+
+    if (validate_simple_cap_proto_header(&(frame->header)) < 0) {
+        fprintf(stderr, "FATAL: Invalid checksum on frame header\n");
+        return -1;
+    }
+
+    packet_sz = ntohl(frame->header.packet_sz);
+
+    if (packet_sz > caph->in_ringbuf->buffer_sz) {
+        fprintf(stderr, "FATAL: Frame too large for the read buffer\n");
+        return -1;
+    }
+
+    if (rb_available < packet_sz)
+        return 0;
+
+    if ((frame_buf = (uint8_t *) malloc(packet_sz)) == NULL) {
+        fprintf(stderr, "FATAL:  Could not allocate read buffer\n");
+        return -1;
+    }
+
+    kis_simple_ringbuf_peek(caph->in_ringbuf, frame_buf, packet_sz);
+    kis_simple_ringbuf_read(caph->in_ringbuf, NULL, packet_sz);
+
+    frame = (simple_cap_proto_frame_t *) frame_buf;
+
+    if (validate_simple_cap_proto(&(frame->header)) < 0) {
+        fprintf(stderr, "FATAL:  Invalid control frame\n");
+        free(frame_buf);
+        return -1;
+    }
+
+    if (strncasecmp(frame->header.type, "MUX", 16) != 0 &&
+            strncasecmp(frame->header.type, "MUXCLOSE", 16) != 0) {
+        fprintf(stderr, "DEBUG - Ignoring %.16s frame outside of a multiplexed "
+                "channel\n", frame->header.type);
+        free(frame_buf);
+        return 1;
+    }
+
+    if (decode_simple_cap_proto_mux(frame, &muxid, &wrapped, &wrapped_sz) < 0) {
+        fprintf(stderr, "FATAL:  Invalid multiplexed frame\n");
+        free(frame_buf);
+        return -1;
+    }
+
+    if (strncasecmp(frame->header.type, "MUXCLOSE", 16) == 0) {
+        for (ch = caph->mux_channels; ch != NULL; ch = ch->mux_next) {
+            if (ch->mux_id == muxid) {
+                cf_mux_close_channel(ch);
+                break;
+            }
+        }
+    } else if (wrapped != NULL && (ch = cf_mux_get_channel(caph, muxid)) != NULL) {
+        if (kis_simple_ringbuf_write(ch->in_ringbuf, wrapped, wrapped_sz) != wrapped_sz) {
+            fprintf(stderr, "ERROR - Insufficient buffer space for multiplexed "
+                    "channel %u\n", muxid);
+            cf_handler_spindown(ch);
+        } else if (cf_handle_rx_data(ch) < 0) {
+            /* Enter spindown if processing an incoming packet failed */
+            cf_handler_spindown(ch);
+        }
+    }
+
+    free(frame_buf);
+
+    return 1;
+}
+
+/* Main loop of a multiplexed helper:  one select loop for the IPC pipe and the
+ * buffers of every channel */
+static int cf_mux_loop(kis_capture_handler_t *caph) {
+    fd_set rset, wset;
+    int max_fd;
+    struct timeval tm;
+    long latency_usec;
+    kis_capture_handler_t *ch, **chp;
+    int ret, rv = 0;
+
+    /* Every channel shares the pipe, so give it more room than one source */
+    kis_simple_ringbuf_free(caph->in_ringbuf);
+    kis_simple_ringbuf_free(caph->out_ringbuf);
+
+    caph->in_ringbuf = kis_simple_ringbuf_create(1024 * 64);
+    caph->out_ringbuf = kis_simple_ringbuf_create(1024 * 1024);
+
+    if (caph->in_ringbuf == NULL || caph->out_ringbuf == NULL) {
+        fprintf(stderr, "FATAL: Could not allocate multiplexed helper buffers\n");
+        return -1;
+    }
+
+    fcntl(caph->in_fd, F_SETFL, fcntl(caph->in_fd, F_GETFL, 0) | O_NONBLOCK);
+    fcntl(caph->out_fd, F_SETFL, fcntl(caph->out_fd, F_GETFL, 0) | O_NONBLOCK);
+
+    while (1) {
+        FD_ZERO(&rset);
+        FD_ZERO(&wset);
+
+        pthread_mutex_lock(&(caph->handler_lock));
+
+        if (caph->shutdown) {
+            fprintf(stderr, "FATAL: Shutting down main select loop\n");
+            pthread_mutex_unlock(&(caph->handler_lock));
+            rv = -1;
+            break;
+        }
+
+        pthread_mutex_unlock(&(caph->handler_lock));
+
+        latency_usec = 500000;
+
+        /* Move along the data of every channel, and free the ones which have
+         * been closed long enough for their threads to be gone */
+        chp = &(caph->mux_channels);
+        while ((ch = *chp) != NULL) {
+            if (ch->mux_closed != 0) {
+                if (time(NULL) - ch->mux_closed >= CF_MUX_FREE_DELAY) {
+                    *chp = ch->mux_next;
+                    cf_mux_free_channel(ch);
+                    continue;
+                }
+            } else if (cf_mux_service_channel(caph, ch, &latency_usec) == 0) {
+                cf_mux_close_channel(ch);
+            }
+
+            chp = &(ch->mux_next);
+        }
+
+        FD_SET(caph->in_fd, &rset);
+        max_fd = caph->in_fd;
+
+        if (kis_simple_ringbuf_used(caph->out_ringbuf) != 0) {
+            FD_SET(caph->out_fd, &wset);
+            if (max_fd < caph->out_fd)
+                max_fd = caph->out_fd;
+        }
+
+        tm.tv_sec = 0;
+        tm.tv_usec = latency_usec;
+
+        if ((ret = select(max_fd + 1, &rset, &wset, NULL, &tm)) < 0) {
+            if (errno != EINTR && errno != EAGAIN) {
+                fprintf(stderr, 
+                        "FATAL:  Error during select(): %s\n", strerror(errno));
+                rv = -1;
+                break;
+            }
+        }
+
+        if (ret <= 0)
+            continue;
+
+        if (FD_ISSET(caph->in_fd, &rset)) {
+            while (kis_simple_ringbuf_available(caph->in_ringbuf)) {
+                ssize_t amt_read;
+                uint8_t rbuf[1024];
+
+                if ((amt_read = read(caph->in_fd, rbuf, 1024)) <= 0) {
+                    /* The pipe is non-blocking, so errno may be left over from
+                     * draining it earlier */
+                    if (amt_read == 0 || (errno != EINTR && errno != EAGAIN)) {
+                        if (amt_read == 0) {
+                            fprintf(stderr, "FATAL: Remote side closed read pipe\n");
+                        } else {
+                            fprintf(stderr,
+                                    "FATAL:  Error during read(): %s\n", strerror(errno));
+                        }
+                        rv = -1;
+                        goto mux_loop_fail;
+                    }
+
+                    break;
+                }
+
+                if (kis_simple_ringbuf_write(caph->in_ringbuf, rbuf, amt_read) != 
+                        (size_t) amt_read) {
+                    fprintf(stderr,
+                            "FATAL:  Error during read(): insufficient buffer space\n");
+                    rv = -1;
+                    goto mux_loop_fail;
+                }
+
+                while ((ret = cf_mux_handle_rx(caph)) > 0)
+                    ;
+
+                if (ret < 0) {
+                    rv = -1;
+                    goto mux_loop_fail;
+                }
+            }
+        }
+
+        if (FD_ISSET(caph->out_fd, &wset)) {
+            ssize_t written_sz;
+            size_t peek_sz;
+            void *peek_buf;
+
+            peek_sz = kis_simple_ringbuf_peek_zc(caph->out_ringbuf, &peek_buf,
+                    kis_simple_ringbuf_used(caph->out_ringbuf));
+
+            if (peek_sz == 0)
+                continue;
+
+            if ((written_sz = write(caph->out_fd, peek_buf, peek_sz)) < 0) {
+                if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
+                    fprintf(stderr,
+                            "FATAL:  Error during write(): %s\n", strerror(errno));
+                    rv = -1;
                     break;
                 }
             }
 
+            if (written_sz > 0)
+                kis_simple_ringbuf_read(caph->out_ringbuf, NULL, (size_t) written_sz);
+        }
+    }
+
+mux_loop_fail:
+    for (ch = caph->mux_channels; ch != NULL; ch = ch->mux_next)
+        cf_mux_close_channel(ch);
+
+    /* Give the cancelled threads time to go, so every interface can be released
+     * the same way a closed channel is */
+    if (caph->mux_channels != NULL)
+        sleep(CF_MUX_FREE_DELAY);
+
+    while ((ch = caph->mux_channels) != NULL) {
+        caph->mux_channels = ch->mux_next;
+        cf_mux_free_channel(ch);
+    }
+
+    return rv;
+}
+
+/* What the main loop waits for on a descriptor */
+#define CF_LOOP_READ    1
+#define CF_LOOP_WRITE   2
+
+typedef struct {
+    int fd;
+    unsigned int want;
+    unsigned int ready;
+} cf_loop_fd_t;
+
+static int cf_loop_wake_open(kis_capture_handler_t *caph) {
+    if (caph->loop_wake_fd[0] >= 0)
+        return 0;
+
+#ifdef SYS_LINUX
+    caph->loop_wake_fd[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    caph->loop_wake_fd[1] = caph->loop_wake_fd[0];
+
+    if (caph->loop_wake_fd[0] < 0)
+        return -1;
+#else
+    if (pipe(caph->loop_wake_fd) < 0) {
+        caph->loop_wake_fd[0] = -1;
+        caph->loop_wake_fd[1] = -1;
+        return -1;
+    }
+
+    fcntl(caph->loop_wake_fd[0], F_SETFL, 
+            fcntl(caph->loop_wake_fd[0], F_GETFL, 0) | O_NONBLOCK);
+    fcntl(caph->loop_wake_fd[1], F_SETFL, 
+            fcntl(caph->loop_wake_fd[1], F_GETFL, 0) | O_NONBLOCK);
+    fcntl(caph->loop_wake_fd[0], F_SETFD, FD_CLOEXEC);
+    fcntl(caph->loop_wake_fd[1], F_SETFD, FD_CLOEXEC);
+#endif
+
+    return 0;
+}
+
+/* Clear the wakeup after it fired */
+static void cf_loop_wake_ack(kis_capture_handler_t *caph) {
+    uint64_t v;
+
+    while (read(caph->loop_wake_fd[0], &v, sizeof(uint64_t)) > 0)
+        ;
+}
+
+/* Wake the main loop if it won't look at the write buffer and pending batch
+ * soon enough on its own.  Called by whoever queued data, with 
+ * out_ringbuf_lock held; a loop which is awake looks at both before it waits
+ * again, so it is never woken. */
+static void cf_loop_notify(kis_capture_handler_t *caph) {
+    uint64_t now, deadline;
+    uint64_t one = 1;
+    size_t used;
+
+    if (caph->loop_sleep_usec == 0)
+        return;
+
+    now = cf_monotonic_usec();
+
+    /* The server reads a shared ring itself */
+    if (caph->out_ringbuf->shm != NULL)
+        used = 0;
+    else
+        used = kis_simple_ringbuf_used(caph->out_ringbuf);
+
+    if (used > kis_simple_ringbuf_available(caph->out_ringbuf)) {
+        /* Over half full */
+        deadline = now;
+    } else if (used != 0 || (caph->resume_link && caph->replay_send != NULL)) {
+        deadline = now + caph->wake_latency_usec;
+    } else if (caph->batch_packets != 0) {
+        struct timeval tv;
+        long batch_age;
+
+        gettimeofday(&tv, NULL);
+        batch_age = (tv.tv_sec - caph->batch_start.tv_sec) * 1000000L +
+            (tv.tv_usec - caph->batch_start.tv_usec);
+
+        if (batch_age >= CF_BATCH_LATENCY_USEC)
+            deadline = now;
+        else
+            deadline = now + (CF_BATCH_LATENCY_USEC - batch_age);
+    } else {
+        return;
+    }
+
+    if (caph->loop_sleep_usec <= deadline)
+        return;
+
+    caph->loop_sleep_usec = 0;
+
+    if (write(caph->loop_wake_fd[1], &one, sizeof(uint64_t)) < 0) {
+        /* A full pipe is already a wakeup */
+    }
+}
+
+/* Forget the descriptors the loop waited on, when the connection changes */
+static void cf_loop_reset(kis_capture_handler_t *caph) {
+    if (caph->loop_epoll_fd >= 0)
+        close(caph->loop_epoll_fd);
+
+    caph->loop_epoll_fd = -1;
+    caph->loop_poll_len = 0;
+}
+
+#ifdef SYS_LINUX
+/* Bring the epoll set in line with what the loop waits for, changing only the
+ * descriptors which differ from the last wait */
+static int cf_loop_update_epoll(kis_capture_handler_t *caph, cf_loop_fd_t *fds,
+        unsigned int nfds) {
+    int want_fd[CF_LOOP_MAX_FDS];
+    uint32_t want_events[CF_LOOP_MAX_FDS];
+    unsigned int nwant = 0;
+    unsigned int i, j;
+    struct epoll_event ev;
+
+    if (caph->loop_epoll_fd < 0) {
+        if ((caph->loop_epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+            return -1;
+
+        caph->loop_poll_len = 0;
+    }
+
+    /* A descriptor can be waited on for reading and writing at once */
+    for (i = 0; i < nfds; i++) {
+        for (j = 0; j < nwant; j++) {
+            if (want_fd[j] == fds[i].fd)
+                break;
+        }
+
+        if (j == nwant) {
+            want_fd[nwant] = fds[i].fd;
+            want_events[nwant] = 0;
+            nwant++;
+        }
+
+        if (fds[i].want & CF_LOOP_READ)
+            want_events[j] |= EPOLLIN;
+        if (fds[i].want & CF_LOOP_WRITE)
+            want_events[j] |= EPOLLOUT;
+    }
+
+    /* Drop what we no longer wait on */
+    for (i = 0; i < caph->loop_poll_len; ) {
+        for (j = 0; j < nwant; j++) {
+            if (want_fd[j] == caph->loop_poll_fd[i])
+                break;
+        }
+
+        if (j < nwant) {
+            i++;
+            continue;
+        }
+
+        epoll_ctl(caph->loop_epoll_fd, EPOLL_CTL_DEL, caph->loop_poll_fd[i], NULL);
+
+        caph->loop_poll_len--;
+        caph->loop_poll_fd[i] = caph->loop_poll_fd[caph->loop_poll_len];
+        caph->loop_poll_events[i] = caph->loop_poll_events[caph->loop_poll_len];
+    }
+
+    for (j = 0; j < nwant; j++) {
+        int op = EPOLL_CTL_ADD;
+
+        for (i = 0; i < caph->loop_poll_len; i++) {
+            if (caph->loop_poll_fd[i] == want_fd[j])
+                break;
+        }
+
+        if (i < caph->loop_poll_len) {
+            if (caph->loop_poll_events[i] == want_events[j])
+                continue;
+
+            op = EPOLL_CTL_MOD;
+        }
+
+        memset(&ev, 0, sizeof(struct epoll_event));
+        ev.events = want_events[j];
+        ev.data.fd = want_fd[j];
+
+        if (epoll_ctl(caph->loop_epoll_fd, op, want_fd[j], &ev) < 0) {
+            /* A descriptor which was closed and reused behind our back */
+            if (op == EPOLL_CTL_MOD && errno == ENOENT)
+                op = EPOLL_CTL_ADD;
+            else if (op == EPOLL_CTL_ADD && errno == EEXIST)
+                op = EPOLL_CTL_MOD;
+            else
+                return -1;
+
+            if (epoll_ctl(caph->loop_epoll_fd, op, want_fd[j], &ev) < 0)
+                return -1;
+        }
+
+        if (i == caph->loop_poll_len)
+            caph->loop_poll_len++;
+
+        caph->loop_poll_fd[i] = want_fd[j];
+        caph->loop_poll_events[i] = want_events[j];
+    }
+
+    return 0;
+}
+#endif
+
+/* Wait until a descriptor is ready for what the loop wants of it, or the
+ * timeout passes, and mark what is ready.
+ *
+ * Returns:
+ * -1   An error occurred
+ *  0   Timed out or interrupted
+ * >0   Something is ready
+ */
+static int cf_loop_wait(kis_capture_handler_t *caph, cf_loop_fd_t *fds, 
+        unsigned int nfds, long timeout_usec) {
+    unsigned int i;
+    int ret;
+
+    for (i = 0; i < nfds; i++)
+        fds[i].ready = 0;
+
+#ifdef SYS_LINUX
+    struct epoll_event events[CF_LOOP_MAX_FDS];
+    int e;
+
+    if (cf_loop_update_epoll(caph, fds, nfds) < 0)
+        return -1;
+
+    /* Round up, so a wait for less than a millisecond doesn't spin */
+    if ((ret = epoll_wait(caph->loop_epoll_fd, events, CF_LOOP_MAX_FDS, 
+                    (int) ((timeout_usec + 999) / 1000))) < 0) {
+        if (errno == EINTR)
+            return 0;
+        return -1;
+    }
+
+    for (e = 0; e < ret; e++) {
+        for (i = 0; i < nfds; i++) {
+            if (fds[i].fd != events[e].data.fd)
+                continue;
+
+            /* Hangups and errors are found by the read or write */
+            if (events[e].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                fds[i].ready |= fds[i].want & CF_LOOP_READ;
+            if (events[e].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+                fds[i].ready |= fds[i].want & CF_LOOP_WRITE;
+        }
+    }
+#else
+    fd_set rset, wset;
+    int max_fd = 0;
+    struct timeval tm;
+
+    FD_ZERO(&rset);
+    FD_ZERO(&wset);
+
+    for (i = 0; i < nfds; i++) {
+        if (fds[i].want & CF_LOOP_READ)
+            FD_SET(fds[i].fd, &rset);
+        if (fds[i].want & CF_LOOP_WRITE)
+            FD_SET(fds[i].fd, &wset);
+        if (max_fd < fds[i].fd)
+            max_fd = fds[i].fd;
+    }
+
+    tm.tv_sec = timeout_usec / 1000000L;
+    tm.tv_usec = timeout_usec % 1000000L;
+
+    if ((ret = select(max_fd + 1, &rset, &wset, NULL, &tm)) < 0) {
+        if (errno == EINTR || errno == EAGAIN)
+            return 0;
+        return -1;
+    }
+
+    for (i = 0; i < nfds; i++) {
+        if ((fds[i].want & CF_LOOP_READ) && FD_ISSET(fds[i].fd, &rset))
+            fds[i].ready |= CF_LOOP_READ;
+        if ((fds[i].want & CF_LOOP_WRITE) && FD_ISSET(fds[i].fd, &wset))
+            fds[i].ready |= CF_LOOP_WRITE;
+    }
+#endif
+
+    return ret;
+}
+
+int cf_handler_loop(kis_capture_handler_t *caph) {
+    cf_loop_fd_t loop_fds[CF_LOOP_MAX_FDS];
+    unsigned int nfds;
+    int read_idx, write_idx, wake_idx, drain_idx;
+    int read_fd, write_fd;
+    long timeout_usec;
+    int spindown;
+    int ret;
+    int rv = 0;
+    int link_lost;
+    kis_shm_ring_t *shm_ring;
+    size_t shm_used;
+    int shm_armed, shm_raced;
+
+    /* A multiplexed helper runs its own loop for all of its channels */
+    if (caph->multiplex)
+        return cf_mux_loop(caph);
+
+    /* If we're going into daemon mode, fork-exec and drop out here */
+    if (caph->daemonize) {
+        int pid = fork();
+
+        if (pid < 0) {
+            fprintf(stderr, "FATAL:  Unable to fork child process: %s\n",
+                    strerror(errno));
+            cf_handler_free(caph);
+            exit(1);
+        } else if (pid > 0) {
+            fprintf(stderr, "INFO: Entering daemon mode...\n");
+            cf_handler_free(caph);
+            exit(0);
+        }
+    }
+
+    /* The capture thread rings this when it queues data for us */
+    if (cf_loop_wake_open(caph) < 0) {
+        fprintf(stderr, "FATAL:  Unable to create main loop wakeup: %s\n",
+                strerror(errno));
+        return -1;
+    }
+
+    /* Loop for reconnecting */
+    while (1) {
+        /* Try to connect to a remote service if we need to, this will loop
+         * automatically and only return a failure when it's completely failed */
+        if (cf_handler_remote_connect(caph) < 0) {
+            return -1;
+        }
+
+        link_lost = 0;
+
+        cf_loop_reset(caph);
+
+        if (caph->tcp_fd >= 0) {
+            read_fd = caph->tcp_fd;
+            write_fd = caph->tcp_fd;
+        } else {
+            /* Set our descriptors as nonblocking */
+            fcntl(caph->in_fd, F_SETFL, fcntl(caph->in_fd, F_GETFL, 0) | O_NONBLOCK);
+            fcntl(caph->out_fd, F_SETFL, fcntl(caph->out_fd, F_GETFL, 0) | O_NONBLOCK);
+
+            read_fd = caph->in_fd;
+            write_fd = caph->out_fd;
+        }
+
+        /* Readiness loop using ring buffers; we fill in from the read descriptor
+         * and try to make frames; similarly we populate the outbound descriptor from
+         * anything that comes in from our IO thread, which wakes us when it queues
+         * data we wouldn't otherwise get to in time */
+        while (1) {
+            /* Check shutdown state or if we're spinning down */
+            pthread_mutex_lock(&(caph->handler_lock));
+
+            /* Hard shutdown */
+            if (caph->shutdown) {
+                fprintf(stderr, "FATAL: Shutting down main select loop\n");
+                pthread_mutex_unlock(&(caph->handler_lock));
+                rv = -1;
+                break;
+            }
+
+            if (caph->last_ping != 0 && time(NULL) - caph->last_ping > 5) {
+                fprintf(stderr, "FATAL - Capture source did not get PING from Kismet for "
+                        "over 5 seconds; shutting down\n");
+                pthread_mutex_unlock(&(caph->handler_lock));
+                rv = -1;
+                link_lost = 1;
+                break;
+            }
+
+            /* Copy spindown state outside of lock */
+            spindown = caph->spindown;
+
+            pthread_mutex_unlock(&(caph->handler_lock));
+
+            /* Let Kismet know about any new drops and hop timing */
+            if (spindown == 0 && time(NULL) != caph->last_drops_check) {
+                cf_report_drops(caph);
+                cf_report_hopstats(caph);
+            }
+
+            nfds = 0;
+            read_idx = write_idx = drain_idx = -1;
+
+            /* Only wait to read if we're not spinning down */
+            if (spindown == 0) {
+                read_idx = nfds;
+                loop_fds[nfds].fd = read_fd;
+                loop_fds[nfds++].want = CF_LOOP_READ;
+            }
+
+            wake_idx = nfds;
+            loop_fds[nfds].fd = caph->loop_wake_fd[0];
+            loop_fds[nfds++].want = CF_LOOP_READ;
+
+            /* Inspect the write buffer - do we have data? */
+            pthread_mutex_lock(&(caph->out_ringbuf_lock));
+
+            /* Push out a batch of packets which has waited long enough, or
+             * everything if we're spinning down */
+            if (caph->batch_packets != 0) {
+                struct timeval now;
+                long batch_age;
+
+                gettimeofday(&now, NULL);
+                batch_age = (now.tv_sec - caph->batch_start.tv_sec) * 1000000L +
+                    (now.tv_usec - caph->batch_start.tv_usec);
+
+                if (spindown != 0 || batch_age >= CF_BATCH_LATENCY_USEC) {
+                    if (cf_flush_data_batch(caph) < 0) {
+                        pthread_mutex_unlock(&(caph->out_ringbuf_lock));
+                        fprintf(stderr, "FATAL: Unable to write batched data\n");
+                        rv = -1;
+                        break;
+                    }
+                }
+            }
+
+            /* Move along anything held for replay */
+            cf_pump_replay(caph);
+
+            shm_ring = caph->out_ringbuf->shm;
+            shm_armed = 0;
+            shm_raced = 0;
+
+            if (kis_simple_ringbuf_used(caph->out_ringbuf) != 0 && shm_ring != NULL) {
+                /* The server reads a shared ring itself; have it ring the drain
+                 * eventfd when it makes room, and look again in case it already
+                 * did before it saw the flag */
+                shm_used = kis_simple_ringbuf_used(caph->out_ringbuf);
+                kis_shm_ring_writer_wait(shm_ring);
+                shm_raced = kis_simple_ringbuf_used(caph->out_ringbuf) != shm_used;
+                shm_armed = 1;
+
+                drain_idx = nfds;
+                loop_fds[nfds].fd = shm_ring->drain_fd;
+                loop_fds[nfds++].want = CF_LOOP_READ;
+            } else if (kis_simple_ringbuf_used(caph->out_ringbuf) != 0) {
+                /* fprintf(stderr, "debug - capf - writebuffer has %lu\n", kis_simple_ringbuf_used(caph->out_ringbuf)); */
+                write_idx = nfds;
+                loop_fds[nfds].fd = write_fd;
+                loop_fds[nfds++].want = CF_LOOP_WRITE;
+            } else if (spindown != 0 && caph->batch_packets == 0 &&
+                    (caph->replay_send == NULL || !caph->resume_link)) {
+                /* fprintf(stderr, "DEBUG - caphandler finished spinning down\n"); */
+                pthread_mutex_unlock(&(caph->out_ringbuf_lock));
+                rv = 0;
+                break;
+            }
+
+            timeout_usec = CF_LOOP_IDLE_USEC;
+
+            /* Wake up in time to send any pending batch */
+            if (caph->batch_packets != 0)
+                timeout_usec = CF_BATCH_LATENCY_USEC;
+
+            if (shm_raced)
+                timeout_usec = 0;
+
+            /* Anything queued from here on is up to the capture thread to 
+             * wake us for */
+            caph->loop_sleep_usec = cf_monotonic_usec() + timeout_usec;
+
+            pthread_mutex_unlock(&(caph->out_ringbuf_lock));
+
+            ret = cf_loop_wait(caph, loop_fds, nfds, timeout_usec);
+
+            pthread_mutex_lock(&(caph->out_ringbuf_lock));
+            caph->loop_sleep_usec = 0;
+            pthread_mutex_unlock(&(caph->out_ringbuf_lock));
+
+            if (ret < 0) {
+                fprintf(stderr, 
+                        "FATAL:  Error waiting for IO: %s\n", strerror(errno));
+                rv = -1;
+                break;
+            }
+
+            if (loop_fds[wake_idx].ready)
+                cf_loop_wake_ack(caph);
+
+            /* The server made room in the shared ring; let any waiting IO know
+             * there's headroom */
+            if (shm_armed && (shm_raced || loop_fds[drain_idx].ready)) {
+                kis_shm_ring_ack(shm_ring->drain_fd);
+                pthread_cond_signal(&(caph->out_ringbuf_flush_cond));
+            }
+
             if (ret == 0)
                 continue;
 
-            if (FD_ISSET(read_fd, &rset)) {
+            if (read_idx >= 0 && loop_fds[read_idx].ready) {
                 while (kis_simple_ringbuf_available(caph->in_ringbuf)) {
                     /* We use a fixed-length read buffer for simplicity, and we shouldn't
                      * ever have too many incoming packets queued because the datasource
@@ -1707,16 +3642,26 @@ int cf_handler_loop(kis_capture_handler_t *caph) {
                     /* We deliberately read as much as we need and try to put it in the 
                      * buffer, if the buffer fills up something has gone wrong anyhow */
 
-                    if ((amt_read = read(read_fd, rbuf, 1024)) <= 0) {
-                        if (errno != EINTR && errno != EAGAIN) {
+                    if (caph->tls_conn != NULL)
+                        amt_read = kis_tls_read(caph->tls_conn, rbuf, 1024);
+                    else
+                        amt_read = read(read_fd, rbuf, 1024);
+
+                    if (amt_read <= 0) {
+                        if (amt_read == 0 || (errno != EINTR && errno != EAGAIN)) {
                             /* Bail entirely */
                             if (amt_read == 0) {
                                 fprintf(stderr, "FATAL: Remote side closed read pipe\n");
+                            } else if (caph->tls_conn != NULL && errno == EIO) {
+                                fprintf(stderr,
+                                        "FATAL:  Error during read(): %s\n", 
+                                        kis_tls_error(caph->tls_conn));
                             } else {
                                 fprintf(stderr,
                                         "FATAL:  Error during read(): %s\n", strerror(errno));
                             }
                             rv = -1;
+                            link_lost = 1;
                             goto cap_loop_fail;
                         } else {
                             /* Drop out of read/process loop */
@@ -1744,58 +3689,52 @@ int cf_handler_loop(kis_capture_handler_t *caph) {
                 }
             }
 
-            if (FD_ISSET(write_fd, &wset)) {
-                /* We can write data - lock the ring buffer mutex and write out
-                 * whatever we can; we peek the ringbuffer and then flag off what
-                 * we've successfully written out */
+            if (write_idx >= 0 && loop_fds[write_idx].ready) {
+                /* We can write data - write out whatever we can straight from
+                 * the ringbuffer and then flag off what we've successfully
+                 * written out.  We're the only reader of the out buffer, so
+                 * this doesn't need the lock, and the capture thread can keep
+                 * queueing data while we block in write() */
                 ssize_t written_sz;
                 size_t peek_sz;
-                size_t peeked_sz;
-                uint8_t *peek_buf;
-
-                pthread_mutex_lock(&(caph->out_ringbuf_lock));
+                void *peek_buf;
 
-                peek_sz = kis_simple_ringbuf_used(caph->out_ringbuf);
+                peek_sz = kis_simple_ringbuf_peek_zc(caph->out_ringbuf, &peek_buf,
+                        kis_simple_ringbuf_used(caph->out_ringbuf));
 
                 /* Don't know how we'd get here... */
-                if (peek_sz == 0) {
-                    pthread_mutex_unlock(&(caph->out_ringbuf_lock));
+                if (peek_sz == 0)
                     continue;
-                }
 
-                peek_buf = (uint8_t *) malloc(peek_sz);
+                /* fprintf(stderr, "debug - peeked %lu\n", peek_sz); */
 
-                if (peek_buf == NULL) {
-                    pthread_mutex_unlock(&(caph->out_ringbuf_lock));
-                    fprintf(stderr,
-                            "FATAL:  Error during write(): could not allocate write "
-                            "buffer space\n");
-                    rv = -1;
-                    break;
-                }
-
-                peeked_sz = kis_simple_ringbuf_peek(caph->out_ringbuf, peek_buf, peek_sz);
+                if (caph->tls_conn != NULL)
+                    written_sz = kis_tls_write(caph->tls_conn, peek_buf, peek_sz);
+                else
+                    written_sz = write(write_fd, peek_buf, peek_sz);
 
-                /* fprintf(stderr, "debug - peeked %lu\n", peeked_sz); */
+                if (written_sz <= 0 && caph->tls_conn != NULL) {
+                    /* A TLS write can see the connection close */
+                    if (written_sz == 0)
+                        errno = EPIPE;
+                    written_sz = -1;
+                }
 
-                if ((written_sz = write(write_fd, peek_buf, peeked_sz)) < 0) {
+                if (written_sz < 0) {
                     if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
-                        pthread_mutex_unlock(&(caph->out_ringbuf_lock));
                         fprintf(stderr,
-                                "FATAL:  Error during write(): %s\n", strerror(errno));
-                        free(peek_buf);
+                                "FATAL:  Error during write(): %s\n", 
+                                caph->tls_conn != NULL && errno == EIO ?
+                                kis_tls_error(caph->tls_conn) : strerror(errno));
                         rv = -1;
+                        link_lost = 1;
                         break;
                     }
                 }
 
-                free(peek_buf);
-
                 /* Flag it as consumed */
-                kis_simple_ringbuf_read(caph->out_ringbuf, NULL, (size_t) written_sz);
-
-                /* Unlock */
-                pthread_mutex_unlock(&(caph->out_ringbuf_lock));
+                if (written_sz > 0)
+                    kis_simple_ringbuf_read(caph->out_ringbuf, NULL, (size_t) written_sz);
 
                 /* Signal to any waiting IO that the buffer has some
                  * headroom */
@@ -1805,15 +3744,37 @@ int cf_handler_loop(kis_capture_handler_t *caph) {
 
         /* Fall out of select loop */
 cap_loop_fail:
-        /* Kill the capture thread */
         pthread_mutex_lock(&(caph->out_ringbuf_lock));
+
+        /* Keep capturing into the replay buffer if we lost the link to a 
+         * session, and resume it when we reconnect */
+        if (link_lost && caph->remote_retry && caph->resume_session != NULL &&
+                !caph->resume_pending) {
+            caph->resume_link = 0;
+            pthread_mutex_unlock(&(caph->out_ringbuf_lock));
+
+            fprintf(stderr, "INFO - Lost connection to remote server, buffering up to "
+                    "%lu bytes of data until the session is resumed\n",
+                    (unsigned long) caph->resume_buffer_max);
+            continue;
+        }
+
+        /* The session can't be resumed if the server hung up on the resume */
+        if (caph->resume_pending)
+            fprintf(stderr, "INFO - Could not resume session with remote server, "
+                    "reopening source\n");
+
+        cf_end_session(caph);
+        cf_close_datagram(caph);
+
+        /* Kill the capture thread */
         if (caph->capture_running) {
             pthread_cancel(caph->capturethread);
             caph->capture_running = 0;
         }
         pthread_mutex_unlock(&(caph->out_ringbuf_lock));
 
-        if (caph->remote_retry)
+        if (caph->remote_retry || caph->redirect_host != NULL)
             continue;
         else
             return rv;
@@ -1835,6 +3796,8 @@ int cf_send_raw_bytes(kis_capture_handler_t *caph, uint8_t *data, size_t len) {
         return -1;
     }
 
+    cf_loop_notify(caph);
+
     pthread_mutex_unlock(&(caph->out_ringbuf_lock));
     return 1;
 }
@@ -1848,18 +3811,8 @@ int cf_stream_packet(kis_capture_handler_t *caph, const char *packtype,
 
     size_t i;
 
-    /* Encode a header */
-    proto_hdr = encode_simple_cap_proto_hdr(&proto_sz, packtype, 0, 
-            in_kv_list, in_kv_len);
-
-    if (proto_hdr == NULL) {
-        fprintf(stderr, "FATAL: Unable to allocate protocol frame header\n");
-        for (i = 0; i < in_kv_len; i++) {
-            free(in_kv_list[i]);
-        }
-        free(in_kv_list);
-        return -1;
-    }
+    int data_frame = strcasecmp(packtype, "DATA") == 0;
+    int r = 1;
 
     /* 
      fprintf(stderr, "debug - trying to write streaming packet '%s' len %lu\n", packtype, proto_sz);
@@ -1867,27 +3820,59 @@ int cf_stream_packet(kis_capture_handler_t *caph, const char *packtype,
 
     pthread_mutex_lock(&(caph->out_ringbuf_lock));
 
-    if (kis_simple_ringbuf_available(caph->out_ringbuf) < proto_sz) {
+    /* Nothing but the RESUME request goes out until the session is resumed
+     * (data waits in the replay list), and keep any queued packets ahead of
+     * this frame */
+    if ((caph->resume_pending && !data_frame && strcasecmp(packtype, "RESUME") != 0) ||
+            cf_flush_data_batch(caph) == 0) {
         pthread_mutex_unlock(&(caph->out_ringbuf_lock));
         for (i = 0; i < in_kv_len; i++) {
             free(in_kv_list[i]);
         }
-        free(in_kv_list);
-        free(proto_hdr);
+        if (in_kv_list != NULL)
+            free(in_kv_list);
         return 0;
     }
 
-    /* Write the header out */
-    kis_simple_ringbuf_write(caph->out_ringbuf, (uint8_t *) proto_hdr, 
-            sizeof(simple_cap_proto_t));
+    /* Encode a header; data frames are numbered for replay */
+    proto_hdr = encode_simple_cap_proto_hdr(&proto_sz, packtype, 
+            data_frame ? cf_next_data_seq(caph) : 0, in_kv_list, in_kv_len);
 
-    /* Write all the kv pairs out */
-    for (i = 0; i < in_kv_len; i++) {
-        simple_cap_proto_kv_t *kv = in_kv_list[i];
+    if (proto_hdr == NULL) {
+        pthread_mutex_unlock(&(caph->out_ringbuf_lock));
+        fprintf(stderr, "FATAL: Unable to allocate protocol frame header\n");
+        for (i = 0; i < in_kv_len; i++) {
+            free(in_kv_list[i]);
+        }
+        if (in_kv_list != NULL)
+            free(in_kv_list);
+        return -1;
+    }
+
+    if (data_frame) {
+        r = cf_write_data_frame(caph, proto_hdr, proto_sz, in_kv_list, in_kv_len);
+    } else if (kis_simple_ringbuf_available(caph->out_ringbuf) < proto_sz) {
+        r = 0;
+    } else {
+        /* Write the header out */
+        kis_simple_ringbuf_write(caph->out_ringbuf, (uint8_t *) proto_hdr, 
+                sizeof(simple_cap_proto_t));
+
+        /* Write all the kv pairs out */
+        for (i = 0; i < in_kv_len; i++) {
+            simple_cap_proto_kv_t *kv = in_kv_list[i];
+
+            kis_simple_ringbuf_write(caph->out_ringbuf, (uint8_t *) kv,
+                    ntohl(kv->header.obj_sz) + sizeof(simple_cap_proto_kv_t));
+        }
+    }
 
-        kis_simple_ringbuf_write(caph->out_ringbuf, (uint8_t *) kv,
-                ntohl(kv->header.obj_sz) + sizeof(simple_cap_proto_kv_t));
+    if (r > 0)
+        cf_loop_notify(caph);
+
+    pthread_mutex_unlock(&(caph->out_ringbuf_lock));
 
+    for (i = 0; i < in_kv_len; i++) {
         free(in_kv_list[i]);
     }
 
@@ -1896,7 +3881,177 @@ int cf_stream_packet(kis_capture_handler_t *caph, const char *packtype,
 
     free(proto_hdr);
 
-    pthread_mutex_unlock(&(caph->out_ringbuf_lock));
+    return r;
+}
+
+int cf_init_compression(kis_capture_handler_t *caph) {
+    if (caph->zstream == NULL) {
+        caph->zstream = (z_stream *) malloc(sizeof(z_stream));
+
+        if (caph->zstream == NULL)
+            return -1;
+
+        memset(caph->zstream, 0, sizeof(z_stream));
+
+        /* Raw deflate; the frame already carries checksums */
+        if (deflateInit2(caph->zstream, CF_COMPRESS_LEVEL, Z_DEFLATED, -15, 8,
+                    Z_DEFAULT_STRATEGY) != Z_OK) {
+            free(caph->zstream);
+            caph->zstream = NULL;
+            return -1;
+        }
+    } else if (deflateReset(caph->zstream) != Z_OK) {
+        return -1;
+    }
+
+    if (deflateSetDictionary(caph->zstream, (const Bytef *) SIMPLE_CAP_ZDICT,
+                sizeof(SIMPLE_CAP_ZDICT) - 1) != Z_OK)
+        return -1;
+
+    caph->zstream_reset = 1;
+
+    return 1;
+}
+
+/* Write the queued batch as a ZDATABATCH frame.  Must be called with 
+ * out_ringbuf_lock held.  The deflate stream can't be rewound, so the buffer
+ * must have room for the largest possible result before anything is 
+ * compressed. */
+static int cf_flush_compressed_batch(kis_capture_handler_t *caph) {
+    simple_cap_proto_t *proto_hdr;
+    simple_cap_proto_kv_t *zkv;
+    simple_cap_proto_zbatch_t *zbatch;
+    uint8_t *raw;
+    size_t raw_len = 0;
+    size_t z_max, z_len, proto_sz;
+    size_t i;
+
+    z_max = deflateBound(caph->zstream, caph->batch_bytes) + 16;
+
+    if (cf_data_room(caph) < sizeof(simple_cap_proto_t) +
+            sizeof(simple_cap_proto_kv_t) + sizeof(simple_cap_proto_zbatch_t) + z_max)
+        return 0;
+
+    raw = (uint8_t *) malloc(caph->batch_bytes);
+    zbatch = (simple_cap_proto_zbatch_t *) 
+        malloc(sizeof(simple_cap_proto_zbatch_t) + z_max);
+
+    if (raw == NULL || zbatch == NULL) {
+        fprintf(stderr, "FATAL: Unable to allocate compressed batch\n");
+        free(raw);
+        free(zbatch);
+        return -1;
+    }
+
+    for (i = 0; i < caph->batch_kvs_len; i++) {
+        simple_cap_proto_kv_t *kv = caph->batch_kvs[i];
+        size_t kv_sz = ntohl(kv->header.obj_sz) + sizeof(simple_cap_proto_kv_t);
+
+        memcpy(raw + raw_len, kv, kv_sz);
+        raw_len += kv_sz;
+    }
+
+    caph->zstream->next_in = raw;
+    caph->zstream->avail_in = raw_len;
+    caph->zstream->next_out = zbatch->data;
+    caph->zstream->avail_out = z_max;
+
+    /* A sync flush ends the batch on a byte boundary so the server can
+     * decompress all of it now */
+    if (deflate(caph->zstream, Z_SYNC_FLUSH) != Z_OK || 
+            caph->zstream->avail_in != 0) {
+        fprintf(stderr, "FATAL: Unable to compress batched data\n");
+        free(raw);
+        free(zbatch);
+        return -1;
+    }
+
+    z_len = z_max - caph->zstream->avail_out;
+
+    zbatch->method = SIMPLE_CAP_ZBATCH_DEFLATE;
+    zbatch->flags = caph->zstream_reset ? SIMPLE_CAP_ZBATCH_RESET : 0;
+    zbatch->pad = 0;
+    zbatch->num_kv_pairs = htonl(caph->batch_kvs_len);
+    zbatch->data_sz = htonl(raw_len);
+
+    free(raw);
+
+    zkv = encode_simple_cap_proto_kv("ZBATCH", (uint8_t *) zbatch, 
+            sizeof(simple_cap_proto_zbatch_t) + z_len);
+
+    free(zbatch);
+
+    if (zkv == NULL) {
+        fprintf(stderr, "FATAL: Unable to allocate compressed batch\n");
+        return -1;
+    }
+
+    proto_hdr = encode_simple_cap_proto_hdr(&proto_sz, "ZDATABATCH", 
+            cf_next_data_seq(caph), &zkv, 1);
+
+    if (proto_hdr == NULL) {
+        fprintf(stderr, "FATAL: Unable to allocate protocol frame header\n");
+        free(zkv);
+        return -1;
+    }
+
+    /* There was room before compressing, and the frame is smaller */
+    if (cf_write_data_frame(caph, proto_hdr, proto_sz, &zkv, 1) <= 0) {
+        fprintf(stderr, "FATAL: Unable to write compressed batch\n");
+        free(proto_hdr);
+        free(zkv);
+        return -1;
+    }
+
+    free(proto_hdr);
+    free(zkv);
+
+    for (i = 0; i < caph->batch_kvs_len; i++)
+        free(caph->batch_kvs[i]);
+
+    caph->batch_kvs_len = 0;
+    caph->batch_bytes = 0;
+    caph->batch_packets = 0;
+
+    caph->zstream_reset = 0;
+
+    return 1;
+}
+
+int cf_flush_data_batch(kis_capture_handler_t *caph) {
+    simple_cap_proto_t *proto_hdr;
+    size_t proto_sz;
+    size_t i;
+    int r;
+
+    if (caph->batch_kvs_len == 0)
+        return 1;
+
+    if (caph->compress_data && caph->zstream != NULL)
+        return cf_flush_compressed_batch(caph);
+
+    proto_hdr = encode_simple_cap_proto_hdr(&proto_sz, "DATABATCH", 
+            cf_next_data_seq(caph), caph->batch_kvs, caph->batch_kvs_len);
+
+    if (proto_hdr == NULL) {
+        fprintf(stderr, "FATAL: Unable to allocate protocol frame header\n");
+        return -1;
+    }
+
+    r = cf_write_data_frame(caph, proto_hdr, proto_sz, 
+            caph->batch_kvs, caph->batch_kvs_len);
+
+    free(proto_hdr);
+
+    if (r <= 0)
+        return r;
+
+    for (i = 0; i < caph->batch_kvs_len; i++)
+        free(caph->batch_kvs[i]);
+
+    caph->batch_kvs_len = 0;
+    caph->batch_bytes = 0;
+    caph->batch_packets = 0;
 
     return 1;
 }
@@ -2285,6 +4440,175 @@ int cf_send_openresp(kis_capture_handler_t *caph, uint32_t seq, unsigned int suc
     return cf_stream_packet(caph, "OPENRESP", kv_pairs, kv_pos);
 }
 
+/* Add the KVs making up one packet to the pending batch, flushing it first if
+ * it is full, and flushing it after if this packet filled it.  Frees the 
+ * provided list, and frees the KVs if they can't be queued. */
+static int cf_queue_data_batch(kis_capture_handler_t *caph,
+        simple_cap_proto_kv_t **in_kv_list, size_t in_kv_len) {
+    size_t i;
+    size_t packet_bytes = 0;
+
+    for (i = 0; i < in_kv_len; i++)
+        packet_bytes += ntohl(in_kv_list[i]->header.obj_sz) + sizeof(simple_cap_proto_kv_t);
+
+    pthread_mutex_lock(&(caph->out_ringbuf_lock));
+
+    /* Make room in the batch */
+    if (caph->batch_packets != 0 &&
+            (caph->batch_packets >= CF_BATCH_MAX_PACKETS ||
+             caph->batch_bytes + packet_bytes > CF_BATCH_MAX_BYTES)) {
+        int r = cf_flush_data_batch(caph);
+
+        if (r <= 0) {
+            pthread_mutex_unlock(&(caph->out_ringbuf_lock));
+
+            for (i = 0; i < in_kv_len; i++)
+                free(in_kv_list[i]);
+            free(in_kv_list);
+
+            return r;
+        }
+    }
+
+    if (caph->batch_packets == 0)
+        gettimeofday(&(caph->batch_start), NULL);
+
+    for (i = 0; i < in_kv_len; i++)
+        caph->batch_kvs[caph->batch_kvs_len++] = in_kv_list[i];
+
+    free(in_kv_list);
+
+    caph->batch_bytes += packet_bytes;
+    caph->batch_packets++;
+
+    /* Send it now if it's full; if there's no room yet it stays queued and
+     * goes out from the main loop or the next packet */
+    if (caph->batch_packets >= CF_BATCH_MAX_PACKETS ||
+            caph->batch_bytes >= CF_BATCH_MAX_BYTES) {
+        if (cf_flush_data_batch(caph) < 0) {
+            pthread_mutex_unlock(&(caph->out_ringbuf_lock));
+            return -1;
+        }
+    }
+
+    cf_loop_notify(caph);
+
+    pthread_mutex_unlock(&(caph->out_ringbuf_lock));
+
+    return 1;
+}
+
+/* Encode the KV carrying a packet:  a metadata-only frame if the source is
+ * sending them and the helper can reduce this one, and otherwise the first
+ * in_cap_sz bytes of the packet */
+static simple_cap_proto_kv_t *cf_encode_packet_kv(kis_capture_handler_t *caph,
+        struct timeval ts, uint32_t packet_sz, uint32_t in_cap_sz, uint8_t *pack) {
+    simple_cap_proto_metaframe_t meta;
+
+    if (caph->metadata_only && caph->metadata_cb != NULL) {
+        memset(&meta, 0, sizeof(simple_cap_proto_metaframe_t));
+
+        if ((*(caph->metadata_cb))(caph, packet_sz, pack, &meta) > 0) {
+            meta.tv_sec = htonl((uint32_t) ts.tv_sec);
+            meta.tv_usec = htonl((uint32_t) ts.tv_usec);
+
+            return encode_kv_metaframe(&meta);
+        }
+    }
+
+    return encode_kv_capdata_truncated(ts, packet_sz, in_cap_sz, pack);
+}
+
+/* Send a packet as a self-contained DATAGRAM frame with the token for the 
+ * source, the optional KVs, and the start of the packet.  Datagrams which can't
+ * be sent right away are dropped and counted as helper drops. */
+static int cf_send_datagram(kis_capture_handler_t *caph,
+        simple_cap_proto_kv_t *kv_message,
+        simple_cap_proto_kv_t *kv_signal,
+        simple_cap_proto_kv_t *kv_gps,
+        struct timeval ts, uint32_t packet_sz, uint8_t *pack) {
+    simple_cap_proto_kv_t *kv_pairs[5];
+    simple_cap_proto_t *proto_hdr = NULL;
+    size_t kv_pos = 0, proto_sz, pos, kv_sz, i;
+    uint8_t dgram[CF_DATAGRAM_MAX_SZ];
+    uint32_t seq;
+    int sent = 0;
+
+    pthread_mutex_lock(&(caph->out_ringbuf_lock));
+
+    /* The server may have stopped taking datagrams since we looked */
+    if (caph->datagram_fd < 0) {
+        caph->helper_drops++;
+        pthread_mutex_unlock(&(caph->out_ringbuf_lock));
+        goto datagram_done;
+    }
+
+    kv_pairs[kv_pos] = encode_simple_cap_proto_kv("TOKEN", 
+            (uint8_t *) caph->datagram_token, strlen(caph->datagram_token));
+    if (kv_pairs[kv_pos] != NULL)
+        kv_pos++;
+
+    if (kv_message != NULL)
+        kv_pairs[kv_pos++] = kv_message;
+    if (kv_signal != NULL)
+        kv_pairs[kv_pos++] = kv_signal;
+    if (kv_gps != NULL)
+        kv_pairs[kv_pos++] = kv_gps;
+
+    /* We own the optional KVs now */
+    kv_message = kv_signal = kv_gps = NULL;
+
+    kv_pairs[kv_pos] = cf_encode_packet_kv(caph, ts, packet_sz, 
+            packet_sz < caph->datagram_snaplen ? packet_sz : caph->datagram_snaplen,
+            pack);
+    if (kv_pairs[kv_pos] != NULL)
+        kv_pos++;
+
+    seq = caph->datagram_seq + 1;
+    if (seq == 0)
+        seq = 1;
+
+    proto_hdr = encode_simple_cap_proto_hdr(&proto_sz, "DATAGRAM", seq, 
+            kv_pairs, kv_pos);
+
+    if (proto_hdr != NULL && proto_sz <= CF_DATAGRAM_MAX_SZ) {
+        memcpy(dgram, proto_hdr, sizeof(simple_cap_proto_t));
+        pos = sizeof(simple_cap_proto_t);
+
+        for (i = 0; i < kv_pos; i++) {
+            kv_sz = ntohl(kv_pairs[i]->header.obj_sz) + sizeof(simple_cap_proto_kv_t);
+            memcpy(dgram + pos, kv_pairs[i], kv_sz);
+            pos += kv_sz;
+        }
+
+        if (send(caph->datagram_fd, dgram, proto_sz, 0) == (ssize_t) proto_sz) {
+            caph->datagram_seq = seq;
+            sent = 1;
+        }
+    }
+
+    if (!sent)
+        caph->helper_drops++;
+
+    pthread_mutex_unlock(&(caph->out_ringbuf_lock));
+
+    for (i = 0; i < kv_pos; i++)
+        free(kv_pairs[i]);
+
+    if (proto_hdr != NULL)
+        free(proto_hdr);
+
+datagram_done:
+    if (kv_message != NULL)
+        free(kv_message);
+    if (kv_signal != NULL)
+        free(kv_signal);
+    if (kv_gps != NULL)
+        free(kv_gps);
+
+    return 1;
+}
+
 int cf_send_data(kis_capture_handler_t *caph,
         simple_cap_proto_kv_t *kv_message,
         simple_cap_proto_kv_t *kv_signal,
@@ -2293,6 +4617,41 @@ int cf_send_data(kis_capture_handler_t *caph,
 
     // fprintf(stderr, "debug - cf_send_data starting\n");
 
+    /* When shedding, discard low-value frames once the write buffer (and the
+     * batch waiting to go into it) is getting full, instead of blocking the
+     * capture and letting the kernel drop whatever arrives next */
+    if (caph->shed_frames && caph->shed_cb != NULL) {
+        size_t used, total;
+
+        pthread_mutex_lock(&(caph->out_ringbuf_lock));
+
+        used = kis_simple_ringbuf_used(caph->out_ringbuf) + caph->batch_bytes;
+        total = kis_simple_ringbuf_used(caph->out_ringbuf) + 
+            kis_simple_ringbuf_available(caph->out_ringbuf);
+
+        if (used > total * CF_SHED_THRESHOLD &&
+                (*(caph->shed_cb))(caph, packet_sz, pack)) {
+            caph->helper_drops++;
+            pthread_mutex_unlock(&(caph->out_ringbuf_lock));
+
+            if (kv_message != NULL)
+                free(kv_message);
+            if (kv_signal != NULL)
+                free(kv_signal);
+            if (kv_gps != NULL)
+                free(kv_gps);
+
+            return 1;
+        }
+
+        pthread_mutex_unlock(&(caph->out_ringbuf_lock));
+    }
+
+    /* Packets go in datagrams when the server accepts them */
+    if (caph->datagram_fd >= 0)
+        return cf_send_datagram(caph, kv_message, kv_signal, kv_gps, ts, 
+                packet_sz, pack);
+
     /* How many KV pairs are we allocating?  1 for data for sure */
     size_t num_kvs = 1;
 
@@ -2327,7 +4686,7 @@ int cf_send_data(kis_capture_handler_t *caph,
         kv_pos++;
     }
 
-    kv_pairs[kv_pos] = encode_kv_capdata(ts, packet_sz, pack);
+    kv_pairs[kv_pos] = cf_encode_packet_kv(caph, ts, packet_sz, packet_sz, pack);
     if (kv_pairs[kv_pos] == NULL) {
         fprintf(stderr, "FATAL: Unable to allocate KV DATA pair\n");
         for (i = 0; i < kv_pos; i++) {
@@ -2338,7 +4697,10 @@ int cf_send_data(kis_capture_handler_t *caph,
     }
     kv_pos++;
 
-    return cf_stream_packet(caph, "DATA", kv_pairs, kv_pos);
+    if (!caph->batch_data)
+        return cf_stream_packet(caph, "DATA", kv_pairs, kv_pos);
+
+    return cf_queue_data_batch(caph, kv_pairs, kv_pos);
 }
 
 int cf_send_configresp(kis_capture_handler_t *caph, unsigned int seqno, 
@@ -2504,7 +4866,8 @@ int cf_send_pong(kis_capture_handler_t *caph) {
 }
 
 int cf_send_newsource(kis_capture_handler_t *caph, const char *uuid) {
-    size_t num_kvs = 3;
+    size_t num_kvs = caph->redirected ? 4 : 3;
+    uint8_t redirected = 1;
     size_t kv_pos = 0;
 
     /* Actual KV pairs we encode into the packet */
@@ -2537,9 +4900,49 @@ int cf_send_newsource(kis_capture_handler_t *caph, const char *uuid) {
     }
     kv_pos++;
 
+    /* A server we were redirected to takes the source, even if its view of
+     * the cluster differs from the server which sent us */
+    if (caph->redirected) {
+        kv_pairs[kv_pos] = encode_simple_cap_proto_kv("REDIRECTED", &redirected, 1);
+        if (kv_pairs[kv_pos] == NULL) {
+            free(kv_pairs[0]);
+            free(kv_pairs[1]);
+            free(kv_pairs[2]);
+            free(kv_pairs);
+            return -1;
+        }
+        kv_pos++;
+    }
+
     return cf_stream_packet(caph, "NEWSOURCE", kv_pairs, num_kvs);
 }
 
+int cf_send_resume(kis_capture_handler_t *caph) {
+    size_t num_kvs = 2;
+
+    /* Actual KV pairs we encode into the packet */
+    simple_cap_proto_kv_t **kv_pairs;
+
+    kv_pairs = 
+        (simple_cap_proto_kv_t **) malloc(sizeof(simple_cap_proto_kv_t *) * num_kvs);
+
+    kv_pairs[0] = encode_kv_uuid(caph->resume_uuid);
+    if (kv_pairs[0] == NULL) {
+        free(kv_pairs);
+        return -1;
+    }
+
+    kv_pairs[1] = encode_simple_cap_proto_kv("SESSION", 
+            (uint8_t *) caph->resume_session, strlen(caph->resume_session));
+    if (kv_pairs[1] == NULL) {
+        free(kv_pairs[0]);
+        free(kv_pairs);
+        return -1;
+    }
+
+    return cf_stream_packet(caph, "RESUME", kv_pairs, num_kvs);
+}
+
 double cf_parse_frequency(const char *freq) {
     char *ufreq;
     unsigned int i;
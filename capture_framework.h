@@ -51,13 +51,85 @@
 
 #include <arpa/inet.h>
 
+#include <zlib.h>
+
 #include "simple_datasource_proto.h"
 #include "simple_ringbuf_c.h"
 #include "msgpuck_buffer.h"
+#include "kis_tls.h"
 
 struct kis_capture_handler;
 typedef struct kis_capture_handler kis_capture_handler_t;
 
+/* Batched DATA delivery:  when enabled, packets are queued and sent as a single
+ * DATABATCH frame holding multiple packets, which is flushed when it holds
+ * CF_BATCH_MAX_PACKETS packets, reaches CF_BATCH_MAX_BYTES, or the oldest
+ * queued packet has waited CF_BATCH_LATENCY_USEC */
+#define CF_BATCH_MAX_PACKETS    64
+#define CF_BATCH_MAX_BYTES      (1024 * 64)
+#define CF_BATCH_LATENCY_USEC   10000
+
+/* Main loop wakeups:  data queued by the capture thread may wait up to 
+ * CF_WAKE_LATENCY_USEC (or the 'wakelatency' flag of the source definition) 
+ * for the main loop to come around to it before the loop is woken for it, 
+ * unless the write buffer is over half full.  The loop waits on at most 
+ * CF_LOOP_MAX_FDS descriptors, and wakes up every CF_LOOP_IDLE_USEC when idle */
+#define CF_WAKE_LATENCY_USEC    2000
+#define CF_LOOP_MAX_FDS         4
+#define CF_LOOP_IDLE_USEC       500000
+
+/* Compressed batches:  remote capture compresses batched data when the server
+ * offers it, unless disabled with --disable-compression.  The deflate level
+ * trades helper CPU against link bandwidth. */
+#define CF_COMPRESS_LEVEL       3
+
+/* Resumable sessions:  when the server offers a session, remote capture keeps
+ * every data frame in a replay buffer until the server acknowledges it.  If
+ * the connection drops, capture continues into the buffer and the session is
+ * resumed on reconnect, replaying whatever the server didn't get.  The buffer
+ * size can be changed with --resume-buffer; once it is full, data waits as it
+ * would for a full write buffer. */
+#define CF_RESUME_BUFFER_DEFAULT    (1024 * 1024 * 8)
+
+/* TLS:  with --tls, the TCP connection to the server is wrapped in TLS once it
+ * connects; a handshake which hasn't completed in CF_TLS_HANDSHAKE_TIMEOUT
+ * seconds is treated like a failed connection.  Reconnects offer the previous
+ * session so they skip the full handshake, and record encryption is handed to
+ * the kernel when it supports it.  Metadata datagrams are not sent over TLS. */
+#define CF_TLS_HANDSHAKE_TIMEOUT    10
+
+/* Metadata datagrams:  with --datagram-metadata, remote capture to a server
+ * which accepts datagrams sends each packet as a self-contained UDP datagram
+ * holding its signal and GPS records and the first CF_DATAGRAM_SNAPLEN bytes
+ * of the packet (or as set with --datagram-snaplen), instead of queueing it
+ * behind everything else on the TCP connection.  Datagrams are never retried;
+ * the server counts the ones which don't arrive. */
+#define CF_DATAGRAM_SNAPLEN     256
+#define CF_DATAGRAM_MAX_SZ      1400
+
+/* Multiplexed helpers:  a Kismet server which shares one capture helper between
+ * several local sources launches it with --multiplex.  Each source is a channel
+ * with a handler of its own (its own userdata, capture and hop threads, and
+ * buffers), set up by the driver's multiplex callback when the first frame for
+ * the channel arrives.  Every frame on the IPC pipe is wrapped in a MUX frame
+ * tagged with the channel id; the helper loop unwraps incoming frames into the
+ * channel handlers and wraps everything they send, so all the channels share
+ * one pipe, one select loop, and one drop and ping check.  A MUXCLOSE frame
+ * from the server closes a channel; channels are freed CF_MUX_FREE_DELAY
+ * seconds after they close, once their threads are gone. */
+#define CF_MUX_FREE_DELAY       2
+
+/* A data frame held for replay */
+struct cf_replay_frame;
+typedef struct cf_replay_frame cf_replay_frame_t;
+
+struct cf_replay_frame {
+    cf_replay_frame_t *next;
+    uint32_t seq;
+    size_t len;
+    uint8_t data[0];
+};
+
 struct cf_params_interface;
 typedef struct cf_params_interface cf_params_interface_t;
 
@@ -223,6 +295,65 @@ typedef int (*cf_callback_spectrumconfig)(kis_capture_handler_t *, uint32_t seqn
     unsigned int amp, uint64_t if_amp, uint64_t baseband_amp, 
     simple_cap_proto_frame_t *in_frame);
 
+/* Drop statistics callback
+ * Called periodically from the main loop to collect the number of frames the
+ * kernel or driver dropped before the capture saw them.
+ *
+ * This callback is optional; it must not block.
+ *
+ * Returns:
+ * -1   Drop count unavailable
+ *  0   Success, total drops since the source was opened placed in ret_drops
+ */
+typedef int (*cf_callback_dropstats)(kis_capture_handler_t *, uint64_t *ret_drops);
+
+/* Shed callback
+ * Called from cf_send_data when the source was opened with 'backpressure=shed'
+ * and the write buffer is filling up, to decide if a frame is low value and
+ * can be discarded to make room for others (for example wifi data frames, 
+ * which say less about a device than management frames).
+ *
+ * This callback is optional; without it no frames are shed.  It is called in
+ * the capture thread and must not block.
+ *
+ * Returns:
+ *  0   Frame should be kept
+ *  1   Frame may be shed
+ */
+typedef int (*cf_callback_shed)(kis_capture_handler_t *, uint32_t packet_sz, 
+        uint8_t *pack);
+
+/* Metadata callback
+ * Called from cf_send_data when the source was opened with 'metadata=true', to
+ * reduce a frame to a metadata-only record:  the 802.11 header, at most
+ * SIMPLE_CAP_METAFRAME_HDR_MAX bytes, without payload, and the layer1 data from
+ * the capture header.  The framework fills in the timestamp; every other field
+ * is set by the callback, in network order.
+ *
+ * This callback is optional; without it full frames are sent.  It is called in
+ * the capture thread and must not block.
+ *
+ * Returns:
+ *  0   Frame can't be reduced, and is sent whole
+ *  1   ret_meta was filled in
+ */
+typedef int (*cf_callback_metadata)(kis_capture_handler_t *, uint32_t packet_sz,
+        uint8_t *pack, simple_cap_proto_metaframe_t *ret_meta);
+
+/* Multiplex channel callback
+ * Called in a helper started with --multiplex when a new channel opens, with the
+ * new channel handler, to set the same callbacks as the helper handler and
+ * allocate userdata for the channel.  Called again with in_release set once
+ * the channel has closed and its threads are gone, to release the userdata.
+ *
+ * Without this callback a helper can't be multiplexed.
+ *
+ * Returns:
+ * -1   Channel could not be set up
+ *  0   Success
+ */
+typedef int (*cf_callback_muxchannel)(kis_capture_handler_t *, int in_release);
+
 struct kis_capture_handler {
     /* Capture source type */
     char *capsource_type;
@@ -242,6 +373,18 @@ struct kis_capture_handler {
     char *remote_host;
     unsigned int remote_port;
 
+    /* Host and port given on the command line; a cluster server can redirect
+     * us to the server which owns the source, and when that one is lost we
+     * go back to the first one to be redirected again */
+    char *home_host;
+    unsigned int home_port;
+
+    /* Pending redirect, and whether the current server is one we were
+     * redirected to */
+    char *redirect_host;
+    unsigned int redirect_port;
+    int redirected;
+
     /* Specified commandline source, used for remote cap */
     char *cli_sourcedef;
 
@@ -254,6 +397,16 @@ struct kis_capture_handler {
     /* TCP connection */
     int tcp_fd;
 
+    /* TLS on the TCP connection, with --tls.  The server certificate is
+     * checked against tls_ca, or the system CAs, unless tls_verify is off.
+     * The context lasts across reconnects so it can offer the last session
+     * again; tls_conn is the current connection */
+    int tls;
+    char *tls_ca;
+    int tls_verify;
+    kis_tls_ctx_t *tls_ctx;
+    kis_tls_conn_t *tls_conn;
+
     /* Die when we hit the end of our write buffer */
     int spindown;
 
@@ -287,6 +440,12 @@ struct kis_capture_handler {
 
     cf_callback_spectrumconfig spectrumconfig_cb;
 
+    cf_callback_dropstats dropstats_cb;
+    cf_callback_shed shed_cb;
+    cf_callback_metadata metadata_cb;
+
+    cf_callback_muxchannel muxchannel_cb;
+
 
     /* Arbitrary data blob */
     void *userdata;
@@ -312,8 +471,109 @@ struct kis_capture_handler {
     unsigned int channel_hop_shuffle_spacing;
 
     int channel_hop_offset;
+
+    /* Batched DATA frames, protected by out_ringbuf_lock.  Each queued packet
+     * contributes its message, signal, and gps KVs followed by its packet KV */
+    int batch_data;
+    simple_cap_proto_kv_t **batch_kvs;
+    size_t batch_kvs_len;
+    size_t batch_bytes;
+    unsigned int batch_packets;
+    struct timeval batch_start;
+
+    /* Compressed batches, protected by out_ringbuf_lock.  The deflate stream
+     * lasts for the connection; zstream_reset is set until the first batch of a
+     * new stream has been sent */
+    int compress_data;
+    int compress_disabled;
+    z_stream *zstream;
+    int zstream_reset;
+
+    /* Resumable session, protected by out_ringbuf_lock.  resume_session is the
+     * token from the server, or NULL without a session.  Data frames are 
+     * numbered with data_seq and kept in the replay list until acknowledged; 
+     * replay_send is the first frame not yet written to the link.  Frames only
+     * go to the link while resume_link is set, and nothing but the RESUME 
+     * request is sent while resume_pending is set. */
+    int resume_disabled;
+    char *resume_session;
+    char *resume_uuid;
+    int resume_link;
+    int resume_pending;
+    uint32_t data_seq;
+    size_t resume_buffer_max;
+    size_t resume_buffer_used;
+    cf_replay_frame_t *replay_head;
+    cf_replay_frame_t *replay_tail;
+    cf_replay_frame_t *replay_send;
+
+    /* Metadata datagrams, protected by out_ringbuf_lock.  datagram_fd is a UDP
+     * socket connected to the server while it accepts datagrams for the source,
+     * and -1 otherwise */
+    int datagram_metadata;
+    unsigned int datagram_snaplen;
+    int datagram_fd;
+    char *datagram_token;
+    uint32_t datagram_seq;
+    struct sockaddr_in remote_addr;
+
+    /* Metadata-only frames, set from the 'metadata' flag of the source 
+     * definition when the source is opened */
+    int metadata_only;
+
+    /* Multiplexed helper.  The helper handler owns the IPC pipe and the list of
+     * channels; a channel handler has no descriptors, and points back to the
+     * helper with mux_parent.  mux_closed is when a channel closed, and it is
+     * freed CF_MUX_FREE_DELAY seconds later. */
+    int multiplex;
+    kis_capture_handler_t *mux_parent;
+    kis_capture_handler_t *mux_channels;
+    kis_capture_handler_t *mux_next;
+    uint32_t mux_id;
+    time_t mux_closed;
+
+    /* Backpressure and drop accounting, protected by out_ringbuf_lock.  When
+     * shedding, low-value frames are discarded once the write buffer is over
+     * CF_SHED_THRESHOLD full instead of waiting for it to drain.  Drop totals
+     * are reported to Kismet in a DROPS KV when they change. */
+    int shed_frames;
+    uint64_t kernel_drops;
+    uint64_t helper_drops;
+    uint64_t reported_kernel_drops;
+    uint64_t reported_helper_drops;
+    time_t last_drops_check;
+
+    /* Hop timing, protected by handler_lock:  channel switches made while 
+     * hopping, the total and worst time they took, and hops which started late
+     * because the hop before them overran the interval.  Reported to Kismet in a
+     * HOPSTATS KV when they change. */
+    uint64_t hop_switches;
+    uint64_t hop_switch_total_usec;
+    uint64_t hop_switch_max_usec;
+    uint64_t hop_late;
+    uint64_t reported_hop_switches;
+
+    /* Main loop wakeups, protected by out_ringbuf_lock.  The loop waits on its
+     * descriptors and loop_wake_fd (an eventfd, or a pipe outside Linux, read 
+     * from [0] and written to [1]); on Linux through an epoll set which is only
+     * changed when what the loop waits on changes.  loop_sleep_usec is the 
+     * monotonic time a waiting loop wakes up on its own, and 0 while it is 
+     * awake or already woken. */
+    int loop_wake_fd[2];
+    int loop_epoll_fd;
+    int loop_poll_fd[CF_LOOP_MAX_FDS];
+    uint32_t loop_poll_events[CF_LOOP_MAX_FDS];
+    unsigned int loop_poll_len;
+    uint64_t loop_sleep_usec;
+    unsigned long wake_latency_usec;
 };
 
+/* Shortest interval between hops; faster hop rates are capped */
+#define CF_HOP_MIN_USEC     5000
+
+/* Fraction of the write buffer in use before frames are shed */
+#define CF_SHED_THRESHOLD   0.75
+
 
 struct cf_params_interface {
     char *capif;
@@ -479,6 +739,16 @@ void cf_handler_set_unknown_cb(kis_capture_handler_t *capf, cf_callback_unknown
 /* Set the capture function, which runs inside its own thread */
 void cf_handler_set_capture_cb(kis_capture_handler_t *capf, cf_callback_capture cb);
 
+/* Set the optional drop statistics and frame shedding functions */
+void cf_handler_set_dropstats_cb(kis_capture_handler_t *capf, cf_callback_dropstats cb);
+void cf_handler_set_shed_cb(kis_capture_handler_t *capf, cf_callback_shed cb);
+
+/* Set the optional metadata-only frame function */
+void cf_handler_set_metadata_cb(kis_capture_handler_t *capf, cf_callback_metadata cb);
+
+/* Set the multiplex channel function, which lets the helper be shared */
+void cf_handler_set_muxchannel_cb(kis_capture_handler_t *capf, cf_callback_muxchannel cb);
+
 
 
 /* Set random data blob */
@@ -620,6 +890,27 @@ int cf_send_raw_bytes(kis_capture_handler_t *caph, uint8_t *data, size_t len);
 int cf_stream_packet(kis_capture_handler_t *caph, const char *packtype,
         simple_cap_proto_kv_t **in_kv_list, unsigned int in_kv_len);
 
+/* Write any queued DATA packets as a single DATABATCH frame, or a ZDATABATCH
+ * frame when compression is enabled.
+ * Must be called with out_ringbuf_lock held.
+ *
+ * Returns:
+ * -1   An error occurred
+ *  0   Insufficient space in buffer; the batch remains queued
+ *  1   Success, or nothing was queued
+ */
+int cf_flush_data_batch(kis_capture_handler_t *caph);
+
+/* Start a new compressed stream for batched data, from the preset dictionary;
+ * the next batch is marked as a stream reset.
+ * Must be called with out_ringbuf_lock held.
+ *
+ * Returns:
+ * -1   An error occurred
+ *  1   Success
+ */
+int cf_init_compression(kis_capture_handler_t *caph);
+
 /* Send a MESSAGE
  * Can be called from any thread.
  *
@@ -708,6 +999,13 @@ int cf_send_openresp(kis_capture_handler_t *caph, uint32_t seq, unsigned int suc
  * If present, include message_kv, signal_kv, or gps_kv along with the packet data.
  * On failure or transmit, provided accessory KV pairs will be freed.
  *
+ * If batching is enabled the packet is queued in the next DATABATCH frame
+ * instead of being sent immediately.
+ *
+ * If the source is shedding frames and the shed callback marks the packet as
+ * low value while the buffer is filling up, the packet is discarded, counted as
+ * a helper drop, and treated as sent.
+ *
  * Returns:
  * -1   An error occurred 
  *  0   Insufficient space in buffer
@@ -777,6 +1075,15 @@ int cf_send_pong(kis_capture_handler_t *caph);
  */
 int cf_send_newsource(kis_capture_handler_t *caph, const char *uuid);
 
+/* Resume a session after reconnecting
+ *
+ * Returns:
+ * -1   An error occurred
+ *  0   Insufficient space in buffer
+ *  1   Success
+ */
+int cf_send_resume(kis_capture_handler_t *caph);
+
 /* Simple frequency parser, returns the frequency in khz from multiple input 
  * formats, such as:
  * 123KHz
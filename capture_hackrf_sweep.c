@@ -225,6 +225,83 @@ float logPower(fftwf_complex in, float scale)
 	return log2f(magsq) * 10.0f / log2(10.0f);
 }
 
+/* log2 from the float exponent and a polynomial over the mantissa; good to
+ * about 0.0005 dB once scaled, far below anything the radio can resolve, and
+ * unlike log2f it's plain arithmetic the compiler can vectorize.  Zero comes
+ * out as a very low finite value instead of -inf. */
+static inline float fast_log2f(float x) {
+    uint32_t bits;
+    float e, m;
+
+    memcpy(&bits, &x, sizeof(bits));
+
+    e = (float) ((int32_t) ((bits >> 23) & 0xFF) - 127);
+
+    bits = (bits & 0x007FFFFF) | 0x3F800000;
+    memcpy(&m, &bits, sizeof(m));
+    m -= 1.0f;
+
+    return e + 0.000114580f + m * (1.436874896f + m * (-0.670882679f +
+                m * (0.312269477f + m * -0.078440676f)));
+}
+
+/* Convert a block of FFT output to dB in one pass.
+ *
+ * Calling logPower per bin recomputes the log2(10) constant and keeps the
+ * compiler from vectorizing the loop; the squared scale is folded into the
+ * log as an offset so the loop is only multiplies, adds, and bit operations
+ * over flat float arrays.
+ */
+void log_power_block(const fftwf_complex *restrict in, float *restrict out,
+        int n, float scale) {
+    const float *restrict iq = (const float *) in;
+    const float db_per_log2 = 10.0f / log2f(10.0f);
+    const float db_scale = log2f(scale * scale) * db_per_log2;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        float magsq = iq[2 * i] * iq[2 * i] + iq[2 * i + 1] * iq[2 * i + 1];
+        out[i] = fast_log2f(magsq) * db_per_log2 + db_scale;
+    }
+}
+
+/* Decimate a block of dB bins by 'factor', keeping the peak of each group so
+ * narrow signals aren't averaged away when the sweep is reported at a coarser
+ * bin width than the FFT.  Returns the number of output bins; a trailing
+ * partial group is folded into the last bin. */
+int decimate_bins_max(const float *restrict in, int n, int factor,
+        float *restrict out) {
+    int nout, i, j;
+
+    if (factor <= 1) {
+        memcpy(out, in, sizeof(float) * n);
+        return n;
+    }
+
+    nout = n / factor;
+
+    for (i = 0; i < nout; i++) {
+        const float *g = in + (i * factor);
+        float m = g[0];
+
+        for (j = 1; j < factor; j++)
+            m = g[j] > m ? g[j] : m;
+
+        out[i] = m;
+    }
+
+    for (i = nout * factor; i < n; i++) {
+        if (nout == 0) {
+            out[0] = in[i];
+            nout = 1;
+        } else if (in[i] > out[nout - 1]) {
+            out[nout - 1] = in[i];
+        }
+    }
+
+    return nout;
+}
+
 
 int probe_callback(kis_capture_handler_t *caph, uint32_t seqno, char *definition,
         char *msg, char **uuid, simple_cap_proto_frame_t *frame,
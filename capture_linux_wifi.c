@@ -60,6 +60,15 @@
 #include <net/if.h>
 #include <arpa/inet.h>
 
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
+#include <net/if_arp.h>
+
 #include <ifaddrs.h>
 
 #include "config.h"
@@ -80,16 +89,53 @@
 
 #define MAX_PACKET_LEN  8192
 
+/* Smallest snaplen we accept; enough for radiotap and the 802.11 header */
+#define MIN_SNAPLEN     64
+
+/* Capture length used by the packet ring when no snaplen is set */
+#define TPACKET_MAX_SNAPLEN 262144
+
+#ifndef PCAP_NETMASK_UNKNOWN
+#define PCAP_NETMASK_UNKNOWN    0xFFFFFFFF
+#endif
+
+/* TPACKET_V3 ring geometry; the kernel fills whole blocks of packets and hands
+ * them to us at once, retiring a partially filled block after the timeout so
+ * quiet channels still deliver promptly */
+#define TPACKET_BLOCK_SZ        (1 << 20)
+#define TPACKET_BLOCK_NR        8
+#define TPACKET_FRAME_SZ        2048
+#define TPACKET_RETIRE_MSEC     60
+
 /* State tracking, put in userdata */
 typedef struct {
     pcap_t *pd;
 
+    /* Memory-mapped TPACKET_V3 capture, used instead of pcap when possible */
+    int use_tpacket;
+    int tp_fd;
+    uint8_t *tp_ring;
+    size_t tp_ring_sz;
+
+    /* The kernel resets the ring statistics when they're read, so keep the
+     * running total of drops */
+    uint64_t tp_drops;
+
     char *interface;
     char *cap_interface;
 
     int datalink_type;
     int override_dlt;
 
+    /* Capture filter, built from the filter= expression and the frame type
+     * flags on the source definition, and applied in the kernel; NULL to capture
+     * everything */
+    char *filter;
+
+    /* Frames are cut to snaplen bytes before they're sent to the server; 0 to
+     * send the whole frame */
+    unsigned int snaplen;
+
     /* Do we use mac80211 controls or basic ioctls?  We have to split this for
      * broken interfaces */
     int use_mac80211_vif;
@@ -156,6 +202,12 @@ typedef struct {
     unsigned int unusual_center1;
     unsigned int center_freq1;
     unsigned int center_freq2;
+
+    /* mac80211 control message for the channel, built the first time we tune to
+     * it and re-sent every hop after that, and the interface it was built for */
+    void *control_msg;
+    int control_ifidx;
+    int control_id;
 } local_channel_t;
 
 /* Find an interface based on a mac address (or mac address prefix in the case
@@ -429,6 +481,17 @@ void *chantranslate_callback(kis_capture_handler_t *caph, char *chanstr) {
     return ret_localchan;
 }
 
+/* Free a local channel and the control message cached with it */
+void chanfree_callback(void *privchan) {
+    local_channel_t *channel = (local_channel_t *) privchan;
+
+    if (channel == NULL)
+        return;
+
+    mac80211_free_control_msg(channel->control_msg);
+    free(channel);
+}
+
 /* Convert a local interpretation of a channel back info a string;
  * 'chanstr' should hold at least STATUS_MAX characters; we'll never use
  * that many but it lets us do some cheaty stuff and re-use errstrs */
@@ -577,22 +640,46 @@ int chancontrol_callback(kis_capture_handler_t *caph, uint32_t seqno, void *priv
          * what kind of channel we're setting */
         /* fprintf(stderr, "debug - %s setting channel %d w %d\n", local_wifi->cap_interface, channel->control_freq, channel->chan_width); */
 
-        if (channel->chan_width != 0) {
-            /* An explicit channel width means we need to use _set_freq to set
-             * a control freq, a width, and possibly an extended center frequency
-             * for VHT; if center1 is 0 _set_frequency will automatically
-             * exclude it and only set the width */
-            r = mac80211_set_frequency_cache(local_wifi->mac80211_ifidx,
-                    local_wifi->mac80211_socket, local_wifi->mac80211_id,
-                    channel->control_freq, channel->chan_width,
-                    channel->center_freq1, channel->center_freq2, errstr);
-        } else {
-            /* Otherwise for HT40 and non-HT channels, set the channel w/ any
-             * flags present */
-            r = mac80211_set_channel_cache(local_wifi->mac80211_ifidx,
-                    local_wifi->mac80211_socket, local_wifi->mac80211_id,
-                    channel->control_freq, channel->chan_type, errstr);
-        } 
+        /* Build the control message once per channel and interface; hopping 
+         * then only has to send it */
+        if (channel->control_msg != NULL && 
+                (channel->control_ifidx != local_wifi->mac80211_ifidx ||
+                 channel->control_id != local_wifi->mac80211_id)) {
+            mac80211_free_control_msg(channel->control_msg);
+            channel->control_msg = NULL;
+        }
+
+        if (channel->control_msg == NULL) {
+            if (channel->chan_width != 0) {
+                /* An explicit channel width means we need to set a control 
+                 * freq, a width, and possibly an extended center frequency
+                 * for VHT; if center1 is 0 it is automatically excluded and 
+                 * only the width is set */
+                channel->control_msg = 
+                    mac80211_build_frequency_msg(local_wifi->mac80211_ifidx,
+                        local_wifi->mac80211_id, channel->control_freq, 
+                        channel->chan_width, channel->center_freq1, 
+                        channel->center_freq2, errstr);
+            } else {
+                /* Otherwise for HT40 and non-HT channels, set the channel w/ any
+                 * flags present */
+                channel->control_msg = 
+                    mac80211_build_channel_msg(local_wifi->mac80211_ifidx,
+                        local_wifi->mac80211_id, channel->control_freq, 
+                        channel->chan_type, errstr);
+            } 
+
+            channel->control_ifidx = local_wifi->mac80211_ifidx;
+            channel->control_id = local_wifi->mac80211_id;
+        }
+
+        if (channel->control_msg == NULL) {
+            r = -1;
+        } else if ((r = mac80211_send_control_msg(local_wifi->mac80211_socket,
+                        channel->control_msg)) < 0) {
+            snprintf(errstr, STATUS_MAX, "unable to set channel via mac80211: "
+                    "error code %d", r);
+        }
 
         /* Handle channel set results */
         if (r < 0) {
@@ -677,6 +764,465 @@ int probe_callback(kis_capture_handler_t *caph, uint32_t seqno, char *definition
     return 1;
 }
 
+/* Map the interface hardware type to the DLT pcap would have used for it */
+int tpacket_hw_to_dlt(int hwtype) {
+    switch (hwtype) {
+        case ARPHRD_IEEE80211_RADIOTAP:
+            return DLT_IEEE802_11_RADIO;
+        case ARPHRD_IEEE80211_PRISM:
+            return DLT_PRISM_HEADER;
+        case ARPHRD_IEEE80211:
+            return DLT_IEEE802_11;
+    }
+
+    return -1;
+}
+
+void tpacket_close(local_wifi_t *local_wifi) {
+    if (local_wifi->tp_ring != NULL) {
+        munmap(local_wifi->tp_ring, local_wifi->tp_ring_sz);
+        local_wifi->tp_ring = NULL;
+    }
+
+    if (local_wifi->tp_fd >= 0) {
+        close(local_wifi->tp_fd);
+        local_wifi->tp_fd = -1;
+    }
+}
+
+/* Add a clause to a capture filter expression */
+void filter_append_clause(char *filter, size_t filter_len, const char *clause) {
+    size_t len = strlen(filter);
+
+    snprintf(filter + len, filter_len - len, "%s%s", len ? " and " : "", clause);
+}
+
+/* Compile the capture filter with the given pcap handle.  With a snaplen set and
+ * no filter expression, this still produces a program:  one which accepts every
+ * frame, cut to the snaplen.
+ *
+ * Returns 1 and fills in prog, 0 if there is nothing to filter, or -1 and fills
+ * in errstr if the filter does not compile */
+int compile_filter(local_wifi_t *local_wifi, pcap_t *pd, struct bpf_program *prog,
+        char *errstr) {
+    char *expr = local_wifi->filter;
+
+    if (expr == NULL && local_wifi->snaplen == 0)
+        return 0;
+
+    if (expr == NULL)
+        expr = (char *) "";
+
+    if (pcap_compile(pd, prog, expr, 1, PCAP_NETMASK_UNKNOWN) < 0) {
+        snprintf(errstr, STATUS_MAX, "could not compile capture filter '%s': %s",
+                expr, pcap_geterr(pd));
+        return -1;
+    }
+
+    return 1;
+}
+
+/* Attach the capture filter to the packet ring socket.  The kernel runs it
+ * before a frame is put in the ring, and keeps only as many bytes of the frame
+ * as the program returns, so this also applies the snaplen */
+int tpacket_attach_filter(local_wifi_t *local_wifi, int dlt, char *errstr) {
+    pcap_t *pd;
+    struct bpf_program prog;
+    struct sock_fprog fprog;
+    int r;
+
+    pd = pcap_open_dead(dlt, 
+            local_wifi->snaplen ? local_wifi->snaplen : TPACKET_MAX_SNAPLEN);
+
+    if (pd == NULL) {
+        snprintf(errstr, STATUS_MAX, "could not create pcap handle for compiling "
+                "the capture filter");
+        return -1;
+    }
+
+    if ((r = compile_filter(local_wifi, pd, &prog, errstr)) <= 0) {
+        pcap_close(pd);
+        return r;
+    }
+
+    /* Classic BPF instructions from pcap have the same layout as the kernel's */
+    fprog.len = prog.bf_len;
+    fprog.filter = (struct sock_filter *) prog.bf_insns;
+
+    r = setsockopt(local_wifi->tp_fd, SOL_SOCKET, SO_ATTACH_FILTER, 
+            &fprog, sizeof(fprog));
+
+    pcap_freecode(&prog);
+    pcap_close(pd);
+
+    if (r < 0) {
+        snprintf(errstr, STATUS_MAX, "could not attach capture filter: %s",
+                strerror(errno));
+        return -1;
+    }
+
+    return 1;
+}
+
+/* Open a TPACKET_V3 receive ring on the capture interface.
+ *
+ * Returns the DLT of the interface, or -1 and fills in errstr if the ring could
+ * not be created and we should fall back to pcap */
+int tpacket_open(local_wifi_t *local_wifi, char *errstr) {
+    struct ifreq ifr;
+    struct sockaddr_ll sll;
+    struct tpacket_req3 req;
+    int version = TPACKET_V3;
+    int dlt;
+
+    local_wifi->tp_fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+
+    if (local_wifi->tp_fd < 0) {
+        snprintf(errstr, STATUS_MAX, "could not create packet socket: %s",
+                strerror(errno));
+        return -1;
+    }
+
+    memset(&ifr, 0, sizeof(struct ifreq));
+    strncpy(ifr.ifr_name, local_wifi->cap_interface, IFNAMSIZ - 1);
+
+    if (ioctl(local_wifi->tp_fd, SIOCGIFHWADDR, &ifr) < 0) {
+        snprintf(errstr, STATUS_MAX, "could not get hardware type: %s",
+                strerror(errno));
+        tpacket_close(local_wifi);
+        return -1;
+    }
+
+    if ((dlt = tpacket_hw_to_dlt(ifr.ifr_hwaddr.sa_family)) < 0) {
+        snprintf(errstr, STATUS_MAX, "unknown hardware type %d", 
+                ifr.ifr_hwaddr.sa_family);
+        tpacket_close(local_wifi);
+        return -1;
+    }
+
+    if (ioctl(local_wifi->tp_fd, SIOCGIFINDEX, &ifr) < 0) {
+        snprintf(errstr, STATUS_MAX, "could not get interface index: %s",
+                strerror(errno));
+        tpacket_close(local_wifi);
+        return -1;
+    }
+
+    if (setsockopt(local_wifi->tp_fd, SOL_PACKET, PACKET_VERSION, 
+                &version, sizeof(version)) < 0) {
+        snprintf(errstr, STATUS_MAX, "TPACKET_V3 not supported: %s",
+                strerror(errno));
+        tpacket_close(local_wifi);
+        return -1;
+    }
+
+    memset(&req, 0, sizeof(struct tpacket_req3));
+    req.tp_block_size = TPACKET_BLOCK_SZ;
+    req.tp_block_nr = TPACKET_BLOCK_NR;
+    req.tp_frame_size = TPACKET_FRAME_SZ;
+    req.tp_frame_nr = (TPACKET_BLOCK_SZ / TPACKET_FRAME_SZ) * TPACKET_BLOCK_NR;
+    req.tp_retire_blk_tov = TPACKET_RETIRE_MSEC;
+
+    if (setsockopt(local_wifi->tp_fd, SOL_PACKET, PACKET_RX_RING,
+                &req, sizeof(req)) < 0) {
+        snprintf(errstr, STATUS_MAX, "could not create capture ring: %s",
+                strerror(errno));
+        tpacket_close(local_wifi);
+        return -1;
+    }
+
+    local_wifi->tp_ring_sz = (size_t) req.tp_block_size * req.tp_block_nr;
+    local_wifi->tp_ring = (uint8_t *) mmap(NULL, local_wifi->tp_ring_sz,
+            PROT_READ | PROT_WRITE, MAP_SHARED, 
+            local_wifi->tp_fd, 0);
+
+    if (local_wifi->tp_ring == MAP_FAILED) {
+        local_wifi->tp_ring = NULL;
+        snprintf(errstr, STATUS_MAX, "could not map capture ring: %s",
+                strerror(errno));
+        tpacket_close(local_wifi);
+        return -1;
+    }
+
+    /* Filter before binding, so that nothing unfiltered reaches the ring */
+    if (tpacket_attach_filter(local_wifi, dlt, errstr) < 0) {
+        tpacket_close(local_wifi);
+        return -1;
+    }
+
+    memset(&sll, 0, sizeof(struct sockaddr_ll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    sll.sll_ifindex = ifr.ifr_ifindex;
+
+    if (bind(local_wifi->tp_fd, (struct sockaddr *) &sll, sizeof(sll)) < 0) {
+        snprintf(errstr, STATUS_MAX, "could not bind to interface: %s",
+                strerror(errno));
+        tpacket_close(local_wifi);
+        return -1;
+    }
+
+    return dlt;
+}
+
+/* Report the frames the kernel dropped because we weren't keeping up */
+int dropstats_callback(kis_capture_handler_t *caph, uint64_t *ret_drops) {
+    local_wifi_t *local_wifi = (local_wifi_t *) caph->userdata;
+
+    if (local_wifi->use_tpacket) {
+        struct tpacket_stats_v3 st;
+        socklen_t st_len = sizeof(st);
+
+        if (local_wifi->tp_fd < 0)
+            return -1;
+
+        if (getsockopt(local_wifi->tp_fd, SOL_PACKET, PACKET_STATISTICS, 
+                    &st, &st_len) < 0)
+            return -1;
+
+        local_wifi->tp_drops += st.tp_drops;
+        *ret_drops = local_wifi->tp_drops;
+
+        return 0;
+    }
+
+    if (local_wifi->pd != NULL) {
+        struct pcap_stat ps;
+
+        if (pcap_stats(local_wifi->pd, &ps) < 0)
+            return -1;
+
+        *ret_drops = ps.ps_drop;
+
+        return 0;
+    }
+
+    return -1;
+}
+
+/* Under backpressure shed data frames first; devices are discovered and 
+ * tracked mostly from management frames */
+int shed_callback(kis_capture_handler_t *caph, uint32_t packet_sz, uint8_t *pack) {
+    local_wifi_t *local_wifi = (local_wifi_t *) caph->userdata;
+    uint32_t offt;
+
+    switch (local_wifi->datalink_type) {
+        case DLT_IEEE802_11_RADIO:
+            if (packet_sz < 4)
+                return 0;
+
+            /* Radiotap header length is little-endian */
+            offt = pack[2] | (pack[3] << 8);
+            break;
+        case DLT_IEEE802_11:
+            offt = 0;
+            break;
+        default:
+            return 0;
+    }
+
+    if (packet_sz < offt + 2)
+        return 0;
+
+    /* Frame type 2 is data */
+    return ((pack[offt] >> 2) & 0x03) == 2;
+}
+
+/* Reduce a frame to its 802.11 header and the radiotap signal, frequency, and
+ * rate, for sources opened with 'metadata=true' */
+int metadata_callback(kis_capture_handler_t *caph, uint32_t packet_sz, uint8_t *pack,
+        simple_cap_proto_metaframe_t *ret_meta) {
+    local_wifi_t *local_wifi = (local_wifi_t *) caph->userdata;
+    uint32_t it_len = 0, present = 0, word, offt, fcs = 0;
+    uint32_t frame_len, hdr_len;
+    uint8_t *frame;
+    unsigned int bit;
+
+    switch (local_wifi->datalink_type) {
+        case DLT_IEEE802_11_RADIO:
+            if (packet_sz < 8)
+                return 0;
+
+            /* Radiotap fields are little-endian */
+            it_len = pack[2] | (pack[3] << 8);
+            present = pack[4] | (pack[5] << 8) | (pack[6] << 16) | 
+                ((uint32_t) pack[7] << 24);
+
+            if (it_len > packet_sz)
+                return 0;
+
+            break;
+        case DLT_IEEE802_11:
+            break;
+        default:
+            return 0;
+    }
+
+    /* Only the fields up to the noise are needed, and none of them are in
+     * extended presence bitmaps */
+    offt = 8;
+    word = present;
+    while (it_len != 0 && (word & 0x80000000)) {
+        if (offt + 4 > it_len)
+            return 0;
+
+        word = pack[offt] | (pack[offt + 1] << 8) | (pack[offt + 2] << 16) |
+            ((uint32_t) pack[offt + 3] << 24);
+        offt += 4;
+    }
+
+    for (bit = 0; it_len != 0 && bit <= 6; bit++) {
+        if ((present & (1 << bit)) == 0)
+            continue;
+
+        switch (bit) {
+            case 0:
+                /* TSFT */
+                offt = ((offt + 7) & ~7) + 8;
+                break;
+            case 1:
+                /* Flags; 0x10 is a trailing FCS */
+                if (offt + 1 <= it_len && (pack[offt] & 0x10))
+                    fcs = 4;
+                offt += 1;
+                break;
+            case 2:
+                /* Rate, in 500kbit/s, in the units the server uses */
+                if (offt + 1 <= it_len) {
+                    ret_meta->datarate = htons(((pack[offt] & ~0x80) / 2) * 10);
+                    ret_meta->flags |= SIMPLE_CAP_METAFRAME_RATE;
+                }
+                offt += 1;
+                break;
+            case 3:
+                /* Channel frequency and flags */
+                offt = (offt + 1) & ~1;
+                if (offt + 4 <= it_len) {
+                    ret_meta->freq_khz = 
+                        htonl((uint32_t) (pack[offt] | (pack[offt + 1] << 8)) * 1000);
+                    ret_meta->flags |= SIMPLE_CAP_METAFRAME_FREQ;
+                }
+                offt += 4;
+                break;
+            case 4:
+                /* FHSS */
+                offt = ((offt + 1) & ~1) + 2;
+                break;
+            case 5:
+                if (offt + 1 <= it_len) {
+                    ret_meta->signal_dbm = (int8_t) pack[offt];
+                    ret_meta->flags |= SIMPLE_CAP_METAFRAME_SIGNAL;
+                }
+                offt += 1;
+                break;
+            case 6:
+                if (offt + 1 <= it_len) {
+                    ret_meta->noise_dbm = (int8_t) pack[offt];
+                    ret_meta->flags |= SIMPLE_CAP_METAFRAME_NOISE;
+                }
+                offt += 1;
+                break;
+        }
+    }
+
+    if (packet_sz < it_len + fcs + 10)
+        return 0;
+
+    frame = pack + it_len;
+    frame_len = packet_sz - it_len - fcs;
+
+    /* Keep the header of data frames, with the fourth address and the QoS and
+     * HT control fields when they're there; management frames keep their fixed
+     * parameters, and control frames are all header */
+    switch ((frame[0] >> 2) & 0x03) {
+        case 0:
+            hdr_len = SIMPLE_CAP_METAFRAME_HDR_MAX;
+            break;
+        case 1:
+            hdr_len = 24;
+            break;
+        case 2:
+            hdr_len = 24;
+
+            if ((frame[1] & 0x03) == 0x03)
+                hdr_len += 6;
+
+            if (frame[0] & 0x80) {
+                hdr_len += 2;
+
+                if (frame[1] & 0x80)
+                    hdr_len += 4;
+            }
+
+            break;
+        default:
+            return 0;
+    }
+
+    if (hdr_len > frame_len)
+        hdr_len = frame_len;
+
+    ret_meta->orig_len = htonl(frame_len);
+    ret_meta->hdr_len = hdr_len;
+    memcpy(ret_meta->hdr, frame, hdr_len);
+
+    return 1;
+}
+
+/* A frame cut short by the snaplen has lost its trailing FCS; if the radiotap
+ * header says there is one, send a copy with the FCS flag cleared so that the
+ * server doesn't try to validate a checksum which isn't there.
+ *
+ * Returns the data to send; either the original frame or the copy in buf */
+uint8_t *snaplen_fix_fcs(local_wifi_t *local_wifi, uint8_t *buf, 
+        uint32_t caplen, uint32_t len, uint8_t *data) {
+    uint32_t it_len, present, word, offt;
+
+    if (caplen >= len || local_wifi->datalink_type != DLT_IEEE802_11_RADIO)
+        return data;
+
+    if (caplen < 8 || caplen > MAX_PACKET_LEN)
+        return data;
+
+    /* Radiotap fields are little-endian */
+    it_len = data[2] | (data[3] << 8);
+    present = data[4] | (data[5] << 8) | (data[6] << 16) | ((uint32_t) data[7] << 24);
+
+    if (it_len > caplen)
+        return data;
+
+    /* Flags are field 1 */
+    if ((present & 0x02) == 0)
+        return data;
+
+    /* Skip any extended presence bitmaps */
+    offt = 8;
+    word = present;
+    while (word & 0x80000000) {
+        if (offt + 4 > it_len)
+            return data;
+
+        word = data[offt] | (data[offt + 1] << 8) | (data[offt + 2] << 16) |
+            ((uint32_t) data[offt + 3] << 24);
+        offt += 4;
+    }
+
+    /* The only field before the flags is the 8-byte aligned TSFT */
+    if (present & 0x01)
+        offt = ((offt + 7) & ~7) + 8;
+
+    if (offt >= it_len)
+        return data;
+
+    /* Flag 0x10, frame includes FCS */
+    if ((data[offt] & 0x10) == 0)
+        return data;
+
+    memcpy(buf, data, caplen);
+    buf[offt] &= ~0x10;
+
+    return buf;
+}
+
 int open_callback(kis_capture_handler_t *caph, uint32_t seqno, char *definition,
         char *msg, uint32_t *dlt, char **uuid, simple_cap_proto_frame_t *frame,
         cf_params_interface_t **ret_interface,
@@ -758,6 +1304,8 @@ int open_callback(kis_capture_handler_t *caph, uint32_t seqno, char *definition,
         local_wifi->pd = NULL;
     }
 
+    tpacket_close(local_wifi);
+
     /* Start processing the open */
 
     if ((placeholder_len = cf_parse_interface(&placeholder, definition)) <= 0) {
@@ -1264,22 +1812,145 @@ int open_callback(kis_capture_handler_t *caph, uint32_t seqno, char *definition,
         cf_send_message(caph, errstr, MSGFLAG_INFO);
 
         if (chancontrol_callback(caph, 0, localchan, msg) < 0) {
+            chanfree_callback(localchan);
             return -1;
         }
+
+        chanfree_callback(localchan);
     }
 
-    /* Open the pcap */
-    local_wifi->pd = pcap_open_live(local_wifi->cap_interface, 
-            MAX_PACKET_LEN, 1, 1000, pcap_errstr);
+    /* Build the capture filter from the filter expression and the frame types
+     * we've been asked to ignore; it's run in the kernel, so filtered frames
+     * never reach us or the server */
+    if (local_wifi->filter != NULL) {
+        free(local_wifi->filter);
+        local_wifi->filter = NULL;
+    }
 
-    if (local_wifi->pd == NULL || strlen(pcap_errstr) != 0) {
-        snprintf(msg, STATUS_MAX, "Could not open capture interface '%s' on '%s' "
-                "as a pcap capture: %s", local_wifi->cap_interface, 
-                local_wifi->interface, pcap_errstr);
-        return -1;
+    {
+        char *user_filter = NULL;
+        int ignore_data = 0, ignore_ctrl = 0;
+        size_t filter_len;
+
+        if ((placeholder_len = cf_find_flag(&placeholder, "filter", definition)) > 0) {
+            user_filter = strndup(placeholder, placeholder_len);
+        }
+
+        if ((placeholder_len = cf_find_flag(&placeholder, "ignoredata", 
+                        definition)) > 0) {
+            if (strncasecmp(placeholder, "true", placeholder_len) == 0)
+                ignore_data = 1;
+        }
+
+        if ((placeholder_len = cf_find_flag(&placeholder, "ignorecontrol", 
+                        definition)) > 0) {
+            if (strncasecmp(placeholder, "true", placeholder_len) == 0)
+                ignore_ctrl = 1;
+        }
+
+        if (user_filter != NULL || ignore_data || ignore_ctrl) {
+            filter_len = (user_filter == NULL ? 0 : strlen(user_filter)) + 64;
+            local_wifi->filter = (char *) malloc(filter_len);
+
+            local_wifi->filter[0] = 0;
+
+            if (user_filter != NULL)
+                snprintf(local_wifi->filter, filter_len, "(%s)", user_filter);
+
+            if (ignore_data)
+                filter_append_clause(local_wifi->filter, filter_len, "not type data");
+
+            if (ignore_ctrl)
+                filter_append_clause(local_wifi->filter, filter_len, "not type ctl");
+
+            snprintf(errstr, STATUS_MAX, "Source '%s' filtering captured frames "
+                    "with '%s'", local_wifi->interface, local_wifi->filter);
+            cf_send_message(caph, errstr, MSGFLAG_INFO);
+        }
+
+        if (user_filter != NULL)
+            free(user_filter);
+    }
+
+    local_wifi->snaplen = 0;
+
+    if ((placeholder_len = cf_find_flag(&placeholder, "snaplen", definition)) > 0) {
+        char *snapstr = strndup(placeholder, placeholder_len);
+        int snaplen = atoi(snapstr);
+        free(snapstr);
+
+        if (snaplen > 0) {
+            if (snaplen < MIN_SNAPLEN)
+                snaplen = MIN_SNAPLEN;
+            if (snaplen > MAX_PACKET_LEN)
+                snaplen = MAX_PACKET_LEN;
+
+            local_wifi->snaplen = snaplen;
+
+            snprintf(errstr, STATUS_MAX, "Source '%s' sending the first %u bytes "
+                    "of each frame", local_wifi->interface, local_wifi->snaplen);
+            cf_send_message(caph, errstr, MSGFLAG_INFO);
+        }
+    }
+
+    /* Try to capture from a mmapped packet ring, unless we've been told not to */
+    local_wifi->use_tpacket = 1;
+
+    if ((placeholder_len = cf_find_flag(&placeholder, "tpacket", definition)) > 0) {
+        if (strncasecmp(placeholder, "false", placeholder_len) == 0) {
+            local_wifi->use_tpacket = 0;
+        }
+    }
+
+    if (local_wifi->use_tpacket) {
+        local_wifi->datalink_type = tpacket_open(local_wifi, errstr);
+
+        if (local_wifi->datalink_type < 0) {
+            snprintf(errstr2, STATUS_MAX, "Could not capture from '%s' with a "
+                    "TPACKET_V3 ring (%s), falling back to pcap", 
+                    local_wifi->cap_interface, errstr);
+            cf_send_message(caph, errstr2, MSGFLAG_INFO);
+            local_wifi->use_tpacket = 0;
+        }
+    }
+
+    if (!local_wifi->use_tpacket) {
+        /* Open the pcap */
+        local_wifi->pd = pcap_open_live(local_wifi->cap_interface, 
+                local_wifi->snaplen ? local_wifi->snaplen : MAX_PACKET_LEN, 
+                1, 1000, pcap_errstr);
+
+        if (local_wifi->pd == NULL || strlen(pcap_errstr) != 0) {
+            snprintf(msg, STATUS_MAX, "Could not open capture interface '%s' on '%s' "
+                    "as a pcap capture: %s", local_wifi->cap_interface, 
+                    local_wifi->interface, pcap_errstr);
+            return -1;
+        }
+
+        local_wifi->datalink_type = pcap_datalink(local_wifi->pd);
+
+        if (local_wifi->filter != NULL) {
+            struct bpf_program prog;
+
+            if (compile_filter(local_wifi, local_wifi->pd, &prog, errstr) < 0) {
+                snprintf(msg, STATUS_MAX, "Could not filter capture interface '%s' "
+                        "on '%s': %s", local_wifi->cap_interface, 
+                        local_wifi->interface, errstr);
+                return -1;
+            }
+
+            if (pcap_setfilter(local_wifi->pd, &prog) < 0) {
+                snprintf(msg, STATUS_MAX, "Could not filter capture interface '%s' "
+                        "on '%s': %s", local_wifi->cap_interface, 
+                        local_wifi->interface, pcap_geterr(local_wifi->pd));
+                pcap_freecode(&prog);
+                return -1;
+            }
+
+            pcap_freecode(&prog);
+        }
     }
 
-    local_wifi->datalink_type = pcap_datalink(local_wifi->pd);
     *dlt = local_wifi->datalink_type;
 
     if (strcmp(local_wifi->interface, local_wifi->cap_interface) != 0) {
@@ -1377,10 +2048,15 @@ void pcap_dispatch_cb(u_char *user, const struct pcap_pkthdr *header,
         const u_char *data)  {
     kis_capture_handler_t *caph = (kis_capture_handler_t *) user;
     local_wifi_t *local_wifi = (local_wifi_t *) caph->userdata;
+    uint8_t snapbuf[MAX_PACKET_LEN];
+    uint8_t *send_data;
     int ret;
 
     /* fprintf(stderr, "debug - pcap_dispatch - got packet %u\n", header->caplen); */
 
+    send_data = snaplen_fix_fcs(local_wifi, snapbuf, header->caplen, header->len,
+            (uint8_t *) data);
+
     /* Try repeatedly to send the packet; go into a thread wait state if
      * the write buffer is full & we'll be woken up as soon as it flushes
      * data out in the main select() loop */
@@ -1388,7 +2064,7 @@ void pcap_dispatch_cb(u_char *user, const struct pcap_pkthdr *header,
         if ((ret = cf_send_data(caph, 
                         NULL, NULL, NULL,
                         header->ts, 
-                        header->caplen, (uint8_t *) data)) < 0) {
+                        header->caplen, send_data)) < 0) {
             pcap_breakloop(local_wifi->pd);
             cf_send_error(caph, "unable to send DATA frame");
             cf_handler_spindown(caph);
@@ -1402,24 +2078,121 @@ void pcap_dispatch_cb(u_char *user, const struct pcap_pkthdr *header,
     }
 }
 
+/* Send every packet in a block the kernel has handed us; returns -1 if we
+ * can no longer send data */
+int tpacket_dispatch_block(kis_capture_handler_t *caph, 
+        struct tpacket_block_desc *block) {
+    local_wifi_t *local_wifi = (local_wifi_t *) caph->userdata;
+    struct tpacket3_hdr *hdr;
+    struct timeval ts;
+    uint8_t snapbuf[MAX_PACKET_LEN];
+    uint8_t *send_data;
+    uint32_t p;
+    int ret;
+
+    hdr = (struct tpacket3_hdr *) 
+        ((uint8_t *) block + block->hdr.bh1.offset_to_first_pkt);
+
+    for (p = 0; p < block->hdr.bh1.num_pkts; p++) {
+        ts.tv_sec = hdr->tp_sec;
+        ts.tv_usec = hdr->tp_nsec / 1000;
+
+        send_data = snaplen_fix_fcs(local_wifi, snapbuf, hdr->tp_snaplen, 
+                hdr->tp_len, (uint8_t *) hdr + hdr->tp_mac);
+
+        /* As with pcap, wait for the write buffer to flush if it's full */
+        while (1) {
+            if ((ret = cf_send_data(caph, 
+                            NULL, NULL, NULL, ts,
+                            hdr->tp_snaplen, send_data)) < 0) {
+                return -1;
+            } else if (ret == 0) {
+                cf_handler_wait_ringbuffer(caph);
+                continue;
+            } else {
+                break;
+            }
+        }
+
+        hdr = (struct tpacket3_hdr *) ((uint8_t *) hdr + hdr->tp_next_offset);
+    }
+
+    return 1;
+}
+
+/* Capture loop for the TPACKET_V3 ring:  wait for the kernel to retire a block,
+ * send all of its packets, and return the block to the kernel */
+void tpacket_capture(kis_capture_handler_t *caph, char *errstr) {
+    local_wifi_t *local_wifi = (local_wifi_t *) caph->userdata;
+    struct tpacket_block_desc *block;
+    struct pollfd pfd;
+    unsigned int block_num = 0;
+    int ret;
+
+    pfd.fd = local_wifi->tp_fd;
+    pfd.events = POLLIN | POLLERR;
+
+    while (!caph->spindown) {
+        block = (struct tpacket_block_desc *) 
+            (local_wifi->tp_ring + ((size_t) block_num * TPACKET_BLOCK_SZ));
+
+        if ((block->hdr.bh1.block_status & TP_STATUS_USER) == 0) {
+            pfd.revents = 0;
+
+            ret = poll(&pfd, 1, 1000);
+
+            if (ret < 0 && errno != EINTR) {
+                snprintf(errstr, STATUS_MAX, "Interface '%s' closed: %s",
+                        local_wifi->cap_interface, strerror(errno));
+                return;
+            }
+
+            if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+                snprintf(errstr, STATUS_MAX, "Interface '%s' closed: "
+                        "interface closed", local_wifi->cap_interface);
+                return;
+            }
+
+            continue;
+        }
+
+        if (tpacket_dispatch_block(caph, block) < 0) {
+            snprintf(errstr, STATUS_MAX, "unable to send DATA frame");
+            return;
+        }
+
+        block->hdr.bh1.block_status = TP_STATUS_KERNEL;
+        __sync_synchronize();
+
+        block_num = (block_num + 1) % TPACKET_BLOCK_NR;
+    }
+
+    snprintf(errstr, STATUS_MAX, "Interface '%s' closed: capture stopped",
+            local_wifi->cap_interface);
+}
+
 void capture_thread(kis_capture_handler_t *caph) {
     local_wifi_t *local_wifi = (local_wifi_t *) caph->userdata;
-    char errstr[PCAP_ERRBUF_SIZE];
+    char errstr[STATUS_MAX];
     char *pcap_errstr;
     char iferrstr[STATUS_MAX];
     int ifflags = 0, ifret;
 
-    /* Simple capture thread: since we don't care about blocking and 
-     * channel control is managed by the channel hopping thread, all we have
-     * to do is enter a blocking pcap loop */
+    if (local_wifi->use_tpacket) {
+        tpacket_capture(caph, errstr);
+    } else {
+        /* Simple capture thread: since we don't care about blocking and 
+         * channel control is managed by the channel hopping thread, all we have
+         * to do is enter a blocking pcap loop */
 
-    pcap_loop(local_wifi->pd, -1, pcap_dispatch_cb, (u_char *) caph);
+        pcap_loop(local_wifi->pd, -1, pcap_dispatch_cb, (u_char *) caph);
 
-    pcap_errstr = pcap_geterr(local_wifi->pd);
+        pcap_errstr = pcap_geterr(local_wifi->pd);
 
-    snprintf(errstr, PCAP_ERRBUF_SIZE, "Interface '%s' closed: %s", 
-            local_wifi->cap_interface, 
-            strlen(pcap_errstr) == 0 ? "interface closed" : pcap_errstr );
+        snprintf(errstr, PCAP_ERRBUF_SIZE, "Interface '%s' closed: %s", 
+                local_wifi->cap_interface, 
+                strlen(pcap_errstr) == 0 ? "interface closed" : pcap_errstr );
+    }
 
     cf_send_error(caph, errstr);
 
@@ -1436,26 +2209,143 @@ void capture_thread(kis_capture_handler_t *caph) {
     cf_handler_spindown(caph);
 }
 
-int main(int argc, char *argv[]) {
-    local_wifi_t local_wifi = {
-        .pd = NULL,
-        .interface = NULL,
-        .cap_interface = NULL,
-        .datalink_type = -1,
-        .override_dlt = -1,
-        .use_mac80211_vif = 1,
-        .use_mac80211_channels = 1,
-        .mac80211_socket = NULL,
-        .seq_channel_failure = 0,
-        .reset_nm_management = 0,
-    };
+/* State of an interface before it's opened */
+static const local_wifi_t local_wifi_defaults = {
+    .pd = NULL,
+    .use_tpacket = 0,
+    .tp_fd = -1,
+    .tp_drops = 0,
+    .tp_ring = NULL,
+    .tp_ring_sz = 0,
+    .interface = NULL,
+    .cap_interface = NULL,
+    .datalink_type = -1,
+    .override_dlt = -1,
+    .filter = NULL,
+    .snaplen = 0,
+    .use_mac80211_vif = 1,
+    .use_mac80211_channels = 1,
+    .mac80211_socket = NULL,
+    .seq_channel_failure = 0,
+    .reset_nm_management = 0,
+};
+
+/* Set the callbacks of a handler for an interface */
+void setup_handler(kis_capture_handler_t *caph, local_wifi_t *local_wifi) {
+    /* Set the local data ptr */
+    cf_handler_set_userdata(caph, local_wifi);
 
+    /* Set the callback for opening  */
+    cf_handler_set_open_cb(caph, open_callback);
+
+    /* Set the callback for probing an interface */
+    cf_handler_set_probe_cb(caph, probe_callback);
+
+    /* Set the list callback */
+    cf_handler_set_listdevices_cb(caph, list_callback);
+
+    /* Set the translation cb */
+    cf_handler_set_chantranslate_cb(caph, chantranslate_callback);
+    cf_handler_set_chanfree_cb(caph, chanfree_callback);
+
+    /* Set the control cb */
+    cf_handler_set_chancontrol_cb(caph, chancontrol_callback);
+
+    /* Set the capture thread */
+    cf_handler_set_capture_cb(caph, capture_thread);
+
+    /* Report kernel drops, and shed data frames under backpressure */
+    cf_handler_set_dropstats_cb(caph, dropstats_callback);
+    cf_handler_set_shed_cb(caph, shed_callback);
+
+    /* Reduce frames to their headers for metadata-only sources */
+    cf_handler_set_metadata_cb(caph, metadata_callback);
+
+    /* Set a channel hop spacing of 4 to get the most out of 2.4 overlap;
+     * it does nothing and hurts nothing on 5ghz */
+    cf_handler_set_hop_shuffle_spacing(caph, 4);
+}
+
+/* Try to reset the networkmanager awareness of the interface */
+void restore_nm_management(local_wifi_t *local_wifi) {
 #ifdef HAVE_LIBNM
     NMClient *nmclient = NULL;
     const GPtrArray *nmdevices;
     GError *nmerror = NULL;
     int i;
+
+    if (!local_wifi->reset_nm_management || local_wifi->interface == NULL)
+        return;
+
+    nmclient = nm_client_new(NULL, &nmerror);
+
+    if (nmclient != NULL) {
+        if (nm_client_get_nm_running(nmclient)) {
+            nmdevices = nm_client_get_devices(nmclient);
+
+            if (nmdevices != NULL) {
+                for (i = 0; i < nmdevices->len; i++) {
+                    const NMDevice *d = g_ptr_array_index(nmdevices, i);
+
+                    if (strcmp(nm_device_get_iface((NMDevice *) d), 
+                                local_wifi->interface) == 0) {
+                        nm_device_set_managed((NMDevice *) d, 1);
+                        break;
+                    }
+                }
+            }
+        }
+
+        g_object_unref(nmclient);
+    }
 #endif
+}
+
+/* A shared helper gives each source a channel with its own interface state */
+int muxchannel_callback(kis_capture_handler_t *caph, int in_release) {
+    local_wifi_t *local_wifi;
+
+    if (in_release) {
+        local_wifi = (local_wifi_t *) caph->userdata;
+
+        if (local_wifi == NULL)
+            return 0;
+
+        if (local_wifi->pd != NULL)
+            pcap_close(local_wifi->pd);
+
+        tpacket_close(local_wifi);
+
+        if (local_wifi->mac80211_socket != NULL)
+            mac80211_disconnect(local_wifi->mac80211_socket);
+
+        restore_nm_management(local_wifi);
+
+        if (local_wifi->interface != NULL)
+            free(local_wifi->interface);
+        if (local_wifi->cap_interface != NULL)
+            free(local_wifi->cap_interface);
+        if (local_wifi->filter != NULL)
+            free(local_wifi->filter);
+
+        free(local_wifi);
+        caph->userdata = NULL;
+
+        return 0;
+    }
+
+    if ((local_wifi = (local_wifi_t *) malloc(sizeof(local_wifi_t))) == NULL)
+        return -1;
+
+    *local_wifi = local_wifi_defaults;
+
+    setup_handler(caph, local_wifi);
+
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    local_wifi_t local_wifi = local_wifi_defaults;
 
 #if 0
     /* Remap stderr so we can log debugging to a file */
@@ -1475,30 +2365,10 @@ int main(int argc, char *argv[]) {
         return -1;
     }
 
-    /* Set the local data ptr */
-    cf_handler_set_userdata(caph, &local_wifi);
-
-    /* Set the callback for opening  */
-    cf_handler_set_open_cb(caph, open_callback);
-
-    /* Set the callback for probing an interface */
-    cf_handler_set_probe_cb(caph, probe_callback);
-
-    /* Set the list callback */
-    cf_handler_set_listdevices_cb(caph, list_callback);
-
-    /* Set the translation cb */
-    cf_handler_set_chantranslate_cb(caph, chantranslate_callback);
-
-    /* Set the control cb */
-    cf_handler_set_chancontrol_cb(caph, chancontrol_callback);
-
-    /* Set the capture thread */
-    cf_handler_set_capture_cb(caph, capture_thread);
+    setup_handler(caph, &local_wifi);
 
-    /* Set a channel hop spacing of 4 to get the most out of 2.4 overlap;
-     * it does nothing and hurts nothing on 5ghz */
-    cf_handler_set_hop_shuffle_spacing(caph, 4);
+    /* One helper can capture from several interfaces */
+    cf_handler_set_muxchannel_cb(caph, muxchannel_callback);
 
     if (cf_handler_parse_opts(caph, argc, argv) < 1) {
         cf_print_help(caph, argv[0]);
@@ -1508,32 +2378,7 @@ int main(int argc, char *argv[]) {
     cf_handler_loop(caph);
 
     /* We're done - try to reset the networkmanager awareness of the interface */
-
-#ifdef HAVE_LIBNM
-    if (local_wifi.reset_nm_management) {
-        nmclient = nm_client_new(NULL, &nmerror);
-
-        if (nmclient != NULL) {
-            if (nm_client_get_nm_running(nmclient)) {
-                nmdevices = nm_client_get_devices(nmclient);
-
-                if (nmdevices != NULL) {
-                    for (i = 0; i < nmdevices->len; i++) {
-                        const NMDevice *d = g_ptr_array_index(nmdevices, i);
-
-                        if (strcmp(nm_device_get_iface((NMDevice *) d), 
-                                    local_wifi.interface) == 0) {
-                            nm_device_set_managed((NMDevice *) d, 1);
-                            break;
-                        }
-                    }
-                }
-            }
-
-            g_object_unref(nmclient);
-        }
-    }
-#endif
+    restore_nm_management(&local_wifi);
 
     cf_handler_free(caph);
 
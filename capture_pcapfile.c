@@ -36,6 +36,11 @@
  * allows us to expand to interesting options, like realtime pcap replay which
  * delays the IO as if they were real packets.
  *
+ * Regular pcap and pcapng files are memory-mapped and walked directly, which is
+ * much faster than reading them through libpcap; anything else (a fifo, or a
+ * file we can't map) is read with libpcap.  Playback runs as fast as the server
+ * can take packets, at the original capture rate, or at a multiple of it.
+ *
  * The DLT is automatically propagated from the pcap file, or can be overridden
  * with a source command.
  *
@@ -60,8 +65,11 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 
+#include <sys/mman.h>
+
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
 
 #include <arpa/inet.h>
 
@@ -69,15 +77,281 @@
 #include "simple_datasource_proto.h"
 #include "capture_framework.h"
 
+/* pcap and pcapng magic values */
+#define PCAP_MAGIC_USEC         0xA1B2C3D4
+#define PCAP_MAGIC_NSEC         0xA1B23C4D
+#define PCAPNG_SHB              0x0A0D0D0A
+#define PCAPNG_BYTE_ORDER       0x1A2B3C4D
+
+/* pcapng block types we understand */
+#define PCAPNG_IDB              0x00000001
+#define PCAPNG_OPB              0x00000002
+#define PCAPNG_SPB              0x00000003
+#define PCAPNG_EPB              0x00000006
+
+/* Interface description option for the timestamp resolution */
+#define PCAPNG_OPT_ENDOFOPT     0
+#define PCAPNG_OPT_IF_TSRESOL   9
+
+/* Most pcapng interfaces we track in one section */
+#define PCAPNG_MAX_INTERFACES   64
+
+#define MMAP_FORMAT_PCAP        1
+#define MMAP_FORMAT_PCAPNG      2
+
 typedef struct {
     pcap_t *pd;
     char *pcapfname;
     int datalink_type;
     int override_dlt;
-    int realtime;
-    struct timeval last_ts;
+
+    /* Playback speed as a multiple of the original capture rate; 0 to replay as
+     * fast as the server takes packets */
+    double speed;
+
+    /* Wall clock time and packet time of the first replayed packet */
+    int pace_started;
+    struct timespec pace_wall;
+    struct timeval pace_ts;
+
+    /* Memory-mapped file, used instead of libpcap when possible */
+    int use_mmap;
+    int map_fd;
+    uint8_t *map;
+    size_t map_sz;
+    size_t map_pos;
+    int map_format;
+    int map_swapped;
+
+    /* Classic pcap:  are timestamps in nanoseconds? */
+    int map_nsec;
+
+    /* pcapng interfaces in the current section:  DLT and timestamp units per
+     * second */
+    unsigned int ng_num_interfaces;
+    int ng_dlt[PCAPNG_MAX_INTERFACES];
+    uint64_t ng_tsunits[PCAPNG_MAX_INTERFACES];
+
+    /* Packets skipped because their interface had a different DLT */
+    uint64_t ng_skipped;
 } local_pcap_t;
 
+static uint32_t map_u32(local_pcap_t *local_pcap, const uint8_t *p) {
+    uint32_t v;
+
+    memcpy(&v, p, 4);
+
+    if (local_pcap->map_swapped)
+        return ((v & 0xFF) << 24) | ((v & 0xFF00) << 8) | 
+            ((v >> 8) & 0xFF00) | ((v >> 24) & 0xFF);
+
+    return v;
+}
+
+static uint16_t map_u16(local_pcap_t *local_pcap, const uint8_t *p) {
+    uint16_t v;
+
+    memcpy(&v, p, 2);
+
+    if (local_pcap->map_swapped)
+        return (uint16_t) ((v << 8) | (v >> 8));
+
+    return v;
+}
+
+void mmap_close(local_pcap_t *local_pcap) {
+    if (local_pcap->map != NULL) {
+        munmap(local_pcap->map, local_pcap->map_sz);
+        local_pcap->map = NULL;
+    }
+
+    if (local_pcap->map_fd >= 0) {
+        close(local_pcap->map_fd);
+        local_pcap->map_fd = -1;
+    }
+
+    local_pcap->map_sz = 0;
+    local_pcap->map_pos = 0;
+}
+
+/* Read a pcapng interface description block into the interface table */
+static void pcapng_parse_idb(local_pcap_t *local_pcap, const uint8_t *body, 
+        size_t body_sz) {
+    unsigned int ifnum = local_pcap->ng_num_interfaces;
+    size_t pos;
+
+    if (body_sz < 8 || ifnum >= PCAPNG_MAX_INTERFACES)
+        return;
+
+    local_pcap->ng_dlt[ifnum] = map_u16(local_pcap, body);
+    local_pcap->ng_tsunits[ifnum] = 1000000;
+
+    /* Walk the options looking for the timestamp resolution */
+    pos = 8;
+    while (pos + 4 <= body_sz) {
+        uint16_t code = map_u16(local_pcap, body + pos);
+        uint16_t len = map_u16(local_pcap, body + pos + 2);
+
+        pos += 4;
+
+        if (code == PCAPNG_OPT_ENDOFOPT || pos + len > body_sz)
+            break;
+
+        if (code == PCAPNG_OPT_IF_TSRESOL && len >= 1) {
+            uint8_t res = body[pos];
+            uint64_t units = 1;
+            unsigned int i;
+
+            /* High bit set is a power of 2, otherwise a power of 10 */
+            if (res & 0x80) {
+                if ((res & 0x7F) < 64)
+                    units = 1ULL << (res & 0x7F);
+            } else {
+                for (i = 0; i < res && i < 19; i++)
+                    units *= 10;
+            }
+
+            local_pcap->ng_tsunits[ifnum] = units;
+        }
+
+        /* Option values are padded to 32 bits */
+        pos += (len + 3) & ~3;
+    }
+
+    local_pcap->ng_num_interfaces++;
+}
+
+/* Start a new pcapng section at map_pos; returns -1 if the section header is
+ * invalid */
+static int pcapng_parse_shb(local_pcap_t *local_pcap, char *errstr) {
+    const uint8_t *p = local_pcap->map + local_pcap->map_pos;
+    uint32_t bom;
+    uint32_t block_sz;
+
+    if (local_pcap->map_sz - local_pcap->map_pos < 28) {
+        snprintf(errstr, PCAP_ERRBUF_SIZE, "truncated pcapng section header");
+        return -1;
+    }
+
+    memcpy(&bom, p + 8, 4);
+
+    if (bom == PCAPNG_BYTE_ORDER) {
+        local_pcap->map_swapped = 0;
+    } else if (bom == 0x4D3C2B1A) {
+        local_pcap->map_swapped = 1;
+    } else {
+        snprintf(errstr, PCAP_ERRBUF_SIZE, "invalid pcapng byte order magic");
+        return -1;
+    }
+
+    block_sz = map_u32(local_pcap, p + 4);
+
+    if (block_sz < 28 || block_sz > local_pcap->map_sz - local_pcap->map_pos) {
+        snprintf(errstr, PCAP_ERRBUF_SIZE, "invalid pcapng section header length");
+        return -1;
+    }
+
+    /* Interfaces are numbered per section */
+    local_pcap->ng_num_interfaces = 0;
+    local_pcap->map_pos += block_sz;
+
+    return 1;
+}
+
+/* Map a pcap or pcapng file and read its header; returns the DLT, or -1 and 
+ * fills in errstr if the file can't be mapped and should be read with libpcap */
+int mmap_open(local_pcap_t *local_pcap, char *errstr) {
+    struct stat sbuf;
+    uint32_t magic;
+
+    local_pcap->map_fd = open(local_pcap->pcapfname, O_RDONLY);
+
+    if (local_pcap->map_fd < 0) {
+        snprintf(errstr, PCAP_ERRBUF_SIZE, "could not open: %s", strerror(errno));
+        return -1;
+    }
+
+    if (fstat(local_pcap->map_fd, &sbuf) < 0 || !S_ISREG(sbuf.st_mode) ||
+            sbuf.st_size < 24) {
+        snprintf(errstr, PCAP_ERRBUF_SIZE, "not a regular pcap file");
+        mmap_close(local_pcap);
+        return -1;
+    }
+
+    local_pcap->map_sz = sbuf.st_size;
+    local_pcap->map = (uint8_t *) mmap(NULL, local_pcap->map_sz, PROT_READ,
+            MAP_PRIVATE, local_pcap->map_fd, 0);
+
+    if (local_pcap->map == MAP_FAILED) {
+        local_pcap->map = NULL;
+        snprintf(errstr, PCAP_ERRBUF_SIZE, "could not map: %s", strerror(errno));
+        mmap_close(local_pcap);
+        return -1;
+    }
+
+    /* We only ever walk forward through the file */
+    madvise(local_pcap->map, local_pcap->map_sz, MADV_SEQUENTIAL);
+
+    memcpy(&magic, local_pcap->map, 4);
+
+    local_pcap->map_pos = 0;
+    local_pcap->ng_num_interfaces = 0;
+    local_pcap->ng_skipped = 0;
+
+    if (magic == PCAP_MAGIC_USEC || magic == PCAP_MAGIC_NSEC) {
+        local_pcap->map_swapped = 0;
+    } else if (magic == 0xD4C3B2A1 || magic == 0x4D3CB2A1) {
+        local_pcap->map_swapped = 1;
+    } else if (magic == PCAPNG_SHB) {
+        local_pcap->map_format = MMAP_FORMAT_PCAPNG;
+
+        if (pcapng_parse_shb(local_pcap, errstr) < 0) {
+            mmap_close(local_pcap);
+            return -1;
+        }
+
+        /* The DLT comes from the first interface, which has to be described
+         * before any packets */
+        while (local_pcap->map_sz - local_pcap->map_pos >= 12) {
+            const uint8_t *p = local_pcap->map + local_pcap->map_pos;
+            uint32_t block_type = map_u32(local_pcap, p);
+            uint32_t block_sz = map_u32(local_pcap, p + 4);
+
+            if (block_sz < 12 || block_sz > local_pcap->map_sz - local_pcap->map_pos)
+                break;
+
+            if (block_type == PCAPNG_IDB) {
+                pcapng_parse_idb(local_pcap, p + 8, block_sz - 12);
+                local_pcap->map_pos = 0;
+                local_pcap->ng_num_interfaces = 0;
+                pcapng_parse_shb(local_pcap, errstr);
+                return local_pcap->ng_dlt[0];
+            }
+
+            if (block_type == PCAPNG_EPB || block_type == PCAPNG_SPB || 
+                    block_type == PCAPNG_OPB)
+                break;
+
+            local_pcap->map_pos += block_sz;
+        }
+
+        snprintf(errstr, PCAP_ERRBUF_SIZE, "no pcapng interface before the first "
+                "packet");
+        mmap_close(local_pcap);
+        return -1;
+    } else {
+        snprintf(errstr, PCAP_ERRBUF_SIZE, "unknown file format");
+        mmap_close(local_pcap);
+        return -1;
+    }
+
+    local_pcap->map_format = MMAP_FORMAT_PCAP;
+    local_pcap->map_nsec = (magic == PCAP_MAGIC_NSEC || magic == 0x4D3CB2A1);
+    local_pcap->map_pos = 24;
+
+    return (int) map_u32(local_pcap, local_pcap->map + 20);
+}
+
 int probe_callback(kis_capture_handler_t *caph, uint32_t seqno, char *definition,
         char *msg, char **uuid, simple_cap_proto_frame_t *frame,
         cf_params_interface_t **ret_interface, 
@@ -193,13 +467,36 @@ int open_callback(kis_capture_handler_t *caph, uint32_t seqno, char *definition,
      * open a fifo during probe and then cause a glitch, but we could open it during
      * normal operation */
 
-    local_pcap->pd = pcap_open_offline(pcapfname, errstr);
-    if (strlen(errstr) > 0) {
-        snprintf(msg, STATUS_MAX, "%s", errstr);
-        return -1;
+    mmap_close(local_pcap);
+    local_pcap->use_mmap = 1;
+    local_pcap->pace_started = 0;
+
+    if ((placeholder_len = cf_find_flag(&placeholder, "mmap", definition)) > 0) {
+        if (strncasecmp(placeholder, "false", placeholder_len) == 0) {
+            local_pcap->use_mmap = 0;
+        }
+    }
+
+    if (local_pcap->use_mmap) {
+        local_pcap->datalink_type = mmap_open(local_pcap, errstr);
+
+        /* Anything we can't map, libpcap may still be able to read */
+        if (local_pcap->datalink_type < 0)
+            local_pcap->use_mmap = 0;
+
+        errstr[0] = 0;
+    }
+
+    if (!local_pcap->use_mmap) {
+        local_pcap->pd = pcap_open_offline(pcapfname, errstr);
+        if (strlen(errstr) > 0) {
+            snprintf(msg, STATUS_MAX, "%s", errstr);
+            return -1;
+        }
+
+        local_pcap->datalink_type = pcap_datalink(local_pcap->pd);
     }
 
-    local_pcap->datalink_type = pcap_datalink(local_pcap->pd);
     *dlt = local_pcap->datalink_type;
 
     /* Kluge a UUID out of the name */
@@ -213,58 +510,91 @@ int open_callback(kis_capture_handler_t *caph, uint32_t seqno, char *definition,
     /* Succesful open with no channel, hop, or chanset data */
     snprintf(msg, STATUS_MAX, "Opened pcapfile '%s' for playback", pcapfname);
 
+    local_pcap->speed = 0;
+
     if ((placeholder_len = cf_find_flag(&placeholder, "realtime", definition)) > 0) {
         if (strncasecmp(placeholder, "true", placeholder_len) == 0) {
-            snprintf(errstr, PCAP_ERRBUF_SIZE, 
-                    "Pcapfile '%s' will replay in realtime", pcapfname);
-            cf_send_message(caph, errstr, MSGFLAG_INFO);
-            local_pcap->realtime = 1;
+            local_pcap->speed = 1;
+        }
+    }
+
+    /* speed=realtime, speed=Nx, or speed=unlimited */
+    if ((placeholder_len = cf_find_flag(&placeholder, "speed", definition)) > 0) {
+        char *speedstr = strndup(placeholder, placeholder_len);
+
+        if (strcasecmp(speedstr, "realtime") == 0) {
+            local_pcap->speed = 1;
+        } else if (strcasecmp(speedstr, "unlimited") == 0) {
+            local_pcap->speed = 0;
+        } else if (sscanf(speedstr, "%lf", &(local_pcap->speed)) != 1 ||
+                local_pcap->speed < 0) {
+            snprintf(msg, STATUS_MAX, "Invalid speed '%s' for pcapfile '%s', "
+                    "expected 'realtime', 'unlimited', or a multiple such as "
+                    "'10x'", speedstr, pcapfname);
+            free(speedstr);
+            return -1;
         }
+
+        free(speedstr);
+    }
+
+    if (local_pcap->speed == 1) {
+        snprintf(errstr, PCAP_ERRBUF_SIZE, 
+                "Pcapfile '%s' will replay in realtime", pcapfname);
+        cf_send_message(caph, errstr, MSGFLAG_INFO);
+    } else if (local_pcap->speed != 0) {
+        snprintf(errstr, PCAP_ERRBUF_SIZE, 
+                "Pcapfile '%s' will replay at %gx the original rate", pcapfname,
+                local_pcap->speed);
+        cf_send_message(caph, errstr, MSGFLAG_INFO);
     }
 
     return 1;
 }
 
-void pcap_dispatch_cb(u_char *user, const struct pcap_pkthdr *header,
-        const u_char *data)  {
-    kis_capture_handler_t *caph = (kis_capture_handler_t *) user;
-    local_pcap_t *local_pcap = (local_pcap_t *) caph->userdata;
-    int ret;
-    unsigned long delay_usec = 0;
-
-    /* If we're doing 'realtime' playback, delay accordingly based on the
-     * previous packet. 
-     *
-     * Because we're in our own thread, we can block as long as we want - this
-     * simulates blocking IO for capturing from hardware, too.
-     */
-    if (local_pcap->realtime) {
-        if (local_pcap->last_ts.tv_sec == 0 && local_pcap->last_ts.tv_usec == 0) {
-            delay_usec = 0;
-        } else {
-            /* Catch corrupt pcaps w/ inconsistent times */
-            if (header->ts.tv_sec < local_pcap->last_ts.tv_sec) {
-                delay_usec = 0;
-            } else {
-                delay_usec = (header->ts.tv_sec - local_pcap->last_ts.tv_sec) * 1000000L;
-            }
+/* When replaying at the original rate (or a multiple of it), wait until it's
+ * time to send a packet.  Packets are paced against the first packet, not the
+ * previous one, so time spent sending doesn't accumulate into drift.
+ *
+ * Because we're in our own thread, we can block as long as we want - this
+ * simulates blocking IO for capturing from hardware, too. */
+void pace_packet(local_pcap_t *local_pcap, struct timeval ts) {
+    struct timespec now;
+    double pkt_offt, wall_offt, delay;
+
+    if (local_pcap->speed <= 0)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (!local_pcap->pace_started) {
+        local_pcap->pace_started = 1;
+        local_pcap->pace_wall = now;
+        local_pcap->pace_ts = ts;
+        return;
+    }
 
-            if (header->ts.tv_usec < local_pcap->last_ts.tv_usec) {
-                delay_usec += (1000000L - local_pcap->last_ts.tv_usec) + 
-                    header->ts.tv_usec;
-            } else {
-                delay_usec += header->ts.tv_usec - local_pcap->last_ts.tv_usec;
-            }
+    pkt_offt = (double) (ts.tv_sec - local_pcap->pace_ts.tv_sec) +
+        (double) (ts.tv_usec - local_pcap->pace_ts.tv_usec) / 1000000;
 
-        }
+    /* Catch corrupt pcaps w/ inconsistent times */
+    if (pkt_offt <= 0)
+        return;
 
-        local_pcap->last_ts.tv_sec = header->ts.tv_sec;
-        local_pcap->last_ts.tv_usec = header->ts.tv_usec;
+    wall_offt = (double) (now.tv_sec - local_pcap->pace_wall.tv_sec) +
+        (double) (now.tv_nsec - local_pcap->pace_wall.tv_nsec) / 1000000000;
 
-        if (delay_usec != 0) {
-            usleep(delay_usec);
-        }
-    }
+    delay = pkt_offt / local_pcap->speed - wall_offt;
+
+    if (delay > 0)
+        usleep((useconds_t) (delay * 1000000));
+}
+
+/* Send a packet, waiting for room in the write buffer; returns -1 if we can no
+ * longer send data */
+int send_packet(kis_capture_handler_t *caph, struct timeval ts, uint32_t caplen,
+        const uint8_t *data) {
+    int ret;
 
     /* Try repeatedly to send the packet; go into a thread wait state if
      * the write buffer is full & we'll be woken up as soon as it flushes
@@ -272,20 +602,227 @@ void pcap_dispatch_cb(u_char *user, const struct pcap_pkthdr *header,
     while (1) {
         if ((ret = cf_send_data(caph, 
                         NULL, NULL, NULL,
-                        header->ts, 
-                        header->caplen, (uint8_t *) data)) < 0) {
-            pcap_breakloop(local_pcap->pd);
-            cf_send_error(caph, "unable to send DATA frame");
-            cf_handler_spindown(caph);
+                        ts, caplen, (uint8_t *) data)) < 0) {
+            return -1;
         } else if (ret == 0) {
             /* Go into a wait for the write buffer to get flushed */
-            // fprintf(stderr, "debug - pcapfile - dispatch_cb - no room in write buffer - waiting for it to have more space\n");
             cf_handler_wait_ringbuffer(caph);
             continue;
         } else {
+            return 1;
+        }
+    }
+}
+
+/* Find the next packet in a classic pcap file; returns 0 at the end of the file */
+static int mmap_next_pcap(local_pcap_t *local_pcap, struct timeval *ts,
+        uint32_t *caplen, const uint8_t **data) {
+    const uint8_t *p;
+    uint32_t incl_len;
+
+    if (local_pcap->map_sz - local_pcap->map_pos < 16)
+        return 0;
+
+    p = local_pcap->map + local_pcap->map_pos;
+
+    incl_len = map_u32(local_pcap, p + 8);
+
+    /* A truncated final record ends the file */
+    if (incl_len > local_pcap->map_sz - local_pcap->map_pos - 16)
+        return 0;
+
+    ts->tv_sec = map_u32(local_pcap, p);
+    ts->tv_usec = map_u32(local_pcap, p + 4);
+
+    if (local_pcap->map_nsec)
+        ts->tv_usec /= 1000;
+
+    *caplen = incl_len;
+    *data = p + 16;
+
+    local_pcap->map_pos += 16 + incl_len;
+
+    return 1;
+}
+
+/* Find the next packet in a pcapng file, skipping other blocks and packets from
+ * interfaces with a different DLT; returns 0 at the end of the file, or -1 if
+ * the file is corrupt */
+static int mmap_next_pcapng(local_pcap_t *local_pcap, struct timeval *ts,
+        uint32_t *caplen, const uint8_t **data, char *errstr) {
+    const uint8_t *p;
+    uint32_t block_type, block_sz;
+    uint32_t ifnum, len;
+    uint64_t tstamp, units;
+    size_t avail;
+
+    while (1) {
+        avail = local_pcap->map_sz - local_pcap->map_pos;
+
+        if (avail < 12)
+            return 0;
+
+        p = local_pcap->map + local_pcap->map_pos;
+
+        /* Section headers are the same in either byte order */
+        if (p[0] == 0x0A && p[1] == 0x0D && p[2] == 0x0D && p[3] == 0x0A) {
+            if (pcapng_parse_shb(local_pcap, errstr) < 0)
+                return -1;
+            continue;
+        }
+
+        block_type = map_u32(local_pcap, p);
+        block_sz = map_u32(local_pcap, p + 4);
+
+        /* A truncated final block ends the file */
+        if (block_sz > avail)
+            return 0;
+
+        if (block_sz < 12 || (block_sz & 3) != 0) {
+            snprintf(errstr, PCAP_ERRBUF_SIZE, "invalid pcapng block length %u",
+                    block_sz);
+            return -1;
+        }
+
+        local_pcap->map_pos += block_sz;
+
+        if (block_type == PCAPNG_IDB) {
+            pcapng_parse_idb(local_pcap, p + 8, block_sz - 12);
+            continue;
+        }
+
+        if (block_type == PCAPNG_EPB && block_sz >= 32) {
+            ifnum = map_u32(local_pcap, p + 8);
+            tstamp = ((uint64_t) map_u32(local_pcap, p + 12) << 32) | 
+                map_u32(local_pcap, p + 16);
+            len = map_u32(local_pcap, p + 20);
+
+            if (len > block_sz - 32)
+                continue;
+
+            *data = p + 28;
+        } else if (block_type == PCAPNG_OPB && block_sz >= 32) {
+            ifnum = map_u16(local_pcap, p + 8);
+            tstamp = ((uint64_t) map_u32(local_pcap, p + 12) << 32) | 
+                map_u32(local_pcap, p + 16);
+            len = map_u32(local_pcap, p + 20);
+
+            if (len > block_sz - 32)
+                continue;
+
+            *data = p + 28;
+        } else if (block_type == PCAPNG_SPB && block_sz >= 16) {
+            /* Simple packets have no timestamp and always come from the first 
+             * interface; the captured length is whatever fits in the block.  They
+             * keep the timestamp of the previous packet */
+            ifnum = 0;
+            tstamp = 0;
+            len = map_u32(local_pcap, p + 8);
+
+            if (len > block_sz - 16)
+                len = block_sz - 16;
+
+            *data = p + 12;
+        } else {
+            continue;
+        }
+
+        if (ifnum >= local_pcap->ng_num_interfaces ||
+                local_pcap->ng_dlt[ifnum] != local_pcap->datalink_type) {
+            local_pcap->ng_skipped++;
+            continue;
+        }
+
+        units = local_pcap->ng_tsunits[ifnum];
+
+        if (block_type != PCAPNG_SPB) {
+            ts->tv_sec = tstamp / units;
+
+            if (units >= 1000000)
+                ts->tv_usec = (tstamp % units) / (units / 1000000);
+            else
+                ts->tv_usec = (tstamp % units) * 1000000 / units;
+        }
+
+        *caplen = len;
+
+        return 1;
+    }
+}
+
+/* Replay a memory-mapped file; frames are sent straight from the mapping */
+void mmap_capture(kis_capture_handler_t *caph) {
+    local_pcap_t *local_pcap = (local_pcap_t *) caph->userdata;
+    char errstr[PCAP_ERRBUF_SIZE] = "";
+    struct timeval ts = { 0, 0 };
+    uint32_t caplen;
+    const uint8_t *data;
+    int r;
+
+    while (1) {
+        if (local_pcap->map_format == MMAP_FORMAT_PCAP)
+            r = mmap_next_pcap(local_pcap, &ts, &caplen, &data);
+        else
+            r = mmap_next_pcapng(local_pcap, &ts, &caplen, &data, errstr);
+
+        if (r <= 0)
             break;
+
+        pace_packet(local_pcap, ts);
+
+        if (send_packet(caph, ts, caplen, data) < 0) {
+            cf_send_error(caph, "unable to send DATA frame");
+            cf_handler_spindown(caph);
+            return;
         }
     }
+
+    if (local_pcap->ng_skipped != 0) {
+        char skipstr[PCAP_ERRBUF_SIZE];
+
+        snprintf(skipstr, PCAP_ERRBUF_SIZE, "Pcapfile '%s' skipped %lu packets from "
+                "interfaces with a different link type",
+                local_pcap->pcapfname, (unsigned long) local_pcap->ng_skipped);
+        cf_send_message(caph, skipstr, MSGFLAG_INFO);
+    }
+
+    /* Make sure the last partial batch goes out before we close */
+    while (1) {
+        pthread_mutex_lock(&(caph->out_ringbuf_lock));
+        r = cf_flush_data_batch(caph);
+        pthread_mutex_unlock(&(caph->out_ringbuf_lock));
+
+        if (r != 0)
+            break;
+
+        cf_handler_wait_ringbuffer(caph);
+    }
+
+    {
+        char closestr[PCAP_ERRBUF_SIZE * 2];
+
+        snprintf(closestr, sizeof(closestr), "Pcapfile '%s' closed: %s", 
+                local_pcap->pcapfname, 
+                strlen(errstr) == 0 ? "end of pcapfile reached" : errstr);
+
+        cf_send_error(caph, closestr);
+    }
+
+    cf_handler_spindown(caph);
+}
+
+void pcap_dispatch_cb(u_char *user, const struct pcap_pkthdr *header,
+        const u_char *data)  {
+    kis_capture_handler_t *caph = (kis_capture_handler_t *) user;
+    local_pcap_t *local_pcap = (local_pcap_t *) caph->userdata;
+
+    pace_packet(local_pcap, header->ts);
+
+    if (send_packet(caph, header->ts, header->caplen, data) < 0) {
+        pcap_breakloop(local_pcap->pd);
+        cf_send_error(caph, "unable to send DATA frame");
+        cf_handler_spindown(caph);
+    }
 }
 
 void capture_thread(kis_capture_handler_t *caph) {
@@ -293,6 +830,11 @@ void capture_thread(kis_capture_handler_t *caph) {
     char errstr[PCAP_ERRBUF_SIZE];
     char *pcap_errstr;
 
+    if (local_pcap->use_mmap) {
+        mmap_capture(caph);
+        return;
+    }
+
     pcap_loop(local_pcap->pd, -1, pcap_dispatch_cb, (u_char *) caph);
 
     pcap_errstr = pcap_geterr(local_pcap->pd);
@@ -311,9 +853,18 @@ int main(int argc, char *argv[]) {
         .pcapfname = NULL,
         .datalink_type = -1,
         .override_dlt = -1,
-        .realtime = 0,
-        .last_ts.tv_sec = 0,
-        .last_ts.tv_usec = 0
+        .speed = 0,
+        .pace_started = 0,
+        .use_mmap = 0,
+        .map_fd = -1,
+        .map = NULL,
+        .map_sz = 0,
+        .map_pos = 0,
+        .map_format = 0,
+        .map_swapped = 0,
+        .map_nsec = 0,
+        .ng_num_interfaces = 0,
+        .ng_skipped = 0,
     };
 
 #if 0
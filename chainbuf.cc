@@ -18,15 +18,118 @@
 
 #include "chainbuf.h"
 #include "util.h"
+#include "kis_probes.h"
+#include "kis_hugepage.h"
+
+struct chainbuf_pool_state {
+    chainbuf_pool_state() : retained(0) { }
+
+    std::mutex mutex;
+    std::vector<uint8_t *> free_chunks[ChainbufPool::max_class_bits - 
+        ChainbufPool::min_class_bits + 1];
+    size_t retained;
+};
+
+// Never destroyed, so chainbufs torn down late in exit can still release
+static chainbuf_pool_state *chainbuf_pool() {
+    static chainbuf_pool_state *state = new chainbuf_pool_state();
+    return state;
+}
+
+// Chunks of a huge page or more may be backed by huge pages
+static uint8_t *chunk_new(size_t in_sz) {
+    if (in_sz >= HugepageAlloc::huge_page_sz) {
+        uint8_t *chunk = (uint8_t *) HugepageAlloc::alloc(in_sz);
+
+        if (chunk != NULL)
+            return chunk;
+    }
+
+    return new uint8_t[in_sz];
+}
+
+static void chunk_delete(uint8_t *in_chunk, size_t in_sz) {
+    if (in_sz >= HugepageAlloc::huge_page_sz && HugepageAlloc::release(in_chunk))
+        return;
+
+    delete[] in_chunk;
+}
+
+unsigned int ChainbufPool::size_class(size_t in_sz) {
+    unsigned int b = min_class_bits;
+
+    while (b < max_class_bits && ((size_t) 1 << b) < in_sz)
+        b++;
+
+    return b;
+}
+
+size_t ChainbufPool::chunk_size(size_t in_sz) {
+    if (in_sz > ((size_t) 1 << max_class_bits))
+        return in_sz;
+
+    return (size_t) 1 << size_class(in_sz);
+}
+
+uint8_t *ChainbufPool::alloc(size_t in_sz) {
+    size_t sz = chunk_size(in_sz);
+
+    if (sz > ((size_t) 1 << max_class_bits))
+        return chunk_new(sz);
+
+    auto pool = chainbuf_pool();
+    auto& fl = pool->free_chunks[size_class(sz) - min_class_bits];
+
+    {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+
+        if (fl.size() > 0) {
+            uint8_t *chunk = fl.back();
+            fl.pop_back();
+            pool->retained -= sz;
+            return chunk;
+        }
+    }
+
+    return chunk_new(sz);
+}
+
+void ChainbufPool::release(uint8_t *in_chunk, size_t in_sz) {
+    if (in_chunk == NULL)
+        return;
+
+    size_t sz = chunk_size(in_sz);
+
+    if (sz <= ((size_t) 1 << max_class_bits)) {
+        auto pool = chainbuf_pool();
+        auto& fl = pool->free_chunks[size_class(sz) - min_class_bits];
+
+        std::lock_guard<std::mutex> lock(pool->mutex);
+
+        if (pool->retained + sz <= max_retained) {
+            fl.push_back(in_chunk);
+            pool->retained += sz;
+            return;
+        }
+    }
+
+    chunk_delete(in_chunk, sz);
+}
+
+size_t ChainbufPool::retained() {
+    auto pool = chainbuf_pool();
+    std::lock_guard<std::mutex> lock(pool->mutex);
+    return pool->retained;
+}
 
 Chainbuf::Chainbuf(size_t in_chunk, size_t pre_allocate) {
-    chunk_sz = in_chunk;
+    chunk_sz = ChainbufPool::chunk_size(in_chunk);
 
     // Allocate slots in the vector, but not bytes
     buff_vec = std::vector<uint8_t *>();
     buff_vec.reserve(pre_allocate);
 
-    buff_vec.push_back(new uint8_t[chunk_sz]);
+    buff_vec.push_back(ChainbufPool::alloc(chunk_sz));
 
     used_sz = 0;
     total_sz = 0;
@@ -49,16 +152,32 @@ Chainbuf::~Chainbuf() {
 
     // fprintf(stderr, "debug - freeing chainbuf, total size %lu chunks %lu, largest allocation delta %lu\n", total_sz, (total_sz / chunk_sz) + 1, alloc_delta);
 
-    clear();
+    for (auto x : buff_vec) 
+        ChainbufPool::release(x, chunk_sz);
+
+    buff_vec.clear();
 }
 
 void Chainbuf::clear() {
     local_locker lock(&buffer_locker);
 
     for (auto x : buff_vec) 
-        delete[](x);
+        ChainbufPool::release(x, chunk_sz);
 
     buff_vec.clear();
+
+    // Start over with a fresh chunk instead of leaving the read and write
+    // pointers aimed at chunks that are back in the pool
+    buff_vec.push_back(ChainbufPool::alloc(chunk_sz));
+
+    used_sz = 0;
+
+    write_block = 0;
+    write_buf = buff_vec[0];
+    read_block = 0;
+    read_buf = buff_vec[0];
+    write_offt = 0;
+    read_offt = 0;
 }
 
 size_t Chainbuf::used() {
@@ -105,11 +224,13 @@ ssize_t Chainbuf::write(uint8_t *in_data, size_t in_sz) {
 
         // If we got here and we have more data, then we must need another chunk
         if (total_written < in_sz) {
-            uint8_t *newchunk = new uint8_t[chunk_sz];
+            uint8_t *newchunk = ChainbufPool::alloc(chunk_sz);
             buff_vec.push_back(newchunk);
             write_block++;
             write_buf = buff_vec[write_block];
 
+            KIS_PROBE3(chainbuf__grow, this, used_sz, write_block - read_block + 1);
+
             if (read_buf == NULL) {
                 read_buf = buff_vec[read_block];
             }
@@ -171,7 +292,7 @@ ssize_t Chainbuf::peek(uint8_t **ret_data, size_t in_sz) {
             copy_sz = left;
 
         // Copy whatever space we have in the buffer remaining
-        memcpy(*ret_data + copy_offt, read_buf + block_offt + offt, copy_sz);
+        memcpy(*ret_data + copy_offt, buff_vec[read_block + block_offt] + offt, copy_sz);
         // Subtract what we just copied
         left -= copy_sz;
         // Start at the beginning of the next buffer
@@ -248,13 +369,13 @@ size_t Chainbuf::consume(size_t in_sz) {
     }
 
     ssize_t consumed_sz = 0;
-    int block_offt = 0;
 
     while (consumed_sz < (ssize_t) in_sz) {
         ssize_t rd_sz = 0;
 
-        // If we've wandered out of our block...
-        if (read_block + block_offt >= buff_vec.size())
+        // If we've wandered out of our block...  read_block already moves
+        // forward as each block is consumed
+        if (read_block >= buff_vec.size())
             throw std::runtime_error("chainbuf ran out of room in buffer vector "
                     "during consume");
 
@@ -274,12 +395,9 @@ size_t Chainbuf::consume(size_t in_sz) {
             // Universal read offt jumps
             read_offt = 0;
 
-            // Data consuming block offt jumps
-            block_offt++;
-
             // Remove the old read block and set the slot to null
             // fprintf(stderr, "debug - chainbuf read_block freeing %u\n", read_block);
-            delete[](buff_vec[read_block]);
+            ChainbufPool::release(buff_vec[read_block], chunk_sz);
             buff_vec[read_block] = NULL;
 
             // Move the global read pointer
@@ -300,6 +418,26 @@ size_t Chainbuf::consume(size_t in_sz) {
     return consumed_sz;
 }
 
+bool Chainbuf::zero_copy_segments(std::vector<std::pair<unsigned char *, size_t> > *ret_segments) {
+    local_locker lock(&buffer_locker);
+
+    ret_segments->clear();
+
+    size_t left = used_sz;
+    size_t offt = read_offt;
+
+    for (size_t b = read_block; left > 0 && b < buff_vec.size(); b++) {
+        size_t sz = min(chunk_sz - offt, left);
+
+        ret_segments->push_back(std::make_pair(buff_vec[b] + offt, sz));
+
+        left -= sz;
+        offt = 0;
+    }
+
+    return true;
+}
+
 ssize_t Chainbuf::reserve(unsigned char **data, size_t in_sz) {
     local_locker lock(&buffer_locker);
 
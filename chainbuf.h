@@ -41,8 +41,37 @@
  * only return the remaining portion of the current slot as they operate purely on
  * the chunk and prevent memory copying.
  *
+ * Chunks come from a process-wide pool (see ChainbufPool), so the chunk size is
+ * rounded up to the pool size class.
+ *
  */
 
+// Process-wide pool of chainbuf chunks.  Chunks are grouped in power-of-two size
+// classes from 4KB to 4MB; freed chunks go back on the free list for their class
+// instead of to the allocator, up to a total of max_retained bytes across all
+// classes, so back to back large responses keep reusing the same memory instead
+// of fragmenting the heap.  Sizes over the largest class aren't pooled.  Chunks
+// of 2MB and up may be backed by huge pages (see kis_hugepage.h).
+class ChainbufPool {
+public:
+    // Size of the chunk which would actually be allocated for in_sz
+    static size_t chunk_size(size_t in_sz);
+
+    // Get a chunk of at least in_sz; release it with the same size
+    static uint8_t *alloc(size_t in_sz);
+    static void release(uint8_t *in_chunk, size_t in_sz);
+
+    // Bytes currently held on the free lists
+    static size_t retained();
+
+    static const unsigned int min_class_bits = 12;
+    static const unsigned int max_class_bits = 22;
+    static const size_t max_retained = 32 * 1024 * 1024;
+
+protected:
+    static unsigned int size_class(size_t in_sz);
+};
+
 class Chainbuf : public CommonBuffer {
 public:
     // Size per chunk and number of slots to pre-allocate in the buffer
@@ -83,6 +112,9 @@ public:
     // Consume from buffer
     size_t consume(size_t in_sz);
 
+    // Every unread byte, a segment per chunk
+    virtual bool zero_copy_segments(std::vector<std::pair<unsigned char *, size_t> > *ret_segments);
+
 protected:
     size_t chunk_sz;
     bool free_after_read;
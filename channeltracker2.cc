@@ -24,21 +24,29 @@
 #include "devicetracker.h"
 #include "devicetracker_component.h"
 #include "packinfo_signal.h"
+#include "kis_clock.h"
 
 Channeltracker_V2::Channeltracker_V2(GlobalRegistry *in_globalreg) :
     tracker_component(in_globalreg, 0), Kis_Net_Httpd_CPPStream_Handler(in_globalreg) {
 
+    Httpd_RegisterRoute("GET", "/channels/channels");
+
     // Number of seconds we consider a device to be active on a frequency 
     // after the last time we see it
     device_decay = 5;
 
+    device_estimate =
+        globalreg->kismet_config->FetchOptBoolean("channel_device_estimate", false);
+    device_estimate_precision =
+        globalreg->kismet_config->FetchOptUInt("channel_device_estimate_precision", 10);
+
     globalreg = in_globalreg;
 
     register_fields();
     reserve_fields(NULL);
 
     globalreg->packetchain->RegisterHandler(&PacketChainHandler, this, 
-            CHAINPOS_LOGGING, 0);
+            CHAINPOS_LOGGING, 0, "channeltracker");
 
 	pack_comp_device = _PCM(PACK_COMP_DEVICE) =
 		globalreg->packetchain->RegisterPacketComponent("DEVICE");
@@ -50,7 +58,7 @@ Channeltracker_V2::Channeltracker_V2(GlobalRegistry *in_globalreg) :
 		globalreg->packetchain->RegisterPacketComponent("RADIODATA");
 
     struct timeval trigger_tm;
-    trigger_tm.tv_sec = time(0) + 1;
+    trigger_tm.tv_sec = KisClock::CoarseWallSec() + 1;
     trigger_tm.tv_usec = 0;
 
     timer_id = 
@@ -101,6 +109,16 @@ bool Channeltracker_V2::Httpd_VerifyPath(const char *path, const char *method) {
     return false;
 }
 
+bool Channeltracker_V2::Httpd_ETag(const char *url, uint64_t *etag) {
+    if (Httpd_StripSuffix(url) != "/channels/channels")
+        return false;
+
+    // Read without the lock; a torn read only costs a refetch
+    *etag = get_mod_version();
+
+    return true;
+}
+
 void Channeltracker_V2::Httpd_CreateStreamResponse(
         Kis_Net_Httpd *httpd __attribute__((unused)),
         Kis_Net_Httpd_Connection *connection __attribute__((unused)),
@@ -130,7 +148,7 @@ public:
             Channeltracker_V2 *channelv2) {
         globalreg = in_globalreg;
         this->channelv2 = channelv2;
-        stime = time(0);
+        stime = KisClock::CoarseWallSec();
     }
 
     virtual ~channeltracker_v2_device_worker() {
@@ -179,12 +197,38 @@ protected:
 int Channeltracker_V2::timetracker_event(int event_id __attribute__((unused))) {
     local_locker locker(&lock);
 
-    channeltracker_v2_device_worker worker(globalreg, this);
-    globalreg->devicetracker->MatchOnDevices(&worker);
+    if (device_estimate) {
+        // Channels already know what they've seen, no need to look at the
+        // devices
+        time_t ts = KisClock::CoarseWallSec();
+
+        // Empty samples are what the RRD is filled forward with anyhow, so
+        // only a channel with devices changes our version
+        for (auto i : *(frequency_map->get_doublemap())) {
+            shared_ptr<Channeltracker_V2_Channel> c =
+                static_pointer_cast<Channeltracker_V2_Channel>(i.second);
+            unsigned int devices = c->estimate_devices(ts, device_decay);
+            c->get_device_rrd()->add_sample(devices, ts);
+            if (devices != 0)
+                bump_mod_version();
+        }
+
+        for (auto i : *(channel_map->get_stringmap())) {
+            shared_ptr<Channeltracker_V2_Channel> c =
+                static_pointer_cast<Channeltracker_V2_Channel>(i.second);
+            unsigned int devices = c->estimate_devices(ts, device_decay);
+            c->get_device_rrd()->add_sample(devices, ts);
+            if (devices != 0)
+                bump_mod_version();
+        }
+    } else {
+        channeltracker_v2_device_worker worker(globalreg, this);
+        globalreg->devicetracker->MatchOnDevices(&worker);
+    }
 
     // Reschedule
     struct timeval trigger_tm;
-    trigger_tm.tv_sec = time(0) + 1;
+    trigger_tm.tv_sec = KisClock::CoarseWallSec() + 1;
     trigger_tm.tv_usec = 0;
 
     timer_id = 
@@ -195,7 +239,7 @@ int Channeltracker_V2::timetracker_event(int event_id __attribute__((unused))) {
 
 void Channeltracker_V2::update_device_counts(map<double, unsigned int> in_counts) {
     local_locker locker(&lock);
-    time_t ts = time(0);
+    time_t ts = KisClock::CoarseWallSec();
 
     for (map<double, unsigned int>::iterator i = in_counts.begin();
             i != in_counts.end(); ++i) {
@@ -210,9 +254,116 @@ void Channeltracker_V2::update_device_counts(map<double, unsigned int> in_counts
         // Update the device RRD for the count
         static_pointer_cast<Channeltracker_V2_Channel>(imi->second)->
             get_device_rrd()->add_sample(i->second, ts);
+
+        bump_mod_version();
     }
 }
 
+bool Channeltracker_V2::get_frequency_activity(double in_freq_khz, unsigned int in_sec,
+        double *ret_pps, double *ret_devices) {
+    local_locker locker(&lock);
+
+    *ret_pps = 0;
+    *ret_devices = 0;
+
+    if (in_sec == 0)
+        return false;
+
+    if (in_sec > 60)
+        in_sec = 60;
+
+    TrackerElement::double_map_iterator imi = frequency_map->double_find(in_freq_khz);
+
+    if (imi == frequency_map->double_end())
+        return false;
+
+    shared_ptr<Channeltracker_V2_Channel> c =
+        static_pointer_cast<Channeltracker_V2_Channel>(imi->second);
+    time_t now = KisClock::CoarseWallSec();
+
+    *ret_pps = (double) c->get_packets_rrd()->get_recent_sum(now, in_sec) / in_sec;
+    *ret_devices = (double) c->get_device_rrd()->get_recent_sum(now, in_sec) / in_sec;
+
+    return true;
+}
+
+bool Channeltracker_V2::get_frequency_utilization(double in_freq_khz, 
+        unsigned int in_sec, double *ret_percent) {
+    local_locker locker(&lock);
+
+    *ret_percent = 0;
+
+    if (in_sec == 0)
+        return false;
+
+    if (in_sec > 60)
+        in_sec = 60;
+
+    TrackerElement::double_map_iterator imi = frequency_map->double_find(in_freq_khz);
+
+    if (imi == frequency_map->double_end())
+        return false;
+
+    shared_ptr<Channeltracker_V2_Channel> c =
+        static_pointer_cast<Channeltracker_V2_Channel>(imi->second);
+    time_t now = KisClock::CoarseWallSec();
+
+    // Microseconds per second, so 10000 is one percent
+    *ret_percent = (double) c->get_airtime_rrd()->get_recent_sum(now, in_sec) / 
+        in_sec / 10000;
+
+    if (*ret_percent > 100)
+        *ret_percent = 100;
+
+    return true;
+}
+
+void Channeltracker_V2::get_frequency_totals(map<double, frequency_totals> *ret_totals) {
+    local_locker locker(&lock);
+
+    for (auto i = frequency_map->double_begin(); i != frequency_map->double_end(); ++i) {
+        shared_ptr<Channeltracker_V2_Channel> c =
+            static_pointer_cast<Channeltracker_V2_Channel>(i->second);
+
+        frequency_totals t;
+        t.packets = c->total_packets;
+        t.bytes = c->total_bytes;
+        t.airtime = c->total_airtime;
+
+        (*ret_totals)[i->first] = t;
+    }
+}
+
+double Channeltracker_V2::channel_to_freq_khz(string in_channel) {
+    unsigned int num;
+    char extra[16];
+
+    // Channels are named by number with optional width suffixes
+    int r = sscanf(in_channel.c_str(), "%u%15s", &num, extra);
+
+    if (r < 1)
+        return 0;
+
+    // Already a frequency in mhz
+    if (num >= 1000)
+        return (double) num * 1000;
+
+    // Anything else with a unit isn't a wifi channel
+    if (r == 2 && StrLower(extra).find("mhz") != string::npos)
+        return 0;
+
+    if (num >= 1 && num <= 13)
+        return (double) (2407 + (5 * num)) * 1000;
+
+    if (num == 14)
+        return 2484 * 1000;
+
+    if (num >= 32 && num <= 196)
+        return (double) (5000 + (5 * num)) * 1000;
+
+    return 0;
+}
+
 int Channeltracker_V2::PacketChainHandler(CHAINCALL_PARMS) {
     Channeltracker_V2 *cv2 = (Channeltracker_V2 *) auxdata;
 
@@ -263,20 +414,34 @@ int Channeltracker_V2::PacketChainHandler(CHAINCALL_PARMS) {
     if (freq_channel == NULL && chan_channel == NULL)
         return 1;
 
-    time_t stime = time(0);
+    cv2->bump_mod_version();
+
+    time_t stime = KisClock::CoarseWallSec();
+
+    uint64_t device_key = 0;
+
+    if (cv2->device_estimate && common != NULL && common->device != mac_addr(0))
+        device_key = DevicetrackerKey::MakeKey(common->device, common->phyid);
 
     if (freq_channel) {
         (*(freq_channel->get_signal_data())) += *(l1info);
         freq_channel->get_packets_rrd()->add_sample(1, stime);
+        freq_channel->total_packets++;
 
         if (common != NULL) {
             freq_channel->get_data_rrd()->add_sample(common->datasize, stime);
+            freq_channel->total_bytes += common->datasize;
+        }
 
-            /*
-            freq_channel->seen_device_map[common->device] = true;
-            */
+        if (l1info->airtime_usec != 0) {
+            freq_channel->get_airtime_rrd()->add_sample(l1info->airtime_usec, stime);
+            freq_channel->total_airtime += l1info->airtime_usec;
         }
 
+        if (device_key != 0)
+            freq_channel->add_device_sample(device_key, stime, cv2->device_decay,
+                    cv2->device_estimate_precision);
+
     }
 
     if (chan_channel) {
@@ -287,21 +452,12 @@ int Channeltracker_V2::PacketChainHandler(CHAINCALL_PARMS) {
             chan_channel->get_data_rrd()->add_sample(common->datasize, stime);
         }
 
-        /*
-        // Track unique devices
-        if (globalreg->timestamp.tv_sec != chan_channel->last_device_sec) {
-            chan_channel->last_device_sec = globalreg->timestamp.tv_sec;
-            chan_channel->seen_device_map.clear();
-        }
-        */
-
-        /*
-        chan_channel->seen_device_map[common->device] = true;
+        if (l1info->airtime_usec != 0)
+            chan_channel->get_airtime_rrd()->add_sample(l1info->airtime_usec, stime);
 
-        chan_channel->get_device_rrd()->add_sample(
-                chan_channel->seen_device_map.size(),
-                globalreg->timestamp.tv_sec);
-                */
+        if (device_key != 0)
+            chan_channel->add_device_sample(device_key, stime, cv2->device_decay,
+                    cv2->device_estimate_precision);
     }
 
     return 1;
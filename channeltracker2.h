@@ -30,6 +30,7 @@
 #include "devicetracker_component.h"
 #include "packetchain.h"
 #include "timetracker.h"
+#include "kis_hyperloglog.h"
 
 // Can appear in the list as either a numerical frequency or a named
 // channel
@@ -40,7 +41,7 @@ public:
         register_fields();
         reserve_fields(NULL);
 
-        // last_device_sec = 0;
+        total_packets = total_bytes = total_airtime = 0;
     }
 
     Channeltracker_V2_Channel(GlobalRegistry *in_globalreg, 
@@ -50,7 +51,7 @@ public:
         register_fields();
         reserve_fields(e);
 
-        // last_device_sec = 0;
+        total_packets = total_bytes = total_airtime = 0;
     }
 
     virtual SharedTrackerElement clone_type() {
@@ -64,16 +65,56 @@ public:
 
     __ProxyTrackable(packets_rrd, uint64_rrd, packets_rrd);
     __ProxyTrackable(data_rrd, uint64_rrd, data_rrd);
+    __ProxyTrackable(airtime_rrd, uint64_rrd, airtime_rrd);
     __ProxyTrackable(device_rrd,uint64_rrd, device_rrd);
 
     __ProxyTrackable(signal_data, kis_tracked_signal_data, signal_data);
 
-    /*
-    // C++-domain map of devices we've seen in the last second for computing if we
-    // increase the RRD record
-    map<mac_addr, bool> seen_device_map;
-    time_t last_device_sec;
-    */
+    // Count a device seen in a packet on this channel, when device counts are
+    // estimated from packets instead of the device list
+    void add_device_sample(uint64_t in_key, time_t in_sec, unsigned int in_decay,
+            unsigned int in_precision) {
+        if (device_sketches.size() != in_decay + 1) {
+            device_sketches.assign(in_decay + 1, kis_hyperloglog(in_precision));
+            device_sketch_sec.assign(in_decay + 1, 0);
+        }
+
+        size_t slot = in_sec % device_sketches.size();
+
+        if (device_sketch_sec[slot] != in_sec) {
+            device_sketches[slot].clear();
+            device_sketch_sec[slot] = in_sec;
+        }
+
+        device_sketches[slot].add(in_key);
+    }
+
+    // Packets, bytes, and microseconds of airtime since startup; the RRDs only
+    // go back a day
+    uint64_t total_packets, total_bytes, total_airtime;
+
+    // Estimated number of distinct devices seen in the last in_decay seconds
+    unsigned int estimate_devices(time_t in_now, unsigned int in_decay) {
+        if (device_sketches.size() == 0)
+            return 0;
+
+        kis_hyperloglog merged(device_sketches[0].get_precision());
+        bool any = false;
+
+        for (size_t x = 0; x < device_sketches.size(); x++) {
+            if (device_sketch_sec[x] < in_now - (time_t) in_decay || 
+                    device_sketch_sec[x] > in_now)
+                continue;
+
+            merged.merge(device_sketches[x]);
+            any = true;
+        }
+
+        if (!any)
+            return 0;
+
+        return (unsigned int) (merged.estimate() + 0.5);
+    }
 
 protected:
     // Timer for updating the device list
@@ -94,6 +135,9 @@ protected:
         __RegisterComplexField(kis_tracked_rrd<>, data_rrd_id, 
                 "kismet.channelrec.data_rrd", "byte count RRD");
 
+        __RegisterComplexField(kis_tracked_rrd<>, airtime_rrd_id, 
+                "kismet.channelrec.airtime_rrd", "airtime RRD (usec per second)");
+
         __RegisterComplexField(kis_tracked_rrd<>, device_rrd_id, 
                 "kismet.channelrec.device_rrd", "active device RRD");
 
@@ -109,6 +153,8 @@ protected:
                         packets_rrd_id, e->get_map_value(packets_rrd_id)));
             data_rrd.reset(new kis_tracked_rrd<>(globalreg, 
                         data_rrd_id, e->get_map_value(data_rrd_id)));
+            airtime_rrd.reset(new kis_tracked_rrd<>(globalreg, 
+                        airtime_rrd_id, e->get_map_value(airtime_rrd_id)));
             device_rrd.reset(new kis_tracked_rrd<>(globalreg, 
                         device_rrd_id, e->get_map_value(device_rrd_id)));
 
@@ -119,6 +165,8 @@ protected:
 
             data_rrd.reset(new kis_tracked_rrd<>(globalreg, data_rrd_id));
 
+            airtime_rrd.reset(new kis_tracked_rrd<>(globalreg, airtime_rrd_id));
+
             device_rrd.reset(new kis_tracked_rrd<>(globalreg, device_rrd_id));
 
             signal_data.reset(new kis_tracked_signal_data(globalreg, signal_data_id));
@@ -126,6 +174,7 @@ protected:
 
         add_map(packets_rrd);
         add_map(data_rrd);
+        add_map(airtime_rrd);
         add_map(device_rrd);
         add_map(signal_data);
 
@@ -148,6 +197,11 @@ protected:
     int data_rrd_id;
     shared_ptr<kis_tracked_rrd<> > data_rrd;
 
+    // Microseconds on the air per second RRD; divided by 10000 it's the percent
+    // of the channel in use
+    int airtime_rrd_id;
+    shared_ptr<kis_tracked_rrd<> > airtime_rrd;
+
     // Devices active per second RRD
     int device_rrd_id;
     shared_ptr<kis_tracked_rrd<> > device_rrd;
@@ -157,6 +211,12 @@ protected:
     int signal_data_id;
     shared_ptr<kis_tracked_signal_data> signal_data;
 
+    // C++-domain estimate of the devices seen on this channel, one sketch per
+    // second of the decay window indexed by the second; empty unless device
+    // counts are estimated from packets
+    vector<kis_hyperloglog> device_sketches;
+    vector<time_t> device_sketch_sec;
+
 };
 
 class Channeltracker_V2 : public tracker_component, 
@@ -184,14 +244,49 @@ public:
             const char *url, const char *method, const char *upload_data,
             size_t *upload_data_size, std::stringstream &stream);
 
+    // Tagged with our modification count, bumped by anything which changes
+    // the channels
+    virtual bool Httpd_ETag(const char *url, uint64_t *etag);
+
     // Timetracker API
     virtual int timetracker_event(int event_id);
 
     // Update device counts
     void update_device_counts(map<double, unsigned int> in_counts);
 
+    // Average packets per second and active devices seen on a frequency (in khz)
+    // over the last in_sec seconds, at most a minute; returns false if nothing has
+    // been seen on the frequency
+    bool get_frequency_activity(double in_freq_khz, unsigned int in_sec,
+            double *ret_pps, double *ret_devices);
+
+    // Average percent of the time a frequency (in khz) was in use over the last
+    // in_sec seconds, at most a minute, from the airtime of the frames seen;
+    // returns false if nothing has been seen on the frequency
+    bool get_frequency_utilization(double in_freq_khz, unsigned int in_sec,
+            double *ret_percent);
+
+    struct frequency_totals {
+        uint64_t packets;
+        uint64_t bytes;
+        uint64_t airtime;
+    };
+
+    // Packets, bytes, and airtime in microseconds seen on every frequency (in
+    // khz) since startup
+    void get_frequency_totals(map<double, frequency_totals> *ret_totals);
+
+    // Frequency, in khz, of a channel as named in a hop list ("6", "36HT40+",
+    // "2412MHz"); 0 if it isn't a recognizable wifi channel or frequency
+    static double channel_to_freq_khz(string in_channel);
+
     int device_decay;
 
+    // Estimate the active devices per channel from the packets seen, instead of
+    // counting the device list every second
+    bool device_estimate;
+    unsigned int device_estimate_precision;
+
 protected:
     pthread_mutex_t lock;
 
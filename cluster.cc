@@ -0,0 +1,405 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <string.h>
+#include <sstream>
+
+#include "cluster.h"
+#include "util.h"
+#include "configfile.h"
+#include "messagebus.h"
+#include "timetracker.h"
+#include "entrytracker.h"
+#include "federation.h"
+#include "datasourcetracker.h"
+
+// FNV-1a, finished with a mix so nearby names land on unrelated ring points
+static uint32_t cluster_hash(const string& in_str) {
+    uint32_t h = 2166136261U;
+
+    for (auto c : in_str) {
+        h ^= (uint8_t) c;
+        h *= 16777619U;
+    }
+
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+
+    return h;
+}
+
+shared_ptr<Cluster> Cluster::create_cluster(GlobalRegistry *in_globalreg) {
+    if (in_globalreg->kismet_config->FetchOptVec("cluster_node").size() == 0)
+        return NULL;
+
+    shared_ptr<Cluster> mon(new Cluster(in_globalreg));
+    in_globalreg->RegisterLifetimeGlobal(mon);
+    in_globalreg->InsertGlobal("CLUSTER", mon);
+    return mon;
+}
+
+Cluster::Cluster(GlobalRegistry *in_globalreg) :
+    Kis_Net_Httpd_CPPStream_Handler(in_globalreg) {
+
+    Httpd_RegisterRoute("GET", "/cluster/status");
+    Httpd_RegisterRoute("GET", "/cluster/owner/:uuid");
+
+    globalreg = in_globalreg;
+
+    redirects = 0;
+
+    vnodes = globalreg->kismet_config->FetchOptUInt("cluster_vnodes", 64);
+    if (vnodes == 0)
+        vnodes = 1;
+
+    string self = globalreg->kismet_config->FetchOpt("cluster_self");
+
+    self_index = 0;
+
+    bool found_self = false;
+
+    for (auto d : globalreg->kismet_config->FetchOptVec("cluster_node")) {
+        cluster_node n;
+
+        if (!ParseNode(d, &n))
+            continue;
+
+        n.self = (n.name == self);
+        n.up = n.self;
+
+        if (n.self) {
+            found_self = true;
+            self_index = nodes.size();
+        }
+
+        nodes.push_back(n);
+    }
+
+    if (!found_self) {
+        // Without knowing which node we are, every source would be sent away
+        _MSG("No cluster_node matches cluster_self='" + self + "', this server takes "
+                "every remote source it is sent", MSGFLAG_ERROR);
+
+        cluster_node n;
+        n.name = self;
+        n.self = true;
+        n.up = true;
+
+        self_index = nodes.size();
+        nodes.push_back(n);
+    }
+
+    status_id =
+        globalreg->entrytracker->RegisterField("kismet.cluster.status",
+                TrackerMap, "cluster status");
+    node_list_id =
+        globalreg->entrytracker->RegisterField("kismet.cluster.node_list",
+                TrackerVector, "cluster nodes");
+    node_id =
+        globalreg->entrytracker->RegisterField("kismet.cluster.node",
+                TrackerMap, "cluster node");
+    node_name_id =
+        globalreg->entrytracker->RegisterField("kismet.cluster.node.name",
+                TrackerString, "node name");
+    node_capture_id =
+        globalreg->entrytracker->RegisterField("kismet.cluster.node.capture",
+                TrackerString, "remote capture address of the node");
+    node_self_id =
+        globalreg->entrytracker->RegisterField("kismet.cluster.node.self",
+                TrackerUInt8, "node is this server");
+    node_up_id =
+        globalreg->entrytracker->RegisterField("kismet.cluster.node.up",
+                TrackerUInt8, "node is on the ring");
+    redirects_id =
+        globalreg->entrytracker->RegisterField("kismet.cluster.redirects",
+                TrackerUInt64, "remote sources sent to other nodes");
+    owner_id =
+        globalreg->entrytracker->RegisterField("kismet.cluster.owner",
+                TrackerMap, "owner of a source");
+    owner_uuid_id =
+        globalreg->entrytracker->RegisterField("kismet.cluster.owner.uuid",
+                TrackerUuid, "source uuid");
+
+    {
+        std::lock_guard<std::mutex> lk(cluster_mutex);
+        RefreshNodes();
+        BuildRing();
+    }
+
+    timer_id =
+        globalreg->timetracker->RegisterTimer(SERVER_TIMESLICES_SEC * 5, NULL, 1,
+                [this](int) -> int {
+                    bool changed;
+
+                    {
+                        std::lock_guard<std::mutex> lk(cluster_mutex);
+                        changed = RefreshNodes();
+                    }
+
+                    if (changed)
+                        Rebalance();
+
+                    return 1;
+                });
+}
+
+Cluster::~Cluster() {
+    globalreg->RemoveGlobal("CLUSTER");
+
+    globalreg->timetracker->RemoveTimer(timer_id);
+}
+
+bool Cluster::ParseNode(string in_def, cluster_node *ret_node) {
+    size_t cpos = in_def.find(':');
+
+    if (cpos == string::npos || cpos == 0) {
+        _MSG("Invalid cluster_node '" + in_def + "', expected "
+                "name:capture=host:port", MSGFLAG_ERROR);
+        return false;
+    }
+
+    ret_node->name = StrStrip(in_def.substr(0, cpos));
+
+    vector<opt_pair> opts;
+    StringToOpts(in_def.substr(cpos + 1, in_def.length()), ",", &opts);
+
+    ret_node->capture = FetchOpt("capture", &opts);
+
+    char host[513];
+    unsigned int port;
+
+    if (sscanf(ret_node->capture.c_str(), "%512[^:]:%u", host, &port) != 2) {
+        _MSG("Cluster node '" + ret_node->name + "' expected capture=host:port",
+                MSGFLAG_ERROR);
+        return false;
+    }
+
+    ret_node->self = false;
+    ret_node->up = false;
+
+    return true;
+}
+
+bool Cluster::RefreshNodes() {
+    shared_ptr<Federation> federation =
+        globalreg->FetchGlobalAs<Federation>("FEDERATION");
+
+    bool changed = false;
+
+    for (auto& n : nodes) {
+        if (n.self)
+            continue;
+
+        bool up = federation != NULL && federation->get_peer_connected(n.name);
+
+        if (up != n.up) {
+            _MSG("Cluster node '" + n.name + "' " + (up ? "joined" : "left") +
+                    ", rebalancing remote sources", MSGFLAG_INFO);
+            n.up = up;
+            changed = true;
+        }
+    }
+
+    if (changed)
+        BuildRing();
+
+    return changed;
+}
+
+void Cluster::BuildRing() {
+    ring.clear();
+
+    for (unsigned int n = 0; n < nodes.size(); n++) {
+        if (!nodes[n].up)
+            continue;
+
+        for (unsigned int v = 0; v < vnodes; v++) {
+            std::stringstream ss;
+            ss << nodes[n].name << "#" << v;
+
+            // On the rare collision the earlier node keeps the point, the same
+            // on every server
+            ring.emplace(cluster_hash(ss.str()), n);
+        }
+    }
+}
+
+unsigned int Cluster::Owner(uuid in_uuid) {
+    if (ring.size() == 0)
+        return self_index;
+
+    auto i = ring.lower_bound(cluster_hash(in_uuid.UUID2String()));
+
+    if (i == ring.end())
+        i = ring.begin();
+
+    return i->second;
+}
+
+bool Cluster::claim_source(uuid in_uuid, string *ret_target) {
+    std::lock_guard<std::mutex> lk(cluster_mutex);
+
+    unsigned int owner = Owner(in_uuid);
+
+    if (owner == self_index)
+        return true;
+
+    redirects++;
+
+    *ret_target = nodes[owner].capture;
+
+    return false;
+}
+
+void Cluster::Rebalance() {
+    shared_ptr<Datasourcetracker> datasourcetracker =
+        globalreg->FetchGlobalAs<Datasourcetracker>("DATASOURCETRACKER");
+
+    if (datasourcetracker == NULL)
+        return;
+
+    vector<SharedDatasource> sources = datasourcetracker->get_datasources();
+
+    for (auto ds : sources) {
+        if (!ds->get_source_remote() || !ds->get_source_running())
+            continue;
+
+        string target;
+
+        {
+            std::lock_guard<std::mutex> lk(cluster_mutex);
+
+            unsigned int owner = Owner(ds->get_source_uuid());
+
+            if (owner == self_index)
+                continue;
+
+            target = nodes[owner].capture;
+            redirects++;
+        }
+
+        _MSG("Moving remote source '" + ds->get_source_name() + "' to cluster node " +
+                target, MSGFLAG_INFO);
+
+        ds->redirect_source(target);
+    }
+}
+
+bool Cluster::Httpd_VerifyPath(const char *path, const char *method) {
+    if (strcmp(method, "GET") != 0)
+        return false;
+
+    string stripped = Httpd_StripSuffix(path);
+
+    if (stripped == "/cluster/status")
+        return Httpd_CanSerialize(path);
+
+    vector<string> tokenurl = StrTokenize(path, "/");
+
+    if (tokenurl.size() != 4 || tokenurl[1] != "cluster" || tokenurl[2] != "owner")
+        return false;
+
+    uuid u(Httpd_StripSuffix(tokenurl[3]));
+
+    if (u.error)
+        return false;
+
+    return Httpd_CanSerialize(tokenurl[3]);
+}
+
+void Cluster::Httpd_CreateStreamResponse(
+        Kis_Net_Httpd *httpd __attribute__((unused)),
+        Kis_Net_Httpd_Connection *connection __attribute__((unused)),
+        const char *path, const char *method,
+        const char *upload_data __attribute__((unused)),
+        size_t *upload_data_size __attribute__((unused)),
+        std::stringstream &stream) {
+
+    if (strcmp(method, "GET") != 0)
+        return;
+
+    std::lock_guard<std::mutex> lk(cluster_mutex);
+
+    SharedTrackerElement e;
+
+    auto make_node = [this](cluster_node& n) -> SharedTrackerElement {
+        SharedTrackerElement nm(new TrackerElement(TrackerMap, node_id));
+        SharedTrackerElement e;
+
+        e.reset(new TrackerElement(TrackerString, node_name_id));
+        e->set(n.name);
+        nm->add_map(e);
+
+        e.reset(new TrackerElement(TrackerString, node_capture_id));
+        e->set(n.capture);
+        nm->add_map(e);
+
+        e.reset(new TrackerElement(TrackerUInt8, node_self_id));
+        e->set((uint8_t) n.self);
+        nm->add_map(e);
+
+        e.reset(new TrackerElement(TrackerUInt8, node_up_id));
+        e->set((uint8_t) n.up);
+        nm->add_map(e);
+
+        return nm;
+    };
+
+    if (Httpd_StripSuffix(path) == "/cluster/status") {
+        SharedTrackerElement status(new TrackerElement(TrackerMap, status_id));
+        SharedTrackerElement nodevec(new TrackerElement(TrackerVector, node_list_id));
+
+        for (auto& n : nodes)
+            nodevec->add_vector(make_node(n));
+
+        status->add_map(nodevec);
+
+        e.reset(new TrackerElement(TrackerUInt64, redirects_id));
+        e->set((uint64_t) redirects);
+        status->add_map(e);
+
+        Httpd_Serialize(path, stream, status);
+        return;
+    }
+
+    vector<string> tokenurl = StrTokenize(path, "/");
+
+    if (tokenurl.size() != 4)
+        return;
+
+    uuid u(Httpd_StripSuffix(tokenurl[3]));
+
+    if (u.error)
+        return;
+
+    SharedTrackerElement owner(new TrackerElement(TrackerMap, owner_id));
+
+    e.reset(new TrackerElement(TrackerUuid, owner_uuid_id));
+    e->set(u);
+    owner->add_map(e);
+
+    owner->add_map(make_node(nodes[Owner(u)]));
+
+    Httpd_Serialize(path, stream, owner);
+}
+
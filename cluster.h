@@ -0,0 +1,125 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __CLUSTER_H__
+#define __CLUSTER_H__
+
+#include "config.h"
+
+#include <stdint.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "globalregistry.h"
+#include "uuid.h"
+#include "kis_net_microhttpd.h"
+
+// Sharding of remote capture across a cluster of servers
+//
+// Every server of the cluster lists all of them, itself included, as
+// 'cluster_node=name:capture=host:port', where capture is the remote capture
+// address of the server, and names itself with 'cluster_self=name'.  The other
+// nodes must also be federation peers (see federation.h) under the same names:
+// a node counts as up while its event stream is open.
+//
+// Sources are owned by the node their uuid hashes to on a ring of
+// 'cluster_vnodes' points per node which is up, so adding or losing a node only
+// moves the sources of the ring segments it gains or gives up.  A remote
+// capture binary connecting to a node which doesn't own its source is sent a
+// REDIRECT to the owner; a binary which was sent here is always taken, so nodes
+// with briefly different views of the cluster can't bounce it around.  When a
+// node joins or leaves, running remote sources whose owner changed are
+// redirected, and the binaries of a lost node reconnect to the server they were
+// started with, which sends them on to the new owner.
+//
+// Capture binaries are pointed at one node, the coordinator, which usually
+// also federates the others for the aggregate device view.  The state of the
+// ring and the owner of a source are served at
+//  /cluster/status
+//  /cluster/owner/[uuid]
+class Cluster : public LifetimeGlobal, public Kis_Net_Httpd_CPPStream_Handler {
+public:
+    // Returns NULL unless cluster nodes are configured
+    static shared_ptr<Cluster> create_cluster(GlobalRegistry *in_globalreg);
+
+private:
+    Cluster(GlobalRegistry *in_globalreg);
+
+public:
+    virtual ~Cluster();
+
+    virtual bool Httpd_VerifyPath(const char *path, const char *method);
+
+    virtual void Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd,
+            Kis_Net_Httpd_Connection *connection,
+            const char *path, const char *method, const char *upload_data,
+            size_t *upload_data_size, std::stringstream &stream);
+
+    // Should this node take a source?  If not, the capture address of the node
+    // which owns it is placed in ret_target
+    bool claim_source(uuid in_uuid, string *ret_target);
+
+protected:
+    GlobalRegistry *globalreg;
+
+    struct cluster_node {
+        string name;
+        string capture;
+        bool self;
+        bool up;
+    };
+
+    // Parse a cluster_node line
+    bool ParseNode(string in_def, cluster_node *ret_node);
+
+    // Refresh which nodes are up; rebuilds the ring and returns true if that
+    // changed.  Must hold cluster_mutex
+    bool RefreshNodes();
+
+    // Build the ring from the nodes which are up; must hold cluster_mutex
+    void BuildRing();
+
+    // Index of the node owning a uuid; must hold cluster_mutex
+    unsigned int Owner(uuid in_uuid);
+
+    // Send running remote sources this node no longer owns to their owner
+    void Rebalance();
+
+    std::mutex cluster_mutex;
+
+    vector<cluster_node> nodes;
+    unsigned int self_index;
+
+    unsigned int vnodes;
+
+    // Ring points and the node they belong to
+    std::map<uint32_t, unsigned int> ring;
+
+    uint64_t redirects;
+
+    int timer_id;
+
+    int status_id, node_list_id, node_id, node_name_id, node_capture_id, node_self_id,
+        node_up_id, redirects_id, owner_id, owner_uuid_id;
+};
+
+#endif
+
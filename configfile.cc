@@ -34,9 +34,128 @@
 #include "configfile.h"
 #include "messagebus.h"
 
+const config_snapshot::entry *config_snapshot::find(const string& in_key) const {
+    auto i = entries.find(in_key);
+
+    if (i != entries.end())
+        return &(i->second);
+
+    // Options are stored lower-case; only pay for converting the key when it
+    // isn't already
+    for (auto c : in_key) {
+        if (isupper(c)) {
+            i = entries.find(StrLower(in_key));
+
+            if (i != entries.end())
+                return &(i->second);
+
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+void config_snapshot::add(const string& in_key, const vector<string>& in_values) {
+    entry& e = entries[in_key];
+
+    e.values = in_values;
+    e.bool_v = -1;
+    e.int_valid = e.uint_valid = false;
+    e.int_v = 0;
+    e.uint_v = 0;
+
+    if (in_values.size() == 0)
+        return;
+
+    string v = StrLower(in_values[0]);
+
+    e.bool_v = StringToBool(v);
+
+    try {
+        e.int_v = StringToInt(v);
+        e.int_valid = true;
+    } catch (const std::runtime_error& err) { }
+
+    try {
+        e.uint_v = StringToUInt(v);
+        e.uint_valid = true;
+    } catch (const std::runtime_error& err) { }
+}
+
+const string& config_snapshot::get(const string& in_key) const {
+    static const string empty;
+
+    const entry *e = find(in_key);
+
+    if (e == NULL || e->values.size() == 0)
+        return empty;
+
+    return e->values[0];
+}
+
+const vector<string>& config_snapshot::get_vec(const string& in_key) const {
+    static const vector<string> empty;
+
+    const entry *e = find(in_key);
+
+    if (e == NULL)
+        return empty;
+
+    return e->values;
+}
+
+int config_snapshot::get_bool(const string& in_key, int dvalue) const {
+    const entry *e = find(in_key);
+
+    if (e == NULL || e->bool_v == -1)
+        return dvalue;
+
+    return e->bool_v;
+}
+
+int config_snapshot::get_int(const string& in_key, int dvalue) const {
+    const entry *e = find(in_key);
+
+    if (e == NULL || !e->int_valid)
+        return dvalue;
+
+    return e->int_v;
+}
+
+unsigned int config_snapshot::get_uint(const string& in_key, unsigned int dvalue) const {
+    const entry *e = find(in_key);
+
+    if (e == NULL || !e->uint_valid)
+        return dvalue;
+
+    return e->uint_v;
+}
+
+std::set<string> config_snapshot::diff(const config_snapshot& a, 
+        const config_snapshot& b) {
+    std::set<string> ret;
+
+    for (auto& ae : a.entries) {
+        auto be = b.entries.find(ae.first);
+
+        if (be == b.entries.end() || be->second.values != ae.second.values)
+            ret.insert(ae.first);
+    }
+
+    for (auto& be : b.entries) {
+        if (a.entries.find(be.first) == a.entries.end())
+            ret.insert(be.first);
+    }
+
+    return ret;
+}
+
 ConfigFile::ConfigFile(GlobalRegistry *in_globalreg) {
     globalreg = in_globalreg;
     checksum = 0;
+    snapshot_version = 0;
+    next_reload_id = 0;
 
     pthread_mutex_init(&config_locker, NULL);
 }
@@ -47,9 +166,144 @@ ConfigFile::~ConfigFile() {
 
 int ConfigFile::ParseConfig(const char *in_fname) {
     local_locker lock(&config_locker);
+
+    parsed_files.push_back(in_fname);
+    snapshot.reset();
+
     return ParseConfig_nl(in_fname);
 }
 
+int ConfigFile::Reload() {
+    shared_ptr<const config_snapshot> new_snap;
+    std::set<string> changed;
+
+    {
+        local_locker lock(&config_locker);
+
+        if (parsed_files.size() == 0)
+            return 0;
+
+        shared_ptr<const config_snapshot> old_snap = FetchSnapshot_nl();
+
+        map<string, vector<config_entity> > old_map;
+        map<string, int> old_dirty = config_map_dirty;
+
+        old_map.swap(config_map);
+
+        for (auto f : parsed_files) {
+            if (ParseConfig_nl(f.c_str()) < 0) {
+                config_map.swap(old_map);
+                config_map_dirty = old_dirty;
+
+                _MSG("Could not reload the Kismet config, keeping the current "
+                        "config", MSGFLAG_ERROR);
+                return -1;
+            }
+        }
+
+        // Options set while running replace what the files say, as they did
+        // when they were set
+        for (auto& o : old_map) {
+            if (o.second.size() != 0 && o.second[0].sourcefile == "::dynamic::")
+                config_map[o.first] = o.second;
+        }
+
+        snapshot.reset();
+        new_snap = FetchSnapshot_nl();
+
+        changed = config_snapshot::diff(*old_snap, *new_snap);
+
+        // Only what changed is dirty because of the reload
+        config_map_dirty = old_dirty;
+        for (auto& c : changed)
+            config_map_dirty[c] = 1;
+    }
+
+    stringstream sstream;
+    sstream << "Reloaded the Kismet config, " << changed.size() << " option" <<
+        (changed.size() == 1 ? "" : "s") << " changed";
+    _MSG(sstream.str(), MSGFLAG_INFO);
+
+    if (changed.size() == 0)
+        return 0;
+
+    // Called without holding any lock, since handlers will want to look at
+    // the config and take locks of their own
+    vector<std::pair<reload_cb, std::set<string> > > calls;
+
+    {
+        std::lock_guard<std::mutex> lock(reload_mutex);
+
+        for (auto& h : reload_handlers) {
+            std::set<string> keys;
+
+            for (auto& k : h.second.keys) {
+                if (changed.find(k) != changed.end())
+                    keys.insert(k);
+            }
+
+            if (keys.size() != 0)
+                calls.push_back(std::make_pair(h.second.cb, keys));
+        }
+    }
+
+    for (auto& c : calls)
+        c.first(new_snap, c.second);
+
+    return changed.size();
+}
+
+shared_ptr<const config_snapshot> ConfigFile::FetchSnapshot() {
+    local_locker lock(&config_locker);
+    return FetchSnapshot_nl();
+}
+
+shared_ptr<const config_snapshot> ConfigFile::FetchSnapshot_nl() {
+    if (snapshot != NULL)
+        return snapshot;
+
+    shared_ptr<config_snapshot> snap(new config_snapshot());
+
+    snap->entries.reserve(config_map.size());
+
+    vector<string> values;
+
+    for (auto& c : config_map) {
+        values.clear();
+
+        for (auto& e : c.second)
+            values.push_back(e.value);
+
+        snap->add(c.first, values);
+    }
+
+    snap->version = ++snapshot_version;
+    snapshot = snap;
+
+    return snapshot;
+}
+
+int ConfigFile::RegisterReloadHandler(const vector<string>& in_keys, reload_cb in_cb) {
+    std::lock_guard<std::mutex> lock(reload_mutex);
+
+    reload_handler h;
+
+    for (auto k : in_keys)
+        h.keys.insert(StrLower(k));
+
+    h.cb = in_cb;
+
+    int id = next_reload_id++;
+    reload_handlers[id] = h;
+
+    return id;
+}
+
+void ConfigFile::RemoveReloadHandler(int in_id) {
+    std::lock_guard<std::mutex> lock(reload_mutex);
+    reload_handlers.erase(in_id);
+}
+
 int ConfigFile::ParseConfig_nl(const char *in_fname) {
     // We don't lock
     
@@ -163,31 +417,77 @@ void ConfigFile::ParseOptInclude(const string path) {
     globfree(&globbed);
 }
 
-int ConfigFile::SaveConfig(const char *in_fname) {
+string ConfigFile::SerializeConfig() {
     local_locker lock(&config_locker);
 
     stringstream sstream;
 
-	FILE *wf = NULL;
+	for (auto x = config_map.begin(); x != config_map.end(); ++x) {
+		for (unsigned int y = 0; y < x->second.size(); y++) {
+            sstream << x->first << "=" << x->second[y].value << "\n";
+		}
+	}
+
+    return sstream.str();
+}
+
+int ConfigFile::WriteConfigFile(GlobalRegistry *globalreg, const string& in_fname,
+        const string& in_content) {
+    stringstream sstream;
 
-	if ((wf = fopen(in_fname, "w")) == NULL) {
+    string tmpname = in_fname + ".tmp";
 
+	FILE *wf = NULL;
+
+	if ((wf = fopen(tmpname.c_str(), "w")) == NULL) {
         sstream << "Error writing config file '" << in_fname <<
             "': " << kis_strerror_r(errno);
         _MSG(sstream.str(), MSGFLAG_ERROR);
 		return -1;
 	}
 
-	for (auto x = config_map.begin(); x != config_map.end(); ++x) {
-		for (unsigned int y = 0; y < x->second.size(); y++) {
-			fprintf(wf, "%s=%s\n", x->first.c_str(), x->second[y].value.c_str());
-		}
-	}
+    if (fwrite(in_content.data(), in_content.length(), 1, wf) != 1 &&
+            in_content.length() != 0) {
+        sstream << "Error writing config file '" << in_fname <<
+            "': " << kis_strerror_r(errno);
+        _MSG(sstream.str(), MSGFLAG_ERROR);
+        fclose(wf);
+        unlink(tmpname.c_str());
+        return -1;
+    }
 
+    // On disk before it replaces the old one, or a crash could leave neither
+    fflush(wf);
+    fsync(fileno(wf));
 	fclose(wf);
+
+    if (rename(tmpname.c_str(), in_fname.c_str()) < 0) {
+        sstream << "Error replacing config file '" << in_fname <<
+            "': " << kis_strerror_r(errno);
+        _MSG(sstream.str(), MSGFLAG_ERROR);
+        unlink(tmpname.c_str());
+        return -1;
+    }
+
 	return 1;
 }
 
+int ConfigFile::SaveConfig(const char *in_fname) {
+    return WriteConfigFile(globalreg, in_fname, SerializeConfig());
+}
+
+void ConfigFile::SaveConfigAsync(string in_fname) {
+    shared_ptr<ConfigWriter> writer =
+        globalreg->FetchGlobalAs<ConfigWriter>("CONFIG_WRITER");
+
+    if (writer == NULL) {
+        SaveConfig(in_fname.c_str());
+        return;
+    }
+
+    writer->QueueSave(in_fname, SerializeConfig());
+}
+
 string ConfigFile::FetchOpt(string in_key) {
     local_locker lock(&config_locker);
 
@@ -307,6 +607,7 @@ void ConfigFile::SetOpt(string in_key, string in_val, int in_dirty) {
     v.push_back(e);
 	config_map[StrLower(in_key)] = v;
 	SetOptDirty_nl(in_key, in_dirty);
+    snapshot.reset();
 }
 
 void ConfigFile::SetOptVec(string in_key, vector<string> in_val, int in_dirty) {
@@ -320,6 +621,7 @@ void ConfigFile::SetOptVec(string in_key, vector<string> in_val, int in_dirty) {
 
 	config_map[StrLower(in_key)] = cev;
 	SetOptDirty_nl(in_key, in_dirty);
+    snapshot.reset();
 }
 
 
@@ -578,3 +880,61 @@ void ConfigFile::CalculateChecksum() {
 	checksum = Adler32Checksum(cks.c_str(), cks.length());
 }
 
+ConfigWriter::ConfigWriter(GlobalRegistry *in_globalreg) {
+    globalreg = in_globalreg;
+    running = true;
+
+    writer_thread = std::thread([this]() { WriterThread(); });
+}
+
+ConfigWriter::~ConfigWriter() {
+    globalreg->RemoveGlobal("CONFIG_WRITER");
+
+    {
+        std::lock_guard<std::mutex> lk(writer_mutex);
+        running = false;
+    }
+
+    writer_cv.notify_one();
+
+    // Writes out anything still queued before exiting
+    writer_thread.join();
+}
+
+void ConfigWriter::QueueSave(const string& in_fname, const string& in_content) {
+    {
+        std::lock_guard<std::mutex> lk(writer_mutex);
+
+        // Shutting down; the writer may already have finished
+        if (!running) {
+            ConfigFile::WriteConfigFile(globalreg, in_fname, in_content);
+            return;
+        }
+
+        pending[in_fname] = in_content;
+    }
+
+    writer_cv.notify_one();
+}
+
+void ConfigWriter::WriterThread() {
+    std::unique_lock<std::mutex> lk(writer_mutex);
+
+    while (1) {
+        while (running && pending.size() == 0)
+            writer_cv.wait(lk);
+
+        if (pending.size() == 0)
+            return;
+
+        map<string, string> saves;
+        saves.swap(pending);
+
+        lk.unlock();
+
+        for (auto s : saves)
+            ConfigFile::WriteConfigFile(globalreg, s.first, s.second);
+
+        lk.lock();
+    }
+}
@@ -30,19 +30,107 @@
 
 #include <string>
 #include <map>
+#include <set>
+#include <unordered_map>
 #include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
 
 #include "globalregistry.h"
 #include "macaddr.h"
 
+// Immutable parsed copy of the config
+//
+// Options are hashed by their lower-case name, and the first value of each
+// is parsed as a boolean and an integer when the snapshot is made, so code
+// which looks options up at runtime - once per source opened, once per alert -
+// doesn't lock the config, copy vectors, or parse strings to do it.  Hold on
+// to the snapshot for as long as references into it are used.
+class config_snapshot {
+public:
+    config_snapshot() {
+        version = 0;
+    }
+
+    uint64_t get_version() const { return version; }
+
+    bool has(const string& in_key) const {
+        return find(in_key) != NULL;
+    }
+
+    // First value of an option, or "" if it isn't set
+    const string& get(const string& in_key) const;
+
+    // All the values of an option
+    const vector<string>& get_vec(const string& in_key) const;
+
+    // Same defaults and parsing as the ConfigFile FetchOpt.. functions
+    int get_bool(const string& in_key, int dvalue) const;
+    int get_int(const string& in_key, int dvalue) const;
+    unsigned int get_uint(const string& in_key, unsigned int dvalue) const;
+
+    // Options which are set in one snapshot and not the other, or have
+    // different values
+    static std::set<string> diff(const config_snapshot& a, const config_snapshot& b);
+
+protected:
+    friend class ConfigFile;
+
+    struct entry {
+        vector<string> values;
+
+        // First value, parsed; -1 when it isn't a boolean
+        int bool_v;
+        bool int_valid, uint_valid;
+        int int_v;
+        unsigned int uint_v;
+    };
+
+    const entry *find(const string& in_key) const;
+
+    void add(const string& in_key, const vector<string>& in_values);
+
+    std::unordered_map<string, entry> entries;
+    uint64_t version;
+};
+
 class ConfigFile {
 public:
 	ConfigFile(GlobalRegistry *in_globalreg);
     ~ConfigFile();
 
     int ParseConfig(const char *in_fname);
+
+    // Write the config to a temporary file and rename it into place, so the
+    // file is never seen half written
 	int SaveConfig(const char *in_fname);
 
+    // Snapshot the config and hand it to the background ConfigWriter, if there
+    // is one, otherwise save it as SaveConfig does
+    void SaveConfigAsync(string in_fname);
+
+    // Re-read the config files originally parsed and replace the config with
+    // them, keeping options set with SetOpt..; handlers of the options which
+    // changed are called with the new snapshot.  Returns the number of
+    // options which changed, or negative if the files couldn't be parsed, in
+    // which case the config is left as it was.
+    int Reload();
+
+    // Current snapshot of the config, made when it is first asked for after
+    // a change
+    shared_ptr<const config_snapshot> FetchSnapshot();
+
+    typedef std::function<void (shared_ptr<const config_snapshot>,
+            const std::set<string>&)> reload_cb;
+
+    // Call a function, from the thread calling Reload, when any of a list of
+    // options changes on reload; it gets the new snapshot and the options of
+    // the list which changed.  Returns an id for RemoveReloadHandler.
+    int RegisterReloadHandler(const vector<string>& in_keys, reload_cb in_cb);
+    void RemoveReloadHandler(int in_id);
+
     string FetchOpt(string in_key);
     string FetchOpt_nl(string in_key);
     vector<string> FetchOptVec(string in_key);
@@ -67,9 +155,16 @@ public:
 	// Fetches the load-time checksum of the config values.
 	uint32_t FetchFileChecksum();
 
+    // Write a saved config into place; returns negative on failure
+    static int WriteConfigFile(GlobalRegistry *globalreg, const string& in_fname,
+            const string& in_content);
+
 protected:
 	GlobalRegistry *globalreg;
 
+    // The config as it is saved, one key=value per line
+    string SerializeConfig();
+
 	void CalculateChecksum();
 
     // Internal non-locking versions for use when parsing configs ourselves
@@ -100,6 +195,59 @@ protected:
 	string ckstring;
 
     pthread_mutex_t config_locker;
+
+    // Top-level files parsed, in order, for reloading
+    vector<string> parsed_files;
+
+    // Snapshot of config_map; reset whenever it changes
+    shared_ptr<const config_snapshot> snapshot;
+    uint64_t snapshot_version;
+
+    shared_ptr<const config_snapshot> FetchSnapshot_nl();
+
+    struct reload_handler {
+        std::set<string> keys;
+        reload_cb cb;
+    };
+
+    std::mutex reload_mutex;
+    map<int, reload_handler> reload_handlers;
+    int next_reload_id;
+};
+
+// Background writer for config files which are rewritten while running, such
+// as the tag, session, and probe caches, so that the thread changing them
+// doesn't wait on the disk.  Saves are queued by file; a file saved again
+// before it was written is only written once, with the latest contents.
+// Anything still queued is written before the writer is destroyed.
+class ConfigWriter : public LifetimeGlobal {
+public:
+    static shared_ptr<ConfigWriter> create_configwriter(GlobalRegistry *in_globalreg) {
+        shared_ptr<ConfigWriter> mon(new ConfigWriter(in_globalreg));
+        in_globalreg->RegisterLifetimeGlobal(mon);
+        in_globalreg->InsertGlobal("CONFIG_WRITER", mon);
+        return mon;
+    }
+
+private:
+    ConfigWriter(GlobalRegistry *in_globalreg);
+
+public:
+    virtual ~ConfigWriter();
+
+    void QueueSave(const string& in_fname, const string& in_content);
+
+protected:
+    GlobalRegistry *globalreg;
+
+    void WriterThread();
+
+    std::mutex writer_mutex;
+    std::condition_variable writer_cv;
+    map<string, string> pending;
+    bool running;
+
+    std::thread writer_thread;
 };
 
 #endif
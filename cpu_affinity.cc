@@ -0,0 +1,201 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <set>
+#include <sstream>
+
+#include "util.h"
+#include "configfile.h"
+#include "messagebus.h"
+#include "cpu_affinity.h"
+
+// Parse a list of cpus into the cpus it names
+static bool parse_cpus(std::string in_cpus, std::set<unsigned int> *ret_cpus) {
+    std::vector<std::string> ranges = StrTokenize(in_cpus, ",");
+
+    ret_cpus->clear();
+
+    for (auto r : ranges) {
+        r = StrStrip(r);
+
+        if (r.length() == 0)
+            return false;
+
+        unsigned int first, last;
+        char extra;
+
+        if (sscanf(r.c_str(), "%u-%u%c", &first, &last, &extra) == 2) {
+            if (last < first)
+                return false;
+        } else if (sscanf(r.c_str(), "%u%c", &first, &extra) == 1) {
+            last = first;
+        } else {
+            return false;
+        }
+
+#ifdef SYS_LINUX
+        if (last >= CPU_SETSIZE)
+            return false;
+#endif
+
+        for (unsigned int c = first; c <= last; c++)
+            ret_cpus->insert(c);
+    }
+
+    return ret_cpus->size() != 0;
+}
+
+CpuAffinity::CpuAffinity(GlobalRegistry *in_globalreg) {
+    globalreg = in_globalreg;
+
+    // Everything the main loop starts from here on inherits its placement
+    place_thread("main", pthread_self(),
+            globalreg->kismet_config->FetchOpt("cpu_affinity_main"));
+}
+
+CpuAffinity::~CpuAffinity() {
+
+}
+
+bool CpuAffinity::place_thread(std::string in_name, pthread_t in_thread,
+        std::string in_cpus) {
+    if (in_cpus.length() == 0)
+        return true;
+
+    std::string cpus = normalize_cpu_list(in_cpus);
+
+    if (cpus.length() == 0) {
+        _MSG("Invalid cpu list '" + in_cpus + "' for " + in_name + ", expected a "
+                "list of cpus like '0-3,8'", MSGFLAG_ERROR);
+        return false;
+    }
+
+#ifdef SYS_LINUX
+    cpu_set_t set;
+
+    parse_cpu_list(cpus, &set);
+
+    int r = pthread_setaffinity_np(in_thread, sizeof(cpu_set_t), &set);
+
+    if (r != 0) {
+        _MSG("Unable to place " + in_name + " on cpus " + cpus + ": " +
+                kis_strerror_r(r), MSGFLAG_ERROR);
+        return false;
+    }
+
+    record_placement(in_name, cpus);
+
+    return true;
+#else
+    _MSG("CPU affinity is not supported on this platform, not placing " + in_name,
+            MSGFLAG_INFO);
+    return false;
+#endif
+}
+
+void CpuAffinity::record_placement(std::string in_name, std::string in_cpus) {
+    std::lock_guard<std::mutex> lk(placement_mutex);
+
+    placements[in_name] = in_cpus;
+}
+
+void CpuAffinity::remove_placement(std::string in_name) {
+    std::lock_guard<std::mutex> lk(placement_mutex);
+
+    placements.erase(in_name);
+}
+
+std::map<std::string, std::string> CpuAffinity::get_placements() {
+    std::lock_guard<std::mutex> lk(placement_mutex);
+
+    return placements;
+}
+
+#ifdef SYS_LINUX
+bool CpuAffinity::parse_cpu_list(std::string in_cpus, cpu_set_t *ret_set) {
+    std::set<unsigned int> cpus;
+
+    CPU_ZERO(ret_set);
+
+    if (!parse_cpus(in_cpus, &cpus))
+        return false;
+
+    for (auto c : cpus)
+        CPU_SET(c, ret_set);
+
+    return true;
+}
+#endif
+
+std::string CpuAffinity::normalize_cpu_list(std::string in_cpus) {
+    std::set<unsigned int> cpus;
+    std::stringstream ss;
+
+    if (!parse_cpus(in_cpus, &cpus))
+        return "";
+
+    // Collapse runs of cpus into ranges
+    auto c = cpus.begin();
+    while (c != cpus.end()) {
+        unsigned int first = *c;
+        unsigned int last = first;
+
+        for (++c; c != cpus.end() && *c == last + 1; ++c)
+            last = *c;
+
+        if (ss.tellp() != 0)
+            ss << ",";
+
+        if (first == last)
+            ss << first;
+        else
+            ss << first << "-" << last;
+    }
+
+    return ss.str();
+}
+
+CpuAffinityScope::CpuAffinityScope(std::string in_cpus) {
+    placed = false;
+
+#ifdef SYS_LINUX
+    cpu_set_t set;
+
+    if (in_cpus.length() == 0 || !CpuAffinity::parse_cpu_list(in_cpus, &set))
+        return;
+
+    if (pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), &saved_set) != 0)
+        return;
+
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set) != 0)
+        return;
+
+    placed = true;
+#endif
+}
+
+CpuAffinityScope::~CpuAffinityScope() {
+#ifdef SYS_LINUX
+    if (placed)
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &saved_set);
+#endif
+}
+
@@ -0,0 +1,110 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __CPU_AFFINITY_H__
+#define __CPU_AFFINITY_H__
+
+#include "config.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "globalregistry.h"
+
+// CPU placement of the threads of the server and the capture binaries it launches
+//
+// Each kind of thread can be kept to a list of cpus ("0-3,8"):  the main loop
+// (cpu_affinity_main), the packet pipeline (cpu_affinity_packetchain), the http
+// server (cpu_affinity_httpd), and each datasource's capture binary and reader
+// thread (the 'affinity' source option, or cpu_affinity_datasources).  Threads
+// and processes inherit the placement of the thread which creates them, so
+// anything not placed explicitly follows the main loop.
+//
+// Keeping the threads which touch the same data on the cores of one socket also
+// keeps the memory they allocate local to that socket.
+//
+// Placements are recorded by name and reported by the system monitor.  On
+// platforms without thread affinity, placement is ignored.
+class CpuAffinity : public LifetimeGlobal {
+public:
+    static shared_ptr<CpuAffinity> create_cpuaffinity(GlobalRegistry *in_globalreg) {
+        shared_ptr<CpuAffinity> mon(new CpuAffinity(in_globalreg));
+        in_globalreg->RegisterLifetimeGlobal(mon);
+        in_globalreg->InsertGlobal("CPU_AFFINITY", mon);
+        return mon;
+    }
+
+private:
+    CpuAffinity(GlobalRegistry *in_globalreg);
+
+public:
+    virtual ~CpuAffinity();
+
+    // Place a thread on a list of cpus, and record it under a name; an empty list
+    // leaves the thread where it is.  Returns false if the list is invalid or the
+    // thread could not be placed.
+    bool place_thread(std::string in_name, pthread_t in_thread, std::string in_cpus);
+
+    // Record a placement made some other way, such as with a CpuAffinityScope
+    void record_placement(std::string in_name, std::string in_cpus);
+    void remove_placement(std::string in_name);
+
+    // Recorded placements, by name
+    std::map<std::string, std::string> get_placements();
+
+#ifdef SYS_LINUX
+    // Parse a list of cpus like "0-3,8"; returns false if it's invalid or names a
+    // cpu the set can't hold
+    static bool parse_cpu_list(std::string in_cpus, cpu_set_t *ret_set);
+#endif
+
+    // Canonical form of a list of cpus ("3,0-2" is "0-3"), or an empty string if
+    // it's invalid
+    static std::string normalize_cpu_list(std::string in_cpus);
+
+protected:
+    GlobalRegistry *globalreg;
+
+    std::mutex placement_mutex;
+    std::map<std::string, std::string> placements;
+};
+
+// Keep the calling thread on a list of cpus for the life of the scope, so the
+// threads and processes it creates meanwhile start out there.  An empty or
+// invalid list changes nothing.
+class CpuAffinityScope {
+public:
+    CpuAffinityScope(std::string in_cpus);
+    ~CpuAffinityScope();
+
+    // Was the thread placed?
+    bool get_placed() { return placed; }
+
+protected:
+    bool placed;
+
+#ifdef SYS_LINUX
+    cpu_set_t saved_set;
+#endif
+};
+
+#endif
+
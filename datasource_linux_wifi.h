@@ -34,6 +34,12 @@ public:
 
         // Set the capture binary
         set_int_source_ipc_binary("kismet_cap_linux_wifi");
+
+        // The capture binary can carry several interfaces at once
+        shared_helper_capable = true;
+
+        // Built on the capture framework, so it can write into a shared ring
+        ipc_shm_capable = true;
     }
 
     virtual ~KisDatasourceLinuxWifi() { };
@@ -34,6 +34,9 @@ public:
 
         // Set the capture binary
         set_int_source_ipc_binary("kismet_cap_pcapfile");
+
+        // Replaying a file runs as fast as we can parse it, so skip the pipe
+        ipc_shm_capable = true;
     }
 
     virtual ~KisDatasourcePcapfile() { };
@@ -19,6 +19,7 @@
 #include "config.h"
 
 #include <string.h>
+#include <sys/stat.h>
 
 #include "configfile.h"
 #include "getopt.h"
@@ -35,9 +36,14 @@
 #include "streamtracker.h"
 #include "kis_httpd_registry.h"
 #include "endian_magic.h"
+#include "ringbuf_spsc.h"
+#include "channeltracker2.h"
+#include "cluster.h"
+#include "kis_spectrum.h"
 
 DST_DatasourceProbe::DST_DatasourceProbe(GlobalRegistry *in_globalreg, 
-        string in_definition, SharedTrackerElement in_protovec) {
+        string in_definition, SharedTrackerElement in_protovec, 
+        unsigned int in_timeout) {
 
     globalreg = in_globalreg;
 
@@ -57,6 +63,7 @@ DST_DatasourceProbe::DST_DatasourceProbe(GlobalRegistry *in_globalreg,
     transaction_id = 0;
 
     cancelled = false;
+    timeout = in_timeout;
     cancel_timer = -1;
 }
 
@@ -150,7 +157,7 @@ void DST_DatasourceProbe::probe_sources(
     local_locker lock(&probe_lock);
 
     cancel_timer = 
-        timetracker->RegisterTimer(SERVER_TIMESLICES_SEC * 10, NULL, 0, 
+        timetracker->RegisterTimer(SERVER_TIMESLICES_SEC * timeout, NULL, 0, 
             [this] (int) -> int {
                 cancel();
                 return 0;
@@ -343,6 +350,8 @@ Datasourcetracker::Datasourcetracker(GlobalRegistry *in_globalreg) :
     pthread_mutexattr_settype(&mutexattr, PTHREAD_MUTEX_RECURSIVE);
 	pthread_mutex_init(&dst_lock, &mutexattr);
 
+    source_list_version = 0;
+
     dst_proto_builder =
         entrytracker->RegisterAndGetField("kismet.datasourcetracker.driver", 
                 SharedDatasourceBuilder(new KisDatasourceBuilder(globalreg, 0)), 
@@ -361,6 +370,8 @@ Datasourcetracker::Datasourcetracker(GlobalRegistry *in_globalreg) :
         entrytracker->RegisterAndGetField("kismet.datasourcetracker.sources",
                 TrackerVector, "Configured sources");
 
+    publish_source_snapshot();
+
     completion_cleanup_id = -1;
     next_probe_id = 0;
     next_list_id = 0;
@@ -402,11 +413,80 @@ Datasourcetracker::Datasourcetracker(GlobalRegistry *in_globalreg) :
         config_defaults->set_random_channel_order(true);
     }
 
+    adaptive_hop = 
+        globalreg->kismet_config->FetchOptBoolean("channel_hop_adaptive", false);
+
+    adaptive_hop_interval = 
+        globalreg->kismet_config->FetchOptUInt("channel_hop_adaptive_interval", 30);
+    if (adaptive_hop_interval == 0)
+        adaptive_hop_interval = 30;
+
+    adaptive_hop_factor = 
+        globalreg->kismet_config->FetchOptUInt("channel_hop_adaptive_factor", 4);
+    if (adaptive_hop_factor == 0)
+        adaptive_hop_factor = 1;
+
+    if (adaptive_hop) {
+        _MSG("Enabling adaptive channel hopping; time on each channel will follow "
+                "the activity seen there", MSGFLAG_INFO);
+    }
+
+    // Sources can turn on adaptive hopping themselves, so re-weight whenever
+    // there is hopping at all
+    adaptive_hop_timer = -1;
+
+    if (config_defaults->get_hop()) {
+        adaptive_hop_timer =
+            timetracker->RegisterTimer(SERVER_TIMESLICES_SEC * adaptive_hop_interval, 
+                    NULL, 1, [this] (int) -> int {
+                        calculate_adaptive_hopping(NULL);
+                        return 1;
+                    });
+    }
+
     if (globalreg->kismet_config->FetchOptBoolean("retry_on_source_error", true)) {
         _MSG("Sources will be re-opened if they encounter an error", MSGFLAG_INFO);
         config_defaults->set_retry_on_error(true);
     }
 
+    // Defaults for sources opened from now on follow the config when it's
+    // reloaded; sources already open keep what they were opened with
+    config_reload_id = 
+        globalreg->kismet_config->RegisterReloadHandler({ "channel_hop", 
+                "channel_hop_speed", "split_source_hopping", "randomized_hopping",
+                "retry_on_source_error" },
+                [this](shared_ptr<const config_snapshot> conf, 
+                    const std::set<string>& changed) {
+                    local_locker lock(&dst_lock);
+
+                    config_defaults->set_hop(conf->get_bool("channel_hop", true));
+
+                    if (conf->get("channel_hop_speed") != "")
+                        config_defaults->set_hop_rate(
+                                string_to_rate(conf->get("channel_hop_speed"), 1));
+                    else
+                        config_defaults->set_hop_rate(1);
+
+                    config_defaults->set_split_same_sources(
+                            conf->get_bool("split_source_hopping", true));
+                    config_defaults->set_random_channel_order(
+                            conf->get_bool("randomized_hopping", true));
+                    config_defaults->set_retry_on_error(
+                            conf->get_bool("retry_on_source_error", true));
+
+                    if (config_defaults->get_hop() && adaptive_hop_timer < 0) {
+                        adaptive_hop_timer =
+                            timetracker->RegisterTimer(SERVER_TIMESLICES_SEC * 
+                                    adaptive_hop_interval, NULL, 1, [this] (int) -> int {
+                                        calculate_adaptive_hopping(NULL);
+                                        return 1;
+                                    });
+                    }
+
+                    _MSG("Updated the datasource defaults from the reloaded config",
+                            MSGFLAG_INFO);
+                });
+
     string listen = globalreg->kismet_config->FetchOpt("remote_capture_listen");
     uint32_t listenport = 
         globalreg->kismet_config->FetchOptUInt("remote_capture_port", 0);
@@ -421,6 +501,23 @@ Datasourcetracker::Datasourcetracker(GlobalRegistry *in_globalreg) :
                 "capture will be enabled.", MSGFLAG_INFO);
     }
 
+    max_probes = globalreg->kismet_config->FetchOptUInt("source_probe_max", 4);
+
+    probe_timeout = globalreg->kismet_config->FetchOptUInt("source_probe_timeout", 10);
+    if (probe_timeout == 0)
+        probe_timeout = 10;
+
+    probe_cache_enabled = 
+        globalreg->kismet_config->FetchOptBoolean("source_probe_cache", true);
+
+    if (probe_cache_enabled) {
+        probe_cache_path = 
+            globalreg->kismet_config->ExpandLogPath(
+                    globalreg->kismet_config->FetchOpt("configdir") + "/" +
+                    "probe_cache.conf", "", "", 0, 1);
+        load_probe_cache();
+    }
+
     config_defaults->set_remote_cap_listen(listen);
     config_defaults->set_remote_cap_port(listenport);
 
@@ -429,12 +526,51 @@ Datasourcetracker::Datasourcetracker(GlobalRegistry *in_globalreg) :
     if (listen.length() != 0 && listenport != 0) {
         _MSG("Launching remote capture server on " + listen + ":" + 
                 UIntToString(listenport), MSGFLAG_INFO);
+        string tls_cert = 
+            globalreg->kismet_config->FetchOpt("remote_capture_tls_cert");
+        string tls_key = 
+            globalreg->kismet_config->FetchOpt("remote_capture_tls_key");
+
+        if (tls_cert.length() != 0 || tls_key.length() != 0) {
+            if (tls_cert.length() == 0 || tls_key.length() == 0) {
+                _MSG("Remote capture TLS needs both remote_capture_tls_cert= and "
+                        "remote_capture_tls_key= in kismet.conf", MSGFLAG_FATAL);
+                globalreg->fatal_condition = 1;
+            } else if (ConfigureTls(
+                        globalreg->kismet_config->ExpandLogPath(tls_cert, "", "", 0, 1),
+                        globalreg->kismet_config->ExpandLogPath(tls_key, "", "", 0, 1)) < 0) {
+                _MSG("Failed to set up TLS for remote capture, check your "
+                        "remote_capture_tls_cert= and remote_capture_tls_key= lines "
+                        "in kismet.conf", MSGFLAG_FATAL);
+                globalreg->fatal_condition = 1;
+            } else {
+                _MSG("Remote capture connections require TLS", MSGFLAG_INFO);
+            }
+        }
+
         if (ConfigureServer(listenport, 1024, listen, vector<string>()) < 0) {
             _MSG("Failed to launch remote capture TCP server, check your "
                     "remote_capture_listen= and remote_capture_port= lines in "
                     "kismet.conf", MSGFLAG_FATAL);
             globalreg->fatal_condition = 1;
         }
+
+        if (globalreg->kismet_config->FetchOptBoolean("remote_capture_datagram", false)) {
+            shared_ptr<PollableTracker> pollabletracker = 
+                globalreg->FetchGlobalAs<PollableTracker>("POLLABLETRACKER");
+
+            datagram_server.reset(new dst_datagram_server(globalreg, this));
+
+            if (datagram_server->OpenServer(listen, listenport) < 0) {
+                _MSG("Failed to launch remote capture datagram server, remote capture "
+                        "will only accept TCP", MSGFLAG_ERROR);
+                datagram_server.reset();
+            } else {
+                _MSG("Accepting remote capture metadata datagrams on " + listen + ":" +
+                        UIntToString(listenport), MSGFLAG_INFO);
+                pollabletracker->RegisterPollable(datagram_server);
+            }
+        }
     }
 
     remote_complete_timer = -1;
@@ -455,10 +591,33 @@ Datasourcetracker::~Datasourcetracker() {
 
     globalreg->RemoveGlobal("DATA_SOURCE_TRACKER");
 
+    globalreg->kismet_config->RemoveReloadHandler(config_reload_id);
+
     if (completion_cleanup_id >= 0)
         timetracker->RemoveTimer(completion_cleanup_id);
 
-    for (auto i = probing_map.begin(); i != probing_map.end(); ++i) {
+    if (adaptive_hop_timer >= 0)
+        timetracker->RemoveTimer(adaptive_hop_timer);
+
+    if (datagram_server != NULL) {
+        shared_ptr<PollableTracker> pollabletracker = 
+            globalreg->FetchGlobalAs<PollableTracker>("POLLABLETRACKER");
+
+        datagram_server->Shutdown();
+
+        if (pollabletracker != NULL)
+            pollabletracker->RemovePollable(datagram_server);
+    }
+
+    // Cancelling a probe calls back into the probing map; take the probes out
+    // of it first so nothing is opened or launched from the queue while we're
+    // shutting down
+    probe_queue.clear();
+
+    map<unsigned int, SharedDSTProbe> cancel_map;
+    cancel_map.swap(probing_map);
+
+    for (auto i = cancel_map.begin(); i != cancel_map.end(); ++i) {
         i->second->cancel();
     }
 
@@ -467,6 +626,7 @@ Datasourcetracker::~Datasourcetracker() {
         // i->second->cancel();
     }
 
+    std::atomic_store(&source_snapshot, shared_ptr<const dst_source_snapshot>());
     datasource_vec.reset();
 
     pthread_mutex_destroy(&dst_lock);
@@ -550,17 +710,37 @@ void Datasourcetracker::system_shutdown() {
 }
 
 void Datasourcetracker::iterate_datasources(DST_Worker *in_worker) {
-    local_locker lock(&dst_lock);
+    shared_ptr<const dst_source_snapshot> snap = get_source_snapshot();
 
-    for (unsigned int x = 0; x < datasource_vec->size(); x++) {
-        shared_ptr<KisDatasource> kds = 
-            static_pointer_cast<KisDatasource>(datasource_vec->get_vector_value(x));
+    for (auto kds : snap->sources)
         in_worker->handle_datasource(kds);
-    }
 
     in_worker->finalize();
 }
 
+void Datasourcetracker::publish_source_snapshot() {
+    local_locker lock(&dst_lock);
+
+    shared_ptr<dst_source_snapshot> snap(new dst_source_snapshot());
+
+    snap->version = source_list_version;
+    snap->source_vec.reset(new TrackerElement(TrackerVector, datasource_vec->get_id()));
+
+    TrackerElementVector dsv(datasource_vec);
+    TrackerElementVector sv(snap->source_vec);
+
+    for (auto i : dsv) {
+        SharedDatasource kds = static_pointer_cast<KisDatasource>(i);
+
+        // The first source with a UUID is the one found, as when searching
+        snap->uuid_index.emplace(kds->get_source_uuid(), snap->sources.size());
+        snap->sources.push_back(kds);
+        sv.push_back(i);
+    }
+
+    std::atomic_store(&source_snapshot, shared_ptr<const dst_source_snapshot>(snap));
+}
+
 bool Datasourcetracker::remove_datasource(uuid in_uuid) {
     local_locker lock(&dst_lock);
 
@@ -582,6 +762,8 @@ bool Datasourcetracker::remove_datasource(uuid in_uuid) {
 
             // Remove it
             dsv.erase(i);
+            source_list_version++;
+            publish_source_snapshot();
 
             // Done
             return true;
@@ -592,20 +774,18 @@ bool Datasourcetracker::remove_datasource(uuid in_uuid) {
 }
 
 SharedDatasource Datasourcetracker::find_datasource(uuid in_uuid) {
-    local_locker lock(&dst_lock);
+    shared_ptr<const dst_source_snapshot> snap = get_source_snapshot();
 
-    TrackerElementVector dsv(datasource_vec);
+    auto i = snap->uuid_index.find(in_uuid);
 
-    // Look for it in the sources vec and fully close it and get rid of it
-    for (auto i = dsv.begin(); i != dsv.end(); ++i) {
-        SharedDatasource kds = static_pointer_cast<KisDatasource>(*i);
+    if (i == snap->uuid_index.end())
+        return NULL;
 
-        if (kds->get_source_uuid() == in_uuid) {
-            return kds;
-        }
-    }
+    return snap->sources[i->second];
+}
 
-    return NULL;
+vector<SharedDatasource> Datasourcetracker::get_datasources() {
+    return get_source_snapshot()->sources;
 }
 
 bool Datasourcetracker::close_datasource(uuid in_uuid) {
@@ -724,15 +904,92 @@ void Datasourcetracker::open_datasource(string in_source,
         return;
     }
 
+    // If this interface was claimed by a driver before, try that driver first;
+    // if it can't open the interface any more, forget it and probe
+    if (probe_cache_enabled) {
+        local_locker lock(&dst_lock);
+
+        SharedDatasourceBuilder proto;
+
+        auto ci = probe_cache.find(interface);
+
+        if (ci != probe_cache.end()) {
+            TrackerElementVector vec(proto_vec);
+
+            for (auto i = vec.begin(); i != vec.end(); ++i) {
+                SharedDatasourceBuilder b = static_pointer_cast<KisDatasourceBuilder>(*i);
+
+                if (StrLower(b->get_source_type()) == ci->second) {
+                    proto = b;
+                    break;
+                }
+            }
+
+            if (proto == NULL)
+                uncache_probe(interface);
+        }
+
+        if (proto != NULL) {
+            _MSG("Using cached type '" + proto->get_source_type() + "' for '" +
+                    interface + "'", MSGFLAG_INFO);
+
+            open_datasource(in_source, proto, 
+                [this, in_source, interface, in_cb](bool success, string reason, 
+                    SharedDatasource ds) {
+                    if (success) {
+                        if (in_cb != NULL)
+                            in_cb(success, reason, ds);
+                        return;
+                    }
+
+                    // Don't let the failed source keep retrying on its own
+                    if (ds != NULL)
+                        ds->disable_source();
+
+                    _MSG("Cached type for '" + interface + "' could not open it (" +
+                            reason + "), probing for a new one", MSGFLAG_INFO);
+
+                    local_locker lock(&dst_lock);
+                    uncache_probe(interface);
+                    start_probe(in_source, in_cb);
+                });
+
+            return;
+        }
+    }
+
     // Otherwise we have to initiate a probe, which is async itself, and 
     // tell it to call our CB when it completes.  The probe will find if there 
     // is a driver that can claim the source string we were given, and 
     // we'll initiate opening it if there is
+    local_locker lock(&dst_lock);
+    start_probe(in_source, in_cb);
+}
+
+void Datasourcetracker::start_probe(string in_source, 
+        function<void (bool, string, SharedDatasource)> in_cb) {
+    local_locker lock(&dst_lock);
+
+    string interface = in_source.substr(0, in_source.find(":"));
+
+    if (max_probes != 0 && probing_map.size() >= max_probes) {
+        _MSG("Waiting to probe for datasource type for '" + interface + "', " +
+                UIntToString(probing_map.size()) + " probes already running", 
+                MSGFLAG_INFO);
+
+        dst_pending_probe pending;
+        pending.definition = in_source;
+        pending.cb = in_cb;
+        probe_queue.push_back(pending);
+
+        return;
+    }
+
     _MSG("Probing for datasource type for '" + interface + "'", MSGFLAG_INFO);
 
     // Create a DSTProber to handle the probing
     SharedDSTProbe dst_probe(new DST_DatasourceProbe(globalreg, 
-                in_source, proto_vec));
+                in_source, proto_vec, probe_timeout));
     unsigned int probeid = next_probe_id++;
 
     // Record it
@@ -741,7 +998,7 @@ void Datasourcetracker::open_datasource(string in_source,
     // fprintf(stderr, "debug - pushed probe %u raw %p\n", probeid, dst_probe.get());
 
     // Initiate the probe
-    dst_probe->probe_sources([this, probeid, in_cb](SharedDatasourceBuilder builder) {
+    dst_probe->probe_sources([this, probeid, interface, in_cb](SharedDatasourceBuilder builder) {
         // Lock on completion
         local_locker lock(&dst_lock);
 
@@ -752,33 +1009,133 @@ void Datasourcetracker::open_datasource(string in_source,
         if (i != probing_map.end()) {
             // fprintf(stderr, "debug - dst - calling callback\n");
             stringstream ss;
+
+            SharedDSTProbe probe = i->second;
+
+            probing_complete_vec.push_back(probe);
+            probing_map.erase(i);
+            schedule_cleanup();
+
             if (builder == NULL) {
                 // fprintf(stderr, "debug - DST - callback with fail\n");
 
                 // We couldn't find a type, return an error to our initial open CB
-                ss << "Unable to find driver for '" << i->second->get_definition() << 
+                ss << "Unable to find driver for '" << probe->get_definition() << 
                     "'.  Make sure that any plugins required are loaded.";
                 _MSG(ss.str(), MSGFLAG_ERROR);
                 in_cb(false, ss.str(), NULL);
             } else {
                 ss << "Found type '" << builder->get_source_type() << "' for '" <<
-                    i->second->get_definition() << "'";
+                    probe->get_definition() << "'";
                 _MSG(ss.str(), MSGFLAG_INFO);
 
+                cache_probe(interface, builder->get_source_type());
+
                 // Initiate an open w/ a known builder
-                open_datasource(i->second->get_definition(), builder, in_cb);
+                open_datasource(probe->get_definition(), builder, in_cb);
             }
 
-            probing_complete_vec.push_back(i->second);
-            probing_map.erase(i);
-            schedule_cleanup();
+            // A slot is free, start the next waiting probe
+            probe_next();
         } else {
             // fprintf(stderr, "debug - DST couldn't find response %u\n", probeid);
         }
     });
+}
+
+void Datasourcetracker::probe_next() {
+    local_locker lock(&dst_lock);
 
+    while (probe_queue.size() != 0 && 
+            (max_probes == 0 || probing_map.size() < max_probes)) {
+        dst_pending_probe pending = probe_queue.front();
+        probe_queue.pop_front();
 
-    return;
+        start_probe(pending.definition, pending.cb);
+    }
+}
+
+void Datasourcetracker::load_probe_cache() {
+    local_locker lock(&dst_lock);
+
+    struct stat buf;
+
+    if (stat(probe_cache_path.c_str(), &buf) < 0)
+        return;
+
+    ConfigFile cache_conf(globalreg);
+
+    if (cache_conf.ParseConfig(probe_cache_path.c_str()) < 0)
+        return;
+
+    // Each record is type,interface; interfaces (or file names) may contain
+    // a comma, types don't
+    vector<string> records = cache_conf.FetchOptVec("probe");
+
+    for (auto r : records) {
+        size_t cpos = r.find(",");
+
+        if (cpos == string::npos || cpos == 0 || cpos == r.length() - 1)
+            continue;
+
+        probe_cache[r.substr(cpos + 1)] = StrLower(r.substr(0, cpos));
+    }
+
+    if (probe_cache.size() != 0) {
+        _MSG("Loaded " + UIntToString(probe_cache.size()) + " cached datasource "
+                "types from " + probe_cache_path, MSGFLAG_INFO);
+    }
+}
+
+void Datasourcetracker::save_probe_cache() {
+    local_locker lock(&dst_lock);
+
+    string dir =
+        globalreg->kismet_config->ExpandLogPath(
+                globalreg->kismet_config->FetchOpt("configdir"), "", "", 0, 1);
+
+    if (mkdir(dir.c_str(), S_IRUSR | S_IWUSR | S_IXUSR) < 0 && errno != EEXIST) {
+        _MSG("Failed to create Kismet settings directory " + dir + ": " + 
+                kis_strerror_r(errno), MSGFLAG_ERROR);
+        return;
+    }
+
+    ConfigFile cache_conf(globalreg);
+    vector<string> records;
+
+    for (auto c : probe_cache) 
+        records.push_back(c.second + "," + c.first);
+
+    cache_conf.SetOptVec("probe", records, 1);
+
+    cache_conf.SaveConfigAsync(probe_cache_path);
+}
+
+void Datasourcetracker::cache_probe(string in_interface, string in_type) {
+    local_locker lock(&dst_lock);
+
+    if (!probe_cache_enabled)
+        return;
+
+    auto ci = probe_cache.find(in_interface);
+
+    if (ci != probe_cache.end() && ci->second == StrLower(in_type))
+        return;
+
+    probe_cache[in_interface] = StrLower(in_type);
+    save_probe_cache();
+}
+
+void Datasourcetracker::uncache_probe(string in_interface) {
+    local_locker lock(&dst_lock);
+
+    auto ci = probe_cache.find(in_interface);
+
+    if (ci == probe_cache.end())
+        return;
+
+    probe_cache.erase(ci);
+    save_probe_cache();
 }
 
 void Datasourcetracker::open_datasource(string in_source, SharedDatasourceBuilder in_proto,
@@ -827,6 +1184,8 @@ void Datasourcetracker::merge_source(SharedDatasource in_source) {
 
     TrackerElementVector vec(datasource_vec);
     vec.push_back(in_source);
+    source_list_version++;
+    publish_source_snapshot();
 }
 
 void Datasourcetracker::list_interfaces(function<void (vector<SharedInterface>)> in_cb) {
@@ -905,11 +1264,57 @@ void Datasourcetracker::NewConnection(shared_ptr<BufferHandlerGeneric> conn_hand
                     uuid in_uuid, shared_ptr<BufferHandlerGeneric> in_handler) {
             in_handler->RemoveReadBufferInterface();
             open_remote_datasource(i, in_type, in_def, in_uuid, in_handler);
+        },
+                [this] (dst_incoming_remote *i, uuid in_uuid, string in_session,
+                    shared_ptr<BufferHandlerGeneric> in_handler) {
+            in_handler->RemoveReadBufferInterface();
+            resume_remote_datasource(i, in_uuid, in_session, in_handler);
         });
 
     conn_handler->SetReadBufferInterface(incoming);
 }
 
+SharedDatasource Datasourcetracker::find_datagram_datasource(string in_token) {
+    shared_ptr<const dst_source_snapshot> snap = get_source_snapshot();
+
+    for (auto d : snap->sources) {
+        if (d->get_datagram_token() == in_token)
+            return d;
+    }
+
+    return NULL;
+}
+
+shared_ptr<dst_shared_helper> Datasourcetracker::get_shared_helper(string in_binary,
+        vector<string> in_args, bool in_validate_checksum, string in_cpus) {
+    local_locker lock(&dst_lock);
+
+    // Sources share a binary only when it would be launched identically for each
+    string key = in_binary;
+    for (auto a : in_args)
+        key += " " + a;
+    key += " @" + in_cpus;
+
+    shared_ptr<dst_shared_helper> helper;
+
+    auto hi = shared_helpers.find(key);
+    if (hi != shared_helpers.end())
+        helper = hi->second.lock();
+
+    if (helper != NULL && !helper->get_failed())
+        return helper;
+
+    helper.reset(new dst_shared_helper(globalreg, in_binary, in_args, 
+                in_validate_checksum, in_cpus));
+
+    if (helper->launch_helper() < 0)
+        return NULL;
+
+    shared_helpers[key] = helper;
+
+    return helper;
+}
+
 void Datasourcetracker::open_remote_datasource(dst_incoming_remote *incoming,
         string in_type, string in_definition, uuid in_uuid, 
         shared_ptr<BufferHandlerGeneric> in_handler) {
@@ -991,6 +1396,45 @@ void Datasourcetracker::open_remote_datasource(dst_incoming_remote *incoming,
 
 }
 
+void Datasourcetracker::resume_remote_datasource(dst_incoming_remote *incoming,
+        uuid in_uuid, string in_session, shared_ptr<BufferHandlerGeneric> in_handler) {
+    SharedDatasource resume_target;
+
+    local_locker lock(&dst_lock);
+
+    // The session token is enough to take over a source, even if we haven't 
+    // noticed that its old connection is gone yet
+    TrackerElementVector ds_vector(datasource_vec);
+
+    for (auto p : ds_vector) {
+        SharedDatasource d = static_pointer_cast<KisDatasource>(p);
+
+        if (!d->get_source_builder()->get_remote_capable())
+            continue;
+
+        if (d->get_source_uuid() == in_uuid) {
+            if (in_session.length() != 0 && d->get_resume_session() == in_session)
+                resume_target = d;
+            break;
+        }
+    }
+
+    if (resume_target == NULL) {
+        _MSG("Remote source " + in_uuid.UUID2String() + " tried to resume a session "
+                "which is not available, closing connection; the source will reconnect "
+                "and be opened again.", MSGFLAG_INFO);
+        in_handler->ProtocolError();
+        return;
+    }
+
+    // Explicitly unlock our mutex before running a thread
+    lock.unlock();
+
+    incoming->handshake_rb(std::thread([resume_target, in_handler]{
+            resume_target->resume_buffer(in_handler);
+            }));
+}
+
 // Basic DST worker for figuring out how many sources of the same type
 // exist, and are hopping
 class dst_chansplit_worker : public DST_Worker {
@@ -1081,6 +1525,28 @@ void Datasourcetracker::calculate_source_hopping(SharedDatasource in_ds) {
 
     // Turn on channel hopping if we do that
     if (config_defaults->get_hop()) {
+        if (get_source_adaptive(in_ds)) {
+            local_locker lock(&dst_lock);
+
+            // The hop list is the full list of channels when the source has just
+            // been opened; remember it, since adaptive lists replace it
+            vector<string> base;
+            TrackerElementVector hopvec(in_ds->get_source_hop_vec());
+
+            for (auto c : hopvec) {
+                string cs = GetTrackerValue<string>(c);
+
+                if (std::find(base.begin(), base.end(), cs) == base.end())
+                    base.push_back(cs);
+            }
+
+            adaptive_base_lists[in_ds->get_source_uuid()] = base;
+            adaptive_hop_lists.erase(in_ds->get_source_uuid());
+
+            calculate_adaptive_hopping(in_ds);
+            return;
+        }
+
         // Do we split sources?
         if (config_defaults->get_split_same_sources()) {
             dst_chansplit_worker worker(globalreg, this, config_defaults, in_ds);
@@ -1094,55 +1560,329 @@ void Datasourcetracker::calculate_source_hopping(SharedDatasource in_ds) {
     }
 }
 
-void Datasourcetracker::queue_dead_remote(dst_incoming_remote *in_dead) {
-    local_locker lock(&dst_lock);
+bool Datasourcetracker::get_source_adaptive(SharedDatasource in_ds) {
+    return in_ds->get_definition_opt_bool("adaptivehop", adaptive_hop);
+}
 
-    for (auto x : dst_remote_complete_vec) {
-        if (x == in_dead)
-            return;
+vector<string> Datasourcetracker::build_adaptive_hop_list(vector<string> in_chans,
+        map<string, double> in_weights, unsigned int in_factor) {
+    vector<string> ret;
+
+    if (in_chans.size() == 0)
+        return ret;
+
+    if (in_factor == 0)
+        in_factor = 1;
+
+    double total = 0;
+    for (auto c : in_chans) {
+        double w = in_weights[c];
+        if (w > 0)
+            total += w;
     }
 
-    if (remote_complete_timer <= 0) {
-        remote_complete_timer =
-            timetracker->RegisterTimer(1, NULL, 0, 
-                [this] (int) -> int {
-                    local_locker lock(&dst_lock);
+    // Every channel gets one slot; the extra slots are shared by weight, and the
+    // slots lost to rounding go to the largest remainders
+    unsigned int extra = (in_factor - 1) * in_chans.size();
+    vector<unsigned int> slots(in_chans.size(), 1);
 
-                    for (auto x : dst_remote_complete_vec) {
-                        delete(x);
-                    }
+    if (total > 0 && extra > 0) {
+        vector<pair<double, size_t> > remainders;
+        unsigned int assigned = 0;
 
-                    dst_remote_complete_vec.clear();
+        for (size_t x = 0; x < in_chans.size(); x++) {
+            double w = in_weights[in_chans[x]];
+            double share = w > 0 ? (w / total) * extra : 0;
 
-                    remote_complete_timer = 0;
-                    return 0;
+            slots[x] += (unsigned int) share;
+            assigned += (unsigned int) share;
+            remainders.push_back(make_pair(share - (unsigned int) share, x));
+        }
+
+        std::stable_sort(remainders.begin(), remainders.end(),
+                [](const pair<double, size_t>& a, const pair<double, size_t>& b) {
+                    return a.first > b.first;
                 });
+
+        for (size_t x = 0; x < remainders.size() && assigned < extra; x++) {
+            if (remainders[x].first <= 0)
+                break;
+
+            slots[remainders[x].second]++;
+            assigned++;
+        }
     }
 
-}
+    // Smooth weighted round-robin, so a channel with several slots is revisited 
+    // at even intervals instead of dwelling on it in one run
+    unsigned int nslots = 0;
+    for (auto s : slots)
+        nslots += s;
 
+    vector<long> current(in_chans.size(), 0);
 
-bool Datasourcetracker::Httpd_VerifyPath(const char *path, const char *method) {
-    string stripped = Httpd_StripSuffix(path);
+    for (unsigned int n = 0; n < nslots; n++) {
+        size_t best = 0;
 
-    if (strcmp(method, "POST") == 0) {
-        if (stripped == "/datasource/add_source")
-            return true;
+        for (size_t x = 0; x < in_chans.size(); x++) {
+            current[x] += slots[x];
+            if (current[x] > current[best])
+                best = x;
+        }
 
-        vector<string> tokenurl = StrTokenize(path, "/");
+        current[best] -= nslots;
+        ret.push_back(in_chans[best]);
+    }
 
-        if (tokenurl.size() < 5)
-            return false;
+    return ret;
+}
 
-        // /datasource/by-uuid/aaa-bbb-cc-dd/source.json | .msgpack
-        if (tokenurl[1] == "datasource") {
-            if (tokenurl[2] == "by-uuid") {
-                uuid u(tokenurl[3]);
+void Datasourcetracker::calculate_adaptive_hopping(SharedDatasource in_ds) {
+    local_locker lock(&dst_lock);
 
-                if (u.error)
-                    return false;
+    if (!config_defaults->get_hop())
+        return;
 
-                local_locker lock(&dst_lock);
+    // Sources taking part: running, hopping, and adaptive
+    vector<SharedDatasource> sources;
+
+    if (in_ds != NULL)
+        sources.push_back(in_ds);
+
+    TrackerElementVector vec(datasource_vec);
+    for (auto se : vec) {
+        SharedDatasource ds = static_pointer_cast<KisDatasource>(se);
+
+        if (ds == in_ds)
+            continue;
+
+        if (!ds->get_source_running() || !ds->get_source_hopping())
+            continue;
+
+        if (!ds->get_definition_opt_bool("channel_hop", true) || !get_source_adaptive(ds))
+            continue;
+
+        if (adaptive_base_lists.find(ds->get_source_uuid()) == adaptive_base_lists.end())
+            continue;
+
+        sources.push_back(ds);
+    }
+
+    // Forget sources which have gone away
+    for (auto bi = adaptive_base_lists.begin(); bi != adaptive_base_lists.end(); ) {
+        bool found = false;
+
+        for (auto ds : sources) {
+            if (ds->get_source_uuid() == bi->first) {
+                found = true;
+                break;
+            }
+        }
+
+        if (!found) {
+            adaptive_hop_lists.erase(bi->first);
+            bi = adaptive_base_lists.erase(bi);
+        } else {
+            ++bi;
+        }
+    }
+
+    if (sources.size() == 0)
+        return;
+
+    // All the channels any source can visit, and the share of the time they were
+    // covered over the last interval; a channel visited half the time only shows
+    // half its traffic
+    vector<string> channels;
+    map<string, double> coverage;
+
+    for (auto ds : sources) {
+        vector<string>& base = adaptive_base_lists[ds->get_source_uuid()];
+
+        for (auto c : base) {
+            if (std::find(channels.begin(), channels.end(), c) == channels.end())
+                channels.push_back(c);
+        }
+
+        auto li = adaptive_hop_lists.find(ds->get_source_uuid());
+        vector<string>& last = li != adaptive_hop_lists.end() ? li->second : base;
+
+        for (auto c : last)
+            coverage[c] += 1.0f / last.size();
+    }
+
+    // Weight each channel by its share of the packets and of the devices
+    shared_ptr<Channeltracker_V2> chantracker =
+        globalreg->FetchGlobalAs<Channeltracker_V2>("CHANNEL_TRACKER");
+
+    unsigned int window = adaptive_hop_interval;
+    if (window > 60)
+        window = 60;
+
+    map<string, double> pps, devices;
+    double total_pps = 0, total_devices = 0;
+
+    for (auto c : channels) {
+        double freq = Channeltracker_V2::channel_to_freq_khz(c);
+        double p = 0, d = 0;
+
+        if (chantracker != NULL && freq != 0)
+            chantracker->get_frequency_activity(freq, window, &p, &d);
+
+        // Don't let a channel with almost no coverage look busy off one packet
+        double cov = coverage[c];
+        if (cov < 0.05f)
+            cov = 0.05f;
+
+        pps[c] = p / cov;
+        devices[c] = d;
+
+        total_pps += pps[c];
+        total_devices += d;
+    }
+
+    map<string, double> weights;
+
+    for (auto c : channels) {
+        double w = 0;
+
+        if (total_pps > 0)
+            w += pps[c] / total_pps;
+        if (total_devices > 0)
+            w += devices[c] / total_devices;
+
+        weights[c] = w / 2;
+    }
+
+    // Split the channels so the sources don't spend time on the same ones:  the
+    // busiest channels go first, each to the least loaded source which can tune
+    // it, and every channel also counts as a visit so quiet ones spread out too
+    map<uuid, vector<string> > assigned;
+
+    if (sources.size() > 1 && config_defaults->get_split_same_sources()) {
+        vector<string> order = channels;
+        std::stable_sort(order.begin(), order.end(),
+                [&weights](const string& a, const string& b) {
+                    return weights[a] > weights[b];
+                });
+
+        map<uuid, double> load;
+        double visit = 1.0f / channels.size();
+
+        for (auto c : order) {
+            SharedDatasource best;
+
+            for (auto ds : sources) {
+                vector<string>& base = adaptive_base_lists[ds->get_source_uuid()];
+
+                if (std::find(base.begin(), base.end(), c) == base.end())
+                    continue;
+
+                if (best == NULL || 
+                        load[ds->get_source_uuid()] < load[best->get_source_uuid()])
+                    best = ds;
+            }
+
+            if (best == NULL)
+                continue;
+
+            assigned[best->get_source_uuid()].push_back(c);
+            load[best->get_source_uuid()] += weights[c] + visit;
+        }
+
+        // A source with nothing left to do watches its busiest channel
+        for (auto ds : sources) {
+            vector<string>& a = assigned[ds->get_source_uuid()];
+            vector<string>& base = adaptive_base_lists[ds->get_source_uuid()];
+
+            if (a.size() != 0 || base.size() == 0)
+                continue;
+
+            for (auto c : order) {
+                if (std::find(base.begin(), base.end(), c) != base.end()) {
+                    a.push_back(c);
+                    break;
+                }
+            }
+        }
+    } else {
+        for (auto ds : sources)
+            assigned[ds->get_source_uuid()] = adaptive_base_lists[ds->get_source_uuid()];
+    }
+
+    for (auto ds : sources) {
+        vector<string> hoplist = 
+            build_adaptive_hop_list(assigned[ds->get_source_uuid()], weights, 
+                    adaptive_hop_factor);
+
+        if (hoplist.size() == 0)
+            continue;
+
+        auto li = adaptive_hop_lists.find(ds->get_source_uuid());
+        if (ds != in_ds && li != adaptive_hop_lists.end() && li->second == hoplist)
+            continue;
+
+        adaptive_hop_lists[ds->get_source_uuid()] = hoplist;
+
+        double rate = string_to_rate(ds->get_definition_opt("hoprate"), -1);
+
+        if (rate < 0)
+            rate = config_defaults->get_hop_rate();
+
+        // The list is already ordered, shuffling would undo the interleave
+        ds->set_channel_hop(rate, hoplist, false, 0, 0, NULL);
+    }
+}
+
+void Datasourcetracker::queue_dead_remote(dst_incoming_remote *in_dead) {
+    local_locker lock(&dst_lock);
+
+    for (auto x : dst_remote_complete_vec) {
+        if (x == in_dead)
+            return;
+    }
+
+    if (remote_complete_timer <= 0) {
+        remote_complete_timer =
+            timetracker->RegisterTimer(1, NULL, 0, 
+                [this] (int) -> int {
+                    local_locker lock(&dst_lock);
+
+                    for (auto x : dst_remote_complete_vec) {
+                        delete(x);
+                    }
+
+                    dst_remote_complete_vec.clear();
+
+                    remote_complete_timer = 0;
+                    return 0;
+                });
+    }
+
+}
+
+
+bool Datasourcetracker::Httpd_VerifyPath(const char *path, const char *method) {
+    string stripped = Httpd_StripSuffix(path);
+
+    if (strcmp(method, "POST") == 0) {
+        if (stripped == "/datasource/add_source")
+            return true;
+
+        vector<string> tokenurl = StrTokenize(path, "/");
+
+        if (tokenurl.size() < 5)
+            return false;
+
+        // /datasource/by-uuid/aaa-bbb-cc-dd/source.json | .msgpack
+        if (tokenurl[1] == "datasource") {
+            if (tokenurl[2] == "by-uuid") {
+                uuid u(tokenurl[3]);
+
+                if (u.error)
+                    return false;
+
+                local_locker lock(&dst_lock);
 
                 if (uuid_source_num_map.find(u) == uuid_source_num_map.end())
                     return false;
@@ -1161,6 +1901,22 @@ bool Datasourcetracker::Httpd_VerifyPath(const char *path, const char *method) {
     }
 
     if (strcmp(method, "GET") == 0) {
+        vector<string> wtokenurl = StrTokenize(path, "/");
+
+        // /datasource/by-uuid/aa-bb/waterfall/f0/f1/t0/t1/width/height/waterfall.bin
+        // is packed binary, not something which gets serialized
+        if (wtokenurl.size() == 12 && wtokenurl[1] == "datasource" &&
+                wtokenurl[2] == "by-uuid" && wtokenurl[4] == "waterfall" &&
+                wtokenurl[11] == "waterfall.bin") {
+            uuid u(wtokenurl[3]);
+
+            if (u.error)
+                return false;
+
+            local_locker lock(&dst_lock);
+
+            return uuid_source_num_map.find(u) != uuid_source_num_map.end();
+        }
         
         if (!Httpd_CanSerialize(path))
             return false;
@@ -1220,6 +1976,28 @@ bool Datasourcetracker::Httpd_VerifyPath(const char *path, const char *method) {
     return false;
 }
 
+bool Datasourcetracker::Httpd_ETag(const char *path, uint64_t *etag) {
+    if (Httpd_StripSuffix(path) != "/datasource/all_sources")
+        return false;
+
+    // Read from the snapshot, without the lock
+    shared_ptr<const dst_source_snapshot> snap = get_source_snapshot();
+
+    uint64_t h = 14695981039346656037ULL;
+
+    h = (h ^ snap->version) * 1099511628211ULL;
+
+    for (auto kds : snap->sources) {
+        // Every packet and state change goes through the source's proxies
+        h = (h ^ kds->get_source_number()) * 1099511628211ULL;
+        h = (h ^ kds->get_mod_version()) * 1099511628211ULL;
+    }
+
+    *etag = h;
+
+    return true;
+}
+
 void Datasourcetracker::Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd,
         Kis_Net_Httpd_Connection *connection,
        const char *path, const char *method, const char *upload_data,
@@ -1231,12 +2009,16 @@ void Datasourcetracker::Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd,
 
     string stripped = Httpd_StripSuffix(path);
 
+    if (Httpd_GetSuffix(path) == "bin") {
+        Httpd_Waterfall(connection, path, stream);
+        return;
+    }
+
     if (!Httpd_CanSerialize(path))
         return;
 
     if (stripped == "/datasource/all_sources") {
-        local_locker lock(&dst_lock);
-        Httpd_Serialize(path, stream, datasource_vec);
+        Httpd_Serialize(path, stream, get_source_snapshot()->source_vec);
         return; 
     }
 
@@ -1362,6 +2144,86 @@ void Datasourcetracker::Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd,
 
 }
 
+void Datasourcetracker::Httpd_Waterfall(Kis_Net_Httpd_Connection *connection,
+        const char *path, std::stringstream &stream) {
+    vector<string> tokenurl = StrTokenize(path, "/");
+
+    if (tokenurl.size() != 12 || tokenurl[4] != "waterfall") {
+        connection->httpcode = 400;
+        return;
+    }
+
+    uuid u(tokenurl[3]);
+
+    if (u.error) {
+        connection->httpcode = 400;
+        return;
+    }
+
+    double f0, f1, t0, t1;
+    unsigned int width, height;
+
+    if (sscanf(tokenurl[5].c_str(), "%lf", &f0) != 1 ||
+            sscanf(tokenurl[6].c_str(), "%lf", &f1) != 1 ||
+            sscanf(tokenurl[7].c_str(), "%lf", &t0) != 1 ||
+            sscanf(tokenurl[8].c_str(), "%lf", &t1) != 1 ||
+            sscanf(tokenurl[9].c_str(), "%u", &width) != 1 ||
+            sscanf(tokenurl[10].c_str(), "%u", &height) != 1) {
+        stream << "Invalid waterfall request";
+        connection->httpcode = 400;
+        return;
+    }
+
+    // Nobody has a display this large; keep a request from asking for a
+    // huge buffer
+    if (width > 16384 || height > 16384) {
+        stream << "Waterfall too large";
+        connection->httpcode = 400;
+        return;
+    }
+
+    // Times are unix seconds, an end of 0 is now and a negative time is
+    // relative to now
+    double now = (double) globalreg->timestamp.tv_sec;
+
+    if (t1 == 0)
+        t1 = now;
+    else if (t1 < 0)
+        t1 = now + t1;
+
+    if (t0 < 0)
+        t0 = now + t0;
+
+    if (t0 < 0)
+        t0 = 0;
+
+    shared_ptr<SpectrumDatasource> sds;
+
+    {
+        local_locker lock(&dst_lock);
+
+        TrackerElementVector svec(datasource_vec);
+
+        for (auto i = svec.begin(); i != svec.end(); ++i) {
+            SharedDatasource dsi = static_pointer_cast<KisDatasource>(*i);
+
+            if (dsi->get_source_uuid() == u) {
+                sds = std::dynamic_pointer_cast<SpectrumDatasource>(dsi);
+                break;
+            }
+        }
+    }
+
+    if (sds == NULL) {
+        stream << "Not a spectrum source";
+        connection->httpcode = 404;
+        return;
+    }
+
+    sds->render_waterfall(f0, f1, (uint64_t) (t0 * 1000000), (uint64_t) (t1 * 1000000),
+            width, height, stream);
+}
+
 int Datasourcetracker::Httpd_PostComplete(Kis_Net_Httpd_Connection *concls) {
     if (!Httpd_CanSerialize(concls->url)) {
         concls->response_stream << "Invalid request";
@@ -1381,13 +2243,7 @@ int Datasourcetracker::Httpd_PostComplete(Kis_Net_Httpd_Connection *concls) {
     try {
 
         // Parse the msgpack or json paramaters, we'll need them later
-        if (concls->variable_cache.find("msgpack") != concls->variable_cache.end()) {
-            structdata.reset(new StructuredMsgpack(Base64::decode(concls->variable_cache["msgpack"]->str())));
-        } else if (concls->variable_cache.find("json") != concls->variable_cache.end()) {
-            structdata.reset(new StructuredJson(concls->variable_cache["json"]->str()));
-        } else {
-            throw std::runtime_error("unable to find data");
-        }
+        structdata = concls->FetchStructuredPost();
 
         // Locker for waiting for the open callback
         shared_ptr<conditional_locker<string> > cl(new conditional_locker<string>());
@@ -1789,19 +2645,26 @@ int Datasourcetracker_Httpd_Pcap::Httpd_CreateStreamResponse(Kis_Net_Httpd *http
 
 dst_incoming_remote::dst_incoming_remote(GlobalRegistry *in_globalreg,
         shared_ptr<BufferHandlerGeneric> in_rbufhandler,
-        function<void (dst_incoming_remote *, string, string, uuid, shared_ptr<BufferHandlerGeneric>)> in_cb) {
+        function<void (dst_incoming_remote *, string, string, uuid, shared_ptr<BufferHandlerGeneric>)> in_cb,
+        function<void (dst_incoming_remote *, uuid, string, shared_ptr<BufferHandlerGeneric>)> in_resume_cb) {
     
     globalreg = in_globalreg;
     rbuf_handler = in_rbufhandler;
     cb = in_cb;
+    resume_cb = in_resume_cb;
+    redirected_out = false;
 
     shared_ptr<Timetracker> timetracker = globalreg->FetchGlobalAs<Timetracker>("TIMETRACKER");
 
     timerid =
         timetracker->RegisterTimer(SERVER_TIMESLICES_SEC * 10, NULL, 0, 
             [this] (int) -> int {
-                _MSG("Remote source connected but didn't send a NEWSOURCE control, "
-                        "closing connection.", MSGFLAG_ERROR);
+                if (redirected_out)
+                    _MSG("Remote source didn't follow its redirect to another "
+                            "cluster server, closing connection.", MSGFLAG_ERROR);
+                else
+                    _MSG("Remote source connected but didn't send a NEWSOURCE control, "
+                            "closing connection.", MSGFLAG_ERROR);
 
                 kill();
 
@@ -1859,10 +2722,14 @@ void dst_incoming_remote::BufferAvailable(size_t in_amt) {
 
     string definition;
     string srctype;
+    string session;
     uuid srcuuid;
+
+    bool resume;
+    bool redirected = false;
    
     while (1) {
-        if (rbuf_handler == NULL)
+        if (rbuf_handler == NULL || redirected_out)
             return;
 
         size_t buffamt = rbuf_handler->GetReadBufferUsed();
@@ -1938,7 +2805,9 @@ void dst_incoming_remote::BufferAvailable(size_t in_amt) {
         }
 
         // Check the header type
-        if (strncmp(frame->header.type, "NEWSOURCE", 16) != 0) {
+        resume = strncmp(frame->header.type, "RESUME", 16) == 0;
+
+        if (!resume && strncmp(frame->header.type, "NEWSOURCE", 16) != 0) {
             rbuf_handler->PeekFreeReadBufferData(buf);
             rbuf_handler->ConsumeReadBufferData(frame_sz);
 
@@ -1970,14 +2839,18 @@ void dst_incoming_remote::BufferAvailable(size_t in_amt) {
             data_offt += 
                 sizeof(simple_cap_proto_kv_h_t) + kis_ntoh32(pkv->header.obj_sz);
 
-            // We only care about 2 KV types but will skip the rest
-            if (strncmp(pkv->header.key, "DEFINITION", 16) == 0) {
+            // We only care about a few KV types but will skip the rest
+            if (strncmp(pkv->header.key, "SESSION", 16) == 0) {
+                session = string((char *) pkv->object, kis_ntoh32(pkv->header.obj_sz));
+            } else if (strncmp(pkv->header.key, "DEFINITION", 16) == 0) {
                 definition = string((char *) pkv->object, kis_ntoh32(pkv->header.obj_sz));
             } else if (strncmp(pkv->header.key, "SOURCETYPE", 16) == 0) {
                 srctype = string((char *) pkv->object, kis_ntoh32(pkv->header.obj_sz));
             } else if (strncmp(pkv->header.key, "UUID", 16) == 0) {
                 string inu = string((char *) pkv->object, kis_ntoh32(pkv->header.obj_sz));
                 srcuuid = uuid(string((char *) pkv->object, kis_ntoh32(pkv->header.obj_sz)));
+            } else if (strncmp(pkv->header.key, "REDIRECTED", 16) == 0) {
+                redirected = true;
             }
         }
 
@@ -1986,6 +2859,26 @@ void dst_incoming_remote::BufferAvailable(size_t in_amt) {
         rbuf_handler->PeekFreeReadBufferData(buf);
         rbuf_handler->ConsumeReadBufferData(frame_sz);
 
+        if (resume) {
+            if (srcuuid == uuid() || session == "") {
+                _MSG("Got an invalid remote data source connection, invalid frame "
+                        "(missing UUID or SESSION kv), disconnecting.", MSGFLAG_ERROR);
+                rbuf_handler->ProtocolError();
+
+                return;
+            }
+
+            if (resume_cb != NULL)
+                resume_cb(this, srcuuid, session, rbuf_handler);
+
+            // Zero out the rbuf handler so that it doesn't get closed
+            rbuf_handler = NULL;
+
+            kill();
+
+            return;
+        }
+
         if (definition == "") {
             _MSG("Got an invalid remote data source connection, invalid frame "
                     "(missing DEFINITION kv), disconnecting.", MSGFLAG_ERROR);
@@ -2011,6 +2904,32 @@ void dst_incoming_remote::BufferAvailable(size_t in_amt) {
             return;
         }
 
+        // A source another cluster server owns is sent there; one which was
+        // already sent here stays, even if our view of the cluster differs
+        shared_ptr<Cluster> cluster = globalreg->FetchGlobalAs<Cluster>("CLUSTER");
+        string target;
+
+        if (cluster != NULL && !redirected && !cluster->claim_source(srcuuid, &target)) {
+            _MSG("Redirecting remote source '" + definition + "' to cluster server " +
+                    target, MSGFLAG_INFO);
+
+            KisDatasourceCapKeyedObject *target_kv =
+                new KisDatasourceCapKeyedObject("REDIRECT", target.data(), 
+                        target.length());
+
+            KisDatasource::KVmap kvmap;
+            kvmap.emplace("REDIRECT", target_kv);
+
+            KisDatasource::write_raw_packet(rbuf_handler, "REDIRECT", kvmap, 0);
+
+            delete(target_kv);
+
+            // The capture binary hangs up once it has the redirect
+            redirected_out = true;
+
+            return;
+        }
+
         if (cb != NULL)
             cb(this, srctype, definition, srcuuid, rbuf_handler);
 
@@ -2024,8 +2943,605 @@ void dst_incoming_remote::BufferAvailable(size_t in_amt) {
 }
 
 void dst_incoming_remote::BufferError(string in_error) {
-    _MSG("Incoming remote source failed: " + in_error, MSGFLAG_ERROR);
+    if (!redirected_out)
+        _MSG("Incoming remote source failed: " + in_error, MSGFLAG_ERROR);
     kill();
     return;
 }
 
+
+dst_datagram_server::dst_datagram_server(GlobalRegistry *in_globalreg,
+        Datasourcetracker *in_dst) {
+    globalreg = in_globalreg;
+    dst = in_dst;
+
+    server_fd = -1;
+    event_driven = false;
+}
+
+dst_datagram_server::~dst_datagram_server() {
+    Shutdown();
+}
+
+int dst_datagram_server::OpenServer(string in_bindaddress, short int in_port) {
+    struct sockaddr_in serv_sock;
+
+    memset(&serv_sock, 0, sizeof(serv_sock));
+    serv_sock.sin_family = AF_INET;
+    serv_sock.sin_port = htons(in_port);
+
+    if (inet_pton(AF_INET, in_bindaddress.c_str(), &(serv_sock.sin_addr.s_addr)) != 1) {
+        _MSG("Datagram server could not parse bind address " + in_bindaddress,
+                MSGFLAG_ERROR);
+        return -1;
+    }
+
+    if ((server_fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        _MSG("Datagram server socket() failed: " + kis_strerror_r(errno),
+                MSGFLAG_ERROR);
+        return -1;
+    }
+
+    fcntl(server_fd, F_SETFD, fcntl(server_fd, F_GETFD, 0) | FD_CLOEXEC);
+
+    if (::bind(server_fd, (struct sockaddr *) &serv_sock, sizeof(serv_sock)) < 0) {
+        _MSG("Datagram server bind() failed: " + kis_strerror_r(errno),
+                MSGFLAG_ERROR);
+        close(server_fd);
+        server_fd = -1;
+        return -1;
+    }
+
+    fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL, 0) | O_NONBLOCK);
+
+    shared_ptr<PollableTracker> pollabletracker =
+        globalreg->FetchGlobalAs<PollableTracker>("POLLABLETRACKER");
+
+    if (pollabletracker != NULL && 
+            pollabletracker->AddEventFd(server_fd, this, true, false) >= 0)
+        event_driven = true;
+
+    return 1;
+}
+
+void dst_datagram_server::Shutdown() {
+    if (server_fd < 0)
+        return;
+
+    if (event_driven) {
+        shared_ptr<PollableTracker> pollabletracker =
+            globalreg->FetchGlobalAs<PollableTracker>("POLLABLETRACKER");
+
+        if (pollabletracker != NULL)
+            pollabletracker->RemoveEventFd(server_fd);
+    }
+
+    close(server_fd);
+    server_fd = -1;
+
+    last_source.reset();
+}
+
+int dst_datagram_server::MergeSet(int in_max_fd, fd_set *out_rset, 
+        fd_set *out_wset __attribute__((unused))) {
+    if (server_fd < 0 || event_driven)
+        return in_max_fd;
+
+    FD_SET(server_fd, out_rset);
+
+    if (server_fd > in_max_fd)
+        return server_fd;
+
+    return in_max_fd;
+}
+
+int dst_datagram_server::Poll(fd_set& in_rset, fd_set& in_wset __attribute__((unused))) {
+    if (server_fd < 0 || event_driven)
+        return 0;
+
+    if (FD_ISSET(server_fd, &in_rset))
+        ReadDatagrams();
+
+    return 0;
+}
+
+int dst_datagram_server::PollEvent(int in_fd, bool in_read, 
+        bool in_write __attribute__((unused))) {
+    if (in_fd != server_fd || !in_read)
+        return 0;
+
+    ReadDatagrams();
+
+    return 0;
+}
+
+void dst_datagram_server::ReadDatagrams() {
+    uint8_t buf[65536];
+    ssize_t len;
+
+    while (server_fd >= 0) {
+        if ((len = recv(server_fd, buf, sizeof(buf), 0)) < 0) {
+            if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+                _MSG("Datagram server recv() failed: " + kis_strerror_r(errno),
+                        MSGFLAG_ERROR);
+            return;
+        }
+
+        ProcessDatagram(buf, (size_t) len);
+    }
+}
+
+void dst_datagram_server::ProcessDatagram(uint8_t *in_buf, size_t in_len) {
+    simple_cap_proto_frame_t *frame = (simple_cap_proto_frame_t *) in_buf;
+    uint32_t header_checksum, data_checksum;
+
+    // A datagram holds exactly one frame, always checksummed
+    if (in_len < sizeof(simple_cap_proto_t))
+        return;
+
+    if (kis_ntoh32(frame->header.signature) != KIS_CAP_SIMPLE_PROTO_SIG)
+        return;
+
+    if (kis_ntoh32(frame->header.packet_sz) != in_len)
+        return;
+
+    if (strncmp(frame->header.type, "DATAGRAM", 16) != 0)
+        return;
+
+    header_checksum = kis_ntoh32(frame->header.header_checksum);
+    data_checksum = kis_ntoh32(frame->header.data_checksum);
+
+    frame->header.header_checksum = 0;
+    frame->header.data_checksum = 0;
+
+    if (Adler32Checksum((const char *) frame, sizeof(simple_cap_proto_t)) != 
+            header_checksum)
+        return;
+
+    if (Adler32Checksum((const char *) in_buf, in_len) != data_checksum)
+        return;
+
+    KisDatasource::KVmap kv_map;
+    vector<KisDatasourceCapKeyedObject *> kv_vec;
+    string token;
+
+    size_t data_offt = 0;
+    for (unsigned int kvn = 0; kvn < kis_ntoh32(frame->header.num_kv_pairs); kvn++) {
+        if (in_len < sizeof(simple_cap_proto_t) + sizeof(simple_cap_proto_kv_t) + 
+                data_offt)
+            break;
+
+        simple_cap_proto_kv_t *pkv =
+            (simple_cap_proto_kv_t *) &((frame->data)[data_offt]);
+
+        data_offt += sizeof(simple_cap_proto_kv_h_t) + kis_ntoh32(pkv->header.obj_sz);
+
+        if (in_len < sizeof(simple_cap_proto_t) + data_offt)
+            break;
+
+        if (strncmp(pkv->header.key, "TOKEN", 16) == 0) {
+            token = string((char *) pkv->object, kis_ntoh32(pkv->header.obj_sz));
+            continue;
+        }
+
+        KisDatasourceCapKeyedObject *kv = new KisDatasourceCapKeyedObject(pkv);
+
+        kv_map[StrLower(kv->key)] = kv;
+        kv_vec.push_back(kv);
+    }
+
+    if (token.length() != 0) {
+        uint32_t seq = kis_ntoh32(frame->header.sequence_number);
+
+        if (last_source == NULL || token != last_token || 
+                !last_source->proto_packet_datagram(token, seq, kv_map)) {
+            last_source = dst->find_datagram_datasource(token);
+            last_token = token;
+
+            if (last_source != NULL)
+                last_source->proto_packet_datagram(token, seq, kv_map);
+        }
+    }
+
+    for (auto i = kv_vec.begin(); i != kv_vec.end(); ++i)
+        delete *i;
+}
+
+
+dst_shared_helper::dst_shared_helper(GlobalRegistry *in_globalreg, string in_binary,
+        vector<string> in_args, bool in_validate_checksum, string in_cpus) {
+    globalreg = in_globalreg;
+
+    binary = in_binary;
+    args = in_args;
+    validate_checksum = in_validate_checksum;
+    cpus = in_cpus;
+
+    failed = false;
+    next_channel_id = 1;
+
+    pthread_mutex_init(&helper_lock, NULL);
+}
+
+dst_shared_helper::~dst_shared_helper() {
+    if (ipc_handler != NULL) {
+        ipc_handler->RemoveReadBufferInterface();
+
+        if (ipc_remote != NULL)
+            ipc_remote->soft_kill();
+
+        ipc_handler->ProtocolError();
+    }
+
+    channels.clear();
+
+    pthread_mutex_destroy(&helper_lock);
+}
+
+int dst_shared_helper::launch_helper() {
+    local_locker lock(&helper_lock);
+
+    // Every source of the binary reads through this buffer, so give it more room
+    // than the buffer of a single source
+    ipc_handler.reset(new BufferHandler<RingbufSPSC, RingbufV2>((4 * 1024 * 1024),
+                (1024 * 1024)));
+    ipc_handler->SetReadBufferInterface(this);
+
+    ipc_remote.reset(new IPCRemoteV2(globalreg, ipc_handler));
+
+    vector<string> bin_paths = 
+        globalreg->kismet_config->FetchOptVec("capture_binary_path");
+
+    for (auto i = bin_paths.begin(); i != bin_paths.end(); ++i) {
+        ipc_remote->add_path(globalreg->kismet_config->ExpandLogPath(*i, "", 
+                    "", 0, 1));
+    }
+
+    ipc_remote->set_cpu_affinity(cpus);
+
+    vector<string> launch_args = args;
+    launch_args.push_back("--multiplex");
+
+    if (ipc_remote->launch_kis_binary(binary, launch_args) < 0) {
+        failed = true;
+        return -1;
+    }
+
+    return 1;
+}
+
+pid_t dst_shared_helper::get_pid() {
+    local_locker lock(&helper_lock);
+
+    if (ipc_remote == NULL)
+        return -1;
+
+    return ipc_remote->get_pid();
+}
+
+bool dst_shared_helper::get_failed() {
+    local_locker lock(&helper_lock);
+
+    return failed;
+}
+
+shared_ptr<BufferHandlerGeneric> dst_shared_helper::attach_channel(uint32_t *ret_id) {
+    local_locker lock(&helper_lock);
+
+    shared_ptr<helper_channel> ch(new helper_channel(this, next_channel_id++));
+
+    // Same sizes as the buffer of a source with its own capture binary
+    ch->handler.reset(new BufferHandler<RingbufSPSC, RingbufV2>((1024 * 1024),
+                (1024 * 1024)));
+    ch->handler->SetWriteBufferInterface(ch.get());
+
+    channels[ch->id] = ch;
+
+    *ret_id = ch->id;
+
+    return ch->handler;
+}
+
+void dst_shared_helper::detach_channel(uint32_t in_id) {
+    shared_ptr<helper_channel> ch;
+    bool helper_failed;
+
+    {
+        local_locker lock(&helper_lock);
+
+        auto ci = channels.find(in_id);
+
+        if (ci == channels.end())
+            return;
+
+        ch = ci->second;
+        channels.erase(ci);
+
+        helper_failed = failed;
+    }
+
+    ch->handler->RemoveWriteBufferInterface();
+
+    if (helper_failed)
+        return;
+
+    // Anything the source wrote last (like CLOSEDEVICE) goes before the close
+    send_channel(ch.get());
+    write_mux("MUXCLOSE", in_id, NULL, 0);
+}
+
+bool dst_shared_helper::write_mux(string in_type, uint32_t in_id, 
+        const uint8_t *in_frame, size_t in_len) {
+    size_t total_sz = sizeof(simple_cap_proto_t) + sizeof(simple_cap_proto_kv_h_t) + 
+        sizeof(uint32_t);
+
+    if (in_frame != NULL)
+        total_sz += sizeof(simple_cap_proto_kv_h_t) + in_len;
+
+    vector<uint8_t> buf(total_sz, 0);
+
+    simple_cap_proto_t *hdr = (simple_cap_proto_t *) buf.data();
+
+    hdr->signature = kis_hton32(KIS_CAP_SIMPLE_PROTO_SIG);
+    snprintf(hdr->type, 16, "%s", in_type.c_str());
+    hdr->packet_sz = kis_hton32(total_sz);
+    hdr->num_kv_pairs = kis_hton32(in_frame != NULL ? 2 : 1);
+
+    size_t offt = sizeof(simple_cap_proto_t);
+
+    simple_cap_proto_kv_t *kv = (simple_cap_proto_kv_t *) (buf.data() + offt);
+    snprintf(kv->header.key, 16, "MUXID");
+    kv->header.obj_sz = kis_hton32(sizeof(uint32_t));
+    uint32_t n_id = kis_hton32(in_id);
+    memcpy(kv->object, &n_id, sizeof(uint32_t));
+    offt += sizeof(simple_cap_proto_kv_h_t) + sizeof(uint32_t);
+
+    if (in_frame != NULL) {
+        kv = (simple_cap_proto_kv_t *) (buf.data() + offt);
+        snprintf(kv->header.key, 16, "FRAME");
+        kv->header.obj_sz = kis_hton32(in_len);
+        memcpy(kv->object, in_frame, in_len);
+    }
+
+    // Frames we send are always checksummed, like write_packet; both checksums
+    // are calculated with the checksum fields zeroed
+    uint32_t header_csum = 
+        Adler32Checksum((const char *) hdr, sizeof(simple_cap_proto_t));
+    uint32_t data_csum = Adler32Checksum((const char *) buf.data(), total_sz);
+
+    hdr->header_checksum = kis_hton32(header_csum);
+    hdr->data_checksum = kis_hton32(data_csum);
+
+    if (ipc_handler == NULL)
+        return false;
+
+    return ipc_handler->PutWriteBufferData(buf.data(), total_sz, true) == total_sz;
+}
+
+void dst_shared_helper::send_channel(helper_channel *in_channel) {
+    local_locker lock(&in_channel->channel_lock);
+
+    uint8_t *buf;
+
+    while (1) {
+        size_t buffamt = in_channel->handler->GetWriteBufferUsed();
+        if (buffamt < sizeof(simple_cap_proto_t))
+            return;
+
+        buffamt = in_channel->handler->PeekWriteBufferData((void **) &buf, buffamt);
+
+        if (buffamt < sizeof(simple_cap_proto_t)) {
+            in_channel->handler->PeekFreeWriteBufferData(buf);
+            return;
+        }
+
+        uint32_t frame_sz = kis_ntoh32(((simple_cap_proto_t *) buf)->packet_sz);
+
+        if (frame_sz < sizeof(simple_cap_proto_t)) {
+            // Sources only write whole frames, so this can't be resynchronized
+            in_channel->handler->PeekFreeWriteBufferData(buf);
+            in_channel->handler->ReadBufferError("invalid frame written to shared "
+                    "capture binary");
+            return;
+        }
+
+        if (frame_sz > buffamt) {
+            in_channel->handler->PeekFreeWriteBufferData(buf);
+            return;
+        }
+
+        // If the capture binary isn't keeping up, leave the frame; it goes out 
+        // the next time the source writes, or the binary sends us anything
+        bool sent = write_mux("MUX", in_channel->id, buf, frame_sz);
+
+        in_channel->handler->PeekFreeWriteBufferData(buf);
+
+        if (!sent)
+            return;
+
+        in_channel->handler->ConsumeWriteBufferData(frame_sz);
+    }
+}
+
+void dst_shared_helper::BufferAvailable(size_t in_amt __attribute__((unused))) {
+    simple_cap_proto_frame_t *frame;
+    uint8_t *buf;
+    uint32_t frame_sz;
+    uint32_t header_checksum, data_checksum;
+
+    // Nothing after a protocol error can be trusted
+    if (get_failed())
+        return;
+
+    while (1) {
+        if (ipc_handler == NULL)
+            return;
+
+        size_t buffamt = ipc_handler->GetReadBufferUsed();
+        if (buffamt < sizeof(simple_cap_proto_t))
+            break;
+
+        buffamt = ipc_handler->PeekReadBufferData((void **) &buf, buffamt);
+
+        if (buffamt < sizeof(simple_cap_proto_t)) {
+            ipc_handler->PeekFreeReadBufferData(buf);
+            break;
+        }
+
+        frame = (simple_cap_proto_frame_t *) buf;
+
+        if (kis_ntoh32(frame->header.signature) != KIS_CAP_SIMPLE_PROTO_SIG) {
+            ipc_handler->PeekFreeReadBufferData(buf);
+            BufferError("shared capture binary sent an invalid frame");
+            ipc_remote->soft_kill();
+            return;
+        }
+
+        frame_sz = kis_ntoh32(frame->header.packet_sz);
+
+        if (frame_sz > buffamt) {
+            ipc_handler->PeekFreeReadBufferData(buf);
+            break;
+        }
+
+        if (validate_checksum) {
+            header_checksum = kis_ntoh32(frame->header.header_checksum);
+            data_checksum = kis_ntoh32(frame->header.data_checksum);
+
+            frame->header.header_checksum = 0;
+            frame->header.data_checksum = 0;
+
+            if (Adler32Checksum((const char *) frame, sizeof(simple_cap_proto_t)) !=
+                    header_checksum ||
+                    Adler32Checksum((const char *) buf, frame_sz) != data_checksum) {
+                ipc_handler->PeekFreeReadBufferData(buf);
+                BufferError("shared capture binary sent a frame with an invalid "
+                        "checksum");
+                ipc_remote->soft_kill();
+                return;
+            }
+        }
+
+        // Find the channel and the wrapped frame
+        bool have_id = false;
+        uint32_t mux_id = 0;
+        uint8_t *wrapped = NULL;
+        uint32_t wrapped_sz = 0;
+
+        size_t data_offt = 0;
+        for (unsigned int kvn = 0; kvn < kis_ntoh32(frame->header.num_kv_pairs); 
+                kvn++) {
+            if (frame_sz < sizeof(simple_cap_proto_t) + 
+                    sizeof(simple_cap_proto_kv_h_t) + data_offt)
+                break;
+
+            simple_cap_proto_kv_t *pkv =
+                (simple_cap_proto_kv_t *) &((frame->data)[data_offt]);
+            uint32_t obj_sz = kis_ntoh32(pkv->header.obj_sz);
+
+            data_offt += sizeof(simple_cap_proto_kv_h_t) + obj_sz;
+
+            if (frame_sz < sizeof(simple_cap_proto_t) + data_offt)
+                break;
+
+            if (strncmp(pkv->header.key, "MUXID", 16) == 0 && 
+                    obj_sz == sizeof(uint32_t)) {
+                memcpy(&mux_id, pkv->object, sizeof(uint32_t));
+                mux_id = kis_ntoh32(mux_id);
+                have_id = true;
+            } else if (strncmp(pkv->header.key, "FRAME", 16) == 0) {
+                wrapped = pkv->object;
+                wrapped_sz = obj_sz;
+            }
+        }
+
+        if (strncmp(frame->header.type, "MUX", 16) != 0 || !have_id || 
+                wrapped == NULL || wrapped_sz < sizeof(simple_cap_proto_t) ||
+                kis_ntoh32(((simple_cap_proto_t *) wrapped)->packet_sz) != wrapped_sz) {
+            ipc_handler->PeekFreeReadBufferData(buf);
+            BufferError("shared capture binary sent an invalid multiplexed frame");
+            ipc_remote->soft_kill();
+            return;
+        }
+
+        shared_ptr<helper_channel> ch;
+
+        {
+            local_locker lock(&helper_lock);
+
+            auto ci = channels.find(mux_id);
+            if (ci != channels.end())
+                ch = ci->second;
+        }
+
+        // Deliver without holding our lock; the source may write to its channel 
+        // or detach while it handles the frame.  Frames of a closed channel are
+        // dropped.
+        if (ch != NULL) {
+            if (ch->handler->PutReadBufferData(wrapped, wrapped_sz, true) != 
+                    wrapped_sz) {
+                ch->handler->ReadBufferError("insufficient space in buffer");
+            }
+        }
+
+        ipc_handler->PeekFreeReadBufferData(buf);
+        ipc_handler->ConsumeReadBufferData(frame_sz);
+    }
+
+    // Retry frames which didn't fit in the write buffer earlier
+    vector<shared_ptr<helper_channel> > pending;
+
+    {
+        local_locker lock(&helper_lock);
+
+        for (auto ci : channels) {
+            if (ci.second->handler->GetWriteBufferUsed() != 0)
+                pending.push_back(ci.second);
+        }
+    }
+
+    for (auto ci : pending)
+        send_channel(ci.get());
+}
+
+void dst_shared_helper::BufferError(string in_error) {
+    vector<shared_ptr<helper_channel> > failed_channels;
+
+    {
+        local_locker lock(&helper_lock);
+
+        if (failed)
+            return;
+
+        failed = true;
+
+        for (auto ci : channels)
+            failed_channels.push_back(ci.second);
+    }
+
+    stringstream ss;
+    ss << "Shared capture binary '" << binary << "' failed: " << in_error;
+    _MSG(ss.str(), MSGFLAG_ERROR);
+
+    // Every source of the binary fails with it, and launches a new one when it
+    // retries
+    for (auto ci : failed_channels)
+        ci->handler->ReadBufferError(in_error);
+}
+
+dst_shared_helper::helper_channel::helper_channel(dst_shared_helper *in_helper,
+        uint32_t in_id) {
+    helper = in_helper;
+    id = in_id;
+
+    pthread_mutex_init(&channel_lock, NULL);
+}
+
+dst_shared_helper::helper_channel::~helper_channel() {
+    pthread_mutex_destroy(&channel_lock);
+}
+
+void dst_shared_helper::helper_channel::BufferAvailable(size_t in_amt 
+        __attribute__((unused))) {
+    helper->send_channel(this);
+}
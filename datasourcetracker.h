@@ -25,7 +25,10 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <unordered_map>
+#include <deque>
 #include <functional>
+#include <memory>
 
 #include "globalregistry.h"
 #include "util.h"
@@ -97,7 +100,7 @@ public:
 class DST_DatasourceProbe {
 public:
     DST_DatasourceProbe(GlobalRegistry *in_globalreg, string in_definition, 
-            SharedTrackerElement in_protovec);
+            SharedTrackerElement in_protovec, unsigned int in_timeout);
     virtual ~DST_DatasourceProbe();
 
     void probe_sources(function<void (SharedDatasourceBuilder)> in_cb);
@@ -140,6 +143,8 @@ protected:
     function<void (SharedDatasourceBuilder)> probe_cb;
     bool cancelled;
 
+    // Seconds to wait for the drivers to answer
+    unsigned int timeout;
     int cancel_timer;
 };
 
@@ -291,12 +296,17 @@ protected:
 // simple packet protocol enough to get a NEWSOURCE command; The resulting source
 // type, definition, uuid, and rbufhandler is passed to the callback function; the cb
 // is responsible for looking up the type, closing the connection if it is invalid, etc.
+// A RESUME command for an existing session passes the uuid and session token to
+// the resume callback instead.  In a cluster, a NEWSOURCE for a source another
+// server owns is answered with a REDIRECT to that server instead.
 class dst_incoming_remote : public BufferInterface {
 public:
     dst_incoming_remote(GlobalRegistry *in_globalreg, 
             shared_ptr<BufferHandlerGeneric> in_rbufhandler,
             function<void (dst_incoming_remote *, string srctype, string srcdef,
-                uuid srcuuid, shared_ptr<BufferHandlerGeneric> handler)> in_cb);
+                uuid srcuuid, shared_ptr<BufferHandlerGeneric> handler)> in_cb,
+            function<void (dst_incoming_remote *, uuid srcuuid, string session,
+                shared_ptr<BufferHandlerGeneric> handler)> in_resume_cb);
     ~dst_incoming_remote();
 
     virtual void BufferAvailable(size_t in_amt);
@@ -320,12 +330,156 @@ protected:
     function<void (dst_incoming_remote *, string, string, uuid, 
             shared_ptr<BufferHandlerGeneric> )> cb;
 
+    function<void (dst_incoming_remote *, uuid, string,
+            shared_ptr<BufferHandlerGeneric> )> resume_cb;
+
     std::thread handshake_thread;
+
+    // Sent a REDIRECT, and waiting for the capture binary to hang up
+    bool redirected_out;
+};
+
+class Datasourcetracker;
+
+// UDP listener for metadata datagrams from remote capture, on the same address
+// and port as the remote capture TCP server.  Each datagram is a self-contained
+// DATAGRAM frame carrying the token Kismet gave the source when it opened it;
+// datagrams with an unknown token or an invalid frame are dropped.
+class dst_datagram_server : public Pollable {
+public:
+    dst_datagram_server(GlobalRegistry *in_globalreg, Datasourcetracker *in_dst);
+    virtual ~dst_datagram_server();
+
+    int OpenServer(string in_bindaddress, short int in_port);
+    void Shutdown();
+
+    // Pollable
+    virtual int MergeSet(int in_max_fd, fd_set *out_rset, fd_set *out_wset);
+    virtual int Poll(fd_set& in_rset, fd_set& in_wset);
+    virtual int PollEvent(int in_fd, bool in_read, bool in_write);
+
+protected:
+    GlobalRegistry *globalreg;
+    Datasourcetracker *dst;
+
+    int server_fd;
+    bool event_driven;
+
+    // Source of the last datagram, so we don't search for every one
+    string last_token;
+    SharedDatasource last_source;
+
+    // Read datagrams until the socket would block
+    void ReadDatagrams();
+    void ProcessDatagram(uint8_t *in_buf, size_t in_len);
+};
+
+// Capture binary shared by several local sources (datasource_shared_helper).  The
+// binary is launched once with --multiplex, and each source attached to it gets a
+// channel with a buffer handler of its own, which it uses exactly as it would the
+// buffer of its own capture binary.  Frames a source writes are wrapped in MUX
+// frames tagged with the channel id; MUX frames from the binary are unwrapped into
+// the buffer of their channel.  The binary is killed once no source holds it.
+class dst_shared_helper : public BufferInterface {
+public:
+    dst_shared_helper(GlobalRegistry *in_globalreg, string in_binary,
+            vector<string> in_args, bool in_validate_checksum, string in_cpus);
+    virtual ~dst_shared_helper();
+
+    // Launch the capture binary; returns negative on failure
+    int launch_helper();
+
+    pid_t get_pid();
+
+    // Has the capture binary failed or exited?
+    bool get_failed();
+
+    // Attach a source; returns the buffer handler of its channel
+    shared_ptr<BufferHandlerGeneric> attach_channel(uint32_t *ret_id);
+
+    // Detach a source, flushing what it has written and closing its channel
+    void detach_channel(uint32_t in_id);
+
+    // Frames from the capture binary
+    virtual void BufferAvailable(size_t in_amt);
+    virtual void BufferError(string in_error);
+
+protected:
+    // Write side of a channel, wraps what the source writes
+    class helper_channel : public BufferInterface {
+    public:
+        helper_channel(dst_shared_helper *in_helper, uint32_t in_id);
+        virtual ~helper_channel();
+
+        virtual void BufferAvailable(size_t in_amt);
+
+        dst_shared_helper *helper;
+        uint32_t id;
+        shared_ptr<BufferHandlerGeneric> handler;
+
+        // Only one thread drains the write buffer at a time, so frames keep 
+        // their order
+        pthread_mutex_t channel_lock;
+    };
+
+    // Wrap and send every complete frame the source has written
+    void send_channel(helper_channel *in_channel);
+
+    // Wrap a frame (or nothing, for MUXCLOSE) in a single write, so frames of 
+    // different channels never interleave
+    bool write_mux(string in_type, uint32_t in_id, const uint8_t *in_frame, 
+            size_t in_len);
+
+    GlobalRegistry *globalreg;
+
+    pthread_mutex_t helper_lock;
+
+    string binary;
+    vector<string> args;
+    bool validate_checksum;
+    string cpus;
+
+    shared_ptr<BufferHandlerGeneric> ipc_handler;
+    shared_ptr<IPCRemoteV2> ipc_remote;
+
+    bool failed;
+
+    uint32_t next_channel_id;
+    map<uint32_t, shared_ptr<helper_channel> > channels;
 };
 
 // Fwd def of datasource pcap feed
 class Datasourcetracker_Httpd_Pcap;
 
+// Hash of a source UUID
+struct dst_uuid_hash {
+    size_t operator()(const uuid& in_uuid) const {
+        uint64_t a, b;
+
+        memcpy(&a, in_uuid.uuid_block, sizeof(uint64_t));
+        memcpy(&b, in_uuid.uuid_block + sizeof(uint64_t), sizeof(uint64_t));
+
+        return (size_t) (a ^ (b * 0x9E3779B97F4A7C15ULL));
+    }
+};
+
+// Read-only copy of the source list, rebuilt and swapped under the tracker lock
+// whenever a source is added or removed.  Readers take a reference to the 
+// current copy and use it without locking; a reader still holding an older
+// copy keeps it alive until it's done with it.
+struct dst_source_snapshot {
+    // Source list version this was built from
+    uint64_t version;
+
+    vector<SharedDatasource> sources;
+
+    // The same sources as a tracked vector, for serializing
+    SharedTrackerElement source_vec;
+
+    // UUID to position in sources
+    std::unordered_map<uuid, size_t, dst_uuid_hash> uuid_index;
+};
+
 class Datasourcetracker : public Kis_Net_Httpd_CPPStream_Handler, 
     public LifetimeGlobal, public TcpServerV2 {
 public:
@@ -387,9 +541,24 @@ public:
             string in_definition, uuid in_uuid,
             shared_ptr<BufferHandlerGeneric> in_handler);
 
+    // Resume the session of a remote data source which lost its connection
+    void resume_remote_datasource(dst_incoming_remote *incoming, uuid in_uuid,
+            string in_session, shared_ptr<BufferHandlerGeneric> in_handler);
+
     // Find a datasource
     SharedDatasource find_datasource(uuid in_uuid);
 
+    // Every datasource
+    vector<SharedDatasource> get_datasources();
+
+    // Find the datasource which accepts datagrams with a token
+    SharedDatasource find_datagram_datasource(string in_token);
+
+    // Find the running shared capture binary for a binary, arguments, and cpus,
+    // or launch one; returns NULL if it can't be launched
+    shared_ptr<dst_shared_helper> get_shared_helper(string in_binary, 
+            vector<string> in_args, bool in_validate_checksum, string in_cpus);
+
     // List potential sources
     //
     // Optional completion function will be called with list of possible sources.
@@ -405,10 +574,21 @@ public:
 
     virtual int Httpd_PostComplete(Kis_Net_Httpd_Connection *concls);
 
-    // Operate on all data sources currently defined.  The datasource tracker is locked
-    // during this operation, making it thread safe.
+    virtual bool Httpd_StreamStructuredPost() { return true; }
+
+    // The source list is tagged with the modification counts of the sources
+    virtual bool Httpd_ETag(const char *path, uint64_t *etag);
+
+    // Operate on all data sources currently defined.  The worker is given the 
+    // snapshot of the source list, without the tracker locked; sources added or
+    // removed while it runs aren't seen.
     void iterate_datasources(DST_Worker *in_worker);
 
+    // Current snapshot of the source list; never NULL
+    shared_ptr<const dst_source_snapshot> get_source_snapshot() {
+        return std::atomic_load(&source_snapshot);
+    }
+
     // TCPServerV2 API
     virtual void NewConnection(shared_ptr<BufferHandlerGeneric> conn_handler);
 
@@ -421,6 +601,12 @@ public:
     // Queue a remote handler to be removed
     void queue_dead_remote(dst_incoming_remote *in_dead);
 
+    // Build a hop list for adaptive hopping:  every channel is visited at least
+    // once per pass, and up to (factor - 1) * channels extra visits are shared out
+    // by weight and interleaved so busy channels are revisited evenly
+    static vector<string> build_adaptive_hop_list(vector<string> in_chans, 
+            map<string, double> in_weights, unsigned int in_factor);
+
 protected:
     // Merge a source into the source list, preserving UUID and source number
     virtual void merge_source(SharedDatasource in_source);
@@ -433,6 +619,13 @@ protected:
 
     pthread_mutex_t dst_lock;
 
+    // Bumped when a source is added or removed, under the lock
+    uint64_t source_list_version;
+
+    // Render a view of the waterfall of a spectrum source as packed rows
+    void Httpd_Waterfall(Kis_Net_Httpd_Connection *connection, const char *path,
+            std::stringstream &stream);
+
     SharedTrackerElement dst_proto_builder;
     SharedTrackerElement dst_source_builder;
 
@@ -442,6 +635,14 @@ protected:
     // Active data sources
     SharedTrackerElement datasource_vec;
 
+    // Published copy of datasource_vec for lookups which don't lock; only ever
+    // accessed with atomic_load and atomic_store
+    shared_ptr<const dst_source_snapshot> source_snapshot;
+
+    // Rebuild and publish the snapshot; called with the lock held after 
+    // datasource_vec changes
+    void publish_source_snapshot();
+
     // Sub-workers probing for a source definition
     map<unsigned int, SharedDSTProbe> probing_map;
     unsigned int next_probe_id;
@@ -449,6 +650,32 @@ protected:
     // Sub-workers slated for being removed
     vector<SharedDSTProbe> probing_complete_vec;
 
+    // Probes wait here when source_probe_max are already running
+    struct dst_pending_probe {
+        string definition;
+        function<void (bool, string, SharedDatasource)> cb;
+    };
+    deque<dst_pending_probe> probe_queue;
+    unsigned int max_probes;
+    unsigned int probe_timeout;
+
+    // Start a probe, or queue it if too many are running
+    void start_probe(string in_source, 
+            function<void (bool, string, SharedDatasource)> in_cb);
+    // Start queued probes while there are free slots
+    void probe_next();
+
+    // Interfaces to the driver type which claimed them, remembered across
+    // restarts so that known interfaces can be opened without probing
+    bool probe_cache_enabled;
+    map<string, string> probe_cache;
+    string probe_cache_path;
+
+    void load_probe_cache();
+    void save_probe_cache();
+    void cache_probe(string in_interface, string in_type);
+    void uncache_probe(string in_interface);
+
     // Sub-workers listing interfaces
     map<unsigned int, SharedDSTList> listing_map;
     unsigned int next_list_id;
@@ -474,13 +701,40 @@ protected:
 
     shared_ptr<datasourcetracker_defaults> config_defaults;
 
+    // Reload handler updating config_defaults
+    int config_reload_id;
+
     // Re-assign channel hopping because we've opened a new source
     // and want to do channel split
     void calculate_source_hopping(SharedDatasource in_ds);
 
+    // Adaptive hopping weights the time spent on each channel by the packets and
+    // devices seen there, and splits the channels among all the adaptive sources
+    bool adaptive_hop;
+    unsigned int adaptive_hop_interval;
+    unsigned int adaptive_hop_factor;
+    int adaptive_hop_timer;
+
+    // Channels each adaptive source can hop, and the last list it was given
+    map<uuid, vector<string> > adaptive_base_lists;
+    map<uuid, vector<string> > adaptive_hop_lists;
+
+    bool get_source_adaptive(SharedDatasource in_ds);
+
+    // Re-weight the hop lists of the adaptive sources; in_ds is included even if
+    // it hasn't been merged into the source list yet
+    void calculate_adaptive_hopping(SharedDatasource in_ds);
+
     // Our pcap http interface
     shared_ptr<Datasourcetracker_Httpd_Pcap> httpd_pcap;
 
+    // Metadata datagrams from remote capture, if enabled
+    shared_ptr<dst_datagram_server> datagram_server;
+
+    // Shared capture binaries, by binary and arguments; the sources attached to
+    // a binary hold it
+    map<string, weak_ptr<dst_shared_helper> > shared_helpers;
+
 };
 
 /* This implements the core 'all data' pcap, and pcap filtered by datasource UUID.
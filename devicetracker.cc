@@ -38,6 +38,7 @@
 #include "messagebus.h"
 #include "packetchain.h"
 #include "devicetracker.h"
+#include "kis_probes.h"
 #include "packet.h"
 #include "gpstracker.h"
 #include "alertracker.h"
@@ -51,13 +52,521 @@
 #include "kismet_json.h"
 #include "base64.h"
 #include "kis_datasource.h"
+#include "packet_dedup.h"
+#include "kis_clock.h"
+
+const tracker_field_desc<kis_tracked_device_base> kis_tracked_device_base::field_desc[] = {
+    __TrackerField(kis_tracked_device_base, "kismet.device.base.key",
+            TrackerUInt64, "unique integer key", key),
+    __TrackerField(kis_tracked_device_base, "kismet.device.base.macaddr",
+            TrackerMac, "mac address", macaddr),
+    __TrackerField(kis_tracked_device_base, "kismet.device.base.phyname",
+            TrackerString, "phy name", phyname),
+    __TrackerField(kis_tracked_device_base, "kismet.device.base.name",
+            TrackerString, "printable device name", devicename),
+    __TrackerField(kis_tracked_device_base, "kismet.device.base.username",
+            TrackerString, "user name", username),
+    __TrackerField(kis_tracked_device_base, "kismet.device.base.type",
+            TrackerString, "printable device type", type_string),
+    __TrackerField(kis_tracked_device_base, "kismet.device.base.basic_type_set",
+            TrackerUInt64, "bitset of basic type", basic_type_set),
+    __TrackerField(kis_tracked_device_base, "kismet.device.base.crypt",
+            TrackerString, "printable encryption type", crypt_string),
+    __TrackerField(kis_tracked_device_base, "kismet.device.base.basic_crypt_set",
+            TrackerUInt64, "bitset of basic encryption", basic_crypt_set),
+
+    __TrackerField(kis_tracked_device_base, "kismet.device.base.first_time",
+            TrackerUInt64, "first time seen time_t", first_time),
+    __TrackerField(kis_tracked_device_base, "kismet.device.base.last_time",
+            TrackerUInt64, "last time seen time_t", last_time),
+
+    __TrackerField(kis_tracked_device_base, "kismet.device.base.packets.total",
+            TrackerUInt64, "total packets seen of all types", packets),
+    __TrackerField(kis_tracked_device_base, "kismet.device.base.packets.rx",
+            TrackerUInt64, "observed packets sent to device", rx_packets),
+    __TrackerField(kis_tracked_device_base, "kismet.device.base.packets.tx",
+            TrackerUInt64, "observed packets from device", tx_packets),
+    __TrackerField(kis_tracked_device_base, "kismet.device.base.packets.llc",
+            TrackerUInt64, "observed protocol control packets", llc_packets),
+    __TrackerField(kis_tracked_device_base, "kismet.device.base.packets.error",
+            TrackerUInt64, "corrupt/error packets", error_packets),
+    __TrackerField(kis_tracked_device_base, "kismet.device.base.packets.data",
+            TrackerUInt64, "data packets", data_packets),
+    __TrackerField(kis_tracked_device_base, "kismet.device.base.packets.crypt",
+            TrackerUInt64, "data packets using encryption", crypt_packets),
+    __TrackerField(kis_tracked_device_base, "kismet.device.base.packets.filtered",
+            TrackerUInt64, "packets dropped by filter", filter_packets),
+
+    __TrackerFieldId(kis_tracked_device_base, "kismet.device.base.packets.sampled",
+            TrackerUInt64, "data packets estimated from overload sampling, "
+            "included in the totals", sampled_packets_id),
+
+    __TrackerField(kis_tracked_device_base, "kismet.device.base.datasize",
+            TrackerUInt64, "transmitted data in bytes", datasize),
+
+    __TrackerComplexField(kis_tracked_device_base, kis_tracked_rrd<>,
+            "kismet.device.base.packets.rrd", "packet rate rrd", packets_rrd_id),
+    __TrackerComplexField(kis_tracked_device_base, kis_tracked_rrd<>,
+            "kismet.device.base.datasize.rrd", "packet size rrd", data_rrd_id),
+    __TrackerComplexField(kis_tracked_device_base, kis_tracked_signal_data,
+            "kismet.device.base.signal", "signal data", signal_data_id),
+
+    __TrackerFieldId(kis_tracked_device_base, "kismet.device.base.freq_khz_map",
+            TrackerSmallDoubleMap, "packets seen per frequency (khz)", freq_khz_map_id),
+
+    __TrackerField(kis_tracked_device_base, "kismet.device.base.channel",
+            TrackerString, "channel (phy specific)", channel),
+    __TrackerField(kis_tracked_device_base, "kismet.device.base.frequency",
+            TrackerDouble, "frequency", frequency),
+
+    __TrackerField(kis_tracked_device_base, "kismet.device.base.manuf",
+            TrackerString, "manufacturer name", manuf),
+
+    __TrackerField(kis_tracked_device_base, "kismet.device.base.num_alerts",
+            TrackerUInt32, "number of alerts on this device", alert),
+
+    __TrackerFieldId(kis_tracked_device_base, "kismet.device.base.tags",
+            TrackerStringMap, "set of arbitrary tags", tag_map_id),
+    __TrackerFieldId(kis_tracked_device_base, "kismet.device.base.tag",
+            TrackerString, "arbitrary tag", tag_entry_id),
+
+    __TrackerComplexField(kis_tracked_device_base, kis_tracked_location,
+            "kismet.device.base.location", "location", location_id),
+
+    __TrackerFieldId(kis_tracked_device_base, "kismet.device.base.seenby",
+            TrackerSmallIntMap, "sources that have seen this device", seenby_map_id),
+
+    // Packet count, not actual frequency, so uint64 not double
+    __TrackerFieldId(kis_tracked_device_base, "kismet.device.base.frequency.count",
+            TrackerUInt64, "frequency packet count", frequency_val_id),
+
+    __TrackerComplexField(kis_tracked_device_base, kis_tracked_seenby_data,
+            "kismet.device.base.seenby.data", "seen-by data", seenby_val_id),
+
+    __TrackerComplexField(kis_tracked_device_base, kis_tracked_minute_rrd<>,
+            "kismet.device.base.packet.bin.250", "Packets up to 250 bytes", packet_rrd_bin_250_id),
+    __TrackerComplexField(kis_tracked_device_base, kis_tracked_minute_rrd<>,
+            "kismet.device.base.packet.bin.500", "Packets up to 500 bytes", packet_rrd_bin_500_id),
+    __TrackerComplexField(kis_tracked_device_base, kis_tracked_minute_rrd<>,
+            "kismet.device.base.packet.bin.1000", "Packets up to 1000 bytes", packet_rrd_bin_1000_id),
+    __TrackerComplexField(kis_tracked_device_base, kis_tracked_minute_rrd<>,
+            "kismet.device.base.packet.bin.1500", "Packets up to 1500 bytes", packet_rrd_bin_1500_id),
+    __TrackerComplexField(kis_tracked_device_base, kis_tracked_minute_rrd<>,
+            "kismet.device.base.packet.bin.jumbo", "Jumbo packets over 1500 bytes", packet_rrd_bin_jumbo_id),
+};
+
+tracker_field_table<kis_tracked_device_base> 
+    kis_tracked_device_base::field_table(kis_tracked_device_base::field_desc);
 
 int Devicetracker_packethook_commontracker(CHAINCALL_PARMS) {
 	return ((Devicetracker *) auxdata)->CommonTracker(in_pack);
 }
 
+DevicetrackerIndex::DevicetrackerIndex(unsigned int in_num_shards) {
+    // Round up to a power of two so we can mask instead of mod
+    num_shards = 1;
+    while (num_shards < in_num_shards && num_shards < 4096)
+        num_shards <<= 1;
+
+    shards = new index_shard[num_shards];
+
+    for (unsigned int s = 0; s < num_shards; s++)
+        pthread_mutex_init(&(shards[s].mutex), NULL);
+
+    num_devices = 0;
+}
+
+DevicetrackerIndex::~DevicetrackerIndex() {
+    for (unsigned int s = 0; s < num_shards; s++)
+        pthread_mutex_destroy(&(shards[s].mutex));
+
+    delete[] shards;
+}
+
+DevicetrackerIndex::index_shard *DevicetrackerIndex::get_shard(uint64_t in_mac) {
+    // Mix the mac so that sequential and same-OUI devices spread out
+    uint64_t h = (in_mac & 0xFFFFFFFFFFFFULL) * 0x9E3779B97F4A7C15ULL;
+    return &(shards[(h >> 32) & (num_shards - 1)]);
+}
+
+shared_ptr<kis_tracked_device_base> DevicetrackerIndex::find(uint64_t in_key) {
+    index_shard *shard = get_shard(DevicetrackerKey::GetDevice(in_key));
+
+    local_locker lock(&(shard->mutex));
+
+    shared_ptr<kis_tracked_device_base> *d = shard->key_map.find(in_key);
+
+    if (d != NULL)
+        return *d;
+
+    return NULL;
+}
+
+vector<shared_ptr<kis_tracked_device_base> > DevicetrackerIndex::find_mac(mac_addr in_mac) {
+    index_shard *shard = get_shard(in_mac.GetAsLong());
+
+    local_locker lock(&(shard->mutex));
+
+    vector<shared_ptr<kis_tracked_device_base> > *v =
+        shard->mac_map.find(in_mac.GetAsLong() & 0xFFFFFFFFFFFFULL);
+
+    if (v != NULL)
+        return *v;
+
+    return vector<shared_ptr<kis_tracked_device_base> >();
+}
+
+bool DevicetrackerIndex::contains_mac(mac_addr in_mac) {
+    index_shard *shard = get_shard(in_mac.GetAsLong());
+
+    local_locker lock(&(shard->mutex));
+
+    return shard->mac_map.find(in_mac.GetAsLong() & 0xFFFFFFFFFFFFULL) != NULL;
+}
+
+shared_ptr<kis_tracked_device_base> 
+    DevicetrackerIndex::insert(shared_ptr<kis_tracked_device_base> in_device) {
+
+    uint64_t key = in_device->get_key();
+    index_shard *shard = get_shard(DevicetrackerKey::GetDevice(key));
+
+    local_locker lock(&(shard->mutex));
+
+    auto r = shard->key_map.insert(key, in_device);
+
+    if (!r.second)
+        return *(r.first);
+
+    shard->mac_map[DevicetrackerKey::GetDevice(key)].push_back(in_device);
+
+    num_devices++;
+
+    return in_device;
+}
+
+void DevicetrackerIndex::erase(shared_ptr<kis_tracked_device_base> in_device) {
+    uint64_t key = in_device->get_key();
+    index_shard *shard = get_shard(DevicetrackerKey::GetDevice(key));
+
+    local_locker lock(&(shard->mutex));
+
+    if (!shard->key_map.erase(key))
+        return;
+
+    vector<shared_ptr<kis_tracked_device_base> > *v =
+        shard->mac_map.find(DevicetrackerKey::GetDevice(key));
+
+    if (v != NULL) {
+        for (auto vi = v->begin(); vi != v->end(); ++vi) {
+            if ((*vi)->get_key() == key) {
+                v->erase(vi);
+                break;
+            }
+        }
+
+        if (v->size() == 0)
+            shard->mac_map.erase(DevicetrackerKey::GetDevice(key));
+    }
+
+    num_devices--;
+}
+
+void DevicetrackerIndex::clear() {
+    for (unsigned int s = 0; s < num_shards; s++) {
+        local_locker lock(&(shards[s].mutex));
+        shards[s].key_map.clear();
+        shards[s].mac_map.clear();
+    }
+
+    num_devices = 0;
+}
+
+void DevicetrackerTermIndex::add(uint64_t in_key, const string& in_term) {
+    vector<string> *terms = device_terms.find(in_key);
+
+    if (terms != NULL) {
+        if (std::find(terms->begin(), terms->end(), in_term) != terms->end())
+            return;
+
+        terms->push_back(in_term);
+    } else {
+        device_terms.insert(in_key, vector<string>(1, in_term));
+    }
+
+    term_map[in_term].insert(in_key);
+}
+
+void DevicetrackerTermIndex::set(uint64_t in_key, const string& in_term) {
+    vector<string> *terms = device_terms.find(in_key);
+
+    if (terms != NULL && terms->size() == 1 && (*terms)[0] == in_term)
+        return;
+
+    erase(in_key);
+
+    if (in_term.length() != 0)
+        add(in_key, in_term);
+}
+
+void DevicetrackerTermIndex::erase(uint64_t in_key) {
+    vector<string> *terms = device_terms.find(in_key);
+
+    if (terms == NULL)
+        return;
+
+    for (auto t : *terms) {
+        auto ti = term_map.find(t);
+
+        if (ti == term_map.end())
+            continue;
+
+        ti->second.erase(in_key);
+
+        if (ti->second.size() == 0)
+            term_map.erase(ti);
+    }
+
+    device_terms.erase(in_key);
+}
+
+void DevicetrackerTermIndex::clear() {
+    term_map.clear();
+    device_terms.clear();
+}
+
+vector<uint64_t> DevicetrackerTermIndex::find(const string& in_term) {
+    vector<uint64_t> ret;
+
+    auto ti = term_map.find(in_term);
+
+    if (ti == term_map.end())
+        return ret;
+
+    ret.insert(ret.end(), ti->second.begin(), ti->second.end());
+
+    return ret;
+}
+
+DevicetrackerGridIndex::DevicetrackerGridIndex(double in_cell_deg) {
+    cell_deg = in_cell_deg;
+
+    num_lat_cells = (uint32_t) ceil(180.0 / cell_deg) + 1;
+    num_lon_cells = (uint32_t) ceil(360.0 / cell_deg);
+}
+
+uint32_t DevicetrackerGridIndex::lat_cell(double in_lat) {
+    if (in_lat < -90)
+        in_lat = -90;
+    else if (in_lat > 90)
+        in_lat = 90;
+
+    uint32_t c = (uint32_t) floor((in_lat + 90) / cell_deg);
+
+    if (c >= num_lat_cells)
+        c = num_lat_cells - 1;
+
+    return c;
+}
+
+uint32_t DevicetrackerGridIndex::lon_cell(double in_lon) {
+    in_lon = fmod(in_lon + 180, 360);
+
+    if (in_lon < 0)
+        in_lon += 360;
+
+    uint32_t c = (uint32_t) floor(in_lon / cell_deg);
+
+    if (c >= num_lon_cells)
+        c = num_lon_cells - 1;
+
+    return c;
+}
+
+void DevicetrackerGridIndex::add(uint64_t in_key, double in_lat, double in_lon) {
+    uint64_t cell = ((uint64_t) lat_cell(in_lat) << 32) | lon_cell(in_lon);
+
+    vector<uint64_t> *cells = device_cells.find(in_key);
+
+    if (cells == NULL) {
+        device_cells.insert(in_key, vector<uint64_t>(1, cell));
+        cell_map[cell].insert(in_key);
+        return;
+    }
+
+    // Most packets come from the cell the device was last seen in
+    if (cells->size() != 0 && cells->back() == cell)
+        return;
+
+    // Keep the cells in the order they were last seen in, so the oldest are
+    // the ones dropped
+    auto ci = std::find(cells->begin(), cells->end(), cell);
+
+    if (ci != cells->end()) {
+        cells->erase(ci);
+        cells->push_back(cell);
+        return;
+    }
+
+    cells->push_back(cell);
+    cell_map[cell].insert(in_key);
+
+    if (cells->size() > DEVICE_GRID_MAX_CELLS) {
+        auto oi = cell_map.find(cells->front());
+
+        if (oi != cell_map.end()) {
+            oi->second.erase(in_key);
+
+            if (oi->second.size() == 0)
+                cell_map.erase(oi);
+        }
+
+        cells->erase(cells->begin());
+    }
+}
+
+void DevicetrackerGridIndex::erase(uint64_t in_key) {
+    vector<uint64_t> *cells = device_cells.find(in_key);
+
+    if (cells == NULL)
+        return;
+
+    for (auto c : *cells) {
+        auto ci = cell_map.find(c);
+
+        if (ci == cell_map.end())
+            continue;
+
+        ci->second.erase(in_key);
+
+        if (ci->second.size() == 0)
+            cell_map.erase(ci);
+    }
+
+    device_cells.erase(in_key);
+}
+
+void DevicetrackerGridIndex::clear() {
+    cell_map.clear();
+    device_cells.clear();
+}
+
+vector<uint64_t> DevicetrackerGridIndex::find(double in_min_lat, double in_min_lon,
+        double in_max_lat, double in_max_lon) {
+    vector<uint64_t> ret;
+
+    if (in_min_lat > in_max_lat)
+        std::swap(in_min_lat, in_max_lat);
+
+    uint32_t min_lat_c = lat_cell(in_min_lat);
+    uint32_t max_lat_c = lat_cell(in_max_lat);
+
+    // A box at least a full turn wide covers every longitude
+    uint32_t min_lon_c, max_lon_c;
+
+    if (in_max_lon - in_min_lon >= 360) {
+        min_lon_c = 0;
+        max_lon_c = num_lon_cells - 1;
+    } else {
+        min_lon_c = lon_cell(in_min_lon);
+        max_lon_c = lon_cell(in_max_lon);
+    }
+
+    // Boxes crossing the antimeridian wrap from the last longitude cell to
+    // the first
+    bool wrap = min_lon_c > max_lon_c;
+
+    uint64_t num_lon = wrap ? (num_lon_cells - min_lon_c) + max_lon_c + 1 :
+        max_lon_c - min_lon_c + 1;
+    uint64_t num_cells = (uint64_t) (max_lat_c - min_lat_c + 1) * num_lon;
+
+    std::unordered_set<uint64_t> keys;
+
+    if (num_cells > cell_map.size()) {
+        // Large boxes hold more cells than have devices in them; check each
+        // occupied cell instead
+        for (auto ci : cell_map) {
+            uint32_t la = (uint32_t) (ci.first >> 32);
+            uint32_t lo = (uint32_t) (ci.first & 0xFFFFFFFF);
+
+            if (la < min_lat_c || la > max_lat_c)
+                continue;
+
+            if (wrap) {
+                if (lo < min_lon_c && lo > max_lon_c)
+                    continue;
+            } else if (lo < min_lon_c || lo > max_lon_c) {
+                continue;
+            }
+
+            keys.insert(ci.second.begin(), ci.second.end());
+        }
+    } else {
+        for (uint32_t la = min_lat_c; la <= max_lat_c; la++) {
+            for (uint64_t n = 0; n < num_lon; n++) {
+                uint32_t lo = (uint32_t) ((min_lon_c + n) % num_lon_cells);
+
+                auto ci = cell_map.find(((uint64_t) la << 32) | lo);
+
+                if (ci != cell_map.end())
+                    keys.insert(ci->second.begin(), ci->second.end());
+            }
+        }
+    }
+
+    ret.insert(ret.end(), keys.begin(), keys.end());
+
+    return ret;
+}
+
+// Grid cell size for the location index, in degrees
+static double FetchLocationGrid(GlobalRegistry *globalreg) {
+    double deg = 0.01;
+    string opt = globalreg->kismet_config->FetchOpt("tracker_location_grid");
+
+    if (opt.length() != 0) {
+        if (sscanf(opt.c_str(), "%lf", &deg) != 1 || deg < 0.0001 || deg > 10) {
+            _MSG("Invalid tracker_location_grid, expected a cell size between "
+                    "0.0001 and 10 degrees; using 0.01", MSGFLAG_ERROR);
+            deg = 0.01;
+        }
+    }
+
+    return deg;
+}
+
 Devicetracker::Devicetracker(GlobalRegistry *in_globalreg) :
-    Kis_Net_Httpd_Chain_Stream_Handler(in_globalreg) {
+    Kis_Net_Httpd_Chain_Stream_Handler(in_globalreg),
+    tracked_index(in_globalreg->kismet_config->FetchOptUInt("tracker_device_shards", 16)),
+    view_last_time([](shared_ptr<kis_tracked_device_base> d) -> int64_t {
+            return d->get_last_time();
+        }),
+    view_signal([](shared_ptr<kis_tracked_device_base> d) -> int64_t {
+            // Devices with no signal sort below any real signal
+            shared_ptr<kis_tracked_signal_data> sig =
+                static_pointer_cast<kis_tracked_signal_data>(d->get_tracker_signal_data());
+
+            if (sig == NULL)
+                return INT64_MIN;
+
+            int dbm = sig->get_last_signal_dbm();
+
+            if (dbm == 0)
+                return INT64_MIN;
+
+            return dbm;
+        }),
+    view_packets([](shared_ptr<kis_tracked_device_base> d) -> int64_t {
+            return d->get_packets();
+        }),
+    view_manuf([](shared_ptr<kis_tracked_device_base> d) -> string {
+            return d->get_manuf();
+        }),
+    view_channel([](shared_ptr<kis_tracked_device_base> d) -> std::pair<int64_t, string> {
+            // Numbered channels sort by number, then by name for HT40+ etc
+            string c = d->get_channel();
+            return std::make_pair((int64_t) strtol(c.c_str(), NULL, 10), c);
+        }),
+    location_index(FetchLocationGrid(in_globalreg)) {
 
     // Initialize as recursive to allow multiple locks in a single thread
     pthread_mutexattr_t mutexattr;
@@ -65,12 +574,22 @@ Devicetracker::Devicetracker(GlobalRegistry *in_globalreg) :
     pthread_mutexattr_settype(&mutexattr, PTHREAD_MUTEX_RECURSIVE);
 	pthread_mutex_init(&devicelist_mutex, &mutexattr);
 
+    LockProfiler::NameMutex(&devicelist_mutex, "devicelist_mutex");
+
 	globalreg = in_globalreg;
 
+    device_snapshot_epoch = 0;
+    device_epoch = 1;
+
     // create a vector
     SharedTrackerElement itve(new TrackerElement(TrackerVector));
     immutable_tracked_vec = TrackerElementVector(itve);
 
+    Httpd_RegisterRoute("GET", "/devices/*");
+    Httpd_RegisterRoute("POST", "/devices/*");
+    Httpd_RegisterRoute("GET", "/phy/all_phys");
+    Httpd_RegisterRoute("GET", "/phy/all_phys_dt");
+
     // Create the pcap httpd
     httpd_pcap.reset(new Devicetracker_Httpd_Pcap(globalreg));
 
@@ -115,13 +634,53 @@ Devicetracker::Devicetracker(GlobalRegistry *in_globalreg) :
         entrytracker->RegisterField("kismet.datatables.draw", TrackerUInt64,
                 "Datatable records draw ID");
 
+    device_view_total_id =
+        entrytracker->RegisterField("kismet.devicelist.view.total", TrackerUInt64,
+                "devices in view");
+    device_view_filtered_id =
+        entrytracker->RegisterField("kismet.devicelist.view.filtered", TrackerUInt64,
+                "devices in view matching filter");
+    device_view_offset_id =
+        entrytracker->RegisterField("kismet.devicelist.view.offset", TrackerUInt64,
+                "offset of first device in window");
+
+    // Basic types and encryption are common to every phy; bits follow the
+    // KIS_DEVICE_BASICTYPE and KIS_DEVICE_BASICCRYPT values
+    flag_index.register_flags({ "ap", "client", "wired", "peer" },
+            [](shared_ptr<kis_tracked_device_base> d) -> uint64_t {
+                return d->get_basic_type_set();
+            });
+    flag_index.register_flags({ "crypt.encrypted", "crypt.l2", "crypt.l3", 
+            "crypt.weakcrypt", "crypt.decrypted" },
+            [](shared_ptr<kis_tracked_device_base> d) -> uint64_t {
+                return d->get_basic_crypt_set() >> 1;
+            });
+
     packets_rrd.reset(new kis_tracked_rrd<>(globalreg, 0));
     packets_rrd_id =
         globalreg->entrytracker->RegisterField("kismet.device.packets_rrd",
                 packets_rrd, "RRD of total packets seen");
 
-	num_packets = num_datapackets = num_errorpackets =
-		num_filterpackets = 0;
+    for (unsigned int p = 0; p < KIS_PHY_COUNTED_MAX + 1; p++) {
+        phy_counts[p].devices = 0;
+        phy_counts[p].packets = 0;
+        phy_counts[p].datapackets = 0;
+        phy_counts[p].cryptpackets = 0;
+        phy_counts[p].errorpackets = 0;
+        phy_counts[p].filterpackets = 0;
+    }
+
+    RegisterPhyMetrics(-1, "unknown");
+
+    shared_ptr<KisMetrics> metrics =
+        globalreg->FetchGlobalAs<KisMetrics>("METRICS");
+
+    if (metrics != NULL) {
+        metrics->register_gauge("kismet_devices", "devices tracked", "",
+                [this]() -> double {
+                    return tracked_index.size();
+                });
+    }
 
 	conf_save = 0;
 	next_phy_id = 0;
@@ -149,9 +708,12 @@ Devicetracker::Devicetracker(GlobalRegistry *in_globalreg) :
 	pack_comp_datasrc = 
 		globalreg->packetchain->RegisterPacketComponent("KISDATASRC");
 
+	pack_comp_dedup =
+		globalreg->packetchain->RegisterPacketComponent("DEDUP");
+
 	// Common tracker, very early in the tracker chain
 	globalreg->packetchain->RegisterHandler(&Devicetracker_packethook_commontracker,
-											this, CHAINPOS_TRACKER, -100);
+											this, CHAINPOS_TRACKER, -100, "devicetracker");
 
 	// Create the global kistxt and kisxml logfiles
 	// new Dumpfile_Devicetracker(globalreg, "kistxt", "text");
@@ -187,6 +749,8 @@ Devicetracker::Devicetracker(GlobalRegistry *in_globalreg) :
 	max_num_devices =
 		globalreg->kismet_config->FetchOptUInt("tracker_max_devices", 0);
 
+    shed_history = false;
+
 	if (max_num_devices > 0) {
 		stringstream ss;
 		ss << "Limiting maximum number of devices to " << max_num_devices <<
@@ -202,14 +766,228 @@ Devicetracker::Devicetracker(GlobalRegistry *in_globalreg) :
 	}
 
     full_refresh_time = globalreg->timestamp.tv_sec;
+
+    // Summaries are written straight from the devices by the direct JSON
+    // writer, so they follow its setting
+    summary_plan_enabled =
+        globalreg->kismet_config->FetchOptBoolean("json_direct_writer", 1);
+
+    serial_cache_enabled =
+        globalreg->kismet_config->FetchOptBoolean("tracker_serial_cache", 1);
+    serial_cache_ts = 0;
+
+    num_match_threads =
+        globalreg->kismet_config->FetchOptUInt("tracker_match_threads", 0);
+
+    match_pool = globalreg->FetchGlobalAs<KisTaskPool>("TASKPOOL");
+
+    if (num_match_threads > 1 && 
+            (match_pool == NULL || match_pool->get_num_workers() == 0)) {
+        _MSG("Device searches can only run in parallel with the task pool "
+                "enabled (taskpool_threads), ignoring tracker_match_threads", 
+                MSGFLAG_ERROR);
+        num_match_threads = 0;
+    } else if (num_match_threads > 1) {
+        stringstream ss;
+        ss << "Splitting device searches into " << num_match_threads << 
+            " parallel tasks";
+        _MSG(ss.str(), MSGFLAG_INFO);
+    }
+
+    snapshot_pending = false;
+    snapshot_map = NULL;
+    snapshot_map_len = 0;
+    snapshot_records = NULL;
+    snapshot_keys = NULL;
+    snapshot_num_records = 0;
+    snapshot_restore_pos = 0;
+    snapshot_num_restored = 0;
+    snapshot_phys_resolved = false;
+    snapshot_timer = -1;
+    snapshot_restore_timer = -1;
+    snapshot_timestamp = 0;
+
+    journal_enabled = false;
+    journal_timer = -1;
+    journal_last_ts = globalreg->timestamp.tv_sec;
+    journal_new_run = true;
+    journal_replaying = false;
+    journal_replay_pending = false;
+    journal_file = NULL;
+    journal_stop = false;
+    journal_failed = false;
+
+    coalesce_enabled =
+        globalreg->kismet_config->FetchOptBoolean("tracker_coalesce_updates", false);
+    coalesce_timer = -1;
+
+    if (coalesce_enabled) {
+        unsigned int interval =
+            globalreg->kismet_config->FetchOptUInt("tracker_coalesce_interval", 250);
+
+        // Timers run in slices of a second
+        unsigned int slices = interval * SERVER_TIMESLICES_SEC / 1000;
+
+        if (slices == 0)
+            slices = 1;
+
+        stringstream ss;
+        ss << "Coalescing updates to existing devices every " << 
+            (slices * 1000 / SERVER_TIMESLICES_SEC) << "ms";
+        _MSG(ss.str(), MSGFLAG_INFO);
+
+        coalesce_timer =
+            globalreg->timetracker->RegisterTimer(slices, NULL, 1, this);
+    }
+
+    unsigned int events_interval =
+        globalreg->kismet_config->FetchOptUInt("tracker_events_interval", 250);
+    unsigned int events_slices = events_interval * SERVER_TIMESLICES_SEC / 1000;
+
+    if (events_slices == 0)
+        events_slices = 1;
+
+    device_events.set_capacity(
+            globalreg->kismet_config->FetchOptUInt("tracker_events_backlog", 65536));
+    device_events_timer =
+        globalreg->timetracker->RegisterTimer(events_slices, NULL, 1, this);
+
+    cold_map = NULL;
+    cold_map_len = 0;
+    cold_end = 0;
+    cold_used = 0;
+    cold_count = 0;
+    cold_freezing = false;
+    cold_timer = -1;
+
+    cold_idle =
+        globalreg->kismet_config->FetchOptUInt("tracker_cold_idle", 0);
+    cold_enabled = cold_idle != 0;
+
+    if (cold_enabled) {
+        string cold_opt = globalreg->kismet_config->FetchOpt("tracker_cold_path");
+
+        if (cold_opt == "")
+            cold_opt = globalreg->kismet_config->FetchOpt("configdir") + "/" + 
+                "devices.cold";
+
+        cold_path = tag_conf->ExpandLogPath(cold_opt, "", "", 0, 1);
+
+        OpenColdStore();
+
+        // Checked every minute, the same as the device timeout
+        if (cold_enabled)
+            cold_timer =
+                globalreg->timetracker->RegisterPoolTimer(SERVER_TIMESLICES_SEC * 60, 
+                        1, task_lane_background,
+                        [this](int) -> int {
+                            // Pending updates hold the device they're for
+                            if (coalesce_enabled)
+                                FlushCoalescedUpdates();
+                            FreezeIdleDevices();
+                            return 1;
+                        });
+    }
+
+    snapshot_enabled =
+        globalreg->kismet_config->FetchOptBoolean("tracker_snapshot", false);
+    snapshot_restore_rate =
+        globalreg->kismet_config->FetchOptUInt("tracker_snapshot_restore_rate", 10000);
+
+    if (snapshot_enabled) {
+        snapshot_path =
+            tag_conf->ExpandLogPath(globalreg->kismet_config->FetchOpt("configdir") +
+                    "/" + "devices.snapshot", "", "", 0, 1);
+
+        OpenSnapshot();
+
+        journal_enabled =
+            globalreg->kismet_config->FetchOptBoolean("tracker_snapshot_journal", false);
+
+        if (journal_enabled) {
+            journal_path = snapshot_path + ".journal";
+
+            OpenJournal();
+
+            unsigned int journal_interval =
+                globalreg->kismet_config->FetchOptUInt("tracker_snapshot_journal_interval", 1);
+
+            if (journal_interval == 0)
+                journal_interval = 1;
+
+            if (journal_enabled)
+                journal_timer =
+                    globalreg->timetracker->RegisterTimer(
+                            SERVER_TIMESLICES_SEC * journal_interval, NULL, 1, this);
+        }
+
+        unsigned int interval =
+            globalreg->kismet_config->FetchOptUInt("tracker_snapshot_interval", 300);
+
+        if (interval > 0)
+            snapshot_timer =
+                globalreg->timetracker->RegisterPoolTimer(SERVER_TIMESLICES_SEC * interval,
+                        1, task_lane_background,
+                        [this](int) -> int {
+                            if (coalesce_enabled)
+                                FlushCoalescedUpdates();
+                            SaveSnapshot();
+                            return 1;
+                        });
+
+        if (snapshot_pending && snapshot_restore_rate > 0)
+            snapshot_restore_timer =
+                globalreg->timetracker->RegisterTimer(SERVER_TIMESLICES_SEC, 
+                        NULL, 1, this);
+    }
 }
 
 Devicetracker::~Devicetracker() {
+    // Timers on the task pool are waited for if they're running, and they take
+    // the device list, so they have to go before we hold it
+    globalreg->timetracker->RemoveTimer(snapshot_timer);
+    globalreg->timetracker->RemoveTimer(cold_timer);
+
+    // Phy workers lock the device list themselves, so they have to finish
+    // before we hold it
+    for (map<int, Kis_Phy_Handler *>::iterator p = phy_handler_map.begin();
+            p != phy_handler_map.end(); ++p) {
+        p->second->Shutdown();
+    }
+
     pthread_mutex_lock(&devicelist_mutex);
 
+    globalreg->timetracker->RemoveTimer(snapshot_restore_timer);
+    globalreg->timetracker->RemoveTimer(journal_timer);
+    globalreg->timetracker->RemoveTimer(coalesce_timer);
+    globalreg->timetracker->RemoveTimer(device_events_timer);
+
+    if (coalesce_enabled)
+        FlushCoalescedUpdates();
+
+    if (snapshot_enabled)
+        SaveSnapshot();
+
+    // Saving the snapshot left the journal empty; if it failed, whatever the
+    // journal holds is still good
+    if (journal_enabled) {
+        QueueJournal();
+        StopJournal();
+    }
+
+    CloseSnapshot();
+    CloseColdStore();
+
     globalreg->devicetracker = NULL;
     globalreg->RemoveGlobal("DEVICE_TRACKER");
 
+    shared_ptr<KisMetrics> metrics =
+        globalreg->FetchGlobalAs<KisMetrics>("METRICS");
+
+    if (metrics != NULL) {
+        metrics->remove_metric("kismet_devices");
+    }
+
 	globalreg->packetchain->RemoveHandler(&Devicetracker_packethook_commontracker,
 										  CHAINPOS_TRACKER);
 
@@ -229,8 +1007,26 @@ Devicetracker::~Devicetracker() {
 
     tracked_vec.clear();
     immutable_tracked_vec.clear();
-    tracked_mac_multimap.clear();
-
+    tracked_index.clear();
+    modified_list.clear();
+    modified_pos.clear();
+    modified_buckets.clear();
+    serial_cache.clear();
+    coalesce_buffers.clear();
+
+    view_last_time.clear();
+    view_signal.clear();
+    view_packets.clear();
+    view_manuf.clear();
+    view_channel.clear();
+
+    ssid_index.clear();
+    oui_index.clear();
+    channel_index.clear();
+    location_index.clear();
+    flag_index.clear();
+
+    LockProfiler::ForgetMutex(&devicelist_mutex);
     pthread_mutex_destroy(&devicelist_mutex);
 }
 
@@ -249,12 +1045,8 @@ void Devicetracker::SaveTags() {
 			 MSGFLAG_ERROR);
 	}
 
-	ret = tag_conf->SaveConfig(tag_conf->ExpandLogPath(globalreg->kismet_config->FetchOpt("configdir") + "/" + "tag.conf", "", "", 0, 1).c_str());
-
-	if (ret < 0)
-		_MSG("Could not save tags, check previous error messages (probably "
-			 "no permission to write to the Kismet config directory: " + dir,
-			 MSGFLAG_ERROR);
+    // Written out by the background config writer
+	tag_conf->SaveConfigAsync(tag_conf->ExpandLogPath(globalreg->kismet_config->FetchOpt("configdir") + "/" + "tag.conf", "", "", 0, 1));
 }
 
 Kis_Phy_Handler *Devicetracker::FetchPhyHandler(int in_phy) {
@@ -294,76 +1086,57 @@ string Devicetracker::FetchPhyName(int in_phy) {
 }
 
 int Devicetracker::FetchNumDevices(int in_phy) {
-    local_locker lock(&devicelist_mutex);
-
-	int r = 0;
+    phy_count_set *c = fetch_phy_counts(in_phy);
 
-	if (in_phy == KIS_PHY_ANY)
-		return tracked_map.size();
-
-	for (unsigned int x = 0; x < tracked_vec.size(); x++) {
-		if (DevicetrackerKey::GetPhy(tracked_vec[x]->get_key()) == in_phy)
-			r++;
-	}
+    if (c == NULL)
+        return 0;
 
-	return r;
+    return (int) c->devices.load(std::memory_order_relaxed);
 }
 
 int Devicetracker::FetchNumPackets(int in_phy) {
-	if (in_phy == KIS_PHY_ANY)
-		return num_packets;
+    phy_count_set *c = fetch_phy_counts(in_phy);
 
-	map<int, int>::iterator i = phy_packets.find(in_phy);
-	if (i != phy_packets.end())
-		return i->second;
+    if (c == NULL)
+        return 0;
 
-	return 0;
+    return (int) c->packets.load(std::memory_order_relaxed);
 }
 
 int Devicetracker::FetchNumDatapackets(int in_phy) {
-	if (in_phy == KIS_PHY_ANY)
-		return num_datapackets;
+    phy_count_set *c = fetch_phy_counts(in_phy);
 
-	map<int, int>::iterator i = phy_datapackets.find(in_phy);
-	if (i != phy_datapackets.end())
-		return i->second;
+    if (c == NULL)
+        return 0;
 
-	return 0;
+    return (int) c->datapackets.load(std::memory_order_relaxed);
 }
 
 int Devicetracker::FetchNumCryptpackets(int in_phy) {
-	int r = 0;
+    phy_count_set *c = fetch_phy_counts(in_phy);
 
-	for (unsigned int x = 0; x < tracked_vec.size(); x++) {
-        int phytype = DevicetrackerKey::GetPhy(tracked_vec[x]->get_key());
-		if (phytype == in_phy || in_phy == KIS_PHY_ANY) {
-            r += tracked_vec[x]->get_crypt_packets();
-		}
-	}
+    if (c == NULL)
+        return 0;
 
-	return 0;
+    return (int) c->cryptpackets.load(std::memory_order_relaxed);
 }
 
 int Devicetracker::FetchNumErrorpackets(int in_phy) {
-	if (in_phy == KIS_PHY_ANY)
-		return num_errorpackets;
+    phy_count_set *c = fetch_phy_counts(in_phy);
 
-	map<int, int>::iterator i = phy_errorpackets.find(in_phy);
-	if (i != phy_errorpackets.end())
-		return i->second;
+    if (c == NULL)
+        return 0;
 
-	return 0;
+    return (int) c->errorpackets.load(std::memory_order_relaxed);
 }
 
 int Devicetracker::FetchNumFilterpackets(int in_phy) {
-	if (in_phy == KIS_PHY_ANY)
-		return num_filterpackets;
+    phy_count_set *c = fetch_phy_counts(in_phy);
 
-	map<int, int>::iterator i = phy_filterpackets.find(in_phy);
-	if (i != phy_errorpackets.end())
-		return i->second;
+    if (c == NULL)
+        return 0;
 
-	return 0;
+    return (int) c->filterpackets.load(std::memory_order_relaxed);
 }
 
 int Devicetracker::RegisterPhyHandler(Kis_Phy_Handler *in_weak_handler) {
@@ -374,10 +1147,7 @@ int Devicetracker::RegisterPhyHandler(Kis_Phy_Handler *in_weak_handler) {
 
 	phy_handler_map[num] = strongphy;
 
-	phy_packets[num] = 0;
-	phy_datapackets[num] = 0;
-	phy_errorpackets[num] = 0;
-	phy_filterpackets[num] = 0;
+    RegisterPhyMetrics(num, strongphy->FetchPhyName());
 
 	_MSG("Registered PHY handler '" + strongphy->FetchPhyName() + "' as ID " +
 		 IntToString(num), MSGFLAG_INFO);
@@ -385,19 +1155,54 @@ int Devicetracker::RegisterPhyHandler(Kis_Phy_Handler *in_weak_handler) {
 	return num;
 }
 
+void Devicetracker::RegisterPhyMetrics(int in_phy, string in_phyname) {
+    phy_metric_set m;
+
+    shared_ptr<KisMetrics> metrics =
+        globalreg->FetchGlobalAs<KisMetrics>("METRICS");
+
+    if (metrics == NULL) {
+        m.packets.reset(new kis_metric_counter());
+        m.data.reset(new kis_metric_counter());
+        m.error.reset(new kis_metric_counter());
+        m.filtered.reset(new kis_metric_counter());
+    } else {
+        string labels = "phy=" + KisMetrics::label_escape(in_phyname);
+
+        m.packets =
+            metrics->register_counter("kismet_tracker_packets",
+                    "packets seen by the device tracker", labels);
+        m.data =
+            metrics->register_counter("kismet_tracker_data_packets",
+                    "data packets seen by the device tracker", labels);
+        m.error =
+            metrics->register_counter("kismet_tracker_error_packets",
+                    "packets the device tracker could not process", labels);
+        m.filtered =
+            metrics->register_counter("kismet_tracker_filtered_packets",
+                    "packets excluded by the tracker filters", labels);
+    }
+
+    phy_metrics[in_phy] = m;
+}
+
 void Devicetracker::UpdateFullRefresh() {
     full_refresh_time = globalreg->timestamp.tv_sec;
 }
 
 shared_ptr<kis_tracked_device_base> Devicetracker::FetchDevice(uint64_t in_key) {
-    local_locker lock(&devicelist_mutex);
+    // The index does its own locking
+    shared_ptr<kis_tracked_device_base> device = tracked_index.find(in_key);
 
-	device_itr i = tracked_map.find(in_key);
+    // Devices from the last run are restored the first time they're asked for
+    if (device == NULL && snapshot_pending)
+        device = RestoreSnapshotDevice(in_key);
 
-	if (i != tracked_map.end())
-		return i->second;
+    // Idle devices are thawed the same way
+    if (device == NULL && cold_count != 0)
+        device = ThawColdDevice(in_key);
 
-	return NULL;
+    return device;
 }
 
 shared_ptr<kis_tracked_device_base> Devicetracker::FetchDevice(mac_addr in_device,
@@ -410,57 +1215,73 @@ int Devicetracker::CommonTracker(kis_packet *in_pack) {
 
 	if (in_pack->error) {
 		// and bail
-		num_errorpackets++;
+        inc_phy_count(KIS_PHY_UNKNOWN, &phy_count_set::errorpackets);
+        phy_metrics[-1].error->inc();
 		return 0;
 	}
 
 	kis_common_info *pack_common =
 		(kis_common_info *) in_pack->fetch(pack_comp_common);
 
-    packets_rrd->add_sample(1, globalreg->timestamp.tv_sec);
-
-	num_packets++;
+    packets_rrd->add_sample(in_pack->sample_weight, globalreg->timestamp.tv_sec);
 
 	// If we can't figure it out at all (no common layer) just bail
-	if (pack_common == NULL)
+	if (pack_common == NULL) {
+        inc_phy_count(KIS_PHY_UNKNOWN, &phy_count_set::packets, in_pack->sample_weight);
+        phy_metrics[-1].packets->inc();
 		return 0;
+    }
 
 	if (pack_common->error) {
 		// If we couldn't get any common data consider it an error
 		// and bail
-		num_errorpackets++;
-
 		if (phy_handler_map.find(pack_common->phyid) != phy_handler_map.end()) {
-			phy_errorpackets[pack_common->phyid]++;
-		}
+            inc_phy_count(pack_common->phyid, &phy_count_set::packets,
+                    in_pack->sample_weight);
+            inc_phy_count(pack_common->phyid, &phy_count_set::errorpackets);
+            phy_metrics[pack_common->phyid].packets->inc();
+            phy_metrics[pack_common->phyid].error->inc();
+		} else {
+            inc_phy_count(KIS_PHY_UNKNOWN, &phy_count_set::packets,
+                    in_pack->sample_weight);
+            inc_phy_count(KIS_PHY_UNKNOWN, &phy_count_set::errorpackets);
+            phy_metrics[-1].packets->inc();
+            phy_metrics[-1].error->inc();
+        }
 
 		return 0;
 	}
 
-	if (in_pack->filtered) {
-		num_filterpackets++;
-	}
-
 	// Make sure our PHY is sane
 	if (phy_handler_map.find(pack_common->phyid) == phy_handler_map.end()) {
+        inc_phy_count(KIS_PHY_UNKNOWN, &phy_count_set::packets, in_pack->sample_weight);
+
+        if (in_pack->filtered)
+            inc_phy_count(KIS_PHY_UNKNOWN, &phy_count_set::filterpackets);
+
 		_MSG("Invalid phy id " + IntToString(pack_common->phyid) + " in packet "
 			 "something is wrong.", MSGFLAG_ERROR);
 		return 0;
 	}
 
-	phy_packets[pack_common->phyid]++;
+    inc_phy_count(pack_common->phyid, &phy_count_set::packets, in_pack->sample_weight);
 
-	if (in_pack->error || pack_common->error) {
-		phy_errorpackets[pack_common->phyid]++;
-	}
+    phy_metric_set& pm = phy_metrics[pack_common->phyid];
+    pm.packets->inc(in_pack->sample_weight);
 
 	if (in_pack->filtered) {
-		phy_filterpackets[pack_common->phyid]++;
-		num_filterpackets++;
+        inc_phy_count(pack_common->phyid, &phy_count_set::filterpackets);
+        pm.filtered->inc();
 	} else {
 		if (pack_common->type == packet_basic_data) {
-			num_datapackets++;
-			phy_datapackets[pack_common->phyid]++;
+            inc_phy_count(pack_common->phyid, &phy_count_set::datapackets,
+                    in_pack->sample_weight);
+
+            if (pack_common->basic_crypt_set != 0)
+                inc_phy_count(pack_common->phyid, &phy_count_set::cryptpackets,
+                        in_pack->sample_weight);
+
+            pm.data->inc(in_pack->sample_weight);
 		}
 	}
 
@@ -496,6 +1317,18 @@ int Devicetracker::CommonTracker(kis_packet *in_pack) {
 shared_ptr<kis_tracked_device_base> Devicetracker::UpdateCommonDevice(mac_addr in_mac,
         int in_phy, kis_packet *in_pack, unsigned int in_flags) {
 
+    // Existing devices take the pending update of this thread instead of the lock
+    if (coalesce_enabled) {
+        shared_ptr<kis_tracked_device_base> device =
+            FetchDevice(DevicetrackerKey::MakeKey(in_mac, in_phy));
+
+        if (device != NULL && CoalesceCommonDevice(device, in_pack, in_flags)) {
+            device_events.report(device->get_key(), DEVICE_EVENT_UPDATED, in_flags,
+                    in_pack->ts.tv_sec);
+            return device;
+        }
+    }
+
     local_locker lock(&devicelist_mutex);
 
     stringstream sstr;
@@ -522,27 +1355,29 @@ shared_ptr<kis_tracked_device_base> Devicetracker::UpdateCommonDevice(mac_addr i
     key = DevicetrackerKey::MakeKey(in_mac, in_phy);
 
 	if ((device = FetchDevice(key)) == NULL) {
-        device.reset(new kis_tracked_device_base(globalreg, device_base_id));
-
-        // Device ID is the size of the vector so a new device always gets put
-        // in it's numbered slot
-        device->set_kis_internal_id(immutable_tracked_vec.size());
+        device = std::make_shared<kis_tracked_device_base>(globalreg, device_base_id);
 
         device->set_key(key);
         device->set_macaddr(in_mac);
         device->set_phyname(phy->FetchPhyName());
 
-        tracked_map[device->get_key()] = device;
-        tracked_vec.push_back(device);
-        immutable_tracked_vec.push_back(device);
-        tracked_mac_multimap.emplace(in_mac, device);
+        AddTrackedDevice(device);
 
         device->set_first_time(in_pack->ts.tv_sec);
 
         if (globalreg->manufdb != NULL)
             device->set_manuf(globalreg->manufdb->LookupOUI(device->get_macaddr()));
+
+        device_events.report(key, DEVICE_EVENT_CREATED, in_flags, in_pack->ts.tv_sec);
+    } else {
+        device_events.report(key, DEVICE_EVENT_UPDATED, in_flags, in_pack->ts.tv_sec);
     }
 
+    // Anything the phy handler changes in the device records below this, such as
+    // nested phy-specific records, doesn't pass through the device's own proxies;
+    // count the packet as a modification so cached serializations are redone
+    device->bump_mod_version();
+
     // Tag the packet with the base device
 	kis_tracked_device_info *devinfo =
 		(kis_tracked_device_info *) in_pack->fetch(pack_comp_device);
@@ -554,41 +1389,53 @@ shared_ptr<kis_tracked_device_base> Devicetracker::UpdateCommonDevice(mac_addr i
 	}
 
 
-    if (device->get_last_time() < in_pack->ts.tv_sec)
+    if (device->get_last_time() < in_pack->ts.tv_sec) {
         device->set_last_time(in_pack->ts.tv_sec);
+        UpdateModifiedList(device);
+    }
+
+    // A packet kept by overload sampling counts for the ones dropped with it
+    uint64_t weight = in_pack->sample_weight;
 
     if (in_flags & UCD_UPDATE_PACKETS) {
-        device->inc_packets();
+        device->inc_packets(weight);
 
-        device->get_packets_rrd()->add_sample(1, globalreg->timestamp.tv_sec);
+        device->get_packets_rrd()->add_sample(weight, globalreg->timestamp.tv_sec);
+
+        if (weight > 1)
+            device->inc_sampled_packets(weight - 1);
 
         if (pack_common != NULL) {
             if (pack_common->error)
-                device->inc_error_packets();
-
-            if (pack_common->type == packet_basic_data) {
-                // TODO fix directional data
-                device->inc_data_packets();
-                device->inc_datasize(pack_common->datasize);
-                device->get_data_rrd()->add_sample(pack_common->datasize,
-                        globalreg->timestamp.tv_sec);
+                device->inc_error_packets(weight);
 
-                if (pack_common->datasize <= 250)
-                    device->get_packet_rrd_bin_250()->add_sample(1, 
-                            globalreg->timestamp.tv_sec);
-                else if (pack_common->datasize <= 500)
-                    device->get_packet_rrd_bin_500()->add_sample(1, 
-                            globalreg->timestamp.tv_sec);
-                else if (pack_common->datasize <= 1000)
-                    device->get_packet_rrd_bin_1000()->add_sample(1, 
-                            globalreg->timestamp.tv_sec);
-                else if (pack_common->datasize <= 1500)
-                    device->get_packet_rrd_bin_1500()->add_sample(1, 
-                            globalreg->timestamp.tv_sec);
-                else 
-                    device->get_packet_rrd_bin_jumbo()->add_sample(1, 
+            if (pack_common->type == packet_basic_data) {
+                // TODO fix directional data
+                device->inc_data_packets(weight);
+                device->inc_datasize(pack_common->datasize * weight);
+
+                // The memory governor may be shedding everything but the totals
+                if (!shed_history) {
+                    device->get_data_rrd()->add_sample(pack_common->datasize * weight,
                             globalreg->timestamp.tv_sec);
 
+                    if (pack_common->datasize <= 250)
+                        device->get_packet_rrd_bin_250()->add_sample(weight, 
+                                globalreg->timestamp.tv_sec);
+                    else if (pack_common->datasize <= 500)
+                        device->get_packet_rrd_bin_500()->add_sample(weight, 
+                                globalreg->timestamp.tv_sec);
+                    else if (pack_common->datasize <= 1000)
+                        device->get_packet_rrd_bin_1000()->add_sample(weight, 
+                                globalreg->timestamp.tv_sec);
+                    else if (pack_common->datasize <= 1500)
+                        device->get_packet_rrd_bin_1500()->add_sample(weight, 
+                                globalreg->timestamp.tv_sec);
+                    else 
+                        device->get_packet_rrd_bin_jumbo()->add_sample(weight, 
+                                globalreg->timestamp.tv_sec);
+                }
+
             } else if (pack_common->type == packet_basic_mgmt ||
                     pack_common->type == packet_basic_phy) {
                 device->inc_llc_packets();
@@ -609,14 +1456,14 @@ shared_ptr<kis_tracked_device_base> Devicetracker::UpdateCommonDevice(mac_addr i
 
             delete(sc);
 
-            device->inc_frequency_count((int) pack_l1info->freq_khz);
+            device->inc_frequency_count((int) pack_l1info->freq_khz, weight);
         } else {
             if (!(pack_common->channel == "0"))
                 device->set_channel(pack_common->channel);
             if (pack_common->freq_khz != 0)
                 device->set_frequency(pack_common->freq_khz);
             
-            device->inc_frequency_count((int) pack_common->freq_khz);
+            device->inc_frequency_count((int) pack_common->freq_khz, weight);
         }
 	}
 
@@ -625,9 +1472,14 @@ shared_ptr<kis_tracked_device_base> Devicetracker::UpdateCommonDevice(mac_addr i
             device->set_channel(pack_common->channel);
     }
 
+    if (in_flags & UCD_UPDATE_FREQUENCIES)
+        channel_index.set(key, device->get_channel());
+
     if ((in_flags & UCD_UPDATE_LOCATION) && pack_gpsinfo != NULL) {
         device->get_location()->add_loc(pack_gpsinfo->lat, pack_gpsinfo->lon,
                 pack_gpsinfo->alt, pack_gpsinfo->fix);
+        IndexDeviceLocation(device, pack_gpsinfo->lat, pack_gpsinfo->lon,
+                pack_gpsinfo->fix);
     }
 
 	// Update seenby records for time, frequency, packets
@@ -637,12 +1489,50 @@ shared_ptr<kis_tracked_device_base> Devicetracker::UpdateCommonDevice(mac_addr i
         if (pack_l1info != NULL)
             f = pack_l1info->freq_khz;
 
-        device->inc_seenby_count(pack_datasrc->ref_source, in_pack->ts.tv_sec, f);
+        device->inc_seenby_count(pack_datasrc->ref_source, in_pack->ts.tv_sec, f,
+                weight);
+
+        // Remember the device so duplicates of this frame from other sources
+        // can be merged into it
+        kis_packet_dedup *pack_dedup =
+            (kis_packet_dedup *) in_pack->fetch(pack_comp_dedup);
+
+        if (pack_dedup != NULL && !pack_dedup->duplicate) {
+            vector<shared_ptr<kis_tracked_device_base> > &devs = 
+                pack_dedup->record->devices;
+
+            if (std::find(devs.begin(), devs.end(), device) == devs.end())
+                devs.push_back(device);
+        }
 	}
 
     return device;
 }
 
+void Devicetracker::MergeDuplicateSeenby(shared_ptr<kis_tracked_device_base> device,
+        KisDatasource *in_source, time_t in_ts, kis_layer1_packinfo *in_l1,
+        kis_gps_packinfo *in_gps) {
+    local_locker lock(&devicelist_mutex);
+
+    double f = -1;
+
+    if (in_l1 != NULL) {
+        f = in_l1->freq_khz;
+
+        Packinfo_Sig_Combo sc(in_l1, in_gps);
+        (*(device->get_signal_data())) += sc;
+    }
+
+    if (in_source != NULL)
+        device->inc_seenby_count(in_source, in_ts, f);
+
+    device->bump_mod_version();
+    UpdateModifiedList(device);
+
+    device_events.report(device->get_key(), DEVICE_EVENT_UPDATED,
+            UCD_UPDATE_SIGNAL | UCD_UPDATE_SEENBY, in_ts);
+}
+
 int Devicetracker::PopulateCommon(shared_ptr<kis_tracked_device_base> device, 
         kis_packet *in_pack) {
 
@@ -705,19 +1595,23 @@ int Devicetracker::PopulateCommon(shared_ptr<kis_tracked_device_base> device,
         // TODO fix directional data
         device->inc_data_packets();
         device->inc_datasize(pack_common->datasize);
-        device->get_data_rrd()->add_sample(pack_common->datasize,
-                globalreg->timestamp.tv_sec);
 
-        if (pack_common->datasize <= 250) {
-            device->get_packet_rrd_bin_250()->add_sample(1, globalreg->timestamp.tv_sec);
-        } else if (pack_common->datasize <= 500) {
-            device->get_packet_rrd_bin_500()->add_sample(1, globalreg->timestamp.tv_sec);
-        } else if (pack_common->datasize <= 1000) {
-            device->get_packet_rrd_bin_1000()->add_sample(1, globalreg->timestamp.tv_sec);
-        } else if (pack_common->datasize <= 1500) {
-            device->get_packet_rrd_bin_1500()->add_sample(1, globalreg->timestamp.tv_sec);
-        } else if (pack_common->datasize > 1500 ) {
-            device->get_packet_rrd_bin_jumbo()->add_sample(1, globalreg->timestamp.tv_sec);
+        // The memory governor may be shedding everything but the totals
+        if (!shed_history) {
+            device->get_data_rrd()->add_sample(pack_common->datasize,
+                    globalreg->timestamp.tv_sec);
+
+            if (pack_common->datasize <= 250) {
+                device->get_packet_rrd_bin_250()->add_sample(1, globalreg->timestamp.tv_sec);
+            } else if (pack_common->datasize <= 500) {
+                device->get_packet_rrd_bin_500()->add_sample(1, globalreg->timestamp.tv_sec);
+            } else if (pack_common->datasize <= 1000) {
+                device->get_packet_rrd_bin_1000()->add_sample(1, globalreg->timestamp.tv_sec);
+            } else if (pack_common->datasize <= 1500) {
+                device->get_packet_rrd_bin_1500()->add_sample(1, globalreg->timestamp.tv_sec);
+            } else if (pack_common->datasize > 1500 ) {
+                device->get_packet_rrd_bin_jumbo()->add_sample(1, globalreg->timestamp.tv_sec);
+            }
         }
 
     } else if (pack_common->type == packet_basic_mgmt ||
@@ -742,6 +1636,8 @@ int Devicetracker::PopulateCommon(shared_ptr<kis_tracked_device_base> device,
     if (pack_gpsinfo != NULL) {
         device->get_location()->add_loc(pack_gpsinfo->lat, pack_gpsinfo->lon,
                 pack_gpsinfo->alt, pack_gpsinfo->fix);
+        IndexDeviceLocation(device, pack_gpsinfo->lat, pack_gpsinfo->lon,
+                pack_gpsinfo->fix);
     }
 
     // Update seenby records for time, frequency, packets
@@ -759,6 +1655,8 @@ int Devicetracker::PopulateCommon(shared_ptr<kis_tracked_device_base> device,
     if (!(pack_common->channel == "0"))
         device->set_channel(pack_common->channel);
 
+    channel_index.set(device->get_key(), device->get_channel());
+
     return 1;
 }
 
@@ -830,9 +1728,108 @@ bool devicetracker_sort_internal_id(shared_ptr<kis_tracked_device_base> a,
 	return a->get_kis_internal_id() < b->get_kis_internal_id();
 }
 
+size_t Devicetracker::MatchChunkSize(size_t in_default, size_t in_last, 
+        uint64_t in_last_usec) {
+    if (Kis_Net_Httpd::CurrentRequestClass() != Kis_Net_Httpd::request_bulk ||
+            globalreg->httpd_server == NULL)
+        return in_default;
+
+    uint64_t slice = globalreg->httpd_server->FetchBulkSliceUsec();
+
+    if (slice == 0 || in_last_usec == 0)
+        return in_last;
+
+    size_t sz = (size_t) ((double) in_last * slice / in_last_usec);
+
+    if (sz < 1)
+        sz = 1;
+
+    if (sz > in_default)
+        sz = in_default;
+
+    return sz;
+}
+
+void Devicetracker::MatchOnDevicesParallel(DevicetrackerFilterWorker *worker,
+        TrackerElementVector vec) {
+
+    // Larger chunks than the serial match; each thread gets a contiguous
+    // slice of every chunk
+    size_t def_chunk_sz = 500 * num_match_threads;
+    size_t chunk_sz = def_chunk_sz;
+    size_t dpos = 0;
+
+    worker->PrepareSlots(num_match_threads);
+
+    while (dpos < vec.size()) {
+        uint64_t lock_start;
+
+        {
+            // Limited scope lock; the match tasks run under the lock we hold
+            // and don't take it themselves
+            local_locker lock(&devicelist_mutex);
+
+            lock_start = KisClock::MonoUsec();
+
+            size_t end = dpos + chunk_sz;
+            if (end > vec.size())
+                end = vec.size();
+
+            size_t slice_sz = ((end - dpos) / num_match_threads) + 1;
+
+            shared_ptr<kis_task_group> group = match_pool->new_group();
+
+            for (unsigned int t = 0; t < num_match_threads; t++) {
+                size_t sb = dpos + (slice_sz * t);
+                size_t se = sb + slice_sz;
+
+                if (sb >= end)
+                    break;
+
+                if (se > end)
+                    se = end;
+
+                match_pool->submit(task_lane_high, group, 
+                        [this, worker, &vec, sb, se, t]() {
+                            for (size_t i = sb; i < se; i++) {
+                                SharedTrackerElement val = vec[i];
+
+                                if (val == NULL)
+                                    continue;
+
+                                worker->MatchDeviceSlot(this, 
+                                        static_pointer_cast<kis_tracked_device_base>(val), t);
+                            }
+                        });
+            }
+
+            // Slices no worker has picked up yet are run here, so a pool busy
+            // with other tasks (or blocked on this lock) can't stall us
+            match_pool->wait(group);
+
+            dpos = end;
+        }
+
+        chunk_sz = MatchChunkSize(def_chunk_sz, chunk_sz, 
+                KisClock::MonoUsec() - lock_start);
+
+        worker->ChunkComplete(this);
+
+        // Let another thread grab the lock if it needs to
+        usleep(1000);
+    }
+
+    worker->Finalize(this);
+}
+
 void Devicetracker::MatchOnDevices(DevicetrackerFilterWorker *worker, 
         TrackerElementVector vec, bool batch) {
 
+    if (batch && num_match_threads > 1 && worker->IsThreadSafe()) {
+        MatchOnDevicesParallel(worker, vec);
+        return;
+    }
+
     // We chunk into blocks of 500 devices and perform the match in 
     // batches; this prevents a single query from running so long that
     // things fall down.  It is slightly less efficient on huge data sets,
@@ -856,6 +1853,7 @@ void Devicetracker::MatchOnDevices(DevicetrackerFilterWorker *worker,
     
     size_t dpos = 0;
     size_t chunk_sz = 50;
+    uint64_t lock_start;
 
     while (1) {
         {
@@ -863,6 +1861,8 @@ void Devicetracker::MatchOnDevices(DevicetrackerFilterWorker *worker,
             
             local_locker lock(&devicelist_mutex);
 
+            lock_start = KisClock::MonoUsec();
+
             auto b = vec.begin() + dpos;
             auto e = b + chunk_sz;
             bool last_loop = false;
@@ -889,6 +1889,8 @@ void Devicetracker::MatchOnDevices(DevicetrackerFilterWorker *worker,
             dpos += chunk_sz;
         }
 
+        chunk_sz = MatchChunkSize(50, chunk_sz, KisClock::MonoUsec() - lock_start);
+
         // We're now unlocked, do a tiny sleep to let another thread grab the lock
         // if it needs to
         usleep(1000);
@@ -902,54 +1904,514 @@ void Devicetracker::MatchOnDevices(DevicetrackerFilterWorker *worker, bool batch
     MatchOnDevices(worker, immutable_tracked_vec, batch);
 }
 
-// Simple std::sort comparison function to order by the least frequently
-// seen devices
-bool devicetracker_sort_lastseen(shared_ptr<kis_tracked_device_base> a,
-	shared_ptr<kis_tracked_device_base> b) {
+void Devicetracker::AddTrackedDevice(shared_ptr<kis_tracked_device_base> in_device) {
+    local_locker lock(&devicelist_mutex);
+
+    // Device ID is the size of the vector so a new device always gets put
+    // in it's numbered slot
+    in_device->set_kis_internal_id(immutable_tracked_vec.size());
+    in_device->set_tracked_vec_pos(tracked_vec.size());
+
+    tracked_index.insert(in_device);
+    tracked_vec.push_back(in_device);
+    immutable_tracked_vec.push_back(in_device);
+
+    inc_phy_count(DevicetrackerKey::GetPhy(in_device->get_key()), &phy_count_set::devices);
+
+    KIS_PROBE2(device__create, in_device->get_key(), in_device->get_kis_internal_id());
+
+    device_epoch++;
+
+    // Restored devices already know their channel
+    oui_index.add(in_device->get_key(), OuiTerm(in_device->get_macaddr()));
+    channel_index.set(in_device->get_key(), in_device->get_channel());
+
+    // Restored devices are filed under their average location
+    shared_ptr<kis_tracked_location> loc =
+        static_pointer_cast<kis_tracked_location>(in_device->get_tracker_location());
+
+    if (loc != NULL && loc->get_valid())
+        IndexDeviceLocation(in_device, loc->get_avg_loc()->get_lat(),
+                loc->get_avg_loc()->get_lon(), loc->get_fix());
+}
+
+void Devicetracker::RemoveTrackedDevice(shared_ptr<kis_tracked_device_base> in_device) {
+    local_locker lock(&devicelist_mutex);
+
+    device_epoch++;
+
+    if (journal_enabled && !journal_replaying && !cold_freezing)
+        journal_expired.push_back(in_device->get_key());
+
+    // Devices replayed from the journal were never announced
+    if (!journal_replaying && !cold_freezing)
+        device_events.report(in_device->get_key(), DEVICE_EVENT_EXPIRED, 0,
+                globalreg->timestamp.tv_sec);
+
+    KIS_PROBE2(device__expire, in_device->get_key(), in_device->get_kis_internal_id());
+
+    // Remove it from the key and mac indexes
+    tracked_index.erase(in_device);
+    inc_phy_count(DevicetrackerKey::GetPhy(in_device->get_key()),
+            &phy_count_set::devices, -1);
+    RemoveModifiedList(in_device);
+    serial_cache.erase(in_device->get_key());
+
+    view_last_time.erase(in_device->get_key());
+    view_signal.erase(in_device->get_key());
+    view_packets.erase(in_device->get_key());
+    view_manuf.erase(in_device->get_key());
+    view_channel.erase(in_device->get_key());
+
+    ssid_index.erase(in_device->get_key());
+    oui_index.erase(in_device->get_key());
+    channel_index.erase(in_device->get_key());
+    location_index.erase(in_device->get_key());
+    flag_index.erase(in_device->get_kis_internal_id());
+
+    // The live vector has no order of its own, so fill the hole with the last
+    // device instead of shifting everything down
+    size_t pos = in_device->get_tracked_vec_pos();
+
+    if (pos < tracked_vec.size() && tracked_vec[pos] == in_device) {
+        if (pos != tracked_vec.size() - 1) {
+            tracked_vec[pos] = tracked_vec.back();
+            tracked_vec[pos]->set_tracked_vec_pos(pos);
+        }
+
+        tracked_vec.pop_back();
+    }
+
+    // Forget it from the immutable vec, but keep its position; we need to 
+    // have vecpos = devid
+    auto iti = immutable_tracked_vec.begin() + in_device->get_kis_internal_id();
+    (*iti).reset();
+}
+
+void Devicetracker::EraseModifiedEntry(modified_entry *in_entry) {
+    auto b = modified_buckets.find(in_entry->bucket);
+
+    // Hand the bucket to the next device in it, or drop the bucket when this
+    // was the only one
+    if (b != modified_buckets.end() && b->second == in_entry->pos) {
+        auto next = std::next(in_entry->pos);
+        modified_entry *ne = NULL;
+
+        if (next != modified_list.end())
+            ne = modified_pos.find((*next)->get_key());
+
+        if (ne != NULL && ne->bucket == in_entry->bucket)
+            b->second = next;
+        else
+            modified_buckets.erase(b);
+    }
+
+    modified_list.erase(in_entry->pos);
+}
+
+void Devicetracker::UpdateModifiedList(shared_ptr<kis_tracked_device_base> in_device) {
+    local_locker lock(&devicelist_mutex);
+
+    modified_entry *entry = modified_pos.find(in_device->get_key());
+    time_t last_time = in_device->get_last_time();
+
+    // Already at the front of its bucket
+    if (entry != NULL && entry->bucket == last_time && 
+            modified_buckets[last_time] == entry->pos)
+        return;
+
+    if (entry != NULL)
+        EraseModifiedEntry(entry);
+
+    // Goes in front of the other devices of the same second, or in front of
+    // the newest older second; packets arrive in near time order so this is
+    // almost always the front of the list
+    modified_list_t::iterator i;
+    auto b = modified_buckets.lower_bound(last_time);
+
+    if (b != modified_buckets.end() && b->first == last_time) {
+        i = b->second;
+    } else if (b == modified_buckets.begin()) {
+        i = modified_list.end();
+    } else {
+        i = std::prev(b)->second;
+    }
+
+    auto ni = modified_list.insert(i, in_device);
+
+    modified_buckets[last_time] = ni;
+
+    if (entry != NULL) {
+        entry->pos = ni;
+        entry->bucket = last_time;
+    } else {
+        modified_entry e;
+        e.pos = ni;
+        e.bucket = last_time;
+        modified_pos.insert(in_device->get_key(), e);
+    }
+}
+
+void Devicetracker::RemoveModifiedList(shared_ptr<kis_tracked_device_base> in_device) {
+    local_locker lock(&devicelist_mutex);
+
+    modified_entry *entry = modified_pos.find(in_device->get_key());
+
+    if (entry == NULL)
+        return;
+
+    EraseModifiedEntry(entry);
+    modified_pos.erase(in_device->get_key());
+}
+
+string Devicetracker::SerialProjectionKey(vector<SharedElementSummary>& in_summary_vec) {
+    stringstream ss;
+
+    for (auto si : in_summary_vec) {
+        for (auto p : si->resolved_path)
+            ss << p << "/";
+
+        ss << ":" << si->rename << ",";
+    }
+
+    return ss.str();
+}
+
+shared_ptr<JsonAdapter::SummaryPlan> Devicetracker::CompileSummaryPlan(string in_format,
+        vector<SharedElementSummary>& in_summary_vec) {
+    // ekjson writes each device the same way json does
+    if (!summary_plan_enabled || (in_format != "json" && in_format != "ekjson"))
+        return NULL;
+
+    return std::make_shared<JsonAdapter::SummaryPlan>(globalreg, in_summary_vec);
+}
+
+SharedTrackerElement Devicetracker::SummarizeDeviceCached(string in_format,
+        SharedTrackerElement in_device, string in_projection,
+        vector<SharedElementSummary>& in_summary_vec,
+        TrackerElementSerializer::rename_map& rename_map,
+        TrackerElementSerializer::serial_cache_map& cache_map,
+        JsonAdapter::SummaryPlan *in_plan) {
+
+    SharedTrackerElement simple;
+
+    local_locker lock(&devicelist_mutex);
+
+    if (!serial_cache_enabled) {
+        // Serialized on its own and output as-is, like a cached device, so the
+        // output never refers to the live device
+        std::stringstream ss;
+
+        if (in_plan != NULL) {
+            {
+                JsonAdapter::json_writer writer(ss);
+                in_plan->Pack(writer, in_device);
+            }
+
+            cache_map[in_device.get()] = std::make_shared<string>(ss.str());
+            return in_device;
+        }
+
+        TrackerElementSerializer::rename_map dev_rename_map;
+
+        SummarizeTrackerElement(entrytracker, in_device, in_summary_vec,
+                simple, dev_rename_map);
+
+        if (!entrytracker->Serialize(in_format, ss, simple, &dev_rename_map)) {
+            rename_map.insert(dev_rename_map.begin(), dev_rename_map.end());
+            return simple;
+        }
+
+        cache_map[in_device.get()] = std::make_shared<string>(ss.str());
+        return in_device;
+    }
+
+    shared_ptr<kis_tracked_device_base> dev =
+        static_pointer_cast<kis_tracked_device_base>(in_device);
+
+    if (serial_cache_ts != globalreg->timestamp.tv_sec) {
+        serial_cache.clear();
+        serial_cache_ts = globalreg->timestamp.tv_sec;
+    }
+
+    // Snapshot the version before serializing, so changes made while we're
+    // serializing make the record stale instead of being lost
+    uint32_t version = dev->get_mod_version();
+
+    shared_ptr<vector<device_serial_cache_rec> > *recs = 
+        serial_cache.find(dev->get_key());
+
+    if (recs == NULL)
+        recs = serial_cache.insert(dev->get_key(), 
+                std::make_shared<vector<device_serial_cache_rec> >()).first;
+
+    device_serial_cache_rec *rec = NULL;
+
+    for (auto& r : **recs) {
+        if (r.format == in_format && r.projection == in_projection) {
+            if (r.version == version) {
+                cache_map[in_device.get()] = r.blob;
+                return in_device;
+            }
+
+            rec = &r;
+            break;
+        }
+    }
+
+    if (rec == NULL) {
+        // Only remember a few formats and projections per device
+        if ((*recs)->size() >= 4)
+            (*recs)->erase((*recs)->begin());
+
+        (*recs)->push_back(device_serial_cache_rec());
+        rec = &((*recs)->back());
+        rec->format = in_format;
+        rec->projection = in_projection;
+    }
+
+    // The device is serialized on its own, which produces the same bytes as it 
+    // would nested in the output vector
+    TrackerElementSerializer::rename_map dev_rename_map;
+    std::stringstream ss;
+
+    if (in_plan != NULL) {
+        {
+            JsonAdapter::json_writer writer(ss);
+            in_plan->Pack(writer, in_device);
+        }
+
+        rec->version = version;
+        rec->blob = std::make_shared<string>(ss.str());
+
+        cache_map[in_device.get()] = rec->blob;
+
+        return in_device;
+    }
+
+    SummarizeTrackerElement(entrytracker, in_device, in_summary_vec,
+            simple, dev_rename_map);
+
+    if (!entrytracker->Serialize(in_format, ss, simple, &dev_rename_map)) {
+        rename_map.insert(dev_rename_map.begin(), dev_rename_map.end());
+        return simple;
+    }
+
+    rec->version = version;
+    rec->blob = std::make_shared<string>(ss.str());
+
+    cache_map[in_device.get()] = rec->blob;
+
+    return in_device;
+}
+
+void Devicetracker::SummarizeDevicesBatched(string in_format,
+        SharedTrackerElement in_devices, string in_projection,
+        vector<SharedElementSummary>& in_summary_vec, 
+        JsonAdapter::SummaryPlan *in_plan, SharedTrackerElement out_devvec,
+        TrackerElementSerializer::rename_map& rename_map,
+        TrackerElementSerializer::serial_cache_map& cache_map) {
+
+    devicetracker_function_worker sw(globalreg, 
+            [this, &in_format, &in_projection, &in_summary_vec, in_plan, 
+            out_devvec, &rename_map, &cache_map](Devicetracker *, 
+                shared_ptr<kis_tracked_device_base> d) -> bool {
+                out_devvec->add_vector(SummarizeDeviceCached(in_format, d, 
+                            in_projection, in_summary_vec, rename_map, cache_map, 
+                            in_plan));
+
+                return false;
+            }, NULL);
+
+    MatchOnDevices(&sw, TrackerElementVector(in_devices));
+}
+
+SharedTrackerElement Devicetracker::FetchDeviceSnapshot() {
+    local_locker lock(&devicelist_mutex);
+
+    if (device_snapshot == NULL || device_snapshot_epoch != device_epoch) {
+        device_snapshot.reset(new TrackerElement(TrackerVector));
+
+        device_snapshot->get_vector()->reserve(tracked_vec.size());
+
+        for (auto d : tracked_vec)
+            device_snapshot->add_vector(d);
+
+        device_snapshot_epoch = device_epoch;
+    }
+
+    return device_snapshot;
+}
+
+void Devicetracker::FetchDevicesSince(time_t in_ts, SharedTrackerElement in_devvec) {
+    local_locker lock(&devicelist_mutex);
+
+    for (auto d : modified_list) {
+        if (d->get_last_time() <= in_ts)
+            break;
+
+        in_devvec->add_vector(d);
+    }
+}
+
+void Devicetracker::IndexDeviceSSID(shared_ptr<kis_tracked_device_base> in_device,
+        const string& in_ssid) {
+    if (in_ssid.length() == 0)
+        return;
+
+    local_locker lock(&devicelist_mutex);
+
+    ssid_index.add(in_device->get_key(), in_ssid);
+}
+
+void Devicetracker::IndexDeviceLocation(shared_ptr<kis_tracked_device_base> in_device,
+        double in_lat, double in_lon, int in_fix) {
+    if (in_fix < 2)
+        return;
+
+    local_locker lock(&devicelist_mutex);
+
+    location_index.add(in_device->get_key(), in_lat, in_lon);
+}
+
+string Devicetracker::OuiTerm(mac_addr in_mac) {
+    return in_mac.Mac2String().substr(0, 8);
+}
+
+DevicetrackerTermIndex *Devicetracker::TermIndexForRequest(const string& in_type,
+        const string& in_term, string& out_term) {
+    if (in_type == "by-ssid") {
+        out_term = in_term;
+        return &ssid_index;
+    } else if (in_type == "by-oui") {
+        // Accept aa-bb-cc as well as AA:BB:CC
+        out_term = StrUpper(in_term);
+        std::replace(out_term.begin(), out_term.end(), '-', ':');
+        return &oui_index;
+    } else if (in_type == "by-channel") {
+        out_term = in_term;
+        return &channel_index;
+    }
+
+    return NULL;
+}
+
+vector<shared_ptr<kis_tracked_device_base> > Devicetracker::FetchDevicesByTerm(
+        DevicetrackerTermIndex& in_index, const string& in_term) {
+    vector<shared_ptr<kis_tracked_device_base> > ret;
+
+    local_locker lock(&devicelist_mutex);
+
+    for (auto k : in_index.find(in_term)) {
+        shared_ptr<kis_tracked_device_base> d = tracked_index.find(k);
+
+        if (d != NULL)
+            ret.push_back(d);
+    }
+
+    return ret;
+}
+
+vector<shared_ptr<kis_tracked_device_base> > Devicetracker::FetchDevicesByLocation(
+        double in_min_lat, double in_min_lon, double in_max_lat, double in_max_lon) {
+    vector<shared_ptr<kis_tracked_device_base> > ret;
+
+    if (in_min_lat > in_max_lat)
+        std::swap(in_min_lat, in_max_lat);
+
+    bool wrap = in_min_lon > in_max_lon;
+
+    local_locker lock(&devicelist_mutex);
+
+    for (auto k : location_index.find(in_min_lat, in_min_lon, in_max_lat, in_max_lon)) {
+        shared_ptr<kis_tracked_device_base> d = tracked_index.find(k);
 
-	return a->get_last_time() < b->get_last_time();
+        if (d == NULL)
+            continue;
+
+        shared_ptr<kis_tracked_location> loc =
+            static_pointer_cast<kis_tracked_location>(d->get_tracker_location());
+
+        if (loc == NULL || !loc->get_valid())
+            continue;
+
+        // Grid cells overhang the edges of the box; keep only devices whose
+        // seen area overlaps it
+        double min_lat = loc->get_min_loc()->get_lat();
+        double max_lat = loc->get_max_loc()->get_lat();
+        double min_lon = loc->get_min_loc()->get_lon();
+        double max_lon = loc->get_max_loc()->get_lon();
+
+        if (max_lat < in_min_lat || min_lat > in_max_lat)
+            continue;
+
+        if (wrap) {
+            if (max_lon < in_min_lon && min_lon > in_max_lon)
+                continue;
+        } else if (max_lon < in_min_lon || min_lon > in_max_lon) {
+            continue;
+        }
+
+        ret.push_back(d);
+    }
+
+    return ret;
+}
+
+shared_ptr<string> Devicetracker::SerializeDevice(string in_format,
+        shared_ptr<kis_tracked_device_base> in_device) {
+    TrackerElementSerializer::rename_map rename_map;
+    TrackerElementSerializer::serial_cache_map cache_map;
+    vector<SharedElementSummary> summary_vec;
+    stringstream ss;
+
+    local_locker lock(&devicelist_mutex);
+
+    SharedTrackerElement simple =
+        SummarizeDeviceCached(in_format, in_device, 
+                SerialProjectionKey(summary_vec), summary_vec, rename_map, cache_map);
+
+    if (!entrytracker->Serialize(in_format, ss, simple, &rename_map, &cache_map))
+        return NULL;
+
+    return std::make_shared<string>(ss.str());
 }
 
 int Devicetracker::timetracker_event(int eventid) {
-    if (eventid == device_idle_timer) {
+    if (eventid == coalesce_timer) {
+        FlushCoalescedUpdates();
+    } else if (eventid == device_events_timer) {
+        PublishDeviceEvents();
+    } else if (eventid == journal_timer) {
+        if (coalesce_enabled)
+            FlushCoalescedUpdates();
+        QueueJournal();
+    } else if (eventid == snapshot_restore_timer) {
+        RestoreSnapshotBatch(snapshot_restore_rate);
+
+        if (!snapshot_pending) {
+            snapshot_restore_timer = -1;
+            return 0;
+        }
+    } else if (eventid == device_idle_timer) {
         local_locker lock(&devicelist_mutex);
 
         time_t ts_now = globalreg->timestamp.tv_sec;
         bool purged = false;
 
-        // Find all eligible devices, remove them from the tracked vec
-        tracked_vec.erase(std::remove_if(tracked_vec.begin(), tracked_vec.end(),
-                [&](shared_ptr<kis_tracked_device_base> d) {
-                    if (ts_now - d->get_last_time() > device_idle_expiration) {
-                        // fprintf(stderr, "debug - forgetting device %s age %lu expiration %d\n", d->get_macaddr().Mac2String().c_str(), globalreg->timestamp.tv_sec - d->get_last_time(), device_idle_expiration);
-                        
-                        device_itr mi = tracked_map.find(d->get_key());
-                        if (mi != tracked_map.end())
-                            tracked_map.erase(mi);
-
-                        // Forget it from the immutable vec, but keep its 
-                        // position; we need to have vecpos = devid
-                        auto iti = immutable_tracked_vec.begin() + d->get_kis_internal_id();
-                        (*iti).reset();
-
-                        // Erase it from the multimap
-                        auto mmp = tracked_mac_multimap.equal_range(d->get_macaddr());
-
-                        for (auto mmpi = mmp.first; mmpi != mmp.second; ++mmpi) {
-                            if (mmpi->second->get_key() == d->get_key()) {
-                                tracked_mac_multimap.erase(mmpi);
-                                break;
-                            }
-                        }
+        // The least recently seen devices are at the back of the modification
+        // list, so stop at the first one which is still live
+        while (modified_list.size() != 0) {
+            shared_ptr<kis_tracked_device_base> d = modified_list.back();
 
-                        purged = true;
+            modified_entry *entry = modified_pos.find(d->get_key());
 
-                        return true;
-                    }
+            if (entry == NULL || ts_now - entry->bucket <= device_idle_expiration)
+                break;
 
-                    return false;
-         
-                    }), tracked_vec.end());
+            RemoveTrackedDevice(d);
+            purged = true;
+        }
 
         if (purged)
             UpdateFullRefresh();
@@ -968,28 +2430,31 @@ int Devicetracker::timetracker_event(int eventid) {
         // Do an update since we're trimming something
         UpdateFullRefresh();
 
-		// Now things start getting expensive.  Start by sorting the
-		// vector of devices - anything else that has to sort the entire list
-        // has to sort it themselves
-		kismet__stable_sort(tracked_vec.begin(), tracked_vec.end(), 
-                devicetracker_sort_lastseen);
+        // Drop the least recently seen devices, which are at the back of
+        // the modification list
+        while (tracked_vec.size() > max_num_devices && modified_list.size() != 0)
+            RemoveTrackedDevice(modified_list.back());
+	}
+
+    // Loop
+    return 1;
+}
 
-		unsigned int drop = tracked_vec.size() - max_num_devices;
+unsigned int Devicetracker::ShedDevices(unsigned int in_count) {
+    local_locker lock(&devicelist_mutex);
 
-		// Figure out how many we don't care about, and remove them from the map
-		for (unsigned int d = 0; d < drop; d++) {
-			device_itr mi = tracked_map.find(tracked_vec[d]->get_key());
+    unsigned int removed = 0;
 
-			if (mi != tracked_map.end())
-				tracked_map.erase(mi);
-		}
+    // Least recently seen first, from the back of the modification list
+    while (removed < in_count && modified_list.size() != 0) {
+        RemoveTrackedDevice(modified_list.back());
+        removed++;
+    }
 
-		// Clear them out of the vector
-		tracked_vec.erase(tracked_vec.begin(), tracked_vec.begin() + drop);
-	}
+    if (removed != 0)
+        UpdateFullRefresh();
 
-    // Loop
-    return 1;
+    return removed;
 }
 
 void Devicetracker::usage(const char *name __attribute__((unused))) {
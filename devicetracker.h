@@ -32,11 +32,27 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <atomic>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <unordered_set>
 
 #include <stdexcept>
 
 #ifdef HAVE_LIBPCRE
 #include <pcre.h>
+
+// JIT arrived in 8.20, and pcre_jit_exec, which takes its JIT stack per call
+// and so suits matching on several threads, in 8.32; in between pcre_exec runs
+// the JIT code on the default JIT stack
+#ifndef PCRE_STUDY_JIT_COMPILE
+typedef void pcre_jit_stack;
+#elif PCRE_MAJOR > 8 || PCRE_MINOR >= 32
+#define HAVE_PCRE_JIT_EXEC
+#endif
 #endif
 
 #include "globalregistry.h"
@@ -57,6 +73,13 @@
 #include "kis_net_microhttpd.h"
 #include "structured.h"
 #include "devicetracker_httpd_pcap.h"
+#include "kis_flat_hash.h"
+#include "kis_log_formats.h"
+#include "devicetracker_events.h"
+#include "kbin_adapter.h"
+#include "json_adapter.h"
+#include "kis_metrics.h"
+#include "kis_taskpool.h"
 
 // How big the main vector of components is, if we ever get more than this
 // many tracked components we'll need to expand this but since it ties to
@@ -66,6 +89,10 @@
 #define KIS_PHY_ANY	-1
 #define KIS_PHY_UNKNOWN -2
 
+// Most phys with their own device and packet counts; phys registered past this
+// are only counted in the totals
+#define KIS_PHY_COUNTED_MAX     32
+
 // Helper for making keys
 //
 // Device keys are phy and runtime specific.
@@ -168,17 +195,17 @@ public:
 
     __Proxy(macaddr, mac_addr, mac_addr, mac_addr, macaddr);
 
-    __Proxy(phyname, string, string, string, phyname);
+    __ProxyInterned(phyname, phyname);
 
     __Proxy(devicename, string, string, string, devicename);
     __Proxy(username, string, string, string, username);
 
-    __Proxy(type_string, string, string, string, type_string);
+    __ProxyInterned(type_string, type_string);
 
     __Proxy(basic_type_set, uint64_t, uint64_t, uint64_t, basic_type_set);
     __ProxyBitset(basic_type_set, uint64_t, basic_type_set);
 
-    __Proxy(crypt_string, string, string, string, crypt_string);
+    __ProxyInterned(crypt_string, crypt_string);
 
     __Proxy(basic_crypt_set, uint64_t, uint64_t, uint64_t, basic_crypt_set);
     void add_basic_crypt(uint64_t in) { (*basic_crypt_set) |= in; }
@@ -213,8 +240,10 @@ public:
     __Proxy(datasize, uint64_t, uint64_t, uint64_t, datasize);
     __ProxyIncDec(datasize, uint64_t, uint64_t, datasize);
 
+    // Sub-records below are only built once there's something to put in them;
+    // a missing record isn't serialized, and summaries report it as 0
     typedef kis_tracked_rrd<> rrdt;
-    __ProxyTrackable(packets_rrd, rrdt, packets_rrd);
+    __ProxyDynamicTrackable(packets_rrd, rrdt, packets_rrd, packets_rrd_id);
 
     __ProxyDynamicTrackable(location, kis_tracked_location, location, location_id);
     __ProxyDynamicTrackable(data_rrd, rrdt, data_rrd, data_rrd_id);
@@ -231,71 +260,92 @@ public:
     __ProxyDynamicTrackable(packet_rrd_bin_jumbo, mrrdt, packet_rrd_bin_jumbo,
             packet_rrd_bin_jumbo_id);
 
-    __Proxy(channel, string, string, string, channel);
+    __ProxyInterned(channel, channel);
     __Proxy(frequency, double, double, double, frequency);
 
-    __Proxy(manuf, string, string, string, manuf);
+    __ProxyInterned(manuf, manuf);
 
     __Proxy(num_alerts, uint32_t, unsigned int, unsigned int, alert);
 
-    __ProxyTrackable(signal_data, kis_tracked_signal_data, signal_data);
+    __ProxyDynamicTrackable(signal_data, kis_tracked_signal_data, signal_data, 
+            signal_data_id);
 
-    // Intmaps need special care by the caller
+    // Intmaps need special care by the caller; NULL until a frequency is counted.
+    // Channel frequencies are only in the map once it has been serialized; see
+    // kis_tracked_freq_map
     SharedTrackerElement get_freq_khz_map() { return freq_khz_map; }
 
-    void inc_frequency_count(double frequency) {
+    void inc_frequency_count(double frequency, uint64_t count = 1) {
         if (frequency <= 0)
             return;
 
-        TrackerElement::double_map_iterator i = freq_khz_map->double_find(frequency);
+        if (freq_khz_map == NULL) {
+            freq_khz_map.reset(new kis_tracked_freq_map(globalreg, freq_khz_map_id,
+                        frequency_val_id));
+            add_map(freq_khz_map);
+        }
 
-        if (i == freq_khz_map->double_end()) {
-            SharedTrackerElement e =
-                globalreg->entrytracker->GetTrackedInstance(frequency_val_id);
-            e->set((uint64_t) 1);
-            freq_khz_map->add_doublemap(frequency, e);
-        } else {
-            (*(i->second))++;
+        freq_khz_map->inc(frequency, count);
+    }
+
+    // Packets counted from the weight of a sampled packet rather than seen; NULL
+    // unless the device was updated while sampling under overload
+    SharedTrackerElement get_sampled_packets() { return sampled_packets; }
+
+    void inc_sampled_packets(uint64_t in_count) {
+        if (sampled_packets == NULL) {
+            sampled_packets = entrytracker->GetTrackedInstance(sampled_packets_id);
+            add_map(sampled_packets);
         }
+
+        (*sampled_packets) += in_count;
     }
 
+    // NULL until a source has seen the device
     SharedTrackerElement get_seenby_map() {
         return seenby_map;
     }
 
-    void inc_seenby_count(KisDatasource *source, time_t tv_sec, int frequency) {
-        TrackerElement::map_iterator seenby_iter;
-        shared_ptr<kis_tracked_seenby_data> seenby;
-
-        seenby_iter = seenby_map->find(source->get_source_number());
+    void inc_seenby_count(KisDatasource *source, time_t tv_sec, int frequency,
+            uint64_t in_count = 1) {
+        unsigned int src_number = source->get_source_number();
+        kis_tracked_seenby_data *seenby = find_seenby(src_number);
 
-        // Make a new seenby record
-        if (seenby_iter == seenby_map->end()) {
-            seenby.reset(new kis_tracked_seenby_data(globalreg, seenby_val_id));
+        if (seenby == NULL) {
+            seenby = add_seenby(src_number, source->get_source_uuid(), tv_sec);
+            seenby->set_num_packets(in_count);
+        } else {
+            seenby->inc_num_packets(in_count);
+        }
 
-            seenby->set_src_uuid(source->get_source_uuid());
-            seenby->set_first_time(tv_sec);
-            seenby->set_last_time(tv_sec);
-            seenby->set_num_packets(1);
+        seenby->set_last_time(tv_sec);
 
-            if (frequency > 0)
-                seenby->inc_frequency_count(frequency);
+        if (frequency > 0)
+            seenby->inc_frequency_count(frequency, in_count);
+    }
 
-            seenby_map->add_intmap(source->get_source_number(), seenby);
+    // Count a number of packets from one source at once; frequencies are
+    // pairs of frequency and packets
+    void add_seenby_count(int in_src_number, uuid in_src_uuid, time_t in_first_time,
+            time_t in_last_time, uint64_t in_packets,
+            const vector<pair<double, uint64_t> >& in_frequencies) {
+        kis_tracked_seenby_data *seenby = find_seenby(in_src_number);
 
+        if (seenby == NULL) {
+            seenby = add_seenby(in_src_number, in_src_uuid, in_first_time);
+            seenby->set_num_packets(in_packets);
         } else {
-            seenby = static_pointer_cast<kis_tracked_seenby_data>(seenby_iter->second);
-
-            seenby->set_last_time(tv_sec);
-            seenby->inc_num_packets();
-
-            if (frequency > 0)
-                seenby->inc_frequency_count(frequency);
+            seenby->inc_num_packets(in_packets);
         }
 
+        seenby->set_last_time(in_last_time);
+
+        for (auto f : in_frequencies)
+            if (f.first > 0)
+                seenby->inc_frequency_count((int) f.first, f.second);
     }
 
-    __ProxyTrackable(tag_map, TrackerElement, tag_map);
+    __ProxyDynamicTrackable(tag_map, TrackerElement, tag_map, tag_map_id);
 
     // Non-exported internal counter used for structured sorting
     uint64_t get_kis_internal_id() {
@@ -306,188 +356,121 @@ public:
         kis_internal_id = in_id;
     }
 
+    // Non-exported position in the tracker's vector of live devices
+    size_t get_tracked_vec_pos() {
+        return tracked_vec_pos;
+    }
+
+    void set_tracked_vec_pos(size_t in_pos) {
+        tracked_vec_pos = in_pos;
+    }
+
 protected:
     virtual void register_fields() {
         tracker_component::register_fields();
 
-        RegisterField("kismet.device.base.key", TrackerUInt64,
-                "unique integer key", &key);
-
-        RegisterField("kismet.device.base.macaddr", TrackerMac,
-                "mac address", &macaddr);
-
-        RegisterField("kismet.device.base.phyname", TrackerString,
-                "phy name", &phyname);
-
-        RegisterField("kismet.device.base.name", TrackerString,
-                "printable device name", &devicename);
-
-        RegisterField("kismet.device.base.username", TrackerString,
-                "user name", &username);
-
-        RegisterField("kismet.device.base.type", TrackerString,
-                "printable device type", &type_string);
-
-        RegisterField("kismet.device.base.basic_type_set", TrackerUInt64,
-                "bitset of basic type", &basic_type_set);
-
-        RegisterField("kismet.device.base.crypt", TrackerString,
-                "printable encryption type", &crypt_string);
-
-        RegisterField("kismet.device.base.basic_crypt_set", TrackerUInt64,
-                "bitset of basic encryption", &basic_crypt_set);
-
-        RegisterField("kismet.device.base.first_time", TrackerUInt64,
-                "first time seen time_t", &first_time);
-        RegisterField("kismet.device.base.last_time", TrackerUInt64,
-                "last time seen time_t", &last_time);
-
-        RegisterField("kismet.device.base.packets.total", TrackerUInt64,
-                "total packets seen of all types", &packets);
-        RegisterField("kismet.device.base.packets.rx", TrackerUInt64,
-                "observed packets sent to device", &rx_packets);
-        RegisterField("kismet.device.base.packets.tx", TrackerUInt64,
-                "observed packets from device", &tx_packets);
-        RegisterField("kismet.device.base.packets.llc", TrackerUInt64,
-                "observed protocol control packets", &llc_packets);
-        RegisterField("kismet.device.base.packets.error", TrackerUInt64,
-                "corrupt/error packets", &error_packets);
-        RegisterField("kismet.device.base.packets.data", TrackerUInt64,
-                "data packets", &data_packets);
-        RegisterField("kismet.device.base.packets.crypt", TrackerUInt64,
-                "data packets using encryption", &crypt_packets);
-        RegisterField("kismet.device.base.packets.filtered", TrackerUInt64,
-                "packets dropped by filter", &filter_packets);
-
-        RegisterField("kismet.device.base.datasize", TrackerUInt64,
-                "transmitted data in bytes", &datasize);
-
-        shared_ptr<kis_tracked_rrd<> > packets_rrd_builder(new kis_tracked_rrd<>(globalreg, 0));
-        packets_rrd_id =
-            globalreg->entrytracker->RegisterField("kismet.device.base.packets.rrd",
-                    packets_rrd_builder, "packet rate rrd");
-
-        shared_ptr<kis_tracked_rrd<> > data_rrd_builder(new kis_tracked_rrd<>(globalreg, 0));
-        data_rrd_id =
-            globalreg->entrytracker->RegisterField("kismet.device.base.datasize.rrd",
-                    data_rrd_builder, "packet size rrd");
-
-        shared_ptr<kis_tracked_signal_data> sig_builder(new kis_tracked_signal_data(globalreg, 0));
-        signal_data_id =
-            RegisterComplexField("kismet.device.base.signal", sig_builder,
-                    "signal data");
-
-        RegisterField("kismet.device.base.freq_khz_map", TrackerDoubleMap,
-                "packets seen per frequency (khz)", &freq_khz_map);
-
-        RegisterField("kismet.device.base.channel", TrackerString,
-                "channel (phy specific)", &channel);
-        RegisterField("kismet.device.base.frequency", TrackerDouble,
-                "frequency", &frequency);
-
-        RegisterField("kismet.device.base.manuf", TrackerString,
-                "manufacturer name", &manuf);
-
-        RegisterField("kismet.device.base.num_alerts", TrackerUInt32,
-                "number of alerts on this device", &alert);
-
-        RegisterField("kismet.device.base.tags", TrackerStringMap,
-                "set of arbitrary tags", &tag_map);
-        tag_entry_id =
-            RegisterField("kismet.device.base.tag", TrackerString, "arbitrary tag");
-
-        shared_ptr<kis_tracked_location> loc_builder(new kis_tracked_location(globalreg, 0));
-        location_id =
-            RegisterComplexField("kismet.device.base.location", loc_builder,
-                    "location");
-
-        RegisterField("kismet.device.base.seenby", TrackerIntMap,
-                "sources that have seen this device", &seenby_map);
-
-        // Packet count, not actual frequency, so uint64 not double
-        frequency_val_id =
-            globalreg->entrytracker->RegisterField("kismet.device.base.frequency.count",
-                    TrackerUInt64, "frequency packet count");
-
-        shared_ptr<kis_tracked_seenby_data> seenby_builder(new kis_tracked_seenby_data(globalreg, 0));
-        seenby_val_id =
-            RegisterComplexField("kismet.device.base.seenby.data",
-                    seenby_builder, "seen-by data");
-
-        shared_ptr<kis_tracked_minute_rrd<> > bin_rrd_builder(new kis_tracked_minute_rrd<>(globalreg, 0));
-
-        packet_rrd_bin_250_id =
-            RegisterComplexField("kismet.device.base.packet.bin.250", bin_rrd_builder, 
-                    "Packets up to 250 bytes");
-        packet_rrd_bin_500_id =
-            RegisterComplexField("kismet.device.base.packet.bin.500", bin_rrd_builder, 
-                    "Packets up to 500 bytes");
-        packet_rrd_bin_1000_id =
-            RegisterComplexField("kismet.device.base.packet.bin.1000", bin_rrd_builder, 
-                    "Packets up to 1000 bytes");
-        packet_rrd_bin_1500_id =
-            RegisterComplexField("kismet.device.base.packet.bin.1500", bin_rrd_builder, 
-                    "Packets up to 1500 bytes");
-        packet_rrd_bin_jumbo_id =
-            RegisterComplexField("kismet.device.base.packet.bin.jumbo", bin_rrd_builder, 
-                    "Jumbo packets over 1500 bytes");
+        register_table_fields(field_table);
     }
 
     virtual void reserve_fields(SharedTrackerElement e) {
         tracker_component::reserve_fields(e);
 
+        // Only import the sub-records the stored device has; the rest stay
+        // empty until they're used
         if (e != NULL) {
-            signal_data.reset(new kis_tracked_signal_data(globalreg, signal_data_id,
-                    e->get_map_value(signal_data_id)));
+            SharedTrackerElement sub;
 
-            location.reset(new kis_tracked_location(globalreg, location_id,
-                    e->get_map_value(location_id)));
+            if ((sub = e->get_map_value(signal_data_id)) != NULL)
+                signal_data.reset(new kis_tracked_signal_data(globalreg, 
+                            signal_data_id, sub));
 
-            packets_rrd.reset(new kis_tracked_rrd<>(globalreg,
-                    packets_rrd_id, e->get_map_value(packets_rrd_id)));
+            if ((sub = e->get_map_value(location_id)) != NULL)
+                location.reset(new kis_tracked_location(globalreg, location_id, sub));
 
-            data_rrd.reset(new kis_tracked_rrd<>(globalreg,
-                    data_rrd_id, e->get_map_value(data_rrd_id)));
+            if ((sub = e->get_map_value(packets_rrd_id)) != NULL)
+                packets_rrd.reset(new kis_tracked_rrd<>(globalreg, packets_rrd_id, sub));
 
-            packet_rrd_bin_250.reset(new kis_tracked_minute_rrd<>(globalreg,
-                    packet_rrd_bin_250_id, e->get_map_value(packet_rrd_bin_250_id)));
+            if ((sub = e->get_map_value(data_rrd_id)) != NULL)
+                data_rrd.reset(new kis_tracked_rrd<>(globalreg, data_rrd_id, sub));
 
-            packet_rrd_bin_500.reset(new kis_tracked_minute_rrd<>(globalreg,
-                    packet_rrd_bin_500_id, e->get_map_value(packet_rrd_bin_500_id)));
+            if ((sub = e->get_map_value(packet_rrd_bin_250_id)) != NULL)
+                packet_rrd_bin_250.reset(new kis_tracked_minute_rrd<>(globalreg,
+                            packet_rrd_bin_250_id, sub));
 
-            packet_rrd_bin_1000.reset(new kis_tracked_minute_rrd<>(globalreg,
-                    packet_rrd_bin_1000_id, e->get_map_value(packet_rrd_bin_1000_id)));
+            if ((sub = e->get_map_value(packet_rrd_bin_500_id)) != NULL)
+                packet_rrd_bin_500.reset(new kis_tracked_minute_rrd<>(globalreg,
+                            packet_rrd_bin_500_id, sub));
 
-            packet_rrd_bin_1500.reset(new kis_tracked_minute_rrd<>(globalreg,
-                    packet_rrd_bin_1500_id, e->get_map_value(packet_rrd_bin_1500_id)));
+            if ((sub = e->get_map_value(packet_rrd_bin_1000_id)) != NULL)
+                packet_rrd_bin_1000.reset(new kis_tracked_minute_rrd<>(globalreg,
+                            packet_rrd_bin_1000_id, sub));
 
-            packet_rrd_bin_jumbo.reset(new kis_tracked_minute_rrd<>(globalreg,
-                    packet_rrd_bin_jumbo_id, e->get_map_value(packet_rrd_bin_jumbo_id)));
+            if ((sub = e->get_map_value(packet_rrd_bin_1500_id)) != NULL)
+                packet_rrd_bin_1500.reset(new kis_tracked_minute_rrd<>(globalreg,
+                            packet_rrd_bin_1500_id, sub));
 
-        } else {
-            signal_data.reset(new kis_tracked_signal_data(globalreg, signal_data_id));
+            if ((sub = e->get_map_value(packet_rrd_bin_jumbo_id)) != NULL)
+                packet_rrd_bin_jumbo.reset(new kis_tracked_minute_rrd<>(globalreg,
+                            packet_rrd_bin_jumbo_id, sub));
+
+            if ((sub = e->get_map_value(freq_khz_map_id)) != NULL) {
+                freq_khz_map.reset(new kis_tracked_freq_map(globalreg, freq_khz_map_id,
+                            frequency_val_id, sub));
+                add_map(freq_khz_map);
+            }
+
+            // Plain maps are imported as they are
+
+            if ((tag_map = e->get_map_value(tag_map_id)) != NULL)
+                add_map(tag_map);
+
+            // Seen-by records are rebuilt as records of their own, so they
+            // can be found by source number again
+            if ((sub = e->get_map_value(seenby_map_id)) != NULL &&
+                    sub->get_type() == TrackerSmallIntMap) {
+                for (auto i = sub->smallint_begin(); i != sub->smallint_end(); ++i) {
+                    if (i->first < 0 || i->second->get_type() != TrackerMap)
+                        continue;
+
+                    shared_ptr<kis_tracked_seenby_data> seenby(
+                            new kis_tracked_seenby_data(globalreg, seenby_val_id,
+                                i->second));
+
+                    set_seenby(i->first, seenby);
+                }
+            }
 
-            packets_rrd.reset(new kis_tracked_rrd<>(globalreg, packets_rrd_id));
+            if ((sampled_packets = e->get_map_value(sampled_packets_id)) != NULL)
+                add_map(sampled_packets);
         }
 
-        // add using known fields b/c we might add null
-        add_map(signal_data_id, signal_data);
-        add_map(location_id, location);
-        add_map(packets_rrd_id, packets_rrd);
-        add_map(data_rrd_id, data_rrd);
-        add_map(packet_rrd_bin_250_id, packet_rrd_bin_250);
-        add_map(packet_rrd_bin_500_id, packet_rrd_bin_500);
-        add_map(packet_rrd_bin_1000_id, packet_rrd_bin_1000);
-        add_map(packet_rrd_bin_1500_id, packet_rrd_bin_1500);
-        add_map(packet_rrd_bin_jumbo_id, packet_rrd_bin_jumbo);
+        // Only add the records we have; a placeholder for a missing one would be
+        // found by path lookups ahead of the record once it's built
+        SharedTrackerElement subrecs[] = {
+            signal_data, location, packets_rrd, data_rrd, 
+            packet_rrd_bin_250, packet_rrd_bin_500, packet_rrd_bin_1000,
+            packet_rrd_bin_1500, packet_rrd_bin_jumbo
+        };
+
+        for (auto r : subrecs) {
+            if (r != NULL)
+                add_map(r);
+        }
     }
 
+    static const tracker_field_desc<kis_tracked_device_base> field_desc[];
+    static tracker_field_table<kis_tracked_device_base> field_table;
+
     // Unique, meaningless, incremental ID.  Practically, this is the order
     // in which kismet saw devices; it has no purpose other than a sorting
     // key which will always preserve order - time, etc, will not.  Used for breaking
     // up long-running queries.
     uint64_t kis_internal_id;
 
+    // Position in the device tracker's vector of live devices, kept up to date
+    // by the tracker so a device can be removed without searching for it
+    size_t tracked_vec_pos;
+
     // Unique key
     SharedTrackerElement key;
 
@@ -536,6 +519,10 @@ protected:
                    // Excluded / filtered packets
                    filter_packets;
 
+    // Packets estimated from sampling, built on first use
+    SharedTrackerElement sampled_packets;
+    int sampled_packets_id;
+
     // Data seen in bytes
     SharedTrackerElement datasize;
 
@@ -566,7 +553,8 @@ protected:
     int signal_data_id;
 
     // Global frequency distribution
-    SharedTrackerElement freq_khz_map;
+    shared_ptr<kis_tracked_freq_map> freq_khz_map;
+    int freq_khz_map_id;
 
     // Manufacturer, if we're able to derive, either from OUI or 
     // from other data (phy-dependent)
@@ -577,6 +565,7 @@ protected:
 
     // Stringmap of tags
     SharedTrackerElement tag_map;
+    int tag_map_id;
     // Entry ID for tag map
     int tag_entry_id;
 
@@ -588,6 +577,46 @@ protected:
     SharedTrackerElement seenby_map;
     int seenby_map_id;
 
+    // Records of the seenby map by the dense datasource number the datasource
+    // tracker assigns, so a packet finds its source's record without a search;
+    // owned by the map
+    vector<kis_tracked_seenby_data *> seenby_slots;
+
+    kis_tracked_seenby_data *find_seenby(unsigned int in_src_number) {
+        if (in_src_number < seenby_slots.size())
+            return seenby_slots[in_src_number];
+
+        return NULL;
+    }
+
+    void set_seenby(unsigned int in_src_number, 
+            shared_ptr<kis_tracked_seenby_data> in_seenby) {
+        if (seenby_map == NULL) {
+            seenby_map = entrytracker->GetTrackedInstance(seenby_map_id);
+            add_map(seenby_map);
+        }
+
+        seenby_map->add_smallintmap(in_src_number, in_seenby);
+
+        if (in_src_number >= seenby_slots.size())
+            seenby_slots.resize(in_src_number + 1, NULL);
+
+        seenby_slots[in_src_number] = in_seenby.get();
+    }
+
+    kis_tracked_seenby_data *add_seenby(unsigned int in_src_number, uuid in_src_uuid,
+            time_t in_first_time) {
+        shared_ptr<kis_tracked_seenby_data> seenby(
+                new kis_tracked_seenby_data(globalreg, seenby_val_id));
+
+        seenby->set_src_uuid(in_src_uuid);
+        seenby->set_first_time(in_first_time);
+
+        set_seenby(in_src_number, seenby);
+
+        return seenby.get();
+    }
+
     // Non-exported local value for frequency count
     int frequency_val_id;
 
@@ -596,7 +625,8 @@ protected:
 };
 
 // Packinfo references
-class kis_tracked_device_info : public packet_component {
+class kis_tracked_device_info : public packet_component, 
+    public pooled_packet_component<kis_tracked_device_info> {
 public:
 	kis_tracked_device_info() {
 		self_destruct = 1;
@@ -620,10 +650,442 @@ public:
     // Finalize operations
     virtual void Finalize(Devicetracker *devicetracker) { }
 
+    // Workers which can match devices from several threads at once without
+    // serializing on the worker lock opt in to parallel matching.  Parallel
+    // workers are given the number of threads via PrepareSlots, then each device
+    // is passed to MatchDeviceSlot with the slot of the thread matching it;
+    // per-slot results should be merged in Finalize.  Results from parallel
+    // matching are not in the order of the source vector.
+    virtual bool IsThreadSafe() { return false; }
+
+    virtual void PrepareSlots(unsigned int in_num_slots __attribute__((unused))) { }
+
+    virtual void MatchDeviceSlot(Devicetracker *devicetracker,
+            shared_ptr<kis_tracked_device_base> base,
+            unsigned int in_slot __attribute__((unused))) {
+        MatchDevice(devicetracker, base);
+    }
+
+    // Called after each chunk of a parallel match, without the devicelist lock.
+    // Slots hold contiguous runs of the chunk, slot 0 first, so workers which
+    // keep per-slot results in order can emit them in source order here
+    virtual void ChunkComplete(Devicetracker *devicetracker __attribute__((unused))) { }
+
 protected:
     pthread_mutex_t worker_mutex;
 };
 
+// Lock-striped index of tracked devices, by key and by mac address.
+//
+// Devices are spread over a fixed number of shards by the mac address portion
+// of their key, so a device and any other device with the same mac in another
+// phy always live in the same shard.  Lookups and insertions only lock the
+// shard they touch, so per-device lookups don't contend with one another or
+// with the device list.  The index does not protect the contents of the device
+// records; that is still the job of the devicelist lock.
+class DevicetrackerIndex {
+public:
+    DevicetrackerIndex(unsigned int in_num_shards);
+    ~DevicetrackerIndex();
+
+    shared_ptr<kis_tracked_device_base> find(uint64_t in_key);
+
+    // All devices, in any phy, with a given mac
+    vector<shared_ptr<kis_tracked_device_base> > find_mac(mac_addr in_mac);
+    bool contains_mac(mac_addr in_mac);
+
+    // Insert a device.  If a device with the same key is already indexed,
+    // the existing device is returned and the index is unchanged; otherwise the
+    // new device is returned.
+    shared_ptr<kis_tracked_device_base> 
+        insert(shared_ptr<kis_tracked_device_base> in_device);
+
+    void erase(shared_ptr<kis_tracked_device_base> in_device);
+    void clear();
+
+    size_t size() {
+        return num_devices;
+    }
+
+    unsigned int get_num_shards() {
+        return num_shards;
+    }
+
+protected:
+    class index_shard {
+    public:
+        pthread_mutex_t mutex;
+        // Full device key to device
+        kis_u64_flat_map<shared_ptr<kis_tracked_device_base> > key_map;
+        // 48-bit mac to every device with that mac; almost always one entry
+        kis_u64_flat_map<vector<shared_ptr<kis_tracked_device_base> > > mac_map;
+    };
+
+    index_shard *get_shard(uint64_t in_mac);
+
+    // Always a power of two
+    unsigned int num_shards;
+    index_shard *shards;
+
+    std::atomic<size_t> num_devices;
+};
+
+// Inverted index of tracked devices by a lookup term such as an SSID, OUI, or
+// channel, so all the devices filed under a term can be found without
+// matching every device.  A device can be filed under any number of terms;
+// the terms of each device are kept so a device can be dropped from all of
+// them when it is forgotten.  Not thread safe; the device tracker protects its
+// term indexes with the devicelist lock.
+class DevicetrackerTermIndex {
+public:
+    // File a device under a term, if it isn't already
+    void add(uint64_t in_key, const string& in_term);
+
+    // File a device under only this term, for fields with a single value;
+    // an empty term removes the device
+    void set(uint64_t in_key, const string& in_term);
+
+    // Remove a device from every term
+    void erase(uint64_t in_key);
+
+    void clear();
+
+    // Keys of all devices filed under a term
+    vector<uint64_t> find(const string& in_term);
+
+protected:
+    std::unordered_map<string, std::unordered_set<uint64_t> > term_map;
+    kis_u64_flat_map<vector<string> > device_terms;
+};
+
+// Cells a device is filed under before the oldest are dropped
+#define DEVICE_GRID_MAX_CELLS   64
+
+// Uniform grid over the locations devices were seen at, so the devices in a
+// bounding box can be found without looking at the location of every device.
+//
+// Cells are in_cell_deg degrees of latitude and longitude.  A device is filed
+// under every cell it was seen in, up to DEVICE_GRID_MAX_CELLS of the most
+// recent.  Not thread safe; the device tracker protects it with the devicelist
+// lock.
+class DevicetrackerGridIndex {
+public:
+    DevicetrackerGridIndex(double in_cell_deg);
+
+    // File a device under the cell holding a location
+    void add(uint64_t in_key, double in_lat, double in_lon);
+
+    // Remove a device from every cell
+    void erase(uint64_t in_key);
+
+    void clear();
+
+    // Keys of all devices filed under a cell overlapping the box; when
+    // in_min_lon is greater than in_max_lon the box crosses the antimeridian
+    vector<uint64_t> find(double in_min_lat, double in_min_lon,
+            double in_max_lat, double in_max_lon);
+
+protected:
+    uint32_t lat_cell(double in_lat);
+    uint32_t lon_cell(double in_lon);
+
+    double cell_deg;
+    uint32_t num_lat_cells, num_lon_cells;
+
+    std::unordered_map<uint64_t, std::unordered_set<uint64_t> > cell_map;
+    kis_u64_flat_map<vector<uint64_t> > device_cells;
+};
+
+// Most flags the device flag index can hold
+#define DEVICE_FLAGS_MAX        64
+
+// Columnar index of device flags, such as the basic type and crypt bits and
+// the phy type and crypt sets, for queries like "every AP with WPA2 and WPS
+// and without WPA": one bitmap per flag with a bit per device, by device id
+// (kis_internal_id), so a query is an AND of whole bitmaps and a popcount
+// instead of a look at every device.
+//
+// Flags are registered in groups by whatever knows how to read them; each
+// group is a function returning the flags of a device as a word, bit n being
+// the nth name of the group.  The index is refreshed from the modification
+// list like the device views, so only the devices which changed since the
+// last query are read again, and everything is read after a group is added.
+// Not thread safe; the device tracker protects it with the devicelist lock.
+class DevicetrackerFlagIndex {
+public:
+    typedef function<uint64_t (shared_ptr<kis_tracked_device_base>)> flag_func;
+
+    DevicetrackerFlagIndex() :
+        refresh_ts(-1) { }
+
+    // Add a group of flags; false if the names are taken or there isn't room
+    bool register_flags(const vector<string>& in_names, flag_func in_func);
+
+    // Bit of a flag, or -1
+    int find_flag(const string& in_name) const;
+
+    const vector<string>& get_flag_names() const {
+        return names;
+    }
+
+    // Parse a query of flag names, each optionally prefixed by '!' for devices
+    // without it; false and an explanation in ret_error for unknown flags
+    bool parse_query(const vector<string>& in_terms, uint64_t *ret_set,
+            uint64_t *ret_clear, string *ret_error) const;
+
+    // Read the flags of a device again
+    void update(shared_ptr<kis_tracked_device_base> in_device);
+
+    void erase(uint64_t in_id);
+
+    void clear();
+
+    // Bring the index up to date, the same way as DevicetrackerViewIndex
+    void refresh(const list<shared_ptr<kis_tracked_device_base> >& in_modified,
+            const vector<shared_ptr<kis_tracked_device_base> >& in_all);
+
+    // Ids of the devices with every flag of in_set and none of in_clear, and
+    // how many there are
+    vector<uint64_t> query(uint64_t in_set, uint64_t in_clear) const;
+    size_t count(uint64_t in_set, uint64_t in_clear) const;
+
+    // Does one device match
+    bool match(uint64_t in_id, uint64_t in_set, uint64_t in_clear) const {
+        if ((in_id >> 6) >= present.size() || 
+                (present[in_id >> 6] & (1ULL << (in_id & 63))) == 0)
+            return false;
+
+        uint64_t f = device_flags[in_id];
+
+        return (f & in_set) == in_set && (f & in_clear) == 0;
+    }
+
+protected:
+    struct flag_group {
+        unsigned int first;
+        unsigned int num;
+        flag_func get_flags;
+    };
+
+    vector<flag_group> groups;
+    vector<string> names;
+
+    time_t refresh_ts;
+
+    // Flags of each device, by id
+    vector<uint64_t> device_flags;
+
+    // Bitmap of the devices in the index, and one bitmap per flag
+    vector<uint64_t> present;
+    vector<uint64_t> bitmaps[DEVICE_FLAGS_MAX];
+
+    // Bitmap of the devices matching a query
+    void query_bitmap(uint64_t in_set, uint64_t in_clear, 
+            vector<uint64_t>& ret_bitmap) const;
+};
+
+// Devices in each sorted block of a device view; blocks are split when they
+// reach twice this size
+#define DEVICE_VIEW_BLOCK       256
+
+// One ordering of the tracked devices for windowed device views, kept sorted
+// as devices change instead of being re-sorted for every request.
+//
+// Entries are the device key and the value it's sorted by, held in a list of
+// short sorted blocks: moving a device only shifts entries within one block,
+// and a window at any offset is found by skipping whole blocks.  Devices with
+// the same value are ordered by key so the order is stable from one request
+// to the next.  Not thread safe; the device tracker protects its views with
+// the devicelist lock.
+template<typename T>
+class DevicetrackerViewIndex {
+public:
+    typedef function<T (shared_ptr<kis_tracked_device_base>)> value_func;
+
+    DevicetrackerViewIndex(value_func in_func) :
+        refresh_ts(-1),
+        get_value(in_func),
+        num_entries(0) { }
+
+    // Index a device by its current value, moving it if it has changed
+    void update(shared_ptr<kis_tracked_device_base> in_device) {
+        uint64_t key = in_device->get_key();
+        T value = get_value(in_device);
+
+        T *cur = values.find(key);
+
+        if (cur != NULL) {
+            if (*cur == value)
+                return;
+
+            remove_entry(view_entry(*cur, key));
+            *cur = value;
+        } else {
+            values.insert(key, value);
+        }
+
+        insert_entry(view_entry(value, key));
+    }
+
+    void erase(uint64_t in_key) {
+        T *cur = values.find(in_key);
+
+        if (cur == NULL)
+            return;
+
+        remove_entry(view_entry(*cur, in_key));
+        values.erase(in_key);
+    }
+
+    void clear() {
+        blocks.clear();
+        values.clear();
+        num_entries = 0;
+        refresh_ts = -1;
+    }
+
+    size_t size() {
+        return num_entries;
+    }
+
+    // Bring the view up to date.  Devices are only re-checked back to the last
+    // second the previous refresh saw in the modification list (newest first),
+    // and every device is indexed the first time.
+    void refresh(const list<shared_ptr<kis_tracked_device_base> >& in_modified,
+            const vector<shared_ptr<kis_tracked_device_base> >& in_all) {
+        if (refresh_ts < 0) {
+            for (auto d : in_all)
+                update(d);
+        } else {
+            for (auto d : in_modified) {
+                if (d->get_last_time() < refresh_ts)
+                    break;
+
+                update(d);
+            }
+        }
+
+        if (in_modified.size() != 0)
+            refresh_ts = in_modified.front()->get_last_time();
+        else
+            refresh_ts = 0;
+    }
+
+    // Newest last_time checked by the last refresh, or -1 if the view has not
+    // been built
+    time_t refresh_ts;
+
+    // Walk device keys in order, or in reverse, starting at an offset, until
+    // the callback returns false
+    void walk(size_t in_offset, bool in_reverse, function<bool (uint64_t)> in_cb) {
+        if (!in_reverse) {
+            for (auto b = blocks.begin(); b != blocks.end(); ++b) {
+                if (in_offset >= b->size()) {
+                    in_offset -= b->size();
+                    continue;
+                }
+
+                for (auto e = b->begin() + in_offset; e != b->end(); ++e) {
+                    if (!in_cb(e->key))
+                        return;
+                }
+
+                in_offset = 0;
+            }
+        } else {
+            for (auto b = blocks.rbegin(); b != blocks.rend(); ++b) {
+                if (in_offset >= b->size()) {
+                    in_offset -= b->size();
+                    continue;
+                }
+
+                for (auto e = b->rbegin() + in_offset; e != b->rend(); ++e) {
+                    if (!in_cb(e->key))
+                        return;
+                }
+
+                in_offset = 0;
+            }
+        }
+    }
+
+protected:
+    class view_entry {
+    public:
+        view_entry(const T& in_value, uint64_t in_key) :
+            value(in_value), key(in_key) { }
+
+        bool operator<(const view_entry& e) const {
+            if (value < e.value)
+                return true;
+            if (e.value < value)
+                return false;
+            return key < e.key;
+        }
+
+        T value;
+        uint64_t key;
+    };
+
+    // First block which could hold the entry
+    typename vector<vector<view_entry> >::iterator find_block(const view_entry& e) {
+        auto b = std::lower_bound(blocks.begin(), blocks.end(), e,
+                [](const vector<view_entry>& blk, const view_entry& v) {
+                    return blk.back() < v;
+                });
+
+        if (b == blocks.end() && blocks.size() != 0)
+            --b;
+
+        return b;
+    }
+
+    void insert_entry(const view_entry& e) {
+        if (blocks.size() == 0) {
+            blocks.push_back(vector<view_entry>(1, e));
+            num_entries++;
+            return;
+        }
+
+        auto b = find_block(e);
+
+        b->insert(std::lower_bound(b->begin(), b->end(), e), e);
+        num_entries++;
+
+        if (b->size() >= DEVICE_VIEW_BLOCK * 2) {
+            vector<view_entry> upper(b->begin() + DEVICE_VIEW_BLOCK, b->end());
+            b->erase(b->begin() + DEVICE_VIEW_BLOCK, b->end());
+            blocks.insert(b + 1, std::move(upper));
+        }
+    }
+
+    void remove_entry(const view_entry& e) {
+        if (blocks.size() == 0)
+            return;
+
+        auto b = find_block(e);
+        auto i = std::lower_bound(b->begin(), b->end(), e);
+
+        if (i == b->end() || i->key != e.key)
+            return;
+
+        b->erase(i);
+        num_entries--;
+
+        if (b->size() == 0)
+            blocks.erase(b);
+    }
+
+    value_func get_value;
+
+    vector<vector<view_entry> > blocks;
+
+    // Value each device is currently indexed by
+    kis_u64_flat_map<T> values;
+
+    size_t num_entries;
+};
+
 class Devicetracker : public Kis_Net_Httpd_Chain_Stream_Handler,
     public TimetrackerEvent, public LifetimeGlobal {
 public:
@@ -690,8 +1152,68 @@ public:
     void MatchOnDevices(DevicetrackerFilterWorker *worker, 
             TrackerElementVector source_vec, bool batch = true);
 
-	typedef map<uint64_t, shared_ptr<kis_tracked_device_base> >::iterator device_itr;
-	typedef map<uint64_t, shared_ptr<kis_tracked_device_base> >::const_iterator const_device_itr;
+    // Add every device seen after a timestamp to a vector, newest first.  Uses
+    // the time-ordered modification list so only the changed devices are
+    // touched, instead of scanning every device
+    void FetchDevicesSince(time_t in_ts, SharedTrackerElement in_devvec);
+
+    // Refcounted list of all devices, frozen as of the last time a device was
+    // added or removed.  The list is shared by every caller until the device
+    // set changes and must not be modified; it can be walked without the
+    // devicelist lock, but the devices themselves still need it.
+    SharedTrackerElement FetchDeviceSnapshot();
+
+    // Summarize a list of devices into an output vector, taking the devicelist
+    // lock a batch of devices at a time so packet processing can run between
+    // batches.  Every summary is a serialized blob in the cache map, so the
+    // output can be serialized afterwards without holding the devicelist lock.
+    void SummarizeDevicesBatched(string in_format, SharedTrackerElement in_devices,
+            string in_projection, vector<SharedElementSummary>& in_summary_vec,
+            JsonAdapter::SummaryPlan *in_plan, SharedTrackerElement out_devvec,
+            TrackerElementSerializer::rename_map& rename_map,
+            TrackerElementSerializer::serial_cache_map& cache_map);
+
+    // File a device under an SSID it advertises or probes for, so it can be
+    // found by /devices/by-ssid; called by the phy handlers as SSIDs are seen
+    void IndexDeviceSSID(shared_ptr<kis_tracked_device_base> in_device,
+            const string& in_ssid);
+
+    // Add a group of named flags to the device flag index, for the "flags"
+    // filter of device list requests; see DevicetrackerFlagIndex.  Returns
+    // false if the names are taken or the index is full.
+    bool RegisterDeviceFlags(const vector<string>& in_names,
+            DevicetrackerFlagIndex::flag_func in_func);
+
+    // Serialize a complete device under the devicelist lock, re-using the cached
+    // output when the device has not changed.  Returns NULL if the format is
+    // unknown.
+    shared_ptr<string> SerializeDevice(string in_format, 
+            shared_ptr<kis_tracked_device_base> in_device);
+
+    // Device change events; see devicetracker_events.h.  Phy handlers report
+    // the changes they make to a device outside of UpdateCommonDevice, as
+    // DEVICE_EVENT_GROUP_ flags.
+    DeviceEventBus *FetchDeviceEvents() {
+        return &device_events;
+    }
+
+    void ReportDeviceChange(shared_ptr<kis_tracked_device_base> in_device,
+            unsigned int in_groups);
+
+    // Stop the parallel match threads
+
+    // Memory governor controls:  stop keeping the per-device data RRDs (total
+    // data and packet size bins) for new samples, and drop up to in_count of
+    // the least recently seen devices, returning how many were removed
+    void SetShedHistory(bool in_shed) {
+        shed_history = in_shed;
+    }
+
+    bool FetchShedHistory() {
+        return shed_history;
+    }
+
+    unsigned int ShedDevices(unsigned int in_count);
 
 	static void Usage(char *argv);
 
@@ -734,15 +1256,34 @@ public:
     shared_ptr<kis_tracked_device_base> UpdateCommonDevice(mac_addr in_mac, int in_phy,
             kis_packet *in_pack, unsigned int in_flags);
 
+    // Merge a duplicate of a frame seen by another source into a device the
+    // first copy updated:  the seenby record for the duplicate's source and the
+    // signal are updated, but the packet is not counted again
+    void MergeDuplicateSeenby(shared_ptr<kis_tracked_device_base> device,
+            KisDatasource *in_source, time_t in_ts, kis_layer1_packinfo *in_l1,
+            kis_gps_packinfo *in_gps);
+
     // HTTP handlers
     virtual bool Httpd_VerifyPath(const char *path, const char *method);
 
+    // All-device dumps use larger chunks
+    virtual size_t Httpd_Chain_Chunk_Size(const char *url);
+
     virtual int Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd,
             Kis_Net_Httpd_Connection *connection,
             const char *url, const char *method, const char *upload_data,
             size_t *upload_data_size);
 
     virtual int Httpd_PostComplete(Kis_Net_Httpd_Connection *concls);
+
+    virtual bool Httpd_StreamStructuredPost() { return true; }
+
+    // Summaries of the device list are shared while no devices are added or
+    // removed
+    virtual bool Httpd_CacheableResponse(const char *url, uint64_t *version);
+
+    // Single devices are tagged with their modification count
+    virtual bool Httpd_ETag(const char *url, uint64_t *etag);
     
     // Generate a list of all phys, serialized appropriately.  If specified,
     // wrap it in a dictionary and name it with the key in in_wrapper, which
@@ -789,17 +1330,47 @@ protected:
 
     int dt_length_id, dt_filter_id, dt_draw_id;
 
-	// Total # of packets
-	int num_packets;
-	int num_datapackets;
-	int num_errorpackets;
-	int num_filterpackets;
+    // Device and packet counts, kept as devices are added and removed and as
+    // packets are tracked, so the phy list and status don't walk the devices.
+    // Slot 0 is every phy and slot n + 1 is phy n; read without the
+    // devicelist mutex
+    struct phy_count_set {
+        std::atomic<int64_t> devices, packets, datapackets, cryptpackets,
+            errorpackets, filterpackets;
+    };
+    phy_count_set phy_counts[KIS_PHY_COUNTED_MAX + 1];
 
-	// Per-phy #s of packets
-	map<int, int> phy_packets;
-	map<int, int> phy_datapackets;
-	map<int, int> phy_errorpackets;
-	map<int, int> phy_filterpackets;
+    // Count set of a phy, or NULL if it isn't counted on its own
+    phy_count_set *fetch_phy_counts(int in_phy) {
+        if (in_phy == KIS_PHY_ANY)
+            return &(phy_counts[0]);
+
+        if (in_phy < 0 || in_phy >= KIS_PHY_COUNTED_MAX)
+            return NULL;
+
+        return &(phy_counts[in_phy + 1]);
+    }
+
+    // Add to a count of a phy and of the total
+    void inc_phy_count(int in_phy, std::atomic<int64_t> phy_count_set::*in_count,
+            int64_t in_num = 1) {
+        (phy_counts[0].*in_count).fetch_add(in_num, std::memory_order_relaxed);
+
+        phy_count_set *c = fetch_phy_counts(in_phy);
+
+        if (c != NULL && c != &(phy_counts[0]))
+            (c->*in_count).fetch_add(in_num, std::memory_order_relaxed);
+    }
+
+    // Per-phy packet counters for /metrics, under the phy name; -1 counts
+    // packets with no phy.  The counters are read by a scrape without the
+    // devicelist mutex
+    struct phy_metric_set {
+        shared_ptr<kis_metric_counter> packets, data, error, filtered;
+    };
+    map<int, phy_metric_set> phy_metrics;
+
+    void RegisterPhyMetrics(int in_phy, string in_phyname);
 
     // Total packet history
     int packets_rrd_id;
@@ -813,6 +1384,9 @@ protected:
     unsigned int max_num_devices;
     int max_devices_timer;
 
+    // Is the memory governor shedding device history?
+    std::atomic<bool> shed_history;
+
     // Timestamp for the last time we removed a device
     time_t full_refresh_time;
 
@@ -821,22 +1395,180 @@ protected:
 
     // Packet components we add or interact with
 	int pack_comp_device, pack_comp_common, pack_comp_basicdata,
-		pack_comp_radiodata, pack_comp_gps, pack_comp_datasrc;
+		pack_comp_radiodata, pack_comp_gps, pack_comp_datasrc, pack_comp_dedup;
 
-	// Tracked devices
-	map<uint64_t, shared_ptr<kis_tracked_device_base> > tracked_map;
+	// Tracked devices, indexed by key and by mac address.  In theory multiple
+    // objects in different PHYs could have the same MAC so the mac index is
+    // not a simple 1:1 map.  The index has its own per-shard locking and does
+    // not require the devicelist lock.
+    DevicetrackerIndex tracked_index;
 	// Vector of tracked devices so we can iterate them quickly
 	vector<shared_ptr<kis_tracked_device_base> > tracked_vec;
-    // MAC address lookups are incredibly expensive from the webui if we don't
-    // track by map; in theory multiple objects in different PHYs could have the
-    // same MAC so it's not a simple 1:1 map
-    multimap<mac_addr, shared_ptr<kis_tracked_device_base> > tracked_mac_multimap;
 
     // Immutable vector, one entry per device; may never be sorted.  Devices
     // which are removed are set to 'null'.  Each position corresponds to the
     // device ID.
     TrackerElementVector immutable_tracked_vec;
 
+    // Devices ordered by last_time, newest first, and the position of each
+    // device in the list by key.  Maintained by UpdateCommonDevice so that
+    // delta queries only cost the number of changed devices, and idle and
+    // max-device expiration only cost the number of devices expired, which
+    // are always at the back.  Protected by the devicelist lock.
+    //
+    // The list is split into one bucket per second of last_time; each bucket
+    // is found by the position of its first device, so a device is placed in
+    // the list without walking past the other devices seen that second.
+    typedef list<shared_ptr<kis_tracked_device_base> > modified_list_t;
+
+    class modified_entry {
+    public:
+        modified_list_t::iterator pos;
+        time_t bucket;
+    };
+
+    modified_list_t modified_list;
+    kis_u64_flat_map<modified_entry> modified_pos;
+    map<time_t, modified_list_t::iterator> modified_buckets;
+
+    // Move a device to its place in the modification list after its last_time
+    // advances, or remove it when it is forgotten
+    void UpdateModifiedList(shared_ptr<kis_tracked_device_base> in_device);
+    void RemoveModifiedList(shared_ptr<kis_tracked_device_base> in_device);
+    void EraseModifiedEntry(modified_entry *in_entry);
+
+    // Windowed device views, by the column they're sorted by.  A view is
+    // built the first time it is requested and refreshed from the modification
+    // list before each request after that, so a page costs the devices which
+    // changed since the last request and the devices on the page, not a sort
+    // of every device.  Protected by the devicelist lock.
+    DevicetrackerViewIndex<int64_t> view_last_time, view_signal, view_packets;
+    DevicetrackerViewIndex<string> view_manuf;
+    DevicetrackerViewIndex<std::pair<int64_t, string> > view_channel;
+
+    int device_view_total_id, device_view_filtered_id, device_view_offset_id;
+
+    // Devices by advertised and probed SSID, by OUI, and by current channel.
+    // Protected by the devicelist lock.
+    DevicetrackerTermIndex ssid_index, oui_index, channel_index;
+
+    // Devices by the locations they were seen at.  Protected by the devicelist
+    // lock.
+    DevicetrackerGridIndex location_index;
+
+    // Devices by their flags.  Protected by the devicelist lock.
+    DevicetrackerFlagIndex flag_index;
+
+    // Flag filter of a request, from the "flags" of the command: a list of flag
+    // names or a comma separated string of them.  Returns 0 if the request
+    // has no flag filter, 1 if it does, or negative with an explanation in
+    // ret_error if it names unknown flags.
+    int FlagQueryForRequest(SharedStructured in_structdata, uint64_t *ret_set,
+            uint64_t *ret_clear, string *ret_error);
+
+    // Devices matching a flag query, in id order; the devicelist lock must be
+    // held
+    vector<shared_ptr<kis_tracked_device_base> > FetchDevicesByFlags_nl(uint64_t in_set,
+            uint64_t in_clear);
+
+    // File a device under the grid cell of a location; fixes below 2d are
+    // ignored
+    void IndexDeviceLocation(shared_ptr<kis_tracked_device_base> in_device,
+            double in_lat, double in_lon, int in_fix);
+
+    // Devices, in any phy, seen inside a bounding box
+    vector<shared_ptr<kis_tracked_device_base> > FetchDevicesByLocation(
+            double in_min_lat, double in_min_lon, double in_max_lat, double in_max_lon);
+
+    // Index term for the OUI of a mac, "AA:BB:CC"
+    static string OuiTerm(mac_addr in_mac);
+
+    // Term index for a /devices/by-ssid, by-oui, or by-channel request, and
+    // the term as it is filed; NULL for any other request
+    DevicetrackerTermIndex *TermIndexForRequest(const string& in_type,
+            const string& in_term, string& out_term);
+
+    // Devices, in any phy, filed under a term
+    vector<shared_ptr<kis_tracked_device_base> > FetchDevicesByTerm(
+            DevicetrackerTermIndex& in_index, const string& in_term);
+
+    // Serve a window of a device view; see devicetracker_view.cc
+    int httpd_device_view(Kis_Net_Httpd_Connection *concls, std::ostream& stream,
+            SharedStructured structdata, vector<SharedElementSummary>& summary_vec,
+            string in_format);
+
+    // Write every device as typed columns of the requested fields, or the
+    // default columns if none are given; see devicetracker_columns.cc
+    int httpd_device_columns(Kis_Net_Httpd_Connection *concls, std::ostream& stream,
+            vector<SharedElementSummary>& summary_vec);
+
+    // Frozen device list from FetchDeviceSnapshot, and the device epoch it was
+    // taken at; the epoch advances whenever a device is added or removed
+    SharedTrackerElement device_snapshot;
+    uint64_t device_snapshot_epoch, device_epoch;
+
+    // Add a new device to the live device vector, or forget it completely
+    void AddTrackedDevice(shared_ptr<kis_tracked_device_base> in_device);
+    void RemoveTrackedDevice(shared_ptr<kis_tracked_device_base> in_device);
+
+    // Serialized output of devices, by device key, for each format and field
+    // projection they were recently requested in.  A record is re-used while the
+    // device modification version is unchanged; RRDs shift as time passes so the
+    // whole cache is dropped whenever the second changes.  Protected by the
+    // devicelist lock.
+    class device_serial_cache_rec {
+    public:
+        string format;
+        string projection;
+        uint32_t version;
+        shared_ptr<string> blob;
+    };
+
+    bool serial_cache_enabled;
+    time_t serial_cache_ts;
+    kis_u64_flat_map<shared_ptr<vector<device_serial_cache_rec> > > serial_cache;
+
+    // Build a key describing a field summary, for matching cached output
+    string SerialProjectionKey(vector<SharedElementSummary>& in_summary_vec);
+
+    // Summarize a device as SummarizeTrackerElement does, but re-use the cached
+    // serialized form of the device when it has not changed.  The returned
+    // element is added to the output vector, which must then be serialized in
+    // the same format with both the rename map and the cache map.  The summary
+    // is always serialized into the cache map (unless the format can't be
+    // serialized), so the output doesn't refer to the live device.
+    //
+    // With a summary plan from CompileSummaryPlan, the device is written
+    // through the plan instead of being summarized into a new map.
+    SharedTrackerElement SummarizeDeviceCached(string in_format,
+            SharedTrackerElement in_device, string in_projection,
+            vector<SharedElementSummary>& in_summary_vec,
+            TrackerElementSerializer::rename_map& rename_map,
+            TrackerElementSerializer::serial_cache_map& cache_map,
+            JsonAdapter::SummaryPlan *in_plan = NULL);
+
+    // Compile a field summary for a request, if the format can use one; NULL
+    // otherwise
+    shared_ptr<JsonAdapter::SummaryPlan> CompileSummaryPlan(string in_format,
+            vector<SharedElementSummary>& in_summary_vec);
+
+    bool summary_plan_enabled;
+
+    // Thread-safe filter workers are split into this many tasks per chunk and
+    // run on the high lane of the task pool.  Tasks are queued by MatchOnDevices
+    // while it holds the devicelist lock, and it waits for them to complete
+    // before releasing the lock.
+    unsigned int num_match_threads;
+    shared_ptr<KisTaskPool> match_pool;
+
+    void MatchOnDevicesParallel(DevicetrackerFilterWorker *worker,
+            TrackerElementVector source_vec);
+
+    // Devices to match in the next chunk under the devicelist lock.  Chunks
+    // for bulk http requests are resized from the time the last one held the
+    // lock, so they hold it for no more than the httpd bulk slice.
+    size_t MatchChunkSize(size_t in_default, size_t in_last, uint64_t in_last_usec);
+
 	// Filtering
 	FilterCore *track_filter;
 
@@ -854,6 +1586,266 @@ protected:
     pthread_mutex_t devicelist_mutex;
 
     shared_ptr<Devicetracker_Httpd_Pcap> httpd_pcap;
+
+    // Saved device state for warm restarts; see devicetracker_snapshot.cc.
+    //
+    // The snapshot from the previous run is mapped at startup and devices are
+    // only decoded when they are first looked up, or by a background timer
+    // which restores the rest a batch at a time.  Protected by the devicelist
+    // lock; snapshot_pending lets lookups skip the lock once everything has
+    // been restored.  The record and key tables are in kis_log_formats.h.
+
+    bool snapshot_enabled;
+    string snapshot_path;
+    int snapshot_timer, snapshot_restore_timer;
+    unsigned int snapshot_restore_rate;
+
+    std::atomic<bool> snapshot_pending;
+    uint8_t *snapshot_map;
+    size_t snapshot_map_len;
+    const snapshot_record *snapshot_records;
+    const snapshot_key *snapshot_keys;
+    uint64_t snapshot_num_records;
+    uint64_t snapshot_restore_pos;
+    uint64_t snapshot_num_restored;
+    vector<bool> snapshot_restored;
+    KbinAdapter::stream_fields snapshot_fields;
+
+    // Phy IDs are assigned at registration and can change between runs, so
+    // keys are translated by phy name; resolved on first use, once the phys
+    // have been registered
+    bool snapshot_phys_resolved;
+    map<int, string> snapshot_phy_names;
+    map<int, int> snapshot_phy_to_current, snapshot_phy_from_current;
+
+    void OpenSnapshot();
+    void CloseSnapshot();
+    int SaveSnapshot();
+    void ResolveSnapshotPhys();
+
+    // Restore a device by its current key, or the next batch of devices in the
+    // background; both take the devicelist lock
+    shared_ptr<kis_tracked_device_base> RestoreSnapshotDevice(uint64_t in_key);
+    void RestoreSnapshotBatch(uint64_t in_count);
+    shared_ptr<kis_tracked_device_base> RestoreSnapshotRecord(uint64_t in_record);
+
+    // Time the loaded snapshot was saved, or 0 if there was none
+    uint64_t snapshot_timestamp;
+
+    // Write-ahead journal of the device changes since the last snapshot, so a
+    // crash only loses the last journal interval; see devicetracker_snapshot.cc.
+    //
+    // A timer packs the devices which changed (by modification version) and
+    // the devices which were removed since the last pass into one batch, under
+    // the devicelist lock; a writer thread appends each batch with one synced
+    // write.  Nothing is written from the packet path.  A journal left by a
+    // crash is replayed over the snapshot it follows before the first saved
+    // device is restored, and is reset whenever a new snapshot is saved.
+    struct journal_batch {
+        bool reset;
+        uint64_t snapshot_ts;
+        string data;
+    };
+
+    bool journal_enabled;
+    string journal_path;
+    int journal_timer;
+
+    // Protected by the devicelist lock
+    time_t journal_last_ts;
+    std::unordered_map<uint64_t, uint32_t> journal_versions;
+    vector<uint64_t> journal_expired;
+    KbinAdapter::defined_fields journal_defined;
+    bool journal_new_run;
+    bool journal_replaying;
+
+    // Journal from the previous run, waiting to be replayed
+    bool journal_replay_pending;
+    vector<uint8_t> journal_replay;
+
+    // Writer; the file is only touched by the writer thread once it's running
+    FILE *journal_file;
+    std::thread journal_thread;
+    std::mutex journal_mutex;
+    std::condition_variable journal_cv;
+    vector<journal_batch> journal_queue;
+    bool journal_stop;
+    std::atomic<bool> journal_failed;
+
+    void OpenJournal();
+    void StopJournal();
+    void JournalThread();
+
+    // Queue the changes since the last pass, or start a new journal after a
+    // snapshot has been saved; both take the devicelist lock
+    void QueueJournal();
+    void ResetJournal(uint64_t in_snapshot_ts);
+
+    // Apply the journal from the previous run; must hold the devicelist lock
+    void ReplayJournal();
+
+    // Coalesced device updates; see devicetracker_coalesce.cc.
+    //
+    // With 'tracker_coalesce_updates' set, UpdateCommonDevice doesn't take the
+    // devicelist lock for devices which already exist.  The packet is added to
+    // a pending update for the device in a buffer owned by the calling thread,
+    // and the buffers are applied to the devices under the lock every
+    // 'tracker_coalesce_interval' milliseconds, and whenever a thread sees the
+    // second change.  New devices are still created and updated directly.
+    class coalesce_seenby {
+    public:
+        int source_number;
+        uuid source_uuid;
+        time_t first_time, last_time;
+        uint64_t packets;
+        vector<pair<double, uint64_t> > frequencies;
+    };
+
+    class coalesce_delta {
+    public:
+        coalesce_delta() {
+            last_time = 0;
+            packets = error_packets = data_packets = llc_packets = datasize = 0;
+            sampled_packets = 0;
+            for (unsigned int x = 0; x < 5; x++)
+                size_bins[x] = 0;
+            have_signal = false;
+            carriers = encodings = 0;
+            max_datarate = 0;
+            have_peak_loc = have_loc = false;
+            peak_lat = peak_lon = peak_alt = lat = lon = alt = 0;
+            peak_fix = fix = 0;
+            have_channel = false;
+            frequency = 0;
+        }
+
+        shared_ptr<kis_tracked_device_base> device;
+
+        time_t last_time;
+
+        uint64_t packets, error_packets, data_packets, llc_packets, datasize;
+
+        // Packets estimated from the weight of sampled packets
+        uint64_t sampled_packets;
+
+        // Data packets of up to 250, 500, 1000, and 1500 bytes, and jumbo
+        uint64_t size_bins[5];
+
+        // Weakest, strongest, and most recent signal, and what was seen across
+        // all of the packets
+        bool have_signal;
+        kis_layer1_packinfo sig_min, sig_max, sig_last;
+        uint64_t carriers, encodings;
+        double max_datarate;
+
+        // Location of the strongest signal, and the last location
+        bool have_peak_loc, have_loc;
+        double peak_lat, peak_lon, peak_alt, lat, lon, alt;
+        int peak_fix, fix;
+
+        bool have_channel;
+        string channel;
+        double frequency;
+
+        vector<pair<double, uint64_t> > frequencies;
+        vector<coalesce_seenby> seenby;
+    };
+
+    class coalesce_buffer {
+    public:
+        coalesce_buffer() {
+            sec = 0;
+        }
+
+        std::mutex mutex;
+
+        // Second the packet RRD samples of the pending updates fall in
+        time_t sec;
+
+        vector<coalesce_delta> deltas;
+        kis_u64_flat_map<size_t> delta_pos;
+    };
+
+    bool coalesce_enabled;
+    int coalesce_timer;
+
+    std::mutex coalesce_mutex;
+    vector<shared_ptr<coalesce_buffer> > coalesce_buffers;
+
+    // Buffer of the calling thread, registered the first time it's used
+    coalesce_buffer *FetchCoalesceBuffer();
+
+    // Add a packet to the pending update of an existing device; returns false
+    // if the packet has to update the device directly
+    bool CoalesceCommonDevice(shared_ptr<kis_tracked_device_base> in_device,
+            kis_packet *in_pack, unsigned int in_flags);
+
+    // Apply the pending updates of every thread, or of one buffer; both take
+    // the devicelist lock
+    void FlushCoalescedUpdates();
+    void FlushCoalesceBuffer(coalesce_buffer *in_buffer);
+    void ApplyCoalesceDelta(coalesce_delta& in_delta, time_t in_sec);
+
+    // Cold tier of idle devices; see devicetracker_cold.cc.
+    //
+    // With 'tracker_cold_idle' set, devices which haven't been seen for that
+    // many seconds are packed into a file mapped at startup and dropped from
+    // memory, leaving only their place in the file in cold_index.  FetchDevice
+    // thaws a cold device back into the tracker, so a new packet or a lookup by
+    // key brings it back; until then it's counted, but missing from views,
+    // searches, and device lists.  Protected by the devicelist lock; cold_count
+    // lets lookups skip the lock when nothing is cold.
+    struct cold_record {
+        uint64_t offset;
+        uint32_t length;
+        uint32_t reserved;
+        time_t last_time;
+    };
+
+    bool cold_enabled;
+    time_t cold_idle;
+    string cold_path;
+    int cold_timer;
+
+    uint8_t *cold_map;
+    size_t cold_map_len;
+
+    // End of the last record, and the bytes of the records still cold
+    uint64_t cold_end, cold_used;
+
+    std::atomic<uint64_t> cold_count;
+    kis_u64_flat_map<cold_record> cold_index;
+
+    // Every record is packed with the same set of defined fields, so a field is
+    // only named by the first record to use it; the definitions are kept here
+    // so records can be thawed in any order
+    KbinAdapter::defined_fields cold_defined;
+    KbinAdapter::stream_fields cold_fields;
+
+    // Freezing a device isn't an expiry as far as the journal is concerned
+    bool cold_freezing;
+
+    void OpenColdStore();
+    void CloseColdStore();
+
+    // Freeze the devices idle past the threshold, and forget the cold devices
+    // past the device timeout; takes the devicelist lock
+    void FreezeIdleDevices();
+
+    // Must hold the devicelist lock
+    bool FreezeDevice(shared_ptr<kis_tracked_device_base> in_device);
+    void CompactColdStore();
+    SharedTrackerElement UnpackColdRecord(const cold_record& in_record);
+
+    // Bring a cold device back into the tracker; takes the devicelist lock
+    shared_ptr<kis_tracked_device_base> ThawColdDevice(uint64_t in_key);
+
+    // Device change events, published every 'tracker_events_interval'
+    // milliseconds; see devicetracker_events.cc
+    DeviceEventBus device_events;
+    int device_events_timer;
+
+    void PublishDeviceEvents();
 };
 
 class kis_tracked_phy : public tracker_component {
@@ -969,6 +1961,39 @@ protected:
             vector<shared_ptr<kis_tracked_device_base> >)> fcb;
 };
 
+// Serializing worker which writes every device to a stream, in the order of
+// the source vector.  With match threads, devices are serialized in parallel
+// into a buffer per thread and the buffers are written in order as each chunk
+// completes.  The serialization function must be safe to call on different
+// devices from several threads at once.
+class devicetracker_serial_worker : public DevicetrackerFilterWorker {
+public:
+    devicetracker_serial_worker(GlobalRegistry *in_globalreg,
+            std::ostream& in_stream,
+            function<void (std::ostream&, shared_ptr<kis_tracked_device_base>)> in_scb);
+
+    virtual ~devicetracker_serial_worker();
+
+    virtual void MatchDevice(Devicetracker *devicetracker,
+            shared_ptr<kis_tracked_device_base> device);
+
+    virtual bool IsThreadSafe() { return true; }
+    virtual void PrepareSlots(unsigned int in_num_slots);
+    virtual void MatchDeviceSlot(Devicetracker *devicetracker,
+            shared_ptr<kis_tracked_device_base> device, unsigned int in_slot);
+    virtual void ChunkComplete(Devicetracker *devicetracker);
+
+protected:
+    GlobalRegistry *globalreg;
+
+    std::ostream& stream;
+
+    function<void (std::ostream&, shared_ptr<kis_tracked_device_base>)> scb;
+
+    // Per-thread output of the current chunk
+    vector<shared_ptr<std::stringstream> > slot_streams;
+};
+
 // Matching worker to match fields against a string search term
 
 class devicetracker_stringmatch_worker : public DevicetrackerFilterWorker {
@@ -991,10 +2016,20 @@ public:
 
     virtual void Finalize(Devicetracker *devicetracker);
 
+    virtual bool IsThreadSafe() { return true; }
+    virtual void PrepareSlots(unsigned int in_num_slots);
+    virtual void MatchDeviceSlot(Devicetracker *devicetracker,
+            shared_ptr<kis_tracked_device_base> device, unsigned int in_slot);
+
 protected:
+    bool match_device(shared_ptr<kis_tracked_device_base> device);
+
     GlobalRegistry *globalreg;
     shared_ptr<EntryTracker> entrytracker;
 
+    // Per-thread matches when running in parallel
+    vector<vector<shared_ptr<kis_tracked_device_base> > > slot_devices;
+
     string query;
     vector<vector<int> > fieldpaths;
 
@@ -1015,18 +2050,30 @@ public:
         pcre_filter() {
             re = NULL;
             study = NULL;
+            jit = false;
         }
 
         ~pcre_filter() {
             if (re != NULL)
                 pcre_free(re);
-            if (study != NULL)
+            if (study != NULL) {
+#ifdef PCRE_STUDY_JIT_COMPILE
+                pcre_free_study(study);
+#else
                 pcre_free(study);
+#endif
+            }
         }
 
         string target;
+        // Target resolved to field ids when the worker is built
+        vector<int> resolved_target;
+        // Source of the expression, when the worker compiled it
+        string regex;
         pcre *re;
         pcre_extra *study;
+        // Study produced JIT code
+        bool jit;
     };
 
     // Prepare the worker with a set of filters and the object we fill our
@@ -1066,10 +2113,35 @@ public:
 
     virtual void Finalize(Devicetracker *devicetracker);
 
+    virtual bool IsThreadSafe() { return true; }
+    virtual void PrepareSlots(unsigned int in_num_slots);
+    virtual void MatchDeviceSlot(Devicetracker *devicetracker,
+            shared_ptr<kis_tracked_device_base> device, unsigned int in_slot);
+
 protected:
+    // Compile and study (with JIT when libpcre has it) an expression into a
+    // filter; throws a runtime_error describing a bad expression
+    static void compile_filter(shared_ptr<devicetracker_pcre_worker::pcre_filter> filter,
+            string in_regex);
+
+    // Large filter sets, such as a SSID watchlist, mostly target the same
+    // field; fold the expressions for each field into a single alternation
+    // so each field is scanned once instead of once per expression
+    void combine_filters();
+
+    bool match_device(shared_ptr<kis_tracked_device_base> device,
+            pcre_jit_stack *in_jit_stack);
+
     GlobalRegistry *globalreg;
     shared_ptr<EntryTracker> entrytracker;
 
+    // Per-thread matches when running in parallel
+    vector<vector<shared_ptr<kis_tracked_device_base> > > slot_devices;
+
+    // Per-thread JIT stacks, the last one for serial matching; a combined
+    // expression can outgrow the default JIT stack
+    vector<pcre_jit_stack *> jit_stacks;
+
     vector<shared_ptr<devicetracker_pcre_worker::pcre_filter> > filter_vec;
     bool error;
 
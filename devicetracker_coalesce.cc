@@ -0,0 +1,433 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+#include "globalregistry.h"
+#include "util.h"
+#include "devicetracker.h"
+#include "packet.h"
+#include "gpstracker.h"
+#include "packinfo_signal.h"
+#include "kis_datasource.h"
+#include "packet_dedup.h"
+
+/* Coalesced device updates
+ *
+ * A busy device can be updated thousands of times a second, and each update
+ * took the devicelist lock.  When coalescing is enabled, a packet for a device
+ * which already exists is folded into a pending update for that device in a
+ * buffer owned by the thread processing it; the lock is only taken when the
+ * buffers are applied, so it's taken per device per interval instead of per
+ * packet.
+ *
+ * Counts, frequencies, and seenby records are added up exactly, and packet
+ * RRD samples are kept in the second they were seen in by applying a thread's
+ * buffer as soon as it sees the second change.  Of the signal levels, only the
+ * weakest, strongest, and most recent packets are applied, so the minimum,
+ * maximum, last, and peak location are exact but noise levels only reflect
+ * those packets; the location history gets the last fix of each update.
+ */
+
+// Signal level used to pick the weakest and strongest packets, 0 for none
+static int coalesce_signal_level(const kis_layer1_packinfo& in_l1) {
+    if (in_l1.signal_type == kis_l1_signal_type_dbm)
+        return in_l1.signal_dbm;
+    else if (in_l1.signal_type == kis_l1_signal_type_rssi)
+        return in_l1.signal_rssi;
+
+    return 0;
+}
+
+static void coalesce_count_frequency(vector<pair<double, uint64_t> >& in_freqs,
+        double in_freq, uint64_t in_count) {
+    for (auto& f : in_freqs) {
+        if (f.first == in_freq) {
+            f.second += in_count;
+            return;
+        }
+    }
+
+    in_freqs.push_back(std::make_pair(in_freq, in_count));
+}
+
+Devicetracker::coalesce_buffer *Devicetracker::FetchCoalesceBuffer() {
+    // The list keeps every buffer reachable by the flush timer, and keeps the
+    // buffer of a thread which has exited until the tracker goes away
+    static thread_local shared_ptr<coalesce_buffer> buffer;
+
+    if (buffer == NULL) {
+        buffer = std::make_shared<coalesce_buffer>();
+
+        std::lock_guard<std::mutex> lk(coalesce_mutex);
+        coalesce_buffers.push_back(buffer);
+    }
+
+    return buffer.get();
+}
+
+bool Devicetracker::CoalesceCommonDevice(shared_ptr<kis_tracked_device_base> in_device,
+        kis_packet *in_pack, unsigned int in_flags) {
+
+    kis_layer1_packinfo *pack_l1info =
+        (kis_layer1_packinfo *) in_pack->fetch(pack_comp_radiodata);
+    kis_gps_packinfo *pack_gpsinfo =
+        (kis_gps_packinfo *) in_pack->fetch(pack_comp_gps);
+    packetchain_comp_datasource *pack_datasrc =
+        (packetchain_comp_datasource *) in_pack->fetch(pack_comp_datasrc);
+    kis_common_info *pack_common =
+        (kis_common_info *) in_pack->fetch(pack_comp_common);
+    kis_packet_dedup *pack_dedup =
+        (kis_packet_dedup *) in_pack->fetch(pack_comp_dedup);
+
+    // The first copy of a deduplicated frame records its devices in the record
+    // it shares with the duplicates, under the devicelist lock
+    if ((in_flags & UCD_UPDATE_SEENBY) && pack_datasrc != NULL &&
+            pack_dedup != NULL && !pack_dedup->duplicate)
+        return false;
+
+    // The phy handler still changes nested records directly
+    in_device->bump_mod_version();
+
+    kis_tracked_device_info *devinfo =
+        (kis_tracked_device_info *) in_pack->fetch(pack_comp_device);
+
+    if (devinfo == NULL) {
+        devinfo = new kis_tracked_device_info;
+        devinfo->devref = in_device;
+        in_pack->insert(pack_comp_device, devinfo);
+    }
+
+    coalesce_buffer *buffer = FetchCoalesceBuffer();
+    time_t now = globalreg->timestamp.tv_sec;
+
+    std::unique_lock<std::mutex> lk(buffer->mutex);
+
+    // Packet RRD samples go in the second they were seen in, so what's pending
+    // from an earlier second is applied first
+    if (buffer->sec != now && buffer->deltas.size() != 0) {
+        lk.unlock();
+        FlushCoalesceBuffer(buffer);
+        lk.lock();
+    }
+
+    if (buffer->deltas.size() == 0)
+        buffer->sec = now;
+
+    coalesce_delta *d;
+    size_t *pos = buffer->delta_pos.find(in_device->get_key());
+
+    if (pos == NULL) {
+        buffer->delta_pos.insert(in_device->get_key(), buffer->deltas.size());
+        buffer->deltas.push_back(coalesce_delta());
+        d = &(buffer->deltas.back());
+        d->device = in_device;
+    } else {
+        d = &(buffer->deltas[*pos]);
+    }
+
+    if (d->last_time < in_pack->ts.tv_sec)
+        d->last_time = in_pack->ts.tv_sec;
+
+    // A packet kept by overload sampling counts for the ones dropped with it
+    uint64_t weight = in_pack->sample_weight;
+
+    if (in_flags & UCD_UPDATE_PACKETS) {
+        d->packets += weight;
+        d->sampled_packets += weight - 1;
+
+        if (pack_common != NULL) {
+            if (pack_common->error)
+                d->error_packets += weight;
+
+            if (pack_common->type == packet_basic_data) {
+                d->data_packets += weight;
+                d->datasize += pack_common->datasize * weight;
+
+                if (pack_common->datasize <= 250)
+                    d->size_bins[0] += weight;
+                else if (pack_common->datasize <= 500)
+                    d->size_bins[1] += weight;
+                else if (pack_common->datasize <= 1000)
+                    d->size_bins[2] += weight;
+                else if (pack_common->datasize <= 1500)
+                    d->size_bins[3] += weight;
+                else
+                    d->size_bins[4] += weight;
+            } else if (pack_common->type == packet_basic_mgmt ||
+                    pack_common->type == packet_basic_phy) {
+                d->llc_packets++;
+            }
+        }
+    }
+
+    if (in_flags & UCD_UPDATE_FREQUENCIES) {
+        if (pack_l1info != NULL) {
+            if (!(pack_l1info->channel == "0")) {
+                d->have_channel = true;
+                d->channel = pack_l1info->channel;
+            }
+
+            if (pack_l1info->freq_khz != 0)
+                d->frequency = pack_l1info->freq_khz;
+
+            int level = coalesce_signal_level(*pack_l1info);
+
+            if (!d->have_signal) {
+                d->have_signal = true;
+                d->sig_min = d->sig_max = *pack_l1info;
+
+                if (pack_gpsinfo != NULL) {
+                    d->have_peak_loc = true;
+                    d->peak_lat = pack_gpsinfo->lat;
+                    d->peak_lon = pack_gpsinfo->lon;
+                    d->peak_alt = pack_gpsinfo->alt;
+                    d->peak_fix = pack_gpsinfo->fix;
+                }
+            } else if (level != 0) {
+                int min_level = coalesce_signal_level(d->sig_min);
+                int max_level = coalesce_signal_level(d->sig_max);
+
+                if (min_level == 0 || level < min_level)
+                    d->sig_min = *pack_l1info;
+
+                if (max_level == 0 || level > max_level) {
+                    d->sig_max = *pack_l1info;
+
+                    d->have_peak_loc = pack_gpsinfo != NULL;
+
+                    if (pack_gpsinfo != NULL) {
+                        d->peak_lat = pack_gpsinfo->lat;
+                        d->peak_lon = pack_gpsinfo->lon;
+                        d->peak_alt = pack_gpsinfo->alt;
+                        d->peak_fix = pack_gpsinfo->fix;
+                    }
+                }
+            }
+
+            d->sig_last = *pack_l1info;
+            d->carriers |= (uint64_t) pack_l1info->carrier;
+            d->encodings |= (uint64_t) pack_l1info->encoding;
+
+            if (d->max_datarate < pack_l1info->datarate)
+                d->max_datarate = pack_l1info->datarate;
+
+            if ((int) pack_l1info->freq_khz > 0)
+                coalesce_count_frequency(d->frequencies, (int) pack_l1info->freq_khz,
+                        weight);
+        } else if (pack_common != NULL) {
+            if (!(pack_common->channel == "0")) {
+                d->have_channel = true;
+                d->channel = pack_common->channel;
+            }
+
+            if (pack_common->freq_khz != 0)
+                d->frequency = pack_common->freq_khz;
+
+            if ((int) pack_common->freq_khz > 0)
+                coalesce_count_frequency(d->frequencies, (int) pack_common->freq_khz,
+                        weight);
+        }
+
+        if (pack_common != NULL && !(pack_common->channel == "0")) {
+            d->have_channel = true;
+            d->channel = pack_common->channel;
+        }
+    }
+
+    if ((in_flags & UCD_UPDATE_LOCATION) && pack_gpsinfo != NULL) {
+        d->have_loc = true;
+        d->lat = pack_gpsinfo->lat;
+        d->lon = pack_gpsinfo->lon;
+        d->alt = pack_gpsinfo->alt;
+        d->fix = pack_gpsinfo->fix;
+    }
+
+    if ((in_flags & UCD_UPDATE_SEENBY) && pack_datasrc != NULL) {
+        KisDatasource *source = pack_datasrc->ref_source;
+        int source_number = source->get_source_number();
+        coalesce_seenby *sb = NULL;
+
+        for (auto& s : d->seenby) {
+            if (s.source_number == source_number) {
+                sb = &s;
+                break;
+            }
+        }
+
+        if (sb == NULL) {
+            d->seenby.push_back(coalesce_seenby());
+            sb = &(d->seenby.back());
+
+            sb->source_number = source_number;
+            sb->source_uuid = source->get_source_uuid();
+            sb->first_time = in_pack->ts.tv_sec;
+            sb->last_time = in_pack->ts.tv_sec;
+            sb->packets = 0;
+        }
+
+        sb->packets += weight;
+
+        if (sb->last_time < in_pack->ts.tv_sec)
+            sb->last_time = in_pack->ts.tv_sec;
+
+        if (pack_l1info != NULL && (int) pack_l1info->freq_khz > 0)
+            coalesce_count_frequency(sb->frequencies, (int) pack_l1info->freq_khz,
+                    weight);
+    }
+
+    return true;
+}
+
+void Devicetracker::FlushCoalescedUpdates() {
+    local_locker lock(&devicelist_mutex);
+
+    vector<shared_ptr<coalesce_buffer> > buffers;
+
+    {
+        std::lock_guard<std::mutex> lk(coalesce_mutex);
+        buffers = coalesce_buffers;
+    }
+
+    for (auto b : buffers)
+        FlushCoalesceBuffer(b.get());
+}
+
+void Devicetracker::FlushCoalesceBuffer(coalesce_buffer *in_buffer) {
+    // Always taken before the buffer lock, so buffers are applied in the order
+    // they were taken
+    local_locker lock(&devicelist_mutex);
+
+    vector<coalesce_delta> deltas;
+    time_t sec;
+
+    {
+        std::lock_guard<std::mutex> lk(in_buffer->mutex);
+
+        if (in_buffer->deltas.size() == 0)
+            return;
+
+        deltas.swap(in_buffer->deltas);
+        in_buffer->delta_pos.clear();
+        sec = in_buffer->sec;
+    }
+
+    for (auto& d : deltas)
+        ApplyCoalesceDelta(d, sec);
+}
+
+void Devicetracker::ApplyCoalesceDelta(coalesce_delta& in_delta, time_t in_sec) {
+    shared_ptr<kis_tracked_device_base> device = in_delta.device;
+
+    // Devices removed since the packets were seen stay removed
+    if (tracked_index.find(device->get_key()) != device)
+        return;
+
+    device->bump_mod_version();
+
+    if (device->get_last_time() < in_delta.last_time) {
+        device->set_last_time(in_delta.last_time);
+        UpdateModifiedList(device);
+    }
+
+    if (in_delta.packets != 0) {
+        device->inc_packets(in_delta.packets);
+        device->get_packets_rrd()->add_sample(in_delta.packets, in_sec);
+    }
+
+    if (in_delta.sampled_packets != 0)
+        device->inc_sampled_packets(in_delta.sampled_packets);
+
+    if (in_delta.error_packets != 0)
+        device->inc_error_packets(in_delta.error_packets);
+
+    if (in_delta.llc_packets != 0)
+        device->inc_llc_packets(in_delta.llc_packets);
+
+    if (in_delta.data_packets != 0) {
+        device->inc_data_packets(in_delta.data_packets);
+        device->inc_datasize(in_delta.datasize);
+
+        // The memory governor may be shedding everything but the totals
+        if (!shed_history) {
+            device->get_data_rrd()->add_sample(in_delta.datasize, in_sec);
+
+            if (in_delta.size_bins[0] != 0)
+                device->get_packet_rrd_bin_250()->add_sample(in_delta.size_bins[0], in_sec);
+            if (in_delta.size_bins[1] != 0)
+                device->get_packet_rrd_bin_500()->add_sample(in_delta.size_bins[1], in_sec);
+            if (in_delta.size_bins[2] != 0)
+                device->get_packet_rrd_bin_1000()->add_sample(in_delta.size_bins[2], in_sec);
+            if (in_delta.size_bins[3] != 0)
+                device->get_packet_rrd_bin_1500()->add_sample(in_delta.size_bins[3], in_sec);
+            if (in_delta.size_bins[4] != 0)
+                device->get_packet_rrd_bin_jumbo()->add_sample(in_delta.size_bins[4], in_sec);
+        }
+    }
+
+    if (in_delta.have_channel)
+        device->set_channel(in_delta.channel);
+
+    if (in_delta.frequency != 0)
+        device->set_frequency(in_delta.frequency);
+
+    if (in_delta.have_signal) {
+        kis_gps_packinfo peak_gps;
+
+        peak_gps.lat = in_delta.peak_lat;
+        peak_gps.lon = in_delta.peak_lon;
+        peak_gps.alt = in_delta.peak_alt;
+        peak_gps.fix = in_delta.peak_fix;
+
+        in_delta.sig_last.carrier = (phy_carrier_type) in_delta.carriers;
+        in_delta.sig_last.encoding = (phy_encoding_type) in_delta.encodings;
+        in_delta.sig_last.datarate = in_delta.max_datarate;
+
+        // Weakest first and most recent last, so the last signal is right
+        Packinfo_Sig_Combo weakest(&(in_delta.sig_min), NULL);
+        Packinfo_Sig_Combo strongest(&(in_delta.sig_max),
+                in_delta.have_peak_loc ? &peak_gps : NULL);
+        Packinfo_Sig_Combo last(&(in_delta.sig_last), NULL);
+
+        (*(device->get_signal_data())) += weakest;
+        (*(device->get_signal_data())) += strongest;
+        (*(device->get_signal_data())) += last;
+    }
+
+    for (auto f : in_delta.frequencies)
+        device->inc_frequency_count(f.first, f.second);
+
+    if (in_delta.have_channel)
+        channel_index.set(device->get_key(), device->get_channel());
+
+    if (in_delta.have_loc) {
+        device->get_location()->add_loc(in_delta.lat, in_delta.lon, in_delta.alt,
+                in_delta.fix);
+        IndexDeviceLocation(device, in_delta.lat, in_delta.lon, in_delta.fix);
+    }
+
+    for (auto& s : in_delta.seenby)
+        device->add_seenby_count(s.source_number, s.source_uuid, s.first_time,
+                s.last_time, s.packets, s.frequencies);
+}
+
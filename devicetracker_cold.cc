@@ -0,0 +1,309 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <sstream>
+#include <algorithm>
+
+#include "globalregistry.h"
+#include "util.h"
+#include "messagebus.h"
+#include "devicetracker.h"
+#include "kbin_adapter.h"
+
+/* Cold device store
+ *
+ * The store is scratch space for this run only:  the file is sized and mapped
+ * at startup and unlinked straight away, so nothing is left behind, and the
+ * records are kbin elements with no header in the native byte order, one after
+ * another.  Records are appended at the end; thawing a device leaves a hole,
+ * and the holes are squeezed out when the end reaches the end of the file.
+ */
+
+void Devicetracker::OpenColdStore() {
+    uint64_t size_mb =
+        globalreg->kismet_config->FetchOptUInt("tracker_cold_size", 256);
+
+    if (size_mb == 0) {
+        cold_enabled = false;
+        return;
+    }
+
+    int fd;
+
+    if ((fd = open(cold_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0) {
+        _MSG("Could not open cold device store '" + cold_path + "': " +
+                string(strerror(errno)) + "; idle devices will be kept in memory",
+                MSGFLAG_ERROR);
+        cold_enabled = false;
+        return;
+    }
+
+    size_t len = size_mb * 1024 * 1024;
+
+    if (ftruncate(fd, len) < 0) {
+        _MSG("Could not size cold device store '" + cold_path + "': " +
+                string(strerror(errno)) + "; idle devices will be kept in memory",
+                MSGFLAG_ERROR);
+        close(fd);
+        unlink(cold_path.c_str());
+        cold_enabled = false;
+        return;
+    }
+
+    void *m = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    unlink(cold_path.c_str());
+
+    if (m == MAP_FAILED) {
+        _MSG("Could not map cold device store '" + cold_path + "': " +
+                string(strerror(errno)) + "; idle devices will be kept in memory",
+                MSGFLAG_ERROR);
+        cold_enabled = false;
+        return;
+    }
+
+    cold_map = (uint8_t *) m;
+    cold_map_len = len;
+    cold_end = 0;
+    cold_used = 0;
+
+    stringstream ss;
+    ss << "Moving devices which have been inactive for more than " << cold_idle <<
+        " seconds to a " << size_mb << "MB store in '" << cold_path << "'";
+    _MSG(ss.str(), MSGFLAG_INFO);
+}
+
+void Devicetracker::CloseColdStore() {
+    if (cold_map != NULL)
+        munmap(cold_map, cold_map_len);
+
+    cold_map = NULL;
+    cold_map_len = 0;
+    cold_end = 0;
+    cold_used = 0;
+    cold_count = 0;
+    cold_index.clear();
+    cold_defined.clear();
+    cold_fields.clear();
+}
+
+void Devicetracker::CompactColdStore() {
+    vector<pair<uint64_t, cold_record *> > recs;
+
+    recs.reserve(cold_index.size());
+    cold_index.for_each([&recs](uint64_t k, cold_record& r) {
+            recs.push_back(std::make_pair(k, &r));
+        });
+
+    std::sort(recs.begin(), recs.end(),
+            [](const pair<uint64_t, cold_record *> &a,
+                const pair<uint64_t, cold_record *> &b) {
+                return a.second->offset < b.second->offset;
+            });
+
+    // Moving in offset order only ever moves a record down over space which
+    // has already been copied
+    uint64_t pos = 0;
+
+    for (auto r : recs) {
+        if (r.second->offset != pos)
+            memmove(cold_map + pos, cold_map + r.second->offset, r.second->length);
+
+        r.second->offset = pos;
+        pos += r.second->length;
+    }
+
+    cold_end = pos;
+    cold_used = pos;
+}
+
+bool Devicetracker::FreezeDevice(shared_ptr<kis_tracked_device_base> in_device) {
+    std::stringstream ss;
+    size_t num_defined = cold_defined.size();
+
+    KbinAdapter::Packer(globalreg, ss, in_device, cold_defined);
+
+    // Remember the names of anything this record defined first
+    if (cold_defined.size() != num_defined) {
+        for (auto f : cold_defined) {
+            if (cold_fields.find(f) == cold_fields.end())
+                KbinAdapter::DefineField(globalreg, cold_fields, f,
+                        entrytracker->GetFieldName(f));
+        }
+    }
+
+    string rec = ss.str();
+
+    if (rec.length() == 0 || rec.length() > cold_map_len)
+        return false;
+
+    if (cold_map_len - cold_end < rec.length()) {
+        if (cold_map_len - cold_used < rec.length())
+            return false;
+
+        CompactColdStore();
+    }
+
+    cold_record r;
+    r.offset = cold_end;
+    r.length = rec.length();
+    r.reserved = 0;
+    r.last_time = in_device->get_last_time();
+
+    memcpy(cold_map + cold_end, rec.data(), rec.length());
+
+    cold_end += r.length;
+    cold_used += r.length;
+
+    cold_index[in_device->get_key()] = r;
+    cold_count = cold_index.size();
+
+    // The device stays counted while it's cold
+    cold_freezing = true;
+    RemoveTrackedDevice(in_device);
+    cold_freezing = false;
+
+    inc_phy_count(DevicetrackerKey::GetPhy(in_device->get_key()), &phy_count_set::devices);
+
+    return true;
+}
+
+void Devicetracker::FreezeIdleDevices() {
+    local_locker lock(&devicelist_mutex);
+
+    if (cold_map == NULL)
+        return;
+
+    time_t ts_now = globalreg->timestamp.tv_sec;
+    bool frozen = false;
+
+    // Cold devices past the device timeout are forgotten as they would have
+    // been in memory
+    if (device_idle_expiration != 0 && cold_index.size() != 0) {
+        vector<uint64_t> expired;
+
+        cold_index.for_each([&](uint64_t k, cold_record& r) {
+                if (ts_now - r.last_time > device_idle_expiration)
+                    expired.push_back(k);
+            });
+
+        for (auto k : expired) {
+            cold_record *r = cold_index.find(k);
+
+            cold_used -= r->length;
+            cold_index.erase(k);
+
+            inc_phy_count(DevicetrackerKey::GetPhy(k), &phy_count_set::devices, -1);
+
+            if (journal_enabled && !journal_replaying)
+                journal_expired.push_back(k);
+
+            device_events.report(k, DEVICE_EVENT_EXPIRED, 0, ts_now);
+        }
+
+        cold_count = cold_index.size();
+    }
+
+    // The least recently seen devices are at the back of the modification
+    // list, so stop at the first one which is still live
+    while (modified_list.size() != 0) {
+        shared_ptr<kis_tracked_device_base> d = modified_list.back();
+
+        modified_entry *entry = modified_pos.find(d->get_key());
+
+        if (entry == NULL || ts_now - entry->bucket <= cold_idle)
+            break;
+
+        if (!FreezeDevice(d)) {
+            _MSG("Cold device store '" + cold_path + "' is full, idle devices "
+                    "will be kept in memory", MSGFLAG_ERROR);
+            break;
+        }
+
+        frozen = true;
+    }
+
+    if (frozen)
+        UpdateFullRefresh();
+}
+
+SharedTrackerElement Devicetracker::UnpackColdRecord(const cold_record& in_record) {
+    SharedTrackerElement e;
+
+    if (KbinAdapter::Unpacker(globalreg, cold_map + in_record.offset, in_record.length,
+                cold_fields, e) < 0 || e == NULL || e->get_type() != TrackerMap)
+        return NULL;
+
+    return e;
+}
+
+shared_ptr<kis_tracked_device_base> Devicetracker::ThawColdDevice(uint64_t in_key) {
+    local_locker lock(&devicelist_mutex);
+
+    // Thawed by someone else while we waited for the lock
+    shared_ptr<kis_tracked_device_base> device = tracked_index.find(in_key);
+
+    if (device != NULL)
+        return device;
+
+    cold_record *r = cold_index.find(in_key);
+
+    if (r == NULL)
+        return NULL;
+
+    SharedTrackerElement e = UnpackColdRecord(*r);
+
+    cold_used -= r->length;
+    cold_index.erase(in_key);
+    cold_count = cold_index.size();
+
+    // Everything has been thawed, so the store starts over from the beginning
+    if (cold_index.size() == 0) {
+        cold_end = 0;
+        cold_used = 0;
+    }
+
+    inc_phy_count(DevicetrackerKey::GetPhy(in_key), &phy_count_set::devices, -1);
+
+    if (e == NULL)
+        return NULL;
+
+    // As with a restored snapshot, the seen-by and phy-specific records are
+    // rebuilt as the device is seen again, since only the common device record
+    // knows how to import itself
+    e->del_map(entrytracker->GetFieldId("kismet.device.base.seenby"));
+
+    device.reset(new kis_tracked_device_base(globalreg, device_base_id, e));
+
+    device->set_key(in_key);
+
+    AddTrackedDevice(device);
+    UpdateModifiedList(device);
+
+    return device;
+}
@@ -0,0 +1,326 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "globalregistry.h"
+#include "util.h"
+#include "devicetracker.h"
+#include "entrytracker.h"
+#include "macaddr.h"
+
+/* Columnar device export
+ *
+ * Every device is written as one row of a table of typed columns, so a
+ * program loading the whole device list gets contiguous arrays instead of
+ * parsing an object per device.  Columns are filled a batch of devices at a
+ * time under the devicelist lock, and written out after the walk without it.
+ *
+ * The layout is described in README.DEV.SERIALIZATION; a Python decoder is in
+ * rest_examples/KismetRest/KismetRest/kcol.py
+ */
+
+#define KCOL_VERSION                1
+#define KCOL_FLAG_LITTLE_ENDIAN     0x01
+
+// Columns exported when the request doesn't list any
+static const char *device_column_defaults[] = {
+    "kismet.device.base.key",
+    "kismet.device.base.macaddr",
+    "kismet.device.base.phyname",
+    "kismet.device.base.type",
+    "kismet.device.base.name",
+    "kismet.device.base.manuf",
+    "kismet.device.base.channel",
+    "kismet.device.base.frequency",
+    "kismet.device.base.first_time",
+    "kismet.device.base.last_time",
+    "kismet.device.base.packets.total",
+    "kismet.device.base.signal/kismet.common.signal.last_signal_dbm",
+    "dot11.device/dot11.device.last_beaconed_ssid",
+    NULL
+};
+
+struct device_column {
+    string name;
+    vector<int> path;
+
+    // Type of the field, and the type it is widened to in the output
+    TrackerType field_type;
+    TrackerType column_type;
+
+    // One cell per device:  the bits of the widened value, or the
+    // dictionary code of a string.  Missing values are 0, and code 0 is
+    // always the empty string.
+    vector<uint64_t> cells;
+
+    vector<string> dictionary;
+    unordered_map<string, uint32_t> dictionary_codes;
+};
+
+// Widened column type for a field type, or TrackerUnassigned if the field
+// can't be a column
+static TrackerType device_column_type(TrackerType in_type) {
+    switch (in_type) {
+        case TrackerInt8:
+        case TrackerInt16:
+        case TrackerInt32:
+        case TrackerInt64:
+            return TrackerInt64;
+        case TrackerUInt8:
+        case TrackerUInt16:
+        case TrackerUInt32:
+        case TrackerUInt64:
+            return TrackerUInt64;
+        case TrackerFloat:
+        case TrackerDouble:
+            return TrackerDouble;
+        case TrackerString:
+            return TrackerString;
+        case TrackerMac:
+            return TrackerMac;
+        default:
+            return TrackerUnassigned;
+    }
+}
+
+static void device_column_add(device_column& col, SharedTrackerElement in_elem) {
+    uint64_t v = 0;
+
+    if (in_elem == NULL || in_elem->get_type() != col.field_type) {
+        col.cells.push_back(v);
+        return;
+    }
+
+    switch (col.field_type) {
+        case TrackerInt8:
+            v = (uint64_t) (int64_t) in_elem->get_int8();
+            break;
+        case TrackerInt16:
+            v = (uint64_t) (int64_t) in_elem->get_int16();
+            break;
+        case TrackerInt32:
+            v = (uint64_t) (int64_t) in_elem->get_int32();
+            break;
+        case TrackerInt64:
+            v = (uint64_t) in_elem->get_int64();
+            break;
+        case TrackerUInt8:
+            v = in_elem->get_uint8();
+            break;
+        case TrackerUInt16:
+            v = in_elem->get_uint16();
+            break;
+        case TrackerUInt32:
+            v = in_elem->get_uint32();
+            break;
+        case TrackerUInt64:
+            v = in_elem->get_uint64();
+            break;
+        case TrackerFloat: {
+            double d = in_elem->get_float();
+            memcpy(&v, &d, sizeof(v));
+            break;
+        }
+        case TrackerDouble: {
+            double d = in_elem->get_double();
+            memcpy(&v, &d, sizeof(v));
+            break;
+        }
+        case TrackerMac:
+            v = in_elem->get_mac().longmac;
+            break;
+        case TrackerString: {
+            string s = in_elem->get_string();
+            auto ci = col.dictionary_codes.find(s);
+
+            if (ci != col.dictionary_codes.end()) {
+                v = ci->second;
+            } else {
+                v = col.dictionary.size();
+                col.dictionary_codes[s] = v;
+                col.dictionary.push_back(s);
+            }
+
+            break;
+        }
+        default:
+            break;
+    }
+
+    col.cells.push_back(v);
+}
+
+// Values go out in native order, the header tells the decoder which
+template<typename T> static inline void kcol_put(std::ostream &stream, T v) {
+    stream.write((const char *) &v, sizeof(T));
+}
+
+static void device_column_write(std::ostream& stream, const device_column& col) {
+    uint16_t namelen = col.name.length() > 0xFFFF ? 0xFFFF : col.name.length();
+    kcol_put<uint16_t>(stream, namelen);
+    stream.write(col.name.data(), namelen);
+    kcol_put<uint8_t>(stream, col.column_type);
+
+    if (col.column_type != TrackerString) {
+        stream.write((const char *) col.cells.data(),
+                col.cells.size() * sizeof(uint64_t));
+        return;
+    }
+
+    kcol_put<uint32_t>(stream, col.dictionary.size());
+
+    for (const auto& s : col.dictionary) {
+        kcol_put<uint32_t>(stream, s.length());
+        stream.write(s.data(), s.length());
+    }
+
+    // Codes are written in blocks so the stream sees a few large writes
+    uint32_t codes[1024];
+    size_t n = 0;
+
+    for (auto c : col.cells) {
+        codes[n++] = (uint32_t) c;
+
+        if (n == 1024) {
+            stream.write((const char *) codes, sizeof(codes));
+            n = 0;
+        }
+    }
+
+    if (n != 0)
+        stream.write((const char *) codes, n * sizeof(uint32_t));
+}
+
+int Devicetracker::httpd_device_columns(Kis_Net_Httpd_Connection *concls,
+        std::ostream& stream, vector<SharedElementSummary>& summary_vec) {
+
+    vector<SharedElementSummary> defaults;
+
+    if (summary_vec.size() == 0) {
+        for (unsigned int x = 0; device_column_defaults[x] != NULL; x++) {
+            SharedElementSummary s(new TrackerElementSummary(device_column_defaults[x],
+                        entrytracker));
+
+            // Fields of phys which aren't loaded are left out
+            bool resolved = s->resolved_path.size() != 0;
+
+            for (auto p : s->resolved_path)
+                if (p < 0)
+                    resolved = false;
+
+            if (resolved)
+                defaults.push_back(s);
+        }
+    }
+
+    vector<SharedElementSummary>& fields =
+        summary_vec.size() == 0 ? defaults : summary_vec;
+
+    vector<device_column> columns;
+    columns.resize(fields.size());
+
+    for (unsigned int x = 0; x < fields.size(); x++) {
+        device_column& col = columns[x];
+
+        col.path = fields[x]->resolved_path;
+
+        SharedTrackerElement instance;
+
+        if (col.path.size() != 0 && col.path[col.path.size() - 1] >= 0)
+            instance = entrytracker->GetTrackedInstance(col.path[col.path.size() - 1]);
+
+        if (instance == NULL) {
+            stream << "Invalid request: Unknown field in column " << x;
+            concls->httpcode = 400;
+            return MHD_YES;
+        }
+
+        col.field_type = instance->get_type();
+        col.column_type = device_column_type(col.field_type);
+
+        if (col.column_type == TrackerUnassigned) {
+            stream << "Invalid request: Column " << x << " is not a scalar field";
+            concls->httpcode = 400;
+            return MHD_YES;
+        }
+
+        if (fields[x]->rename.length() != 0)
+            col.name = fields[x]->rename;
+        else
+            col.name = entrytracker->GetFieldName(col.path[col.path.size() - 1]);
+
+        col.dictionary.push_back("");
+        col.dictionary_codes[""] = 0;
+    }
+
+    SharedTrackerElement devices = FetchDeviceSnapshot();
+    TrackerElementVector devvec(devices);
+
+    for (auto& col : columns)
+        col.cells.reserve(devvec.size());
+
+    uint64_t rows = 0;
+
+    devicetracker_function_worker fw(globalreg,
+            [&columns, &rows](Devicetracker *,
+                shared_ptr<kis_tracked_device_base> d) -> bool {
+                for (auto& col : columns) {
+                    SharedTrackerElement e;
+
+                    try {
+                        e = GetTrackerElementPath(col.path, d);
+                    } catch (std::runtime_error& x) {
+                        e = NULL;
+                    }
+
+                    device_column_add(col, e);
+                }
+
+                rows++;
+
+                return false;
+            }, NULL);
+
+    MatchOnDevices(&fw, devvec);
+
+    uint8_t flags = 0;
+    uint16_t probe = 1;
+
+    if (*((uint8_t *) &probe) == 1)
+        flags |= KCOL_FLAG_LITTLE_ENDIAN;
+
+    stream.write("KCOL", 4);
+    kcol_put<uint8_t>(stream, KCOL_VERSION);
+    kcol_put<uint8_t>(stream, flags);
+    kcol_put<uint32_t>(stream, columns.size());
+    kcol_put<uint64_t>(stream, rows);
+
+    for (auto& col : columns)
+        device_column_write(stream, col);
+
+    return MHD_YES;
+}
+
@@ -19,6 +19,7 @@
 #include "config.h"
 
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 #include <list>
 #include <map>
@@ -31,6 +32,7 @@
 #include <pthread.h>
 
 #include "devicetracker_component.h"
+#include "wifi_ht_channels.h"
 
 kis_tracked_ip_data::kis_tracked_ip_data(GlobalRegistry *in_globalreg, int in_id) : 
     tracker_component(in_globalreg, in_id) {
@@ -77,217 +79,180 @@ SharedTrackerElement kis_tracked_signal_data::clone_type() {
     return SharedTrackerElement(new kis_tracked_signal_data(globalreg, get_id()));
 }
 
-kis_tracked_signal_data& kis_tracked_signal_data::operator+= (const kis_layer1_packinfo& lay1) {
-    if (lay1.signal_type == kis_l1_signal_type_dbm) {
-        if (lay1.signal_dbm != 0) {
+// Tracked fields of each packed statistic, in the order of signal_stats
+SharedTrackerElement kis_tracked_signal_data::* const 
+    kis_tracked_signal_data::stat_fields[sig_num_stats] = {
+    &kis_tracked_signal_data::last_signal_dbm, &kis_tracked_signal_data::last_noise_dbm,
+    &kis_tracked_signal_data::last_signal_rssi, &kis_tracked_signal_data::last_noise_rssi,
+    &kis_tracked_signal_data::min_signal_dbm, &kis_tracked_signal_data::min_noise_dbm,
+    &kis_tracked_signal_data::min_signal_rssi, &kis_tracked_signal_data::min_noise_rssi,
+    &kis_tracked_signal_data::max_signal_dbm, &kis_tracked_signal_data::max_noise_dbm,
+    &kis_tracked_signal_data::max_signal_rssi, &kis_tracked_signal_data::max_noise_rssi,
+};
+
+// All ones for true, for selecting without a branch
+static inline int32_t sig_mask(bool in_b) {
+    return -((int32_t) in_b);
+}
 
-            last_signal_dbm->set((int32_t) lay1.signal_dbm);
+static inline int32_t sig_select(int32_t in_mask, int32_t in_a, int32_t in_b) {
+    return (in_a & in_mask) | (in_b & ~in_mask);
+}
 
-            if ((*min_signal_dbm) == (int32_t) 0 ||
-                    (*min_signal_dbm) > (int32_t) lay1.signal_dbm) {
-                min_signal_dbm->set((int32_t) lay1.signal_dbm);
-            }
+unsigned int kis_tracked_signal_data::fold_signal(const kis_layer1_packinfo& lay1) {
+    // Only the readings of the type the packet was measured in count, and a
+    // reading of 0 is no reading at all
+    int32_t dbm = sig_mask(lay1.signal_type == kis_l1_signal_type_dbm);
+    int32_t rssi = sig_mask(lay1.signal_type == kis_l1_signal_type_rssi);
 
-            if ((*max_signal_dbm) == (int32_t) 0 ||
-                    (*max_signal_dbm) < (int32_t) lay1.signal_dbm) {
-                max_signal_dbm->set((int32_t) lay1.signal_dbm);
-            }
-        }
+    const int32_t sample[sig_num_readings] = {
+        (int32_t) lay1.signal_dbm, (int32_t) lay1.noise_dbm,
+        (int32_t) lay1.signal_rssi, (int32_t) lay1.noise_rssi
+    };
 
-        if (lay1.noise_dbm != 0) {
-            last_noise_dbm->set((int32_t) lay1.noise_dbm);
+    const int32_t type_mask[sig_num_readings] = { dbm, dbm, rssi, rssi };
 
-            if ((*min_noise_dbm) == (int32_t) 0 ||
-                    (*min_noise_dbm) > (int32_t) lay1.noise_dbm) {
-                min_noise_dbm->set((int32_t) lay1.noise_dbm);
-            }
+    int32_t *last = stats.values;
+    int32_t *min = stats.values + sig_num_readings;
+    int32_t *max = stats.values + (2 * sig_num_readings);
 
-            if ((*max_noise_dbm) == (int32_t) 0 ||
-                    (*max_noise_dbm) < (int32_t) lay1.noise_dbm) {
-                max_noise_dbm->set((int32_t) lay1.noise_dbm);
-            }
-        }
-    } else if (lay1.signal_type == kis_l1_signal_type_rssi) {
-        if (lay1.signal_rssi != 0) {
-            last_signal_rssi->set((int32_t) lay1.signal_rssi);
+    unsigned int changed = 0;
 
-            if ((*min_signal_rssi) == (int32_t) 0 ||
-                    (*min_signal_rssi) > (int32_t) lay1.signal_rssi) {
-                min_signal_dbm->set((int32_t) lay1.signal_rssi);
-            }
+    // An empty min or max (0) takes any reading
+    for (unsigned int i = 0; i < sig_num_readings; i++) {
+        int32_t v = sample[i];
+        int32_t valid = type_mask[i] & sig_mask(v != 0);
 
-            if ((*max_signal_rssi) == (int32_t) 0 ||
-                    (*max_signal_rssi) < (int32_t) lay1.signal_rssi) {
-                max_signal_rssi->set((int32_t) lay1.signal_rssi);
-            }
-        }
+        int32_t lo = valid & (sig_mask(min[i] == 0) | sig_mask(v < min[i]));
+        int32_t hi = valid & (sig_mask(max[i] == 0) | sig_mask(v > max[i]));
 
-        if (lay1.noise_rssi != 0) {
-            last_noise_rssi->set((int32_t) lay1.noise_rssi);
+        int32_t nlast = sig_select(valid, v, last[i]);
+        int32_t nmin = sig_select(lo, v, min[i]);
+        int32_t nmax = sig_select(hi, v, max[i]);
 
-            if ((*min_noise_rssi) == (int32_t) 0 ||
-                    (*min_noise_rssi) > (int32_t) lay1.noise_rssi) {
-                min_noise_rssi->set((int32_t) lay1.noise_rssi);
-            }
+        changed |= ((unsigned int) (nlast != last[i])) << i;
+        changed |= ((unsigned int) (nmin != min[i])) << (i + sig_num_readings);
+        changed |= ((unsigned int) (nmax != max[i])) << (i + 2 * sig_num_readings);
 
-            if ((*max_noise_rssi) == (int32_t) 0 ||
-                    (*max_noise_rssi) < (int32_t) lay1.noise_rssi) {
-                max_noise_rssi->set((int32_t) lay1.noise_rssi);
-            }
-        }
-
-        (*carrierset) |= (uint64_t) lay1.carrier;
-        (*encodingset) |= (uint64_t) lay1.encoding;
-
-        if ((*maxseenrate) < (double) lay1.datarate) {
-            maxseenrate->set((double) lay1.datarate);
-        }
+        last[i] = nlast;
+        min[i] = nmin;
+        max[i] = nmax;
     }
 
-    return *this;
-}
+    unsigned int ret = changed;
 
-kis_tracked_signal_data& kis_tracked_signal_data::operator+= (const Packinfo_Sig_Combo& in) {
-    if (in.lay1 != NULL) {
-        if (in.lay1->signal_type == kis_l1_signal_type_dbm) {
-            if (in.lay1->signal_dbm != 0) {
-
-                last_signal_dbm->set((int32_t) in.lay1->signal_dbm);
-
-                if ((*min_signal_dbm) == (int32_t) 0 ||
-                        (*min_signal_dbm) > (int32_t) in.lay1->signal_dbm) {
-                    min_signal_dbm->set((int32_t) in.lay1->signal_dbm);
-                }
+    // Write back only what moved; usually just the last readings
+    for (unsigned int i = 0; changed != 0; i++, changed >>= 1) {
+        if (changed & 1)
+            tracker_fast_access<int32_t>::set(this->*stat_fields[i], stats.values[i]);
+    }
 
-                if ((*max_signal_dbm) == (int32_t) 0 ||
-                        (*max_signal_dbm) < (int32_t) in.lay1->signal_dbm) {
-                    max_signal_dbm->set((int32_t) in.lay1->signal_dbm);
+    if ((stats.carrierset | (uint64_t) lay1.carrier) != stats.carrierset) {
+        stats.carrierset |= (uint64_t) lay1.carrier;
+        tracker_fast_access<uint64_t>::set(carrierset, stats.carrierset);
+    }
 
-                    if (in.gps != NULL) {
-                        get_peak_loc()->set(in.gps->lat, in.gps->lon, in.gps->alt, 
-                                in.gps->fix);
-                    }
-                }
+    if ((stats.encodingset | (uint64_t) lay1.encoding) != stats.encodingset) {
+        stats.encodingset |= (uint64_t) lay1.encoding;
+        tracker_fast_access<uint64_t>::set(encodingset, stats.encodingset);
+    }
 
-                get_signal_min_rrd()->add_sample(in.lay1->signal_dbm, 
-                        globalreg->timestamp.tv_sec);
-            }
+    if (stats.maxseenrate < (double) lay1.datarate) {
+        stats.maxseenrate = lay1.datarate;
+        tracker_fast_access<double>::set(maxseenrate, stats.maxseenrate);
+    }
 
-            if (in.lay1->noise_dbm != 0) {
-                last_noise_dbm->set((int32_t) in.lay1->noise_dbm);
+    return ret;
+}
 
-                if ((*min_noise_dbm) == (int32_t) 0 ||
-                        (*min_noise_dbm) > (int32_t) in.lay1->noise_dbm) {
-                    min_noise_dbm->set((int32_t) in.lay1->noise_dbm);
-                }
+kis_tracked_signal_data& kis_tracked_signal_data::operator+= (const kis_layer1_packinfo& lay1) {
+    fold_signal(lay1);
 
-                if ((*max_noise_dbm) == (int32_t) 0 ||
-                        (*max_noise_dbm) < (int32_t) in.lay1->noise_dbm) {
-                    max_noise_dbm->set((int32_t) in.lay1->noise_dbm);
-                }
-            }
-        } else if (in.lay1->signal_type == kis_l1_signal_type_rssi) {
-            if (in.lay1->signal_rssi != 0) {
-                last_signal_rssi->set((int32_t) in.lay1->signal_rssi);
-
-                if ((*min_signal_rssi) == (int32_t) 0 ||
-                        (*min_signal_rssi) > (int32_t) in.lay1->signal_rssi) {
-                    min_signal_dbm->set((int32_t) in.lay1->signal_rssi);
-                }
-
-                if ((*max_signal_rssi) == (int32_t) 0 ||
-                        (*max_signal_rssi) < (int32_t) in.lay1->signal_rssi) {
-                    max_signal_rssi->set((int32_t) in.lay1->signal_rssi);
-
-                    if (in.gps != NULL) {
-                        get_peak_loc()->set(in.gps->lat, in.gps->lon, in.gps->alt, 
-                                in.gps->fix);
-                    }
-                }
-
-                get_signal_min_rrd()->add_sample(in.lay1->signal_rssi, 
-                        globalreg->timestamp.tv_sec);
-            }
+    return *this;
+}
 
-            if (in.lay1->noise_rssi != 0) {
-                last_noise_rssi->set((int32_t) in.lay1->noise_rssi);
+kis_tracked_signal_data& kis_tracked_signal_data::operator+= (const Packinfo_Sig_Combo& in) {
+    if (in.lay1 == NULL)
+        return *this;
 
-                if ((*min_noise_rssi) == (int32_t) 0 ||
-                        (*min_noise_rssi) > (int32_t) in.lay1->noise_rssi) {
-                    min_noise_rssi->set((int32_t) in.lay1->noise_rssi);
-                }
+    unsigned int changed = fold_signal(*(in.lay1));
 
-                if ((*max_noise_rssi) == (int32_t) 0 ||
-                        (*max_noise_rssi) < (int32_t) in.lay1->noise_rssi) {
-                    max_noise_rssi->set((int32_t) in.lay1->noise_rssi);
-                }
-            }
+    int32_t sample = 0;
+    bool peak = false;
 
-        }
+    if (in.lay1->signal_type == kis_l1_signal_type_dbm) {
+        sample = in.lay1->signal_dbm;
+        peak = changed & (1 << (sig_max + sig_signal_dbm));
+    } else if (in.lay1->signal_type == kis_l1_signal_type_rssi) {
+        sample = in.lay1->signal_rssi;
+        peak = changed & (1 << (sig_max + sig_signal_rssi));
+    }
 
-        (*carrierset) |= (uint64_t) in.lay1->carrier;
-        (*encodingset) |= (uint64_t) in.lay1->encoding;
+    if (sample != 0) {
+        if (peak && in.gps != NULL)
+            get_peak_loc()->set(in.gps->lat, in.gps->lon, in.gps->alt, in.gps->fix);
 
-        if ((*maxseenrate) < (double) in.lay1->datarate) {
-            maxseenrate->set((double) in.lay1->datarate);
-        }
+        get_signal_min_rrd()->add_sample(sample, globalreg->timestamp.tv_sec);
     }
 
     return *this;
 }
 
+const tracker_field_desc<kis_tracked_signal_data> kis_tracked_signal_data::field_desc[] = {
+    __TrackerField(kis_tracked_signal_data, "kismet.common.signal.last_signal_dbm",
+            TrackerInt32, "most recent signal (dBm)", last_signal_dbm),
+    __TrackerField(kis_tracked_signal_data, "kismet.common.signal.last_noise_dbm",
+            TrackerInt32, "most recent noise (dBm)", last_noise_dbm),
+
+    __TrackerField(kis_tracked_signal_data, "kismet.common.signal.min_signal_dbm",
+            TrackerInt32, "minimum signal (dBm)", min_signal_dbm),
+    __TrackerField(kis_tracked_signal_data, "kismet.common.signal.min_noise_dbm",
+            TrackerInt32, "minimum noise (dBm)", min_noise_dbm),
+
+    __TrackerField(kis_tracked_signal_data, "kismet.common.signal.max_signal_dbm",
+            TrackerInt32, "maximum signal (dBm)", max_signal_dbm),
+    __TrackerField(kis_tracked_signal_data, "kismet.common.signal.max_noise_dbm",
+            TrackerInt32, "maximum noise (dBm)", max_noise_dbm),
+
+    __TrackerField(kis_tracked_signal_data, "kismet.common.signal.last_signal_rssi",
+            TrackerInt32, "most recent signal (RSSI)", last_signal_rssi),
+    __TrackerField(kis_tracked_signal_data, "kismet.common.signal.last_noise_rssi",
+            TrackerInt32, "most recent noise (RSSI)", last_noise_rssi),
+
+    __TrackerField(kis_tracked_signal_data, "kismet.common.signal.min_signal_rssi",
+            TrackerInt32, "minimum signal (rssi)", min_signal_rssi),
+    __TrackerField(kis_tracked_signal_data, "kismet.common.signal.min_noise_rssi",
+            TrackerInt32, "minimum noise (RSSI)", min_noise_rssi),
+
+    __TrackerField(kis_tracked_signal_data, "kismet.common.signal.max_signal_rssi",
+            TrackerInt32, "maximum signal (RSSI)", max_signal_rssi),
+    __TrackerField(kis_tracked_signal_data, "kismet.common.signal.max_noise_rssi",
+            TrackerInt32, "maximum noise (RSSI)", max_noise_rssi),
+
+    __TrackerComplexField(kis_tracked_signal_data, kis_tracked_location_triplet,
+            "kismet.common.signal.peak_loc", "location of strongest signal", 
+            peak_loc_id),
+
+    __TrackerField(kis_tracked_signal_data, "kismet.common.signal.maxseenrate",
+            TrackerDouble, "maximum observed data rate (phy dependent)", maxseenrate),
+    __TrackerField(kis_tracked_signal_data, "kismet.common.signal.encodingset",
+            TrackerUInt64, "bitset of observed encodings", encodingset),
+    __TrackerField(kis_tracked_signal_data, "kismet.common.signal.carrierset",
+            TrackerUInt64, "bitset of observed carrier types", carrierset),
+
+    __TrackerComplexField(kis_tracked_signal_data, 
+            kis_tracked_minute_rrd<kis_tracked_rrd_peak_signal_aggregator>,
+            "kismet.common.signal.signal_rrd", "signal data for past minute",
+            signal_min_rrd_id),
+};
+
+tracker_field_table<kis_tracked_signal_data> 
+    kis_tracked_signal_data::field_table(kis_tracked_signal_data::field_desc);
+
 void kis_tracked_signal_data::register_fields() {
     tracker_component::register_fields();
 
-    RegisterField("kismet.common.signal.last_signal_dbm", TrackerInt32,
-            "most recent signal (dBm)", &last_signal_dbm);
-    RegisterField("kismet.common.signal.last_noise_dbm", TrackerInt32,
-            "most recent noise (dBm)", &last_noise_dbm);
-
-    RegisterField("kismet.common.signal.min_signal_dbm", TrackerInt32,
-            "minimum signal (dBm)", &min_signal_dbm);
-    RegisterField("kismet.common.signal.min_noise_dbm", TrackerInt32,
-            "minimum noise (dBm)", &min_noise_dbm);
-
-    RegisterField("kismet.common.signal.max_signal_dbm", TrackerInt32,
-            "maximum signal (dBm)", &max_signal_dbm);
-    RegisterField("kismet.common.signal.max_noise_dbm", TrackerInt32,
-            "maximum noise (dBm)", &max_noise_dbm);
-
-    RegisterField("kismet.common.signal.last_signal_rssi", TrackerInt32,
-            "most recent signal (RSSI)", &last_signal_rssi);
-    RegisterField("kismet.common.signal.last_noise_rssi", TrackerInt32,
-            "most recent noise (RSSI)", &last_noise_rssi);
-
-    RegisterField("kismet.common.signal.min_signal_rssi", TrackerInt32,
-            "minimum signal (rssi)", &min_signal_rssi);
-    RegisterField("kismet.common.signal.min_noise_rssi", TrackerInt32,
-            "minimum noise (RSSI)", &min_noise_rssi);
-
-    RegisterField("kismet.common.signal.max_signal_rssi", TrackerInt32,
-            "maximum signal (RSSI)", &max_signal_rssi);
-    RegisterField("kismet.common.signal.max_noise_rssi", TrackerInt32,
-            "maximum noise (RSSI)", &max_noise_rssi);
-
-
-    shared_ptr<kis_tracked_location_triplet> 
-        loc_builder(new kis_tracked_location_triplet(globalreg, 0));
-    peak_loc_id = 
-        RegisterComplexField("kismet.common.signal.peak_loc", loc_builder,
-                "location of strongest signal");
-
-    RegisterField("kismet.common.signal.maxseenrate", TrackerDouble,
-            "maximum observed data rate (phy dependent)", &maxseenrate);
-    RegisterField("kismet.common.signal.encodingset", TrackerUInt64,
-            "bitset of observed encodings", &encodingset);
-    RegisterField("kismet.common.signal.carrierset", TrackerUInt64,
-            "bitset of observed carrier types", &carrierset);
-
-    shared_ptr<kis_tracked_minute_rrd<kis_tracked_rrd_peak_signal_aggregator> >
-        signal_min_rrd_builder(new kis_tracked_minute_rrd<kis_tracked_rrd_peak_signal_aggregator>(globalreg, 0));
-    signal_min_rrd_id =
-        RegisterComplexField("kismet.common.signal.signal_rrd",
-                signal_min_rrd_builder, "signal data for past minute");
+    register_table_fields(field_table);
 }
 
 void kis_tracked_signal_data::reserve_fields(SharedTrackerElement e) {
@@ -302,8 +267,34 @@ void kis_tracked_signal_data::reserve_fields(SharedTrackerElement e) {
 
     add_map(peak_loc_id, peak_loc);
     add_map(signal_min_rrd_id, signal_min_rrd);
+
+    // Restored records carry their statistics in the tracked fields
+    for (unsigned int i = 0; i < sig_num_stats; i++)
+        stats.values[i] = tracker_fast_access<int32_t>::get(this->*stat_fields[i]);
+
+    stats.carrierset = tracker_fast_access<uint64_t>::get(carrierset);
+    stats.encodingset = tracker_fast_access<uint64_t>::get(encodingset);
+    stats.maxseenrate = tracker_fast_access<double>::get(maxseenrate);
 }
 
+const tracker_field_desc<kis_tracked_seenby_data> kis_tracked_seenby_data::field_desc[] = {
+    __TrackerField(kis_tracked_seenby_data, "kismet.common.seenby.uuid",
+            TrackerUuid, "UUID of source", src_uuid),
+    __TrackerField(kis_tracked_seenby_data, "kismet.common.seenby.first_time",
+            TrackerUInt64, "first time seen time_t", first_time),
+    __TrackerField(kis_tracked_seenby_data, "kismet.common.seenby.last_time",
+            TrackerUInt64, "last time seen time_t", last_time),
+    __TrackerField(kis_tracked_seenby_data, "kismet.common.seenby.num_packets",
+            TrackerUInt64, "number of packets seen by this device", num_packets),
+    __TrackerFieldId(kis_tracked_seenby_data, "kismet.common.seenby.freq_khz_map",
+            TrackerSmallIntMap, "packets seen per frequency (khz)", freq_khz_map_id),
+    __TrackerFieldId(kis_tracked_seenby_data, "kismet.common.seenby.frequency.count",
+            TrackerUInt64, "frequency packet count", frequency_val_id),
+};
+
+tracker_field_table<kis_tracked_seenby_data> 
+    kis_tracked_seenby_data::field_table(kis_tracked_seenby_data::field_desc);
+
 kis_tracked_seenby_data::kis_tracked_seenby_data(GlobalRegistry *in_globalreg, int in_id) : 
     tracker_component(in_globalreg, in_id) { 
     register_fields();
@@ -317,37 +308,181 @@ kis_tracked_seenby_data::kis_tracked_seenby_data(GlobalRegistry *in_globalreg, i
 }
 
 SharedTrackerElement kis_tracked_seenby_data::clone_type() {
-    return SharedTrackerElement(new kis_tracked_signal_data(globalreg, get_id()));
+    return SharedTrackerElement(new kis_tracked_seenby_data(globalreg, get_id()));
 }
 
-void kis_tracked_seenby_data::inc_frequency_count(int frequency) {
-    TrackerElement::map_iterator i = freq_khz_map->find(frequency);
+void kis_tracked_seenby_data::inc_frequency_count(int frequency, uint64_t count) {
+    if (freq_khz_map == NULL) {
+        freq_khz_map = entrytracker->GetTrackedInstance(freq_khz_map_id);
+        add_map(freq_khz_map);
+    }
+
+    TrackerElement::small_int_map_iterator i = freq_khz_map->smallint_find(frequency);
 
-    if (i == freq_khz_map->end()) {
+    if (i == freq_khz_map->smallint_end()) {
         SharedTrackerElement e = 
             globalreg->entrytracker->GetTrackedInstance(frequency_val_id);
-        e->set((uint64_t) 1);
-        freq_khz_map->add_intmap(frequency, e);
+        e->set(count);
+        freq_khz_map->add_smallintmap(frequency, e);
     } else {
-        (*(i->second))++;
+        (*(i->second)) += count;
     }
 }
 
 void kis_tracked_seenby_data::register_fields() {
     tracker_component::register_fields();
 
-    RegisterField("kismet.common.seenby.uuid", TrackerUuid,
-            "UUID of source", &src_uuid);
-    RegisterField("kismet.common.seenby.first_time", TrackerUInt64,
-            "first time seen time_t", &first_time);
-    RegisterField("kismet.common.seenby.last_time", TrackerUInt64,
-            "last time seen time_t", &last_time);
-    RegisterField("kismet.common.seenby.num_packets", TrackerUInt64,
-            "number of packets seen by this device", &num_packets);
-    RegisterField("kismet.common.seenby.freq_khz_map", TrackerIntMap,
-            "packets seen per frequency (khz)", &freq_khz_map);
-    frequency_val_id =
-        globalreg->entrytracker->RegisterField("kismet.common.seenby.frequency.count",
-                TrackerUInt64, "frequency packet count");
+    register_table_fields(field_table);
 }
 
+void kis_tracked_seenby_data::reserve_fields(SharedTrackerElement e) {
+    tracker_component::reserve_fields(e);
+
+    if (e != NULL) {
+        if ((freq_khz_map = e->get_map_value(freq_khz_map_id)) != NULL)
+            add_map(freq_khz_map);
+    }
+}
+
+// Wi-Fi channel frequencies by dense index, and the index of each whole MHz
+// from the lowest channel to the highest; built once from the channel table
+struct freq_map_channels {
+    freq_map_channels() {
+        min_mhz = 0;
+        max_mhz = 0;
+
+        freq_khz.push_back(0);
+
+        for (unsigned int c = 0; c <= MAX_WIFI_HT_CHANNEL; c++) {
+            unsigned int mhz = (unsigned int) wifi_ht_channels[c].freq;
+
+            if (mhz == 0 || mhz != wifi_ht_channels[c].freq)
+                continue;
+
+            if (min_mhz == 0 || mhz < min_mhz)
+                min_mhz = mhz;
+            if (mhz > max_mhz)
+                max_mhz = mhz;
+        }
+
+        if (min_mhz == 0)
+            return;
+
+        by_mhz.resize(max_mhz - min_mhz + 1, 0);
+
+        for (unsigned int c = 0; c <= MAX_WIFI_HT_CHANNEL; c++) {
+            unsigned int mhz = (unsigned int) wifi_ht_channels[c].freq;
+
+            if (mhz == 0 || mhz != wifi_ht_channels[c].freq)
+                continue;
+
+            if (by_mhz[mhz - min_mhz] != 0 || freq_khz.size() > 255)
+                continue;
+
+            by_mhz[mhz - min_mhz] = freq_khz.size();
+            freq_khz.push_back(mhz * 1000.0);
+        }
+    }
+
+    unsigned int min_mhz, max_mhz;
+    vector<uint8_t> by_mhz;
+    vector<double> freq_khz;
+};
+
+static const freq_map_channels& freq_map_channel_table() {
+    static freq_map_channels table;
+    return table;
+}
+
+kis_tracked_freq_map::kis_tracked_freq_map(GlobalRegistry *in_globalreg, int in_id,
+        int in_val_id) : TrackerElement(TrackerSmallDoubleMap, in_id) {
+    globalreg = in_globalreg;
+    val_id = in_val_id;
+
+    memset(slot_index, 0, sizeof(slot_index));
+    memset(slot_count, 0, sizeof(slot_count));
+}
+
+kis_tracked_freq_map::kis_tracked_freq_map(GlobalRegistry *in_globalreg, int in_id,
+        int in_val_id, SharedTrackerElement e) : 
+    kis_tracked_freq_map(in_globalreg, in_id, in_val_id) {
+
+    if (e == NULL || e->get_type() != TrackerSmallDoubleMap)
+        return;
+
+    for (auto i = e->smalldouble_begin(); i != e->smalldouble_end(); ++i)
+        inc(i->first, GetTrackerValue<uint64_t>(i->second));
+}
+
+SharedTrackerElement kis_tracked_freq_map::clone_type() {
+    return SharedTrackerElement(new kis_tracked_freq_map(globalreg, get_id(), val_id));
+}
+
+unsigned int kis_tracked_freq_map::channel_index(double in_freq_khz) {
+    const freq_map_channels& t = freq_map_channel_table();
+
+    if (in_freq_khz < t.min_mhz * 1000.0 || in_freq_khz > t.max_mhz * 1000.0)
+        return 0;
+
+    unsigned int mhz = (unsigned int) (in_freq_khz / 1000);
+
+    if (mhz * 1000.0 != in_freq_khz)
+        return 0;
+
+    return t.by_mhz[mhz - t.min_mhz];
+}
+
+void kis_tracked_freq_map::inc(double in_freq_khz, uint64_t in_count) {
+    unsigned int ci = channel_index(in_freq_khz);
+
+    if (ci != 0) {
+        for (unsigned int s = 0; s < FREQ_MAP_SLOTS; s++) {
+            if (slot_index[s] == ci) {
+                slot_count[s] += in_count;
+                return;
+            }
+
+            if (slot_index[s] == 0) {
+                slot_index[s] = ci;
+                slot_count[s] = in_count;
+                return;
+            }
+        }
+    }
+
+    inc_map(in_freq_khz, in_count);
+}
+
+void kis_tracked_freq_map::inc_map(double in_freq_khz, uint64_t in_count) {
+    TrackerElement::small_double_map_iterator i = smalldouble_find(in_freq_khz);
+
+    if (i == smalldouble_end()) {
+        SharedTrackerElement e = globalreg->entrytracker->GetTrackedInstance(val_id);
+        e->set(in_count);
+        add_smalldoublemap(in_freq_khz, e);
+    } else {
+        (*(i->second)) += in_count;
+    }
+}
+
+void kis_tracked_freq_map::pre_serialize() {
+    TrackerElement::pre_serialize();
+
+    const freq_map_channels& t = freq_map_channel_table();
+
+    // Slot frequencies are only ever counted in the slots, so their map
+    // entries just copy the slot
+    for (unsigned int s = 0; s < FREQ_MAP_SLOTS && slot_index[s] != 0; s++) {
+        double k = t.freq_khz[slot_index[s]];
+
+        TrackerElement::small_double_map_iterator i = smalldouble_find(k);
+
+        if (i == smalldouble_end()) {
+            SharedTrackerElement e = globalreg->entrytracker->GetTrackedInstance(val_id);
+            e->set(slot_count[s]);
+            add_smalldoublemap(k, e);
+        } else {
+            i->second->set(slot_count[s]);
+        }
+    }
+}
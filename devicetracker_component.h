@@ -119,6 +119,9 @@ protected:
     virtual void register_fields();
     virtual void reserve_fields(SharedTrackerElement e);
 
+    static const tracker_field_desc<kis_tracked_signal_data> field_desc[];
+    static tracker_field_table<kis_tracked_signal_data> field_table;
+
     SharedTrackerElement last_signal_dbm, last_noise_dbm;
     SharedTrackerElement min_signal_dbm, min_noise_dbm;
     SharedTrackerElement max_signal_dbm, max_noise_dbm;
@@ -132,12 +135,78 @@ protected:
 
     SharedTrackerElement maxseenrate, encodingset, carrierset;
 
+    // The last, min, and max readings of signal and noise in dBm and RSSI, packed
+    // beside the tracked fields, so each packet is folded in by one branch-free
+    // pass over plain integers and only the fields which changed are written
+    // back to the tracked elements everything else reads
+    enum {
+        sig_signal_dbm = 0, sig_noise_dbm = 1, sig_signal_rssi = 2, sig_noise_rssi = 3,
+        sig_num_readings = 4,
+
+        sig_last = 0, sig_min = 4, sig_max = 8,
+        sig_num_stats = 12
+    };
+
+    struct signal_stats {
+        int32_t values[sig_num_stats];
+        uint64_t carrierset, encodingset;
+        double maxseenrate;
+    };
+
+    signal_stats stats;
+
+    static SharedTrackerElement kis_tracked_signal_data::* const stat_fields[sig_num_stats];
+
+    // Fold in the readings of a packet, returning a bit for each of the packed
+    // statistics which changed
+    unsigned int fold_signal(const kis_layer1_packinfo& lay1);
+
     // Signal record over the past minute, either rssi or dbm.  Devices
     // should not mix rssi and dbm signal reporting.
     int signal_min_rrd_id;
     shared_ptr<kis_tracked_minute_rrd<kis_tracked_rrd_peak_signal_aggregator> > signal_min_rrd;
 };
 
+// Channel frequencies a frequency map counts in fixed slots before falling
+// back to the map itself
+#define FREQ_MAP_SLOTS      8
+
+// Packets seen per frequency (khz), as a small double map.
+//
+// Most devices are seen on a few Wi-Fi channels, so channel frequencies (from
+// the wifi_ht_channels table) are turned into a small dense index and counted
+// in fixed slots, without a map lookup or a new element per frequency.  Other
+// frequencies, and channels past the slots, are counted in the map as before.
+// The slot counts are written into the map when it is serialized, so the map
+// read any other way is missing them.
+class kis_tracked_freq_map : public TrackerElement {
+public:
+    kis_tracked_freq_map(GlobalRegistry *in_globalreg, int in_id, int in_val_id);
+
+    // Import a stored map
+    kis_tracked_freq_map(GlobalRegistry *in_globalreg, int in_id, int in_val_id,
+            SharedTrackerElement e);
+
+    virtual SharedTrackerElement clone_type();
+
+    void inc(double in_freq_khz, uint64_t in_count);
+
+    virtual void pre_serialize();
+
+    // Dense index of a Wi-Fi channel frequency, from 1, or 0 for anything else
+    static unsigned int channel_index(double in_freq_khz);
+
+protected:
+    GlobalRegistry *globalreg;
+    int val_id;
+
+    // Slots are filled in order; an index of 0 is an empty slot
+    uint8_t slot_index[FREQ_MAP_SLOTS];
+    uint64_t slot_count[FREQ_MAP_SLOTS];
+
+    void inc_map(double in_freq_khz, uint64_t in_count);
+};
+
 class kis_tracked_seenby_data : public tracker_component {
 public:
     kis_tracked_seenby_data(GlobalRegistry *in_globalreg, int in_id);
@@ -152,19 +221,27 @@ public:
     __Proxy(num_packets, uint64_t, uint64_t, uint64_t, num_packets);
     __ProxyIncDec(num_packets, uint64_t, uint64_t, num_packets);
 
-    // Intmaps need special care by the caller
+    // Intmaps need special care by the caller; NULL until a frequency is counted
     SharedTrackerElement get_freq_khz_map() { return freq_khz_map; }
 
-    void inc_frequency_count(int frequency);
+    void inc_frequency_count(int frequency, uint64_t count = 1);
 
 protected:
     virtual void register_fields();
+    virtual void reserve_fields(SharedTrackerElement e);
+
+    // A record is built for every device each source sees, so the fields are
+    // described once
+    static const tracker_field_desc<kis_tracked_seenby_data> field_desc[];
+    static tracker_field_table<kis_tracked_seenby_data> field_table;
 
     SharedTrackerElement src_uuid;
     SharedTrackerElement first_time; 
     SharedTrackerElement last_time;
     SharedTrackerElement num_packets;
+
     SharedTrackerElement freq_khz_map;
+    int freq_khz_map_id;
 
     int frequency_val_id;
 };
@@ -0,0 +1,208 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <string>
+#include <vector>
+
+#include "globalregistry.h"
+#include "devicetracker.h"
+#include "devicetracker_events.h"
+
+/* Device change events
+ *
+ * Reports are cheap enough to make from the packet path: one lock and one
+ * lookup in the pending batch, and nothing at all while nobody subscribes.
+ * A device updated a thousand times in an interval is one event in the batch,
+ * carrying every group those updates touched; a device created and updated is
+ * one created event, and a device which expires is an expired event whatever
+ * else happened to it before.
+ */
+
+DeviceEventBus::DeviceEventBus() {
+    capacity = 65536;
+    next_id = 0;
+    num_subscribers = 0;
+    reported = 0;
+    published = 0;
+}
+
+void DeviceEventBus::report(uint64_t in_key, unsigned int in_type,
+        unsigned int in_groups, time_t in_ts) {
+    if (num_subscribers == 0)
+        return;
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    reported++;
+
+    size_t *pos = pending_pos.find(in_key);
+
+    if (pos == NULL) {
+        kis_device_event ev;
+
+        ev.key = in_key;
+        ev.type = in_type;
+        ev.groups = in_groups;
+        ev.ts = in_ts;
+
+        pending_pos.insert(in_key, pending.size());
+        pending.push_back(ev);
+
+        return;
+    }
+
+    kis_device_event& ev = pending[*pos];
+
+    if (in_type == DEVICE_EVENT_EXPIRED) {
+        ev.type = DEVICE_EVENT_EXPIRED;
+        ev.groups = 0;
+    } else if (ev.type == DEVICE_EVENT_EXPIRED) {
+        // The same key came back after expiring
+        ev.type = DEVICE_EVENT_CREATED;
+        ev.groups = in_groups;
+    } else {
+        if (in_type == DEVICE_EVENT_CREATED)
+            ev.type = DEVICE_EVENT_CREATED;
+        ev.groups |= in_groups;
+    }
+
+    if (in_ts > ev.ts)
+        ev.ts = in_ts;
+}
+
+void DeviceEventBus::publish() {
+    std::vector<std::function<void ()> > notify;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if (pending.size() == 0)
+            return;
+
+        for (auto& ev : pending)
+            ring.push(ev, ev.ts, NULL);
+
+        published += pending.size();
+
+        pending.clear();
+        pending_pos.clear();
+
+        for (auto& s : subscribers) {
+            if (s.second.notify != NULL)
+                notify.push_back(s.second.notify);
+        }
+    }
+
+    for (auto& n : notify)
+        n();
+}
+
+int DeviceEventBus::subscribe(const std::string& in_name,
+        std::function<void ()> in_notify) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (ring.capacity() == 0)
+        ring.set_capacity(capacity == 0 ? 1 : capacity);
+
+    subscriber s;
+
+    s.name = in_name;
+    s.notify = in_notify;
+    s.cursor = ring.get_next_seq();
+    s.missed = 0;
+
+    int id = next_id++;
+
+    subscribers[id] = s;
+    num_subscribers = subscribers.size();
+
+    return id;
+}
+
+void DeviceEventBus::unsubscribe(int in_id) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    subscribers.erase(in_id);
+    num_subscribers = subscribers.size();
+
+    // Nobody is left to hear about the rest of the batch
+    if (num_subscribers == 0) {
+        pending.clear();
+        pending_pos.clear();
+    }
+}
+
+uint64_t DeviceEventBus::fetch(int in_id, std::vector<kis_device_event> *ret_events) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    auto si = subscribers.find(in_id);
+
+    if (si == subscribers.end())
+        return 0;
+
+    subscriber& s = si->second;
+    uint64_t missed = 0;
+
+    if (s.cursor < ring.get_first_seq()) {
+        missed = ring.get_first_seq() - s.cursor;
+        s.missed += missed;
+    }
+
+    ring.for_each_from_seq(s.cursor, [ret_events](uint64_t, const kis_device_event& ev) {
+            ret_events->push_back(ev);
+        });
+
+    s.cursor = ring.get_next_seq();
+
+    return missed;
+}
+
+std::vector<std::pair<std::string, uint64_t> > DeviceEventBus::subscriber_stats() {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    std::vector<std::pair<std::string, uint64_t> > ret;
+
+    for (auto& s : subscribers)
+        ret.push_back(std::make_pair(s.second.name, s.second.missed));
+
+    return ret;
+}
+
+void Devicetracker::ReportDeviceChange(shared_ptr<kis_tracked_device_base> in_device,
+        unsigned int in_groups) {
+    if (in_device == NULL)
+        return;
+
+    device_events.report(in_device->get_key(), DEVICE_EVENT_UPDATED, in_groups,
+            globalreg->timestamp.tv_sec);
+}
+
+void Devicetracker::PublishDeviceEvents() {
+    if (!device_events.active())
+        return;
+
+    // Coalesced updates are reported as they are taken, so apply them before
+    // anyone goes to look at the devices
+    if (coalesce_enabled)
+        FlushCoalescedUpdates();
+
+    device_events.publish();
+}
+
@@ -0,0 +1,137 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __DEVICETRACKER_EVENTS_H__
+#define __DEVICETRACKER_EVENTS_H__
+
+#include "config.h"
+
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "kis_backlog.h"
+#include "kis_flat_hash.h"
+
+// What happened to a device
+#define DEVICE_EVENT_CREATED        1
+#define DEVICE_EVENT_UPDATED        2
+#define DEVICE_EVENT_EXPIRED        3
+
+// Groups of fields an update touched.  The common groups are the UCD_UPDATE_
+// flags UpdateCommonDevice was called with; phy handlers add their own.
+#define DEVICE_EVENT_GROUP_PHY          (1 << 8)
+#define DEVICE_EVENT_GROUP_SSID         (1 << 9)
+#define DEVICE_EVENT_GROUP_CLIENT       (1 << 10)
+#define DEVICE_EVENT_GROUP_HANDSHAKE    (1 << 11)
+
+class kis_device_event {
+public:
+    kis_device_event() {
+        key = 0;
+        type = 0;
+        groups = 0;
+        ts = 0;
+    }
+
+    uint64_t key;
+    unsigned int type;
+    unsigned int groups;
+    time_t ts;
+};
+
+// Device change events, for everything inside the server which wants to know
+// what changed in the device list without hooking the packet chain again or
+// sweeping the devices itself
+//
+// The device tracker reports devices as they are created, updated by
+// UpdateCommonDevice and the phy handlers, and expired.  Reports are collected
+// into a batch with one event per device, the groups of every update to it
+// merged, and the batch is published onto a ring every
+// 'tracker_events_interval' milliseconds, once any coalesced updates have been
+// applied to the devices.  Each subscriber has its own cursor into the ring and
+// takes the events since it last looked, so any number of consumers share the
+// cost of finding the changes; a subscriber which falls a whole ring behind is
+// told how many events it missed.
+//
+// Nothing is collected while there are no subscribers.
+class DeviceEventBus {
+public:
+    DeviceEventBus();
+
+    // Ring size for the first subscriber; changing it later has no effect
+    void set_capacity(size_t in_capacity) { capacity = in_capacity; }
+
+    bool active() const { return num_subscribers != 0; }
+
+    // Report a change to a device, merged into the pending batch
+    void report(uint64_t in_key, unsigned int in_type, unsigned int in_groups,
+            time_t in_ts);
+
+    // Move the pending batch onto the ring and call the subscribers which asked
+    // to be told; called from the device tracker timer, without the devicelist
+    // lock held
+    void publish();
+
+    // Add a subscriber, which starts at the next batch.  The notify function,
+    // if there is one, is called after every batch which wasn't empty, without
+    // any locks held.  Returns the subscriber ID.
+    int subscribe(const std::string& in_name, std::function<void ()> in_notify = NULL);
+    void unsubscribe(int in_id);
+
+    // Append the events since the last fetch by this subscriber and advance its
+    // cursor.  Returns the number of events it missed by falling behind.
+    uint64_t fetch(int in_id, std::vector<kis_device_event> *ret_events);
+
+    // (name, missed) of each subscriber, and the totals of every batch so far
+    std::vector<std::pair<std::string, uint64_t> > subscriber_stats();
+    uint64_t get_reported() const { return reported; }
+    uint64_t get_published() const { return published; }
+
+protected:
+    class subscriber {
+    public:
+        std::string name;
+        std::function<void ()> notify;
+        uint64_t cursor;
+        uint64_t missed;
+    };
+
+    std::mutex mutex;
+
+    size_t capacity;
+
+    std::vector<kis_device_event> pending;
+    kis_u64_flat_map<size_t> pending_pos;
+
+    kis_backlog<kis_device_event> ring;
+
+    int next_id;
+    std::map<int, subscriber> subscribers;
+    std::atomic<unsigned int> num_subscribers;
+
+    std::atomic<uint64_t> reported, published;
+};
+
+#endif
+
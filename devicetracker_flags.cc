@@ -0,0 +1,314 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <string>
+#include <vector>
+
+#include "globalregistry.h"
+#include "util.h"
+#include "devicetracker.h"
+#include "structured.h"
+
+/* Device flag index
+ *
+ * Each flag is a bitmap over device ids, so a query is a handful of passes of
+ * AND (or AND NOT) over whole bitmaps, which the compiler turns into vector
+ * instructions, followed by a popcount or a walk of the set bits.  A device
+ * is indexed by its id so the bitmaps never move; ids of forgotten devices
+ * are simply clear.  Each device also keeps its flags as one word, so
+ * re-reading a device which hasn't changed touches no bitmaps and checking
+ * a single device is one compare.
+ */
+
+bool DevicetrackerFlagIndex::register_flags(const vector<string>& in_names,
+        flag_func in_func) {
+    if (names.size() + in_names.size() > DEVICE_FLAGS_MAX)
+        return false;
+
+    for (auto n : in_names) {
+        if (find_flag(n) >= 0)
+            return false;
+    }
+
+    flag_group g;
+
+    g.first = names.size();
+    g.num = in_names.size();
+    g.get_flags = in_func;
+
+    groups.push_back(g);
+
+    for (auto n : in_names) {
+        bitmaps[names.size()].assign(present.size(), 0);
+        names.push_back(n);
+    }
+
+    // Every device has to be read for the new flags
+    refresh_ts = -1;
+
+    return true;
+}
+
+int DevicetrackerFlagIndex::find_flag(const string& in_name) const {
+    for (unsigned int n = 0; n < names.size(); n++) {
+        if (names[n] == in_name)
+            return n;
+    }
+
+    return -1;
+}
+
+bool DevicetrackerFlagIndex::parse_query(const vector<string>& in_terms, 
+        uint64_t *ret_set, uint64_t *ret_clear, string *ret_error) const {
+    *ret_set = 0;
+    *ret_clear = 0;
+
+    for (auto t : in_terms) {
+        t = StrStrip(t);
+
+        if (t.length() == 0)
+            continue;
+
+        bool negate = false;
+
+        if (t[0] == '!') {
+            negate = true;
+            t = StrStrip(t.substr(1));
+        }
+
+        int f = find_flag(t);
+
+        if (f < 0) {
+            *ret_error = "Unknown device flag '" + t + "'";
+            return false;
+        }
+
+        if (negate)
+            *ret_clear |= (1ULL << f);
+        else
+            *ret_set |= (1ULL << f);
+    }
+
+    return true;
+}
+
+void DevicetrackerFlagIndex::update(shared_ptr<kis_tracked_device_base> in_device) {
+    uint64_t id = in_device->get_kis_internal_id();
+    size_t word = id >> 6;
+    uint64_t bit = 1ULL << (id & 63);
+
+    if (id >= device_flags.size())
+        device_flags.resize(id + 1, 0);
+
+    if (word >= present.size()) {
+        present.resize(word + 1, 0);
+
+        for (unsigned int n = 0; n < names.size(); n++)
+            bitmaps[n].resize(word + 1, 0);
+    }
+
+    uint64_t flags = 0;
+
+    for (auto& g : groups) {
+        uint64_t gf = g.get_flags(in_device);
+
+        if (g.num < 64)
+            gf &= (1ULL << g.num) - 1;
+
+        flags |= gf << g.first;
+    }
+
+    uint64_t changed = flags ^ device_flags[id];
+
+    present[word] |= bit;
+    device_flags[id] = flags;
+
+    while (changed != 0) {
+        unsigned int f = __builtin_ctzll(changed);
+        changed &= changed - 1;
+
+        bitmaps[f][word] ^= bit;
+    }
+}
+
+void DevicetrackerFlagIndex::erase(uint64_t in_id) {
+    size_t word = in_id >> 6;
+    uint64_t bit = 1ULL << (in_id & 63);
+
+    if (word >= present.size() || (present[word] & bit) == 0)
+        return;
+
+    uint64_t flags = device_flags[in_id];
+
+    while (flags != 0) {
+        unsigned int f = __builtin_ctzll(flags);
+        flags &= flags - 1;
+
+        bitmaps[f][word] &= ~bit;
+    }
+
+    present[word] &= ~bit;
+    device_flags[in_id] = 0;
+}
+
+void DevicetrackerFlagIndex::clear() {
+    device_flags.clear();
+    present.clear();
+
+    for (unsigned int n = 0; n < DEVICE_FLAGS_MAX; n++)
+        bitmaps[n].clear();
+
+    refresh_ts = -1;
+}
+
+void DevicetrackerFlagIndex::refresh(const list<shared_ptr<kis_tracked_device_base> >& in_modified,
+        const vector<shared_ptr<kis_tracked_device_base> >& in_all) {
+    if (refresh_ts < 0) {
+        for (auto d : in_all)
+            update(d);
+    } else {
+        for (auto d : in_modified) {
+            if (d->get_last_time() < refresh_ts)
+                break;
+
+            update(d);
+        }
+    }
+
+    if (in_modified.size() != 0)
+        refresh_ts = in_modified.front()->get_last_time();
+    else
+        refresh_ts = 0;
+}
+
+void DevicetrackerFlagIndex::query_bitmap(uint64_t in_set, uint64_t in_clear,
+        vector<uint64_t>& ret_bitmap) const {
+    ret_bitmap = present;
+
+    size_t num_words = ret_bitmap.size();
+    uint64_t *r = ret_bitmap.data();
+
+    // One pass per flag over whole bitmaps; the inner loops are plain word
+    // operations the compiler can vectorize
+    while (in_set != 0) {
+        unsigned int f = __builtin_ctzll(in_set);
+        in_set &= in_set - 1;
+
+        const uint64_t *b = bitmaps[f].data();
+
+        for (size_t w = 0; w < num_words; w++)
+            r[w] &= b[w];
+    }
+
+    while (in_clear != 0) {
+        unsigned int f = __builtin_ctzll(in_clear);
+        in_clear &= in_clear - 1;
+
+        const uint64_t *b = bitmaps[f].data();
+
+        for (size_t w = 0; w < num_words; w++)
+            r[w] &= ~b[w];
+    }
+}
+
+vector<uint64_t> DevicetrackerFlagIndex::query(uint64_t in_set, uint64_t in_clear) const {
+    vector<uint64_t> bm;
+    vector<uint64_t> ret;
+
+    query_bitmap(in_set, in_clear, bm);
+
+    for (size_t w = 0; w < bm.size(); w++) {
+        uint64_t v = bm[w];
+
+        while (v != 0) {
+            ret.push_back((w << 6) + __builtin_ctzll(v));
+            v &= v - 1;
+        }
+    }
+
+    return ret;
+}
+
+size_t DevicetrackerFlagIndex::count(uint64_t in_set, uint64_t in_clear) const {
+    vector<uint64_t> bm;
+    size_t ret = 0;
+
+    query_bitmap(in_set, in_clear, bm);
+
+    for (auto w : bm)
+        ret += __builtin_popcountll(w);
+
+    return ret;
+}
+
+bool Devicetracker::RegisterDeviceFlags(const vector<string>& in_names,
+        DevicetrackerFlagIndex::flag_func in_func) {
+    local_locker lock(&devicelist_mutex);
+
+    return flag_index.register_flags(in_names, in_func);
+}
+
+int Devicetracker::FlagQueryForRequest(SharedStructured in_structdata,
+        uint64_t *ret_set, uint64_t *ret_clear, string *ret_error) {
+    if (in_structdata == NULL || !in_structdata->hasKey("flags"))
+        return 0;
+
+    vector<string> terms;
+
+    try {
+        SharedStructured flags = in_structdata->getStructuredByKey("flags");
+
+        if (flags->isString())
+            terms = StrTokenize(flags->getString(), ",");
+        else
+            terms = flags->getStringVec();
+    } catch (const StructuredDataException& e) {
+        *ret_error = string("Invalid flags: ") + e.what();
+        return -1;
+    }
+
+    local_locker lock(&devicelist_mutex);
+
+    if (!flag_index.parse_query(terms, ret_set, ret_clear, ret_error))
+        return -1;
+
+    return 1;
+}
+
+vector<shared_ptr<kis_tracked_device_base> > Devicetracker::FetchDevicesByFlags_nl(
+        uint64_t in_set, uint64_t in_clear) {
+    vector<shared_ptr<kis_tracked_device_base> > ret;
+
+    flag_index.refresh(modified_list, tracked_vec);
+
+    for (auto id : flag_index.query(in_set, in_clear)) {
+        if (id >= immutable_tracked_vec.size())
+            continue;
+
+        shared_ptr<kis_tracked_device_base> d =
+            static_pointer_cast<kis_tracked_device_base>(immutable_tracked_vec[id]);
+
+        if (d != NULL)
+            ret.push_back(d);
+    }
+
+    return ret;
+}
+
@@ -24,6 +24,7 @@
 #include <time.h>
 #include <list>
 #include <map>
+#include <set>
 #include <vector>
 
 #include "kismet_algorithm.h"
@@ -50,6 +51,86 @@
 #include "structured.h"
 #include "kismet_json.h"
 #include "base64.h"
+#include "kis_clock.h"
+
+// Bounding box of a /devices/by-location/MINLAT/MINLON/MAXLAT/MAXLON/ request
+static bool ParseLocationBox(const vector<string>& tokenurl, double *out_box) {
+    if (tokenurl.size() < 8)
+        return false;
+
+    for (unsigned int i = 0; i < 4; i++) {
+        if (sscanf(tokenurl[3 + i].c_str(), "%lf", &(out_box[i])) != 1)
+            return false;
+    }
+
+    return true;
+}
+
+static bool ParseLocationBox(const kis_strview_vec& tokenurl, double *out_box) {
+    if (tokenurl.size() < 8)
+        return false;
+
+    for (unsigned int i = 0; i < 4; i++) {
+        if (sscanf(tokenurl[3 + i].str().c_str(), "%lf", &(out_box[i])) != 1)
+            return false;
+    }
+
+    return true;
+}
+
+// HTTP interfaces
+bool Devicetracker::Httpd_CacheableResponse(const char *url, uint64_t *version) {
+    if (strncmp(url, "/devices/summary/", 17) != 0 &&
+            strncmp(url, "/phy/all_phys", 13) != 0)
+        return false;
+
+    local_locker lock(&devicelist_mutex);
+    *version = device_epoch;
+
+    return true;
+}
+
+bool Devicetracker::Httpd_ETag(const char *url, uint64_t *etag) {
+    if (strncmp(url, "/devices/by-key/", 16) != 0)
+        return false;
+
+    kis_strview_vec tokenurl;
+    StrTokenizeView(url, '/', tokenurl);
+
+    if (tokenurl.size() < 5 || Httpd_StripSuffix(tokenurl[4].str()) != "device")
+        return false;
+
+    uint64_t key = 0;
+    std::stringstream ss(tokenurl[3].str());
+    ss >> key;
+
+    // Only the index lock, unless the device has to be thawed or restored;
+    // the device isn't locked to read its count.  Every
+    // packet bumps it, and the internal id keeps a device which was removed
+    // and seen again from matching the old one.  RRDs are filled forward to
+    // the current time when serialized, but clients redo that from the
+    // last update time, so it doesn't change the version
+    shared_ptr<kis_tracked_device_base> dev = FetchDevice(key);
+
+    if (dev == NULL)
+        return false;
+
+    *etag = (dev->get_kis_internal_id() << 32) ^ dev->get_mod_version();
+
+    return true;
+}
+
+size_t Devicetracker::Httpd_Chain_Chunk_Size(const char *url) {
+    // Everything which can stream out the whole device list
+    if (strcmp(url, "/devices/all_devices.ekjson") == 0 ||
+            strncmp(url, "/devices/summary/", 17) == 0 ||
+            strncmp(url, "/devices/last-time/", 19) == 0 ||
+            strncmp(url, "/devices/multikey/", 18) == 0 ||
+            strcmp(url, "/devices/columns/devices.kcol") == 0)
+        return 1024 * 1024;
+
+    return Kis_Net_Httpd_Chain_Stream_Handler::Httpd_Chain_Chunk_Size(url);
+}
 
 // HTTP interfaces
 bool Devicetracker::Httpd_VerifyPath(const char *path, const char *method) {
@@ -64,6 +145,10 @@ bool Devicetracker::Httpd_VerifyPath(const char *path, const char *method) {
         if (strcmp(path, "/devices/all_devices.ekjson") == 0)
             return true;
 
+        // Columnar export isn't a serializer either
+        if (strcmp(path, "/devices/columns/devices.kcol") == 0)
+            return true;
+
         /*
         if (stripped == "/devices/all_devices" && can_serialize)
             return true;
@@ -82,7 +167,8 @@ bool Devicetracker::Httpd_VerifyPath(const char *path, const char *method) {
             return true;
 
         // Split URL and process
-        vector<string> tokenurl = StrTokenize(path, "/");
+        kis_strview_vec tokenurl;
+        StrTokenizeView(path, '/', tokenurl);
         if (tokenurl.size() < 2)
             return false;
 
@@ -90,37 +176,46 @@ bool Devicetracker::Httpd_VerifyPath(const char *path, const char *method) {
             if (tokenurl.size() < 3)
                 return false;
 
+            string term;
+
+            if (tokenurl.size() >= 5 &&
+                    TermIndexForRequest(tokenurl[2].str(), tokenurl[3].str(), term) != NULL)
+                return Httpd_CanSerialize(tokenurl[4].str());
+
+            double box[4];
+
+            if (tokenurl[2] == "by-location")
+                return ParseLocationBox(tokenurl, box) &&
+                    Httpd_CanSerialize(tokenurl[7].str());
+
             // Do a by-key lookup and return the device or the device path
             if (tokenurl[2] == "by-key") {
                 if (tokenurl.size() < 5) {
                     return false;
                 }
 
-                local_locker lock(&devicelist_mutex);
-
                 uint64_t key = 0;
-                std::stringstream ss(tokenurl[3]);
+                std::stringstream ss(tokenurl[3].str());
                 ss >> key;
 
-                if (!Httpd_CanSerialize(tokenurl[4]))
+                if (!Httpd_CanSerialize(tokenurl[4].str()))
                     return false;
 
-                map<uint64_t, shared_ptr<kis_tracked_device_base> >::iterator tmi =
-                    tracked_map.find(key);
+                shared_ptr<kis_tracked_device_base> dev = FetchDevice(key);
 
-                if (tmi == tracked_map.end())
+                if (dev == NULL)
                     return false;
 
-                string target = Httpd_StripSuffix(tokenurl[4]);
+                string target = Httpd_StripSuffix(tokenurl[4].str());
 
                 if (target == "device") {
                     // Try to find the exact field
                     if (tokenurl.size() > 5) {
-                        vector<string>::const_iterator first = tokenurl.begin() + 5;
-                        vector<string>::const_iterator last = tokenurl.end();
-                        vector<string> fpath(first, last);
+                        vector<string> fpath = tokenurl.str_vec(5);
 
-                        if (tmi->second->get_child_path(fpath) == NULL) {
+                        local_locker lock(&devicelist_mutex);
+
+                        if (dev->get_child_path(fpath) == NULL) {
                             return false;
                         }
                     }
@@ -133,18 +228,16 @@ bool Devicetracker::Httpd_VerifyPath(const char *path, const char *method) {
                 if (tokenurl.size() < 5)
                     return false;
 
-                local_locker lock(&devicelist_mutex);
-
-                if (!Httpd_CanSerialize(tokenurl[4]))
+                if (!Httpd_CanSerialize(tokenurl[4].str()))
                     return false;
 
-                mac_addr mac = mac_addr(tokenurl[3]);
+                mac_addr mac = mac_addr(tokenurl[3].str());
 
                 if (mac.error) {
                     return false;
                 }
 
-                if (tracked_mac_multimap.count(mac) > 0)
+                if (tracked_index.contains_mac(mac))
                     return true;
 
                 return false;
@@ -154,7 +247,7 @@ bool Devicetracker::Httpd_VerifyPath(const char *path, const char *method) {
                 }
 
                 long lastts;
-                if (sscanf(tokenurl[3].c_str(), "%ld", &lastts) != 1) {
+                if (sscanf(tokenurl[3].str().c_str(), "%ld", &lastts) != 1) {
                     return false;
                 }
 
@@ -162,12 +255,13 @@ bool Devicetracker::Httpd_VerifyPath(const char *path, const char *method) {
                 if (tokenurl[4] == "devices.ekjson")
                     return true;
 
-                return Httpd_CanSerialize(tokenurl[4]);
+                return Httpd_CanSerialize(tokenurl[4].str());
             }
         }
     } else if (strcmp(method, "POST") == 0) {
         // Split URL and process
-        vector<string> tokenurl = StrTokenize(path, "/");
+        kis_strview_vec tokenurl;
+        StrTokenizeView(path, '/', tokenurl);
         if (tokenurl.size() < 2)
             return false;
 
@@ -176,40 +270,55 @@ bool Devicetracker::Httpd_VerifyPath(const char *path, const char *method) {
                 return false;
 
             } else if (tokenurl[2] == "summary") {
-                return Httpd_CanSerialize(tokenurl[3]);
+                return Httpd_CanSerialize(tokenurl[3].str());
+            } else if (tokenurl[2] == "view") {
+                return Httpd_CanSerialize(tokenurl[3].str());
+            } else if (tokenurl[2] == "columns") {
+                return tokenurl[3] == "devices.kcol";
+            } else if (tokenurl[2] == "by-ssid" || tokenurl[2] == "by-oui" ||
+                    tokenurl[2] == "by-channel") {
+                if (tokenurl.size() < 5)
+                    return false;
+
+                return Httpd_CanSerialize(tokenurl[4].str());
+            } else if (tokenurl[2] == "multikey") {
+                return Httpd_StripSuffix(tokenurl[3].str()) == "devices" &&
+                    Httpd_CanSerialize(tokenurl[3].str());
+            } else if (tokenurl[2] == "by-location") {
+                double box[4];
+
+                return ParseLocationBox(tokenurl, box) &&
+                    Httpd_CanSerialize(tokenurl[7].str());
             } else if (tokenurl[2] == "last-time") {
                 if (tokenurl.size() < 5) {
                     return false;
                 }
 
                 long lastts;
-                if (sscanf(tokenurl[3].c_str(), "%ld", &lastts) != 1) {
+                if (sscanf(tokenurl[3].str().c_str(), "%ld", &lastts) != 1) {
                     fprintf(stderr, "debug - unable to parse ts\n");
                     return false;
                 }
 
-                return Httpd_CanSerialize(tokenurl[4]);
+                return Httpd_CanSerialize(tokenurl[4].str());
             } else if (tokenurl[2] == "by-key") {
                 if (tokenurl.size() < 5) {
                     return false;
                 }
 
-                local_locker lock(&devicelist_mutex);
-
                 uint64_t key = 0;
-                std::stringstream ss(tokenurl[3]);
+                std::stringstream ss(tokenurl[3].str());
                 ss >> key;
 
-                if (!Httpd_CanSerialize(tokenurl[4]))
+                if (!Httpd_CanSerialize(tokenurl[4].str()))
                     return false;
 
-                map<uint64_t, shared_ptr<kis_tracked_device_base> >::iterator tmi =
-                    tracked_map.find(key);
+                shared_ptr<kis_tracked_device_base> dev = FetchDevice(key);
 
-                if (tmi == tracked_map.end())
+                if (dev == NULL)
                     return false;
 
-                string target = Httpd_StripSuffix(tokenurl[4]);
+                string target = Httpd_StripSuffix(tokenurl[4].str());
 
                 if (target == "device") {
                     return true;
@@ -222,18 +331,16 @@ bool Devicetracker::Httpd_VerifyPath(const char *path, const char *method) {
                 if (tokenurl.size() < 5)
                     return false;
 
-                local_locker lock(&devicelist_mutex);
-
-                if (!Httpd_CanSerialize(tokenurl[4]))
+                if (!Httpd_CanSerialize(tokenurl[4].str()))
                     return false;
 
-                mac_addr mac = mac_addr(tokenurl[3]);
+                mac_addr mac = mac_addr(tokenurl[3].str());
 
                 if (mac.error) {
                     return false;
                 }
 
-                if (tracked_mac_multimap.count(mac) > 0)
+                if (tracked_index.contains_mac(mac))
                     return true;
 
                 return false;
@@ -279,12 +386,15 @@ void Devicetracker::httpd_device_summary(string url, std::ostream &stream,
         vector<SharedElementSummary> summary_vec,
         string in_wrapper_key) {
 
-    local_locker lock(&devicelist_mutex);
-
     SharedTrackerElement devvec =
         globalreg->entrytracker->GetTrackedInstance(device_summary_base_id);
 
     TrackerElementSerializer::rename_map rename_map;
+    TrackerElementSerializer::serial_cache_map cache_map;
+
+    string format = httpd->GetSuffix(url);
+    string projection = SerialProjectionKey(summary_vec);
+    shared_ptr<JsonAdapter::SummaryPlan> plan = CompileSummaryPlan(format, summary_vec);
 
     // Wrap the dev vec in a dictionary and change its name
     SharedTrackerElement wrapper = NULL;
@@ -297,36 +407,25 @@ void Devicetracker::httpd_device_summary(string url, std::ostream &stream,
         wrapper = devvec;
     }
 
-    if (subvec == NULL) {
-        for (unsigned int x = 0; x < tracked_vec.size(); x++) {
-            if (summary_vec.size() == 0) {
-                devvec->add_vector(tracked_vec[x]);
-            } else {
-                SharedTrackerElement simple;
+    // Devices are summarized a batch at a time under the devicelist lock, and
+    // the output is written without it
+    SharedTrackerElement devices;
 
-                SummarizeTrackerElement(entrytracker, tracked_vec[x], 
-                        summary_vec, simple, rename_map);
-
-                devvec->add_vector(simple);
-            }
-        }
+    if (subvec == NULL) {
+        devices = FetchDeviceSnapshot();
     } else {
+        devices.reset(new TrackerElement(TrackerVector));
+
         for (TrackerElementVector::const_iterator x = subvec->begin();
                 x != subvec->end(); ++x) {
-            if (summary_vec.size() == 0) {
-                devvec->add_vector(*x);
-            } else {
-                SharedTrackerElement simple;
-
-                SummarizeTrackerElement(entrytracker, *x, 
-                        summary_vec, simple, rename_map);
-
-                devvec->add_vector(simple);
-            }
+            devices->add_vector(*x);
         }
     }
 
-    entrytracker->Serialize(httpd->GetSuffix(url), stream, wrapper, &rename_map);
+    SummarizeDevicesBatched(format, devices, projection, summary_vec, plan.get(),
+            devvec, rename_map, cache_map);
+
+    entrytracker->Serialize(format, stream, wrapper, &rename_map, &cache_map);
 }
 
 void Devicetracker::httpd_xml_device_summary(std::ostream &stream) {
@@ -434,22 +533,32 @@ int Devicetracker::Httpd_CreateStreamResponse(
 
 
     if (strcmp(path, "/devices/all_devices.ekjson") == 0) {
-        // Instantiate a manual serializer
-        JsonAdapter::Serializer serial(globalreg); 
-
-        devicetracker_function_worker fw(globalreg, 
-                [this, &stream, &serial](Devicetracker *, shared_ptr<kis_tracked_device_base> d) -> bool {
-                    serial.serialize(d, stream);
-                    stream << "\n";
-
-                    // Return false because we're not building a list, we're serializing
-                    // per element
-                    return false;
-                }, NULL);
-        MatchOnDevices(&fw);
+        bool direct_writer =
+            globalreg->kismet_config->FetchOptBoolean("json_direct_writer", 1);
+
+        // Each device is packed on its own, so with match threads ranges of
+        // devices are packed in parallel and written in order
+        devicetracker_serial_worker sw(globalreg, stream,
+                [this, direct_writer](std::ostream& s, 
+                    shared_ptr<kis_tracked_device_base> d) {
+                    if (direct_writer)
+                        JsonAdapter::Pack(globalreg, s, d);
+                    else
+                        JsonAdapter::PackStream(globalreg, s, d);
+                    s << "\n";
+                });
+
+        // Walk a frozen list so devices being added don't need the lock held
+        // for the whole dump
+        MatchOnDevices(&sw, TrackerElementVector(FetchDeviceSnapshot()));
         return MHD_YES;
     }
 
+    if (strcmp(path, "/devices/columns/devices.kcol") == 0) {
+        vector<SharedElementSummary> summary_vec;
+        return httpd_device_columns(connection, stream, summary_vec);
+    }
+
     string stripped = Httpd_StripSuffix(path);
 
     if (stripped == "/phy/all_phys") {
@@ -471,6 +580,44 @@ int Devicetracker::Httpd_CreateStreamResponse(
         if (tokenurl.size() < 5)
             return MHD_YES;
 
+        string term;
+        DevicetrackerTermIndex *term_index =
+            TermIndexForRequest(tokenurl[2], tokenurl[3], term);
+
+        if (term_index != NULL) {
+            if (!Httpd_CanSerialize(tokenurl[4]))
+                return MHD_YES;
+
+            local_locker lock(&devicelist_mutex);
+
+            SharedTrackerElement devvec(new TrackerElement(TrackerVector));
+
+            for (auto d : FetchDevicesByTerm(*term_index, term))
+                devvec->add_vector(d);
+
+            entrytracker->Serialize(httpd->GetSuffix(tokenurl[4]), stream, devvec, NULL);
+
+            return MHD_YES;
+        }
+
+        double box[4];
+
+        if (tokenurl[2] == "by-location") {
+            if (!ParseLocationBox(tokenurl, box) || !Httpd_CanSerialize(tokenurl[7]))
+                return MHD_YES;
+
+            local_locker lock(&devicelist_mutex);
+
+            SharedTrackerElement devvec(new TrackerElement(TrackerVector));
+
+            for (auto d : FetchDevicesByLocation(box[0], box[1], box[2], box[3]))
+                devvec->add_vector(d);
+
+            entrytracker->Serialize(httpd->GetSuffix(tokenurl[7]), stream, devvec, NULL);
+
+            return MHD_YES;
+        }
+
         if (tokenurl[2] == "by-key") {
             if (tokenurl.size() < 5) {
                 return MHD_YES;
@@ -492,10 +639,9 @@ int Devicetracker::Httpd_CreateStreamResponse(
             }
             */
 
-            map<uint64_t, shared_ptr<kis_tracked_device_base> >::iterator tmi =
-                tracked_map.find(key);
+            shared_ptr<kis_tracked_device_base> dev = FetchDevice(key);
 
-            if (tmi == tracked_map.end()) {
+            if (dev == NULL) {
                 stream << "Invalid device key";
                 return MHD_YES;
             }
@@ -509,7 +655,7 @@ int Devicetracker::Httpd_CreateStreamResponse(
                     vector<string>::const_iterator last = tokenurl.end();
                     vector<string> fpath(first, last);
 
-                    SharedTrackerElement sub = tmi->second->get_child_path(fpath);
+                    SharedTrackerElement sub = dev->get_child_path(fpath);
 
                     if (sub == NULL) {
                         return MHD_YES;
@@ -521,7 +667,7 @@ int Devicetracker::Httpd_CreateStreamResponse(
                 }
 
                 entrytracker->Serialize(httpd->GetSuffix(tokenurl[4]), stream, 
-                        tmi->second, NULL);
+                        dev, NULL);
 
                 return MHD_YES;
             } else {
@@ -544,9 +690,8 @@ int Devicetracker::Httpd_CreateStreamResponse(
 
             SharedTrackerElement devvec(new TrackerElement(TrackerVector));
 
-            auto mmp = tracked_mac_multimap.equal_range(mac);
-            for (auto mmpi = mmp.first; mmpi != mmp.second; ++mmpi) {
-                devvec->add_vector(mmpi->second);
+            for (auto d : tracked_index.find_mac(mac)) {
+                devvec->add_vector(d);
             }
 
             entrytracker->Serialize(httpd->GetSuffix(tokenurl[4]), stream, devvec, NULL);
@@ -563,30 +708,29 @@ int Devicetracker::Httpd_CreateStreamResponse(
 
             // If it's negative, subtract from the current ts
             if (lastts < 0) {
-                time_t now = time(0);
+                time_t now = KisClock::CoarseWallSec();
                 lastts = now + lastts;
             }
 
             if (!Httpd_CanSerialize(tokenurl[4]))
                 return MHD_YES;
 
-            local_locker lock(&devicelist_mutex);
-
             SharedTrackerElement devvec =
                 globalreg->entrytracker->GetTrackedInstance(device_list_base_id);
 
-            devicetracker_function_worker fw(globalreg, 
-                    [this, &stream, devvec, lastts](Devicetracker *, shared_ptr<kis_tracked_device_base> d) -> bool {
-                        if (d->get_last_time() <= lastts)
-                            return false;
+            SharedTrackerElement sincevec(new TrackerElement(TrackerVector));
 
-                        devvec->add_vector(d);
-                        
-                        return false;
-                    }, NULL);
-            MatchOnDevices(&fw);
+            FetchDevicesSince(lastts, sincevec);
 
-            entrytracker->Serialize(httpd->GetSuffix(tokenurl[4]), stream, devvec, NULL);
+            TrackerElementSerializer::rename_map rename_map;
+            TrackerElementSerializer::serial_cache_map cache_map;
+            vector<SharedElementSummary> summary_vec;
+            string format = httpd->GetSuffix(tokenurl[4]);
+
+            SummarizeDevicesBatched(format, sincevec, "", summary_vec, NULL,
+                    devvec, rename_map, cache_map);
+
+            entrytracker->Serialize(format, stream, devvec, &rename_map, &cache_map);
 
             return MHD_YES;
         }
@@ -597,7 +741,8 @@ int Devicetracker::Httpd_CreateStreamResponse(
 }
 
 int Devicetracker::Httpd_PostComplete(Kis_Net_Httpd_Connection *concls) {
-    local_locker lock(&devicelist_mutex);
+    // Each request takes the devicelist lock for as long as it needs it;
+    // the device lists summarize in batches and serialize without it
 
     // Split URL and process
     vector<string> tokenurl = StrTokenize(concls->url, "/");
@@ -642,19 +787,18 @@ int Devicetracker::Httpd_PostComplete(Kis_Net_Httpd_Connection *concls) {
     // Rename cache generated during simplification
     TrackerElementSerializer::rename_map rename_map;
 
+    // Cached serialized devices used in the output
+    TrackerElementSerializer::serial_cache_map cache_map;
+
     SharedStructured regexdata;
 
+    // Flag filter, if any
+    uint64_t flag_set = 0, flag_clear = 0;
+    int flag_query = 0;
+
     try {
         // Decode the base64 msgpack and parse it, or parse the json
-        if (concls->variable_cache.find("msgpack") != concls->variable_cache.end()) {
-            structdata.reset(new StructuredMsgpack(Base64::decode(concls->variable_cache["msgpack"]->str())));
-        } else if (concls->variable_cache.find("json") != 
-                concls->variable_cache.end()) {
-            structdata.reset(new StructuredJson(concls->variable_cache["json"]->str()));
-        } else {
-            // fprintf(stderr, "debug - missing data\n");
-            throw StructuredDataException("Missing data");
-        }
+        structdata = concls->FetchStructuredPost();
     } catch(const StructuredDataException e) {
         stream << "Invalid request: ";
         stream << e.what();
@@ -704,6 +848,18 @@ int Devicetracker::Httpd_PostComplete(Kis_Net_Httpd_Connection *concls) {
         return MHD_YES;
     }
 
+    string flag_error;
+    flag_query = FlagQueryForRequest(structdata, &flag_set, &flag_clear, &flag_error);
+
+    if (flag_query < 0) {
+        stream << "Invalid request: ";
+        stream << flag_error;
+        concls->httpcode = 400;
+        return MHD_YES;
+    }
+
+    string projection = SerialProjectionKey(summary_vec);
+
     if (tokenurl[1] == "devices") {
         if (tokenurl[2] == "by-mac") {
             if (tokenurl.size() < 5) {
@@ -734,7 +890,7 @@ int Devicetracker::Httpd_PostComplete(Kis_Net_Httpd_Connection *concls) {
                 return MHD_YES;
             }
 
-            if (tracked_mac_multimap.count(mac) == 0) {
+            if (!tracked_index.contains_mac(mac)) {
                 stream << "Invalid request";
                 concls->httpcode = 400;
                 return MHD_YES;
@@ -745,19 +901,18 @@ int Devicetracker::Httpd_PostComplete(Kis_Net_Httpd_Connection *concls) {
             if (target == "devices") {
                 SharedTrackerElement devvec(new TrackerElement(TrackerVector));
 
-                auto mmp = tracked_mac_multimap.equal_range(mac);
+                string format = httpd->GetSuffix(tokenurl[4]);
+                shared_ptr<JsonAdapter::SummaryPlan> plan =
+                    CompileSummaryPlan(format, summary_vec);
 
-                for (auto mmpi = mmp.first; mmpi != mmp.second; ++mmpi) {
-                    SharedTrackerElement simple;
-
-                    SummarizeTrackerElement(entrytracker, mmpi->second, summary_vec,
-                            simple, rename_map);
-            
-                    devvec->add_vector(simple);
+                for (auto d : tracked_index.find_mac(mac)) {
+                    devvec->add_vector(SummarizeDeviceCached(format, d,
+                                projection, summary_vec, rename_map, cache_map,
+                                plan.get()));
                 }
 
-                entrytracker->Serialize(httpd->GetSuffix(tokenurl[4]), stream, 
-                        devvec, &rename_map);
+                entrytracker->Serialize(format, stream, devvec, &rename_map, 
+                        &cache_map);
 
                 return MHD_YES;
             }
@@ -782,10 +937,11 @@ int Devicetracker::Httpd_PostComplete(Kis_Net_Httpd_Connection *concls) {
             std::stringstream ss(tokenurl[3]);
             ss >> key;
 
-            map<uint64_t, shared_ptr<kis_tracked_device_base> >::iterator tmi =
-                tracked_map.find(key);
+            local_locker lock(&devicelist_mutex);
+
+            shared_ptr<kis_tracked_device_base> dev = FetchDevice(key);
 
-            if (tmi == tracked_map.end()) {
+            if (dev == NULL) {
                 stream << "Invalid request";
                 concls->httpcode = 400;
                 return MHD_YES;
@@ -796,7 +952,7 @@ int Devicetracker::Httpd_PostComplete(Kis_Net_Httpd_Connection *concls) {
             if (target == "device") {
                 SharedTrackerElement simple;
 
-                SummarizeTrackerElement(entrytracker, tmi->second, summary_vec,
+                SummarizeTrackerElement(entrytracker, dev, summary_vec,
                         simple, rename_map);
 
                 entrytracker->Serialize(httpd->GetSuffix(tokenurl[4]), stream, 
@@ -813,10 +969,170 @@ int Devicetracker::Httpd_PostComplete(Kis_Net_Httpd_Connection *concls) {
 
             }
 
+        } else if (tokenurl[2] == "view") {
+            return httpd_device_view(concls, stream, structdata, summary_vec,
+                    httpd->GetSuffix(tokenurl[3]));
+        } else if (tokenurl[2] == "columns") {
+            return httpd_device_columns(concls, stream, summary_vec);
+        } else if (tokenurl[2] == "by-ssid" || tokenurl[2] == "by-oui" ||
+                tokenurl[2] == "by-channel") {
+            if (tokenurl.size() < 5 || !Httpd_CanSerialize(tokenurl[4])) {
+                stream << "Invalid request";
+                concls->httpcode = 400;
+                return MHD_YES;
+            }
+
+            string term;
+            DevicetrackerTermIndex *term_index =
+                TermIndexForRequest(tokenurl[2], tokenurl[3], term);
+
+            local_locker lock(&devicelist_mutex);
+
+            SharedTrackerElement devvec(new TrackerElement(TrackerVector));
+
+            string format = httpd->GetSuffix(tokenurl[4]);
+            shared_ptr<JsonAdapter::SummaryPlan> plan =
+                CompileSummaryPlan(format, summary_vec);
+
+            for (auto d : FetchDevicesByTerm(*term_index, term)) {
+                devvec->add_vector(SummarizeDeviceCached(format, d,
+                            projection, summary_vec, rename_map, cache_map,
+                            plan.get()));
+            }
+
+            entrytracker->Serialize(format, stream, devvec, &rename_map, &cache_map);
+
+            return MHD_YES;
+        } else if (tokenurl[2] == "multikey") {
+            // Every device named by key or by MAC, in the order asked for,
+            // from one pass under the list lock
+            vector<uint64_t> keys;
+            vector<mac_addr> macs;
+            vector<bool> is_mac;
+
+            try {
+                if (!structdata->hasKey("devices")) {
+                    stream << "Invalid request: Expected 'devices'";
+                    concls->httpcode = 400;
+                    return MHD_YES;
+                }
+
+                StructuredData::structured_vec dvec =
+                    structdata->getStructuredByKey("devices")->getStructuredArray();
+
+                for (auto i : dvec) {
+                    if (i->isNumber()) {
+                        keys.push_back((uint64_t) i->getNumber());
+                        is_mac.push_back(false);
+                        continue;
+                    }
+
+                    string term = i->getString();
+
+                    if (term.find(':') != string::npos) {
+                        mac_addr mac(term);
+
+                        if (mac.error) {
+                            stream << "Invalid request: Invalid MAC " << term;
+                            concls->httpcode = 400;
+                            return MHD_YES;
+                        }
+
+                        macs.push_back(mac);
+                        is_mac.push_back(true);
+                    } else {
+                        uint64_t key = 0;
+                        std::stringstream ss(term);
+                        ss >> key;
+
+                        if (ss.fail()) {
+                            stream << "Invalid request: Invalid key " << term;
+                            concls->httpcode = 400;
+                            return MHD_YES;
+                        }
+
+                        keys.push_back(key);
+                        is_mac.push_back(false);
+                    }
+                }
+            } catch(const StructuredDataException e) {
+                stream << "Invalid request: ";
+                stream << e.what();
+                concls->httpcode = 400;
+                return MHD_YES;
+            }
+
+            local_locker lock(&devicelist_mutex);
+
+            SharedTrackerElement devvec(new TrackerElement(TrackerVector));
+
+            string format = httpd->GetSuffix(tokenurl[3]);
+            shared_ptr<JsonAdapter::SummaryPlan> plan =
+                CompileSummaryPlan(format, summary_vec);
+
+            // A device named twice, or by its key and its MAC, is sent once
+            std::set<kis_tracked_device_base *> seen;
+            size_t ki = 0, mi = 0;
+
+            auto add_device = [&](shared_ptr<kis_tracked_device_base> d) {
+                if (d == NULL || !seen.insert(d.get()).second)
+                    return;
+
+                devvec->add_vector(SummarizeDeviceCached(format, d,
+                            projection, summary_vec, rename_map, cache_map,
+                            plan.get()));
+            };
+
+            for (size_t x = 0; x < is_mac.size(); x++) {
+                if (is_mac[x]) {
+                    mac_addr& mac = macs[mi++];
+
+                    if (!tracked_index.contains_mac(mac))
+                        continue;
+
+                    for (auto d : tracked_index.find_mac(mac))
+                        add_device(d);
+                } else {
+                    add_device(FetchDevice(keys[ki++]));
+                }
+            }
+
+            entrytracker->Serialize(format, stream, devvec, &rename_map, &cache_map);
+
+            return MHD_YES;
+        } else if (tokenurl[2] == "by-location") {
+            double box[4];
+
+            if (!ParseLocationBox(tokenurl, box) || !Httpd_CanSerialize(tokenurl[7])) {
+                stream << "Invalid request";
+                concls->httpcode = 400;
+                return MHD_YES;
+            }
+
+            local_locker lock(&devicelist_mutex);
+
+            SharedTrackerElement devvec(new TrackerElement(TrackerVector));
+
+            string format = httpd->GetSuffix(tokenurl[7]);
+            shared_ptr<JsonAdapter::SummaryPlan> plan =
+                CompileSummaryPlan(format, summary_vec);
+
+            for (auto d : FetchDevicesByLocation(box[0], box[1], box[2], box[3])) {
+                devvec->add_vector(SummarizeDeviceCached(format, d,
+                            projection, summary_vec, rename_map, cache_map,
+                            plan.get()));
+            }
+
+            entrytracker->Serialize(format, stream, devvec, &rename_map, &cache_map);
+
+            return MHD_YES;
         } else if (tokenurl[2] == "summary") {
             // Wrapper we insert under
             SharedTrackerElement wrapper = NULL;
 
+            shared_ptr<JsonAdapter::SummaryPlan> plan =
+                CompileSummaryPlan(httpd->GetSuffix(tokenurl[3]), summary_vec);
+
             // DT fields
             SharedTrackerElement dt_length_elem = NULL;
             SharedTrackerElement dt_filter_elem = NULL;
@@ -950,7 +1266,7 @@ int Devicetracker::Httpd_PostComplete(Kis_Net_Httpd_Connection *concls) {
                 // Make the length and filter elements
                 dt_length_elem.reset(new TrackerElement(TrackerUInt64, dt_length_id));
                 dt_length_elem->set_local_name("recordsTotal");
-                dt_length_elem->set((uint64_t) tracked_vec.size());
+                dt_length_elem->set((uint64_t) tracked_index.size());
                 wrapper->add_map(dt_length_elem);
 
                 dt_filter_elem.reset(new TrackerElement(TrackerUInt64, dt_filter_id));
@@ -958,6 +1274,23 @@ int Devicetracker::Httpd_PostComplete(Kis_Net_Httpd_Connection *concls) {
                 wrapper->add_map(dt_filter_elem);
             }
 
+            // Devices in the output, in order; summarized after the devicelist
+            // lock is released
+            SharedTrackerElement selected(new TrackerElement(TrackerVector));
+
+            // Devices matching the flag filter, which are all the other filters
+            // look at
+            SharedTrackerElement flagdevs;
+
+            if (flag_query > 0) {
+                flagdevs.reset(new TrackerElement(TrackerVector));
+
+                local_locker lock(&devicelist_mutex);
+
+                for (auto d : FetchDevicesByFlags_nl(flag_set, flag_clear))
+                    flagdevs->add_vector(d);
+            }
+
             if (regexdata != NULL) {
                 // If we're doing a basic regex outside of devicetables
                 // shenanigans...
@@ -966,7 +1299,13 @@ int Devicetracker::Httpd_PostComplete(Kis_Net_Httpd_Connection *concls) {
                 TrackerElementVector pcrevec(pcredevs);
 
                 devicetracker_pcre_worker worker(globalreg, regexdata, pcredevs);
-                MatchOnDevices(&worker);
+                if (flagdevs != NULL)
+                    MatchOnDevices(&worker, flagdevs);
+                else
+                    MatchOnDevices(&worker);
+
+                // Sorting looks at the device fields
+                local_locker lock(&devicelist_mutex);
                 
                 // Check DT ranges
                 if (dt_start >= pcrevec.size())
@@ -1000,15 +1339,8 @@ int Devicetracker::Httpd_PostComplete(Kis_Net_Httpd_Connection *concls) {
                 else
                     ei = pcrevec.begin() + dt_start + dt_length;
 
-                for (vi = pcrevec.begin() + dt_start; vi != ei; ++vi) {
-                    SharedTrackerElement simple;
-
-                    SummarizeTrackerElement(entrytracker,
-                            (*vi), summary_vec,
-                            simple, rename_map);
-
-                    outdevs->add_vector(simple);
-                }
+                for (vi = pcrevec.begin() + dt_start; vi != ei; ++vi)
+                    selected->add_vector(*vi);
             } else if (dt_search_paths.size() != 0) {
                 // Otherwise, we're doing a search inside a datatables query,
                 // so go through every device and do a search on every element
@@ -1020,7 +1352,13 @@ int Devicetracker::Httpd_PostComplete(Kis_Net_Httpd_Connection *concls) {
 
                 devicetracker_stringmatch_worker worker(globalreg, dt_search, 
                         dt_search_paths, matchdevs);
-                MatchOnDevices(&worker);
+                if (flagdevs != NULL)
+                    MatchOnDevices(&worker, flagdevs);
+                else
+                    MatchOnDevices(&worker);
+
+                // Sorting looks at the device fields
+                local_locker lock(&devicelist_mutex);
                 
                 if (dt_order_col > 0) {
                     kismet__stable_sort(matchvec.begin(), matchvec.end(), 
@@ -1054,18 +1392,51 @@ int Devicetracker::Httpd_PostComplete(Kis_Net_Httpd_Connection *concls) {
 
                 // If we filtered, that's our list
                 TrackerElementVector::iterator vi;
-                for (vi = matchvec.begin() + dt_start; vi != ei; ++vi) {
-                    SharedTrackerElement simple;
+                for (vi = matchvec.begin() + dt_start; vi != ei; ++vi)
+                    selected->add_vector(*vi);
+            } else if (flagdevs != NULL) {
+                // Only the flag filter, so the flagged devices are the list
+                TrackerElementVector flagvec(flagdevs);
+
+                // Sorting looks at the device fields
+                local_locker lock(&devicelist_mutex);
+
+                if (dt_order_col > 0) {
+                    kismet__stable_sort(flagvec.begin(), flagvec.end(), 
+                            [&](SharedTrackerElement a, SharedTrackerElement b) {
+                            SharedTrackerElement fa =
+                                GetTrackerElementPath(dt_order_field, a);
+                            SharedTrackerElement fb =
+                                GetTrackerElementPath(dt_order_field, b);
 
-                    SummarizeTrackerElement(entrytracker,
-                            (*vi), summary_vec,
-                            simple, rename_map);
+                            if (dt_order_dir == 0)
+                                return fa < fb;
 
-                    outdevs->add_vector(simple);
+                            return fb < fa;
+                        });
                 }
+
+                // Check DT ranges
+                if (dt_start >= flagvec.size())
+                    dt_start = 0;
+
+                if (dt_filter_elem != NULL)
+                    dt_filter_elem->set((uint64_t) flagvec.size());
+
+                TrackerElementVector::iterator ei;
+                if (dt_length == 0 ||
+                        dt_length + dt_start >= flagvec.size())
+                    ei = flagvec.end();
+                else
+                    ei = flagvec.begin() + dt_start + dt_length;
+
+                for (TrackerElementVector::iterator vi = flagvec.begin() + dt_start; 
+                        vi != ei; ++vi)
+                    selected->add_vector(*vi);
             } else {
                 // Otherwise we use the complete list
-                //
+                local_locker lock(&devicelist_mutex);
+
                 // Check DT ranges
                 if (dt_start >= tracked_vec.size())
                     dt_start = 0;
@@ -1086,6 +1457,9 @@ int Devicetracker::Httpd_PostComplete(Kis_Net_Httpd_Connection *concls) {
 
                             return fb < fa;
                         });
+
+                    for (size_t x = 0; x < tracked_vec.size(); x++)
+                        tracked_vec[x]->set_tracked_vec_pos(x);
                 }
 
                 vector<shared_ptr<kis_tracked_device_base> >::iterator vi;
@@ -1098,17 +1472,14 @@ int Devicetracker::Httpd_PostComplete(Kis_Net_Httpd_Connection *concls) {
                 else
                     ei = tracked_vec.begin() + dt_start + dt_length;
 
-                for (vi = tracked_vec.begin() + dt_start; vi != ei; ++vi) {
-                    SharedTrackerElement simple;
-
-                    SummarizeTrackerElement(entrytracker,
-                            (*vi), summary_vec,
-                            simple, rename_map);
-
-                    outdevs->add_vector(simple);
-                }
+                for (vi = tracked_vec.begin() + dt_start; vi != ei; ++vi)
+                    selected->add_vector(*vi);
             }
 
+            SummarizeDevicesBatched(httpd->GetSuffix(tokenurl[3]), selected,
+                    projection, summary_vec, plan.get(), outdevs, rename_map, 
+                    cache_map);
+
             // Apply wrapper if we haven't applied it already
             if (wrapper_name != "" && wrapper == NULL) {
                 wrapper.reset(new TrackerElement(TrackerMap));
@@ -1119,7 +1490,7 @@ int Devicetracker::Httpd_PostComplete(Kis_Net_Httpd_Connection *concls) {
             }
 
             entrytracker->Serialize(httpd->GetSuffix(tokenurl[3]), stream, 
-                    wrapper, &rename_map);
+                    wrapper, &rename_map, &cache_map);
             return MHD_YES;
 
         } else if (tokenurl[2] == "last-time") {
@@ -1140,7 +1511,7 @@ int Devicetracker::Httpd_PostComplete(Kis_Net_Httpd_Connection *concls) {
 
             // If it's negative, subtract from the current ts
             if (lastts < 0) {
-                time_t now = time(0);
+                time_t now = KisClock::CoarseWallSec();
                 lastts = now + lastts;
             }
 
@@ -1153,16 +1524,29 @@ int Devicetracker::Httpd_PostComplete(Kis_Net_Httpd_Connection *concls) {
             //  List of devices that pass the regex filter
             SharedTrackerElement regexdevs(new TrackerElement(TrackerVector));
 
-            devicetracker_function_worker tw(globalreg, 
-                    [this, &stream, timedevs, lastts](Devicetracker *, shared_ptr<kis_tracked_device_base> d) -> bool {
-                        if (d->get_last_time() <= lastts)
-                            return false;
+            FetchDevicesSince(lastts, timedevs);
+
+            if (flag_query > 0) {
+                SharedTrackerElement flagdevs(new TrackerElement(TrackerVector));
+                TrackerElementVector timevec(timedevs);
 
-                        timedevs->add_vector(d);
-                        
-                        return false;
-                    }, NULL);
-            MatchOnDevices(&tw);
+                {
+                    local_locker lock(&devicelist_mutex);
+
+                    flag_index.refresh(modified_list, tracked_vec);
+
+                    for (auto d : timevec) {
+                        shared_ptr<kis_tracked_device_base> dev =
+                            static_pointer_cast<kis_tracked_device_base>(d);
+
+                        if (flag_index.match(dev->get_kis_internal_id(), 
+                                    flag_set, flag_clear))
+                            flagdevs->add_vector(d);
+                    }
+                }
+
+                timedevs = flagdevs;
+            }
 
             // fprintf(stderr, "debug - %lu time devs\n", timedevs->get_vector()->size());
 
@@ -1178,22 +1562,16 @@ int Devicetracker::Httpd_PostComplete(Kis_Net_Httpd_Connection *concls) {
             // Final devices being simplified and sent out
             SharedTrackerElement outdevs(new TrackerElement(TrackerVector));
 
-            devicetracker_function_worker sw(globalreg, 
-                    [this, summary_vec, &rename_map, outdevs](Devicetracker *, shared_ptr<kis_tracked_device_base> d) -> bool {
-                        SharedTrackerElement simple;
+            string format = httpd->GetSuffix(tokenurl[4]);
 
-                        SummarizeTrackerElement(entrytracker, 
-                                static_pointer_cast<TrackerElement>(d), summary_vec,
-                                simple, rename_map);
+            shared_ptr<JsonAdapter::SummaryPlan> plan =
+                CompileSummaryPlan(format, summary_vec);
 
-                        outdevs->add_vector(simple);
-                        
-                        return false;
-                    }, NULL);
-            MatchOnDevices(&sw, regexdevs);
+            SummarizeDevicesBatched(format, regexdevs, projection, summary_vec,
+                    plan.get(), outdevs, rename_map, cache_map);
 
-            entrytracker->Serialize(httpd->GetSuffix(tokenurl[4]), stream, 
-                    outdevs, &rename_map);
+            entrytracker->Serialize(format, stream, outdevs, &rename_map, 
+                    &cache_map);
             return MHD_YES;
         }
     }
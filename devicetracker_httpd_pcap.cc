@@ -81,21 +81,9 @@ int Devicetracker_Httpd_Pcap::Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd,
     shared_ptr<Devicetracker> devicetracker =
         static_pointer_cast<Devicetracker>(http_globalreg->FetchGlobal("DEVICE_TRACKER"));
 
-    vector<string> tokenurl = StrTokenize(url, "/");
-    if (tokenurl.size() < 6)
-        return MHD_YES;
-
-    if (tokenurl[1] != "devices")
-        return MHD_YES;
-
-    if (tokenurl[2] != "by-key")
-        return MHD_YES;
-
-    if (tokenurl[4] != "pcap")
-        return MHD_YES;
-
+    // The path was matched by our route
     uint64_t key = 0;
-    std::stringstream ss(tokenurl[3]);
+    std::stringstream ss(connection->url_params["key"]);
     ss >> key;
 
     shared_ptr<kis_tracked_device_base> dev = devicetracker->FetchDevice(key);
@@ -30,7 +30,9 @@ class Devicetracker_Httpd_Pcap : public Kis_Net_Httpd_Ringbuf_Stream_Handler {
 public:
     Devicetracker_Httpd_Pcap() : Kis_Net_Httpd_Ringbuf_Stream_Handler() { }
     Devicetracker_Httpd_Pcap(GlobalRegistry *in_globalreg) : 
-        Kis_Net_Httpd_Ringbuf_Stream_Handler(in_globalreg) { }
+        Kis_Net_Httpd_Ringbuf_Stream_Handler(in_globalreg) {
+        Httpd_RegisterRoute("GET", "/devices/by-key/:key/pcap/:file");
+    }
 
     virtual ~Devicetracker_Httpd_Pcap() { };
 
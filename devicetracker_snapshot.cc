@@ -0,0 +1,1003 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <zlib.h>
+
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#include "globalregistry.h"
+#include "util.h"
+#include "messagebus.h"
+#include "devicetracker.h"
+#include "kbin_adapter.h"
+#include "kis_log_formats.h"
+
+/* Saved device state
+ *
+ * The snapshot is written in the native byte order of the server, and is only
+ * meant to be read back by the same server on the same host:
+ *
+ *   header
+ *   device records, newest first; each is one kbin element with no header
+ *   field table     u32 count, { i32 id, u16 len, name }
+ *   phy table       u32 count, { i32 id, u16 len, name }
+ *   record table    snapshot_record per device, in record order
+ *   key table       snapshot_key per device, sorted by key
+ *
+ * Field and phy IDs are only valid for the run which wrote the snapshot, so
+ * both are carried by name and resolved again when the snapshot is loaded.
+ *
+ * The journal of changes since the snapshot is in the same byte order:
+ *
+ *   journal header
+ *   batches, each a journal_batch_header and its payload:
+ *     phy table     u32 count, { i32 id, u16 len, name }
+ *     records       u8 op, u64 key; updates follow with u32 len, one kbin element
+ *
+ * The structures are in kis_log_formats.h, where kismet_query finds them too.
+ *
+ * Kbin elements name each field the first time it is used, so the fields of a
+ * run are defined across its batches; the first batch of each run is flagged
+ * so the fields of the previous run are forgotten.  A batch which is short or
+ * fails its checksum was torn by the crash, and ends the journal.
+ */
+
+static uint32_t snapshot_native_flags() {
+    uint16_t probe = 1;
+
+    if (*((uint8_t *) &probe) == 1)
+        return KBIN_FLAG_LITTLE_ENDIAN;
+
+    return 0;
+}
+
+template<typename T> static inline void snapshot_put(std::ostream &stream, T v) {
+    stream.write((const char *) &v, sizeof(T));
+}
+
+static inline void snapshot_put_name(std::ostream &stream, const string& s) {
+    uint16_t len = s.length() > 0xFFFF ? 0xFFFF : s.length();
+    snapshot_put<uint16_t>(stream, len);
+    stream.write(s.data(), len);
+}
+
+// Read a table of { i32 id, u16 len, name } records
+static bool snapshot_get_names(const uint8_t *in_data, size_t in_len,
+        map<int, string> &ret_names) {
+    size_t pos = 0;
+    uint32_t count;
+
+    if (in_len < 4)
+        return false;
+
+    memcpy(&count, in_data, 4);
+    pos += 4;
+
+    for (uint32_t x = 0; x < count; x++) {
+        int32_t id;
+        uint16_t len;
+
+        if (in_len - pos < 6)
+            return false;
+
+        memcpy(&id, in_data + pos, 4);
+        memcpy(&len, in_data + pos + 4, 2);
+        pos += 6;
+
+        if (in_len - pos < len)
+            return false;
+
+        ret_names[id] = string((const char *) in_data + pos, len);
+        pos += len;
+    }
+
+    return true;
+}
+
+void Devicetracker::OpenSnapshot() {
+    int fd;
+    struct stat st;
+
+    if ((fd = open(snapshot_path.c_str(), O_RDONLY)) < 0) {
+        if (errno != ENOENT)
+            _MSG("Could not open saved device state '" + snapshot_path + "': " +
+                    string(strerror(errno)), MSGFLAG_ERROR);
+        return;
+    }
+
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(snapshot_header)) {
+        _MSG("Ignoring invalid saved device state '" + snapshot_path + "'",
+                MSGFLAG_ERROR);
+        close(fd);
+        return;
+    }
+
+    void *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (m == MAP_FAILED) {
+        _MSG("Could not map saved device state '" + snapshot_path + "': " +
+                string(strerror(errno)), MSGFLAG_ERROR);
+        return;
+    }
+
+    snapshot_map = (uint8_t *) m;
+    snapshot_map_len = st.st_size;
+
+    snapshot_header hdr;
+    memcpy(&hdr, snapshot_map, sizeof(snapshot_header));
+
+    uint64_t len = snapshot_map_len;
+
+    // Everything has to line up exactly, anything else is a partial or foreign
+    // file and we start empty
+    if (memcmp(hdr.magic, SNAPSHOT_MAGIC, 8) != 0 ||
+            hdr.version != SNAPSHOT_VERSION ||
+            hdr.flags != snapshot_native_flags() ||
+            hdr.file_length != len ||
+            hdr.fields_offset > hdr.phys_offset ||
+            hdr.phys_offset > hdr.records_offset ||
+            hdr.records_offset > len ||
+            hdr.num_records > (len - hdr.records_offset) /
+                (sizeof(snapshot_record) + sizeof(snapshot_key)) ||
+            hdr.keys_offset != hdr.records_offset +
+                hdr.num_records * sizeof(snapshot_record) ||
+            hdr.keys_offset + hdr.num_records * sizeof(snapshot_key) != len) {
+        _MSG("Ignoring invalid saved device state '" + snapshot_path + "'",
+                MSGFLAG_ERROR);
+        CloseSnapshot();
+        return;
+    }
+
+    snapshot_timestamp = hdr.timestamp;
+
+    map<int, string> field_names;
+
+    if (!snapshot_get_names(snapshot_map + hdr.fields_offset,
+                hdr.phys_offset - hdr.fields_offset, field_names) ||
+            !snapshot_get_names(snapshot_map + hdr.phys_offset,
+                hdr.records_offset - hdr.phys_offset, snapshot_phy_names)) {
+        _MSG("Ignoring invalid saved device state '" + snapshot_path + "'",
+                MSGFLAG_ERROR);
+        CloseSnapshot();
+        return;
+    }
+
+    // Make sure the device fields, and all the fields of the records nested
+    // inside it, are registered before we look them up by name
+    shared_ptr<kis_tracked_device_base> proto(new kis_tracked_device_base(globalreg,
+                device_base_id));
+
+    for (auto f : field_names)
+        KbinAdapter::DefineField(globalreg, snapshot_fields, f.first, f.second);
+
+    snapshot_records = (const snapshot_record *) (snapshot_map + hdr.records_offset);
+    snapshot_keys = (const snapshot_key *) (snapshot_map + hdr.keys_offset);
+    snapshot_num_records = hdr.num_records;
+
+    for (uint64_t r = 0; r < snapshot_num_records; r++) {
+        if (snapshot_records[r].offset < sizeof(snapshot_header) ||
+                snapshot_records[r].offset > hdr.fields_offset ||
+                snapshot_records[r].length >
+                    hdr.fields_offset - snapshot_records[r].offset ||
+                snapshot_keys[r].record >= snapshot_num_records) {
+            _MSG("Ignoring invalid saved device state '" + snapshot_path + "'",
+                    MSGFLAG_ERROR);
+            CloseSnapshot();
+            return;
+        }
+    }
+
+    snapshot_restored.assign(snapshot_num_records, false);
+    snapshot_restore_pos = 0;
+    snapshot_num_restored = 0;
+    snapshot_phys_resolved = false;
+
+    if (snapshot_num_records == 0) {
+        CloseSnapshot();
+        return;
+    }
+
+    snapshot_pending = true;
+
+    stringstream ss;
+    ss << "Restoring " << snapshot_num_records << " devices saved " <<
+        (globalreg->timestamp.tv_sec - (time_t) hdr.timestamp) <<
+        " seconds ago from '" << snapshot_path << "'";
+    _MSG(ss.str(), MSGFLAG_INFO);
+}
+
+void Devicetracker::CloseSnapshot() {
+    snapshot_pending = false;
+
+    if (snapshot_map != NULL)
+        munmap(snapshot_map, snapshot_map_len);
+
+    snapshot_map = NULL;
+    snapshot_map_len = 0;
+    snapshot_records = NULL;
+    snapshot_keys = NULL;
+    snapshot_num_records = 0;
+    snapshot_restored.clear();
+    snapshot_fields.clear();
+}
+
+void Devicetracker::ResolveSnapshotPhys() {
+    if (snapshot_phys_resolved)
+        return;
+
+    snapshot_phys_resolved = true;
+
+    for (auto p : snapshot_phy_names) {
+        Kis_Phy_Handler *phy = FetchPhyHandlerByName(p.second);
+
+        if (phy == NULL) {
+            _MSG("Saved devices for phy '" + p.second + "' will not be restored, "
+                    "that phy is no longer available", MSGFLAG_INFO);
+            continue;
+        }
+
+        snapshot_phy_to_current[p.first] = phy->FetchPhyId();
+        snapshot_phy_from_current[phy->FetchPhyId()] = p.first;
+    }
+}
+
+shared_ptr<kis_tracked_device_base> Devicetracker::RestoreSnapshotRecord(uint64_t in_record) {
+    local_locker lock(&devicelist_mutex);
+
+    if (snapshot_map == NULL || in_record >= snapshot_num_records ||
+            snapshot_restored[in_record])
+        return NULL;
+
+    snapshot_restored[in_record] = true;
+    snapshot_num_restored++;
+
+    ResolveSnapshotPhys();
+
+    const snapshot_record *rec = &(snapshot_records[in_record]);
+
+    uint64_t key = rec->key;
+
+    auto pi = snapshot_phy_to_current.find(DevicetrackerKey::GetPhy(key));
+    if (pi == snapshot_phy_to_current.end())
+        return NULL;
+
+    DevicetrackerKey::SetPhy(key, pi->second);
+
+    // Seen again before we got to it
+    if (tracked_index.find(key) != NULL)
+        return NULL;
+
+    SharedTrackerElement e;
+
+    if (KbinAdapter::Unpacker(globalreg, snapshot_map + rec->offset, rec->length,
+                snapshot_fields, e) < 0 || e == NULL || e->get_type() != TrackerMap)
+        return NULL;
+
+    // Seen-by records are keyed by datasource numbers, which are only valid for
+    // the run that saved them; they're rebuilt as sources see the device again.
+    // Phy-specific records are left for the phy to rebuild the same way, since
+    // only the common device record knows how to import itself.
+    e->del_map(entrytracker->GetFieldId("kismet.device.base.seenby"));
+
+    shared_ptr<kis_tracked_device_base> device(new kis_tracked_device_base(globalreg,
+                device_base_id, e));
+
+    device->set_key(key);
+
+    AddTrackedDevice(device);
+    UpdateModifiedList(device);
+
+    return device;
+}
+
+shared_ptr<kis_tracked_device_base> Devicetracker::RestoreSnapshotDevice(uint64_t in_key) {
+    local_locker lock(&devicelist_mutex);
+
+    if (!snapshot_pending)
+        return NULL;
+
+    // Anything in the journal is newer than the snapshot
+    ReplayJournal();
+
+    shared_ptr<kis_tracked_device_base> device = tracked_index.find(in_key);
+
+    if (device != NULL)
+        return device;
+
+    ResolveSnapshotPhys();
+
+    auto pi = snapshot_phy_from_current.find(DevicetrackerKey::GetPhy(in_key));
+    if (pi == snapshot_phy_from_current.end())
+        return NULL;
+
+    uint64_t saved_key = in_key;
+    DevicetrackerKey::SetPhy(saved_key, pi->second);
+
+    const snapshot_key *end = snapshot_keys + snapshot_num_records;
+    const snapshot_key *k =
+        std::lower_bound(snapshot_keys, end, saved_key,
+                [](const snapshot_key &a, uint64_t b) { return a.key < b; });
+
+    if (k == end || k->key != saved_key)
+        return NULL;
+
+    return RestoreSnapshotRecord(k->record);
+}
+
+void Devicetracker::RestoreSnapshotBatch(uint64_t in_count) {
+    local_locker lock(&devicelist_mutex);
+
+    if (!snapshot_pending)
+        return;
+
+    ReplayJournal();
+
+    uint64_t n = 0;
+
+    // Records are newest first, so each one restored in order goes to the
+    // oldest bucket of the modification list
+    while (n < in_count && snapshot_restore_pos < snapshot_num_records) {
+        if (!snapshot_restored[snapshot_restore_pos]) {
+            RestoreSnapshotRecord(snapshot_restore_pos);
+            n++;
+        }
+
+        snapshot_restore_pos++;
+    }
+
+    if (snapshot_restore_pos >= snapshot_num_records) {
+        stringstream ss;
+        ss << "Finished restoring saved devices, " << tracked_vec.size() <<
+            " devices tracked";
+        _MSG(ss.str(), MSGFLAG_INFO);
+
+        CloseSnapshot();
+    }
+
+    UpdateFullRefresh();
+}
+
+int Devicetracker::SaveSnapshot() {
+    local_locker lock(&devicelist_mutex);
+
+    // Anything not restored yet would be lost from the new snapshot
+    if (snapshot_pending)
+        RestoreSnapshotBatch(snapshot_num_records);
+
+    vector<shared_ptr<kis_tracked_device_base> > devs = tracked_vec;
+
+    std::stable_sort(devs.begin(), devs.end(),
+            [](const shared_ptr<kis_tracked_device_base> &a,
+                const shared_ptr<kis_tracked_device_base> &b) {
+                return a->get_last_time() > b->get_last_time();
+            });
+
+    string tmp_path = snapshot_path + ".tmp";
+
+    std::ofstream ofs(tmp_path.c_str(), std::ios::binary | std::ios::trunc);
+
+    if (!ofs.is_open()) {
+        _MSG("Could not save device state to '" + tmp_path + "': " +
+                string(strerror(errno)), MSGFLAG_ERROR);
+        return -1;
+    }
+
+    snapshot_header hdr;
+    memset(&hdr, 0, sizeof(snapshot_header));
+    ofs.write((const char *) &hdr, sizeof(snapshot_header));
+
+    KbinAdapter::defined_fields defined;
+    vector<snapshot_record> records;
+    vector<snapshot_key> keys;
+
+    records.reserve(devs.size());
+    keys.reserve(devs.size());
+
+    for (auto d : devs) {
+        snapshot_record r;
+
+        r.key = d->get_key();
+        r.offset = ofs.tellp();
+        r.reserved = 0;
+
+        KbinAdapter::Packer(globalreg, ofs, d, defined);
+
+        r.length = (uint64_t) ofs.tellp() - r.offset;
+
+        snapshot_key k;
+        k.key = r.key;
+        k.record = records.size();
+
+        records.push_back(r);
+        keys.push_back(k);
+    }
+
+    // Cold devices are older than anything still in memory, and go after them;
+    // they're decoded and packed again so the snapshot names its own fields
+    vector<pair<uint64_t, cold_record> > cold;
+
+    cold.reserve(cold_index.size());
+    cold_index.for_each([&cold](uint64_t k, cold_record& cr) {
+            cold.push_back(std::make_pair(k, cr));
+        });
+
+    std::stable_sort(cold.begin(), cold.end(),
+            [](const pair<uint64_t, cold_record> &a,
+                const pair<uint64_t, cold_record> &b) {
+                return a.second.last_time > b.second.last_time;
+            });
+
+    for (auto c : cold) {
+        SharedTrackerElement e = UnpackColdRecord(c.second);
+
+        if (e == NULL)
+            continue;
+
+        snapshot_record r;
+
+        r.key = c.first;
+        r.offset = ofs.tellp();
+        r.reserved = 0;
+
+        KbinAdapter::Packer(globalreg, ofs, e, defined);
+
+        r.length = (uint64_t) ofs.tellp() - r.offset;
+
+        snapshot_key k;
+        k.key = r.key;
+        k.record = records.size();
+
+        records.push_back(r);
+        keys.push_back(k);
+    }
+
+    hdr.fields_offset = ofs.tellp();
+
+    snapshot_put<uint32_t>(ofs, defined.size());
+    for (auto f : defined) {
+        snapshot_put<int32_t>(ofs, f);
+        snapshot_put_name(ofs, entrytracker->GetFieldName(f));
+    }
+
+    hdr.phys_offset = ofs.tellp();
+
+    snapshot_put<uint32_t>(ofs, phy_handler_map.size());
+    for (auto p : phy_handler_map) {
+        snapshot_put<int32_t>(ofs, p.first);
+        snapshot_put_name(ofs, p.second->FetchPhyName());
+    }
+
+    std::sort(keys.begin(), keys.end(),
+            [](const snapshot_key &a, const snapshot_key &b) {
+                return a.key < b.key;
+            });
+
+    hdr.records_offset = ofs.tellp();
+    ofs.write((const char *) records.data(), records.size() * sizeof(snapshot_record));
+
+    hdr.keys_offset = ofs.tellp();
+    ofs.write((const char *) keys.data(), keys.size() * sizeof(snapshot_key));
+
+    memcpy(hdr.magic, SNAPSHOT_MAGIC, 8);
+    hdr.version = SNAPSHOT_VERSION;
+    hdr.flags = snapshot_native_flags();
+    hdr.timestamp = globalreg->timestamp.tv_sec;
+    hdr.num_records = records.size();
+    hdr.file_length = ofs.tellp();
+
+    ofs.seekp(0);
+    ofs.write((const char *) &hdr, sizeof(snapshot_header));
+    ofs.close();
+
+    if (ofs.fail()) {
+        _MSG("Could not save device state to '" + tmp_path + "'", MSGFLAG_ERROR);
+        unlink(tmp_path.c_str());
+        return -1;
+    }
+
+    // Replace the old snapshot in one step so a crash never leaves a partial one
+    if (rename(tmp_path.c_str(), snapshot_path.c_str()) < 0) {
+        _MSG("Could not save device state to '" + snapshot_path + "': " +
+                string(strerror(errno)), MSGFLAG_ERROR);
+        unlink(tmp_path.c_str());
+        return -1;
+    }
+
+    // Everything in the journal is in the new snapshot
+    if (journal_enabled)
+        ResetJournal(hdr.timestamp);
+
+    return 1;
+}
+
+void Devicetracker::OpenJournal() {
+    journal_header hdr;
+    bool journal_valid = false;
+
+    // Keep the journal if it follows the snapshot we loaded; it's replayed over
+    // the snapshot and new batches are added after it, so a second crash
+    // before the next snapshot loses nothing either
+    std::ifstream ifs(journal_path.c_str(), std::ios::binary);
+
+    if (ifs.is_open()) {
+        std::stringstream ss;
+        ss << ifs.rdbuf();
+        string contents = ss.str();
+
+        if (contents.length() >= sizeof(journal_header)) {
+            memcpy(&hdr, contents.data(), sizeof(journal_header));
+
+            if (memcmp(hdr.magic, JOURNAL_MAGIC, 8) == 0 &&
+                    hdr.version == JOURNAL_VERSION &&
+                    hdr.flags == snapshot_native_flags() &&
+                    hdr.snapshot_ts == snapshot_timestamp) {
+                journal_replay.assign(contents.begin() + sizeof(journal_header),
+                        contents.end());
+                journal_valid = true;
+            }
+        }
+    }
+
+    if (journal_valid) {
+        // Find the end of the last complete batch; anything after it was torn
+        // by the crash, and has to go before new batches are added after it
+        size_t good = 0;
+
+        while (journal_replay.size() - good >= sizeof(journal_batch_header)) {
+            journal_batch_header bhdr;
+            memcpy(&bhdr, journal_replay.data() + good, sizeof(journal_batch_header));
+
+            size_t remaining = journal_replay.size() - good - sizeof(journal_batch_header);
+
+            if (bhdr.magic != JOURNAL_BATCH_MAGIC || bhdr.length > remaining ||
+                    crc32(0L, (const Bytef *) journal_replay.data() + good + 
+                        sizeof(journal_batch_header), bhdr.length) != bhdr.crc)
+                break;
+
+            good += sizeof(journal_batch_header) + bhdr.length;
+        }
+
+        if (good != journal_replay.size()) {
+            _MSG("Discarding an incomplete batch at the end of the device journal '" +
+                    journal_path + "'", MSGFLAG_INFO);
+
+            journal_replay.resize(good);
+
+            if (truncate(journal_path.c_str(), sizeof(journal_header) + good) < 0)
+                journal_valid = false;
+        }
+
+        journal_replay_pending = journal_valid && good != 0;
+    }
+
+    if (journal_valid) {
+        journal_file = fopen(journal_path.c_str(), "ab");
+
+        if (journal_replay_pending) {
+            // Restoring has to run even if there's no snapshot to go with it
+            snapshot_pending = true;
+
+            stringstream ss;
+            ss << "Replaying " << journal_replay.size() << " bytes of device "
+                "changes from '" << journal_path << "'";
+            _MSG(ss.str(), MSGFLAG_INFO);
+        }
+    } else {
+        journal_replay.clear();
+
+        journal_file = fopen(journal_path.c_str(), "wb");
+
+        if (journal_file != NULL) {
+            memset(&hdr, 0, sizeof(journal_header));
+            memcpy(hdr.magic, JOURNAL_MAGIC, 8);
+            hdr.version = JOURNAL_VERSION;
+            hdr.flags = snapshot_native_flags();
+            hdr.snapshot_ts = snapshot_timestamp;
+
+            fwrite(&hdr, sizeof(journal_header), 1, journal_file);
+            fflush(journal_file);
+        }
+    }
+
+    if (journal_file == NULL) {
+        _MSG("Could not open device journal '" + journal_path + "': " +
+                string(strerror(errno)) + ", changes since the last snapshot will "
+                "not survive a crash", MSGFLAG_ERROR);
+        journal_enabled = false;
+        return;
+    }
+
+    journal_stop = false;
+    journal_thread = std::thread([this]() { JournalThread(); });
+}
+
+void Devicetracker::StopJournal() {
+    if (journal_thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lk(journal_mutex);
+            journal_stop = true;
+            journal_cv.notify_one();
+        }
+
+        journal_thread.join();
+    }
+
+    if (journal_file != NULL)
+        fclose(journal_file);
+
+    journal_file = NULL;
+}
+
+void Devicetracker::JournalThread() {
+    vector<journal_batch> batches;
+
+    while (1) {
+        bool stopping;
+
+        {
+            std::unique_lock<std::mutex> lk(journal_mutex);
+
+            while (!journal_stop && journal_queue.size() == 0)
+                journal_cv.wait(lk);
+
+            std::swap(batches, journal_queue);
+            stopping = journal_stop;
+        }
+
+        bool ok = true;
+
+        for (auto& b : batches) {
+            if (b.reset) {
+                journal_header hdr;
+
+                memset(&hdr, 0, sizeof(journal_header));
+                memcpy(hdr.magic, JOURNAL_MAGIC, 8);
+                hdr.version = JOURNAL_VERSION;
+                hdr.flags = snapshot_native_flags();
+                hdr.snapshot_ts = b.snapshot_ts;
+
+                // The file is opened for appending, so once it's truncated the
+                // header lands at the start
+                if (fflush(journal_file) != 0 ||
+                        ftruncate(fileno(journal_file), 0) < 0 ||
+                        fwrite(&hdr, sizeof(journal_header), 1, journal_file) != 1)
+                    ok = false;
+
+                continue;
+            }
+
+            if (fwrite(b.data.data(), b.data.length(), 1, journal_file) != 1)
+                ok = false;
+        }
+
+        // Every batch queued since the last pass is made durable with one sync
+        if (batches.size() != 0) {
+            if (fflush(journal_file) != 0 || fdatasync(fileno(journal_file)) < 0)
+                ok = false;
+        }
+
+        if (!ok && !journal_failed) {
+            _MSG("Could not write device journal '" + journal_path + "': " +
+                    string(strerror(errno)), MSGFLAG_ERROR);
+        }
+
+        // The next batch has to define its fields again, since the ones in a
+        // lost batch may never have reached the journal
+        if (!ok)
+            journal_failed = true;
+
+        batches.clear();
+
+        if (stopping)
+            break;
+    }
+}
+
+void Devicetracker::QueueJournal() {
+    if (!journal_enabled)
+        return;
+
+    local_locker lock(&devicelist_mutex);
+
+    if (journal_failed.exchange(false)) {
+        journal_defined.clear();
+        journal_new_run = true;
+    }
+
+    time_t now = globalreg->timestamp.tv_sec;
+
+    stringstream payload;
+    unsigned int num_records = 0;
+
+    snapshot_put<uint32_t>(payload, phy_handler_map.size());
+    for (auto p : phy_handler_map) {
+        snapshot_put<int32_t>(payload, p.first);
+        snapshot_put_name(payload, p.second->FetchPhyName());
+    }
+
+    // Devices seen later in the same second as the last pass were missed by
+    // it, so overlap by a second; devices which haven't changed are skipped by
+    // their version
+    for (auto d : modified_list) {
+        if (d->get_last_time() <= journal_last_ts)
+            break;
+
+        uint32_t version = d->get_mod_version();
+        auto vi = journal_versions.find(d->get_key());
+
+        if (vi != journal_versions.end() && vi->second == version)
+            continue;
+
+        stringstream rec;
+        KbinAdapter::Packer(globalreg, rec, d, journal_defined);
+        string recdata = rec.str();
+
+        snapshot_put<uint8_t>(payload, JOURNAL_OP_UPDATE);
+        snapshot_put<uint64_t>(payload, d->get_key());
+        snapshot_put<uint32_t>(payload, recdata.length());
+        payload.write(recdata.data(), recdata.length());
+
+        journal_versions[d->get_key()] = version;
+        num_records++;
+    }
+
+    journal_last_ts = now - 1;
+
+    for (auto k : journal_expired) {
+        snapshot_put<uint8_t>(payload, JOURNAL_OP_EXPIRE);
+        snapshot_put<uint64_t>(payload, k);
+
+        journal_versions.erase(k);
+        num_records++;
+    }
+
+    journal_expired.clear();
+
+    if (num_records == 0)
+        return;
+
+    string data = payload.str();
+
+    journal_batch_header bhdr;
+    bhdr.magic = JOURNAL_BATCH_MAGIC;
+    bhdr.flags = journal_new_run ? JOURNAL_BATCH_NEWRUN : 0;
+    bhdr.length = data.length();
+    bhdr.crc = crc32(0L, (const Bytef *) data.data(), data.length());
+
+    journal_new_run = false;
+
+    journal_batch b;
+    b.reset = false;
+    b.snapshot_ts = 0;
+    b.data.reserve(sizeof(journal_batch_header) + data.length());
+    b.data.append((const char *) &bhdr, sizeof(journal_batch_header));
+    b.data.append(data);
+
+    std::lock_guard<std::mutex> lk(journal_mutex);
+    journal_queue.push_back(std::move(b));
+    journal_cv.notify_one();
+}
+
+void Devicetracker::ResetJournal(uint64_t in_snapshot_ts) {
+    local_locker lock(&devicelist_mutex);
+
+    // The new journal starts over, defining every field again
+    journal_defined.clear();
+    journal_new_run = true;
+
+    journal_batch b;
+    b.reset = true;
+    b.snapshot_ts = in_snapshot_ts;
+
+    // Anything still waiting is already in the snapshot
+    std::lock_guard<std::mutex> lk(journal_mutex);
+    journal_queue.clear();
+    journal_queue.push_back(std::move(b));
+    journal_cv.notify_one();
+}
+
+void Devicetracker::ReplayJournal() {
+    if (!journal_replay_pending)
+        return;
+
+    journal_replay_pending = false;
+    journal_replaying = true;
+
+    ResolveSnapshotPhys();
+
+    KbinAdapter::stream_fields fields;
+    map<int, int> phy_to_current;
+
+    const uint8_t *data = journal_replay.data();
+    size_t len = journal_replay.size();
+    size_t pos = 0;
+
+    uint64_t num_updated = 0, num_expired = 0;
+    bool torn = false;
+
+    // Keep a device from the snapshot from coming back over the journal
+    auto mark_snapshot = [this](uint64_t in_key) {
+        auto pi = snapshot_phy_from_current.find(DevicetrackerKey::GetPhy(in_key));
+        if (pi == snapshot_phy_from_current.end() || snapshot_keys == NULL)
+            return;
+
+        uint64_t saved_key = in_key;
+        DevicetrackerKey::SetPhy(saved_key, pi->second);
+
+        const snapshot_key *end = snapshot_keys + snapshot_num_records;
+        const snapshot_key *k =
+            std::lower_bound(snapshot_keys, end, saved_key,
+                    [](const snapshot_key &a, uint64_t b) { return a.key < b; });
+
+        if (k != end && k->key == saved_key && !snapshot_restored[k->record]) {
+            snapshot_restored[k->record] = true;
+            snapshot_num_restored++;
+        }
+    };
+
+    while (pos < len) {
+        journal_batch_header bhdr;
+
+        if (len - pos < sizeof(journal_batch_header)) {
+            torn = true;
+            break;
+        }
+
+        memcpy(&bhdr, data + pos, sizeof(journal_batch_header));
+        pos += sizeof(journal_batch_header);
+
+        if (bhdr.magic != JOURNAL_BATCH_MAGIC || len - pos < bhdr.length ||
+                crc32(0L, (const Bytef *) data + pos, bhdr.length) != bhdr.crc) {
+            torn = true;
+            break;
+        }
+
+        const uint8_t *bdata = data + pos;
+        size_t blen = bhdr.length;
+        size_t bpos = 0;
+
+        pos += bhdr.length;
+
+        if (bhdr.flags & JOURNAL_BATCH_NEWRUN)
+            fields.clear();
+
+        map<int, string> phy_names;
+        uint32_t num_phys;
+
+        if (blen < 4)
+            break;
+
+        // Walk the phy table to find the records
+        memcpy(&num_phys, bdata, 4);
+        bpos = 4;
+
+        for (uint32_t x = 0; x < num_phys && bpos + 6 <= blen; x++) {
+            uint16_t nlen;
+            memcpy(&nlen, bdata + bpos + 4, 2);
+            bpos += 6 + nlen;
+        }
+
+        if (bpos > blen || !snapshot_get_names(bdata, bpos, phy_names))
+            break;
+
+        phy_to_current.clear();
+        for (auto p : phy_names) {
+            Kis_Phy_Handler *phy = FetchPhyHandlerByName(p.second);
+
+            if (phy != NULL)
+                phy_to_current[p.first] = phy->FetchPhyId();
+        }
+
+        while (bpos < blen) {
+            uint8_t op;
+            uint64_t key;
+
+            if (blen - bpos < 9)
+                break;
+
+            memcpy(&op, bdata + bpos, 1);
+            memcpy(&key, bdata + bpos + 1, 8);
+            bpos += 9;
+
+            SharedTrackerElement e;
+
+            if (op == JOURNAL_OP_UPDATE) {
+                uint32_t rlen;
+
+                if (blen - bpos < 4)
+                    break;
+
+                memcpy(&rlen, bdata + bpos, 4);
+                bpos += 4;
+
+                if (blen - bpos < rlen)
+                    break;
+
+                // Decode even if the phy is gone, so the fields it defines are
+                // known to the records after it
+                ssize_t r = KbinAdapter::Unpacker(globalreg, bdata + bpos, rlen, 
+                        fields, e);
+
+                bpos += rlen;
+
+                if (r < 0 || e == NULL || e->get_type() != TrackerMap)
+                    continue;
+            } else if (op != JOURNAL_OP_EXPIRE) {
+                break;
+            }
+
+            auto pi = phy_to_current.find(DevicetrackerKey::GetPhy(key));
+            if (pi == phy_to_current.end())
+                continue;
+
+            DevicetrackerKey::SetPhy(key, pi->second);
+
+            mark_snapshot(key);
+
+            shared_ptr<kis_tracked_device_base> existing = tracked_index.find(key);
+
+            if (existing != NULL)
+                RemoveTrackedDevice(existing);
+
+            if (op == JOURNAL_OP_EXPIRE) {
+                num_expired++;
+                continue;
+            }
+
+            // As with the snapshot, seen-by records and phy details are rebuilt
+            // from new traffic
+            e->del_map(entrytracker->GetFieldId("kismet.device.base.seenby"));
+
+            shared_ptr<kis_tracked_device_base> device(
+                    new kis_tracked_device_base(globalreg, device_base_id, e));
+
+            device->set_key(key);
+
+            AddTrackedDevice(device);
+            UpdateModifiedList(device);
+
+            num_updated++;
+        }
+    }
+
+    journal_replaying = false;
+
+    journal_replay.clear();
+    journal_replay.shrink_to_fit();
+
+    stringstream ss;
+    ss << "Replayed the device journal, " << num_updated << " devices updated and " <<
+        num_expired << " removed since the snapshot";
+    if (torn)
+        ss << ", the last batch was incomplete and was skipped";
+    _MSG(ss.str(), MSGFLAG_INFO);
+
+    UpdateFullRefresh();
+}
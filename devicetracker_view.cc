@@ -0,0 +1,232 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+
+#include <string>
+#include <sstream>
+#include <vector>
+
+#include "globalregistry.h"
+#include "util.h"
+#include "devicetracker.h"
+#include "entrytracker.h"
+#include "structured.h"
+
+/* Windowed device views
+ *
+ * A view is one page of the device list, sorted by one of a fixed set of
+ * columns and optionally filtered by a string.  Each sortable column has a
+ * DevicetrackerViewIndex which is kept sorted between requests, so the page
+ * is found by offset in the index instead of sorting every device.  A filter
+ * still has to look at every device in the view to count the matches, but
+ * walks them in sorted order.
+ */
+
+// Case-insensitive match of a lowercase filter against the fields a person
+// would search the device list by
+static bool device_view_match(shared_ptr<kis_tracked_device_base> in_device,
+        const string& in_filter) {
+    if (StrLower(in_device->get_macaddr().Mac2String()).find(in_filter) != string::npos)
+        return true;
+
+    if (StrLower(in_device->get_devicename()).find(in_filter) != string::npos)
+        return true;
+
+    if (StrLower(in_device->get_username()).find(in_filter) != string::npos)
+        return true;
+
+    if (StrLower(in_device->get_manuf()).find(in_filter) != string::npos)
+        return true;
+
+    if (StrLower(in_device->get_type_string()).find(in_filter) != string::npos)
+        return true;
+
+    return false;
+}
+
+int Devicetracker::httpd_device_view(Kis_Net_Httpd_Connection *concls,
+        std::ostream& stream, SharedStructured structdata,
+        vector<SharedElementSummary>& summary_vec, string in_format) {
+
+    local_locker lock(&devicelist_mutex);
+
+    string sort;
+    bool reverse;
+    string filter;
+    double in_offset, in_length;
+
+    try {
+        sort = structdata->getKeyAsString("sort", "last_time");
+        reverse = structdata->getKeyAsString("order", "desc") != "asc";
+        filter = StrLower(structdata->getKeyAsString("filter", ""));
+        in_offset = structdata->getKeyAsNumber("offset", 0);
+        in_length = structdata->getKeyAsNumber("length", 50);
+    } catch(const StructuredDataException e) {
+        stream << "Invalid request: ";
+        stream << e.what();
+        concls->httpcode = 400;
+        return MHD_YES;
+    }
+
+    uint64_t flag_set = 0, flag_clear = 0;
+    string flag_error;
+    int flag_query = FlagQueryForRequest(structdata, &flag_set, &flag_clear, &flag_error);
+
+    if (flag_query < 0) {
+        stream << "Invalid request: ";
+        stream << flag_error;
+        concls->httpcode = 400;
+        return MHD_YES;
+    }
+
+    if (flag_query > 0)
+        flag_index.refresh(modified_list, tracked_vec);
+
+    size_t offset = 0, length = 50;
+
+    if (in_offset > 0)
+        offset = (size_t) in_offset;
+
+    if (in_length > 200)
+        length = 200;
+    else if (in_length >= 1)
+        length = (size_t) in_length;
+
+    // Bring the requested view up to date and walk it; the walk callback is
+    // handed every device key in view order from the starting offset
+    function<void (size_t, function<bool (uint64_t)>)> walk;
+    size_t total;
+
+    if (sort == "last_time") {
+        view_last_time.refresh(modified_list, tracked_vec);
+        total = view_last_time.size();
+        walk = [this, reverse](size_t o, function<bool (uint64_t)> cb) {
+            view_last_time.walk(o, reverse, cb);
+        };
+    } else if (sort == "signal") {
+        view_signal.refresh(modified_list, tracked_vec);
+        total = view_signal.size();
+        walk = [this, reverse](size_t o, function<bool (uint64_t)> cb) {
+            view_signal.walk(o, reverse, cb);
+        };
+    } else if (sort == "packets") {
+        view_packets.refresh(modified_list, tracked_vec);
+        total = view_packets.size();
+        walk = [this, reverse](size_t o, function<bool (uint64_t)> cb) {
+            view_packets.walk(o, reverse, cb);
+        };
+    } else if (sort == "manuf") {
+        view_manuf.refresh(modified_list, tracked_vec);
+        total = view_manuf.size();
+        walk = [this, reverse](size_t o, function<bool (uint64_t)> cb) {
+            view_manuf.walk(o, reverse, cb);
+        };
+    } else if (sort == "channel") {
+        view_channel.refresh(modified_list, tracked_vec);
+        total = view_channel.size();
+        walk = [this, reverse](size_t o, function<bool (uint64_t)> cb) {
+            view_channel.walk(o, reverse, cb);
+        };
+    } else {
+        stream << "Invalid request: Unknown sort column";
+        concls->httpcode = 400;
+        return MHD_YES;
+    }
+
+    vector<shared_ptr<kis_tracked_device_base> > window;
+    size_t filtered = 0;
+
+    if (filter.length() == 0 && flag_query == 0) {
+        filtered = total;
+
+        walk(offset, [this, &window, length](uint64_t k) -> bool {
+                shared_ptr<kis_tracked_device_base> d = tracked_index.find(k);
+
+                if (d != NULL)
+                    window.push_back(d);
+
+                return window.size() < length;
+            });
+    } else {
+        // Every match has to be counted, but only the ones in the window are
+        // kept
+        walk(0, [this, &window, &filtered, &filter, flag_query, flag_set, flag_clear,
+                offset, length](uint64_t k) -> bool {
+                shared_ptr<kis_tracked_device_base> d = tracked_index.find(k);
+
+                if (d == NULL)
+                    return true;
+
+                // The flag test is one word compare, so it goes first
+                if (flag_query > 0 && 
+                        !flag_index.match(d->get_kis_internal_id(), flag_set, flag_clear))
+                    return true;
+
+                if (filter.length() != 0 && !device_view_match(d, filter))
+                    return true;
+
+                if (filtered >= offset && window.size() < length)
+                    window.push_back(d);
+
+                filtered++;
+
+                return true;
+            });
+    }
+
+    TrackerElementSerializer::rename_map rename_map;
+    TrackerElementSerializer::serial_cache_map cache_map;
+
+    string projection = SerialProjectionKey(summary_vec);
+    shared_ptr<JsonAdapter::SummaryPlan> plan =
+        CompileSummaryPlan(in_format, summary_vec);
+
+    SharedTrackerElement wrapper(new TrackerElement(TrackerMap));
+
+    SharedTrackerElement total_elem(new TrackerElement(TrackerUInt64,
+                device_view_total_id));
+    total_elem->set((uint64_t) total);
+    wrapper->add_map(total_elem);
+
+    SharedTrackerElement filtered_elem(new TrackerElement(TrackerUInt64,
+                device_view_filtered_id));
+    filtered_elem->set((uint64_t) filtered);
+    wrapper->add_map(filtered_elem);
+
+    SharedTrackerElement offset_elem(new TrackerElement(TrackerUInt64,
+                device_view_offset_id));
+    offset_elem->set((uint64_t) offset);
+    wrapper->add_map(offset_elem);
+
+    SharedTrackerElement outdevs =
+        globalreg->entrytracker->GetTrackedInstance(device_list_base_id);
+    wrapper->add_map(outdevs);
+
+    for (auto d : window) {
+        outdevs->add_vector(SummarizeDeviceCached(in_format, d, projection,
+                    summary_vec, rename_map, cache_map, plan.get()));
+    }
+
+    entrytracker->Serialize(in_format, stream, wrapper, &rename_map, &cache_map);
+
+    return MHD_YES;
+}
+
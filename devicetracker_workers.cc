@@ -92,6 +92,52 @@ void devicetracker_function_worker::Finalize(Devicetracker *devicetracker) {
 }
 
 
+devicetracker_serial_worker::devicetracker_serial_worker(GlobalRegistry *in_globalreg,
+        std::ostream& in_stream,
+        function<void (std::ostream&, shared_ptr<kis_tracked_device_base>)> in_scb) :
+    stream(in_stream) {
+
+    globalreg = in_globalreg;
+
+    scb = in_scb;
+
+    pthread_mutex_init(&worker_mutex, NULL);
+}
+
+devicetracker_serial_worker::~devicetracker_serial_worker() {
+    pthread_mutex_destroy(&worker_mutex);
+}
+
+void devicetracker_serial_worker::MatchDevice(Devicetracker *devicetracker,
+        shared_ptr<kis_tracked_device_base> device) {
+    local_locker lock(&worker_mutex);
+
+    scb(stream, device);
+}
+
+void devicetracker_serial_worker::PrepareSlots(unsigned int in_num_slots) {
+    slot_streams.clear();
+
+    for (unsigned int s = 0; s < in_num_slots; s++)
+        slot_streams.push_back(std::make_shared<std::stringstream>());
+}
+
+void devicetracker_serial_worker::MatchDeviceSlot(Devicetracker *devicetracker,
+        shared_ptr<kis_tracked_device_base> device, unsigned int in_slot) {
+    scb(*(slot_streams[in_slot]), device);
+}
+
+void devicetracker_serial_worker::ChunkComplete(Devicetracker *devicetracker) {
+    for (auto s : slot_streams) {
+        string chunk = s->str();
+
+        if (chunk.length() != 0)
+            stream.write(chunk.data(), chunk.length());
+
+        s->str("");
+    }
+}
+
 devicetracker_stringmatch_worker::devicetracker_stringmatch_worker(GlobalRegistry *in_globalreg,
         string in_query,
         vector<vector<int> > in_paths,
@@ -117,8 +163,7 @@ devicetracker_stringmatch_worker::~devicetracker_stringmatch_worker() {
     pthread_mutex_destroy(&worker_mutex);
 }
 
-void devicetracker_stringmatch_worker::MatchDevice(Devicetracker *devicetracker __attribute__((unused)),
-        shared_ptr<kis_tracked_device_base> device) {
+bool devicetracker_stringmatch_worker::match_device(shared_ptr<kis_tracked_device_base> device) {
     vector<vector<int> >::iterator i;
 
     bool matched = false;
@@ -140,21 +185,182 @@ void devicetracker_stringmatch_worker::MatchDevice(Devicetracker *devicetracker
                         mac_query_term_len);
         }
 
-        if (matched) {
-            local_locker lock(&worker_mutex);
-            return_dev_vec->add_vector(device);
-            break;
-        }
+        if (matched)
+            return true;
     }
 
+    return false;
+}
+
+void devicetracker_stringmatch_worker::MatchDevice(Devicetracker *devicetracker __attribute__((unused)),
+        shared_ptr<kis_tracked_device_base> device) {
+
+    if (match_device(device)) {
+        local_locker lock(&worker_mutex);
+        return_dev_vec->add_vector(device);
+    }
+}
+
+void devicetracker_stringmatch_worker::PrepareSlots(unsigned int in_num_slots) {
+    slot_devices.resize(in_num_slots);
+}
+
+void devicetracker_stringmatch_worker::MatchDeviceSlot(Devicetracker *devicetracker __attribute__((unused)),
+        shared_ptr<kis_tracked_device_base> device, unsigned int in_slot) {
+
+    if (match_device(device))
+        slot_devices[in_slot].push_back(device);
 }
 
 void devicetracker_stringmatch_worker::Finalize(Devicetracker *devicetracker __attribute__((unused))) {
+    local_locker lock(&worker_mutex);
 
+    for (auto& sv : slot_devices) {
+        for (auto d : sv)
+            return_dev_vec->add_vector(d);
+    }
+
+    slot_devices.clear();
 }
 
 #ifdef HAVE_LIBPCRE
 
+// JIT stacks start small and grow to this as a combined expression needs
+#define PCRE_JIT_STACK_MAX      (1024 * 1024)
+
+void devicetracker_pcre_worker::compile_filter(shared_ptr<devicetracker_pcre_worker::pcre_filter> filter,
+        string in_regex) {
+    const char *compile_error, *study_error = NULL;
+    int erroroffset;
+    ostringstream errordesc;
+
+    filter->regex = in_regex;
+
+    filter->re =
+        pcre_compile(in_regex.c_str(), 0, &compile_error, &erroroffset, NULL);
+
+    if (filter->re == NULL) {
+        errordesc << "Could not parse PCRE expression: " << compile_error <<
+            " at character " << erroroffset;
+        throw std::runtime_error(errordesc.str());
+    }
+
+    int study_opts = 0;
+#ifdef PCRE_STUDY_JIT_COMPILE
+    study_opts |= PCRE_STUDY_JIT_COMPILE;
+#endif
+
+    // Study returns NULL without an error when there was nothing to learn
+    filter->study = pcre_study(filter->re, study_opts, &study_error);
+    if (study_error != NULL) {
+        errordesc << "Could not parse PCRE expression, study/optimization "
+            "failure: " << study_error;
+        throw std::runtime_error(errordesc.str());
+    }
+
+    filter->jit = false;
+
+#ifdef PCRE_STUDY_JIT_COMPILE
+    // Without JIT support in libpcre, or for expressions it can't compile,
+    // the interpreter is used
+    int jit = 0;
+    if (filter->study != NULL &&
+            pcre_fullinfo(filter->re, filter->study, PCRE_INFO_JIT, &jit) == 0)
+        filter->jit = (jit != 0);
+#endif
+}
+
+// Expressions which can't be wrapped in a group of an alternation without
+// changing what they match: back references and recursion count groups from
+// the start of the whole expression, verbs must start it, and quoting or
+// extended-mode comments could swallow the closing bracket
+static bool pcre_combinable(const string& in_regex) {
+    const char *reject[] = { "\\g", "\\k", "\\Q", "(?P=", "(?P>", "(?R",
+        "(?&", "(*", "#" };
+
+    if (in_regex.length() == 0)
+        return false;
+
+    for (auto r : reject)
+        if (in_regex.find(r) != string::npos)
+            return false;
+
+    for (size_t p = 0; p + 1 < in_regex.length(); p++) {
+        if (in_regex[p] == '\\') {
+            if (isdigit(in_regex[p + 1]) && in_regex[p + 1] != '0')
+                return false;
+            // Skip whatever was escaped
+            p++;
+            continue;
+        }
+
+        if (in_regex[p] == '(' && p + 2 < in_regex.length() && in_regex[p + 1] == '?' &&
+                (isdigit(in_regex[p + 2]) || in_regex[p + 2] == '+' ||
+                 in_regex[p + 2] == '-')) {
+            // (?1), (?+1), (?-1) recursion; (?-i) is an option and fine
+            if (in_regex[p + 2] != '-' ||
+                    (p + 3 < in_regex.length() && isdigit(in_regex[p + 3])))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+void devicetracker_pcre_worker::combine_filters() {
+    vector<shared_ptr<devicetracker_pcre_worker::pcre_filter> > combined_vec;
+
+    // Expressions per target, in the order the targets were first seen
+    vector<string> target_order;
+    map<string, vector<shared_ptr<devicetracker_pcre_worker::pcre_filter> > > target_map;
+
+    for (auto f : filter_vec) {
+        if (!pcre_combinable(f->regex)) {
+            combined_vec.push_back(f);
+            continue;
+        }
+
+        if (target_map.find(f->target) == target_map.end())
+            target_order.push_back(f->target);
+
+        target_map[f->target].push_back(f);
+    }
+
+    for (auto t : target_order) {
+        vector<shared_ptr<devicetracker_pcre_worker::pcre_filter> >& tv = target_map[t];
+
+        if (tv.size() == 1) {
+            combined_vec.push_back(tv[0]);
+            continue;
+        }
+
+        string regex;
+
+        for (auto f : tv) {
+            if (regex.length() != 0)
+                regex += "|";
+            regex += "(?:" + f->regex + ")";
+        }
+
+        shared_ptr<pcre_filter> filter(new pcre_filter());
+        filter->target = t;
+        filter->resolved_target = tv[0]->resolved_target;
+
+        try {
+            compile_filter(filter, regex);
+        } catch (const std::runtime_error& e) {
+            // Every expression compiled alone, so keep them that way
+            for (auto f : tv)
+                combined_vec.push_back(f);
+            continue;
+        }
+
+        combined_vec.push_back(filter);
+    }
+
+    filter_vec = combined_vec;
+}
+
 devicetracker_pcre_worker::devicetracker_pcre_worker(GlobalRegistry *in_globalreg,
         vector<shared_ptr<devicetracker_pcre_worker::pcre_filter> > in_filter_vec,
         SharedTrackerElement in_devvec_object) {
@@ -167,8 +373,15 @@ devicetracker_pcre_worker::devicetracker_pcre_worker(GlobalRegistry *in_globalre
     filter_vec = in_filter_vec;
     error = false;
 
+    for (auto f : filter_vec)
+        f->resolved_target = CompileTrackerElementPath(f->target, entrytracker);
+
+    combine_filters();
+
     return_dev_vec = in_devvec_object;
 
+    PrepareSlots(0);
+
     pthread_mutex_init(&worker_mutex, NULL);
 }
 
@@ -201,30 +414,17 @@ devicetracker_pcre_worker::devicetracker_pcre_worker(GlobalRegistry *in_globalre
 
         shared_ptr<pcre_filter> filter(new pcre_filter());
         filter->target = field;
+        filter->resolved_target = CompileTrackerElementPath(field, entrytracker);
 
-        const char *compile_error, *study_error;
-        int erroroffset;
-        ostringstream errordesc;
-
-        filter->re =
-            pcre_compile(regex.c_str(), 0, &compile_error, &erroroffset, NULL);
-
-        if (filter->re == NULL) {
-            errordesc << "Could not parse PCRE expression: " << compile_error <<
-                " at character " << erroroffset;
-            throw std::runtime_error(errordesc.str());
-        }
-
-        filter->study = pcre_study(filter->re, 0, &study_error);
-        if (filter->study == NULL) {
-            errordesc << "Could not parse PCRE expression, study/optimization "
-                "failure: " << study_error;
-            throw std::runtime_error(errordesc.str());
-        }
+        compile_filter(filter, regex);
 
         filter_vec.push_back(filter);
     }
 
+    combine_filters();
+
+    PrepareSlots(0);
+
     pthread_mutex_init(&worker_mutex, NULL);
 }
 
@@ -253,50 +453,41 @@ devicetracker_pcre_worker::devicetracker_pcre_worker(GlobalRegistry *in_globalre
 
         shared_ptr<pcre_filter> filter(new pcre_filter());
         filter->target = in_target; 
+        filter->resolved_target = CompileTrackerElementPath(in_target, entrytracker);
 
-        const char *compile_error, *study_error;
-        int erroroffset;
-        ostringstream errordesc;
-
-        filter->re =
-            pcre_compile(regex.c_str(), 0, &compile_error, &erroroffset, NULL);
-
-        if (filter->re == NULL) {
-            errordesc << "Could not parse PCRE expression: " << compile_error <<
-                " at character " << erroroffset;
-            throw std::runtime_error(errordesc.str());
-        }
-
-        filter->study = pcre_study(filter->re, 0, &study_error);
-        if (filter->study == NULL) {
-            errordesc << "Could not parse PCRE expression, study/optimization "
-                "failure: " << study_error;
-            throw std::runtime_error(errordesc.str());
-        }
+        compile_filter(filter, regex);
 
         filter_vec.push_back(filter);
     }
 
+    combine_filters();
+
+    PrepareSlots(0);
+
     pthread_mutex_init(&worker_mutex, NULL);
 }
 
 devicetracker_pcre_worker::~devicetracker_pcre_worker() {
+#ifdef HAVE_PCRE_JIT_EXEC
+    for (auto s : jit_stacks)
+        if (s != NULL)
+            pcre_jit_stack_free(s);
+#endif
+
     pthread_mutex_destroy(&worker_mutex);
 }
 
-void devicetracker_pcre_worker::MatchDevice(Devicetracker *devicetracker __attribute__((unused)),
-        shared_ptr<kis_tracked_device_base> device) {
+bool devicetracker_pcre_worker::match_device(shared_ptr<kis_tracked_device_base> device,
+        pcre_jit_stack *in_jit_stack __attribute__((unused))) {
     vector<shared_ptr<devicetracker_pcre_worker::pcre_filter> >::iterator i;
 
-    bool matched = false;
-
     // Go through all the filters until we find one that hits
     for (i = filter_vec.begin(); i != filter_vec.end(); ++i) {
 
         // Get complex fields - this lets us search nested vectors
         // or strings or whatnot
         vector<SharedTrackerElement> fields = 
-            GetTrackerElementMultiPath((*i)->target, device, entrytracker);
+            GetTrackerElementMultiPath((*i)->resolved_target, device);
 
         for (vector<SharedTrackerElement>::iterator fi = fields.begin();
                 fi != fields.end(); ++fi) {
@@ -305,31 +496,65 @@ void devicetracker_pcre_worker::MatchDevice(Devicetracker *devicetracker __attri
                 continue;
 
             int rc;
-            int ovector[128];
-
-            rc = pcre_exec((*i)->re, (*i)->study,
-                    GetTrackerValue<string>(*fi).c_str(),
-                    GetTrackerValue<string>(*fi).length(),
-                    0, 0, ovector, 128);
+            const string& value = GetTrackerValue<string>(*fi);
+
+            // Only whether it matched matters, so no match vector is needed
+#ifdef HAVE_PCRE_JIT_EXEC
+            if ((*i)->jit && in_jit_stack != NULL)
+                rc = pcre_jit_exec((*i)->re, (*i)->study, value.c_str(),
+                        value.length(), 0, 0, NULL, 0, in_jit_stack);
+            else
+#endif
+                rc = pcre_exec((*i)->re, (*i)->study, value.c_str(),
+                        value.length(), 0, 0, NULL, 0);
 
             // Stop matching as soon as we find a hit
-            if (rc >= 0) {
-                matched = true;
-                break;
-            }
-
+            if (rc >= 0)
+                return true;
         }
+    }
 
-        if (matched) {
-            local_locker lock(&worker_mutex);
-            return_dev_vec->add_vector(device);
-        }
+    return false;
+}
+
+void devicetracker_pcre_worker::MatchDevice(Devicetracker *devicetracker __attribute__((unused)),
+        shared_ptr<kis_tracked_device_base> device) {
+
+    if (match_device(device, jit_stacks.back())) {
+        local_locker lock(&worker_mutex);
+        return_dev_vec->add_vector(device);
     }
+}
 
+void devicetracker_pcre_worker::PrepareSlots(unsigned int in_num_slots) {
+    slot_devices.resize(in_num_slots);
+
+    // One stack per slot, plus the serial one
+    while (jit_stacks.size() < in_num_slots + 1) {
+#ifdef HAVE_PCRE_JIT_EXEC
+        jit_stacks.push_back(pcre_jit_stack_alloc(32 * 1024, PCRE_JIT_STACK_MAX));
+#else
+        jit_stacks.push_back(NULL);
+#endif
+    }
+}
+
+void devicetracker_pcre_worker::MatchDeviceSlot(Devicetracker *devicetracker __attribute__((unused)),
+        shared_ptr<kis_tracked_device_base> device, unsigned int in_slot) {
+
+    if (match_device(device, jit_stacks[in_slot]))
+        slot_devices[in_slot].push_back(device);
 }
 
 void devicetracker_pcre_worker::Finalize(Devicetracker *devicetracker __attribute__((unused))) {
+    local_locker lock(&worker_mutex);
+
+    for (auto& sv : slot_devices) {
+        for (auto d : sv)
+            return_dev_vec->add_vector(d);
+    }
 
+    slot_devices.clear();
 }
 
 #endif
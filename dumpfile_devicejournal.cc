@@ -0,0 +1,533 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+
+#include "util.h"
+#include "dumpfile_devicejournal.h"
+#include "devicetracker.h"
+
+// Journals smaller than this are never compacted
+#define DEVICEJOURNAL_MIN_COMPACT   (1024 * 1024)
+
+// Buffers of an io_uring journal; records are small, so a few modest buffers
+#define DEVICEJOURNAL_URING_BUFFER  (256 * 1024)
+#define DEVICEJOURNAL_URING_BUFFERS 4
+
+Dumpfile_Devicejournal::Dumpfile_Devicejournal() {
+    fprintf(stderr, "FATAL OOPS: Dumpfile_Devicejournal called with no globalreg\n");
+    exit(1);
+}
+
+Dumpfile_Devicejournal::Dumpfile_Devicejournal(GlobalRegistry *in_globalreg) :
+    Dumpfile(in_globalreg),
+    Kis_Net_Httpd_CPPStream_Handler(in_globalreg) {
+
+    globalreg = in_globalreg;
+
+    type = "devicejournal";
+    logclass = "devicejournal";
+
+    journal = NULL;
+    journal_bytes = 0;
+    journal_uring = NULL;
+    live_bytes = 0;
+
+    device_timer = -1;
+    last_device_ts = 0;
+
+    writer_stop = false;
+    writer_flush = false;
+
+    stat_records = 0;
+    stat_skipped = 0;
+    stat_compactions = 0;
+    stat_journal_bytes = 0;
+    stat_live_bytes = 0;
+    stat_devices = 0;
+    stat_errors = 0;
+
+    stats_id =
+        globalreg->entrytracker->RegisterField("kismet.devicejournal.stats", TrackerMap,
+                "device journal writer statistics");
+    stats_records_id =
+        globalreg->entrytracker->RegisterField("kismet.devicejournal.records",
+                TrackerUInt64, "device records appended to the journal");
+    stats_skipped_id =
+        globalreg->entrytracker->RegisterField("kismet.devicejournal.skipped",
+                TrackerUInt64, "devices seen but not modified since their last record");
+    stats_compactions_id =
+        globalreg->entrytracker->RegisterField("kismet.devicejournal.compactions",
+                TrackerUInt64, "times the journal was compacted");
+    stats_journal_bytes_id =
+        globalreg->entrytracker->RegisterField("kismet.devicejournal.journal_bytes",
+                TrackerUInt64, "size of the journal");
+    stats_live_bytes_id =
+        globalreg->entrytracker->RegisterField("kismet.devicejournal.live_bytes",
+                TrackerUInt64, "size of the latest record of every device");
+    stats_devices_id =
+        globalreg->entrytracker->RegisterField("kismet.devicejournal.devices",
+                TrackerUInt64, "devices in the journal");
+    stats_errors_id =
+        globalreg->entrytracker->RegisterField("kismet.devicejournal.errors",
+                TrackerUInt64, "records which could not be written");
+
+    compact_factor =
+        globalreg->kismet_config->FetchOptUInt("devicejournalcompact", 4);
+    if (compact_factor < 2)
+        compact_factor = 2;
+
+    unsigned int device_interval =
+        globalreg->kismet_config->FetchOptUInt("devicejournalinterval", 30);
+    if (device_interval == 0)
+        device_interval = 30;
+
+    // Find the file name
+    if ((fname = ProcessConfigOpt()) == "" || globalreg->fatal_condition) {
+        return;
+    }
+
+    journal_use_uring =
+        globalreg->kismet_config->FetchOptBoolean("devicejournaluring", false);
+
+    journal = OpenJournal(false, &journal_uring);
+
+    if (journal == NULL) {
+        _MSG("Failed to open device journal '" + fname + "': " +
+                string(strerror(errno)), MSGFLAG_FATAL);
+        globalreg->fatal_condition = 1;
+        return;
+    }
+
+    _MSG("Opened device journal '" + fname + "'", MSGFLAG_INFO);
+
+    StartWriter();
+
+    device_timer =
+        globalreg->timetracker->RegisterTimer(SERVER_TIMESLICES_SEC * device_interval,
+                NULL, 1, this);
+
+    globalreg->RegisterDumpFile(this);
+}
+
+Dumpfile_Devicejournal::~Dumpfile_Devicejournal() {
+    // Nothing was hooked up if the log never opened
+    if (journal == NULL)
+        return;
+
+    if (device_timer >= 0)
+        globalreg->timetracker->RemoveTimer(device_timer);
+
+    // Catch the final state of every device changed since the last pass, then
+    // let the writer drain the queue before the journal is closed
+    QueueDevices();
+    StopWriter();
+
+    fclose(journal);
+    journal = NULL;
+
+    dumped_frames = stat_records;
+
+    _MSG("Closed device journal '" + fname + "', " +
+            ULongToString(stat_records) + " device records, " +
+            ULongToString(stat_devices) + " devices", MSGFLAG_INFO);
+}
+
+int Dumpfile_Devicejournal::Flush() {
+    if (journal == NULL)
+        return 0;
+
+    std::lock_guard<std::mutex> lk(queue_mutex);
+    writer_flush = true;
+    writer_cv.notify_one();
+
+    return 1;
+}
+
+int Dumpfile_Devicejournal::timetracker_event(int event_id) {
+    if (event_id == device_timer)
+        QueueDevices();
+
+    return 1;
+}
+
+void Dumpfile_Devicejournal::QueueDevices() {
+    if (journal == NULL)
+        return;
+
+    shared_ptr<Devicetracker> devicetracker =
+        globalreg->FetchGlobalAs<Devicetracker>("DEVICE_TRACKER");
+
+    if (devicetracker == NULL)
+        return;
+
+    SharedTrackerElement devvec(new TrackerElement(TrackerVector));
+
+    // Devices seen later in the same second as this pass would be missed by
+    // the next one, so overlap by a second; devices whose version hasn't
+    // moved are skipped
+    time_t now = globalreg->timestamp.tv_sec;
+    devicetracker->FetchDevicesSince(last_device_ts, devvec);
+    last_device_ts = now - 1;
+
+    vector<device_rec> devices;
+    devices.reserve(TrackerElementVector(devvec).size());
+
+    // The worker runs a batch of devices at a time under the devicelist lock
+    devicetracker_function_worker fw(globalreg,
+            [this, &devices, now](Devicetracker *dt, 
+                shared_ptr<kis_tracked_device_base> d) -> bool {
+                // Snapshot the version before serializing, so a change made
+                // while we're serializing is caught next time
+                uint32_t version = d->get_mod_version();
+
+                auto vi = queued_versions.find(d->get_key());
+
+                if (vi != queued_versions.end() && vi->second == version) {
+                    stat_skipped++;
+                    return false;
+                }
+
+                device_rec r;
+
+                r.key = d->get_key();
+                r.ts = now;
+                r.json = dt->SerializeDevice("json", d);
+
+                if (r.json != NULL) {
+                    queued_versions[r.key] = version;
+                    devices.push_back(std::move(r));
+                }
+
+                return false;
+            }, NULL);
+
+    devicetracker->MatchOnDevices(&fw, TrackerElementVector(devvec));
+
+    if (devices.size() == 0)
+        return;
+
+    std::lock_guard<std::mutex> lk(queue_mutex);
+
+    // A pass the writer hasn't reached yet is still queued; add to it
+    if (queue.size() == 0) {
+        queue.swap(devices);
+    } else {
+        for (auto& d : devices)
+            queue.push_back(std::move(d));
+    }
+
+    writer_cv.notify_one();
+}
+
+void Dumpfile_Devicejournal::StartWriter() {
+    writer_stop = false;
+    writer_thread = std::thread([this]() { WriterThread(); });
+}
+
+void Dumpfile_Devicejournal::StopWriter() {
+    if (!writer_thread.joinable())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lk(queue_mutex);
+        writer_stop = true;
+        writer_cv.notify_one();
+    }
+
+    writer_thread.join();
+}
+
+void Dumpfile_Devicejournal::WriterThread() {
+    // Swapped with the live queue each pass, so both keep their capacity
+    vector<device_rec> batch;
+
+    while (1) {
+        bool stopping, flushing;
+
+        {
+            std::unique_lock<std::mutex> lk(queue_mutex);
+
+            if (!writer_stop && !writer_flush && queue.size() == 0)
+                writer_cv.wait(lk);
+
+            std::swap(batch, queue);
+
+            flushing = writer_flush;
+            writer_flush = false;
+            stopping = writer_stop;
+        }
+
+        if (batch.size() != 0)
+            WriteRecords(batch);
+
+        batch.clear();
+
+        if (flushing || stopping)
+            FlushJournal();
+
+        // The timer is gone and the last pass queued before we're stopped, so
+        // the last swap got all of it
+        if (stopping)
+            break;
+    }
+}
+
+void Dumpfile_Devicejournal::WriteRecords(vector<device_rec>& in_records) {
+    unsigned int errors = 0;
+
+    for (auto& r : in_records) {
+        string line = "{\"kismet.devicejournal.key\": \"" + std::to_string(r.key) + 
+            "\", \"kismet.devicejournal.time\": " + std::to_string(r.ts) + 
+            ", \"kismet.devicejournal.device\": " + *(r.json) + "}\n";
+
+        if (fwrite(line.data(), line.length(), 1, journal) != 1) {
+            errors++;
+            continue;
+        }
+
+        auto li = latest_records.find(r.key);
+
+        if (li != latest_records.end()) {
+            live_bytes -= li->second.length;
+        } else {
+            li = latest_records.insert(std::make_pair(r.key, journal_pos())).first;
+        }
+
+        li->second.offset = journal_bytes;
+        li->second.length = line.length();
+
+        journal_bytes += line.length();
+        live_bytes += line.length();
+
+        stat_records++;
+    }
+
+    if (errors != 0) {
+        stat_errors += errors;
+        _MSG("Device journal '" + fname + "' failed to write " + UIntToString(errors) +
+                " records: " + string(strerror(errno)), MSGFLAG_ERROR);
+    }
+
+    // Compacting once the journal has grown by a fixed factor keeps the cost of
+    // compaction proportional to the records written since the last one
+    if (journal_bytes > DEVICEJOURNAL_MIN_COMPACT &&
+            journal_bytes > live_bytes * compact_factor) {
+        if (CompactJournal())
+            stat_compactions++;
+    }
+
+    stat_journal_bytes = journal_bytes;
+    stat_live_bytes = live_bytes;
+    stat_devices = latest_records.size();
+}
+
+bool Dumpfile_Devicejournal::CompactJournal() {
+    string tmpname = fname + ".compact";
+
+    if (FlushJournal() != 0)
+        return false;
+
+    FILE *in = fopen(fname.c_str(), "rb");
+
+    if (in == NULL) {
+        _MSG("Failed to open device journal '" + fname + "' for compaction: " +
+                string(strerror(errno)), MSGFLAG_ERROR);
+        return false;
+    }
+
+    FILE *out = fopen(tmpname.c_str(), "wb");
+
+    if (out == NULL) {
+        _MSG("Failed to create compacted device journal '" + tmpname + "': " +
+                string(strerror(errno)), MSGFLAG_ERROR);
+        fclose(in);
+        return false;
+    }
+
+    // Copy in journal order, so the old journal is read front to back and the
+    // new one keeps the order devices were last updated in
+    vector<std::pair<uint64_t, journal_pos *> > order;
+    order.reserve(latest_records.size());
+
+    for (auto& l : latest_records)
+        order.push_back(std::make_pair(l.second.offset, &(l.second)));
+
+    std::sort(order.begin(), order.end(),
+            [](const std::pair<uint64_t, journal_pos *>& a,
+                const std::pair<uint64_t, journal_pos *>& b) -> bool {
+                return a.first < b.first;
+            });
+
+    vector<char> buf;
+    vector<uint64_t> new_offsets;
+    new_offsets.reserve(order.size());
+
+    uint64_t pos = 0;
+    bool ok = true;
+
+    for (auto& o : order) {
+        buf.resize(o.second->length);
+
+        if (fseeko(in, (off_t) o.first, SEEK_SET) != 0 ||
+                fread(buf.data(), buf.size(), 1, in) != 1 ||
+                fwrite(buf.data(), buf.size(), 1, out) != 1) {
+            ok = false;
+            break;
+        }
+
+        new_offsets.push_back(pos);
+        pos += buf.size();
+    }
+
+    fclose(in);
+
+    if (fclose(out) != 0)
+        ok = false;
+
+    if (!ok || rename(tmpname.c_str(), fname.c_str()) != 0) {
+        _MSG("Failed to compact device journal '" + fname + "': " +
+                string(strerror(errno)), MSGFLAG_ERROR);
+        unlink(tmpname.c_str());
+        return false;
+    }
+
+    // The old journal is gone from under our handle; carry on appending to
+    // the compacted one
+    KisUringFile *compacted_uring = NULL;
+    FILE *compacted = OpenJournal(true, &compacted_uring);
+
+    if (compacted == NULL) {
+        _MSG("Failed to reopen compacted device journal '" + fname + "': " +
+                string(strerror(errno)), MSGFLAG_ERROR);
+        return false;
+    }
+
+    fclose(journal);
+    journal = compacted;
+    journal_uring = compacted_uring;
+
+    for (size_t i = 0; i < order.size(); i++)
+        order[i].second->offset = new_offsets[i];
+
+    journal_bytes = pos;
+
+    return true;
+}
+
+FILE *Dumpfile_Devicejournal::OpenJournal(bool in_append, KisUringFile **ret_uring) {
+    *ret_uring = NULL;
+
+    if (journal_use_uring) {
+        KisUringFile *uf = new KisUringFile();
+        FILE *fp = NULL;
+
+        if (uf->open(fname, in_append, false, DEVICEJOURNAL_URING_BUFFER,
+                    DEVICEJOURNAL_URING_BUFFERS) &&
+                (fp = KisUringFile::fopen_stream(uf)) != NULL) {
+            *ret_uring = uf;
+            return fp;
+        }
+
+        _MSG("Device journal '" + fname + "' could not be written with io_uring (" +
+                string(strerror(errno)) + "), using the normal writer", MSGFLAG_ERROR);
+
+        delete uf;
+        journal_use_uring = false;
+    }
+
+    return fopen(fname.c_str(), in_append ? "ab" : "wb");
+}
+
+int Dumpfile_Devicejournal::FlushJournal() {
+    if (fflush(journal) != 0)
+        return -1;
+
+    if (journal_uring != NULL)
+        return journal_uring->flush();
+
+    return 0;
+}
+
+bool Dumpfile_Devicejournal::Httpd_VerifyPath(const char *path, const char *method) {
+    if (strcmp(method, "GET") != 0)
+        return false;
+
+    if (!Httpd_CanSerialize(path))
+        return false;
+
+    if (Httpd_StripSuffix(path) == "/logging/" + type + "/stats")
+        return true;
+
+    return false;
+}
+
+void Dumpfile_Devicejournal::Httpd_CreateStreamResponse(
+        Kis_Net_Httpd *httpd __attribute__((unused)),
+        Kis_Net_Httpd_Connection *connection __attribute__((unused)),
+        const char *path, const char *method,
+        const char *upload_data __attribute__((unused)),
+        size_t *upload_data_size __attribute__((unused)),
+        std::stringstream &stream) {
+
+    if (strcmp(method, "GET") != 0)
+        return;
+
+    if (Httpd_StripSuffix(path) != "/logging/" + type + "/stats")
+        return;
+
+    SharedTrackerElement stats(new TrackerElement(TrackerMap, stats_id));
+
+    SharedTrackerElement e;
+
+    e.reset(new TrackerElement(TrackerUInt64, stats_records_id));
+    e->set((uint64_t) stat_records);
+    stats->add_map(e);
+
+    e.reset(new TrackerElement(TrackerUInt64, stats_skipped_id));
+    e->set((uint64_t) stat_skipped);
+    stats->add_map(e);
+
+    e.reset(new TrackerElement(TrackerUInt64, stats_compactions_id));
+    e->set((uint64_t) stat_compactions);
+    stats->add_map(e);
+
+    e.reset(new TrackerElement(TrackerUInt64, stats_journal_bytes_id));
+    e->set((uint64_t) stat_journal_bytes);
+    stats->add_map(e);
+
+    e.reset(new TrackerElement(TrackerUInt64, stats_live_bytes_id));
+    e->set((uint64_t) stat_live_bytes);
+    stats->add_map(e);
+
+    e.reset(new TrackerElement(TrackerUInt64, stats_devices_id));
+    e->set((uint64_t) stat_devices);
+    stats->add_map(e);
+
+    e.reset(new TrackerElement(TrackerUInt64, stats_errors_id));
+    e->set((uint64_t) stat_errors);
+    stats->add_map(e);
+
+    Httpd_Serialize(path, stream, stats);
+}
+
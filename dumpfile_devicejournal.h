@@ -0,0 +1,151 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __DUMPFILE_DEVICEJOURNAL_H__
+#define __DUMPFILE_DEVICEJOURNAL_H__
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "globalregistry.h"
+#include "configfile.h"
+#include "messagebus.h"
+#include "timetracker.h"
+#include "dumpfile.h"
+#include "kis_net_microhttpd.h"
+#include "kis_uring_file.h"
+
+// Append-only device journal
+//
+// Every devicejournalinterval seconds, each device which changed since the last
+// pass (by its modification version) is appended to the journal as one line of
+// JSON:
+//  {"kismet.devicejournal.key": "[key]", "kismet.devicejournal.time": [ts],
+//   "kismet.devicejournal.device": { ...device... }}
+// Devices come from the time-ordered modification list and are serialized
+// through the device serialization cache, so a pass costs the devices which
+// changed, not every device.  The latest line for a key is the current state of
+// that device.
+//
+// A writer thread owns the file.  Once the journal is more than
+// devicejournalcompact times the size of the latest record of every device, it
+// is compacted:  the latest records are copied to a new file, which replaces the
+// journal.
+//
+// With devicejournaluring, the writer writes the journal through io_uring (see
+// kis_uring_file.h) where it's available.
+//
+// Writer counters are served at /logging/devicejournal/stats
+class Dumpfile_Devicejournal : public Dumpfile, public TimetrackerEvent,
+    public Kis_Net_Httpd_CPPStream_Handler {
+public:
+    Dumpfile_Devicejournal();
+    Dumpfile_Devicejournal(GlobalRegistry *in_globalreg);
+
+    virtual ~Dumpfile_Devicejournal();
+
+    virtual int Flush();
+
+    virtual int timetracker_event(int event_id);
+
+    virtual bool Httpd_VerifyPath(const char *path, const char *method);
+
+    virtual void Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd,
+            Kis_Net_Httpd_Connection *connection,
+            const char *url, const char *method, const char *upload_data,
+            size_t *upload_data_size, std::stringstream &stream);
+
+protected:
+    struct device_rec {
+        uint64_t key;
+        time_t ts;
+        shared_ptr<string> json;
+    };
+
+    // Where the latest record of a device is in the journal
+    struct journal_pos {
+        uint64_t offset;
+        uint32_t length;
+    };
+
+    // Queue every device modified since the last pass
+    void QueueDevices();
+
+    void StartWriter();
+    void StopWriter();
+    void WriterThread();
+    void WriteRecords(vector<device_rec>& in_records);
+
+    // Replace the journal with the latest record of every device
+    bool CompactJournal();
+
+    // Open the journal, through io_uring if we can; ret_uring is set to the
+    // file behind the stream, or NULL for a plain stdio stream
+    FILE *OpenJournal(bool in_append, KisUringFile **ret_uring);
+
+    // Flush the journal down to the file; returns 0 on success
+    int FlushJournal();
+
+    GlobalRegistry *globalreg;
+
+    FILE *journal;
+    uint64_t journal_bytes;
+
+    // Set when the journal stream writes through io_uring; owned by the stream
+    bool journal_use_uring;
+    KisUringFile *journal_uring;
+
+    int device_timer;
+    time_t last_device_ts;
+
+    // Modification version each device was last queued at; only touched by
+    // the timer
+    std::unordered_map<uint64_t, uint32_t> queued_versions;
+
+    // Latest record of each device, and their total size; only touched by the
+    // writer
+    std::unordered_map<uint64_t, journal_pos> latest_records;
+    uint64_t live_bytes;
+
+    unsigned int compact_factor;
+
+    std::mutex queue_mutex;
+    vector<device_rec> queue;
+
+    std::thread writer_thread;
+    std::condition_variable writer_cv;
+    bool writer_stop, writer_flush;
+
+    // Counters served over REST
+    std::atomic<uint64_t> stat_records, stat_skipped, stat_compactions,
+        stat_journal_bytes, stat_live_bytes, stat_devices, stat_errors;
+
+    int stats_id, stats_records_id, stats_skipped_id, stats_compactions_id,
+        stats_journal_bytes_id, stats_live_bytes_id, stats_devices_id, 
+        stats_errors_id;
+};
+
+#endif
@@ -0,0 +1,737 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#ifdef HAVE_LIBSQLITE3
+
+#include <sys/time.h>
+
+#include "util.h"
+#include "dumpfile_kismetdb.h"
+#include "packet.h"
+#include "gpstracker.h"
+#include "alertracker.h"
+#include "devicetracker.h"
+#include "kis_datasource.h"
+#include "entrytracker.h"
+
+// Schema version, stored in the KISMET table so readers can tell what they
+// are looking at
+#define KISMETDB_VERSION    1
+
+static const char *kismetdb_schema[] = {
+    "CREATE TABLE IF NOT EXISTS KISMET ("
+        "kismet_version TEXT, db_version INT, start_time INT)",
+
+    "CREATE TABLE IF NOT EXISTS packets ("
+        "ts_sec INT, ts_usec INT, phyname TEXT, "
+        "sourcemac TEXT, destmac TEXT, transmac TEXT, "
+        "frequency REAL, channel TEXT, signal INT, lat REAL, lon REAL, "
+        "datasource TEXT, dlt INT, packet BLOB)",
+
+    "CREATE TABLE IF NOT EXISTS devices ("
+        "devkey TEXT PRIMARY KEY, first_time INT, last_time INT, "
+        "phyname TEXT, devmac TEXT, device TEXT)",
+
+    "CREATE TABLE IF NOT EXISTS alerts ("
+        "ts_sec INT, ts_usec INT, phyname TEXT, header TEXT, "
+        "bssid TEXT, sourcemac TEXT, destmac TEXT, othermac TEXT, "
+        "channel TEXT, text TEXT)",
+
+    "CREATE TABLE IF NOT EXISTS messages ("
+        "ts_sec INT, ts_usec INT, flags INT, message TEXT)",
+
+    NULL
+};
+
+int dumpfilekismetdb_chain_hook(CHAINCALL_PARMS) {
+    Dumpfile_Kismetdb *auxptr = (Dumpfile_Kismetdb *) auxdata;
+    return auxptr->chain_handler(in_pack);
+}
+
+static inline void kismetdb_bind_text(sqlite3_stmt *stmt, int pos, const string& s) {
+    sqlite3_bind_text(stmt, pos, s.data(), s.length(), SQLITE_STATIC);
+}
+
+Dumpfile_Kismetdb::Dumpfile_Kismetdb() :
+    MessageClient(NULL, NULL) {
+    fprintf(stderr, "FATAL OOPS: Dumpfile_Kismetdb called with no globalreg\n");
+    exit(1);
+}
+
+Dumpfile_Kismetdb::Dumpfile_Kismetdb(GlobalRegistry *in_globalreg) :
+    Dumpfile(in_globalreg),
+    MessageClient(in_globalreg, NULL),
+    Kis_Net_Httpd_CPPStream_Handler(in_globalreg) {
+
+    globalreg = in_globalreg;
+
+    type = "kismetdb";
+    logclass = "kismetdb";
+
+    db = NULL;
+    packet_stmt = device_stmt = alert_stmt = message_stmt = NULL;
+
+    device_timer = -1;
+    last_device_ts = 0;
+    alert_cb_id = -1;
+
+    writer_stop = false;
+    writer_flush = false;
+
+    stat_packets = 0;
+    stat_devices = 0;
+    stat_alerts = 0;
+    stat_messages = 0;
+    stat_dropped = 0;
+    stat_transactions = 0;
+    stat_errors = 0;
+
+    pack_comp_common = globalreg->packetchain->RegisterPacketComponent("COMMON");
+    pack_comp_linkframe = globalreg->packetchain->RegisterPacketComponent("LINKFRAME");
+    pack_comp_radiodata = globalreg->packetchain->RegisterPacketComponent("RADIODATA");
+    pack_comp_gps = globalreg->packetchain->RegisterPacketComponent("GPS");
+    pack_comp_datasrc = globalreg->packetchain->RegisterPacketComponent("KISDATASRC");
+
+    stats_id =
+        globalreg->entrytracker->RegisterField("kismet.kismetdb.stats", TrackerMap,
+                "kismetdb log writer statistics");
+    stats_packets_id =
+        globalreg->entrytracker->RegisterField("kismet.kismetdb.packets",
+                TrackerUInt64, "packets written to the log");
+    stats_devices_id =
+        globalreg->entrytracker->RegisterField("kismet.kismetdb.devices",
+                TrackerUInt64, "device records written to the log");
+    stats_alerts_id =
+        globalreg->entrytracker->RegisterField("kismet.kismetdb.alerts",
+                TrackerUInt64, "alerts written to the log");
+    stats_messages_id =
+        globalreg->entrytracker->RegisterField("kismet.kismetdb.messages",
+                TrackerUInt64, "messages written to the log");
+    stats_dropped_id =
+        globalreg->entrytracker->RegisterField("kismet.kismetdb.dropped",
+                TrackerUInt64, "packets dropped because the queue was full");
+    stats_transactions_id =
+        globalreg->entrytracker->RegisterField("kismet.kismetdb.transactions",
+                TrackerUInt64, "transactions committed to the log");
+    stats_errors_id =
+        globalreg->entrytracker->RegisterField("kismet.kismetdb.errors",
+                TrackerUInt64, "records which could not be written");
+
+    log_packets = globalreg->kismet_config->FetchOptBoolean("kismetdbpackets", true);
+    log_devices = globalreg->kismet_config->FetchOptBoolean("kismetdbdevices", true);
+    log_alerts = globalreg->kismet_config->FetchOptBoolean("kismetdbalerts", true);
+    log_messages = globalreg->kismet_config->FetchOptBoolean("kismetdbmessages", true);
+
+    max_packets = globalreg->kismet_config->FetchOptUInt("kismetdbqueue", 65536);
+    if (max_packets < 16)
+        max_packets = 16;
+
+    commit_interval = globalreg->kismet_config->FetchOptUInt("kismetdbcommit", 1);
+    if (commit_interval == 0)
+        commit_interval = 1;
+
+    unsigned int device_interval =
+        globalreg->kismet_config->FetchOptUInt("kismetdbdeviceinterval", 30);
+    if (device_interval == 0)
+        device_interval = 30;
+
+    // Find the file name
+    if ((fname = ProcessConfigOpt()) == "" || globalreg->fatal_condition) {
+        return;
+    }
+
+    if (!OpenDatabase()) {
+        globalreg->fatal_condition = 1;
+        return;
+    }
+
+    _MSG("Opened kismetdb log file '" + fname + "'", MSGFLAG_INFO);
+
+    StartWriter();
+
+    if (log_packets)
+        globalreg->packetchain->RegisterHandler(&dumpfilekismetdb_chain_hook, this,
+                CHAINPOS_LOGGING, -100, "kismetdb log");
+
+    if (log_alerts) {
+        alert_cb_id =
+            globalreg->alertracker->RegisterAlertCallback([this](kis_alert_info *in_info) {
+                alert_rec r;
+
+                r.ts = in_info->tm;
+                r.header = in_info->header;
+                r.bssid = in_info->bssid.Mac2String();
+                r.sourcemac = in_info->source.Mac2String();
+                r.destmac = in_info->dest.Mac2String();
+                r.othermac = in_info->other.Mac2String();
+                r.channel = in_info->channel;
+                r.text = in_info->text;
+
+                shared_ptr<Devicetracker> devicetracker =
+                    globalreg->FetchGlobalAs<Devicetracker>("DEVICE_TRACKER");
+                if (devicetracker != NULL)
+                    r.phyname = devicetracker->FetchPhyName(in_info->phy);
+
+                std::lock_guard<std::mutex> lk(queue_mutex);
+                queue.alerts.push_back(std::move(r));
+            });
+    }
+
+    // Alerts are logged whole through the callback, not as their message text
+    if (log_messages)
+        globalreg->messagebus->RegisterClient(this, MSGFLAG_ALL & ~MSGFLAG_ALERT);
+
+    if (log_devices)
+        device_timer =
+            globalreg->timetracker->RegisterTimer(SERVER_TIMESLICES_SEC * device_interval,
+                    NULL, 1, this);
+
+    globalreg->RegisterDumpFile(this);
+}
+
+Dumpfile_Kismetdb::~Dumpfile_Kismetdb() {
+    // Nothing was hooked up if the log never opened
+    if (db == NULL)
+        return;
+
+    if (log_packets)
+        globalreg->packetchain->RemoveHandler(&dumpfilekismetdb_chain_hook,
+                CHAINPOS_LOGGING);
+
+    if (alert_cb_id >= 0)
+        globalreg->alertracker->RemoveAlertCallback(alert_cb_id);
+
+    if (log_messages)
+        globalreg->messagebus->RemoveClient(this);
+
+    if (device_timer >= 0)
+        globalreg->timetracker->RemoveTimer(device_timer);
+
+    // Catch the final state of every device changed since the last pass, then
+    // let the writer drain the queue before the database is closed
+    QueueDevices();
+    StopWriter();
+    CloseDatabase();
+
+    dumped_frames = stat_packets;
+
+    _MSG("Closed kismetdb log '" + fname + "', " +
+            ULongToString(stat_devices) + " device records, " +
+            ULongToString(stat_alerts) + " alerts, " +
+            ULongToString(stat_messages) + " messages, " +
+            ULongToString(stat_dropped) + " packets dropped", MSGFLAG_INFO);
+}
+
+bool Dumpfile_Kismetdb::Exec(const char *in_sql) {
+    char *err = NULL;
+
+    if (sqlite3_exec(db, in_sql, NULL, NULL, &err) != SQLITE_OK) {
+        _MSG("kismetdb log '" + fname + "' failed to run '" + string(in_sql) + "': " +
+                string(err == NULL ? "unknown error" : err), MSGFLAG_ERROR);
+        sqlite3_free(err);
+        return false;
+    }
+
+    return true;
+}
+
+bool Dumpfile_Kismetdb::OpenDatabase() {
+    if (sqlite3_open_v2(fname.c_str(), &db,
+                SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL) != SQLITE_OK) {
+        _MSG("Failed to open kismetdb log file '" + fname + "': " +
+                string(db == NULL ? "out of memory" : sqlite3_errmsg(db)), MSGFLAG_FATAL);
+        CloseDatabase();
+        return false;
+    }
+
+    // WAL lets the log be read while it's written, and with synchronous=NORMAL
+    // a commit doesn't wait on the disk; a crash can lose the last transactions
+    // but won't corrupt the log
+    if (!Exec("PRAGMA journal_mode=WAL") || !Exec("PRAGMA synchronous=NORMAL")) {
+        CloseDatabase();
+        return false;
+    }
+
+    for (unsigned int x = 0; kismetdb_schema[x] != NULL; x++) {
+        if (!Exec(kismetdb_schema[x])) {
+            CloseDatabase();
+            return false;
+        }
+    }
+
+    const char *packet_sql =
+        "INSERT INTO packets (ts_sec, ts_usec, phyname, sourcemac, destmac, transmac, "
+        "frequency, channel, signal, lat, lon, datasource, dlt, packet) "
+        "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)";
+    const char *device_sql =
+        "INSERT OR REPLACE INTO devices (devkey, first_time, last_time, phyname, "
+        "devmac, device) VALUES (?, ?, ?, ?, ?, ?)";
+    const char *alert_sql =
+        "INSERT INTO alerts (ts_sec, ts_usec, phyname, header, bssid, sourcemac, "
+        "destmac, othermac, channel, text) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?)";
+    const char *message_sql =
+        "INSERT INTO messages (ts_sec, ts_usec, flags, message) VALUES (?, ?, ?, ?)";
+
+    if (sqlite3_prepare_v2(db, packet_sql, -1, &packet_stmt, NULL) != SQLITE_OK ||
+            sqlite3_prepare_v2(db, device_sql, -1, &device_stmt, NULL) != SQLITE_OK ||
+            sqlite3_prepare_v2(db, alert_sql, -1, &alert_stmt, NULL) != SQLITE_OK ||
+            sqlite3_prepare_v2(db, message_sql, -1, &message_stmt, NULL) != SQLITE_OK) {
+        _MSG("Failed to prepare kismetdb log statements: " +
+                string(sqlite3_errmsg(db)), MSGFLAG_FATAL);
+        CloseDatabase();
+        return false;
+    }
+
+    sqlite3_stmt *info_stmt = NULL;
+
+    if (sqlite3_prepare_v2(db, "INSERT INTO KISMET (kismet_version, db_version, "
+                "start_time) VALUES (?, ?, ?)", -1, &info_stmt, NULL) == SQLITE_OK) {
+        string version = globalreg->version_major + "." + globalreg->version_minor +
+            "." + globalreg->version_tiny;
+
+        kismetdb_bind_text(info_stmt, 1, version);
+        sqlite3_bind_int(info_stmt, 2, KISMETDB_VERSION);
+        sqlite3_bind_int64(info_stmt, 3, globalreg->start_time);
+        sqlite3_step(info_stmt);
+    }
+
+    sqlite3_finalize(info_stmt);
+
+    return true;
+}
+
+void Dumpfile_Kismetdb::CloseDatabase() {
+    sqlite3_finalize(packet_stmt);
+    sqlite3_finalize(device_stmt);
+    sqlite3_finalize(alert_stmt);
+    sqlite3_finalize(message_stmt);
+
+    packet_stmt = device_stmt = alert_stmt = message_stmt = NULL;
+
+    if (db != NULL)
+        sqlite3_close(db);
+
+    db = NULL;
+}
+
+int Dumpfile_Kismetdb::Flush() {
+    if (db == NULL)
+        return 0;
+
+    std::lock_guard<std::mutex> lk(queue_mutex);
+    writer_flush = true;
+    writer_cv.notify_one();
+
+    return 1;
+}
+
+void Dumpfile_Kismetdb::Wake() {
+    std::lock_guard<std::mutex> lk(queue_mutex);
+    writer_cv.notify_one();
+}
+
+int Dumpfile_Kismetdb::timetracker_event(int event_id) {
+    if (event_id == device_timer)
+        QueueDevices();
+
+    return 1;
+}
+
+void Dumpfile_Kismetdb::QueueDevices() {
+    if (!log_devices || db == NULL)
+        return;
+
+    // If the last pass still hasn't been written, skip this one; the devices
+    // are picked up next time, since the pass time hasn't moved
+    {
+        std::lock_guard<std::mutex> lk(queue_mutex);
+        if (queue.devices.size() != 0)
+            return;
+    }
+
+    shared_ptr<Devicetracker> devicetracker =
+        globalreg->FetchGlobalAs<Devicetracker>("DEVICE_TRACKER");
+
+    if (devicetracker == NULL)
+        return;
+
+    SharedTrackerElement devvec(new TrackerElement(TrackerVector));
+
+    // Devices seen later in the same second as this pass would be missed by
+    // the next one, so overlap by a second; the rows are replaced by key
+    time_t now = globalreg->timestamp.tv_sec;
+    devicetracker->FetchDevicesSince(last_device_ts, devvec);
+    last_device_ts = now - 1;
+
+    vector<device_rec> devices;
+    devices.reserve(TrackerElementVector(devvec).size());
+
+    // The worker runs a batch of devices at a time under the devicelist lock
+    devicetracker_function_worker fw(globalreg,
+            [&devices](Devicetracker *dt, shared_ptr<kis_tracked_device_base> d) -> bool {
+                device_rec r;
+
+                r.key = d->get_key();
+                r.first_time = d->get_first_time();
+                r.last_time = d->get_last_time();
+                r.phyname = d->get_phyname();
+                r.devmac = d->get_macaddr().Mac2String();
+                r.json = dt->SerializeDevice("json", d);
+
+                if (r.json != NULL)
+                    devices.push_back(std::move(r));
+
+                return false;
+            }, NULL);
+
+    devicetracker->MatchOnDevices(&fw, TrackerElementVector(devvec));
+
+    if (devices.size() == 0)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lk(queue_mutex);
+        queue.devices.swap(devices);
+        writer_cv.notify_one();
+    }
+}
+
+int Dumpfile_Kismetdb::chain_handler(kis_packet *in_pack) {
+    if (db == NULL)
+        return 0;
+
+    kis_common_info *common =
+        (kis_common_info *) in_pack->fetch(pack_comp_common);
+    kis_datachunk *chunk =
+        (kis_datachunk *) in_pack->fetch(pack_comp_linkframe);
+
+    if (common == NULL && chunk == NULL)
+        return 0;
+
+    // Don't build the record if it'd be dropped
+    {
+        std::lock_guard<std::mutex> lk(queue_mutex);
+
+        if (queue.packets.size() >= max_packets) {
+            stat_dropped++;
+            return 0;
+        }
+    }
+
+    kis_layer1_packinfo *radioinfo =
+        (kis_layer1_packinfo *) in_pack->fetch(pack_comp_radiodata);
+    kis_gps_packinfo *gpsinfo =
+        (kis_gps_packinfo *) in_pack->fetch(pack_comp_gps);
+    packetchain_comp_datasource *datasrc =
+        (packetchain_comp_datasource *) in_pack->fetch(pack_comp_datasrc);
+
+    packet_rec r;
+
+    r.ts = in_pack->ts;
+    r.frequency = 0;
+    r.signal = 0;
+    r.lat = r.lon = 0;
+    r.dlt = 0;
+
+    if (common != NULL) {
+        shared_ptr<Devicetracker> devicetracker =
+            globalreg->FetchGlobalAs<Devicetracker>("DEVICE_TRACKER");
+        if (devicetracker != NULL)
+            r.phyname = devicetracker->FetchPhyName(common->phyid);
+
+        r.sourcemac = common->source.Mac2String();
+        r.destmac = common->dest.Mac2String();
+        r.transmac = common->transmitter.Mac2String();
+        r.frequency = common->freq_khz;
+        r.channel = common->channel;
+    }
+
+    if (radioinfo != NULL) {
+        if (radioinfo->signal_type == kis_l1_signal_type_dbm)
+            r.signal = radioinfo->signal_dbm;
+        else if (radioinfo->signal_type == kis_l1_signal_type_rssi)
+            r.signal = radioinfo->signal_rssi;
+
+        if (r.frequency == 0)
+            r.frequency = radioinfo->freq_khz;
+    }
+
+    if (gpsinfo != NULL && gpsinfo->fix >= 2) {
+        r.lat = gpsinfo->lat;
+        r.lon = gpsinfo->lon;
+    }
+
+    if (datasrc != NULL && datasrc->ref_source != NULL)
+        r.datasource = datasrc->ref_source->get_source_uuid().UUID2String();
+
+    if (chunk != NULL) {
+        r.dlt = chunk->dlt;
+        r.data.assign((const char *) chunk->data, chunk->length);
+    }
+
+    bool wake;
+
+    {
+        std::lock_guard<std::mutex> lk(queue_mutex);
+        queue.packets.push_back(std::move(r));
+
+        // Normally the writer wakes on its own every commit interval; only
+        // hurry it along if the queue is filling up
+        wake = queue.packets.size() == max_packets / 2;
+    }
+
+    if (wake)
+        Wake();
+
+    dumped_frames++;
+
+    return 1;
+}
+
+void Dumpfile_Kismetdb::ProcessMessage(string in_msg, int in_flags) {
+    if (db == NULL)
+        return;
+
+    message_rec r;
+
+    gettimeofday(&(r.ts), NULL);
+    r.flags = in_flags;
+    r.msg = in_msg;
+
+    std::lock_guard<std::mutex> lk(queue_mutex);
+    queue.messages.push_back(std::move(r));
+}
+
+void Dumpfile_Kismetdb::StartWriter() {
+    writer_stop = false;
+    writer_thread = std::thread([this]() { WriterThread(); });
+}
+
+void Dumpfile_Kismetdb::StopWriter() {
+    if (!writer_thread.joinable())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lk(queue_mutex);
+        writer_stop = true;
+        writer_cv.notify_one();
+    }
+
+    writer_thread.join();
+}
+
+void Dumpfile_Kismetdb::WriterThread() {
+    // Swapped with the live queue each pass, so both keep their capacity
+    write_queue batch;
+
+    while (1) {
+        bool stopping;
+
+        {
+            std::unique_lock<std::mutex> lk(queue_mutex);
+
+            if (!writer_stop && !writer_flush && queue.packets.size() < max_packets / 2)
+                writer_cv.wait_for(lk, std::chrono::seconds(commit_interval));
+
+            std::swap(batch.packets, queue.packets);
+            std::swap(batch.devices, queue.devices);
+            std::swap(batch.alerts, queue.alerts);
+            std::swap(batch.messages, queue.messages);
+
+            writer_flush = false;
+            stopping = writer_stop;
+        }
+
+        if (batch.size() != 0)
+            WriteQueue(batch);
+
+        batch.clear();
+
+        // Everything which can queue records is gone before we're stopped, so
+        // the last swap got all of it
+        if (stopping)
+            break;
+    }
+}
+
+void Dumpfile_Kismetdb::WriteQueue(write_queue& in_queue) {
+    unsigned int errors = 0;
+    string first_error;
+
+    auto step = [this, &errors, &first_error](sqlite3_stmt *stmt) -> bool {
+        int r = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+
+        if (r != SQLITE_DONE) {
+            if (errors == 0)
+                first_error = sqlite3_errmsg(db);
+            errors++;
+            return false;
+        }
+
+        return true;
+    };
+
+    if (sqlite3_exec(db, "BEGIN TRANSACTION", NULL, NULL, NULL) != SQLITE_OK) {
+        stat_errors += in_queue.size();
+        _MSG("kismetdb log '" + fname + "' could not start a transaction: " +
+                string(sqlite3_errmsg(db)), MSGFLAG_ERROR);
+        return;
+    }
+
+    for (auto& p : in_queue.packets) {
+        sqlite3_bind_int64(packet_stmt, 1, p.ts.tv_sec);
+        sqlite3_bind_int64(packet_stmt, 2, p.ts.tv_usec);
+        kismetdb_bind_text(packet_stmt, 3, p.phyname);
+        kismetdb_bind_text(packet_stmt, 4, p.sourcemac);
+        kismetdb_bind_text(packet_stmt, 5, p.destmac);
+        kismetdb_bind_text(packet_stmt, 6, p.transmac);
+        sqlite3_bind_double(packet_stmt, 7, p.frequency);
+        kismetdb_bind_text(packet_stmt, 8, p.channel);
+        sqlite3_bind_int(packet_stmt, 9, p.signal);
+        sqlite3_bind_double(packet_stmt, 10, p.lat);
+        sqlite3_bind_double(packet_stmt, 11, p.lon);
+        kismetdb_bind_text(packet_stmt, 12, p.datasource);
+        sqlite3_bind_int(packet_stmt, 13, p.dlt);
+        sqlite3_bind_blob(packet_stmt, 14, p.data.data(), p.data.length(), SQLITE_STATIC);
+
+        if (step(packet_stmt))
+            stat_packets++;
+    }
+
+    for (auto& d : in_queue.devices) {
+        string key = std::to_string(d.key);
+
+        kismetdb_bind_text(device_stmt, 1, key);
+        sqlite3_bind_int64(device_stmt, 2, d.first_time);
+        sqlite3_bind_int64(device_stmt, 3, d.last_time);
+        kismetdb_bind_text(device_stmt, 4, d.phyname);
+        kismetdb_bind_text(device_stmt, 5, d.devmac);
+        kismetdb_bind_text(device_stmt, 6, *(d.json));
+
+        if (step(device_stmt))
+            stat_devices++;
+    }
+
+    for (auto& a : in_queue.alerts) {
+        sqlite3_bind_int64(alert_stmt, 1, a.ts.tv_sec);
+        sqlite3_bind_int64(alert_stmt, 2, a.ts.tv_usec);
+        kismetdb_bind_text(alert_stmt, 3, a.phyname);
+        kismetdb_bind_text(alert_stmt, 4, a.header);
+        kismetdb_bind_text(alert_stmt, 5, a.bssid);
+        kismetdb_bind_text(alert_stmt, 6, a.sourcemac);
+        kismetdb_bind_text(alert_stmt, 7, a.destmac);
+        kismetdb_bind_text(alert_stmt, 8, a.othermac);
+        kismetdb_bind_text(alert_stmt, 9, a.channel);
+        kismetdb_bind_text(alert_stmt, 10, a.text);
+
+        if (step(alert_stmt))
+            stat_alerts++;
+    }
+
+    for (auto& m : in_queue.messages) {
+        sqlite3_bind_int64(message_stmt, 1, m.ts.tv_sec);
+        sqlite3_bind_int64(message_stmt, 2, m.ts.tv_usec);
+        sqlite3_bind_int(message_stmt, 3, m.flags);
+        kismetdb_bind_text(message_stmt, 4, m.msg);
+
+        if (step(message_stmt))
+            stat_messages++;
+    }
+
+    if (sqlite3_exec(db, "COMMIT TRANSACTION", NULL, NULL, NULL) != SQLITE_OK) {
+        if (errors == 0)
+            first_error = sqlite3_errmsg(db);
+        errors++;
+    } else {
+        stat_transactions++;
+    }
+
+    if (errors != 0) {
+        stat_errors += errors;
+        _MSG("kismetdb log '" + fname + "' failed to write " + UIntToString(errors) +
+                " records: " + first_error, MSGFLAG_ERROR);
+    }
+}
+
+bool Dumpfile_Kismetdb::Httpd_VerifyPath(const char *path, const char *method) {
+    if (strcmp(method, "GET") != 0)
+        return false;
+
+    if (!Httpd_CanSerialize(path))
+        return false;
+
+    if (Httpd_StripSuffix(path) == "/logging/" + type + "/stats")
+        return true;
+
+    return false;
+}
+
+void Dumpfile_Kismetdb::Httpd_CreateStreamResponse(
+        Kis_Net_Httpd *httpd __attribute__((unused)),
+        Kis_Net_Httpd_Connection *connection __attribute__((unused)),
+        const char *path, const char *method,
+        const char *upload_data __attribute__((unused)),
+        size_t *upload_data_size __attribute__((unused)),
+        std::stringstream &stream) {
+
+    if (strcmp(method, "GET") != 0)
+        return;
+
+    if (Httpd_StripSuffix(path) != "/logging/" + type + "/stats")
+        return;
+
+    SharedTrackerElement stats(new TrackerElement(TrackerMap, stats_id));
+
+    SharedTrackerElement e;
+
+    e.reset(new TrackerElement(TrackerUInt64, stats_packets_id));
+    e->set((uint64_t) stat_packets);
+    stats->add_map(e);
+
+    e.reset(new TrackerElement(TrackerUInt64, stats_devices_id));
+    e->set((uint64_t) stat_devices);
+    stats->add_map(e);
+
+    e.reset(new TrackerElement(TrackerUInt64, stats_alerts_id));
+    e->set((uint64_t) stat_alerts);
+    stats->add_map(e);
+
+    e.reset(new TrackerElement(TrackerUInt64, stats_messages_id));
+    e->set((uint64_t) stat_messages);
+    stats->add_map(e);
+
+    e.reset(new TrackerElement(TrackerUInt64, stats_dropped_id));
+    e->set((uint64_t) stat_dropped);
+    stats->add_map(e);
+
+    e.reset(new TrackerElement(TrackerUInt64, stats_transactions_id));
+    e->set((uint64_t) stat_transactions);
+    stats->add_map(e);
+
+    e.reset(new TrackerElement(TrackerUInt64, stats_errors_id));
+    e->set((uint64_t) stat_errors);
+    stats->add_map(e);
+
+    Httpd_Serialize(path, stream, stats);
+}
+
+#endif
+
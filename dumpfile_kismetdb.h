@@ -0,0 +1,194 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __DUMPFILE_KISMETDB_H__
+#define __DUMPFILE_KISMETDB_H__
+
+#include "config.h"
+
+#ifdef HAVE_LIBSQLITE3
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include <sqlite3.h>
+
+#include "globalregistry.h"
+#include "configfile.h"
+#include "messagebus.h"
+#include "packetchain.h"
+#include "timetracker.h"
+#include "dumpfile.h"
+#include "kis_net_microhttpd.h"
+
+// Hook for grabbing packets
+int dumpfilekismetdb_chain_hook(CHAINCALL_PARMS);
+
+// Unified sqlite3 log
+//
+// Packets, devices, alerts, and messages all go to one database.  The packet
+// chain, alert dispatcher, and message bus only copy each record into a queue;
+// a writer thread owns the database, and writes everything queued since its
+// last pass in one transaction through prepared statements.  The database is
+// in WAL mode, so it can be read while Kismet is still writing it.
+//
+// Devices are written every kismetdbdeviceinterval seconds, only those which changed
+// since the last pass; each device row holds the latest JSON for the device.
+//
+// When more than kismetdbqueue packets are waiting for the writer, new packets
+// are dropped and counted; the packet chain never waits on the database.
+//
+// Writer counters are served at /logging/kismetdb/stats
+class Dumpfile_Kismetdb : public Dumpfile, public MessageClient,
+    public TimetrackerEvent, public Kis_Net_Httpd_CPPStream_Handler {
+public:
+    Dumpfile_Kismetdb();
+    Dumpfile_Kismetdb(GlobalRegistry *in_globalreg);
+
+    virtual ~Dumpfile_Kismetdb();
+
+    virtual int chain_handler(kis_packet *in_pack);
+    virtual int Flush();
+
+    virtual void ProcessMessage(string in_msg, int in_flags);
+
+    virtual int timetracker_event(int event_id);
+
+    virtual bool Httpd_VerifyPath(const char *path, const char *method);
+
+    virtual void Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd,
+            Kis_Net_Httpd_Connection *connection,
+            const char *url, const char *method, const char *upload_data,
+            size_t *upload_data_size, std::stringstream &stream);
+
+protected:
+    struct packet_rec {
+        struct timeval ts;
+        string phyname;
+        string sourcemac, destmac, transmac;
+        double frequency;
+        string channel;
+        int signal;
+        double lat, lon;
+        string datasource;
+        int dlt;
+        string data;
+    };
+
+    struct device_rec {
+        uint64_t key;
+        time_t first_time, last_time;
+        string phyname;
+        string devmac;
+        shared_ptr<string> json;
+    };
+
+    struct alert_rec {
+        struct timeval ts;
+        string phyname;
+        string header;
+        string bssid, sourcemac, destmac, othermac;
+        string channel;
+        string text;
+    };
+
+    struct message_rec {
+        struct timeval ts;
+        int flags;
+        string msg;
+    };
+
+    // Everything waiting for the writer; the writer swaps the whole queue out
+    // under the lock and writes it without
+    struct write_queue {
+        vector<packet_rec> packets;
+        vector<device_rec> devices;
+        vector<alert_rec> alerts;
+        vector<message_rec> messages;
+
+        void clear() {
+            packets.clear();
+            devices.clear();
+            alerts.clear();
+            messages.clear();
+        }
+
+        size_t size() {
+            return packets.size() + devices.size() + alerts.size() + messages.size();
+        }
+    };
+
+    bool OpenDatabase();
+    void CloseDatabase();
+
+    // Run a statement with no results, logging any error
+    bool Exec(const char *in_sql);
+
+    // Queue every device modified since the last pass
+    void QueueDevices();
+
+    void StartWriter();
+    void StopWriter();
+    void WriterThread();
+    void WriteQueue(write_queue& in_queue);
+
+    void Wake();
+
+    GlobalRegistry *globalreg;
+
+    sqlite3 *db;
+
+    sqlite3_stmt *packet_stmt, *device_stmt, *alert_stmt, *message_stmt;
+
+    int device_timer;
+    time_t last_device_ts;
+
+    int alert_cb_id;
+
+    bool log_packets, log_devices, log_alerts, log_messages;
+
+    unsigned int max_packets;
+    unsigned int commit_interval;
+
+    int pack_comp_common, pack_comp_linkframe, pack_comp_radiodata,
+        pack_comp_gps, pack_comp_datasrc;
+
+    std::mutex queue_mutex;
+    write_queue queue;
+
+    std::thread writer_thread;
+    std::condition_variable writer_cv;
+    bool writer_stop, writer_flush;
+
+    // Counters served over REST
+    std::atomic<uint64_t> stat_packets, stat_devices, stat_alerts, stat_messages,
+        stat_dropped, stat_transactions, stat_errors;
+
+    int stats_id, stats_packets_id, stats_devices_id, stats_alerts_id,
+        stats_messages_id, stats_dropped_id, stats_transactions_id, stats_errors_id;
+};
+
+#endif /* sqlite3 */
+
+#endif /* __dump... */
+
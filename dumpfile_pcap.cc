@@ -21,11 +21,31 @@
 #ifdef HAVE_LIBPCAP
 
 #include <errno.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#ifdef SYS_LINUX
+#include <sys/syscall.h>
+#endif
 
 #include "endian_magic.h"
 #include "dumpfile_pcap.h"
+#include "kis_log_formats.h"
 #include "kis_ppi.h"
 #include "phy_80211.h"
+#include "devicetracker.h"
+#include "pcapng_stream_ringbuf.h"
+
+// Size of the stdio buffer used by the async writer; records are coalesced into
+// writes of roughly this size
+#define PCAP_ASYNC_WRITE_BUFFER     (1024 * 1024)
+// Buffers registered with io_uring, each PCAP_ASYNC_WRITE_BUFFER
+#define PCAP_URING_BUFFERS          8
+
+// Most offsets held for one device before its block is written early
+#define PCAP_INDEX_MAX_PENDING      4096
 
 int dumpfilepcap_chain_hook(CHAINCALL_PARMS) {
 	Dumpfile_Pcap *auxptr = (Dumpfile_Pcap *) auxdata;
@@ -37,7 +57,9 @@ Dumpfile_Pcap::Dumpfile_Pcap() {
 	exit(1);
 }
 
-Dumpfile_Pcap::Dumpfile_Pcap(GlobalRegistry *in_globalreg) : Dumpfile(in_globalreg) {
+Dumpfile_Pcap::Dumpfile_Pcap(GlobalRegistry *in_globalreg) : 
+    Dumpfile(in_globalreg),
+    Kis_Net_Httpd_CPPStream_Handler(in_globalreg) {
 	globalreg = in_globalreg;
 
 	parent = NULL;
@@ -65,7 +87,8 @@ Dumpfile_Pcap::Dumpfile_Pcap(GlobalRegistry *in_globalreg) : Dumpfile(in_globalr
 Dumpfile_Pcap::Dumpfile_Pcap(GlobalRegistry *in_globalreg, string in_type,
 							 int in_dlt, Dumpfile_Pcap *in_parent,
 							 dumpfile_pcap_filter_cb in_filter, void *in_aux) :
-		Dumpfile(in_globalreg) {
+		Dumpfile(in_globalreg),
+        Kis_Net_Httpd_CPPStream_Handler(in_globalreg) {
 
 	globalreg = in_globalreg;
 	type = in_type;
@@ -87,6 +110,160 @@ void Dumpfile_Pcap::Startup_Dumpfile() {
 
 	dumpfile = NULL;
 	dumper = NULL;
+    logfp = NULL;
+    uring_file = NULL;
+
+    async_head = 0;
+    async_tail = 0;
+    async_ring_mask = 0;
+    async_writer_sleeping = false;
+    async_stop = false;
+    async_flush = false;
+
+    stat_queued = 0;
+    stat_written = 0;
+    stat_dropped = 0;
+    stat_blocked = 0;
+    stat_fsyncs = 0;
+    stat_max_depth = 0;
+
+    shared_ptr<KisMetrics> metrics =
+        globalreg->FetchGlobalAs<KisMetrics>("METRICS");
+
+    if (metrics != NULL) {
+        string labels = "log=" + KisMetrics::label_escape(type);
+
+        metric_written =
+            metrics->register_counter("kismet_log_packets_written",
+                    "packets written to a log", labels);
+        metric_dropped =
+            metrics->register_counter("kismet_log_packets_dropped",
+                    "packets dropped because the log writer fell behind", labels);
+        metric_blocked =
+            metrics->register_counter("kismet_log_packets_blocked",
+                    "packets which waited for the log writer to catch up", labels);
+    } else {
+        metric_written.reset(new kis_metric_counter());
+        metric_dropped.reset(new kis_metric_counter());
+        metric_blocked.reset(new kis_metric_counter());
+    }
+
+    rotate_log = false;
+    rotate_bytes = 0;
+    rotate_sec = 0;
+    compress_log = false;
+    keep_segments = 0;
+    keep_bytes = 0;
+    segment_number = 1;
+    segment_offset = 0;
+    segment_retry = 0;
+    compress_stop = false;
+
+    index_log = false;
+    index_file = NULL;
+    index_bucket_sec = 60;
+    index_bucket = 0;
+
+    pack_comp_device = globalreg->packetchain->RegisterPacketComponent("DEVICE");
+    pack_comp_datasrc = globalreg->packetchain->RegisterPacketComponent("KISDATASRC");
+    pack_comp_epbcache = globalreg->packetchain->RegisterPacketComponent("PCAPNG_EPB");
+
+    ng_interfaces_written = 0;
+
+    stats_id =
+        globalreg->entrytracker->RegisterField("kismet.pcapdump.stats", TrackerMap,
+                "pcap log writer statistics");
+    stats_async_id =
+        globalreg->entrytracker->RegisterField("kismet.pcapdump.async", TrackerUInt8,
+                "pcap log is written by a background thread");
+    stats_queue_size_id =
+        globalreg->entrytracker->RegisterField("kismet.pcapdump.queue_size", 
+                TrackerUInt64, "maximum number of packets queued for the writer");
+    stats_queue_depth_id =
+        globalreg->entrytracker->RegisterField("kismet.pcapdump.queue_depth", 
+                TrackerUInt64, "packets currently queued for the writer");
+    stats_max_depth_id =
+        globalreg->entrytracker->RegisterField("kismet.pcapdump.queue_max_depth", 
+                TrackerUInt64, "most packets queued for the writer at once");
+    stats_queued_id =
+        globalreg->entrytracker->RegisterField("kismet.pcapdump.queued", 
+                TrackerUInt64, "packets queued for the writer");
+    stats_written_id =
+        globalreg->entrytracker->RegisterField("kismet.pcapdump.written", 
+                TrackerUInt64, "packets written to the log");
+    stats_dropped_id =
+        globalreg->entrytracker->RegisterField("kismet.pcapdump.dropped", 
+                TrackerUInt64, "packets dropped because the queue was full");
+    stats_blocked_id =
+        globalreg->entrytracker->RegisterField("kismet.pcapdump.blocked", 
+                TrackerUInt64, "times the packet chain waited for queue space");
+    stats_fsyncs_id =
+        globalreg->entrytracker->RegisterField("kismet.pcapdump.fsyncs", 
+                TrackerUInt64, "times the log was synced to disk");
+
+    segments_id =
+        globalreg->entrytracker->RegisterField("kismet.pcapdump.segments", 
+                TrackerVector, "pcap log segments");
+    segment_id =
+        globalreg->entrytracker->RegisterField("kismet.pcapdump.segment", 
+                TrackerMap, "pcap log segment");
+    segment_number_id =
+        globalreg->entrytracker->RegisterField("kismet.pcapdump.segment.number", 
+                TrackerUInt32, "segment number");
+    segment_name_id =
+        globalreg->entrytracker->RegisterField("kismet.pcapdump.segment.file", 
+                TrackerString, "segment file");
+    segment_start_id =
+        globalreg->entrytracker->RegisterField("kismet.pcapdump.segment.start", 
+                TrackerUInt64, "time the segment was started");
+    segment_end_id =
+        globalreg->entrytracker->RegisterField("kismet.pcapdump.segment.end", 
+                TrackerUInt64, "time the segment was closed, or 0 if open");
+    segment_bytes_id =
+        globalreg->entrytracker->RegisterField("kismet.pcapdump.segment.bytes", 
+                TrackerUInt64, "size of the segment on disk");
+    segment_packets_id =
+        globalreg->entrytracker->RegisterField("kismet.pcapdump.segment.packets", 
+                TrackerUInt64, "packets in the segment");
+    segment_state_id =
+        globalreg->entrytracker->RegisterField("kismet.pcapdump.segment.state", 
+                TrackerString, "open, closed, compressing, or compressed");
+
+    async_write =
+        globalreg->kismet_config->FetchOptBoolean(type + "async", false);
+
+    async_block = false;
+    string queuefull = StrLower(globalreg->kismet_config->FetchOpt(type + "queuefull"));
+    if (queuefull == "block") {
+        async_block = true;
+    } else if (queuefull != "" && queuefull != "drop") {
+        _MSG("Unknown " + type + "queuefull option '" + queuefull + "', expected "
+                "'drop' or 'block'; dropping packets when the queue is full",
+                MSGFLAG_ERROR);
+    }
+
+    async_fsync = globalreg->kismet_config->FetchOptUInt(type + "fsync", 0);
+
+    async_uring = async_write &&
+        globalreg->kismet_config->FetchOptBoolean(type + "uring", false);
+    async_direct = 
+        globalreg->kismet_config->FetchOptBoolean(type + "direct", false);
+
+    if (async_write) {
+        unsigned int queuelen = 
+            globalreg->kismet_config->FetchOptUInt(type + "queue", 4096);
+
+        // Round up to a power of two so the ring can be masked
+        uint64_t ringsz = 16;
+        while (ringsz < queuelen && ringsz < (1 << 24))
+            ringsz <<= 1;
+
+        async_ring.resize(ringsz);
+        async_ring_mask = ringsz - 1;
+
+        for (auto& r : async_ring)
+            r.data = NULL;
+    }
 
 	// Process a resume request
 	dumpformat = dump_unknown;
@@ -102,6 +279,9 @@ void Dumpfile_Pcap::Startup_Dumpfile() {
 		// Set us to PPI
 		fdlt = DLT_PPI;
 #endif
+	} else if (globalreg->kismet_config->FetchOpt(type + "format") == "pcapng") {
+		_MSG("Pcap log in pcapng format", MSGFLAG_INFO);
+		dumpformat = dump_pcapng;
 	} else {
 		_MSG("Pcap logging for type " + type, MSGFLAG_INFO);
 	}
@@ -112,30 +292,92 @@ void Dumpfile_Pcap::Startup_Dumpfile() {
 		return;
 	}
 
-	dumpfile = pcap_open_dead(fdlt, MAX_PACKET_LEN);
-	if (dumpfile == NULL) {
+	// Pcapng logs are written without libpcap
+	if (dumpformat != dump_pcapng)
+		dumpfile = pcap_open_dead(fdlt, MAX_PACKET_LEN);
+
+	if (dumpfile == NULL && dumpformat != dump_pcapng) {
 		_MSG("Failed to open pcap dump file '" + fname + "': " +
 			 string(strerror(errno)), MSGFLAG_FATAL);
 		globalreg->fatal_condition = 1;
 		return;
 	}
 
-	dumper = pcap_dump_open(dumpfile, fname.c_str());
-	if (dumper == NULL) {
-		_MSG("Failed to open pcap dump file '" + fname + "': " +
-			 string(strerror(errno)), MSGFLAG_FATAL);
+    index_log = globalreg->kismet_config->FetchOptBoolean(type + "index", false);
+    index_bucket_sec = 
+        globalreg->kismet_config->FetchOptUInt(type + "indexbucket", 60);
+
+    if (index_bucket_sec == 0)
+        index_bucket_sec = 1;
+
+    rotate_bytes = 
+        (uint64_t) globalreg->kismet_config->FetchOptUInt(type + "rotatemb", 0) * 
+        1024 * 1024;
+    rotate_sec = globalreg->kismet_config->FetchOptUInt(type + "rotateseconds", 0);
+    rotate_log = rotate_bytes != 0 || rotate_sec != 0;
+
+    keep_segments = globalreg->kismet_config->FetchOptUInt(type + "keepsegments", 0);
+    keep_bytes = 
+        (uint64_t) globalreg->kismet_config->FetchOptUInt(type + "keepmb", 0) * 
+        1024 * 1024;
+
+    compress_log = false;
+    string compress = StrLower(globalreg->kismet_config->FetchOpt(type + "compress"));
+    if (compress == "gzip") {
+        compress_log = true;
+    } else if (compress != "" && compress != "none") {
+        _MSG("Unknown " + type + "compress option '" + compress + "', expected "
+                "'none' or 'gzip'; not compressing log segments", MSGFLAG_ERROR);
+    }
+
+    if (!rotate_log && (compress_log || keep_segments != 0 || keep_bytes != 0)) {
+        _MSG("Compression and retention of the " + type + " log only apply to "
+                "rotated segments; set " + type + "rotatemb or " + type + 
+                "rotateseconds to rotate the log", MSGFLAG_ERROR);
+        compress_log = false;
+    }
+
+	if (!OpenSegment()) {
+		_MSG("Unable to open the " + type + " log", MSGFLAG_FATAL);
 		globalreg->fatal_condition = 1;
 		return;
 	}
 
-	_MSG("Opened pcapdump log file '" + fname + "'", MSGFLAG_INFO);
+    if (index_log)
+        _MSG("Indexing packets of each device in pcapdump log '" + fname + 
+                "', in buckets of " + UIntToString(index_bucket_sec) + " seconds", 
+                MSGFLAG_INFO);
+
+    if (rotate_log) {
+        string limits;
+
+        if (rotate_bytes != 0)
+            limits += UIntToString(rotate_bytes / 1024 / 1024) + "MB";
+
+        if (rotate_sec != 0)
+            limits += string(limits.length() ? " or " : "") + 
+                UIntToString(rotate_sec) + " seconds";
+
+        _MSG("Rotating pcapdump log '" + fname + "' every " + limits + 
+                (compress_log ? ", compressing closed segments" : ""), MSGFLAG_INFO);
+
+        if (compress_log)
+            compress_thread = std::thread([this]() { CompressorThread(); });
+    }
 
 	beaconlog = 1;
 	phylog = 1;
 	corruptlog = 1;
 
+    if (async_write) {
+        _MSG("Writing pcapdump log '" + fname + "' from a background thread, " +
+                "queueing up to " + UIntToString(async_ring.size()) + " packets",
+                MSGFLAG_INFO);
+        StartAsyncWriter();
+    }
+
 	globalreg->packetchain->RegisterHandler(&dumpfilepcap_chain_hook, this,
-											CHAINPOS_LOGGING, -100);
+											CHAINPOS_LOGGING, -100, "pcap log");
 
 	globalreg->RegisterDumpFile(this);
 }
@@ -144,30 +386,1045 @@ Dumpfile_Pcap::~Dumpfile_Pcap() {
 	globalreg->packetchain->RemoveHandler(&dumpfilepcap_chain_hook, 
 										  CHAINPOS_LOGGING);
 
+    // Nothing can queue once the handler is gone; let the writer drain whatever
+    // is left and exit before we close the file out from under it
+    StopAsyncWriter();
+
 	// Close files
-	if (dumper != NULL) {
+	if (logfp != NULL) {
 		Flush();
-		pcap_dump_flush(dumper);
-		pcap_dump_close(dumper);
+        CloseSegment();
 	}
 
+    // Any segments still waiting for compression are left as they are
+    if (compress_thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lk(segment_mutex);
+            compress_stop = true;
+            compress_cv.notify_one();
+        }
+
+        compress_thread.join();
+    }
+
 	if (dumpfile != NULL) {
 		pcap_close(dumpfile);
 	}
 
 	dumper = NULL;
+	logfp = NULL;
 	dumpfile = NULL;
 }
 
+bool Dumpfile_Pcap::OpenSegment() {
+    shared_ptr<log_segment> seg(new log_segment());
+
+    seg->number = segment_number++;
+    seg->start = time(0);
+    seg->end = 0;
+    seg->bytes = 0;
+    seg->packets = 0;
+    seg->state = segment_open;
+
+    // Rotated segments are numbered before the extension of the log name
+    seg->fname = fname;
+
+    if (rotate_log) {
+        char num[16];
+        snprintf(num, 16, "-%04u", seg->number);
+
+        size_t dot = fname.rfind('.');
+        size_t slash = fname.rfind('/');
+
+        if (dot != string::npos && (slash == string::npos || dot > slash))
+            seg->fname = fname.substr(0, dot) + num + fname.substr(dot);
+        else
+            seg->fname = fname + num;
+    }
+
+    if (dumpformat == dump_pcapng) {
+        // There's no libpcap dumper for pcapng; blocks go to the stream 
+        // directly, through a large buffer so they reach the file in big writes
+        if (async_uring) {
+            KisUringFile *uf = new KisUringFile();
+
+            if (uf->open(seg->fname, false, async_direct, PCAP_ASYNC_WRITE_BUFFER, 
+                        PCAP_URING_BUFFERS) &&
+                    (logfp = KisUringFile::fopen_stream(uf)) != NULL) {
+                uring_file = uf;
+            } else {
+                _MSG("Pcap log '" + seg->fname + "' could not be written with "
+                        "io_uring (" + string(strerror(errno)) + "), using the "
+                        "normal writer", MSGFLAG_ERROR);
+                delete uf;
+                async_uring = false;
+            }
+        }
+
+        if (logfp == NULL && (logfp = fopen(seg->fname.c_str(), "wb")) != NULL)
+            setvbuf(logfp, NULL, _IOFBF, PCAP_ASYNC_WRITE_BUFFER);
+    } else if (async_uring) {
+        KisUringFile *uf = new KisUringFile();
+        FILE *dumpfp = NULL;
+
+        if (uf->open(seg->fname, false, async_direct, PCAP_ASYNC_WRITE_BUFFER, 
+                    PCAP_URING_BUFFERS) &&
+                (dumpfp = KisUringFile::fopen_stream(uf)) != NULL) {
+            dumper = pcap_dump_fopen(dumpfile, dumpfp);
+
+            // Closing the stream takes the file with it
+            if (dumper == NULL)
+                fclose(dumpfp);
+            else
+                uring_file = uf;
+        } else {
+            _MSG("Pcap log '" + seg->fname + "' could not be written with io_uring (" + 
+                    string(strerror(errno)) + "), using the normal writer", 
+                    MSGFLAG_ERROR);
+            delete uf;
+            async_uring = false;
+        }
+    }
+
+    if (dumpformat == dump_pcapng) {
+        // Opened above
+    } else if (dumper == NULL && async_write) {
+        // Open the file ourselves so the writer gets a much larger buffer than
+        // the stdio default, and coalesces records into big writes
+        FILE *dumpfp = fopen(seg->fname.c_str(), "wb");
+
+        if (dumpfp != NULL) {
+            setvbuf(dumpfp, NULL, _IOFBF, PCAP_ASYNC_WRITE_BUFFER);
+
+            dumper = pcap_dump_fopen(dumpfile, dumpfp);
+
+            if (dumper == NULL)
+                fclose(dumpfp);
+        }
+    } else if (dumper == NULL) {
+        dumper = pcap_dump_open(dumpfile, seg->fname.c_str());
+    }
+
+    if (dumper != NULL)
+        logfp = pcap_dump_file(dumper);
+
+    if (logfp == NULL) {
+        _MSG("Failed to open pcap dump file '" + seg->fname + "': " +
+            string(strerror(errno)), MSGFLAG_ERROR);
+        return false;
+    }
+
+    if (dumpformat == dump_pcapng) {
+        if (!WriteNgHeader()) {
+            _MSG("Failed to write pcap dump file '" + seg->fname + "': " +
+                    string(strerror(errno)), MSGFLAG_ERROR);
+            fclose(logfp);
+            logfp = NULL;
+            uring_file = NULL;
+            return false;
+        }
+    } else {
+        segment_offset = sizeof(struct pcap_file_header);
+    }
+
+    seg->bytes = segment_offset;
+
+	_MSG("Opened pcapdump log file '" + seg->fname + "'", MSGFLAG_INFO);
+
+    if (index_log) {
+        seg->index_fname = seg->fname + ".kidx";
+
+        index_file = fopen(seg->index_fname.c_str(), "wb");
+
+        if (index_file == NULL) {
+            _MSG("Failed to open pcapdump index '" + seg->index_fname + "': " +
+                    string(strerror(errno)) + ", continuing without an index",
+                    MSGFLAG_ERROR);
+            seg->index_fname = "";
+        } else {
+            uint32_t v;
+
+            fwrite(PCAP_INDEX_MAGIC, 8, 1, index_file);
+            v = kis_htole32(PCAP_INDEX_VERSION);
+            fwrite(&v, sizeof(uint32_t), 1, index_file);
+            v = kis_htole32(index_bucket_sec);
+            fwrite(&v, sizeof(uint32_t), 1, index_file);
+        }
+    }
+
+    std::lock_guard<std::mutex> lk(segment_mutex);
+
+    segments.push_back(seg);
+    open_segment = seg;
+
+    return true;
+}
+
+void Dumpfile_Pcap::CloseSegment() {
+    if (logfp == NULL)
+        return;
+
+    FlushIndex();
+
+    if (dumper != NULL)
+        pcap_dump_close(dumper);
+    else
+        fclose(logfp);
+
+    dumper = NULL;
+    logfp = NULL;
+    uring_file = NULL;
+
+    if (index_file != NULL)
+        fclose(index_file);
+    index_file = NULL;
+
+    // A new segment starts a new index bucket
+    index_bucket = 0;
+
+    std::lock_guard<std::mutex> lk(segment_mutex);
+
+    if (open_segment == NULL)
+        return;
+
+    open_segment->end = time(0);
+    open_segment->state = segment_closed;
+
+    if (compress_thread.joinable()) {
+        compress_queue.push_back(open_segment);
+        compress_cv.notify_one();
+    }
+
+    open_segment.reset();
+
+    ExpireSegments();
+}
+
+void Dumpfile_Pcap::ExpireSegments() {
+    while (segments.size() != 0) {
+        uint64_t total = 0;
+
+        for (auto s : segments)
+            total += s->bytes;
+
+        if (!(keep_segments != 0 && segments.size() > keep_segments) &&
+                !(keep_bytes != 0 && total > keep_bytes))
+            break;
+
+        shared_ptr<log_segment> seg = segments.front();
+
+        // Never delete the segment being written or compressed; the limit is
+        // applied again when they close
+        if (seg->state == segment_open || seg->state == segment_compressing)
+            break;
+
+        _MSG("Removing pcapdump log segment '" + seg->fname + "' to stay within "
+                "the retention limits", MSGFLAG_INFO);
+
+        unlink(seg->fname.c_str());
+
+        if (seg->index_fname.length() != 0)
+            unlink(seg->index_fname.c_str());
+
+        for (auto ci = compress_queue.begin(); ci != compress_queue.end(); ++ci) {
+            if (*ci == seg) {
+                compress_queue.erase(ci);
+                break;
+            }
+        }
+
+        segments.pop_front();
+    }
+}
+
+void Dumpfile_Pcap::CompressorThread() {
+#ifdef SYS_LINUX
+    // Compression only uses otherwise idle cpu
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+#endif
+
+    std::unique_lock<std::mutex> lk(segment_mutex);
+
+    while (1) {
+        while (!compress_stop && compress_queue.size() == 0)
+            compress_cv.wait(lk);
+
+        if (compress_stop)
+            break;
+
+        shared_ptr<log_segment> seg = compress_queue.front();
+        compress_queue.pop_front();
+
+        seg->state = segment_compressing;
+        string gzname = seg->fname + ".gz";
+
+        lk.unlock();
+        bool ok = CompressSegment(seg, gzname);
+        lk.lock();
+
+        if (ok) {
+            unlink(seg->fname.c_str());
+
+            if (seg->index_fname.length() != 0)
+                unlink(seg->index_fname.c_str());
+
+            struct stat sbuf;
+            if (stat(gzname.c_str(), &sbuf) == 0)
+                seg->bytes = sbuf.st_size;
+
+            seg->fname = gzname;
+            seg->index_fname = "";
+            seg->state = segment_compressed;
+        } else {
+            unlink(gzname.c_str());
+            seg->state = segment_closed;
+        }
+
+        ExpireSegments();
+    }
+}
+
+bool Dumpfile_Pcap::CompressSegment(shared_ptr<log_segment> in_segment, 
+        string in_fname) {
+    FILE *in = fopen(in_segment->fname.c_str(), "rb");
+
+    if (in == NULL) {
+        _MSG("Failed to open pcapdump log segment '" + in_segment->fname + 
+                "' for compression: " + string(strerror(errno)), MSGFLAG_ERROR);
+        return false;
+    }
+
+    gzFile out = gzopen(in_fname.c_str(), "wb6");
+
+    if (out == NULL) {
+        _MSG("Failed to create compressed pcapdump log segment '" + in_fname + 
+                "': " + string(strerror(errno)), MSGFLAG_ERROR);
+        fclose(in);
+        return false;
+    }
+
+    vector<char> buf(PCAP_ASYNC_WRITE_BUFFER);
+    bool ok = true;
+    size_t r;
+
+    while ((r = fread(buf.data(), 1, buf.size(), in)) > 0) {
+        if (gzwrite(out, buf.data(), r) != (int) r) {
+            ok = false;
+            break;
+        }
+
+        // Stop early on shutdown; the segment is left uncompressed
+        if (compress_stop) {
+            ok = false;
+            break;
+        }
+    }
+
+    if (ferror(in))
+        ok = false;
+
+    fclose(in);
+
+    if (gzclose(out) != Z_OK)
+        ok = false;
+
+    if (!ok && !compress_stop)
+        _MSG("Failed to compress pcapdump log segment '" + in_segment->fname + "'",
+                MSGFLAG_ERROR);
+
+    return ok;
+}
+
 int Dumpfile_Pcap::Flush() {
-	if (dumper == NULL || dumpfile == NULL)
+	if (logfp == NULL)
 		return 0;
 
-	pcap_dump_flush(dumper);
+    // The writer thread owns the file while it's running; ask it to flush
+    if (async_thread.joinable()) {
+        async_flush = true;
+
+        std::lock_guard<std::mutex> lk(async_mutex);
+        async_write_cv.notify_one();
+
+        return 1;
+    }
+
+	FlushDumper();
+    FlushIndex();
 
 	return 1;
 }
 
+void Dumpfile_Pcap::StartAsyncWriter() {
+    async_stop = false;
+    async_thread = std::thread([this]() { AsyncWriterThread(); });
+}
+
+void Dumpfile_Pcap::StopAsyncWriter() {
+    if (!async_thread.joinable())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lk(async_mutex);
+        async_stop = true;
+        async_write_cv.notify_one();
+        async_space_cv.notify_all();
+    }
+
+    async_thread.join();
+}
+
+void Dumpfile_Pcap::AsyncWriterThread() {
+    time_t last_fsync = time(0);
+
+    while (1) {
+        uint64_t tail = async_tail.load(std::memory_order_relaxed);
+        uint64_t head = async_head.load(std::memory_order_acquire);
+
+        while (tail != head) {
+            async_rec *r = &(async_ring[tail & async_ring_mask]);
+
+            DumpRecord(&(r->hdr), r->data, r->device_key, r->block.get(), 
+                    r->interface);
+
+            delete[] r->data;
+            r->data = NULL;
+            r->block.reset();
+
+            tail++;
+            async_tail.store(tail, std::memory_order_release);
+            stat_written++;
+            metric_written->inc();
+        }
+
+        if (async_block)
+            async_space_cv.notify_all();
+
+        bool stopping = async_stop;
+        time_t now = time(0);
+        bool sync = 
+            async_fsync != 0 && (now - last_fsync) >= (time_t) async_fsync;
+
+        if (async_flush.exchange(false) || sync || stopping) {
+            FlushDumper();
+            FlushIndex();
+
+            if (sync && logfp != NULL) {
+                if (uring_file != NULL)
+                    uring_file->sync();
+                else
+                    fsync(fileno(logfp));
+                stat_fsyncs++;
+                last_fsync = now;
+            }
+        }
+
+        // The chain handler is removed before we're stopped, so once we're told
+        // to stop and have drained the ring, nothing else is coming
+        if (stopping && async_tail == async_head)
+            break;
+
+        std::unique_lock<std::mutex> lk(async_mutex);
+
+        // Producers only poke the condition when they see we're asleep; the
+        // timeout catches any wakeup we race with, and drives the fsync cadence
+        async_writer_sleeping = true;
+
+        if (async_head == tail && !async_stop && !async_flush)
+            async_write_cv.wait_for(lk, std::chrono::milliseconds(500));
+
+        async_writer_sleeping = false;
+    }
+}
+
+void Dumpfile_Pcap::DumpRecord(struct pcap_pkthdr *in_hdr, u_char *in_data,
+        uint64_t in_device_key, const vector<uint8_t> *in_block,
+        unsigned int in_interface) {
+    if (rotate_log) {
+        if (logfp != NULL &&
+                ((rotate_bytes != 0 && segment_offset >= rotate_bytes) ||
+                 (rotate_sec != 0 && 
+                  time(0) - open_segment->start >= (time_t) rotate_sec))) {
+            CloseSegment();
+            OpenSegment();
+            segment_retry = time(0);
+        } else if (logfp == NULL && time(0) - segment_retry >= 10) {
+            // The last segment couldn't be opened; keep trying every few seconds
+            // instead of on every packet
+            OpenSegment();
+            segment_retry = time(0);
+        }
+    }
+
+    // Packets are lost while no segment is open
+    if (logfp == NULL)
+        return;
+
+    // Records are written as a fixed header and the data, so the position in the
+    // log is tracked here instead of asking stdio for it
+    uint64_t offt;
+
+    if (in_block != NULL) {
+        if (in_block->size() < sizeof(pcapng_epb))
+            return;
+
+        // Any interface the packet is the first of goes in ahead of it
+        WriteNgInterfaces(in_interface);
+
+        offt = segment_offset;
+
+        // The shared block was encoded for interface 0; only the header is
+        // copied to change it
+        pcapng_epb epb;
+        memcpy(&epb, in_block->data(), sizeof(pcapng_epb));
+        epb.interface_id = in_interface;
+
+        fwrite(&epb, sizeof(pcapng_epb), 1, logfp);
+        fwrite(in_block->data() + sizeof(pcapng_epb), 
+                in_block->size() - sizeof(pcapng_epb), 1, logfp);
+
+        segment_offset += in_block->size();
+    } else {
+        offt = segment_offset;
+
+        pcap_dump((u_char *) dumper, in_hdr, in_data);
+
+        segment_offset += sizeof(pcap_index_sf_hdr) + in_hdr->caplen;
+    }
+    open_segment->bytes = segment_offset;
+    open_segment->packets++;
+
+    if (!index_log || index_file == NULL || in_device_key == 0)
+        return;
+
+    time_t bucket = in_hdr->ts.tv_sec - (in_hdr->ts.tv_sec % index_bucket_sec);
+
+    // Close out the previous bucket of every device once time moves on, so
+    // only the current bucket is ever held
+    if (bucket != index_bucket) {
+        FlushIndex();
+        index_bucket = bucket;
+    }
+
+    vector<uint64_t>& offsets = index_pending[in_device_key];
+
+    offsets.push_back(offt);
+
+    if (offsets.size() >= PCAP_INDEX_MAX_PENDING)
+        FlushIndex();
+}
+
+void Dumpfile_Pcap::FlushDumper() {
+    if (logfp == NULL)
+        return;
+
+    if (dumper != NULL)
+        pcap_dump_flush(dumper);
+    else
+        fflush(logfp);
+
+    if (uring_file != NULL && uring_file->flush() < 0)
+        _MSG("Pcap log '" + fname + "' failed to write: " +
+                string(strerror(errno)), MSGFLAG_ERROR);
+}
+
+bool Dumpfile_Pcap::WriteNgHeader() {
+    vector<uint8_t> shb;
+
+    Pcap_Stream_Ringbuf::pcapng_encode_shb("", "", "Kismet", shb);
+
+    if (fwrite(shb.data(), shb.size(), 1, logfp) != 1)
+        return false;
+
+    segment_offset = shb.size();
+    ng_interfaces_written = 0;
+
+    return true;
+}
+
+void Dumpfile_Pcap::WriteNgInterfaces(unsigned int in_interface) {
+    if (in_interface < ng_interfaces_written)
+        return;
+
+    std::lock_guard<std::mutex> lk(ng_interface_mutex);
+
+    while (ng_interfaces_written <= in_interface && 
+            ng_interfaces_written < ng_interfaces.size()) {
+        const vector<uint8_t>& idb = ng_interfaces[ng_interfaces_written].idb;
+
+        fwrite(idb.data(), idb.size(), 1, logfp);
+
+        segment_offset += idb.size();
+        ng_interfaces_written++;
+    }
+}
+
+void Dumpfile_Pcap::FlushIndex() {
+    if (index_file == NULL || index_pending.size() == 0)
+        return;
+
+    // Everything the index points to has to be in the log before the index is
+    FlushDumper();
+
+    for (auto p : index_pending) {
+        if (p.second.size() == 0)
+            continue;
+
+        uint64_t v64;
+        uint32_t v32;
+
+        v64 = kis_htole64(p.first);
+        fwrite(&v64, sizeof(uint64_t), 1, index_file);
+        v64 = kis_htole64((uint64_t) index_bucket);
+        fwrite(&v64, sizeof(uint64_t), 1, index_file);
+        v32 = kis_htole32(p.second.size());
+        fwrite(&v32, sizeof(uint32_t), 1, index_file);
+        v32 = 0;
+        fwrite(&v32, sizeof(uint32_t), 1, index_file);
+
+        for (auto o : p.second) {
+            v64 = kis_htole64(o);
+            fwrite(&v64, sizeof(uint64_t), 1, index_file);
+        }
+    }
+
+    index_pending.clear();
+
+    fflush(index_file);
+}
+
+bool Dumpfile_Pcap::ReadIndex(string in_index_fname, uint64_t in_key, 
+        time_t in_start, time_t in_end, vector<uint64_t> *ret_offsets) {
+    ret_offsets->clear();
+
+    FILE *idx = fopen(in_index_fname.c_str(), "rb");
+
+    if (idx == NULL)
+        return false;
+
+    char magic[8];
+    uint32_t hdr[2];
+
+    if (fread(magic, 8, 1, idx) != 1 || memcmp(magic, PCAP_INDEX_MAGIC, 8) != 0 ||
+            fread(hdr, sizeof(uint32_t), 2, idx) != 2 ||
+            kis_letoh32(hdr[0]) != PCAP_INDEX_VERSION) {
+        fclose(idx);
+        return false;
+    }
+
+    time_t bucket_sec = kis_letoh32(hdr[1]);
+
+    // Only the block headers are read for other devices; their offsets are
+    // skipped over
+    while (1) {
+        uint64_t bhdr[2];
+        uint32_t bcount[2];
+
+        if (fread(bhdr, sizeof(uint64_t), 2, idx) != 2 ||
+                fread(bcount, sizeof(uint32_t), 2, idx) != 2)
+            break;
+
+        uint64_t key = kis_letoh64(bhdr[0]);
+        time_t bucket = (time_t) kis_letoh64(bhdr[1]);
+        uint32_t count = kis_letoh32(bcount[0]);
+
+        if (key != in_key || bucket + bucket_sec <= in_start || 
+                (in_end != 0 && bucket > in_end)) {
+            if (fseek(idx, (long) count * sizeof(uint64_t), SEEK_CUR) < 0)
+                break;
+            continue;
+        }
+
+        size_t pos = ret_offsets->size();
+        ret_offsets->resize(pos + count);
+
+        size_t r = fread(&((*ret_offsets)[pos]), sizeof(uint64_t), count, idx);
+
+        ret_offsets->resize(pos + r);
+
+        for (size_t i = pos; i < ret_offsets->size(); i++)
+            (*ret_offsets)[i] = kis_letoh64((*ret_offsets)[i]);
+
+        if (r != count)
+            break;
+    }
+
+    fclose(idx);
+
+    return true;
+}
+
+void Dumpfile_Pcap::ExtractDevice(uint64_t in_key, time_t in_start, time_t in_end,
+        std::stringstream &stream) {
+    vector<pair<string, string> > logs;
+
+    {
+        std::lock_guard<std::mutex> lk(segment_mutex);
+
+        for (auto seg : segments) {
+            if (seg->index_fname.length() == 0)
+                continue;
+
+            if (in_end != 0 && seg->start > in_end)
+                continue;
+
+            if (seg->end != 0 && seg->end < in_start)
+                continue;
+
+            logs.push_back(make_pair(seg->fname, seg->index_fname));
+        }
+    }
+
+    bool wrote_header = false;
+    vector<uint64_t> offsets;
+    vector<char> data;
+
+    for (auto l : logs) {
+        if (!ReadIndex(l.second, in_key, in_start, in_end, &offsets))
+            continue;
+
+        // Segments which were removed or compressed since we looked are skipped
+        FILE *log = fopen(l.first.c_str(), "rb");
+
+        if (log == NULL)
+            continue;
+
+        if (dumpformat == dump_pcapng) {
+            ExtractPcapng(log, offsets, in_start, in_end, stream, &wrote_header);
+            fclose(log);
+            continue;
+        }
+
+        // The log header carries the DLT and snaplen, so copy it as-is, once
+        struct pcap_file_header fhdr;
+
+        if (fread(&fhdr, sizeof(struct pcap_file_header), 1, log) != 1) {
+            fclose(log);
+            continue;
+        }
+
+        if (!wrote_header) {
+            stream.write((const char *) &fhdr, sizeof(struct pcap_file_header));
+            wrote_header = true;
+        }
+
+        for (auto o : offsets) {
+            pcap_index_sf_hdr rhdr;
+
+            if (fseek(log, (long) o, SEEK_SET) < 0 ||
+                    fread(&rhdr, sizeof(pcap_index_sf_hdr), 1, log) != 1)
+                break;
+
+            if (rhdr.caplen > MAX_PACKET_LEN)
+                break;
+
+            if ((time_t) rhdr.ts_sec < in_start || 
+                    (in_end != 0 && (time_t) rhdr.ts_sec > in_end))
+                continue;
+
+            data.resize(rhdr.caplen);
+
+            if (rhdr.caplen != 0 && fread(&(data[0]), rhdr.caplen, 1, log) != 1)
+                break;
+
+            stream.write((const char *) &rhdr, sizeof(pcap_index_sf_hdr));
+            stream.write(data.data(), rhdr.caplen);
+        }
+
+        fclose(log);
+    }
+}
+
+void Dumpfile_Pcap::ExtractPcapng(FILE *in_log, const vector<uint64_t>& in_offsets,
+        time_t in_start, time_t in_end, std::stringstream &stream, 
+        bool *wrote_header) {
+    // Interfaces are numbered the same in every segment, so one header and every
+    // interface we know of covers the packets of all of them
+    if (!*wrote_header) {
+        vector<uint8_t> shb;
+        Pcap_Stream_Ringbuf::pcapng_encode_shb("", "", "Kismet", shb);
+        stream.write((const char *) shb.data(), shb.size());
+
+        std::lock_guard<std::mutex> lk(ng_interface_mutex);
+
+        for (auto i : ng_interfaces)
+            stream.write((const char *) i.idb.data(), i.idb.size());
+
+        *wrote_header = true;
+    }
+
+    vector<uint8_t> data;
+
+    for (auto o : in_offsets) {
+        uint32_t bhdr[2];
+
+        if (fseek(in_log, (long) o, SEEK_SET) < 0 ||
+                fread(bhdr, sizeof(bhdr), 1, in_log) != 1)
+            break;
+
+        if (bhdr[0] != PCAPNG_EPB_BLOCK_TYPE || 
+                bhdr[1] < sizeof(pcapng_epb) + sizeof(uint32_t) ||
+                bhdr[1] > MAX_PACKET_LEN + 64)
+            break;
+
+        data.resize(bhdr[1]);
+        memcpy(data.data(), bhdr, sizeof(bhdr));
+
+        if (fread(data.data() + sizeof(bhdr), bhdr[1] - sizeof(bhdr), 1, in_log) != 1)
+            break;
+
+        pcapng_epb *epb = (pcapng_epb *) data.data();
+
+        time_t ts_sec = 
+            ((((uint64_t) epb->timestamp_high) << 32) | epb->timestamp_low) / 1000000;
+
+        if (ts_sec < in_start || (in_end != 0 && ts_sec > in_end))
+            continue;
+
+        stream.write((const char *) data.data(), data.size());
+    }
+}
+
+void Dumpfile_Pcap::WriteRecord(struct pcap_pkthdr *in_hdr, u_char *in_data,
+        uint64_t in_device_key, shared_ptr<vector<uint8_t> > in_block,
+        unsigned int in_interface) {
+    if (!async_thread.joinable()) {
+        DumpRecord(in_hdr, in_data, in_device_key, in_block.get(), in_interface);
+        delete[] in_data;
+        stat_written++;
+        metric_written->inc();
+        dumped_frames++;
+        return;
+    }
+
+    uint64_t head = async_head.load(std::memory_order_relaxed);
+
+    if (head - async_tail.load(std::memory_order_acquire) >= async_ring.size()) {
+        if (!async_block) {
+            delete[] in_data;
+            stat_dropped++;
+            metric_dropped->inc();
+            return;
+        }
+
+        // Back-pressure the packet chain until the writer catches up
+        stat_blocked++;
+        metric_blocked->inc();
+
+        std::unique_lock<std::mutex> lk(async_mutex);
+
+        while (head - async_tail.load(std::memory_order_acquire) >= 
+                async_ring.size() && !async_stop) {
+            async_write_cv.notify_one();
+            async_space_cv.wait_for(lk, std::chrono::milliseconds(10));
+        }
+
+        if (async_stop) {
+            delete[] in_data;
+            stat_dropped++;
+            metric_dropped->inc();
+            return;
+        }
+    }
+
+    async_rec *r = &(async_ring[head & async_ring_mask]);
+    r->hdr = *in_hdr;
+    r->data = in_data;
+    r->device_key = in_device_key;
+    r->block = in_block;
+    r->interface = in_interface;
+
+    async_head.store(head + 1);
+
+    stat_queued++;
+    dumped_frames++;
+
+    uint64_t depth = head + 1 - async_tail.load(std::memory_order_relaxed);
+    if (depth > stat_max_depth)
+        stat_max_depth = depth;
+
+    if (async_writer_sleeping) {
+        std::lock_guard<std::mutex> lk(async_mutex);
+        async_write_cv.notify_one();
+    }
+}
+
+bool Dumpfile_Pcap::Httpd_VerifyPath(const char *path, const char *method) {
+    if (strcmp(method, "GET") != 0)
+        return false;
+
+    if (index_log && Httpd_GetSuffix(path) == ExtractSuffix()) {
+        // /logging/[type]/device/[key].pcap
+        // /logging/[type]/device/[key]/[start]/[end].pcap
+        // or .pcapng, for pcapng logs
+        vector<string> tokenurl = StrTokenize(Httpd_StripSuffix(path), "/");
+
+        if ((tokenurl.size() == 5 || tokenurl.size() == 7) &&
+                tokenurl[1] == "logging" && tokenurl[2] == type &&
+                tokenurl[3] == "device")
+            return true;
+    }
+
+    if (!Httpd_CanSerialize(path))
+        return false;
+
+    if (Httpd_StripSuffix(path) == "/logging/" + type + "/stats")
+        return true;
+
+    if (Httpd_StripSuffix(path) == "/logging/" + type + "/segments")
+        return true;
+
+    return false;
+}
+
+void Dumpfile_Pcap::Httpd_CreateStreamResponse(
+        Kis_Net_Httpd *httpd __attribute__((unused)),
+        Kis_Net_Httpd_Connection *connection __attribute__((unused)),
+        const char *path, const char *method, 
+        const char *upload_data __attribute__((unused)),
+        size_t *upload_data_size __attribute__((unused)), 
+        std::stringstream &stream) {
+
+    if (strcmp(method, "GET") != 0)
+        return;
+
+    if (index_log && Httpd_GetSuffix(path) == ExtractSuffix()) {
+        vector<string> tokenurl = StrTokenize(Httpd_StripSuffix(path), "/");
+
+        if (tokenurl.size() != 5 && tokenurl.size() != 7)
+            return;
+
+        uint64_t key = 0;
+        long int start = 0, end = 0;
+
+        std::stringstream ss(tokenurl[4]);
+        ss >> key;
+
+        if (ss.fail())
+            return;
+
+        if (tokenurl.size() == 7 &&
+                (sscanf(tokenurl[5].c_str(), "%ld", &start) != 1 ||
+                 sscanf(tokenurl[6].c_str(), "%ld", &end) != 1))
+            return;
+
+        ExtractDevice(key, start, end, stream);
+
+        return;
+    }
+
+    if (Httpd_StripSuffix(path) == "/logging/" + type + "/segments") {
+        SharedTrackerElement segvec(new TrackerElement(TrackerVector, segments_id));
+
+        std::unique_lock<std::mutex> lk(segment_mutex);
+
+        for (auto seg : segments) {
+            SharedTrackerElement segmap(new TrackerElement(TrackerMap, segment_id));
+            SharedTrackerElement e;
+
+            e.reset(new TrackerElement(TrackerUInt32, segment_number_id));
+            e->set((uint32_t) seg->number);
+            segmap->add_map(e);
+
+            e.reset(new TrackerElement(TrackerString, segment_name_id));
+            e->set(seg->fname);
+            segmap->add_map(e);
+
+            e.reset(new TrackerElement(TrackerUInt64, segment_start_id));
+            e->set((uint64_t) seg->start);
+            segmap->add_map(e);
+
+            e.reset(new TrackerElement(TrackerUInt64, segment_end_id));
+            e->set((uint64_t) seg->end);
+            segmap->add_map(e);
+
+            e.reset(new TrackerElement(TrackerUInt64, segment_bytes_id));
+            e->set((uint64_t) seg->bytes);
+            segmap->add_map(e);
+
+            e.reset(new TrackerElement(TrackerUInt64, segment_packets_id));
+            e->set((uint64_t) seg->packets);
+            segmap->add_map(e);
+
+            string state;
+            switch (seg->state) {
+                case segment_open:
+                    state = "open";
+                    break;
+                case segment_closed:
+                    state = "closed";
+                    break;
+                case segment_compressing:
+                    state = "compressing";
+                    break;
+                case segment_compressed:
+                    state = "compressed";
+                    break;
+            }
+
+            e.reset(new TrackerElement(TrackerString, segment_state_id));
+            e->set(state);
+            segmap->add_map(e);
+
+            segvec->add_vector(segmap);
+        }
+
+        lk.unlock();
+
+        Httpd_Serialize(path, stream, segvec);
+
+        return;
+    }
+
+    if (Httpd_StripSuffix(path) != "/logging/" + type + "/stats")
+        return;
+
+    SharedTrackerElement stats(new TrackerElement(TrackerMap, stats_id));
+
+    SharedTrackerElement e;
+
+    e.reset(new TrackerElement(TrackerUInt8, stats_async_id));
+    e->set((uint8_t) async_thread.joinable());
+    stats->add_map(e);
+
+    uint64_t tail = async_tail;
+    uint64_t head = async_head;
+
+    e.reset(new TrackerElement(TrackerUInt64, stats_queue_size_id));
+    e->set((uint64_t) async_ring.size());
+    stats->add_map(e);
+
+    e.reset(new TrackerElement(TrackerUInt64, stats_queue_depth_id));
+    e->set((uint64_t) (head - tail));
+    stats->add_map(e);
+
+    e.reset(new TrackerElement(TrackerUInt64, stats_max_depth_id));
+    e->set((uint64_t) stat_max_depth);
+    stats->add_map(e);
+
+    e.reset(new TrackerElement(TrackerUInt64, stats_queued_id));
+    e->set((uint64_t) stat_queued);
+    stats->add_map(e);
+
+    e.reset(new TrackerElement(TrackerUInt64, stats_written_id));
+    e->set((uint64_t) stat_written);
+    stats->add_map(e);
+
+    e.reset(new TrackerElement(TrackerUInt64, stats_dropped_id));
+    e->set((uint64_t) stat_dropped);
+    stats->add_map(e);
+
+    e.reset(new TrackerElement(TrackerUInt64, stats_blocked_id));
+    e->set((uint64_t) stat_blocked);
+    stats->add_map(e);
+
+    e.reset(new TrackerElement(TrackerUInt64, stats_fsyncs_id));
+    e->set((uint64_t) stat_fsyncs);
+    stats->add_map(e);
+
+    Httpd_Serialize(path, stream, stats);
+}
+
 void Dumpfile_Pcap::RegisterPPICallback(dumpfile_ppi_cb in_cb, void *in_aux) {
 	for (unsigned int x = 0; x < ppi_cb_vec.size(); x++) {
 		if (ppi_cb_vec[x].cb == in_cb && ppi_cb_vec[x].aux == in_aux)
@@ -212,6 +1469,10 @@ int Dumpfile_Pcap::chain_handler(kis_packet *in_pack) {
 	if (cbfilter != NULL) {
 		// If we have a filter, grab the data using that
 		chunk = (*cbfilter)(globalreg, in_pack, cbaux);
+	} else if (dumpformat == dump_pcapng) {
+		// Pcapng logs hold the frame as it was captured, the same data the
+		// pcapng streams and packet retention share
+		chunk = (kis_datachunk *) in_pack->fetch(pack_comp_linkframe);
 	} else if (chunk == NULL) {
 		// Look for the 802.11 frame
 		if ((chunk = 
@@ -234,7 +1495,7 @@ int Dumpfile_Pcap::chain_handler(kis_packet *in_pack) {
 	}
 
 	// Make sure we have the right DLT for simple matching conditions
-	if (cbfilter == NULL && chunk->dlt != dlt) {
+	if (cbfilter == NULL && dumpformat != dump_pcapng && chunk->dlt != dlt) {
 		return 0;
 	}
 
@@ -261,6 +1522,9 @@ int Dumpfile_Pcap::chain_handler(kis_packet *in_pack) {
 		}
 	}
 
+	if (dumpformat == dump_pcapng)
+		return chain_handler_pcapng(in_pack, chunk);
+
 	unsigned int dump_len = 0;
 	if (chunk != NULL)
 		dump_len += chunk->length;
@@ -526,14 +1790,79 @@ int Dumpfile_Pcap::chain_handler(kis_packet *in_pack) {
 	wh.ts.tv_usec = in_pack->ts.tv_usec;
 	wh.caplen = wh.len = dump_len;
 
-	// Dump it
-	pcap_dump((u_char *) dumper, &wh, dump_data);
+	// Note the device for the index
+	uint64_t device_key = 0;
 
-	delete[] dump_data;
+	kis_tracked_device_info *devinfo =
+		(kis_tracked_device_info *) in_pack->fetch(pack_comp_device);
+
+	if (devinfo != NULL && devinfo->devref != NULL)
+		device_key = devinfo->devref->get_key();
+
+	// Dump it
+	WriteRecord(&wh, dump_data, device_key);
 
-	dumped_frames++;
 	return 1;
 }
 
+int Dumpfile_Pcap::chain_handler_pcapng(kis_packet *in_pack, kis_datachunk *in_chunk) {
+    packetchain_comp_datasource *datasrc =
+        (packetchain_comp_datasource *) in_pack->fetch(pack_comp_datasrc);
+
+    // Without a source there's no interface to log the packet under
+    if (datasrc == NULL || datasrc->ref_source == NULL || in_chunk->length == 0)
+        return 0;
+
+    unsigned int interface;
+
+    {
+        std::lock_guard<std::mutex> lk(ng_interface_mutex);
+
+        auto key = make_pair(datasrc->ref_source->get_source_number(), in_chunk->dlt);
+        auto ii = ng_interface_map.find(key);
+
+        if (ii == ng_interface_map.end()) {
+            ng_interface ngi;
+            string ifname, ifdesc;
+
+            ngi.sourcenumber = key.first;
+            ngi.dlt = key.second;
+
+            Pcap_Stream_Ringbuf::pcapng_datasource_names(datasrc->ref_source,
+                    &ifname, &ifdesc);
+            Pcap_Stream_Ringbuf::pcapng_encode_idb(ifname, ifdesc, in_chunk->dlt,
+                    ngi.idb);
+
+            interface = ng_interfaces.size();
+            ng_interfaces.push_back(ngi);
+            ng_interface_map[key] = interface;
+        } else {
+            interface = ii->second;
+        }
+    }
+
+    // Encoded once for every pcapng writer of the packet, and only referenced
+    // until the writer has copied it into the log
+    shared_ptr<vector<uint8_t> > block =
+        Pcap_Stream_Ringbuf::pcapng_shared_epb(in_pack, in_chunk, pack_comp_epbcache);
+
+    struct pcap_pkthdr wh;
+    wh.ts.tv_sec = in_pack->ts.tv_sec;
+    wh.ts.tv_usec = in_pack->ts.tv_usec;
+    wh.caplen = wh.len = block->size();
+
+    uint64_t device_key = 0;
+
+    kis_tracked_device_info *devinfo =
+        (kis_tracked_device_info *) in_pack->fetch(pack_comp_device);
+
+    if (devinfo != NULL && devinfo->devref != NULL)
+        device_key = devinfo->devref->get_key();
+
+    WriteRecord(&wh, NULL, device_key, block, interface);
+
+    return 1;
+}
+
 #endif /* have_libpcap */
 
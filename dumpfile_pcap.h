@@ -24,6 +24,15 @@
 #ifdef HAVE_LIBPCAP
 #include <stdio.h>
 #include <string>
+#include <vector>
+#include <map>
+#include <list>
+#include <memory>
+#include <sstream>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 extern "C" {
 #ifndef HAVE_PCAPPCAP_H
@@ -38,12 +47,15 @@ extern "C" {
 #include "messagebus.h"
 #include "packetchain.h"
 #include "dumpfile.h"
+#include "kis_net_microhttpd.h"
+#include "kis_metrics.h"
+#include "kis_uring_file.h"
 
 // Hook for grabbing packets
 int dumpfilepcap_chain_hook(CHAINCALL_PARMS);
 
 enum dumpfile_pcap_format {
-	dump_unknown, dump_dlt, dump_ppi
+	dump_unknown, dump_dlt, dump_ppi, dump_pcapng
 };
 
 // Plugin/module PPI callback
@@ -64,7 +76,52 @@ typedef int (*dumpfile_ppi_cb)(DUMPFILE_PPI_PARMS);
 typedef kis_datachunk *(*dumpfile_pcap_filter_cb)(DUMPFILE_PCAP_FILTER_PARMS);
 
 // Pcap-based packet writer
-class Dumpfile_Pcap : public Dumpfile {
+//
+// When [type]async is enabled in the config, the packet chain only assembles
+// each record and hands it to a bounded queue; a dedicated writer thread owns
+// the pcap file, writes through a large stdio buffer, and optionally fsyncs on
+// a fixed cadence.  When the queue is full, records are either dropped and
+// counted or the packet chain waits for the writer, per [type]queuefull.
+//
+// With [type]uring, the writer thread writes through io_uring (see
+// kis_uring_file.h) instead of stdio, optionally with O_DIRECT ([type]direct);
+// where io_uring isn't available the stdio writer is used.
+//
+// Queue and writer counters are served at /logging/[type]/stats
+//
+// When [type]index is enabled, a sidecar index ([log].kidx) is written next to
+// the log, mapping each device and time bucket ([type]indexbucket seconds) to
+// the offsets of its packets in the log.  The packets of one device are served
+// from the log at /logging/[type]/device/[key].pcap, or limited to a time range
+// at /logging/[type]/device/[key]/[start]/[end].pcap, reading only the records
+// of that device.  The index covers the log up to the last closed bucket or
+// flush.
+//
+// Index file, all values little-endian:
+//  header:  "KISPCIDX" (8 bytes), version (u32), bucket seconds (u32)
+//  block:   device key (u64), bucket start (u64), count (u32), reserved (u32),
+//           then count record offsets into the log (u64 each)
+// A device may have more than one block for a bucket.
+//
+// With [type]rotatemb or [type]rotateseconds set, the log is written in
+// numbered segments ([log]-0001.pcapdump, ...), each with its own index, and a
+// new segment is started once the current one reaches the size or age limit.
+// With [type]compress=gzip, closed segments are compressed by a low-priority
+// background thread, and their index is removed; device extraction covers
+// segments which are not compressed.  Closed segments beyond [type]keepsegments
+// or [type]keepmb are deleted, oldest first.  Segments are listed at
+// /logging/[type]/segments
+//
+// With [type]format=pcapng, the log is pcapng instead of pcap, with an
+// interface per datasource and link type, and holds each link frame as it was
+// captured.  Packets are written from the same shared enhanced packet block 
+// the pcapng streams and packet retention use (see pcapng_epb_cache), so a 
+// packet is encoded once for all of them; the writer only holds a reference to
+// the block until it has been copied into the log's write buffer.  Every
+// segment numbers its interfaces the same way, and writes each interface block
+// ahead of the first packet which uses it; devices are extracted as pcapng,
+// from /logging/[type]/device/[key].pcapng.
+class Dumpfile_Pcap : public Dumpfile, public Kis_Net_Httpd_CPPStream_Handler {
 public:
 	Dumpfile_Pcap();
 	Dumpfile_Pcap(GlobalRegistry *in_globalreg);
@@ -90,6 +147,13 @@ public:
 		void *aux;
 	};
 
+    virtual bool Httpd_VerifyPath(const char *path, const char *method);
+
+    virtual void Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd,
+            Kis_Net_Httpd_Connection *connection,
+            const char *url, const char *method, const char *upload_data,
+            size_t *upload_data_size, std::stringstream &stream);
+
 protected:
 	Dumpfile_Pcap *parent;
 
@@ -99,6 +163,9 @@ protected:
 	pcap_t *dumpfile;
 	pcap_dumper_t *dumper;
 
+    // Stream of the open segment, either format; NULL while no segment is open
+    FILE *logfp;
+
 	int beaconlog, phylog, corruptlog;
 	dumpfile_pcap_format dumpformat;
 
@@ -112,7 +179,186 @@ protected:
 	void *cbaux;
 
     int pack_comp_80211, pack_comp_mangleframe, pack_comp_radiodata,
-        pack_comp_gps, pack_comp_checksum, pack_comp_decap, pack_comp_linkframe;
+        pack_comp_gps, pack_comp_checksum, pack_comp_decap, pack_comp_linkframe,
+        pack_comp_datasrc, pack_comp_epbcache;
+
+    // Hand an assembled record to the writer, or write it directly when not
+    // running asynchronously.  Takes ownership of in_data.  Pcapng records have 
+    // no data, and carry a shared enhanced packet block and its interface.
+    void WriteRecord(struct pcap_pkthdr *in_hdr, u_char *in_data,
+            uint64_t in_device_key, 
+            shared_ptr<vector<uint8_t> > in_block = shared_ptr<vector<uint8_t> >(),
+            unsigned int in_interface = 0);
+
+    // Write one record to the log and note it in the index; only called by
+    // whoever owns the file, the writer thread or the packet chain
+    void DumpRecord(struct pcap_pkthdr *in_hdr, u_char *in_data,
+            uint64_t in_device_key, const vector<uint8_t> *in_block,
+            unsigned int in_interface);
+
+    // Queue the link frame of a packet for a pcapng log
+    int chain_handler_pcapng(kis_packet *in_pack, kis_datachunk *in_chunk);
+
+    // Pcapng interfaces, numbered in the order they're first seen by datasource
+    // number and link type.  The list only grows, and is protected by
+    // ng_interface_mutex; the packet chain adds to it, and whoever owns the file
+    // writes the blocks of the open segment.
+    struct ng_interface {
+        unsigned int sourcenumber;
+        int dlt;
+        vector<uint8_t> idb;
+    };
+
+    std::mutex ng_interface_mutex;
+    vector<ng_interface> ng_interfaces;
+    std::map<pair<unsigned int, int>, unsigned int> ng_interface_map;
+
+    // Interfaces whose blocks are in the open segment; same ownership as
+    // DumpRecord
+    unsigned int ng_interfaces_written;
+
+    // Write the section header of a new pcapng segment
+    bool WriteNgHeader();
+
+    // Write the interface blocks of the open segment up to in_interface
+    void WriteNgInterfaces(unsigned int in_interface);
+
+    // Write the pending blocks of the index, after flushing the log they point
+    // into; same ownership as DumpRecord
+    void FlushIndex();
+
+    // Flush the log down to the file, and through io_uring if it's used; same
+    // ownership as DumpRecord
+    void FlushDumper();
+
+    // Offsets of every record of a device, from the index of a segment
+    bool ReadIndex(string in_index_fname, uint64_t in_key, time_t in_start,
+            time_t in_end, vector<uint64_t> *ret_offsets);
+
+    // Stream the records of a device from the log as a pcap file
+    void ExtractDevice(uint64_t in_key, time_t in_start, time_t in_end,
+            std::stringstream &stream);
+
+    // Copy the packet blocks at the offsets of one pcapng segment, writing the
+    // section and interface blocks first if they haven't been
+    void ExtractPcapng(FILE *in_log, const vector<uint64_t>& in_offsets,
+            time_t in_start, time_t in_end, std::stringstream &stream,
+            bool *wrote_header);
+
+    // Device extraction URLs end in the log format
+    string ExtractSuffix() {
+        return dumpformat == dump_pcapng ? "pcapng" : "pcap";
+    }
+
+    void StartAsyncWriter();
+    void StopAsyncWriter();
+    void AsyncWriterThread();
+
+    struct async_rec {
+        struct pcap_pkthdr hdr;
+        u_char *data;
+        uint64_t device_key;
+        shared_ptr<vector<uint8_t> > block;
+        unsigned int interface;
+    };
+
+    // Single-producer, single-consumer ring.  Logging chain handlers are always
+    // called under the packetchain lock, so there is only ever one producer at a
+    // time; the writer thread is the only consumer.  Head and tail are free-running
+    // counters, and the ring size is a power of two.
+    bool async_write;
+    bool async_block;
+    unsigned int async_fsync;
+
+    // Write the open segment through io_uring; the file belongs to the stream
+    // libpcap writes to, and goes away when the dumper is closed
+    bool async_uring, async_direct;
+    KisUringFile *uring_file;
+
+    vector<async_rec> async_ring;
+    uint64_t async_ring_mask;
+    std::atomic<uint64_t> async_head, async_tail;
+
+    std::thread async_thread;
+    std::mutex async_mutex;
+    std::condition_variable async_write_cv, async_space_cv;
+    std::atomic<bool> async_writer_sleeping, async_stop, async_flush;
+
+    // Counters served over REST
+    std::atomic<uint64_t> stat_queued, stat_written, stat_dropped, stat_blocked,
+        stat_fsyncs, stat_max_depth;
+
+    // The same, shared by logs of the same type, for /metrics
+    shared_ptr<kis_metric_counter> metric_written, metric_dropped, metric_blocked;
+
+    // Log segments, oldest first; the last is the one being written when the
+    // log is open.  The list and the state of each segment are protected by
+    // segment_mutex; the open segment's file is only touched by whoever owns
+    // the dumper.
+    enum log_segment_state {
+        segment_open, segment_closed, segment_compressing, segment_compressed
+    };
+
+    struct log_segment {
+        unsigned int number;
+        string fname;
+        string index_fname;
+        time_t start, end;
+        std::atomic<uint64_t> bytes, packets;
+        log_segment_state state;
+    };
+
+    // Start a new segment and open its log and index; same ownership as
+    // DumpRecord
+    bool OpenSegment();
+
+    // Close the open segment, hand it to the compressor, and apply the retention
+    // limits
+    void CloseSegment();
+
+    // Delete the oldest closed segments past the retention limits; must hold
+    // segment_mutex
+    void ExpireSegments();
+
+    void CompressorThread();
+    bool CompressSegment(shared_ptr<log_segment> in_segment, string in_fname);
+
+    bool rotate_log;
+    uint64_t rotate_bytes;
+    unsigned int rotate_sec;
+    bool compress_log;
+    unsigned int keep_segments;
+    uint64_t keep_bytes;
+
+    unsigned int segment_number;
+    shared_ptr<log_segment> open_segment;
+    uint64_t segment_offset;
+    time_t segment_retry;
+
+    std::mutex segment_mutex;
+    std::list<shared_ptr<log_segment> > segments;
+    std::list<shared_ptr<log_segment> > compress_queue;
+
+    std::thread compress_thread;
+    std::condition_variable compress_cv;
+    bool compress_stop;
+
+    int segments_id, segment_id, segment_number_id, segment_name_id,
+        segment_start_id, segment_end_id, segment_bytes_id, segment_packets_id,
+        segment_state_id;
+
+    // Sidecar device index
+    bool index_log;
+    FILE *index_file;
+    unsigned int index_bucket_sec;
+    time_t index_bucket;
+    std::map<uint64_t, vector<uint64_t> > index_pending;
+
+    int pack_comp_device;
+
+    int stats_id, stats_async_id, stats_queue_size_id, stats_queue_depth_id,
+        stats_max_depth_id, stats_queued_id, stats_written_id, stats_dropped_id,
+        stats_blocked_id, stats_fsyncs_id;
 };
 
 #endif /* pcap */
@@ -52,6 +52,9 @@
 #define kis_htobe64(x) (x)
 #define kis_htole64(x) kis_swap64((x))
 
+#define kis_letoh64(x) kis_swap64((x))
+#define kis_betoh64(x) (x)
+
 #else
 
 #define kis_hton16(x) kis_swap16((x))
@@ -82,6 +85,9 @@
 #define kis_htole64(x) (x)
 #define kis_htobe64(x) kis_swap64((x))
 
+#define kis_letoh64(x) (x)
+#define kis_betoh64(x) kis_swap64((x))
+
 #endif
 
 // Swap magic
@@ -18,11 +18,15 @@
 
 #include <string>
 #include <sstream>
+#include <algorithm>
 
 #include "util.h"
 
 #include "entrytracker.h"
 #include "messagebus.h"
+#include "configfile.h"
+#include "json_adapter.h"
+#include "msgpack_adapter.h"
 
 EntryTracker::EntryTracker(GlobalRegistry *in_globalreg) :
     Kis_Net_Httpd_CPPStream_Handler(in_globalreg) {
@@ -35,6 +39,42 @@ EntryTracker::EntryTracker(GlobalRegistry *in_globalreg) :
 	pthread_mutex_init(&entry_mutex, &mutexattr);
 
     next_field_num = 1;
+
+    shared_ptr<reserved_field> unknown(new reserved_field());
+    unknown->field_name = "field.unknown.not.registered";
+    encode_field_keys(unknown);
+    unknown_json_key = unknown->json_key;
+    unknown_msgpack_key = unknown->msgpack_key;
+
+    // Every field id comes from us, so this is early enough that no element
+    // with an id exists yet
+    if (globalreg->kismet_config->FetchOptBoolean("track_element_memory", false)) {
+        TrackerElementAccounting::Enable();
+        _MSG("Tracking tracked element memory use, see /system/tracked_memory.json",
+                MSGFLAG_INFO);
+    }
+
+    memory_enabled_id =
+        RegisterField("kismet.system.memory.accounting", TrackerUInt8,
+                "element memory accounting enabled");
+    memory_fields_id =
+        RegisterField("kismet.system.memory.fields", TrackerVector,
+                "element memory by field");
+    memory_field_id =
+        RegisterField("kismet.system.memory.field", TrackerMap,
+                "element memory for a field");
+    memory_name_id =
+        RegisterField("kismet.system.memory.field.name", TrackerString,
+                "field name");
+    memory_fid_id =
+        RegisterField("kismet.system.memory.field.id", TrackerInt32,
+                "field id");
+    memory_count_id =
+        RegisterField("kismet.system.memory.field.count", TrackerInt64,
+                "live elements of this field");
+    memory_bytes_id =
+        RegisterField("kismet.system.memory.field.bytes", TrackerInt64,
+                "estimated bytes used by live elements of this field");
 }
 
 EntryTracker::~EntryTracker() {
@@ -80,9 +120,15 @@ int EntryTracker::RegisterField(string in_name, TrackerType in_type, string in_d
 
     definition->field_description = in_desc;
 
+    encode_field_keys(definition);
+
     field_name_map[mod_name] = definition;
     field_id_map[definition->field_id] = definition;
 
+    if (field_id_vec.size() <= (size_t) definition->field_id)
+        field_id_vec.resize(definition->field_id + 1, NULL);
+    field_id_vec[definition->field_id] = definition.get();
+
     return definition->field_id;
 }
 
@@ -116,9 +162,15 @@ int EntryTracker::RegisterField(string in_name, shared_ptr<TrackerElement> in_bu
 
     definition->field_description = in_desc;
 
+    encode_field_keys(definition);
+
     field_name_map[mod_name] = definition;
     field_id_map[definition->field_id] = definition;
 
+    if (field_id_vec.size() <= (size_t) definition->field_id)
+        field_id_vec.resize(definition->field_id + 1, NULL);
+    field_id_vec[definition->field_id] = definition.get();
+
     // Set the builders ID now that we know it
     definition->builder->set_id(definition->field_id);
 
@@ -145,13 +197,52 @@ int EntryTracker::GetFieldId(string in_name) {
 string EntryTracker::GetFieldName(int in_id) {
     local_locker lock(&entry_mutex);
 
-    id_itr iter = field_id_map.find(in_id);
-
-    if (iter == field_id_map.end()) {
+    if (in_id < 0 || (size_t) in_id >= field_id_vec.size() ||
+            field_id_vec[in_id] == NULL) {
         return "field.unknown.not.registered";
     }
 
-    return iter->second->field_name;
+    return field_id_vec[in_id]->field_name;
+}
+
+const string& EntryTracker::GetFieldJsonKey(int in_id) {
+    local_locker lock(&entry_mutex);
+
+    if (in_id < 0 || (size_t) in_id >= field_id_vec.size() ||
+            field_id_vec[in_id] == NULL) {
+        return unknown_json_key;
+    }
+
+    return field_id_vec[in_id]->json_key;
+}
+
+const string& EntryTracker::GetFieldMsgpackKey(int in_id) {
+    local_locker lock(&entry_mutex);
+
+    if (in_id < 0 || (size_t) in_id >= field_id_vec.size() ||
+            field_id_vec[in_id] == NULL) {
+        return unknown_msgpack_key;
+    }
+
+    return field_id_vec[in_id]->msgpack_key;
+}
+
+void EntryTracker::encode_field_keys(shared_ptr<reserved_field> in_field) {
+    std::stringstream js;
+
+    {
+        JsonAdapter::json_writer writer(js);
+        writer.write_string(in_field->field_name);
+        writer.write(": ", 2);
+    }
+
+    in_field->json_key = js.str();
+
+    std::stringstream ms;
+    msgpack::packer<std::ostream> packer(&ms);
+    packer.pack(in_field->field_name);
+
+    in_field->msgpack_key = ms.str();
 }
 
 shared_ptr<TrackerElement> EntryTracker::RegisterAndGetField(string in_name, 
@@ -166,7 +257,7 @@ shared_ptr<TrackerElement> EntryTracker::RegisterAndGetField(string in_name,
 
     fn = RegisterField(in_name, in_type, in_desc);
 
-    return shared_ptr<TrackerElement>(new TrackerElement(in_type, fn));
+    return std::make_shared<TrackerElement>(in_type, fn);
 }
 
 shared_ptr<TrackerElement> EntryTracker::RegisterAndGetField(string in_name, 
@@ -199,8 +290,8 @@ shared_ptr<TrackerElement> EntryTracker::GetTrackedInstance(int in_id) {
     definition = iter->second;
 
     if (definition->builder == NULL)
-        return shared_ptr<TrackerElement>(new TrackerElement(definition->track_type, 
-                    definition->field_id));
+        return std::make_shared<TrackerElement>(definition->track_type, 
+                    definition->field_id);
     else
         return definition->builder->clone_type(definition->field_id);
 }
@@ -220,8 +311,8 @@ shared_ptr<TrackerElement> EntryTracker::GetTrackedInstance(string in_name) {
     shared_ptr<reserved_field> definition = iter->second;
 
     if (definition->builder == NULL)
-        return shared_ptr<TrackerElement>(new TrackerElement(definition->track_type, 
-                    definition->field_id));
+        return std::make_shared<TrackerElement>(definition->track_type, 
+                    definition->field_id);
     else
         return definition->builder->clone_type(definition->field_id);
 }
@@ -233,6 +324,12 @@ bool EntryTracker::Httpd_VerifyPath(const char *path, const char *method) {
     if (strcmp(path, "/system/tracked_fields.html") == 0)
         return true;
 
+    if (!Httpd_CanSerialize(path))
+        return false;
+
+    if (Httpd_StripSuffix(path) == "/system/tracked_memory")
+        return true;
+
     return false;
 }
 
@@ -282,6 +379,59 @@ void EntryTracker::Httpd_CreateStreamResponse(
         return;
     }
 
+    if (Httpd_StripSuffix(path) == "/system/tracked_memory") {
+        SharedTrackerElement wrapper(new TrackerElement(TrackerMap));
+
+        SharedTrackerElement enabled = GetTrackedInstance(memory_enabled_id);
+        enabled->set((uint8_t) TrackerElementAccounting::IsEnabled());
+        wrapper->add_map(enabled);
+
+        SharedTrackerElement fields = GetTrackedInstance(memory_fields_id);
+        wrapper->add_map(fields);
+
+        // Largest first
+        vector<pair<int64_t, shared_ptr<reserved_field> > > used;
+
+        for (auto i : field_id_map) {
+            if (TrackerElementAccounting::FetchCount(i.first) > 0)
+                used.push_back(make_pair(TrackerElementAccounting::FetchBytes(i.first),
+                            i.second));
+        }
+
+        std::stable_sort(used.begin(), used.end(), 
+                [](const pair<int64_t, shared_ptr<reserved_field> >& a,
+                    const pair<int64_t, shared_ptr<reserved_field> >& b) {
+                    return a.first > b.first;
+                });
+
+        for (auto u : used) {
+            SharedTrackerElement f = GetTrackedInstance(memory_field_id);
+            SharedTrackerElement e;
+
+            e = GetTrackedInstance(memory_name_id);
+            e->set(u.second->field_name);
+            f->add_map(e);
+
+            e = GetTrackedInstance(memory_fid_id);
+            e->set((int32_t) u.second->field_id);
+            f->add_map(e);
+
+            e = GetTrackedInstance(memory_count_id);
+            e->set((int64_t) TrackerElementAccounting::FetchCount(u.second->field_id));
+            f->add_map(e);
+
+            e = GetTrackedInstance(memory_bytes_id);
+            e->set(u.first);
+            f->add_map(e);
+
+            fields->add_vector(f);
+        }
+
+        Httpd_Serialize(path, stream, wrapper);
+
+        return;
+    }
+
 }
 
 void EntryTracker::RegisterSerializer(string in_name, 
@@ -325,7 +475,8 @@ bool EntryTracker::CanSerialize(string in_name) {
 
 bool EntryTracker::Serialize(string in_name, std::ostream &stream,
         SharedTrackerElement e,
-        TrackerElementSerializer::rename_map *name_map) {
+        TrackerElementSerializer::rename_map *name_map,
+        TrackerElementSerializer::serial_cache_map *cache_map) {
     local_locker lock(&entry_mutex);
 
     serial_itr i = serializer_map.find(in_name);
@@ -335,7 +486,7 @@ bool EntryTracker::Serialize(string in_name, std::ostream &stream,
         return false;
     }
 
-    i->second->serialize(e, stream, name_map);
+    i->second->serialize(e, stream, name_map, cache_map);
 
     return true;
 }
@@ -27,6 +27,7 @@
 #include <memory>
 #include <string>
 #include <map>
+#include <unordered_map>
 
 #include <pthread.h>
 
@@ -79,6 +80,14 @@ public:
     int GetFieldId(string in_name);
     string GetFieldName(int in_id);
 
+    // Field names already encoded as map keys for the serializers, so packing
+    // a map copies bytes instead of looking up and escaping each name again:
+    // the quoted, escaped JSON key followed by ': ', and the msgpack str
+    // header and bytes.  Fields are never removed, so the references stay
+    // valid.
+    const string& GetFieldJsonKey(int in_id);
+    const string& GetFieldMsgpackKey(int in_id);
+
     // Get a field instance
     // Return: NULL if unknown
     shared_ptr<TrackerElement> GetTrackedInstance(string in_name);
@@ -89,7 +98,8 @@ public:
     void RemoveSerializer(string type);
     bool CanSerialize(string type);
     bool Serialize(string type, std::ostream &stream, SharedTrackerElement elem,
-            TrackerElementSerializer::rename_map *name_map = NULL);
+            TrackerElementSerializer::rename_map *name_map = NULL,
+            TrackerElementSerializer::serial_cache_map *cache_map = NULL);
 
     // HTTP api
     virtual bool Httpd_VerifyPath(const char *path, const char *method);
@@ -119,17 +129,37 @@ protected:
 
         // Might as well track this for auto-doc
         string field_description;
+
+        // Encoded names for the serializers
+        string json_key;
+        string msgpack_key;
     };
 
-    map<string, shared_ptr<reserved_field> > field_name_map;
-    typedef map<string, shared_ptr<reserved_field> >::iterator name_itr;
+    // Fill in the encoded names of a new field
+    void encode_field_keys(shared_ptr<reserved_field> in_field);
+
+    // Encoded names for unregistered ids
+    string unknown_json_key, unknown_msgpack_key;
+
+    // Names are only ever looked up, never walked in order, and are looked up
+    // for every field path given in a request
+    unordered_map<string, shared_ptr<reserved_field> > field_name_map;
+    typedef unordered_map<string, shared_ptr<reserved_field> >::iterator name_itr;
 
     map<int, shared_ptr<reserved_field> > field_id_map;
     typedef map<int, shared_ptr<reserved_field> >::iterator id_itr;
 
+    // Ids are handed out in order, so the keys are looked up by id directly;
+    // serializers fetch one for every map entry they write
+    vector<reserved_field *> field_id_vec;
+
     map<string, shared_ptr<TrackerElementSerializer> > serializer_map;
     typedef map<string, shared_ptr<TrackerElementSerializer> >::iterator serial_itr;
 
+    // Fields for the element memory report
+    int memory_enabled_id, memory_fields_id, memory_field_id, memory_name_id,
+        memory_fid_id, memory_count_id, memory_bytes_id;
+
 };
 
 #endif
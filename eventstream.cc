@@ -0,0 +1,374 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <arpa/inet.h>
+#include <sstream>
+#include <msgpack.hpp>
+
+#include "eventstream.h"
+#include "entrytracker.h"
+#include "devicetracker.h"
+#include "alertracker.h"
+#include "messagebus_restclient.h"
+#include "json_adapter.h"
+#include "msgpack_adapter.h"
+
+// Send a heartbeat after this many seconds without any other events
+#define EVENTSTREAM_HEARTBEAT   10
+
+EventStream::EventStream(GlobalRegistry *in_globalreg) :
+    Kis_Net_Httpd_Ringbuf_Stream_Handler(in_globalreg),
+    MessageClient(in_globalreg, NULL) {
+
+    globalreg = in_globalreg;
+
+    pthread_mutexattr_t mutexattr;
+    pthread_mutexattr_init(&mutexattr);
+    pthread_mutexattr_settype(&mutexattr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&stream_mutex, &mutexattr);
+
+    devicetracker =
+        static_pointer_cast<Devicetracker>(globalreg->FetchGlobal("DEVICE_TRACKER"));
+    alertracker =
+        static_pointer_cast<Alertracker>(globalreg->FetchGlobal("ALERTTRACKER"));
+
+    // Records are built the same way as the message and alert endpoints
+    message_entry_id =
+        globalreg->entrytracker->GetFieldId("kismet.messagebus.message");
+    alert_entry_id =
+        globalreg->entrytracker->GetFieldId("kismet.alert.alert");
+
+    last_sweep = globalreg->timestamp.tv_sec;
+    device_sub = -1;
+    last_event = globalreg->timestamp.tv_sec;
+
+    globalreg->messagebus->RegisterClient(this, MSGFLAG_ALL);
+
+    alert_cb_id = -1;
+    if (alertracker != NULL)
+        alert_cb_id = alertracker->RegisterAlertCallback([this](kis_alert_info *info) {
+                HandleAlert(info);
+            });
+
+    timer_id =
+        globalreg->timetracker->RegisterTimer(SERVER_TIMESLICES_SEC, NULL, 1, this);
+}
+
+EventStream::~EventStream() {
+    globalreg->RemoveGlobal("EVENTSTREAM");
+
+    globalreg->timetracker->RemoveTimer(timer_id);
+    globalreg->messagebus->RemoveClient(this);
+
+    if (alertracker != NULL && alert_cb_id >= 0)
+        alertracker->RemoveAlertCallback(alert_cb_id);
+
+    if (devicetracker != NULL && device_sub >= 0)
+        devicetracker->FetchDeviceEvents()->unsubscribe(device_sub);
+
+    {
+        local_locker lock(&stream_mutex);
+
+        for (auto c : client_vec)
+            delete(c);
+
+        client_vec.clear();
+    }
+
+    pthread_mutex_destroy(&stream_mutex);
+}
+
+bool EventStream::Httpd_VerifyPath(const char *path, const char *method) {
+    if (strcmp(method, "GET") != 0)
+        return false;
+
+    if (strcmp(path, "/eventstream/events.ekjson") == 0 ||
+            strcmp(path, "/eventstream/events.msgpack") == 0)
+        return true;
+
+    return false;
+}
+
+int EventStream::Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd,
+        Kis_Net_Httpd_Connection *connection,
+        const char *url, const char *method, const char *upload_data,
+        size_t *upload_data_size) {
+
+    if (strcmp(method, "GET") != 0)
+        return MHD_YES;
+
+    bool binary;
+
+    if (strcmp(url, "/eventstream/events.ekjson") == 0)
+        binary = false;
+    else if (strcmp(url, "/eventstream/events.msgpack") == 0)
+        binary = true;
+    else
+        return MHD_YES;
+
+    Kis_Net_Httpd_Buffer_Stream_Aux *saux =
+        (Kis_Net_Httpd_Buffer_Stream_Aux *) connection->custom_extension;
+
+    eventstream_client *client = new eventstream_client();
+    client->rbhandler = saux->get_rbhandler();
+    client->dropped = 0;
+    client->binary = binary;
+
+    {
+        local_locker lock(&stream_mutex);
+        client_vec.push_back(client);
+    }
+
+    // Drop the client when the connection closes, before the buffer goes away
+    saux->set_aux(client,
+            [this](Kis_Net_Httpd_Buffer_Stream_Aux *aux) {
+                local_locker lock(&stream_mutex);
+
+                eventstream_client *c = (eventstream_client *) aux->aux;
+
+                for (unsigned int x = 0; x < client_vec.size(); x++) {
+                    if (client_vec[x] == c) {
+                        client_vec.erase(client_vec.begin() + x);
+                        break;
+                    }
+                }
+
+                delete(c);
+                aux->aux = NULL;
+            });
+
+    // Keep the stream open
+    return MHD_NO;
+}
+
+bool EventStream::HasClients() {
+    local_locker lock(&stream_mutex);
+    return client_vec.size() != 0;
+}
+
+bool EventStream::HasClients(bool in_binary) {
+    local_locker lock(&stream_mutex);
+
+    for (auto c : client_vec) {
+        if (c->binary == in_binary)
+            return true;
+    }
+
+    return false;
+}
+
+string EventStream::MakeEvent(string in_type, const string& in_json) {
+    std::stringstream ss;
+
+    ss << "{\"kismet.eventstream.type\": \"" << in_type << "\", " <<
+        "\"kismet.eventstream.time\": " << globalreg->timestamp.tv_sec << ", " <<
+        "\"kismet.eventstream.event\": " << in_json << "}\n";
+
+    return ss.str();
+}
+
+string EventStream::MakeBinaryEvent(string in_type, const string& in_msgpack) {
+    std::stringstream ss;
+    msgpack::packer<std::ostream> packer(&ss);
+
+    packer.pack_map(3);
+    packer.pack(string("kismet.eventstream.type"));
+    packer.pack(in_type);
+    packer.pack(string("kismet.eventstream.time"));
+    packer.pack((uint64_t) globalreg->timestamp.tv_sec);
+    packer.pack(string("kismet.eventstream.event"));
+
+    // The record is already a complete msgpack object
+    ss.write(in_msgpack.data(), in_msgpack.length());
+
+    string body = ss.str();
+
+    uint32_t len = htonl((uint32_t) body.length());
+
+    return string((const char *) &len, sizeof(uint32_t)) + body;
+}
+
+void EventStream::SendEvents(const vector<string>& in_events, bool in_binary) {
+    if (in_events.size() == 0)
+        return;
+
+    local_locker lock(&stream_mutex);
+
+    last_event = globalreg->timestamp.tv_sec;
+
+    for (auto c : client_vec) {
+        if (c->binary != in_binary)
+            continue;
+
+        for (auto e : in_events) {
+            // Whole events only; a client which has fallen behind loses events
+            // instead of getting a broken line or frame
+            if (c->rbhandler->PutWriteBufferData((void *) e.data(), e.length(),
+                        true) != e.length())
+                c->dropped++;
+        }
+    }
+}
+
+void EventStream::ProcessMessage(string in_msg, int in_flags) {
+    if (in_flags & MSGFLAG_LOCAL)
+        return;
+
+    if (!HasClients())
+        return;
+
+    shared_ptr<tracked_message> msg =
+        static_pointer_cast<tracked_message>(globalreg->entrytracker->GetTrackedInstance(message_entry_id));
+
+    if (msg == NULL)
+        return;
+
+    msg->set_from_message(in_msg, in_flags);
+
+    if (HasClients(false)) {
+        std::stringstream ss;
+        JsonAdapter::Pack(globalreg, ss, msg);
+        SendEvents(vector<string>{MakeEvent("MESSAGE", ss.str())}, false);
+    }
+
+    if (HasClients(true)) {
+        std::stringstream ss;
+        MsgpackAdapter::Pack(globalreg, ss, msg);
+        SendEvents(vector<string>{MakeBinaryEvent("MESSAGE", ss.str())}, true);
+    }
+}
+
+void EventStream::HandleAlert(kis_alert_info *in_alert) {
+    if (!HasClients())
+        return;
+
+    shared_ptr<tracked_alert> ta(new tracked_alert(globalreg, alert_entry_id));
+    ta->from_alert_info(in_alert);
+
+    if (HasClients(false)) {
+        std::stringstream ss;
+        JsonAdapter::Pack(globalreg, ss, ta);
+        SendEvents(vector<string>{MakeEvent("ALERT", ss.str())}, false);
+    }
+
+    if (HasClients(true)) {
+        std::stringstream ss;
+        MsgpackAdapter::Pack(globalreg, ss, ta);
+        SendEvents(vector<string>{MakeBinaryEvent("ALERT", ss.str())}, true);
+    }
+}
+
+int EventStream::timetracker_event(int eventid __attribute__((unused))) {
+    time_t now = globalreg->timestamp.tv_sec;
+
+    // Device changes are only collected for us while someone is listening
+    if (!HasClients()) {
+        if (devicetracker != NULL && device_sub >= 0) {
+            devicetracker->FetchDeviceEvents()->unsubscribe(device_sub);
+            device_sub = -1;
+        }
+
+        last_sweep = now;
+        return 1;
+    }
+
+    bool json_clients = HasClients(false);
+    bool binary_clients = HasClients(true);
+
+    vector<string> events, binary_events;
+
+    if (devicetracker != NULL) {
+        DeviceEventBus *bus = devicetracker->FetchDeviceEvents();
+        vector<shared_ptr<kis_tracked_device_base> > changed;
+
+        vector<kis_device_event> devevents;
+        bool sweep = false;
+
+        if (device_sub < 0) {
+            device_sub = bus->subscribe("eventstream");
+            sweep = true;
+        } else if (bus->fetch(device_sub, &devevents) != 0) {
+            sweep = true;
+        }
+
+        if (sweep) {
+            // The first pass for a new subscription, or one which fell behind
+            // the event ring, finds the changes from the modification list
+            // instead
+            SharedTrackerElement devs(new TrackerElement(TrackerVector));
+
+            devicetracker->FetchDevicesSince(last_sweep - 1, devs);
+
+            for (auto d : *(devs->get_vector()))
+                changed.push_back(static_pointer_cast<kis_tracked_device_base>(d));
+        } else {
+            // Each batch has one event per device, but a device can be in more
+            // than one batch since the last pass
+            kis_u64_flat_map<bool> seen;
+
+            for (auto& ev : devevents) {
+                if (ev.type == DEVICE_EVENT_EXPIRED || !seen.insert(ev.key, true).second)
+                    continue;
+
+                shared_ptr<kis_tracked_device_base> dev =
+                    devicetracker->FetchDevice(ev.key);
+
+                if (dev != NULL)
+                    changed.push_back(dev);
+            }
+        }
+
+        for (auto dev : changed) {
+            if (json_clients) {
+                shared_ptr<string> blob = devicetracker->SerializeDevice("json", dev);
+
+                if (blob != NULL)
+                    events.push_back(MakeEvent("DEVICE", *blob));
+            }
+
+            if (binary_clients) {
+                shared_ptr<string> blob = devicetracker->SerializeDevice("msgpack", dev);
+
+                if (blob != NULL)
+                    binary_events.push_back(MakeBinaryEvent("DEVICE", *blob));
+            }
+        }
+    }
+
+    last_sweep = now;
+
+    if (events.size() == 0 && binary_events.size() == 0 &&
+            now - last_event >= EVENTSTREAM_HEARTBEAT) {
+        std::stringstream ss;
+        ss << now;
+        events.push_back(MakeEvent("TIMESTAMP", ss.str()));
+
+        std::stringstream bs;
+        msgpack::packer<std::ostream> packer(&bs);
+        packer.pack((uint64_t) now);
+        binary_events.push_back(MakeBinaryEvent("TIMESTAMP", bs.str()));
+    }
+
+    SendEvents(events, false);
+    SendEvents(binary_events, true);
+
+    return 1;
+}
+
@@ -0,0 +1,136 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __EVENTSTREAM_H__
+#define __EVENTSTREAM_H__
+
+#include "config.h"
+
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+#include "globalregistry.h"
+#include "messagebus.h"
+#include "timetracker.h"
+#include "kis_flat_hash.h"
+#include "kis_net_microhttpd.h"
+
+class Devicetracker;
+class Alertracker;
+class kis_alert_info;
+
+// Long-lived push stream of server events.  Clients open
+//
+//   /eventstream/events.ekjson
+//   /eventstream/events.msgpack
+//
+// and receive one JSON object per line, or one msgpack map per frame (a 32 bit
+// big-endian length followed by the map), as things happen, instead of polling
+// the device, alert, and message endpoints:
+//
+//   DEVICE     complete device record for every device which changed, from
+//              the device change events, once per second
+//   ALERT      alert records as they are raised
+//   MESSAGE    messagebus messages as they are sent
+//   TIMESTAMP  heartbeat when no other events have been sent for a while, so
+//              idle connections are not dropped
+//
+// Device records are serialized once per change and format no matter how many
+// clients are connected.  Events are dropped for clients which can't keep up and have filled
+// their stream buffer.
+class EventStream : public Kis_Net_Httpd_Ringbuf_Stream_Handler, public MessageClient,
+    public LifetimeGlobal, public TimetrackerEvent {
+public:
+    static shared_ptr<EventStream> create_eventstream(GlobalRegistry *in_globalreg) {
+        shared_ptr<EventStream> mon(new EventStream(in_globalreg));
+        in_globalreg->RegisterLifetimeGlobal(mon);
+        in_globalreg->InsertGlobal("EVENTSTREAM", mon);
+        return mon;
+    }
+
+private:
+    EventStream(GlobalRegistry *in_globalreg);
+
+public:
+    virtual ~EventStream();
+
+    virtual bool Httpd_VerifyPath(const char *path, const char *method);
+
+    virtual int Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd,
+            Kis_Net_Httpd_Connection *connection,
+            const char *url, const char *method, const char *upload_data,
+            size_t *upload_data_size);
+
+    virtual int Httpd_PostComplete(Kis_Net_Httpd_Connection *con __attribute__((unused))) {
+        return 0;
+    }
+
+    // Messagebus client
+    virtual void ProcessMessage(string in_msg, int in_flags);
+
+    // Device sweep timer
+    virtual int timetracker_event(int eventid);
+
+protected:
+    class eventstream_client {
+    public:
+        shared_ptr<BufferHandlerGeneric> rbhandler;
+        uint64_t dropped;
+        bool binary;
+    };
+
+    // Wrap a serialized JSON record in an event line
+    string MakeEvent(string in_type, const string& in_json);
+
+    // Wrap a serialized msgpack record in a length-prefixed event frame
+    string MakeBinaryEvent(string in_type, const string& in_msgpack);
+
+    // Write events to every client of one format
+    void SendEvents(const vector<string>& in_events, bool in_binary);
+
+    bool HasClients();
+    bool HasClients(bool in_binary);
+
+    void HandleAlert(kis_alert_info *in_alert);
+
+    GlobalRegistry *globalreg;
+
+    // Protects the client list.  Never held while calling into the
+    // devicetracker or sending messages, since both can call back into us.
+    pthread_mutex_t stream_mutex;
+
+    vector<eventstream_client *> client_vec;
+
+    shared_ptr<Devicetracker> devicetracker;
+    shared_ptr<Alertracker> alertracker;
+
+    int alert_cb_id;
+    int message_entry_id, alert_entry_id;
+
+    // Subscription to the device change events while there are clients, and
+    // the time of the last pass, for the devices seen since then when the
+    // events can't say.  Only touched by the timer.
+    int device_sub;
+    time_t last_sweep;
+
+    time_t last_event;
+};
+
+#endif
+
@@ -0,0 +1,218 @@
+#!/usr/bin/env python3
+
+# Generate the synthetic 802.11 capture used by 'make benchmark'
+#
+# The capture is radiotap + 802.11 and deterministic for a given set of
+# arguments, so benchmark numbers from different builds are comparable.  It
+# mixes beacons from a set of access points, probe requests from a larger set
+# of clients, and data frames between them, roughly the shape of a busy
+# channel.
+#
+# With --beacons, every frame is a beacon carrying the full set of IE tags a
+# modern access point sends (rates, HT, RSN, and several vendor tags), for
+# measuring the management frame dissectors on their own.
+#
+# --profile picks one of the workloads of the performance suite
+# (extra/perf_suite.py) instead:
+#
+#   urban         a dense city block: thousands of access points over every
+#                 channel beaconing with full IE tags, some hidden, and a little
+#                 client traffic
+#   probestorm    tens of thousands of clients with randomized MAC addresses,
+#                 nearly all sending probe requests
+#   datachannel   one busy channel of a few access points and their clients,
+#                 nearly all QoS data in both directions
+#
+#   make_benchmark_pcap.py [--packets N] [--aps N] [--clients N]
+#       [--beacons | --profile P] output.pcap
+
+import argparse
+import random
+import struct
+
+LINKTYPE_IEEE802_11_RADIOTAP = 127
+
+CHANNELS = [ (1, 2412), (6, 2437), (11, 2462), (36, 5180), (149, 5745) ]
+
+def radiotap(freq, signal):
+    # flags, channel, dbm antenna signal
+    present = (1 << 1) | (1 << 3) | (1 << 5)
+    chanflags = 0x0080 if freq < 5000 else 0x0100
+    body = struct.pack("<BxHHb", 0, freq, chanflags, signal)
+    return struct.pack("<BBHI", 0, 0, 8 + len(body), present) + body
+
+def mac(prefix, n):
+    return bytes(prefix) + struct.pack(">I", n)[1:]
+
+def ie(tag, data):
+    return struct.pack("BB", tag, len(data)) + data
+
+RATES = ie(1, bytes([ 0x82, 0x84, 0x8b, 0x96, 0x0c, 0x12, 0x18, 0x24 ]))
+
+EXT_RATES = ie(50, bytes([ 0x30, 0x48, 0x60, 0x6c ]))
+
+# 20/40MHz, short GI, MCS 0-15
+HT_CAP = ie(45, struct.pack("<HB", 0x006e, 0x17) + bytes([ 0xff, 0xff ]) + bytes(21))
+
+# WPA2 PSK, CCMP
+RSN = ie(48, struct.pack("<H", 1) + b"\x00\x0f\xac\x04" + struct.pack("<H", 1) + \
+        b"\x00\x0f\xac\x04" + struct.pack("<H", 1) + b"\x00\x0f\xac\x02" + \
+        struct.pack("<H", 0))
+
+COUNTRY = ie(7, b"US\x20\x01\x0b\x1e")
+
+# WMM parameters, a WPS state, and an opaque vendor tag
+WMM = ie(221, b"\x00\x50\xf2\x02\x01\x01\x80\x00" + \
+        b"\x03\xa4\x00\x00\x27\xa4\x00\x00\x42\x43\x5e\x00\x62\x32\x2f\x00")
+WPS = ie(221, b"\x00\x50\xf2\x04" + struct.pack(">HHB", 0x104a, 1, 0x10) + \
+        struct.pack(">HHB", 0x1044, 1, 0x02))
+VENDOR = ie(221, b"\x00\x10\x18\x02\x00\x00\x1c\x00\x00")
+
+def beacon(bssid, seq, ssid, channel, ts, full = False):
+    hdr = struct.pack("<HH", 0x0080, 0) + b"\xff" * 6 + bssid + bssid + \
+            struct.pack("<H", (seq & 0xfff) << 4)
+    body = struct.pack("<QHH", ts, 100, 0x0411 if not full else 0x0431) + \
+            ie(0, ssid) + RATES + ie(3, bytes([ channel ]))
+    if full:
+        body += COUNTRY + EXT_RATES + HT_CAP + RSN + WMM + WPS + VENDOR
+    return hdr + body
+
+def probe(client, seq, ssid):
+    hdr = struct.pack("<HH", 0x0040, 0) + b"\xff" * 6 + client + b"\xff" * 6 + \
+            struct.pack("<H", (seq & 0xfff) << 4)
+    return hdr + ie(0, ssid) + RATES
+
+def data(bssid, client, dest, seq, length, qos = False, from_ds = False):
+    # To-DS data from the client (or from-DS to it), LLC/SNAP IPv4
+    fc = 0x0188 if qos else 0x0108
+    if from_ds:
+        fc ^= 0x0300
+        hdr = struct.pack("<HH", fc, 0) + client + bssid + dest
+    else:
+        hdr = struct.pack("<HH", fc, 0) + bssid + client + dest
+    hdr += struct.pack("<H", (seq & 0xfff) << 4)
+    if qos:
+        hdr += struct.pack("<H", seq & 0x7)
+    ip = struct.pack(">BBHHHBBH4s4s", 0x45, 0, 20 + length, seq & 0xffff, 0, 64, 17, 0,
+            bytes([ 10, 0, 0, 1 ]), bytes([ 10, 0, 0, 2 ]))
+    return hdr + b"\xaa\xaa\x03\x00\x00\x00\x08\x00" + ip + bytes(length)
+
+URBAN_CHANNELS = [ (c, 2407 + 5 * c) for c in range(1, 12) ] + \
+        [ (c, 5000 + 5 * c) for c in (36, 40, 44, 48, 149, 153, 157, 161) ]
+
+# (aps, clients, channels) of each workload, unless given on the command line
+PROFILES = {
+    "mixed": (500, 5000, CHANNELS),
+    "beacons": (500, 5000, CHANNELS),
+    "urban": (3000, 2000, URBAN_CHANNELS),
+    "probestorm": (50, 30000, CHANNELS),
+    "datachannel": (20, 300, [ (6, 2437) ]),
+}
+
+def main():
+    parser = argparse.ArgumentParser(description="Generate a Kismet benchmark pcap")
+    parser.add_argument("--packets", type=int, default=200000)
+    parser.add_argument("--aps", type=int)
+    parser.add_argument("--clients", type=int)
+    parser.add_argument("--seed", type=int, default=1234)
+    parser.add_argument("--beacons", action="store_true",
+            help="generate only beacons with a full set of IE tags")
+    parser.add_argument("--profile", choices=sorted(PROFILES.keys()), default="mixed",
+            help="workload to generate")
+    parser.add_argument("output")
+    args = parser.parse_args()
+
+    if args.beacons:
+        args.profile = "beacons"
+
+    def_aps, def_clients, channels = PROFILES[args.profile]
+
+    if args.aps is None:
+        args.aps = def_aps
+    if args.clients is None:
+        args.clients = def_clients
+
+    rng = random.Random(args.seed)
+
+    aps = []
+    for n in range(args.aps):
+        channel, freq = channels[n % len(channels)]
+        ssid = ("bench%d" % n).encode()
+        # Some of a city's networks don't say who they are
+        if args.profile == "urban" and n % 10 == 0:
+            ssid = b""
+        aps.append((mac([ 0x00, 0x11, 0x22 ], n), ssid, channel, freq))
+
+    clients = []
+    for n in range(args.clients):
+        if args.profile == "probestorm":
+            # Locally administered, random per client
+            addr = bytes([ 0x02 | (rng.randint(0, 63) << 2) ]) + \
+                    bytes(rng.randint(0, 255) for _ in range(5))
+        else:
+            addr = mac([ 0xf4, 0xf5, 0xd8 ], n)
+        clients.append((addr, rng.choice(aps)))
+
+    with open(args.output, "wb") as out:
+        out.write(struct.pack("<IHHiIII", 0xa1b2c3d4, 2, 4, 0, 0, 65535,
+            LINKTYPE_IEEE802_11_RADIOTAP))
+
+        usec = 1500000000 * 1000000
+
+        for seq in range(args.packets):
+            usec += rng.randint(50, 500)
+            kind = rng.random()
+
+            if args.profile == "beacons":
+                bssid, ssid, channel, freq = rng.choice(aps)
+                frame = beacon(bssid, seq, ssid, channel, usec, True)
+            elif args.profile == "urban":
+                if kind < 0.8:
+                    bssid, ssid, channel, freq = rng.choice(aps)
+                    frame = beacon(bssid, seq, ssid, channel, usec, True)
+                elif kind < 0.9:
+                    client, ap = rng.choice(clients)
+                    frame = probe(client, seq, b"")
+                    freq = ap[3]
+                else:
+                    client, ap = rng.choice(clients)
+                    frame = data(ap[0], client, b"\xff" * 6, seq, rng.randint(40, 1400))
+                    freq = ap[3]
+            elif args.profile == "probestorm":
+                if kind < 0.9:
+                    client, ap = rng.choice(clients)
+                    frame = probe(client, seq, ap[1] if rng.random() < 0.3 else b"")
+                    freq = ap[3]
+                else:
+                    bssid, ssid, channel, freq = rng.choice(aps)
+                    frame = beacon(bssid, seq, ssid, channel, usec)
+            elif args.profile == "datachannel":
+                if kind < 0.05:
+                    bssid, ssid, channel, freq = rng.choice(aps)
+                    frame = beacon(bssid, seq, ssid, channel, usec, True)
+                else:
+                    client, ap = rng.choice(clients)
+                    frame = data(ap[0], client, b"\x00\x1d\xaa\x00\x00\x01", seq,
+                            rng.randint(40, 1460), True, rng.random() < 0.6)
+                    freq = ap[3]
+            elif kind < 0.3:
+                bssid, ssid, channel, freq = rng.choice(aps)
+                frame = beacon(bssid, seq, ssid, channel, usec)
+            elif kind < 0.45:
+                client, ap = rng.choice(clients)
+                frame = probe(client, seq, ap[1] if rng.random() < 0.5 else b"")
+                freq = ap[3]
+            else:
+                client, ap = rng.choice(clients)
+                frame = data(ap[0], client, b"\xff" * 6, seq, rng.randint(40, 1400))
+                freq = ap[3]
+
+            pkt = radiotap(freq, -rng.randint(30, 90)) + frame
+
+            out.write(struct.pack("<IIII", usec // 1000000, usec % 1000000,
+                len(pkt), len(pkt)))
+            out.write(pkt)
+
+if __name__ == "__main__":
+    main()
+
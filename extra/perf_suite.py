@@ -0,0 +1,275 @@
+#!/usr/bin/env python3
+
+# Performance regression suite, run by 'make perf-suite'
+#
+# Each workload profile (see make_benchmark_pcap.py) is replayed through the
+# server in --benchmark mode while a poller does what the web UI does: fetch
+# the device summary and the devices changed since the last poll.  The report
+# has, for each profile, the packet rate, devices, peak RSS, time in each
+# packetchain stage, and p50/p99 latency of each REST endpoint, as JSON.
+#
+# With --baseline, the report is compared to an earlier one, and the suite
+# fails if any profile got slower or bigger by more than --tolerance percent.
+#
+#   perf_suite.py [--kismet ./kismet] [--config %E/kismet.conf] [--workdir DIR]
+#       [--profiles urban,probestorm,datachannel] [--packets N]
+#       [--output perf_report.json] [--baseline old_report.json]
+#       [--tolerance 10] [--user U --password P]
+
+import argparse
+import base64
+import json
+import os
+import socket
+import subprocess
+import sys
+import threading
+import time
+import urllib.parse
+import urllib.request
+
+PROFILES = [ "urban", "probestorm", "datachannel" ]
+
+# The fields the web UI device list asks for
+SUMMARY_FIELDS = [
+    "kismet.device.base.macaddr",
+    "kismet.device.base.name",
+    "kismet.device.base.type",
+    "kismet.device.base.phyname",
+    "kismet.device.base.channel",
+    "kismet.device.base.manuf",
+    "kismet.device.base.first_time",
+    "kismet.device.base.last_time",
+    "kismet.device.base.packets.total",
+    [ "kismet.device.base.signal/kismet.common.signal.last_signal", "signal" ],
+]
+
+def percentile(values, pct):
+    # Nearest rank
+    if len(values) == 0:
+        return 0
+    values = sorted(values)
+    rank = int(round(pct / 100.0 * len(values) + 0.5)) - 1
+    return values[max(0, min(rank, len(values) - 1))]
+
+class Poller(threading.Thread):
+    def __init__(self, port, interval, auth):
+        threading.Thread.__init__(self)
+        self.daemon = True
+        self.base = "http://127.0.0.1:%d" % port
+        self.interval = interval
+        self.auth = auth
+        self.stop = threading.Event()
+        self.latency = { "summary": [], "last_time": [] }
+        self.errors = 0
+
+    def post(self, path, cmd):
+        data = urllib.parse.urlencode({ "json": json.dumps(cmd) }).encode()
+        req = urllib.request.Request(self.base + path, data)
+        if self.auth is not None:
+            req.add_header("Authorization", "Basic " + self.auth)
+
+        start = time.monotonic()
+        with urllib.request.urlopen(req, timeout = 30) as r:
+            r.read()
+        return time.monotonic() - start
+
+    def timed(self, name, path, cmd):
+        try:
+            self.latency[name].append(self.post(path, cmd) * 1000.0)
+        except Exception:
+            self.errors += 1
+
+    def run(self):
+        while not self.stop.is_set():
+            try:
+                socket.create_connection(("127.0.0.1",
+                    int(self.base.rsplit(":", 1)[1])), 1).close()
+                break
+            except OSError:
+                time.sleep(0.05)
+
+        cmd = { "fields": SUMMARY_FIELDS }
+
+        while not self.stop.is_set():
+            self.timed("summary", "/devices/summary/devices.json", cmd)
+            self.timed("last_time", "/devices/last-time/-%d/devices.json" %
+                    max(1, int(self.interval + 1)), cmd)
+            self.stop.wait(self.interval)
+
+def free_port():
+    s = socket.socket()
+    s.bind(("127.0.0.1", 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+def run_profile(args, profile, workdir, auth):
+    pcap = os.path.join(workdir, "perf_%s_%d.pcap" % (profile, args.packets))
+
+    if not os.path.exists(pcap):
+        subprocess.check_call([ sys.executable,
+            os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                "make_benchmark_pcap.py"),
+            "--profile", profile, "--packets", str(args.packets), pcap ])
+
+    port = free_port()
+
+    # The first value of an option wins, so ours go before the real config
+    conf = os.path.join(workdir, "perf_%s.conf" % profile)
+    with open(conf, "w") as f:
+        f.write("httpd_port=%d\n" % port)
+        f.write("include=%s\n" % args.config)
+
+    report = os.path.join(workdir, "perf_%s.json" % profile)
+    if os.path.exists(report):
+        os.unlink(report)
+
+    cmd = [ args.kismet, "--no-plugins", "--no-ncurses-wrapper", "--silent",
+            "--benchmark", "--benchmark-report=" + report,
+            "-f", conf, "-c", pcap + ":type=pcapfile" ] + args.kismet_args
+
+    poller = Poller(port, args.interval, auth)
+
+    with open(os.path.join(workdir, "perf_%s.log" % profile), "w") as log:
+        proc = subprocess.Popen(cmd, stdout = log, stderr = subprocess.STDOUT)
+        poller.start()
+
+        try:
+            proc.wait(timeout = args.timeout)
+        except subprocess.TimeoutExpired:
+            proc.kill()
+            proc.wait()
+
+        poller.stop.set()
+        poller.join()
+
+    if not os.path.exists(report):
+        raise RuntimeError("Kismet did not write a benchmark report for %s, see "
+                "perf_%s.log" % (profile, profile))
+
+    with open(report) as f:
+        result = json.load(f)
+
+    result["rest"] = {}
+    for name, lat in poller.latency.items():
+        result["rest"][name] = {
+            "requests": len(lat),
+            "p50_ms": round(percentile(lat, 50), 3),
+            "p99_ms": round(percentile(lat, 99), 3),
+        }
+    result["rest_errors"] = poller.errors
+
+    return result
+
+def metrics(result):
+    # (name, value, higher is better)
+    yield ("packets_per_sec", result["packets_per_sec"], True)
+    yield ("peak_rss_kb", result["peak_rss_kb"], False)
+
+    for stage, st in sorted(result["stages"].items()):
+        yield ("stage.%s.usec_per_packet" % stage, st["usec_per_packet"], False)
+
+    for name, rest in sorted(result["rest"].items()):
+        if rest["requests"] == 0:
+            continue
+        yield ("rest.%s.p50_ms" % name, rest["p50_ms"], False)
+        yield ("rest.%s.p99_ms" % name, rest["p99_ms"], False)
+
+def compare(report, baseline, tolerance):
+    regressions = []
+
+    for profile, result in sorted(report["profiles"].items()):
+        base = baseline.get("profiles", {}).get(profile)
+
+        if base is None:
+            continue
+
+        base_metrics = dict((m[0], m[1]) for m in metrics(base))
+
+        for name, value, higher_better in metrics(result):
+            old = base_metrics.get(name)
+
+            if old is None or old == 0:
+                continue
+
+            change = (value - old) * 100.0 / old
+
+            if (higher_better and change < -tolerance) or \
+                    (not higher_better and change > tolerance):
+                regressions.append((profile, name, old, value, change))
+
+    return regressions
+
+def main():
+    parser = argparse.ArgumentParser(description="Kismet performance regression suite")
+    parser.add_argument("--kismet", default="./kismet")
+    parser.add_argument("--config", default="%E/kismet.conf",
+            help="config the suite's own options are put in front of")
+    parser.add_argument("--profiles", default=",".join(PROFILES))
+    parser.add_argument("--packets", type=int, default=200000)
+    parser.add_argument("--workdir", default=".",
+            help="where the captures are cached and the runs logged")
+    parser.add_argument("--interval", type=float, default=0.5,
+            help="seconds between polls of the REST endpoints")
+    parser.add_argument("--timeout", type=int, default=900,
+            help="seconds to allow each profile to run")
+    parser.add_argument("--output", default="perf_report.json")
+    parser.add_argument("--baseline")
+    parser.add_argument("--tolerance", type=float, default=10.0,
+            help="percent a metric may get worse before it is a regression")
+    parser.add_argument("--user")
+    parser.add_argument("--password")
+    parser.add_argument("kismet_args", nargs="*",
+            help="more kismet options, after --")
+    args = parser.parse_args()
+
+    auth = None
+    if args.user is not None:
+        auth = base64.b64encode(("%s:%s" % (args.user, args.password or "")).encode()).decode()
+
+    if not os.path.isdir(args.workdir):
+        os.makedirs(args.workdir)
+
+    report = { "kismet_perf_suite": 1, "packets": args.packets, "profiles": {} }
+
+    for profile in args.profiles.split(","):
+        profile = profile.strip()
+        if profile == "":
+            continue
+
+        print("Running %s..." % profile)
+        result = run_profile(args, profile, args.workdir, auth)
+        report["profiles"][profile] = result
+
+        print("  %.0f packets/sec, %d devices, %d KB peak RSS" %
+                (result["packets_per_sec"], result["devices"], result["peak_rss_kb"]))
+        for name, rest in sorted(result["rest"].items()):
+            print("  %-10s %5d requests, p50 %.1f ms, p99 %.1f ms" %
+                    (name, rest["requests"], rest["p50_ms"], rest["p99_ms"]))
+
+    with open(args.output, "w") as f:
+        json.dump(report, f, indent = 2, sort_keys = True)
+        f.write("\n")
+
+    print("Wrote %s" % args.output)
+
+    if args.baseline is None:
+        return 0
+
+    with open(args.baseline) as f:
+        baseline = json.load(f)
+
+    regressions = compare(report, baseline, args.tolerance)
+
+    for profile, name, old, value, change in regressions:
+        print("REGRESSION %s %s: %g -> %g (%+.1f%%)" % (profile, name, old, value, change))
+
+    if len(regressions) != 0:
+        return 1
+
+    print("No regressions against %s beyond %g%%" % (args.baseline, args.tolerance))
+    return 0
+
+if __name__ == "__main__":
+    sys.exit(main())
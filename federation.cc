@@ -0,0 +1,652 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <arpa/inet.h>
+#include <string.h>
+#include <sstream>
+
+#include "federation.h"
+#include "util.h"
+#include "base64.h"
+#include "configfile.h"
+#include "messagebus.h"
+#include "timetracker.h"
+#include "entrytracker.h"
+#include "msgpack_adapter.h"
+
+// Largest event frame we accept from a peer; a full device record is rarely
+// more than a few tens of kilobytes
+#define FEDERATION_MAX_FRAME    (512 * 1024)
+
+// Reconnect a stream which hasn't sent anything, not even the heartbeat the
+// event stream sends every 10 seconds, in this long
+#define FEDERATION_STALL_SECONDS    30
+
+void federation_peer::BufferAvailable(size_t in_amt __attribute__((unused))) {
+    federation->PeerData(this);
+}
+
+void federation_peer::BufferError(string in_err) {
+    federation->PeerError(this, in_err);
+}
+
+shared_ptr<Federation> Federation::create_federation(GlobalRegistry *in_globalreg) {
+    if (in_globalreg->kismet_config->FetchOptVec("federation_peer").size() == 0)
+        return NULL;
+
+    shared_ptr<Federation> mon(new Federation(in_globalreg));
+    in_globalreg->RegisterLifetimeGlobal(mon);
+    in_globalreg->InsertGlobal("FEDERATION", mon);
+    return mon;
+}
+
+Federation::Federation(GlobalRegistry *in_globalreg) :
+    Kis_Net_Httpd_CPPStream_Handler(in_globalreg) {
+
+    Httpd_RegisterRoute("GET", "/federation/peers");
+    Httpd_RegisterRoute("GET", "/federation/devices/all_devices");
+    Httpd_RegisterRoute("GET", "/federation/devices/last-time/:ts/devices");
+
+    globalreg = in_globalreg;
+
+    pollabletracker = globalreg->FetchGlobalAs<PollableTracker>("POLLABLETRACKER");
+
+    device_timeout =
+        globalreg->kismet_config->FetchOptUInt("federation_device_timeout", 0);
+
+    shared_ptr<federated_device> device_builder(new federated_device(globalreg, 0));
+    device_entry_id =
+        globalreg->entrytracker->RegisterField("kismet.federation.device",
+                device_builder, "device reported by federation peers");
+    device_list_id =
+        globalreg->entrytracker->RegisterField("kismet.federation.device_list",
+                TrackerVector, "devices reported by federation peers");
+
+    peer_list_id =
+        globalreg->entrytracker->RegisterField("kismet.federation.peer_list",
+                TrackerVector, "federation peers");
+    peer_entry_id =
+        globalreg->entrytracker->RegisterField("kismet.federation.peer",
+                TrackerMap, "federation peer");
+    peer_name_id =
+        globalreg->entrytracker->RegisterField("kismet.federation.peer.name",
+                TrackerString, "peer name");
+    peer_host_id =
+        globalreg->entrytracker->RegisterField("kismet.federation.peer.host",
+                TrackerString, "peer host");
+    peer_port_id =
+        globalreg->entrytracker->RegisterField("kismet.federation.peer.port",
+                TrackerUInt32, "peer port");
+    peer_uuid_id =
+        globalreg->entrytracker->RegisterField("kismet.federation.peer.uuid",
+                TrackerUuid, "uuid of the seen-by records of the peer");
+    peer_connected_id =
+        globalreg->entrytracker->RegisterField("kismet.federation.peer.connected",
+                TrackerUInt8, "event stream of the peer is open");
+    peer_connects_id =
+        globalreg->entrytracker->RegisterField("kismet.federation.peer.connects",
+                TrackerUInt64, "connections made to the peer");
+    peer_events_id =
+        globalreg->entrytracker->RegisterField("kismet.federation.peer.events",
+                TrackerUInt64, "events read from the peer");
+    peer_devices_id =
+        globalreg->entrytracker->RegisterField("kismet.federation.peer.devices",
+                TrackerUInt64, "device records merged from the peer");
+    peer_errors_id =
+        globalreg->entrytracker->RegisterField("kismet.federation.peer.errors",
+                TrackerUInt64, "connection and protocol errors");
+    peer_last_event_id =
+        globalreg->entrytracker->RegisterField("kismet.federation.peer.last_event",
+                TrackerUInt64, "time of the last event read from the peer");
+
+    vector<string> defs = globalreg->kismet_config->FetchOptVec("federation_peer");
+
+    {
+        std::lock_guard<std::recursive_mutex> lk(fed_mutex);
+
+        for (auto d : defs) {
+            shared_ptr<federation_peer> peer = ParsePeer(d, peers.size());
+
+            if (peer == NULL)
+                continue;
+
+            peers.push_back(peer);
+            ConnectPeer(peer);
+        }
+    }
+
+    timer_id =
+        globalreg->timetracker->RegisterTimer(SERVER_TIMESLICES_SEC * 5, NULL, 1,
+                [this](int) -> int {
+                    std::lock_guard<std::recursive_mutex> lk(fed_mutex);
+
+                    time_t now = globalreg->timestamp.tv_sec;
+
+                    for (auto p : peers) {
+                        if (p->state == 0 ||
+                                now - p->last_event > FEDERATION_STALL_SECONDS)
+                            ConnectPeer(p);
+                    }
+
+                    ExpireDevices(now);
+
+                    return 1;
+                });
+}
+
+Federation::~Federation() {
+    globalreg->RemoveGlobal("FEDERATION");
+
+    globalreg->timetracker->RemoveTimer(timer_id);
+
+    std::lock_guard<std::recursive_mutex> lk(fed_mutex);
+
+    for (auto p : peers)
+        DisconnectPeer(p);
+
+    peers.clear();
+    device_map.clear();
+}
+
+shared_ptr<federation_peer> Federation::ParsePeer(string in_def, unsigned int in_number) {
+    size_t cpos = in_def.find(':');
+
+    if (cpos == string::npos || cpos == 0) {
+        _MSG("Invalid federation_peer '" + in_def + "', expected "
+                "name:host=...,port=...", MSGFLAG_ERROR);
+        return NULL;
+    }
+
+    shared_ptr<federation_peer> peer(new federation_peer(this));
+
+    peer->number = in_number;
+    peer->name = StrStrip(in_def.substr(0, cpos));
+
+    vector<opt_pair> opts;
+    StringToOpts(in_def.substr(cpos + 1, in_def.length()), ",", &opts);
+
+    peer->host = FetchOpt("host", &opts);
+
+    if (peer->host.length() == 0) {
+        _MSG("Federation peer '" + peer->name + "' has no host= option", MSGFLAG_ERROR);
+        return NULL;
+    }
+
+    string port = FetchOpt("port", &opts);
+
+    if (port.length() != 0 && sscanf(port.c_str(), "%u", &peer->port) != 1) {
+        _MSG("Federation peer '" + peer->name + "' expected a number in port=",
+                MSGFLAG_ERROR);
+        return NULL;
+    }
+
+    string user = FetchOpt("user", &opts);
+
+    if (user.length() != 0)
+        peer->auth = Base64::encode(user + ":" + FetchOpt("password", &opts));
+
+    string uuidstr = FetchOpt("uuid", &opts);
+
+    if (uuidstr.length() != 0) {
+        peer->peer_uuid = uuid(uuidstr);
+
+        if (peer->peer_uuid.error) {
+            _MSG("Federation peer '" + peer->name + "' has an invalid uuid=",
+                    MSGFLAG_ERROR);
+            return NULL;
+        }
+    } else {
+        // The same name always makes the same uuid, so seen-by records keep
+        // their source across restarts
+        uint8_t node[6] = { 'K', 'F', 'E', 'D', 0, 0 };
+        uint32_t h = Adler32Checksum(peer->name.c_str(), peer->name.length());
+
+        node[4] = (h >> 8) & 0xFF;
+        node[5] = h & 0xFF;
+
+        peer->peer_uuid.GenerateStoredUUID(h, peer->name.length() & 0xFFFF,
+                0x4000, 0x8000, node);
+    }
+
+    return peer;
+}
+
+void Federation::DisconnectPeer(shared_ptr<federation_peer> in_peer) {
+    if (in_peer->tcpclient != NULL) {
+        pollabletracker->RemovePollable(in_peer->tcpclient);
+        in_peer->tcpclient.reset();
+    }
+
+    if (in_peer->tcphandler != NULL) {
+        delete in_peer->tcphandler;
+        in_peer->tcphandler = NULL;
+    }
+
+    in_peer->state = 0;
+}
+
+void Federation::ConnectPeer(shared_ptr<federation_peer> in_peer) {
+    DisconnectPeer(in_peer);
+
+    // Events only come in; the write side only carries the request
+    in_peer->tcphandler = new BufferHandler<RingbufV2>(FEDERATION_MAX_FRAME * 2, 1024);
+    in_peer->tcphandler->SetReadBufferInterface(in_peer.get());
+
+    in_peer->tcpclient.reset(new TcpClientV2(globalreg, in_peer->tcphandler));
+
+    in_peer->state = 1;
+    in_peer->connects++;
+
+    // Given a stall timeout from now, not from the last stream
+    in_peer->last_event = globalreg->timestamp.tv_sec;
+
+    // HTTP/1.0, so the stream comes back unchunked and ends when the connection
+    // closes
+    std::stringstream req;
+
+    req << "GET /eventstream/events.msgpack HTTP/1.0\r\n" <<
+        "Host: " << in_peer->host << ":" << in_peer->port << "\r\n";
+
+    if (in_peer->auth.length() != 0)
+        req << "Authorization: Basic " << in_peer->auth << "\r\n";
+
+    req << "\r\n";
+
+    string reqstr = req.str();
+
+    in_peer->tcphandler->PutWriteBufferData((void *) reqstr.data(), reqstr.length(), true);
+
+    if (in_peer->tcpclient->Connect(in_peer->host, in_peer->port) < 0) {
+        in_peer->errors++;
+        in_peer->state = 0;
+        return;
+    }
+
+    pollabletracker->RegisterPollable(static_pointer_cast<Pollable>(in_peer->tcpclient));
+}
+
+bool Federation::get_peer_connected(string in_name) {
+    std::lock_guard<std::recursive_mutex> lk(fed_mutex);
+
+    for (auto p : peers) {
+        if (p->name == in_name)
+            return p->state == 2;
+    }
+
+    return false;
+}
+
+void Federation::PeerError(federation_peer *in_peer, string in_err) {
+    std::lock_guard<std::recursive_mutex> lk(fed_mutex);
+
+    // The connection is torn down by the next reconnect, not from inside the
+    // client which is reporting the error
+    if (in_peer->state != 0) {
+        _MSG("Federation peer '" + in_peer->name + "' disconnected: " + in_err,
+                MSGFLAG_ERROR);
+        in_peer->errors++;
+    }
+
+    in_peer->state = 0;
+}
+
+void Federation::PeerData(federation_peer *in_peer) {
+    std::lock_guard<std::recursive_mutex> lk(fed_mutex);
+
+    BufferHandler<RingbufV2> *handler = in_peer->tcphandler;
+
+    if (handler == NULL)
+        return;
+
+    size_t used = handler->GetReadBufferUsed();
+
+    if (used == 0)
+        return;
+
+    // A stream we've given up on is drained until the reconnect replaces it
+    if (in_peer->state == 0) {
+        handler->ConsumeReadBufferData(used);
+        return;
+    }
+
+    char *buf;
+    size_t len = handler->PeekReadBufferData((void **) &buf, used);
+    size_t pos = 0;
+
+    string error;
+
+    if (in_peer->state == 1) {
+        const char *hdr_end = (const char *) memmem(buf, len, "\r\n\r\n", 4);
+
+        if (hdr_end == NULL) {
+            handler->PeekFreeReadBufferData(buf);
+
+            if (len > 16384) {
+                in_peer->state = 0;
+                in_peer->errors++;
+                _MSG("Federation peer '" + in_peer->name + "' sent an invalid "
+                        "response", MSGFLAG_ERROR);
+            }
+
+            return;
+        }
+
+        string status(buf, strcspn(buf, "\r\n"));
+
+        if (status.find(" 200 ") == string::npos) {
+            handler->PeekFreeReadBufferData(buf);
+
+            in_peer->state = 0;
+            in_peer->errors++;
+            _MSG("Federation peer '" + in_peer->name + "' refused the event "
+                    "stream: " + MungeToPrintable(status), MSGFLAG_ERROR);
+            return;
+        }
+
+        pos = (hdr_end - buf) + 4;
+        in_peer->state = 2;
+
+        _MSG("Federation connected to peer '" + in_peer->name + "' at " +
+                in_peer->host + ":" + UIntToString(in_peer->port), MSGFLAG_INFO);
+    }
+
+    while (in_peer->state == 2 && len - pos >= sizeof(uint32_t)) {
+        uint32_t frame_len;
+        memcpy(&frame_len, buf + pos, sizeof(uint32_t));
+        frame_len = ntohl(frame_len);
+
+        if (frame_len > FEDERATION_MAX_FRAME) {
+            in_peer->state = 0;
+            in_peer->errors++;
+            _MSG("Federation peer '" + in_peer->name + "' sent an oversized event, "
+                    "dropping the connection", MSGFLAG_ERROR);
+            break;
+        }
+
+        if (len - pos - sizeof(uint32_t) < frame_len)
+            break;
+
+        try {
+            SharedStructured event(new StructuredMsgpack(string(buf + pos +
+                            sizeof(uint32_t), frame_len)));
+            HandleEvent(in_peer, event);
+        } catch (const StructuredDataException& e) {
+            in_peer->errors++;
+        }
+
+        pos += sizeof(uint32_t) + frame_len;
+    }
+
+    handler->PeekFreeReadBufferData(buf);
+
+    if (in_peer->state == 0)
+        pos = len;
+
+    handler->ConsumeReadBufferData(pos);
+}
+
+void Federation::HandleEvent(federation_peer *in_peer, SharedStructured in_event) {
+    in_peer->events++;
+    in_peer->last_event = globalreg->timestamp.tv_sec;
+
+    StructuredData::structured_str_map fields = in_event->getStructuredStrMap();
+
+    auto ti = fields.find("kismet.eventstream.type");
+    auto ei = fields.find("kismet.eventstream.event");
+
+    if (ti == fields.end() || ei == fields.end())
+        return;
+
+    if (ti->second->getString() == "DEVICE")
+        MergeDevice(in_peer, ei->second);
+}
+
+void Federation::MergeDevice(federation_peer *in_peer, SharedStructured in_device) {
+    StructuredData::structured_str_map fields = in_device->getStructuredStrMap();
+
+    auto get_string = [&fields](const char *in_key) -> string {
+        auto i = fields.find(in_key);
+
+        if (i == fields.end() || !i->second->isString())
+            return "";
+
+        return i->second->getString();
+    };
+
+    auto get_number = [&fields](const char *in_key) -> double {
+        auto i = fields.find(in_key);
+
+        if (i == fields.end() || !i->second->isNumber())
+            return 0;
+
+        return i->second->getNumber();
+    };
+
+    string macstr = get_string("kismet.device.base.macaddr");
+    string phyname = get_string("kismet.device.base.phyname");
+
+    mac_addr mac(macstr);
+
+    if (mac.error || phyname.length() == 0)
+        return;
+
+    string key = phyname + "/" + mac.Mac2String();
+
+    shared_ptr<federated_device> dev;
+
+    auto di = device_map.find(key);
+
+    if (di == device_map.end()) {
+        dev.reset(new federated_device(globalreg, device_entry_id));
+        dev->set_key(key);
+        dev->set_macaddr(mac);
+        dev->set_phyname(phyname);
+        device_map[key] = dev;
+    } else {
+        dev = di->second;
+    }
+
+    in_peer->devices++;
+
+    time_t first_time = (time_t) get_number("kismet.device.base.first_time");
+    time_t last_time = (time_t) get_number("kismet.device.base.last_time");
+
+    string name = get_string("kismet.device.base.name");
+    if (name.length() != 0)
+        dev->set_devicename(name);
+
+    string type = get_string("kismet.device.base.type");
+    if (type.length() != 0)
+        dev->set_type_string(type);
+
+    if (first_time != 0 && (dev->get_first_time() == 0 || first_time < dev->get_first_time()))
+        dev->set_first_time(first_time);
+
+    if (last_time > dev->get_last_time())
+        dev->set_last_time(last_time);
+
+    dev->set_update_time(globalreg->timestamp.tv_sec);
+
+    // The strongest signal, or the latest signal of the peer which had it
+    auto si = fields.find("kismet.device.base.signal");
+
+    if (si != fields.end() && si->second->isDictionary()) {
+        int32_t signal = (int32_t) si->second->getKeyAsNumber("kismet.common.signal.last_signal_dbm", 0);
+
+        if (signal != 0 && (dev->get_best_signal() == 0 ||
+                    dev->get_best_peer() == in_peer->peer_uuid ||
+                    signal > dev->get_best_signal())) {
+            dev->set_best_signal(signal);
+            dev->set_best_peer(in_peer->peer_uuid);
+        }
+    }
+
+    // What this peer knows of the device
+    SharedTrackerElement seenby_map = dev->get_seenby_map();
+    shared_ptr<kis_tracked_seenby_data> seenby;
+
+    auto sbi = seenby_map->find(in_peer->number);
+
+    if (sbi == seenby_map->end()) {
+        seenby.reset(new kis_tracked_seenby_data(globalreg, dev->get_seenby_val_id()));
+        seenby->set_src_uuid(in_peer->peer_uuid);
+        seenby_map->add_intmap(in_peer->number, seenby);
+    } else {
+        seenby = static_pointer_cast<kis_tracked_seenby_data>(sbi->second);
+    }
+
+    seenby->set_first_time(first_time);
+    seenby->set_last_time(last_time);
+    seenby->set_num_packets((uint64_t) get_number("kismet.device.base.packets.total"));
+}
+
+void Federation::ExpireDevices(time_t in_now) {
+    if (device_timeout == 0)
+        return;
+
+    for (auto i = device_map.begin(); i != device_map.end(); ) {
+        if (in_now - i->second->get_update_time() > (time_t) device_timeout)
+            i = device_map.erase(i);
+        else
+            ++i;
+    }
+}
+
+bool Federation::Httpd_VerifyPath(const char *path, const char *method) {
+    if (strcmp(method, "GET") != 0)
+        return false;
+
+    string stripped = Httpd_StripSuffix(path);
+
+    if (stripped == "/federation/peers" || stripped == "/federation/devices/all_devices")
+        return Httpd_CanSerialize(path);
+
+    vector<string> tokenurl = StrTokenize(path, "/");
+
+    if (tokenurl.size() != 6 || tokenurl[1] != "federation" ||
+            tokenurl[2] != "devices" || tokenurl[3] != "last-time" ||
+            Httpd_StripSuffix(tokenurl[5]) != "devices")
+        return false;
+
+    long lastts;
+    if (sscanf(tokenurl[4].c_str(), "%ld", &lastts) != 1)
+        return false;
+
+    return Httpd_CanSerialize(tokenurl[5]);
+}
+
+void Federation::Httpd_CreateStreamResponse(
+        Kis_Net_Httpd *httpd __attribute__((unused)),
+        Kis_Net_Httpd_Connection *connection __attribute__((unused)),
+        const char *path, const char *method,
+        const char *upload_data __attribute__((unused)),
+        size_t *upload_data_size __attribute__((unused)),
+        std::stringstream &stream) {
+
+    if (strcmp(method, "GET") != 0)
+        return;
+
+    string stripped = Httpd_StripSuffix(path);
+
+    std::lock_guard<std::recursive_mutex> lk(fed_mutex);
+
+    if (stripped == "/federation/peers") {
+        SharedTrackerElement peervec(new TrackerElement(TrackerVector, peer_list_id));
+
+        for (auto p : peers) {
+            SharedTrackerElement pm(new TrackerElement(TrackerMap, peer_entry_id));
+            SharedTrackerElement e;
+
+            e.reset(new TrackerElement(TrackerString, peer_name_id));
+            e->set(p->name);
+            pm->add_map(e);
+
+            e.reset(new TrackerElement(TrackerString, peer_host_id));
+            e->set(p->host);
+            pm->add_map(e);
+
+            e.reset(new TrackerElement(TrackerUInt32, peer_port_id));
+            e->set((uint32_t) p->port);
+            pm->add_map(e);
+
+            e.reset(new TrackerElement(TrackerUuid, peer_uuid_id));
+            e->set(p->peer_uuid);
+            pm->add_map(e);
+
+            e.reset(new TrackerElement(TrackerUInt8, peer_connected_id));
+            e->set((uint8_t) (p->state == 2));
+            pm->add_map(e);
+
+            e.reset(new TrackerElement(TrackerUInt64, peer_connects_id));
+            e->set((uint64_t) p->connects);
+            pm->add_map(e);
+
+            e.reset(new TrackerElement(TrackerUInt64, peer_events_id));
+            e->set((uint64_t) p->events);
+            pm->add_map(e);
+
+            e.reset(new TrackerElement(TrackerUInt64, peer_devices_id));
+            e->set((uint64_t) p->devices);
+            pm->add_map(e);
+
+            e.reset(new TrackerElement(TrackerUInt64, peer_errors_id));
+            e->set((uint64_t) p->errors);
+            pm->add_map(e);
+
+            e.reset(new TrackerElement(TrackerUInt64, peer_last_event_id));
+            e->set((uint64_t) p->last_event);
+            pm->add_map(e);
+
+            peervec->add_vector(pm);
+        }
+
+        Httpd_Serialize(path, stream, peervec);
+        return;
+    }
+
+    time_t since = 0;
+
+    if (stripped != "/federation/devices/all_devices") {
+        vector<string> tokenurl = StrTokenize(path, "/");
+
+        if (tokenurl.size() != 6)
+            return;
+
+        long lastts;
+        if (sscanf(tokenurl[4].c_str(), "%ld", &lastts) != 1)
+            return;
+
+        // If it's negative, subtract from the current ts
+        if (lastts < 0)
+            lastts = globalreg->timestamp.tv_sec + lastts;
+
+        since = lastts;
+    }
+
+    SharedTrackerElement devvec(new TrackerElement(TrackerVector, device_list_id));
+
+    for (auto d : device_map) {
+        if (since == 0 || d.second->get_update_time() > since)
+            devvec->add_vector(d.second);
+    }
+
+    Httpd_Serialize(path, stream, devvec);
+}
+
@@ -0,0 +1,253 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __FEDERATION_H__
+#define __FEDERATION_H__
+
+#include "config.h"
+
+#include <stdint.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "globalregistry.h"
+#include "trackedelement.h"
+#include "buffer_handler.h"
+#include "ringbuf2.h"
+#include "tcpclient2.h"
+#include "pollabletracker.h"
+#include "devicetracker_component.h"
+#include "structured.h"
+#include "kis_net_microhttpd.h"
+
+class Federation;
+
+// A device as reported by the servers of a federation.  Its identity is the phy
+// and mac address, since device keys are only meaningful to the server which
+// made them; the seen-by map holds one record for each peer which reports it,
+// keyed by the number of the peer.
+class federated_device : public tracker_component {
+public:
+    federated_device(GlobalRegistry *in_globalreg, int in_id) :
+        tracker_component(in_globalreg, in_id) {
+        register_fields();
+        reserve_fields(NULL);
+    }
+
+    federated_device(GlobalRegistry *in_globalreg, int in_id, SharedTrackerElement e) :
+        tracker_component(in_globalreg, in_id) {
+        register_fields();
+        reserve_fields(e);
+    }
+
+    virtual SharedTrackerElement clone_type() {
+        return SharedTrackerElement(new federated_device(globalreg, get_id()));
+    }
+
+    __Proxy(key, string, string, string, key);
+    __Proxy(macaddr, mac_addr, mac_addr, mac_addr, macaddr);
+    __Proxy(phyname, string, string, string, phyname);
+    __Proxy(devicename, string, string, string, devicename);
+    __Proxy(type_string, string, string, string, type_string);
+    __Proxy(first_time, uint64_t, time_t, time_t, first_time);
+    __Proxy(last_time, uint64_t, time_t, time_t, last_time);
+    __Proxy(update_time, uint64_t, time_t, time_t, update_time);
+    __Proxy(best_signal, int32_t, int32_t, int32_t, best_signal);
+    __Proxy(best_peer, uuid, uuid, uuid, best_peer);
+
+    SharedTrackerElement get_seenby_map() { return seenby_map; }
+
+    int get_seenby_val_id() { return seenby_val_id; }
+
+protected:
+    virtual void register_fields() {
+        tracker_component::register_fields();
+
+        RegisterField("kismet.federation.device.key", TrackerString,
+                "phy and mac address of the device", &key);
+        RegisterField("kismet.federation.device.macaddr", TrackerMac,
+                "mac address", &macaddr);
+        RegisterField("kismet.federation.device.phyname", TrackerString,
+                "phy name", &phyname);
+        RegisterField("kismet.federation.device.name", TrackerString,
+                "printable device name", &devicename);
+        RegisterField("kismet.federation.device.type", TrackerString,
+                "printable device type", &type_string);
+        RegisterField("kismet.federation.device.first_time", TrackerUInt64,
+                "first time seen by any peer", &first_time);
+        RegisterField("kismet.federation.device.last_time", TrackerUInt64,
+                "last time seen by any peer", &last_time);
+        RegisterField("kismet.federation.device.update_time", TrackerUInt64,
+                "last time a peer reported a change", &update_time);
+        RegisterField("kismet.federation.device.best_signal", TrackerInt32,
+                "strongest last signal reported by a peer", &best_signal);
+        RegisterField("kismet.federation.device.best_peer", TrackerUuid,
+                "peer reporting the strongest signal", &best_peer);
+        RegisterField("kismet.federation.device.seenby", TrackerIntMap,
+                "peers which have seen this device", &seenby_map);
+
+        shared_ptr<kis_tracked_seenby_data> seenby_builder(new kis_tracked_seenby_data(globalreg, 0));
+        seenby_val_id =
+            RegisterComplexField("kismet.federation.device.seenby.data",
+                    seenby_builder, "seen-by data of one peer");
+    }
+
+    SharedTrackerElement key;
+    SharedTrackerElement macaddr;
+    SharedTrackerElement phyname;
+    SharedTrackerElement devicename;
+    SharedTrackerElement type_string;
+    SharedTrackerElement first_time;
+    SharedTrackerElement last_time;
+    SharedTrackerElement update_time;
+    SharedTrackerElement best_signal;
+    SharedTrackerElement best_peer;
+    SharedTrackerElement seenby_map;
+
+    int seenby_val_id;
+};
+
+// One server of the federation, read through its binary event stream
+class federation_peer : public BufferInterface {
+public:
+    federation_peer(Federation *in_federation) :
+        federation(in_federation) {
+        number = 0;
+        port = 2501;
+        tcphandler = NULL;
+        state = 0;
+        connects = events = devices = errors = 0;
+        last_event = 0;
+    }
+
+    virtual ~federation_peer() { }
+
+    virtual void BufferAvailable(size_t in_amt);
+    virtual void BufferError(string in_err);
+
+    Federation *federation;
+
+    unsigned int number;
+    string name;
+    string host;
+    unsigned int port;
+    uuid peer_uuid;
+
+    // Basic authorization, already encoded
+    string auth;
+
+    shared_ptr<TcpClientV2> tcpclient;
+    BufferHandler<RingbufV2> *tcphandler;
+
+    // 0 disconnected, 1 waiting for the response headers, 2 reading events
+    int state;
+
+    uint64_t connects, events, devices, errors;
+    time_t last_event;
+};
+
+// Federation of several servers into one device table
+//
+// Each 'federation_peer=name:host=...,port=...' names another kismet_server
+// (optionally with 'user=' and 'password=' for its login, and 'uuid=' to fix
+// the uuid its seen-by records carry, which is otherwise derived from the
+// name).  The peer's binary event stream (/eventstream/events.msgpack) is held
+// open, and every device it reports as changed is merged into a table keyed by
+// phy and mac address, with one kis_tracked_seenby_data record per peer:  the
+// first and last times and packet count the peer has for the device.
+//
+// Only changes cross the network, so a site-wide view stays current without
+// re-downloading the device lists of every peer.  A device idle on every peer
+// since the federation connected only appears once it changes again.  Devices
+// no peer has reported for 'federation_device_timeout' seconds are dropped; 0
+// keeps them for the life of the server.
+//
+// The merged table and the state of the peers are served at
+//  /federation/peers
+//  /federation/devices/all_devices
+//  /federation/devices/last-time/[ts]/devices
+// where the last-time view carries the devices updated since the timestamp
+// (negative for seconds before now), for incremental polling of the merged table.
+class Federation : public LifetimeGlobal, public Kis_Net_Httpd_CPPStream_Handler {
+public:
+    // Returns NULL unless peers are configured
+    static shared_ptr<Federation> create_federation(GlobalRegistry *in_globalreg);
+
+private:
+    Federation(GlobalRegistry *in_globalreg);
+
+public:
+    virtual ~Federation();
+
+    virtual bool Httpd_VerifyPath(const char *path, const char *method);
+
+    virtual void Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd,
+            Kis_Net_Httpd_Connection *connection,
+            const char *path, const char *method, const char *upload_data,
+            size_t *upload_data_size, std::stringstream &stream);
+
+    // Is the event stream of a peer open?  False for names which aren't peers
+    bool get_peer_connected(string in_name);
+
+    // Stream data and errors from a peer connection
+    void PeerData(federation_peer *in_peer);
+    void PeerError(federation_peer *in_peer, string in_err);
+
+protected:
+    GlobalRegistry *globalreg;
+
+    shared_ptr<PollableTracker> pollabletracker;
+
+    // Parse a federation_peer line
+    shared_ptr<federation_peer> ParsePeer(string in_def, unsigned int in_number);
+
+    // (Re)open the event stream of a peer; must hold fed_mutex
+    void ConnectPeer(shared_ptr<federation_peer> in_peer);
+    void DisconnectPeer(shared_ptr<federation_peer> in_peer);
+
+    // Handle one event from a peer; must hold fed_mutex
+    void HandleEvent(federation_peer *in_peer, SharedStructured in_event);
+
+    // Merge a device record from a peer; must hold fed_mutex
+    void MergeDevice(federation_peer *in_peer, SharedStructured in_device);
+
+    // Drop devices past the timeout; must hold fed_mutex
+    void ExpireDevices(time_t in_now);
+
+    std::recursive_mutex fed_mutex;
+
+    vector<shared_ptr<federation_peer> > peers;
+
+    std::map<string, shared_ptr<federated_device> > device_map;
+
+    unsigned int device_timeout;
+
+    int timer_id;
+
+    int device_entry_id, device_list_id;
+
+    int peer_entry_id, peer_list_id, peer_name_id, peer_host_id, peer_port_id,
+        peer_uuid_id, peer_connected_id, peer_connects_id, peer_events_id,
+        peer_devices_id, peer_errors_id, peer_last_event_id;
+};
+
+#endif
+
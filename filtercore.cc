@@ -42,6 +42,41 @@ FilterCore::FilterCore(GlobalRegistry *in_globalreg) {
 #endif
 }
 
+void FilterCoreMacSet::insert(const mac_addr& in_mac) {
+	if (in_mac.longmask == (uint64_t) -1) {
+		exact_set.insert(in_mac.longmac);
+		return;
+	}
+
+	uint64_t masked = in_mac.longmac & in_mac.longmask;
+
+	vector<mask_group>::iterator g;
+	for (g = mask_table.begin(); g != mask_table.end(); ++g) {
+		if (g->mask == in_mac.longmask)
+			break;
+	}
+
+	if (g == mask_table.end()) {
+		mask_group group;
+		group.mask = in_mac.longmask;
+
+		// Masks are normally contiguous from the top, so a larger mask is a
+		// tighter one
+		for (g = mask_table.begin(); g != mask_table.end(); ++g) {
+			if (g->mask < group.mask)
+				break;
+		}
+
+		g = mask_table.insert(g, group);
+	}
+
+	vector<uint64_t>::iterator m = 
+		std::lower_bound(g->macs.begin(), g->macs.end(), masked);
+
+	if (m == g->macs.end() || *m != masked)
+		g->macs.insert(m, masked);
+}
+
 #define _filter_stacker_none	0
 #define _filter_stacker_mac		1
 #define _filter_stacker_pcre	2
@@ -505,7 +540,7 @@ int FilterCore::AddFilterLine(string filter_str) {
 		macvec = local_maps[_filter_type_bssid];
 		bssid_invert = negate;
 		for (unsigned int x = 0; x < macvec.size(); x++) {
-			bssid_map.insert(macvec[x], 1);
+			bssid_map.insert(macvec[x]);
 		}
 	}
 
@@ -514,7 +549,7 @@ int FilterCore::AddFilterLine(string filter_str) {
 		macvec = local_maps[_filter_type_source];
 		source_invert = negate;
 		for (unsigned int x = 0; x < macvec.size(); x++) {
-			source_map.insert(macvec[x], 1);
+			source_map.insert(macvec[x]);
 		}
 	}
 
@@ -523,7 +558,7 @@ int FilterCore::AddFilterLine(string filter_str) {
 		macvec = local_maps[_filter_type_dest];
 		dest_invert = negate;
 		for (unsigned int x = 0; x < macvec.size(); x++) {
-			dest_map.insert(macvec[x], 1);
+			dest_map.insert(macvec[x]);
 		}
 	}
 
@@ -531,9 +566,9 @@ int FilterCore::AddFilterLine(string filter_str) {
 	if (negate != -1) {
 		macvec = local_maps[_filter_type_any];
 		for (unsigned int x = 0; x < macvec.size(); x++) {
-			dest_map.insert(macvec[x], 1);
-			source_map.insert(macvec[x], 1);
-			bssid_map.insert(macvec[x], 1);
+			dest_map.insert(macvec[x]);
+			source_map.insert(macvec[x]);
+			bssid_map.insert(macvec[x]);
 		}
 	}
 
@@ -668,7 +703,7 @@ int FilterCore::AddFilterLine(string filter_str) {
 						 MSGFLAG_ERROR);
 					return -1;
 				}
-                bssid_map.insert(mac, invert);
+                bssid_map.insert(mac);
 				bssid_invert = invert;
             } if (address_target & 0x02) {
 				if (source_invert != -1 && invert != source_invert) {
@@ -678,7 +713,7 @@ int FilterCore::AddFilterLine(string filter_str) {
 						 MSGFLAG_ERROR);
 					return -1;
 				}
-                source_map.insert(mac, invert);
+                source_map.insert(mac);
 				source_invert = invert;
             } if (address_target & 0x04) {
 				if (dest_invert != -1 && invert != dest_invert) {
@@ -688,7 +723,7 @@ int FilterCore::AddFilterLine(string filter_str) {
 						 MSGFLAG_ERROR);
 					return -1;
 				}
-                dest_map.insert(mac, invert);
+                dest_map.insert(mac);
 				dest_invert = invert;
             }
 
@@ -707,28 +742,31 @@ int FilterCore::AddFilterLine(string filter_str) {
 int FilterCore::RunFilter(mac_addr bssidmac, mac_addr sourcemac,
 						  mac_addr destmac) {
 	int hit = 0;
-	// Clumsy artifact of how iters are defined for macmap currently, must
-	// be defined as an assign
-	macmap<int>::iterator fitr = bssid_map.find(bssidmac);
-	
-	if ((fitr != bssid_map.end() && bssid_invert == 1) ||
-		(fitr == bssid_map.end() && bssid_invert == 0)) {
-		bssid_hit++;
-		hit = 1;
+	bool match;
+
+	// Unconfigured filters have no inversion set and can never hit
+	if (bssid_invert != -1) {
+		match = bssid_map.match(bssidmac);
+		if ((match && bssid_invert == 1) || (!match && bssid_invert == 0)) {
+			bssid_hit++;
+			hit = 1;
+		}
 	}
 
-	fitr = source_map.find(sourcemac);
-	if ((fitr != source_map.end() && source_invert == 1) ||
-		(fitr == source_map.end() && source_invert == 0)) {
-		source_hit++;
-		hit = 1;
+	if (source_invert != -1) {
+		match = source_map.match(sourcemac);
+		if ((match && source_invert == 1) || (!match && source_invert == 0)) {
+			source_hit++;
+			hit = 1;
+		}
 	}
 
-	fitr = dest_map.find(destmac);
-	if ((fitr != dest_map.end() && dest_invert == 1) ||
-		(fitr == dest_map.end() && dest_invert == 0)) {
-		dest_hit++;
-		hit = 1;
+	if (dest_invert != -1) {
+		match = dest_map.match(destmac);
+		if ((match && dest_invert == 1) || (!match && dest_invert == 0)) {
+			dest_hit++;
+			hit = 1;
+		}
 	}
 
 	return hit;
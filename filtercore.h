@@ -33,6 +33,7 @@
 #include <vector>
 #include <algorithm>
 #include <string>
+#include <unordered_set>
 
 #ifdef HAVE_LIBPCRE
 #include <pcre.h>
@@ -43,6 +44,40 @@
 #include "packetchain.h"
 #include "timetracker.h"
 
+// Set of MAC addresses and masked MAC ranges a filter compares against
+//
+// Full addresses go in a hash, and masked ranges in a table with one sorted
+// vector of masked addresses per distinct mask, tightest mask first, so a
+// lookup is one hash probe plus one binary search per mask in use no matter
+// how many addresses the filter lists
+class FilterCoreMacSet {
+public:
+	void insert(const mac_addr& in_mac);
+
+	bool match(const mac_addr& in_mac) const {
+		if (exact_set.size() != 0 && exact_set.count(in_mac.longmac) != 0)
+			return true;
+
+		for (auto& g : mask_table) {
+			if (std::binary_search(g.macs.begin(), g.macs.end(),
+								   in_mac.longmac & g.mask))
+				return true;
+		}
+
+		return false;
+	}
+
+protected:
+	struct mask_group {
+		uint64_t mask;
+		// Addresses with the mask applied, sorted
+		vector<uint64_t> macs;
+	};
+
+	unordered_set<uint64_t> exact_set;
+	vector<mask_group> mask_table;
+};
+
 class FilterCore {
 public:
 
@@ -79,9 +114,9 @@ public:
 protected:
 	GlobalRegistry *globalreg;
 
-	macmap<int> bssid_map;
-	macmap<int> source_map;
-	macmap<int> dest_map;
+	FilterCoreMacSet bssid_map;
+	FilterCoreMacSet source_map;
+	FilterCoreMacSet dest_map;
 	int bssid_invert;
 	int source_invert;
 	int dest_invert;
@@ -22,7 +22,11 @@
 #include "messagebus.h"
 
 GPSFake::GPSFake(GlobalRegistry *in_globalreg, SharedGpsBuilder in_builder) : 
-    KisGps(in_globalreg, in_builder) { }
+    KisGps(in_globalreg, in_builder) {
+
+    // A fixed location never goes stale
+    location_lifetime = 0;
+}
 
 GPSFake::~GPSFake() { }
 
@@ -33,6 +33,10 @@
 GpsTracker::GpsTracker(GlobalRegistry *in_globalreg) :
     Kis_Net_Httpd_CPPStream_Handler(in_globalreg) {
 
+    Httpd_RegisterRoute("GET", "/gps/drivers");
+    Httpd_RegisterRoute("GET", "/gps/all_gps");
+    Httpd_RegisterRoute("GET", "/gps/location");
+
     tracked_uuid_addition_id = 
         entrytracker->RegisterField("kismet.common.location.gps_uuid", TrackerUuid,
                 "UUID of GPS reporting location");
@@ -45,7 +49,7 @@ GpsTracker::GpsTracker(GlobalRegistry *in_globalreg) :
 
     // Register the packet chain hook
     globalreg->packetchain->RegisterHandler(&kis_gpspack_hook, this,
-            CHAINPOS_POSTCAP, -100);
+            CHAINPOS_POSTCAP, -100, "gps");
 
     gps_prototypes.reset(new TrackerElement(TrackerVector));
     gps_prototypes_vec = TrackerElementVector(gps_prototypes);
@@ -58,7 +62,9 @@ GpsTracker::GpsTracker(GlobalRegistry *in_globalreg) :
     register_gps_builder(SharedGpsBuilder(new GPSGpsdV2Builder(globalreg)));
     register_gps_builder(SharedGpsBuilder(new GPSFakeBuilder(globalreg)));
     register_gps_builder(SharedGpsBuilder(new GPSWebBuilder(globalreg)));
+}
 
+void GpsTracker::open_config_gps() {
     // Process any gps options in the config file
     vector<string> gpsvec = globalreg->kismet_config->FetchOptVec("gps");
     for (auto g : gpsvec) {
@@ -184,6 +190,25 @@ kis_gps_packinfo *GpsTracker::get_best_location() {
     return NULL;
 }
 
+kis_gps_packinfo *GpsTracker::acquire_best_location() {
+    local_locker lock(&gpsmanager_mutex);
+
+    for (auto d : gps_instances_vec) {
+        SharedGps gps = static_pointer_cast<KisGps>(d);
+
+        if (gps->get_gps_data_only())
+            continue;
+
+        kis_gps_packinfo *pi = 
+            gps->acquire_published_location(globalreg->timestamp.tv_sec);
+
+        if (pi != NULL)
+            return pi;
+    }
+
+    return NULL;
+}
+
 int GpsTracker::kis_gpspack_hook(CHAINCALL_PARMS) {
     // We're an 'external user' of GpsTracker despite being inside it,
     // so don't do thread locking - that's up to GpsTracker internals
@@ -195,12 +220,12 @@ int GpsTracker::kis_gpspack_hook(CHAINCALL_PARMS) {
     if (in_pack->fetch(_PCM(PACK_COMP_GPS)) != NULL)
         return 1;
 
-    kis_gps_packinfo *gpsloc = gpstracker->get_best_location();
+    kis_gps_packinfo *gpsloc = gpstracker->acquire_best_location();
 
     if (gpsloc == NULL)
         return 0;
 
-    // Insert into chain; we were given a new location
+    // Insert into chain; the packet holds a reference to the shared fix
     in_pack->insert(_PCM(PACK_COMP_GPS), gpsloc);
 
     return 1;
@@ -21,6 +21,7 @@
 
 #include "config.h"
 
+#include <atomic>
 #include <mutex>
 
 #include "packetchain.h"
@@ -35,9 +36,10 @@ class KisGps;
 typedef shared_ptr<KisGps> SharedGps;
 
 // Packet info attached to each packet, if there isn't already GPS info present
-class kis_gps_packinfo : public packet_component {
+class kis_gps_packinfo : public packet_component, 
+    public pooled_packet_component<kis_gps_packinfo> {
 public:
-	kis_gps_packinfo() {
+	kis_gps_packinfo() : refs(1) {
 		self_destruct = 1;
         lat = lon = alt = speed = heading = 0;
         precision = 0;
@@ -46,24 +48,37 @@ public:
         tv.tv_usec = 0;
 	}
 
-    kis_gps_packinfo(kis_gps_packinfo *src) {
+    kis_gps_packinfo(kis_gps_packinfo *src) : refs(1) {
         if (src != NULL) {
             self_destruct = src->self_destruct;
-
-            lat = src->lat;
-            lon = src->lon;
-            alt = src->alt;
-            speed = src->speed;
-            heading = src->heading;
-            precision = src->precision;
-            fix = src->fix;
-            tv.tv_sec = src->tv.tv_sec;
-            tv.tv_usec = src->tv.tv_usec;
-            gpsuuid = src->gpsuuid;
-            gpsname = src->gpsname;
+            copy_location(*src);
         }
     }
 
+    kis_gps_packinfo(const kis_gps_packinfo& src) : packet_component(), refs(1) {
+        self_destruct = src.self_destruct;
+        copy_location(src);
+    }
+
+    kis_gps_packinfo& operator=(const kis_gps_packinfo& src) {
+        self_destruct = src.self_destruct;
+        copy_location(src);
+        return *this;
+    }
+
+    // A GPS publishes each new fix as one record which every packet shares;
+    // packets hold a reference and the last one frees it.  Records made for
+    // a single packet have only the packet's reference.
+    kis_gps_packinfo *acquire() {
+        refs.fetch_add(1, std::memory_order_relaxed);
+        return this;
+    }
+
+    virtual void release_component() {
+        if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            delete this;
+    }
+
     double lat;
     double lon;
     double alt;
@@ -83,6 +98,23 @@ public:
 
     // Name of GPS that created us
     string gpsname;
+
+protected:
+    void copy_location(const kis_gps_packinfo& src) {
+        lat = src.lat;
+        lon = src.lon;
+        alt = src.alt;
+        speed = src.speed;
+        heading = src.heading;
+        precision = src.precision;
+        fix = src.fix;
+        tv.tv_sec = src.tv.tv_sec;
+        tv.tv_usec = src.tv.tv_usec;
+        gpsuuid = src.gpsuuid;
+        gpsname = src.gpsname;
+    }
+
+    std::atomic<unsigned int> refs;
 };
 
 /* GPS manager which handles configuring GPS sources and deciding which one
@@ -102,6 +134,10 @@ private:
 public:
     virtual ~GpsTracker();
 
+    // Open the GPS devices in the config file; they may be slow to open, so
+    // this may be run alongside the rest of startup
+    void open_config_gps();
+
     virtual bool Httpd_VerifyPath(const char *path, const char *method);
 
     virtual void Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd,
@@ -125,6 +161,10 @@ public:
     // responsible for deleting.
     kis_gps_packinfo *get_best_location();
 
+    // Get a reference to the fix published by the best GPS, without copying it;
+    // the caller releases it with release_component(), or gives it to a packet
+    kis_gps_packinfo *acquire_best_location();
+
     // Populate packets that don't have a GPS location
     static int kis_gpspack_hook(CHAINCALL_PARMS);
 
@@ -29,6 +29,9 @@ GPSWeb::GPSWeb(GlobalRegistry *in_globalreg, SharedGpsBuilder in_builder) :
     Kis_Net_Httpd_CPPStream_Handler(NULL) {
 
     last_heading_time = 0;
+
+    // Allow a wider location window
+    location_lifetime = 30;
 }
 
 GPSWeb::~GPSWeb() { }
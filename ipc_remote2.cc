@@ -22,12 +22,62 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <spawn.h>
+#include <string.h>
 #include <sstream>
 
 #include "util.h"
 #include "messagebus.h"
 #include "ipc_remote2.h"
 #include "pollabletracker.h"
+#include "cpu_affinity.h"
+#include "ringbuf_shm.h"
+
+extern char **environ;
+
+// Spawn a helper binary with posix_spawn.  Unlike fork(), spawning doesn't copy
+// the page tables of the server (glibc spawns with a vfork-style clone), so
+// launching a helper costs the same no matter how large the server has grown.
+// The pipes are arranged in the child by the file actions, and the child gets
+// the signal mask we had before blocking SIGCHLD.  The child starts on the cpus
+// of the spawning thread, so the thread is moved to in_cpus for the spawn; the
+// binary is placed before it runs any of its own code.
+//
+// Returns the pid, or -1 and sets errno
+static pid_t ipc_spawn(const string& in_path, const vector<string>& in_args,
+        posix_spawn_file_actions_t *in_actions, const sigset_t *in_mask,
+        const string& in_cpus) {
+    posix_spawnattr_t attr;
+    pid_t pid;
+    int r;
+
+    CpuAffinityScope affinity(in_cpus);
+
+    vector<char *> argv;
+
+    argv.push_back(const_cast<char *>(in_path.c_str()));
+    for (auto a : in_args)
+        argv.push_back(strdup(a.c_str()));
+    argv.push_back(NULL);
+
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, in_mask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+    r = posix_spawn(&pid, in_path.c_str(), in_actions, &attr, argv.data(), environ);
+
+    posix_spawnattr_destroy(&attr);
+
+    for (unsigned int x = 1; x < argv.size(); x++)
+        free(argv[x]);
+
+    if (r != 0) {
+        errno = r;
+        return -1;
+    }
+
+    return pid;
+}
 
 IPCRemoteV2::IPCRemoteV2(GlobalRegistry *in_globalreg, 
         shared_ptr<BufferHandlerGeneric> in_rbhandler) {
@@ -61,6 +111,8 @@ IPCRemoteV2::IPCRemoteV2(GlobalRegistry *in_globalreg,
 
     child_pid = -1;
     tracker_free = false;
+
+    shm_ring = NULL;
 }
 
 IPCRemoteV2::~IPCRemoteV2() {
@@ -120,7 +172,6 @@ int IPCRemoteV2::launch_kis_binary(string cmd, vector<string> args) {
 
 int IPCRemoteV2::launch_kis_explicit_binary(string cmdpath, vector<string> args) {
     struct stat buf;
-    char **cmdarg;
     stringstream arg;
 
     if (pipeclient != NULL) {
@@ -137,10 +188,7 @@ int IPCRemoteV2::launch_kis_explicit_binary(string cmdpath, vector<string> args)
         return -1;
     }
 
-    // We can't use a local_locker here because we can't let it unlock
-    // inside the child thread, because the mutex doesn't survive across
-    // forking
-    pthread_mutex_lock(&ipc_locker);
+    local_locker lock(&ipc_locker);
 
     // 'in' to the spawned process, write to the server process, 
     // [1] belongs to us, [0] to them
@@ -151,7 +199,6 @@ int IPCRemoteV2::launch_kis_explicit_binary(string cmdpath, vector<string> args)
 
     if (pipe2(inpipepair, O_NONBLOCK) < 0) {
         _MSG("IPC could not create pipe", MSGFLAG_ERROR);
-        pthread_mutex_unlock(&ipc_locker);
         return -1;
     }
 
@@ -159,84 +206,97 @@ int IPCRemoteV2::launch_kis_explicit_binary(string cmdpath, vector<string> args)
         _MSG("IPC could not create pipe", MSGFLAG_ERROR);
         close(inpipepair[0]);
         close(inpipepair[1]);
-        pthread_mutex_unlock(&ipc_locker);
         return -1;
     }
-    
-   
-    // Mask sigchild until we're done and it's in the list
-    sigset_t mask, oldmask;
 
-    sigemptyset(&mask);
-    sigemptyset(&oldmask);
+    // Our halves of the pipes never belong in a helper, this one or any launched
+    // later
+    fcntl(inpipepair[1], F_SETFD, fcntl(inpipepair[1], F_GETFD, 0) | FD_CLOEXEC);
+    fcntl(outpipepair[0], F_SETFD, fcntl(outpipepair[0], F_GETFD, 0) | FD_CLOEXEC);
 
-    sigaddset(&mask, SIGCHLD);
+    // Child reads from inpair, writes to outpair
+    vector<string> spawnargs;
 
-    sigprocmask(SIG_BLOCK, &mask, &oldmask);
+    arg << "--in-fd=" << inpipepair[0];
+    spawnargs.push_back(arg.str());
+    arg.str("");
 
-    if ((child_pid = fork()) < 0) {
-        _MSG("IPC could not fork()", MSGFLAG_ERROR);
-        pthread_mutex_unlock(&ipc_locker);
-    } else if (child_pid == 0) {
-        // We're the child process
-      
-#if 0
-        cmdarg = new char*[args.size() + 8];
+    arg << "--out-fd=" << outpipepair[1];
+    spawnargs.push_back(arg.str());
+
+    // The ring descriptors are close-on-exec; hand the child copies which
+    // survive it
+    int shmfds[3] = { -1, -1, -1 };
+
+    if (shm_ring != NULL) {
+        shmfds[0] = dup(shm_ring->get_ring_fd());
+        shmfds[1] = dup(shm_ring->get_doorbell_fd());
+        shmfds[2] = dup(shm_ring->get_drain_fd());
 
-        cmdarg[0] = strdup("valgrind");
-        cmdarg[1] = strdup("--tool=memcheck");
-        cmdarg[2] = strdup("--leak-check=full");
-        cmdarg[3] = strdup("--show-leak-kinds=all");
-        cmdarg[4] = strdup(cmdpath.c_str());
+        if (shmfds[0] < 0 || shmfds[1] < 0 || shmfds[2] < 0) {
+            _MSG("IPC could not pass shared memory ring", MSGFLAG_ERROR);
+            for (unsigned int x = 0; x < 3; x++) {
+                if (shmfds[x] > -1)
+                    close(shmfds[x]);
+            }
+            close(inpipepair[0]);
+            close(inpipepair[1]);
+            close(outpipepair[0]);
+            close(outpipepair[1]);
+            return -1;
+        }
 
-        // Child reads from inpair
-        arg << "--in-fd=" << inpipepair[0];
-        cmdarg[5] = strdup(arg.str().c_str());
         arg.str("");
+        arg << "--shm-ring=" << shmfds[0] << "," << shmfds[1] << "," << shmfds[2];
+        spawnargs.push_back(arg.str());
+    }
 
-        // Child writes to writepair
-        arg << "--out-fd=" << outpipepair[1];
-        cmdarg[6] = strdup(arg.str().c_str());
+    spawnargs.insert(spawnargs.end(), args.begin(), args.end());
 
-        for (unsigned int x = 0; x < args.size(); x++)
-            cmdarg[x+7] = strdup(args[x].c_str());
+    string spawnpath = cmdpath;
 
-        cmdarg[args.size() + 7] = NULL;
-#else
-        // argv[0], "--in-fd" "--out-fd" ... NULL
-        cmdarg = new char*[args.size() + 4];
-        cmdarg[0] = strdup(cmdpath.c_str());
+#if 0
+    spawnargs.insert(spawnargs.begin(), { "--tool=memcheck", "--leak-check=full",
+            "--show-leak-kinds=all", cmdpath });
+    spawnpath = "/usr/bin/valgrind";
+#endif
 
-        // Child reads from inpair
-        arg << "--in-fd=" << inpipepair[0];
-        cmdarg[1] = strdup(arg.str().c_str());
-        arg.str("");
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addclose(&actions, inpipepair[1]);
+    posix_spawn_file_actions_addclose(&actions, outpipepair[0]);
 
-        // Child writes to writepair
-        arg << "--out-fd=" << outpipepair[1];
-        cmdarg[2] = strdup(arg.str().c_str());
+    // Mask sigchild until we're done and it's in the list
+    sigset_t mask, oldmask;
 
-        for (unsigned int x = 0; x < args.size(); x++)
-            cmdarg[x+3] = strdup(args[x].c_str());
+    sigemptyset(&mask);
+    sigemptyset(&oldmask);
 
-        cmdarg[args.size() + 3] = NULL;
-#endif
+    sigaddset(&mask, SIGCHLD);
 
-        // Close the unused half of the pairs on the child
-        close(inpipepair[1]);
-        close(outpipepair[0]);
+    sigprocmask(SIG_BLOCK, &mask, &oldmask);
 
-        // Un-mask the child signals
-        sigprocmask(SIG_UNBLOCK, &mask, &oldmask);
+    // fprintf(stderr, "debug - ipcremote2 - spawn %s\n", spawnpath.c_str());
+    child_pid = ipc_spawn(spawnpath, spawnargs, &actions, &oldmask, cpu_affinity);
 
-        // fprintf(stderr, "debug - ipcremote2 - exec %s\n", cmdarg[0]);
-        execvp(cmdarg[0], cmdarg);
+    posix_spawn_file_actions_destroy(&actions);
+
+    for (unsigned int x = 0; x < 3; x++) {
+        if (shmfds[x] > -1)
+            close(shmfds[x]);
+    }
+
+    if (child_pid < 0) {
+        _MSG("IPC could not launch '" + cmdpath + "': " + kis_strerror_r(errno),
+                MSGFLAG_ERROR);
+        close(inpipepair[0]);
+        close(inpipepair[1]);
+        close(outpipepair[0]);
+        close(outpipepair[1]);
+        sigprocmask(SIG_SETMASK, &oldmask, NULL);
+        return -1;
+    }
 
-        exit(255);
-    } 
-   
-    // Parent process
-   
     // fprintf(stderr, "debug - ipcremote2 creating pipeclient\n");
 
     pipeclient.reset(new PipeClient(globalreg, ipchandler));
@@ -244,7 +304,14 @@ int IPCRemoteV2::launch_kis_explicit_binary(string cmdpath, vector<string> args)
     pollabletracker->RegisterPollable(pipeclient);
 
     // Read from the child write pair, write to the child read pair
-    pipeclient->OpenPipes(outpipepair[0], inpipepair[1]);
+    if (shm_ring != NULL) {
+        pipeclient->OpenShmPipes(outpipepair[0], inpipepair[1], shm_ring);
+
+        // The child has the memory mapped now
+        shm_ring->close_ring_fd();
+    } else {
+        pipeclient->OpenPipes(outpipepair[0], inpipepair[1]);
+    }
 
     // Close the remote side of the pipes from the parent, they're open in the child
     close(inpipepair[0]);
@@ -257,10 +324,8 @@ int IPCRemoteV2::launch_kis_explicit_binary(string cmdpath, vector<string> args)
         remotehandler->add_ipc(this);
     }
 
-    pthread_mutex_unlock(&ipc_locker);
-
     // Unmask the child signal now that we're done
-    sigprocmask(SIG_UNBLOCK, &mask, &oldmask);
+    sigprocmask(SIG_SETMASK, &oldmask, NULL);
 
     return 1;
 }
@@ -278,8 +343,6 @@ int IPCRemoteV2::launch_standard_binary(string cmd, vector<string> args) {
 
 int IPCRemoteV2::launch_standard_explicit_binary(string cmdpath, vector<string> args) {
     struct stat buf;
-    char **cmdarg;
-    stringstream arg;
 
     if (pipeclient != NULL) {
         soft_kill();
@@ -295,19 +358,15 @@ int IPCRemoteV2::launch_standard_explicit_binary(string cmdpath, vector<string>
         return -1;
     }
 
-    // We can't use a local_locker here because we can't let it unlock
-    // inside the child thread, because the mutex doesn't survive across
-    // forking
-    pthread_mutex_lock(&ipc_locker);
+    local_locker lock(&ipc_locker);
 
-    // 'in' to the spawned process, [0] belongs to us, [1] to them
+    // 'in' to the spawned process, [1] belongs to us, [0] to them
     int inpipepair[2];
-    // 'out' from the spawned process, [1] belongs to us, [0] to them
+    // 'out' from the spawned process, [0] belongs to us, [1] to them
     int outpipepair[2];
 
     if (pipe(inpipepair) < 0) {
         _MSG("IPC could not create pipe", MSGFLAG_ERROR);
-        pthread_mutex_unlock(&ipc_locker);
         return -1;
     }
 
@@ -315,43 +374,48 @@ int IPCRemoteV2::launch_standard_explicit_binary(string cmdpath, vector<string>
         _MSG("IPC could not create pipe", MSGFLAG_ERROR);
         close(inpipepair[0]);
         close(inpipepair[1]);
-        pthread_mutex_unlock(&ipc_locker);
         return -1;
     }
 
-    if ((child_pid = fork()) < 0) {
-        _MSG("IPC could not fork()", MSGFLAG_ERROR);
-        pthread_mutex_unlock(&ipc_locker);
-    } else if (child_pid == 0) {
-        // We're the child process
-        
-        // argv[0], "--in-fd" "--out-fd" ... NULL
-        cmdarg = new char*[args.size() + 1];
-        cmdarg[0] = strdup(cmdpath.c_str());
+    fcntl(inpipepair[1], F_SETFD, fcntl(inpipepair[1], F_GETFD, 0) | FD_CLOEXEC);
+    fcntl(outpipepair[0], F_SETFD, fcntl(outpipepair[0], F_GETFD, 0) | FD_CLOEXEC);
 
-        for (unsigned int x = 0; x < args.size(); x++)
-            cmdarg[x+3] = strdup(args[x].c_str());
+    // Clone over the stdin/stdout and close the originals in the child
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, inpipepair[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, outpipepair[1], STDOUT_FILENO);
+    if (inpipepair[0] != STDIN_FILENO && inpipepair[0] != STDOUT_FILENO)
+        posix_spawn_file_actions_addclose(&actions, inpipepair[0]);
+    if (outpipepair[1] != STDIN_FILENO && outpipepair[1] != STDOUT_FILENO)
+        posix_spawn_file_actions_addclose(&actions, outpipepair[1]);
 
-        cmdarg[args.size() + 1] = NULL;
+    // Mask sigchild until we're done and it's in the list
+    sigset_t mask, oldmask;
 
-        // Clone over the stdin/stdout
-        dup2(inpipepair[0], STDIN_FILENO);
-        dup2(outpipepair[1], STDOUT_FILENO);
+    sigemptyset(&mask);
+    sigemptyset(&oldmask);
 
-        // Close the remote side of the pipes
-        close(inpipepair[0]);
-        close(outpipepair[1]);
+    sigaddset(&mask, SIGCHLD);
+
+    sigprocmask(SIG_BLOCK, &mask, &oldmask);
 
-        execvp(cmdarg[0], cmdarg);
+    child_pid = ipc_spawn(cmdpath, args, &actions, &oldmask, cpu_affinity);
 
-        exit(255);
-    } 
+    posix_spawn_file_actions_destroy(&actions);
 
-    // Only reach here if we're the parent process
-    
     // Close the remote side of the pipes
-    close(inpipepair[1]);
-    close(outpipepair[0]);
+    close(inpipepair[0]);
+    close(outpipepair[1]);
+
+    if (child_pid < 0) {
+        _MSG("IPC could not launch '" + cmdpath + "': " + kis_strerror_r(errno),
+                MSGFLAG_ERROR);
+        close(inpipepair[1]);
+        close(outpipepair[0]);
+        sigprocmask(SIG_SETMASK, &oldmask, NULL);
+        return -1;
+    }
 
     pipeclient.reset(new PipeClient(globalreg, ipchandler));
 
@@ -368,7 +432,7 @@ int IPCRemoteV2::launch_standard_explicit_binary(string cmdpath, vector<string>
         remotehandler->add_ipc(this);
     }
 
-    pthread_mutex_unlock(&ipc_locker);
+    sigprocmask(SIG_SETMASK, &oldmask, NULL);
 
     return 1;
 }
@@ -378,6 +442,17 @@ pid_t IPCRemoteV2::get_pid() {
     return child_pid;
 }
 
+void IPCRemoteV2::set_cpu_affinity(string in_cpus) {
+    local_locker lock(&ipc_locker);
+    cpu_affinity = in_cpus;
+}
+
+void IPCRemoteV2::set_shm_ring(RingbufShm *in_ring) {
+    local_locker lock(&ipc_locker);
+
+    shm_ring = in_ring;
+}
+
 void IPCRemoteV2::set_tracker_free(bool in_free) {
     local_locker lock(&ipc_locker);
     tracker_free = in_free;
@@ -47,6 +47,7 @@
  */
 
 class IPCRemoteV2Tracker;
+class RingbufShm;
 
 class IPCRemoteV2 {
 public:
@@ -85,6 +86,15 @@ public:
 
     pid_t get_pid();
 
+    // Start binaries on a list of cpus ("0-3,8"); an empty list starts them where
+    // the launching thread runs
+    void set_cpu_affinity(string in_cpus);
+
+    // Have the next kismet binary write its data into a shared ring instead of
+    // the out pipe; the ring must be the read buffer of the handler, and is
+    // passed to the binary via --shm-ring=
+    void set_shm_ring(RingbufShm *in_ring);
+
     // Does the ipc tracker free us when we die?  This should be set to true when
     // we are destroying something that uses an IPC context, and we need the IPC
     // context deleted once the process is reaped.
@@ -116,6 +126,10 @@ protected:
     string binary_path;
     vector<string> binary_args;
 
+    string cpu_affinity;
+
+    RingbufShm *shm_ring;
+
 };
 
 /* IPC remote handler / coordinator
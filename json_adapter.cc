@@ -19,12 +19,15 @@
 #include "config.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <time.h>
 #include <list>
 #include <map>
 #include <vector>
 #include <algorithm>
 #include <string>
+#include <sstream>
+#include <cmath>
 
 #include "globalregistry.h"
 #include "trackedelement.h"
@@ -41,27 +44,667 @@ string JsonAdapter::SanitizeString(string in) {
     return itr;
 }
 
+static const char json_digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+void JsonAdapter::json_writer::write_uint(uint64_t v) {
+    // Digits are produced two at a time from the end
+    char tmp[20];
+    char *p = tmp + sizeof(tmp);
+
+    while (v >= 100) {
+        unsigned int d = (unsigned int) (v % 100) * 2;
+        v /= 100;
+        *--p = json_digit_pairs[d + 1];
+        *--p = json_digit_pairs[d];
+    }
+
+    if (v >= 10) {
+        unsigned int d = (unsigned int) v * 2;
+        *--p = json_digit_pairs[d + 1];
+        *--p = json_digit_pairs[d];
+    } else {
+        *--p = (char) ('0' + v);
+    }
+
+    write(p, (tmp + sizeof(tmp)) - p);
+}
+
+void JsonAdapter::json_writer::write_int(int64_t v) {
+    if (v < 0) {
+        put('-');
+        // Negate as unsigned so INT64_MIN survives
+        write_uint(~((uint64_t) v) + 1);
+    } else {
+        write_uint((uint64_t) v);
+    }
+}
+
+static const double json_pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13,
+    1e14, 1e15
+};
+
+// Write a scaled integer with a decimal point 'places' digits from the right
+void JsonAdapter::json_writer::write_decimal(uint64_t in_scaled, bool in_negative,
+        int in_places) {
+    char tmp[24];
+    char *p = tmp + sizeof(tmp);
+    int digits = 0;
+
+    // Fractional digits, dropping trailing zeros
+    bool trailing = true;
+
+    while (digits < in_places) {
+        char d = (char) ('0' + (in_scaled % 10));
+        in_scaled /= 10;
+        digits++;
+
+        if (trailing && d == '0')
+            continue;
+
+        trailing = false;
+        *--p = d;
+    }
+
+    if (!trailing)
+        *--p = '.';
+
+    do {
+        *--p = (char) ('0' + (in_scaled % 10));
+        in_scaled /= 10;
+    } while (in_scaled != 0);
+
+    if (in_negative)
+        *--p = '-';
+
+    write(p, (tmp + sizeof(tmp)) - p);
+}
+
+void JsonAdapter::json_writer::write_double(double v) {
+    char tmp[32];
+    int n = 0;
+
+    if (!std::isfinite(v)) {
+        put('0');
+        return;
+    }
+
+    // Most values have only a few decimal places.  If v scaled by 10^k rounds
+    // to an integer r which divides back to exactly v, then "r with k places"
+    // reads back as v as well (both are the correctly rounded value of the same
+    // decimal), so it can be written with integer formatting.  The smallest k
+    // gives the shortest text.
+    double a = std::fabs(v);
+
+    for (int k = 0; k < 16; k++) {
+        double scaled = a * json_pow10[k];
+
+        if (scaled >= 9007199254740992.0)
+            break;
+
+        double r = std::floor(scaled + 0.5);
+
+        if (r / json_pow10[k] == a) {
+            write_decimal((uint64_t) r, v < 0, k);
+            return;
+        }
+    }
+
+    for (int prec = 15; prec <= 17; prec++) {
+        n = snprintf(tmp, sizeof(tmp), "%.*g", prec, v);
+        if (prec == 17 || strtod(tmp, NULL) == v)
+            break;
+    }
+
+    write(tmp, n);
+}
+
+void JsonAdapter::json_writer::write_float(float v) {
+    char tmp[32];
+    int n = 0;
+
+    if (!std::isfinite(v)) {
+        put('0');
+        return;
+    }
+
+    // As with doubles; the scaled value is kept in float range so the
+    // division rounds the same way a float parse would
+    float a = std::fabs(v);
+
+    for (int k = 0; k < 8; k++) {
+        float scaled = a * (float) json_pow10[k];
+
+        if (scaled >= 16777216.0f)
+            break;
+
+        float r = std::floor(scaled + 0.5f);
+
+        if (r / (float) json_pow10[k] == a) {
+            write_decimal((uint64_t) r, v < 0, k);
+            return;
+        }
+    }
+
+    for (int prec = 6; prec <= 9; prec++) {
+        n = snprintf(tmp, sizeof(tmp), "%.*g", prec, (double) v);
+        if (prec == 9 || strtof(tmp, NULL) == v)
+            break;
+    }
+
+    write(tmp, n);
+}
+
+void JsonAdapter::json_writer::write_fixed(double v) {
+    char tmp[64];
+    int n;
+
+    n = snprintf(tmp, sizeof(tmp), "%f", v);
+
+    if (n < 0)
+        return;
+
+    // Only absurdly large values need more than the local buffer
+    if ((size_t) n >= sizeof(tmp)) {
+        string big(n + 1, 0);
+        snprintf(&(big[0]), n + 1, "%f", v);
+        write(big.data(), n);
+        return;
+    }
+
+    write(tmp, n);
+}
+
+void JsonAdapter::json_writer::write_string(const char *in_str, size_t in_len) {
+    static const char hex[] = "0123456789abcdef";
+
+    put('"');
+
+    // Copy runs of characters which need no escaping in one go
+    size_t run = 0;
+
+    for (size_t i = 0; i < in_len; i++) {
+        unsigned char c = (unsigned char) in_str[i];
+
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+
+        write(in_str + run, i - run);
+        run = i + 1;
+
+        switch (c) {
+            case '"':
+                write("\\\"", 2);
+                break;
+            case '\\':
+                write("\\\\", 2);
+                break;
+            case '\n':
+                write("\\n", 2);
+                break;
+            case '\r':
+                write("\\r", 2);
+                break;
+            case '\t':
+                write("\\t", 2);
+                break;
+            default:
+                char u[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xF] };
+                write(u, 6);
+                break;
+        }
+    }
+
+    write(in_str + run, in_len - run);
+
+    put('"');
+}
+
+void JsonAdapter::json_writer::write_hex(const uint8_t *in_data, size_t in_len) {
+    static const char hex[] = "0123456789ABCDEF";
+
+    put('"');
+
+    for (size_t i = 0; i < in_len; i++) {
+        char h[2] = { hex[in_data[i] >> 4], hex[in_data[i] & 0xF] };
+        write(h, 2);
+    }
+
+    put('"');
+}
+
 void JsonAdapter::Pack(GlobalRegistry *globalreg, std::ostream &stream,
-    SharedTrackerElement e, TrackerElementSerializer::rename_map *name_map) {
+    const SharedTrackerElement& e, TrackerElementSerializer::rename_map *name_map,
+    TrackerElementSerializer::serial_cache_map *cache_map) {
+
+    json_writer writer(stream);
+    JsonAdapter::Pack(globalreg, writer, e, name_map, cache_map);
+}
+
+void JsonAdapter::Pack(GlobalRegistry *globalreg, json_writer &writer,
+    const SharedTrackerElement& e, TrackerElementSerializer::rename_map *name_map,
+    TrackerElementSerializer::serial_cache_map *cache_map) {
+
+    if (e == NULL) {
+        writer.put('0');
+        return;
+    }
+
+    // Unchanged elements which were already serialized are written as-is
+    if (cache_map != NULL) {
+        TrackerElementSerializer::serial_cache_map::iterator ci = 
+            cache_map->find(e.get());
+        if (ci != cache_map->end()) {
+            writer.write(*(ci->second));
+            return;
+        }
+    }
+
+    SharedElementSummary path_summary;
+
+    if (name_map != NULL) {
+        TrackerElementSerializer::rename_map::iterator nmi = name_map->find(e);
+        if (nmi != name_map->end())
+            path_summary = nmi->second;
+    }
+
+    if (path_summary != NULL)
+        TrackerElementSerializer::pre_serialize_path(path_summary);
+    else
+        e->pre_serialize();
+
+    TrackerElement::tracked_vector *tvec;
+    TrackerElement::vector_iterator vec_iter;
+
+    TrackerElement::tracked_map *tmap;
+    TrackerElement::map_iterator map_iter;
+
+    TrackerElement::tracked_int_map *tintmap;
+    TrackerElement::int_map_iterator int_map_iter;
+
+    TrackerElement::tracked_mac_map *tmacmap;
+    TrackerElement::mac_map_iterator mac_map_iter;
+
+    TrackerElement::tracked_string_map *tstringmap;
+    TrackerElement::string_map_iterator string_map_iter;
+
+    TrackerElement::tracked_double_map *tdoublemap;
+    TrackerElement::double_map_iterator double_map_iter;
+
+    TrackerElement::tracked_small_int_map *tsmallintmap;
+    TrackerElement::small_int_map_iterator small_int_map_iter;
+
+    TrackerElement::tracked_small_double_map *tsmalldoublemap;
+    TrackerElement::small_double_map_iterator small_double_map_iter;
+
+    switch (e->get_type()) {
+        case TrackerString:
+            writer.write_string(GetTrackerValue<string>(e));
+            break;
+        case TrackerInt8:
+            writer.write_int(GetTrackerValue<int8_t>(e));
+            break;
+        case TrackerUInt8:
+            writer.write_uint(GetTrackerValue<uint8_t>(e));
+            break;
+        case TrackerInt16:
+            writer.write_int(GetTrackerValue<int16_t>(e));
+            break;
+        case TrackerUInt16:
+            writer.write_uint(GetTrackerValue<uint16_t>(e));
+            break;
+        case TrackerInt32:
+            writer.write_int(GetTrackerValue<int32_t>(e));
+            break;
+        case TrackerUInt32:
+            writer.write_uint(GetTrackerValue<uint32_t>(e));
+            break;
+        case TrackerInt64:
+            writer.write_int(GetTrackerValue<int64_t>(e));
+            break;
+        case TrackerUInt64:
+            writer.write_uint(GetTrackerValue<uint64_t>(e));
+            break;
+        case TrackerFloat:
+            writer.write_float(GetTrackerValue<float>(e));
+            break;
+        case TrackerDouble:
+            writer.write_double(GetTrackerValue<double>(e));
+            break;
+        case TrackerMac:
+            // Mac is quoted as a string value, mac only
+            writer.put('"');
+            writer.write(GetTrackerValue<mac_addr>(e).Mac2String());
+            writer.put('"');
+            break;
+        case TrackerUuid:
+            // UUID is quoted as a string value
+            writer.put('"');
+            writer.write(GetTrackerValue<uuid>(e).UUID2String());
+            writer.put('"');
+            break;
+        case TrackerVector:
+            tvec = e->get_vector();
+            writer.put('[');
+            for (vec_iter = tvec->begin(); vec_iter != tvec->end(); /* */ ) {
+                JsonAdapter::Pack(globalreg, writer, *vec_iter, name_map, cache_map);
+                if (++vec_iter != tvec->end())
+                    writer.put(',');
+            }
+            writer.put(']');
+            break;
+        case TrackerMap:
+            tmap = e->get_map();
+            writer.put('{');
+            for (map_iter = tmap->begin(); map_iter != tmap->end(); /* */) {
+                bool named = false;
+
+                if (name_map != NULL) {
+                    TrackerElementSerializer::rename_map::iterator nmi = 
+                        name_map->find(map_iter->second);
+                    if (nmi != name_map->end() && nmi->second->rename.length() != 0) {
+                        writer.write_string(nmi->second->rename);
+                        named = true;
+                    }
+                }
+
+                if (named) {
+                    writer.write(": ", 2);
+                } else if (map_iter->second == NULL ||
+                        !map_iter->second->has_local_name()) {
+                    // Registered names come pre-encoded, separator included
+                    writer.write(globalreg->entrytracker->GetFieldJsonKey(map_iter->first));
+                } else {
+                    writer.write_string(map_iter->second->get_local_name());
+                    writer.write(": ", 2);
+                }
+
+                JsonAdapter::Pack(globalreg, writer, map_iter->second, name_map, cache_map);
+                if (++map_iter != tmap->end()) // Increment iter in loop
+                    writer.put(',');
+            }
+            writer.put('}');
+            break;
+        case TrackerIntMap:
+            tintmap = e->get_intmap();
+            writer.put('{');
+            for (int_map_iter = tintmap->begin(); int_map_iter != tintmap->end(); /* */) {
+                // Integer dictionary keys in json are still quoted as strings
+                writer.put('"');
+                writer.write_int(int_map_iter->first);
+                writer.write("\": ", 3);
+                JsonAdapter::Pack(globalreg, writer, int_map_iter->second, name_map, cache_map);
+                if (++int_map_iter != tintmap->end()) // Increment iter in loop
+                    writer.put(',');
+            }
+            writer.put('}');
+            break;
+        case TrackerMacMap:
+            tmacmap = e->get_macmap();
+            writer.put('{');
+            for (mac_map_iter = tmacmap->begin(); 
+                    mac_map_iter != tmacmap->end(); /* */) {
+                // Mac keys are strings and we push only the mac not the mask */
+                writer.put('"');
+                writer.write(mac_map_iter->first.Mac2String());
+                writer.write("\": ", 3);
+                JsonAdapter::Pack(globalreg, writer, mac_map_iter->second, name_map, cache_map);
+                if (++mac_map_iter != tmacmap->end())
+                    writer.put(',');
+            }
+            writer.put('}');
+            break;
+        case TrackerStringMap:
+            tstringmap = e->get_stringmap();
+            writer.put('{');
+            for (string_map_iter = tstringmap->begin();
+                    string_map_iter != tstringmap->end(); /* */) {
+                writer.write_string(string_map_iter->first);
+                writer.write(": ", 2);
+                JsonAdapter::Pack(globalreg, writer, string_map_iter->second, name_map, cache_map);
+                if (++string_map_iter != tstringmap->end())
+                    writer.put(',');
+            }
+            writer.put('}');
+            break;
+        case TrackerDoubleMap:
+            tdoublemap = e->get_doublemap();
+            writer.put('{');
+            for (double_map_iter = tdoublemap->begin();
+                    double_map_iter != tdoublemap->end(); /* */) {
+                // Double keys are handled as strings in json, and keep the fixed
+                // form so clients looking up keys by name still find them
+                writer.put('"');
+                writer.write_fixed(double_map_iter->first);
+                writer.write("\": ", 3);
+                JsonAdapter::Pack(globalreg, writer, double_map_iter->second, name_map, cache_map);
+                if (++double_map_iter != tdoublemap->end())
+                    writer.put(',');
+            }
+            writer.put('}');
+            break;
+        case TrackerSmallIntMap:
+            tsmallintmap = e->get_smallintmap();
+            writer.put('{');
+            for (small_int_map_iter = tsmallintmap->begin(); 
+                    small_int_map_iter != tsmallintmap->end(); /* */) {
+                writer.put('"');
+                writer.write_int(small_int_map_iter->first);
+                writer.write("\": ", 3);
+                JsonAdapter::Pack(globalreg, writer, small_int_map_iter->second, 
+                        name_map, cache_map);
+                if (++small_int_map_iter != tsmallintmap->end())
+                    writer.put(',');
+            }
+            writer.put('}');
+            break;
+        case TrackerSmallDoubleMap:
+            tsmalldoublemap = e->get_smalldoublemap();
+            writer.put('{');
+            for (small_double_map_iter = tsmalldoublemap->begin();
+                    small_double_map_iter != tsmalldoublemap->end(); /* */) {
+                writer.put('"');
+                writer.write_fixed(small_double_map_iter->first);
+                writer.write("\": ", 3);
+                JsonAdapter::Pack(globalreg, writer, small_double_map_iter->second, 
+                        name_map, cache_map);
+                if (++small_double_map_iter != tsmalldoublemap->end())
+                    writer.put(',');
+            }
+            writer.put('}');
+            break;
+        case TrackerByteArray:
+            writer.write_hex(e->get_bytearray().get(), e->get_bytearray_size());
+            break;
+
+        default:
+            break;
+    }
+
+    if (path_summary != NULL)
+        TrackerElementSerializer::post_serialize_path(path_summary);
+    else
+        e->post_serialize();
+}
+
+JsonAdapter::SummaryPlan::SummaryPlan(GlobalRegistry *in_globalreg,
+        const vector<SharedElementSummary>& in_summary) :
+    globalreg(in_globalreg),
+    passthrough(in_summary.size() == 0) {
+
+    unsigned int fn = 0;
+
+    for (auto si : in_summary) {
+        fn++;
+
+        if (si->resolved_path.size() == 0)
+            continue;
+
+        plan_field f;
+
+        f.path = si->resolved_path;
+        f.field_id = f.path[f.path.size() - 1];
+        f.renamed = si->rename.length() != 0;
+        f.pathed = f.path.size() > 1;
+
+        // Missing values are named the way SummarizeTrackerElement names
+        // their stand-ins
+        std::stringstream ks, ms;
+
+        {
+            json_writer kw(ks);
+            json_writer mw(ms);
+
+            if (f.renamed) {
+                kw.write_string(si->rename);
+                kw.write(": ", 2);
+                mw.write_string(si->rename);
+            } else if (f.field_id < 0) {
+                mw.write_string("unknown" + IntToString(fn));
+            } else {
+                mw.write_string(globalreg->entrytracker->GetFieldName(f.field_id));
+            }
+
+            mw.write(": ", 2);
+        }
+
+        f.key = ks.str();
+        f.missing_key = ms.str();
+
+        fields.push_back(f);
+    }
+
+    // Found values are keyed by field in the summary map, which is ordered by
+    // id and keeps duplicates in the order they were added
+    for (unsigned int i = 0; i < fields.size(); i++)
+        output_order.push_back(i);
+
+    std::stable_sort(output_order.begin(), output_order.end(),
+            [this](unsigned int a, unsigned int b) {
+                return fields[a].field_id < fields[b].field_id;
+            });
+
+    values.resize(fields.size());
+}
+
+void JsonAdapter::SummaryPlan::Pack(json_writer& writer, SharedTrackerElement in_elem) {
+    if (passthrough) {
+        JsonAdapter::Pack(globalreg, writer, in_elem);
+        return;
+    }
+
+    bool first = true;
+
+    writer.put('{');
+
+    // Resolve everything first; missing values are stand-ins with no id, so
+    // in a summary map they come before everything found, in request order
+    for (unsigned int i = 0; i < fields.size(); i++) {
+        values[i] = GetTrackerElementPath(fields[i].path, in_elem);
+
+        if (values[i] != NULL)
+            continue;
+
+        if (!first)
+            writer.put(',');
+        first = false;
+
+        writer.write(fields[i].missing_key);
+        writer.put('0');
+    }
+
+    for (auto i : output_order) {
+        plan_field& f = fields[i];
+        SharedTrackerElement& v = values[i];
+
+        if (v == NULL)
+            continue;
+
+        if (!first)
+            writer.put(',');
+        first = false;
+
+        if (f.renamed) {
+            writer.write(f.key);
+        } else if (v->has_local_name()) {
+            writer.write_string(v->get_local_name());
+            writer.write(": ", 2);
+        } else {
+            writer.write(globalreg->entrytracker->GetFieldJsonKey(v->get_id()));
+        }
+
+        // Pre-serialize the path down to the value, as serializing a summary
+        // does; the value itself is handled by packing it
+        parents.clear();
+
+        if (f.renamed || f.pathed) {
+            SharedTrackerElement inter = in_elem;
+
+            for (unsigned int p = 0; p + 1 < f.path.size(); p++) {
+                inter = inter->get_map_value(f.path[p]);
+                inter->pre_serialize();
+                parents.push_back(inter);
+            }
+        }
+
+        JsonAdapter::Pack(globalreg, writer, v);
+
+        for (auto pi = parents.rbegin(); pi != parents.rend(); ++pi)
+            (*pi)->post_serialize();
+
+        v.reset();
+    }
+
+    parents.clear();
+
+    writer.put('}');
+}
+
+void JsonAdapter::PackStream(GlobalRegistry *globalreg, std::ostream &stream,
+    const SharedTrackerElement& e, TrackerElementSerializer::rename_map *name_map,
+    TrackerElementSerializer::serial_cache_map *cache_map) {
 
     if (e == NULL) {
         stream << "0";
         return;
     }
 
+    // Unchanged elements which were already serialized are written as-is
+    if (cache_map != NULL) {
+        TrackerElementSerializer::serial_cache_map::iterator ci = 
+            cache_map->find(e.get());
+        if (ci != cache_map->end()) {
+            stream.write(ci->second->data(), ci->second->length());
+            return;
+        }
+    }
+
     // If we have a rename map, find out if we've got a pathed element that needs
-    // to be custom-serialized
+    // to be custom-serialized, and remember it so it can be released the same
+    // way after output
+    SharedElementSummary path_summary;
+
     if (name_map != NULL) {
         TrackerElementSerializer::rename_map::iterator nmi = name_map->find(e);
-        if (nmi != name_map->end()) {
-            TrackerElementSerializer::pre_serialize_path(nmi->second);
-        } else {
-            e->pre_serialize();
-        } 
-    } else {
-        e->pre_serialize();
+        if (nmi != name_map->end())
+            path_summary = nmi->second;
     }
 
+    if (path_summary != NULL)
+        TrackerElementSerializer::pre_serialize_path(path_summary);
+    else
+        e->pre_serialize();
+
     TrackerElement::tracked_vector *tvec;
     TrackerElement::vector_iterator vec_iter;
 
@@ -80,6 +723,12 @@ void JsonAdapter::Pack(GlobalRegistry *globalreg, std::ostream &stream,
     TrackerElement::tracked_double_map *tdoublemap;
     TrackerElement::double_map_iterator double_map_iter;
 
+    TrackerElement::tracked_small_int_map *tsmallintmap;
+    TrackerElement::small_int_map_iterator small_int_map_iter;
+
+    TrackerElement::tracked_small_double_map *tsmalldoublemap;
+    TrackerElement::small_double_map_iterator small_double_map_iter;
+
     mac_addr mac;
     uuid euuid;
 
@@ -138,7 +787,7 @@ void JsonAdapter::Pack(GlobalRegistry *globalreg, std::ostream &stream,
             tvec = e->get_vector();
             stream << "[";
             for (vec_iter = tvec->begin(); vec_iter != tvec->end(); /* */ ) {
-                JsonAdapter::Pack(globalreg, stream, *vec_iter, name_map);
+                JsonAdapter::PackStream(globalreg, stream, *vec_iter, name_map, cache_map);
                 if (++vec_iter != tvec->end())
                     stream << ",";
             }
@@ -174,7 +823,7 @@ void JsonAdapter::Pack(GlobalRegistry *globalreg, std::ostream &stream,
                 stream << "\"" << 
                     tname <<
                     "\": ";
-                JsonAdapter::Pack(globalreg, stream, map_iter->second, name_map);
+                JsonAdapter::PackStream(globalreg, stream, map_iter->second, name_map, cache_map);
                 if (++map_iter != tmap->end()) // Increment iter in loop
                     stream << ",";
             }
@@ -186,7 +835,7 @@ void JsonAdapter::Pack(GlobalRegistry *globalreg, std::ostream &stream,
             for (int_map_iter = tintmap->begin(); int_map_iter != tintmap->end(); /* */) {
                 // Integer dictionary keys in json are still quoted as strings
                 stream << "\"" << int_map_iter->first << "\": ";
-                JsonAdapter::Pack(globalreg, stream, int_map_iter->second, name_map);
+                JsonAdapter::PackStream(globalreg, stream, int_map_iter->second, name_map, cache_map);
                 if (++int_map_iter != tintmap->end()) // Increment iter in loop
                     stream << ",";
             }
@@ -199,7 +848,7 @@ void JsonAdapter::Pack(GlobalRegistry *globalreg, std::ostream &stream,
                     mac_map_iter != tmacmap->end(); /* */) {
                 // Mac keys are strings and we push only the mac not the mask */
                 stream << "\"" << mac_map_iter->first.Mac2String() << "\": ";
-                JsonAdapter::Pack(globalreg, stream, mac_map_iter->second, name_map);
+                JsonAdapter::PackStream(globalreg, stream, mac_map_iter->second, name_map, cache_map);
                 if (++mac_map_iter != tmacmap->end())
                     stream << ",";
             }
@@ -211,7 +860,7 @@ void JsonAdapter::Pack(GlobalRegistry *globalreg, std::ostream &stream,
             for (string_map_iter = tstringmap->begin();
                     string_map_iter != tstringmap->end(); /* */) {
                 stream << "\"" << string_map_iter->first << "\": ";
-                JsonAdapter::Pack(globalreg, stream, string_map_iter->second, name_map);
+                JsonAdapter::PackStream(globalreg, stream, string_map_iter->second, name_map, cache_map);
                 if (++string_map_iter != tstringmap->end())
                     stream << ",";
             }
@@ -224,12 +873,38 @@ void JsonAdapter::Pack(GlobalRegistry *globalreg, std::ostream &stream,
                     double_map_iter != tdoublemap->end(); /* */) {
                 // Double keys are handled as strings in json
                 stream << "\"" << fixed << double_map_iter->first << "\": ";
-                JsonAdapter::Pack(globalreg, stream, double_map_iter->second, name_map);
+                JsonAdapter::PackStream(globalreg, stream, double_map_iter->second, name_map, cache_map);
                 if (++double_map_iter != tdoublemap->end())
                     stream << ",";
             }
             stream << "}";
             break;
+        case TrackerSmallIntMap:
+            tsmallintmap = e->get_smallintmap();
+            stream << "{";
+            for (small_int_map_iter = tsmallintmap->begin(); 
+                    small_int_map_iter != tsmallintmap->end(); /* */) {
+                stream << "\"" << small_int_map_iter->first << "\": ";
+                JsonAdapter::PackStream(globalreg, stream, small_int_map_iter->second, 
+                        name_map, cache_map);
+                if (++small_int_map_iter != tsmallintmap->end())
+                    stream << ",";
+            }
+            stream << "}";
+            break;
+        case TrackerSmallDoubleMap:
+            tsmalldoublemap = e->get_smalldoublemap();
+            stream << "{";
+            for (small_double_map_iter = tsmalldoublemap->begin();
+                    small_double_map_iter != tsmalldoublemap->end(); /* */) {
+                stream << "\"" << fixed << small_double_map_iter->first << "\": ";
+                JsonAdapter::PackStream(globalreg, stream, small_double_map_iter->second, 
+                        name_map, cache_map);
+                if (++small_double_map_iter != tsmalldoublemap->end())
+                    stream << ",";
+            }
+            stream << "}";
+            break;
         case TrackerByteArray:
             bytes = e->get_bytearray();
             sz = e->get_bytearray_size();
@@ -250,4 +925,9 @@ void JsonAdapter::Pack(GlobalRegistry *globalreg, std::ostream &stream,
         default:
             break;
     }
+
+    if (path_summary != NULL)
+        TrackerElementSerializer::post_serialize_path(path_summary);
+    else
+        e->post_serialize();
 }
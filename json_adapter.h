@@ -21,7 +21,10 @@
 
 #include "config.h"
 
+#include <string.h>
+
 #include "globalregistry.h"
+#include "configfile.h"
 #include "trackedelement.h"
 #include "devicetracker_component.h"
 
@@ -30,21 +33,164 @@
 // BufferHandlerOStreambuf or similar
 namespace JsonAdapter {
 
-void Pack(GlobalRegistry *globalreg, std::ostream &stream, SharedTrackerElement e,
-        TrackerElementSerializer::rename_map *name_map = NULL);
+// Formats JSON into a local buffer and hands it to the stream in large
+// blocks with write(), so output goes straight to the stream buffer without
+// the per-value formatting, locale, and sentry cost of operator<<.  Pending
+// output is written when the buffer fills and when the writer is destroyed.
+class json_writer {
+public:
+    json_writer(std::ostream& in_stream) :
+        stream(in_stream), len(0) { }
+
+    ~json_writer() {
+        flush();
+    }
+
+    void flush() {
+        if (len != 0) {
+            stream.write(buf, len);
+            len = 0;
+        }
+    }
+
+    void put(char c) {
+        if (len == sizeof(buf))
+            flush();
+
+        buf[len++] = c;
+    }
+
+    void write(const char *in_data, size_t in_len) {
+        if (in_len > sizeof(buf) - len) {
+            flush();
+
+            if (in_len > sizeof(buf)) {
+                stream.write(in_data, in_len);
+                return;
+            }
+        }
+
+        memcpy(buf + len, in_data, in_len);
+        len += in_len;
+    }
+
+    void write(const string& in_str) {
+        write(in_str.data(), in_str.length());
+    }
+
+    void write_uint(uint64_t v);
+    void write_int(int64_t v);
+
+    // Shortest text which reads back as the same value; JSON has no
+    // representation for nan or infinity, so those are written as 0
+    void write_double(double v);
+    void write_float(float v);
+
+    // Fixed 6-digit form, matching the ostream 'fixed' output
+    void write_fixed(double v);
+
+    // Quoted string, escaped in a single pass
+    void write_string(const char *in_str, size_t in_len);
+    void write_string(const string& in_str) {
+        write_string(in_str.data(), in_str.length());
+    }
+
+    // Quoted uppercase hex
+    void write_hex(const uint8_t *in_data, size_t in_len);
+
+protected:
+    void write_decimal(uint64_t in_scaled, bool in_negative, int in_places);
+
+    std::ostream& stream;
+
+    char buf[8192];
+    size_t len;
+};
+
+void Pack(GlobalRegistry *globalreg, std::ostream &stream, const SharedTrackerElement& e,
+        TrackerElementSerializer::rename_map *name_map = NULL,
+        TrackerElementSerializer::serial_cache_map *cache_map = NULL);
+
+// Pack into a writer already in use
+void Pack(GlobalRegistry *globalreg, json_writer &writer, const SharedTrackerElement& e,
+        TrackerElementSerializer::rename_map *name_map = NULL,
+        TrackerElementSerializer::serial_cache_map *cache_map = NULL);
+
+// Pack by formatting each value through the ostream; slower, kept for
+// json_direct_writer=false
+void PackStream(GlobalRegistry *globalreg, std::ostream &stream, 
+        const SharedTrackerElement& e,
+        TrackerElementSerializer::rename_map *name_map = NULL,
+        TrackerElementSerializer::serial_cache_map *cache_map = NULL);
 
 string SanitizeString(string in);
 
+// A field summary compiled once for a request and applied to every device
+// in it.  Packing an element through the plan writes the same JSON as
+// packing the result of SummarizeTrackerElement with its rename map, but
+// resolves the fields straight from the element into the writer with the
+// keys already encoded, instead of building a summary map and rename records
+// for each element.
+class SummaryPlan {
+public:
+    SummaryPlan(GlobalRegistry *in_globalreg,
+            const vector<SharedElementSummary>& in_summary);
+
+    void Pack(json_writer& writer, SharedTrackerElement in_elem);
+
+protected:
+    struct plan_field {
+        vector<int> path;
+
+        // Field the value is keyed by in the summary map
+        int field_id;
+
+        // Renamed or pathed fields pre-serialize the path down to them
+        bool renamed, pathed;
+
+        // Encoded keys, with separator, for a found and a missing value
+        string key;
+        string missing_key;
+    };
+
+    GlobalRegistry *globalreg;
+
+    // In request order, and the order they're written in (the order of the
+    // fields in a summary map); fields with no path are left out
+    vector<plan_field> fields;
+    vector<unsigned int> output_order;
+
+    // Nothing to summarize, elements are packed whole
+    bool passthrough;
+
+    // Per-element scratch
+    vector<SharedTrackerElement> values;
+    vector<SharedTrackerElement> parents;
+};
+
 class Serializer : public TrackerElementSerializer {
 public:
     Serializer(GlobalRegistry *in_globalreg) :
-        TrackerElementSerializer(in_globalreg) { }
+        TrackerElementSerializer(in_globalreg) {
+        direct_writer = true;
+
+        if (globalreg->kismet_config != NULL)
+            direct_writer =
+                globalreg->kismet_config->FetchOptBoolean("json_direct_writer", 1);
+    }
 
     virtual void serialize(SharedTrackerElement in_elem, std::ostream &stream,
-            rename_map *name_map = NULL) {
+            rename_map *name_map = NULL, serial_cache_map *cache_map = NULL) {
         local_locker lock(&mutex);
-        Pack(globalreg, stream, in_elem, name_map);
+
+        if (direct_writer)
+            Pack(globalreg, stream, in_elem, name_map, cache_map);
+        else
+            PackStream(globalreg, stream, in_elem, name_map, cache_map);
     }
+
+protected:
+    bool direct_writer;
 };
 
 }
@@ -61,23 +207,49 @@ string SanitizeString(string in);
 class Serializer : public TrackerElementSerializer {
 public:
     Serializer(GlobalRegistry *in_globalreg) :
-        TrackerElementSerializer(in_globalreg) { }
+        TrackerElementSerializer(in_globalreg) {
+        direct_writer = true;
+
+        if (globalreg->kismet_config != NULL)
+            direct_writer =
+                globalreg->kismet_config->FetchOptBoolean("json_direct_writer", 1);
+    }
 
     virtual void serialize(SharedTrackerElement in_elem, std::ostream &stream,
-            rename_map *name_map = NULL) {
+            rename_map *name_map = NULL, serial_cache_map *cache_map = NULL) {
         local_locker lock(&mutex);
 
+        if (!direct_writer) {
+            if (in_elem->get_type() == TrackerVector) {
+                TrackerElementVector v(in_elem);
+
+                for (auto i : v) {
+                    JsonAdapter::PackStream(globalreg, stream, i, name_map, cache_map);
+                    stream << "\n";
+                }
+            } else {
+                JsonAdapter::PackStream(globalreg, stream, in_elem, name_map, cache_map);
+            }
+
+            return;
+        }
+
+        JsonAdapter::json_writer writer(stream);
+
         if (in_elem->get_type() == TrackerVector) {
             TrackerElementVector v(in_elem);
 
             for (auto i : v) {
-                JsonAdapter::Pack(globalreg, stream, i, name_map);
-                stream << "\n";
+                JsonAdapter::Pack(globalreg, writer, i, name_map, cache_map);
+                writer.put('\n');
             }
         } else {
-            JsonAdapter::Pack(globalreg, stream, in_elem, name_map);
+            JsonAdapter::Pack(globalreg, writer, in_elem, name_map, cache_map);
         }
     }
+
+protected:
+    bool direct_writer;
 };
 
 }
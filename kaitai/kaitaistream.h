@@ -7,11 +7,52 @@
 #include <istream>
 #include <fstream>
 #include <sstream>
+#include <list>
 #include <stdint.h>
+#include <string.h>
 #include <sys/types.h>
+#include <endian.h>
+#include <byteswap.h>
 
 namespace kaitai {
 
+/**
+ * Bytes read from a stream without copying them: a pointer into the buffer a
+ * memory stream reads from, and a length.  A view is only valid as long as the
+ * buffer is, so a structure holding views must not outlive the frame it was
+ * parsed from.  Views compare equal to strings with the same bytes, and
+ * convert to a string for anything which has to keep them.
+ */
+class kbytes {
+public:
+    kbytes() : m_data(NULL), m_len(0) { }
+    kbytes(const char *data, size_t len) : m_data(data), m_len(len) { }
+
+    const char *data() const { return m_data; }
+    size_t size() const { return m_len; }
+    size_t length() const { return m_len; }
+    bool empty() const { return m_len == 0; }
+
+    char operator[](size_t i) const { return m_data[i]; }
+
+    std::string str() const { return std::string(m_data, m_len); }
+    operator std::string() const { return str(); }
+
+    bool operator==(const kbytes& o) const {
+        return m_len == o.m_len && (m_len == 0 || memcmp(m_data, o.m_data, m_len) == 0);
+    }
+    bool operator!=(const kbytes& o) const { return !(*this == o); }
+
+    bool operator==(const std::string& o) const {
+        return *this == kbytes(o.data(), o.length());
+    }
+    bool operator!=(const std::string& o) const { return !(*this == o); }
+
+private:
+    const char *m_data;
+    size_t m_len;
+};
+
 /**
  * Kaitai Stream class (kaitai::kstream) is an implementation of
  * <a href="https://github.com/kaitai-io/kaitai_struct/wiki/Kaitai-Struct-stream-API">Kaitai Struct stream API</a>
@@ -39,11 +80,37 @@ public:
 
     /**
      * Constructs new Kaitai Stream object, wrapping a given in-memory data
-     * buffer.
+     * buffer.  The buffer is read in place, not copied, so it must outlive
+     * the stream.
      * \param data data buffer to use for this Kaitai Stream
      */
     kstream(std::string& data);
 
+    /**
+     * Constructs new Kaitai Stream object reading directly from memory, such
+     * as a captured frame, without a std::istream.  The buffer is read in
+     * place and must outlive the stream.  Reading past the end throws
+     * std::ios_base::failure, the same as a stream.
+     * \param data start of the buffer
+     * \param len length of the buffer
+     */
+    kstream(const char *data, size_t len);
+
+    /**
+     * Constructs new Kaitai Stream object reading a view from another stream in
+     * place, for substreams.
+     * \param data bytes to read, which must outlive the stream
+     */
+    kstream(const kbytes& data);
+
+    /**
+     * Streams hold no resources of their own, so the ones generated parsers
+     * allocate for substreams are carved from the active parse arena, if any,
+     * the same as the structures (see kaitai::arena).
+     */
+    static void *operator new(size_t sz);
+    static void operator delete(void *ptr);
+
     void close();
 
     /** @name Stream positioning */
@@ -80,49 +147,51 @@ public:
     /** @name Integer numbers */
     //@{
 
+    // Reads from memory streams are inlined: a bounds check and a load
+
     // ------------------------------------------------------------------------
     // Signed
     // ------------------------------------------------------------------------
 
-    int8_t read_s1();
+    int8_t read_s1() { return read_fixed<int8_t>(); }
 
     // ........................................................................
     // Big-endian
     // ........................................................................
 
-    int16_t read_s2be();
-    int32_t read_s4be();
-    int64_t read_s8be();
+    int16_t read_s2be() { return be16toh(read_fixed<uint16_t>()); }
+    int32_t read_s4be() { return be32toh(read_fixed<uint32_t>()); }
+    int64_t read_s8be() { return be64toh(read_fixed<uint64_t>()); }
 
     // ........................................................................
     // Little-endian
     // ........................................................................
 
-    int16_t read_s2le();
-    int32_t read_s4le();
-    int64_t read_s8le();
+    int16_t read_s2le() { return le16toh(read_fixed<uint16_t>()); }
+    int32_t read_s4le() { return le32toh(read_fixed<uint32_t>()); }
+    int64_t read_s8le() { return le64toh(read_fixed<uint64_t>()); }
 
     // ------------------------------------------------------------------------
     // Unsigned
     // ------------------------------------------------------------------------
 
-    uint8_t read_u1();
+    uint8_t read_u1() { return read_fixed<uint8_t>(); }
 
     // ........................................................................
     // Big-endian
     // ........................................................................
 
-    uint16_t read_u2be();
-    uint32_t read_u4be();
-    uint64_t read_u8be();
+    uint16_t read_u2be() { return be16toh(read_fixed<uint16_t>()); }
+    uint32_t read_u4be() { return be32toh(read_fixed<uint32_t>()); }
+    uint64_t read_u8be() { return be64toh(read_fixed<uint64_t>()); }
 
     // ........................................................................
     // Little-endian
     // ........................................................................
 
-    uint16_t read_u2le();
-    uint32_t read_u4le();
-    uint64_t read_u8le();
+    uint16_t read_u2le() { return le16toh(read_fixed<uint16_t>()); }
+    uint32_t read_u4le() { return le32toh(read_fixed<uint32_t>()); }
+    uint64_t read_u8le() { return le64toh(read_fixed<uint64_t>()); }
 
     //@}
 
@@ -133,15 +202,15 @@ public:
     // Big-endian
     // ........................................................................
 
-    float read_f4be();
-    double read_f8be();
+    float read_f4be() { return as_float(be32toh(read_fixed<uint32_t>())); }
+    double read_f8be() { return as_double(be64toh(read_fixed<uint64_t>())); }
 
     // ........................................................................
     // Little-endian
     // ........................................................................
 
-    float read_f4le();
-    double read_f8le();
+    float read_f4le() { return as_float(le32toh(read_fixed<uint32_t>())); }
+    double read_f8le() { return as_double(le64toh(read_fixed<uint64_t>())); }
 
     //@}
 
@@ -161,6 +230,20 @@ public:
     std::string read_bytes_term(char term, bool include, bool consume, bool eos_error);
     std::string ensure_fixed_contents(std::string expected);
 
+    /**
+     * As read_bytes and read_bytes_full, without copying the bytes out of a
+     * memory stream.  Views read from a std::istream are copied into the
+     * stream and live as long as it does.
+     */
+    kbytes read_bytes_view(ssize_t len);
+    kbytes read_bytes_full_view();
+
+    /**
+     * Reads the expected bytes and returns them; reading anything else throws
+     * std::runtime_error.
+     */
+    kbytes ensure_fixed_view(const char *expected, size_t len);
+
     static std::string bytes_strip_right(std::string src, char pad_byte);
     static std::string bytes_terminate(std::string src, char term, bool include);
     static std::string bytes_to_str(std::string src, std::string src_enc);
@@ -231,14 +314,58 @@ public:
     static std::string reverse(std::string val);
 
 private:
+    // Either m_io is set, or the stream reads from m_buf
     std::istream* m_io;
-    std::istringstream m_io_str;
+    const char *m_buf;
+    size_t m_buf_len;
+    size_t m_buf_pos;
     int m_bits_left;
     uint64_t m_bits;
 
+    // Copies of the views read from m_io
+    std::list<std::string> m_views;
+
     void init();
     void exceptions_enable() const;
 
+    // Read exactly len bytes or throw
+    void read_raw(char *buf, size_t len);
+
+    // Take len bytes in place from a memory stream, or NULL for a std::istream
+    // or too few bytes left, for read_raw to handle (or throw)
+    const char *take(size_t len) {
+        if (m_io != NULL || len > m_buf_len - m_buf_pos)
+            return NULL;
+
+        const char *r = m_buf + m_buf_pos;
+        m_buf_pos += len;
+        return r;
+    }
+
+    template<typename T> T read_fixed() {
+        T t;
+        const char *p = take(sizeof(T));
+
+        if (p != NULL)
+            memcpy(&t, p, sizeof(T));
+        else
+            read_raw(reinterpret_cast<char *>(&t), sizeof(T));
+
+        return t;
+    }
+
+    static float as_float(uint32_t v) {
+        float f;
+        memcpy(&f, &v, sizeof(f));
+        return f;
+    }
+
+    static double as_double(uint64_t v) {
+        double d;
+        memcpy(&d, &v, sizeof(d));
+        return d;
+    }
+
     static uint64_t get_mask_ones(int n);
 
     static const int ZLIB_BUF_SIZE = 128 * 1024;
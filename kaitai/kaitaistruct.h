@@ -3,11 +3,89 @@
 
 #include <kaitai/kaitaistream.h>
 
+#include <stddef.h>
+
 namespace kaitai {
 
+/**
+ * Bump allocator for the objects of a single parse.
+ *
+ * Generated parsers allocate every substructure with new, and most of them
+ * never free what they allocate.  While an arena_scope is active on a thread,
+ * structures and substreams created on that thread are carved from its arena
+ * instead.  Deleting a structure runs its destructor but leaves the memory to
+ * the arena; when the arena is destroyed, every structure which is still alive
+ * is destroyed in the order it was created, and the memory is released at
+ * once.  The first block lives inside the arena itself, so a parser on the
+ * stack with an arena on the stack rarely touches the heap for structures.
+ *
+ * Anything taken from an arena must not be used after the arena is destroyed.
+ */
+class arena {
+public:
+    arena();
+    ~arena();
+
+    void *alloc(size_t sz);
+
+    // Allocate from the active arena, or the heap when there isn't one; a
+    // structure in an arena is destroyed with it unless it was deleted first
+    static void *allocate(size_t sz, bool is_struct);
+    // Free something from allocate(); arena allocations are left for the arena
+    static void release(void *ptr);
+
+    // The active arena on this thread, or NULL
+    static arena *current();
+
+    // Precedes every allocation, and keeps the allocation 16 byte aligned
+    struct header {
+        arena *owner;
+        header *next;
+        bool live_struct;
+    } __attribute__((aligned(16)));
+
+private:
+    friend class arena_scope;
+
+    arena(const arena&);
+    arena& operator=(const arena&);
+
+    struct block {
+        block *next;
+    } __attribute__((aligned(16)));
+
+    static const size_t INLINE_SIZE = 1024;
+
+    alignas(16) char m_inline[INLINE_SIZE];
+
+    char *m_pos;
+    char *m_end;
+    block *m_blocks;
+
+    // Allocations in order, for destroying the structures
+    header *m_first;
+    header *m_last;
+};
+
+/**
+ * Makes an arena the active one on this thread for the life of the scope
+ */
+class arena_scope {
+public:
+    arena_scope(arena *a);
+    ~arena_scope();
+
+private:
+    arena *m_prev;
+};
+
 class kstruct {
 public:
     kstruct(kstream *_io) { m__io = _io; };
+    virtual ~kstruct() { }
+
+    static void *operator new(size_t sz) { return arena::allocate(sz, true); }
+    static void operator delete(void *ptr) { arena::release(ptr); }
 protected:
     kstream *m__io;
 public:
@@ -8,7 +8,6 @@
 
 #include <stdint.h>
 #include <vector>
-#include <sstream>
 
 #if KAITAI_STRUCT_VERSION < 7000L
 #error "Incompatible Kaitai Struct C++/STL API: version 0.7 or later is required"
@@ -23,14 +22,14 @@ public:
 
 private:
     uint8_t m_tag_length;
-    std::string m_vendor_oui;
+    kaitai::kbytes m_vendor_oui;
     uint8_t m_vendor_type;
     ie221_t* m__root;
     kaitai::kstruct* m__parent;
 
 public:
     uint8_t tag_length() const { return m_tag_length; }
-    std::string vendor_oui() const { return m_vendor_oui; }
+    kaitai::kbytes vendor_oui() const { return m_vendor_oui; }
     uint8_t vendor_type() const { return m_vendor_type; }
     ie221_t* _root() const { return m__root; }
     kaitai::kstruct* _parent() const { return m__parent; }
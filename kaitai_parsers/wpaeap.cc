@@ -2,8 +2,6 @@
 
 #include "wpaeap.h"
 
-#include <iostream>
-#include <fstream>
 
 wpaeap_t::wpaeap_t(kaitai::kstream *p_io, kaitai::kstruct *p_parent, wpaeap_t *p_root) : kaitai::kstruct(p_io) {
     m__parent = p_parent;
@@ -55,7 +53,7 @@ wpaeap_t::eapol_field_messagetype_t::~eapol_field_messagetype_t() {
 wpaeap_t::eapol_field_macaddress_t::eapol_field_macaddress_t(kaitai::kstream *p_io, kaitai::kstruct *p_parent, wpaeap_t *p_root) : kaitai::kstruct(p_io) {
     m__parent = p_parent;
     m__root = p_root;
-    m_macaddress = m__io->read_bytes(6);
+    m_macaddress = m__io->read_bytes_view(6);
 }
 
 wpaeap_t::eapol_field_macaddress_t::~eapol_field_macaddress_t() {
@@ -78,13 +76,13 @@ wpaeap_t::eapol_rsn_key_t::eapol_rsn_key_t(kaitai::kstream *p_io, wpaeap_t::dot1
     m_key_information = new eapol_rsn_key_info_t(m__io, this, m__root);
     m_key_length = m__io->read_u2be();
     m_replay_counter = m__io->read_u8be();
-    m_wpa_key_nonce = m__io->read_bytes(32);
-    m_key_iv = m__io->read_bytes(16);
-    m_wpa_key_rsc = m__io->read_bytes(8);
-    m_wpa_key_id = m__io->read_bytes(8);
-    m_wpa_key_mic = m__io->read_bytes(16);
+    m_wpa_key_nonce = m__io->read_bytes_view(32);
+    m_key_iv = m__io->read_bytes_view(16);
+    m_wpa_key_rsc = m__io->read_bytes_view(8);
+    m_wpa_key_id = m__io->read_bytes_view(8);
+    m_wpa_key_mic = m__io->read_bytes_view(16);
     m_wpa_key_data_length = m__io->read_u2be();
-    m_wpa_key_data = m__io->read_bytes(wpa_key_data_length());
+    m_wpa_key_data = m__io->read_bytes_view(wpa_key_data_length());
 }
 
 wpaeap_t::eapol_rsn_key_t::~eapol_rsn_key_t() {
@@ -108,7 +106,7 @@ wpaeap_t::dot1x_key_t::~dot1x_key_t() {
 wpaeap_t::eapol_field_uuid_t::eapol_field_uuid_t(kaitai::kstream *p_io, wpaeap_t::eapol_field_t *p_parent, wpaeap_t *p_root) : kaitai::kstruct(p_io) {
     m__parent = p_parent;
     m__root = p_root;
-    m_uuid = m__io->read_bytes(16);
+    m_uuid = m__io->read_bytes_view(16);
 }
 
 wpaeap_t::eapol_field_uuid_t::~eapol_field_uuid_t() {
@@ -183,42 +181,42 @@ wpaeap_t::eapol_field_t::eapol_field_t(kaitai::kstream *p_io, wpaeap_t::eapol_ex
     m_field_length = m__io->read_u2be();
     switch (type()) {
     case EAPOL_FIELD_TYPE_ENUM_CONFIG_METHODS:
-        m__raw_content = m__io->read_bytes(field_length());
+        m__raw_content = m__io->read_bytes_view(field_length());
         m__io__raw_content = new kaitai::kstream(m__raw_content);
         m_content = new eapol_field_config_methods_t(m__io__raw_content, this, m__root);
         break;
     case EAPOL_FIELD_TYPE_ENUM_UUID:
-        m__raw_content = m__io->read_bytes(field_length());
+        m__raw_content = m__io->read_bytes_view(field_length());
         m__io__raw_content = new kaitai::kstream(m__raw_content);
         m_content = new eapol_field_uuid_t(m__io__raw_content, this, m__root);
         break;
     case EAPOL_FIELD_TYPE_ENUM_VERSION:
-        m__raw_content = m__io->read_bytes(field_length());
+        m__raw_content = m__io->read_bytes_view(field_length());
         m__io__raw_content = new kaitai::kstream(m__raw_content);
         m_content = new eapol_field_version_t(m__io__raw_content, this, m__root);
         break;
     case EAPOL_FIELD_TYPE_ENUM_ENCRYPTION_TYPE_FLAGS:
-        m__raw_content = m__io->read_bytes(field_length());
+        m__raw_content = m__io->read_bytes_view(field_length());
         m__io__raw_content = new kaitai::kstream(m__raw_content);
         m_content = new eapol_field_encryption_type_flags_t(m__io__raw_content, this, m__root);
         break;
     case EAPOL_FIELD_TYPE_ENUM_AUTH_TYPE_FLAGS:
-        m__raw_content = m__io->read_bytes(field_length());
+        m__raw_content = m__io->read_bytes_view(field_length());
         m__io__raw_content = new kaitai::kstream(m__raw_content);
         m_content = new eapol_field_auth_type_flags_t(m__io__raw_content, this, m__root);
         break;
     case EAPOL_FIELD_TYPE_ENUM_MESSAGE_TYPE:
-        m__raw_content = m__io->read_bytes(field_length());
+        m__raw_content = m__io->read_bytes_view(field_length());
         m__io__raw_content = new kaitai::kstream(m__raw_content);
         m_content = new eapol_field_messagetype_t(m__io__raw_content, this, m__root);
         break;
     case EAPOL_FIELD_TYPE_ENUM_CONNECTION_TYPE_FLAGS:
-        m__raw_content = m__io->read_bytes(field_length());
+        m__raw_content = m__io->read_bytes_view(field_length());
         m__io__raw_content = new kaitai::kstream(m__raw_content);
         m_content = new eapol_field_connection_type_flags_t(m__io__raw_content, this, m__root);
         break;
     default:
-        m__raw_content = m__io->read_bytes(field_length());
+        m__raw_content = m__io->read_bytes_view(field_length());
         break;
     }
 }
@@ -229,7 +227,7 @@ wpaeap_t::eapol_field_t::~eapol_field_t() {
 wpaeap_t::eapol_extended_wpa_wps_t::eapol_extended_wpa_wps_t(kaitai::kstream *p_io, wpaeap_t::dot1x_eapol_t *p_parent, wpaeap_t *p_root) : kaitai::kstruct(p_io) {
     m__parent = p_parent;
     m__root = p_root;
-    m_vendor_id = m__io->ensure_fixed_contents(std::string("\x00\x37\x2A", 3));
+    m_vendor_id = m__io->ensure_fixed_view("\x00\x37\x2A", 3);
     m_vendor_type = static_cast<wpaeap_t::eapol_wfa_vendortype_enum_t>(m__io->read_u4be());
     m_opcode = static_cast<wpaeap_t::eapol_wfa_opcode_t>(m__io->read_u1());
     m_flags = m__io->read_u1();
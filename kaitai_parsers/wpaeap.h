@@ -8,7 +8,6 @@
 
 #include <stdint.h>
 #include <vector>
-#include <sstream>
 
 #if KAITAI_STRUCT_VERSION < 7000L
 #error "Incompatible Kaitai Struct C++/STL API: version 0.7 or later is required"
@@ -160,12 +159,12 @@ public:
         ~eapol_field_macaddress_t();
 
     private:
-        std::string m_macaddress;
+        kaitai::kbytes m_macaddress;
         wpaeap_t* m__root;
         kaitai::kstruct* m__parent;
 
     public:
-        std::string macaddress() const { return m_macaddress; }
+        kaitai::kbytes macaddress() const { return m_macaddress; }
         wpaeap_t* _root() const { return m__root; }
         kaitai::kstruct* _parent() const { return m__parent; }
     };
@@ -203,13 +202,13 @@ public:
         eapol_rsn_key_info_t* m_key_information;
         uint16_t m_key_length;
         uint64_t m_replay_counter;
-        std::string m_wpa_key_nonce;
-        std::string m_key_iv;
-        std::string m_wpa_key_rsc;
-        std::string m_wpa_key_id;
-        std::string m_wpa_key_mic;
+        kaitai::kbytes m_wpa_key_nonce;
+        kaitai::kbytes m_key_iv;
+        kaitai::kbytes m_wpa_key_rsc;
+        kaitai::kbytes m_wpa_key_id;
+        kaitai::kbytes m_wpa_key_mic;
         uint16_t m_wpa_key_data_length;
-        std::string m_wpa_key_data;
+        kaitai::kbytes m_wpa_key_data;
         wpaeap_t* m__root;
         wpaeap_t::dot1x_key_t* m__parent;
 
@@ -217,13 +216,13 @@ public:
         eapol_rsn_key_info_t* key_information() const { return m_key_information; }
         uint16_t key_length() const { return m_key_length; }
         uint64_t replay_counter() const { return m_replay_counter; }
-        std::string wpa_key_nonce() const { return m_wpa_key_nonce; }
-        std::string key_iv() const { return m_key_iv; }
-        std::string wpa_key_rsc() const { return m_wpa_key_rsc; }
-        std::string wpa_key_id() const { return m_wpa_key_id; }
-        std::string wpa_key_mic() const { return m_wpa_key_mic; }
+        kaitai::kbytes wpa_key_nonce() const { return m_wpa_key_nonce; }
+        kaitai::kbytes key_iv() const { return m_key_iv; }
+        kaitai::kbytes wpa_key_rsc() const { return m_wpa_key_rsc; }
+        kaitai::kbytes wpa_key_id() const { return m_wpa_key_id; }
+        kaitai::kbytes wpa_key_mic() const { return m_wpa_key_mic; }
         uint16_t wpa_key_data_length() const { return m_wpa_key_data_length; }
-        std::string wpa_key_data() const { return m_wpa_key_data; }
+        kaitai::kbytes wpa_key_data() const { return m_wpa_key_data; }
         wpaeap_t* _root() const { return m__root; }
         wpaeap_t::dot1x_key_t* _parent() const { return m__parent; }
     };
@@ -256,12 +255,12 @@ public:
         ~eapol_field_uuid_t();
 
     private:
-        std::string m_uuid;
+        kaitai::kbytes m_uuid;
         wpaeap_t* m__root;
         wpaeap_t::eapol_field_t* m__parent;
 
     public:
-        std::string uuid() const { return m_uuid; }
+        kaitai::kbytes uuid() const { return m_uuid; }
         wpaeap_t* _root() const { return m__root; }
         wpaeap_t::eapol_field_t* _parent() const { return m__parent; }
     };
@@ -395,7 +394,7 @@ public:
         kaitai::kstruct* m_content;
         wpaeap_t* m__root;
         wpaeap_t::eapol_extended_wpa_wps_t* m__parent;
-        std::string m__raw_content;
+        kaitai::kbytes m__raw_content;
         kaitai::kstream* m__io__raw_content;
 
     public:
@@ -404,7 +403,7 @@ public:
         kaitai::kstruct* content() const { return m_content; }
         wpaeap_t* _root() const { return m__root; }
         wpaeap_t::eapol_extended_wpa_wps_t* _parent() const { return m__parent; }
-        std::string _raw_content() const { return m__raw_content; }
+        kaitai::kbytes _raw_content() const { return m__raw_content; }
         kaitai::kstream* _io__raw_content() const { return m__io__raw_content; }
     };
 
@@ -416,7 +415,7 @@ public:
         ~eapol_extended_wpa_wps_t();
 
     private:
-        std::string m_vendor_id;
+        kaitai::kbytes m_vendor_id;
         eapol_wfa_vendortype_enum_t m_vendor_type;
         eapol_wfa_opcode_t m_opcode;
         uint8_t m_flags;
@@ -425,7 +424,7 @@ public:
         wpaeap_t::dot1x_eapol_t* m__parent;
 
     public:
-        std::string vendor_id() const { return m_vendor_id; }
+        kaitai::kbytes vendor_id() const { return m_vendor_id; }
         eapol_wfa_vendortype_enum_t vendor_type() const { return m_vendor_type; }
         eapol_wfa_opcode_t opcode() const { return m_opcode; }
         uint8_t flags() const { return m_flags; }
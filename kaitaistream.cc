@@ -1,27 +1,74 @@
 #include <kaitai/kaitaistream.h>
+#include <kaitai/kaitaistruct.h>
 
 #include <endian.h>
 #include <byteswap.h>
 
+#include <string.h>
+
 #include <iostream>
 #include <vector>
 #include <stdexcept>
 
 kaitai::kstream::kstream(std::istream* io) {
     m_io = io;
+    m_buf = NULL;
+    m_buf_len = 0;
+    m_buf_pos = 0;
+    init();
+}
+
+kaitai::kstream::kstream(std::string& data) {
+    m_io = NULL;
+    m_buf = data.data();
+    m_buf_len = data.length();
+    m_buf_pos = 0;
     init();
 }
 
-kaitai::kstream::kstream(std::string& data): m_io_str(data) {
-    m_io = &m_io_str;
+kaitai::kstream::kstream(const char *data, size_t len) {
+    m_io = NULL;
+    m_buf = data;
+    m_buf_len = len;
+    m_buf_pos = 0;
     init();
 }
 
+kaitai::kstream::kstream(const kbytes& data) {
+    m_io = NULL;
+    m_buf = data.data();
+    m_buf_len = data.size();
+    m_buf_pos = 0;
+    init();
+}
+
+void *kaitai::kstream::operator new(size_t sz) {
+    return arena::allocate(sz, false);
+}
+
+void kaitai::kstream::operator delete(void *ptr) {
+    arena::release(ptr);
+}
+
 void kaitai::kstream::init() {
-    exceptions_enable();
+    if (m_io != NULL)
+        exceptions_enable();
     align_to_byte();
 }
 
+void kaitai::kstream::read_raw(char *buf, size_t len) {
+    if (m_io != NULL) {
+        m_io->read(buf, len);
+        return;
+    }
+
+    if (len > m_buf_len - m_buf_pos)
+        throw std::ios_base::failure("kstream: read past end of buffer");
+
+    memcpy(buf, m_buf + m_buf_pos, len);
+    m_buf_pos += len;
+}
+
 void kaitai::kstream::close() {
     //  m_io->close();
 }
@@ -39,6 +86,9 @@ void kaitai::kstream::exceptions_enable() const {
 // ========================================================================
 
 bool kaitai::kstream::is_eof() const {
+    if (m_io == NULL)
+        return m_buf_pos >= m_buf_len;
+
     char t;
     m_io->exceptions(
         std::istream::badbit
@@ -56,14 +106,27 @@ bool kaitai::kstream::is_eof() const {
 }
 
 void kaitai::kstream::seek(uint64_t pos) {
+    if (m_io == NULL) {
+        if (pos > m_buf_len)
+            throw std::ios_base::failure("kstream: seek past end of buffer");
+        m_buf_pos = pos;
+        return;
+    }
+
     m_io->seekg(pos);
 }
 
 uint64_t kaitai::kstream::pos() {
+    if (m_io == NULL)
+        return m_buf_pos;
+
     return m_io->tellg();
 }
 
 uint64_t kaitai::kstream::size() {
+    if (m_io == NULL)
+        return m_buf_len;
+
     std::ifstream::pos_type cur_pos = m_io->tellg();
     m_io->seekg(0, std::ios::end);
     std::ifstream::pos_type len = m_io->tellg();
@@ -71,202 +134,6 @@ uint64_t kaitai::kstream::size() {
     return len;
 }
 
-// ========================================================================
-// Integer numbers
-// ========================================================================
-
-// ------------------------------------------------------------------------
-// Signed
-// ------------------------------------------------------------------------
-
-int8_t kaitai::kstream::read_s1() {
-    char t;
-    m_io->get(t);
-    return t;
-}
-
-// ........................................................................
-// Big-endian
-// ........................................................................
-
-int16_t kaitai::kstream::read_s2be() {
-    int16_t t;
-    m_io->read(reinterpret_cast<char *>(&t), 2);
-#if __BYTE_ORDER == __LITTLE_ENDIAN
-    t = bswap_16(t);
-#endif
-    return t;
-}
-
-int32_t kaitai::kstream::read_s4be() {
-    int32_t t;
-    m_io->read(reinterpret_cast<char *>(&t), 4);
-#if __BYTE_ORDER == __LITTLE_ENDIAN
-    t = bswap_32(t);
-#endif
-    return t;
-}
-
-int64_t kaitai::kstream::read_s8be() {
-    int64_t t;
-    m_io->read(reinterpret_cast<char *>(&t), 8);
-#if __BYTE_ORDER == __LITTLE_ENDIAN
-    t = bswap_64(t);
-#endif
-    return t;
-}
-
-// ........................................................................
-// Little-endian
-// ........................................................................
-
-int16_t kaitai::kstream::read_s2le() {
-    int16_t t;
-    m_io->read(reinterpret_cast<char *>(&t), 2);
-#if __BYTE_ORDER == __BIG_ENDIAN
-    t = bswap_16(t);
-#endif
-    return t;
-}
-
-int32_t kaitai::kstream::read_s4le() {
-    int32_t t;
-    m_io->read(reinterpret_cast<char *>(&t), 4);
-#if __BYTE_ORDER == __BIG_ENDIAN
-    t = bswap_32(t);
-#endif
-    return t;
-}
-
-int64_t kaitai::kstream::read_s8le() {
-    int64_t t;
-    m_io->read(reinterpret_cast<char *>(&t), 8);
-#if __BYTE_ORDER == __BIG_ENDIAN
-    t = bswap_64(t);
-#endif
-    return t;
-}
-
-// ------------------------------------------------------------------------
-// Unsigned
-// ------------------------------------------------------------------------
-
-uint8_t kaitai::kstream::read_u1() {
-    char t;
-    m_io->get(t);
-    return t;
-}
-
-// ........................................................................
-// Big-endian
-// ........................................................................
-
-uint16_t kaitai::kstream::read_u2be() {
-    uint16_t t;
-    m_io->read(reinterpret_cast<char *>(&t), 2);
-#if __BYTE_ORDER == __LITTLE_ENDIAN
-    t = bswap_16(t);
-#endif
-    return t;
-}
-
-uint32_t kaitai::kstream::read_u4be() {
-    uint32_t t;
-    m_io->read(reinterpret_cast<char *>(&t), 4);
-#if __BYTE_ORDER == __LITTLE_ENDIAN
-    t = bswap_32(t);
-#endif
-    return t;
-}
-
-uint64_t kaitai::kstream::read_u8be() {
-    uint64_t t;
-    m_io->read(reinterpret_cast<char *>(&t), 8);
-#if __BYTE_ORDER == __LITTLE_ENDIAN
-    t = bswap_64(t);
-#endif
-    return t;
-}
-
-// ........................................................................
-// Little-endian
-// ........................................................................
-
-uint16_t kaitai::kstream::read_u2le() {
-    uint16_t t;
-    m_io->read(reinterpret_cast<char *>(&t), 2);
-#if __BYTE_ORDER == __BIG_ENDIAN
-    t = bswap_16(t);
-#endif
-    return t;
-}
-
-uint32_t kaitai::kstream::read_u4le() {
-    uint32_t t;
-    m_io->read(reinterpret_cast<char *>(&t), 4);
-#if __BYTE_ORDER == __BIG_ENDIAN
-    t = bswap_32(t);
-#endif
-    return t;
-}
-
-uint64_t kaitai::kstream::read_u8le() {
-    uint64_t t;
-    m_io->read(reinterpret_cast<char *>(&t), 8);
-#if __BYTE_ORDER == __BIG_ENDIAN
-    t = bswap_64(t);
-#endif
-    return t;
-}
-
-// ========================================================================
-// Floating point numbers
-// ========================================================================
-
-// ........................................................................
-// Big-endian
-// ........................................................................
-
-float kaitai::kstream::read_f4be() {
-    uint32_t t;
-    m_io->read(reinterpret_cast<char *>(&t), 4);
-#if __BYTE_ORDER == __LITTLE_ENDIAN
-    t = bswap_32(t);
-#endif
-    return reinterpret_cast<float&>(t);
-}
-
-double kaitai::kstream::read_f8be() {
-    uint64_t t;
-    m_io->read(reinterpret_cast<char *>(&t), 8);
-#if __BYTE_ORDER == __LITTLE_ENDIAN
-    t = bswap_64(t);
-#endif
-    return reinterpret_cast<double&>(t);
-}
-
-// ........................................................................
-// Little-endian
-// ........................................................................
-
-float kaitai::kstream::read_f4le() {
-    uint32_t t;
-    m_io->read(reinterpret_cast<char *>(&t), 4);
-#if __BYTE_ORDER == __BIG_ENDIAN
-    t = bswap_32(t);
-#endif
-    return reinterpret_cast<float&>(t);
-}
-
-double kaitai::kstream::read_f8le() {
-    uint64_t t;
-    m_io->read(reinterpret_cast<char *>(&t), 8);
-#if __BYTE_ORDER == __BIG_ENDIAN
-    t = bswap_64(t);
-#endif
-    return reinterpret_cast<double&>(t);
-}
-
 // ========================================================================
 // Unaligned bit values
 // ========================================================================
@@ -286,7 +153,7 @@ uint64_t kaitai::kstream::read_bits_int(int n) {
         if (bytes_needed > 8)
             throw std::runtime_error("read_bits_int: more than 8 bytes requested");
         char buf[8];
-        m_io->read(buf, bytes_needed);
+        read_raw(buf, bytes_needed);
         for (int i = 0; i < bytes_needed; i++) {
             uint8_t b = buf[i];
             m_bits <<= 8;
@@ -323,12 +190,31 @@ uint64_t kaitai::kstream::get_mask_ones(int n) {
 // ========================================================================
 
 std::string kaitai::kstream::read_bytes(ssize_t len) {
-    std::vector<char> result(len);
-    m_io->read(&result[0], len);
-    return std::string(result.begin(), result.end());
+    if (len < 0)
+        throw std::ios_base::failure("kstream: negative read length");
+
+    if (m_io == NULL) {
+        if ((size_t) len > m_buf_len - m_buf_pos)
+            throw std::ios_base::failure("kstream: read past end of buffer");
+
+        std::string result(m_buf + m_buf_pos, len);
+        m_buf_pos += len;
+        return result;
+    }
+
+    std::string result(len, '\0');
+    if (len > 0)
+        m_io->read(&result[0], len);
+    return result;
 }
 
 std::string kaitai::kstream::read_bytes_full() {
+    if (m_io == NULL) {
+        std::string result(m_buf + m_buf_pos, m_buf_len - m_buf_pos);
+        m_buf_pos = m_buf_len;
+        return result;
+    }
+
     std::ifstream::pos_type p1 = m_io->tellg();
     m_io->seekg(0, std::ios::end);
     std::ifstream::pos_type p2 = m_io->tellg();
@@ -346,6 +232,22 @@ std::string kaitai::kstream::read_bytes_full() {
 }
 
 std::string kaitai::kstream::read_bytes_term(char term, bool include, bool consume, bool eos_error) {
+    if (m_io == NULL) {
+        const char *start = m_buf + m_buf_pos;
+        const char *t = (const char *) memchr(start, term, m_buf_len - m_buf_pos);
+
+        if (t == NULL) {
+            // encountered EOF
+            m_buf_pos = m_buf_len;
+            return std::string(start, m_buf_len - (start - m_buf));
+        }
+
+        // encountered terminator
+        std::string result(start, t - start + (include ? 1 : 0));
+        m_buf_pos = (t - m_buf) + (consume ? 1 : 0);
+        return result;
+    }
+
     std::string result;
     std::getline(*m_io, result, term);
     if (m_io->eof()) {
@@ -375,6 +277,39 @@ std::string kaitai::kstream::ensure_fixed_contents(std::string expected) {
     return actual;
 }
 
+kaitai::kbytes kaitai::kstream::read_bytes_view(ssize_t len) {
+    if (len < 0)
+        throw std::ios_base::failure("kstream: negative read length");
+
+    const char *p = take(len);
+
+    if (p != NULL)
+        return kbytes(p, len);
+
+    if (m_io == NULL)
+        throw std::ios_base::failure("kstream: read past end of buffer");
+
+    m_views.push_back(read_bytes(len));
+    return kbytes(m_views.back().data(), m_views.back().length());
+}
+
+kaitai::kbytes kaitai::kstream::read_bytes_full_view() {
+    if (m_io == NULL)
+        return read_bytes_view(m_buf_len - m_buf_pos);
+
+    m_views.push_back(read_bytes_full());
+    return kbytes(m_views.back().data(), m_views.back().length());
+}
+
+kaitai::kbytes kaitai::kstream::ensure_fixed_view(const char *expected, size_t len) {
+    kbytes actual = read_bytes_view(len);
+
+    if (memcmp(actual.data(), expected, len) != 0)
+        throw std::runtime_error("kstream: fixed contents mismatch");
+
+    return actual;
+}
+
 std::string kaitai::kstream::bytes_strip_right(std::string src, char pad_byte) {
     std::size_t new_len = src.length();
 
@@ -599,3 +534,112 @@ std::string kaitai::kstream::bytes_to_str(std::string src, std::string src_enc)
     return src;
 }
 #endif
+
+// ========================================================================
+// Parse arenas
+// ========================================================================
+
+namespace {
+
+size_t arena_round(size_t sz) {
+    return (sz + 15) & ~((size_t) 15);
+}
+
+thread_local kaitai::arena *active_arena = NULL;
+
+}
+
+kaitai::arena::arena() {
+    m_pos = m_inline;
+    m_end = m_inline + INLINE_SIZE;
+    m_blocks = NULL;
+    m_first = NULL;
+    m_last = NULL;
+}
+
+kaitai::arena::~arena() {
+    for (header *h = m_first; h != NULL; h = h->next) {
+        if (h->live_struct) {
+            h->live_struct = false;
+            reinterpret_cast<kstruct *>(h + 1)->~kstruct();
+        }
+    }
+
+    while (m_blocks != NULL) {
+        block *next = m_blocks->next;
+        ::operator delete(m_blocks);
+        m_blocks = next;
+    }
+}
+
+void *kaitai::arena::alloc(size_t sz) {
+    sz = arena_round(sz);
+
+    if (sz > (size_t) (m_end - m_pos)) {
+        size_t bsz = sz > 4096 ? sz : 4096;
+
+        block *b = (block *) ::operator new(sizeof(block) + bsz);
+        b->next = m_blocks;
+        m_blocks = b;
+
+        m_pos = (char *) (b + 1);
+        m_end = m_pos + bsz;
+    }
+
+    void *r = m_pos;
+    m_pos += sz;
+
+    return r;
+}
+
+void *kaitai::arena::allocate(size_t sz, bool is_struct) {
+    arena *a = active_arena;
+    header *h;
+
+    if (a != NULL) {
+        h = (header *) a->alloc(sizeof(header) + sz);
+
+        h->live_struct = is_struct;
+        h->next = NULL;
+
+        if (a->m_last != NULL)
+            a->m_last->next = h;
+        else
+            a->m_first = h;
+        a->m_last = h;
+    } else {
+        h = (header *) ::operator new(sizeof(header) + sz);
+        h->live_struct = false;
+        h->next = NULL;
+    }
+
+    h->owner = a;
+
+    return h + 1;
+}
+
+void kaitai::arena::release(void *ptr) {
+    if (ptr == NULL)
+        return;
+
+    header *h = (header *) ptr - 1;
+
+    // Already destroyed by whoever deleted it
+    h->live_struct = false;
+
+    if (h->owner == NULL)
+        ::operator delete(h);
+}
+
+kaitai::arena *kaitai::arena::current() {
+    return active_arena;
+}
+
+kaitai::arena_scope::arena_scope(arena *a) {
+    m_prev = active_arena;
+    active_arena = a;
+}
+
+kaitai::arena_scope::~arena_scope() {
+    active_arena = m_prev;
+}
@@ -0,0 +1,609 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <stdint.h>
+#include <string>
+
+#include "globalregistry.h"
+#include "trackedelement.h"
+#include "macaddr.h"
+#include "entrytracker.h"
+#include "uuid.h"
+#include "kbin_adapter.h"
+
+// Scalars go out in native order, the header tells the decoder which
+template<typename T> static inline void kbin_put(std::ostream &stream, T v) {
+    stream.write((const char *) &v, sizeof(T));
+}
+
+static inline void kbin_put_string(std::ostream &stream, const string& s) {
+    kbin_put<uint32_t>(stream, s.length());
+    stream.write(s.data(), s.length());
+}
+
+static inline void kbin_put_name(std::ostream &stream, const string& s) {
+    uint16_t len = s.length() > 0xFFFF ? 0xFFFF : s.length();
+    kbin_put<uint16_t>(stream, len);
+    stream.write(s.data(), len);
+}
+
+static inline void kbin_put_mac(std::ostream &stream, const mac_addr& m) {
+    kbin_put<uint64_t>(stream, m.longmac);
+    kbin_put<uint64_t>(stream, m.longmask);
+}
+
+static void kbin_put_header(std::ostream &stream) {
+    uint8_t flags = 0;
+    uint16_t probe = 1;
+
+    if (*((uint8_t *) &probe) == 1)
+        flags |= KBIN_FLAG_LITTLE_ENDIAN;
+
+    kbin_put<uint8_t>(stream, KBIN_HEADER);
+    stream.write("KBIN", 4);
+    kbin_put<uint8_t>(stream, KBIN_VERSION);
+    kbin_put<uint8_t>(stream, flags);
+}
+
+void KbinAdapter::Packer(GlobalRegistry *globalreg, std::ostream &stream,
+        SharedTrackerElement e, defined_fields &defined,
+        TrackerElementSerializer::rename_map *name_map,
+        TrackerElementSerializer::serial_cache_map *cache_map) {
+
+    if (e == NULL) {
+        kbin_put<uint8_t>(stream, TrackerUInt8);
+        kbin_put<uint8_t>(stream, 0);
+        return;
+    }
+
+    // Cached elements carry their own header and field definitions, so they
+    // can be written as-is anywhere an element is expected
+    if (cache_map != NULL) {
+        TrackerElementSerializer::serial_cache_map::iterator ci =
+            cache_map->find(e.get());
+        if (ci != cache_map->end()) {
+            stream.write(ci->second->data(), ci->second->length());
+            return;
+        }
+    }
+
+    // Pathed elements preserialize their parents, and release them the same
+    // way after output
+    SharedElementSummary path_summary;
+
+    if (name_map != NULL) {
+        TrackerElementSerializer::rename_map::iterator nmi = name_map->find(e);
+        if (nmi != name_map->end())
+            path_summary = nmi->second;
+    }
+
+    if (path_summary != NULL)
+        TrackerElementSerializer::pre_serialize_path(path_summary);
+    else
+        e->pre_serialize();
+
+    TrackerElement::tracked_vector *tvec;
+    TrackerElement::tracked_map *tmap;
+    TrackerElement::tracked_int_map *tintmap;
+    TrackerElement::tracked_mac_map *tmacmap;
+    TrackerElement::tracked_string_map *tstringmap;
+    TrackerElement::tracked_double_map *tdoublemap;
+
+    shared_ptr<uint8_t> bytes;
+    size_t sz;
+
+    kbin_put<uint8_t>(stream, e->get_type());
+
+    switch (e->get_type()) {
+        case TrackerString:
+            kbin_put_string(stream, GetTrackerValue<string>(e));
+            break;
+        case TrackerInt8:
+            kbin_put<int8_t>(stream, GetTrackerValue<int8_t>(e));
+            break;
+        case TrackerUInt8:
+            kbin_put<uint8_t>(stream, GetTrackerValue<uint8_t>(e));
+            break;
+        case TrackerInt16:
+            kbin_put<int16_t>(stream, GetTrackerValue<int16_t>(e));
+            break;
+        case TrackerUInt16:
+            kbin_put<uint16_t>(stream, GetTrackerValue<uint16_t>(e));
+            break;
+        case TrackerInt32:
+            kbin_put<int32_t>(stream, GetTrackerValue<int32_t>(e));
+            break;
+        case TrackerUInt32:
+            kbin_put<uint32_t>(stream, GetTrackerValue<uint32_t>(e));
+            break;
+        case TrackerInt64:
+            kbin_put<int64_t>(stream, GetTrackerValue<int64_t>(e));
+            break;
+        case TrackerUInt64:
+            kbin_put<uint64_t>(stream, GetTrackerValue<uint64_t>(e));
+            break;
+        case TrackerFloat:
+            kbin_put<float>(stream, GetTrackerValue<float>(e));
+            break;
+        case TrackerDouble:
+            kbin_put<double>(stream, GetTrackerValue<double>(e));
+            break;
+        case TrackerMac:
+            kbin_put_mac(stream, GetTrackerValue<mac_addr>(e));
+            break;
+        case TrackerUuid:
+            stream.write((const char *) GetTrackerValue<uuid>(e).uuid_block, 16);
+            break;
+        case TrackerVector:
+            tvec = e->get_vector();
+            kbin_put<uint32_t>(stream, tvec->size());
+            for (auto i : *tvec)
+                Packer(globalreg, stream, i, defined, name_map, cache_map);
+            break;
+        case TrackerMap:
+            tmap = e->get_map();
+            kbin_put<uint32_t>(stream, tmap->size());
+            for (auto i : *tmap) {
+                string tname;
+                TrackerElementSerializer::rename_map::iterator nmi;
+
+                // Renamed and locally named fields have no ID which means the
+                // right thing, so they're always sent by name
+                if (name_map != NULL &&
+                        (nmi = name_map->find(i.second)) != name_map->end() &&
+                        nmi->second->rename.length() != 0) {
+                    tname = nmi->second->rename;
+                } else if (i.second != NULL) {
+                    tname = i.second->get_local_name();
+                }
+
+                if (tname != "") {
+                    kbin_put<uint8_t>(stream, KBIN_KEY_NAME);
+                    kbin_put_name(stream, tname);
+                } else if (defined.find(i.first) != defined.end()) {
+                    kbin_put<uint8_t>(stream, KBIN_KEY_FIELD);
+                    kbin_put<int32_t>(stream, i.first);
+                } else {
+                    defined.insert(i.first);
+                    kbin_put<uint8_t>(stream, KBIN_KEY_FIELD_DEFINE);
+                    kbin_put<int32_t>(stream, i.first);
+                    kbin_put_name(stream,
+                            globalreg->entrytracker->GetFieldName(i.first));
+                }
+
+                Packer(globalreg, stream, i.second, defined, name_map, cache_map);
+            }
+            break;
+        case TrackerIntMap:
+            tintmap = e->get_intmap();
+            kbin_put<uint32_t>(stream, tintmap->size());
+            for (auto i : *tintmap) {
+                kbin_put<int32_t>(stream, i.first);
+                Packer(globalreg, stream, i.second, defined, name_map, cache_map);
+            }
+            break;
+        case TrackerMacMap:
+            tmacmap = e->get_macmap();
+            kbin_put<uint32_t>(stream, tmacmap->size());
+            for (auto i : *tmacmap) {
+                kbin_put_mac(stream, i.first);
+                Packer(globalreg, stream, i.second, defined, name_map, cache_map);
+            }
+            break;
+        case TrackerStringMap:
+            tstringmap = e->get_stringmap();
+            kbin_put<uint32_t>(stream, tstringmap->size());
+            for (auto i : *tstringmap) {
+                kbin_put_string(stream, i.first);
+                Packer(globalreg, stream, i.second, defined, name_map, cache_map);
+            }
+            break;
+        case TrackerDoubleMap:
+            tdoublemap = e->get_doublemap();
+            kbin_put<uint32_t>(stream, tdoublemap->size());
+            for (auto i : *tdoublemap) {
+                kbin_put<double>(stream, i.first);
+                Packer(globalreg, stream, i.second, defined, name_map, cache_map);
+            }
+            break;
+        case TrackerSmallIntMap:
+            kbin_put<uint32_t>(stream, e->get_smallintmap()->size());
+            for (const auto& i : *(e->get_smallintmap())) {
+                kbin_put<int32_t>(stream, i.first);
+                Packer(globalreg, stream, i.second, defined, name_map, cache_map);
+            }
+            break;
+        case TrackerSmallDoubleMap:
+            kbin_put<uint32_t>(stream, e->get_smalldoublemap()->size());
+            for (const auto& i : *(e->get_smalldoublemap())) {
+                kbin_put<double>(stream, i.first);
+                Packer(globalreg, stream, i.second, defined, name_map, cache_map);
+            }
+            break;
+        case TrackerByteArray:
+            bytes = e->get_bytearray();
+            sz = e->get_bytearray_size();
+
+            kbin_put<uint32_t>(stream, sz);
+            stream.write((const char *) bytes.get(), sz);
+            break;
+        default:
+            break;
+    }
+
+    if (path_summary != NULL)
+        TrackerElementSerializer::post_serialize_path(path_summary);
+    else
+        e->post_serialize();
+}
+
+void KbinAdapter::Pack(GlobalRegistry *globalreg, std::ostream &stream,
+        SharedTrackerElement e, TrackerElementSerializer::rename_map *name_map,
+        TrackerElementSerializer::serial_cache_map *cache_map) {
+    defined_fields defined;
+
+    kbin_put_header(stream);
+    Packer(globalreg, stream, e, defined, name_map, cache_map);
+}
+
+// Decoder cursor; every read is bounds checked and sets error instead of running
+// off the end of the data
+class kbin_reader {
+public:
+    kbin_reader(const uint8_t *in_data, size_t in_len) {
+        data = in_data;
+        len = in_len;
+        pos = 0;
+        error = false;
+    }
+
+    template<typename T> T get() {
+        T v;
+
+        if (error || len - pos < sizeof(T)) {
+            error = true;
+            return 0;
+        }
+
+        memcpy(&v, data + pos, sizeof(T));
+        pos += sizeof(T);
+
+        return v;
+    }
+
+    const uint8_t *get_bytes(size_t in_sz) {
+        if (error || len - pos < in_sz) {
+            error = true;
+            return NULL;
+        }
+
+        const uint8_t *r = data + pos;
+        pos += in_sz;
+
+        return r;
+    }
+
+    string get_string() {
+        uint32_t sz = get<uint32_t>();
+        const uint8_t *d = get_bytes(sz);
+
+        if (d == NULL)
+            return "";
+
+        return string((const char *) d, sz);
+    }
+
+    string get_name() {
+        uint16_t sz = get<uint16_t>();
+        const uint8_t *d = get_bytes(sz);
+
+        if (d == NULL)
+            return "";
+
+        return string((const char *) d, sz);
+    }
+
+    mac_addr get_mac() {
+        mac_addr m;
+        m.longmac = get<uint64_t>();
+        m.longmask = get<uint64_t>();
+        return m;
+    }
+
+    const uint8_t *data;
+    size_t len;
+    size_t pos;
+    bool error;
+};
+
+// Deeper than any record we write; only reached by corrupt data
+#define KBIN_MAX_DEPTH      64
+
+// Fields which moved from a tree map to a small map are still written as the
+// tree map by older stores; copy them into the type the field has now
+static SharedTrackerElement kbin_convert_map(const SharedTrackerElement& in_elem,
+        TrackerType in_type) {
+    SharedTrackerElement e;
+
+    if (in_type == TrackerSmallIntMap && in_elem->get_type() == TrackerIntMap) {
+        e.reset(new TrackerElement(TrackerSmallIntMap, in_elem->get_id()));
+        for (const auto& i : *(in_elem->get_intmap()))
+            e->add_smallintmap(i.first, i.second);
+    } else if (in_type == TrackerSmallDoubleMap &&
+            in_elem->get_type() == TrackerDoubleMap) {
+        e.reset(new TrackerElement(TrackerSmallDoubleMap, in_elem->get_id()));
+        for (const auto& i : *(in_elem->get_doublemap()))
+            e->add_smalldoublemap(i.first, i.second);
+    } else {
+        e = in_elem;
+    }
+
+    return e;
+}
+
+static SharedTrackerElement kbin_unpack(GlobalRegistry *globalreg, kbin_reader &rd,
+        KbinAdapter::stream_fields &fields, int in_id, int in_depth) {
+
+    if (in_depth > KBIN_MAX_DEPTH) {
+        rd.error = true;
+        return NULL;
+    }
+
+    uint8_t t = rd.get<uint8_t>();
+
+    if (rd.error)
+        return NULL;
+
+    SharedTrackerElement e;
+    uint32_t n;
+
+    switch (t) {
+        case TrackerString:
+            e.reset(new TrackerElement(TrackerString, in_id));
+            e->set(rd.get_string());
+            break;
+        case TrackerInt8:
+            e.reset(new TrackerElement(TrackerInt8, in_id));
+            e->set(rd.get<int8_t>());
+            break;
+        case TrackerUInt8:
+            e.reset(new TrackerElement(TrackerUInt8, in_id));
+            e->set(rd.get<uint8_t>());
+            break;
+        case TrackerInt16:
+            e.reset(new TrackerElement(TrackerInt16, in_id));
+            e->set(rd.get<int16_t>());
+            break;
+        case TrackerUInt16:
+            e.reset(new TrackerElement(TrackerUInt16, in_id));
+            e->set(rd.get<uint16_t>());
+            break;
+        case TrackerInt32:
+            e.reset(new TrackerElement(TrackerInt32, in_id));
+            e->set(rd.get<int32_t>());
+            break;
+        case TrackerUInt32:
+            e.reset(new TrackerElement(TrackerUInt32, in_id));
+            e->set(rd.get<uint32_t>());
+            break;
+        case TrackerInt64:
+            e.reset(new TrackerElement(TrackerInt64, in_id));
+            e->set(rd.get<int64_t>());
+            break;
+        case TrackerUInt64:
+            e.reset(new TrackerElement(TrackerUInt64, in_id));
+            e->set(rd.get<uint64_t>());
+            break;
+        case TrackerFloat:
+            e.reset(new TrackerElement(TrackerFloat, in_id));
+            e->set(rd.get<float>());
+            break;
+        case TrackerDouble:
+            e.reset(new TrackerElement(TrackerDouble, in_id));
+            e->set(rd.get<double>());
+            break;
+        case TrackerMac:
+            e.reset(new TrackerElement(TrackerMac, in_id));
+            e->set(rd.get_mac());
+            break;
+        case TrackerUuid: {
+            const uint8_t *ub = rd.get_bytes(16);
+
+            if (ub == NULL)
+                return NULL;
+
+            uuid u;
+            memcpy(u.uuid_block, ub, 16);
+
+            e.reset(new TrackerElement(TrackerUuid, in_id));
+            e->set(u);
+            break;
+        }
+        case TrackerVector:
+            e.reset(new TrackerElement(TrackerVector, in_id));
+            n = rd.get<uint32_t>();
+            for (uint32_t x = 0; x < n && !rd.error; x++) {
+                SharedTrackerElement c = kbin_unpack(globalreg, rd, fields, -1, in_depth + 1);
+                if (c != NULL)
+                    e->add_vector(c);
+            }
+            break;
+        case TrackerMap:
+            e.reset(new TrackerElement(TrackerMap, in_id));
+            n = rd.get<uint32_t>();
+            for (uint32_t x = 0; x < n && !rd.error; x++) {
+                uint8_t tag = rd.get<uint8_t>();
+                int sid = -1;
+                int fid = -1;
+                TrackerType ftype = TrackerString;
+                bool keep = false;
+
+                if (tag == KBIN_KEY_NAME) {
+                    // Locally named fields have no field to go back into
+                    rd.get_name();
+                } else if (tag == KBIN_KEY_FIELD || tag == KBIN_KEY_FIELD_DEFINE) {
+                    sid = rd.get<int32_t>();
+
+                    if (tag == KBIN_KEY_FIELD_DEFINE) {
+                        string fname = rd.get_name();
+                        if (fields.find(sid) == fields.end())
+                            KbinAdapter::DefineField(globalreg, fields, sid, fname);
+                    }
+
+                    auto fi = fields.find(sid);
+
+                    if (fi == fields.end()) {
+                        rd.error = true;
+                        return NULL;
+                    }
+
+                    fid = fi->second.id;
+                    ftype = fi->second.type;
+                    keep = fid >= 0;
+                } else {
+                    rd.error = true;
+                    return NULL;
+                }
+
+                SharedTrackerElement c = kbin_unpack(globalreg, rd, fields, fid, in_depth + 1);
+
+                if (keep && c != NULL && c->get_type() != ftype)
+                    c = kbin_convert_map(c, ftype);
+
+                // Empty dynamic fields are written as a placeholder byte; those,
+                // and anything which no longer matches the field, are dropped
+                if (keep && c != NULL && c->get_type() == ftype)
+                    e->add_map(fid, c);
+            }
+            break;
+        case TrackerIntMap:
+            e.reset(new TrackerElement(TrackerIntMap, in_id));
+            n = rd.get<uint32_t>();
+            for (uint32_t x = 0; x < n && !rd.error; x++) {
+                int32_t k = rd.get<int32_t>();
+                SharedTrackerElement c = kbin_unpack(globalreg, rd, fields, -1, in_depth + 1);
+                if (c != NULL)
+                    e->add_intmap(k, c);
+            }
+            break;
+        case TrackerMacMap:
+            e.reset(new TrackerElement(TrackerMacMap, in_id));
+            n = rd.get<uint32_t>();
+            for (uint32_t x = 0; x < n && !rd.error; x++) {
+                mac_addr k = rd.get_mac();
+                SharedTrackerElement c = kbin_unpack(globalreg, rd, fields, -1, in_depth + 1);
+                if (c != NULL)
+                    e->add_macmap(k, c);
+            }
+            break;
+        case TrackerStringMap:
+            e.reset(new TrackerElement(TrackerStringMap, in_id));
+            n = rd.get<uint32_t>();
+            for (uint32_t x = 0; x < n && !rd.error; x++) {
+                string k = rd.get_string();
+                SharedTrackerElement c = kbin_unpack(globalreg, rd, fields, -1, in_depth + 1);
+                if (c != NULL)
+                    e->add_stringmap(k, c);
+            }
+            break;
+        case TrackerDoubleMap:
+            e.reset(new TrackerElement(TrackerDoubleMap, in_id));
+            n = rd.get<uint32_t>();
+            for (uint32_t x = 0; x < n && !rd.error; x++) {
+                double k = rd.get<double>();
+                SharedTrackerElement c = kbin_unpack(globalreg, rd, fields, -1, in_depth + 1);
+                if (c != NULL)
+                    e->add_doublemap(k, c);
+            }
+            break;
+        case TrackerSmallIntMap:
+            e.reset(new TrackerElement(TrackerSmallIntMap, in_id));
+            n = rd.get<uint32_t>();
+            for (uint32_t x = 0; x < n && !rd.error; x++) {
+                int32_t k = rd.get<int32_t>();
+                SharedTrackerElement c = kbin_unpack(globalreg, rd, fields, -1, in_depth + 1);
+                if (c != NULL)
+                    e->add_smallintmap(k, c);
+            }
+            break;
+        case TrackerSmallDoubleMap:
+            e.reset(new TrackerElement(TrackerSmallDoubleMap, in_id));
+            n = rd.get<uint32_t>();
+            for (uint32_t x = 0; x < n && !rd.error; x++) {
+                double k = rd.get<double>();
+                SharedTrackerElement c = kbin_unpack(globalreg, rd, fields, -1, in_depth + 1);
+                if (c != NULL)
+                    e->add_smalldoublemap(k, c);
+            }
+            break;
+        case TrackerByteArray: {
+            n = rd.get<uint32_t>();
+            const uint8_t *b = rd.get_bytes(n);
+
+            if (b == NULL)
+                return NULL;
+
+            e.reset(new TrackerElement(TrackerByteArray, in_id));
+            e->set_bytearray((uint8_t *) b, n);
+            break;
+        }
+        default:
+            rd.error = true;
+            return NULL;
+    }
+
+    if (rd.error)
+        return NULL;
+
+    return e;
+}
+
+void KbinAdapter::DefineField(GlobalRegistry *globalreg, stream_fields &fields,
+        int in_stream_id, const string& in_name) {
+    stream_field f;
+
+    f.id = globalreg->entrytracker->GetFieldId(in_name);
+    f.type = TrackerString;
+
+    if (f.id >= 0) {
+        SharedTrackerElement proto = globalreg->entrytracker->GetTrackedInstance(f.id);
+
+        if (proto != NULL)
+            f.type = proto->get_type();
+        else
+            f.id = -1;
+    }
+
+    fields[in_stream_id] = f;
+}
+
+ssize_t KbinAdapter::Unpacker(GlobalRegistry *globalreg, const uint8_t *in_data,
+        size_t in_len, stream_fields &fields, SharedTrackerElement &ret_elem) {
+    kbin_reader rd(in_data, in_len);
+
+    ret_elem = kbin_unpack(globalreg, rd, fields, -1, 0);
+
+    if (rd.error) {
+        ret_elem.reset();
+        return -1;
+    }
+
+    return rd.pos;
+}
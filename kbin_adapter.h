@@ -0,0 +1,109 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __KBIN_ADAPTER_H__
+#define __KBIN_ADAPTER_H__
+
+#include "config.h"
+
+#include <set>
+#include <map>
+
+#include "globalregistry.h"
+#include "trackedelement.h"
+
+// Compact binary serialization adapter ("kbin").
+//
+// Every element is written as a one-byte TrackerType followed by its value;
+// scalars are fixed width in the native byte order of the server, and map
+// keys are written as field IDs, with the field name included the first time
+// an ID is used in the stream.  Field IDs are only stable for the life of the
+// server, so clients must learn them from the stream and never hard-code them.
+//
+// A header (KBIN_HEADER, "KBIN", version, flags) is written before the top
+// level element and may appear again before any element; decoders take the
+// byte order from the most recent header.
+//
+// See README.DEV.SERIALIZATION for the full layout
+namespace KbinAdapter {
+
+#define KBIN_VERSION            1
+
+// Pseudo-type which introduces a header
+#define KBIN_HEADER             0xFF
+
+// Header flags
+#define KBIN_FLAG_LITTLE_ENDIAN 0x01
+
+// Map key tags
+#define KBIN_KEY_FIELD          0x00
+#define KBIN_KEY_FIELD_DEFINE   0x01
+#define KBIN_KEY_NAME           0x02
+
+// Field IDs already named in this stream
+typedef std::set<int> defined_fields;
+
+void Packer(GlobalRegistry *globalreg, std::ostream &stream, SharedTrackerElement e,
+        defined_fields &defined,
+        TrackerElementSerializer::rename_map *name_map = NULL,
+        TrackerElementSerializer::serial_cache_map *cache_map = NULL);
+
+void Pack(GlobalRegistry *globalreg, std::ostream &stream, SharedTrackerElement e,
+        TrackerElementSerializer::rename_map *name_map = NULL,
+        TrackerElementSerializer::serial_cache_map *cache_map = NULL);
+
+// Decoding, for reading kbin records written by this server (such as saved
+// device state) back into tracked elements.  Only data in the native byte order
+// of the server is accepted.
+
+// Field IDs used in a stream, resolved to the field with the same name in this
+// server and its type.  Fields which no longer exist, or which have changed
+// type, resolve to an ID of -1 and are dropped when decoding.
+class stream_field {
+public:
+    int id;
+    TrackerType type;
+};
+typedef std::map<int, stream_field> stream_fields;
+
+// Resolve a field ID from a stream by name
+void DefineField(GlobalRegistry *globalreg, stream_fields &fields, int in_stream_id,
+        const string& in_name);
+
+// Decode a single element with no header.  Returns the number of bytes consumed,
+// or -1 if the data is malformed.  Fields defined in the data are added to
+// fields as they are found.
+ssize_t Unpacker(GlobalRegistry *globalreg, const uint8_t *in_data, size_t in_len,
+        stream_fields &fields, SharedTrackerElement &ret_elem);
+
+class Serializer : public TrackerElementSerializer {
+public:
+    Serializer(GlobalRegistry *in_globalreg) :
+        TrackerElementSerializer(in_globalreg) { }
+
+    virtual void serialize(SharedTrackerElement in_elem, std::ostream &stream,
+            rename_map *name_map = NULL, serial_cache_map *cache_map = NULL) {
+        local_locker lock(&mutex);
+        Pack(globalreg, stream, in_elem, name_map, cache_map);
+    }
+};
+
+}
+
+#endif
+
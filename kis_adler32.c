@@ -0,0 +1,220 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define KIS_ADLER32_X86
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define KIS_ADLER32_NEON
+#endif
+
+#include "kis_adler32.h"
+
+/* Block kernels consume as many whole blocks as they can from the front of the
+ * buffer, update s1 and s2, and return the number of bytes they consumed; the
+ * remainder is finished by the scalar loop.
+ *
+ * Over a block of n bytes b[0..n-1] the byte-at-a-time loop works out to
+ *
+ *   s2 += n * s1 + sum((n - j) * b[j])
+ *   s1 += sum(b[j])
+ *
+ * and since nothing is reduced modulo anything, the vector lanes can simply
+ * wrap; the result is identical to summing one byte at a time. */
+typedef size_t (*adler32_block_fn)(const uint8_t *, size_t, uint32_t *, uint32_t *);
+
+static size_t adler32_blocks_none(const uint8_t *in_buf __attribute__((unused)),
+        size_t in_len __attribute__((unused)),
+        uint32_t *s1 __attribute__((unused)), uint32_t *s2 __attribute__((unused))) {
+    return 0;
+}
+
+#ifdef KIS_ADLER32_X86
+__attribute__((target("sse2")))
+static inline uint32_t adler32_hsum_sse2(__m128i v) {
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return (uint32_t) _mm_cvtsi128_si32(v);
+}
+
+__attribute__((target("sse2")))
+static size_t adler32_blocks_sse2(const uint8_t *in_buf, size_t in_len,
+        uint32_t *s1, uint32_t *s2) {
+    size_t nblocks = in_len / 16;
+    size_t i;
+
+    const __m128i zero = _mm_setzero_si128();
+    /* Weights 16..9 for the low 8 bytes and 8..1 for the high 8 */
+    const __m128i w_lo = _mm_set_epi16(9, 10, 11, 12, 13, 14, 15, 16);
+    const __m128i w_hi = _mm_set_epi16(1, 2, 3, 4, 5, 6, 7, 8);
+
+    /* Byte sums, weighted sums, and the sum of s1 at the start of each block */
+    __m128i v_s1 = zero;
+    __m128i v_s2 = zero;
+    __m128i v_s1_blocks = zero;
+
+    for (i = 0; i < nblocks; i++) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (in_buf + (i * 16)));
+
+        v_s1_blocks = _mm_add_epi32(v_s1_blocks, v_s1);
+        v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(v, zero));
+        v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_unpacklo_epi8(v, zero), w_lo));
+        v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_unpackhi_epi8(v, zero), w_hi));
+    }
+
+    *s2 += (uint32_t) (nblocks * 16) * *s1 + 16 * adler32_hsum_sse2(v_s1_blocks) +
+        adler32_hsum_sse2(v_s2);
+    *s1 += adler32_hsum_sse2(v_s1);
+
+    return nblocks * 16;
+}
+
+__attribute__((target("avx2")))
+static size_t adler32_blocks_avx2(const uint8_t *in_buf, size_t in_len,
+        uint32_t *s1, uint32_t *s2) {
+    size_t nblocks = in_len / 32;
+    size_t i;
+
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi16(1);
+    /* Weights 32..1 */
+    const __m256i w = _mm256_set_epi8(1, 2, 3, 4, 5, 6, 7, 8,
+            9, 10, 11, 12, 13, 14, 15, 16,
+            17, 18, 19, 20, 21, 22, 23, 24,
+            25, 26, 27, 28, 29, 30, 31, 32);
+
+    __m256i v_s1 = zero;
+    __m256i v_s2 = zero;
+    __m256i v_s1_blocks = zero;
+
+    __m128i r_s1, r_s2, r_s1_blocks;
+
+    for (i = 0; i < nblocks; i++) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (in_buf + (i * 32)));
+
+        v_s1_blocks = _mm256_add_epi32(v_s1_blocks, v_s1);
+        v_s1 = _mm256_add_epi32(v_s1, _mm256_sad_epu8(v, zero));
+        v_s2 = _mm256_add_epi32(v_s2,
+                _mm256_madd_epi16(_mm256_maddubs_epi16(v, w), ones));
+    }
+
+    r_s1 = _mm_add_epi32(_mm256_castsi256_si128(v_s1),
+            _mm256_extracti128_si256(v_s1, 1));
+    r_s2 = _mm_add_epi32(_mm256_castsi256_si128(v_s2),
+            _mm256_extracti128_si256(v_s2, 1));
+    r_s1_blocks = _mm_add_epi32(_mm256_castsi256_si128(v_s1_blocks),
+            _mm256_extracti128_si256(v_s1_blocks, 1));
+
+    *s2 += (uint32_t) (nblocks * 32) * *s1 + 32 * adler32_hsum_sse2(r_s1_blocks) +
+        adler32_hsum_sse2(r_s2);
+    *s1 += adler32_hsum_sse2(r_s1);
+
+    return nblocks * 32;
+}
+#endif
+
+#ifdef KIS_ADLER32_NEON
+static size_t adler32_blocks_neon(const uint8_t *in_buf, size_t in_len,
+        uint32_t *s1, uint32_t *s2) {
+    size_t nblocks = in_len / 16;
+    size_t i;
+
+    /* Weights 16..9 for the low 8 bytes and 8..1 for the high 8 */
+    static const uint8_t w_lo_v[8] = { 16, 15, 14, 13, 12, 11, 10, 9 };
+    static const uint8_t w_hi_v[8] = { 8, 7, 6, 5, 4, 3, 2, 1 };
+    const uint8x8_t w_lo = vld1_u8(w_lo_v);
+    const uint8x8_t w_hi = vld1_u8(w_hi_v);
+
+    uint32x4_t v_s1 = vdupq_n_u32(0);
+    uint32x4_t v_s2 = vdupq_n_u32(0);
+    uint32x4_t v_s1_blocks = vdupq_n_u32(0);
+
+    for (i = 0; i < nblocks; i++) {
+        uint8x16_t v = vld1q_u8(in_buf + (i * 16));
+
+        v_s1_blocks = vaddq_u32(v_s1_blocks, v_s1);
+        v_s1 = vpadalq_u16(v_s1, vpaddlq_u8(v));
+        v_s2 = vpadalq_u16(v_s2, vmull_u8(vget_low_u8(v), w_lo));
+        v_s2 = vpadalq_u16(v_s2, vmull_u8(vget_high_u8(v), w_hi));
+    }
+
+    *s2 += (uint32_t) (nblocks * 16) * *s1 + 16 * vaddvq_u32(v_s1_blocks) +
+        vaddvq_u32(v_s2);
+    *s1 += vaddvq_u32(v_s1);
+
+    return nblocks * 16;
+}
+#endif
+
+static adler32_block_fn adler32_blocks = adler32_blocks_none;
+static pthread_once_t adler32_select_once = PTHREAD_ONCE_INIT;
+
+static void adler32_select(void) {
+#ifdef KIS_ADLER32_X86
+    unsigned int eax, ebx, ecx, edx;
+
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2")) {
+        adler32_blocks = adler32_blocks_avx2;
+        return;
+    }
+
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (edx & bit_SSE2)) {
+        adler32_blocks = adler32_blocks_sse2;
+        return;
+    }
+#endif
+
+#ifdef KIS_ADLER32_NEON
+    /* NEON is always present on arm64 */
+    adler32_blocks = adler32_blocks_neon;
+#endif
+}
+
+uint32_t kis_adler32_partial(const uint8_t *in_buf, size_t in_len,
+        uint32_t *s1, uint32_t *s2) {
+    size_t i;
+
+    if (in_len < 4)
+        return 0;
+
+    pthread_once(&adler32_select_once, adler32_select);
+
+    i = (*adler32_blocks)(in_buf, in_len, s1, s2);
+
+    for (; i + 4 <= in_len; i += 4) {
+        *s2 += 4 * (*s1 + in_buf[i]) + 3 * in_buf[i + 1] +
+            2 * in_buf[i + 2] + in_buf[i + 3];
+        *s1 += in_buf[i] + in_buf[i + 1] + in_buf[i + 2] + in_buf[i + 3];
+    }
+
+    for (; i < in_len; i++) {
+        *s1 += in_buf[i];
+        *s2 += *s1;
+    }
+
+    return (*s1 & 0xffff) + (*s2 << 16);
+}
+
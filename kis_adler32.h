@@ -0,0 +1,54 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __KIS_ADLER32_H__
+#define __KIS_ADLER32_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Checksum used by the simple capture protocol; shared by the Kismet server and
+ * the pure-C capture binaries so both sides of the link use the same code.
+ *
+ * This is the rsync flavor of adler32:  s1 is the running sum of the bytes and
+ * s2 the running sum of s1, both kept as plain wrapping 32 bit values with no
+ * modulus, and the result is (s1 & 0xFFFF) + (s2 << 16).  Buffers shorter than
+ * 4 bytes are not summed and return 0.  This must stay bit-for-bit identical to
+ * the original implementation, since it is on the wire.
+ *
+ * Blocks are summed with SSE2 or AVX2 on x86 and NEON on arm64, picked at
+ * runtime the first time it's called.
+ *
+ * To compute a checksum over multiple chunks, the caller preserves s1 and s2
+ * between calls; the first call must set s1 and s2 to 0.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+uint32_t kis_adler32_partial(const uint8_t *in_buf, size_t in_len,
+        uint32_t *s1, uint32_t *s2);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
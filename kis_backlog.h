@@ -0,0 +1,195 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __KIS_BACKLOG_H__
+#define __KIS_BACKLOG_H__
+
+#include "config.h"
+
+#include <stdint.h>
+#include <vector>
+
+// Fixed size backlog of the most recent records, such as messages or alerts
+//
+// Records are kept in a ring; adding one to a full backlog replaces the
+// oldest, and hands it back so the caller can release it.  Every record gets
+// the next of a sequence which never goes backwards, so a client can poll for
+// everything after the last sequence it saw, and is found by sequence directly.
+//
+// Records are also found by time with a binary search.  Times are allowed to
+// step backwards (the clock can be set back); the search runs on the latest
+// time seen up to each record, which never does, and the records it finds are
+// then checked against their own times.
+//
+// Not locked; the owner holds its own lock around it.
+template<class T>
+class kis_backlog {
+public:
+    kis_backlog(size_t in_capacity = 0) {
+        set_capacity(in_capacity);
+        next_seq = 0;
+    }
+
+    // Resizing throws away anything already in the backlog
+    void set_capacity(size_t in_capacity) {
+        slots.clear();
+        slots.resize(in_capacity);
+        first = 0;
+        count = 0;
+    }
+
+    size_t capacity() const { return slots.size(); }
+    size_t size() const { return count; }
+
+    // Sequence the next record will get
+    uint64_t get_next_seq() const { return next_seq; }
+
+    // Sequence of the oldest record still held
+    uint64_t get_first_seq() const { return next_seq - count; }
+
+    // Add a record, returning true and the record it replaced in
+    // ret_evicted if the backlog was full.  A backlog with no capacity
+    // hands the new record straight back.
+    bool push(const T& in_rec, double in_ts, T *ret_evicted) {
+        uint64_t seq = next_seq++;
+
+        if (slots.size() == 0) {
+            if (ret_evicted != NULL)
+                *ret_evicted = in_rec;
+            return true;
+        }
+
+        double key = in_ts;
+
+        if (count != 0) {
+            double last_key = slots[index(count - 1)].key;
+
+            if (last_key > key)
+                key = last_key;
+        }
+
+        bool evicted = false;
+        size_t pos;
+
+        if (count == slots.size()) {
+            pos = first;
+
+            if (ret_evicted != NULL)
+                *ret_evicted = slots[pos].rec;
+
+            first = (first + 1) % slots.size();
+            evicted = true;
+        } else {
+            pos = index(count);
+            count++;
+        }
+
+        slots[pos].rec = in_rec;
+        slots[pos].seq = seq;
+        slots[pos].ts = in_ts;
+        slots[pos].key = key;
+
+        return evicted;
+    }
+
+    // Call fn(seq, rec) for every record from the oldest
+    template<class F>
+    void for_each(F fn) const {
+        for (size_t x = 0; x < count; x++) {
+            const slot& s = slots[index(x)];
+            fn(s.seq, s.rec);
+        }
+    }
+
+    // Call fn(seq, rec) for every record with a sequence of in_seq or later
+    template<class F>
+    void for_each_from_seq(uint64_t in_seq, F fn) const {
+        uint64_t first_seq = get_first_seq();
+
+        if (in_seq < first_seq)
+            in_seq = first_seq;
+
+        for (size_t x = in_seq - first_seq; x < count; x++) {
+            const slot& s = slots[index(x)];
+            fn(s.seq, s.rec);
+        }
+    }
+
+    // Call fn(seq, rec) for every record newer than in_ts
+    template<class F>
+    void for_each_since_time(double in_ts, F fn) const {
+        // First record where the latest time so far is past in_ts; nothing
+        // before it can be newer
+        size_t lo = 0, hi = count;
+
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+
+            if (slots[index(mid)].key > in_ts)
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+
+        for (size_t x = lo; x < count; x++) {
+            const slot& s = slots[index(x)];
+
+            if (s.ts > in_ts)
+                fn(s.seq, s.rec);
+        }
+    }
+
+    // Empty the backlog, calling fn(rec) on every record to release it;
+    // sequences carry on from where they were
+    template<class F>
+    void clear(F fn) {
+        for (size_t x = 0; x < count; x++) {
+            slot& s = slots[index(x)];
+            fn(s.rec);
+            s.rec = T();
+        }
+
+        first = 0;
+        count = 0;
+    }
+
+    void clear() {
+        clear([](T&) { });
+    }
+
+protected:
+    struct slot {
+        T rec;
+        uint64_t seq;
+        double ts;
+        // Latest time of this record and every one before it
+        double key;
+    };
+
+    // Position of the Nth oldest record
+    size_t index(size_t in_n) const {
+        return (first + in_n) % slots.size();
+    }
+
+    std::vector<slot> slots;
+    size_t first, count;
+    uint64_t next_seq;
+};
+
+#endif
+
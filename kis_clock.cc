@@ -0,0 +1,100 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include "kis_clock.h"
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#endif
+
+// Calibrating the TSC against CLOCK_MONOTONIC over this long gives a
+// multiplier good to a few parts per million, plenty for instrumentation
+#define KIS_CLOCK_CALIBRATE_NSEC    (20 * 1000 * 1000)
+
+std::atomic<uint64_t> KisClock::coarse_mono_usec(0);
+std::atomic<uint64_t> KisClock::coarse_wall_usec(0);
+std::atomic<uint64_t> KisClock::wall_offset_usec(0);
+std::atomic<uint64_t> KisClock::tsc_mult(0);
+uint64_t KisClock::tsc_base = 0;
+uint64_t KisClock::tsc_base_nsec = 0;
+
+static uint64_t mono_nsec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+void KisClock::Init() {
+    Update();
+
+#if defined(__x86_64__)
+    if (tsc_mult != 0)
+        return;
+
+    unsigned int eax, ebx, ecx, edx;
+
+    // Only an invariant TSC ticks at a constant rate through frequency changes
+    // and sleep states, and is synchronized between cores
+    if (__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) == 0 || eax < 0x80000007)
+        return;
+
+    if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) == 0 || (edx & (1 << 8)) == 0)
+        return;
+
+    uint64_t start_ns = mono_nsec();
+    uint64_t start_tsc = __rdtsc();
+
+    struct timespec wait;
+    wait.tv_sec = 0;
+    wait.tv_nsec = KIS_CLOCK_CALIBRATE_NSEC;
+    nanosleep(&wait, NULL);
+
+    uint64_t end_ns = mono_nsec();
+    uint64_t end_tsc = __rdtsc();
+
+    if (end_tsc <= start_tsc || end_ns <= start_ns)
+        return;
+
+    uint64_t mult = ((end_ns - start_ns) << 32) / (end_tsc - start_tsc);
+
+    if (mult == 0)
+        return;
+
+    tsc_base = end_tsc;
+    tsc_base_nsec = end_ns;
+    tsc_mult.store(mult, std::memory_order_release);
+#endif
+}
+
+void KisClock::Update() {
+    struct timespec mts;
+    struct timeval wtv;
+
+    clock_gettime(CLOCK_MONOTONIC, &mts);
+    gettimeofday(&wtv, NULL);
+
+    uint64_t mono = ((uint64_t) mts.tv_sec * 1000000ULL) + (mts.tv_nsec / 1000);
+    uint64_t wall = TimevalToUsec(wtv);
+
+    coarse_mono_usec.store(mono, std::memory_order_relaxed);
+    coarse_wall_usec.store(wall, std::memory_order_relaxed);
+    wall_offset_usec.store(wall - mono, std::memory_order_relaxed);
+}
+
@@ -0,0 +1,135 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __KIS_CLOCK_H__
+#define __KIS_CLOCK_H__
+
+#include "config.h"
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/time.h>
+#include <atomic>
+
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+// Central clock
+//
+// Everything which needs the time should read it here, so packets, trackers,
+// and timers agree on it:
+//
+//  coarse      monotonic and wall time as of the last Update, which the
+//              Timetracker calls every tick of the main loop; a relaxed load,
+//              so cheap enough for every packet.  globalreg->timestamp is the
+//              same wall time.
+//  precise     nanoseconds for instrumentation, from the TSC when the CPU has
+//              an invariant TSC (calibrated against CLOCK_MONOTONIC in Init),
+//              otherwise from CLOCK_MONOTONIC
+//  mapping     between monotonic and wall time, by their offset at the last
+//              Update
+//
+// Monotonic time doesn't move when the wall clock is stepped by NTP or set
+// from GPS, so intervals and timers are measured with it; wall time is only
+// for things which are shown or stored as a time of day.
+class KisClock {
+public:
+    // Calibrate the precise clock and read the coarse clocks; call once, early,
+    // before anything is timed
+    static void Init();
+
+    // Read the clocks into the coarse values
+    static void Update();
+
+    static uint64_t CoarseMonoUsec() {
+        return coarse_mono_usec.load(std::memory_order_relaxed);
+    }
+
+    static time_t CoarseWallSec() {
+        return coarse_wall_usec.load(std::memory_order_relaxed) / 1000000ULL;
+    }
+
+    static struct timeval CoarseWall() {
+        return UsecToTimeval(coarse_wall_usec.load(std::memory_order_relaxed));
+    }
+
+    // Monotonic time now, in microseconds
+    static uint64_t MonoUsec() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ((uint64_t) ts.tv_sec * 1000000ULL) + (ts.tv_nsec / 1000);
+    }
+
+    // Nanoseconds on the same epoch as CLOCK_MONOTONIC, for timing intervals;
+    // not guaranteed to agree exactly with MonoUsec
+    static uint64_t PreciseNsec() {
+#if defined(__x86_64__)
+        uint64_t mult = tsc_mult.load(std::memory_order_relaxed);
+
+        if (mult != 0) {
+            uint64_t delta = __rdtsc() - tsc_base;
+            return tsc_base_nsec + (uint64_t) (((unsigned __int128) delta * mult) >> 32);
+        }
+#endif
+
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ((uint64_t) ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+    }
+
+    // Is the precise clock the TSC?
+    static bool PreciseIsTSC() {
+        return tsc_mult.load(std::memory_order_relaxed) != 0;
+    }
+
+    static uint64_t MonoToWallUsec(uint64_t in_mono_usec) {
+        return in_mono_usec + wall_offset_usec.load(std::memory_order_relaxed);
+    }
+
+    static uint64_t WallToMonoUsec(uint64_t in_wall_usec) {
+        return in_wall_usec - wall_offset_usec.load(std::memory_order_relaxed);
+    }
+
+    static uint64_t TimevalToUsec(const struct timeval& in_tv) {
+        return ((uint64_t) in_tv.tv_sec * 1000000ULL) + (uint64_t) in_tv.tv_usec;
+    }
+
+    static struct timeval UsecToTimeval(uint64_t in_usec) {
+        struct timeval tv;
+        tv.tv_sec = in_usec / 1000000ULL;
+        tv.tv_usec = in_usec % 1000000ULL;
+        return tv;
+    }
+
+protected:
+    static std::atomic<uint64_t> coarse_mono_usec;
+    static std::atomic<uint64_t> coarse_wall_usec;
+    // Wall minus monotonic, modulo 2^64
+    static std::atomic<uint64_t> wall_offset_usec;
+
+    // TSC ticks to nanoseconds, as a 32.32 fixed point multiplier, from the
+    // CLOCK_MONOTONIC time at tsc_base; 0 when the TSC isn't used.  The base is
+    // only written by Init, before the multiplier is
+    static std::atomic<uint64_t> tsc_mult;
+    static uint64_t tsc_base;
+    static uint64_t tsc_base_nsec;
+};
+
+#endif
+
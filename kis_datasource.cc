@@ -19,6 +19,7 @@
 #include "config.h"
 
 #include "kis_datasource.h"
+#include "kis_probes.h"
 #include "simple_datasource_proto.h"
 #include "endian_magic.h"
 #include "configfile.h"
@@ -26,6 +27,10 @@
 #include "datasourcetracker.h"
 #include "entrytracker.h"
 #include "alertracker.h"
+#include "ringbuf_spsc.h"
+#include "ringbuf_shm.h"
+#include "cpu_affinity.h"
+#include "kis_clock.h"
 
 // We never instantiate from a generic tracker component or from a stored
 // record so we always re-allocate ourselves
@@ -64,12 +69,36 @@ KisDatasource::KisDatasource(GlobalRegistry *in_globalreg,
 
     next_cmd_sequence = rand(); 
 
+    validate_checksum = true;
+
+    read_backlogged = false;
+
+    // A source is made for every probe and list as well as every open
+    shared_ptr<const config_snapshot> conf = globalreg->kismet_config->FetchSnapshot();
+
+    offer_compression = conf->get_bool("remote_capture_compression", true);
+    inflate_stream = NULL;
+
+    offer_resume = conf->get_bool("remote_capture_resume", true);
+    last_data_seq = 0;
+    acked_data_seq = 0;
+
+    offer_datagram = conf->get_bool("remote_capture_datagram", false);
+    last_datagram_seq = 0;
+
     error_timer_id = -1;
     ping_timer_id = -1;
 
+    ingress_id = -1;
+    ingress_depth = 0;
+
     mode_probing = false;
     mode_listing = false;
 
+    shared_helper_id = 0;
+    shared_helper_capable = false;
+    ipc_shm_capable = false;
+
     shared_ptr<EntryTracker> entrytracker = 
         static_pointer_cast<EntryTracker>(globalreg->FetchGlobal("ENTRY_TRACKER"));
     listed_interface_builder =
@@ -79,12 +108,23 @@ KisDatasource::KisDatasource(GlobalRegistry *in_globalreg,
 
     last_pong = 0;
 
+    last_kernel_drops = 0;
+    last_helper_drops = 0;
+
     quiet_errors = 0;
 
+    reader_thread_enabled = false;
+    reader_pending = false;
+    reader_sleeping = false;
+    reader_stop = false;
+
     set_int_source_running(false);
 }
 
 KisDatasource::~KisDatasource() {
+    // The reader takes the source lock, so it has to be stopped before we hold it
+    StopReaderThread();
+
     local_eol_locker lock(&source_lock);
 
     // fprintf(stderr, "debug - ~KisDatasource\n");
@@ -96,6 +136,11 @@ KisDatasource::~KisDatasource() {
     if (ping_timer_id > 0)
         timetracker->RemoveTimer(ping_timer_id);
 
+    if (inflate_stream != NULL) {
+        inflateEnd(inflate_stream);
+        delete inflate_stream;
+    }
+
     // Delete the ringbuf handler
     if (ringbuf_handler != NULL) {
         // Remove ourself from getting notifications from the rb
@@ -111,6 +156,19 @@ KisDatasource::~KisDatasource() {
 
     ipc_remote.reset();
 
+    release_shared_helper();
+
+    if (ingress_id >= 0)
+        packetchain->RemoveIngress(ingress_id);
+
+    shared_ptr<CpuAffinity> affinity =
+        globalreg->FetchGlobalAs<CpuAffinity>("CPU_AFFINITY");
+
+    if (affinity != NULL) {
+        affinity->remove_placement(placement_name("helper"));
+        affinity->remove_placement(placement_name("reader"));
+    }
+
     // We don't call a normal close here because we can't risk double-free
     // or going through commands again - if the source is being deleted, it should
     // be completed!
@@ -314,10 +372,56 @@ void KisDatasource::connect_buffer(shared_ptr<BufferHandlerGeneric> in_ringbuf,
     // We're remote
     set_int_source_remote(true);
 
+    // Network links are always checksummed
+    validate_checksum = true;
+
     // Send an opensource
     send_command_open_interface(in_definition, 0, in_cb);
 }
 
+void KisDatasource::resume_buffer(shared_ptr<BufferHandlerGeneric> in_ringbuf) {
+    local_locker lock(&source_lock);
+
+    // Drop the old connection if it hasn't failed yet
+    if (ringbuf_handler != NULL && ringbuf_handler != in_ringbuf) {
+        ringbuf_handler->RemoveReadBufferInterface();
+        ringbuf_handler->ProtocolError();
+        ringbuf_handler = NULL;
+    }
+
+    ringbuf_handler = in_ringbuf;
+    ringbuf_handler->SetReadBufferInterface(this);
+
+    // The capture binary never closed the source, so pick up where we left off
+    quiet_errors = 0;
+    set_int_source_error(false);
+    set_int_source_error_reason("");
+    set_int_source_running(true);
+
+    _MSG("Resumed session for remote source " + get_source_name(), MSGFLAG_INFO);
+
+    // Tell the capture binary what we already have; it replays the rest
+    uint32_t seq_be = kis_hton32(last_data_seq);
+
+    KisDatasourceCapKeyedObject *dataseq =
+        new KisDatasourceCapKeyedObject("DATASEQ", (const char *) &seq_be, 
+                sizeof(uint32_t));
+
+    KVmap kvmap;
+    kvmap.emplace("DATASEQ", dataseq);
+
+    uint32_t seqno;
+    write_packet("RESUMERESP", kvmap, seqno);
+
+    delete(dataseq);
+
+    acked_data_seq = last_data_seq;
+
+    last_pong = 0;
+
+    start_ping_timer();
+}
+
 void KisDatasource::close_source() {
     local_locker lock(&source_lock);
 
@@ -337,6 +441,11 @@ void KisDatasource::close_source() {
         ipc_remote->soft_kill();
     }
 
+    detach_shared_helper();
+
+    // Stop taking datagrams
+    datagram_token = "";
+
     quiet_errors = true;
 
     cancel_all_commands("Closing source");
@@ -360,6 +469,79 @@ void KisDatasource::disable_source() {
 }
 
 void KisDatasource::BufferAvailable(size_t in_amt __attribute__((unused))) {
+    if (!reader_thread_enabled) {
+        ProcessBufferFrames();
+        return;
+    }
+
+    // Nothing new gets started once we're being torn down
+    if (reader_stop)
+        return;
+
+    if (!reader_thread.joinable())
+        StartReaderThread();
+
+    reader_pending = true;
+
+    if (reader_sleeping) {
+        std::lock_guard<std::mutex> lk(reader_mutex);
+        reader_cv.notify_one();
+    }
+}
+
+void KisDatasource::StartReaderThread() {
+    reader_thread = std::thread([this]() { ReaderThread(); });
+
+    shared_ptr<CpuAffinity> affinity =
+        globalreg->FetchGlobalAs<CpuAffinity>("CPU_AFFINITY");
+
+    if (affinity != NULL && cpu_affinity.length() != 0)
+        affinity->place_thread(placement_name("reader"), reader_thread.native_handle(),
+                cpu_affinity);
+}
+
+string KisDatasource::placement_name(string in_what) {
+    return "datasource " + get_source_name() + " " + in_what;
+}
+
+void KisDatasource::StopReaderThread() {
+    if (!reader_thread.joinable())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lk(reader_mutex);
+        reader_stop = true;
+        reader_cv.notify_one();
+    }
+
+    // If the last reference to the source goes away from a packet handler on
+    // our own thread, we can't wait for ourselves
+    if (reader_thread.get_id() == std::this_thread::get_id())
+        reader_thread.detach();
+    else
+        reader_thread.join();
+}
+
+void KisDatasource::ReaderThread() {
+    while (!reader_stop) {
+        if (reader_pending.exchange(false)) {
+            ProcessBufferFrames();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lk(reader_mutex);
+
+        // The timeout catches any wakeup we race with
+        reader_sleeping = true;
+
+        if (!reader_pending && !reader_stop)
+            reader_cv.wait_for(lk, std::chrono::milliseconds(100));
+
+        reader_sleeping = false;
+    }
+}
+
+void KisDatasource::ProcessBufferFrames() {
     // Handle reading raw frames off the incoming buffer and validate their
     // framing, then break them into KVMap records and dispatch them.
     //
@@ -380,6 +562,17 @@ void KisDatasource::BufferAvailable(size_t in_amt __attribute__((unused))) {
             return;
 
         size_t buffamt = ringbuf_handler->GetReadBufferUsed();
+
+        // Backlogged past three quarters of the buffer until it drains to a
+        // quarter
+        ssize_t buffsz = ringbuf_handler->GetReadBufferSize();
+        if (buffsz > 0) {
+            if (!read_backlogged && buffamt >= (size_t) buffsz * 3 / 4)
+                read_backlogged = true;
+            else if (read_backlogged && buffamt < (size_t) buffsz / 4)
+                read_backlogged = false;
+        }
+
         if (buffamt < sizeof(simple_cap_proto_t)) {
             return;
         }
@@ -420,8 +613,11 @@ void KisDatasource::BufferAvailable(size_t in_amt __attribute__((unused))) {
         frame->header.data_checksum = 0;
 
         // Calc the checksum of the header
-        calc_checksum = Adler32Checksum((const char *) frame, 
-                sizeof(simple_cap_proto_t));
+        if (validate_checksum)
+            calc_checksum = Adler32Checksum((const char *) frame, 
+                    sizeof(simple_cap_proto_t));
+        else
+            calc_checksum = header_checksum;
 
         // fprintf(stderr, "debug - frame type... %s len %u?\n", string(frame->header.type, 16).c_str(), kis_ntoh32(frame->header.packet_sz));
 
@@ -474,7 +670,10 @@ void KisDatasource::BufferAvailable(size_t in_amt __attribute__((unused))) {
         }
 
         // Calc the checksum of the rest
-        calc_checksum = Adler32Checksum((const char *) buf, frame_sz);
+        if (validate_checksum)
+            calc_checksum = Adler32Checksum((const char *) buf, frame_sz);
+        else
+            calc_checksum = data_checksum;
 
         // Compare to the saved checksum
         if (calc_checksum != data_checksum) {
@@ -487,8 +686,10 @@ void KisDatasource::BufferAvailable(size_t in_amt __attribute__((unused))) {
             return;
         }
 
-        // Extract the kv pairs
+        // Extract the kv pairs; keep them in order as well, since a batched data
+        // frame repeats keys for each packet
         KVmap kv_map;
+        vector<KisDatasourceCapKeyedObject *> kv_vec;
 
         size_t data_offt = 0;
         for (unsigned int kvn = 0; 
@@ -520,15 +721,58 @@ void KisDatasource::BufferAvailable(size_t in_amt __attribute__((unused))) {
                 new KisDatasourceCapKeyedObject(pkv);
 
             kv_map[StrLower(kv->key)] = kv;
+            kv_vec.push_back(kv);
         }
 
         char ctype[17];
         snprintf(ctype, 17, "%s", frame->header.type);
 
-        proto_dispatch_packet(ctype, kv_map);
+        string ltype = StrLower(ctype);
+
+        // Data frames in a resumable session are numbered; after a resume the
+        // capture binary replays frames we may already have, which are skipped
+        // before they reach the decompression stream
+        uint32_t data_seq = kis_ntoh32(frame->header.sequence_number);
+
+        if (resume_session.length() != 0 && data_seq != 0 && 
+                (ltype == "data" || ltype == "databatch" || ltype == "zdatabatch")) {
+            if (last_data_seq != 0 && (int32_t) (data_seq - last_data_seq) <= 0) {
+                for (auto i = kv_vec.begin(); i != kv_vec.end(); ++i) {
+                    delete *i;
+                }
 
-        for (auto i = kv_map.begin(); i != kv_map.end(); ++i) {
-            delete i->second;
+                ringbuf_handler->PeekFreeReadBufferData(buf);
+                ringbuf_handler->ConsumeReadBufferData(frame_sz);
+
+                continue;
+            }
+
+            last_data_seq = data_seq;
+        }
+
+        if (ltype == "databatch") {
+            proto_packet_databatch(kv_vec);
+        } else if (ltype == "zdatabatch") {
+            if (!proto_packet_zdatabatch(kv_map)) {
+                for (auto i = kv_vec.begin(); i != kv_vec.end(); ++i) {
+                    delete *i;
+                }
+
+                ringbuf_handler->PeekFreeReadBufferData(buf);
+                ringbuf_handler->ConsumeReadBufferData(frame_sz);
+
+                _MSG("Kismet data source " + get_source_name() + " got an invalid "
+                        "compressed batch from IPC/Network, closing.", MSGFLAG_ERROR);
+                trigger_error("Source got invalid compressed batch");
+
+                return;
+            }
+        } else {
+            proto_dispatch_packet(ctype, kv_map);
+        }
+
+        for (auto i = kv_vec.begin(); i != kv_vec.end(); ++i) {
+            delete *i;
         }
 
         // Consume the packet in the ringbuf 
@@ -542,6 +786,34 @@ void KisDatasource::BufferError(string in_error) {
     trigger_error(in_error);
 }
 
+void KisDatasource::register_metrics() {
+    local_locker lock(&source_lock);
+
+    shared_ptr<KisMetrics> metrics =
+        globalreg->FetchGlobalAs<KisMetrics>("METRICS");
+
+    if (metrics == NULL) {
+        metric_packets.reset(new kis_metric_counter());
+        metric_errors.reset(new kis_metric_counter());
+        return;
+    }
+
+    // Errors opening a source can come before it has a uuid; those aren't
+    // counted
+    if (get_source_uuid().error)
+        return;
+
+    string labels = "uuid=" + KisMetrics::label_escape(get_source_uuid().UUID2String()) +
+        ",source=" + KisMetrics::label_escape(get_source_name());
+
+    metric_packets =
+        metrics->register_counter("kismet_datasource_packets",
+                "packets received from a data source", labels);
+    metric_errors =
+        metrics->register_counter("kismet_datasource_errors",
+                "errors encountered by a data source", labels);
+}
+
 void KisDatasource::trigger_error(string in_error) {
     local_locker lock(&source_lock);
 
@@ -556,6 +828,11 @@ void KisDatasource::trigger_error(string in_error) {
         set_int_source_error_reason(in_error);
     }
 
+    if (metric_errors == NULL)
+        register_metrics();
+    if (metric_errors != NULL)
+        metric_errors->inc();
+
     // Kill any interaction w/ the source
     close_source();
 
@@ -650,6 +927,38 @@ bool KisDatasource::parse_interface_definition(string in_definition) {
 
     clobber_timestamp = get_definition_opt_bool("timestamp", 
             datasourcetracker->get_config_defaults()->get_remote_cap_timestamp());
+
+    reader_thread_enabled = get_definition_opt_bool("readthread",
+            globalreg->kismet_config->FetchOptBoolean("datasource_reader_threads", false));
+
+    cpu_affinity = get_definition_opt("affinity");
+    if (cpu_affinity == "")
+        cpu_affinity = globalreg->kismet_config->FetchOpt("cpu_affinity_datasources");
+
+    // Scheduling into the packetchain; a source re-opened with new options
+    // keeps the queue it has
+    unsigned int priority = 1, ratelimit = 0, queuedepth = 0;
+
+    try {
+        if (get_definition_opt("priority") != "")
+            priority = StringToUInt(get_definition_opt("priority"));
+        if (get_definition_opt("ratelimit") != "")
+            ratelimit = StringToUInt(get_definition_opt("ratelimit"));
+        if (get_definition_opt("queuedepth") != "")
+            queuedepth = StringToUInt(get_definition_opt("queuedepth"));
+    } catch (const std::runtime_error& e) {
+        _MSG("Invalid priority, ratelimit, or queuedepth for data source " + 
+                get_source_name() + "/" + get_source_interface() + 
+                ", expected a number", MSGFLAG_ERROR);
+        return false;
+    }
+
+    if (priority == 0)
+        priority = 1;
+
+    set_int_source_priority(priority);
+    set_int_source_rate_limit(ratelimit);
+    ingress_depth = queuedepth;
    
     return true;
 }
@@ -734,7 +1043,7 @@ void KisDatasource::proto_dispatch_packet(string in_type, KVmap in_kvmap) {
     } else if (ltype == "ping") {
         send_command_pong();
     } else if (ltype == "pong") {
-        last_pong = time(0);
+        last_pong = KisClock::CoarseWallSec();
     } else if (ltype == "data") {
         proto_packet_data(in_kvmap);
     }
@@ -742,6 +1051,125 @@ void KisDatasource::proto_dispatch_packet(string in_type, KVmap in_kvmap) {
     // We don't care about types we don't understand
 }
 
+void KisDatasource::proto_packet_databatch(vector<KisDatasourceCapKeyedObject *> in_kvlist) {
+    local_locker lock(&source_lock);
+
+    // Split the batch into the KVs of each packet; every packet ends with
+    // its packet or metaframe KV
+    KVmap kv_map;
+
+    for (auto i : in_kvlist) {
+        string k = StrLower(i->key);
+
+        kv_map[k] = i;
+
+        if (k == "packet" || k == "metaframe") {
+            proto_packet_data(kv_map);
+            kv_map.clear();
+        }
+    }
+
+    // Anything left over without a packet is handled like a data frame
+    // without a packet
+    if (kv_map.size() != 0)
+        proto_packet_data(kv_map);
+}
+
+bool KisDatasource::proto_packet_zdatabatch(KVmap in_kvpairs) {
+    local_locker lock(&source_lock);
+
+    auto i = in_kvpairs.find("zbatch");
+
+    if (i == in_kvpairs.end())
+        return false;
+
+    if (i->second->size < sizeof(simple_cap_proto_zbatch_t))
+        return false;
+
+    simple_cap_proto_zbatch_t *zbatch = (simple_cap_proto_zbatch_t *) i->second->object;
+
+    if (zbatch->method != SIMPLE_CAP_ZBATCH_DEFLATE)
+        return false;
+
+    if (inflate_stream == NULL && !(zbatch->flags & SIMPLE_CAP_ZBATCH_RESET))
+        return false;
+
+    // A new stream starts from the dictionary
+    if (zbatch->flags & SIMPLE_CAP_ZBATCH_RESET) {
+        if (inflate_stream == NULL) {
+            inflate_stream = new z_stream;
+            memset(inflate_stream, 0, sizeof(z_stream));
+
+            if (inflateInit2(inflate_stream, -15) != Z_OK) {
+                delete inflate_stream;
+                inflate_stream = NULL;
+                return false;
+            }
+        } else if (inflateReset(inflate_stream) != Z_OK) {
+            return false;
+        }
+
+        if (inflateSetDictionary(inflate_stream, (const Bytef *) SIMPLE_CAP_ZDICT,
+                    sizeof(SIMPLE_CAP_ZDICT) - 1) != Z_OK)
+            return false;
+    }
+
+    uint32_t data_sz = kis_ntoh32(zbatch->data_sz);
+    uint32_t num_kvs = kis_ntoh32(zbatch->num_kv_pairs);
+
+    // A batch is never larger than what the capture framework will batch, with
+    // plenty of room to spare
+    if (data_sz > 1024 * 1024 * 4)
+        return false;
+
+    // One byte of spare room lets inflate consume the empty block which ends
+    // the sync flush, instead of stopping when the output is full
+    inflate_buf.resize(data_sz + 1);
+
+    inflate_stream->next_in = (Bytef *) zbatch->data;
+    inflate_stream->avail_in = i->second->size - sizeof(simple_cap_proto_zbatch_t);
+    inflate_stream->next_out = inflate_buf.data();
+    inflate_stream->avail_out = data_sz + 1;
+
+    int r = inflate(inflate_stream, Z_SYNC_FLUSH);
+
+    if ((r != Z_OK && r != Z_BUF_ERROR) || inflate_stream->avail_out != 1 ||
+            inflate_stream->avail_in != 0)
+        return false;
+
+    // Split the decompressed data into the KVs of a data batch
+    vector<KisDatasourceCapKeyedObject *> kv_vec;
+    size_t data_offt = 0;
+    bool valid = true;
+
+    for (unsigned int kvn = 0; kvn < num_kvs; kvn++) {
+        if (data_offt + sizeof(simple_cap_proto_kv_h_t) > data_sz) {
+            valid = false;
+            break;
+        }
+
+        simple_cap_proto_kv_t *pkv = 
+            (simple_cap_proto_kv_t *) &(inflate_buf[data_offt]);
+
+        data_offt += sizeof(simple_cap_proto_kv_h_t) + kis_ntoh32(pkv->header.obj_sz);
+
+        if (data_offt > data_sz) {
+            valid = false;
+            break;
+        }
+
+        kv_vec.push_back(new KisDatasourceCapKeyedObject(pkv));
+    }
+
+    if (valid)
+        proto_packet_databatch(kv_vec);
+
+    for (auto k : kv_vec)
+        delete k;
+
+    return valid;
+}
+
 void KisDatasource::proto_packet_probe_resp(KVmap in_kvpairs) {
     KVmap::iterator i;
     string msg;
@@ -788,6 +1216,10 @@ void KisDatasource::proto_packet_open_resp(KVmap in_kvpairs) {
     KVmap::iterator i;
     string msg;
 
+    // A newly opened helper counts drops from zero
+    last_kernel_drops = 0;
+    last_helper_drops = 0;
+
     // Process any messages
     if ((i = in_kvpairs.find("message")) != in_kvpairs.end()) {
         msg = handle_kv_message(i->second);
@@ -872,20 +1304,32 @@ void KisDatasource::proto_packet_open_resp(KVmap in_kvpairs) {
     last_pong = 0;
 
     // If we got here we're valid; start a PING timer
-    if (ping_timer_id <= 0) {
-        ping_timer_id = timetracker->RegisterTimer(SERVER_TIMESLICES_SEC, NULL,
-                1, [this](int) -> int {
-            local_locker lock(&source_lock);
-            
-            if (!get_source_running()) {
-                ping_timer_id = 0;
-                return 0;
-            }
-            
-            send_command_ping();
-            return 1;
-        });
-    }
+    start_ping_timer();
+}
+
+void KisDatasource::start_ping_timer() {
+    local_locker lock(&source_lock);
+
+    if (ping_timer_id > 0)
+        return;
+
+    ping_timer_id = timetracker->RegisterTimer(SERVER_TIMESLICES_SEC, NULL,
+            1, [this](int) -> int {
+        local_locker lock(&source_lock);
+        
+        if (!get_source_running()) {
+            ping_timer_id = 0;
+            return 0;
+        }
+        
+        send_command_ping();
+
+        // Let the capture binary release the data we have
+        if (resume_session.length() != 0 && last_data_seq != acked_data_seq)
+            send_command_data_ack();
+
+        return 1;
+    });
 }
 
 void KisDatasource::proto_packet_list_resp(KVmap in_kvpairs) {
@@ -1005,9 +1449,19 @@ void KisDatasource::proto_packet_data(KVmap in_kvpairs) {
         handle_kv_warning(i->second);
     }
 
-    // Do we have a packet?
+    if ((i = in_kvpairs.find("drops")) != in_kvpairs.end()) {
+        handle_kv_drops(i->second);
+    }
+
+    if ((i = in_kvpairs.find("hopstats")) != in_kvpairs.end()) {
+        handle_kv_hopstats(i->second);
+    }
+
+    // Do we have a packet, or the metadata of one?
     if ((i = in_kvpairs.find("packet")) != in_kvpairs.end()) {
         packet = handle_kv_packet(i->second);
+    } else if ((i = in_kvpairs.find("metaframe")) != in_kvpairs.end()) {
+        packet = handle_kv_metaframe(i->second, &siginfo);
     }
 
     if (packet == NULL) {
@@ -1015,7 +1469,7 @@ void KisDatasource::proto_packet_data(KVmap in_kvpairs) {
     }
 
     // Gather signal data
-    if ((i = in_kvpairs.find("signal")) != in_kvpairs.end()) {
+    if (siginfo == NULL && (i = in_kvpairs.find("signal")) != in_kvpairs.end()) {
         siginfo = handle_kv_signal(i->second);
     }
     
@@ -1038,11 +1492,23 @@ void KisDatasource::proto_packet_data(KVmap in_kvpairs) {
 
     packet->insert(pack_comp_datasrc, datasrcinfo);
 
+    if (read_backlogged)
+        packet->backlogged = 1;
+
     inc_source_num_packets(1);
-    get_source_packet_rrd()->add_sample(1, time(0));
+    get_source_packet_rrd()->add_sample(1, KisClock::CoarseWallSec());
+
+    if (metric_packets == NULL)
+        register_metrics();
+    if (metric_packets != NULL)
+        metric_packets->inc();
+
+    if (ingress_id < 0)
+        ingress_id = packetchain->RegisterIngress(get_source_name(), 
+                get_source_priority(), ingress_depth, get_source_rate_limit());
 
     // Inject the packet into the packetchain if we have one
-    packetchain->ProcessPacket(packet);
+    packetchain->ProcessPacket(packet, ingress_id);
 
 }
 
@@ -1286,6 +1752,14 @@ kis_gps_packinfo *KisDatasource::handle_kv_gps(KisDatasourceCapKeyedObject *in_o
     return gpsinfo;
 }
 
+// Have msgpack reference binary objects (the packet data) in the source buffer
+// instead of copying them into the unpack zone
+static bool kis_datasource_msgpack_ref_bin(msgpack::type::object_type type,
+        std::size_t size __attribute__((unused)), 
+        void *user_data __attribute__((unused))) {
+    return type == msgpack::type::BIN;
+}
+
 kis_packet *KisDatasource::handle_kv_packet(KisDatasourceCapKeyedObject *in_obj) {
     // Extract a packet record
     
@@ -1298,7 +1772,8 @@ kis_packet *KisDatasource::handle_kv_packet(KisDatasourceCapKeyedObject *in_obj)
     MsgpackAdapter::MsgpackStrMap::iterator obj_iter;
 
     try {
-        msgpack::unpack(result, in_obj->object, in_obj->size);
+        msgpack::unpack(result, in_obj->object, in_obj->size,
+                kis_datasource_msgpack_ref_bin, NULL);
         msgpack::object deserialized = result.get();
         dict = deserialized.as<MsgpackAdapter::MsgpackStrMap>();
 
@@ -1342,7 +1817,20 @@ kis_packet *KisDatasource::handle_kv_packet(KisDatasourceCapKeyedObject *in_obj)
             throw std::runtime_error(string("packet size did not match data size"));
         }
 
-        datachunk->copy_data((const uint8_t *) rawdata.via.bin.ptr, size);
+        // Datagrams only carry the start of the packet
+        if ((obj_iter = dict.find("origlen")) != dict.end()) {
+            if (obj_iter->second.as<uint64_t>() > size)
+                packet->truncated = 1;
+        }
+
+        // The packet data is still in the peeked read buffer.  If the packet
+        // chain is synchronous the packet is done with before the buffer is
+        // released, so we can point at it directly; otherwise the packet
+        // outlives the buffer and gets its own copy.
+        if (packetchain->IsPipelined())
+            datachunk->copy_data((const uint8_t *) rawdata.via.bin.ptr, size);
+        else
+            datachunk->set_data((uint8_t *) rawdata.via.bin.ptr, size, false);
 
     } catch (const std::exception& e) {
         // Something went wrong with msgpack unpacking
@@ -1365,9 +1853,196 @@ kis_packet *KisDatasource::handle_kv_packet(KisDatasourceCapKeyedObject *in_obj)
 
     packet->insert(pack_comp_linkframe, datachunk);
 
+    KIS_PROBE4(packet__create, packet, this, datachunk->length, datachunk->dlt);
+
+    return packet;
+}
+
+kis_packet *KisDatasource::handle_kv_metaframe(KisDatasourceCapKeyedObject *in_obj,
+        kis_layer1_packinfo **ret_siginfo) {
+    // A metadata-only frame is the 802.11 header of a frame and what the
+    // helper already decoded from the radio header; it goes into the chain as a
+    // truncated 802.11 frame with its layer1 data attached, and skips the DLT
+    // handlers entirely
+    if (in_obj->size < SIMPLE_CAP_METAFRAME_FIXED_SZ) {
+        trigger_error("Invalid METAFRAME object in packet");
+        return NULL;
+    }
+
+    simple_cap_proto_metaframe_t *meta = (simple_cap_proto_metaframe_t *) in_obj->object;
+
+    if (meta->hdr_len > SIMPLE_CAP_METAFRAME_HDR_MAX ||
+            in_obj->size < SIMPLE_CAP_METAFRAME_FIXED_SZ + meta->hdr_len) {
+        trigger_error("Invalid METAFRAME object in packet, header longer than record");
+        return NULL;
+    }
+
+    kis_packet *packet = packetchain->GeneratePacket();
+
+    if (clobber_timestamp && get_source_remote()) {
+        gettimeofday(&(packet->ts), NULL);
+    } else {
+        packet->ts.tv_sec = kis_ntoh32(meta->tv_sec);
+        packet->ts.tv_usec = kis_ntoh32(meta->tv_usec);
+    }
+
+    if (kis_ntoh32(meta->orig_len) > meta->hdr_len)
+        packet->truncated = 1;
+
+    // The header is small enough that copying it is cheaper than keeping the
+    // read buffer pinned
+    kis_datachunk *datachunk = new kis_datachunk();
+    datachunk->copy_data(meta->hdr, meta->hdr_len);
+    datachunk->dlt = KDLT_IEEE802_11;
+
+    packet->insert(pack_comp_linkframe, datachunk);
+
+    if (meta->flags != 0) {
+        kis_layer1_packinfo *siginfo = new kis_layer1_packinfo();
+
+        if (meta->flags & SIMPLE_CAP_METAFRAME_SIGNAL) {
+            siginfo->signal_type = kis_l1_signal_type_dbm;
+            siginfo->signal_dbm = meta->signal_dbm;
+        }
+
+        if (meta->flags & SIMPLE_CAP_METAFRAME_NOISE) {
+            siginfo->signal_type = kis_l1_signal_type_dbm;
+            siginfo->noise_dbm = meta->noise_dbm;
+        }
+
+        if (meta->flags & SIMPLE_CAP_METAFRAME_FREQ)
+            siginfo->freq_khz = kis_ntoh32(meta->freq_khz);
+
+        if (meta->flags & SIMPLE_CAP_METAFRAME_RATE)
+            siginfo->datarate = kis_ntoh16(meta->datarate);
+
+        *ret_siginfo = siginfo;
+    }
+
+    KIS_PROBE4(packet__create, packet, this, datachunk->length, datachunk->dlt);
+
     return packet;
 }
 
+bool KisDatasource::proto_packet_datagram(string in_token, uint32_t in_seq, 
+        KVmap in_kvpairs) {
+    local_locker lock(&source_lock);
+
+    if (datagram_token.length() == 0 || in_token != datagram_token)
+        return false;
+
+    inc_int_source_num_datagrams(1);
+
+    // Anything skipped over is lost until it turns up late; sequence numbers
+    // wrap, and skip 0
+    if (last_datagram_seq == 0) {
+        last_datagram_seq = in_seq;
+    } else if ((int32_t) (in_seq - last_datagram_seq) > 0) {
+        uint32_t skipped = in_seq - last_datagram_seq - 1;
+
+        if (in_seq < last_datagram_seq && skipped > 0)
+            skipped--;
+
+        inc_int_source_num_datagrams_lost(skipped);
+        last_datagram_seq = in_seq;
+    } else if (get_source_num_datagrams_lost() > 0) {
+        dec_int_source_num_datagrams_lost();
+    }
+
+    proto_packet_data(in_kvpairs);
+
+    return true;
+}
+
+void KisDatasource::handle_kv_drops(KisDatasourceCapKeyedObject *in_obj) {
+    // Unpack the dictionary
+    MsgpackAdapter::MsgpackStrMap dict;
+    msgpack::unpacked result;
+    MsgpackAdapter::MsgpackStrMap::iterator obj_iter;
+
+    uint64_t kernel_drops = last_kernel_drops;
+    uint64_t helper_drops = last_helper_drops;
+
+    try {
+        msgpack::unpack(result, in_obj->object, in_obj->size);
+        msgpack::object deserialized = result.get();
+        dict = deserialized.as<MsgpackAdapter::MsgpackStrMap>();
+
+        if ((obj_iter = dict.find("kernel")) != dict.end()) {
+            kernel_drops = obj_iter->second.as<uint64_t>();
+        }
+
+        if ((obj_iter = dict.find("helper")) != dict.end()) {
+            helper_drops = obj_iter->second.as<uint64_t>();
+        }
+    } catch (const std::exception& e) {
+        // Something went wrong with msgpack unpacking
+        stringstream ss;
+        ss << "failed to unpack drops bundle: " << e.what();
+
+        trigger_error(ss.str());
+        return;
+    }
+
+    // Totals only go backwards if the helper was restarted without us seeing
+    // the open
+    if (kernel_drops < last_kernel_drops)
+        last_kernel_drops = 0;
+    if (helper_drops < last_helper_drops)
+        last_helper_drops = 0;
+
+    set_int_source_num_kernel_drops(get_source_num_kernel_drops() + 
+            (kernel_drops - last_kernel_drops));
+    set_int_source_num_helper_drops(get_source_num_helper_drops() + 
+            (helper_drops - last_helper_drops));
+
+    last_kernel_drops = kernel_drops;
+    last_helper_drops = helper_drops;
+}
+
+void KisDatasource::handle_kv_hopstats(KisDatasourceCapKeyedObject *in_obj) {
+    // Unpack the dictionary
+    MsgpackAdapter::MsgpackStrMap dict;
+    msgpack::unpacked result;
+    MsgpackAdapter::MsgpackStrMap::iterator obj_iter;
+
+    uint64_t switches = 0, total_usec = 0, max_usec = 0, late = 0;
+
+    try {
+        msgpack::unpack(result, in_obj->object, in_obj->size);
+        msgpack::object deserialized = result.get();
+        dict = deserialized.as<MsgpackAdapter::MsgpackStrMap>();
+
+        if ((obj_iter = dict.find("switches")) != dict.end()) {
+            switches = obj_iter->second.as<uint64_t>();
+        }
+
+        if ((obj_iter = dict.find("total_usec")) != dict.end()) {
+            total_usec = obj_iter->second.as<uint64_t>();
+        }
+
+        if ((obj_iter = dict.find("max_usec")) != dict.end()) {
+            max_usec = obj_iter->second.as<uint64_t>();
+        }
+
+        if ((obj_iter = dict.find("late")) != dict.end()) {
+            late = obj_iter->second.as<uint64_t>();
+        }
+    } catch (const std::exception& e) {
+        // Something went wrong with msgpack unpacking
+        stringstream ss;
+        ss << "failed to unpack hopstats bundle: " << e.what();
+
+        trigger_error(ss.str());
+        return;
+    }
+
+    set_int_source_hop_switches(switches);
+    set_int_source_hop_switch_latency(switches == 0 ? 0 : (double) total_usec / switches);
+    set_int_source_hop_switch_latency_max(max_usec);
+    set_int_source_hop_late(late);
+}
+
 void KisDatasource::handle_kv_uuid(KisDatasourceCapKeyedObject *in_obj) {
     uuid parsed_uuid(string(in_obj->object, in_obj->size));
 
@@ -1572,6 +2247,15 @@ bool KisDatasource::write_packet(string in_cmd, KVmap in_kvpairs,
     if (ringbuf_handler == NULL)
         return false;
 
+    ret_seqno = next_cmd_sequence;
+    next_cmd_sequence++;
+
+    return write_raw_packet(ringbuf_handler, in_cmd, in_kvpairs, ret_seqno);
+}
+
+bool KisDatasource::write_raw_packet(shared_ptr<BufferHandlerGeneric> in_handler,
+        string in_cmd, KVmap in_kvpairs, uint32_t in_seqno) {
+
     simple_cap_proto_t proto_hdr;
 
     uint32_t hcsum, dcsum = 0, csum_s1 = 0, csum_s2 = 0;
@@ -1588,9 +2272,7 @@ bool KisDatasource::write_packet(string in_cmd, KVmap in_kvpairs,
     proto_hdr.data_checksum = 0;
     proto_hdr.packet_sz = kis_hton32(total_len);
 
-    proto_hdr.sequence_number = kis_hton32(next_cmd_sequence);
-    ret_seqno = next_cmd_sequence;
-    next_cmd_sequence++;
+    proto_hdr.sequence_number = kis_hton32(in_seqno);
 
     snprintf(proto_hdr.type, 16, "%s", in_cmd.c_str());
 
@@ -1614,12 +2296,12 @@ bool KisDatasource::write_packet(string in_cmd, KVmap in_kvpairs,
     proto_hdr.header_checksum = kis_hton32(hcsum);
     proto_hdr.data_checksum = kis_hton32(dcsum);
 
-    if (ringbuf_handler->PutWriteBufferData(&proto_hdr, 
+    if (in_handler->PutWriteBufferData(&proto_hdr, 
                 sizeof(simple_cap_proto_t), true) == 0)
         return false;
 
     for (auto i = in_kvpairs.begin(); i != in_kvpairs.end(); ++i) {
-        if (ringbuf_handler->PutWriteBufferData(i->second->kv,
+        if (in_handler->PutWriteBufferData(i->second->kv,
                     sizeof(simple_cap_proto_kv_h_t) + i->second->size, true) == 0)
             return false;
     }
@@ -1700,6 +2382,55 @@ void KisDatasource::send_command_open_interface(string in_definition,
     KVmap kvmap;
     kvmap.emplace("DEFINITION", definition);
 
+    // Offer compressed batches; capture binaries which don't know about them
+    // ignore this, and local capture binaries never compress
+    KisDatasourceCapKeyedObject *compression = NULL;
+
+    if (offer_compression) {
+        compression = new KisDatasourceCapKeyedObject("COMPRESSION", "deflate", 7);
+        kvmap.emplace("COMPRESSION", compression);
+    }
+
+    // Offer a resumable session; each open starts a new one, and capture 
+    // binaries which don't know about them ignore this
+    KisDatasourceCapKeyedObject *resume = NULL;
+
+    resume_session = "";
+    last_data_seq = 0;
+    acked_data_seq = 0;
+
+    if (offer_resume && get_source_remote()) {
+        char token[33];
+
+        snprintf(token, 33, "%08x%08x%08x%08x", (unsigned int) rand(),
+                (unsigned int) rand(), (unsigned int) rand(), (unsigned int) rand());
+
+        resume_session = token;
+
+        resume = new KisDatasourceCapKeyedObject("RESUME", resume_session.data(),
+                resume_session.length());
+        kvmap.emplace("RESUME", resume);
+    }
+
+    // Offer metadata datagrams with a new token
+    KisDatasourceCapKeyedObject *datagram = NULL;
+
+    datagram_token = "";
+    last_datagram_seq = 0;
+
+    if (offer_datagram && get_source_remote()) {
+        char token[33];
+
+        snprintf(token, 33, "%08x%08x%08x%08x", (unsigned int) rand(),
+                (unsigned int) rand(), (unsigned int) rand(), (unsigned int) rand());
+
+        datagram_token = token;
+
+        datagram = new KisDatasourceCapKeyedObject("DATAGRAM", datagram_token.data(),
+                datagram_token.length());
+        kvmap.emplace("DATAGRAM", datagram);
+    }
+
     uint32_t seqno;
     bool success;
     shared_ptr<tracked_command> cmd;
@@ -1708,6 +2439,15 @@ void KisDatasource::send_command_open_interface(string in_definition,
 
     delete(definition);
 
+    if (compression != NULL)
+        delete(compression);
+
+    if (resume != NULL)
+        delete(resume);
+
+    if (datagram != NULL)
+        delete(datagram);
+
     if (!success) {
         if (in_cb != NULL) {
             in_cb(in_transaction, false, "unable to generate command frame");
@@ -1835,6 +2575,25 @@ void KisDatasource::send_command_ping() {
     write_packet("PING", kvmap, seqno);
 }
 
+void KisDatasource::send_command_data_ack() {
+    local_locker lock(&source_lock);
+
+    uint32_t seq_be = kis_hton32(last_data_seq);
+
+    KisDatasourceCapKeyedObject *dataseq =
+        new KisDatasourceCapKeyedObject("DATASEQ", (const char *) &seq_be, 
+                sizeof(uint32_t));
+
+    KVmap kvmap;
+    kvmap.emplace("DATASEQ", dataseq);
+
+    uint32_t seqno;
+    if (write_packet("DATAACK", kvmap, seqno))
+        acked_data_seq = last_data_seq;
+
+    delete(dataseq);
+}
+
 void KisDatasource::send_command_pong() {
     local_locker lock(&source_lock);
 
@@ -1846,6 +2605,27 @@ void KisDatasource::send_command_pong() {
     write_packet("PONG", kvmap, seqno);
 }
 
+void KisDatasource::redirect_source(string in_target) {
+    local_locker lock(&source_lock);
+
+    if (!get_source_remote())
+        return;
+
+    KisDatasourceCapKeyedObject *target =
+        new KisDatasourceCapKeyedObject("REDIRECT", in_target.data(), 
+                in_target.length());
+
+    KVmap kvmap;
+    kvmap.emplace("REDIRECT", target);
+
+    // The capture binary hangs up once it has the redirect, and the source
+    // closes as if the connection had been lost
+    uint32_t seqno;
+    write_packet("REDIRECT", kvmap, seqno);
+
+    delete(target);
+}
+
 void KisDatasource::register_fields() {
     tracker_component::register_fields();
 
@@ -1916,11 +2696,46 @@ void KisDatasource::register_fields() {
     RegisterField("kismet.datasource.num_error_packets", TrackerUInt64,
             "Number of invalid/error packets seen by source",
             &source_num_error_packets);
+    RegisterField("kismet.datasource.num_kernel_drops", TrackerUInt64,
+            "Number of packets dropped by the kernel or driver before capture",
+            &source_num_kernel_drops);
+    RegisterField("kismet.datasource.num_helper_drops", TrackerUInt64,
+            "Number of packets discarded by the capture helper under backpressure",
+            &source_num_helper_drops);
+    RegisterField("kismet.datasource.hop_switches", TrackerUInt64,
+            "Number of channel switches made while hopping",
+            &source_hop_switches);
+    RegisterField("kismet.datasource.hop_switch_latency", TrackerDouble,
+            "Average time to switch channels while hopping (microseconds)",
+            &source_hop_switch_latency);
+    RegisterField("kismet.datasource.hop_switch_latency_max", TrackerUInt64,
+            "Longest time to switch channels while hopping (microseconds)",
+            &source_hop_switch_latency_max);
+    RegisterField("kismet.datasource.hop_late", TrackerUInt64,
+            "Number of hops delayed because a channel switch overran the hop interval",
+            &source_hop_late);
+    RegisterField("kismet.datasource.num_datagrams", TrackerUInt64,
+            "Number of metadata datagrams received from remote capture",
+            &source_num_datagrams);
+    RegisterField("kismet.datasource.num_datagrams_lost", TrackerUInt64,
+            "Number of metadata datagrams from remote capture which never arrived",
+            &source_num_datagrams_lost);
 
     packet_rate_rrd_id = RegisterComplexField("kismet.datasource.packets_rrd", 
             shared_ptr<kis_tracked_minute_rrd<> >(new kis_tracked_minute_rrd<>(globalreg, 0)), 
             "packet rate over past minute");
 
+    RegisterField("kismet.datasource.priority", TrackerUInt32,
+            "Share of the packet pipeline against other sources", &source_priority);
+    RegisterField("kismet.datasource.rate_limit", TrackerUInt32,
+            "Packets per second admitted to the packet pipeline (0 for no limit)",
+            &source_rate_limit);
+    RegisterField("kismet.datasource.queue_depth", TrackerUInt64,
+            "Packets waiting for the packet pipeline", &source_queue_depth);
+    RegisterField("kismet.datasource.num_ratelimit_drops", TrackerUInt64,
+            "Number of packets dropped by the rate limit", 
+            &source_num_ratelimit_drops);
+
     RegisterField("kismet.datasource.retry", TrackerUInt8,
             "Source will try to re-open after failure", &source_retry);
     RegisterField("kismet.datasource.retry_attempts", TrackerUInt32,
@@ -1929,6 +2744,16 @@ void KisDatasource::register_fields() {
             "Total unsuccessful retry attempts", &source_total_retry_attempts);
 }
 
+void KisDatasource::pre_serialize() {
+    tracker_component::pre_serialize();
+
+    if (ingress_id < 0)
+        return;
+
+    set_int_source_queue_depth(packetchain->FetchIngressDepth(ingress_id));
+    set_int_source_num_ratelimit_drops(packetchain->FetchIngressDropped(ingress_id));
+}
+
 void KisDatasource::reserve_fields(SharedTrackerElement e) {
     tracker_component::reserve_fields(e);
 
@@ -2075,27 +2900,93 @@ void KisDatasource::launch_ipc() {
         _MSG(ss.str(), MSGFLAG_INFO);
 
         ipc_remote->soft_kill();
+        ipc_remote.reset();
     }
 
+    release_shared_helper();
+
     set_int_source_ipc_pid(-1);
 
-    // Make a new handler and new ipc.  Give a generous buffer.
-    ringbuf_handler.reset(new BufferHandler<RingbufV2>((1024 * 1024), (1024 * 1024)));
+    // A pipe to a capture binary we launched ourselves can't corrupt or misframe
+    // data, so unless configured otherwise ask the binary not to checksum what it
+    // sends.  Frames we send are still checksummed, so a capture binary which
+    // doesn't know the option keeps working.
+    vector<string> args = ipc_binary_args;
+
+    // Every source launched looks these up, so look them up once in the
+    // parsed config
+    shared_ptr<const config_snapshot> conf = globalreg->kismet_config->FetchSnapshot();
+
+    validate_checksum = conf->get_bool("datasource_ipc_checksum", false);
+
+    if (!validate_checksum)
+        args.push_back("--disable-checksum");
+
+    // Open sources may share one capture binary between them; probing and listing
+    // are short-lived and always get their own
+    if (shared_helper_capable && !mode_probing && !mode_listing &&
+            get_definition_opt_bool("sharedhelper", 
+                conf->get_bool("datasource_shared_helper", false))) {
+        shared_helper = 
+            datasourcetracker->get_shared_helper(get_source_ipc_binary(), args,
+                    validate_checksum, cpu_affinity);
+
+        if (shared_helper == NULL) {
+            ss.str("");
+            ss << "failed to launch shared IPC binary '" << get_source_ipc_binary() << 
+                "'";
+            trigger_error(ss.str());
+            return;
+        }
+
+        ringbuf_handler = shared_helper->attach_channel(&shared_helper_id);
+        ringbuf_handler->SetReadBufferInterface(this);
+
+        set_int_source_ipc_pid(shared_helper->get_pid());
+
+        record_helper_placement();
+
+        return;
+    }
+
+    // Frames from a local capture binary can skip the pipe entirely and be
+    // parsed where the binary wrote them, in a ring shared with it; fall back
+    // to the pipe when the platform can't share one
+    RingbufShm *shm_ring = NULL;
+
+    if (ipc_shm_capable && !mode_probing && !mode_listing &&
+            get_definition_opt_bool("ipcshm",
+                conf->get_bool("datasource_ipc_shm", true)))
+        shm_ring = RingbufShm::create(1024 * 1024);
+
+    // Make a new handler and new ipc.  Give a generous buffer.  The pipe is the
+    // only writer of the read side and we're the only reader, so it can be
+    // lock-free; commands are written from any thread, so the write side can't.
+    if (shm_ring != NULL)
+        ringbuf_handler.reset(new BufferHandler<RingbufShm, RingbufV2>(shm_ring,
+                    new RingbufV2(1024 * 1024)));
+    else
+        ringbuf_handler.reset(new BufferHandler<RingbufSPSC, RingbufV2>((1024 * 1024), 
+                    (1024 * 1024)));
     ringbuf_handler->SetReadBufferInterface(this);
 
     ipc_remote.reset(new IPCRemoteV2(globalreg, ringbuf_handler));
 
+    if (shm_ring != NULL)
+        ipc_remote->set_shm_ring(shm_ring);
+
     // Get allowed paths for binaries
-    vector<string> bin_paths = 
-        globalreg->kismet_config->FetchOptVec("capture_binary_path");
+    const vector<string>& bin_paths = conf->get_vec("capture_binary_path");
 
     // Explode any expansion macros in the path and add it to the list we search
-    for (vector<string>::iterator i = bin_paths.begin(); i != bin_paths.end(); ++i) {
+    for (auto i = bin_paths.begin(); i != bin_paths.end(); ++i) {
         ipc_remote->add_path(globalreg->kismet_config->ExpandLogPath(*i, "", 
                     "", 0, 1));
     }
 
-    int ret = ipc_remote->launch_kis_binary(get_source_ipc_binary(), ipc_binary_args);
+    ipc_remote->set_cpu_affinity(cpu_affinity);
+
+    int ret = ipc_remote->launch_kis_binary(get_source_ipc_binary(), args);
 
     if (ret < 0) {
         ss.str("");
@@ -2106,9 +2997,47 @@ void KisDatasource::launch_ipc() {
 
     set_int_source_ipc_pid(ipc_remote->get_pid());
 
+    record_helper_placement();
+
     return;
 }
 
+void KisDatasource::record_helper_placement() {
+    shared_ptr<CpuAffinity> affinity =
+        globalreg->FetchGlobalAs<CpuAffinity>("CPU_AFFINITY");
+
+    if (affinity == NULL || cpu_affinity.length() == 0)
+        return;
+
+    string cpus = CpuAffinity::normalize_cpu_list(cpu_affinity);
+
+    if (cpus.length() == 0) {
+        _MSG("Datasource '" + get_source_name() + "' has an invalid cpu list '" +
+                cpu_affinity + "', expected a list of cpus like '0-3,8'", 
+                MSGFLAG_ERROR);
+        return;
+    }
+
+    affinity->record_placement(placement_name("helper"), cpus);
+}
+
+void KisDatasource::detach_shared_helper() {
+    local_locker lock(&source_lock);
+
+    if (shared_helper == NULL || shared_helper_id == 0)
+        return;
+
+    shared_helper->detach_channel(shared_helper_id);
+    shared_helper_id = 0;
+}
+
+void KisDatasource::release_shared_helper() {
+    local_locker lock(&source_lock);
+
+    detach_shared_helper();
+    shared_helper.reset();
+}
+
 KisDatasourceCapKeyedObject::KisDatasourceCapKeyedObject(simple_cap_proto_kv *in_kp) {
     char ckey[16];
 
@@ -22,6 +22,12 @@
 #include "config.h"
 
 #include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+#include <zlib.h>
 
 #include "globalregistry.h"
 #include "ipc_remote2.h"
@@ -33,6 +39,7 @@
 #include "packetchain.h"
 #include "simple_datasource_proto.h"
 #include "entrytracker.h"
+#include "kis_metrics.h"
 
 // Builder class responsible for making an instance of this datasource
 class KisDatasourceBuilder;
@@ -47,6 +54,7 @@ class KisDatasourceCapKeyedObject;
 
 // Fwd def for DST
 class Datasourcetracker;
+class dst_shared_helper;
 
 class KisDatasource : public tracker_component, public BufferInterface {
 public:
@@ -132,6 +140,33 @@ public:
     virtual void connect_buffer(shared_ptr<BufferHandlerGeneric> in_ringbuf,
             string in_definition, open_callback_t in_cb);
 
+    // Resume the session of a remote source which lost its connection on a new
+    // buffer; the capture binary kept the source open and replays any data we
+    // didn't get
+    virtual void resume_buffer(shared_ptr<BufferHandlerGeneric> in_ringbuf);
+
+    // Session token offered to a remote capture binary, or empty if the
+    // current session can't be resumed
+    string get_resume_session() {
+        local_locker lock(&source_lock);
+        return resume_session;
+    }
+
+    // Token a remote capture binary sends with its metadata datagrams, or empty
+    // if we don't accept datagrams for this source
+    string get_datagram_token() {
+        local_locker lock(&source_lock);
+        return datagram_token;
+    }
+
+    // KV pairs of a protocol frame, by lowercase key
+    typedef map<string, KisDatasourceCapKeyedObject *> KVmap;
+
+    // Handle a DATAGRAM frame received for this source; false if the token
+    // doesn't match
+    virtual bool proto_packet_datagram(string in_token, uint32_t in_seq, 
+            KVmap in_kvpairs);
+
 
     // Close the source
     // Cancels any current activity (probe, open, pending commands) and sends a
@@ -142,6 +177,15 @@ public:
     // the retry option is configured.
     virtual void close_source();
 
+    // Send a remote capture binary to another server, as host:port; it drops
+    // this connection and opens the source there
+    virtual void redirect_source(string in_target);
+
+    // Write a protocol frame to a buffer with no source attached yet, such as an
+    // incoming remote connection.  Returns false if the buffer is full
+    static bool write_raw_packet(shared_ptr<BufferHandlerGeneric> in_handler,
+            string in_cmd, KVmap in_kvpairs, uint32_t in_seqno);
+
 
     // Disables a source
     // Cancels any current activity, and sends a terminate to the capture binary.
@@ -160,6 +204,10 @@ public:
     // may be made to IPC or network, and speaks the kismet datasource simplified
     // protocol.  This function does basic framing and then calls the private 
     // hierarchy of key-value parsers.
+    //
+    // When the source has a reader thread (datasource_reader_threads or the
+    // readthread= source option), this only wakes the thread, which does the
+    // framing and decoding and injects the packets itself.
     virtual void BufferAvailable(size_t in_amt);
 
     // Buffer interface - handles error on IPC or TCP, called when there is a 
@@ -211,9 +259,39 @@ public:
     __ProxyIncDec(source_num_error_packets, uint64_t, uint64_t, 
             source_num_error_packets);
 
+    // Frames lost before the capture helper saw them, and frames the helper
+    // discarded itself while shedding, as reported by the helper
+    __ProxyGet(source_num_kernel_drops, uint64_t, uint64_t, source_num_kernel_drops);
+    __ProxyGet(source_num_helper_drops, uint64_t, uint64_t, source_num_helper_drops);
+
+    // Channel switch timing while hopping, as measured by the capture helper
+    // since it opened the source; latencies are in microseconds
+    __ProxyGet(source_hop_switches, uint64_t, uint64_t, source_hop_switches);
+    __ProxyGet(source_hop_switch_latency, double, double, source_hop_switch_latency);
+    __ProxyGet(source_hop_switch_latency_max, uint64_t, uint64_t, 
+            source_hop_switch_latency_max);
+    __ProxyGet(source_hop_late, uint64_t, uint64_t, source_hop_late);
+
+    // Metadata datagrams received from a remote capture binary, and datagrams
+    // which never arrived
+    __ProxyGet(source_num_datagrams, uint64_t, uint64_t, source_num_datagrams);
+    __ProxyGet(source_num_datagrams_lost, uint64_t, uint64_t, source_num_datagrams_lost);
+
     __ProxyDynamicTrackable(source_packet_rrd, kis_tracked_minute_rrd<>, 
             packet_rate_rrd, packet_rate_rrd_id);
 
+    // Scheduling of our packets into the packetchain:  our weight against the
+    // other sources, the packets a second we're limited to (0 for no limit),
+    // and the packets waiting in our queue and dropped by the limit
+    __ProxyGet(source_priority, uint32_t, unsigned int, source_priority);
+    __ProxyGet(source_rate_limit, uint32_t, unsigned int, source_rate_limit);
+    __ProxyGet(source_queue_depth, uint64_t, uint64_t, source_queue_depth);
+    __ProxyGet(source_num_ratelimit_drops, uint64_t, uint64_t, 
+            source_num_ratelimit_drops);
+
+    // Refresh the queue counts from the packetchain
+    virtual void pre_serialize();
+
     // IPC binary name, if any
     __ProxyGet(source_ipc_binary, string, string, source_ipc_binary);
     // IPC channel pid, if any
@@ -318,7 +396,6 @@ protected:
     // dispatched by packet type, then kv pairs.  Packets and kv pair handling
     // can be overridden to add additional handlers.  When overriding, make sure
     // to call the parent implementation to get the default packet handling.
-    typedef map<string, KisDatasourceCapKeyedObject *> KVmap;
 
     // Datasource protocol - dispatch handler.  Handles dispatching top-level
     // packet types to helper functions.  Automatically handles the default
@@ -334,6 +411,14 @@ protected:
     virtual void proto_packet_configresp(KVmap in_kvpairs);
     virtual void proto_packet_data(KVmap in_kvpairs);
 
+    // Batched data frames repeat the data KVs for each packet, so they're handled
+    // as an ordered list and split into a proto_packet_data call per packet
+    virtual void proto_packet_databatch(vector<KisDatasourceCapKeyedObject *> in_kvlist);
+
+    // Compressed batches are decompressed into the KVs of a data batch; false if
+    // the batch could not be decompressed
+    virtual bool proto_packet_zdatabatch(KVmap in_kvpairs);
+
     // Common K-V pair handlers that are likely to be found in multiple types
     // of packets; these can be used by custom packet handlers to implement automatic
     // "proper" behavior for existing pairs, or overridden and extended.  In general,
@@ -353,9 +438,13 @@ protected:
     virtual kis_gps_packinfo *handle_kv_gps(KisDatasourceCapKeyedObject *in_obj);
     virtual kis_layer1_packinfo *handle_kv_signal(KisDatasourceCapKeyedObject *in_obj);
     virtual kis_packet *handle_kv_packet(KisDatasourceCapKeyedObject *in_obj);
+    virtual kis_packet *handle_kv_metaframe(KisDatasourceCapKeyedObject *in_obj,
+            kis_layer1_packinfo **ret_siginfo);
     virtual void handle_kv_uuid(KisDatasourceCapKeyedObject *in_obj);
     virtual void handle_kv_capif(KisDatasourceCapKeyedObject *in_obj);
     virtual unsigned int handle_kv_dlt(KisDatasourceCapKeyedObject *in_obj);
+    virtual void handle_kv_drops(KisDatasourceCapKeyedObject *in_obj);
+    virtual void handle_kv_hopstats(KisDatasourceCapKeyedObject *in_obj);
 
 
     // Assemble a packet it write it out the buffer, returning a command 
@@ -379,6 +468,10 @@ protected:
             unsigned int in_transaction, configure_callback_t in_cb);
     virtual void send_command_ping();
     virtual void send_command_pong();
+    virtual void send_command_data_ack();
+
+    // Ping the capture binary once a second while it's running
+    virtual void start_ping_timer();
 
 
     // TrackerComponent API, we can't ever get instantiated from a saved element
@@ -462,9 +555,49 @@ protected:
     SharedTrackerElement source_num_packets;
     SharedTrackerElement source_num_error_packets;
 
+    // Drop totals, accumulated over every time the source was opened; the helper
+    // counts from zero each time it opens the source 
+    __ProxySet(int_source_num_kernel_drops, uint64_t, uint64_t, source_num_kernel_drops);
+    __ProxySet(int_source_num_helper_drops, uint64_t, uint64_t, source_num_helper_drops);
+
+    __ProxySet(int_source_hop_switches, uint64_t, uint64_t, source_hop_switches);
+    __ProxySet(int_source_hop_switch_latency, double, double, source_hop_switch_latency);
+    __ProxySet(int_source_hop_switch_latency_max, uint64_t, uint64_t, 
+            source_hop_switch_latency_max);
+    __ProxySet(int_source_hop_late, uint64_t, uint64_t, source_hop_late);
+
+    __ProxyIncDec(int_source_num_datagrams, uint64_t, uint64_t, source_num_datagrams);
+    __ProxyIncDec(int_source_num_datagrams_lost, uint64_t, uint64_t, 
+            source_num_datagrams_lost);
+    SharedTrackerElement source_num_datagrams;
+    SharedTrackerElement source_num_datagrams_lost;
+    SharedTrackerElement source_num_kernel_drops;
+    SharedTrackerElement source_num_helper_drops;
+    uint64_t last_kernel_drops, last_helper_drops;
+
+    SharedTrackerElement source_hop_switches;
+    SharedTrackerElement source_hop_switch_latency;
+    SharedTrackerElement source_hop_switch_latency_max;
+    SharedTrackerElement source_hop_late;
+
     int packet_rate_rrd_id;
     shared_ptr<kis_tracked_minute_rrd<> > packet_rate_rrd;
 
+    __ProxySet(int_source_priority, uint32_t, unsigned int, source_priority);
+    __ProxySet(int_source_rate_limit, uint32_t, unsigned int, source_rate_limit);
+    __ProxySet(int_source_queue_depth, uint64_t, uint64_t, source_queue_depth);
+    __ProxySet(int_source_num_ratelimit_drops, uint64_t, uint64_t, 
+            source_num_ratelimit_drops);
+    SharedTrackerElement source_priority;
+    SharedTrackerElement source_rate_limit;
+    SharedTrackerElement source_queue_depth;
+    SharedTrackerElement source_num_ratelimit_drops;
+
+    // Our ingress queue in the packetchain, registered with the first packet
+    // so it has our name; -1 until then
+    int ingress_id;
+    size_t ingress_depth;
+
 
     // Local ID number is an increasing number assigned to each 
     // unique UUID; it's used inside Kismet for fast mapping for seenby, 
@@ -510,6 +643,14 @@ protected:
     // Timer ID for sending a PING
     int ping_timer_id;
 
+    // Packet and error counters for /metrics, registered under the source
+    // uuid once the source has one (and NULL until then); a source which
+    // reopens keeps counting in the same series
+    shared_ptr<kis_metric_counter> metric_packets;
+    shared_ptr<kis_metric_counter> metric_errors;
+
+    void register_metrics();
+
     // Function that gets called when we encounter an error; allows for scheduling
     // bringup, etc
     virtual void handle_source_error();
@@ -528,6 +669,36 @@ protected:
     // Do we clobber the remote timestamp?
     bool clobber_timestamp;
 
+    // Do we check the checksums on frames from the capture binary?  Turned off
+    // for local IPC pipes.
+    bool validate_checksum;
+
+    // Is the buffer from the capture binary filling faster than we drain it?
+    // Packets are tagged as backlogged for overload sampling while it is
+    bool read_backlogged;
+
+    // Do we offer compressed batches to the capture binary?  Only remote
+    // capture uses them.  The inflate stream lasts for the connection, and is
+    // reset when the capture binary starts a new one.
+    bool offer_compression;
+    z_stream *inflate_stream;
+    vector<uint8_t> inflate_buf;
+
+    // Do we offer a resumable session to remote capture binaries?  Data frames
+    // in a session are numbered; last_data_seq is the last one we processed,
+    // and acked_data_seq the last one we acknowledged to the capture binary.
+    bool offer_resume;
+    string resume_session;
+    uint32_t last_data_seq;
+    uint32_t acked_data_seq;
+
+    // Do we offer metadata datagrams to remote capture binaries?  Each open
+    // gets a new token; datagrams are numbered, and last_datagram_seq is the
+    // newest one we've seen.
+    bool offer_datagram;
+    string datagram_token;
+    uint32_t last_datagram_seq;
+
     SharedTrackerElement source_remote;
     __ProxySet(int_source_remote, uint8_t, bool, source_remote);
 
@@ -547,6 +718,22 @@ protected:
     // Launch IPC binary or fail trying
     virtual void launch_ipc();
 
+    // Capture binary shared with other local sources, if we're using one; the
+    // ringbuf_handler is our channel of it.  Only source types whose capture 
+    // binary supports --multiplex may set shared_helper_capable.
+    shared_ptr<dst_shared_helper> shared_helper;
+    uint32_t shared_helper_id;
+    bool shared_helper_capable;
+
+    // Capture binary built on the capture framework, which can write its frames
+    // into a shared memory ring (--shm-ring) instead of the out pipe
+    bool ipc_shm_capable;
+
+    // Close our channel of the shared capture binary; the binary is killed when
+    // the last source releases it
+    void detach_shared_helper();
+    void release_shared_helper();
+
 
 
     // Interfaces we found via list
@@ -579,6 +766,32 @@ protected:
     // Reference to the DST
     shared_ptr<Datasourcetracker> datasourcetracker;
 
+    // Frame and dispatch everything in the read buffer
+    void ProcessBufferFrames();
+
+    // Optional thread which decodes frames instead of the main loop, so a busy
+    // source only delays itself.  The main loop only sets reader_pending; the 
+    // condition is only signalled when the reader is asleep.
+    bool reader_thread_enabled;
+
+    // Cpus for our capture binary and reader thread, from the 'affinity' option or
+    // cpu_affinity_datasources; empty to leave them where they start
+    string cpu_affinity;
+
+    // Name our placement is reported under
+    string placement_name(string in_what);
+
+    // Report where our capture binary was started
+    void record_helper_placement();
+
+    void StartReaderThread();
+    void StopReaderThread();
+    void ReaderThread();
+
+    std::thread reader_thread;
+    std::mutex reader_mutex;
+    std::condition_variable reader_cv;
+    std::atomic<bool> reader_pending, reader_sleeping, reader_stop;
 };
 
 typedef shared_ptr<KisDatasource> SharedDatasource;
@@ -808,7 +1021,8 @@ public:
 
 // Packet chain component; we need to use a raw pointer here but it only exists
 // for the lifetime of the packet being processed
-class packetchain_comp_datasource : public packet_component {
+class packetchain_comp_datasource : public packet_component, 
+    public pooled_packet_component<packetchain_comp_datasource> {
 public:
     KisDatasource *ref_source;
 
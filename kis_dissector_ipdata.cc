@@ -39,7 +39,7 @@ Kis_Dissector_IPdata::Kis_Dissector_IPdata(GlobalRegistry *in_globalreg) {
 	globalreg->InsertGlobal("DISSECTOR_IPDATA", shared_ptr<Kis_Dissector_IPdata>(this));
 
 	globalreg->packetchain->RegisterHandler(&ipdata_packethook, this,
-		 									CHAINPOS_DATADISSECT, -100);
+		 									CHAINPOS_DATADISSECT, -100, "ipdata");
 
 	pack_comp_basicdata = 
 		globalreg->packetchain->RegisterPacketComponent("BASICDATA");
@@ -57,12 +57,42 @@ Kis_Dissector_IPdata::Kis_Dissector_IPdata(GlobalRegistry *in_globalreg) {
                 "MAC of the packet.  A client which fails to do so may "
                 "be attempting to exhaust the DHCP pool with spoofed requests.");
 
+	pthread_mutex_init(&signature_mutex, NULL);
+	next_signature_id = 1;
+
+	// +1 for the CDP version byte we compare first; the rest are as long as
+	// the fields each parser reads unchecked
+	RegisterSignature("cdp", LLC_UI_OFFSET, CISCO_SIGNATURE, sizeof(CISCO_SIGNATURE),
+			LLC_UI_OFFSET + 1 + sizeof(CISCO_SIGNATURE), 0,
+			[this](kis_packet *p, kis_datachunk *d, kis_common_info *c) {
+				return ParseCDP(p, d, c);
+			});
+
+	RegisterSignature("arp", ARP_OFFSET, ARP_SIGNATURE, sizeof(ARP_SIGNATURE),
+			kismax(20, ARP_OFFSET + ARP_PACKET_SIZE), 10,
+			[this](kis_packet *p, kis_datachunk *d, kis_common_info *c) {
+				return ParseARP(p, d, c);
+			});
+
+	RegisterSignature("udp", IP_OFFSET, UDP_SIGNATURE, sizeof(UDP_SIGNATURE),
+			kismax(UDP_OFFSET + 4, IP_OFFSET + 11), 20,
+			[this](kis_packet *p, kis_datachunk *d, kis_common_info *c) {
+				return ParseUDP(p, d, c);
+			});
+
+	RegisterSignature("tcp", IP_OFFSET, TCP_SIGNATURE, sizeof(TCP_SIGNATURE),
+			kismax(TCP_OFFSET + 4, IP_OFFSET + TCP_HEADER_SIZE), 30,
+			[this](kis_packet *p, kis_datachunk *d, kis_common_info *c) {
+				return ParseTCP(p, d, c);
+			});
 }
 
 Kis_Dissector_IPdata::~Kis_Dissector_IPdata() {
 	globalreg->InsertGlobal("DISSECTOR_IPDATA", NULL);
 
 	globalreg->packetchain->RemoveHandler(&ipdata_packethook, CHAINPOS_DATADISSECT);
+
+	pthread_mutex_destroy(&signature_mutex);
 }
 
 #define MDNS_PTR_MASK		0xC0
@@ -165,9 +195,81 @@ string MDNS_Fetchname(kis_datachunk *chunk, unsigned int baseofft,
 	return dns_str;
 }
 
-int Kis_Dissector_IPdata::HandlePacket(kis_packet *in_pack) {
-	kis_data_packinfo *datainfo = NULL;
+int Kis_Dissector_IPdata::RegisterSignature(string in_name, unsigned int in_offset,
+		const uint8_t *in_sig, size_t in_sig_len, unsigned int in_min_len,
+		int in_priority, ipdata_parser in_parser) {
+	if (in_sig_len == 0)
+		return -1;
+
+	local_locker lock(&signature_mutex);
+
+	ipdata_signature sig;
+
+	sig.id = next_signature_id++;
+	sig.name = in_name;
+	sig.offset = in_offset;
+	sig.signature.assign(in_sig, in_sig + in_sig_len);
+	sig.min_length = in_min_len;
+	sig.priority = in_priority;
+	sig.parser = in_parser;
+	sig.order = 0;
+
+	signatures.push_back(sig);
+
+	RebuildSignatureIndex();
+
+	return sig.id;
+}
+
+void Kis_Dissector_IPdata::RemoveSignature(int in_id) {
+	local_locker lock(&signature_mutex);
+
+	for (auto i = signatures.begin(); i != signatures.end(); ++i) {
+		if (i->id == in_id) {
+			signatures.erase(i);
+			RebuildSignatureIndex();
+			return;
+		}
+	}
+}
+
+void Kis_Dissector_IPdata::RebuildSignatureIndex() {
+	shared_ptr<ipdata_signature_index> index(new ipdata_signature_index());
+
+	// Priority order, and registration order within a priority
+	index->signatures = signatures;
+	stable_sort(index->signatures.begin(), index->signatures.end(),
+			[](const ipdata_signature& a, const ipdata_signature& b) {
+				return a.priority < b.priority;
+			});
+
+	for (unsigned int x = 0; x < index->signatures.size(); x++) {
+		ipdata_signature *sig = &(index->signatures[x]);
 
+		sig->order = x;
+
+		ipdata_signature_group *group = NULL;
+
+		for (auto& g : index->groups) {
+			if (g.offset == sig->offset) {
+				group = &g;
+				break;
+			}
+		}
+
+		if (group == NULL) {
+			index->groups.push_back(ipdata_signature_group());
+			group = &(index->groups.back());
+			group->offset = sig->offset;
+		}
+
+		group->by_byte[sig->signature[0]].push_back(x);
+	}
+
+	signature_index = index;
+}
+
+int Kis_Dissector_IPdata::HandlePacket(kis_packet *in_pack) {
 	if (in_pack->error)
 		return 0;
 
@@ -186,477 +288,525 @@ int Kis_Dissector_IPdata::HandlePacket(kis_packet *in_pack) {
 	if (common == NULL)
 		return 0;
 
-	datainfo = new kis_data_packinfo;
+	shared_ptr<ipdata_signature_index> index;
 
-	// CDP cisco discovery frames, good for finding unauthorized APs
-	// +1 for the version frame we compare first
-	if ((LLC_UI_OFFSET + 1 + sizeof(CISCO_SIGNATURE)) < chunk->length &&
-		memcmp(&(chunk->data[LLC_UI_OFFSET]), CISCO_SIGNATURE,
-			   sizeof(CISCO_SIGNATURE)) == 0) {
-		unsigned int offset = 0;
+	{
+		local_locker lock(&signature_mutex);
+		index = signature_index;
+	}
 
-		// Look for frames the old way, maybe v1 used it?  Compare the versions.
-		// I don't remember why the code worked this way.
-		if (chunk->data[LLC_UI_OFFSET + sizeof(CISCO_SIGNATURE)] == 2)
-			offset = LLC_UI_OFFSET + sizeof(CISCO_SIGNATURE) + 4;
-		else
-			offset = LLC_UI_OFFSET + 12;
+	if (index == NULL)
+		return 1;
 
-		// Did we get useful info?
-		int gotinfo = 0;
+	// Collect the signatures which match, in priority order; the byte at each
+	// offset picks the only ones worth comparing
+	const ipdata_signature *candidates[max_candidates];
+	unsigned int num_candidates = 0;
 
-		while (offset + CDP_ELEMENT_LEN < chunk->length) {
-		// uint16_t dot1x_length = kis_extract16(&(chunk->data[offset + 2]));
-			uint16_t elemtype = kis_ntoh16(kis_extract16(&(chunk->data[offset + 0])));
-			uint16_t elemlen = kis_ntoh16(kis_extract16(&(chunk->data[offset + 2])));
+	for (auto& g : index->groups) {
+		if (g.offset >= chunk->length)
+			continue;
 
-			if (elemlen == 0)
-				break;
+		for (auto si : g.by_byte[chunk->data[g.offset]]) {
+			const ipdata_signature *sig = &(index->signatures[si]);
 
-			if (offset + elemlen >= chunk->length)
-				break;
+			if (chunk->length <= sig->min_length ||
+					sig->offset + sig->signature.size() > chunk->length)
+				continue;
 
-			if (elemtype == 0x01) {
-				// Device id, we care about this
-				if (elemlen < 4) {
-					_MSG("Corrupt CDP frame (possibly an exploit attempt), discarded",
-						 MSGFLAG_ERROR);
-					delete(datainfo);
-					return 0;
-				}
+			if (sig->signature.size() > 1 &&
+					memcmp(&(chunk->data[sig->offset + 1]), sig->signature.data() + 1,
+						sig->signature.size() - 1) != 0)
+				continue;
 
-				datainfo->cdp_dev_id = 
-					MungeToPrintable((char *) &(chunk->data[offset + 4]), 
-									 elemlen - 4, 0);
-				gotinfo = 1;
-			} else if (elemtype == 0x03) {
-				if (elemlen < 4) {
-					_MSG("Corrupt CDP frame (possibly an exploit attempt), discarded",
-						 MSGFLAG_ERROR);
-					delete(datainfo);
-					return 0;
-				}
+			if (num_candidates == max_candidates)
+				break;
 
-				datainfo->cdp_port_id = 
-					MungeToPrintable((char *) &(chunk->data[offset + 4]), 
-									 elemlen - 4, 0);
-				gotinfo = 1;
+			unsigned int c = num_candidates++;
+
+			while (c > 0 && candidates[c - 1]->order > sig->order) {
+				candidates[c] = candidates[c - 1];
+				c--;
 			}
 
-			offset += elemlen;
+			candidates[c] = sig;
 		}
+	}
 
-		if (gotinfo) {
-			datainfo->proto = proto_cdp;
-			in_pack->insert(pack_comp_basicdata, datainfo);
+	for (unsigned int c = 0; c < num_candidates; c++) {
+		int r = candidates[c]->parser(in_pack, chunk, common);
+
+		if (r > 0)
 			return 1;
-		}
 
+		if (r < 0)
+			return 0;
 	}
 
-	if (kismax(20, ARP_OFFSET + ARP_PACKET_SIZE) < chunk->length && 
-		ARP_OFFSET + sizeof(ARP_SIGNATURE) < chunk->length &&
-		memcmp(&(chunk->data[ARP_OFFSET]),
-			   ARP_SIGNATURE, sizeof(ARP_SIGNATURE)) == 0) {
-		// If we look like a ARP frame and we're big enough to be an arp 
-		// frame...
-		
-		datainfo->proto = proto_arp;
-		memcpy(&(datainfo->ip_source_addr.s_addr),
-			   &(chunk->data[ARP_OFFSET + 16]), 4);
-		in_pack->insert(pack_comp_basicdata, datainfo);
-		return 1;
-	}
+	return 1;
+}
 
-	if (kismax(UDP_OFFSET + 4, IP_OFFSET + 11) < chunk->length && 
-		IP_OFFSET + sizeof(TCP_SIGNATURE) < chunk->length &&
-		memcmp(&(chunk->data[IP_OFFSET]),
-			   UDP_SIGNATURE, sizeof(UDP_SIGNATURE)) == 0) {
+// CDP cisco discovery frames, good for finding unauthorized APs
+int Kis_Dissector_IPdata::ParseCDP(kis_packet *in_pack, kis_datachunk *chunk,
+		kis_common_info *common) {
+	string cdp_dev_id, cdp_port_id;
 
-		// UDP frame...
-		datainfo->ip_source_port = 
-			kis_ntoh16(kis_extract16(&(chunk->data[UDP_OFFSET])));
-		datainfo->ip_dest_port = 
-			kis_ntoh16(kis_extract16(&(chunk->data[UDP_OFFSET + 2])));
+	unsigned int offset = 0;
 
-		memcpy(&(datainfo->ip_source_addr.s_addr),
-			   &(chunk->data[IP_OFFSET + 3]), 4);
-		memcpy(&(datainfo->ip_dest_addr.s_addr),
-			   &(chunk->data[IP_OFFSET + 7]), 4);
+	// Look for frames the old way, maybe v1 used it?  Compare the versions.
+	// I don't remember why the code worked this way.
+	if (chunk->data[LLC_UI_OFFSET + sizeof(CISCO_SIGNATURE)] == 2)
+		offset = LLC_UI_OFFSET + sizeof(CISCO_SIGNATURE) + 4;
+	else
+		offset = LLC_UI_OFFSET + 12;
 
-#if 0
-		if (datainfo->ip_source_port == IAPP_PORT &&
-			datainfo->ip_dest_port == IAPP_PORT &&
-			(IAPP_OFFSET + IAPP_HEADER_SIZE) < chunk->length) {
-
-			uint8_t iapp_version = 
-				chunk->data[IAPP_OFFSET];
-			uint8_t iapp_type =
-				chunk->data[IAPP_OFFSET + 1];
-
-			// If we can't understand the iapp version, bail and return the
-			// UDP frame we DID decode
-			if (iapp_version != 1) {
-				in_pack->insert(pack_comp_basicdata, datainfo);
-				return 1;
+	// Did we get useful info?
+	int gotinfo = 0;
+
+	while (offset + CDP_ELEMENT_LEN < chunk->length) {
+	// uint16_t dot1x_length = kis_extract16(&(chunk->data[offset + 2]));
+		uint16_t elemtype = kis_ntoh16(kis_extract16(&(chunk->data[offset + 0])));
+		uint16_t elemlen = kis_ntoh16(kis_extract16(&(chunk->data[offset + 2])));
+
+		if (elemlen == 0)
+			break;
+
+		if (offset + elemlen >= chunk->length)
+			break;
+
+		if (elemtype == 0x01) {
+			// Device id, we care about this
+			if (elemlen < 4) {
+				_MSG("Corrupt CDP frame (possibly an exploit attempt), discarded",
+					 MSGFLAG_ERROR);
+				return -1;
 			}
 
-			// Same again -- bail on UDP if we can't make sense of this
-			switch (iapp_type) {
-				case iapp_announce_request:
-				case iapp_announce_response:
-				case iapp_handover_request:
-				case iapp_handover_response:
-					break;
-				default:
-					in_pack->insert(pack_comp_basicdata, datainfo);
-					return 1;
-					break;
+			cdp_dev_id = 
+				MungeToPrintable((char *) &(chunk->data[offset + 4]), 
+								 elemlen - 4, 0);
+			gotinfo = 1;
+		} else if (elemtype == 0x03) {
+			if (elemlen < 4) {
+				_MSG("Corrupt CDP frame (possibly an exploit attempt), discarded",
+					 MSGFLAG_ERROR);
+				return -1;
 			}
 
-			unsigned int pdu_offset = IAPP_OFFSET + IAPP_HEADER_SIZE;
+			cdp_port_id = 
+				MungeToPrintable((char *) &(chunk->data[offset + 4]), 
+								 elemlen - 4, 0);
+			gotinfo = 1;
+		}
 
-			while (pdu_offset + IAPP_PDUHEADER_SIZE < chunk->length) {
-				uint8_t *pdu = &(chunk->data[pdu_offset]);
-				uint8_t pdu_type = pdu[0];
-				uint8_t pdu_len = pdu[1];
+		offset += elemlen;
+	}
 
-				// If we have a short/malformed PDU frame, bail
-				if ((pdu_offset + 3 + pdu_len) >= chunk->length) {
-					delete datainfo;
-					return 0;
-				}
+	if (!gotinfo)
+		return 0;
 
-				switch (pdu_type) {
-					case iapp_pdu_ssid:
-						if (pdu_len > SSID_SIZE)
-							break;
+	kis_data_packinfo *datainfo = new kis_data_packinfo;
 
-						packinfo->ssid = 
-							MungeToPrintable((char *) &(pdu[3]), pdu_len, 0);
-						break;
-					case iapp_pdu_bssid:
-						if (pdu_len != PHY80211_MAC_LEN)
-							break;
+	datainfo->cdp_dev_id = cdp_dev_id;
+	datainfo->cdp_port_id = cdp_port_id;
+	datainfo->proto = proto_cdp;
+	in_pack->insert(pack_comp_basicdata, datainfo);
+
+	return 1;
+}
+
+int Kis_Dissector_IPdata::ParseARP(kis_packet *in_pack, kis_datachunk *chunk,
+		kis_common_info *common) {
+	kis_data_packinfo *datainfo = new kis_data_packinfo;
+
+	datainfo->proto = proto_arp;
+	memcpy(&(datainfo->ip_source_addr.s_addr),
+		   &(chunk->data[ARP_OFFSET + 16]), 4);
+	in_pack->insert(pack_comp_basicdata, datainfo);
+	return 1;
+}
+
+int Kis_Dissector_IPdata::ParseUDP(kis_packet *in_pack, kis_datachunk *chunk,
+		kis_common_info *common) {
+	kis_data_packinfo *datainfo = new kis_data_packinfo;
+
+	// UDP frame...
+	datainfo->ip_source_port = 
+		kis_ntoh16(kis_extract16(&(chunk->data[UDP_OFFSET])));
+	datainfo->ip_dest_port = 
+		kis_ntoh16(kis_extract16(&(chunk->data[UDP_OFFSET + 2])));
 
-						packinfo->bssid_mac = mac_addr(&(pdu[3]), PHY80211_MAC_LEN);
+	memcpy(&(datainfo->ip_source_addr.s_addr),
+		   &(chunk->data[IP_OFFSET + 3]), 4);
+	memcpy(&(datainfo->ip_dest_addr.s_addr),
+		   &(chunk->data[IP_OFFSET + 7]), 4);
+
+#if 0
+	if (datainfo->ip_source_port == IAPP_PORT &&
+		datainfo->ip_dest_port == IAPP_PORT &&
+		(IAPP_OFFSET + IAPP_HEADER_SIZE) < chunk->length) {
+
+		uint8_t iapp_version = 
+			chunk->data[IAPP_OFFSET];
+		uint8_t iapp_type =
+			chunk->data[IAPP_OFFSET + 1];
+
+		// If we can't understand the iapp version, bail and return the
+		// UDP frame we DID decode
+		if (iapp_version != 1) {
+			in_pack->insert(pack_comp_basicdata, datainfo);
+			return 1;
+		}
+
+		// Same again -- bail on UDP if we can't make sense of this
+		switch (iapp_type) {
+			case iapp_announce_request:
+			case iapp_announce_response:
+			case iapp_handover_request:
+			case iapp_handover_response:
+				break;
+			default:
+				in_pack->insert(pack_comp_basicdata, datainfo);
+				return 1;
+				break;
+		}
+
+		unsigned int pdu_offset = IAPP_OFFSET + IAPP_HEADER_SIZE;
+
+		while (pdu_offset + IAPP_PDUHEADER_SIZE < chunk->length) {
+			uint8_t *pdu = &(chunk->data[pdu_offset]);
+			uint8_t pdu_type = pdu[0];
+			uint8_t pdu_len = pdu[1];
+
+			// If we have a short/malformed PDU frame, bail
+			if ((pdu_offset + 3 + pdu_len) >= chunk->length) {
+				delete datainfo;
+				return -1;
+			}
+
+			switch (pdu_type) {
+				case iapp_pdu_ssid:
+					if (pdu_len > SSID_SIZE)
 						break;
-					case iapp_pdu_capability:
-						if (pdu_len != 1)
-							break;
-						if ((pdu[3] & iapp_cap_wep))
-							packinfo->cryptset |= crypt_wep;
+
+					packinfo->ssid = 
+						MungeToPrintable((char *) &(pdu[3]), pdu_len, 0);
+					break;
+				case iapp_pdu_bssid:
+					if (pdu_len != PHY80211_MAC_LEN)
 						break;
-					case iapp_pdu_channel:
-						if (pdu_len != 1)
-							break;
-						packinfo->channel = (int) pdu[3];
+
+					packinfo->bssid_mac = mac_addr(&(pdu[3]), PHY80211_MAC_LEN);
+					break;
+				case iapp_pdu_capability:
+					if (pdu_len != 1)
 						break;
-					case iapp_pdu_beaconint:
-						if (pdu_len != 2)
-							break;
-						packinfo->beacon_interval = (int) ((pdu[3] << 8) | pdu[4]);
+					if ((pdu[3] & iapp_cap_wep))
+						packinfo->cryptset |= crypt_wep;
+					break;
+				case iapp_pdu_channel:
+					if (pdu_len != 1)
 						break;
-					case iapp_pdu_oldbssid:
-					case iapp_pdu_msaddr:
-					case iapp_pdu_announceint:
-					case iapp_pdu_hotimeout:
-					case iapp_pdu_messageid:
-					case iapp_pdu_phytype:
-					case iapp_pdu_regdomain:
-					case iapp_pdu_ouiident:
-					case iapp_pdu_authinfo:
-					default:
+					packinfo->channel = (int) pdu[3];
+					break;
+				case iapp_pdu_beaconint:
+					if (pdu_len != 2)
 						break;
-				}
-				pdu_offset += pdu_len + 3;
+					packinfo->beacon_interval = (int) ((pdu[3] << 8) | pdu[4]);
+					break;
+				case iapp_pdu_oldbssid:
+				case iapp_pdu_msaddr:
+				case iapp_pdu_announceint:
+				case iapp_pdu_hotimeout:
+				case iapp_pdu_messageid:
+				case iapp_pdu_phytype:
+				case iapp_pdu_regdomain:
+				case iapp_pdu_ouiident:
+				case iapp_pdu_authinfo:
+				default:
+					break;
 			}
+			pdu_offset += pdu_len + 3;
+		}
 
-			datainfo->proto = proto_iapp;
-			in_pack->insert(pack_comp_basicdata, datainfo);
-			return 1;
-		} // IAPP port
-
-		if ((datainfo->ip_source_port == ISAKMP_PORT ||
-			 datainfo->ip_dest_port == ISAKMP_PORT) &&
-			(ISAKMP_OFFSET + ISAKMP_PACKET_SIZE) < chunk->length) {
-			
-			datainfo->proto = proto_isakmp;
-			datainfo->field1 = 
-				chunk->data[ISAKMP_OFFSET + 4];
-
-			packinfo->cryptset |= crypt_isakmp;
-			
-			in_pack->insert(pack_comp_basicdata, datainfo);
-			return 1;
+		datainfo->proto = proto_iapp;
+		in_pack->insert(pack_comp_basicdata, datainfo);
+		return 1;
+	} // IAPP port
 
-		}
+	if ((datainfo->ip_source_port == ISAKMP_PORT ||
+		 datainfo->ip_dest_port == ISAKMP_PORT) &&
+		(ISAKMP_OFFSET + ISAKMP_PACKET_SIZE) < chunk->length) {
+		
+		datainfo->proto = proto_isakmp;
+		datainfo->field1 = 
+			chunk->data[ISAKMP_OFFSET + 4];
+
+		packinfo->cryptset |= crypt_isakmp;
+		
+		in_pack->insert(pack_comp_basicdata, datainfo);
+		return 1;
+
+	}
 #endif
 
-		/* DHCP Offer */
-		if (common->dest == globalreg->broadcast_mac &&
-			datainfo->ip_source_port == 67 &&
-			datainfo->ip_dest_port == 68) {
+	/* DHCP Offer */
+	if (common->dest == globalreg->broadcast_mac &&
+		datainfo->ip_source_port == 67 &&
+		datainfo->ip_dest_port == 68) {
 
-			// Extract the DHCP tags the same way we get IEEE 80211 tags,
-			// infact we can re-use the code
-			map<int, vector<int> > dhcp_tag_map;
+		// Extract the DHCP tags the same way we get IEEE 80211 tags,
+		// infact we can re-use the code
+		map<int, vector<int> > dhcp_tag_map;
 
-			// This is convenient since it won't return anything that is outside
-			// the context of the packet, we can feed it the length w/out checking 
-			// and we can trust the tags
-			GetLengthTagOffsets(DHCPD_OFFSET + 252, chunk, &dhcp_tag_map);
+		// This is convenient since it won't return anything that is outside
+		// the context of the packet, we can feed it the length w/out checking 
+		// and we can trust the tags
+		GetLengthTagOffsets(DHCPD_OFFSET + 252, chunk, &dhcp_tag_map);
 
-			if (dhcp_tag_map.find(53) != dhcp_tag_map.end() &&
-				dhcp_tag_map[53].size() != 0 &&
-				chunk->data[dhcp_tag_map[53][0] + 1] == 0x02) {
+		if (dhcp_tag_map.find(53) != dhcp_tag_map.end() &&
+			dhcp_tag_map[53].size() != 0 &&
+			chunk->data[dhcp_tag_map[53][0] + 1] == 0x02) {
 
-				// We're a DHCP offer...
-				datainfo->proto = proto_dhcp_offer;
+			// We're a DHCP offer...
+			datainfo->proto = proto_dhcp_offer;
 
-				// This should never be possible, but let's check
-				if ((DHCPD_OFFSET + 32) >= chunk->length) {
-					delete datainfo;
-					return 0;
-				}
+			// This should never be possible, but let's check
+			if ((DHCPD_OFFSET + 32) >= chunk->length) {
+				delete datainfo;
+				return -1;
+			}
 
-				memcpy(&(datainfo->ip_dest_addr.s_addr), 
-					   &(chunk->data[DHCPD_OFFSET + 28]), 4);
+			memcpy(&(datainfo->ip_dest_addr.s_addr), 
+				   &(chunk->data[DHCPD_OFFSET + 28]), 4);
 
-				if (dhcp_tag_map.find(1) != dhcp_tag_map.end() &&
-					dhcp_tag_map[1].size() != 0) {
+			if (dhcp_tag_map.find(1) != dhcp_tag_map.end() &&
+				dhcp_tag_map[1].size() != 0) {
 
-					memcpy(&(datainfo->ip_netmask_addr.s_addr), 
-						   &(chunk->data[dhcp_tag_map[1][0] + 1]), 4);
-				}
+				memcpy(&(datainfo->ip_netmask_addr.s_addr), 
+					   &(chunk->data[dhcp_tag_map[1][0] + 1]), 4);
+			}
 
-				if (dhcp_tag_map.find(3) != dhcp_tag_map.end() &&
-					dhcp_tag_map[3].size() != 0) {
+			if (dhcp_tag_map.find(3) != dhcp_tag_map.end() &&
+				dhcp_tag_map[3].size() != 0) {
 
-					memcpy(&(datainfo->ip_gateway_addr.s_addr), 
-						   &(chunk->data[dhcp_tag_map[3][0] + 1]), 4);
-				}
+				memcpy(&(datainfo->ip_gateway_addr.s_addr), 
+					   &(chunk->data[dhcp_tag_map[3][0] + 1]), 4);
 			}
 		}
+	}
 
-		/* DHCP Discover */
-		if (common->dest == globalreg->broadcast_mac &&
-			datainfo->ip_source_port == 68 &&
-			datainfo->ip_dest_port == 67) {
+	/* DHCP Discover */
+	if (common->dest == globalreg->broadcast_mac &&
+		datainfo->ip_source_port == 68 &&
+		datainfo->ip_dest_port == 67) {
 
-			// Extract the DHCP tags the same way we get IEEE 80211 tags,
-			// infact we can re-use the code
-			map<int, vector<int> > dhcp_tag_map;
+		// Extract the DHCP tags the same way we get IEEE 80211 tags,
+		// infact we can re-use the code
+		map<int, vector<int> > dhcp_tag_map;
 
-			// This is convenient since it won't return anything that is outside
-			// the context of the packet, we can feed it the length w/out checking 
-			// and we can trust the tags
-			GetLengthTagOffsets(DHCPD_OFFSET + 252, chunk, &dhcp_tag_map);
+		// This is convenient since it won't return anything that is outside
+		// the context of the packet, we can feed it the length w/out checking 
+		// and we can trust the tags
+		GetLengthTagOffsets(DHCPD_OFFSET + 252, chunk, &dhcp_tag_map);
 
-			if (dhcp_tag_map.find(53) != dhcp_tag_map.end() &&
-				dhcp_tag_map[53].size() != 0 &&
-				chunk->data[dhcp_tag_map[53][0] + 1] == 0x01) {
+		if (dhcp_tag_map.find(53) != dhcp_tag_map.end() &&
+			dhcp_tag_map[53].size() != 0 &&
+			chunk->data[dhcp_tag_map[53][0] + 1] == 0x01) {
 
-				// We're definitely a dhcp discover
-				datainfo->proto = proto_dhcp_discover;
+			// We're definitely a dhcp discover
+			datainfo->proto = proto_dhcp_discover;
 
-				if (dhcp_tag_map.find(12) != dhcp_tag_map.end() &&
-					dhcp_tag_map[12].size() != 0) {
+			if (dhcp_tag_map.find(12) != dhcp_tag_map.end() &&
+				dhcp_tag_map[12].size() != 0) {
 
-					datainfo->discover_host = 
-						string((char *) &(chunk->data[dhcp_tag_map[12][0] + 1]), 
-							   chunk->data[dhcp_tag_map[12][0]]);
+				datainfo->discover_host = 
+					string((char *) &(chunk->data[dhcp_tag_map[12][0] + 1]), 
+						   chunk->data[dhcp_tag_map[12][0]]);
 
-					datainfo->discover_host = MungeToPrintable(datainfo->discover_host);
-				}
+				datainfo->discover_host = MungeToPrintable(datainfo->discover_host);
+			}
 
-				if (dhcp_tag_map.find(60) != dhcp_tag_map.end() &&
-					dhcp_tag_map[60].size() != 0) {
+			if (dhcp_tag_map.find(60) != dhcp_tag_map.end() &&
+				dhcp_tag_map[60].size() != 0) {
 
-					datainfo->discover_vendor = 
-						string((char *) &(chunk->data[dhcp_tag_map[60][0] + 1]), 
-							   chunk->data[dhcp_tag_map[60][0]]);
-					datainfo->discover_vendor = 
-						MungeToPrintable(datainfo->discover_vendor);
-				}
+				datainfo->discover_vendor = 
+					string((char *) &(chunk->data[dhcp_tag_map[60][0] + 1]), 
+						   chunk->data[dhcp_tag_map[60][0]]);
+				datainfo->discover_vendor = 
+					MungeToPrintable(datainfo->discover_vendor);
+			}
 
-				if (dhcp_tag_map.find(61) != dhcp_tag_map.end() &&
-					dhcp_tag_map[61].size() == 7) {
-					mac_addr clmac = mac_addr(&(chunk->data[dhcp_tag_map[61][0] + 2]),
-											  6);
-
-					if (clmac != common->source) {
-						_COMMONALERT(alert_dhcpclient_ref, in_pack, common, 
-							 string("DHCP request from ") +
-							 common->source.Mac2String() + 
-							 string(" doesn't match DHCP DISCOVER client id ") +
-							 clmac.Mac2String() + string(" which can indicate "
-														 "a DHCP spoofing attack"));
-					}
+			if (dhcp_tag_map.find(61) != dhcp_tag_map.end() &&
+				dhcp_tag_map[61].size() == 7) {
+				mac_addr clmac = mac_addr(&(chunk->data[dhcp_tag_map[61][0] + 2]),
+										  6);
+
+				if (clmac != common->source) {
+					_COMMONALERT(alert_dhcpclient_ref, in_pack, common, 
+						 string("DHCP request from ") +
+						 common->source.Mac2String() + 
+						 string(" doesn't match DHCP DISCOVER client id ") +
+						 clmac.Mac2String() + string(" which can indicate "
+													 "a DHCP spoofing attack"));
 				}
 			}
 		}
+	}
 
-		// MDNS extractor
-		if (datainfo->ip_source_port == 5353 &&
-			datainfo->ip_dest_port == 5353) {
-			uint16_t mdns_flag_response = (1 << 15);
-
-			uint16_t mdns_flags;
-			uint16_t answer_rr = 0, auth_rr = 0, additional_rr = 0;
+	// MDNS extractor
+	if (datainfo->ip_source_port == 5353 &&
+		datainfo->ip_dest_port == 5353) {
+		uint16_t mdns_flag_response = (1 << 15);
 
-			// mdns name
-			string mdns_name;
-			string mdns_ptr;
+		uint16_t mdns_flags;
+		uint16_t answer_rr = 0, auth_rr = 0, additional_rr = 0;
 
-			// Skip UDP headers
-			unsigned int mdns_start = UDP_OFFSET + 8;
-			unsigned int offt = UDP_OFFSET + 8;
+		// mdns name
+		string mdns_name;
+		string mdns_ptr;
 
-			map<unsigned int, string> mdns_cache;
+		// Skip UDP headers
+		unsigned int mdns_start = UDP_OFFSET + 8;
+		unsigned int offt = UDP_OFFSET + 8;
 
-			// Skip transaction ID, we don't care
-			offt += 2;
+		map<unsigned int, string> mdns_cache;
 
-			if (offt + 2 >= chunk->length)
-				goto mdns_end;
+		// Skip transaction ID, we don't care
+		offt += 2;
 
-			mdns_flags = 
-				kis_ntoh16(kis_extract16(&(chunk->data[offt])));
+		if (offt + 2 >= chunk->length)
+			goto mdns_end;
 
-			// Only care about responses right now
-			if ((mdns_flags & mdns_flag_response) == 0) {
-				// printf("debug - mdns doesn't look like response, flags %x\n", mdns_flags);
-				goto mdns_end;
-			}
+		mdns_flags = 
+			kis_ntoh16(kis_extract16(&(chunk->data[offt])));
 
-			// Skip past flags
-			offt += 2;
+		// Only care about responses right now
+		if ((mdns_flags & mdns_flag_response) == 0) {
+			// printf("debug - mdns doesn't look like response, flags %x\n", mdns_flags);
+			goto mdns_end;
+		}
 
-			// Skip Q
-			offt += 2;
+		// Skip past flags
+		offt += 2;
 
-			if (offt + 8 >= chunk->length)
-				goto mdns_end;
+		// Skip Q
+		offt += 2;
 
-			answer_rr = 
-				kis_ntoh16(kis_extract16(&(chunk->data[offt])));
-			auth_rr = 
-				kis_ntoh16(kis_extract16(&(chunk->data[offt+2])));
-			additional_rr = 
-				kis_ntoh16(kis_extract16(&(chunk->data[offt+4])));
+		if (offt + 8 >= chunk->length)
+			goto mdns_end;
 
-			// answer, auth, additional
-			offt += 6;
+		answer_rr = 
+			kis_ntoh16(kis_extract16(&(chunk->data[offt])));
+		auth_rr = 
+			kis_ntoh16(kis_extract16(&(chunk->data[offt+2])));
+		additional_rr = 
+			kis_ntoh16(kis_extract16(&(chunk->data[offt+4])));
 
-			if (offt >= chunk->length)
-				goto mdns_end;
+		// answer, auth, additional
+		offt += 6;
 
-			// printf("debug - mdns - looking at %u answers\n", answer_rr + auth_rr + additional_rr);
-			for (uint32_t a = 0; a < (uint32_t) (answer_rr + auth_rr + additional_rr); a++) {
-				int retbytes;
+		if (offt >= chunk->length)
+			goto mdns_end;
 
-				mdns_name = MDNS_Fetchname(chunk, mdns_start, offt, &mdns_cache, &retbytes);
+		// printf("debug - mdns - looking at %u answers\n", answer_rr + auth_rr + additional_rr);
+		for (uint32_t a = 0; a < (uint32_t) (answer_rr + auth_rr + additional_rr); a++) {
+			int retbytes;
 
-				if (retbytes <= 0)
-					goto mdns_end;
+			mdns_name = MDNS_Fetchname(chunk, mdns_start, offt, &mdns_cache, &retbytes);
 
-				offt += retbytes;
+			if (retbytes <= 0)
+				goto mdns_end;
 
-				// printf("debug - mdns record name: %s\n", mdns_name.c_str());
+			offt += retbytes;
 
-				if (offt + 2 >= chunk->length) {
-					goto mdns_end;
-				}
+			// printf("debug - mdns record name: %s\n", mdns_name.c_str());
 
-				uint16_t rec_type;
-
-				rec_type = 
-					kis_ntoh16(kis_extract16(&(chunk->data[offt])));
+			if (offt + 2 >= chunk->length) {
+				goto mdns_end;
+			}
 
-				// printf("debug - rectype %x\n", rec_type);
+			uint16_t rec_type;
 
-				offt += 8;
+			rec_type = 
+				kis_ntoh16(kis_extract16(&(chunk->data[offt])));
 
-				if (offt + 2 >= chunk->length) {
-					goto mdns_end;
-				}
+			// printf("debug - rectype %x\n", rec_type);
 
-				uint16_t rec_len;
+			offt += 8;
 
-				rec_len =
-					kis_ntoh16(kis_extract16(&(chunk->data[offt])));
+			if (offt + 2 >= chunk->length) {
+				goto mdns_end;
+			}
 
-				offt += 2;
+			uint16_t rec_len;
 
-				// printf("debug - mdns - record length %u\n", rec_len);
+			rec_len =
+				kis_ntoh16(kis_extract16(&(chunk->data[offt])));
 
-				if (offt + rec_len >= chunk->length)
-					goto mdns_end;
+			offt += 2;
 
-				// printf("debug - mdns - rectype %x reclen %u\n", rec_type, rec_len);
+			// printf("debug - mdns - record length %u\n", rec_len);
 
-				// Only care about PTR records for now
-				if (rec_type != 0xC) {
-					// printf("debug - mdns - not a PTR record, type %x, skipping\n", rec_type);
-					offt += rec_len;
-					continue;
-				}
+			if (offt + rec_len >= chunk->length)
+				goto mdns_end;
 
-				string mdns_rec;
+			// printf("debug - mdns - rectype %x reclen %u\n", rec_type, rec_len);
 
-				mdns_rec = MDNS_Fetchname(chunk, mdns_start, offt, &mdns_cache, &retbytes);
+			// Only care about PTR records for now
+			if (rec_type != 0xC) {
+				// printf("debug - mdns - not a PTR record, type %x, skipping\n", rec_type);
+				offt += rec_len;
+				continue;
+			}
 
-				if (retbytes <= 0)
-					goto mdns_end;
+			string mdns_rec;
 
-				offt += retbytes;
+			mdns_rec = MDNS_Fetchname(chunk, mdns_start, offt, &mdns_cache, &retbytes);
 
-				// printf("debug - mdns ptr %s\n", mdns_rec.c_str());
-			}
+			if (retbytes <= 0)
+				goto mdns_end;
 
-mdns_end:
-			;
+			offt += retbytes;
 
+			// printf("debug - mdns ptr %s\n", mdns_rec.c_str());
 		}
 
-		in_pack->insert(pack_comp_basicdata, datainfo);
-		return 1;
-
-	} // UDP frame
+mdns_end:
+		;
 
-	if (kismax(TCP_OFFSET + 4, IP_OFFSET + TCP_HEADER_SIZE) < chunk->length && 
-		IP_OFFSET + sizeof(TCP_SIGNATURE) < chunk->length &&
-		memcmp(&(chunk->data[IP_OFFSET]),
-			   TCP_SIGNATURE, sizeof(TCP_SIGNATURE)) == 0) {
+	}
 
-		// TCP frame...
-		datainfo->ip_source_port = 
-			kis_ntoh16(kis_extract16(&(chunk->data[TCP_OFFSET])));
-		datainfo->ip_dest_port = 
-			kis_ntoh16(kis_extract16(&(chunk->data[TCP_OFFSET + 2])));
+	in_pack->insert(pack_comp_basicdata, datainfo);
+	return 1;
+}
 
-		memcpy(&(datainfo->ip_source_addr.s_addr),
-			   &(chunk->data[IP_OFFSET + 3]), 4);
-		memcpy(&(datainfo->ip_dest_addr.s_addr),
-			   &(chunk->data[IP_OFFSET + 7]), 4);
+int Kis_Dissector_IPdata::ParseTCP(kis_packet *in_pack, kis_datachunk *chunk,
+		kis_common_info *common) {
+	kis_data_packinfo *datainfo = new kis_data_packinfo;
 
-		datainfo->proto = proto_tcp;
+	// TCP frame...
+	datainfo->ip_source_port = 
+		kis_ntoh16(kis_extract16(&(chunk->data[TCP_OFFSET])));
+	datainfo->ip_dest_port = 
+		kis_ntoh16(kis_extract16(&(chunk->data[TCP_OFFSET + 2])));
 
-		/*
-		if (datainfo->ip_source_port == PPTP_PORT || 
-			datainfo->ip_dest_port == PPTP_PORT) {
-			datainfo->proto = proto_pptp;
-			packinfo->cryptset |= crypt_pptp;
-		}
-		*/
+	memcpy(&(datainfo->ip_source_addr.s_addr),
+		   &(chunk->data[IP_OFFSET + 3]), 4);
+	memcpy(&(datainfo->ip_dest_addr.s_addr),
+		   &(chunk->data[IP_OFFSET + 7]), 4);
 
-		in_pack->insert(pack_comp_basicdata, datainfo);
-		return 1;
-	} // TCP frame
+	datainfo->proto = proto_tcp;
 
-	// Trash the data if we didn't fill it in
-	delete(datainfo);
+	/*
+	if (datainfo->ip_source_port == PPTP_PORT || 
+		datainfo->ip_dest_port == PPTP_PORT) {
+		datainfo->proto = proto_pptp;
+		packinfo->cryptset |= crypt_pptp;
+	}
+	*/
 
+	in_pack->insert(pack_comp_basicdata, datainfo);
 	return 1;
 }
+
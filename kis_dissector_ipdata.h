@@ -21,10 +21,34 @@
 
 #include "config.h"
 
+#include <pthread.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
 #include "globalregistry.h"
 #include "packet.h"
 #include "packetchain.h"
 
+// Data frame dissection is table driven: each signature is a run of bytes at
+// an offset into the data payload (the LLC header, the ethertype, the IP
+// protocol), the length the payload has to exceed for its parser to be safe to
+// run, and the parser.  Frames are dispatched on the byte at each signature
+// offset, so only the parsers whose signature can match a frame are compared
+// against it, in priority order.
+//
+// A parser returns 1 if it dissected the frame (and inserted its own
+// kis_data_packinfo), 0 if the frame isn't one it handles so the next matching
+// signature gets a try, or -1 to stop dissecting the frame.
+//
+// Plugins add their own protocols with RegisterSignature; the built-in
+// signatures are registered with priorities 0 (CDP), 10 (ARP), 20 (UDP) and
+// 30 (TCP).
+typedef std::function<int (kis_packet *, kis_datachunk *, kis_common_info *)> 
+    ipdata_parser;
+
 class Kis_Dissector_IPdata : public SharedGlobalData {
 public:
 	Kis_Dissector_IPdata() { 
@@ -38,11 +62,62 @@ public:
 
 	~Kis_Dissector_IPdata();
 
+	// Register a signature of in_sig_len bytes (at least 1) at in_offset of the
+	// data payload; in_parser is only called for frames longer than 
+	// in_min_len.  Lower priorities are tried first.  Returns the signature id,
+	// or -1 if the signature is empty.
+	int RegisterSignature(string in_name, unsigned int in_offset, 
+			const uint8_t *in_sig, size_t in_sig_len, unsigned int in_min_len, 
+			int in_priority, ipdata_parser in_parser);
+	void RemoveSignature(int in_id);
+
 protected:
 	GlobalRegistry *globalreg;
 
 	int pack_comp_datapayload, pack_comp_basicdata, pack_comp_common;
 	int alert_dhcpclient_ref;
+
+	struct ipdata_signature {
+		int id;
+		string name;
+		unsigned int offset;
+		vector<uint8_t> signature;
+		unsigned int min_length;
+		int priority;
+		ipdata_parser parser;
+
+		// Position in priority order
+		unsigned int order;
+	};
+
+	// Signatures sharing an offset, bucketed by their first byte
+	struct ipdata_signature_group {
+		unsigned int offset;
+		vector<unsigned int> by_byte[256];
+	};
+
+	// Immutable once built; registering a signature builds a new index, so
+	// frames in flight keep the one they started with
+	struct ipdata_signature_index {
+		vector<ipdata_signature> signatures;
+		vector<ipdata_signature_group> groups;
+	};
+
+	// Most signatures a single frame can be matched against
+	static const unsigned int max_candidates = 32;
+
+	pthread_mutex_t signature_mutex;
+	vector<ipdata_signature> signatures;
+	shared_ptr<ipdata_signature_index> signature_index;
+	int next_signature_id;
+
+	void RebuildSignatureIndex();
+
+	// Built-in parsers
+	int ParseCDP(kis_packet *in_pack, kis_datachunk *chunk, kis_common_info *common);
+	int ParseARP(kis_packet *in_pack, kis_datachunk *chunk, kis_common_info *common);
+	int ParseUDP(kis_packet *in_pack, kis_datachunk *chunk, kis_common_info *common);
+	int ParseTCP(kis_packet *in_pack, kis_datachunk *chunk, kis_common_info *common);
 };
 
 #endif
@@ -37,7 +37,7 @@ Kis_DLT_Handler::Kis_DLT_Handler(GlobalRegistry *in_globalreg) {
 
 	chainid = 
 		globalreg->packetchain->RegisterHandler(&kis_dlt_packethook, this,
-												CHAINPOS_POSTCAP, 0);
+												CHAINPOS_POSTCAP, 0, "dlt decapsulation");
 
 	pack_comp_linkframe =
 		globalreg->packetchain->RegisterPacketComponent("LINKFRAME");
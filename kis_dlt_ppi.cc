@@ -40,6 +40,8 @@ Kis_DLT_PPI::Kis_DLT_PPI(GlobalRegistry *in_globalreg) :
 	dlt_name = "PPI";
 	dlt = DLT_PPI;
 
+	globalreg->packetchain->SetHandlerDLT(chainid, dlt);
+
 	globalreg->InsertGlobal("DLT_PPI", shared_ptr<Kis_DLT_PPI>(this));
 
 	_MSG("Registering support for DLT_PPI packet header decoding", MSGFLAG_INFO);
@@ -262,8 +264,11 @@ int Kis_DLT_PPI::HandlePacket(kis_packet *in_pack) {
 		}
 	}
 
-	if (applyfcs)
+	// A truncated frame lost its FCS along with the rest of it
+	if (applyfcs && !in_pack->truncated)
 		applyfcs = 4;
+	else
+		applyfcs = 0;
 
 	decapchunk = new kis_datachunk;
 
@@ -71,17 +71,41 @@ Kis_DLT_Radiotap::Kis_DLT_Radiotap(GlobalRegistry *in_globalreg) :
 	dlt_name = "Radiotap";
 	dlt = DLT_IEEE802_11_RADIO;
 
+	globalreg->packetchain->SetHandlerDLT(chainid, dlt);
+
 	globalreg->InsertGlobal("DLT_RADIOTAP", shared_ptr<Kis_DLT_Radiotap>(this));
 
 	_MSG("Registering support for DLT_RADIOTAP packet header decoding", MSGFLAG_INFO);
-
-    crc32_init_table_80211(crc32_table);
 }
 
 Kis_DLT_Radiotap::~Kis_DLT_Radiotap() {
     globalreg->RemoveGlobal("DLT_RADIOTAP");
 }
 
+// Number of radiotap layouts each thread remembers; must be a power of 2
+#define RADIOTAP_LAYOUT_CACHE   16
+
+// Fields after the original set, which older radiotap headers don't name
+#define RADIOTAP_RX_FLAGS       14
+#define RADIOTAP_TX_FLAGS       15
+#define RADIOTAP_RTS_RETRIES    16
+#define RADIOTAP_DATA_RETRIES   17
+#define RADIOTAP_XCHANNEL       18
+#define RADIOTAP_MCS            19
+#define RADIOTAP_AMPDU_STATUS   20
+#define RADIOTAP_VHT            21
+
+#define RADIOTAP_MCS_HAVE_BW    0x01
+#define RADIOTAP_MCS_HAVE_MCS   0x02
+#define RADIOTAP_MCS_HAVE_GI    0x04
+#define RADIOTAP_MCS_BW_MASK    0x03
+#define RADIOTAP_MCS_BW_40      1
+#define RADIOTAP_MCS_SGI        0x04
+
+#define RADIOTAP_VHT_HAVE_GI    0x0004
+#define RADIOTAP_VHT_HAVE_BW    0x0040
+#define RADIOTAP_VHT_SGI        0x04
+
 #define ALIGN_OFFSET(offset, width) \
 	    ( (((offset) + ((width) - 1)) & (~((width) - 1))) - offset )
 
@@ -124,6 +148,112 @@ Kis_DLT_Radiotap::~Kis_DLT_Radiotap() {
 #define BITNO_4(x) (((x) >> 2) ? 2 + BITNO_2((x) >> 2) : BITNO_2((x)))
 #define BITNO_2(x) (((x) & 2) ? 1 : 0)
 #define BIT(n)	(1 << n)
+void Kis_DLT_Radiotap::BuildLayout(uint32_t in_present, unsigned int in_fields_offset,
+        radiotap_layout *ret_layout) {
+    unsigned int offt = in_fields_offset;
+	u_int32_t present, next_present;
+	enum ieee80211_radiotap_type bit;
+
+    ret_layout->flags = -1;
+    ret_layout->rate = -1;
+    ret_layout->channel = -1;
+    ret_layout->dbm_antsignal = -1;
+    ret_layout->dbm_antnoise = -1;
+    ret_layout->mcs = -1;
+    ret_layout->vht = -1;
+#if defined(SYS_OPENBSD)
+    ret_layout->rssi = -1;
+#endif
+
+    // Only fields in the first bitmap are decoded; bits in extended bitmaps all
+    // fall outside the fields we know, same as a field we don't know the size of
+    for (present = in_present; present; present = next_present) {
+        /* clear the least significant bit that is set */
+        next_present = present & (present - 1);
+
+        /* extract the least significant bit that is set */
+        bit = (enum ieee80211_radiotap_type) BITNO_32(present ^ next_present);
+
+        switch ((int) bit) {
+            case IEEE80211_RADIOTAP_FLAGS:
+                ret_layout->flags = offt;
+                offt += 1;
+                break;
+            case IEEE80211_RADIOTAP_RATE:
+                ret_layout->rate = offt;
+                offt += 1;
+                break;
+            case IEEE80211_RADIOTAP_DBM_ANTSIGNAL:
+                ret_layout->dbm_antsignal = offt;
+                offt += 1;
+                break;
+            case IEEE80211_RADIOTAP_DBM_ANTNOISE:
+                ret_layout->dbm_antnoise = offt;
+                offt += 1;
+                break;
+            /*
+            case IEEE80211_RADIOTAP_DB_ANTSIGNAL:
+            case IEEE80211_RADIOTAP_DB_ANTNOISE:
+            */
+            case IEEE80211_RADIOTAP_ANTENNA:
+            case IEEE80211_RADIOTAP_DBM_TX_POWER:
+                offt += 1;
+                break;
+            case IEEE80211_RADIOTAP_CHANNEL:
+                offt += ALIGN_OFFSET(offt, 2);
+                ret_layout->channel = offt;
+                offt += 4;
+                break;
+            case IEEE80211_RADIOTAP_FHSS:
+            case IEEE80211_RADIOTAP_LOCK_QUALITY:
+            case IEEE80211_RADIOTAP_TX_ATTENUATION:
+            case IEEE80211_RADIOTAP_DB_TX_ATTENUATION:
+                offt += ALIGN_OFFSET(offt, 2);
+                offt += 2;
+                break;
+            case IEEE80211_RADIOTAP_TSFT:
+                offt += ALIGN_OFFSET(offt, 8);
+                offt += 8;
+                break;
+            case RADIOTAP_RX_FLAGS:
+            case RADIOTAP_TX_FLAGS:
+                offt += ALIGN_OFFSET(offt, 2);
+                offt += 2;
+                break;
+            case RADIOTAP_RTS_RETRIES:
+            case RADIOTAP_DATA_RETRIES:
+                offt += 1;
+                break;
+            case RADIOTAP_XCHANNEL:
+            case RADIOTAP_AMPDU_STATUS:
+                offt += ALIGN_OFFSET(offt, 4);
+                offt += 8;
+                break;
+            case RADIOTAP_MCS:
+                ret_layout->mcs = offt;
+                offt += 3;
+                break;
+            case RADIOTAP_VHT:
+                offt += ALIGN_OFFSET(offt, 2);
+                ret_layout->vht = offt;
+                offt += 12;
+                break;
+#if defined(SYS_OPENBSD)
+            case IEEE80211_RADIOTAP_RSSI:
+                ret_layout->rssi = offt;
+                offt += 2;
+                break;
+#endif
+            default:
+                /* this bit indicates a field whose
+                 * size we do not know, so we cannot
+                 * proceed.
+                 */
+                return;
+        }
+    }
+}
+
 int Kis_DLT_Radiotap::HandlePacket(kis_packet *in_pack) {
     static int packnum = 0;
 
@@ -158,33 +288,22 @@ int Kis_DLT_Radiotap::HandlePacket(kis_packet *in_pack) {
 		return 1;
 	}
 
-	union {
-		int8_t	i8;
-		int16_t	i16;
-		u_int8_t	u8;
-		u_int16_t	u16;
-		u_int32_t	u32;
-		u_int64_t	u64;
-	} u;
-	union {
-		int8_t		i8;
-		int16_t		i16;
-		u_int8_t	u8;
-		u_int16_t	u16;
-		u_int32_t	u32;
-		u_int64_t	u64;
-	} u2;
-
-	u2.u64 = 0;
-
 	struct ieee80211_radiotap_header *hdr;
-	u_int32_t present, next_present;
-	u_int32_t *presentp, *last_presentp;
-	enum ieee80211_radiotap_type bit;
-	int bit0;
-	const u_char *iter;
-	const u_char *iter_start;
-	unsigned int iter_align;
+	u_int32_t *last_presentp;
+	unsigned int it_len, fields_offset;
+	uint64_t layout_key;
+	radiotap_layout *layout;
+
+    // A key never has a zero fields offset, so zeroed slots are empty
+    struct layout_cache_slot {
+        uint64_t key;
+        radiotap_layout layout;
+    };
+    static thread_local layout_cache_slot layout_cache[RADIOTAP_LAYOUT_CACHE];
+    layout_cache_slot *cache_slot;
+
+	u_int16_t chan_freq, chan_flags;
+	u_int8_t rtflags;
 	int fcs_cut = 0; // Is the FCS bit set?
     bool fcs_flag_invalid = false; // Do we have a flag that tells us the fcs is known bad?
 	char errstr[STATUS_MAX];
@@ -221,161 +340,160 @@ int Kis_DLT_Radiotap::HandlePacket(kis_packet *in_pack) {
         return 0;
     }
 
+    it_len = EXTRACT_LE_16BITS(&(hdr->it_len));
+
+    // Fields start after the last bitmap, and are aligned from the start of the
+    // header, so the number of bitmaps and the first bitmap fix every offset
+    fields_offset = (u_char *) (last_presentp + 1) - linkchunk->data;
+    layout_key = ((uint64_t) fields_offset << 32) | EXTRACT_LE_32BITS(&hdr->it_present);
+
+    cache_slot = &(layout_cache[((layout_key * 0x9E3779B97F4A7C15ULL) >> 32) &
+            (RADIOTAP_LAYOUT_CACHE - 1)]);
+
+    if (cache_slot->key != layout_key) {
+        BuildLayout(EXTRACT_LE_32BITS(&hdr->it_present), fields_offset, 
+                &(cache_slot->layout));
+        cache_slot->key = layout_key;
+    }
+
+    layout = &(cache_slot->layout);
+
 	decapchunk = new kis_datachunk;
 	radioheader = new kis_layer1_packinfo;
 
 	decapchunk->dlt = KDLT_IEEE802_11;
-	
-    iter = (u_char*)(last_presentp + 1); 
-    // Alignment in Radiotap must be done from the beginning of the header, 
-    // not from the byte following the last bitmap. 
-    iter_start = (u_char*)(linkchunk->data); 
-
-    for (bit0 = 0, presentp = &hdr->it_present; presentp <= last_presentp;
-         presentp++, bit0 += 32) {
-        for (present = EXTRACT_LE_32BITS(presentp); present; present = next_present) {
-            /* clear the least significant bit that is set */
-            next_present = present & (present - 1);
-
-            /* extract the least significant bit that is set */
-            bit = (enum ieee80211_radiotap_type)
-                (bit0 + BITNO_32(present ^ next_present));
-
-            switch (bit) {
-                case IEEE80211_RADIOTAP_FLAGS:
-                case IEEE80211_RADIOTAP_RATE:
-				/*
-                case IEEE80211_RADIOTAP_DB_ANTSIGNAL:
-                case IEEE80211_RADIOTAP_DB_ANTNOISE:
-				*/
-                case IEEE80211_RADIOTAP_DBM_ANTSIGNAL:
-                case IEEE80211_RADIOTAP_DBM_ANTNOISE:
-                case IEEE80211_RADIOTAP_ANTENNA:
-                    u.u8 = *iter++;
-                    break;
-                case IEEE80211_RADIOTAP_DBM_TX_POWER:
-                    u.i8 = *iter++;
-                    break;
-                case IEEE80211_RADIOTAP_CHANNEL:
-					iter_align = ALIGN_OFFSET((unsigned int) (iter - iter_start), 2);
-					iter += iter_align;
-
-                    u.u16 = EXTRACT_LE_16BITS(iter);
-                    iter += sizeof(u.u16);
-                    u2.u16 = EXTRACT_LE_16BITS(iter);
-                    iter += sizeof(u2.u16);
-                    break;
-                case IEEE80211_RADIOTAP_FHSS:
-                case IEEE80211_RADIOTAP_LOCK_QUALITY:
-                case IEEE80211_RADIOTAP_TX_ATTENUATION:
-                case IEEE80211_RADIOTAP_DB_TX_ATTENUATION:
-					iter_align = ALIGN_OFFSET((unsigned int) (iter - iter_start), 2);
-					iter += iter_align;
-
-                    u.u16 = EXTRACT_LE_16BITS(iter);
-                    iter += sizeof(u.u16);
-                    break;
-                case IEEE80211_RADIOTAP_TSFT:
-					iter_align = ALIGN_OFFSET((unsigned int) (iter - iter_start), 8);
-					iter += iter_align;
-
-                    u.u64 = EXTRACT_LE_64BITS(iter);
-                    iter += sizeof(u.u64);
-                    break;
-#if defined(SYS_OPENBSD)
-                case IEEE80211_RADIOTAP_RSSI:
-                    u.u8 = EXTRACT_LE_8BITS(iter);
-                    iter += sizeof(u.u8);
-                    u2.u8 = EXTRACT_LE_8BITS(iter);
-                    iter += sizeof(u2.u8);
-                    break;
-#endif
-                default:
-                    /* this bit indicates a field whose
-                     * size we do not know, so we cannot
-                     * proceed.
-                     */
-                    next_present = 0;
-                    continue;
-            }
 
-			// static int pnum = 0;
-            switch (bit) {
-                case IEEE80211_RADIOTAP_CHANNEL:
-                    // radioheader->channel = ieee80211_mhz2ieee(u.u16, u2.u16);
-                    radioheader->freq_khz = (double) u.u16 * 1000;
-					// printf("debug - %d freq %u\n", pnum++, radioheader->freq_mhz);
-                    if (IEEE80211_IS_CHAN_FHSS(u2.u16))
-                        radioheader->carrier = carrier_80211fhss;
-                    else if (IEEE80211_IS_CHAN_A(u2.u16))
-                        radioheader->carrier = carrier_80211a;
-                    else if (IEEE80211_IS_CHAN_BPLUS(u2.u16))
-                        radioheader->carrier = carrier_80211bplus;
-                    else if (IEEE80211_IS_CHAN_B(u2.u16))
-                        radioheader->carrier = carrier_80211b;
-                    else if (IEEE80211_IS_CHAN_PUREG(u2.u16))
-                        radioheader->carrier = carrier_80211g;
-                    else if (IEEE80211_IS_CHAN_G(u2.u16))
-                        radioheader->carrier = carrier_80211g;
-                    else if (IEEE80211_IS_CHAN_T(u2.u16))
-                        radioheader->carrier = carrier_80211a;/*XXX*/
-                    else
-                        radioheader->carrier = carrier_unknown;
-                    if ((u2.u16 & IEEE80211_CHAN_CCK) == IEEE80211_CHAN_CCK)
-                        radioheader->encoding = encoding_cck;
-                    else if ((u2.u16 & IEEE80211_CHAN_OFDM) == IEEE80211_CHAN_OFDM)
-                        radioheader->encoding = encoding_ofdm;
-                    else if ((u2.u16 & IEEE80211_CHAN_DYN) == IEEE80211_CHAN_DYN)
-                        radioheader->encoding = encoding_dynamiccck;
-                    else if ((u2.u16 & IEEE80211_CHAN_GFSK) == IEEE80211_CHAN_GFSK)
-                        radioheader->encoding = encoding_gfsk;
-                    else
-                        radioheader->encoding = encoding_unknown;
-                    break;
-                case IEEE80211_RADIOTAP_RATE:
-					/* strip basic rate bit & convert to kismet units */
-                    radioheader->datarate = ((u.u8 &~ 0x80) / 2) * 10;
-                    break;
-				/* ignore DB values, they're not helpful
-                case IEEE80211_RADIOTAP_DB_ANTSIGNAL:
-                    radioheader->signal_dbm = u.i8;
-                    break;
-                case IEEE80211_RADIOTAP_DB_ANTNOISE:
-                    radioheader->noise_dbm = u.i8;
-                    break;
-				*/
-				case IEEE80211_RADIOTAP_DBM_ANTSIGNAL:
-                    radioheader->signal_type = kis_l1_signal_type_dbm;
-					radioheader->signal_dbm = u.i8;
-					break;
-				case IEEE80211_RADIOTAP_DBM_ANTNOISE:
-                    radioheader->signal_type = kis_l1_signal_type_dbm;
-					radioheader->noise_dbm = u.i8;
-					break;
-                case IEEE80211_RADIOTAP_FLAGS:
-                    if (u.u8 & IEEE80211_RADIOTAP_F_FCS) {
-						fcs_cut = 4;
-					}
-
-                    if (u.u8 & IEEE80211_RADIOTAP_F_BADFCS) {
-                        fcs_flag_invalid = true;
-                    }
-
-                    break;
-#if defined(SYS_OPENBSD)
-                case IEEE80211_RADIOTAP_RSSI:
-                    /* Convert to Kismet units...  No reason to use RSSI units
-					 * here since we know the conversion factor */
-                    radioheader->signal_type = kis_l1_signal_type_dbm;
-                    radioheader->signal_dbm = int((float(u.u8) / float(u2.u8) * 255));
-                    break;
-#endif
-                default:
-                    break;
+    // Fields which would run past the end of the radiotap header are ignored
+
+    if (layout->flags >= 0 && (unsigned int) layout->flags + 1 <= it_len) {
+        rtflags = linkchunk->data[layout->flags];
+
+        // A truncated frame lost its FCS along with the rest of it
+        if ((rtflags & IEEE80211_RADIOTAP_F_FCS) && !in_pack->truncated) {
+            fcs_cut = 4;
+        }
+
+        if (rtflags & IEEE80211_RADIOTAP_F_BADFCS) {
+            fcs_flag_invalid = true;
+        }
+
+        if (rtflags & IEEE80211_RADIOTAP_F_SHORTPRE)
+            radioheader->short_preamble = true;
+    }
+
+    // HT rate; the stream count follows from the index
+    if (layout->mcs >= 0 && (unsigned int) layout->mcs + 3 <= it_len) {
+        uint8_t known = linkchunk->data[layout->mcs];
+        uint8_t mflags = linkchunk->data[layout->mcs + 1];
+
+        if (known & RADIOTAP_MCS_HAVE_MCS) {
+            radioheader->mcs = linkchunk->data[layout->mcs + 2];
+            radioheader->mcs_nss = (radioheader->mcs / 8) + 1;
+            radioheader->mcs_vht = false;
+
+            if ((known & RADIOTAP_MCS_HAVE_BW) && 
+                    (mflags & RADIOTAP_MCS_BW_MASK) == RADIOTAP_MCS_BW_40)
+                radioheader->mcs_bandwidth = 40;
+            else
+                radioheader->mcs_bandwidth = 20;
+
+            radioheader->mcs_short_gi = 
+                (known & RADIOTAP_MCS_HAVE_GI) && (mflags & RADIOTAP_MCS_SGI);
+        }
+    }
+
+    // VHT rate of the first user
+    if (layout->vht >= 0 && (unsigned int) layout->vht + 12 <= it_len) {
+        uint16_t known = EXTRACT_LE_16BITS(linkchunk->data + layout->vht);
+        uint8_t vflags = linkchunk->data[layout->vht + 2];
+        uint8_t bw = linkchunk->data[layout->vht + 3];
+        uint8_t mcs_nss = linkchunk->data[layout->vht + 4];
+
+        if ((mcs_nss & 0x0F) != 0) {
+            radioheader->mcs = mcs_nss >> 4;
+            radioheader->mcs_nss = mcs_nss & 0x0F;
+            radioheader->mcs_vht = true;
+
+            // Bandwidth values 1-3 are kinds of 40MHz, 4-10 of 80MHz, and 11-25
+            // of 160MHz
+            radioheader->mcs_bandwidth = 20;
+
+            if (known & RADIOTAP_VHT_HAVE_BW) {
+                if (bw >= 11 && bw <= 25)
+                    radioheader->mcs_bandwidth = 160;
+                else if (bw >= 4)
+                    radioheader->mcs_bandwidth = 80;
+                else if (bw >= 1)
+                    radioheader->mcs_bandwidth = 40;
             }
+
+            radioheader->mcs_short_gi = 
+                (known & RADIOTAP_VHT_HAVE_GI) && (vflags & RADIOTAP_VHT_SGI);
         }
     }
 
+    if (layout->rate >= 0 && (unsigned int) layout->rate + 1 <= it_len) {
+        /* strip basic rate bit & convert to kismet units */
+        radioheader->datarate = ((linkchunk->data[layout->rate] &~ 0x80) / 2) * 10;
+    }
+
+    if (layout->channel >= 0 && (unsigned int) layout->channel + 4 <= it_len) {
+        chan_freq = EXTRACT_LE_16BITS(linkchunk->data + layout->channel);
+        chan_flags = EXTRACT_LE_16BITS(linkchunk->data + layout->channel + 2);
+
+        // radioheader->channel = ieee80211_mhz2ieee(chan_freq, chan_flags);
+        radioheader->freq_khz = (double) chan_freq * 1000;
+        if (IEEE80211_IS_CHAN_FHSS(chan_flags))
+            radioheader->carrier = carrier_80211fhss;
+        else if (IEEE80211_IS_CHAN_A(chan_flags))
+            radioheader->carrier = carrier_80211a;
+        else if (IEEE80211_IS_CHAN_BPLUS(chan_flags))
+            radioheader->carrier = carrier_80211bplus;
+        else if (IEEE80211_IS_CHAN_B(chan_flags))
+            radioheader->carrier = carrier_80211b;
+        else if (IEEE80211_IS_CHAN_PUREG(chan_flags))
+            radioheader->carrier = carrier_80211g;
+        else if (IEEE80211_IS_CHAN_G(chan_flags))
+            radioheader->carrier = carrier_80211g;
+        else if (IEEE80211_IS_CHAN_T(chan_flags))
+            radioheader->carrier = carrier_80211a;/*XXX*/
+        else
+            radioheader->carrier = carrier_unknown;
+        if ((chan_flags & IEEE80211_CHAN_CCK) == IEEE80211_CHAN_CCK)
+            radioheader->encoding = encoding_cck;
+        else if ((chan_flags & IEEE80211_CHAN_OFDM) == IEEE80211_CHAN_OFDM)
+            radioheader->encoding = encoding_ofdm;
+        else if ((chan_flags & IEEE80211_CHAN_DYN) == IEEE80211_CHAN_DYN)
+            radioheader->encoding = encoding_dynamiccck;
+        else if ((chan_flags & IEEE80211_CHAN_GFSK) == IEEE80211_CHAN_GFSK)
+            radioheader->encoding = encoding_gfsk;
+        else
+            radioheader->encoding = encoding_unknown;
+    }
+
+    /* ignore DB values, they're not helpful */
+
+    if (layout->dbm_antsignal >= 0 && (unsigned int) layout->dbm_antsignal + 1 <= it_len) {
+        radioheader->signal_type = kis_l1_signal_type_dbm;
+        radioheader->signal_dbm = (int8_t) linkchunk->data[layout->dbm_antsignal];
+    }
+
+    if (layout->dbm_antnoise >= 0 && (unsigned int) layout->dbm_antnoise + 1 <= it_len) {
+        radioheader->signal_type = kis_l1_signal_type_dbm;
+        radioheader->noise_dbm = (int8_t) linkchunk->data[layout->dbm_antnoise];
+    }
+
+#if defined(SYS_OPENBSD)
+    if (layout->rssi >= 0 && (unsigned int) layout->rssi + 2 <= it_len) {
+        /* Convert to Kismet units...  No reason to use RSSI units
+         * here since we know the conversion factor */
+        radioheader->signal_type = kis_l1_signal_type_dbm;
+        radioheader->signal_dbm = 
+            int((float(linkchunk->data[layout->rssi]) / 
+                        float(linkchunk->data[layout->rssi + 1]) * 255));
+    }
+#endif
+
 	if (EXTRACT_LE_16BITS(&(hdr->it_len)) + fcs_cut > (int) linkchunk->length) {
 		/*
 		_MSG("Pcap Radiotap converter got corrupted Radiotap frame, not "
@@ -463,47 +581,3 @@ int Kis_DLT_Radiotap::HandlePacket(kis_packet *in_pack) {
 #undef BITNO_2
 #undef BIT
 
-// Taken from the BBN USRP 802.11 encoding code
-unsigned int Kis_DLT_Radiotap::update_crc32_80211(unsigned int crc, const unsigned char *data,
-        int len, unsigned int poly) {
-	int i, j;
-	unsigned short ch;
-
-	for ( i = 0; i < len; ++i) {
-		ch = data[i];
-		for (j = 0; j < 8; ++j) {
-			if ((crc ^ ch) & 0x0001) {
-				crc = (crc >> 1) ^ poly;
-			} else {
-				crc = (crc >> 1);
-			}
-			ch >>= 1;
-		}
-	}
-	return crc;
-}
-
-void Kis_DLT_Radiotap::crc32_init_table_80211(unsigned int *crc32_table) {
-	int i;
-	unsigned char c;
-
-	for (i = 0; i < 256; ++i) {
-		c = (unsigned char) i;
-		crc32_table[i] = update_crc32_80211(0, &c, 1, IEEE_802_3_CRC32_POLY);
-	}
-}
-
-unsigned int Kis_DLT_Radiotap::crc32_le_80211(unsigned int *crc32_table, 
-        const unsigned char *buf, int len) {
-	int i;
-	unsigned int crc = 0xFFFFFFFF;
-
-	for (i = 0; i < len; ++i) {
-		crc = (crc >> 8) ^ crc32_table[(crc ^ buf[i]) & 0xFF];
-	}
-
-	crc ^= 0xFFFFFFFF;
-
-	return crc;
-}
-
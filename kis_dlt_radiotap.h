@@ -42,12 +42,30 @@ public:
 	~Kis_DLT_Radiotap();
 
 protected:
-    unsigned int update_crc32_80211(unsigned int crc, const unsigned char *data,
-            int len, unsigned int poly);
-    void crc32_init_table_80211(unsigned int *crc32_table);
-    unsigned int crc32_le_80211(unsigned int *crc32_table, const unsigned char *buf, int len);
+    // Where the fields we decode live in a radiotap header, as byte offsets from
+    // the start of the header, or -1 if the field isn't present.  Field positions
+    // depend only on the present bitmaps, and a source almost always sends the
+    // same bitmaps on every frame, so the layout is worked out once per set of
+    // bitmaps instead of walking and aligning every field of every packet.
+    // Recent layouts are cached per thread, so dissector threads never share or
+    // lock them.
+    struct radiotap_layout {
+        int flags;
+        int rate;
+        int channel;
+        int dbm_antsignal;
+        int dbm_antnoise;
+        int mcs;
+        int vht;
+#if defined(SYS_OPENBSD)
+        int rssi;
+#endif
+    };
 
-    unsigned int crc32_table[256];
+    // Build the layout for the first present bitmap, with fields starting at
+    // in_fields_offset after all of the bitmap words
+    static void BuildLayout(uint32_t in_present, unsigned int in_fields_offset,
+            radiotap_layout *ret_layout);
 };
 
 #endif
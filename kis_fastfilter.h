@@ -0,0 +1,176 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __KIS_FASTFILTER_H__
+#define __KIS_FASTFILTER_H__
+
+/* Fast packet filter plugin ABI
+ *
+ * A narrow, versioned C interface for plugins which only need to look at
+ * frames and decide what happens to them.  Unlike a packetchain handler, a
+ * fast filter doesn't need the Kismet C++ headers or ABI and never sees the
+ * packet itself:  it is handed a read-only view of the decoded headers and
+ * layer 1 info of a batch of packets, and returns a verdict and a set of tags
+ * for each.
+ *
+ * Filters are run in the dissector threads at the end of the data dissection
+ * chain (see packetchain.h), on up to 'packet_dissector_batch' packets at once,
+ * and run in parallel with themselves; the filter function must be reentrant.
+ * Without dissector threads they are run on every packet as a batch of one.
+ *
+ * A plugin provides a filter by exporting, in the C name space:
+ *
+ *  int kis_fastfilter_register(struct kis_fastfilter_registration *)
+ *
+ * which is called after kis_plugin_activate, if the plugin has one, with
+ * api_version set to KIS_FASTFILTER_API_VERSION.  The plugin fills in the rest
+ * of the record and returns non-negative, or returns negative if it doesn't
+ * support that version of the API.  A plugin may be nothing but a fast filter,
+ * in which case kis_plugin_activate may simply return 0.
+ *
+ * Everything in this file only ever grows at the end of a struct; fields are
+ * never reused, and the version is bumped whenever fields are added.
+ */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define KIS_FASTFILTER_API_VERSION      1
+
+/* Most tags a filter can define */
+#define KIS_FASTFILTER_MAX_TAGS         32
+
+/* Verdicts */
+#define KIS_FASTFILTER_PASS             0
+/* Mark the packet filtered; it is still counted against its device, as a
+ * filtered packet, but no longer tracked or logged as one */
+#define KIS_FASTFILTER_DROP             1
+
+/* Frame flags */
+/* The 802.11 fields are filled in */
+#define KIS_FASTFILTER_FRAME_DOT11      (1 << 0)
+/* The layer 1 fields are filled in */
+#define KIS_FASTFILTER_FRAME_L1         (1 << 1)
+/* The signal and noise are in dBm rather than RSSI */
+#define KIS_FASTFILTER_FRAME_DBM        (1 << 2)
+/* The frame is corrupt, or failed its checksum */
+#define KIS_FASTFILTER_FRAME_ERROR      (1 << 3)
+/* 802.11 frame control flags */
+#define KIS_FASTFILTER_FRAME_RETRY      (1 << 4)
+#define KIS_FASTFILTER_FRAME_PROTECTED  (1 << 5)
+#define KIS_FASTFILTER_FRAME_FRAGMENT   (1 << 6)
+
+/* Distribution of an 802.11 frame */
+#define KIS_FASTFILTER_DIST_UNKNOWN     0
+#define KIS_FASTFILTER_DIST_FROMDS      1
+#define KIS_FASTFILTER_DIST_TODS        2
+#define KIS_FASTFILTER_DIST_INTRADS     3
+#define KIS_FASTFILTER_DIST_ADHOC       4
+
+struct kis_fastfilter_frame {
+    /* Capture time */
+    uint64_t ts_sec;
+    uint32_t ts_usec;
+
+    /* KIS_FASTFILTER_FRAME_ flags */
+    uint32_t flags;
+
+    /* Link type and contents of the frame:  the 802.11 frame for wifi, with
+     * any capture headers removed; otherwise the frame as captured.  Only
+     * valid for the duration of the call. */
+    uint32_t dlt;
+    uint32_t length;
+    const uint8_t *data;
+
+    /* 802.11, with KIS_FASTFILTER_FRAME_DOT11:  the frame control type (0
+     * management, 1 control, 2 data) and subtype, as in the frame; addresses
+     * by role rather than by position, all zero when not in the frame */
+    uint8_t type;
+    uint8_t subtype;
+    uint8_t distrib;
+    uint8_t reserved0;
+    uint16_t sequence;
+    uint16_t fragment;
+    uint8_t source[6];
+    uint8_t dest[6];
+    uint8_t bssid[6];
+    uint8_t other[6];
+    /* Offset of the frame body in data */
+    uint32_t header_len;
+
+    /* Layer 1, with KIS_FASTFILTER_FRAME_L1 */
+    double freq_khz;
+    int32_t signal;
+    int32_t noise;
+    /* Rate in 100kbit/sec units, and the HT/VHT MCS index or -1 */
+    uint32_t datarate;
+    int32_t mcs;
+    /* Estimated time on the air, 0 if unknown */
+    uint32_t airtime_usec;
+};
+
+struct kis_fastfilter_batch {
+    uint32_t count;
+
+    /* Frames in this batch */
+    const struct kis_fastfilter_frame *frames;
+
+    /* Filled in by the filter, one per frame; every verdict starts as
+     * KIS_FASTFILTER_PASS and every tag set as 0 */
+    uint8_t *verdicts;
+    /* Bit N of a tag set applies the tag tag_names[N] of the registration */
+    uint32_t *tags;
+};
+
+/* Called from any dissector thread, possibly several at once; returns
+ * negative on failure, in which case the verdicts and tags of the batch are
+ * ignored */
+typedef int (*kis_fastfilter_func)(void *ctx, const struct kis_fastfilter_batch *batch);
+
+/* Called once the filter has been removed, before the plugin is unloaded */
+typedef void (*kis_fastfilter_release_func)(void *ctx);
+
+struct kis_fastfilter_registration {
+    /* Set by the server */
+    uint32_t api_version;
+
+    /* Set by the plugin */
+    const char *name;
+
+    /* Names of the tags, in bit order; at most KIS_FASTFILTER_MAX_TAGS.  Must
+     * remain valid while the plugin is loaded. */
+    uint32_t num_tags;
+    const char * const *tag_names;
+
+    void *ctx;
+    kis_fastfilter_func filter;
+    /* May be NULL */
+    kis_fastfilter_release_func release;
+};
+
+typedef int (*kis_fastfilter_register_func)(struct kis_fastfilter_registration *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -0,0 +1,205 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __KIS_FLAT_HASH_H__
+#define __KIS_FLAT_HASH_H__
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <utility>
+#include <vector>
+
+// Open-addressing hash map keyed on a uint64_t
+//
+// All entries live in a single flat array of slots; collisions are resolved by
+// linear probing and removals use backward-shift deletion so there are never
+// tombstones to skip.  Lookups touch one or two cache lines instead of walking
+// a tree of heap-allocated nodes, which matters for the per-packet device
+// lookups.
+//
+// Pointers returned by find() and insert() are only valid until the next insert
+// or erase.  Not thread safe; callers provide their own locking.
+template<class V>
+class kis_u64_flat_map {
+public:
+    kis_u64_flat_map() {
+        num_used = 0;
+        mask = 0;
+        grow(16);
+    }
+
+    // Murmur3 finalizer; device keys and macs are far from random in their
+    // low bits so they need real mixing before masking
+    static inline uint64_t mix(uint64_t k) {
+        k ^= k >> 33;
+        k *= 0xff51afd7ed558ccdULL;
+        k ^= k >> 33;
+        k *= 0xc4ceb9fe1a85ec53ULL;
+        k ^= k >> 33;
+        return k;
+    }
+
+    size_t size() const {
+        return num_used;
+    }
+
+    size_t capacity() const {
+        return slots.size();
+    }
+
+    V *find(uint64_t in_key) {
+        size_t pos = mix(in_key) & mask;
+
+        while (slots[pos].used) {
+            if (slots[pos].key == in_key)
+                return &(slots[pos].value);
+
+            pos = (pos + 1) & mask;
+        }
+
+        return NULL;
+    }
+
+    // Insert a value if the key is not already present.  Returns a pointer to the
+    // value in the map, and true if the value was inserted.
+    std::pair<V *, bool> insert(uint64_t in_key, const V& in_value) {
+        // Keep the load under 70% so probe runs stay short
+        if ((num_used + 1) * 10 > slots.size() * 7)
+            grow(slots.size() * 2);
+
+        size_t pos = mix(in_key) & mask;
+
+        while (slots[pos].used) {
+            if (slots[pos].key == in_key)
+                return std::make_pair(&(slots[pos].value), false);
+
+            pos = (pos + 1) & mask;
+        }
+
+        slots[pos].used = true;
+        slots[pos].key = in_key;
+        slots[pos].value = in_value;
+        num_used++;
+
+        return std::make_pair(&(slots[pos].value), true);
+    }
+
+    // Find or default-construct a value
+    V& operator[](uint64_t in_key) {
+        V *v = find(in_key);
+
+        if (v != NULL)
+            return *v;
+
+        return *(insert(in_key, V()).first);
+    }
+
+    bool erase(uint64_t in_key) {
+        size_t pos = mix(in_key) & mask;
+
+        while (slots[pos].used) {
+            if (slots[pos].key == in_key)
+                break;
+
+            pos = (pos + 1) & mask;
+        }
+
+        if (!slots[pos].used)
+            return false;
+
+        // Backward-shift: pull any following entries which would have wanted
+        // to live at or before the hole back into it
+        size_t hole = pos;
+        size_t next = (pos + 1) & mask;
+
+        while (slots[next].used) {
+            size_t ideal = mix(slots[next].key) & mask;
+
+            // Distance from the ideal slot to the hole and to the entry; if the
+            // hole is closer it's a valid home for the entry
+            if (((hole - ideal) & mask) < ((next - ideal) & mask)) {
+                slots[hole].key = slots[next].key;
+                slots[hole].value = slots[next].value;
+                hole = next;
+            }
+
+            next = (next + 1) & mask;
+        }
+
+        slots[hole].used = false;
+        slots[hole].value = V();
+        num_used--;
+
+        return true;
+    }
+
+    void clear() {
+        for (auto& s : slots) {
+            s.used = false;
+            s.value = V();
+        }
+
+        num_used = 0;
+    }
+
+    // Call a function on every entry, in no particular order
+    template<class F>
+    void for_each(F fn) {
+        for (auto& s : slots) {
+            if (s.used)
+                fn(s.key, s.value);
+        }
+    }
+
+protected:
+    class flat_slot {
+    public:
+        flat_slot() {
+            key = 0;
+            used = false;
+        }
+
+        uint64_t key;
+        bool used;
+        V value;
+    };
+
+    void grow(size_t in_sz) {
+        std::vector<flat_slot> old;
+        old.swap(slots);
+
+        slots.resize(in_sz);
+        mask = in_sz - 1;
+        num_used = 0;
+
+        for (auto& s : old) {
+            if (s.used)
+                insert(s.key, s.value);
+        }
+    }
+
+    std::vector<flat_slot> slots;
+    size_t num_used;
+    size_t mask;
+};
+
+#endif
+
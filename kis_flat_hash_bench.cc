@@ -0,0 +1,107 @@
+/* benchmark harness for the Kismet flat device index
+ *
+ * Compares insert and lookup cost of kis_u64_flat_map against std::map, using
+ * keys shaped like device keys (phy id in the upper bits, mac in the lower 48,
+ * devices clustered into a handful of OUIs)
+ *
+ * # configure kismet
+ * ./configure
+ *
+ * # build benchmark
+ * g++ -O2 -std=c++11 -o kis_flat_hash_bench kis_flat_hash_bench.cc
+ *
+ * ./kis_flat_hash_bench
+ *
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <map>
+#include <memory>
+#include <vector>
+#include <algorithm>
+
+#include "kis_flat_hash.h"
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1000000000.0f);
+}
+
+static std::vector<uint64_t> make_keys(size_t in_num) {
+    std::vector<uint64_t> ret;
+    uint64_t ouis[] = { 0x001122ULL, 0xF4F5D8ULL, 0x3C5AB4ULL, 0xACBC32ULL };
+
+    srand(1234);
+
+    for (size_t i = 0; i < in_num; i++) {
+        uint64_t oui = ouis[rand() % 4];
+        uint64_t mac = (oui << 24) | (i & 0xFFFFFF);
+        uint64_t phy = (uint64_t) ((i >> 24) + 1);
+        ret.push_back((phy << 48) | mac);
+    }
+
+    std::random_shuffle(ret.begin(), ret.end());
+
+    return ret;
+}
+
+static void bench(size_t in_num) {
+    std::vector<uint64_t> keys = make_keys(in_num);
+    std::vector<uint64_t> lookups = keys;
+    std::random_shuffle(lookups.begin(), lookups.end());
+
+    std::shared_ptr<int> val = std::make_shared<int>(1);
+    size_t found = 0;
+    double start;
+
+    std::map<uint64_t, std::shared_ptr<int> > tree;
+    kis_u64_flat_map<std::shared_ptr<int> > flat;
+
+    start = now_sec();
+    for (auto k : keys)
+        tree[k] = val;
+    double tree_ins = now_sec() - start;
+
+    start = now_sec();
+    for (auto k : lookups) {
+        if (tree.find(k) != tree.end())
+            found++;
+    }
+    double tree_find = now_sec() - start;
+
+    start = now_sec();
+    for (auto k : keys)
+        flat.insert(k, val);
+    double flat_ins = now_sec() - start;
+
+    start = now_sec();
+    for (auto k : lookups) {
+        if (flat.find(k) != NULL)
+            found++;
+    }
+    double flat_find = now_sec() - start;
+
+    if (found != in_num * 2)
+        fprintf(stderr, "lookups mismatched, found %lu of %lu\n", found, in_num * 2);
+
+    printf("%8lu devices  std::map insert %6.1fns find %6.1fns  "
+            "flat insert %6.1fns find %6.1fns\n",
+            in_num,
+            tree_ins * 1e9 / in_num, tree_find * 1e9 / in_num,
+            flat_ins * 1e9 / in_num, flat_find * 1e9 / in_num);
+}
+
+int main(void) {
+    bench(10000);
+    bench(100000);
+    bench(1000000);
+
+    return 0;
+}
+
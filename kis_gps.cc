@@ -38,11 +38,20 @@ KisGps::KisGps(GlobalRegistry *in_globalreg, SharedGpsBuilder in_builder) :
     gps_location = new kis_gps_packinfo();
     gps_last_location = new kis_gps_packinfo();
 
+    published_location = NULL;
+    location_lifetime = 10;
+
     shared_ptr<Timetracker> timetracker = globalreg->FetchGlobalAs<Timetracker>("TIMETRACKER");
 }
 
 KisGps::~KisGps() {
     local_eol_locker lock(&gps_mutex);
+
+    std::lock_guard<std::mutex> plock(published_mutex);
+
+    if (published_location != NULL)
+        published_location->release_component();
+    published_location = NULL;
 }
 
 bool KisGps::open_gps(string in_definition) {
@@ -241,5 +250,43 @@ void KisGps::update_locations() {
         tracked_last_location->set_time_sec(gps_last_location->tv.tv_sec);
         tracked_last_location->set_time_usec(gps_last_location->tv.tv_usec);
     }
+
+    publish_location();
+}
+
+void KisGps::publish_location() {
+    kis_gps_packinfo *pi = NULL;
+
+    if (gps_location != NULL) {
+        pi = new kis_gps_packinfo(gps_location);
+        pi->gpsuuid = get_gps_uuid();
+        pi->gpsname = get_gps_name();
+    }
+
+    kis_gps_packinfo *old;
+
+    {
+        std::lock_guard<std::mutex> lock(published_mutex);
+        old = published_location;
+        published_location = pi;
+    }
+
+    // Packets still holding the old fix keep it until they're done
+    if (old != NULL)
+        old->release_component();
+}
+
+kis_gps_packinfo *KisGps::acquire_published_location(time_t in_now) {
+    std::lock_guard<std::mutex> lock(published_mutex);
+
+    kis_gps_packinfo *pi = published_location;
+
+    if (pi == NULL || pi->fix < 2)
+        return NULL;
+
+    if (location_lifetime != 0 && in_now - pi->tv.tv_sec > location_lifetime)
+        return NULL;
+
+    return pi->acquire();
 }
 
@@ -129,6 +129,12 @@ public:
     // will determine if we consider a value to still be valid
     virtual bool get_location_valid() { return false; }
 
+    // Take a reference to the last published fix, if it is a 2d or 3d fix no
+    // older than location_lifetime; the caller releases it with
+    // release_component().  Doesn't take the GPS lock, so the packet path never
+    // waits on a GPS parsing a sentence.
+    kis_gps_packinfo *acquire_published_location(time_t in_now);
+
     virtual bool open_gps(string in_definition);
 
     // Various GPS transformation utility functions
@@ -193,6 +199,17 @@ protected:
     // Push the locations into the tracked locations and swap
     virtual void update_locations();
 
+    // Publish a copy of the current location for packets to share
+    void publish_location();
+
+    // The published fix, swapped under published_mutex and never changed once
+    // published
+    std::mutex published_mutex;
+    kis_gps_packinfo *published_location;
+
+    // Seconds a published fix stays valid for packets, 0 for always
+    time_t location_lifetime;
+
     SharedGpsBuilder gps_prototype;
 
     SharedTrackerElement gps_name;
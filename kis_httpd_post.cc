@@ -0,0 +1,215 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "kis_httpd_post.h"
+#include "msgpack_adapter.h"
+#include "base64.h"
+
+// Nesting deeper than this is refused, as it is by the JSON tape
+#define STRUCTURED_POST_MAX_DEPTH   64
+
+static int b64_value(unsigned char c) {
+    if (c >= 'A' && c <= 'Z')
+        return c - 'A';
+    if (c >= 'a' && c <= 'z')
+        return c - 'a' + 26;
+    if (c >= '0' && c <= '9')
+        return c - '0' + 52;
+
+    // A '+' which wasn't escaped in the form turns into a space when the form
+    // is decoded
+    if (c == '+' || c == ' ')
+        return 62;
+    if (c == '/')
+        return 63;
+
+    return -1;
+}
+
+// Strings are left in the unpacker buffer, which the object's zone keeps
+static bool reference_func(msgpack::type::object_type in_type __attribute__((unused)),
+        size_t in_len __attribute__((unused)), void *in_data __attribute__((unused))) {
+    return true;
+}
+
+Kis_Httpd_Structured_Post::Kis_Httpd_Structured_Post(const std::string& in_var,
+        size_t in_max_sz) :
+    unpacker(&reference_func, NULL,
+            MSGPACK_UNPACKER_INIT_BUFFER_SIZE,
+            msgpack::unpack_limit(0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff,
+                0xffffffff, STRUCTURED_POST_MAX_DEPTH)) {
+
+    var = in_var;
+    msgpack_var = (var == "msgpack");
+
+    max_sz = in_max_sz;
+    total_sz = 0;
+
+    too_large = false;
+
+    // FNV-1a offset basis
+    hash = 0xcbf29ce484222325ULL;
+
+    b64_phase = 0;
+    b64_done = false;
+    have_unpacked = false;
+
+    if (!msgpack_var)
+        doc = std::make_shared<JSON_tape_doc>();
+}
+
+bool Kis_Httpd_Structured_Post::IsStructuredVar(const char *in_var) {
+    return strcmp(in_var, "json") == 0 || strcmp(in_var, "msgpack") == 0;
+}
+
+bool Kis_Httpd_Structured_Post::Feed(const char *in_data, size_t in_sz) {
+    if (too_large || error.length() != 0)
+        return false;
+
+    total_sz += in_sz;
+
+    if (max_sz != 0 && total_sz > max_sz) {
+        too_large = true;
+        doc.reset();
+        return false;
+    }
+
+    for (size_t i = 0; i < in_sz; i++) {
+        hash ^= (uint8_t) in_data[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    if (msgpack_var)
+        return FeedMsgpack(in_data, in_sz);
+
+    doc->json.append(in_data, in_sz);
+
+    return true;
+}
+
+bool Kis_Httpd_Structured_Post::FeedMsgpack(const char *in_data, size_t in_sz) {
+    if (b64_done)
+        return true;
+
+    // Every full group of 4 characters, including the ones carried over, is 3
+    // bytes, and decodeblock writes one past them
+    unpacker.reserve_buffer((in_sz + 3) / 4 * 3 + 4);
+
+    unsigned char *out = (unsigned char *) unpacker.buffer();
+    size_t out_sz = 0;
+
+    for (size_t i = 0; i < in_sz; i++) {
+        if (in_data[i] == '=') {
+            // Padding:  whatever is left of the group is the last 1 or 2 bytes
+            if (b64_phase >= 2) {
+                Base64::decodeblock(b64_group, out + out_sz);
+                out_sz += b64_phase - 1;
+            }
+
+            b64_phase = 0;
+            b64_done = true;
+            break;
+        }
+
+        int v = b64_value(in_data[i]);
+
+        if (v < 0) {
+            error = "Invalid base64 in msgpack variable";
+            return false;
+        }
+
+        b64_group[b64_phase++] = v;
+
+        if (b64_phase == 4) {
+            Base64::decodeblock(b64_group, out + out_sz);
+            out_sz += 3;
+            b64_phase = 0;
+        }
+    }
+
+    unpacker.buffer_consumed(out_sz);
+
+    // Parse what has arrived; the unpacker picks up where it left off with the
+    // next piece
+    try {
+        if (!have_unpacked)
+            have_unpacked = unpacker.next(unpacked);
+    } catch (const std::exception& e) {
+        error = string("Unable to unpack msgpack object: ") + e.what();
+        return false;
+    }
+
+    return true;
+}
+
+std::string Kis_Httpd_Structured_Post::FetchDigest() const {
+    char buf[64];
+
+    snprintf(buf, 64, "%lu:%016llx", (unsigned long) total_sz, 
+            (unsigned long long) hash);
+
+    return string(buf);
+}
+
+SharedStructured Kis_Httpd_Structured_Post::Finish() {
+    if (structured != NULL)
+        return structured;
+
+    if (too_large)
+        throw StructuredDataUnparseable("Request too large");
+
+    if (error.length() != 0)
+        throw StructuredDataUnparseable(error);
+
+    if (!msgpack_var) {
+        structured.reset(new StructuredJson(doc));
+        return structured;
+    }
+
+    // An unpadded body leaves the end of the last group
+    if (!b64_done && b64_phase >= 2) {
+        unpacker.reserve_buffer(4);
+        Base64::decodeblock(b64_group, (unsigned char *) unpacker.buffer());
+        unpacker.buffer_consumed(b64_phase - 1);
+        b64_phase = 0;
+    }
+
+    b64_done = true;
+
+    try {
+        if (!have_unpacked)
+            have_unpacked = unpacker.next(unpacked);
+    } catch (const std::exception& e) {
+        error = string("Unable to unpack msgpack object: ") + e.what();
+        throw StructuredDataUnparseable(error);
+    }
+
+    if (!have_unpacked)
+        throw StructuredDataUnparseable("Incomplete msgpack object");
+
+    structured.reset(new StructuredMsgpack(unpacked));
+
+    return structured;
+}
+
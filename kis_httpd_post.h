@@ -0,0 +1,101 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#ifndef __KIS_HTTPD_POST_H__
+#define __KIS_HTTPD_POST_H__
+
+#include "config.h"
+
+#include <stdint.h>
+#include <memory>
+#include <string>
+
+#include <msgpack.hpp>
+
+#include "structured.h"
+#include "kismet_json.h"
+
+// Structured POST commands decoded as they are uploaded
+//
+// Commands (field lists, regex filters, tag updates, and so on) are posted as
+// JSON in the 'json' variable or as base64 msgpack in the 'msgpack' variable.
+// Instead of caching the text and copying it out to parse once the post is
+// complete, each piece the post processor hands over is fed straight to the
+// decoder:  msgpack is base64 decoded into the buffer of a streaming unpacker,
+// which parses what it has so far as each piece arrives, and JSON is gathered
+// into the document which the tape parser then reads in place.  Either way the
+// body is held once, and a body is dropped as soon as it passes the size limit.
+class Kis_Httpd_Structured_Post {
+public:
+    // in_max_sz of 0 is unlimited
+    Kis_Httpd_Structured_Post(const std::string& in_var, size_t in_max_sz);
+
+    // Is this the name of a structured command variable?
+    static bool IsStructuredVar(const char *in_var);
+
+    const std::string& FetchVar() const { return var; }
+    bool FetchMsgpack() const { return msgpack_var; }
+
+    // Feed the next piece of the variable; returns false once the body is
+    // invalid or too large, and everything after is ignored
+    bool Feed(const char *in_data, size_t in_sz);
+
+    bool FetchTooLarge() const { return too_large; }
+
+    // Length and hash of everything fed, so identical requests can be matched
+    // without keeping the text
+    std::string FetchDigest() const;
+
+    // Complete the body and return the command; throws StructuredDataException
+    // if it was invalid, incomplete, or too large.  The command is decoded
+    // once and the same one is returned by every call.
+    SharedStructured Finish();
+
+protected:
+    std::string var;
+    bool msgpack_var;
+
+    size_t max_sz;
+    size_t total_sz;
+
+    bool too_large;
+    std::string error;
+
+    uint64_t hash;
+
+    SharedStructured structured;
+
+    // msgpack state:  the partial base64 group carried between pieces, and
+    // the unpacker
+    unsigned char b64_group[4];
+    unsigned int b64_phase;
+    bool b64_done;
+
+    msgpack::unpacker unpacker;
+    msgpack::unpacked unpacked;
+    bool have_unpacked;
+
+    // JSON state
+    std::shared_ptr<JSON_tape_doc> doc;
+
+    bool FeedMsgpack(const char *in_data, size_t in_sz);
+};
+
+#endif
+
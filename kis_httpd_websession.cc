@@ -222,12 +222,16 @@ bool Kis_Httpd_Websession::validate_login(struct MHD_Connection *connection) {
 
     user = MHD_basic_auth_get_username_password(connection, &pass);
 
-    if (user == NULL || pass == NULL || 
-            conf_username != user || conf_password != pass) {
-        return false;
-    }
+    bool valid = user != NULL && pass != NULL &&
+        conf_username == user && conf_password == pass;
+
+    // Both are allocated by microhttpd
+    if (user != NULL)
+        free(user);
+    if (pass != NULL)
+        free(pass);
 
-    return true;
+    return valid;
 }
 
 bool Kis_Httpd_Websession::Httpd_VerifyPath(const char *path, const char *method) {
@@ -0,0 +1,166 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <sys/mman.h>
+#include <mutex>
+#include <unordered_map>
+
+#include "kis_hugepage.h"
+
+std::atomic<HugepageAlloc::hugepage_mode> HugepageAlloc::mode(HugepageAlloc::hugepage_off);
+std::atomic<uint64_t> HugepageAlloc::hugetlb_total(0);
+std::atomic<uint64_t> HugepageAlloc::thp_total(0);
+std::atomic<uint64_t> HugepageAlloc::hugetlb_fails(0);
+
+struct hugepage_region {
+    size_t sz;
+    bool hugetlb;
+};
+
+struct hugepage_state {
+    std::mutex mutex;
+    std::unordered_map<void *, hugepage_region> regions;
+};
+
+// Never destroyed, so buffers torn down late in exit can still release
+static hugepage_state *hugepage_regions() {
+    static hugepage_state *state = new hugepage_state();
+    return state;
+}
+
+bool HugepageAlloc::parse_mode(std::string in_mode, hugepage_mode *ret_mode) {
+    if (in_mode == "off" || in_mode == "false" || in_mode == "") {
+        *ret_mode = hugepage_off;
+    } else if (in_mode == "thp" || in_mode == "true") {
+        *ret_mode = hugepage_thp;
+    } else if (in_mode == "hugetlb") {
+        *ret_mode = hugepage_hugetlb;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+std::string HugepageAlloc::mode_name(hugepage_mode in_mode) {
+    switch (in_mode) {
+        case hugepage_thp:
+            return "thp";
+        case hugepage_hugetlb:
+            return "hugetlb";
+        default:
+            return "off";
+    }
+}
+
+void *HugepageAlloc::alloc(size_t in_sz) {
+    hugepage_mode m = get_mode();
+
+    // Less than a huge page would only waste the rest of it
+    if (m == hugepage_off || in_sz < huge_page_sz)
+        return NULL;
+
+    size_t sz = ((in_sz + huge_page_sz - 1) / huge_page_sz) * huge_page_sz;
+    void *ptr = MAP_FAILED;
+    bool hugetlb = false;
+
+#ifdef MAP_HUGETLB
+    if (m == hugepage_hugetlb) {
+        ptr = mmap(NULL, sz, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+        if (ptr != MAP_FAILED)
+            hugetlb = true;
+        else
+            hugetlb_fails++;
+    }
+#endif
+
+    if (ptr == MAP_FAILED) {
+        // Map a huge page extra so the region can start on a huge page
+        // boundary, and give back the ends
+        uint8_t *raw = (uint8_t *) mmap(NULL, sz + huge_page_sz, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (raw == (uint8_t *) MAP_FAILED)
+            return NULL;
+
+        uintptr_t start = ((uintptr_t) raw + huge_page_sz - 1) & ~(huge_page_sz - 1);
+        size_t head = start - (uintptr_t) raw;
+
+        if (head != 0)
+            munmap(raw, head);
+
+        if (huge_page_sz - head != 0)
+            munmap((uint8_t *) start + sz, huge_page_sz - head);
+
+        ptr = (void *) start;
+
+#ifdef MADV_HUGEPAGE
+        madvise(ptr, sz, MADV_HUGEPAGE);
+#endif
+    }
+
+    auto state = hugepage_regions();
+
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        hugepage_region r;
+        r.sz = sz;
+        r.hugetlb = hugetlb;
+        state->regions[ptr] = r;
+    }
+
+    if (hugetlb)
+        hugetlb_total += sz;
+    else
+        thp_total += sz;
+
+    return ptr;
+}
+
+bool HugepageAlloc::release(void *in_ptr) {
+    if (in_ptr == NULL)
+        return false;
+
+    auto state = hugepage_regions();
+    hugepage_region r;
+
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+
+        auto i = state->regions.find(in_ptr);
+
+        if (i == state->regions.end())
+            return false;
+
+        r = i->second;
+        state->regions.erase(i);
+    }
+
+    munmap(in_ptr, r.sz);
+
+    if (r.hugetlb)
+        hugetlb_total -= r.sz;
+    else
+        thp_total -= r.sz;
+
+    return true;
+}
@@ -0,0 +1,78 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __KIS_HUGEPAGE_H__
+#define __KIS_HUGEPAGE_H__
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <atomic>
+
+// Huge page backed allocations for large buffers
+//
+// Multi-megabyte ring buffers and pool chunks are touched from end to end, so
+// on 4KB pages they cost a TLB entry per page.  With hugepages=hugetlb they
+// are mapped from the reserved huge page pool (MAP_HUGETLB), falling back to
+// memory advised for transparent huge pages (MADV_HUGEPAGE) when the pool is
+// empty; with hugepages=thp they are always advised.  Either way the memory is
+// 2MB aligned and rounded up to 2MB.
+//
+// alloc() returns NULL when huge pages are off or the size is too small to be
+// worth it, and the caller allocates normally; release() returns false for
+// memory it didn't hand out, so callers can free theirs.
+class HugepageAlloc {
+public:
+    enum hugepage_mode {
+        hugepage_off, hugepage_thp, hugepage_hugetlb
+    };
+
+    // Parse 'off', 'thp', or 'hugetlb'; returns false for anything else
+    static bool parse_mode(std::string in_mode, hugepage_mode *ret_mode);
+    static std::string mode_name(hugepage_mode in_mode);
+
+    static void set_mode(hugepage_mode in_mode) {
+        mode.store(in_mode, std::memory_order_relaxed);
+    }
+
+    static hugepage_mode get_mode() {
+        return mode.load(std::memory_order_relaxed);
+    }
+
+    static void *alloc(size_t in_sz);
+    static bool release(void *in_ptr);
+
+    // Bytes currently mapped from the huge page pool and advised for
+    // transparent huge pages
+    static uint64_t hugetlb_bytes() { return hugetlb_total.load(); }
+    static uint64_t thp_bytes() { return thp_total.load(); }
+
+    // Allocations which wanted the huge page pool and didn't get it
+    static uint64_t hugetlb_fallbacks() { return hugetlb_fails.load(); }
+
+    static const size_t huge_page_sz = 2 * 1024 * 1024;
+
+protected:
+    static std::atomic<hugepage_mode> mode;
+    static std::atomic<uint64_t> hugetlb_total, thp_total, hugetlb_fails;
+};
+
+#endif
+
@@ -0,0 +1,138 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __KIS_HYPERLOGLOG_H__
+#define __KIS_HYPERLOGLOG_H__
+
+#include "config.h"
+
+#include <stdint.h>
+#include <math.h>
+#include <vector>
+
+// HyperLogLog estimate of the number of distinct 64 bit values added, in a
+// fixed 2^precision bytes no matter how many values are seen.
+//
+// The standard error of the estimate is about 1.04 / sqrt(2^precision); 3.25%
+// at the default precision of 10 (1KB).  Small counts, up to about 2.5 * 2^
+// precision, are estimated by linear counting of the empty registers instead
+// and are closer than that; at precision 10 counts of a few hundred are
+// typically within 2-2.5%, and 10 devices within one.  Error is worst, about
+// 4%, around the switch from linear counting at roughly 2500.
+//
+// Values are mixed before use, so device keys and MAC addresses can be added
+// directly.  Sketches of the same precision can be merged to estimate the
+// distinct values of the union.
+class kis_hyperloglog {
+public:
+    kis_hyperloglog(unsigned int in_precision = 10) {
+        if (in_precision < 4)
+            in_precision = 4;
+        if (in_precision > 16)
+            in_precision = 16;
+
+        precision = in_precision;
+        registers.assign(1 << precision, 0);
+    }
+
+    // Murmur3 finalizer, same as kis_u64_flat_map
+    static inline uint64_t mix(uint64_t k) {
+        k ^= k >> 33;
+        k *= 0xff51afd7ed558ccdULL;
+        k ^= k >> 33;
+        k *= 0xc4ceb9fe1a85ec53ULL;
+        k ^= k >> 33;
+        return k;
+    }
+
+    void add(uint64_t in_value) {
+        uint64_t h = mix(in_value);
+
+        // Top bits pick the register, the rank of the first set bit in the
+        // rest is what the register remembers
+        size_t r = h >> (64 - precision);
+        uint64_t w = h << precision;
+
+        uint8_t rank;
+        if (w == 0)
+            rank = 64 - precision + 1;
+        else
+            rank = __builtin_clzll(w) + 1;
+
+        if (registers[r] < rank)
+            registers[r] = rank;
+    }
+
+    void merge(const kis_hyperloglog& in_sketch) {
+        if (in_sketch.precision != precision)
+            return;
+
+        for (size_t r = 0; r < registers.size(); r++) {
+            if (registers[r] < in_sketch.registers[r])
+                registers[r] = in_sketch.registers[r];
+        }
+    }
+
+    void clear() {
+        registers.assign(registers.size(), 0);
+    }
+
+    double estimate() const {
+        double m = registers.size();
+        double alpha;
+
+        if (registers.size() == 16)
+            alpha = 0.673;
+        else if (registers.size() == 32)
+            alpha = 0.697;
+        else if (registers.size() == 64)
+            alpha = 0.709;
+        else
+            alpha = 0.7213 / (1 + 1.079 / m);
+
+        double sum = 0;
+        unsigned int zeros = 0;
+
+        for (auto r : registers) {
+            sum += ldexp(1.0, -((int) r));
+
+            if (r == 0)
+                zeros++;
+        }
+
+        double e = alpha * m * m / sum;
+
+        // Linear counting is far more accurate while there's still empty
+        // registers; with a 64 bit hash there's no large range correction
+        if (e <= 2.5 * m && zeros != 0)
+            e = m * log(m / zeros);
+
+        return e;
+    }
+
+    unsigned int get_precision() const {
+        return precision;
+    }
+
+protected:
+    unsigned int precision;
+    std::vector<uint8_t> registers;
+};
+
+#endif
+
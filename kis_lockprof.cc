@@ -0,0 +1,290 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <string.h>
+#include <algorithm>
+#include <mutex>
+
+#include "kis_lockprof.h"
+
+std::atomic<bool> LockProfiler::enabled(false);
+
+// Mutex addresses to records, open addressed; a power of two
+#define LOCKPROF_ADDR_SLOTS     4096
+
+// A forgotten address; lookups probe past it and names may reuse it
+#define LOCKPROF_ADDR_FORGOTTEN ((uintptr_t) 1)
+
+namespace {
+
+struct lockprof_site {
+    // File pointer mixed with the line, 0 while the slot is free; the file
+    // and line are only read once the key is set
+    std::atomic<uintptr_t> key;
+    std::atomic<const char *> file;
+    std::atomic<int> line;
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> hold_ns;
+};
+
+struct lockprof_record {
+    char name[LOCKPROF_NAME_LEN];
+
+    std::atomic<uint64_t> acquires;
+    std::atomic<uint64_t> contended;
+    std::atomic<uint64_t> wait_ns;
+    std::atomic<uint64_t> hold_ns;
+    std::atomic<uint64_t> wait_histogram[LOCKPROF_BUCKETS];
+    std::atomic<uint64_t> hold_histogram[LOCKPROF_BUCKETS];
+
+    lockprof_site sites[LOCKPROF_MAX_SITES];
+};
+
+struct lockprof_addr {
+    std::atomic<uintptr_t> addr;
+    std::atomic<int> rec;
+};
+
+lockprof_record lockprof_records[LOCKPROF_MAX_LOCKS];
+std::atomic<int> lockprof_num_records(1);
+
+lockprof_addr lockprof_addrs[LOCKPROF_ADDR_SLOTS];
+
+// Naming is rare; lookups never take this
+std::mutex lockprof_name_mutex;
+
+unsigned int lockprof_addr_hash(uintptr_t in_addr) {
+    return (unsigned int) (((uint64_t) in_addr * 0x9E3779B97F4A7C15ULL) >> 52) &
+        (LOCKPROF_ADDR_SLOTS - 1);
+}
+
+unsigned int lockprof_bucket(uint64_t in_ns) {
+    unsigned int bucket = 0;
+    if (in_ns != 0)
+        bucket = 64 - __builtin_clzll(in_ns);
+    if (bucket >= LOCKPROF_BUCKETS)
+        bucket = LOCKPROF_BUCKETS - 1;
+    return bucket;
+}
+
+}
+
+void LockProfiler::Enable() {
+    strncpy(lockprof_records[0].name, "unnamed", LOCKPROF_NAME_LEN - 1);
+    enabled = true;
+}
+
+void LockProfiler::NameMutex(const void *in_mutex, const char *in_name) {
+    std::lock_guard<std::mutex> lk(lockprof_name_mutex);
+
+    int rec = -1;
+    int num = lockprof_num_records.load();
+
+    for (int r = 1; r < num; r++) {
+        if (strncmp(lockprof_records[r].name, in_name, LOCKPROF_NAME_LEN - 1) == 0) {
+            rec = r;
+            break;
+        }
+    }
+
+    // Out of records, it stays unnamed
+    if (rec < 0) {
+        if (num >= LOCKPROF_MAX_LOCKS)
+            return;
+
+        rec = num;
+        strncpy(lockprof_records[rec].name, in_name, LOCKPROF_NAME_LEN - 1);
+        lockprof_num_records.store(num + 1);
+    }
+
+    uintptr_t addr = (uintptr_t) in_mutex;
+    unsigned int h = lockprof_addr_hash(addr);
+    int reuse = -1;
+
+    for (unsigned int p = 0; p < LOCKPROF_ADDR_SLOTS; p++) {
+        unsigned int s = (h + p) & (LOCKPROF_ADDR_SLOTS - 1);
+        uintptr_t cur = lockprof_addrs[s].addr.load();
+
+        if (cur == addr) {
+            lockprof_addrs[s].rec.store(rec);
+            return;
+        }
+
+        if (cur == LOCKPROF_ADDR_FORGOTTEN && reuse < 0)
+            reuse = s;
+
+        if (cur == 0) {
+            if (reuse < 0)
+                reuse = s;
+            break;
+        }
+    }
+
+    // A full table leaves the mutex unnamed
+    if (reuse < 0)
+        return;
+
+    // The record has to be in place before a lookup can find the address
+    lockprof_addrs[reuse].rec.store(rec);
+    lockprof_addrs[reuse].addr.store(addr);
+}
+
+void LockProfiler::ForgetMutex(const void *in_mutex) {
+    std::lock_guard<std::mutex> lk(lockprof_name_mutex);
+
+    uintptr_t addr = (uintptr_t) in_mutex;
+    unsigned int h = lockprof_addr_hash(addr);
+
+    for (unsigned int p = 0; p < LOCKPROF_ADDR_SLOTS; p++) {
+        unsigned int s = (h + p) & (LOCKPROF_ADDR_SLOTS - 1);
+        uintptr_t cur = lockprof_addrs[s].addr.load();
+
+        if (cur == 0)
+            return;
+
+        if (cur == addr) {
+            lockprof_addrs[s].addr.store(LOCKPROF_ADDR_FORGOTTEN);
+            return;
+        }
+    }
+}
+
+int LockProfiler::FetchRecord(const void *in_mutex) {
+    uintptr_t addr = (uintptr_t) in_mutex;
+    unsigned int h = lockprof_addr_hash(addr);
+
+    for (unsigned int p = 0; p < LOCKPROF_ADDR_SLOTS; p++) {
+        unsigned int s = (h + p) & (LOCKPROF_ADDR_SLOTS - 1);
+        uintptr_t cur = lockprof_addrs[s].addr.load(std::memory_order_acquire);
+
+        if (cur == 0)
+            return 0;
+
+        if (cur == addr)
+            return lockprof_addrs[s].rec.load(std::memory_order_relaxed);
+    }
+
+    return 0;
+}
+
+void LockProfiler::RecordAcquire(int in_rec, bool in_contended, uint64_t in_wait_ns) {
+    lockprof_record& r = lockprof_records[in_rec];
+
+    r.acquires.fetch_add(1, std::memory_order_relaxed);
+
+    if (in_contended)
+        r.contended.fetch_add(1, std::memory_order_relaxed);
+
+    r.wait_ns.fetch_add(in_wait_ns, std::memory_order_relaxed);
+    r.wait_histogram[lockprof_bucket(in_wait_ns)].fetch_add(1, std::memory_order_relaxed);
+}
+
+void LockProfiler::RecordRelease(int in_rec, const char *in_file, int in_line,
+        uint64_t in_hold_ns) {
+    lockprof_record& r = lockprof_records[in_rec];
+
+    r.hold_ns.fetch_add(in_hold_ns, std::memory_order_relaxed);
+    r.hold_histogram[lockprof_bucket(in_hold_ns)].fetch_add(1, std::memory_order_relaxed);
+
+    uintptr_t key = ((uintptr_t) in_file * 31) + in_line;
+    if (key == 0)
+        key = 1;
+
+    unsigned int h = lockprof_addr_hash(key) & (LOCKPROF_MAX_SITES - 1);
+
+    // Sites past the table are only in the lock totals
+    for (unsigned int p = 0; p < LOCKPROF_MAX_SITES; p++) {
+        lockprof_site& s = r.sites[(h + p) & (LOCKPROF_MAX_SITES - 1)];
+        uintptr_t cur = s.key.load(std::memory_order_acquire);
+
+        if (cur == 0) {
+            if (s.key.compare_exchange_strong(cur, key)) {
+                s.file.store(in_file);
+                s.line.store(in_line);
+                cur = key;
+            }
+        }
+
+        if (cur == key) {
+            s.count.fetch_add(1, std::memory_order_relaxed);
+            s.hold_ns.fetch_add(in_hold_ns, std::memory_order_relaxed);
+            return;
+        }
+    }
+}
+
+std::vector<LockProfiler::lock_stats> LockProfiler::FetchStats(unsigned int in_max_sites) {
+    std::vector<lock_stats> ret;
+
+    int num = lockprof_num_records.load();
+
+    for (int n = 0; n < num; n++) {
+        lockprof_record& r = lockprof_records[n];
+
+        lock_stats ls;
+
+        ls.acquires = r.acquires.load(std::memory_order_relaxed);
+
+        if (ls.acquires == 0)
+            continue;
+
+        {
+            std::lock_guard<std::mutex> lk(lockprof_name_mutex);
+            ls.name = std::string(r.name);
+        }
+
+        ls.contended = r.contended.load(std::memory_order_relaxed);
+        ls.wait_ns = r.wait_ns.load(std::memory_order_relaxed);
+        ls.hold_ns = r.hold_ns.load(std::memory_order_relaxed);
+
+        for (unsigned int b = 0; b < LOCKPROF_BUCKETS; b++) {
+            ls.wait_histogram[b] = r.wait_histogram[b].load(std::memory_order_relaxed);
+            ls.hold_histogram[b] = r.hold_histogram[b].load(std::memory_order_relaxed);
+        }
+
+        for (unsigned int s = 0; s < LOCKPROF_MAX_SITES; s++) {
+            // The winner of a slot may not have filled it in yet
+            if (r.sites[s].key.load(std::memory_order_acquire) == 0 ||
+                    r.sites[s].file.load() == NULL)
+                continue;
+
+            site_stats ss;
+            ss.file = std::string(r.sites[s].file.load());
+            ss.line = r.sites[s].line.load();
+            ss.count = r.sites[s].count.load(std::memory_order_relaxed);
+            ss.hold_ns = r.sites[s].hold_ns.load(std::memory_order_relaxed);
+
+            ls.sites.push_back(ss);
+        }
+
+        std::sort(ls.sites.begin(), ls.sites.end(),
+                [](const site_stats& a, const site_stats& b) -> bool {
+                    return a.hold_ns > b.hold_ns;
+                });
+
+        if (ls.sites.size() > in_max_sites)
+            ls.sites.resize(in_max_sites);
+
+        ret.push_back(ls);
+    }
+
+    return ret;
+}
+
@@ -0,0 +1,112 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __KIS_LOCKPROF_H__
+#define __KIS_LOCKPROF_H__
+
+#include "config.h"
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "kis_clock.h"
+
+// Optional lock contention profiling, enabled with 'lock_profiling=true'.
+//
+// While enabled, every local_locker acquisition is counted against the mutex
+// it locks:  whether it had to wait, how long it waited and how long it held
+// the lock, in log2 histograms of nanoseconds (bucket 0 under 1ns, bucket N
+// [2^(N-1), 2^N) ns, the last bucket everything slower), and the hold time of
+// each file and line which took it.  Mutexes are grouped by the name they are
+// given with NameMutex, so every buffer_locker is one record; mutexes which
+// were never named are counted together as 'unnamed'.  The stats are served as
+// /system/lock_stats.json
+//
+// When disabled, locking costs one extra relaxed load.
+#define LOCKPROF_MAX_LOCKS      128
+#define LOCKPROF_MAX_SITES      64
+#define LOCKPROF_BUCKETS        32
+#define LOCKPROF_NAME_LEN       48
+
+// Lock call sites, from the caller of the local_locker constructor where the
+// compiler can tell us
+#if (defined(__clang__) && __clang_major__ >= 9) || \
+    (!defined(__clang__) && defined(__GNUC__) && \
+     (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 8)))
+#define KIS_LOCK_SITE_FILE __builtin_FILE()
+#define KIS_LOCK_SITE_LINE __builtin_LINE()
+#else
+#define KIS_LOCK_SITE_FILE "unknown"
+#define KIS_LOCK_SITE_LINE 0
+#endif
+
+class LockProfiler {
+public:
+    static void Enable();
+
+    static bool IsEnabled() {
+        return enabled.load(std::memory_order_relaxed);
+    }
+
+    // Name a mutex, and forget it before it is destroyed so the address can't
+    // be mistaken for it later
+    static void NameMutex(const void *in_mutex, const char *in_name);
+    static void ForgetMutex(const void *in_mutex);
+
+    // Record of a mutex; 0 is the shared record of unnamed mutexes
+    static int FetchRecord(const void *in_mutex);
+
+    static uint64_t Now() {
+        return KisClock::PreciseNsec();
+    }
+
+    static void RecordAcquire(int in_rec, bool in_contended, uint64_t in_wait_ns);
+    static void RecordRelease(int in_rec, const char *in_file, int in_line,
+            uint64_t in_hold_ns);
+
+    struct site_stats {
+        std::string file;
+        int line;
+        uint64_t count;
+        uint64_t hold_ns;
+    };
+
+    struct lock_stats {
+        std::string name;
+        uint64_t acquires;
+        uint64_t contended;
+        uint64_t wait_ns;
+        uint64_t hold_ns;
+        uint64_t wait_histogram[LOCKPROF_BUCKETS];
+        uint64_t hold_histogram[LOCKPROF_BUCKETS];
+
+        // Sites which held the lock longest in total, longest first
+        std::vector<site_stats> sites;
+    };
+
+    // Every lock which was taken at least once, with up to in_max_sites sites
+    static std::vector<lock_stats> FetchStats(unsigned int in_max_sites);
+
+protected:
+    static std::atomic<bool> enabled;
+};
+
+#endif
+
@@ -0,0 +1,101 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __KIS_LOG_FORMATS_H__
+#define __KIS_LOG_FORMATS_H__
+
+#include <stdint.h>
+
+// On-disk formats of the files the server leaves behind which are read by
+// something other than the code that writes them: the saved device snapshot
+// and its journal (see devicetracker_snapshot.cc), and the sidecar index of
+// the pcap log (see dumpfile_pcap.cc).  Shared by the server and kismet_query,
+// so nothing here may depend on the rest of the server.
+
+#define SNAPSHOT_MAGIC      "KISDSNAP"
+#define SNAPSHOT_VERSION    1
+
+struct snapshot_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint64_t timestamp;
+    uint64_t num_records;
+    uint64_t fields_offset;
+    uint64_t phys_offset;
+    uint64_t records_offset;
+    uint64_t keys_offset;
+    uint64_t file_length;
+};
+
+// Record table entry, one per device in record order
+struct snapshot_record {
+    uint64_t key;
+    uint64_t offset;
+    uint32_t length;
+    uint32_t reserved;
+};
+
+// Key table entry, sorted by key
+struct snapshot_key {
+    uint64_t key;
+    uint64_t record;
+};
+
+#define JOURNAL_MAGIC       "KISDJRNL"
+#define JOURNAL_VERSION     1
+
+#define JOURNAL_BATCH_MAGIC     0x4B4A4254
+#define JOURNAL_BATCH_NEWRUN    0x01
+
+#define JOURNAL_OP_UPDATE       1
+#define JOURNAL_OP_EXPIRE       2
+
+struct journal_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint64_t snapshot_ts;
+};
+
+struct journal_batch_header {
+    uint32_t magic;
+    uint32_t flags;
+    uint32_t length;
+    uint32_t crc;
+};
+
+// Pcap log index, always little endian:
+//
+//   magic, u32 version, u32 bucket seconds
+//   blocks, each u64 device key, u64 bucket start, u32 count, u32 reserved,
+//     and count u64 offsets of records in the log
+#define PCAP_INDEX_MAGIC            "KISPCIDX"
+#define PCAP_INDEX_VERSION          1
+
+// Record header as it sits in a pcap file, with 32-bit times regardless of the
+// size of a timeval on this platform
+struct pcap_index_sf_hdr {
+    uint32_t ts_sec;
+    uint32_t ts_usec;
+    uint32_t caplen;
+    uint32_t len;
+};
+
+#endif
+
@@ -0,0 +1,326 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sstream>
+
+#include "kis_metrics.h"
+#include "messagebus.h"
+
+unsigned int kis_metric_shard() {
+    static std::atomic<unsigned int> next_shard(0);
+    static thread_local unsigned int shard =
+        next_shard.fetch_add(1, std::memory_order_relaxed) % KIS_METRIC_SHARDS;
+
+    return shard;
+}
+
+kis_metric_counter::kis_metric_counter() {
+    for (unsigned int x = 0; x < KIS_METRIC_SHARDS; x++)
+        shards[x].value = 0;
+}
+
+uint64_t kis_metric_counter::value() {
+    uint64_t v = 0;
+
+    for (unsigned int x = 0; x < KIS_METRIC_SHARDS; x++)
+        v += shards[x].value.load(std::memory_order_relaxed);
+
+    return v;
+}
+
+kis_metric_histogram::kis_metric_histogram() {
+    for (unsigned int x = 0; x < KIS_METRIC_SHARDS; x++) {
+        for (unsigned int b = 0; b < KIS_METRIC_BUCKETS; b++)
+            shards[x].buckets[b] = 0;
+        shards[x].sum_nsec = 0;
+    }
+}
+
+void kis_metric_histogram::snapshot(uint64_t *ret_buckets, uint64_t *ret_sum_nsec) {
+    *ret_sum_nsec = 0;
+
+    for (unsigned int b = 0; b < KIS_METRIC_BUCKETS; b++)
+        ret_buckets[b] = 0;
+
+    for (unsigned int x = 0; x < KIS_METRIC_SHARDS; x++) {
+        for (unsigned int b = 0; b < KIS_METRIC_BUCKETS; b++)
+            ret_buckets[b] += shards[x].buckets[b].load(std::memory_order_relaxed);
+        *ret_sum_nsec += shards[x].sum_nsec.load(std::memory_order_relaxed);
+    }
+}
+
+shared_ptr<KisMetrics> KisMetrics::create_metrics(GlobalRegistry *in_globalreg) {
+    shared_ptr<KisMetrics> mon(new KisMetrics(in_globalreg));
+    in_globalreg->RegisterLifetimeGlobal(mon);
+    in_globalreg->InsertGlobal("METRICS", mon);
+    return mon;
+}
+
+KisMetrics::KisMetrics(GlobalRegistry *in_globalreg) :
+    Kis_Net_Httpd_CPPStream_Handler(in_globalreg) {
+
+    Httpd_RegisterRoute("GET", "/metrics");
+
+    globalreg = in_globalreg;
+
+    register_gauge("kismet_start_time_seconds", "time the server was started", "",
+            [this]() -> double {
+                return globalreg->start_time;
+            });
+
+    register_gauge("kismet_process_cpu_seconds", "user and system cpu time used", "",
+            []() -> double {
+                struct rusage ru;
+
+                if (getrusage(RUSAGE_SELF, &ru) < 0)
+                    return 0;
+
+                return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+                    (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000000.0;
+            });
+}
+
+KisMetrics::~KisMetrics() {
+    globalreg->RemoveGlobal("METRICS");
+}
+
+KisMetrics::metric_family *KisMetrics::fetch_family(string in_name, string in_help,
+        metric_type in_type) {
+    auto f = families.find(in_name);
+
+    if (f != families.end()) {
+        if (f->second.type != in_type) {
+            _MSG("Metric '" + in_name + "' registered twice with different "
+                    "types, ignoring the second", MSGFLAG_ERROR);
+            return NULL;
+        }
+
+        return &(f->second);
+    }
+
+    metric_family &fam = families[in_name];
+    fam.type = in_type;
+    fam.help = in_help;
+
+    return &fam;
+}
+
+shared_ptr<kis_metric_counter> KisMetrics::register_counter(string in_name,
+        string in_help, string in_labels) {
+    std::lock_guard<std::mutex> lk(metrics_mutex);
+
+    metric_family *fam = fetch_family(in_name, in_help, metric_counter);
+
+    // Still hand back a counter so the caller never has to check; it just
+    // isn't exposed
+    if (fam == NULL)
+        return shared_ptr<kis_metric_counter>(new kis_metric_counter());
+
+    auto c = fam->counters.find(in_labels);
+
+    if (c != fam->counters.end())
+        return c->second;
+
+    shared_ptr<kis_metric_counter> counter(new kis_metric_counter());
+    fam->counters[in_labels] = counter;
+
+    return counter;
+}
+
+shared_ptr<kis_metric_histogram> KisMetrics::register_histogram(string in_name,
+        string in_help, string in_labels) {
+    std::lock_guard<std::mutex> lk(metrics_mutex);
+
+    metric_family *fam = fetch_family(in_name, in_help, metric_histogram);
+
+    if (fam == NULL)
+        return shared_ptr<kis_metric_histogram>(new kis_metric_histogram());
+
+    auto h = fam->histograms.find(in_labels);
+
+    if (h != fam->histograms.end())
+        return h->second;
+
+    shared_ptr<kis_metric_histogram> histogram(new kis_metric_histogram());
+    fam->histograms[in_labels] = histogram;
+
+    return histogram;
+}
+
+void KisMetrics::register_gauge(string in_name, string in_help, string in_labels,
+        function<double ()> in_cb) {
+    std::lock_guard<std::mutex> lk(metrics_mutex);
+
+    metric_family *fam = fetch_family(in_name, in_help, metric_gauge);
+
+    if (fam == NULL)
+        return;
+
+    fam->gauges[in_labels] = in_cb;
+}
+
+void KisMetrics::remove_metric(string in_name, string in_labels) {
+    std::lock_guard<std::mutex> lk(metrics_mutex);
+
+    auto f = families.find(in_name);
+
+    if (f == families.end())
+        return;
+
+    f->second.counters.erase(in_labels);
+    f->second.histograms.erase(in_labels);
+    f->second.gauges.erase(in_labels);
+
+    if (f->second.counters.size() == 0 && f->second.histograms.size() == 0 &&
+            f->second.gauges.size() == 0)
+        families.erase(f);
+}
+
+string KisMetrics::label_escape(string in_value) {
+    string ret = "\"";
+
+    for (auto c : in_value) {
+        if (c == '\\')
+            ret += "\\\\";
+        else if (c == '"')
+            ret += "\\\"";
+        else if (c == '\n')
+            ret += "\\n";
+        else
+            ret += c;
+    }
+
+    ret += "\"";
+
+    return ret;
+}
+
+bool KisMetrics::Httpd_VerifyPath(const char *path, const char *method) {
+    return strcmp(method, "GET") == 0 && strcmp(path, "/metrics") == 0;
+}
+
+int KisMetrics::Httpd_HandleGetRequest(Kis_Net_Httpd *httpd,
+        Kis_Net_Httpd_Connection *connection,
+        const char *url, const char *method, const char *upload_data,
+        size_t *upload_data_size) {
+
+    std::stringstream stream;
+
+    Httpd_CreateStreamResponse(httpd, connection, url, method, upload_data,
+            upload_data_size, stream);
+
+    // The path has no suffix to take the type from
+    connection->response =
+        MHD_create_response_from_buffer(stream.str().length(),
+                (void *) stream.str().data(), MHD_RESPMEM_MUST_COPY);
+
+    MHD_add_response_header(connection->response, "Content-Type",
+            "application/openmetrics-text; version=1.0.0; charset=utf-8");
+
+    return httpd->SendStandardHttpResponse(httpd, connection, url);
+}
+
+void KisMetrics::Httpd_CreateStreamResponse(
+        Kis_Net_Httpd *httpd __attribute__((unused)),
+        Kis_Net_Httpd_Connection *connection __attribute__((unused)),
+        const char *path __attribute__((unused)),
+        const char *method __attribute__((unused)),
+        const char *upload_data __attribute__((unused)),
+        size_t *upload_data_size __attribute__((unused)),
+        std::stringstream &stream) {
+
+    std::lock_guard<std::mutex> lk(metrics_mutex);
+
+    char num[64];
+
+    // Labels of a series plus one more
+    auto labelset = [](const string& in_labels, const string& in_extra) -> string {
+        if (in_labels.length() == 0 && in_extra.length() == 0)
+            return "";
+
+        if (in_extra.length() == 0)
+            return "{" + in_labels + "}";
+
+        if (in_labels.length() == 0)
+            return "{" + in_extra + "}";
+
+        return "{" + in_labels + "," + in_extra + "}";
+    };
+
+    for (auto& f : families) {
+        const string& name = f.first;
+        metric_family& fam = f.second;
+
+        if (fam.type == metric_counter) {
+            stream << "# TYPE " << name << " counter\n";
+            stream << "# HELP " << name << " " << fam.help << "\n";
+
+            for (auto& c : fam.counters)
+                stream << name << "_total" << labelset(c.first, "") << " " <<
+                    c.second->value() << "\n";
+        } else if (fam.type == metric_gauge) {
+            stream << "# TYPE " << name << " gauge\n";
+            stream << "# HELP " << name << " " << fam.help << "\n";
+
+            for (auto& g : fam.gauges) {
+                snprintf(num, 64, "%.17g", g.second());
+                stream << name << labelset(g.first, "") << " " << num << "\n";
+            }
+        } else if (fam.type == metric_histogram) {
+            stream << "# TYPE " << name << " histogram\n";
+            stream << "# HELP " << name << " " << fam.help << "\n";
+
+            for (auto& h : fam.histograms) {
+                uint64_t buckets[KIS_METRIC_BUCKETS];
+                uint64_t sum_nsec;
+
+                h.second->snapshot(buckets, &sum_nsec);
+
+                uint64_t cumulative = 0;
+
+                // Every bucket but the last has an upper bound of 2^N ns
+                for (unsigned int b = 0; b < KIS_METRIC_BUCKETS - 1; b++) {
+                    cumulative += buckets[b];
+
+                    snprintf(num, 64, "le=\"%.9g\"", (double) (1ULL << b) / 1e9);
+                    stream << name << "_bucket" << labelset(h.first, num) << " " <<
+                        cumulative << "\n";
+                }
+
+                cumulative += buckets[KIS_METRIC_BUCKETS - 1];
+
+                stream << name << "_bucket" << labelset(h.first, "le=\"+Inf\"") <<
+                    " " << cumulative << "\n";
+                stream << name << "_count" << labelset(h.first, "") << " " <<
+                    cumulative << "\n";
+
+                snprintf(num, 64, "%.9f", sum_nsec / 1e9);
+                stream << name << "_sum" << labelset(h.first, "") << " " << num << "\n";
+            }
+        }
+    }
+
+    stream << "# EOF\n";
+}
+
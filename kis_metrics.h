@@ -0,0 +1,181 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __KIS_METRICS_H__
+#define __KIS_METRICS_H__
+
+#include "config.h"
+
+#include <stdint.h>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "globalregistry.h"
+#include "kis_net_microhttpd.h"
+
+// Counters are split into shards, and a thread always updates the same shard,
+// so threads counting the same event don't bounce one cache line between them.
+// Shards are padded to a full line; the stride alone keeps two shards off the
+// same line, so heap allocations don't need to be over-aligned.
+#define KIS_METRIC_SHARDS       16
+#define KIS_METRIC_CACHELINE    64
+
+// Histograms are log2 buckets of nanoseconds, like the packetchain handler
+// histograms:  bucket 0 counts observations under 1ns, bucket N [2^(N-1), 2^N)
+// ns, and the last bucket everything slower
+#define KIS_METRIC_BUCKETS      32
+
+// Shard of the calling thread
+unsigned int kis_metric_shard();
+
+class kis_metric_counter {
+public:
+    kis_metric_counter();
+
+    void inc(uint64_t in_amt = 1) {
+        shards[kis_metric_shard()].value.fetch_add(in_amt, std::memory_order_relaxed);
+    }
+
+    // Sum of the shards; concurrent increments may or may not be included
+    uint64_t value();
+
+protected:
+    struct shard {
+        std::atomic<uint64_t> value;
+        char pad[KIS_METRIC_CACHELINE - sizeof(std::atomic<uint64_t>)];
+    };
+
+    shard shards[KIS_METRIC_SHARDS];
+};
+
+class kis_metric_histogram {
+public:
+    kis_metric_histogram();
+
+    void observe_nsec(uint64_t in_nsec) {
+        unsigned int bucket = 0;
+        if (in_nsec != 0)
+            bucket = 64 - __builtin_clzll(in_nsec);
+        if (bucket >= KIS_METRIC_BUCKETS)
+            bucket = KIS_METRIC_BUCKETS - 1;
+
+        shard& s = shards[kis_metric_shard()];
+        s.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+        s.sum_nsec.fetch_add(in_nsec, std::memory_order_relaxed);
+    }
+
+    // Per-bucket counts (not cumulative) and the total time observed
+    void snapshot(uint64_t *ret_buckets, uint64_t *ret_sum_nsec);
+
+protected:
+    struct shard {
+        std::atomic<uint64_t> buckets[KIS_METRIC_BUCKETS];
+        std::atomic<uint64_t> sum_nsec;
+        char pad[KIS_METRIC_CACHELINE -
+            ((KIS_METRIC_BUCKETS + 1) * sizeof(std::atomic<uint64_t>)) %
+            KIS_METRIC_CACHELINE];
+    };
+
+    shard shards[KIS_METRIC_SHARDS];
+};
+
+// OpenMetrics exposition of the server counters
+//
+// Modules register the counters and histograms they update on their hot
+// paths, under an OpenMetrics family name and an optional label set such as
+//  source="wlan0"
+// and gauges as callbacks reading values the module already keeps (which must
+// not take locks a scrape could stall on, like the devicelist mutex).
+// Registering an existing name and label set returns the same counter, so
+// several instances of a module can share one.  The text exposition is served
+// at
+//  /metrics
+// Reading a counter only sums its shards, so the endpoint can be scraped as
+// often as every few seconds without slowing the packet path.
+class KisMetrics : public LifetimeGlobal, public Kis_Net_Httpd_CPPStream_Handler {
+public:
+    static shared_ptr<KisMetrics> create_metrics(GlobalRegistry *in_globalreg);
+
+private:
+    KisMetrics(GlobalRegistry *in_globalreg);
+
+public:
+    virtual ~KisMetrics();
+
+    virtual bool Httpd_VerifyPath(const char *path, const char *method);
+
+    virtual int Httpd_HandleGetRequest(Kis_Net_Httpd *httpd,
+            Kis_Net_Httpd_Connection *connection,
+            const char *url, const char *method, const char *upload_data,
+            size_t *upload_data_size);
+
+    virtual void Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd,
+            Kis_Net_Httpd_Connection *connection,
+            const char *path, const char *method, const char *upload_data,
+            size_t *upload_data_size, std::stringstream &stream);
+
+    // Names are family names; counters are exposed with the _total suffix
+    // added, histograms in seconds
+    shared_ptr<kis_metric_counter> register_counter(string in_name, string in_help,
+            string in_labels = "");
+    shared_ptr<kis_metric_histogram> register_histogram(string in_name, string in_help,
+            string in_labels = "");
+    void register_gauge(string in_name, string in_help, string in_labels,
+            function<double ()> in_cb);
+
+    // Stop exposing a metric, for instance when the module owning a gauge
+    // callback goes away
+    void remove_metric(string in_name, string in_labels = "");
+
+    // Quote a label value
+    static string label_escape(string in_value);
+
+protected:
+    GlobalRegistry *globalreg;
+
+    enum metric_type {
+        metric_counter, metric_gauge, metric_histogram
+    };
+
+    struct metric_family {
+        metric_type type;
+        string help;
+
+        // Series by label set
+        std::map<string, shared_ptr<kis_metric_counter> > counters;
+        std::map<string, shared_ptr<kis_metric_histogram> > histograms;
+        std::map<string, function<double ()> > gauges;
+    };
+
+    // Find or make a family; must hold metrics_mutex.  Returns NULL if the
+    // name is already used by another type of metric
+    metric_family *fetch_family(string in_name, string in_help, metric_type in_type);
+
+    std::mutex metrics_mutex;
+
+    // Families in exposition order
+    std::map<string, metric_family> families;
+};
+
+#endif
+
@@ -0,0 +1,115 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "kis_mirror_mmap.h"
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+int kis_mirror_shm_fd(size_t sz) {
+    int fd = -1;
+
+#if defined(__linux__) && defined(SYS_memfd_create)
+    fd = (int) syscall(SYS_memfd_create, "kismet_ringbuf", 0);
+#endif
+
+    /* Older kernels and other platforms get an unlinked temp file */
+    if (fd < 0) {
+        char tmpl[] = "/tmp/kismet_ringbuf_XXXXXX";
+
+        if ((fd = mkstemp(tmpl)) < 0)
+            return -1;
+
+        unlink(tmpl);
+    }
+
+    if (ftruncate(fd, (off_t) sz) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+void *kis_mirror_map_fd(int fd, off_t offt, size_t sz) {
+    uint8_t *base, *a, *b;
+
+    /* Reserve room for both copies so nothing else lands in the middle, then
+     * map the file over each half */
+    base = (uint8_t *) mmap(NULL, sz * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (base == MAP_FAILED)
+        return NULL;
+
+    a = (uint8_t *) mmap(base, sz, PROT_READ | PROT_WRITE, 
+            MAP_SHARED | MAP_FIXED, fd, offt);
+    b = (uint8_t *) mmap(base + sz, sz, PROT_READ | PROT_WRITE, 
+            MAP_SHARED | MAP_FIXED, fd, offt);
+
+    if (a != base || b != base + sz) {
+        munmap(base, sz * 2);
+        return NULL;
+    }
+
+    return base;
+}
+
+void *kis_mirror_alloc(size_t in_sz, size_t *ret_sz) {
+    long page_sz = sysconf(_SC_PAGESIZE);
+    size_t sz;
+    int fd;
+    void *base;
+
+    if (page_sz <= 0 || in_sz == 0)
+        return NULL;
+
+    sz = ((in_sz + page_sz - 1) / page_sz) * page_sz;
+
+    if ((fd = kis_mirror_shm_fd(sz)) < 0)
+        return NULL;
+
+    base = kis_mirror_map_fd(fd, 0, sz);
+
+    /* The mappings hold their own reference to the memory */
+    close(fd);
+
+    if (base == NULL)
+        return NULL;
+
+    *ret_sz = sz;
+
+    return base;
+}
+
+void kis_mirror_free(void *ptr, size_t sz) {
+    if (ptr != NULL)
+        munmap(ptr, sz * 2);
+}
+
@@ -0,0 +1,63 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __KIS_MIRROR_MMAP_H__
+#define __KIS_MIRROR_MMAP_H__
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Mirrored memory for ring buffers; shared by the Kismet server and the
+ * pure-C capture binaries.
+ *
+ * The same pages are mapped twice, back to back, so the byte at ptr + i and
+ * ptr + size + i are the same memory.  A ring buffer using it can read or write
+ * any span of up to size bytes starting anywhere in the first copy as one
+ * contiguous block, with no special handling for the wrap.
+ *
+ * The size is rounded up to a multiple of the page size and the actual size is
+ * returned in ret_sz.  Returns NULL if the platform can't do it, in which case
+ * the caller should fall back to a normal allocation.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void *kis_mirror_alloc(size_t in_sz, size_t *ret_sz);
+
+/* Free a mirrored region; sz is the size returned by kis_mirror_alloc */
+void kis_mirror_free(void *ptr, size_t sz);
+
+/* Get an fd for sz bytes of shared memory, not linked anywhere in the
+ * filesystem, or -1 */
+int kis_mirror_shm_fd(size_t sz);
+
+/* Map sz bytes of fd, starting at offt, twice back to back; both must be
+ * multiples of the page size.  The mapping holds its own reference to the
+ * memory, so fd may be closed afterwards.  Free with kis_mirror_free.  Returns
+ * NULL on failure. */
+void *kis_mirror_map_fd(int fd, off_t offt, size_t sz);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -36,15 +36,34 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <dirent.h>
 
 #include "globalregistry.h"
 #include "messagebus.h"
 #include "configfile.h"
 #include "kis_net_microhttpd.h"
+#include "timetracker.h"
 #include "base64.h"
 #include "entrytracker.h"
+#include "kis_httpd_post.h"
+#include "kismet_json.h"
+#include "msgpack_adapter.h"
 #include "kis_httpd_websession.h"
+#include "cpu_affinity.h"
+#include "kis_metrics.h"
+#include "kis_probes.h"
+
+// Suspend/resume and the Linux epoll backend are needed for thread pool mode
+#if MHD_VERSION >= 0x00094000
+#define KIS_MHD_SUSPEND_RESUME
+#endif
+
+// Responses built from a list of buffers, sent without copying them
+#if MHD_VERSION >= 0x00097400
+#define KIS_MHD_IOVEC
+#endif
 
 Kis_Net_Httpd::Kis_Net_Httpd(GlobalRegistry *in_globalreg) {
     globalreg = in_globalreg;
@@ -55,6 +74,15 @@ Kis_Net_Httpd::Kis_Net_Httpd(GlobalRegistry *in_globalreg) {
     cert_pem = NULL;
     cert_key = NULL;
 
+    thread_pool_size = 0;
+    connection_limit = 0;
+    connection_timeout = 0;
+
+    use_compression = true;
+    use_zero_copy = false;
+
+    post_max = 0;
+
     pthread_mutexattr_t mutexattr;
     pthread_mutexattr_init(&mutexattr);
     pthread_mutexattr_settype(&mutexattr, PTHREAD_MUTEX_RECURSIVE);
@@ -110,10 +138,104 @@ Kis_Net_Httpd::Kis_Net_Httpd(GlobalRegistry *in_globalreg) {
     session_timeout = 
         globalreg->kismet_config->FetchOptUInt("httpd_session_timeout", 7200);
 
+    session_timer_id =
+        globalreg->timetracker->RegisterTimer(SERVER_TIMESLICES_SEC * KIS_SESSION_WHEEL_TICK,
+                NULL, 1, [this](int) -> int {
+                    ExpireSessions();
+                    return 1;
+                });
+
     use_ssl = globalreg->kismet_config->FetchOptBoolean("httpd_ssl", false);
     pem_path = globalreg->kismet_config->FetchOpt("httpd_ssl_cert");
     key_path = globalreg->kismet_config->FetchOpt("httpd_ssl_key");
 
+    thread_pool_size =
+        globalreg->kismet_config->FetchOptUInt("httpd_thread_pool", 0);
+    connection_limit =
+        globalreg->kismet_config->FetchOptUInt("httpd_connection_limit", 0);
+    connection_timeout =
+        globalreg->kismet_config->FetchOptUInt("httpd_connection_timeout", 0);
+
+    use_compression = 
+        globalreg->kismet_config->FetchOptBoolean("httpd_compression", true);
+
+    use_zero_copy =
+        globalreg->kismet_config->FetchOptBoolean("httpd_zero_copy", true);
+
+    post_max =
+        globalreg->kismet_config->FetchOptUInt("httpd_post_max", 16 * 1024 * 1024);
+
+    use_static_cache =
+        globalreg->kismet_config->FetchOptBoolean("httpd_static_cache", true);
+    static_cache_max_file =
+        globalreg->kismet_config->FetchOptUInt("httpd_static_cache_file", 256 * 1024);
+    static_cache_max =
+        globalreg->kismet_config->FetchOptUInt("httpd_static_cache_size", 32 * 1024 * 1024);
+    static_cache_bytes = 0;
+    static_preload =
+        globalreg->kismet_config->FetchOptBoolean("httpd_static_preload", true);
+
+    use_shared_responses =
+        globalreg->kismet_config->FetchOptBoolean("httpd_share_responses", true);
+    shared_response_ttl = std::chrono::milliseconds(
+        globalreg->kismet_config->FetchOptUInt("httpd_response_cache_ms", 0));
+    shared_response_max =
+        globalreg->kismet_config->FetchOptUInt("httpd_response_cache_max", 
+                8 * 1024 * 1024);
+
+    etag_epoch = (uint64_t) time(0);
+
+    // Request classes; configured prefixes replace the defaults of their class
+    vector<string> bulk_prefixes = 
+        globalreg->kismet_config->FetchOptVec("httpd_bulk_prefix");
+    vector<string> stream_prefixes = 
+        globalreg->kismet_config->FetchOptVec("httpd_streaming_prefix");
+
+    if (bulk_prefixes.size() == 0)
+        bulk_prefixes = { "/devices/all_devices", "/devices/summary/", 
+            "/devices/last-time/", "/devices/columns/", "/timeseries/" };
+
+    if (stream_prefixes.size() == 0)
+        stream_prefixes = { "/pcap/", "/datasource/pcap/", "/devices/by-key/*/pcap/",
+            "/phy/phy80211/by-bssid/*/pcap/", "/eventstream/" };
+
+    for (auto p : bulk_prefixes)
+        class_prefixes.push_back(std::make_pair(p, (int) request_bulk));
+    for (auto p : stream_prefixes)
+        class_prefixes.push_back(std::make_pair(p, (int) request_streaming));
+
+    class_limit[request_interactive] =
+        globalreg->kismet_config->FetchOptUInt("httpd_interactive_limit", 0);
+    class_limit[request_bulk] =
+        globalreg->kismet_config->FetchOptUInt("httpd_bulk_limit", 2);
+    class_limit[request_streaming] =
+        globalreg->kismet_config->FetchOptUInt("httpd_streaming_limit", 8);
+
+    for (unsigned int c = 0; c < 3; c++) {
+        class_active[c] = 0;
+        metric_class_rejected[c].reset(new kis_metric_counter());
+    }
+
+    bulk_slice_usec =
+        globalreg->kismet_config->FetchOptUInt("httpd_bulk_slice_ms", 5) * 1000;
+
+#ifndef KIS_MHD_SUSPEND_RESUME
+    if (thread_pool_size > 0) {
+        _MSG("httpd_thread_pool requires libmicrohttpd 0.9.40 or newer, falling "
+                "back to a thread per connection", MSGFLAG_ERROR);
+        thread_pool_size = 0;
+    }
+#endif
+
+    // A pool thread can't wait for a response to be finished, and older
+    // libmicrohttpd can't send one by reference
+#ifdef KIS_MHD_IOVEC
+    if (thread_pool_size > 0)
+        use_zero_copy = false;
+#else
+    use_zero_copy = false;
+#endif
+
     RegisterMimeType("html", "text/html");
     RegisterMimeType("svg", "image/svg+xml");
     RegisterMimeType("css", "text/css");
@@ -123,6 +245,8 @@ Kis_Net_Httpd::Kis_Net_Httpd(GlobalRegistry *in_globalreg) {
     RegisterMimeType("json", "application/json");
     RegisterMimeType("ekjson", "application/json");
     RegisterMimeType("pcap", "application/vnd.tcpdump.pcap");
+    RegisterMimeType("pcapng", "application/x-pcapng");
+    RegisterMimeType("bin", "application/octet-stream");
 
     vector<string> mimeopts = globalreg->kismet_config->FetchOptVec("httpd_mime");
     for (unsigned int i = 0; i < mimeopts.size(); i++) {
@@ -190,7 +314,7 @@ Kis_Net_Httpd::Kis_Net_Httpd(GlobalRegistry *in_globalreg) {
                     continue;
 
                 // Don't use AddSession because we don't want to trigger a write, yet
-                session_map.emplace(sess->sessionid, sess);
+                session_table.insert(sess);
             }
         }
     }
@@ -212,7 +336,10 @@ Kis_Net_Httpd::~Kis_Net_Httpd() {
         delete(session_db);
     }
 
-    session_map.clear();
+    if (globalreg->timetracker != NULL)
+        globalreg->timetracker->RemoveTimer(session_timer_id);
+
+    session_table.clear();
 
     pthread_mutex_destroy(&controller_mutex);
 }
@@ -304,6 +431,205 @@ void Kis_Net_Httpd::RemoveHandler(Kis_Net_Httpd_Handler *in_handler) {
             break;
         }
     }
+
+    route_trie.remove(in_handler);
+}
+
+void Kis_Net_Httpd::RegisterRoute(Kis_Net_Httpd_Handler *in_handler, string in_method,
+        string in_pattern) {
+    local_locker lock(&controller_mutex);
+
+    route_trie.insert(in_method, in_pattern, in_handler);
+
+    // Routed handlers are no longer asked about every path
+    for (unsigned int x = 0; x < handler_vec.size(); x++) {
+        if (handler_vec[x] == in_handler) {
+            handler_vec.erase(handler_vec.begin() + x);
+            break;
+        }
+    }
+}
+
+// Non-empty segments of a path
+static void route_split(const kis_strview& in_path, kis_strview_vec& out_segs) {
+    size_t start = 0;
+
+    while (start <= in_path.length()) {
+        size_t end = in_path.find('/', start);
+
+        if (end == string::npos)
+            end = in_path.length();
+
+        if (end != start)
+            out_segs.push_back(in_path.substr(start, end - start));
+
+        start = end + 1;
+    }
+}
+
+bool Kis_Net_Httpd_Route_Trie::node::literal_less(const std::pair<string, std::unique_ptr<node> >& in_lit,
+        const kis_strview& in_seg) {
+    return kis_strview(in_lit.first) < in_seg;
+}
+
+Kis_Net_Httpd_Route_Trie::node *Kis_Net_Httpd_Route_Trie::node::find_literal(const kis_strview& in_seg) {
+    auto li = std::lower_bound(literals.begin(), literals.end(), in_seg, literal_less);
+
+    if (li == literals.end() || in_seg != li->first)
+        return NULL;
+
+    return li->second.get();
+}
+
+Kis_Net_Httpd_Route_Trie::node *Kis_Net_Httpd_Route_Trie::node::insert_literal(const string& in_seg) {
+    auto li = std::lower_bound(literals.begin(), literals.end(), 
+            kis_strview(in_seg), literal_less);
+
+    if (li != literals.end() && li->first == in_seg)
+        return li->second.get();
+
+    li = literals.insert(li, std::make_pair(in_seg, std::unique_ptr<node>(new node())));
+
+    return li->second.get();
+}
+
+void Kis_Net_Httpd_Route_Trie::insert(const string& in_method, const string& in_pattern,
+        Kis_Net_Httpd_Handler *in_handler) {
+    kis_strview_vec segs;
+    route_split(in_pattern, segs);
+
+    route r;
+    r.method = in_method;
+    r.handler = in_handler;
+
+    node *n = &root;
+
+    for (size_t i = 0; i < segs.size(); i++) {
+        if (segs[i] == "*") {
+            n->rest_routes.push_back(r);
+            return;
+        }
+
+        if (segs[i][0] == ':') {
+            r.param_names.push_back(segs[i].substr(1).str());
+
+            if (n->param == NULL)
+                n->param.reset(new node());
+
+            n = n->param.get();
+            continue;
+        }
+
+        n = n->insert_literal(segs[i].str());
+    }
+
+    n->routes.push_back(r);
+}
+
+void Kis_Net_Httpd_Route_Trie::remove_node(node *in_node,
+        Kis_Net_Httpd_Handler *in_handler) {
+    auto of_handler = [in_handler](const route& r) -> bool {
+        return r.handler == in_handler;
+    };
+
+    in_node->routes.erase(std::remove_if(in_node->routes.begin(),
+                in_node->routes.end(), of_handler), in_node->routes.end());
+    in_node->rest_routes.erase(std::remove_if(in_node->rest_routes.begin(),
+                in_node->rest_routes.end(), of_handler), in_node->rest_routes.end());
+
+    for (auto& l : in_node->literals)
+        remove_node(l.second.get(), in_handler);
+
+    if (in_node->param != NULL)
+        remove_node(in_node->param.get(), in_handler);
+}
+
+void Kis_Net_Httpd_Route_Trie::remove(Kis_Net_Httpd_Handler *in_handler) {
+    remove_node(&root, in_handler);
+}
+
+void Kis_Net_Httpd_Route_Trie::add_match(const route& in_route,
+        const kis_strview_vec& in_captured, const kis_strview_vec& in_segs,
+        size_t in_rest_pos, bool in_rest, vector<route_match>& out_matches) {
+    // A handler is only asked once, for its most specific route
+    for (auto& m : out_matches) {
+        if (m.handler == in_route.handler)
+            return;
+    }
+
+    route_match m;
+    m.handler = in_route.handler;
+
+    for (size_t i = 0; i < in_route.param_names.size() && i < in_captured.size(); i++)
+        m.params[in_route.param_names[i]] = in_captured[i].str();
+
+    if (in_rest) {
+        string rest;
+
+        for (size_t i = in_rest_pos; i < in_segs.size(); i++) {
+            if (i != in_rest_pos)
+                rest += "/";
+            rest.append(in_segs[i].data(), in_segs[i].length());
+        }
+
+        m.params["*"] = rest;
+    }
+
+    out_matches.push_back(m);
+}
+
+void Kis_Net_Httpd_Route_Trie::find_node(node *in_node, const kis_strview_vec& in_segs,
+        size_t in_pos, kis_strview_vec& in_captured, const char *in_method,
+        vector<route_match>& out_matches) {
+
+    if (in_pos == in_segs.size()) {
+        for (auto& r : in_node->routes) {
+            if (r.method == in_method)
+                add_match(r, in_captured, in_segs, 0, false, out_matches);
+        }
+    } else {
+        const kis_strview& seg = in_segs[in_pos];
+
+        node *li = in_node->find_literal(seg);
+
+        if (li != NULL)
+            find_node(li, in_segs, in_pos + 1, in_captured, in_method, out_matches);
+
+        // The last segment may match a literal without its suffix
+        if (in_pos == in_segs.size() - 1) {
+            size_t dpos = seg.find_last_of('.');
+
+            if (dpos != string::npos) {
+                li = in_node->find_literal(seg.substr(0, dpos));
+
+                if (li != NULL)
+                    find_node(li, in_segs, in_pos + 1, in_captured,
+                            in_method, out_matches);
+            }
+        }
+
+        if (in_node->param != NULL) {
+            in_captured.push_back(seg);
+            find_node(in_node->param.get(), in_segs, in_pos + 1, in_captured,
+                    in_method, out_matches);
+            in_captured.pop_back();
+        }
+    }
+
+    for (auto& r : in_node->rest_routes) {
+        if (r.method == in_method)
+            add_match(r, in_captured, in_segs, in_pos, true, out_matches);
+    }
+}
+
+void Kis_Net_Httpd_Route_Trie::find(const char *in_path, const char *in_method,
+        vector<route_match>& out_matches) {
+    kis_strview_vec segs;
+    kis_strview_vec captured;
+
+    route_split(in_path, segs);
+
+    find_node(&root, segs, 0, captured, in_method, out_matches);
 }
 
 int Kis_Net_Httpd::StartHttpd() {
@@ -341,18 +667,109 @@ int Kis_Net_Httpd::StartHttpd() {
     }
 
 
-    if (!use_ssl) {
-        microhttpd = MHD_start_daemon(MHD_USE_THREAD_PER_CONNECTION,
-                http_port, NULL, NULL, 
-                &http_request_handler, this, 
-                MHD_OPTION_NOTIFY_COMPLETED, &http_request_completed, NULL,
-                MHD_OPTION_END); 
+    shared_ptr<KisMetrics> metrics =
+        globalreg->FetchGlobalAs<KisMetrics>("METRICS");
+
+    if (metrics != NULL) {
+        metric_requests =
+            metrics->register_counter("kismet_http_requests",
+                    "http requests completed");
+        metric_aborted =
+            metrics->register_counter("kismet_http_requests_aborted",
+                    "http requests ended by an error or a closed connection");
+        metric_latency =
+            metrics->register_histogram("kismet_http_request_seconds",
+                    "time from the arrival of a request to its completion");
+        metric_shared =
+            metrics->register_counter("kismet_http_shared_responses",
+                    "http requests answered with the response generated for an "
+                    "identical request");
+        metric_not_modified =
+            metrics->register_counter("kismet_http_not_modified",
+                    "http requests answered with a 304 because the client had "
+                    "the current version");
+
+        const char *class_names[3] = { "interactive", "bulk", "streaming" };
+
+        for (unsigned int c = 0; c < 3; c++) {
+            string labels = "class=" + KisMetrics::label_escape(class_names[c]);
+
+            metric_class_rejected[c] =
+                metrics->register_counter("kismet_http_class_rejected",
+                        "http requests answered with a 503 because their class was "
+                        "at its limit", labels);
+            metrics->register_gauge("kismet_http_class_active",
+                    "http requests of a class being handled", labels,
+                    [this, c]() -> double {
+                        return class_active[c];
+                    });
+        }
+    }
+
+    unsigned int flags = 0;
+    std::vector<struct MHD_OptionItem> options;
+
+    // A fixed pool of threads each running their own epoll loop scales with the
+    // number of cores instead of the number of clients; streaming responses
+    // suspend their connection while they wait for data
+    if (thread_pool_size > 0) {
+        flags |= MHD_USE_SELECT_INTERNALLY;
+#ifdef KIS_MHD_SUSPEND_RESUME
+        flags |= MHD_USE_SUSPEND_RESUME;
+#ifdef __linux__
+        flags |= MHD_USE_EPOLL_LINUX_ONLY;
+#endif
+#endif
+
+        options.push_back({MHD_OPTION_THREAD_POOL_SIZE, 
+                (intptr_t) thread_pool_size, NULL});
     } else {
-        microhttpd = MHD_start_daemon(MHD_USE_THREAD_PER_CONNECTION | MHD_USE_SSL,
-                http_port, NULL, NULL, &http_request_handler, this, 
-                MHD_OPTION_HTTPS_MEM_KEY, cert_key,
-                MHD_OPTION_HTTPS_MEM_CERT, cert_pem,
+        flags |= MHD_USE_THREAD_PER_CONNECTION;
+    }
+
+    if (connection_limit > 0)
+        options.push_back({MHD_OPTION_CONNECTION_LIMIT, 
+                (intptr_t) connection_limit, NULL});
+
+    if (connection_timeout > 0)
+        options.push_back({MHD_OPTION_CONNECTION_TIMEOUT, 
+                (intptr_t) connection_timeout, NULL});
+
+    options.push_back({MHD_OPTION_NOTIFY_COMPLETED, 
+            (intptr_t) &http_request_completed, NULL});
+
+    if (use_ssl) {
+        flags |= MHD_USE_SSL;
+
+        options.push_back({MHD_OPTION_HTTPS_MEM_KEY, 0, cert_key});
+        options.push_back({MHD_OPTION_HTTPS_MEM_CERT, 0, cert_pem});
+    }
+
+    options.push_back({MHD_OPTION_END, 0, NULL});
+
+    // The server makes its threads as it starts (and the listening thread makes
+    // any per-connection threads), so they all inherit the placement we start it
+    // with
+    string httpd_cpus = globalreg->kismet_config->FetchOpt("cpu_affinity_httpd");
+
+    {
+        CpuAffinityScope affinity_scope(httpd_cpus);
+
+        if (httpd_cpus.length() != 0 && !affinity_scope.get_placed())
+            _MSG("Unable to place the http server on cpus '" + httpd_cpus + "'",
+                    MSGFLAG_ERROR);
+
+        microhttpd = MHD_start_daemon(flags, http_port, NULL, NULL, 
+                &http_request_handler, this, 
+                MHD_OPTION_ARRAY, options.data(),
                 MHD_OPTION_END); 
+
+        shared_ptr<CpuAffinity> affinity =
+            globalreg->FetchGlobalAs<CpuAffinity>("CPU_AFFINITY");
+
+        if (affinity != NULL && affinity_scope.get_placed())
+            affinity->record_placement("httpd", 
+                    CpuAffinity::normalize_cpu_list(httpd_cpus));
     }
 
 
@@ -365,7 +782,11 @@ int Kis_Net_Httpd::StartHttpd() {
 
     MHD_set_panic_func(Kis_Net_Httpd::MHD_Panic, this);
 
-    _MSG("Started http server on port " + UIntToString(http_port), MSGFLAG_INFO);
+    if (thread_pool_size > 0)
+        _MSG("Started http server on port " + UIntToString(http_port) + " with " +
+                UIntToString(thread_pool_size) + " threads", MSGFLAG_INFO);
+    else
+        _MSG("Started http server on port " + UIntToString(http_port), MSGFLAG_INFO);
 
     return 1;
 }
@@ -397,30 +818,191 @@ void Kis_Net_Httpd::MHD_Panic(void *cls, const char *file, unsigned int line,
     httpd->microhttpd = NULL;
 }
 
-void Kis_Net_Httpd::AddSession(shared_ptr<Kis_Net_Httpd_Session> in_session) {
-    local_locker lock(&controller_mutex);
+Kis_Net_Httpd_Session_Table::Kis_Net_Httpd_Session_Table() {
+    last_tick = 0;
+}
 
-    session_map.emplace(in_session->sessionid, in_session);
-    WriteSessions();
+bool Kis_Net_Httpd_Session_Table::expired(shared_ptr<Kis_Net_Httpd_Session> in_session,
+        time_t in_now) {
+    if (in_session->session_lifetime == 0)
+        return false;
+
+    return in_now >= in_session->session_created + in_session->session_lifetime;
 }
 
-void Kis_Net_Httpd::DelSession(string in_key) {
-    local_locker lock(&controller_mutex);
+void Kis_Net_Httpd_Session_Table::insert(shared_ptr<Kis_Net_Httpd_Session> in_session) {
+    {
+        stripe& st = stripe_for(in_session->sessionid);
+        std::lock_guard<std::mutex> lk(st.mutex);
+        st.sessions[in_session->sessionid] = in_session;
+    }
 
-    auto i = session_map.find(in_key);
+    // Sessions which never expire stay off the wheel
+    if (in_session->session_lifetime == 0)
+        return;
 
-    if (i != session_map.end())
-        DelSession(i);
+    time_t expiry = in_session->session_created + in_session->session_lifetime;
 
+    std::lock_guard<std::mutex> lk(wheel_mutex);
+    wheel[(expiry / KIS_SESSION_WHEEL_TICK) % KIS_SESSION_WHEEL_SLOTS].push_back(
+            std::make_pair(expiry, in_session->sessionid));
 }
 
-void Kis_Net_Httpd::DelSession(map<string, shared_ptr<Kis_Net_Httpd_Session> >::iterator in_itr) {
-    local_locker lock(&controller_mutex);
+shared_ptr<Kis_Net_Httpd_Session> Kis_Net_Httpd_Session_Table::find(const string& in_id,
+        time_t in_now) {
+    stripe& st = stripe_for(in_id);
+    std::lock_guard<std::mutex> lk(st.mutex);
 
-    if (in_itr != session_map.end()) {
-        session_map.erase(in_itr);
-        WriteSessions();
+    auto si = st.sessions.find(in_id);
+
+    // Expired sessions are left for the wheel to remove
+    if (si == st.sessions.end() || expired(si->second, in_now))
+        return NULL;
+
+    si->second->session_seen = in_now;
+
+    return si->second;
+}
+
+bool Kis_Net_Httpd_Session_Table::erase(const string& in_id) {
+    stripe& st = stripe_for(in_id);
+    std::lock_guard<std::mutex> lk(st.mutex);
+
+    // Any wheel entry finds nothing when it comes due
+    return st.sessions.erase(in_id) != 0;
+}
+
+size_t Kis_Net_Httpd_Session_Table::expire(time_t in_now) {
+    size_t removed = 0;
+    time_t tick = in_now / KIS_SESSION_WHEEL_TICK;
+
+    {
+        std::lock_guard<std::mutex> lk(wheel_mutex);
+
+        // Look at each slot which has come due since the last sweep, including
+        // the one the last sweep was part way through; a whole turn of the
+        // wheel covers every slot
+        time_t first = tick - (KIS_SESSION_WHEEL_SLOTS - 1);
+
+        if (last_tick != 0 && last_tick > first)
+            first = last_tick;
+
+        for (time_t t = first; t <= tick; t++) {
+            vector<std::pair<time_t, string> >& slot = wheel[t % KIS_SESSION_WHEEL_SLOTS];
+
+            for (size_t i = 0; i < slot.size(); ) {
+                // Expires on a later turn of the wheel
+                if (slot[i].first > in_now) {
+                    i++;
+                    continue;
+                }
+
+                stripe& st = stripe_for(slot[i].second);
+
+                {
+                    std::lock_guard<std::mutex> slk(st.mutex);
+
+                    auto si = st.sessions.find(slot[i].second);
+
+                    if (si != st.sessions.end() && expired(si->second, in_now)) {
+                        st.sessions.erase(si);
+                        removed++;
+                    }
+                }
+
+                slot[i] = slot.back();
+                slot.pop_back();
+            }
+        }
+
+        last_tick = tick;
     }
+
+    if (removed == 0)
+        return 0;
+
+    // Forget logins whose session is gone
+    std::lock_guard<std::mutex> lk(auth_mutex);
+
+    for (auto ai = auth_sessions.begin(); ai != auth_sessions.end(); ) {
+        stripe& st = stripe_for(ai->second);
+        std::lock_guard<std::mutex> slk(st.mutex);
+
+        if (st.sessions.find(ai->second) == st.sessions.end())
+            ai = auth_sessions.erase(ai);
+        else
+            ++ai;
+    }
+
+    return removed;
+}
+
+vector<Kis_Net_Httpd_Session> Kis_Net_Httpd_Session_Table::snapshot() {
+    vector<Kis_Net_Httpd_Session> ret;
+
+    for (unsigned int i = 0; i < KIS_SESSION_STRIPES; i++) {
+        std::lock_guard<std::mutex> lk(stripes[i].mutex);
+
+        for (auto s : stripes[i].sessions)
+            ret.push_back(*(s.second));
+    }
+
+    return ret;
+}
+
+void Kis_Net_Httpd_Session_Table::clear() {
+    for (unsigned int i = 0; i < KIS_SESSION_STRIPES; i++) {
+        std::lock_guard<std::mutex> lk(stripes[i].mutex);
+        stripes[i].sessions.clear();
+    }
+
+    {
+        std::lock_guard<std::mutex> lk(wheel_mutex);
+
+        for (unsigned int i = 0; i < KIS_SESSION_WHEEL_SLOTS; i++)
+            wheel[i].clear();
+    }
+
+    std::lock_guard<std::mutex> lk(auth_mutex);
+    auth_sessions.clear();
+}
+
+void Kis_Net_Httpd_Session_Table::cache_auth(const string& in_auth, const string& in_id) {
+    std::lock_guard<std::mutex> lk(auth_mutex);
+    auth_sessions[in_auth] = in_id;
+}
+
+shared_ptr<Kis_Net_Httpd_Session> Kis_Net_Httpd_Session_Table::find_auth(
+        const string& in_auth, time_t in_now) {
+    string id;
+
+    {
+        std::lock_guard<std::mutex> lk(auth_mutex);
+
+        auto ai = auth_sessions.find(in_auth);
+
+        if (ai == auth_sessions.end())
+            return NULL;
+
+        id = ai->second;
+    }
+
+    return find(id, in_now);
+}
+
+void Kis_Net_Httpd::AddSession(shared_ptr<Kis_Net_Httpd_Session> in_session) {
+    session_table.insert(in_session);
+    WriteSessions();
+}
+
+void Kis_Net_Httpd::DelSession(string in_key) {
+    if (session_table.erase(in_key))
+        WriteSessions();
+}
+
+void Kis_Net_Httpd::ExpireSessions() {
+    if (session_table.expire(globalreg->timestamp.tv_sec) != 0)
+        WriteSessions();
 }
 
 void Kis_Net_Httpd::WriteSessions() {
@@ -432,19 +1014,88 @@ void Kis_Net_Httpd::WriteSessions() {
     vector<string> sessions;
     stringstream str;
 
-    for (auto i : session_map) {
+    for (auto i : session_table.snapshot()) {
         str.str("");
 
-        str << i.second->sessionid << "," << i.second->session_created << "," <<
-            i.second->session_seen << "," << i.second->session_lifetime;
+        str << i.sessionid << "," << i.session_created << "," <<
+            i.session_seen << "," << i.session_lifetime;
 
         sessions.push_back(str.str());
     }
 
     session_db->SetOptVec("session", sessions, true);
 
-    // Ignore failures here I guess?
-    session_db->SaveConfig(sessiondb_file.c_str());
+    // Failures are reported by the config writer
+    session_db->SaveConfigAsync(sessiondb_file);
+}
+
+// Class of the request being handled by this thread
+static thread_local int kis_httpd_current_class = Kis_Net_Httpd::request_interactive;
+
+int Kis_Net_Httpd::CurrentRequestClass() {
+    return kis_httpd_current_class;
+}
+
+void Kis_Net_Httpd::SetCurrentRequestClass(int in_class) {
+    kis_httpd_current_class = in_class;
+}
+
+int Kis_Net_Httpd::ClassifyRequest(const string& in_url) {
+    for (auto& cp : class_prefixes) {
+        const string& p = cp.first;
+        size_t pi = 0, ui = 0;
+
+        while (pi < p.length() && ui < in_url.length()) {
+            if (p[pi] == '*') {
+                // Any one segment
+                while (ui < in_url.length() && in_url[ui] != '/')
+                    ui++;
+                pi++;
+                continue;
+            }
+
+            if (p[pi] != in_url[ui])
+                break;
+
+            pi++;
+            ui++;
+        }
+
+        if (pi == p.length())
+            return cp.second;
+    }
+
+    return request_interactive;
+}
+
+bool Kis_Net_Httpd::AdmitRequestClass(Kis_Net_Httpd_Connection *connection, int *ret) {
+    if (connection->class_admitted)
+        return true;
+
+    int c = connection->request_class;
+    unsigned int active = ++class_active[c];
+
+    if (class_limit[c] == 0 || active <= class_limit[c]) {
+        connection->class_admitted = true;
+        return true;
+    }
+
+    class_active[c]--;
+    metric_class_rejected[c]->inc();
+
+    string busy = "Too many requests of this kind at once, try again shortly";
+
+    struct MHD_Response *response = 
+        MHD_create_response_from_buffer(busy.length(), 
+                (void *) busy.c_str(), MHD_RESPMEM_MUST_COPY);
+
+    MHD_add_response_header(response, "Retry-After", "1");
+
+    *ret = MHD_queue_response(connection->connection, MHD_HTTP_SERVICE_UNAVAILABLE, 
+            response);
+    MHD_destroy_response(response);
+
+    return false;
 }
 
 int Kis_Net_Httpd::http_request_handler(void *cls, struct MHD_Connection *connection,
@@ -465,37 +1116,41 @@ int Kis_Net_Httpd::http_request_handler(void *cls, struct MHD_Connection *connec
     cookieval = MHD_lookup_connection_value(connection, 
             MHD_COOKIE_KIND, KIS_SESSION_COOKIE);
 
-    if (cookieval != NULL) {
-        auto si = kishttpd->session_map.find(cookieval);
-
-        if (si != kishttpd->session_map.end()) {
-            s = si->second;
-
-            if (s->session_lifetime != 0) {
-                // Delete if the session has expired
-                if (s->session_seen + s->session_lifetime < 
-                        kishttpd->globalreg->timestamp.tv_sec) {
-                    kishttpd->DelSession(si);
-                }
-            }
+    // Finding the session marks it as seen; expired sessions aren't found
+    if (cookieval != NULL)
+        s = kishttpd->session_table.find(cookieval, kishttpd->globalreg->timestamp.tv_sec);
 
-            // Update the last seen
-            s->session_seen = kishttpd->globalreg->timestamp.tv_sec;
-        }
-    } 
     
     Kis_Net_Httpd_Handler *handler = NULL;
+    map<string, string> url_params;
+
+    // Handlers with routes matching the path get the first chance, the most
+    // specific route first; handlers are asked without holding the controller
+    // lock, since verifying a path may take their own locks
+    vector<Kis_Net_Httpd_Route_Trie::route_match> matches;
+    vector<Kis_Net_Httpd_Handler *> unrouted;
 
     {
-        local_locker(&(kishttpd->controller_mutex));
-        /* Find a handler that can handle this path & method */
-        for (unsigned int i = 0; i < kishttpd->handler_vec.size(); i++) {
-            Kis_Net_Httpd_Handler *h = kishttpd->handler_vec[i];
+        local_locker lock(&(kishttpd->controller_mutex));
+        kishttpd->route_trie.find(url, method, matches);
+        unrouted = kishttpd->handler_vec;
+    }
 
-            if (h->Httpd_VerifyPath(url, method)) {
-                handler = h;
-                break;
-            }
+    for (auto& m : matches) {
+        if (m.handler->Httpd_VerifyPath(url, method)) {
+            handler = m.handler;
+            url_params = m.params;
+            break;
+        }
+    }
+
+    /* Find a handler that can handle this path & method */
+    for (unsigned int i = 0; handler == NULL && i < unrouted.size(); i++) {
+        Kis_Net_Httpd_Handler *h = unrouted[i];
+
+        if (h->Httpd_VerifyPath(url, method)) {
+            handler = h;
+            break;
         }
     }
 
@@ -511,7 +1166,11 @@ int Kis_Net_Httpd::http_request_handler(void *cls, struct MHD_Connection *connec
         concls->session = s;
         concls->httpcode = MHD_HTTP_OK;
         concls->url = string(url);
+        concls->url_params = url_params;
         concls->connection = connection;
+        concls->request_class = kishttpd->ClassifyRequest(concls->url);
+
+        KIS_PROBE3(http__request__start, concls, url, method);
 
         /* Set up a POST handler */
         if (strcmp(method, "POST") == 0) {
@@ -556,6 +1215,9 @@ int Kis_Net_Httpd::http_request_handler(void *cls, struct MHD_Connection *connec
         return MHD_YES;
     }
 
+    if (!kishttpd->AdmitRequestClass(concls, &ret))
+        return ret;
+
     if (strcmp(method, "POST") == 0) {
         // Handle post
         
@@ -575,15 +1237,37 @@ int Kis_Net_Httpd::http_request_handler(void *cls, struct MHD_Connection *connec
         // fprintf(stderr, "con %p post complete\n", concls);
         concls->post_complete = true;
 
+        if (concls->post_too_large) {
+            string toolarge = "Request too large";
+
+            struct MHD_Response *response = 
+                MHD_create_response_from_buffer(toolarge.length(), 
+                        (void *) toolarge.c_str(), MHD_RESPMEM_MUST_COPY);
+
+            ret = MHD_queue_response(connection, MHD_HTTP_REQUEST_ENTITY_TOO_LARGE,
+                    response);
+            MHD_destroy_response(response);
+
+            return ret;
+        }
+
+        SetCurrentRequestClass(concls->request_class);
+
         // Handle a post req inside the processor and return the results
-        return (concls->httpdhandler)->Httpd_HandlePostRequest(kishttpd, concls, url,
+        ret = (concls->httpdhandler)->Httpd_HandlePostRequest(kishttpd, concls, url,
                 method, upload_data, upload_data_size);
     } else {
+        SetCurrentRequestClass(concls->request_class);
+
         // Handle GET + any others
-        ret = handler->Httpd_HandleGetRequest(kishttpd, concls, url, method, 
-                upload_data, upload_data_size);
+        if (strcmp(method, "GET") != 0 ||
+                !kishttpd->HandleConditionalGet(handler, concls, url, &ret))
+            ret = handler->Httpd_HandleGetRequest(kishttpd, concls, url, method, 
+                    upload_data, upload_data_size);
     }
 
+    SetCurrentRequestClass(request_interactive);
+
     return ret;
 }
 
@@ -592,52 +1276,436 @@ int Kis_Net_Httpd::http_post_handler(void *coninfo_cls, enum MHD_ValueKind kind,
         const char *transfer_encoding, const char *data, 
         uint64_t off, size_t size) {
 
-    Kis_Net_Httpd_Connection *concls = (Kis_Net_Httpd_Connection *) coninfo_cls;
+    Kis_Net_Httpd_Connection *concls = (Kis_Net_Httpd_Connection *) coninfo_cls;
+
+    if (concls->httpdhandler->Httpd_UseCustomPostIterator()) {
+        return (concls->httpdhandler)->Httpd_PostIterator(coninfo_cls, kind,
+                key, filename, content_type, transfer_encoding, data, off, size);
+    } else {
+        if (concls->post_too_large)
+            return MHD_NO;
+
+        size_t post_max = concls->httpd->FetchPostMax();
+
+        concls->post_size += size;
+
+        if (post_max != 0 && concls->post_size > post_max) {
+            concls->post_too_large = true;
+            concls->variable_cache.clear();
+            concls->structured_post.reset();
+            return MHD_NO;
+        }
+
+        // Structured commands go straight to their decoder; the first of
+        // msgpack or json wins, unless msgpack follows json, as msgpack has always
+        // been preferred
+        if (concls->httpdhandler->Httpd_StreamStructuredPost() &&
+                Kis_Httpd_Structured_Post::IsStructuredVar(key)) {
+            if (concls->structured_post == NULL ||
+                    (concls->structured_post->FetchVar() != key &&
+                     strcmp(key, "msgpack") == 0 && off == 0))
+                concls->structured_post =
+                    std::make_shared<Kis_Httpd_Structured_Post>(key, post_max);
+
+            if (concls->structured_post->FetchVar() == key)
+                concls->structured_post->Feed(data, size);
+
+            return MHD_YES;
+        }
+
+        // Cache all the variables by name until we're complete
+        if (concls->variable_cache.find(key) == concls->variable_cache.end())
+            concls->variable_cache[key] = 
+                unique_ptr<std::stringstream>(new std::stringstream);
+
+        concls->variable_cache[key]->write(data, size);
+
+        return MHD_YES;
+    }
+}
+
+SharedStructured Kis_Net_Httpd_Connection::FetchStructuredPost() {
+    if (structured_post != NULL)
+        return structured_post->Finish();
+
+    if (variable_cache.find("msgpack") != variable_cache.end())
+        return SharedStructured(new StructuredMsgpack(Base64::decode(variable_cache["msgpack"]->str())));
+
+    if (variable_cache.find("json") != variable_cache.end())
+        return SharedStructured(new StructuredJson(variable_cache["json"]->str()));
+
+    throw StructuredDataException("Missing data");
+}
+
+void Kis_Net_Httpd::http_request_completed(void *cls __attribute__((unused)), 
+        struct MHD_Connection *connection __attribute__((unused)),
+        void **con_cls, 
+        enum MHD_RequestTerminationCode toe) {
+    Kis_Net_Httpd_Connection *con_info = (Kis_Net_Httpd_Connection *) *con_cls;
+
+    if (con_info == NULL)
+        return;
+
+    KIS_PROBE4(http__request__end, con_info, con_info->url.c_str(), con_info->httpcode,
+            (int) toe);
+
+    Kis_Net_Httpd *kishttpd = con_info->httpd;
+
+    if (kishttpd != NULL && kishttpd->metric_requests != NULL) {
+        if (toe == MHD_REQUEST_TERMINATED_COMPLETED_OK)
+            kishttpd->metric_requests->inc();
+        else
+            kishttpd->metric_aborted->inc();
+
+        kishttpd->metric_latency->observe_nsec(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - con_info->start_time).count());
+    }
+
+    if (kishttpd != NULL && con_info->class_admitted)
+        kishttpd->class_active[con_info->request_class]--;
+
+    if (con_info->connection_type == Kis_Net_Httpd_Connection::CONNECTION_POST) {
+        MHD_destroy_post_processor(con_info->postprocessor);
+        con_info->postprocessor = NULL;
+    }
+
+    delete(con_info);
+    *con_cls = NULL;
+}
+
+// Which of gzip and deflate the client will accept
+static void accepted_encodings(struct MHD_Connection *mhd_connection, bool *gzip,
+        bool *deflate) {
+    *gzip = false;
+    *deflate = false;
+
+    const char *accept = 
+        MHD_lookup_connection_value(mhd_connection, MHD_HEADER_KIND, "Accept-Encoding");
+
+    if (accept == NULL)
+        return;
+
+    // Comma separated codings with optional parameters; a q of 0 refuses the
+    // coding, any other weight is good enough for us
+    vector<string> codings = StrTokenize(accept, ",");
+    for (auto c : codings) {
+        vector<string> params = StrTokenize(c, ";");
+
+        if (params.size() == 0)
+            continue;
+
+        string coding = StrLower(StrStrip(params[0]));
+        bool refused = false;
+
+        for (unsigned int p = 1; p < params.size(); p++) {
+            string q = StrStrip(params[p]);
+            if (q.length() > 2 && q[0] == 'q' && q[1] == '=' && 
+                    strtod(q.c_str() + 2, NULL) <= 0)
+                refused = true;
+        }
+
+        if (refused)
+            continue;
+
+        if (coding == "gzip" || coding == "x-gzip")
+            *gzip = true;
+        else if (coding == "deflate")
+            *deflate = true;
+    }
+}
+
+// A cached static file being sent; holds the content until the response is
+// done with it, even if the cache entry is replaced meanwhile
+static ssize_t static_content_reader(void *cls, uint64_t pos, char *buf, size_t max) {
+    shared_ptr<string> *content = (shared_ptr<string> *) cls;
+
+    if (pos >= (*content)->length())
+        return MHD_CONTENT_READER_END_OF_STREAM;
+
+    size_t len = (*content)->length() - pos;
+
+    if (len > max)
+        len = max;
+
+    memcpy(buf, (*content)->data() + pos, len);
+
+    return len;
+}
+
+static void static_content_free(void *cls) {
+    delete (shared_ptr<string> *) cls;
+}
+
+static bool gzip_content(const string& in_content, string& out_content) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(z_stream));
+
+    // Static content is compressed once, so take the best compression
+    if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                Z_DEFAULT_STRATEGY) != Z_OK)
+        return false;
+
+    out_content.resize(deflateBound(&zs, in_content.length()) + 32);
+
+    zs.next_in = (Bytef *) in_content.data();
+    zs.avail_in = in_content.length();
+    zs.next_out = (Bytef *) &(out_content[0]);
+    zs.avail_out = out_content.length();
+
+    int r = deflate(&zs, Z_FINISH);
+
+    out_content.resize(zs.total_out);
+    deflateEnd(&zs);
+
+    return r == Z_STREAM_END;
+}
+
+// Does this mime type compress well?  Images and fonts are already compressed
+static bool static_compressible(const string& in_mime) {
+    return in_mime.find("text/") == 0 || 
+        in_mime.find("javascript") != string::npos ||
+        in_mime.find("json") != string::npos ||
+        in_mime.find("xml") != string::npos;
+}
+
+// Does an If-None-Match header match our etag?
+static bool etag_matches(const char *in_header, const string& in_etag) {
+    if (in_header == NULL)
+        return false;
+
+    vector<string> tags = StrTokenize(in_header, ",");
+
+    for (auto t : tags) {
+        t = StrStrip(t);
+
+        // Weak tags compare the same for a GET
+        if (t.find("W/") == 0)
+            t = t.substr(2);
+
+        if (t == "*" || t == in_etag)
+            return true;
+    }
+
+    return false;
+}
+
+bool Kis_Net_Httpd::HandleConditionalGet(Kis_Net_Httpd_Handler *handler,
+        Kis_Net_Httpd_Connection *connection, const char *url, int *ret) {
+    uint64_t version;
+
+    if (!handler->Httpd_ETag(url, &version))
+        return false;
+
+    std::stringstream etag;
+    etag << "\"" << std::hex << etag_epoch << "-" << version << "\"";
+    connection->etag = etag.str();
+
+    if (!etag_matches(MHD_lookup_connection_value(connection->connection,
+                    MHD_HEADER_KIND, "If-None-Match"), connection->etag))
+        return false;
+
+    if (metric_not_modified != NULL)
+        metric_not_modified->inc();
+
+    connection->httpcode = MHD_HTTP_NOT_MODIFIED;
+    connection->response = MHD_create_response_from_buffer(0, (void *) "",
+            MHD_RESPMEM_PERSISTENT);
+
+    *ret = SendStandardHttpResponse(this, connection, url);
+    return true;
+}
+
+shared_ptr<Kis_Net_Httpd::static_file> Kis_Net_Httpd::FetchStaticFile(
+        const string& in_path, int in_fd, const struct stat& in_stat,
+        bool in_compressible) {
+
+    {
+        std::lock_guard<std::mutex> lk(static_cache_mutex);
+
+        auto ci = static_cache.find(in_path);
+
+        if (ci != static_cache.end()) {
+            shared_ptr<static_file> f = ci->second;
+
+            if (f->dev == in_stat.st_dev && f->ino == in_stat.st_ino &&
+                    f->size == in_stat.st_size && f->mtime == in_stat.st_mtime)
+                return f;
+
+            // The file changed; forget it and load it again
+            if (f->content != NULL)
+                static_cache_bytes -= f->content->length();
+            if (f->gzip_content != NULL)
+                static_cache_bytes -= f->gzip_content->length();
+
+            static_cache.erase(ci);
+        }
+    }
+
+    shared_ptr<static_file> f(new static_file());
+
+    f->dev = in_stat.st_dev;
+    f->ino = in_stat.st_ino;
+    f->size = in_stat.st_size;
+    f->mtime = in_stat.st_mtime;
+
+    char lastmod[31];
+    struct tm tmstruct;
+    gmtime_r(&(in_stat.st_mtime), &tmstruct);
+    strftime(lastmod, 31, "%a, %d %b %Y %H:%M:%S GMT", &tmstruct);
+    f->last_modified = lastmod;
+
+    std::stringstream etag;
+    etag << "\"" << std::hex << (uint64_t) in_stat.st_ino << "-" <<
+        (uint64_t) in_stat.st_size << "-" << (uint64_t) in_stat.st_mtime << "\"";
+    f->etag = etag.str();
+
+    if (!use_static_cache || (size_t) in_stat.st_size > static_cache_max_file)
+        return f;
+
+    shared_ptr<string> content(new string());
+    content->resize(in_stat.st_size);
+
+    size_t pos = 0;
+
+    while (pos < content->length()) {
+        ssize_t r = pread(in_fd, &((*content)[pos]), content->length() - pos, pos);
+
+        // Changed under us; serve it from the file this time
+        if (r <= 0)
+            return f;
+
+        pos += r;
+    }
+
+    f->content = content;
+
+    if (in_compressible && use_compression) {
+        shared_ptr<string> gz(new string());
+
+        // Only worth sending compressed if it saves something
+        if (gzip_content(*content, *gz) && gz->length() < content->length() * 9 / 10)
+            f->gzip_content = gz;
+    }
+
+    std::lock_guard<std::mutex> lk(static_cache_mutex);
+
+    size_t len = content->length() + 
+        (f->gzip_content == NULL ? 0 : f->gzip_content->length());
+
+    // Still serve it from memory this time, but don't hold it once the cache
+    // is full
+    if (static_cache_bytes + len > static_cache_max)
+        return f;
+
+    static_cache_bytes += len;
+    static_cache[in_path] = f;
+
+    return f;
+}
+
+void Kis_Net_Httpd::PreloadStaticFiles() {
+    if (!use_static_cache || !static_preload)
+        return;
+
+    vector<static_dir> static_dirs;
+
+    {
+        local_locker lock(&controller_mutex);
+        static_dirs = static_dir_vec;
+    }
+
+    for (auto sd : static_dirs) {
+        char *base_realpath = realpath(sd.path.c_str(), NULL);
+
+        if (base_realpath == NULL)
+            continue;
+
+        string base(base_realpath);
+        free(base_realpath);
+
+        if (!PreloadStaticDir(base, 0))
+            break;
+    }
+
+    std::lock_guard<std::mutex> lk(static_cache_mutex);
+
+    _MSG("Preloaded " + UIntToString(static_cache.size()) + " static files (" +
+            UIntToString(static_cache_bytes / 1024) + "KB) into the web server "
+            "cache", MSGFLAG_INFO);
+}
+
+bool Kis_Net_Httpd::PreloadStaticDir(const string& in_path, unsigned int in_depth) {
+    // Static content doesn't nest deeply; don't follow a link loop forever
+    if (in_depth > 16)
+        return true;
+
+    DIR *dir = opendir(in_path.c_str());
+
+    if (dir == NULL)
+        return true;
+
+    struct dirent *de;
+
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] == '.')
+            continue;
+
+        string fpath = in_path + "/" + de->d_name;
+
+        int fd = open(fpath.c_str(), O_RDONLY);
+
+        if (fd < 0)
+            continue;
+
+        struct stat buf;
 
-    if (concls->httpdhandler->Httpd_UseCustomPostIterator()) {
-        return (concls->httpdhandler)->Httpd_PostIterator(coninfo_cls, kind,
-                key, filename, content_type, transfer_encoding, data, off, size);
-    } else {
-        // Cache all the variables by name until we're complete
-        if (concls->variable_cache.find(key) == concls->variable_cache.end())
-            concls->variable_cache[key] = 
-                unique_ptr<std::stringstream>(new std::stringstream);
+        if (fstat(fd, &buf) != 0) {
+            close(fd);
+            continue;
+        }
 
-        concls->variable_cache[key]->write(data, size);
+        if (S_ISDIR(buf.st_mode)) {
+            close(fd);
 
-        return MHD_YES;
-    }
-}
+            if (!PreloadStaticDir(fpath, in_depth + 1)) {
+                closedir(dir);
+                return false;
+            }
 
-void Kis_Net_Httpd::http_request_completed(void *cls __attribute__((unused)), 
-        struct MHD_Connection *connection __attribute__((unused)),
-        void **con_cls, 
-        enum MHD_RequestTerminationCode toe __attribute__((unused))) {
-    Kis_Net_Httpd_Connection *con_info = (Kis_Net_Httpd_Connection *) *con_cls;
+            continue;
+        }
 
-    if (con_info == NULL)
-        return;
+        if (!S_ISREG(buf.st_mode) || (size_t) buf.st_size > static_cache_max_file) {
+            close(fd);
+            continue;
+        }
 
-    if (con_info->connection_type == Kis_Net_Httpd_Connection::CONNECTION_POST) {
-        MHD_destroy_post_processor(con_info->postprocessor);
-        con_info->postprocessor = NULL;
-    }
+        {
+            std::lock_guard<std::mutex> lk(static_cache_mutex);
 
-    delete(con_info);
-    *con_cls = NULL;
-}
+            if (static_cache_bytes + buf.st_size > static_cache_max) {
+                close(fd);
+                closedir(dir);
+                return false;
+            }
+        }
 
-static ssize_t file_reader(void *cls, uint64_t pos, char *buf, size_t max) {
-    FILE *file = (FILE *) cls;
+        // Cached by the resolved path, as handle_static_file looks it up
+        char *file_realpath = realpath(fpath.c_str(), NULL);
 
-    fseek(file, pos, SEEK_SET);
-    return fread(buf, 1, max, file);
-}
+        if (file_realpath != NULL) {
+            FetchStaticFile(string(file_realpath), fd, buf,
+                    static_compressible(GetMimeType(GetSuffix(fpath))));
+            free(file_realpath);
+        }
+
+        close(fd);
+    }
 
+    closedir(dir);
 
-static void free_callback(void *cls) {
-    FILE *file = (FILE *) cls;
-    fclose(file);
+    return true;
 }
 
 string Kis_Net_Httpd::GetMimeType(string ext) {
@@ -662,9 +1730,14 @@ int Kis_Net_Httpd::handle_static_file(void *cls, Kis_Net_Httpd_Connection *conne
     if (surl[surl.length() - 1] == '/')
         surl += "index.html";
 
-    local_locker lock(&(kishttpd->controller_mutex));
+    vector<static_dir> static_dirs;
+
+    {
+        local_locker lock(&(kishttpd->controller_mutex));
+        static_dirs = kishttpd->static_dir_vec;
+    }
 
-    for (auto sd : kishttpd->static_dir_vec) {
+    for (auto sd : static_dirs) {
         if (strlen(url) < sd.prefix.size())
             continue;
 
@@ -701,72 +1774,105 @@ int Kis_Net_Httpd::handle_static_file(void *cls, Kis_Net_Httpd_Connection *conne
             continue;
         }
 
-        // The path is resolved, try to open the file
-        FILE *f = fopen(modified_realpath, "rb");
+        string resolved_path(modified_realpath);
 
         free(modified_realpath);
         free(base_realpath);
 
-        if (f != NULL) {
-            struct MHD_Response *response;
-            struct stat buf;
+        // The path is resolved, try to open the file
+        int fd = open(resolved_path.c_str(), O_RDONLY);
 
-            int fd;
+        if (fd < 0)
+            continue;
 
-            fd = fileno(f);
-            if (fstat(fd, &buf) != 0 || (!S_ISREG(buf.st_mode))) {
-                fclose(f);
-                return -1;
-            }
+        struct stat buf;
 
-            response = MHD_create_response_from_callback(buf.st_size, 32 * 1024,
-                    &file_reader, f, &free_callback);
+        if (fstat(fd, &buf) != 0 || (!S_ISREG(buf.st_mode))) {
+            close(fd);
+            return -1;
+        }
 
-            if (response == NULL) {
-                fclose(f);
-                return -1;
-            }
+        string suffix = GetSuffix(surl);
+        string mime = kishttpd->GetMimeType(suffix);
+        bool compressible = static_compressible(mime);
 
-            if (connection->session != NULL) {
-                std::stringstream cookiestr;
-                std::stringstream cookie;
+        shared_ptr<static_file> sf = 
+            kishttpd->FetchStaticFile(resolved_path, fd, buf, compressible);
 
-                cookiestr << KIS_SESSION_COOKIE << "=";
-                cookiestr << connection->session->sessionid;
-                cookiestr << "; Path=/";
+        struct MHD_Response *response;
+        int code = MHD_HTTP_OK;
 
-                MHD_add_response_header(response, MHD_HTTP_HEADER_SET_COOKIE, 
-                        cookiestr.str().c_str());
-            }
+        bool gzip = false, deflate = false;
 
-            char lastmod[31];
-            struct tm tmstruct;
-            localtime_r(&(buf.st_ctime), &tmstruct);
-            strftime(lastmod, 31, "%a, %d %b %Y %H:%M:%S %Z", &tmstruct);
-            MHD_add_response_header(response, "Last-Modified", lastmod);
+        if (sf->gzip_content != NULL)
+            accepted_encodings(connection->connection, &gzip, &deflate);
 
-            string suffix = GetSuffix(url);
-            string mime = kishttpd->GetMimeType(suffix);
+        if (etag_matches(MHD_lookup_connection_value(connection->connection,
+                        MHD_HEADER_KIND, "If-None-Match"), sf->etag)) {
+            // The browser already has it
+            close(fd);
+            code = MHD_HTTP_NOT_MODIFIED;
+            response = MHD_create_response_from_buffer(0, (void *) "",
+                    MHD_RESPMEM_PERSISTENT);
+        } else if (sf->content != NULL) {
+            close(fd);
 
-            if (mime != "") {
-                MHD_add_response_header(response, "Content-Type", mime.c_str());
-            }
+            shared_ptr<string> *content = 
+                new shared_ptr<string>(gzip ? sf->gzip_content : sf->content);
 
-            // Allow any?
-            MHD_add_response_header(response, "Access-Control-Allow-Origin", "*");
+            response = MHD_create_response_from_callback((*content)->length(), 
+                    32 * 1024, &static_content_reader, content, &static_content_free);
 
-            // Never let the browser cache our responses.  Maybe moderate this
-            // in the future to cache for 60 seconds or something?
-            MHD_add_response_header(response, "Cache-Control", "no-cache");
-            MHD_add_response_header(response, "Pragma", "no-cache");
-            MHD_add_response_header(response, 
-                    "Expires", "Sat, 01 Jan 2000 00:00:00 GMT");
+            if (response == NULL)
+                delete content;
+        } else {
+            // Large files go from the file descriptor, which MHD can send with
+            // sendfile; MHD closes it when the response is done
+            response = MHD_create_response_from_fd(buf.st_size, fd);
 
-            MHD_queue_response(connection->connection, MHD_HTTP_OK, response);
-            MHD_destroy_response(response);
+            if (response == NULL)
+                close(fd);
+        }
+
+        if (response == NULL)
+            return -1;
+
+        if (connection->session != NULL) {
+            std::stringstream cookiestr;
+            std::stringstream cookie;
+
+            cookiestr << KIS_SESSION_COOKIE << "=";
+            cookiestr << connection->session->sessionid;
+            cookiestr << "; Path=/";
+
+            MHD_add_response_header(response, MHD_HTTP_HEADER_SET_COOKIE, 
+                    cookiestr.str().c_str());
+        }
+
+        MHD_add_response_header(response, "Last-Modified", sf->last_modified.c_str());
+        MHD_add_response_header(response, "ETag", sf->etag.c_str());
 
-            return 1;
+        if (mime != "") {
+            MHD_add_response_header(response, "Content-Type", mime.c_str());
         }
+
+        if (sf->gzip_content != NULL)
+            MHD_add_response_header(response, "Vary", "Accept-Encoding");
+
+        if (gzip && code == MHD_HTTP_OK)
+            MHD_add_response_header(response, "Content-Encoding", "gzip");
+
+        // Allow any?
+        MHD_add_response_header(response, "Access-Control-Allow-Origin", "*");
+
+        // Browsers may keep our files but must check them with the ETag before
+        // using them, so an unchanged file costs a 304 instead of the whole file
+        MHD_add_response_header(response, "Cache-Control", "no-cache");
+
+        MHD_queue_response(connection->connection, code, response);
+        MHD_destroy_response(response);
+
+        return 1;
     }
 
     return -1;
@@ -814,6 +1920,11 @@ void Kis_Net_Httpd::AppendStandardHeaders(Kis_Net_Httpd *httpd,
         MHD_add_response_header(connection->response, "Content-Disposition", disp.c_str());
     }
 
+    // No-cache still lets the browser revalidate with the tag
+    if (connection->etag != "" && (connection->httpcode == MHD_HTTP_OK ||
+                connection->httpcode == MHD_HTTP_NOT_MODIFIED))
+        MHD_add_response_header(connection->response, "ETag", connection->etag.c_str());
+
     // Allow any?  This lets us handle webuis hosted elsewhere
     MHD_add_response_header(connection->response, 
             "Access-Control-Allow-Origin", "*");
@@ -875,6 +1986,11 @@ void Kis_Net_Httpd_Handler::Bind_Httpd_Server(GlobalRegistry *in_globalreg) {
     }
 }
 
+void Kis_Net_Httpd_Handler::Httpd_RegisterRoute(string in_method, string in_pattern) {
+    if (httpd != NULL)
+        httpd->RegisterRoute(this, in_method, in_pattern);
+}
+
 bool Kis_Net_Httpd_Handler::Httpd_CanSerialize(string path) {
     return entrytracker->CanSerialize(httpd->GetSuffix(path));
 }
@@ -901,9 +2017,36 @@ int Kis_Net_Httpd_CPPStream_Handler::Httpd_HandleGetRequest(Kis_Net_Httpd *httpd
     std::stringstream stream;
     int ret;
 
+    string cache_key;
+    uint64_t version = 0;
+    bool leader = false;
+    shared_ptr<Kis_Net_Httpd::shared_response> shared;
+
+    if (httpd->FetchUsingSharedResponses() && Httpd_CacheableResponse(url, &version)) {
+        cache_key = httpd->SharedResponseKey(connection, url);
+        shared = httpd->JoinSharedResponse(cache_key, version, leader);
+
+        if (shared != NULL && !leader) {
+            connection->response = 
+                MHD_create_response_from_buffer(shared->content->length(),
+                        (void *) shared->content->data(), MHD_RESPMEM_MUST_COPY);
+
+            return httpd->SendStandardHttpResponse(httpd, connection, url);
+        }
+    }
+
     Httpd_CreateStreamResponse(httpd, connection, url, method, upload_data,
             upload_data_size, stream);
 
+    if (leader) {
+        shared_ptr<string> content;
+
+        if (connection->response == NULL && connection->httpcode == 200)
+            content = std::make_shared<string>(stream.str());
+
+        httpd->CompleteSharedResponse(cache_key, shared, content);
+    }
+
     if (connection->response == NULL) {
         connection->response = 
             MHD_create_response_from_buffer(stream.str().length(),
@@ -922,9 +2065,36 @@ int Kis_Net_Httpd_CPPStream_Handler::Httpd_HandlePostRequest(Kis_Net_Httpd *http
         const char *url, const char *method, const char *upload_data,
         size_t *upload_data_size) {
 
+    string cache_key;
+    uint64_t version = 0;
+    bool leader = false;
+    shared_ptr<Kis_Net_Httpd::shared_response> shared;
+
+    if (httpd->FetchUsingSharedResponses() && Httpd_CacheableResponse(url, &version)) {
+        cache_key = httpd->SharedResponseKey(connection, url);
+        shared = httpd->JoinSharedResponse(cache_key, version, leader);
+
+        if (shared != NULL && !leader) {
+            connection->response = 
+                MHD_create_response_from_buffer(shared->content->length(),
+                        (void *) shared->content->data(), MHD_RESPMEM_MUST_COPY);
+
+            return httpd->SendStandardHttpResponse(httpd, connection, url);
+        }
+    }
+
     // Call the post complete and populate our stream
     Httpd_PostComplete(connection);
 
+    if (leader) {
+        shared_ptr<string> content;
+
+        if (connection->response == NULL && connection->httpcode == 200)
+            content = std::make_shared<string>(connection->response_stream.str());
+
+        httpd->CompleteSharedResponse(cache_key, shared, content);
+    }
+
     if (connection->response == NULL) {
         connection->response = 
             MHD_create_response_from_buffer(connection->response_stream.str().length(),
@@ -938,6 +2108,112 @@ int Kis_Net_Httpd_CPPStream_Handler::Httpd_HandlePostRequest(Kis_Net_Httpd *http
 }
 
 
+string Kis_Net_Httpd::SharedResponseKey(Kis_Net_Httpd_Connection *connection,
+        const char *url) {
+    std::stringstream key;
+
+    // Logged in and anonymous requests can get different answers
+    bool valid = HasValidSession(connection, false);
+
+    key << connection->connection_type << " " << (valid ? 1 : 0) << " " << url;
+
+    // Variables are kept sorted by name; lengths keep values containing the
+    // separators from colliding
+    for (auto& v : connection->variable_cache) {
+        string val = v.second->str();
+        key << " " << v.first.length() << ":" << v.first << 
+            val.length() << ":" << val;
+    }
+
+    // Commands decoded as they were posted aren't kept as text
+    if (connection->structured_post != NULL)
+        key << " " << connection->structured_post->FetchVar() << "#" <<
+            connection->structured_post->FetchDigest();
+
+    return key.str();
+}
+
+shared_ptr<Kis_Net_Httpd::shared_response> Kis_Net_Httpd::JoinSharedResponse(
+        const string& in_key, uint64_t in_version, bool& out_leader) {
+    std::unique_lock<std::mutex> lk(shared_response_mutex);
+
+    out_leader = false;
+
+    auto now = std::chrono::steady_clock::now();
+    auto ri = shared_responses.find(in_key);
+
+    if (ri != shared_responses.end()) {
+        shared_ptr<shared_response> r = ri->second;
+
+        if (!r->complete && !r->failed) {
+            // Wait for the request generating it, but not forever; a response
+            // which never finishes is generated by each request instead
+            shared_response_cv.wait_for(lk, std::chrono::seconds(10),
+                    [r]() { return r->complete || r->failed; });
+
+            if (!r->complete)
+                return NULL;
+
+            if (metric_shared != NULL)
+                metric_shared->inc();
+
+            return r;
+        }
+
+        if (r->complete && r->version == in_version && 
+                now - r->built <= shared_response_ttl) {
+            if (metric_shared != NULL)
+                metric_shared->inc();
+
+            return r;
+        }
+
+        shared_responses.erase(ri);
+    }
+
+    // Drop the other expired responses while we're here
+    for (auto i = shared_responses.begin(); i != shared_responses.end(); ) {
+        if (i->second->complete && now - i->second->built > shared_response_ttl)
+            i = shared_responses.erase(i);
+        else
+            ++i;
+    }
+
+    shared_ptr<shared_response> r = std::make_shared<shared_response>();
+    r->version = in_version;
+    shared_responses[in_key] = r;
+
+    out_leader = true;
+
+    return r;
+}
+
+void Kis_Net_Httpd::CompleteSharedResponse(const string& in_key,
+        shared_ptr<shared_response> in_response, shared_ptr<string> in_content) {
+    {
+        std::lock_guard<std::mutex> lk(shared_response_mutex);
+
+        if (in_content != NULL) {
+            in_response->content = in_content;
+            in_response->built = std::chrono::steady_clock::now();
+            in_response->complete = true;
+        } else {
+            in_response->failed = true;
+        }
+
+        // Requests waiting on it still hold it; only keep it around for later
+        // requests if it can be reused
+        if (!in_response->complete || shared_response_ttl.count() == 0) {
+            auto ri = shared_responses.find(in_key);
+
+            if (ri != shared_responses.end() && ri->second == in_response)
+                shared_responses.erase(ri);
+        }
+    }
+
+    shared_response_cv.notify_all();
+}
+
 bool Kis_Net_Httpd::HasValidSession(Kis_Net_Httpd_Connection *connection,
         bool send_invalid) {
     if (connection->session != NULL)
@@ -950,32 +2226,34 @@ bool Kis_Net_Httpd::HasValidSession(Kis_Net_Httpd_Connection *connection,
             MHD_COOKIE_KIND, KIS_SESSION_COOKIE);
 
     if (cookieval != NULL) {
-        auto si = session_map.find(cookieval);
+        s = session_table.find(cookieval, globalreg->timestamp.tv_sec);
 
-        if (si != session_map.end()) {
+        if (s != NULL) {
+            connection->session = s;
+            return true;
+        }
+    }
 
-            s = si->second;
+    // A login we've already checked gets the session it was given
+    const char *authval = MHD_lookup_connection_value(connection->connection,
+            MHD_HEADER_KIND, "Authorization");
 
-            // Does the session never expire?
-            if (s->session_lifetime == 0) {
-                connection->session = s;
-                return true;
-            }
+    if (authval != NULL) {
+        s = session_table.find_auth(authval, globalreg->timestamp.tv_sec);
 
-            // Is the session still valid?
-            if (globalreg->timestamp.tv_sec < s->session_created + s->session_lifetime) {
-                connection->session = s;
-                return true;
-            } else {
-                DelSession(si);
-                connection->session = NULL;
-            }
+        if (s != NULL) {
+            connection->session = s;
+            return true;
         }
     }
 
     // If we got here, we either don't have a session, or the session isn't valid.
     if (websession != NULL && websession->validate_login(connection->connection)) {
         CreateSession(connection, NULL, session_timeout);
+
+        if (authval != NULL && connection->session != NULL)
+            session_table.cache_auth(authval, connection->session->sessionid);
+
         return true;
     }
 
@@ -1109,6 +2387,15 @@ Kis_Net_Httpd_Buffer_Stream_Aux::Kis_Net_Httpd_Buffer_Stream_Aux(
 
     in_error = false;
 
+    mhd_connection = in_httpd_connection->connection;
+    use_suspend = in_httpd_connection->httpd->FetchUsingThreadPool();
+    suspended = false;
+    wake_pending = false;
+
+    zstream = NULL;
+    zstream_pending = false;
+    zstream_finished = false;
+
     // If the buffer encounters an error, unlock the variable and set the error state
     ringbuf_handler->SetProtocolErrorCb([this]() {
             trigger_error();
@@ -1125,6 +2412,11 @@ Kis_Net_Httpd_Buffer_Stream_Aux::~Kis_Net_Httpd_Buffer_Stream_Aux() {
         ringbuf_handler->RemoveWriteBufferInterface();
         ringbuf_handler->SetProtocolErrorCb(NULL);
     }
+
+    if (zstream != NULL) {
+        deflateEnd(zstream);
+        delete(zstream);
+    }
 }
 
 void Kis_Net_Httpd_Buffer_Stream_Aux::BufferAvailable(size_t in_amt) {
@@ -1133,6 +2425,8 @@ void Kis_Net_Httpd_Buffer_Stream_Aux::BufferAvailable(size_t in_amt) {
     // re-lock and block
     // fprintf(stderr, "debug - knmh - unlocking %lu\n", in_amt);
     cl->unlock("data");
+
+    wake_connection();
 }
 
 void Kis_Net_Httpd_Buffer_Stream_Aux::block_until_data() {
@@ -1160,6 +2454,134 @@ void Kis_Net_Httpd_Buffer_Stream_Aux::block_until_data() {
     cl->block_until();
 }
 
+bool Kis_Net_Httpd_Buffer_Stream_Aux::suspend_until_data() {
+    // Pending output lives in the write side of the buffer
+    if (get_rbhandler()->GetWriteBufferUsed())
+        return true;
+
+    if (get_in_error())
+        return true;
+
+#ifdef KIS_MHD_SUSPEND_RESUME
+    std::lock_guard<std::mutex> lk(suspend_mutex);
+
+    // Data or an error arrived after we checked; don't suspend and miss it
+    if (wake_pending) {
+        wake_pending = false;
+        return true;
+    }
+
+    suspended = true;
+    MHD_suspend_connection(mhd_connection);
+#endif
+
+    return false;
+}
+
+void Kis_Net_Httpd_Buffer_Stream_Aux::wake_connection() {
+    if (!use_suspend)
+        return;
+
+#ifdef KIS_MHD_SUSPEND_RESUME
+    std::lock_guard<std::mutex> lk(suspend_mutex);
+
+    if (suspended) {
+        suspended = false;
+        MHD_resume_connection(mhd_connection);
+    } else {
+        wake_pending = true;
+    }
+#endif
+}
+
+string Kis_Net_Httpd_Buffer_Stream_Aux::negotiate_encoding() {
+    if (!httpd_connection->httpd->FetchUsingCompression())
+        return "";
+
+    bool gzip, deflate;
+
+    accepted_encodings(mhd_connection, &gzip, &deflate);
+
+    if (!gzip && !deflate)
+        return "";
+
+    zstream = new z_stream;
+    memset(zstream, 0, sizeof(z_stream));
+
+    // 15 bits of window for zlib framing, +16 for gzip framing
+    if (deflateInit2(zstream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 
+                gzip ? 15 + 16 : 15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        delete(zstream);
+        zstream = NULL;
+        return "";
+    }
+
+    return gzip ? "gzip" : "deflate";
+}
+
+// Fill the MHD buffer with compressed data from the stream buffer; a sync flush
+// is done whenever the buffer is drained so that slow streams (like packets) are
+// not held in the compressor, and the stream is finished once the generator is 
+// done and everything has been consumed
+static ssize_t buffer_event_deflate(Kis_Net_Httpd_Buffer_Stream_Aux *stream_aux,
+        char *buf, size_t max) {
+    shared_ptr<BufferHandlerGeneric> rbh = stream_aux->get_rbhandler();
+    z_stream *zs = stream_aux->zstream;
+
+    if (stream_aux->zstream_finished)
+        return -1;
+
+    zs->next_out = (Bytef *) buf;
+    zs->avail_out = max;
+
+    while (zs->avail_out > 0) {
+        unsigned char *zbuf;
+        size_t read_sz;
+        int flush = Z_NO_FLUSH;
+
+        read_sz = rbh->ZeroCopyPeekWriteBufferData((void **) &zbuf, max);
+
+        if (read_sz == 0) {
+            if (stream_aux->get_in_error())
+                flush = Z_FINISH;
+            else
+                flush = Z_SYNC_FLUSH;
+        }
+
+        zs->next_in = (Bytef *) zbuf;
+        zs->avail_in = read_sz;
+
+        int r = deflate(zs, flush);
+
+        size_t consumed = read_sz - zs->avail_in;
+
+        rbh->PeekFreeWriteBufferData(zbuf);
+        rbh->ConsumeWriteBufferData(consumed);
+
+        if (r == Z_STREAM_END) {
+            stream_aux->zstream_finished = true;
+            break;
+        }
+
+        if (r != Z_OK && r != Z_BUF_ERROR)
+            return -1;
+
+        // Flushed everything we had, or out of room for more output
+        if (read_sz == 0 || consumed < read_sz)
+            break;
+    }
+
+    stream_aux->zstream_pending = (zs->avail_out == 0);
+
+    ssize_t produced = max - zs->avail_out;
+
+    // Count a finished stream with nothing left to send as the end
+    if (produced == 0 && stream_aux->zstream_finished)
+        return -1;
+
+    return produced;
+}
+
 Kis_Net_Httpd_Buffer_Stream_Handler::~Kis_Net_Httpd_Buffer_Stream_Handler() {
 
 }
@@ -1173,8 +2595,23 @@ ssize_t Kis_Net_Httpd_Buffer_Stream_Handler::buffer_event_cb(void *cls, uint64_t
 
     // We get called as soon as the webserver has either a) processed our request
     // or b) sent what we gave it; we need to hold the thread until we
-    // get more data in the buf, so we block until we have data
-    stream_aux->block_until_data();
+    // get more data in the buf, so we block until we have data.  Pool threads 
+    // are shared by every client so instead of blocking we suspend the connection
+    // and get called again once it is resumed.
+    // 
+    // A compressor which filled the last output may still be holding data, so
+    // drain it before waiting for more.
+    if (stream_aux->zstream_pending) {
+        // Go straight to the compressor
+    } else if (stream_aux->use_suspend) {
+        if (!stream_aux->suspend_until_data())
+            return 0;
+    } else {
+        stream_aux->block_until_data();
+    }
+
+    if (stream_aux->zstream != NULL)
+        return buffer_event_deflate(stream_aux, buf, max);
 
     // Read from the buffer; currently we have to force a copy into our existing
     // buffer unfortunately
@@ -1203,6 +2640,18 @@ ssize_t Kis_Net_Httpd_Buffer_Stream_Handler::buffer_event_cb(void *cls, uint64_t
     return (ssize_t) read_sz;
 }
 
+void Kis_Net_Httpd_Buffer_Stream_Handler::AppendContentEncoding(
+        Kis_Net_Httpd_Connection *connection, const string& in_encoding) {
+    if (connection->response == NULL)
+        return;
+
+    if (in_encoding != "")
+        MHD_add_response_header(connection->response, "Content-Encoding", 
+                in_encoding.c_str());
+
+    MHD_add_response_header(connection->response, "Vary", "Accept-Encoding");
+}
+
 static void free_buffer_aux_callback(void *cls) {
     Kis_Net_Httpd_Buffer_Stream_Aux *aux = (Kis_Net_Httpd_Buffer_Stream_Aux *) cls;
 
@@ -1220,32 +2669,127 @@ static void free_buffer_aux_callback(void *cls) {
     delete(aux);
 }
 
+struct MHD_Response *Kis_Net_Httpd_Buffer_Stream_Handler::CreateZeroCopyResponse(
+        Kis_Net_Httpd *httpd __attribute__((unused)),
+        Kis_Net_Httpd_Buffer_Stream_Aux *aux __attribute__((unused))) {
+#ifdef KIS_MHD_IOVEC
+    std::vector<std::pair<unsigned char *, size_t> > segments;
+
+    if (!aux->get_rbhandler()->ZeroCopySegmentsWriteBufferData(&segments))
+        return NULL;
+
+    std::vector<struct MHD_IoVec> iov(segments.size());
+
+    for (size_t s = 0; s < segments.size(); s++) {
+        iov[s].iov_base = segments[s].first;
+        iov[s].iov_len = segments[s].second;
+    }
+
+    // The buffer, and every chunk the segments point into, belong to the aux
+    // and go back to the pool when MHD frees the response once it's sent
+    return MHD_create_response_from_iovec(iov.data(), iov.size(),
+            &free_buffer_aux_callback, aux);
+#else
+    return NULL;
+#endif
+}
+
+int Kis_Net_Httpd_Buffer_Stream_Handler::Httpd_GenerateShared(Kis_Net_Httpd *httpd,
+        Kis_Net_Httpd_Connection *connection, Kis_Net_Httpd_Buffer_Stream_Aux *aux,
+        const string& in_cache_key, uint64_t in_version,
+        function<int ()> in_generator) {
+
+    if (in_cache_key.length() == 0)
+        return in_generator();
+
+    bool leader;
+    shared_ptr<Kis_Net_Httpd::shared_response> shared =
+        httpd->JoinSharedResponse(in_cache_key, in_version, leader);
+
+    if (shared == NULL)
+        return in_generator();
+
+    shared_ptr<BufferHandlerCapture> capture =
+        static_pointer_cast<BufferHandlerCapture>(aux->get_rbhandler());
+
+    if (!leader) {
+        capture->PutWriteBufferData((void *) shared->content->data(), 
+                shared->content->length(), false);
+        return MHD_YES;
+    }
+
+    capture->start_capture(httpd->FetchSharedResponseMax());
+
+    int r = in_generator();
+
+    shared_ptr<string> content;
+
+    // Streams left open past the generator aren't complete responses
+    if (r == MHD_YES && connection->httpcode == 200) {
+        aux->sync();
+        content = capture->get_capture();
+    }
+
+    httpd->CompleteSharedResponse(in_cache_key, shared, content);
+
+    return r;
+}
+
 int Kis_Net_Httpd_Buffer_Stream_Handler::Httpd_HandleGetRequest(Kis_Net_Httpd *httpd, 
         Kis_Net_Httpd_Connection *connection,
         const char *url, const char *method, const char *upload_data,
         size_t *upload_data_size) {
 
     if (connection->response == NULL) {
-        shared_ptr<BufferHandlerGeneric> rbh(allocate_buffer());
+        string cache_key;
+        uint64_t version = 0;
+        shared_ptr<BufferHandlerGeneric> rbh;
+
+        // Shareable responses are captured as they're written, so they need
+        // the capturing buffer instead of the one they'd get
+        if (httpd->FetchUsingSharedResponses() && Httpd_CacheableResponse(url, &version)) {
+            cache_key = httpd->SharedResponseKey(connection, url);
+            rbh = allocate_capture_buffer(url);
+        } else {
+            rbh = allocate_buffer(url);
+        }
 
         Kis_Net_Httpd_Buffer_Stream_Aux *aux = 
             new Kis_Net_Httpd_Buffer_Stream_Aux(this, connection, rbh, NULL, NULL);
         connection->custom_extension = aux;
 
+        string encoding = aux->negotiate_encoding();
+
         // Establish a locker to make sure the thread is fully operational
         shared_ptr<conditional_locker<int> > cl(new conditional_locker<int>());
         cl->lock();
 
+        // An uncompressed response which can be sent from its buffer is waited for
+        // until it is finished; a thread per connection is free to wait
+        shared_ptr<conditional_locker<int> > done;
+
+        if (encoding == "" && cache_key.length() == 0 && 
+                httpd->FetchUsingZeroCopy() && Httpd_ZeroCopy(url)) {
+            done.reset(new conditional_locker<int>());
+            done->lock();
+        }
+
         // Run it in its own thread and set up the connection streaming object; we MUST pass
         // the aux as a direct pointer because the microhttpd backend can delete the 
         // connection BEFORE calling our cleanup on our response!
         aux->generator_thread =
-            std::thread([this, cl, aux, httpd, connection, url, method, upload_data, upload_data_size]{
+            std::thread([this, cl, done, aux, httpd, connection, url, method, upload_data, 
+                    upload_data_size, cache_key, version]{
+                Kis_Net_Httpd::SetCurrentRequestClass(connection->request_class);
                 cl->unlock(1);
 
                 int r = 
-                    Httpd_CreateStreamResponse(httpd, connection, url, method, upload_data,
-                        upload_data_size);
+                    Httpd_GenerateShared(httpd, connection, aux, cache_key, version,
+                            [this, httpd, connection, url, method, upload_data, 
+                            upload_data_size]() -> int {
+                                return Httpd_CreateStreamResponse(httpd, connection, 
+                                        url, method, upload_data, upload_data_size);
+                            });
 
                 // Trigger 'error' when the function is complete, causing us to finish 
                 // the stream
@@ -1253,14 +2797,26 @@ int Kis_Net_Httpd_Buffer_Stream_Handler::Httpd_HandleGetRequest(Kis_Net_Httpd *h
                     aux->sync();
                     aux->trigger_error();
                 }
+
+                if (done != NULL)
+                    done->unlock(r);
                 });
         // aux->generator_thread.detach();
 
         // Block until the populating thread has launched
         cl->block_until();
-        connection->response = 
-            MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, 32 * 1024,
-                    &buffer_event_cb, aux, &free_buffer_aux_callback);
+
+        // A generator which returns MHD_NO keeps writing to the stream after it
+        // returns, so it's streamed as usual
+        if (done != NULL && done->block_until() == MHD_YES)
+            connection->response = CreateZeroCopyResponse(httpd, aux);
+
+        if (connection->response == NULL)
+            connection->response = 
+                MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, 32 * 1024,
+                        &buffer_event_cb, aux, &free_buffer_aux_callback);
+
+        AppendContentEncoding(connection, encoding);
 
         return httpd->SendStandardHttpResponse(httpd, connection, url);
     }
@@ -1278,22 +2834,38 @@ int Kis_Net_Httpd_Buffer_Stream_Handler::Httpd_HandlePostRequest(Kis_Net_Httpd *
         shared_ptr<conditional_locker<int> > cl(new conditional_locker<int>());
         cl->lock();
 
-        // No read, default write
-        shared_ptr<BufferHandlerGeneric> rbh(allocate_buffer());
+        string cache_key;
+        uint64_t version = 0;
+        shared_ptr<BufferHandlerGeneric> rbh;
+
+        // No read, default write; shareable responses are captured as they're
+        // written
+        if (httpd->FetchUsingSharedResponses() && Httpd_CacheableResponse(url, &version)) {
+            cache_key = httpd->SharedResponseKey(connection, url);
+            rbh = allocate_capture_buffer(url);
+        } else {
+            rbh = allocate_buffer(url);
+        }
 
         Kis_Net_Httpd_Buffer_Stream_Aux *aux = 
             new Kis_Net_Httpd_Buffer_Stream_Aux(this, connection, rbh, NULL, NULL);
 
         connection->custom_extension = aux;
 
+        string encoding = aux->negotiate_encoding();
+
         // Call the post complete and populate our stream;
         // Run it in its own thread and set up the connection streaming object; we MUST pass
         // the aux as a direct pointer because the microhttpd backend can delete the 
         // connection BEFORE calling our cleanup on our response!
         aux->generator_thread =
-            std::thread([this, cl, aux, connection] {
-                int r = Httpd_PostComplete(connection);
-                cl->unlock(1);
+            std::thread([this, cl, aux, httpd, connection, cache_key, version] {
+                Kis_Net_Httpd::SetCurrentRequestClass(connection->request_class);
+
+                int r = Httpd_GenerateShared(httpd, connection, aux, cache_key, version,
+                        [this, connection]() -> int {
+                            return Httpd_PostComplete(connection);
+                        });
 
                 // Trigger 'error' when the function is complete, causing us to finish 
                 // the stream
@@ -1301,14 +2873,25 @@ int Kis_Net_Httpd_Buffer_Stream_Handler::Httpd_HandlePostRequest(Kis_Net_Httpd *
                     aux->sync();
                     aux->trigger_error();
                 }
+
+                cl->unlock(r);
                 });
         // aux->generator_thread.detach();
 
-        cl->block_until();
+        // The post is always complete by the time we have a response, so an
+        // uncompressed one can go straight from the buffer
+        int r = cl->block_until();
 
-        connection->response = 
-            MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, 32 * 1024,
-                    &buffer_event_cb, aux, &free_buffer_aux_callback);
+        if (r == MHD_YES && encoding == "" && cache_key.length() == 0 &&
+                httpd->FetchUsingZeroCopy() && Httpd_ZeroCopy(url))
+            connection->response = CreateZeroCopyResponse(httpd, aux);
+
+        if (connection->response == NULL)
+            connection->response = 
+                MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, 32 * 1024,
+                        &buffer_event_cb, aux, &free_buffer_aux_callback);
+
+        AppendContentEncoding(connection, encoding);
 
         return httpd->SendStandardHttpResponse(httpd, connection, url);
     }
@@ -25,13 +25,21 @@
 #include <time.h>
 #include <list>
 #include <map>
+#include <unordered_map>
 #include <vector>
 #include <algorithm>
 #include <string>
 #include <sstream>
 #include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #include <microhttpd.h>
+#include <zlib.h>
 #include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <atomic>
 
 #include "globalregistry.h"
 #include "trackedelement.h"
@@ -42,9 +50,13 @@
 class Kis_Net_Httpd;
 class Kis_Net_Httpd_Session;
 class Kis_Net_Httpd_Connection;
+class Kis_Net_Httpd_Buffer_Stream_Aux;
 
 class EntryTracker;
 
+class kis_metric_counter;
+class kis_metric_histogram;
+
 // Basic request handler from MHD
 class Kis_Net_Httpd_Handler {
 public:
@@ -79,6 +91,32 @@ public:
     virtual string Httpd_GetSuffix(string path);
     virtual string Httpd_StripSuffix(string path);
 
+    // Declare a path this handler serves; see Kis_Net_Httpd_Route_Trie.  A
+    // handler which declares any routes is only asked to verify paths matching
+    // one of them, instead of every request
+    void Httpd_RegisterRoute(string in_method, string in_pattern);
+
+    // Can the response to this request be shared?  Identical requests (same
+    // method, path, POST variables, and login) arriving while it is generated
+    // get a copy of it instead of generating their own, and with
+    // httpd_response_cache_ms set, so do those arriving within that long after.
+    // A cached response is only reused while the handler reports the same
+    // version, so handlers can tie it to their data changing.
+    virtual bool Httpd_CacheableResponse(const char *url __attribute__((unused)),
+            uint64_t *version __attribute__((unused))) {
+        return false;
+    }
+
+    // Version of the resource a GET would return, for its ETag.  A request with
+    // a matching If-None-Match gets a 304 without the handler being called, so
+    // this must be cheap and must not take locks held while serializing; it is
+    // read before the response is generated, so a change made while generating
+    // only costs the client another fetch.
+    virtual bool Httpd_ETag(const char *url __attribute__((unused)),
+            uint64_t *etag __attribute__((unused))) {
+        return false;
+    }
+
 
     // By default, the Kismet HTTPD implementation will cache all POST variables
     // in the variable_cache map in the connection record, and call
@@ -90,6 +128,14 @@ public:
         return false;
     }
 
+    // Decode the structured command variables (json and msgpack) as they are
+    // posted, instead of caching their text; the handler fetches the command
+    // with Kis_Net_Httpd_Connection::FetchStructuredPost, which works either
+    // way.  See kis_httpd_post.h
+    virtual bool Httpd_StreamStructuredPost() {
+        return false;
+    }
+
     // Called when a POST event is complete - all data has been uploaded and
     // cached in the connection info.
     virtual int Httpd_PostComplete(Kis_Net_Httpd_Connection *con __attribute__((unused))) {
@@ -240,8 +286,40 @@ public:
         k_n_h_r_ringbuf_size = in_sz;
     }
 
+    // Can the response to this URL be finished before it is sent, and then sent
+    // straight from the buffer it was written to?  Only for buffers which can
+    // give out references to their memory, and responses of a bounded size.
+    virtual bool Httpd_ZeroCopy(const char *url __attribute__((unused))) {
+        return false;
+    }
+
 protected:
-    virtual shared_ptr<BufferHandlerGeneric> allocate_buffer() = 0;
+    // Add the encoding headers for the encoding negotiated for the stream to
+    // the response
+    void AppendContentEncoding(Kis_Net_Httpd_Connection *connection,
+            const string& in_encoding);
+
+    // Build the response from the finished contents of the stream buffer,
+    // or return NULL to stream it instead
+    struct MHD_Response *CreateZeroCopyResponse(Kis_Net_Httpd *httpd,
+            Kis_Net_Httpd_Buffer_Stream_Aux *aux);
+
+    // Run a stream generator, or copy the response of an identical request into
+    // the stream when the response is shared; returns the result of the
+    // generator, or MHD_YES for a copied response
+    int Httpd_GenerateShared(Kis_Net_Httpd *httpd,
+            Kis_Net_Httpd_Connection *connection, Kis_Net_Httpd_Buffer_Stream_Aux *aux,
+            const string& in_cache_key, uint64_t in_version,
+            function<int ()> in_generator);
+
+    virtual shared_ptr<BufferHandlerGeneric> allocate_buffer(const char *url) = 0;
+
+    // Buffer for a response which may be shared, which keeps a copy of what's
+    // written to it
+    virtual shared_ptr<BufferHandlerCapture> allocate_capture_buffer(
+            const char *url __attribute__((unused))) {
+        return std::make_shared<BufferHandlerCapture>(new Chainbuf(64 * 1024, 512));
+    }
 
     size_t k_n_h_r_ringbuf_size;
 };
@@ -255,7 +333,7 @@ public:
         Kis_Net_Httpd_Buffer_Stream_Handler(in_globalreg) { }
 
 protected:
-    virtual shared_ptr<BufferHandlerGeneric> allocate_buffer() {
+    virtual shared_ptr<BufferHandlerGeneric> allocate_buffer(const char *url) {
         return static_pointer_cast<BufferHandlerGeneric>(shared_ptr<BufferHandler<RingbufV2> >(new BufferHandler<RingbufV2>(0, k_n_h_r_ringbuf_size)));
     }
 };
@@ -267,11 +345,28 @@ public:
     Kis_Net_Httpd_Chain_Stream_Handler(GlobalRegistry *in_globalreg) :
         Kis_Net_Httpd_Buffer_Stream_Handler(in_globalreg) { }
 
+    // Chunk size for the response to a URL; bulk exports which stream out many
+    // MB can return a larger size so they allocate fewer chunks
+    virtual size_t Httpd_Chain_Chunk_Size(const char *url __attribute__((unused))) {
+        return 64 * 1024;
+    }
+
+    // Chain responses are finished by their generator, and the chunks are
+    // sent in place
+    virtual bool Httpd_ZeroCopy(const char *url __attribute__((unused))) {
+        return true;
+    }
+
 protected:
-    virtual shared_ptr<BufferHandlerGeneric> allocate_buffer() {
+    virtual shared_ptr<BufferHandlerGeneric> allocate_buffer(const char *url) {
         // Allocate a buffer directly, in a multiple of the max output size for the webserver
         // buffer
-        return static_pointer_cast<BufferHandlerGeneric>(shared_ptr<BufferHandler<Chainbuf> >(new BufferHandler<Chainbuf>(NULL, new Chainbuf(64 * 1024, 512))));
+        return static_pointer_cast<BufferHandlerGeneric>(shared_ptr<BufferHandler<Chainbuf> >(new BufferHandler<Chainbuf>(NULL, new Chainbuf(Httpd_Chain_Chunk_Size(url), 512))));
+    }
+
+    virtual shared_ptr<BufferHandlerCapture> allocate_capture_buffer(const char *url) {
+        return std::make_shared<BufferHandlerCapture>(
+                new Chainbuf(Httpd_Chain_Chunk_Size(url), 512));
     }
 
 };
@@ -297,10 +392,14 @@ public:
     }
 
     void trigger_error() {
-        local_locker lock(&aux_mutex);
+        {
+            local_locker lock(&aux_mutex);
 
-        in_error = true;
-        cl->unlock("triggered");
+            in_error = true;
+            cl->unlock("triggered");
+        }
+
+        wake_connection();
     }
 
     void set_aux(void *in_aux, 
@@ -334,6 +433,21 @@ public:
     // session)
     void block_until_data();
 
+    // Thread pool equivalent of block_until_data; returns true if there is data
+    // or an error to process, otherwise suspends the connection so the pool thread
+    // can service other clients and returns false.  The connection is resumed
+    // when data arrives or the stream is finished.
+    bool suspend_until_data();
+
+    // Resume a suspended connection, or remember that data arrived so that the
+    // next suspend_until_data does not sleep through it
+    void wake_connection();
+
+    // Pick a content encoding from the Accept-Encoding of the request and start
+    // the compressor; returns the Content-Encoding to send, or an empty string
+    // if the response goes out uncompressed
+    string negotiate_encoding();
+
 public:
     std::recursive_timed_mutex aux_mutex;
 
@@ -352,6 +466,25 @@ public:
     // Are we in error?
     bool in_error;
 
+    // Raw MHD connection, kept so the connection can be resumed from the generator
+    // thread after the httpd connection record has gone away
+    struct MHD_Connection *mhd_connection;
+
+    // Suspend state for thread pool mode; suspend_mutex is only held around the
+    // suspend and resume calls, never while taking another lock
+    std::mutex suspend_mutex;
+    bool use_suspend;
+    bool suspended;
+    bool wake_pending;
+
+    // Incremental compressor, if the client accepted one; output is produced as
+    // the buffer is drained so compressed chunks go out while the response is 
+    // still being generated.  zstream_pending is set when the last call filled
+    // the output and the compressor may still hold data.
+    z_stream *zstream;
+    bool zstream_pending;
+    bool zstream_finished;
+
     // Possible worker thread for processing the buffer fill
     std::thread generator_thread;
 
@@ -372,6 +505,9 @@ public:
 #define KIS_SESSION_COOKIE      "KISMET"
 #define KIS_HTTPD_POSTBUFFERSZ  (1024 * 32)
 
+class Kis_Httpd_Structured_Post;
+class StructuredData;
+
 // Connection data, generated for all requests by the processing system;
 // contains per-handler states, request information, request type, session
 // data if known, POST variables if the standard POST processing is enabled
@@ -391,14 +527,35 @@ public:
         connection = NULL;
         response = NULL;
         custom_extension = NULL;
+        start_time = std::chrono::steady_clock::now();
+        request_class = 0;
+        class_admitted = false;
+        post_size = 0;
+        post_too_large = false;
     }
 
+    // The structured command of a POST, decoded as it was posted or from the
+    // cached json or msgpack variable; throws StructuredDataException if
+    // there isn't one or it can't be parsed
+    shared_ptr<StructuredData> FetchStructuredPost();
+
+    // ETag of the response, if the handler versions it
+    string etag;
+
     // response generated by post
     std::stringstream response_stream;
 
     // Cache of variables in session
     map<string, std::unique_ptr<std::stringstream> > variable_cache;
 
+    // Structured command being decoded as it is posted
+    shared_ptr<Kis_Httpd_Structured_Post> structured_post;
+
+    // Bytes of POST variables so far; once over the limit of the server the
+    // rest of the post is dropped and the request is refused
+    size_t post_size;
+    bool post_too_large;
+
     // Optional alternate filename to pass to the browser for downloading
     string optional_filename;
 
@@ -408,6 +565,9 @@ public:
     // URL
     string url;
 
+    // Path parameters captured by the route which matched, if any
+    map<string, string> url_params;
+
     // Post processor struct
     struct MHD_PostProcessor *postprocessor;
 
@@ -434,6 +594,81 @@ public:
 
     // Custom arbitrary value inserted by other processors
     void *custom_extension;
+
+    // When the request arrived, for the request latency metrics
+    std::chrono::steady_clock::time_point start_time;
+
+    // Request class of the URL, and whether the request holds a place in the
+    // concurrency limit of its class
+    int request_class;
+    bool class_admitted;
+};
+
+// Prefix trie of the paths declared by handlers, so a request is matched in
+// one walk of its path instead of asking every handler in turn.
+//
+// Patterns are split on '/'.  A segment is matched literally, or by ':name'
+// which matches any one segment and captures it as a parameter; a final '*'
+// matches the rest of the path, which is captured as '*'.  A literal can
+// match the last segment of a path without its suffix, so '/gps/location'
+// matches '/gps/location.json'.
+//
+// Literal segments are preferred over parameters, and longer matches over
+// '*', so the most specific route comes first.  Not thread safe; the httpd
+// protects it with the controller lock.
+class Kis_Net_Httpd_Route_Trie {
+public:
+    struct route_match {
+        Kis_Net_Httpd_Handler *handler;
+        map<string, string> params;
+    };
+
+    void insert(const string& in_method, const string& in_pattern,
+            Kis_Net_Httpd_Handler *in_handler);
+
+    // Remove every route of a handler
+    void remove(Kis_Net_Httpd_Handler *in_handler);
+
+    // Every route matching a path and method, most specific first
+    void find(const char *in_path, const char *in_method, vector<route_match>& out_matches);
+
+protected:
+    struct route {
+        string method;
+        Kis_Net_Httpd_Handler *handler;
+        vector<string> param_names;
+    };
+
+    struct node {
+        // Sorted by segment, so a path segment can be looked up as a view
+        // without copying it
+        vector<std::pair<string, std::unique_ptr<node> > > literals;
+        std::unique_ptr<node> param;
+
+        // Routes ending at this node, and routes ending in '*' here
+        vector<route> routes;
+        vector<route> rest_routes;
+
+        node *find_literal(const kis_strview& in_seg);
+        node *insert_literal(const string& in_seg);
+
+        static bool literal_less(const std::pair<string, std::unique_ptr<node> >& in_lit,
+                const kis_strview& in_seg);
+    };
+
+    // Paths are matched as views of the URL; nothing is copied until a
+    // route matches
+    void find_node(node *in_node, const kis_strview_vec& in_segs, size_t in_pos,
+            kis_strview_vec& in_captured, const char *in_method,
+            vector<route_match>& out_matches);
+
+    void add_match(const route& in_route, const kis_strview_vec& in_captured,
+            const kis_strview_vec& in_segs, size_t in_rest_pos, bool in_rest,
+            vector<route_match>& out_matches);
+
+    static void remove_node(node *in_node, Kis_Net_Httpd_Handler *in_handler);
+
+    node root;
 };
 
 class Kis_Net_Httpd_Session {
@@ -451,6 +686,76 @@ public:
     time_t session_lifetime;
 };
 
+// Sessions are spread over this many independently locked stripes
+#define KIS_SESSION_STRIPES     16
+
+// Expiring sessions are filed in a wheel of slots, each covering this many
+// seconds; the wheel is swept every slot
+#define KIS_SESSION_WHEEL_SLOTS 64
+#define KIS_SESSION_WHEEL_TICK  30
+
+// Session table
+//
+// Sessions are looked up on every request, so the table is a hash table split
+// into stripes, each with its own lock, instead of one map under the httpd
+// controller lock.  Expiring sessions are also filed in a timer wheel by the
+// time they expire; expire() only looks at the slots which have come due
+// since it last ran, instead of every session.
+//
+// Logins which have already been checked are remembered against the session
+// they created, so clients sending basic auth on every request instead of the
+// session cookie reuse one session instead of validating and creating a new
+// session each time.
+class Kis_Net_Httpd_Session_Table {
+public:
+    Kis_Net_Httpd_Session_Table();
+
+    void insert(shared_ptr<Kis_Net_Httpd_Session> in_session);
+
+    // A session which is still valid at in_now, and mark it as seen; NULL if
+    // there is no such session or it has expired
+    shared_ptr<Kis_Net_Httpd_Session> find(const string& in_id, time_t in_now);
+
+    bool erase(const string& in_id);
+
+    // Remove sessions which have expired by in_now; returns how many were
+    // removed
+    size_t expire(time_t in_now);
+
+    // Copy of every session, for saving
+    vector<Kis_Net_Httpd_Session> snapshot();
+
+    void clear();
+
+    // Remember the session a validated Authorization header was given
+    void cache_auth(const string& in_auth, const string& in_id);
+
+    // Session for an Authorization header which has already been validated
+    shared_ptr<Kis_Net_Httpd_Session> find_auth(const string& in_auth, time_t in_now);
+
+protected:
+    struct stripe {
+        std::mutex mutex;
+        std::unordered_map<string, shared_ptr<Kis_Net_Httpd_Session> > sessions;
+    };
+
+    stripe& stripe_for(const string& in_id) {
+        return stripes[std::hash<string>()(in_id) % KIS_SESSION_STRIPES];
+    }
+
+    static bool expired(shared_ptr<Kis_Net_Httpd_Session> in_session, time_t in_now);
+
+    stripe stripes[KIS_SESSION_STRIPES];
+
+    // Expiry time and session id, in the slot of the tick they expire in
+    std::mutex wheel_mutex;
+    vector<std::pair<time_t, string> > wheel[KIS_SESSION_WHEEL_SLOTS];
+    time_t last_tick;
+
+    std::mutex auth_mutex;
+    std::unordered_map<string, string> auth_sessions;
+};
+
 class Kis_Httpd_Websession;
 
 class Kis_Net_Httpd : public LifetimeGlobal {
@@ -476,11 +781,30 @@ public:
     unsigned int FetchPort() { return http_port; };
     bool FetchUsingSSL() { return use_ssl; };
 
+    // Are we serving from a fixed thread pool?  Streaming responses must suspend
+    // instead of blocking when they run out of data
+    bool FetchUsingThreadPool() { return thread_pool_size > 0; };
+
+    // Are streamed responses compressed when the client supports it?
+    bool FetchUsingCompression() { return use_compression; };
+
+    // Are finished responses handed to libmicrohttpd by reference instead of
+    // being copied out of their buffer as they're sent?
+    bool FetchUsingZeroCopy() { return use_zero_copy; };
+
+    // Largest total of POST variables accepted, 0 for no limit
+    size_t FetchPostMax() { return post_max; };
+
     void RegisterSessionHandler(shared_ptr<Kis_Httpd_Websession> in_session);
 
     void RegisterHandler(Kis_Net_Httpd_Handler *in_handler);
     void RemoveHandler(Kis_Net_Httpd_Handler *in_handler);
 
+    // Route a path pattern to a handler; the handler is then only consulted
+    // for paths matching its routes
+    void RegisterRoute(Kis_Net_Httpd_Handler *in_handler, string in_method,
+            string in_pattern);
+
     static string GetSuffix(string url);
     static string StripSuffix(string url);
 
@@ -490,6 +814,11 @@ public:
     // Register a static files directory (used for system, home, and plugin data)
     void RegisterStaticDir(string in_url_prefix, string in_path);
 
+    // Load the files of the static directories registered so far into the
+    // static file cache ahead of the first requests for them, until it is full;
+    // safe to call from a thread of its own
+    void PreloadStaticFiles();
+
     // Interrogate the session handler and figure out if this connection has a
     // valid session; optionally sends basic auth failure automatically
     bool HasValidSession(Kis_Net_Httpd_Connection *connection, bool send_reject = true);
@@ -516,6 +845,60 @@ public:
     static int SendStandardHttpResponse(Kis_Net_Httpd *httpd,
             Kis_Net_Httpd_Connection *connection, const char *url);
 
+    // Response shared between identical requests; see
+    // Kis_Net_Httpd_Handler::Httpd_CacheableResponse
+    class shared_response {
+    public:
+        shared_response() : complete(false), failed(false), version(0) { }
+
+        bool complete, failed;
+        uint64_t version;
+        std::chrono::steady_clock::time_point built;
+        shared_ptr<string> content;
+    };
+
+    bool FetchUsingSharedResponses() { return use_shared_responses; }
+
+    // Largest response which is shared
+    size_t FetchSharedResponseMax() { return shared_response_max; }
+
+    // Key of a request: method, path, POST variables, and whether it is logged in
+    string SharedResponseKey(Kis_Net_Httpd_Connection *connection, const char *url);
+
+    // Join the response to a request.  If out_leader is set, the caller generates
+    // the response and must finish it with CompleteSharedResponse.  Otherwise
+    // the caller gets the finished response, waiting for it if it's still being
+    // generated, or NULL if it should generate its own.
+    shared_ptr<shared_response> JoinSharedResponse(const string& in_key,
+            uint64_t in_version, bool& out_leader);
+
+    // Finish a response we lead; a NULL content fails it, and anyone waiting
+    // on it generates their own
+    void CompleteSharedResponse(const string& in_key, 
+            shared_ptr<shared_response> in_response, shared_ptr<string> in_content);
+
+    // Requests are classed by path prefix as interactive, bulk (full dumps of
+    // the device list and the like), or streaming (pcap and event streams), and
+    // each class has its own limit of requests at once, so a few heavy clients
+    // can't take every worker from the status and alert requests of a dashboard
+    enum request_class {
+        request_interactive = 0,
+        request_bulk = 1,
+        request_streaming = 2
+    };
+
+    int ClassifyRequest(const string& in_url);
+
+    // Class of the request this thread is handling, for serializers deciding
+    // how long to hold their locks; generator threads of stream handlers take
+    // the class of their request.  Interactive outside of a request.
+    static int CurrentRequestClass();
+    static void SetCurrentRequestClass(int in_class);
+
+    // Longest a bulk request should hold a shared lock at a time, in
+    // microseconds
+    uint64_t FetchBulkSliceUsec() { return bulk_slice_usec; }
+
     // Catch MHD panics and try to close more elegantly
     static void MHD_Panic(void *cls, const char *file, unsigned int line,
             const char *reason);
@@ -530,14 +913,42 @@ protected:
     struct MHD_Daemon *microhttpd;
     std::vector<Kis_Net_Httpd_Handler *> handler_vec;
 
+    // Handlers which declared routes are kept here instead of being asked
+    // about every request
+    Kis_Net_Httpd_Route_Trie route_trie;
+
     string conf_username, conf_password;
 
     bool use_ssl;
     char *cert_pem, *cert_key;
     string pem_path, key_path;
 
+    // Number of pool threads (0 for a thread per connection), maximum concurrent
+    // connections, and idle keep-alive timeout in seconds; 0 uses the MHD default
+    unsigned int thread_pool_size;
+    unsigned int connection_limit;
+    unsigned int connection_timeout;
+
+    bool use_compression;
+    bool use_zero_copy;
+
+    size_t post_max;
+
     bool running;
 
+    // Path prefixes of the bulk and streaming classes, where a '*' segment
+    // matches any one segment, and the class limits; a limit of 0 is unlimited
+    vector<pair<string, int> > class_prefixes;
+    unsigned int class_limit[3];
+    std::atomic<unsigned int> class_active[3];
+    uint64_t bulk_slice_usec;
+
+    shared_ptr<kis_metric_counter> metric_class_rejected[3];
+
+    // Take a place in the limit of the request's class; false if the class is
+    // full and the request was answered with a 503
+    bool AdmitRequestClass(Kis_Net_Httpd_Connection *connection, int *ret);
+
     std::map<string, string> mime_type_map;
 
     class static_dir {
@@ -553,8 +964,67 @@ protected:
 
     vector<static_dir> static_dir_vec;
 
+    // A static file as last served.  Files up to static_cache_max_file bytes
+    // are held in memory, along with a gzipped copy when compressing them
+    // helps; larger files are sent straight from the file descriptor.  Entries
+    // are checked against the file on every request and reloaded when it
+    // changes
+    struct static_file {
+        dev_t dev;
+        ino_t ino;
+        off_t size;
+        time_t mtime;
+
+        string etag;
+        string last_modified;
+
+        shared_ptr<string> content;
+        shared_ptr<string> gzip_content;
+    };
+
+    // Static file cache, by resolved path
+    std::mutex static_cache_mutex;
+    std::map<string, shared_ptr<static_file> > static_cache;
+    size_t static_cache_bytes;
+
+    bool use_static_cache, static_preload;
+    size_t static_cache_max_file, static_cache_max;
+
+    // Cached record of a static file, loading or refreshing it as needed
+    shared_ptr<static_file> FetchStaticFile(const string& in_path, int in_fd,
+            const struct stat& in_stat, bool in_compressible);
+
+    // Preload a static directory and those under it; returns false once the
+    // cache is full
+    bool PreloadStaticDir(const string& in_path, unsigned int in_depth);
+
+    // Responses being generated, or kept for reuse, by request key
+    bool use_shared_responses;
+    std::chrono::milliseconds shared_response_ttl;
+    size_t shared_response_max;
+    std::mutex shared_response_mutex;
+    std::condition_variable shared_response_cv;
+    std::map<string, shared_ptr<shared_response> > shared_responses;
+
     pthread_mutex_t controller_mutex;
 
+    // Requests completed and aborted, and time from arrival to completion,
+    // for /metrics
+    shared_ptr<kis_metric_counter> metric_requests;
+    shared_ptr<kis_metric_counter> metric_aborted;
+    shared_ptr<kis_metric_histogram> metric_latency;
+    shared_ptr<kis_metric_counter> metric_shared;
+    shared_ptr<kis_metric_counter> metric_not_modified;
+
+    // Prefix of the ETags of handler responses, so versions counted by a
+    // previous run never match
+    uint64_t etag_epoch;
+
+    // Answer a GET with a 304 if the handler versions it and the client has
+    // that version; returns false if the request still has to be handled
+    bool HandleConditionalGet(Kis_Net_Httpd_Handler *handler,
+            Kis_Net_Httpd_Connection *connection, const char *url, int *ret);
+
     // Handle the requests and dispatch to controllers
     static int http_request_handler(void *cls, struct MHD_Connection *connection,
             const char *url, const char *method, const char *version,
@@ -575,10 +1045,13 @@ protected:
 
     void AddSession(shared_ptr<Kis_Net_Httpd_Session> in_session);
     void DelSession(string in_key);
-    void DelSession(map<string, shared_ptr<Kis_Net_Httpd_Session> >::iterator in_itr);
     void WriteSessions();
 
-    map<string, shared_ptr<Kis_Net_Httpd_Session> > session_map;
+    // Drop expired sessions, run from the session timer
+    void ExpireSessions();
+
+    Kis_Net_Httpd_Session_Table session_table;
+    int session_timer_id;
 
     bool store_sessions;
     string sessiondb_file;
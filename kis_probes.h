@@ -0,0 +1,53 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __KIS_PROBES_H__
+#define __KIS_PROBES_H__
+
+#include "config.h"
+
+// Static tracing probes (USDT) for perf, bpftrace, and systemtap
+//
+// When configure finds sys/sdt.h (systemtap-sdt-dev or systemtap-sdt-devel),
+// each KIS_PROBE compiles to a single nop in the code plus a note in the
+// binary describing the probe and where its arguments live; nothing runs
+// unless a tracer attaches, though the arguments are still evaluated, so only
+// pass values already at hand.  Without sys/sdt.h the probes compile to
+// nothing.
+//
+// All probes are in the 'kismet' provider, and their arguments are listed in
+// docs/dev/probes.md; for instance
+//  bpftrace -e 'usdt:./kismet:kismet:chain__exit { @[arg0] = hist(arg2); }'
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define KIS_PROBE(name) DTRACE_PROBE(kismet, name)
+#define KIS_PROBE1(name, a1) DTRACE_PROBE1(kismet, name, a1)
+#define KIS_PROBE2(name, a1, a2) DTRACE_PROBE2(kismet, name, a1, a2)
+#define KIS_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(kismet, name, a1, a2, a3)
+#define KIS_PROBE4(name, a1, a2, a3, a4) DTRACE_PROBE4(kismet, name, a1, a2, a3, a4)
+#else
+#define KIS_PROBE(name) do { } while (0)
+#define KIS_PROBE1(name, a1) do { } while (0)
+#define KIS_PROBE2(name, a1, a2) do { } while (0)
+#define KIS_PROBE3(name, a1, a2, a3) do { } while (0)
+#define KIS_PROBE4(name, a1, a2, a3, a4) do { } while (0)
+#endif
+
+#endif
+
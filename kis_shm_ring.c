@@ -0,0 +1,220 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "kis_shm_ring.h"
+#include "kis_mirror_mmap.h"
+
+static void shm_ring_cloexec(int fd) {
+    fcntl(fd, F_SETFD, fcntl(fd, F_GETFD, 0) | FD_CLOEXEC);
+}
+
+/* Map the header page and the mirrored data of a ring fd */
+static kis_shm_ring_t *shm_ring_map(int ring_fd, size_t hdr_sz, size_t data_sz) {
+    kis_shm_ring_t *ring;
+
+    ring = (kis_shm_ring_t *) malloc(sizeof(kis_shm_ring_t));
+
+    if (ring == NULL)
+        return NULL;
+
+    ring->hdr = (kis_shm_ring_hdr_t *) mmap(NULL, hdr_sz, PROT_READ | PROT_WRITE,
+            MAP_SHARED, ring_fd, 0);
+
+    if (ring->hdr == (kis_shm_ring_hdr_t *) MAP_FAILED) {
+        free(ring);
+        return NULL;
+    }
+
+    ring->data = (uint8_t *) kis_mirror_map_fd(ring_fd, (off_t) hdr_sz, data_sz);
+
+    if (ring->data == NULL) {
+        munmap(ring->hdr, hdr_sz);
+        free(ring);
+        return NULL;
+    }
+
+    ring->hdr_sz = hdr_sz;
+    ring->data_sz = data_sz;
+    ring->ring_fd = ring_fd;
+    ring->doorbell_fd = -1;
+    ring->drain_fd = -1;
+
+    return ring;
+}
+
+kis_shm_ring_t *kis_shm_ring_create(size_t in_sz) {
+#ifdef __linux__
+    long page_sz = sysconf(_SC_PAGESIZE);
+    size_t data_sz;
+    int fd;
+    kis_shm_ring_t *ring;
+
+    if (page_sz <= 0 || in_sz == 0 || sizeof(kis_shm_ring_hdr_t) > (size_t) page_sz)
+        return NULL;
+
+    data_sz = ((in_sz + page_sz - 1) / page_sz) * page_sz;
+
+    if ((fd = kis_mirror_shm_fd(page_sz + data_sz)) < 0)
+        return NULL;
+
+    shm_ring_cloexec(fd);
+
+    if ((ring = shm_ring_map(fd, page_sz, data_sz)) == NULL) {
+        close(fd);
+        return NULL;
+    }
+
+    ring->doorbell_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ring->drain_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (ring->doorbell_fd < 0 || ring->drain_fd < 0) {
+        kis_shm_ring_free(ring);
+        return NULL;
+    }
+
+    memset(ring->hdr, 0, sizeof(kis_shm_ring_hdr_t));
+    ring->hdr->magic = KIS_SHM_RING_MAGIC;
+    ring->hdr->version = KIS_SHM_RING_VERSION;
+    ring->hdr->data_sz = data_sz;
+
+    /* Nothing is reading until the first doorbell */
+    ring->hdr->reader_waiting = 1;
+
+    return ring;
+#else
+    return NULL;
+#endif
+}
+
+kis_shm_ring_t *kis_shm_ring_attach(int ring_fd, int doorbell_fd, int drain_fd) {
+    long page_sz = sysconf(_SC_PAGESIZE);
+    struct stat buf;
+    kis_shm_ring_hdr_t *hdr;
+    size_t data_sz;
+    kis_shm_ring_t *ring;
+
+    if (page_sz <= 0 || fstat(ring_fd, &buf) < 0 || buf.st_size <= page_sz)
+        return NULL;
+
+    /* Read the size from the header before mapping the data */
+    hdr = (kis_shm_ring_hdr_t *) mmap(NULL, page_sz, PROT_READ, MAP_SHARED, ring_fd, 0);
+
+    if (hdr == (kis_shm_ring_hdr_t *) MAP_FAILED)
+        return NULL;
+
+    if (hdr->magic != KIS_SHM_RING_MAGIC || hdr->version != KIS_SHM_RING_VERSION ||
+            hdr->data_sz == 0 || (off_t) (page_sz + hdr->data_sz) != buf.st_size) {
+        munmap(hdr, page_sz);
+        return NULL;
+    }
+
+    data_sz = hdr->data_sz;
+    munmap(hdr, page_sz);
+
+    if ((ring = shm_ring_map(ring_fd, page_sz, data_sz)) == NULL)
+        return NULL;
+
+    ring->doorbell_fd = doorbell_fd;
+    ring->drain_fd = drain_fd;
+
+    /* The memory stays mapped without it */
+    kis_shm_ring_close_fd(ring);
+
+    return ring;
+}
+
+void kis_shm_ring_free(kis_shm_ring_t *ring) {
+    if (ring == NULL)
+        return;
+
+    kis_mirror_free(ring->data, ring->data_sz);
+    munmap(ring->hdr, ring->hdr_sz);
+
+    kis_shm_ring_close_fd(ring);
+
+    if (ring->doorbell_fd >= 0)
+        close(ring->doorbell_fd);
+
+    if (ring->drain_fd >= 0)
+        close(ring->drain_fd);
+
+    free(ring);
+}
+
+void kis_shm_ring_close_fd(kis_shm_ring_t *ring) {
+    if (ring->ring_fd >= 0)
+        close(ring->ring_fd);
+
+    ring->ring_fd = -1;
+}
+
+static void shm_ring_ring(int in_fd) {
+    uint64_t one = 1;
+    ssize_t r;
+
+    /* A full counter still wakes the other side, so a failure can be ignored */
+    r = write(in_fd, &one, sizeof(uint64_t));
+    (void) r;
+}
+
+void kis_shm_ring_notify_reader(kis_shm_ring_t *ring) {
+    /* Order the published length before looking at the flag, against the
+     * reader setting the flag before looking at the length */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (__atomic_exchange_n(&(ring->hdr->reader_waiting), 0, __ATOMIC_SEQ_CST))
+        shm_ring_ring(ring->doorbell_fd);
+}
+
+void kis_shm_ring_notify_writer(kis_shm_ring_t *ring) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (__atomic_exchange_n(&(ring->hdr->writer_waiting), 0, __ATOMIC_SEQ_CST))
+        shm_ring_ring(ring->drain_fd);
+}
+
+void kis_shm_ring_reader_wait(kis_shm_ring_t *ring) {
+    __atomic_store_n(&(ring->hdr->reader_waiting), 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void kis_shm_ring_writer_wait(kis_shm_ring_t *ring) {
+    __atomic_store_n(&(ring->hdr->writer_waiting), 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void kis_shm_ring_ack(int in_fd) {
+    uint64_t count;
+    ssize_t r;
+
+    /* Nonblocking; one read resets the counter */
+    r = read(in_fd, &count, sizeof(uint64_t));
+    (void) r;
+}
+
@@ -0,0 +1,117 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __KIS_SHM_RING_H__
+#define __KIS_SHM_RING_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Shared memory ring from a local capture binary to the Kismet server; shared
+ * by the server and the pure-C capture binaries.
+ *
+ * The server creates the ring and passes its memory fd and two eventfds to the
+ * capture binary when it launches it (--shm-ring=ring,doorbell,drain); the
+ * binary attaches to the same memory.  The binary is the only writer and the
+ * server the only reader, so frames are written once, straight into memory
+ * the server parses them from.
+ *
+ * The memory is one page of header followed by the data, mirrored (see
+ * kis_mirror_mmap.h) so no frame is ever split at the wrap.  Only the length
+ * is shared; each side keeps its own position.
+ *
+ * The reader sets reader_waiting before it stops reading; a writer which
+ * publishes data and finds it set clears it and rings the doorbell eventfd, so
+ * a busy reader is never woken.  The drain eventfd works the same way in the
+ * other direction, for a writer waiting on room.
+ *
+ * Linux only, for the eventfds; elsewhere creating a ring fails and the pipes
+ * are used.
+ */
+
+#define KIS_SHM_RING_MAGIC      0x4B53484D
+#define KIS_SHM_RING_VERSION    1
+
+struct kis_shm_ring_hdr {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t data_sz;
+
+    /* Each side writes its own cache line */
+    char pad0[64 - 16];
+    size_t length;
+    char pad1[64 - sizeof(size_t)];
+    uint32_t reader_waiting;
+    char pad2[64 - sizeof(uint32_t)];
+    uint32_t writer_waiting;
+};
+typedef struct kis_shm_ring_hdr kis_shm_ring_hdr_t;
+
+struct kis_shm_ring {
+    kis_shm_ring_hdr_t *hdr;
+    size_t hdr_sz;
+
+    uint8_t *data;
+    size_t data_sz;
+
+    /* Memory fd, which is only needed until the capture binary is launched,
+     * and the doorbell and drain eventfds */
+    int ring_fd;
+    int doorbell_fd;
+    int drain_fd;
+};
+typedef struct kis_shm_ring kis_shm_ring_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Create a ring of at least in_sz bytes; the descriptors are close-on-exec.
+ * Returns NULL if the platform can't do it. */
+kis_shm_ring_t *kis_shm_ring_create(size_t in_sz);
+
+/* Attach to a ring created by the server; takes ownership of the descriptors.
+ * Returns NULL if the memory isn't a ring. */
+kis_shm_ring_t *kis_shm_ring_attach(int ring_fd, int doorbell_fd, int drain_fd);
+
+/* Unmap the ring and close any descriptors still open */
+void kis_shm_ring_free(kis_shm_ring_t *ring);
+
+/* Close the memory fd once it has been handed over */
+void kis_shm_ring_close_fd(kis_shm_ring_t *ring);
+
+/* Called by the writer after publishing data, and by the reader after
+ * consuming it; rings the other side if it is waiting */
+void kis_shm_ring_notify_reader(kis_shm_ring_t *ring);
+void kis_shm_ring_notify_writer(kis_shm_ring_t *ring);
+
+/* Flag that the reader or writer is about to wait; they must check the ring
+ * again after setting it, to catch anything which raced it */
+void kis_shm_ring_reader_wait(kis_shm_ring_t *ring);
+void kis_shm_ring_writer_wait(kis_shm_ring_t *ring);
+
+/* Clear a doorbell or drain eventfd after it fired */
+void kis_shm_ring_ack(int in_fd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -20,6 +20,13 @@
 #define __KIS_SPECTRUM_H__
 
 #include "config.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <ostream>
+#include <vector>
+#include <mutex>
+
 #include "trackedelement.h"
 #include "kis_datasource.h"
 
@@ -64,6 +71,21 @@ public:
     __Proxy(bin_hz, uint64_t, uint64_t, uint64_t, sample_hz_width);
     __Proxy(samples_per_freq, uint64_t, uint64_t, uint64_t, samples_per_freq);
 
+    // Fill the sample vector from a packed sweep
+    void set_samples(const float *in_samples, size_t in_num) {
+        TrackerElementVector v(sample_vec);
+
+        v.clear();
+
+        for (size_t i = 0; i < in_num; i++) {
+            SharedTrackerElement s(new TrackerElement(TrackerDouble));
+            s->set((double) in_samples[i]);
+            v.push_back(s);
+        }
+
+        set_num_samples(in_num);
+    }
+
 protected:
 
     SharedTrackerElement num_samples_sweep;
@@ -75,6 +97,356 @@ protected:
 
 };
 
+// Bounded history of sweeps with the same shape, stored as packed float
+// arrays instead of a tracked element per sample.  The average over the
+// retained sweeps and the max-hold since the last reset are kept up to date
+// as each sweep is added, so neither needs a pass over the history.
+//
+// Not locked; the owning datasource serializes access.
+class Spectrum_Sweep_Ring {
+public:
+    Spectrum_Sweep_Ring(size_t in_max_sweeps) :
+        max_sweeps(in_max_sweeps > 0 ? in_max_sweeps : 1),
+        num_bins(0), head(0), count(0) { }
+
+    // Add a sweep; a sweep of a different width than the ones already held
+    // (because the source was reconfigured) starts the history over
+    void add_sweep(const float *in_samples, size_t in_num) {
+        if (in_num == 0)
+            return;
+
+        if (in_num != num_bins)
+            reset(in_num);
+
+        float *slot = &(samples[head * num_bins]);
+
+        // Retire the oldest sweep from the running sum once the ring is full
+        if (count == max_sweeps) {
+            for (size_t i = 0; i < num_bins; i++)
+                sum[i] -= slot[i];
+        } else {
+            count++;
+        }
+
+        for (size_t i = 0; i < num_bins; i++) {
+            float v = in_samples[i];
+
+            slot[i] = v;
+            sum[i] += v;
+            max_hold[i] = v > max_hold[i] ? v : max_hold[i];
+        }
+
+        head = (head + 1) % max_sweeps;
+    }
+
+    size_t get_num_bins() const { return num_bins; }
+    size_t get_num_sweeps() const { return count; }
+
+    // Most recent sweep, or NULL if there are none
+    const float *get_last_sweep() const {
+        if (count == 0)
+            return NULL;
+
+        return &(samples[((head + max_sweeps - 1) % max_sweeps) * num_bins]);
+    }
+
+    const std::vector<float>& get_max_hold() const { return max_hold; }
+
+    // Average of the retained sweeps into ret_avg
+    void get_average(std::vector<float>& ret_avg) const {
+        ret_avg.resize(num_bins);
+
+        for (size_t i = 0; i < num_bins; i++)
+            ret_avg[i] = count == 0 ? 0 : (float) (sum[i] / count);
+    }
+
+    void reset_max_hold() {
+        max_hold.assign(num_bins, -1000.0f);
+    }
+
+    void reset(size_t in_num_bins) {
+        num_bins = in_num_bins;
+        head = 0;
+        count = 0;
+        samples.assign(max_sweeps * num_bins, 0.0f);
+        sum.assign(num_bins, 0.0);
+        reset_max_hold();
+    }
+
+protected:
+    size_t max_sweeps;
+    size_t num_bins;
+
+    // Next slot to write, and number of valid sweeps
+    size_t head;
+    size_t count;
+
+    // max_sweeps * num_bins, one sweep after another
+    std::vector<float> samples;
+
+    // Sums in double so repeatedly adding and retiring sweeps doesn't drift
+    std::vector<double> sum;
+    std::vector<float> max_hold;
+};
+
+// Sweeps kept per spectrum source
+#define SPECTRUM_SWEEP_HISTORY      64
+
+// Rows kept in each tier of the waterfall
+#define SPECTRUM_WATERFALL_ROWS     256
+
+// Waterfall history for display
+//
+// A waterfall only ever shows a few hundred or thousand pixels of a sweep of
+// thousands of bins, so the history is kept in tiers of lower resolution:
+// every sweep at full resolution, then rows which hold the max of 8 sweeps in
+// bins of 4, and rows which hold the max of 64 sweeps in bins of 16.  Each tier
+// holds SPECTRUM_WATERFALL_ROWS rows, so the coarsest reaches back 64 times
+// further than the sweeps themselves.  Samples are held as whole dBm.
+//
+// A view of a frequency and time range is rendered from the finest tier which
+// reaches back to the start of the range, taking the max of the bins under
+// each pixel and of the rows folded into each output row, so a peak is never
+// lost to the downsampling.
+//
+// Not locked; the owning datasource serializes access.
+class Spectrum_Waterfall {
+public:
+    // Marks a pixel with no samples
+    enum { no_sample = -128 };
+
+    Spectrum_Waterfall() :
+        num_bins(0), start_mhz(0), bin_hz(0) {
+        tiers[0].bin_decimation = 1;
+        tiers[0].time_decimation = 1;
+        tiers[1].bin_decimation = 4;
+        tiers[1].time_decimation = 8;
+        tiers[2].bin_decimation = 16;
+        tiers[2].time_decimation = 64;
+    }
+
+    // Add a sweep; a sweep of a different shape than the ones already held
+    // starts the history over
+    void add_sweep(uint64_t in_ts_usec, double in_start_mhz, uint64_t in_bin_hz,
+            const float *in_samples, size_t in_num) {
+        if (in_num == 0 || in_bin_hz == 0)
+            return;
+
+        if (in_num != num_bins || in_start_mhz != start_mhz || in_bin_hz != bin_hz)
+            reset(in_start_mhz, in_bin_hz, in_num);
+
+        for (unsigned int t = 0; t < num_tiers; t++) {
+            tier& tr = tiers[t];
+
+            if (tr.pending_sweeps == 0) {
+                tr.pending.assign(tr.num_bins, no_sample);
+                tr.pending_ts = in_ts_usec;
+            }
+
+            for (size_t i = 0; i < num_bins; i++) {
+                int8_t v = quantize(in_samples[i]);
+                int8_t& p = tr.pending[i / tr.bin_decimation];
+
+                if (v > p)
+                    p = v;
+            }
+
+            if (++tr.pending_sweeps < tr.time_decimation)
+                continue;
+
+            memcpy(&(tr.rows[tr.head * tr.num_bins]), tr.pending.data(), tr.num_bins);
+            tr.ts[tr.head] = tr.pending_ts;
+
+            tr.head = (tr.head + 1) % SPECTRUM_WATERFALL_ROWS;
+            if (tr.count < SPECTRUM_WATERFALL_ROWS)
+                tr.count++;
+
+            tr.pending_sweeps = 0;
+        }
+    }
+
+    size_t get_num_bins() const { return num_bins; }
+
+    // Render the range of frequencies (MHz) and times (usec) at in_width pixels
+    // and at most in_max_rows rows, oldest first, as
+    //
+    //  "KWF1", uint32 width, uint32 rows, double start_mhz, double end_mhz
+    //  rows * (uint64 row time in usec, width * int8 dBm)
+    //
+    // little endian, where a pixel without samples is no_sample
+    void render(double in_start_mhz, double in_end_mhz, uint64_t in_start_usec,
+            uint64_t in_end_usec, unsigned int in_width, unsigned int in_max_rows,
+            std::ostream& out) const {
+        std::vector<size_t> sel;
+        const tier *tr = NULL;
+
+        if (in_width == 0 || in_end_mhz <= in_start_mhz || in_max_rows == 0) {
+            in_width = 0;
+        } else {
+            // The finest tier which reaches back far enough, or the coarsest
+            // one with anything in it
+            for (unsigned int t = 0; t < num_tiers; t++) {
+                if (tiers[t].count == 0)
+                    continue;
+
+                tr = &(tiers[t]);
+
+                if (tr->ts[oldest(*tr)] <= in_start_usec)
+                    break;
+            }
+
+            if (tr != NULL) {
+                for (size_t r = 0; r < tr->count; r++) {
+                    size_t pos = (oldest(*tr) + r) % SPECTRUM_WATERFALL_ROWS;
+
+                    if (tr->ts[pos] >= in_start_usec && tr->ts[pos] <= in_end_usec)
+                        sel.push_back(pos);
+                }
+            }
+        }
+
+        // Fold consecutive rows together to fit the height
+        size_t fold = 1;
+        if (sel.size() > in_max_rows)
+            fold = (sel.size() + in_max_rows - 1) / in_max_rows;
+
+        uint32_t nrows = (sel.size() + fold - 1) / fold;
+
+        out.write("KWF1", 4);
+        put_le(out, (uint32_t) in_width);
+        put_le(out, nrows);
+        put_le_double(out, in_start_mhz);
+        put_le_double(out, in_end_mhz);
+
+        if (nrows == 0)
+            return;
+
+        // Span of tier bins under each pixel, or the single bin under its
+        // center when a pixel is narrower than a bin
+        double tbin_mhz = ((double) bin_hz * tr->bin_decimation) / 1000000;
+        double px_mhz = (in_end_mhz - in_start_mhz) / in_width;
+
+        std::vector<long> px_first(in_width), px_last(in_width);
+
+        for (unsigned int x = 0; x < in_width; x++) {
+            double f0 = in_start_mhz + (x * px_mhz);
+            double f1 = f0 + px_mhz;
+
+            long b0 = (long) ((f0 - start_mhz) / tbin_mhz);
+            long b1 = (long) ((f1 - start_mhz) / tbin_mhz) - 1;
+
+            if (b1 < b0)
+                b0 = b1 = (long) ((f0 + (px_mhz / 2) - start_mhz) / tbin_mhz);
+
+            px_first[x] = b0;
+            px_last[x] = b1;
+        }
+
+        std::vector<int8_t> row(in_width);
+        std::vector<int8_t> merged(tr->num_bins);
+
+        for (size_t r = 0; r < sel.size(); r += fold) {
+            merged.assign(tr->num_bins, no_sample);
+
+            for (size_t f = r; f < r + fold && f < sel.size(); f++) {
+                const int8_t *src = &(tr->rows[sel[f] * tr->num_bins]);
+
+                for (size_t i = 0; i < tr->num_bins; i++)
+                    if (src[i] > merged[i])
+                        merged[i] = src[i];
+            }
+
+            for (unsigned int x = 0; x < in_width; x++) {
+                int8_t v = no_sample;
+
+                for (long b = px_first[x]; b <= px_last[x]; b++) {
+                    if (b < 0 || b >= (long) tr->num_bins)
+                        continue;
+
+                    if (merged[b] > v)
+                        v = merged[b];
+                }
+
+                row[x] = v;
+            }
+
+            put_le(out, tr->ts[sel[r]]);
+            out.write((const char *) row.data(), in_width);
+        }
+    }
+
+    void reset(double in_start_mhz, uint64_t in_bin_hz, size_t in_num_bins) {
+        start_mhz = in_start_mhz;
+        bin_hz = in_bin_hz;
+        num_bins = in_num_bins;
+
+        for (unsigned int t = 0; t < num_tiers; t++) {
+            tier& tr = tiers[t];
+
+            tr.num_bins = (num_bins + tr.bin_decimation - 1) / tr.bin_decimation;
+            tr.rows.assign(SPECTRUM_WATERFALL_ROWS * tr.num_bins, no_sample);
+            tr.ts.assign(SPECTRUM_WATERFALL_ROWS, 0);
+            tr.head = 0;
+            tr.count = 0;
+            tr.pending_sweeps = 0;
+        }
+    }
+
+protected:
+    static const unsigned int num_tiers = 3;
+
+    struct tier {
+        unsigned int bin_decimation;
+        unsigned int time_decimation;
+        size_t num_bins;
+
+        // SPECTRUM_WATERFALL_ROWS * num_bins, and the time each row started
+        std::vector<int8_t> rows;
+        std::vector<uint64_t> ts;
+        size_t head, count;
+
+        // Row being built from the sweeps so far
+        std::vector<int8_t> pending;
+        unsigned int pending_sweeps;
+        uint64_t pending_ts;
+    };
+
+    static int8_t quantize(float in_dbm) {
+        if (in_dbm <= -127)
+            return -127;
+        if (in_dbm >= 127)
+            return 127;
+        return (int8_t) (in_dbm < 0 ? in_dbm - 0.5f : in_dbm + 0.5f);
+    }
+
+    static size_t oldest(const tier& in_tier) {
+        return (in_tier.head + SPECTRUM_WATERFALL_ROWS - in_tier.count) %
+            SPECTRUM_WATERFALL_ROWS;
+    }
+
+    template<class T>
+    static void put_le(std::ostream& out, T in_v) {
+        uint8_t b[sizeof(T)];
+
+        for (size_t i = 0; i < sizeof(T); i++)
+            b[i] = (uint8_t) ((uint64_t) in_v >> (8 * i));
+
+        out.write((const char *) b, sizeof(T));
+    }
+
+    static void put_le_double(std::ostream& out, double in_v) {
+        uint64_t u;
+        memcpy(&u, &in_v, sizeof(double));
+        put_le(out, u);
+    }
+
+    size_t num_bins;
+    double start_mhz;
+    uint64_t bin_hz;
+
+    tier tiers[num_tiers];
+};
+
 // Spectrum-specific sub-type of Kismet data sources
 class SpectrumDatasource : public KisDatasource {
 public:
@@ -109,6 +481,54 @@ public:
     __ProxyGet(spectrum_gain_baseband_max, uint64_t, uint64_t, spectrum_gain_baseband_max);
     __ProxyGet(spectrum_gain_baseband_step, uint64_t, uint64_t, spectrum_gain_baseband_step);
 
+    // Record a sweep of dBm samples from the source, starting at in_start_mhz
+    // in bins of in_bin_hz
+    void add_sweep(uint64_t in_ts_usec, double in_start_mhz, uint64_t in_bin_hz,
+            const float *in_samples, size_t in_num) {
+        std::lock_guard<std::mutex> lock(sweep_mutex);
+        sweep_ring.add_sweep(in_samples, in_num);
+        waterfall.add_sweep(in_ts_usec, in_start_mhz, in_bin_hz, in_samples, in_num);
+    }
+
+    // Render a view of the waterfall; see Spectrum_Waterfall::render
+    void render_waterfall(double in_start_mhz, double in_end_mhz, uint64_t in_start_usec,
+            uint64_t in_end_usec, unsigned int in_width, unsigned int in_max_rows,
+            std::ostream& out) {
+        std::lock_guard<std::mutex> lock(sweep_mutex);
+        waterfall.render(in_start_mhz, in_end_mhz, in_start_usec, in_end_usec,
+                in_width, in_max_rows, out);
+    }
+
+    // Materialize the latest sweep, the average, or the max-hold as a sweep
+    // record for serialization; returns false if no sweeps have been seen
+    enum sweep_view { sweep_view_last, sweep_view_average, sweep_view_max };
+
+    bool get_sweep(sweep_view in_view, shared_ptr<Spectrum_Sweep> ret_sweep) {
+        std::lock_guard<std::mutex> lock(sweep_mutex);
+
+        if (sweep_ring.get_num_sweeps() == 0)
+            return false;
+
+        if (in_view == sweep_view_last) {
+            ret_sweep->set_samples(sweep_ring.get_last_sweep(),
+                    sweep_ring.get_num_bins());
+        } else if (in_view == sweep_view_max) {
+            ret_sweep->set_samples(sweep_ring.get_max_hold().data(),
+                    sweep_ring.get_num_bins());
+        } else {
+            std::vector<float> avg;
+            sweep_ring.get_average(avg);
+            ret_sweep->set_samples(avg.data(), avg.size());
+        }
+
+        return true;
+    }
+
+    void reset_max_hold() {
+        std::lock_guard<std::mutex> lock(sweep_mutex);
+        sweep_ring.reset_max_hold();
+    }
+
 protected:
     virtual void register_fields() {
         tracker_component::register_fields();
@@ -121,9 +541,9 @@ protected:
         RegisterField("kismet.spectrum.device.max_mhz", TrackerUInt64,
                 "maximum frequency of spectrum sweep (Hz)", &spectrum_max_mhz);
         RegisterField("kismet.spectrum.device.min_bin_mhz", TrackerUInt64,
-                "minimum size of frequency bin (Hz)", &spectrum_min_bin_mhz);
+                "minimum size of frequency bin (Hz)", &spectrum_min_bin_hz);
         RegisterField("kismet.spectrum.device.max_bin_mhz", TrackerUInt64,
-                "maximum size of frequency bin (Hz)", &spectrum_max_bin_mhz);
+                "maximum size of frequency bin (Hz)", &spectrum_max_bin_hz);
         RegisterField("kismet.spectrum.device.min_num_samples_per", TrackerUInt64,
                 "minimum number of samples per frequency bin", &spectrum_min_num_samples_per);
         RegisterField("kismet.spectrum.device.max_num_samples_per", TrackerUInt64,
@@ -192,7 +612,10 @@ protected:
     SharedTrackerElement spectrum_gain_baseband_min;
     SharedTrackerElement spectrum_gain_baseband_max;
     SharedTrackerElement spectrum_gain_baseband_step;
-    
+
+    std::mutex sweep_mutex;
+    Spectrum_Sweep_Ring sweep_ring{SPECTRUM_SWEEP_HISTORY};
+    Spectrum_Waterfall waterfall;
     
 };
 
@@ -0,0 +1,171 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <algorithm>
+
+#include "kis_startup.h"
+#include "messagebus.h"
+
+// Slowest steps named in the startup message
+#define STARTUP_REPORT_STEPS    5
+
+std::mutex StartupProfiler::startup_mutex;
+std::vector<StartupProfiler::startup_step> StartupProfiler::steps;
+uint64_t StartupProfiler::begin_usec = 0;
+uint64_t StartupProfiler::complete_usec = 0;
+
+StartupProfiler::step::step(const string& in_name) {
+    name = in_name;
+    start = KisClock::MonoUsec();
+    ended = false;
+}
+
+StartupProfiler::step::~step() {
+    End();
+}
+
+void StartupProfiler::step::End() {
+    if (ended)
+        return;
+
+    ended = true;
+
+    StartupProfiler::Record(name, start, KisClock::MonoUsec(), false);
+}
+
+StartupProfiler::task::task(const string& in_name, std::function<void ()> in_fn) {
+    name = in_name;
+    waited = false;
+
+    thread = std::thread([in_name, in_fn]() {
+            uint64_t start = KisClock::MonoUsec();
+            in_fn();
+            StartupProfiler::Record(in_name, start, KisClock::MonoUsec(), true);
+        });
+}
+
+StartupProfiler::task::~task() {
+    Wait();
+}
+
+void StartupProfiler::task::Wait() {
+    if (waited)
+        return;
+
+    waited = true;
+
+    uint64_t start = KisClock::MonoUsec();
+
+    thread.join();
+
+    uint64_t end = KisClock::MonoUsec();
+
+    // Only worth a line of the timeline if the main thread got there first
+    if (end - start >= 1000)
+        StartupProfiler::Record("waiting for " + name, start, end, false);
+}
+
+void StartupProfiler::Begin() {
+    std::lock_guard<std::mutex> lk(startup_mutex);
+
+    begin_usec = KisClock::MonoUsec();
+}
+
+void StartupProfiler::Record(const string& in_name, uint64_t in_start,
+        uint64_t in_end, bool in_parallel) {
+    std::lock_guard<std::mutex> lk(startup_mutex);
+
+    startup_step s;
+
+    s.name = in_name;
+    s.start_usec = in_start > begin_usec ? in_start - begin_usec : 0;
+    s.duration_usec = in_end > in_start ? in_end - in_start : 0;
+    s.parallel = in_parallel;
+
+    // Tasks finish out of order; keep the timeline in order of starting
+    auto i = std::upper_bound(steps.begin(), steps.end(), s,
+            [](const startup_step& a, const startup_step& b) {
+                return a.start_usec < b.start_usec;
+            });
+
+    steps.insert(i, s);
+}
+
+void StartupProfiler::Complete(GlobalRegistry *globalreg) {
+    std::vector<startup_step> slowest;
+    uint64_t total;
+
+    {
+        std::lock_guard<std::mutex> lk(startup_mutex);
+
+        if (complete_usec != 0)
+            return;
+
+        complete_usec = KisClock::MonoUsec();
+        total = complete_usec - begin_usec;
+        slowest = steps;
+    }
+
+    std::sort(slowest.begin(), slowest.end(),
+            [](const startup_step& a, const startup_step& b) {
+                return a.duration_usec > b.duration_usec;
+            });
+
+    char buf[64];
+
+    snprintf(buf, 64, "%.2f", (double) total / 1000000);
+
+    string msg = "Kismet started in " + string(buf) + " seconds";
+
+    for (size_t x = 0; x < slowest.size() && x < STARTUP_REPORT_STEPS; x++) {
+        snprintf(buf, 64, "%.2f", (double) slowest[x].duration_usec / 1000000);
+
+        msg += string(x == 0 ? "; slowest " : ", ") + slowest[x].name + " " +
+            buf + "s";
+
+        if (slowest[x].parallel)
+            msg += " (in parallel)";
+    }
+
+    _MSG(msg + "; see /system/startup.json", MSGFLAG_INFO);
+}
+
+bool StartupProfiler::IsComplete() {
+    std::lock_guard<std::mutex> lk(startup_mutex);
+
+    return complete_usec != 0;
+}
+
+uint64_t StartupProfiler::FetchTotalUsec() {
+    std::lock_guard<std::mutex> lk(startup_mutex);
+
+    if (complete_usec != 0)
+        return complete_usec - begin_usec;
+
+    return KisClock::MonoUsec() - begin_usec;
+}
+
+std::vector<StartupProfiler::startup_step> StartupProfiler::FetchSteps() {
+    std::lock_guard<std::mutex> lk(startup_mutex);
+
+    return steps;
+}
+
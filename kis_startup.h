@@ -0,0 +1,116 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __KIS_STARTUP_H__
+#define __KIS_STARTUP_H__
+
+#include "config.h"
+
+#include <stdint.h>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "kis_clock.h"
+
+class GlobalRegistry;
+
+// Startup timeline
+//
+// Every step of server startup is timed from the start of the process until
+// Complete() is called, once the server is about to start capturing.  Steps run
+// one after another by the main thread are timed with a StartupProfiler::step;
+// independent initializers are run on threads of their own with a
+// StartupProfiler::task, and the main thread waits for them at the point a
+// later step depends on them, which is recorded as a step of its own when it
+// had to wait.
+//
+// Once complete, the total and the slowest steps are reported as a message, and
+// the timeline is served as /system/startup.json
+class StartupProfiler {
+public:
+    struct startup_step {
+        std::string name;
+
+        // Microseconds from the start of the process
+        uint64_t start_usec;
+        uint64_t duration_usec;
+
+        // Run on a thread of its own, alongside the main thread
+        bool parallel;
+    };
+
+    // Times a step of the main thread from construction until End or
+    // destruction
+    class step {
+    public:
+        step(const std::string& in_name);
+        ~step();
+
+        void End();
+
+    protected:
+        std::string name;
+        uint64_t start;
+        bool ended;
+    };
+
+    // Runs an initializer on a thread of its own; Wait is the barrier for
+    // anything which depends on it, and the task is always waited for before
+    // it is destroyed
+    class task {
+    public:
+        task(const std::string& in_name, std::function<void ()> in_fn);
+        ~task();
+
+        void Wait();
+
+    protected:
+        std::string name;
+        std::thread thread;
+        bool waited;
+    };
+
+    // Mark the start of the process; call once, first thing
+    static void Begin();
+
+    // Record a step started and ended at monotonic times in usec
+    static void Record(const std::string& in_name, uint64_t in_start, uint64_t in_end,
+            bool in_parallel);
+
+    // Startup is done; report the timeline
+    static void Complete(GlobalRegistry *globalreg);
+
+    static bool IsComplete();
+
+    // Microseconds from the start of the process until Complete, or until now
+    static uint64_t FetchTotalUsec();
+
+    // Steps in the order they started
+    static std::vector<startup_step> FetchSteps();
+
+protected:
+    static std::mutex startup_mutex;
+    static std::vector<startup_step> steps;
+    static uint64_t begin_usec, complete_usec;
+};
+
+#endif
+
@@ -0,0 +1,111 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <mutex>
+#include <unordered_map>
+
+#include "kis_string_intern.h"
+
+namespace {
+
+// The table is keyed by the string inside each record, so a lookup doesn't need
+// to copy the string it's looking for
+struct str_ptr_hash {
+    size_t operator()(const std::string *s) const {
+        return std::hash<std::string>()(*s);
+    }
+};
+
+struct str_ptr_eq {
+    bool operator()(const std::string *a, const std::string *b) const {
+        return *a == *b;
+    }
+};
+
+typedef std::unordered_map<const std::string *, kis_string_rec *,
+        str_ptr_hash, str_ptr_eq> intern_map;
+
+// Allocated on first use and never freed, so elements destroyed during static
+// teardown can still release their strings
+std::mutex& intern_mutex() {
+    static std::mutex *m = new std::mutex();
+    return *m;
+}
+
+intern_map& intern_table() {
+    static intern_map *t = new intern_map();
+    return *t;
+}
+
+}
+
+kis_string_rec *kis_string_intern::acquire(const std::string& in_str) {
+    std::lock_guard<std::mutex> lock(intern_mutex());
+
+    intern_map& table = intern_table();
+
+    auto i = table.find(&in_str);
+
+    if (i != table.end()) {
+        i->second->refs.fetch_add(1, std::memory_order_relaxed);
+        return i->second;
+    }
+
+    kis_string_rec *rec = new kis_string_rec(in_str);
+    rec->pooled = true;
+
+    table[&(rec->str)] = rec;
+
+    return rec;
+}
+
+void kis_string_intern::release(kis_string_rec *in_rec) {
+    if (in_rec == NULL)
+        return;
+
+    if (!in_rec->pooled) {
+        delete in_rec;
+        return;
+    }
+
+    // Anyone else holding a reference can drop theirs without the lock; only
+    // the last reference has to take it, so that a lookup can't find the record
+    // as it is being removed
+    unsigned int r = in_rec->refs.load(std::memory_order_relaxed);
+
+    while (r > 1) {
+        if (in_rec->refs.compare_exchange_weak(r, r - 1, std::memory_order_acq_rel))
+            return;
+    }
+
+    std::lock_guard<std::mutex> lock(intern_mutex());
+
+    if (in_rec->refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return;
+
+    intern_table().erase(&(in_rec->str));
+    delete in_rec;
+}
+
+size_t kis_string_intern::size() {
+    std::lock_guard<std::mutex> lock(intern_mutex());
+    return intern_table().size();
+}
+
@@ -0,0 +1,64 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __KIS_STRING_INTERN_H__
+#define __KIS_STRING_INTERN_H__
+
+#include "config.h"
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+
+// Storage for the value of a string tracked element.
+//
+// A record is either private to one element, or shared out of the global
+// intern table.  Thousands of devices carry the same manufacturer, phy and
+// type names and the same handful of SSIDs; interned values are stored once
+// and reference counted, and two interned records hold the same string
+// exactly when they are the same record.
+struct kis_string_rec {
+    kis_string_rec() : refs(1), pooled(false) { }
+    kis_string_rec(const std::string& in_str) : str(in_str), refs(1), pooled(false) { }
+
+    std::string str;
+    std::atomic<unsigned int> refs;
+    bool pooled;
+};
+
+class kis_string_intern {
+public:
+    // Return the interned record for a string, holding a new reference
+    static kis_string_rec *acquire(const std::string& in_str);
+
+    // Take another reference to a record already held
+    static kis_string_rec *acquire(kis_string_rec *in_rec) {
+        in_rec->refs.fetch_add(1, std::memory_order_relaxed);
+        return in_rec;
+    }
+
+    // Drop a reference; private records are freed, interned records are removed
+    // from the table with their last reference
+    static void release(kis_string_rec *in_rec);
+
+    // Number of distinct interned strings
+    static size_t size();
+};
+
+#endif
+
@@ -0,0 +1,320 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <chrono>
+#include <sstream>
+
+#include "kis_taskpool.h"
+#include "kis_metrics.h"
+#include "configfile.h"
+#include "messagebus.h"
+
+// Which pool and worker the current thread is, so tasks queued from inside a
+// task stay on the worker which queued them
+static thread_local KisTaskPool *taskpool_self = NULL;
+static thread_local unsigned int taskpool_worker = 0;
+
+static uint64_t taskpool_now_nsec() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool kis_task_group::run_one() {
+    std::function<void ()> fn;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if (tasks.size() == 0)
+            return false;
+
+        fn = std::move(tasks.front());
+        tasks.pop_front();
+    }
+
+    fn();
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (--outstanding == 0)
+        cv.notify_all();
+
+    return true;
+}
+
+shared_ptr<KisTaskPool> KisTaskPool::create_taskpool(GlobalRegistry *in_globalreg) {
+    shared_ptr<KisTaskPool> mon(new KisTaskPool(in_globalreg));
+    in_globalreg->RegisterLifetimeGlobal(mon);
+    in_globalreg->InsertGlobal("TASKPOOL", mon);
+    return mon;
+}
+
+const char *KisTaskPool::lane_name(unsigned int in_lane) {
+    switch (in_lane) {
+        case task_lane_high:
+            return "high";
+        case task_lane_normal:
+            return "normal";
+        case task_lane_background:
+            return "background";
+    }
+
+    return "unknown";
+}
+
+KisTaskPool::KisTaskPool(GlobalRegistry *in_globalreg) {
+    globalreg = in_globalreg;
+
+    next_worker = 0;
+    queued = 0;
+    idle = 0;
+    stopping = false;
+
+    shared_ptr<KisMetrics> metrics =
+        globalreg->FetchGlobalAs<KisMetrics>("METRICS");
+
+    for (unsigned int l = 0; l < task_lane_max; l++) {
+        stats[l].depth = 0;
+
+        if (metrics == NULL) {
+            stats[l].tasks.reset(new kis_metric_counter());
+            stats[l].steals.reset(new kis_metric_counter());
+            stats[l].wait.reset(new kis_metric_histogram());
+            stats[l].run.reset(new kis_metric_histogram());
+            continue;
+        }
+
+        string labels = "lane=" + KisMetrics::label_escape(lane_name(l));
+
+        stats[l].tasks =
+            metrics->register_counter("kismet_taskpool_tasks",
+                    "tasks run by the task pool", labels);
+        stats[l].steals =
+            metrics->register_counter("kismet_taskpool_steals",
+                    "tasks a task pool worker took from another worker's queue",
+                    labels);
+        stats[l].wait =
+            metrics->register_histogram("kismet_taskpool_queue_latency",
+                    "time task pool tasks spent queued before starting", labels);
+        stats[l].run =
+            metrics->register_histogram("kismet_taskpool_run_time",
+                    "time task pool tasks took to run", labels);
+
+        metrics->register_gauge("kismet_taskpool_queue_depth",
+                "tasks queued in the task pool and not started", labels,
+                [this, l]() -> double {
+                    return stats[l].depth;
+                });
+    }
+
+    unsigned int num_threads = std::thread::hardware_concurrency();
+
+    if (num_threads < 2)
+        num_threads = 2;
+
+    num_threads =
+        globalreg->kismet_config->FetchOptUInt("taskpool_threads", num_threads);
+
+    if (num_threads == 0) {
+        _MSG("No task pool threads configured (taskpool_threads=0), background "
+                "tasks will run in the threads which queue them", MSGFLAG_INFO);
+        return;
+    }
+
+    for (unsigned int t = 0; t < num_threads; t++)
+        workers.push_back(new worker());
+
+    for (unsigned int t = 0; t < num_threads; t++)
+        workers[t]->thread = std::thread([this, t]() { WorkerThread(t); });
+
+    std::stringstream ss;
+    ss << "Started task pool with " << num_threads << " threads";
+    _MSG(ss.str(), MSGFLAG_INFO);
+}
+
+KisTaskPool::~KisTaskPool() {
+    globalreg->RemoveGlobal("TASKPOOL");
+
+    {
+        std::lock_guard<std::mutex> lock(idle_mutex);
+        stopping = true;
+    }
+
+    idle_cv.notify_all();
+
+    // Workers steal from each other right up until they stop
+    for (auto w : workers) {
+        if (w->thread.joinable())
+            w->thread.join();
+    }
+
+    for (auto w : workers)
+        delete w;
+
+    workers.clear();
+
+    shared_ptr<KisMetrics> metrics =
+        globalreg->FetchGlobalAs<KisMetrics>("METRICS");
+
+    if (metrics != NULL) {
+        for (unsigned int l = 0; l < task_lane_max; l++)
+            metrics->remove_metric("kismet_taskpool_queue_depth",
+                    "lane=" + KisMetrics::label_escape(lane_name(l)));
+    }
+}
+
+void KisTaskPool::submit(kis_task_lane in_lane, std::function<void ()> in_task) {
+    if (workers.size() == 0) {
+        in_task();
+        return;
+    }
+
+    unsigned int w;
+
+    if (taskpool_self == this)
+        w = taskpool_worker;
+    else
+        w = next_worker.fetch_add(1, std::memory_order_relaxed) % workers.size();
+
+    {
+        std::lock_guard<std::mutex> lock(workers[w]->mutex);
+
+        task t;
+        t.fn = std::move(in_task);
+        t.queued_nsec = taskpool_now_nsec();
+
+        workers[w]->lanes[in_lane].push_back(std::move(t));
+    }
+
+    stats[in_lane].depth++;
+
+    // Counted before looking for idle workers, and a worker counts itself idle
+    // before looking at the count, so one of the two always sees the other
+    queued++;
+
+    if (idle != 0) {
+        std::lock_guard<std::mutex> lock(idle_mutex);
+        idle_cv.notify_one();
+    }
+}
+
+shared_ptr<kis_task_group> KisTaskPool::new_group() {
+    return shared_ptr<kis_task_group>(new kis_task_group());
+}
+
+void KisTaskPool::submit(kis_task_lane in_lane, shared_ptr<kis_task_group> in_group,
+        std::function<void ()> in_task) {
+    if (workers.size() == 0) {
+        in_task();
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(in_group->mutex);
+        in_group->tasks.push_back(std::move(in_task));
+        in_group->outstanding++;
+    }
+
+    // The pool only gets a ticket for the group; whoever gets to it first,
+    // worker or waiter, runs the task
+    submit(in_lane, [in_group]() { in_group->run_one(); });
+}
+
+void KisTaskPool::wait(shared_ptr<kis_task_group> in_group) {
+    while (in_group->run_one())
+        ;
+
+    std::unique_lock<std::mutex> lock(in_group->mutex);
+    in_group->cv.wait(lock, [in_group]() { return in_group->outstanding == 0; });
+}
+
+bool KisTaskPool::FetchTask(unsigned int in_num, task *ret_task,
+        unsigned int *ret_lane) {
+    unsigned int n = workers.size();
+
+    for (unsigned int l = 0; l < task_lane_max; l++) {
+        for (unsigned int i = 0; i < n; i++) {
+            worker *w = workers[(in_num + i) % n];
+
+            std::lock_guard<std::mutex> lock(w->mutex);
+
+            if (w->lanes[l].size() == 0)
+                continue;
+
+            if (i == 0) {
+                *ret_task = std::move(w->lanes[l].back());
+                w->lanes[l].pop_back();
+            } else {
+                *ret_task = std::move(w->lanes[l].front());
+                w->lanes[l].pop_front();
+                stats[l].steals->inc();
+            }
+
+            *ret_lane = l;
+
+            stats[l].depth--;
+            queued--;
+
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void KisTaskPool::RunTask(task& in_task, unsigned int in_lane) {
+    uint64_t start = taskpool_now_nsec();
+
+    stats[in_lane].wait->observe_nsec(start - in_task.queued_nsec);
+
+    in_task.fn();
+
+    stats[in_lane].run->observe_nsec(taskpool_now_nsec() - start);
+    stats[in_lane].tasks->inc();
+}
+
+void KisTaskPool::WorkerThread(unsigned int in_num) {
+    taskpool_self = this;
+    taskpool_worker = in_num;
+
+    task t;
+    unsigned int lane;
+
+    while (!stopping) {
+        if (FetchTask(in_num, &t, &lane)) {
+            RunTask(t, lane);
+            t.fn = NULL;
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(idle_mutex);
+
+        if (stopping)
+            break;
+
+        idle++;
+        idle_cv.wait(lock, [this]() { return stopping || queued != 0; });
+        idle--;
+
+        if (stopping)
+            break;
+    }
+}
+
@@ -0,0 +1,156 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __KIS_TASKPOOL_H__
+#define __KIS_TASKPOOL_H__
+
+#include "config.h"
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "globalregistry.h"
+
+class kis_metric_counter;
+class kis_metric_histogram;
+
+// Lanes, in the order workers look at them; a worker only takes a task from a
+// lower lane when there is nothing in the ones above it anywhere in the pool
+enum kis_task_lane {
+    // Work someone is waiting on, such as parallel matching for a request
+    task_lane_high = 0,
+    task_lane_normal = 1,
+    // Periodic upkeep, such as saving the device snapshot
+    task_lane_background = 2,
+    task_lane_max = 3
+};
+
+// Set of tasks which can be waited on together.  A task of the group which no
+// worker has started yet is run by the waiter itself, so waiting can't stall
+// behind workers which are busy or blocked, even on a lock the waiter holds.
+class kis_task_group {
+public:
+    kis_task_group() {
+        outstanding = 0;
+    }
+
+protected:
+    friend class KisTaskPool;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+
+    // Tasks no one has started
+    std::deque<std::function<void ()> > tasks;
+
+    // Tasks not yet finished, started or not
+    size_t outstanding;
+
+    // Start the next unstarted task, if there is one; returns false otherwise
+    bool run_one();
+};
+
+// Shared pool of worker threads
+//
+// Each worker has a queue per lane.  Tasks queued by a worker go on its own
+// queues, and tasks from anywhere else are spread over the workers in turn;
+// a worker runs the newest task of its own queue, and when it has nothing to
+// do steals the oldest task of another worker, so bursts of tasks queued from
+// one place spread over the whole pool.
+//
+// Queue depth, waits from queueing to starting, run times, and steals are
+// counted per lane and served with the other metrics at /metrics.
+//
+// Tasks still queued when the server shuts down are dropped.  With no pool
+// (taskpool_threads=0) tasks run in the calling thread.
+class KisTaskPool : public LifetimeGlobal {
+public:
+    static shared_ptr<KisTaskPool> create_taskpool(GlobalRegistry *in_globalreg);
+
+private:
+    KisTaskPool(GlobalRegistry *in_globalreg);
+
+public:
+    virtual ~KisTaskPool();
+
+    unsigned int get_num_workers() const { return workers.size(); }
+
+    // Queue a task
+    void submit(kis_task_lane in_lane, std::function<void ()> in_task);
+
+    // Queue a task as part of a group
+    shared_ptr<kis_task_group> new_group();
+    void submit(kis_task_lane in_lane, shared_ptr<kis_task_group> in_group,
+            std::function<void ()> in_task);
+
+    // Wait for every task of a group to finish, running the ones which
+    // haven't started
+    void wait(shared_ptr<kis_task_group> in_group);
+
+    static const char *lane_name(unsigned int in_lane);
+
+protected:
+    GlobalRegistry *globalreg;
+
+    struct task {
+        std::function<void ()> fn;
+        uint64_t queued_nsec;
+    };
+
+    struct worker {
+        std::mutex mutex;
+        std::deque<task> lanes[task_lane_max];
+        std::thread thread;
+    };
+
+    struct lane_stats {
+        std::atomic<int64_t> depth;
+        shared_ptr<kis_metric_counter> tasks, steals;
+        shared_ptr<kis_metric_histogram> wait, run;
+    };
+
+    vector<worker *> workers;
+    lane_stats stats[task_lane_max];
+
+    std::atomic<unsigned int> next_worker;
+
+    // Idle workers sleep until something is queued anywhere
+    std::mutex idle_mutex;
+    std::condition_variable idle_cv;
+    std::atomic<uint64_t> queued;
+    std::atomic<unsigned int> idle;
+    std::atomic<bool> stopping;
+
+    void WorkerThread(unsigned int in_num);
+
+    // Take the next task for a worker, its own first and then anyone's, from
+    // the highest lane with a task
+    bool FetchTask(unsigned int in_num, task *ret_task, unsigned int *ret_lane);
+
+    void RunTask(task& in_task, unsigned int in_lane);
+};
+
+#endif
+
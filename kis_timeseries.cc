@@ -0,0 +1,975 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <zlib.h>
+
+#include <fstream>
+#include <sstream>
+#include <set>
+
+#include "util.h"
+#include "configfile.h"
+#include "messagebus.h"
+#include "entrytracker.h"
+#include "timetracker.h"
+#include "devicetracker.h"
+#include "channeltracker2.h"
+#include "kis_timeseries.h"
+
+#define KTSS_MAGIC              "KISTSSEG"
+#define KTSS_VERSION            1
+#define KTSS_FLAG_LITTLE_ENDIAN 0x01
+
+#define KTS_SAMPLE_SEC          60
+
+struct ktss_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint32_t interval;
+    uint32_t num_rows;
+    uint32_t num_series;
+    uint32_t reserved;
+    uint64_t start;
+};
+
+static uint32_t ktss_native_flags() {
+    uint16_t probe = 1;
+
+    if (*((uint8_t *) &probe) == 1)
+        return KTSS_FLAG_LITTLE_ENDIAN;
+
+    return 0;
+}
+
+template<typename T> static inline void kts_put(string &out, T v) {
+    out.append((const char *) &v, sizeof(T));
+}
+
+template<typename T> static inline bool kts_get(const uint8_t *in_data, size_t in_len,
+        size_t *pos, T *ret) {
+    if (in_len - *pos < sizeof(T))
+        return false;
+
+    memcpy(ret, in_data + *pos, sizeof(T));
+    *pos += sizeof(T);
+    return true;
+}
+
+static inline void kts_put_varint(string &out, int64_t v) {
+    uint64_t u = ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+
+    while (u >= 0x80) {
+        out += (char) (u | 0x80);
+        u >>= 7;
+    }
+
+    out += (char) u;
+}
+
+static inline bool kts_get_varint(const uint8_t *in_data, size_t in_len, size_t *pos,
+        int64_t *ret) {
+    uint64_t u = 0;
+    unsigned int shift = 0;
+
+    while (*pos < in_len && shift < 64) {
+        uint8_t b = in_data[(*pos)++];
+
+        u |= (uint64_t) (b & 0x7F) << shift;
+
+        if ((b & 0x80) == 0) {
+            *ret = (int64_t) (u >> 1) ^ -((int64_t) (u & 1));
+            return true;
+        }
+
+        shift += 7;
+    }
+
+    return false;
+}
+
+// A column of deltas from in_base
+static string kts_encode_column(const vector<int64_t> &in_values, int64_t in_base) {
+    string out;
+    int64_t prev = in_base;
+
+    for (auto v : in_values) {
+        kts_put_varint(out, v - prev);
+        prev = v;
+    }
+
+    return out;
+}
+
+static bool kts_decode_column(const uint8_t *in_data, size_t in_len, uint32_t in_rows,
+        int64_t in_base, vector<int64_t> *ret_values) {
+    size_t pos = 0;
+    int64_t v = in_base;
+
+    ret_values->reserve(in_rows);
+
+    for (uint32_t r = 0; r < in_rows; r++) {
+        int64_t d;
+
+        if (!kts_get_varint(in_data, in_len, &pos, &d))
+            return false;
+
+        v += d;
+        ret_values->push_back(v);
+    }
+
+    return true;
+}
+
+shared_ptr<KisTimeseries> KisTimeseries::create_timeseries(GlobalRegistry *in_globalreg) {
+    if (!in_globalreg->kismet_config->FetchOptBoolean("timeseries", false))
+        return NULL;
+
+    shared_ptr<KisTimeseries> mon(new KisTimeseries(in_globalreg));
+    in_globalreg->RegisterLifetimeGlobal(mon);
+    in_globalreg->InsertGlobal("TIMESERIES", mon);
+    return mon;
+}
+
+KisTimeseries::KisTimeseries(GlobalRegistry *in_globalreg) :
+    Kis_Net_Httpd_CPPStream_Handler(in_globalreg) {
+
+    Httpd_RegisterRoute("GET", "/timeseries/series");
+    Httpd_RegisterRoute("GET", "/timeseries/:series/:tier/:start/:end/samples");
+
+    globalreg = in_globalreg;
+
+    sample_timer = -1;
+
+    series_list_id =
+        globalreg->entrytracker->RegisterField("kismet.timeseries.series_list",
+                TrackerVector, "series with long-term history");
+    series_name_id =
+        globalreg->entrytracker->RegisterField("kismet.timeseries.series_name",
+                TrackerString, "series name");
+
+    samples_id =
+        globalreg->entrytracker->RegisterField("kismet.timeseries.samples", TrackerMap,
+                "long-term samples of a series");
+    samples_series_id =
+        globalreg->entrytracker->RegisterField("kismet.timeseries.series",
+                TrackerString, "series name");
+    samples_tier_id =
+        globalreg->entrytracker->RegisterField("kismet.timeseries.tier",
+                TrackerString, "tier the samples were read from");
+    samples_interval_id =
+        globalreg->entrytracker->RegisterField("kismet.timeseries.interval",
+                TrackerUInt64, "seconds between samples");
+    samples_values_id =
+        globalreg->entrytracker->RegisterField("kismet.timeseries.values",
+                TrackerVector, "samples, as [unix time, value]");
+
+    string dir = globalreg->kismet_config->FetchOpt("timeseries_dir");
+
+    if (dir == "")
+        dir = globalreg->kismet_config->FetchOpt("configdir") + "/timeseries";
+
+    ts_dir = globalreg->kismet_config->ExpandLogPath(dir, "", "", 0, 1);
+
+    if (mkdir(ts_dir.c_str(), S_IRUSR | S_IWUSR | S_IXUSR) < 0 && errno != EEXIST) {
+        _MSG("Could not create timeseries directory '" + ts_dir + "': " +
+                string(strerror(errno)) + "; long-term history will not be saved",
+                MSGFLAG_ERROR);
+        return;
+    }
+
+    unsigned int minute_days =
+        globalreg->kismet_config->FetchOptUInt("timeseries_minute_days", 14);
+    unsigned int hour_days =
+        globalreg->kismet_config->FetchOptUInt("timeseries_hour_days", 400);
+
+    // Each segment is a whole number of buckets of the next tier, so the rows
+    // an open bucket is built from are always in the open segment
+    tiers.resize(3);
+
+    tiers[0].name = "minute";
+    tiers[0].interval = 60;
+    tiers[0].span = 86400;
+    tiers[0].retention = (time_t) minute_days * 86400;
+
+    tiers[1].name = "hour";
+    tiers[1].interval = 3600;
+    tiers[1].span = 86400 * 30;
+    tiers[1].retention = (time_t) hour_days * 86400;
+
+    tiers[2].name = "day";
+    tiers[2].interval = 86400;
+    tiers[2].span = 86400 * 360;
+    tiers[2].retention = 0;
+
+    for (size_t t = 0; t < tiers.size(); t++) {
+        tiers[t].seg_start = 0;
+        tiers[t].log_file = NULL;
+        tiers[t].log_path = ts_dir + "/" + tiers[t].name + ".log";
+
+        LoadTier(tiers[t]);
+        ReplayLog(t);
+        OpenLog(tiers[t], false);
+    }
+
+    for (size_t t = 0; t + 1 < tiers.size(); t++)
+        RebuildAccum(t);
+
+    for (auto m : globalreg->kismet_config->FetchOptVec("timeseries_device")) {
+        mac_addr mac(m);
+
+        if (mac.error) {
+            _MSG("Ignoring invalid timeseries_device '" + m + "'", MSGFLAG_ERROR);
+            continue;
+        }
+
+        watch_devices.push_back(mac);
+    }
+
+    sample_timer =
+        globalreg->timetracker->RegisterTimer(SERVER_TIMESLICES_SEC * KTS_SAMPLE_SEC,
+                NULL, 1, [this](int) -> int {
+                    Sample();
+                    return 1;
+                });
+
+    _MSG("Saving long-term history to '" + ts_dir + "'", MSGFLAG_INFO);
+}
+
+KisTimeseries::~KisTimeseries() {
+    globalreg->RemoveGlobal("TIMESERIES");
+
+    if (globalreg->timetracker != NULL && sample_timer >= 0)
+        globalreg->timetracker->RemoveTimer(sample_timer);
+
+    std::lock_guard<std::mutex> lk(ts_mutex);
+
+    for (auto& t : tiers) {
+        if (t.log_file != NULL)
+            fclose(t.log_file);
+        t.log_file = NULL;
+    }
+}
+
+void KisTimeseries::CollectRow(sample_row *ret_row) {
+    // Counters are read as totals, and recorded as what they went up by
+    std::map<string, uint64_t> counters;
+    std::map<string, int64_t> gauges;
+
+    Devicetracker *devicetracker = globalreg->devicetracker;
+
+    if (devicetracker != NULL) {
+        counters["packets"] = (uint32_t) devicetracker->FetchNumPackets(KIS_PHY_ANY);
+        gauges["devices"] = devicetracker->FetchNumDevices(KIS_PHY_ANY);
+
+        for (int p = 0; p < KIS_PHY_COUNTED_MAX; p++) {
+            Kis_Phy_Handler *phy = devicetracker->FetchPhyHandler(p);
+
+            if (phy == NULL)
+                continue;
+
+            string prefix = "phy." + phy->FetchPhyName() + ".";
+
+            counters[prefix + "packets"] = (uint32_t) devicetracker->FetchNumPackets(p);
+            gauges[prefix + "devices"] = devicetracker->FetchNumDevices(p);
+        }
+
+        if (watch_devices.size() != 0) {
+            devicelist_scope_locker dlocker(devicetracker);
+
+            for (auto m : watch_devices) {
+                shared_ptr<kis_tracked_device_base> dev;
+
+                for (int p = 0; p < KIS_PHY_COUNTED_MAX && dev == NULL; p++) {
+                    if (devicetracker->FetchPhyHandler(p) != NULL)
+                        dev = devicetracker->FetchDevice(m, p);
+                }
+
+                if (dev == NULL)
+                    continue;
+
+                string prefix = "device." + m.Mac2String() + ".";
+
+                counters[prefix + "packets"] = dev->get_packets();
+
+                shared_ptr<kis_tracked_signal_data> sig =
+                    static_pointer_cast<kis_tracked_signal_data>(dev->get_tracker_signal_data());
+
+                if (sig != NULL && sig->get_last_signal_dbm() != 0)
+                    gauges[prefix + "signal"] = sig->get_last_signal_dbm();
+            }
+        }
+    }
+
+    shared_ptr<Channeltracker_V2> channeltracker =
+        globalreg->FetchGlobalAs<Channeltracker_V2>("CHANNEL_TRACKER");
+
+    if (channeltracker != NULL) {
+        map<double, Channeltracker_V2::frequency_totals> totals;
+
+        channeltracker->get_frequency_totals(&totals);
+
+        for (auto f : totals) {
+            char freq[32];
+            snprintf(freq, 32, "freq.%.0f.", f.first);
+
+            counters[string(freq) + "packets"] = f.second.packets;
+            counters[string(freq) + "bytes"] = f.second.bytes;
+            counters[string(freq) + "airtime"] = f.second.airtime;
+        }
+    }
+
+    for (auto c : counters) {
+        auto l = last_counter.find(c.first);
+
+        if (l != last_counter.end()) {
+            series_value v;
+            v.kind = kind_counter;
+
+            // A counter which went backwards started over
+            if (c.second >= l->second)
+                v.value = c.second - l->second;
+            else
+                v.value = c.second;
+
+            (*ret_row)[c.first] = v;
+        }
+
+        last_counter[c.first] = c.second;
+    }
+
+    for (auto g : gauges) {
+        series_value v;
+        v.kind = kind_gauge;
+        v.value = g.second;
+        (*ret_row)[g.first] = v;
+    }
+}
+
+void KisTimeseries::Sample() {
+    sample_row row;
+
+    CollectRow(&row);
+
+    time_t now = globalreg->timestamp.tv_sec;
+    time_t ts = now - (now % tiers[0].interval);
+
+    std::lock_guard<std::mutex> lk(ts_mutex);
+
+    AddRow(0, ts, row, true);
+}
+
+void KisTimeseries::AddRow(size_t in_tier, time_t in_ts, const sample_row& in_row,
+        bool in_log) {
+    tier& t = tiers[in_tier];
+
+    // Timer slop can put two samples in the same interval
+    if (t.times.size() != 0 && in_ts <= t.times.back())
+        return;
+
+    if (t.times.size() != 0 && in_ts >= t.seg_start + t.span)
+        SealSegment(t);
+
+    if (t.times.size() == 0)
+        t.seg_start = in_ts - (in_ts % t.span);
+
+    if (in_log)
+        WriteLogRow(t, in_ts, in_row);
+
+    AppendRow(t, in_ts, in_row);
+
+    if (in_log)
+        Downsample(in_tier, in_ts, in_row);
+}
+
+void KisTimeseries::AppendRow(tier& in_tier, time_t in_ts, const sample_row& in_row) {
+    in_tier.times.push_back(in_ts);
+
+    for (auto r : in_row) {
+        auto ci = in_tier.columns.find(r.first);
+
+        if (ci == in_tier.columns.end()) {
+            series_column c;
+            c.kind = r.second.kind;
+            c.values.assign(in_tier.times.size() - 1, 0);
+            ci = in_tier.columns.insert(std::make_pair(r.first, c)).first;
+        }
+
+        ci->second.values.push_back(r.second.value);
+    }
+
+    // Series with nothing in this row
+    for (auto& c : in_tier.columns) {
+        if (c.second.values.size() < in_tier.times.size())
+            c.second.values.push_back(0);
+    }
+}
+
+void KisTimeseries::Downsample(size_t in_tier, time_t in_ts, const sample_row& in_row) {
+    if (in_tier + 1 >= tiers.size())
+        return;
+
+    tier_accum& a = tiers[in_tier].accum;
+    time_t interval = tiers[in_tier + 1].interval;
+    time_t bucket = in_ts - (in_ts % interval);
+
+    // The first row of a new bucket finishes the last one
+    if (a.bucket >= 0 && a.bucket != bucket) {
+        sample_row out;
+
+        for (auto s : a.sums) {
+            series_value v = s.second.first;
+
+            if (v.kind == kind_gauge && s.second.second != 0)
+                v.value /= (int64_t) s.second.second;
+
+            out[s.first] = v;
+        }
+
+        time_t out_ts = a.bucket;
+
+        a.sums.clear();
+        a.bucket = -1;
+
+        AddRow(in_tier + 1, out_ts, out, true);
+    }
+
+    a.bucket = bucket;
+
+    for (auto r : in_row) {
+        auto& s = a.sums[r.first];
+
+        s.first.kind = r.second.kind;
+        s.first.value += r.second.value;
+        s.second++;
+    }
+}
+
+void KisTimeseries::SealSegment(tier& in_tier) {
+    string out;
+
+    ktss_header hdr;
+    memset(&hdr, 0, sizeof(ktss_header));
+    memcpy(hdr.magic, KTSS_MAGIC, 8);
+    hdr.version = KTSS_VERSION;
+    hdr.flags = ktss_native_flags();
+    hdr.interval = in_tier.interval;
+    hdr.num_rows = in_tier.times.size();
+    hdr.num_series = in_tier.columns.size();
+    hdr.start = in_tier.seg_start;
+
+    out.append((const char *) &hdr, sizeof(ktss_header));
+
+    vector<int64_t> times(in_tier.times.begin(), in_tier.times.end());
+    string tcol = kts_encode_column(times, in_tier.seg_start);
+
+    kts_put<uint32_t>(out, tcol.length());
+    out += tcol;
+
+    for (auto c : in_tier.columns) {
+        uint16_t len = c.first.length() > 0xFFFF ? 0xFFFF : c.first.length();
+        string col = kts_encode_column(c.second.values, 0);
+
+        kts_put<uint16_t>(out, len);
+        out.append(c.first.data(), len);
+        kts_put<uint8_t>(out, c.second.kind);
+        kts_put<uint32_t>(out, col.length());
+        out += col;
+    }
+
+    std::stringstream ss;
+    ss << ts_dir << "/" << in_tier.name << "-" << in_tier.seg_start << ".seg";
+    string path = ss.str();
+    string tmp_path = path + ".tmp";
+
+    std::ofstream ofs(tmp_path.c_str(), std::ios::binary | std::ios::trunc);
+
+    ofs.write(out.data(), out.length());
+    ofs.close();
+
+    // Replace it in one step so a crash never leaves a partial segment; the
+    // log is only started over once the segment is in place
+    if (ofs.fail() || rename(tmp_path.c_str(), path.c_str()) < 0) {
+        _MSG("Could not save timeseries segment '" + path + "': " +
+                string(strerror(errno)), MSGFLAG_ERROR);
+        unlink(tmp_path.c_str());
+    } else {
+        in_tier.sealed[in_tier.seg_start] = path;
+    }
+
+    in_tier.times.clear();
+    in_tier.columns.clear();
+
+    OpenLog(in_tier, true);
+
+    ExpireSegments(in_tier, globalreg->timestamp.tv_sec);
+}
+
+void KisTimeseries::ExpireSegments(tier& in_tier, time_t in_now) {
+    if (in_tier.retention == 0)
+        return;
+
+    while (in_tier.sealed.size() != 0) {
+        auto s = in_tier.sealed.begin();
+
+        if (s->first + in_tier.span >= in_now - in_tier.retention)
+            break;
+
+        unlink(s->second.c_str());
+        in_tier.sealed.erase(s);
+    }
+}
+
+void KisTimeseries::LoadTier(tier& in_tier) {
+    DIR *dir;
+    struct dirent *ent;
+
+    if ((dir = opendir(ts_dir.c_str())) == NULL)
+        return;
+
+    string prefix = in_tier.name + "-";
+
+    while ((ent = readdir(dir)) != NULL) {
+        string fname = ent->d_name;
+        unsigned long long start;
+        char suffix[8];
+
+        if (fname.compare(0, prefix.length(), prefix) != 0)
+            continue;
+
+        if (sscanf(fname.c_str() + prefix.length(), "%llu.%7s", &start, suffix) != 2 ||
+                strcmp(suffix, "seg") != 0)
+            continue;
+
+        in_tier.sealed[(time_t) start] = ts_dir + "/" + fname;
+    }
+
+    closedir(dir);
+
+    ExpireSegments(in_tier, globalreg->timestamp.tv_sec);
+}
+
+void KisTimeseries::OpenLog(tier& in_tier, bool in_truncate) {
+    if (in_tier.log_file != NULL)
+        fclose(in_tier.log_file);
+
+    if ((in_tier.log_file = fopen(in_tier.log_path.c_str(), in_truncate ? "wb" : "ab")) == NULL)
+        _MSG("Could not open timeseries log '" + in_tier.log_path + "': " +
+                string(strerror(errno)) + "; the open " + in_tier.name + " segment "
+                "will be lost on restart", MSGFLAG_ERROR);
+}
+
+/* Open segment log
+ *
+ * One record per row, in the native byte order:
+ *
+ *   uint32 length, uint32 crc32 of the payload
+ *   int64 time, uint32 values, { uint16 length, name, uint8 kind, int64 value }
+ *
+ * A record which is short or fails its checksum was torn by a crash, and ends
+ * the log.
+ */
+void KisTimeseries::WriteLogRow(tier& in_tier, time_t in_ts, const sample_row& in_row) {
+    if (in_tier.log_file == NULL)
+        return;
+
+    string payload;
+
+    kts_put<int64_t>(payload, in_ts);
+    kts_put<uint32_t>(payload, in_row.size());
+
+    for (auto r : in_row) {
+        uint16_t len = r.first.length() > 0xFFFF ? 0xFFFF : r.first.length();
+
+        kts_put<uint16_t>(payload, len);
+        payload.append(r.first.data(), len);
+        kts_put<uint8_t>(payload, r.second.kind);
+        kts_put<int64_t>(payload, r.second.value);
+    }
+
+    string rec;
+    kts_put<uint32_t>(rec, payload.length());
+    kts_put<uint32_t>(rec, crc32(0L, (const Bytef *) payload.data(), payload.length()));
+    rec += payload;
+
+    if (fwrite(rec.data(), rec.length(), 1, in_tier.log_file) != 1 ||
+            fflush(in_tier.log_file) != 0) {
+        _MSG("Could not write timeseries log '" + in_tier.log_path + "': " +
+                string(strerror(errno)), MSGFLAG_ERROR);
+        fclose(in_tier.log_file);
+        in_tier.log_file = NULL;
+    }
+}
+
+void KisTimeseries::ReplayLog(size_t in_tier) {
+    tier& t = tiers[in_tier];
+
+    std::ifstream ifs(t.log_path.c_str(), std::ios::binary);
+
+    if (!ifs.is_open())
+        return;
+
+    std::stringstream ss;
+    ss << ifs.rdbuf();
+    string contents = ss.str();
+
+    const uint8_t *data = (const uint8_t *) contents.data();
+    size_t len = contents.length();
+    size_t pos = 0;
+
+    while (pos < len) {
+        uint32_t plen, crc;
+
+        if (!kts_get<uint32_t>(data, len, &pos, &plen) ||
+                !kts_get<uint32_t>(data, len, &pos, &crc) ||
+                len - pos < plen ||
+                crc32(0L, (const Bytef *) data + pos, plen) != crc)
+            break;
+
+        const uint8_t *pdata = data + pos;
+        size_t ppos = 0;
+        int64_t ts;
+        uint32_t count;
+        sample_row row;
+        bool valid = true;
+
+        pos += plen;
+
+        if (!kts_get<int64_t>(pdata, plen, &ppos, &ts) ||
+                !kts_get<uint32_t>(pdata, plen, &ppos, &count))
+            break;
+
+        for (uint32_t x = 0; x < count && valid; x++) {
+            uint16_t nlen;
+            series_value v;
+
+            if (!kts_get<uint16_t>(pdata, plen, &ppos, &nlen) || plen - ppos < nlen) {
+                valid = false;
+                break;
+            }
+
+            string name((const char *) pdata + ppos, nlen);
+            ppos += nlen;
+
+            if (!kts_get<uint8_t>(pdata, plen, &ppos, &v.kind) ||
+                    !kts_get<int64_t>(pdata, plen, &ppos, &v.value)) {
+                valid = false;
+                break;
+            }
+
+            row[name] = v;
+        }
+
+        if (!valid)
+            break;
+
+        // Rows were downsampled when they were logged; the open buckets are
+        // rebuilt afterwards
+        AddRow(in_tier, (time_t) ts, row, false);
+    }
+
+    // A segment which ended while we were stopped is sealed by the next row,
+    // once the bucket it was building has been finished
+}
+
+void KisTimeseries::RebuildAccum(size_t in_tier) {
+    tier& t = tiers[in_tier];
+    tier& next = tiers[in_tier + 1];
+
+    t.accum = tier_accum();
+
+    if (t.times.size() == 0)
+        return;
+
+    time_t bucket = t.times.back() - (t.times.back() % next.interval);
+
+    // Already finished
+    if (next.times.size() != 0 && next.times.back() >= bucket)
+        return;
+
+    t.accum.bucket = bucket;
+
+    for (size_t r = 0; r < t.times.size(); r++) {
+        if (t.times[r] < bucket)
+            continue;
+
+        for (auto c : t.columns) {
+            auto& s = t.accum.sums[c.first];
+
+            s.first.kind = c.second.kind;
+            s.first.value += c.second.values[r];
+            s.second++;
+        }
+    }
+}
+
+bool KisTimeseries::ReadSealedSeries(const string& in_path, const string& in_series,
+        time_t in_start, time_t in_end, vector<pair<time_t, int64_t> > *ret_samples) {
+
+    std::ifstream ifs(in_path.c_str(), std::ios::binary);
+
+    if (!ifs.is_open())
+        return false;
+
+    std::stringstream ss;
+    ss << ifs.rdbuf();
+    string contents = ss.str();
+
+    const uint8_t *data = (const uint8_t *) contents.data();
+    size_t len = contents.length();
+    size_t pos = 0;
+
+    ktss_header hdr;
+
+    if (!kts_get<ktss_header>(data, len, &pos, &hdr) ||
+            memcmp(hdr.magic, KTSS_MAGIC, 8) != 0 ||
+            hdr.version != KTSS_VERSION || hdr.flags != ktss_native_flags())
+        return false;
+
+    uint32_t clen;
+    vector<int64_t> times;
+
+    if (!kts_get<uint32_t>(data, len, &pos, &clen) || len - pos < clen ||
+            !kts_decode_column(data + pos, clen, hdr.num_rows, hdr.start, &times))
+        return false;
+
+    pos += clen;
+
+    // Skip the columns of the other series without decoding them
+    for (uint32_t s = 0; s < hdr.num_series; s++) {
+        uint16_t nlen;
+        uint8_t kind;
+
+        if (!kts_get<uint16_t>(data, len, &pos, &nlen) || len - pos < nlen)
+            return false;
+
+        string name((const char *) data + pos, nlen);
+        pos += nlen;
+
+        if (!kts_get<uint8_t>(data, len, &pos, &kind) ||
+                !kts_get<uint32_t>(data, len, &pos, &clen) || len - pos < clen)
+            return false;
+
+        if (name != in_series) {
+            pos += clen;
+            continue;
+        }
+
+        vector<int64_t> values;
+
+        if (!kts_decode_column(data + pos, clen, hdr.num_rows, 0, &values))
+            return false;
+
+        for (uint32_t r = 0; r < hdr.num_rows; r++) {
+            if (times[r] >= in_start && times[r] <= in_end)
+                ret_samples->push_back(std::make_pair((time_t) times[r], values[r]));
+        }
+
+        return true;
+    }
+
+    return true;
+}
+
+void KisTimeseries::QuerySeries(const tier& in_tier, const string& in_series,
+        time_t in_start, time_t in_end, vector<pair<time_t, int64_t> > *ret_samples) {
+
+    for (auto s : in_tier.sealed) {
+        if (s.first + in_tier.span <= in_start || s.first > in_end)
+            continue;
+
+        ReadSealedSeries(s.second, in_series, in_start, in_end, ret_samples);
+    }
+
+    auto ci = in_tier.columns.find(in_series);
+
+    if (ci == in_tier.columns.end())
+        return;
+
+    for (size_t r = 0; r < in_tier.times.size(); r++) {
+        if (in_tier.times[r] >= in_start && in_tier.times[r] <= in_end)
+            ret_samples->push_back(std::make_pair(in_tier.times[r], ci->second.values[r]));
+    }
+}
+
+bool KisTimeseries::ParseQueryPath(const char *path, string *series, string *tiername,
+        time_t *start, time_t *end) {
+    vector<string> tokenurl = StrTokenize(path, "/");
+
+    // "", timeseries, series, tier, start, end, samples.suffix
+    if (tokenurl.size() != 7 || tokenurl[1] != "timeseries")
+        return false;
+
+    if (Httpd_StripSuffix(tokenurl[6]) != "samples")
+        return false;
+
+    unsigned long long s, e;
+
+    if (sscanf(tokenurl[4].c_str(), "%llu", &s) != 1 ||
+            sscanf(tokenurl[5].c_str(), "%llu", &e) != 1)
+        return false;
+
+    *series = tokenurl[2];
+    *tiername = tokenurl[3];
+    *start = (time_t) s;
+    *end = (time_t) e;
+
+    if (*tiername == "auto")
+        return true;
+
+    for (auto& t : tiers) {
+        if (t.name == *tiername)
+            return true;
+    }
+
+    return false;
+}
+
+bool KisTimeseries::Httpd_VerifyPath(const char *path, const char *method) {
+    if (strcmp(method, "GET") != 0)
+        return false;
+
+    if (Httpd_StripSuffix(path) == "/timeseries/series")
+        return Httpd_CanSerialize(path);
+
+    string series, tiername;
+    time_t start, end;
+
+    if (!ParseQueryPath(path, &series, &tiername, &start, &end))
+        return false;
+
+    return Httpd_CanSerialize(path);
+}
+
+void KisTimeseries::Httpd_CreateStreamResponse(
+        Kis_Net_Httpd *httpd __attribute__((unused)),
+        Kis_Net_Httpd_Connection *connection __attribute__((unused)),
+        const char *path, const char *method,
+        const char *upload_data __attribute__((unused)),
+        size_t *upload_data_size __attribute__((unused)),
+        std::stringstream &stream) {
+
+    if (strcmp(method, "GET") != 0)
+        return;
+
+    SharedTrackerElement e;
+
+    if (Httpd_StripSuffix(path) == "/timeseries/series") {
+        SharedTrackerElement list(new TrackerElement(TrackerVector, series_list_id));
+        std::set<string> names;
+
+        {
+            std::lock_guard<std::mutex> lk(ts_mutex);
+
+            for (auto& t : tiers) {
+                for (auto c : t.columns)
+                    names.insert(c.first);
+            }
+        }
+
+        for (auto n : names) {
+            e.reset(new TrackerElement(TrackerString, series_name_id));
+            e->set(n);
+            list->add_vector(e);
+        }
+
+        Httpd_Serialize(path, stream, list);
+        return;
+    }
+
+    string series, tiername;
+    time_t start, end;
+
+    if (!ParseQueryPath(path, &series, &tiername, &start, &end))
+        return;
+
+    vector<pair<time_t, int64_t> > samples;
+    time_t interval = 0;
+
+    {
+        std::lock_guard<std::mutex> lk(ts_mutex);
+
+        if (tiers.size() == 0)
+            return;
+
+        size_t ti = tiers.size() - 1;
+
+        for (size_t t = 0; t < tiers.size(); t++) {
+            if (tiername == "auto") {
+                time_t now = globalreg->timestamp.tv_sec;
+
+                if (tiers[t].retention == 0 || now - tiers[t].retention <= start) {
+                    ti = t;
+                    break;
+                }
+            } else if (tiers[t].name == tiername) {
+                ti = t;
+                break;
+            }
+        }
+
+        tiername = tiers[ti].name;
+        interval = tiers[ti].interval;
+
+        QuerySeries(tiers[ti], series, start, end, &samples);
+    }
+
+    SharedTrackerElement s(new TrackerElement(TrackerMap, samples_id));
+
+    e.reset(new TrackerElement(TrackerString, samples_series_id));
+    e->set(series);
+    s->add_map(e);
+
+    e.reset(new TrackerElement(TrackerString, samples_tier_id));
+    e->set(tiername);
+    s->add_map(e);
+
+    e.reset(new TrackerElement(TrackerUInt64, samples_interval_id));
+    e->set((uint64_t) interval);
+    s->add_map(e);
+
+    SharedTrackerElement values(new TrackerElement(TrackerVector, samples_values_id));
+    s->add_map(values);
+
+    for (auto v : samples) {
+        SharedTrackerElement sv(new TrackerElement(TrackerVector));
+
+        e.reset(new TrackerElement(TrackerUInt64));
+        e->set((uint64_t) v.first);
+        sv->add_vector(e);
+
+        e.reset(new TrackerElement(TrackerInt64));
+        e->set((int64_t) v.second);
+        sv->add_vector(e);
+
+        values->add_vector(sv);
+    }
+
+    Httpd_Serialize(path, stream, s);
+}
+
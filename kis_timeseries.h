@@ -0,0 +1,187 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __KIS_TIMESERIES_H__
+#define __KIS_TIMESERIES_H__
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "globalregistry.h"
+#include "macaddr.h"
+#include "kis_net_microhttpd.h"
+
+// Long-term history on disk
+//
+// The RRDs of the tracker only reach back a day.  With 'timeseries=true', the
+// packet counts of the server and of every phy, the packets, bytes, and airtime
+// seen on every frequency, the number of devices, and the packets and signal of the
+// devices listed in 'timeseries_device' are sampled every minute and kept in
+// 'timeseries_dir' in three tiers:
+//
+//  minute      one sample a minute, segments of a day, kept for
+//              'timeseries_minute_days'
+//  hour        the minutes of each hour, segments of 30 days, kept for
+//              'timeseries_hour_days'
+//  day         the hours of each day, segments of 360 days, kept forever
+//
+// Counters are recorded as the increase over each sample and add up when a
+// tier is downsampled; gauges are recorded as they are and averaged.
+//
+// The open segment of each tier is kept in memory and in an append-only log,
+// one row per sample; when a sample falls past the end of the segment, it is
+// written out as a sealed segment with a column of zigzag varint deltas for
+// the timestamps and for each series (see README.DEV.SERIALIZATION), and the
+// log starts over.  A query only decodes the column of the series it asks for.
+//
+// Series are listed at
+//  /timeseries/series.json
+// and samples in a range of unix times are served at
+//  /timeseries/[series]/[tier]/[start]/[end]/samples.json
+// where tier is minute, hour, day, or auto for the finest tier which still
+// holds the start of the range.
+class KisTimeseries : public LifetimeGlobal, public Kis_Net_Httpd_CPPStream_Handler {
+public:
+    // Returns NULL unless timeseries is enabled
+    static shared_ptr<KisTimeseries> create_timeseries(GlobalRegistry *in_globalreg);
+
+private:
+    KisTimeseries(GlobalRegistry *in_globalreg);
+
+public:
+    virtual ~KisTimeseries();
+
+    virtual bool Httpd_VerifyPath(const char *path, const char *method);
+
+    virtual void Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd,
+            Kis_Net_Httpd_Connection *connection,
+            const char *url, const char *method, const char *upload_data,
+            size_t *upload_data_size, std::stringstream &stream);
+
+protected:
+    GlobalRegistry *globalreg;
+
+    enum series_kind {
+        kind_counter = 0,
+        kind_gauge = 1
+    };
+
+    struct series_value {
+        uint8_t kind;
+        int64_t value;
+    };
+
+    // One sample of every series
+    typedef std::map<string, series_value> sample_row;
+
+    struct series_column {
+        uint8_t kind;
+        vector<int64_t> values;
+    };
+
+    // Downsampled rows being built for the next tier
+    struct tier_accum {
+        tier_accum() : bucket(-1) { }
+
+        time_t bucket;
+        std::map<string, pair<series_value, uint64_t> > sums;
+    };
+
+    struct tier {
+        string name;
+        time_t interval;
+        time_t span;
+
+        // Seconds sealed segments are kept, or 0 for forever
+        time_t retention;
+
+        // Sealed segments by start time
+        std::map<time_t, string> sealed;
+
+        // Open segment, with one value per row in every column; series without
+        // a value in a row are 0
+        time_t seg_start;
+        vector<time_t> times;
+        std::map<string, series_column> columns;
+
+        string log_path;
+        FILE *log_file;
+
+        // Rows of this tier being downsampled into the next
+        tier_accum accum;
+    };
+
+    std::mutex ts_mutex;
+
+    string ts_dir;
+    vector<tier> tiers;
+
+    int sample_timer;
+
+    // Last reading of every counter, to record the increase
+    std::map<string, uint64_t> last_counter;
+
+    vector<mac_addr> watch_devices;
+
+    int series_list_id, series_name_id;
+    int samples_id, samples_series_id, samples_tier_id, samples_interval_id,
+        samples_values_id;
+
+    // Read the sources and add the row to the minute tier
+    void Sample();
+    void CollectRow(sample_row *ret_row);
+
+    // Add a row to a tier, sealing the open segment if the row is past it, and
+    // downsample it into the next tier; must hold ts_mutex
+    void AddRow(size_t in_tier, time_t in_ts, const sample_row& in_row, bool in_log);
+    void AppendRow(tier& in_tier, time_t in_ts, const sample_row& in_row);
+    void Downsample(size_t in_tier, time_t in_ts, const sample_row& in_row);
+
+    void SealSegment(tier& in_tier);
+    void ExpireSegments(tier& in_tier, time_t in_now);
+
+    // Startup:  find the sealed segments, replay the open logs, and rebuild the
+    // downsampling of the rows already in each open segment
+    void LoadTier(tier& in_tier);
+    void ReplayLog(size_t in_tier);
+    void RebuildAccum(size_t in_tier);
+
+    void OpenLog(tier& in_tier, bool in_truncate);
+    void WriteLogRow(tier& in_tier, time_t in_ts, const sample_row& in_row);
+
+    // Samples of one series from one tier, in time order
+    void QuerySeries(const tier& in_tier, const string& in_series, time_t in_start,
+            time_t in_end, vector<pair<time_t, int64_t> > *ret_samples);
+    bool ReadSealedSeries(const string& in_path, const string& in_series,
+            time_t in_start, time_t in_end, vector<pair<time_t, int64_t> > *ret_samples);
+
+    // Parse /timeseries/[series]/[tier]/[start]/[end]/samples.suffix
+    bool ParseQueryPath(const char *path, string *series, string *tiername,
+            time_t *start, time_t *end);
+};
+
+#endif
+
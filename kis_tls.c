@@ -0,0 +1,439 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "kis_tls.h"
+
+#ifdef HAVE_OPENSSL
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+struct kis_tls_ctx {
+    SSL_CTX *ctx;
+    int server;
+    int verify;
+
+    /* Last session a client was given, offered on its next connection */
+    SSL_SESSION *session;
+};
+
+struct kis_tls_conn {
+    SSL *ssl;
+    int want_write;
+
+    /* A connection which failed must not send a close notification */
+    int failed;
+
+    char err[256];
+};
+
+static void kis_tls_errstr(char *errstr, size_t errstr_len, const char *what) {
+    unsigned long e = ERR_get_error();
+    char ebuf[200];
+
+    if (errstr == NULL || errstr_len == 0) {
+        ERR_clear_error();
+        return;
+    }
+
+    if (e != 0) {
+        ERR_error_string_n(e, ebuf, sizeof(ebuf));
+        snprintf(errstr, errstr_len, "%s: %s", what, ebuf);
+    } else {
+        snprintf(errstr, errstr_len, "%s", what);
+    }
+
+    ERR_clear_error();
+}
+
+/* Client sessions, including TLS 1.3 tickets which arrive after the
+ * handshake, are kept by the context for the next connection */
+static int kis_tls_new_session(SSL *ssl, SSL_SESSION *sess) {
+    kis_tls_ctx_t *ctx = (kis_tls_ctx_t *) SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+
+    if (ctx == NULL)
+        return 0;
+
+    if (ctx->session != NULL)
+        SSL_SESSION_free(ctx->session);
+
+    ctx->session = sess;
+
+    return 1;
+}
+
+static kis_tls_ctx_t *kis_tls_ctx_new(int in_server, char *errstr, size_t errstr_len) {
+    kis_tls_ctx_t *ctx;
+    SSL_CTX *sctx;
+
+    OPENSSL_init_ssl(0, NULL);
+
+    sctx = SSL_CTX_new(in_server ? TLS_server_method() : TLS_client_method());
+
+    if (sctx == NULL) {
+        kis_tls_errstr(errstr, errstr_len, "Could not create TLS context");
+        return NULL;
+    }
+
+    SSL_CTX_set_min_proto_version(sctx, TLS1_2_VERSION);
+
+    /* Writes come straight out of ring buffers:  a write may go out in
+     * parts, and is retried from wherever the buffer has it after more was
+     * added */
+    SSL_CTX_set_mode(sctx, SSL_MODE_ENABLE_PARTIAL_WRITE | 
+            SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+#ifdef SSL_OP_ENABLE_KTLS
+    SSL_CTX_set_options(sctx, SSL_OP_ENABLE_KTLS);
+#endif
+
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    /* A capture link dropping without a close notification is just closed */
+    SSL_CTX_set_options(sctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+
+    ctx = (kis_tls_ctx_t *) calloc(1, sizeof(kis_tls_ctx_t));
+
+    if (ctx == NULL) {
+        SSL_CTX_free(sctx);
+        snprintf(errstr, errstr_len, "Could not allocate TLS context");
+        return NULL;
+    }
+
+    ctx->ctx = sctx;
+    ctx->server = in_server;
+
+    SSL_CTX_set_app_data(sctx, ctx);
+
+    return ctx;
+}
+
+kis_tls_ctx_t *kis_tls_server_ctx(const char *in_cert, const char *in_key,
+        char *errstr, size_t errstr_len) {
+    kis_tls_ctx_t *ctx = kis_tls_ctx_new(1, errstr, errstr_len);
+
+    if (ctx == NULL)
+        return NULL;
+
+    if (SSL_CTX_use_certificate_chain_file(ctx->ctx, in_cert) != 1) {
+        kis_tls_errstr(errstr, errstr_len, "Could not load TLS certificate");
+        kis_tls_ctx_free(ctx);
+        return NULL;
+    }
+
+    if (SSL_CTX_use_PrivateKey_file(ctx->ctx, in_key, SSL_FILETYPE_PEM) != 1 ||
+            SSL_CTX_check_private_key(ctx->ctx) != 1) {
+        kis_tls_errstr(errstr, errstr_len, "Could not load TLS key");
+        kis_tls_ctx_free(ctx);
+        return NULL;
+    }
+
+    /* Resumption by session id for TLS 1.2, and by ticket for both */
+    SSL_CTX_set_session_cache_mode(ctx->ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_session_id_context(ctx->ctx, (const unsigned char *) "kismet-remote", 13);
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+    /* A sensor only needs the latest ticket to reconnect */
+    SSL_CTX_set_num_tickets(ctx->ctx, 1);
+#endif
+
+    return ctx;
+}
+
+kis_tls_ctx_t *kis_tls_client_ctx(const char *in_ca, int in_verify,
+        char *errstr, size_t errstr_len) {
+    kis_tls_ctx_t *ctx = kis_tls_ctx_new(0, errstr, errstr_len);
+    int r;
+
+    if (ctx == NULL)
+        return NULL;
+
+    ctx->verify = in_verify;
+
+    if (in_verify) {
+        if (in_ca != NULL)
+            r = SSL_CTX_load_verify_locations(ctx->ctx, in_ca, NULL);
+        else
+            r = SSL_CTX_set_default_verify_paths(ctx->ctx);
+
+        if (r != 1) {
+            kis_tls_errstr(errstr, errstr_len, "Could not load TLS CA certificates");
+            kis_tls_ctx_free(ctx);
+            return NULL;
+        }
+
+        SSL_CTX_set_verify(ctx->ctx, SSL_VERIFY_PEER, NULL);
+    } else {
+        SSL_CTX_set_verify(ctx->ctx, SSL_VERIFY_NONE, NULL);
+    }
+
+    SSL_CTX_set_session_cache_mode(ctx->ctx, 
+            SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx->ctx, kis_tls_new_session);
+
+    return ctx;
+}
+
+void kis_tls_ctx_free(kis_tls_ctx_t *ctx) {
+    if (ctx == NULL)
+        return;
+
+    if (ctx->session != NULL)
+        SSL_SESSION_free(ctx->session);
+
+    SSL_CTX_free(ctx->ctx);
+
+    free(ctx);
+}
+
+kis_tls_conn_t *kis_tls_conn_new(kis_tls_ctx_t *ctx, int in_fd, int in_server,
+        const char *in_host) {
+    kis_tls_conn_t *conn;
+    unsigned char addr[16];
+    int is_ip;
+
+    conn = (kis_tls_conn_t *) calloc(1, sizeof(kis_tls_conn_t));
+
+    if (conn == NULL)
+        return NULL;
+
+    conn->ssl = SSL_new(ctx->ctx);
+
+    if (conn->ssl == NULL || SSL_set_fd(conn->ssl, in_fd) != 1) {
+        if (conn->ssl != NULL)
+            SSL_free(conn->ssl);
+        free(conn);
+        ERR_clear_error();
+        return NULL;
+    }
+
+    if (in_server) {
+        SSL_set_accept_state(conn->ssl);
+        return conn;
+    }
+
+    SSL_set_connect_state(conn->ssl);
+
+    if (in_host != NULL) {
+        is_ip = inet_pton(AF_INET, in_host, addr) == 1 ||
+            inet_pton(AF_INET6, in_host, addr) == 1;
+
+        /* Names go in the SNI and are matched against the certificate names;
+         * an address is matched against the certificate addresses */
+        if (!is_ip)
+            SSL_set_tlsext_host_name(conn->ssl, in_host);
+
+        if (ctx->verify) {
+            if (is_ip)
+                X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(conn->ssl), in_host);
+            else
+                SSL_set1_host(conn->ssl, in_host);
+        }
+    }
+
+    if (ctx->session != NULL)
+        SSL_set_session(conn->ssl, ctx->session);
+
+    return conn;
+}
+
+void kis_tls_conn_free(kis_tls_conn_t *conn) {
+    if (conn == NULL)
+        return;
+
+    if (!conn->failed && SSL_is_init_finished(conn->ssl))
+        SSL_shutdown(conn->ssl);
+
+    SSL_free(conn->ssl);
+
+    ERR_clear_error();
+
+    free(conn);
+}
+
+/* Turn a failed call into the matching socket result */
+static ssize_t kis_tls_result(kis_tls_conn_t *conn, int r) {
+    int e = SSL_get_error(conn->ssl, r);
+
+    conn->want_write = 0;
+
+    switch (e) {
+        case SSL_ERROR_WANT_READ:
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_WANT_WRITE:
+            conn->want_write = 1;
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_SYSCALL:
+            conn->failed = 1;
+            ERR_clear_error();
+
+            /* End of file without a close notification */
+            if (errno == 0)
+                return 0;
+
+            snprintf(conn->err, sizeof(conn->err), "%s", strerror(errno));
+            return -1;
+        default:
+            conn->failed = 1;
+            kis_tls_errstr(conn->err, sizeof(conn->err), "TLS error");
+            errno = EIO;
+            return -1;
+    }
+}
+
+int kis_tls_handshake(kis_tls_conn_t *conn) {
+    int r;
+
+    ERR_clear_error();
+    errno = 0;
+
+    if ((r = SSL_do_handshake(conn->ssl)) == 1)
+        return 1;
+
+    if (kis_tls_result(conn, r) < 0 && errno == EAGAIN)
+        return 0;
+
+    if (conn->err[0] == 0)
+        snprintf(conn->err, sizeof(conn->err), "Connection closed during TLS handshake");
+
+    conn->failed = 1;
+
+    return -1;
+}
+
+ssize_t kis_tls_read(kis_tls_conn_t *conn, void *buf, size_t len) {
+    int r;
+
+    ERR_clear_error();
+    errno = 0;
+
+    if ((r = SSL_read(conn->ssl, buf, len > INT_MAX ? INT_MAX : (int) len)) > 0)
+        return r;
+
+    return kis_tls_result(conn, r);
+}
+
+ssize_t kis_tls_write(kis_tls_conn_t *conn, const void *buf, size_t len) {
+    int r;
+
+    ERR_clear_error();
+    errno = 0;
+
+    if ((r = SSL_write(conn->ssl, buf, len > INT_MAX ? INT_MAX : (int) len)) > 0)
+        return r;
+
+    return kis_tls_result(conn, r);
+}
+
+int kis_tls_want_write(kis_tls_conn_t *conn) {
+    return conn->want_write;
+}
+
+int kis_tls_resumed(kis_tls_conn_t *conn) {
+    return SSL_session_reused(conn->ssl);
+}
+
+const char *kis_tls_offload(kis_tls_conn_t *conn) {
+#if defined(BIO_get_ktls_send) && defined(BIO_get_ktls_recv)
+    int tx = BIO_get_ktls_send(SSL_get_wbio(conn->ssl));
+    int rx = BIO_get_ktls_recv(SSL_get_rbio(conn->ssl));
+
+    if (tx && rx)
+        return "tx+rx";
+    if (tx)
+        return "tx";
+    if (rx)
+        return "rx";
+#endif
+
+    return "none";
+}
+
+const char *kis_tls_error(kis_tls_conn_t *conn) {
+    return conn->err;
+}
+
+#else
+
+kis_tls_ctx_t *kis_tls_server_ctx(const char *in_cert, const char *in_key,
+        char *errstr, size_t errstr_len) {
+    snprintf(errstr, errstr_len, "Kismet was compiled without TLS support (OpenSSL)");
+    return NULL;
+}
+
+kis_tls_ctx_t *kis_tls_client_ctx(const char *in_ca, int in_verify,
+        char *errstr, size_t errstr_len) {
+    snprintf(errstr, errstr_len, "Kismet was compiled without TLS support (OpenSSL)");
+    return NULL;
+}
+
+void kis_tls_ctx_free(kis_tls_ctx_t *ctx) { }
+
+kis_tls_conn_t *kis_tls_conn_new(kis_tls_ctx_t *ctx, int in_fd, int in_server,
+        const char *in_host) {
+    return NULL;
+}
+
+void kis_tls_conn_free(kis_tls_conn_t *conn) { }
+
+int kis_tls_handshake(kis_tls_conn_t *conn) {
+    return -1;
+}
+
+ssize_t kis_tls_read(kis_tls_conn_t *conn, void *buf, size_t len) {
+    errno = EIO;
+    return -1;
+}
+
+ssize_t kis_tls_write(kis_tls_conn_t *conn, const void *buf, size_t len) {
+    errno = EIO;
+    return -1;
+}
+
+int kis_tls_want_write(kis_tls_conn_t *conn) {
+    return 0;
+}
+
+int kis_tls_resumed(kis_tls_conn_t *conn) {
+    return 0;
+}
+
+const char *kis_tls_offload(kis_tls_conn_t *conn) {
+    return "none";
+}
+
+const char *kis_tls_error(kis_tls_conn_t *conn) {
+    return "Kismet was compiled without TLS support (OpenSSL)";
+}
+
+#endif
+
@@ -0,0 +1,101 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __KIS_TLS_H__
+#define __KIS_TLS_H__
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * TLS for the remote capture link; shared by the server and the pure-C
+ * capture binaries.
+ *
+ * A connection wraps a nonblocking socket, and is read and written like one:
+ * kis_tls_read and kis_tls_write return the bytes moved, 0 when the other side
+ * closed the link, or -1 with errno set, EAGAIN when the socket would block,
+ * so callers keep the same error handling they use for plain sockets.  The
+ * handshake runs inside the first reads and writes, or can be driven with
+ * kis_tls_handshake.
+ *
+ * Sessions are resumable:  the server hands out session tickets, and a client
+ * context keeps the last session it was given and offers it on its next
+ * connection, so a sensor reconnecting after a dropped link skips the full
+ * handshake.
+ *
+ * Kernel TLS offload is asked for whenever the TLS library supports it; once
+ * the handshake is done the kernel encrypts and decrypts the records on the
+ * socket, and the library hands it the plain data instead of encrypting it
+ * into buffers of its own.  Where the kernel can't, records are encrypted in
+ * userspace as usual.
+ *
+ * Without OpenSSL, creating a context fails with an explanation.
+ */
+
+typedef struct kis_tls_ctx kis_tls_ctx_t;
+typedef struct kis_tls_conn kis_tls_conn_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Server context from a PEM certificate (chain) and key */
+kis_tls_ctx_t *kis_tls_server_ctx(const char *in_cert, const char *in_key,
+        char *errstr, size_t errstr_len);
+
+/* Client context; the server certificate is checked against in_ca, or the
+ * system trust store when in_ca is NULL, unless in_verify is 0 */
+kis_tls_ctx_t *kis_tls_client_ctx(const char *in_ca, int in_verify,
+        char *errstr, size_t errstr_len);
+
+void kis_tls_ctx_free(kis_tls_ctx_t *ctx);
+
+/* Wrap a connected socket; in_host is the name the server certificate has to
+ * match, for a client connection */
+kis_tls_conn_t *kis_tls_conn_new(kis_tls_ctx_t *ctx, int in_fd, int in_server,
+        const char *in_host);
+
+/* Send a close notification if the socket will take it, and free the
+ * connection; the socket is left open */
+void kis_tls_conn_free(kis_tls_conn_t *conn);
+
+/* Advance the handshake; 1 when it is done, 0 while it waits on the socket
+ * (kis_tls_want_write says for which), -1 on failure */
+int kis_tls_handshake(kis_tls_conn_t *conn);
+
+ssize_t kis_tls_read(kis_tls_conn_t *conn, void *buf, size_t len);
+ssize_t kis_tls_write(kis_tls_conn_t *conn, const void *buf, size_t len);
+
+/* The last call would block until the socket is writeable, rather than
+ * readable */
+int kis_tls_want_write(kis_tls_conn_t *conn);
+
+/* Completed handshake details:  whether the session was resumed, and which
+ * directions the kernel took over ("tx+rx", "tx", "rx", or "none") */
+int kis_tls_resumed(kis_tls_conn_t *conn);
+const char *kis_tls_offload(kis_tls_conn_t *conn);
+
+/* Reason for the last failure */
+const char *kis_tls_error(kis_tls_conn_t *conn);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -0,0 +1,517 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "kis_uring_file.h"
+
+KisUringFile::KisUringFile() {
+    fd = -1;
+    direct = false;
+    file_size = 0;
+    pending_error = 0;
+
+#ifdef HAVE_LIBURING
+    ring_init = false;
+    buf_sz = 0;
+    cur = 0;
+    unsubmitted = 0;
+    outstanding = 0;
+#endif
+}
+
+KisUringFile::~KisUringFile() {
+    close();
+}
+
+#ifdef HAVE_LIBURING
+
+bool KisUringFile::open(std::string in_fname, bool in_append, bool in_direct,
+        size_t in_buf_sz, unsigned int in_bufs) {
+    struct stat st;
+
+    if (fd >= 0) {
+        errno = EBUSY;
+        return false;
+    }
+
+    if (in_bufs < 2)
+        in_bufs = 2;
+
+    buf_sz = ((in_buf_sz + KIS_URING_DIRECT_ALIGN - 1) / KIS_URING_DIRECT_ALIGN) *
+        KIS_URING_DIRECT_ALIGN;
+
+    if (buf_sz == 0)
+        buf_sz = KIS_URING_DIRECT_ALIGN;
+
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+
+    if (!in_append)
+        flags |= O_TRUNC;
+
+    if ((fd = ::open(in_fname.c_str(), flags, 0644)) < 0)
+        return false;
+
+    if (fstat(fd, &st) < 0) {
+        int e = errno;
+        ::close(fd);
+        fd = -1;
+        errno = e;
+        return false;
+    }
+
+    file_size = st.st_size;
+
+    // Direct IO can only pick up from an aligned end of the file; otherwise
+    // write through the page cache
+    direct = false;
+
+    if (in_direct && (file_size % KIS_URING_DIRECT_ALIGN) == 0 &&
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_DIRECT) == 0)
+        direct = true;
+
+    int r;
+
+    if ((r = io_uring_queue_init(in_bufs * 2, &ring, 0)) < 0) {
+        ::close(fd);
+        fd = -1;
+        errno = -r;
+        return false;
+    }
+
+    ring_init = true;
+
+    bufs.resize(in_bufs);
+
+    std::vector<struct iovec> iov;
+    iov.resize(in_bufs);
+
+    for (unsigned int i = 0; i < in_bufs; i++) {
+        void *m;
+
+        if (posix_memalign(&m, KIS_URING_DIRECT_ALIGN, buf_sz) != 0) {
+            bufs.resize(i);
+            ::close(fd);
+            fd = -1;
+            close();
+            errno = ENOMEM;
+            return false;
+        }
+
+        bufs[i].data = (uint8_t *) m;
+        bufs[i].used = 0;
+        bufs[i].offset = 0;
+        bufs[i].inflight = 0;
+
+        iov[i].iov_base = m;
+        iov[i].iov_len = buf_sz;
+    }
+
+    if ((r = io_uring_register_buffers(&ring, iov.data(), in_bufs)) < 0) {
+        ::close(fd);
+        fd = -1;
+        close();
+        errno = -r;
+        return false;
+    }
+
+    cur = 0;
+    bufs[cur].offset = file_size;
+
+    unsubmitted = 0;
+    outstanding = 0;
+    pending_error = 0;
+
+    return true;
+}
+
+struct io_uring_sqe *KisUringFile::get_sqe() {
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+
+    // The queue is sized for every buffer and a sync, but submit and retry if
+    // it's somehow full
+    if (sqe == NULL && submit())
+        sqe = io_uring_get_sqe(&ring);
+
+    return sqe;
+}
+
+bool KisUringFile::queue_buf(unsigned int in_buf) {
+    uring_buf *b = &(bufs[in_buf]);
+    size_t len = b->used;
+
+    // Pad a partial direct block with zeroes; the padding is overwritten by
+    // the next write of this buffer, or truncated on close
+    if (direct) {
+        len = ((len + KIS_URING_DIRECT_ALIGN - 1) / KIS_URING_DIRECT_ALIGN) *
+            KIS_URING_DIRECT_ALIGN;
+        memset(b->data + b->used, 0, len - b->used);
+    }
+
+    struct io_uring_sqe *sqe = get_sqe();
+
+    if (sqe == NULL) {
+        errno = EAGAIN;
+        return false;
+    }
+
+    io_uring_prep_write_fixed(sqe, fd, b->data, len, b->offset, in_buf);
+    io_uring_sqe_set_data(sqe, (void *) (uintptr_t) in_buf);
+
+    b->inflight = len;
+
+    unsubmitted++;
+    outstanding++;
+
+    return true;
+}
+
+bool KisUringFile::submit() {
+    if (unsubmitted == 0)
+        return true;
+
+    int r = io_uring_submit(&ring);
+
+    if (r < 0) {
+        errno = -r;
+        return false;
+    }
+
+    unsubmitted = 0;
+
+    return true;
+}
+
+bool KisUringFile::reap(bool in_wait) {
+    struct io_uring_cqe *cqe;
+    int r;
+
+    while (outstanding != 0) {
+        if (in_wait)
+            r = io_uring_wait_cqe(&ring, &cqe);
+        else
+            r = io_uring_peek_cqe(&ring, &cqe);
+
+        if (r == -EAGAIN)
+            return true;
+
+        if (r == -EINTR)
+            continue;
+
+        if (r < 0) {
+            errno = -r;
+            return false;
+        }
+
+        uintptr_t user = (uintptr_t) io_uring_cqe_get_data(cqe);
+        int res = cqe->res;
+
+        io_uring_cqe_seen(&ring, cqe);
+        outstanding--;
+
+        // A sync has no buffer
+        if (user >= bufs.size()) {
+            if (res < 0)
+                pending_error = -res;
+            return true;
+        }
+
+        uring_buf *b = &(bufs[user]);
+
+        if (res < 0)
+            pending_error = -res;
+        else if ((size_t) res != b->inflight)
+            pending_error = EIO;
+
+        b->inflight = 0;
+
+        // The current buffer keeps a direct tail to write again later; any
+        // other buffer is free
+        if (user != cur)
+            b->used = 0;
+
+        // One completion is all a waiter needs
+        if (in_wait)
+            return true;
+    }
+
+    return true;
+}
+
+bool KisUringFile::wait_buf(unsigned int in_buf) {
+    if (!submit())
+        return false;
+
+    while (bufs[in_buf].inflight != 0) {
+        if (!reap(true))
+            return false;
+    }
+
+    return true;
+}
+
+bool KisUringFile::wait_all() {
+    if (!submit())
+        return false;
+
+    while (outstanding != 0) {
+        if (!reap(true))
+            return false;
+    }
+
+    return true;
+}
+
+ssize_t KisUringFile::write(const void *in_data, size_t in_sz) {
+    const uint8_t *data = (const uint8_t *) in_data;
+    size_t left = in_sz;
+
+    if (fd < 0) {
+        errno = EBADF;
+        return -1;
+    }
+
+    // Pick up anything which already finished without entering the kernel
+    reap(false);
+
+    if (pending_error != 0) {
+        errno = pending_error;
+        pending_error = 0;
+        return -1;
+    }
+
+    while (left != 0) {
+        uring_buf *b = &(bufs[cur]);
+
+        // A flushed direct tail may still be on its way out
+        if (b->inflight != 0 && !wait_buf(cur))
+            return -1;
+
+        size_t chunk = buf_sz - b->used;
+
+        if (chunk > left)
+            chunk = left;
+
+        memcpy(b->data + b->used, data, chunk);
+        b->used += chunk;
+        file_size += chunk;
+        data += chunk;
+        left -= chunk;
+
+        if (b->used < buf_sz)
+            break;
+
+        if (!queue_buf(cur))
+            return -1;
+
+        unsigned int next = (cur + 1) % bufs.size();
+        uint64_t next_offset = b->offset + buf_sz;
+
+        // Submit in batches of half the buffers, and whenever we have to wait
+        // for the next one
+        if (unsubmitted * 2 >= bufs.size() && !submit())
+            return -1;
+
+        cur = next;
+
+        if (bufs[cur].inflight != 0 && !wait_buf(cur))
+            return -1;
+
+        bufs[cur].used = 0;
+        bufs[cur].offset = next_offset;
+    }
+
+    return in_sz;
+}
+
+int KisUringFile::flush() {
+    if (fd < 0) {
+        errno = EBADF;
+        return -1;
+    }
+
+    uring_buf *b = &(bufs[cur]);
+
+    if (b->used != 0 && b->inflight == 0) {
+        if (!queue_buf(cur))
+            return -1;
+
+        // A page cache write can move on to a new buffer; a direct one keeps
+        // filling this one and writes it again
+        if (!direct) {
+            unsigned int next = (cur + 1) % bufs.size();
+            uint64_t next_offset = b->offset + b->used;
+
+            cur = next;
+
+            if (bufs[cur].inflight != 0 && !wait_buf(cur))
+                return -1;
+
+            bufs[cur].used = 0;
+            bufs[cur].offset = next_offset;
+        }
+    }
+
+    if (!wait_all())
+        return -1;
+
+    if (pending_error != 0) {
+        errno = pending_error;
+        pending_error = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+int KisUringFile::sync() {
+    if (flush() < 0)
+        return -1;
+
+    struct io_uring_sqe *sqe = get_sqe();
+
+    if (sqe == NULL) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    io_uring_prep_fsync(sqe, fd, 0);
+    io_uring_sqe_set_data(sqe, (void *) (uintptr_t) bufs.size());
+
+    unsubmitted++;
+    outstanding++;
+
+    if (!wait_all())
+        return -1;
+
+    if (pending_error != 0) {
+        errno = pending_error;
+        pending_error = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+int KisUringFile::close() {
+    int r = 0;
+
+    if (fd >= 0 && ring_init) {
+        if (flush() < 0)
+            r = -1;
+
+        // Cut off the padding of the last direct block
+        if (direct && ftruncate(fd, (off_t) file_size) < 0)
+            r = -1;
+    }
+
+    if (ring_init) {
+        io_uring_queue_exit(&ring);
+        ring_init = false;
+    }
+
+    for (auto& b : bufs)
+        free(b.data);
+
+    bufs.clear();
+
+    if (fd >= 0 && ::close(fd) < 0)
+        r = -1;
+
+    fd = -1;
+
+    return r;
+}
+
+static ssize_t uring_stream_write(void *cookie, const char *buf, size_t size) {
+    KisUringFile *f = (KisUringFile *) cookie;
+
+    if (f->write(buf, size) < 0)
+        return -1;
+
+    return size;
+}
+
+static int uring_stream_close(void *cookie) {
+    KisUringFile *f = (KisUringFile *) cookie;
+
+    int r = f->close();
+
+    delete f;
+
+    return r;
+}
+
+FILE *KisUringFile::fopen_stream(KisUringFile *in_file) {
+    cookie_io_functions_t funcs;
+
+    memset(&funcs, 0, sizeof(cookie_io_functions_t));
+    funcs.write = uring_stream_write;
+    funcs.close = uring_stream_close;
+
+    FILE *fp = fopencookie(in_file, "w", funcs);
+
+    // The file buffers everything already
+    if (fp != NULL)
+        setvbuf(fp, NULL, _IONBF, 0);
+
+    return fp;
+}
+
+#else
+
+bool KisUringFile::open(std::string in_fname __attribute__((unused)),
+        bool in_append __attribute__((unused)), bool in_direct __attribute__((unused)),
+        size_t in_buf_sz __attribute__((unused)), 
+        unsigned int in_bufs __attribute__((unused))) {
+    errno = ENOSYS;
+    return false;
+}
+
+ssize_t KisUringFile::write(const void *in_data __attribute__((unused)), 
+        size_t in_sz __attribute__((unused))) {
+    errno = EBADF;
+    return -1;
+}
+
+int KisUringFile::flush() {
+    errno = EBADF;
+    return -1;
+}
+
+int KisUringFile::sync() {
+    errno = EBADF;
+    return -1;
+}
+
+int KisUringFile::close() {
+    return 0;
+}
+
+FILE *KisUringFile::fopen_stream(KisUringFile *in_file __attribute__((unused))) {
+    return NULL;
+}
+
+#endif
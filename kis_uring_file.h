@@ -0,0 +1,124 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __KIS_URING_FILE_H__
+#define __KIS_URING_FILE_H__
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+// Alignment of every write to an O_DIRECT file
+#define KIS_URING_DIRECT_ALIGN      4096
+
+// Append-only log file written through io_uring
+//
+// Writes are copied into a few buffers registered with the ring.  A full buffer
+// becomes one fixed-buffer write at its offset in the file and the writer moves
+// on to the next; writes are submitted in batches, and the kernel is only
+// waited on for a free buffer, a flush, or a sync.
+//
+// With O_DIRECT every write is a whole number of aligned blocks.  A partial
+// block at the end is written padded on flush, written again once it has more
+// in it, and cut off when the file is closed.
+//
+// Only one thread may use a file at a time.  Without liburing, or when the
+// kernel can't make a ring, open() fails and callers use stdio instead.
+class KisUringFile {
+public:
+    KisUringFile();
+    ~KisUringFile();
+
+    // Open a file for writing, truncating it or appending to it, with in_bufs
+    // buffers of in_buf_sz bytes.  Returns false and sets errno on failure.
+    bool open(std::string in_fname, bool in_append, bool in_direct, 
+            size_t in_buf_sz, unsigned int in_bufs);
+
+    // Append data; returns in_sz, or -1 and sets errno on failure
+    ssize_t write(const void *in_data, size_t in_sz);
+
+    // Wait for everything written so far to reach the file; returns 0, or -1
+    // and sets errno on failure
+    int flush();
+
+    // Flush, then fsync the file
+    int sync();
+
+    // Flush and close the file
+    int close();
+
+    bool is_open() { return fd >= 0; }
+
+    // Size of the file once everything written has been flushed
+    uint64_t get_size() { return file_size; }
+
+    // Wrap an open file in a stdio stream, for writers such as libpcap which
+    // need a FILE.  The stream doesn't buffer and fflush() does nothing; flush
+    // the file itself.  Closing the stream closes and deletes the file.
+    // Returns NULL on failure.
+    static FILE *fopen_stream(KisUringFile *in_file);
+
+protected:
+    int fd;
+    bool direct;
+
+    // Logical size of the file, past anything padded by O_DIRECT
+    uint64_t file_size;
+
+    // Error from a completion, reported by the next call
+    int pending_error;
+
+#ifdef HAVE_LIBURING
+    struct io_uring ring;
+    bool ring_init;
+
+    struct uring_buf {
+        uint8_t *data;
+        // Bytes held, and where they go in the file
+        size_t used;
+        uint64_t offset;
+        // Bytes of the write in flight, 0 when idle
+        size_t inflight;
+    };
+
+    std::vector<uring_buf> bufs;
+    size_t buf_sz;
+    unsigned int cur;
+
+    // Writes prepared but not submitted yet, and submitted but not complete
+    unsigned int unsubmitted, outstanding;
+
+    bool queue_buf(unsigned int in_buf);
+    bool submit();
+    bool reap(bool in_wait);
+    bool wait_buf(unsigned int in_buf);
+    bool wait_all();
+    struct io_uring_sqe *get_sqe();
+#endif
+};
+
+#endif
+
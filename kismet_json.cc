@@ -770,3 +770,472 @@ vector<struct JSON_value *> JSON_dict_get_array(struct JSON_value *in_parent,
 	return v->value_array;
 }
 
+
+// Value of 4 hex digits, already validated by the parser
+static unsigned int json_hex4(const char *in_hex) {
+    unsigned int v = 0;
+
+    for (unsigned int x = 0; x < 4; x++) {
+        char c = in_hex[x];
+
+        v <<= 4;
+
+        if (c >= '0' && c <= '9')
+            v |= c - '0';
+        else if (c >= 'a' && c <= 'f')
+            v |= c - 'a' + 10;
+        else
+            v |= c - 'A' + 10;
+    }
+
+    return v;
+}
+
+bool JSON_tape::parse(const char *in_json, size_t in_len, string& error) {
+    json = in_json;
+    json_len = in_len;
+
+    tape.clear();
+    error = "";
+
+    size_t pos = skip_ws(0);
+
+    if (pos >= json_len || (json[pos] != '{' && json[pos] != '[')) {
+        error = "JSON expected a dictionary or array at position " + IntToString(pos);
+        return false;
+    }
+
+    if (!parse_value(pos, 0, error))
+        return false;
+
+    pos = skip_ws(pos);
+
+    if (pos != json_len) {
+        error = "JSON parser found end of JSON block before the end of the "
+            "data at " + IntToString(pos);
+        return false;
+    }
+
+    return true;
+}
+
+size_t JSON_tape::skip_ws(size_t in_pos) const {
+    while (in_pos < json_len && (json[in_pos] == ' ' || json[in_pos] == '\t' ||
+                json[in_pos] == '\n' || json[in_pos] == '\r'))
+        in_pos++;
+
+    return in_pos;
+}
+
+size_t JSON_tape::push_entry(tape_type in_type, size_t in_pos, size_t in_len) {
+    tape_entry e;
+
+    e.type = in_type;
+    e.escaped = false;
+    e.pos = in_pos;
+    e.len = in_len;
+    e.end = tape.size() + 1;
+    e.count = 0;
+
+    tape.push_back(e);
+
+    return tape.size() - 1;
+}
+
+bool JSON_tape::parse_value(size_t& pos, int depth, string& error) {
+    pos = skip_ws(pos);
+
+    if (pos >= json_len) {
+        error = "JSON unexpected end of data";
+        return false;
+    }
+
+    char c = json[pos];
+
+    if (c == '{' || c == '[') {
+        if (depth >= max_depth) {
+            error = "JSON nested too deeply at position " + IntToString(pos);
+            return false;
+        }
+
+        bool obj = (c == '{');
+        char close = obj ? '}' : ']';
+
+        size_t ci = push_entry(obj ? tape_object : tape_array, pos, 0);
+        size_t start = pos;
+
+        pos = skip_ws(pos + 1);
+
+        if (pos < json_len && json[pos] == close) {
+            pos++;
+        } else {
+            while (1) {
+                if (obj) {
+                    pos = skip_ws(pos);
+
+                    if (pos >= json_len || json[pos] != '"') {
+                        error = "JSON expected a symbol at position " + IntToString(pos);
+                        return false;
+                    }
+
+                    if (!parse_string(pos, error))
+                        return false;
+
+                    pos = skip_ws(pos);
+
+                    if (pos >= json_len || json[pos] != ':') {
+                        error = "JSON expected ':' at position " + IntToString(pos);
+                        return false;
+                    }
+
+                    pos++;
+                }
+
+                if (!parse_value(pos, depth + 1, error))
+                    return false;
+
+                tape[ci].count++;
+
+                pos = skip_ws(pos);
+
+                if (pos < json_len && json[pos] == ',') {
+                    pos++;
+                    continue;
+                }
+
+                if (pos < json_len && json[pos] == close) {
+                    pos++;
+                    break;
+                }
+
+                error = "JSON parser got unexpected data at " + IntToString(pos);
+                return false;
+            }
+        }
+
+        tape[ci].len = pos - start;
+        tape[ci].end = tape.size();
+
+        return true;
+    }
+
+    if (c == '"')
+        return parse_string(pos, error);
+
+    if (c == '-' || (c >= '0' && c <= '9'))
+        return parse_number(pos, error);
+
+    if (json_len - pos >= 4 && strncmp(json + pos, "true", 4) == 0) {
+        push_entry(tape_true, pos, 4);
+        pos += 4;
+        return true;
+    }
+
+    if (json_len - pos >= 5 && strncmp(json + pos, "false", 5) == 0) {
+        push_entry(tape_false, pos, 5);
+        pos += 5;
+        return true;
+    }
+
+    if (json_len - pos >= 4 && strncmp(json + pos, "null", 4) == 0) {
+        push_entry(tape_null, pos, 4);
+        pos += 4;
+        return true;
+    }
+
+    error = "Unexpected symbol '" + string(1, c) + "' at position " + IntToString(pos);
+    return false;
+}
+
+bool JSON_tape::parse_string(size_t& pos, string& error) {
+    size_t start = pos + 1;
+    bool escaped = false;
+
+    for (pos = start; pos < json_len; pos++) {
+        unsigned char c = json[pos];
+
+        if (c == '"') {
+            size_t ei = push_entry(tape_string, start, pos - start);
+            tape[ei].escaped = escaped;
+            pos++;
+            return true;
+        }
+
+        if (c < 0x20) {
+            error = "JSON control character in string at position " + IntToString(pos);
+            return false;
+        }
+
+        if (c == '\\') {
+            escaped = true;
+            pos++;
+
+            if (pos >= json_len)
+                break;
+
+            switch (json[pos]) {
+                case '"':
+                case '\\':
+                case '/':
+                case 'b':
+                case 'f':
+                case 'n':
+                case 'r':
+                case 't':
+                    break;
+                case 'u':
+                    if (json_len - pos < 5) {
+                        error = "JSON short unicode escape at position " + 
+                            IntToString(pos);
+                        return false;
+                    }
+
+                    for (unsigned int x = 1; x <= 4; x++) {
+                        if (!isxdigit(json[pos + x])) {
+                            error = "JSON invalid unicode escape at position " +
+                                IntToString(pos);
+                            return false;
+                        }
+                    }
+
+                    pos += 4;
+                    break;
+                default:
+                    error = "JSON invalid escape at position " + IntToString(pos);
+                    return false;
+            }
+        }
+    }
+
+    error = "JSON unterminated string at position " + IntToString(start - 1);
+    return false;
+}
+
+bool JSON_tape::parse_number(size_t& pos, string& error) {
+    size_t start = pos;
+
+    if (json[pos] == '-')
+        pos++;
+
+    if (pos >= json_len || !isdigit(json[pos])) {
+        error = "JSON invalid number at position " + IntToString(start);
+        return false;
+    }
+
+    while (pos < json_len && isdigit(json[pos]))
+        pos++;
+
+    if (pos < json_len && json[pos] == '.') {
+        pos++;
+
+        if (pos >= json_len || !isdigit(json[pos])) {
+            error = "JSON invalid number at position " + IntToString(start);
+            return false;
+        }
+
+        while (pos < json_len && isdigit(json[pos]))
+            pos++;
+    }
+
+    if (pos < json_len && (json[pos] == 'e' || json[pos] == 'E')) {
+        pos++;
+
+        if (pos < json_len && (json[pos] == '+' || json[pos] == '-'))
+            pos++;
+
+        if (pos >= json_len || !isdigit(json[pos])) {
+            error = "JSON invalid number at position " + IntToString(start);
+            return false;
+        }
+
+        while (pos < json_len && isdigit(json[pos]))
+            pos++;
+    }
+
+    push_entry(tape_number, start, pos - start);
+
+    return true;
+}
+
+bool JSON_tape::key_equals(size_t in_idx, const char *in_key, size_t in_len) const {
+    const tape_entry& e = tape[in_idx];
+
+    if (!e.escaped)
+        return e.len == in_len && memcmp(json + e.pos, in_key, in_len) == 0;
+
+    return get_string(in_idx) == string(in_key, in_len);
+}
+
+size_t JSON_tape::find(size_t in_obj, const char *in_key) const {
+    if (in_obj >= tape.size() || tape[in_obj].type != tape_object)
+        return npos;
+
+    size_t klen = strlen(in_key);
+
+    for (size_t k = in_obj + 1; k < tape[in_obj].end; k = tape[k + 1].end) {
+        if (key_equals(k, in_key, klen))
+            return k + 1;
+    }
+
+    return npos;
+}
+
+size_t JSON_tape::find(size_t in_obj, const string& in_key) const {
+    return find(in_obj, in_key.c_str());
+}
+
+bool JSON_tape::string_equals(size_t in_idx, const char *in_str, size_t in_len) const {
+    if (tape[in_idx].type != tape_string)
+        return false;
+
+    return key_equals(in_idx, in_str, in_len);
+}
+
+string JSON_tape::get_string(size_t in_idx) const {
+    const tape_entry& e = tape[in_idx];
+
+    switch (e.type) {
+        case tape_number:
+        case tape_true:
+        case tape_false:
+            return string(json + e.pos, e.len);
+        case tape_string:
+            break;
+        default:
+            return "";
+    }
+
+    if (!e.escaped)
+        return string(json + e.pos, e.len);
+
+    string ret;
+    ret.reserve(e.len);
+
+    for (size_t x = e.pos; x < e.pos + e.len; x++) {
+        if (json[x] != '\\') {
+            ret += json[x];
+            continue;
+        }
+
+        x++;
+
+        switch (json[x]) {
+            case 'b':
+                ret += '\b';
+                break;
+            case 'f':
+                ret += '\f';
+                break;
+            case 'n':
+                ret += '\n';
+                break;
+            case 'r':
+                ret += '\r';
+                break;
+            case 't':
+                ret += '\t';
+                break;
+            case 'u': {
+                unsigned int cp = json_hex4(json + x + 1);
+                x += 4;
+
+                // Combine a surrogate pair
+                if (cp >= 0xD800 && cp <= 0xDBFF && x + 6 < e.pos + e.len &&
+                        json[x + 1] == '\\' && json[x + 2] == 'u') {
+                    unsigned int lo = json_hex4(json + x + 3);
+
+                    if (lo >= 0xDC00 && lo <= 0xDFFF) {
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                        x += 6;
+                    }
+                }
+
+                if (cp < 0x80) {
+                    ret += (char) cp;
+                } else if (cp < 0x800) {
+                    ret += (char) (0xC0 | (cp >> 6));
+                    ret += (char) (0x80 | (cp & 0x3F));
+                } else if (cp < 0x10000) {
+                    ret += (char) (0xE0 | (cp >> 12));
+                    ret += (char) (0x80 | ((cp >> 6) & 0x3F));
+                    ret += (char) (0x80 | (cp & 0x3F));
+                } else {
+                    ret += (char) (0xF0 | (cp >> 18));
+                    ret += (char) (0x80 | ((cp >> 12) & 0x3F));
+                    ret += (char) (0x80 | ((cp >> 6) & 0x3F));
+                    ret += (char) (0x80 | (cp & 0x3F));
+                }
+
+                break;
+            }
+            default:
+                // Quote, backslash and slash are themselves
+                ret += json[x];
+                break;
+        }
+    }
+
+    return ret;
+}
+
+double JSON_tape::get_number(size_t in_idx, string& error) const {
+    const tape_entry& e = tape[in_idx];
+
+    error = "";
+
+    if (e.type == tape_true)
+        return 1.0f;
+
+    if (e.type == tape_false)
+        return 0.0f;
+
+    if (e.type == tape_number || (e.type == tape_string && !e.escaped)) {
+        // Numbers aren't terminated in the buffer; anything a valid number
+        // would fit in goes through a stack buffer
+        char buf[64];
+        double f;
+
+        if (e.len < sizeof(buf)) {
+            memcpy(buf, json + e.pos, e.len);
+            buf[e.len] = 0;
+
+            if (e.type == tape_string && strcmp(buf, "true") == 0)
+                return 1.0f;
+
+            if (e.type == tape_string && strcmp(buf, "false") == 0)
+                return 0.0f;
+
+            if (sscanf(buf, "%lf", &f) == 1)
+                return f;
+        }
+    }
+
+    error = "JSON expected a numerical value but didn't get one";
+    return 0.0f;
+}
+
+string JSON_tape::dict_get_string(size_t in_obj, const char *in_key, 
+        string& error) const {
+    size_t v = find(in_obj, in_key);
+
+    if (v == npos) {
+        error = "JSON no such key '" + string(in_key) + "' in dictionary";
+        return "";
+    }
+
+    error = "";
+
+    return get_string(v);
+}
+
+double JSON_tape::dict_get_number(size_t in_obj, const char *in_key, 
+        string& error) const {
+    size_t v = find(in_obj, in_key);
+
+    if (v == npos) {
+        error = "JSON no such key '" + string(in_key) + "' in dictionary";
+        return 0.0f;
+    }
+
+    return get_number(v, error);
+}
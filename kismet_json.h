@@ -131,33 +131,154 @@ bool JSON_dict_has_key(struct JSON_value *val, string in_key);
 // Example function which dumps to stdout a representation of the parsed JSON data
 void JSON_dump(struct JSON_value *jsonv, string key, int depth);
 
+// In-place JSON parser.
+//
+// JSON_tape tokenizes a buffer into a flat tape of entries referencing the
+// buffer, in document order; nothing is copied and nothing is allocated beyond
+// the tape itself, which keeps its capacity when a tape is re-used.  Lookups
+// walk the tape and compare keys against the buffer, and strings are only
+// copied (and unescaped) when fetched with get_string.
+//
+// A container entry is followed by its children and records the index just
+// past them, so whole sub-trees are skipped without being walked.  The children
+// of an object alternate key, value.
+//
+// The buffer must stay valid and unchanged as long as the tape is used.
+class JSON_tape {
+public:
+    enum tape_type {
+        tape_object, tape_array, tape_string, tape_number, 
+        tape_true, tape_false, tape_null
+    };
+
+    struct tape_entry {
+        tape_type type;
+
+        // Strings with escapes have to be unescaped when fetched
+        bool escaped;
+
+        // Location in the buffer; strings exclude the quotes
+        size_t pos, len;
+
+        // Index past this entry and all of its children
+        size_t end;
+
+        // Number of values in a container
+        size_t count;
+    };
+
+    static const size_t npos = (size_t) -1;
+
+    JSON_tape() : json(NULL), json_len(0) { }
+
+    // Parse a buffer; the top level must be an object or array, as with
+    // JSON_parse.  Returns false and sets error on failure.
+    bool parse(const char *in_json, size_t in_len, string& error);
+
+    size_t root() const { return 0; }
+    size_t size() const { return tape.size(); }
+
+    tape_type type(size_t in_idx) const { return tape[in_idx].type; }
+    size_t count(size_t in_idx) const { return tape[in_idx].count; }
+
+    bool is_object(size_t in_idx) const { return tape[in_idx].type == tape_object; }
+    bool is_array(size_t in_idx) const { return tape[in_idx].type == tape_array; }
+    bool is_string(size_t in_idx) const { return tape[in_idx].type == tape_string; }
+    bool is_number(size_t in_idx) const { return tape[in_idx].type == tape_number; }
+    bool is_bool(size_t in_idx) const { 
+        return tape[in_idx].type == tape_true || tape[in_idx].type == tape_false;
+    }
+
+    // Walking a container:  the first child of a non-empty container is the
+    // next entry, and children end at end(container)
+    size_t first_child(size_t in_idx) const { return in_idx + 1; }
+    size_t next(size_t in_idx) const { return tape[in_idx].end; }
+    size_t end(size_t in_idx) const { return tape[in_idx].end; }
+
+    // Index of the value of a key in an object, or npos.  If a key occurs more
+    // than once, the first is found.
+    size_t find(size_t in_obj, const char *in_key) const;
+    size_t find(size_t in_obj, const string& in_key) const;
+
+    bool has_key(size_t in_obj, const char *in_key) const {
+        return find(in_obj, in_key) != npos;
+    }
+
+    // Does a string entry equal a plain string, without copying it
+    bool string_equals(size_t in_idx, const char *in_str, size_t in_len) const;
+
+    // Strings are unescaped; numbers and bools return their text, as with
+    // JSON_get_string
+    string get_string(size_t in_idx) const;
+
+    // Numbers, bools (as 1 or 0), and strings holding numbers, as with
+    // JSON_get_number
+    double get_number(size_t in_idx, string& error) const;
+
+    // Fetch the value of a key in an object, as with JSON_dict_get_string and
+    // JSON_dict_get_number; error is set if there is no such key
+    string dict_get_string(size_t in_obj, const char *in_key, string& error) const;
+    double dict_get_number(size_t in_obj, const char *in_key, string& error) const;
+
+protected:
+    const char *json;
+    size_t json_len;
+
+    vector<tape_entry> tape;
+
+    // Nesting deeper than this is refused, which bounds the recursion
+    static const int max_depth = 64;
+
+    size_t skip_ws(size_t in_pos) const;
+    bool parse_value(size_t& pos, int depth, string& error);
+    bool parse_string(size_t& pos, string& error);
+    bool parse_number(size_t& pos, string& error);
+
+    size_t push_entry(tape_type in_type, size_t in_pos, size_t in_len);
+
+    bool key_equals(size_t in_idx, const char *in_key, size_t in_len) const;
+};
+
+// A parsed document:  the tape, and the copy of the text it references
+class JSON_tape_doc {
+public:
+    JSON_tape_doc() { }
+    JSON_tape_doc(const string& in_json) : json(in_json) { }
+
+    string json;
+    JSON_tape tape;
+};
+
+// StructuredData interface over a JSON tape; sub-structures share the parsed
+// document and refer to their entry in it
 class StructuredJson : public StructuredData {
 public:
     StructuredJson(string data) : StructuredData(data) {
-        json = JSON_parse(data, err);
+        doc = std::make_shared<JSON_tape_doc>(data);
 
-        if (json == NULL || err.length() != 0) {
+        if (!doc->tape.parse(doc->json.data(), doc->json.length(), err))
             throw StructuredDataUnparseable(err);
-        }
 
-        free_me = true;
+        idx = doc->tape.root();
     }
 
-    StructuredJson(struct JSON_value *in_json) {
-        free_me = false;
-        json = in_json;
-    }
+    // Parse a document which has already been filled in, without copying it
+    StructuredJson(shared_ptr<JSON_tape_doc> in_doc) {
+        doc = in_doc;
 
-    virtual ~StructuredJson() {
-        if (free_me && json != NULL)
-            JSON_delete(json);
+        if (!doc->tape.parse(doc->json.data(), doc->json.length(), err))
+            throw StructuredDataUnparseable(err);
+
+        idx = doc->tape.root();
     }
 
-    void exceptIfNull() {
-        if (json == NULL)
-            throw StructuredDataNull("no JSON data");
+    StructuredJson(shared_ptr<JSON_tape_doc> in_doc, size_t in_idx) {
+        doc = in_doc;
+        idx = in_idx;
     }
 
+    virtual ~StructuredJson() { }
+
     void exceptIfNot(bool match, string t) {
         if (!match) {
             throw StructuredDataUnsuitable("JSON field is not " + t);
@@ -165,35 +286,29 @@ public:
     }
 
     virtual bool isNumber() {
-        exceptIfNull();
-        return (json->value.tok_type == JSON_numeric);
+        return doc->tape.is_number(idx);
     }
 
     virtual bool isBool() {
-        exceptIfNull();
-        return (json->value.tok_type == JSON_boolean);
+        return doc->tape.is_bool(idx);
     }
 
     virtual bool isString() {
-        exceptIfNull();
-        return (json->value.tok_type == JSON_quoted);
+        return doc->tape.is_string(idx);
     }
 
     virtual bool isArray() {
-        exceptIfNull();
-        return (json->value_array.size() != 0);
+        return doc->tape.is_array(idx);
     }
 
     virtual bool isDictionary() {
-        exceptIfNull();
-        return (json->value_map.size() != 0);
+        return doc->tape.is_object(idx);
     }
 
     virtual double getNumber() {
-        exceptIfNull();
         exceptIfNot(isNumber(), "number");
 
-        double n = JSON_get_number(json, err);
+        double n = doc->tape.get_number(idx, err);
 
         if (err.length() != 0)
             throw StructuredDataUnparseable(err);
@@ -202,22 +317,25 @@ public:
     }
 
     virtual string getString() {
-        exceptIfNull();
         exceptIfNot(isString(), "string");
 
-        string s = JSON_get_string(json, err);
-
-        if (err.length() != 0) 
-            throw StructuredDataUnparseable(err);
-
-        return s;
+        return doc->tape.get_string(idx);
     }
 
     virtual bool getBool() {
-        exceptIfNull();
         exceptIfNot(isBool() || isString(), "Boolean");
 
-        bool b = (JSON_get_number(json, err) == 1.0f);
+        if (doc->tape.type(idx) == JSON_tape::tape_true)
+            return true;
+        if (doc->tape.type(idx) == JSON_tape::tape_false)
+            return false;
+
+        if (doc->tape.string_equals(idx, "true", 4))
+            return true;
+        if (doc->tape.string_equals(idx, "false", 5))
+            return false;
+
+        bool b = (doc->tape.get_number(idx, err) == 1.0f);
 
         if (err.length() != 0)
             throw StructuredDataUnparseable(err);
@@ -226,14 +344,13 @@ public:
     }
 
     virtual number_vec getNumberVec() {
-        exceptIfNull();
         exceptIfNot(isArray(), "Array/Vector");
 
         number_vec v;
 
-        for (vector<struct JSON_value *>::iterator jvi = json->value_array.begin();
-                jvi != json->value_array.end(); ++jvi) {
-            double d = JSON_get_number(*jvi, err);
+        for (size_t i = doc->tape.first_child(idx); i < doc->tape.end(idx); 
+                i = doc->tape.next(i)) {
+            double d = doc->tape.get_number(i, err);
 
             if (err.length() != 0)
                 throw StructuredDataUnparseable(err);
@@ -245,41 +362,31 @@ public:
     }
 
     virtual string_vec getStringVec() {
-        exceptIfNull();
         exceptIfNot(isArray(), "Array/Vector");
 
         string_vec v;
 
-        for (vector<struct JSON_value *>::iterator jvi = json->value_array.begin();
-                jvi != json->value_array.end(); ++jvi) {
-            string s = JSON_get_string(*jvi, err);
-
-            if (err.length() != 0)
-                throw StructuredDataUnparseable(err);
-
-            v.push_back(s);
+        for (size_t i = doc->tape.first_child(idx); i < doc->tape.end(idx); 
+                i = doc->tape.next(i)) {
+            v.push_back(doc->tape.get_string(i));
         }
 
         return v;
     }
 
     virtual bool hasKey(string key) {
-        return JSON_dict_has_key(json, key);
+        return doc->tape.find(idx, key) != JSON_tape::npos;
     }
 
     virtual SharedStructured getStructuredByKey(string key) {
-        exceptIfNull();
         exceptIfNot(isDictionary(), "Dictionary/Map");
 
-        if (!JSON_dict_has_key(json, key)) 
-            throw StructuredDataNoSuchKey("No such key: " + key);
-
-        struct JSON_value *nj = JSON_dict_get_value(json, key, err);
+        size_t v = doc->tape.find(idx, key);
 
-        if (err.length() != 0 || nj == NULL)
-            throw StructuredDataUnsuitable(err);
+        if (v == JSON_tape::npos)
+            throw StructuredDataNoSuchKey("No such key: " + key);
 
-        return SharedStructured(new StructuredJson(nj));
+        return SharedStructured(new StructuredJson(doc, v));
     }
 
     virtual double getKeyAsNumber(string key) {
@@ -287,15 +394,12 @@ public:
     }
 
     virtual double getKeyAsNumber(string key, double def) {
-        if (!hasKey(key))
-            return def;
-
-        SharedStructured v = getStructuredByKey(key);
+        size_t v = doc->tape.find(idx, key);
 
-        if (!v->isNumber())
+        if (v == JSON_tape::npos || !doc->tape.is_number(v))
             return def;
 
-        return v->getNumber();
+        return StructuredJson(doc, v).getNumber();
     }
 
     virtual string getKeyAsString(string key) {
@@ -303,15 +407,12 @@ public:
     }
 
     virtual string getKeyAsString(string key, string def) {
-        if (!hasKey(key))
-            return def;
-
-        SharedStructured v = getStructuredByKey(key);
+        size_t v = doc->tape.find(idx, key);
 
-        if (!v->isString())
+        if (v == JSON_tape::npos || !doc->tape.is_string(v))
             return def;
 
-        return v->getString();
+        return doc->tape.get_string(v);
     }
 
     virtual bool getKeyAsBool(string key) {
@@ -319,68 +420,64 @@ public:
     }
 
     virtual bool getKeyAsBool(string key, bool def) {
-        if (!hasKey(key))
-            return def;
-
-        SharedStructured v = getStructuredByKey(key);
+        size_t v = doc->tape.find(idx, key);
 
-        if (!v->isBool())
+        if (v == JSON_tape::npos || !doc->tape.is_bool(v))
             return def;
 
-        return v->getBool();
+        return doc->tape.type(v) == JSON_tape::tape_true;
     }
 
     virtual structured_vec getStructuredArray() {
-        exceptIfNull();
         exceptIfNot(isArray(), "array/vector");
 
         structured_vec v;
 
-        for (vector<struct JSON_value *>::iterator jvi = json->value_array.begin();
-                jvi != json->value_array.end(); ++jvi) {
-            v.push_back(SharedStructured(new StructuredJson(*jvi)));
+        for (size_t i = doc->tape.first_child(idx); i < doc->tape.end(idx); 
+                i = doc->tape.next(i)) {
+            v.push_back(SharedStructured(new StructuredJson(doc, i)));
         }
 
         return v;
     }
 
     virtual structured_num_map getStructuredNumMap() {
-        exceptIfNull();
-        exceptIfNot(isArray(), "dictionary/map");
+        exceptIfNot(isDictionary(), "dictionary/map");
 
         structured_num_map m;
 
-        for (map<string, struct JSON_value *>::iterator jmi = json->value_map.begin();
-                jmi != json->value_map.end(); ++jmi) {
+        for (size_t k = doc->tape.first_child(idx); k < doc->tape.end(idx); 
+                k = doc->tape.next(k + 1)) {
             double n;
 
-            if (sscanf(jmi->first.c_str(), "%lf", &n) != 1)
+            if (sscanf(doc->tape.get_string(k).c_str(), "%lf", &n) != 1)
                 throw StructuredDataUnsuitable("got non-numerical key converting "
                         "to structured numerical map");
 
-            m[n] = SharedStructured(new StructuredJson(jmi->second));
+            m.insert(std::make_pair(n, 
+                        SharedStructured(new StructuredJson(doc, k + 1))));
         }
 
         return m;
     }
 
     virtual structured_str_map getStructuredStrMap() {
-        exceptIfNull();
         exceptIfNot(isDictionary(), "dictionary/map");
 
         structured_str_map m;
 
-        for (map<string, struct JSON_value *>::iterator jmi = json->value_map.begin();
-                jmi != json->value_map.end(); ++jmi) {
-            m[jmi->first] = SharedStructured(new StructuredJson(jmi->second));
+        for (size_t k = doc->tape.first_child(idx); k < doc->tape.end(idx); 
+                k = doc->tape.next(k + 1)) {
+            m.insert(std::make_pair(doc->tape.get_string(k),
+                        SharedStructured(new StructuredJson(doc, k + 1))));
         }
 
         return m;
     }
 
 protected:
-    bool free_me;
-    struct JSON_value *json;
+    shared_ptr<JSON_tape_doc> doc;
+    size_t idx;
     string err;
 };
 
@@ -0,0 +1,1739 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* Offline queries over the files a server leaves behind
+ *
+ * Reads the saved device snapshot, the journal of changes since it, and the
+ * pcap log with its index directly, mapped into memory, without starting a
+ * server:
+ *
+ * # every device, or a few fields of the 802.11 devices seen in the last day
+ * kismet_query devices
+ * kismet_query --since -24h --phy IEEE802.11 \
+ *      --fields kismet.device.base.macaddr,kismet.device.base.name devices
+ *
+ * # one device, by key or MAC address
+ * kismet_query device AA:BB:CC:DD:EE:FF
+ *
+ * # the packets of a device from the log, for a time range
+ * kismet_query --pcap Kismet-20261013.pcap --device AA:BB:CC:DD:EE:FF \
+ *      --since "2026-10-13 09:00" --until "2026-10-13 10:00" --out dev.pcap packets
+ *
+ * # device counts by phy, the journal, and the log segments
+ * kismet_query --pcap Kismet-20261013-0001.pcap --pcap ... stats
+ *
+ * Options:
+ *  --snapshot FILE     Device snapshot (default ~/.kismet/devices.snapshot)
+ *  --journal FILE      Journal of the snapshot (default [snapshot].journal)
+ *  --pcap FILE         Pcap log or segment, repeated for each; the index is
+ *                      FILE.kidx.  Compressed (.gz) segments have no index and
+ *                      are read through.
+ *  --phy NAME          Only devices of this phy
+ *  --device KEY|MAC    Only this device
+ *  --since TIME        Only devices seen, or packets, at or after TIME
+ *  --until TIME        Only devices seen, or packets, at or before TIME
+ *  --fields A,B/C,..   Only these fields of each device; nested fields are
+ *                      separated by '/', as in the REST field paths
+ *  --group FIELD       Count the devices by the value of FIELD in stats
+ *  --out FILE          Where packets are written (default stdout)
+ *
+ * Times are seconds since the epoch, "YYYY-MM-DD[ HH:MM[:SS]]" in local time,
+ * or relative to now as -N[s|m|h|d].
+ *
+ * The snapshot and journal are in the byte order of the server which wrote
+ * them, and can only be read on a host with the same byte order.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "getopt.h"
+#include "endian_magic.h"
+#include "kis_log_formats.h"
+
+// Element types and map key tags as written by kbin_adapter; the values are
+// those of TrackerType, which the query tool doesn't link against
+#define KQ_STRING               0
+#define KQ_INT8                 1
+#define KQ_UINT8                2
+#define KQ_INT16                3
+#define KQ_UINT16               4
+#define KQ_INT32                5
+#define KQ_UINT32               6
+#define KQ_INT64                7
+#define KQ_UINT64               8
+#define KQ_FLOAT                9
+#define KQ_DOUBLE               10
+#define KQ_MAC                  11
+#define KQ_UUID                 12
+#define KQ_VECTOR               13
+#define KQ_MAP                  14
+#define KQ_INTMAP               15
+#define KQ_MACMAP               16
+#define KQ_STRINGMAP            17
+#define KQ_DOUBLEMAP            18
+#define KQ_BYTEARRAY            19
+#define KQ_SMALLINTMAP          20
+#define KQ_SMALLDOUBLEMAP       21
+
+#define KQ_KBIN_HEADER          0xFF
+#define KQ_KEY_FIELD            0x00
+#define KQ_KEY_FIELD_DEFINE     0x01
+#define KQ_KEY_NAME             0x02
+
+#define KQ_MAX_DEPTH            64
+
+#define KQ_DEVICE_MASK          0xFFFFFFFFFFFFULL
+
+// A decoded element.  Maps of every kind keep their keys as the strings they
+// would have in JSON, in the order they were written.
+struct kq_value {
+    kq_value() : type(KQ_UINT8), num(0), snum(0), dnum(0) { }
+
+    uint8_t type;
+    uint64_t num;
+    int64_t snum;
+    double dnum;
+    std::string str;
+
+    std::vector<std::string> names;
+    std::vector<kq_value> children;
+
+    const kq_value *find(const std::string& in_name) const {
+        for (size_t x = 0; x < names.size(); x++) {
+            if (names[x] == in_name)
+                return &(children[x]);
+        }
+
+        return NULL;
+    }
+
+    double as_double() const {
+        switch (type) {
+            case KQ_INT8: case KQ_INT16: case KQ_INT32: case KQ_INT64:
+                return (double) snum;
+            case KQ_UINT8: case KQ_UINT16: case KQ_UINT32: case KQ_UINT64:
+                return (double) num;
+            case KQ_FLOAT: case KQ_DOUBLE:
+                return dnum;
+            default:
+                return 0;
+        }
+    }
+};
+
+// Field names by the ID a stream gave them
+typedef std::map<int, std::string> kq_fields;
+
+static std::string kq_mac_string(uint64_t in_mac) {
+    char buf[18];
+
+    snprintf(buf, 18, "%02X:%02X:%02X:%02X:%02X:%02X",
+            (unsigned int) ((in_mac >> 40) & 0xFF), (unsigned int) ((in_mac >> 32) & 0xFF),
+            (unsigned int) ((in_mac >> 24) & 0xFF), (unsigned int) ((in_mac >> 16) & 0xFF),
+            (unsigned int) ((in_mac >> 8) & 0xFF), (unsigned int) (in_mac & 0xFF));
+
+    return std::string(buf);
+}
+
+static std::string kq_double_string(double in_v) {
+    char buf[32];
+
+    if (!isfinite(in_v))
+        return "0";
+
+    // Shortest form which reads back as the same value
+    for (int p = 1; p <= 17; p++) {
+        snprintf(buf, 32, "%.*g", p, in_v);
+
+        if (strtod(buf, NULL) == in_v)
+            break;
+    }
+
+    return std::string(buf);
+}
+
+class kq_reader {
+public:
+    kq_reader(const uint8_t *in_data, size_t in_len) {
+        data = in_data;
+        len = in_len;
+        pos = 0;
+        error = false;
+    }
+
+    template<typename T> T get() {
+        T v;
+
+        if (error || len - pos < sizeof(T)) {
+            error = true;
+            return 0;
+        }
+
+        memcpy(&v, data + pos, sizeof(T));
+        pos += sizeof(T);
+
+        return v;
+    }
+
+    const uint8_t *get_bytes(size_t in_sz) {
+        if (error || len - pos < in_sz) {
+            error = true;
+            return NULL;
+        }
+
+        const uint8_t *r = data + pos;
+        pos += in_sz;
+
+        return r;
+    }
+
+    std::string get_sized(size_t in_sz) {
+        const uint8_t *d = get_bytes(in_sz);
+
+        if (d == NULL)
+            return "";
+
+        return std::string((const char *) d, in_sz);
+    }
+
+    const uint8_t *data;
+    size_t len;
+    size_t pos;
+    bool error;
+};
+
+static bool kq_unpack(kq_reader& rd, kq_fields& fields, kq_value& ret, int in_depth) {
+    if (in_depth > KQ_MAX_DEPTH)
+        return false;
+
+    uint8_t t = rd.get<uint8_t>();
+
+    // A header can come before any element; the byte order was already checked
+    // against the file
+    if (t == KQ_KBIN_HEADER) {
+        rd.get_bytes(6);
+        t = rd.get<uint8_t>();
+    }
+
+    if (rd.error)
+        return false;
+
+    ret.type = t;
+
+    uint32_t n;
+    char buf[64];
+
+    switch (t) {
+        case KQ_STRING:
+            n = rd.get<uint32_t>();
+            ret.str = rd.get_sized(n);
+            break;
+        case KQ_INT8:
+            ret.snum = rd.get<int8_t>();
+            break;
+        case KQ_UINT8:
+            ret.num = rd.get<uint8_t>();
+            break;
+        case KQ_INT16:
+            ret.snum = rd.get<int16_t>();
+            break;
+        case KQ_UINT16:
+            ret.num = rd.get<uint16_t>();
+            break;
+        case KQ_INT32:
+            ret.snum = rd.get<int32_t>();
+            break;
+        case KQ_UINT32:
+            ret.num = rd.get<uint32_t>();
+            break;
+        case KQ_INT64:
+            ret.snum = rd.get<int64_t>();
+            break;
+        case KQ_UINT64:
+            ret.num = rd.get<uint64_t>();
+            break;
+        case KQ_FLOAT:
+            ret.dnum = rd.get<float>();
+            break;
+        case KQ_DOUBLE:
+            ret.dnum = rd.get<double>();
+            break;
+        case KQ_MAC:
+            ret.num = rd.get<uint64_t>();
+            rd.get<uint64_t>();
+            ret.str = kq_mac_string(ret.num);
+            break;
+        case KQ_UUID: {
+            const uint8_t *u = rd.get_bytes(16);
+            uint32_t tl;
+            uint16_t tm, th, cs;
+
+            if (u == NULL)
+                return false;
+
+            memcpy(&tl, u, 4);
+            memcpy(&tm, u + 4, 2);
+            memcpy(&th, u + 6, 2);
+            memcpy(&cs, u + 8, 2);
+
+            snprintf(buf, 64, "%08x-%04hx-%04hx-%04hx-%02hx%02hx%02hx%02hx%02hx%02hx",
+                    tl, tm, th, cs, (unsigned short) u[10], (unsigned short) u[11],
+                    (unsigned short) u[12], (unsigned short) u[13],
+                    (unsigned short) u[14], (unsigned short) u[15]);
+            ret.str = buf;
+            break;
+        }
+        case KQ_VECTOR:
+            n = rd.get<uint32_t>();
+            for (uint32_t x = 0; x < n && !rd.error; x++) {
+                ret.children.push_back(kq_value());
+                if (!kq_unpack(rd, fields, ret.children.back(), in_depth + 1))
+                    return false;
+            }
+            break;
+        case KQ_MAP:
+            n = rd.get<uint32_t>();
+            for (uint32_t x = 0; x < n && !rd.error; x++) {
+                uint8_t tag = rd.get<uint8_t>();
+                std::string name;
+
+                if (tag == KQ_KEY_NAME) {
+                    name = rd.get_sized(rd.get<uint16_t>());
+                } else if (tag == KQ_KEY_FIELD || tag == KQ_KEY_FIELD_DEFINE) {
+                    int32_t sid = rd.get<int32_t>();
+
+                    if (tag == KQ_KEY_FIELD_DEFINE)
+                        fields[sid] = rd.get_sized(rd.get<uint16_t>());
+
+                    auto fi = fields.find(sid);
+
+                    if (fi == fields.end())
+                        return false;
+
+                    name = fi->second;
+                } else {
+                    return false;
+                }
+
+                kq_value c;
+
+                if (!kq_unpack(rd, fields, c, in_depth + 1))
+                    return false;
+
+                // Empty dynamic fields are written as a placeholder byte
+                if (c.type == KQ_UINT8 && c.num == 0 && name.length() == 0)
+                    continue;
+
+                ret.names.push_back(name);
+                ret.children.push_back(std::move(c));
+            }
+            break;
+        case KQ_INTMAP:
+        case KQ_SMALLINTMAP:
+            n = rd.get<uint32_t>();
+            for (uint32_t x = 0; x < n && !rd.error; x++) {
+                snprintf(buf, 64, "%d", rd.get<int32_t>());
+                ret.names.push_back(buf);
+                ret.children.push_back(kq_value());
+                if (!kq_unpack(rd, fields, ret.children.back(), in_depth + 1))
+                    return false;
+            }
+            break;
+        case KQ_MACMAP:
+            n = rd.get<uint32_t>();
+            for (uint32_t x = 0; x < n && !rd.error; x++) {
+                uint64_t m = rd.get<uint64_t>();
+                rd.get<uint64_t>();
+                ret.names.push_back(kq_mac_string(m));
+                ret.children.push_back(kq_value());
+                if (!kq_unpack(rd, fields, ret.children.back(), in_depth + 1))
+                    return false;
+            }
+            break;
+        case KQ_STRINGMAP:
+            n = rd.get<uint32_t>();
+            for (uint32_t x = 0; x < n && !rd.error; x++) {
+                ret.names.push_back(rd.get_sized(rd.get<uint32_t>()));
+                ret.children.push_back(kq_value());
+                if (!kq_unpack(rd, fields, ret.children.back(), in_depth + 1))
+                    return false;
+            }
+            break;
+        case KQ_DOUBLEMAP:
+        case KQ_SMALLDOUBLEMAP:
+            n = rd.get<uint32_t>();
+            for (uint32_t x = 0; x < n && !rd.error; x++) {
+                // Fixed form, as the server writes double keys in JSON
+                snprintf(buf, 64, "%f", rd.get<double>());
+                ret.names.push_back(buf);
+                ret.children.push_back(kq_value());
+                if (!kq_unpack(rd, fields, ret.children.back(), in_depth + 1))
+                    return false;
+            }
+            break;
+        case KQ_BYTEARRAY:
+            n = rd.get<uint32_t>();
+            ret.str = rd.get_sized(n);
+            break;
+        default:
+            return false;
+    }
+
+    return !rd.error;
+}
+
+static bool kq_decode(const uint8_t *in_data, size_t in_len, kq_fields& fields,
+        kq_value& ret) {
+    kq_reader rd(in_data, in_len);
+
+    return kq_unpack(rd, fields, ret, 0);
+}
+
+static void kq_write_json_string(FILE *out, const std::string& in_str) {
+    fputc('"', out);
+
+    for (size_t x = 0; x < in_str.length(); x++) {
+        unsigned char c = in_str[x];
+
+        switch (c) {
+            case '"':
+                fputs("\\\"", out);
+                break;
+            case '\\':
+                fputs("\\\\", out);
+                break;
+            case '\n':
+                fputs("\\n", out);
+                break;
+            case '\r':
+                fputs("\\r", out);
+                break;
+            case '\t':
+                fputs("\\t", out);
+                break;
+            default:
+                if (c < 0x20)
+                    fprintf(out, "\\u%04x", c);
+                else
+                    fputc(c, out);
+        }
+    }
+
+    fputc('"', out);
+}
+
+static void kq_write_json(FILE *out, const kq_value& v) {
+    static const char hex[] = "0123456789ABCDEF";
+
+    switch (v.type) {
+        case KQ_STRING:
+        case KQ_MAC:
+        case KQ_UUID:
+            kq_write_json_string(out, v.str);
+            break;
+        case KQ_INT8: case KQ_INT16: case KQ_INT32: case KQ_INT64:
+            fprintf(out, "%lld", (long long) v.snum);
+            break;
+        case KQ_UINT8: case KQ_UINT16: case KQ_UINT32: case KQ_UINT64:
+            fprintf(out, "%llu", (unsigned long long) v.num);
+            break;
+        case KQ_FLOAT: case KQ_DOUBLE:
+            fputs(kq_double_string(v.dnum).c_str(), out);
+            break;
+        case KQ_BYTEARRAY:
+            fputc('"', out);
+            for (size_t x = 0; x < v.str.length(); x++) {
+                fputc(hex[((uint8_t) v.str[x]) >> 4], out);
+                fputc(hex[((uint8_t) v.str[x]) & 0xF], out);
+            }
+            fputc('"', out);
+            break;
+        case KQ_VECTOR:
+            fputc('[', out);
+            for (size_t x = 0; x < v.children.size(); x++) {
+                if (x != 0)
+                    fputc(',', out);
+                kq_write_json(out, v.children[x]);
+            }
+            fputc(']', out);
+            break;
+        default:
+            fputc('{', out);
+            for (size_t x = 0; x < v.children.size(); x++) {
+                if (x != 0)
+                    fputc(',', out);
+                kq_write_json_string(out, v.names[x]);
+                fputc(':', out);
+                kq_write_json(out, v.children[x]);
+            }
+            fputc('}', out);
+            break;
+    }
+}
+
+// Field by a path of names separated by '/'
+static const kq_value *kq_find_path(const kq_value& in_v, const std::string& in_path) {
+    const kq_value *v = &in_v;
+    size_t start = 0;
+
+    while (v != NULL) {
+        size_t end = in_path.find('/', start);
+
+        v = v->find(in_path.substr(start, end == std::string::npos ?
+                    std::string::npos : end - start));
+
+        if (end == std::string::npos)
+            break;
+
+        start = end + 1;
+    }
+
+    return v;
+}
+
+// A file mapped read-only
+class kq_mapped {
+public:
+    kq_mapped() : data(NULL), len(0) { }
+
+    ~kq_mapped() {
+        if (data != NULL)
+            munmap((void *) data, len);
+    }
+
+    bool open(const std::string& in_path, bool in_quiet) {
+        int fd = ::open(in_path.c_str(), O_RDONLY);
+        struct stat st;
+
+        if (fd < 0) {
+            if (!in_quiet || errno != ENOENT)
+                fprintf(stderr, "ERROR: Could not open '%s': %s\n", in_path.c_str(),
+                        strerror(errno));
+            return false;
+        }
+
+        if (fstat(fd, &st) < 0 || st.st_size == 0) {
+            close(fd);
+            return false;
+        }
+
+        void *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+
+        if (m == MAP_FAILED) {
+            fprintf(stderr, "ERROR: Could not map '%s': %s\n", in_path.c_str(),
+                    strerror(errno));
+            return false;
+        }
+
+        // Everything is read front to back, or looked up a record at a time
+        madvise(m, st.st_size, MADV_WILLNEED);
+
+        data = (const uint8_t *) m;
+        len = st.st_size;
+
+        return true;
+    }
+
+    const uint8_t *data;
+    size_t len;
+};
+
+static uint32_t kq_native_flags() {
+    uint16_t probe = 1;
+
+    // KBIN_FLAG_LITTLE_ENDIAN
+    if (*((uint8_t *) &probe) == 1)
+        return 0x01;
+
+    return 0;
+}
+
+// Read a table of { i32 id, u16 len, name } records, returning the bytes used
+static size_t kq_get_names(const uint8_t *in_data, size_t in_len,
+        std::map<int, std::string>& ret_names) {
+    uint32_t count;
+    size_t pos = 4;
+
+    if (in_len < 4)
+        return 0;
+
+    memcpy(&count, in_data, 4);
+
+    for (uint32_t x = 0; x < count; x++) {
+        int32_t id;
+        uint16_t len;
+
+        if (in_len - pos < 6)
+            return 0;
+
+        memcpy(&id, in_data + pos, 4);
+        memcpy(&len, in_data + pos + 4, 2);
+        pos += 6;
+
+        if (in_len - pos < len)
+            return 0;
+
+        ret_names[id] = std::string((const char *) in_data + pos, len);
+        pos += len;
+    }
+
+    return pos;
+}
+
+// Phy IDs only mean something within the run which wrote them, so devices are
+// matched between the snapshot and the journal by phy name and address
+static std::string kq_identity(const std::string& in_phy, uint64_t in_key) {
+    char buf[24];
+    snprintf(buf, 24, "/%012llx", (unsigned long long) (in_key & KQ_DEVICE_MASK));
+    return in_phy + buf;
+}
+
+struct kq_device {
+    kq_device() : key(0), record(-1), expired(false) { }
+
+    std::string phy;
+    uint64_t key;
+
+    // Snapshot record, or -1 if the device came from the journal
+    int64_t record;
+
+    kq_value journal;
+    bool expired;
+};
+
+class kq_store {
+public:
+    kq_store() {
+        hdr = NULL;
+        records = NULL;
+        keys = NULL;
+        num_records = 0;
+        journal_batches = 0;
+        journal_updates = 0;
+        journal_expires = 0;
+        journal_torn = false;
+    }
+
+    bool open_snapshot(const std::string& in_path) {
+        if (!snapshot.open(in_path, false))
+            return false;
+
+        if (snapshot.len < sizeof(snapshot_header)) {
+            fprintf(stderr, "ERROR: '%s' is not a device snapshot\n", in_path.c_str());
+            return false;
+        }
+
+        hdr = (const snapshot_header *) snapshot.data;
+
+        uint64_t len = snapshot.len;
+
+        if (memcmp(hdr->magic, SNAPSHOT_MAGIC, 8) != 0 ||
+                hdr->version != SNAPSHOT_VERSION) {
+            fprintf(stderr, "ERROR: '%s' is not a device snapshot\n", in_path.c_str());
+            return false;
+        }
+
+        if (hdr->flags != kq_native_flags()) {
+            fprintf(stderr, "ERROR: '%s' was saved with a different byte order\n",
+                    in_path.c_str());
+            return false;
+        }
+
+        if (hdr->file_length != len ||
+                hdr->fields_offset > hdr->phys_offset ||
+                hdr->phys_offset > hdr->records_offset ||
+                hdr->records_offset > len ||
+                hdr->num_records > (len - hdr->records_offset) /
+                    (sizeof(snapshot_record) + sizeof(snapshot_key)) ||
+                hdr->keys_offset != hdr->records_offset +
+                    hdr->num_records * sizeof(snapshot_record) ||
+                hdr->keys_offset + hdr->num_records * sizeof(snapshot_key) != len ||
+                kq_get_names(snapshot.data + hdr->fields_offset,
+                    hdr->phys_offset - hdr->fields_offset, snapshot_fields) == 0 ||
+                kq_get_names(snapshot.data + hdr->phys_offset,
+                    hdr->records_offset - hdr->phys_offset, snapshot_phys) == 0) {
+            fprintf(stderr, "ERROR: '%s' is incomplete or damaged\n", in_path.c_str());
+            return false;
+        }
+
+        records = (const snapshot_record *) (snapshot.data + hdr->records_offset);
+        keys = (const snapshot_key *) (snapshot.data + hdr->keys_offset);
+        num_records = hdr->num_records;
+
+        return true;
+    }
+
+    // Collect the latest change to every device in the journal; a journal for
+    // some other snapshot is ignored, as the server would
+    void open_journal(const std::string& in_path) {
+        kq_mapped journal;
+
+        if (!journal.open(in_path, true))
+            return;
+
+        journal_header jhdr;
+
+        if (journal.len < sizeof(journal_header))
+            return;
+
+        memcpy(&jhdr, journal.data, sizeof(journal_header));
+
+        if (memcmp(jhdr.magic, JOURNAL_MAGIC, 8) != 0 ||
+                jhdr.version != JOURNAL_VERSION || jhdr.flags != kq_native_flags()) {
+            fprintf(stderr, "WARNING: Ignoring '%s', it is not a device journal from "
+                    "this host\n", in_path.c_str());
+            return;
+        }
+
+        if (hdr != NULL && jhdr.snapshot_ts != hdr->timestamp) {
+            fprintf(stderr, "WARNING: Ignoring '%s', it belongs to a different "
+                    "snapshot\n", in_path.c_str());
+            return;
+        }
+
+        const uint8_t *data = journal.data + sizeof(journal_header);
+        size_t len = journal.len - sizeof(journal_header);
+        size_t pos = 0;
+
+        kq_fields fields;
+
+        while (pos < len) {
+            journal_batch_header bhdr;
+
+            if (len - pos < sizeof(journal_batch_header)) {
+                journal_torn = true;
+                break;
+            }
+
+            memcpy(&bhdr, data + pos, sizeof(journal_batch_header));
+            pos += sizeof(journal_batch_header);
+
+            if (bhdr.magic != JOURNAL_BATCH_MAGIC || len - pos < bhdr.length ||
+                    crc32(0L, (const Bytef *) data + pos, bhdr.length) != bhdr.crc) {
+                journal_torn = true;
+                break;
+            }
+
+            const uint8_t *bdata = data + pos;
+            size_t blen = bhdr.length;
+
+            pos += bhdr.length;
+            journal_batches++;
+
+            if (bhdr.flags & JOURNAL_BATCH_NEWRUN)
+                fields.clear();
+
+            std::map<int, std::string> phys;
+            size_t bpos = kq_get_names(bdata, blen, phys);
+
+            if (bpos == 0)
+                break;
+
+            while (blen - bpos >= 9) {
+                uint8_t op;
+                uint64_t key;
+
+                memcpy(&op, bdata + bpos, 1);
+                memcpy(&key, bdata + bpos + 1, 8);
+                bpos += 9;
+
+                kq_device d;
+
+                d.key = key;
+                d.phy = phys[(key >> 48) & 0xFFFF];
+
+                if (op == JOURNAL_OP_UPDATE) {
+                    uint32_t rlen;
+
+                    if (blen - bpos < 4)
+                        break;
+
+                    memcpy(&rlen, bdata + bpos, 4);
+                    bpos += 4;
+
+                    if (blen - bpos < rlen)
+                        break;
+
+                    // Decoded as we go, since the fields a record uses are defined
+                    // by the records before it
+                    bool ok = kq_decode(bdata + bpos, rlen, fields, d.journal);
+
+                    bpos += rlen;
+
+                    if (!ok || d.journal.type != KQ_MAP)
+                        continue;
+
+                    journal_updates++;
+                } else if (op == JOURNAL_OP_EXPIRE) {
+                    d.expired = true;
+                    journal_expires++;
+                } else {
+                    break;
+                }
+
+                changes[kq_identity(d.phy, key)] = std::move(d);
+            }
+        }
+    }
+
+    std::string snapshot_phy(uint64_t in_key) const {
+        auto pi = snapshot_phys.find((in_key >> 48) & 0xFFFF);
+
+        if (pi == snapshot_phys.end())
+            return "";
+
+        return pi->second;
+    }
+
+    // Decode a device from the snapshot; the snapshot defines every field up
+    // front, so records can be read in any order
+    bool decode_record(uint64_t in_record, kq_value& ret) const {
+        const snapshot_record *r = &(records[in_record]);
+
+        if (r->offset < sizeof(snapshot_header) || r->offset > hdr->fields_offset ||
+                r->length > hdr->fields_offset - r->offset)
+            return false;
+
+        kq_fields fields = snapshot_fields;
+
+        return kq_decode(snapshot.data + r->offset, r->length, fields, ret) &&
+            ret.type == KQ_MAP;
+    }
+
+    // Call fn(device, record) for every device, newest first; devices which
+    // changed since the snapshot come from the journal.  The walk stops early
+    // once the snapshot is older than in_since, since it is saved newest first.
+    template<class F>
+    void for_each(double in_since, F fn) const {
+        for (const auto& c : changes) {
+            if (!c.second.expired && !fn(c.second, c.second.journal))
+                return;
+        }
+
+        for (uint64_t r = 0; r < num_records; r++) {
+            kq_device d;
+
+            d.key = records[r].key;
+            d.phy = snapshot_phy(d.key);
+            d.record = r;
+
+            if (changes.find(kq_identity(d.phy, d.key)) != changes.end())
+                continue;
+
+            kq_value v;
+
+            if (!decode_record(r, v))
+                continue;
+
+            if (in_since > 0) {
+                const kq_value *lt = v.find("kismet.device.base.last_time");
+
+                if (lt != NULL && lt->as_double() < in_since)
+                    break;
+            }
+
+            if (!fn(d, v))
+                return;
+        }
+    }
+
+    // Find a device without decoding anything but the match; by exact key
+    // through the key table, or by address through the keys of the records
+    bool find(uint64_t in_key, bool in_by_mac, kq_device& ret_dev,
+            kq_value& ret_val) const {
+        for (const auto& c : changes) {
+            bool match = in_by_mac ?
+                (c.second.key & KQ_DEVICE_MASK) == in_key : c.second.key == in_key;
+
+            if (match) {
+                if (c.second.expired)
+                    return false;
+
+                ret_dev = c.second;
+                ret_val = c.second.journal;
+                return true;
+            }
+        }
+
+        int64_t rec = -1;
+
+        if (in_by_mac) {
+            for (uint64_t r = 0; r < num_records; r++) {
+                if ((records[r].key & KQ_DEVICE_MASK) == in_key) {
+                    rec = r;
+                    break;
+                }
+            }
+        } else {
+            const snapshot_key *end = keys + num_records;
+            const snapshot_key *k = std::lower_bound(keys, end, in_key,
+                    [](const snapshot_key& a, uint64_t b) { return a.key < b; });
+
+            if (k != end && k->key == in_key && k->record < num_records)
+                rec = k->record;
+        }
+
+        if (rec < 0)
+            return false;
+
+        ret_dev.key = records[rec].key;
+        ret_dev.phy = snapshot_phy(ret_dev.key);
+        ret_dev.record = rec;
+
+        // Removed since the snapshot
+        if (changes.find(kq_identity(ret_dev.phy, ret_dev.key)) != changes.end())
+            return false;
+
+        return decode_record(rec, ret_val);
+    }
+
+    kq_mapped snapshot;
+    const snapshot_header *hdr;
+    const snapshot_record *records;
+    const snapshot_key *keys;
+    uint64_t num_records;
+
+    kq_fields snapshot_fields;
+    std::map<int, std::string> snapshot_phys;
+
+    std::map<std::string, kq_device> changes;
+    uint64_t journal_batches, journal_updates, journal_expires;
+    bool journal_torn;
+};
+
+// Options shared by every command
+struct kq_options {
+    kq_options() : since(0), until(0), device(0), device_set(false),
+        device_by_mac(false) { }
+
+    std::string snapshot, journal, phy, out, group;
+    std::vector<std::string> pcaps;
+    std::vector<std::string> fields;
+    double since, until;
+    uint64_t device;
+    bool device_set, device_by_mac;
+};
+
+static bool kq_parse_time(const char *in_str, double *ret_time) {
+    char *end;
+
+    if (in_str[0] == '-') {
+        double v = strtod(in_str + 1, &end);
+        double mult = 1;
+
+        if (end == in_str + 1)
+            return false;
+
+        if (*end == 'm')
+            mult = 60;
+        else if (*end == 'h')
+            mult = 3600;
+        else if (*end == 'd')
+            mult = 86400;
+        else if (*end != 's' && *end != 0)
+            return false;
+
+        *ret_time = time(NULL) - v * mult;
+        return true;
+    }
+
+    double v = strtod(in_str, &end);
+
+    if (*end == 0 && end != in_str) {
+        *ret_time = v;
+        return true;
+    }
+
+    static const char *formats[] = {
+        "%Y-%m-%d %H:%M:%S", "%Y-%m-%dT%H:%M:%S", "%Y-%m-%d %H:%M",
+        "%Y-%m-%dT%H:%M", "%Y-%m-%d", NULL
+    };
+
+    for (unsigned int x = 0; formats[x] != NULL; x++) {
+        struct tm tm;
+
+        memset(&tm, 0, sizeof(struct tm));
+
+        const char *r = strptime(in_str, formats[x], &tm);
+
+        if (r != NULL && *r == 0) {
+            tm.tm_isdst = -1;
+            *ret_time = mktime(&tm);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// A device is a key, decimal or 0x hex, or an address
+static bool kq_parse_device(const char *in_str, kq_options *opts) {
+    unsigned int b[6];
+    char tail;
+
+    if (sscanf(in_str, "%2x:%2x:%2x:%2x:%2x:%2x%c", &b[0], &b[1], &b[2], &b[3],
+                &b[4], &b[5], &tail) == 6) {
+        opts->device = 0;
+
+        for (unsigned int x = 0; x < 6; x++)
+            opts->device = (opts->device << 8) | b[x];
+
+        opts->device_by_mac = true;
+        opts->device_set = true;
+
+        return true;
+    }
+
+    char *end;
+    unsigned long long k = strtoull(in_str, &end, 0);
+
+    if (*end != 0 || end == in_str)
+        return false;
+
+    opts->device = k;
+    opts->device_by_mac = false;
+    opts->device_set = true;
+
+    return true;
+}
+
+static bool kq_device_matches(const kq_options& opts, const kq_device& d,
+        const kq_value& v) {
+    if (opts.phy.length() != 0 && d.phy != opts.phy)
+        return false;
+
+    if (opts.device_set) {
+        if (opts.device_by_mac && (d.key & KQ_DEVICE_MASK) != opts.device)
+            return false;
+
+        if (!opts.device_by_mac && d.key != opts.device)
+            return false;
+    }
+
+    if (opts.since > 0 || opts.until > 0) {
+        const kq_value *lt = v.find("kismet.device.base.last_time");
+        const kq_value *ft = v.find("kismet.device.base.first_time");
+
+        if (opts.since > 0 && (lt == NULL || lt->as_double() < opts.since))
+            return false;
+
+        if (opts.until > 0 && (ft == NULL || ft->as_double() > opts.until))
+            return false;
+    }
+
+    return true;
+}
+
+static void kq_write_device(FILE *out, const kq_options& opts, const kq_value& v) {
+    if (opts.fields.size() == 0) {
+        kq_write_json(out, v);
+        return;
+    }
+
+    fputc('{', out);
+
+    for (size_t x = 0; x < opts.fields.size(); x++) {
+        if (x != 0)
+            fputc(',', out);
+
+        kq_write_json_string(out, opts.fields[x]);
+        fputc(':', out);
+
+        const kq_value *f = kq_find_path(v, opts.fields[x]);
+
+        if (f == NULL)
+            fputs("null", out);
+        else
+            kq_write_json(out, *f);
+    }
+
+    fputc('}', out);
+}
+
+static int kq_cmd_devices(const kq_options& opts, const kq_store& store) {
+    bool first = true;
+
+    printf("[");
+
+    store.for_each(opts.since, [&](const kq_device& d, const kq_value& v) {
+            if (!kq_device_matches(opts, d, v))
+                return true;
+
+            printf(first ? "\n" : ",\n");
+            first = false;
+
+            kq_write_device(stdout, opts, v);
+
+            return true;
+        });
+
+    printf("\n]\n");
+
+    return 0;
+}
+
+static int kq_cmd_device(const kq_options& opts, const kq_store& store) {
+    kq_device d;
+    kq_value v;
+
+    if (!opts.device_set) {
+        fprintf(stderr, "ERROR: No device given\n");
+        return 1;
+    }
+
+    if (!store.find(opts.device, opts.device_by_mac, d, v)) {
+        fprintf(stderr, "ERROR: No such device\n");
+        return 1;
+    }
+
+    kq_write_device(stdout, opts, v);
+    printf("\n");
+
+    return 0;
+}
+
+// A pcap log or segment, mapped if it's plain or read through if it was
+// compressed after it rotated
+class kq_pcap {
+public:
+    kq_pcap() : data(NULL), len(0), swapped(false) { }
+
+    bool open(const std::string& in_path) {
+        path = in_path;
+
+        if (in_path.length() > 3 && in_path.substr(in_path.length() - 3) == ".gz") {
+            gzFile gz = gzopen(in_path.c_str(), "rb");
+
+            if (gz == NULL) {
+                fprintf(stderr, "ERROR: Could not open '%s': %s\n", in_path.c_str(),
+                        strerror(errno));
+                return false;
+            }
+
+            char buf[65536];
+            int r;
+
+            while ((r = gzread(gz, buf, sizeof(buf))) > 0)
+                inflated.append(buf, r);
+
+            gzclose(gz);
+
+            data = (const uint8_t *) inflated.data();
+            len = inflated.length();
+        } else {
+            if (!mapped.open(in_path, false))
+                return false;
+
+            data = mapped.data;
+            len = mapped.len;
+        }
+
+        uint32_t magic;
+
+        if (len < 24) {
+            fprintf(stderr, "ERROR: '%s' is not a pcap file\n", in_path.c_str());
+            return false;
+        }
+
+        memcpy(&magic, data, 4);
+
+        if (magic == 0xa1b2c3d4 || magic == 0xa1b23c4d) {
+            swapped = false;
+        } else if (magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1) {
+            swapped = true;
+        } else {
+            fprintf(stderr, "ERROR: '%s' is not a pcap file\n", in_path.c_str());
+            return false;
+        }
+
+        return true;
+    }
+
+    uint32_t fix(uint32_t in_v) const {
+        return swapped ? kis_swap32(in_v) : in_v;
+    }
+
+    uint32_t dlt() const {
+        uint32_t v;
+        memcpy(&v, data + 20, 4);
+        return fix(v);
+    }
+
+    // Record header at an offset into the file, if there's a whole record there
+    bool record(uint64_t in_offt, pcap_index_sf_hdr *ret_hdr) const {
+        if (in_offt < 24 || len - in_offt < sizeof(pcap_index_sf_hdr) || in_offt > len)
+            return false;
+
+        memcpy(ret_hdr, data + in_offt, sizeof(pcap_index_sf_hdr));
+
+        ret_hdr->ts_sec = fix(ret_hdr->ts_sec);
+        ret_hdr->ts_usec = fix(ret_hdr->ts_usec);
+        ret_hdr->caplen = fix(ret_hdr->caplen);
+        ret_hdr->len = fix(ret_hdr->len);
+
+        return ret_hdr->caplen <= len - in_offt - sizeof(pcap_index_sf_hdr);
+    }
+
+    // Offsets of the records of a device from the index, in the time range; false
+    // if there's no index to ask
+    bool indexed(uint64_t in_device, bool in_by_mac, double in_since, double in_until,
+            std::vector<uint64_t> *ret_offsets) const {
+        kq_mapped idx;
+
+        if (!idx.open(path + ".kidx", true))
+            return false;
+
+        if (idx.len < 16 || memcmp(idx.data, PCAP_INDEX_MAGIC, 8) != 0)
+            return false;
+
+        uint32_t v;
+
+        memcpy(&v, idx.data + 8, 4);
+
+        if (kis_letoh32(v) != PCAP_INDEX_VERSION)
+            return false;
+
+        memcpy(&v, idx.data + 12, 4);
+        double bucket_sec = kis_letoh32(v);
+
+        size_t pos = 16;
+
+        while (idx.len - pos >= 24) {
+            uint64_t key, bucket;
+            uint32_t count;
+
+            memcpy(&key, idx.data + pos, 8);
+            memcpy(&bucket, idx.data + pos + 8, 8);
+            memcpy(&count, idx.data + pos + 16, 4);
+            pos += 24;
+
+            key = kis_letoh64(key);
+            bucket = kis_letoh64(bucket);
+            count = kis_letoh32(count);
+
+            if ((idx.len - pos) / 8 < count)
+                break;
+
+            bool match = in_by_mac ? (key & KQ_DEVICE_MASK) == in_device : key == in_device;
+
+            if (match && (in_since <= 0 || bucket + bucket_sec > in_since) &&
+                    (in_until <= 0 || bucket <= in_until)) {
+                for (uint32_t x = 0; x < count; x++) {
+                    uint64_t o;
+                    memcpy(&o, idx.data + pos + x * 8, 8);
+                    ret_offsets->push_back(kis_letoh64(o));
+                }
+            }
+
+            pos += (size_t) count * 8;
+        }
+
+        std::sort(ret_offsets->begin(), ret_offsets->end());
+        ret_offsets->erase(std::unique(ret_offsets->begin(), ret_offsets->end()),
+                ret_offsets->end());
+
+        return true;
+    }
+
+    // Packet counts of every device in the index
+    bool device_counts(std::map<uint64_t, uint64_t> *ret_counts) const {
+        kq_mapped idx;
+
+        if (!idx.open(path + ".kidx", true))
+            return false;
+
+        if (idx.len < 16 || memcmp(idx.data, PCAP_INDEX_MAGIC, 8) != 0)
+            return false;
+
+        size_t pos = 16;
+
+        while (idx.len - pos >= 24) {
+            uint64_t key;
+            uint32_t count;
+
+            memcpy(&key, idx.data + pos, 8);
+            memcpy(&count, idx.data + pos + 16, 4);
+            pos += 24;
+
+            count = kis_letoh32(count);
+
+            if ((idx.len - pos) / 8 < count)
+                break;
+
+            (*ret_counts)[kis_letoh64(key)] += count;
+
+            pos += (size_t) count * 8;
+        }
+
+        return true;
+    }
+
+    std::string path;
+
+    kq_mapped mapped;
+    std::string inflated;
+
+    const uint8_t *data;
+    size_t len;
+    bool swapped;
+};
+
+static bool kq_in_range(const kq_options& opts, const pcap_index_sf_hdr& in_hdr) {
+    double ts = in_hdr.ts_sec;
+
+    if (opts.since > 0 && ts < opts.since)
+        return false;
+
+    if (opts.until > 0 && ts > opts.until)
+        return false;
+
+    return true;
+}
+
+static int kq_cmd_packets(const kq_options& opts) {
+    if (opts.pcaps.size() == 0) {
+        fprintf(stderr, "ERROR: No pcap logs given (--pcap)\n");
+        return 1;
+    }
+
+    FILE *out = stdout;
+
+    if (opts.out.length() != 0 && opts.out != "-") {
+        if ((out = fopen(opts.out.c_str(), "wb")) == NULL) {
+            fprintf(stderr, "ERROR: Could not open '%s': %s\n", opts.out.c_str(),
+                    strerror(errno));
+            return 1;
+        }
+    } else if (isatty(fileno(stdout))) {
+        fprintf(stderr, "ERROR: Not writing a pcap to a terminal, use --out\n");
+        return 1;
+    }
+
+    bool wrote_header = false;
+    uint32_t out_dlt = 0;
+    uint64_t written = 0;
+
+    for (auto p : opts.pcaps) {
+        kq_pcap pcap;
+
+        if (!pcap.open(p))
+            continue;
+
+        if (!wrote_header) {
+            fwrite(pcap.data, 24, 1, out);
+            out_dlt = pcap.dlt();
+            wrote_header = true;
+        } else if (pcap.dlt() != out_dlt) {
+            fprintf(stderr, "WARNING: Skipping '%s', it has a different link type\n",
+                    p.c_str());
+            continue;
+        }
+
+        pcap_index_sf_hdr rhdr;
+
+        auto put = [&](uint64_t in_offt) {
+            // Records go out in the byte order of the first file
+            pcap_index_sf_hdr ohdr = rhdr;
+
+            if (pcap.swapped) {
+                ohdr.ts_sec = kis_swap32(ohdr.ts_sec);
+                ohdr.ts_usec = kis_swap32(ohdr.ts_usec);
+                ohdr.caplen = kis_swap32(ohdr.caplen);
+                ohdr.len = kis_swap32(ohdr.len);
+            }
+
+            fwrite(&ohdr, sizeof(pcap_index_sf_hdr), 1, out);
+            fwrite(pcap.data + in_offt + sizeof(pcap_index_sf_hdr), rhdr.caplen, 1, out);
+            written++;
+        };
+
+        std::vector<uint64_t> offsets;
+
+        if (opts.device_set) {
+            if (!pcap.indexed(opts.device, opts.device_by_mac, opts.since, opts.until,
+                        &offsets)) {
+                fprintf(stderr, "WARNING: Skipping '%s', packets can only be found "
+                        "by device with an index (%s.kidx)\n", p.c_str(), p.c_str());
+                continue;
+            }
+
+            for (auto o : offsets) {
+                if (pcap.record(o, &rhdr) && kq_in_range(opts, rhdr))
+                    put(o);
+            }
+
+            continue;
+        }
+
+        // The whole log in order; only the record headers are looked at for
+        // packets outside the range
+        uint64_t offt = 24;
+
+        while (pcap.record(offt, &rhdr)) {
+            if (kq_in_range(opts, rhdr))
+                put(offt);
+
+            offt += sizeof(pcap_index_sf_hdr) + rhdr.caplen;
+        }
+    }
+
+    if (out != stdout)
+        fclose(out);
+
+    fprintf(stderr, "Wrote %llu packets\n", (unsigned long long) written);
+
+    return 0;
+}
+
+static int kq_cmd_stats(const kq_options& opts, const kq_store& store) {
+    struct phy_stats {
+        phy_stats() : devices(0), packets(0), first(0), last(0) { }
+        uint64_t devices, packets;
+        double first, last;
+    };
+
+    std::map<std::string, phy_stats> phys;
+    std::map<std::string, uint64_t> groups;
+
+    store.for_each(opts.since, [&](const kq_device& d, const kq_value& v) {
+            if (!kq_device_matches(opts, d, v))
+                return true;
+
+            phy_stats& s = phys[d.phy];
+            const kq_value *f;
+
+            s.devices++;
+
+            if ((f = v.find("kismet.device.base.packets.total")) != NULL)
+                s.packets += f->as_double();
+
+            if ((f = v.find("kismet.device.base.first_time")) != NULL &&
+                    (s.first == 0 || f->as_double() < s.first))
+                s.first = f->as_double();
+
+            if ((f = v.find("kismet.device.base.last_time")) != NULL &&
+                    f->as_double() > s.last)
+                s.last = f->as_double();
+
+            if (opts.group.length() != 0) {
+                f = kq_find_path(v, opts.group);
+
+                if (f == NULL) {
+                    groups["null"]++;
+                } else if (f->type == KQ_STRING || f->type == KQ_MAC ||
+                        f->type == KQ_UUID) {
+                    groups[f->str]++;
+                } else if (f->type == KQ_FLOAT || f->type == KQ_DOUBLE) {
+                    groups[kq_double_string(f->dnum)]++;
+                } else {
+                    groups[kq_double_string(f->as_double())]++;
+                }
+            }
+
+            return true;
+        });
+
+    printf("{\"devices\":{");
+
+    bool first = true;
+    for (auto p : phys) {
+        if (!first)
+            printf(",");
+        first = false;
+
+        kq_write_json_string(stdout, p.first);
+        printf(":{\"devices\":%llu,\"packets\":%llu,\"first_time\":%.0f,"
+                "\"last_time\":%.0f}", (unsigned long long) p.second.devices,
+                (unsigned long long) p.second.packets, p.second.first, p.second.last);
+    }
+
+    printf("}");
+
+    if (opts.group.length() != 0) {
+        printf(",\"group\":{");
+
+        first = true;
+        for (auto g : groups) {
+            if (!first)
+                printf(",");
+            first = false;
+
+            kq_write_json_string(stdout, g.first);
+            printf(":%llu", (unsigned long long) g.second);
+        }
+
+        printf("}");
+    }
+
+    if (store.hdr != NULL)
+        printf(",\"snapshot\":{\"timestamp\":%llu,\"records\":%llu}",
+                (unsigned long long) store.hdr->timestamp,
+                (unsigned long long) store.num_records);
+
+    printf(",\"journal\":{\"batches\":%llu,\"updated\":%llu,\"removed\":%llu,"
+            "\"torn\":%s}", (unsigned long long) store.journal_batches,
+            (unsigned long long) store.journal_updates,
+            (unsigned long long) store.journal_expires,
+            store.journal_torn ? "true" : "false");
+
+    if (opts.pcaps.size() != 0) {
+        printf(",\"pcap\":[");
+
+        first = true;
+        for (auto p : opts.pcaps) {
+            kq_pcap pcap;
+
+            if (!pcap.open(p))
+                continue;
+
+            uint64_t packets = 0, bytes = 0, in_range = 0;
+            double first_ts = 0, last_ts = 0;
+
+            pcap_index_sf_hdr rhdr;
+            uint64_t offt = 24;
+
+            while (pcap.record(offt, &rhdr)) {
+                packets++;
+                bytes += rhdr.caplen;
+
+                if (first_ts == 0 || rhdr.ts_sec < first_ts)
+                    first_ts = rhdr.ts_sec;
+                if (rhdr.ts_sec > last_ts)
+                    last_ts = rhdr.ts_sec;
+
+                if (kq_in_range(opts, rhdr))
+                    in_range++;
+
+                offt += sizeof(pcap_index_sf_hdr) + rhdr.caplen;
+            }
+
+            if (!first)
+                printf(",");
+            first = false;
+
+            printf("{\"file\":");
+            kq_write_json_string(stdout, p);
+            printf(",\"dlt\":%u,\"packets\":%llu,\"bytes\":%llu,\"in_range\":%llu,"
+                    "\"first_time\":%.0f,\"last_time\":%.0f,\"truncated\":%s",
+                    pcap.dlt(), (unsigned long long) packets, (unsigned long long) bytes,
+                    (unsigned long long) in_range, first_ts, last_ts,
+                    offt != pcap.len ? "true" : "false");
+
+            std::map<uint64_t, uint64_t> counts;
+
+            if (pcap.device_counts(&counts)) {
+                std::vector<std::pair<uint64_t, uint64_t> > top(counts.begin(),
+                        counts.end());
+
+                std::sort(top.begin(), top.end(),
+                        [](const std::pair<uint64_t, uint64_t>& a,
+                            const std::pair<uint64_t, uint64_t>& b) {
+                            return a.second > b.second;
+                        });
+
+                printf(",\"indexed_devices\":%llu,\"top_devices\":[",
+                        (unsigned long long) counts.size());
+
+                for (size_t x = 0; x < top.size() && x < 10; x++) {
+                    printf("%s{\"key\":%llu,\"macaddr\":\"%s\",\"packets\":%llu}",
+                            x == 0 ? "" : ",", (unsigned long long) top[x].first,
+                            kq_mac_string(top[x].first & KQ_DEVICE_MASK).c_str(),
+                            (unsigned long long) top[x].second);
+                }
+
+                printf("]");
+            }
+
+            printf("}");
+        }
+
+        printf("]");
+    }
+
+    printf("}\n");
+
+    return 0;
+}
+
+static void kq_usage(const char *argv0) {
+    printf("usage: %s [options] devices|device [KEY|MAC]|packets|stats\n"
+            " --snapshot FILE     Device snapshot (default ~/.kismet/devices.snapshot)\n"
+            " --journal FILE      Journal of the snapshot (default [snapshot].journal)\n"
+            " --pcap FILE         Pcap log or segment; repeat for each segment\n"
+            " --phy NAME          Only devices of this phy\n"
+            " --device KEY|MAC    Only this device\n"
+            " --since TIME        Only devices seen, or packets, at or after TIME\n"
+            " --until TIME        Only devices seen, or packets, at or before TIME\n"
+            " --fields A,B/C,...  Only these fields of each device\n"
+            " --group FIELD       Count devices by the value of FIELD (stats)\n"
+            " --out FILE          Write packets to FILE (default stdout)\n"
+            "\n"
+            "TIME is seconds since the epoch, \"YYYY-MM-DD[ HH:MM[:SS]]\", or\n"
+            "-N[s|m|h|d] before now\n", argv0);
+}
+
+int main(int argc, char *argv[]) {
+    kq_options opts;
+
+    static struct option longopt[] = {
+        { "snapshot", required_argument, 0, 's' },
+        { "journal", required_argument, 0, 'j' },
+        { "pcap", required_argument, 0, 'p' },
+        { "phy", required_argument, 0, 'P' },
+        { "device", required_argument, 0, 'd' },
+        { "since", required_argument, 0, 'S' },
+        { "until", required_argument, 0, 'U' },
+        { "fields", required_argument, 0, 'f' },
+        { "group", required_argument, 0, 'g' },
+        { "out", required_argument, 0, 'o' },
+        { "help", no_argument, 0, 'h' },
+        { 0, 0, 0, 0 }
+    };
+
+    int option_idx = 0;
+    int r;
+
+    while ((r = getopt_long(argc, argv, "s:j:p:P:d:S:U:f:g:o:h", longopt,
+                    &option_idx)) != -1) {
+        switch (r) {
+            case 's':
+                opts.snapshot = optarg;
+                break;
+            case 'j':
+                opts.journal = optarg;
+                break;
+            case 'p':
+                opts.pcaps.push_back(optarg);
+                break;
+            case 'P':
+                opts.phy = optarg;
+                break;
+            case 'd':
+                if (!kq_parse_device(optarg, &opts)) {
+                    fprintf(stderr, "ERROR: Expected a device key or MAC address, "
+                            "not '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'S':
+            case 'U':
+                if (!kq_parse_time(optarg, r == 'S' ? &opts.since : &opts.until)) {
+                    fprintf(stderr, "ERROR: Could not parse time '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'f': {
+                std::string f = optarg;
+                size_t start = 0;
+
+                while (start <= f.length()) {
+                    size_t end = f.find(',', start);
+
+                    if (end == std::string::npos)
+                        end = f.length();
+
+                    if (end != start)
+                        opts.fields.push_back(f.substr(start, end - start));
+
+                    start = end + 1;
+                }
+                break;
+            }
+            case 'g':
+                opts.group = optarg;
+                break;
+            case 'o':
+                opts.out = optarg;
+                break;
+            case 'h':
+                kq_usage(argv[0]);
+                return 0;
+            default:
+                kq_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind >= argc) {
+        kq_usage(argv[0]);
+        return 1;
+    }
+
+    std::string cmd = argv[optind];
+
+    if (cmd == "device" && optind + 1 < argc && !kq_parse_device(argv[optind + 1], &opts)) {
+        fprintf(stderr, "ERROR: Expected a device key or MAC address, not '%s'\n",
+                argv[optind + 1]);
+        return 1;
+    }
+
+    if (cmd == "packets")
+        return kq_cmd_packets(opts);
+
+    if (cmd != "devices" && cmd != "device" && cmd != "stats") {
+        kq_usage(argv[0]);
+        return 1;
+    }
+
+    if (opts.snapshot.length() == 0) {
+        const char *home = getenv("HOME");
+        opts.snapshot = std::string(home != NULL ? home : ".") + "/.kismet/devices.snapshot";
+    }
+
+    if (opts.journal.length() == 0)
+        opts.journal = opts.snapshot + ".journal";
+
+    kq_store store;
+
+    // Stats of the pcap logs alone don't need the device state
+    bool have_snapshot = store.open_snapshot(opts.snapshot);
+
+    if (!have_snapshot && !(cmd == "stats" && opts.pcaps.size() != 0))
+        return 1;
+
+    if (have_snapshot)
+        store.open_journal(opts.journal);
+
+    if (cmd == "devices")
+        return kq_cmd_devices(opts, store);
+
+    if (cmd == "device")
+        return kq_cmd_device(opts, store);
+
+    return kq_cmd_stats(opts, store);
+}
+
@@ -65,10 +65,20 @@
 #include "datasource_linux_wifi.h"
 
 #include "timetracker.h"
+#include "kis_clock.h"
+#include "kis_startup.h"
 #include "alertracker.h"
 
 #include "kis_net_microhttpd.h"
 #include "system_monitor.h"
+#include "memory_governor.h"
+#include "kis_timeseries.h"
+#include "benchmark.h"
+#include "eventstream.h"
+#include "federation.h"
+#include "cluster.h"
+#include "kis_metrics.h"
+#include "kis_taskpool.h"
 #include "channeltracker2.h"
 #include "kis_httpd_websession.h"
 #include "kis_httpd_registry.h"
@@ -77,16 +87,24 @@
 #include "gpstracker.h"
 
 #include "devicetracker.h"
+#include "packet_dedup.h"
+#include "cpu_affinity.h"
+#include "kis_hugepage.h"
+#include "signal_heatmap.h"
+#include "packet_retention.h"
 #include "phy_80211.h"
 #include "phy_rtl433.h"
 #include "phy_zwave.h"
 
 #include "dumpfile.h"
 #include "dumpfile_pcap.h"
+#include "dumpfile_kismetdb.h"
+#include "dumpfile_devicejournal.h"
 
 #include "ipc_remote2.h"
 
 #include "statealert.h"
+#include "alertrules.h"
 
 #include "manuf.h"
 
@@ -94,6 +112,7 @@
 
 #include "msgpack_adapter.h"
 #include "json_adapter.h"
+#include "kbin_adapter.h"
 
 #include "streamtracker.h"
 
@@ -212,6 +231,13 @@ int packnum = 0, localdropnum = 0;
 // Ultimate registry of global components
 GlobalRegistry *globalregistry = NULL;
 
+// Set by SIGHUP; the config is reloaded from the main loop
+volatile sig_atomic_t reload_requested = 0;
+
+void CatchReload(int sig) {
+    reload_requested = 1;
+}
+
 // Catch our interrupt
 void CatchShutdown(int sig) {
     static bool in_shutdown = false;
@@ -309,6 +335,11 @@ void SpindownKismet(shared_ptr<PollableTracker> pollabletracker) {
                 "CONTINUE.  ***\n");
     }
 
+    // Drain any packets still in flight before we start tearing down the
+    // things which process them
+    if (globalregistry->packetchain != NULL)
+        globalregistry->packetchain->StopPipeline();
+
     // Kill all the logfiles
     fprintf(stderr, "Shutting down log files...\n");
     for (unsigned int x = 0; x < globalregistry->subsys_dumpfile_vec.size(); x++) {
@@ -618,6 +649,8 @@ void ncurses_wrapper_fork() {
 #endif
 
 int main(int argc, char *argv[], char *envp[]) {
+    StartupProfiler::Begin();
+
     exec_name = argv[0];
     char errstr[STATUS_MAX];
     char *configfilename = NULL;
@@ -683,7 +716,7 @@ int main(int argc, char *argv[], char *envp[]) {
     // Catch the interrupt handler to shut down
     signal(SIGINT, CatchShutdown);
     signal(SIGTERM, CatchShutdown);
-    signal(SIGHUP, CatchShutdown);
+    signal(SIGHUP, CatchReload);
     signal(SIGQUIT, CatchShutdown);
     signal(SIGCHLD, CatchChild);
     signal(SIGPIPE, SIG_IGN);
@@ -705,6 +738,7 @@ int main(int argc, char *argv[], char *envp[]) {
 
     // Set up usage functions
     globalregistry->RegisterUsageFunc(Devicetracker::usage);
+    globalregistry->RegisterUsageFunc(Benchmark::usage);
 
     int max_fd = 0;
     fd_set rset, wset;
@@ -797,6 +831,31 @@ int main(int argc, char *argv[], char *envp[]) {
     }
     globalregistry->kismet_config = conf;
 
+    // Calibrate the clocks before anything times itself against them
+    KisClock::Init();
+
+    // As early as possible, so the lockers of everything made after this are
+    // profiled
+    if (conf->FetchOptBoolean("lock_profiling", false)) {
+        LockProfiler::Enable();
+        _MSG("Profiling lock contention, see /system/lock_stats.json", MSGFLAG_INFO);
+    }
+
+    // Before anything allocates the buffers huge pages would back
+    HugepageAlloc::hugepage_mode hugemode;
+
+    if (!HugepageAlloc::parse_mode(StrLower(conf->FetchOpt("hugepages")), &hugemode)) {
+        _MSG("Unknown hugepages option '" + conf->FetchOpt("hugepages") + "', expected "
+                "'off', 'thp', or 'hugetlb'; not using huge pages", MSGFLAG_ERROR);
+        hugemode = HugepageAlloc::hugepage_off;
+    }
+
+    HugepageAlloc::set_mode(hugemode);
+
+    if (hugemode != HugepageAlloc::hugepage_off)
+        _MSG("Backing large buffers with huge pages (" + 
+                HugepageAlloc::mode_name(hugemode) + ")", MSGFLAG_INFO);
+
     struct stat fstat;
     string configdir;
 
@@ -825,13 +884,18 @@ int main(int argc, char *argv[], char *envp[]) {
         CatchShutdown(-1);
     }
 
+    // Place the main loop before it starts any threads, so they inherit it
+    CpuAffinity::create_cpuaffinity(globalregistry);
+
     // Make the timetracker
     Timetracker::create_timetracker(globalregistry);
 
     // HTTP BLOCK
     // Create the HTTPD server, it needs to exist before most things
     _MSG("Starting Kismet web server...", MSGFLAG_INFO);
+    StartupProfiler::step httpd_step("httpd");
     Kis_Net_Httpd::create_httpd(globalregistry);
+    httpd_step.End();
 
     if (globalregistry->fatal_condition)
         CatchShutdown(-1);
@@ -845,6 +909,7 @@ int main(int argc, char *argv[], char *envp[]) {
     entrytracker->RegisterSerializer("msgpack", shared_ptr<TrackerElementSerializer>(new MsgpackAdapter::Serializer(globalregistry)));
     entrytracker->RegisterSerializer("json", shared_ptr<TrackerElementSerializer>(new JsonAdapter::Serializer(globalregistry)));
     entrytracker->RegisterSerializer("ekjson", shared_ptr<TrackerElementSerializer>(new EkJsonAdapter::Serializer(globalregistry)));
+    entrytracker->RegisterSerializer("kbin", shared_ptr<TrackerElementSerializer>(new KbinAdapter::Serializer(globalregistry)));
 
     // cmd is msgpack, jcmd is json (for now?)
     entrytracker->RegisterSerializer("cmd", shared_ptr<TrackerElementSerializer>(new MsgpackAdapter::Serializer(globalregistry)));
@@ -867,6 +932,15 @@ int main(int argc, char *argv[], char *envp[]) {
         globalregistry->messagebus->RemoveClient(smartmsgcli);
     }
 
+    // Deliver messages from a background thread; this has to wait until we've
+    // forked, threads don't survive it
+    if (conf->FetchOptBoolean("message_async", false))
+        globalregistry->messagebus->StartAsyncDispatch(
+                conf->FetchOptUInt("message_queue", 1024));
+
+    // Write the tag, session, and probe caches from a background thread
+    ConfigWriter::create_configwriter(globalregistry);
+
     if (conf->FetchOpt("servername") == "") {
         char hostname[64];
         if (gethostname(hostname, 64) < 0)
@@ -877,11 +951,25 @@ int main(int argc, char *argv[], char *envp[]) {
         globalregistry->servername = MungeToPrintable(conf->FetchOpt("servername"));
     }
 
+    // Index the manuf db alongside the rest of startup; nothing looks up a
+    // manufacturer until devices are created, so it's only waited for where
+    // it used to be created.  This has to wait until we've forked.
+    StartupProfiler::task manuf_task("manuf", []() {
+            globalregistry->manufdb = new Manuf(globalregistry);
+        });
+
     // Create the IPC handler
     IPCRemoteV2Tracker::create_ipcremote(globalregistry);
 
+    // Create the metrics registry before anything which counts into it
+    KisMetrics::create_metrics(globalregistry);
+
+    // Create the shared task pool, which the trackers schedule onto
+    KisTaskPool::create_taskpool(globalregistry);
+
     // Create the packet chain
     _MSG("Creating packet chain...", MSGFLAG_INFO);
+    StartupProfiler::step core_step("packetchain and trackers");
     Packetchain::create_packetchain(globalregistry);
 
     // Create the stream tracking
@@ -903,9 +991,17 @@ int main(int argc, char *argv[], char *envp[]) {
     // Create the alert tracker
     Alertracker::create_alertracker(globalregistry);
 
+    // Benchmark mode, if requested; this overrides the source and logging config
+    // so it has to come before they're read
+    Benchmark::create_benchmark(globalregistry);
+
+    core_step.End();
+
     // Add the datasource tracker
+    StartupProfiler::step dst_step("datasourcetracker");
     shared_ptr<Datasourcetracker> datasourcetracker;
     datasourcetracker = Datasourcetracker::create_dst(globalregistry);
+    dst_step.End();
 
     if (globalregistry->fatal_condition)
         CatchShutdown(-1);
@@ -913,13 +1009,40 @@ int main(int argc, char *argv[], char *envp[]) {
     if (globalregistry->fatal_condition)
         CatchShutdown(-1);
 
+    shared_ptr<Plugintracker> plugintracker;
+
+    // Start the plugin handler, and look for plugins while the device tracker
+    // and phys are created; they're waited for before they're activated
+    if (plugins) {
+        plugintracker = Plugintracker::create_plugintracker(globalregistry);
+    } else {
+        globalregistry->messagebus->InjectMessage(
+            "Plugins disabled on the command line, plugins will NOT be loaded...",
+            MSGFLAG_INFO);
+    }
+
+    StartupProfiler::task plugin_scan_task("plugin scan", [plugintracker]() {
+            if (plugintracker != NULL)
+                plugintracker->ScanPlugins();
+        });
+
     // Create the device tracker
+    StartupProfiler::step devicetracker_step("devicetracker");
     Devicetracker::create_devicetracker(globalregistry);
+    devicetracker_step.End();
 
     if (globalregistry->fatal_condition)
         CatchShutdown(-1);
 
+    // Merge frames captured by more than one source, if enabled
+    PacketDedup::create_packetdedup(globalregistry);
+    PacketRetention::create_packetretention(globalregistry);
+
+    // Bin packet signal into map tiles, if enabled
+    SignalHeatmap::create_signalheatmap(globalregistry);
+
     // Register the DLT handlers
+    StartupProfiler::step phy_step("phys");
     new Kis_DLT_PPI(globalregistry);
     new Kis_DLT_Radiotap(globalregistry);
 
@@ -941,21 +1064,14 @@ int main(int argc, char *argv[], char *envp[]) {
 #endif
     datasourcetracker->register_datasource(SharedDatasourceBuilder(new DatasourceLinuxWifiBuilder(globalregistry)));
 
-    shared_ptr<Plugintracker> plugintracker;
+    phy_step.End();
 
-    // Start the plugin handler
-    if (plugins) {
-        plugintracker = Plugintracker::create_plugintracker(globalregistry);
-    } else {
-        globalregistry->messagebus->InjectMessage(
-            "Plugins disabled on the command line, plugins will NOT be loaded...",
-            MSGFLAG_INFO);
-    }
+    plugin_scan_task.Wait();
 
+    // Activate the plugins
+    StartupProfiler::step plugin_step("plugins");
 
-    // Process plugins and activate them
     if (plugintracker != NULL) {
-        plugintracker->ScanPlugins();
         plugintracker->ActivatePlugins();
 
         if (globalregistry->fatal_condition) {
@@ -965,14 +1081,29 @@ int main(int argc, char *argv[], char *envp[]) {
         }
     }
 
-    // Create the GPS components
+    plugin_step.End();
+
+    // Every static directory is registered once the plugins are, so the cache
+    // can be loaded while the rest of the server starts
+    StartupProfiler::task static_task("static file cache", []() {
+            globalregistry->httpd_server->PreloadStaticFiles();
+        });
+
+    // Create the GPS components, and open the GPS devices while the rest of the
+    // server starts; they only have to be open before the sources are
     GpsTracker::create_gpsmanager(globalregistry);
 
-    // Create the manuf db
-    globalregistry->manufdb = new Manuf(globalregistry);
+    StartupProfiler::task gps_task("gps", []() {
+            globalregistry->FetchGlobalAs<GpsTracker>("GPSTRACKER")->open_config_gps();
+        });
+
+    // The manuf db has to be ready before dumpfiles and anything after them
+    manuf_task.Wait();
     if (globalregistry->fatal_condition)
         CatchShutdown(-1);
 
+    StartupProfiler::step dumpfile_step("dumpfiles");
+
     // Create the dumpfiles.  We don't have to assign the new dumpfile anywhere
     // because it puts itself in the global vector
     globalregistry->messagebus->InjectMessage("Registering dumpfiles...",
@@ -984,6 +1115,16 @@ int main(int argc, char *argv[], char *envp[]) {
         CatchShutdown(-1);
 #endif
 
+#ifdef HAVE_LIBSQLITE3
+    new Dumpfile_Kismetdb(globalregistry);
+    if (globalregistry->fatal_condition)
+        CatchShutdown(-1);
+#endif
+
+    new Dumpfile_Devicejournal(globalregistry);
+    if (globalregistry->fatal_condition)
+        CatchShutdown(-1);
+
     if (conf->FetchOpt("writeinterval") != "") {
         if (sscanf(conf->FetchOpt("writeinterval").c_str(), "%d", &data_dump) != 1) {
             data_dump = 0;
@@ -1004,15 +1145,45 @@ int main(int argc, char *argv[], char *envp[]) {
         CatchShutdown(-1);
     }
 
+    dumpfile_step.End();
+
+    StartupProfiler::step service_step("monitoring and services");
+
     // Start stateful alert systems
     BSSTSStateAlert *bsstsa;
     bsstsa = new BSSTSStateAlert(globalregistry);
     if (globalregistry->fatal_condition)
         CatchShutdown(-1);
 
+    // Compile the alert rules from the config, once every phy is registered
+    AlertRules::create_alertrules(globalregistry);
+    if (globalregistry->fatal_condition)
+        CatchShutdown(-1);
+
     // Add system monitor 
     Systemmonitor::create_systemmonitor(globalregistry);
 
+    // Shed load as memory use nears the budget, if there is one
+    MemoryGovernor::create_memorygovernor(globalregistry);
+
+    // Keep long-term history on disk, if enabled
+    KisTimeseries::create_timeseries(globalregistry);
+
+    // Add the push event stream
+    EventStream::create_eventstream(globalregistry);
+
+    // Merge the devices of other servers, if any are configured
+    Federation::create_federation(globalregistry);
+
+    // Shard remote capture across the cluster, if one is configured
+    Cluster::create_cluster(globalregistry);
+
+    service_step.End();
+
+    // Sources need the GPS, and the web server its cache
+    gps_task.Wait();
+    static_task.Wait();
+
     // Blab about starting
     globalregistry->messagebus->InjectMessage("Kismet starting to gather packets",
                                               MSGFLAG_INFO);
@@ -1029,6 +1200,8 @@ int main(int argc, char *argv[], char *envp[]) {
     // Start the http server as the last thing before we start sources
     globalregistry->httpd_server->StartHttpd();
 
+    StartupProfiler::Complete(globalregistry);
+
     sigset_t mask, oldmask;
     sigemptyset(&mask);
     sigemptyset(&oldmask);
@@ -1053,6 +1226,9 @@ int main(int argc, char *argv[], char *envp[]) {
         tm.tv_sec = 0;
         tm.tv_usec = 100000;
 
+        // Wake up early for timers due before the next slice
+        globalregistry->timetracker->ClampTimeout(&tm);
+
         if (select(max_fd + 1, &rset, &wset, NULL, &tm) < 0) {
             if (errno != EINTR && errno != EAGAIN) {
                 fprintf(stderr, "Main select failed: %s\n", strerror(errno));
@@ -1067,6 +1243,11 @@ int main(int argc, char *argv[], char *envp[]) {
 
         globalregistry->timetracker->Tick();
 
+        if (reload_requested) {
+            reload_requested = 0;
+            globalregistry->kismet_config->Reload();
+        }
+
         // fprintf(stderr, "debug - main poll()\n");
 
         pollabletracker->ProcessPollableSelect(rset, wset);
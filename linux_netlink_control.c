@@ -246,25 +246,24 @@ nla_put_failure:
 #endif
 }
 
-int mac80211_set_channel_cache(int ifindex, void *nl_sock,
-        int nl80211_id, int channel, unsigned int chmode, char *errstr) {
+void *mac80211_build_channel_msg(int ifindex, int nl80211_id, int channel, 
+        unsigned int chmode, char *errstr) {
 #ifndef HAVE_LINUX_NETLINK
     snprintf(errstr, STATUS_MAX, "Kismet was not compiled with netlink/mac80211 "
             "support, check the output of ./configure for why");
-    return -1;
+    return NULL;
 #else
     struct nl_msg *msg;
-    int ret = 0;
 
     if (chmode >= 4) {
         snprintf(errstr, STATUS_MAX, "unable to set channel: invalid channel mode");
-        return -1;
+        return NULL;
     }
 
     if ((msg = nlmsg_alloc()) == NULL) {
         snprintf(errstr, STATUS_MAX, 
                 "unable to set channel: unable to allocate mac80211 control message.");
-        return -1;
+        return NULL;
     }
 
     genlmsg_put(msg, 0, 0, nl80211_id, 0, 0, NL80211_CMD_SET_WIPHY, 0);
@@ -272,24 +271,105 @@ int mac80211_set_channel_cache(int ifindex, void *nl_sock,
     NLA_PUT_U32(msg, NL80211_ATTR_WIPHY_FREQ, mac80211_chan_to_freq(channel));
     NLA_PUT_U32(msg, NL80211_ATTR_WIPHY_CHANNEL_TYPE, chmode);
 
-    if ((ret = nl_send_auto_complete(nl_sock, msg)) >= 0) {
-        if ((ret = nl_wait_for_ack(nl_sock)) < 0) 
-            goto nla_put_failure;
-    }
+    return msg;
 
+nla_put_failure:
+    snprintf(errstr, STATUS_MAX, 
+            "unable to set channel %u/%u mode %u via mac80211: unable to build "
+            "control message", channel, mac80211_chan_to_freq(channel), chmode);
     nlmsg_free(msg);
+    return NULL;
+#endif
+}
 
-    return 0;
+void *mac80211_build_frequency_msg(int ifindex, int nl80211_id, 
+        unsigned int control_freq, unsigned int chan_width, 
+        unsigned int center_freq1, unsigned int center_freq2,
+        char *errstr) {
+#ifndef HAVE_LINUX_NETLINK
+	snprintf(errstr, STATUS_MAX, "Kismet was not compiled with netlink/mac80211 "
+			 "support, check the output of ./configure for why");
+    return NULL;
+#else
+    struct nl_msg *msg;
+
+    if ((msg = nlmsg_alloc()) == NULL) {
+        snprintf(errstr, STATUS_MAX, 
+                "unable to set channel/frequency: unable to allocate "
+                "mac80211 control message.");
+        return NULL;
+    }
+
+    genlmsg_put(msg, 0, 0, nl80211_id, 0, 0, NL80211_CMD_SET_WIPHY, 0);
+    NLA_PUT_U32(msg, NL80211_ATTR_IFINDEX, ifindex);
+    NLA_PUT_U32(msg, NL80211_ATTR_WIPHY_FREQ, control_freq);
+    NLA_PUT_U32(msg, NL80211_ATTR_CHANNEL_WIDTH, chan_width);
+
+    if (center_freq1 != 0) {
+        NLA_PUT_U32(msg, NL80211_ATTR_CENTER_FREQ1, center_freq1);
+    }
+
+    return msg;
 
 nla_put_failure:
-    snprintf(errstr, STATUS_MAX, 
-            "unable to set channel %u/%u mode %u via mac80211: "
-            "error code %d", channel, mac80211_chan_to_freq(channel), chmode, ret);
-    nlmsg_free(msg);
-    return ret;
+	snprintf(errstr, STATUS_MAX, 
+            "unable to set frequency %u %u %u via mac80211: unable to build "
+            "control message", control_freq, chan_width, center_freq1);
+	nlmsg_free(msg);
+	return NULL;
+#endif
+}
+
+int mac80211_send_control_msg(void *nl_sock, void *msg) {
+#ifndef HAVE_LINUX_NETLINK
+    return -1;
+#else
+    struct nlmsghdr *hdr = nlmsg_hdr((struct nl_msg *) msg);
+    int ret;
+
+    /* Sending completes the header with the next sequence number of the socket; 
+     * clear it so a message can be sent again */
+    hdr->nlmsg_seq = 0;
+    hdr->nlmsg_pid = 0;
+
+    if ((ret = nl_send_auto_complete((struct nl_sock *) nl_sock, 
+                    (struct nl_msg *) msg)) < 0)
+        return ret;
+
+    if ((ret = nl_wait_for_ack((struct nl_sock *) nl_sock)) < 0)
+        return ret;
+
+    return 0;
 #endif
 }
 
+void mac80211_free_control_msg(void *msg) {
+#ifdef HAVE_LINUX_NETLINK
+    if (msg != NULL)
+        nlmsg_free((struct nl_msg *) msg);
+#endif
+}
+
+int mac80211_set_channel_cache(int ifindex, void *nl_sock,
+        int nl80211_id, int channel, unsigned int chmode, char *errstr) {
+    void *msg;
+    int ret;
+
+    if ((msg = mac80211_build_channel_msg(ifindex, nl80211_id, channel, 
+                    chmode, errstr)) == NULL)
+        return -1;
+
+    if ((ret = mac80211_send_control_msg(nl_sock, msg)) < 0) {
+        snprintf(errstr, STATUS_MAX, 
+                "unable to set channel %u/%u mode %u via mac80211: "
+                "error code %d", channel, mac80211_chan_to_freq(channel), chmode, ret);
+    }
+
+    mac80211_free_control_msg(msg);
+
+    return ret;
+}
+
 int mac80211_set_channel(const char *interface, int channel, 
         unsigned int chmode, char *errstr) {
 #ifndef HAVE_LINUX_NETLINK
@@ -317,46 +397,22 @@ int mac80211_set_frequency_cache(int ifindex, void *nl_sock, int nl80211_id,
         unsigned int control_freq, unsigned int chan_width, 
         unsigned int center_freq1, unsigned int center_freq2,
         char *errstr) {
-#ifndef HAVE_LINUX_NETLINK
-	snprintf(errstr, STATUS_MAX, "Kismet was not compiled with netlink/mac80211 "
-			 "support, check the output of ./configure for why");
-    return -1;
-#else
-    struct nl_msg *msg;
-    int ret = 0;
+    void *msg;
+    int ret;
 
-    if ((msg = nlmsg_alloc()) == NULL) {
-        snprintf(errstr, STATUS_MAX, 
-                "unable to set channel/frequency: unable to allocate "
-                "mac80211 control message.");
+    if ((msg = mac80211_build_frequency_msg(ifindex, nl80211_id, control_freq,
+                    chan_width, center_freq1, center_freq2, errstr)) == NULL)
         return -1;
-    }
 
-    genlmsg_put(msg, 0, 0, nl80211_id, 0, 0, NL80211_CMD_SET_WIPHY, 0);
-    NLA_PUT_U32(msg, NL80211_ATTR_IFINDEX, ifindex);
-    NLA_PUT_U32(msg, NL80211_ATTR_WIPHY_FREQ, control_freq);
-    NLA_PUT_U32(msg, NL80211_ATTR_CHANNEL_WIDTH, chan_width);
-
-    if (center_freq1 != 0) {
-        NLA_PUT_U32(msg, NL80211_ATTR_CENTER_FREQ1, center_freq1);
-    }
-
-    if ((ret = nl_send_auto_complete(nl_sock, msg)) >= 0) {
-        if ((ret = nl_wait_for_ack(nl_sock)) < 0) 
-            goto nla_put_failure;
+    if ((ret = mac80211_send_control_msg(nl_sock, msg)) < 0) {
+        snprintf(errstr, STATUS_MAX, 
+                "unable to set frequency %u %u %u via mac80211: error code %d",
+                control_freq, chan_width, center_freq1, ret);
     }
 
-    nlmsg_free(msg);
-
-    return 0;
+    mac80211_free_control_msg(msg);
 
-nla_put_failure:
-	snprintf(errstr, STATUS_MAX, 
-            "unable to set frequency %u %u %u via mac80211: error code %d",
-            control_freq, chan_width, center_freq1, ret);
-	nlmsg_free(msg);
-	return ret;
-#endif
+    return ret;
 }
 
 int mac80211_set_frequency(const char *interface, 
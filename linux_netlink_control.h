@@ -99,6 +99,32 @@ int mac80211_set_frequency_cache(int ifidx, void *nl_sock, int nl80211_id,
         unsigned int control_freq, unsigned int chan_width, unsigned int center_freq1, 
         unsigned int center_freq2, char *errstr);
 
+/* Build the control message for a channel or frequency ahead of time, so that 
+ * hopping only needs to send it.  Arguments match mac80211_set_channel_cache and
+ * mac80211_set_frequency_cache; the message is only valid for the socket state it
+ * was built for.
+ *
+ * Returns:
+ * NULL Error, errstr is set
+ * ptr  Message, to be freed with mac80211_free_control_msg
+ */
+void *mac80211_build_channel_msg(int ifindex, int nl80211_id, int channel, 
+        unsigned int chmode, char *errstr);
+void *mac80211_build_frequency_msg(int ifindex, int nl80211_id, 
+        unsigned int control_freq, unsigned int chan_width, 
+        unsigned int center_freq1, unsigned int center_freq2, char *errstr);
+
+/* Send a control message and wait for the ack; messages can be sent any number
+ * of times.
+ *
+ * Returns:
+ * <0   Error code
+ *  0   Success
+ */
+int mac80211_send_control_msg(void *nl_sock, void *msg);
+
+void mac80211_free_control_msg(void *msg);
+
 /* Get the parent phy of an interface.
  *
  * Returns:
@@ -57,6 +57,44 @@ struct mac_addr {
     uint64_t longmask;
     int error;
 
+    // Value of a hex digit, or -1
+    static inline int hex_nibble(char c) {
+        if (c >= '0' && c <= '9')
+            return c - '0';
+
+        c |= 0x20;
+
+        if (c >= 'a' && c <= 'f')
+            return c - 'a' + 10;
+
+        return -1;
+    }
+
+    // Read one byte of up to two hex digits and step past it; like the "%2hX"
+    // scan this replaces, always steps two characters when there are two
+    static inline bool parse_hex_byte(const char *&in, unsigned int &byte) {
+        int h = hex_nibble(in[0]);
+
+        if (h < 0)
+            return false;
+
+        if (in[1] == 0) {
+            byte = h;
+            in++;
+            return true;
+        }
+
+        int l = hex_nibble(in[1]);
+
+        if (l < 0)
+            byte = h;
+        else
+            byte = (h << 4) | l;
+
+        in += 2;
+        return true;
+    }
+
     // Convert a string mac address to the long-int storage format, with 
 	// mask conversion if present.
     void string2long(const char *in) {
@@ -66,7 +104,7 @@ struct mac_addr {
 
         longmask = (uint64_t) -1;
 
-		short unsigned int byte;
+		unsigned int byte;
 
 		int nbyte = 0;
 		int mode = 0;
@@ -85,17 +123,11 @@ struct mac_addr {
 				continue;
 			}
 
-			if (sscanf(in, "%2hX", &byte) != 1) {
-                // printf("couldn't read byte in pos %d '%s' %x\n", nbyte, in, in[0]);
+			if (!parse_hex_byte(in, byte)) {
 				error = 1;
 				break;
 			}
 
-			if (strlen(in) >= 2)
-				in += 2;
-			else
-				in++;
-
 			if (nbyte >= MAC_LEN_MAX) {
                 // printf("pos > max len\n");
 				error = 1;
@@ -159,7 +191,7 @@ struct mac_addr {
     inline static bool PrepareSearchTerm(string s, uint64_t &ret_term, 
             unsigned int &ret_len) {
 
-		short unsigned int byte;
+		unsigned int byte;
 		int nbyte = 0;
         const char *in = s.c_str();
 
@@ -175,16 +207,11 @@ struct mac_addr {
 				continue;
 			}
 
-			if (sscanf(in, "%2hX", &byte) != 1) {
+			if (!parse_hex_byte(in, byte)) {
                 ret_len = 0;
                 return false;
 			}
 
-			if (strlen(in) >= 2)
-				in += 2;
-			else
-				in++;
-
 			if (nbyte >= MAC_LEN_MAX) {
                 ret_len = 0;
                 return false;
@@ -214,12 +241,15 @@ struct mac_addr {
         return false;
     }
 
+    // The narrower of two masks, which the masked compares use; compiles to a
+    // conditional move rather than a branch
+    static inline uint64_t common_mask(uint64_t a, uint64_t b) {
+        return a < b ? a : b;
+    }
+
     // Masked MAC compare
     inline bool operator== (const mac_addr& op) const {
-        if (longmask < op.longmask)
-            return ((longmac & longmask) == (op.longmac & longmask));
-
-        return ((longmac & op.longmask) == (op.longmac & op.longmask));
+        return ((longmac ^ op.longmac) & common_mask(longmask, op.longmask)) == 0;
     }
 
 	inline bool operator== (const unsigned long int op) const {
@@ -228,10 +258,7 @@ struct mac_addr {
 
     // MAC compare
     inline bool operator!= (const mac_addr& op) const {
-        if (longmask < op.longmask)
-            return ((longmac & longmask) != (op.longmac & longmask));
-
-        return ((longmac & op.longmask) != (op.longmac & op.longmask));
+        return ((longmac ^ op.longmac) & common_mask(longmask, op.longmask)) != 0;
     }
 
     // mac less-than-eq
@@ -281,6 +308,11 @@ struct mac_addr {
         return index64(longmac, mdex);
     }
 
+    // Locally administered, as randomized addresses are
+    inline bool LocallyAdministered() const {
+        return (longmac >> (5 * 8)) & 0x02;
+    }
+
 	// Return the top 3 of the mac. 
 	inline uint32_t OUI() const {
 		return (longmac >> (3 * 8)) & 0x00FFFFFF;
@@ -294,28 +326,43 @@ struct mac_addr {
         return (val[0] << 16) | (val[1] << 8) | val[2];
     }
 
-    inline string Mac2String() const {
-		ostringstream osstr;
+    // Format the 6 octets of a value as XX:XX:XX:XX:XX:XX into out, which
+    // must hold 18 bytes
+    static inline void long2string(uint64_t val, char *out) {
+        static const char hexdigits[] = "0123456789ABCDEF";
 
-		for (unsigned int x = 0; x < MAC_LEN_MAX; x++) {
-			osstr << hex << setw(2) << setfill('0') << uppercase << index64(longmac, x);
-			if (x != MAC_LEN_MAX - 1)
-				osstr << ':';
-		}
+        for (unsigned int x = 0; x < MAC_LEN_MAX; x++) {
+            unsigned int byte = (uint8_t) (val >> ((MAC_LEN_MAX - x - 1) * 8));
+            out[x * 3] = hexdigits[byte >> 4];
+            out[x * 3 + 1] = hexdigits[byte & 0xF];
+            out[x * 3 + 2] = ':';
+        }
 
-		return osstr.str();
+        out[(MAC_LEN_MAX * 3) - 1] = 0;
     }
 
-    inline string MacMask2String() const {
-		ostringstream osstr;
+    inline string Mac2String() const {
+        char buf[MAC_LEN_MAX * 3];
+        long2string(longmac, buf);
+        return string(buf, (MAC_LEN_MAX * 3) - 1);
+    }
 
-		for (unsigned int x = 0; x < MAC_LEN_MAX; x++) {
-			osstr << hex << setw(2) << setfill('0') << uppercase << index64(longmask, x);
-			if (x != MAC_LEN_MAX - 1)
-				osstr << ':';
-		}
+    inline string MacMask2String() const {
+        char buf[MAC_LEN_MAX * 3];
+        long2string(longmask, buf);
+        return string(buf, (MAC_LEN_MAX * 3) - 1);
+    }
 
-		return osstr.str();
+    // Hash of the address for hashed containers; only meaningful for unmasked
+    // addresses, since a mask makes different addresses compare equal
+    inline uint64_t Hash() const {
+        uint64_t k = longmac;
+        k ^= k >> 33;
+        k *= 0xff51afd7ed558ccdULL;
+        k ^= k >> 33;
+        k *= 0xc4ceb9fe1a85ec53ULL;
+        k ^= k >> 33;
+        return k;
     }
 
     inline uint64_t GetAsLong() const {
@@ -328,6 +375,12 @@ struct mac_addr {
 
 };
 
+// Hash functor for unordered containers of unmasked addresses
+struct mac_addr_hash {
+    inline size_t operator()(const mac_addr& m) const {
+        return (size_t) m.Hash();
+    }
+};
 
 // A templated container for storing groups of masked mac addresses.  A stl-map 
 // will work for single macs, but we need this for smart mask matching on 
@@ -19,6 +19,9 @@
 #include "config.h"
 
 #include <stdio.h>
+#include <algorithm>
+#include <map>
+
 #include "configfile.h"
 #include "messagebus.h"
 #include "util.h"
@@ -26,6 +29,7 @@
 
 Manuf::Manuf(GlobalRegistry *in_globalreg) {
     globalreg = in_globalreg;
+    mfile = NULL;
 
     if (globalreg->kismet_config == NULL) {
         fprintf(stderr, "FATAL OOPS:  Manuf called before kismet_config\n");
@@ -61,132 +65,77 @@ Manuf::Manuf(GlobalRegistry *in_globalreg) {
 void Manuf::IndexOUI() {
     char buf[1024];
     int line = 0;
-    fpos_t prev_pos;
     short int m[3];
-    uint32_t last_oui = 0;
+    char manuf[16];
+    int pos;
+
+    // Offsets of names already in the table
+    map<string, uint32_t> name_map;
 
     if (mfile == NULL)
         return;
 
     _MSG("Indexing manufacturer db", MSGFLAG_INFO);
 
-    fgetpos(mfile, &prev_pos);
-
     while (!feof(mfile)) {
-        if (fgets(buf, 1024, mfile) == NULL || feof(mfile))
+        if (fgets(buf, 1024, mfile) == NULL)
             break;
 
-        if ((line % 50) == 0) {
-            if (sscanf(buf, "%hx:%hx:%hx",
-                       &(m[0]), &(m[1]), &(m[2])) == 3) {
-
-                // Log a position at the previous pos - which is the line before
-                // this one, so we're inclusive
-                index_pos ip;
-                uint32_t oui;
-
-                oui = 0;
-                oui |= (uint32_t) m[0] << 16;
-                oui |= (uint32_t) m[1] << 8;
-                oui |= (uint32_t) m[2];
-
-                if (oui < last_oui) {
-                    _MSG("Warning:  Manuf file appears to be out of order, expected "
-                            "sorted manuf OUI data", MSGFLAG_ERROR);
-                }
-
-                ip.oui = oui;
-                ip.pos = prev_pos;
-
-                last_oui = oui;
-
-                index_vec.push_back(ip);
-            } else {
-                // Compensate for not getting a reasonable line (probably a
-                // comment) by decrementing here so we keep trying at each
-                // index point until we get info we're looking for
-                line--;
-            }
-        }
-
-        fgetpos(mfile, &prev_pos);
         line++;
-    }
 
-    _MSG("Completed indexing manufacturer db, " + IntToString(line) + " lines " +
-         IntToString(index_vec.size()) + " indexes", MSGFLAG_INFO);
-}
+        // Only plain OUIs are supported, skip sub-allocated ranges like
+        // 00:1B:C5:00:00:00/36, comments, and blank lines
+        if (sscanf(buf, "%hx:%hx:%hx%n", &(m[0]), &(m[1]), &(m[2]), &pos) != 3)
+            continue;
 
-string Manuf::LookupOUI(mac_addr in_mac) {
-    uint32_t soui = in_mac.OUI(), toui;
-    int matched = -1;
-    char buf[1024];
-    short int m[3];
-    char manuf[16];
+        if (buf[pos] != ' ' && buf[pos] != '\t')
+            continue;
 
-    if (mfile == NULL)
-        return "Unknown";
+        if (sscanf(buf + pos, "%10s", manuf) != 1)
+            continue;
 
-    // Use the cache first
-    if (oui_map.find(soui) != oui_map.end()) {
-        return oui_map[soui].manuf;
-    }
+        string name = MungeToPrintable(string(manuf));
 
-    for (unsigned int x = 0; x < index_vec.size(); x++) {
-        if (soui > index_vec[x].oui) {
-            matched = x;
-            continue;
+        oui_rec rec;
+        rec.oui = mac_addr::OUI(m);
+
+        map<string, uint32_t>::iterator ni = name_map.find(name);
+        if (ni != name_map.end()) {
+            rec.name_pos = ni->second;
+        } else {
+            rec.name_pos = name_table.length();
+            name_table.append(name);
+            name_table.push_back('\0');
+            name_map[name] = rec.name_pos;
         }
 
-        break;
+        oui_vec.push_back(rec);
     }
 
-    // Cache unknown to save us effort in the future
-    if (matched < 0) {
-        manuf_data md;
-        md.oui = soui;
-        md.manuf = "Unknown";
-        oui_map[soui] = md;
+    fclose(mfile);
+    mfile = NULL;
 
-        return md.manuf;
-    }
+    // Keep the first entry for any OUI listed more than once
+    std::stable_sort(oui_vec.begin(), oui_vec.end());
+    oui_vec.erase(std::unique(oui_vec.begin(), oui_vec.end(), 
+                [](const oui_rec& a, const oui_rec& b) {
+                    return a.oui == b.oui;
+                }), oui_vec.end());
+    oui_vec.shrink_to_fit();
 
-    // Jump backwards one index in the matching unless we're in the first block
-    if (matched > 0)
-        matched -= 1;
+    _MSG("Completed indexing manufacturer db, " + IntToString(line) + " lines " +
+         IntToString(oui_vec.size()) + " manufacturers", MSGFLAG_INFO);
+}
 
-    fsetpos(mfile, &(index_vec[matched].pos));
+string Manuf::LookupOUI(mac_addr in_mac) {
+    oui_rec key;
+    key.oui = in_mac.OUI();
 
-    while (!feof(mfile)) {
-        if (fgets(buf, 1024, mfile) == NULL || feof(mfile))
-            break;
+    vector<oui_rec>::const_iterator i = 
+        std::lower_bound(oui_vec.begin(), oui_vec.end(), key);
 
-        if (sscanf(buf, "%hx:%hx:%hx\t%10s",
-                   &(m[0]), &(m[1]), &(m[2]), manuf) == 4) {
-
-            // Log a position at the previous pos - which is the line before
-            // this one, so we're inclusive
-            toui = mac_addr::OUI(m);
-
-            if (toui == soui) {
-                manuf_data md;
-                md.oui = soui;
-                md.manuf = MungeToPrintable(string(manuf));
-                oui_map[soui] = md;
-                return md.manuf;
-            }
-
-            if (toui > soui) {
-                manuf_data md;
-                md.oui = soui;
-                md.manuf = "Unknown";
-                oui_map[soui] = md;
-                return md.manuf;
-            }
-        }
-    }
+    if (i == oui_vec.end() || i->oui != key.oui)
+        return "Unknown";
 
-    return "Unknown";
+    return string(name_table.c_str() + i->name_pos);
 }
-
-
@@ -40,26 +40,31 @@ public:
 	Manuf() { fprintf(stderr, "FATAL OOPS: Manuf()\n"); exit(1); }
 	Manuf(GlobalRegistry *in_globalreg);
 
+    // Load the whole manuf file into the OUI table
 	void IndexOUI();
 
+    // Look up the manufacturer of a MAC.  The table is never modified after 
+    // loading, so lookups take no locks and do no file IO.
 	string LookupOUI(mac_addr in_mac);
 
-	struct index_pos {
+    // Packed OUI record; the name is an offset into the name table
+	struct oui_rec {
 		uint32_t oui;
-		fpos_t pos;
-	};
+		uint32_t name_pos;
 
-	struct manuf_data {
-		uint32_t oui;
-		string manuf;
-	}; 
+        bool operator<(const oui_rec& r) const {
+            return oui < r.oui;
+        }
+	};
 
 protected:
 	GlobalRegistry *globalreg;
 
-	vector<index_pos> index_vec;
+    // Sorted by OUI for binary searching
+	vector<oui_rec> oui_vec;
 
-	map<uint32_t, manuf_data> oui_map;
+    // NUL-separated manufacturer names, each distinct name stored once
+    string name_table;
 
 	FILE *mfile;
 };
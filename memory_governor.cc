@@ -0,0 +1,361 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+
+#include "memory_governor.h"
+#include "configfile.h"
+#include "messagebus.h"
+#include "timetracker.h"
+#include "packetchain.h"
+#include "packet_retention.h"
+#include "devicetracker.h"
+#include "system_monitor.h"
+#include "kis_metrics.h"
+
+// Levels are left this far below where they start, in percent of the budget
+#define MEMORY_GOVERNOR_HYSTERESIS  5
+
+shared_ptr<MemoryGovernor> MemoryGovernor::create_memorygovernor(GlobalRegistry *in_globalreg) {
+    string opt = in_globalreg->kismet_config->FetchOpt("memory_budget_mb");
+
+    if (opt.length() == 0)
+        return NULL;
+
+    uint64_t budget = 0;
+
+    if (StrLower(opt) == "auto") {
+        budget = FetchCgroupLimit();
+
+        if (budget == 0) {
+            in_globalreg->messagebus->InjectMessage("memory_budget_mb=auto, but "
+                    "Kismet isn't in a cgroup with a memory limit; not governing "
+                    "memory use", MSGFLAG_ERROR);
+            return NULL;
+        }
+    } else {
+        unsigned int mb;
+
+        if (sscanf(opt.c_str(), "%u", &mb) != 1 || mb == 0) {
+            in_globalreg->messagebus->InjectMessage("Invalid memory_budget_mb, "
+                    "expected a size in MB or 'auto'; not governing memory use",
+                    MSGFLAG_ERROR);
+            return NULL;
+        }
+
+        budget = (uint64_t) mb * 1024 * 1024;
+    }
+
+    shared_ptr<MemoryGovernor> mon(new MemoryGovernor(in_globalreg, budget));
+    in_globalreg->RegisterLifetimeGlobal(mon);
+    in_globalreg->InsertGlobal("MEMORY_GOVERNOR", mon);
+    return mon;
+}
+
+uint64_t MemoryGovernor::FetchCgroupLimit() {
+    const char *limit_files[] = {
+        // cgroup v2, 'max' when unlimited
+        "/sys/fs/cgroup/memory.max",
+        // cgroup v1, a huge number when unlimited
+        "/sys/fs/cgroup/memory/memory.limit_in_bytes",
+    };
+
+    for (auto f : limit_files) {
+        FILE *lf = fopen(f, "r");
+
+        if (lf == NULL)
+            continue;
+
+        unsigned long long limit = 0;
+        int r = fscanf(lf, "%llu", &limit);
+
+        fclose(lf);
+
+        if (r != 1 || limit == 0 || limit >= (1ULL << 60))
+            return 0;
+
+        return limit;
+    }
+
+    return 0;
+}
+
+MemoryGovernor::MemoryGovernor(GlobalRegistry *in_globalreg, uint64_t in_budget) {
+    globalreg = in_globalreg;
+
+    budget = in_budget;
+    step = 0;
+    last_rss = 0;
+
+    unsigned int pct[step_devices + 1] = { 0, 70, 80, 90, 95 };
+
+    vector<string> levelopt =
+        StrTokenize(globalreg->kismet_config->FetchOpt("memory_governor_levels"), ",");
+
+    if (levelopt.size() != 0) {
+        bool valid = levelopt.size() == step_devices;
+        unsigned int parsed[step_devices + 1] = { 0 };
+
+        for (unsigned int x = 0; valid && x < levelopt.size(); x++) {
+            if (sscanf(levelopt[x].c_str(), "%u", &(parsed[x + 1])) != 1 ||
+                    parsed[x + 1] <= parsed[x] || parsed[x + 1] > 100)
+                valid = false;
+        }
+
+        if (valid) {
+            for (unsigned int x = 1; x <= step_devices; x++)
+                pct[x] = parsed[x];
+        } else {
+            _MSG("Invalid memory_governor_levels, expected four increasing "
+                    "percentages of the budget; using 70,80,90,95", MSGFLAG_ERROR);
+        }
+    }
+
+    levels[0] = 0;
+    for (unsigned int x = 1; x <= step_devices; x++)
+        levels[x] = budget / 100 * pct[x];
+
+    string pauseopt = globalreg->kismet_config->FetchOpt("memory_governor_pause");
+
+    if (pauseopt.length() == 0)
+        pauseopt = "ipdata,heatmap";
+
+    for (auto h : StrTokenize(pauseopt, ","))
+        if (StrStrip(h).length() != 0)
+            pause_handlers.push_back(StrStrip(h));
+
+    shed_devices_pct =
+        globalreg->kismet_config->FetchOptUInt("memory_governor_shed_devices", 10);
+
+    if (shed_devices_pct == 0 || shed_devices_pct > 100)
+        shed_devices_pct = 10;
+
+    shared_ptr<KisMetrics> metrics =
+        globalreg->FetchGlobalAs<KisMetrics>("METRICS");
+
+    for (unsigned int x = 1; x <= step_devices; x++) {
+        if (metrics == NULL)
+            metric_steps[x].reset(new kis_metric_counter());
+        else
+            metric_steps[x] =
+                metrics->register_counter("kismet_memory_governor_steps",
+                        "times the memory governor started shedding a step",
+                        "step=" + KisMetrics::label_escape(StepName(x)));
+    }
+
+    if (metrics == NULL) {
+        metric_evicted.reset(new kis_metric_counter());
+    } else {
+        metric_evicted =
+            metrics->register_counter("kismet_memory_governor_evicted_devices",
+                    "devices removed by the memory governor");
+
+        metrics->register_gauge("kismet_memory_budget_bytes",
+                "memory budget of the governor", "",
+                [this]() -> double {
+                    return budget;
+                });
+
+        metrics->register_gauge("kismet_memory_rss_bytes",
+                "RSS last checked by the memory governor", "",
+                [this]() -> double {
+                    return last_rss;
+                });
+
+        metrics->register_gauge("kismet_memory_governor_step",
+                "load shedding step of the memory governor, 0 for none", "",
+                [this]() -> double {
+                    return step;
+                });
+    }
+
+    check_timer_id =
+        globalreg->timetracker->RegisterTimer(SERVER_TIMESLICES_SEC * 5, NULL, 1,
+                [this](int) -> int {
+                    CheckMemory();
+                    return 1;
+                });
+
+    _MSG("Governing memory use to a budget of " +
+            UIntToString(budget / 1024 / 1024) + "MB; load will be shed from " +
+            UIntToString(pct[step_history]) + "% of the budget", MSGFLAG_INFO);
+}
+
+MemoryGovernor::~MemoryGovernor() {
+    globalreg->RemoveGlobal("MEMORY_GOVERNOR");
+
+    if (globalreg->timetracker != NULL)
+        globalreg->timetracker->RemoveTimer(check_timer_id);
+
+    shared_ptr<KisMetrics> metrics =
+        globalreg->FetchGlobalAs<KisMetrics>("METRICS");
+
+    if (metrics != NULL) {
+        metrics->remove_metric("kismet_memory_budget_bytes");
+        metrics->remove_metric("kismet_memory_rss_bytes");
+        metrics->remove_metric("kismet_memory_governor_step");
+    }
+}
+
+string MemoryGovernor::StepName(int in_step) {
+    switch (in_step) {
+        case step_history:
+            return "history";
+        case step_retention:
+            return "retention";
+        case step_dissectors:
+            return "dissectors";
+        case step_devices:
+            return "devices";
+    }
+
+    return "none";
+}
+
+void MemoryGovernor::CheckMemory() {
+    shared_ptr<Systemmonitor> monitor =
+        globalreg->FetchGlobalAs<Systemmonitor>("SYSTEM_MONITOR");
+
+    if (monitor == NULL)
+        return;
+
+    // Only read on Linux; nothing to govern without it
+    uint64_t rss = monitor->get_memory() * 1024;
+
+    if (rss == 0)
+        return;
+
+    last_rss = rss;
+
+    uint64_t hysteresis = budget / 100 * MEMORY_GOVERNOR_HYSTERESIS;
+
+    while (step < step_devices && rss >= levels[step + 1]) {
+        step++;
+        EnterStep(step, rss);
+    }
+
+    while (step > 0 && rss + hysteresis < levels[step]) {
+        LeaveStep(step, rss);
+        step--;
+    }
+
+    // Shedding devices continues for as long as we're at that step
+    if (step == step_devices) {
+        shared_ptr<Devicetracker> devicetracker =
+            globalreg->FetchGlobalAs<Devicetracker>("DEVICE_TRACKER");
+
+        if (devicetracker == NULL)
+            return;
+
+        unsigned int num_devices = devicetracker->FetchNumDevices(KIS_PHY_ANY);
+        unsigned int shed = num_devices * shed_devices_pct / 100;
+
+        if (shed == 0 && num_devices != 0)
+            shed = 1;
+
+        unsigned int removed = devicetracker->ShedDevices(shed);
+
+        if (removed != 0) {
+            metric_evicted->inc(removed);
+
+            _MSG("Memory use is " + UIntToString(rss / 1024 / 1024) + "MB of a " +
+                    UIntToString(budget / 1024 / 1024) + "MB budget, removed the " +
+                    UIntToString(removed) + " least recently seen devices",
+                    MSGFLAG_ERROR);
+        }
+    }
+}
+
+void MemoryGovernor::EnterStep(int in_step, uint64_t in_rss) {
+    metric_steps[in_step]->inc();
+
+    string usage = "Memory use is " + UIntToString(in_rss / 1024 / 1024) + "MB of a " +
+        UIntToString(budget / 1024 / 1024) + "MB budget, ";
+
+    if (in_step == step_history) {
+        shared_ptr<Devicetracker> devicetracker =
+            globalreg->FetchGlobalAs<Devicetracker>("DEVICE_TRACKER");
+
+        if (devicetracker != NULL)
+            devicetracker->SetShedHistory(true);
+
+        _MSG(usage + "no longer keeping per-device data history", MSGFLAG_ERROR);
+    } else if (in_step == step_retention) {
+        shared_ptr<PacketRetention> retention =
+            globalreg->FetchGlobalAs<PacketRetention>("PACKET_RETENTION");
+
+        if (retention == NULL) {
+            _MSG(usage + "but packet retention is not enabled", MSGFLAG_INFO);
+            return;
+        }
+
+        globalreg->packetchain->PauseHandler("packet retention", true);
+        size_t freed = retention->ReleaseAll();
+
+        _MSG(usage + "dropped " + UIntToString(freed / 1024) + "KB of retained "
+                "packets and paused packet retention", MSGFLAG_ERROR);
+    } else if (in_step == step_dissectors) {
+        string paused;
+
+        for (auto h : pause_handlers) {
+            if (globalreg->packetchain->PauseHandler(h, true) == 0)
+                continue;
+
+            if (paused.length() != 0)
+                paused += ", ";
+            paused += h;
+        }
+
+        if (paused.length() == 0)
+            _MSG(usage + "but none of the optional packet handlers are running",
+                    MSGFLAG_INFO);
+        else
+            _MSG(usage + "paused packet handlers " + paused, MSGFLAG_ERROR);
+    } else if (in_step == step_devices) {
+        _MSG(usage + "removing the least recently seen devices until it falls",
+                MSGFLAG_ERROR);
+    }
+}
+
+void MemoryGovernor::LeaveStep(int in_step, uint64_t in_rss) {
+    string usage = "Memory use is down to " + UIntToString(in_rss / 1024 / 1024) +
+        "MB of a " + UIntToString(budget / 1024 / 1024) + "MB budget, ";
+
+    if (in_step == step_history) {
+        shared_ptr<Devicetracker> devicetracker =
+            globalreg->FetchGlobalAs<Devicetracker>("DEVICE_TRACKER");
+
+        if (devicetracker != NULL)
+            devicetracker->SetShedHistory(false);
+
+        _MSG(usage + "keeping per-device data history again", MSGFLAG_INFO);
+    } else if (in_step == step_retention) {
+        if (globalreg->packetchain->PauseHandler("packet retention", false) != 0)
+            _MSG(usage + "resuming packet retention", MSGFLAG_INFO);
+    } else if (in_step == step_dissectors) {
+        for (auto h : pause_handlers)
+            globalreg->packetchain->PauseHandler(h, false);
+
+        _MSG(usage + "resuming paused packet handlers", MSGFLAG_INFO);
+    } else if (in_step == step_devices) {
+        _MSG(usage + "no longer removing devices", MSGFLAG_INFO);
+    }
+}
+
@@ -0,0 +1,103 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __MEMORY_GOVERNOR_H__
+#define __MEMORY_GOVERNOR_H__
+
+#include "config.h"
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "globalregistry.h"
+
+class kis_metric_counter;
+
+// Memory governor
+//
+// With 'memory_budget_mb' set (or 'auto', for the limit of the cgroup Kismet is
+// running in), the RSS read by the system monitor is compared to the budget
+// every few seconds, and as it crosses each of the 'memory_governor_levels'
+// (percentages of the budget) Kismet sheds another step of load:
+//
+//  1. history      new samples only go into the device totals, not the per
+//                  device data and packet size RRDs
+//  2. retention    every retained packet is dropped and retention is paused
+//  3. dissectors   the packetchain handlers in 'memory_governor_pause' are
+//                  paused
+//  4. devices      every check, 'memory_governor_shed_devices' percent of the
+//                  devices are removed, least recently seen first
+//
+// A step is undone once the RSS falls 5% of the budget below its level; devices
+// which were removed are not brought back.  Every step is announced on the
+// messagebus and counted in /metrics.
+class MemoryGovernor : public LifetimeGlobal {
+public:
+    // Returns NULL unless a memory budget is configured
+    static shared_ptr<MemoryGovernor> create_memorygovernor(GlobalRegistry *in_globalreg);
+
+private:
+    MemoryGovernor(GlobalRegistry *in_globalreg, uint64_t in_budget);
+
+public:
+    virtual ~MemoryGovernor();
+
+protected:
+    GlobalRegistry *globalreg;
+
+    enum governor_step {
+        step_history = 1,
+        step_retention = 2,
+        step_dissectors = 3,
+        step_devices = 4
+    };
+
+    // Limit of the cgroup we're in, in bytes, or 0
+    static uint64_t FetchCgroupLimit();
+
+    // Check the RSS and move between steps
+    void CheckMemory();
+
+    void EnterStep(int in_step, uint64_t in_rss);
+    void LeaveStep(int in_step, uint64_t in_rss);
+
+    std::string StepName(int in_step);
+
+    uint64_t budget;
+
+    // RSS where each step starts, in bytes; level 0 is unused
+    uint64_t levels[step_devices + 1];
+
+    // Step we're at, 0 for none, and the last RSS seen; read by /metrics
+    std::atomic<int> step;
+    std::atomic<uint64_t> last_rss;
+
+    std::vector<std::string> pause_handlers;
+    unsigned int shed_devices_pct;
+
+    int check_timer_id;
+
+    shared_ptr<kis_metric_counter> metric_steps[step_devices + 1];
+    shared_ptr<kis_metric_counter> metric_evicted;
+};
+
+#endif
+
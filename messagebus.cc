@@ -37,9 +37,22 @@ void StdoutMessageClient::ProcessMessage(string in_msg, int in_flags) {
 MessageBus::MessageBus(GlobalRegistry *in_globalreg) {
     globalreg = in_globalreg;
     pthread_mutex_init(&msg_mutex, NULL);
+
+    async_enabled = false;
+    async_ring_mask = 0;
+    async_head = async_tail = async_delivered = 0;
+    async_stop = false;
+
+    stat_queued = 0;
+    stat_coalesced = 0;
+    stat_dropped = 0;
+    stat_max_depth = 0;
 }
 
 MessageBus::~MessageBus() {
+    // Deliver whatever is still queued before the bus goes away
+    StopAsyncDispatch();
+
     pthread_mutex_lock(&msg_mutex);
 
     globalreg->RemoveGlobal("MESSAGEBUS");
@@ -49,6 +62,54 @@ MessageBus::~MessageBus() {
 }
 
 void MessageBus::InjectMessage(string in_msg, int in_flags) {
+    if (!async_enabled) {
+        DeliverMessage(in_msg, in_flags);
+        return;
+    }
+
+    // Fatal conditions have to be seen before we start shutting down, so they
+    // skip the queue; flush it first so they still arrive in order.  The
+    // dispatch thread can't wait for itself.
+    if (in_flags & (MSGFLAG_FATAL | MSGFLAG_PRINT)) {
+        if (std::this_thread::get_id() != async_thread_id)
+            FlushAsync();
+
+        DeliverMessage(in_msg, in_flags);
+        return;
+    }
+
+    std::lock_guard<std::mutex> lk(async_mutex);
+
+    if (async_head != async_tail) {
+        async_rec *last = &(async_ring[(async_head - 1) & async_ring_mask]);
+
+        if (last->flags == in_flags && last->msg == in_msg) {
+            last->repeats++;
+            stat_coalesced++;
+            return;
+        }
+    }
+
+    if (async_head - async_tail >= async_ring.size()) {
+        stat_dropped++;
+        return;
+    }
+
+    async_rec *r = &(async_ring[async_head & async_ring_mask]);
+    r->msg = in_msg;
+    r->flags = in_flags;
+    r->repeats = 0;
+
+    async_head++;
+    stat_queued++;
+
+    if (async_head - async_tail > stat_max_depth)
+        stat_max_depth = async_head - async_tail;
+
+    async_cv.notify_one();
+}
+
+void MessageBus::DeliverMessage(const string& in_msg, int in_flags) {
     local_locker lock(&msg_mutex);
 
     for (unsigned int x = 0; x < subscribers.size(); x++) {
@@ -59,6 +120,110 @@ void MessageBus::InjectMessage(string in_msg, int in_flags) {
     return;
 }
 
+void MessageBus::StartAsyncDispatch(unsigned int in_queue_size) {
+    if (async_enabled)
+        return;
+
+    // Round up to a power of two so the ring can be masked
+    uint64_t ringsz = 16;
+    while (ringsz < in_queue_size && ringsz < (1 << 20))
+        ringsz <<= 1;
+
+    async_ring.resize(ringsz);
+    async_ring_mask = ringsz - 1;
+    async_stop = false;
+
+    async_thread = std::thread([this]() { AsyncDispatchThread(); });
+    async_thread_id = async_thread.get_id();
+
+    async_enabled = true;
+}
+
+void MessageBus::StopAsyncDispatch() {
+    if (!async_thread.joinable())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lk(async_mutex);
+        async_stop = true;
+        async_cv.notify_one();
+    }
+
+    async_thread.join();
+
+    async_enabled = false;
+}
+
+void MessageBus::FlushAsync() {
+    std::unique_lock<std::mutex> lk(async_mutex);
+
+    uint64_t target = async_head;
+
+    // Don't hang a shutdown on a wedged client
+    async_flush_cv.wait_for(lk, std::chrono::seconds(1), 
+            [this, target]() { return async_delivered >= target; });
+}
+
+void MessageBus::AsyncDispatchThread() {
+    vector<async_rec> batch;
+
+    while (1) {
+        uint64_t end;
+
+        {
+            std::unique_lock<std::mutex> lk(async_mutex);
+
+            while (async_head == async_tail && !async_stop)
+                async_cv.wait(lk);
+
+            if (async_head == async_tail && async_stop)
+                break;
+
+            // Take everything queued so producers only wait on the ring while
+            // it's being emptied, not while the clients run
+            for (; async_tail != async_head; async_tail++) {
+                async_rec *r = &(async_ring[async_tail & async_ring_mask]);
+
+                batch.push_back(async_rec());
+                batch.back().msg.swap(r->msg);
+                batch.back().flags = r->flags;
+                batch.back().repeats = r->repeats;
+            }
+
+            end = async_tail;
+        }
+
+        for (auto& r : batch) {
+            DeliverMessage(r.msg, r.flags);
+
+            if (r.repeats != 0)
+                DeliverMessage("Previous message repeated " + UIntToString(r.repeats) +
+                        " more times", r.flags);
+        }
+
+        batch.clear();
+
+        {
+            std::lock_guard<std::mutex> lk(async_mutex);
+            async_delivered = end;
+            async_flush_cv.notify_all();
+        }
+    }
+}
+
+void MessageBus::FetchAsyncStats(async_stats *ret_stats) {
+    std::lock_guard<std::mutex> lk(async_mutex);
+
+    ret_stats->async = async_enabled;
+    ret_stats->queue_size = async_ring.size();
+    ret_stats->queue_depth = async_head - async_tail;
+    ret_stats->max_depth = stat_max_depth;
+    ret_stats->queued = stat_queued;
+    ret_stats->delivered = async_delivered;
+    ret_stats->coalesced = stat_coalesced;
+    ret_stats->dropped = stat_dropped;
+}
+
 void MessageBus::RegisterClient(MessageClient *in_subscriber, int in_mask) {
     local_locker lock(&msg_mutex);
 
@@ -25,6 +25,10 @@
 #include <string>
 #include <vector>
 #include <pthread.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 
 #include "globalregistry.h"
 
@@ -99,11 +103,64 @@ public:
     void RegisterClient(MessageClient *in_subcriber, int in_mask);
     void RemoveClient(MessageClient *in_unsubscriber);
 
+    // Deliver messages to the clients from a background thread instead of the
+    // thread injecting them.  Messages are queued in a ring of up to 
+    // in_queue_size; when it's full new messages are dropped and counted, and
+    // a message identical to the last one still queued is folded into it.  
+    // Fatal and PRINT messages are still delivered immediately, after the queue
+    // ahead of them.  Threads don't survive fork(), so this has to be started 
+    // after daemonizing.
+    void StartAsyncDispatch(unsigned int in_queue_size);
+
+    struct async_stats {
+        bool async;
+        uint64_t queue_size;
+        uint64_t queue_depth;
+        uint64_t max_depth;
+        uint64_t queued;
+        uint64_t delivered;
+        uint64_t coalesced;
+        uint64_t dropped;
+    };
+
+    void FetchAsyncStats(async_stats *ret_stats);
+
 protected:
     GlobalRegistry *globalreg;
 
     pthread_mutex_t msg_mutex;
 
+    // Hand a message to every subscribed client
+    void DeliverMessage(const string& in_msg, int in_flags);
+
+    // Wait for everything queued so far to be delivered
+    void FlushAsync();
+
+    void StopAsyncDispatch();
+    void AsyncDispatchThread();
+
+    struct async_rec {
+        string msg;
+        int flags;
+        // Identical messages folded into this one
+        unsigned int repeats;
+    };
+
+    std::atomic<bool> async_enabled;
+
+    // The ring and counters are protected by async_mutex
+    vector<async_rec> async_ring;
+    uint64_t async_ring_mask;
+    uint64_t async_head, async_tail, async_delivered;
+
+    std::thread async_thread;
+    std::thread::id async_thread_id;
+    std::mutex async_mutex;
+    std::condition_variable async_cv, async_flush_cv;
+    bool async_stop;
+
+    uint64_t stat_queued, stat_coalesced, stat_dropped, stat_max_depth;
+
     typedef struct {
         MessageClient *client;
         int mask;
@@ -30,6 +30,8 @@ RestMessageClient::RestMessageClient(GlobalRegistry *in_globalreg, void *in_aux)
     MessageClient(in_globalreg, in_aux),
     Kis_Net_Httpd_CPPStream_Handler(in_globalreg) {
 
+    Httpd_RegisterRoute("GET", "/messagebus/*");
+
     globalreg = in_globalreg;
 
     message_vec_id =
@@ -40,12 +42,47 @@ RestMessageClient::RestMessageClient(GlobalRegistry *in_globalreg, void *in_aux)
         globalreg->entrytracker->RegisterField("kismet.messagebus.timestamp",
                 TrackerUInt64, "message update timestamp");
 
+    message_seq_id =
+        globalreg->entrytracker->RegisterField("kismet.messagebus.sequence",
+                TrackerUInt64, "sequence of the next message, for polling by sequence");
+
     shared_ptr<tracked_message> msg_builder(new tracked_message(globalreg, 0));
 
     message_entry_id =
         globalreg->entrytracker->RegisterField("kismet.messagebus.message",
                 msg_builder, "Kismet message");
 
+    stats_id =
+        globalreg->entrytracker->RegisterField("kismet.messagebus.stats", TrackerMap,
+                "messagebus delivery statistics");
+    stats_async_id =
+        globalreg->entrytracker->RegisterField("kismet.messagebus.async", TrackerUInt8,
+                "messages are delivered by a background thread");
+    stats_queue_size_id =
+        globalreg->entrytracker->RegisterField("kismet.messagebus.queue_size",
+                TrackerUInt64, "maximum number of messages queued for delivery");
+    stats_queue_depth_id =
+        globalreg->entrytracker->RegisterField("kismet.messagebus.queue_depth",
+                TrackerUInt64, "messages currently queued for delivery");
+    stats_max_depth_id =
+        globalreg->entrytracker->RegisterField("kismet.messagebus.queue_max_depth",
+                TrackerUInt64, "most messages queued for delivery at once");
+    stats_queued_id =
+        globalreg->entrytracker->RegisterField("kismet.messagebus.queued",
+                TrackerUInt64, "messages queued for delivery");
+    stats_delivered_id =
+        globalreg->entrytracker->RegisterField("kismet.messagebus.delivered",
+                TrackerUInt64, "queued messages delivered to clients");
+    stats_coalesced_id =
+        globalreg->entrytracker->RegisterField("kismet.messagebus.coalesced",
+                TrackerUInt64, "repeated messages folded into the previous message");
+    stats_dropped_id =
+        globalreg->entrytracker->RegisterField("kismet.messagebus.dropped",
+                TrackerUInt64, "messages dropped because the queue was full");
+
+    // Hardcode a backlog count right now
+    message_backlog.set_capacity(50);
+
     pthread_mutex_init(&msg_mutex, NULL);
 
 	globalreg->messagebus->RegisterClient(this, MSGFLAG_ALL);
@@ -58,7 +95,7 @@ RestMessageClient::~RestMessageClient() {
 
     globalreg->RemoveGlobal("REST_MSG_CLIENT");
 
-    message_vec.clear();
+    message_backlog.clear();
 
     pthread_mutex_destroy(&msg_mutex);
 }
@@ -76,12 +113,7 @@ void RestMessageClient::ProcessMessage(string in_msg, int in_flags) {
     {
         local_locker lock(&msg_mutex);
 
-        message_vec.push_back(msg);
-
-        // Hardcode a backlog count right now
-        if (message_vec.size() > 50) {
-            message_vec.erase(message_vec.begin());
-        }
+        message_backlog.push(msg, msg->get_timestamp(), NULL);
     }
 }
 
@@ -96,11 +128,13 @@ bool RestMessageClient::Httpd_VerifyPath(const char *path, const char *method) {
         return false;
 
     if (tokenurl[1] == "messagebus") {
-        if (tokenurl[2] == "all_messages.msgpack") {
+        if (Httpd_StripSuffix(tokenurl[2]) == "stats") {
+            return Httpd_CanSerialize(tokenurl[2]);
+        } else if (tokenurl[2] == "all_messages.msgpack") {
             return true;
         } else if (tokenurl[2] == "all_messages.json") {
             return true;
-        } else if (tokenurl[2] == "last-time") {
+        } else if (tokenurl[2] == "last-time" || tokenurl[2] == "last-seq") {
             if (tokenurl.size() < 5)
                 return false;
 
@@ -123,6 +157,8 @@ void RestMessageClient::Httpd_CreateStreamResponse(
         size_t *upload_data_size, std::stringstream &stream) {
 
     time_t since_time = 0;
+    uint64_t since_seq = 0;
+    bool by_seq = false;
     bool wrap = false;
 
     if (strcmp(method, "GET") != 0) {
@@ -139,7 +175,49 @@ void RestMessageClient::Httpd_CreateStreamResponse(
         return;
 
     if (tokenurl[1] == "messagebus") {
-        if (tokenurl[2] == "last-time") {
+        if (Httpd_StripSuffix(tokenurl[2]) == "stats") {
+            MessageBus::async_stats mstats;
+            globalreg->messagebus->FetchAsyncStats(&mstats);
+
+            SharedTrackerElement stats(new TrackerElement(TrackerMap, stats_id));
+
+            SharedTrackerElement e;
+
+            e.reset(new TrackerElement(TrackerUInt8, stats_async_id));
+            e->set((uint8_t) mstats.async);
+            stats->add_map(e);
+
+            e.reset(new TrackerElement(TrackerUInt64, stats_queue_size_id));
+            e->set(mstats.queue_size);
+            stats->add_map(e);
+
+            e.reset(new TrackerElement(TrackerUInt64, stats_queue_depth_id));
+            e->set(mstats.queue_depth);
+            stats->add_map(e);
+
+            e.reset(new TrackerElement(TrackerUInt64, stats_max_depth_id));
+            e->set(mstats.max_depth);
+            stats->add_map(e);
+
+            e.reset(new TrackerElement(TrackerUInt64, stats_queued_id));
+            e->set(mstats.queued);
+            stats->add_map(e);
+
+            e.reset(new TrackerElement(TrackerUInt64, stats_delivered_id));
+            e->set(mstats.delivered);
+            stats->add_map(e);
+
+            e.reset(new TrackerElement(TrackerUInt64, stats_coalesced_id));
+            e->set(mstats.coalesced);
+            stats->add_map(e);
+
+            e.reset(new TrackerElement(TrackerUInt64, stats_dropped_id));
+            e->set(mstats.dropped);
+            stats->add_map(e);
+
+            Httpd_Serialize(path, stream, stats);
+            return;
+        } else if (tokenurl[2] == "last-time") {
             if (tokenurl.size() < 5)
                 return;
 
@@ -154,6 +232,22 @@ void RestMessageClient::Httpd_CreateStreamResponse(
 
             since_time = lastts;
 
+        } else if (tokenurl[2] == "last-seq") {
+            if (tokenurl.size() < 5)
+                return;
+
+            if (!Httpd_CanSerialize(tokenurl[4]))
+                return;
+
+            unsigned long long lastseq;
+            if (sscanf(tokenurl[3].c_str(), "%llu", &lastseq) != 1)
+                return;
+
+            wrap = true;
+            by_seq = true;
+
+            since_seq = lastseq;
+
         } else if (Httpd_StripSuffix(tokenurl[2]) != "all_messages") {
             return;
         }
@@ -174,16 +268,23 @@ void RestMessageClient::Httpd_CreateStreamResponse(
                 globalreg->entrytracker->GetTrackedInstance(message_timestamp_id);
             ts->set((uint64_t) globalreg->timestamp.tv_sec);
             wrapper->add_map(ts);
+
+            SharedTrackerElement seq =
+                globalreg->entrytracker->GetTrackedInstance(message_seq_id);
+            seq->set((uint64_t) message_backlog.get_next_seq());
+            wrapper->add_map(seq);
         } else {
             wrapper = msgvec;
         }
 
-        for (vector<shared_ptr<tracked_message> >::iterator i = message_vec.begin();
-                i != message_vec.end(); ++i) {
-            if (since_time < (*i)->get_timestamp()) {
-                msgvec->add_vector(*i);
-            }
-        }
+        auto add_fn = [msgvec](uint64_t, const shared_ptr<tracked_message>& m) {
+            msgvec->add_vector(m);
+        };
+
+        if (by_seq)
+            message_backlog.for_each_from_seq(since_seq, add_fn);
+        else
+            message_backlog.for_each_since_time(since_time, add_fn);
 
         Httpd_Serialize(path, stream, wrapper);
     }
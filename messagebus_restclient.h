@@ -31,6 +31,7 @@
 #include "messagebus.h"
 #include "trackedelement.h"
 #include "kis_net_microhttpd.h"
+#include "kis_backlog.h"
 
 class tracked_message : public tracker_component {
 public:
@@ -117,9 +118,13 @@ public:
 protected:
     pthread_mutex_t msg_mutex;
 
-    std::vector<shared_ptr<tracked_message> > message_vec;
+    kis_backlog<shared_ptr<tracked_message> > message_backlog;
 
-    int message_vec_id, message_entry_id, message_timestamp_id;
+    int message_vec_id, message_entry_id, message_timestamp_id, message_seq_id;
+
+    int stats_id, stats_async_id, stats_queue_size_id, stats_queue_depth_id,
+        stats_max_depth_id, stats_queued_id, stats_delivered_id, stats_coalesced_id,
+        stats_dropped_id;
 };
 
 
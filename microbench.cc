@@ -0,0 +1,558 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* Microbenchmarks of the core data structures and serializers
+ *
+ * # build and run everything, generating the beacon corpus if needed
+ * make microbench
+ *
+ * # or run only the benchmarks whose names contain any of the arguments
+ * ./kismet_microbench ringbuf chainbuf
+ *
+ * Options:
+ *  --config FILE   Parse a Kismet config file first (for ouifile, tracker
+ *                  options, etc); otherwise every option is the default
+ *  --corpus FILE   Radiotap pcap of beacons for the 802.11 benchmarks, as made
+ *                  by extra/make_benchmark_pcap.py --beacons
+ *
+ * Each benchmark prints the time per operation; compare runs of the same build
+ * options on the same host before and after a change.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+
+#include <chrono>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "globalregistry.h"
+#include "messagebus.h"
+#include "configfile.h"
+#include "util.h"
+#include "macaddr.h"
+#include "pollabletracker.h"
+#include "timetracker.h"
+#include "kis_clock.h"
+#include "kis_net_microhttpd.h"
+#include "kis_httpd_registry.h"
+#include "kis_metrics.h"
+#include "entrytracker.h"
+#include "trackedelement.h"
+#include "msgpack_adapter.h"
+#include "json_adapter.h"
+#include "xmlserialize_adapter.h"
+#include "packet.h"
+#include "packetchain.h"
+#include "channeltracker2.h"
+#include "alertracker.h"
+#include "devicetracker.h"
+#include "phy_80211.h"
+#include "ringbuf2.h"
+#include "chainbuf.h"
+#include "manuf.h"
+
+// getopt reports errors as the running binary
+char *exec_name;
+
+// Only errors; the benchmarks shouldn't be interleaved with startup chatter
+class MicrobenchMessageClient : public MessageClient {
+public:
+    MicrobenchMessageClient(GlobalRegistry *in_globalreg, void *in_aux) :
+        MessageClient(in_globalreg, in_aux) { }
+    virtual ~MicrobenchMessageClient() { }
+
+    void ProcessMessage(string in_msg, int in_flags) {
+        if (in_flags & (MSGFLAG_ERROR | MSGFLAG_FATAL))
+            fprintf(stderr, "ERROR: %s\n", in_msg.c_str());
+    }
+};
+
+static uint64_t microbench_now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Results the compiler can't prove unused
+static volatile uint64_t microbench_sink;
+
+static vector<string> microbench_filters;
+
+static bool microbench_selected(const char *in_name) {
+    if (microbench_filters.size() == 0)
+        return true;
+
+    for (auto f : microbench_filters) {
+        if (strstr(in_name, f.c_str()) != NULL)
+            return true;
+    }
+
+    return false;
+}
+
+// Run in_fn in_iterations times after a warmup of a tenth as many, and print the
+// time per call; in_bytes is the bytes handled per call, for throughput
+template<typename F>
+static void microbench_run(const char *in_name, uint64_t in_iterations,
+        size_t in_bytes, F in_fn) {
+    if (!microbench_selected(in_name))
+        return;
+
+    for (uint64_t i = 0; i < in_iterations / 10; i++)
+        in_fn(i);
+
+    uint64_t start = microbench_now_ns();
+
+    for (uint64_t i = 0; i < in_iterations; i++)
+        in_fn(i);
+
+    uint64_t elapsed = microbench_now_ns() - start;
+
+    double per_op = (double) elapsed / in_iterations;
+
+    if (in_bytes != 0)
+        printf("%-36s %10lu %12.1f ns/op %10.1f MB/s\n", in_name,
+                (unsigned long) in_iterations, per_op,
+                (in_bytes * in_iterations) / (elapsed / 1e9) / (1024 * 1024));
+    else
+        printf("%-36s %10lu %12.1f ns/op\n", in_name,
+                (unsigned long) in_iterations, per_op);
+
+    fflush(stdout);
+}
+
+// Load the 802.11 frames from a radiotap pcap, stripping the radiotap headers
+static vector<string> microbench_load_corpus(const string& in_fname,
+        unsigned int in_max) {
+    vector<string> frames;
+
+    FILE *pf = fopen(in_fname.c_str(), "rb");
+
+    if (pf == NULL) {
+        fprintf(stderr, "ERROR: Could not open corpus %s: %s\n", in_fname.c_str(),
+                strerror(errno));
+        return frames;
+    }
+
+    uint8_t hdr[24];
+
+    // Little-endian, radiotap, as make_benchmark_pcap.py writes them
+    if (fread(hdr, 24, 1, pf) != 1 || hdr[0] != 0xd4 || hdr[1] != 0xc3 ||
+            hdr[20] != 127) {
+        fprintf(stderr, "ERROR: %s is not a little-endian radiotap pcap\n",
+                in_fname.c_str());
+        fclose(pf);
+        return frames;
+    }
+
+    uint8_t rec[16];
+    vector<uint8_t> pkt;
+
+    while (frames.size() < in_max && fread(rec, 16, 1, pf) == 1) {
+        uint32_t caplen = rec[8] | (rec[9] << 8) | (rec[10] << 16) | (rec[11] << 24);
+
+        pkt.resize(caplen);
+
+        if (caplen == 0 || fread(pkt.data(), caplen, 1, pf) != 1)
+            break;
+
+        if (caplen < 4)
+            continue;
+
+        unsigned int rtlen = pkt[2] | (pkt[3] << 8);
+
+        if (rtlen >= caplen)
+            continue;
+
+        frames.push_back(string((char *) pkt.data() + rtlen, caplen - rtlen));
+    }
+
+    fclose(pf);
+
+    return frames;
+}
+
+int main(int argc, char *argv[]) {
+    exec_name = argv[0];
+
+    string configfile;
+    string corpusfile = "benchmark_beacons.pcap";
+
+    for (int a = 1; a < argc; a++) {
+        if (strcmp(argv[a], "--config") == 0 && a + 1 < argc) {
+            configfile = argv[++a];
+        } else if (strcmp(argv[a], "--corpus") == 0 && a + 1 < argc) {
+            corpusfile = argv[++a];
+        } else if (strcmp(argv[a], "--help") == 0 || strcmp(argv[a], "-h") == 0) {
+            printf("usage: %s [--config kismet.conf] [--corpus beacons.pcap] "
+                    "[benchmark name filter ...]\n", argv[0]);
+            exit(0);
+        } else {
+            microbench_filters.push_back(argv[a]);
+        }
+    }
+
+    // Bring up just enough of the server to build and dissect devices, in the
+    // same order kismet_server does
+    GlobalRegistry *globalreg = new GlobalRegistry;
+
+    globalreg->argc = argc;
+    globalreg->argv = argv;
+
+    gettimeofday(&(globalreg->timestamp), NULL);
+    globalreg->start_time = time(0);
+
+    MessageBus::create_messagebus(globalreg);
+    globalreg->messagebus->RegisterClient(new MicrobenchMessageClient(globalreg, NULL),
+            MSGFLAG_ALL);
+
+    PollableTracker::create_pollabletracker(globalreg);
+
+    ConfigFile *conf = new ConfigFile(globalreg);
+
+    if (configfile.length() != 0 && conf->ParseConfig(configfile.c_str()) < 0) {
+        fprintf(stderr, "ERROR: Could not parse config %s\n", configfile.c_str());
+        exit(1);
+    }
+
+    globalreg->kismet_config = conf;
+
+    // Don't touch the real config directory, and find the OUI file the
+    // default config would
+    if (conf->FetchOpt("configdir") == "")
+        conf->SetOpt("configdir", "/tmp/kismet_microbench", 0);
+
+    if (conf->FetchOptVec("ouifile").size() == 0) {
+        vector<string> ouifiles;
+        ouifiles.push_back("/etc/manuf");
+        ouifiles.push_back("/usr/share/wireshark/wireshark/manuf");
+        ouifiles.push_back("/usr/share/wireshark/manuf");
+        conf->SetOptVec("ouifile", ouifiles, 0);
+    }
+
+    KisClock::Init();
+    Timetracker::create_timetracker(globalreg);
+    Kis_Net_Httpd::create_httpd(globalreg);
+
+    shared_ptr<EntryTracker> entrytracker =
+        EntryTracker::create_entrytracker(globalreg);
+
+    entrytracker->RegisterSerializer("msgpack",
+            shared_ptr<TrackerElementSerializer>(new MsgpackAdapter::Serializer(globalreg)));
+    entrytracker->RegisterSerializer("json",
+            shared_ptr<TrackerElementSerializer>(new JsonAdapter::Serializer(globalreg)));
+
+    KisMetrics::create_metrics(globalreg);
+    shared_ptr<Packetchain> packetchain = Packetchain::create_packetchain(globalreg);
+    Kis_Httpd_Registry::create_http_registry(globalreg);
+    Channeltracker_V2::create_channeltracker(globalreg);
+    Alertracker::create_alertracker(globalreg);
+    shared_ptr<Devicetracker> devicetracker =
+        Devicetracker::create_devicetracker(globalreg);
+
+    int dot11_phyid = devicetracker->RegisterPhyHandler(new Kis_80211_Phy(globalreg));
+
+    globalreg->manufdb = new Manuf(globalreg);
+
+    if (globalreg->fatal_condition || dot11_phyid < 0) {
+        fprintf(stderr, "ERROR: Could not start the tracking core\n");
+        exit(1);
+    }
+
+    Kis_80211_Phy *dot11phy =
+        (Kis_80211_Phy *) devicetracker->FetchPhyHandler(dot11_phyid);
+
+    int pack_comp_linkframe = packetchain->RegisterPacketComponent("LINKFRAME");
+
+    vector<string> corpus = microbench_load_corpus(corpusfile, 4096);
+
+    printf("%-36s %10s %15s\n", "benchmark", "iterations", "time");
+
+    // Tracked elements
+    int uint64_id =
+        entrytracker->RegisterField("kismet.microbench.uint64", TrackerUInt64,
+                "microbenchmark value");
+
+    microbench_run("trackerelement_construct", 2000000, 0, [&](uint64_t) {
+            SharedTrackerElement e(new TrackerElement(TrackerUInt64, uint64_id));
+            microbench_sink += e->get_id();
+        });
+
+    // Checked element access against the proxy and TrackedScalar paths
+    SharedTrackerElement counter(new TrackerElement(TrackerUInt64, uint64_id));
+    TrackedScalar<uint64_t> counter_scalar(counter);
+
+    microbench_run("trackerelement_add_checked", 20000000, 0, [&](uint64_t i) {
+            (*counter) += i;
+            microbench_sink += GetTrackerValue<uint64_t>(counter);
+        });
+
+    microbench_run("trackerelement_add_proxy", 20000000, 0, [&](uint64_t i) {
+            tracker_fast_access<uint64_t>::ref(counter) += i;
+            microbench_sink += tracker_fast_access<uint64_t>::get(counter);
+        });
+
+    microbench_run("trackerelement_add_scalar", 20000000, 0, [&](uint64_t i) {
+            counter_scalar += i;
+            microbench_sink += counter_scalar.get();
+        });
+
+    shared_ptr<kis_tracked_device_base> builder(new kis_tracked_device_base(globalreg,
+                entrytracker->GetFieldId("kismet.device.base")));
+
+    microbench_run("trackerelement_clone_device", 20000, 0, [&](uint64_t) {
+            SharedTrackerElement e = builder->clone_type();
+            microbench_sink += e->get_id();
+        });
+
+    microbench_run("trackerelement_construct_dot11_device", 20000, 0, [&](uint64_t) {
+            shared_ptr<dot11_tracked_device> d(new dot11_tracked_device(globalreg, 0));
+            microbench_sink += d->get_id();
+        });
+
+    // Field registration; every name is new, so each is a real registration
+    vector<string> field_names;
+    for (unsigned int x = 0; x < 22000; x++)
+        field_names.push_back("kismet.microbench.field." + UIntToString(x));
+
+    microbench_run("entrytracker_register_field", 20000, 0, [&](uint64_t i) {
+            microbench_sink +=
+                entrytracker->RegisterField(field_names[i], TrackerUInt64, "field");
+        });
+
+    const char *lookup_names[] = {
+        "kismet.device.base.macaddr", "kismet.device.base.packets.total",
+        "kismet.common.signal.last_signal_dbm", "dot11.device",
+        "kismet.microbench.field.100", "kismet.microbench.missing"
+    };
+
+    microbench_run("entrytracker_get_field_id", 2000000, 0, [&](uint64_t i) {
+            microbench_sink += entrytracker->GetFieldId(lookup_names[i % 6]);
+        });
+
+    // MAC addresses
+    vector<string> mac_strings;
+    vector<mac_addr> macs;
+    for (unsigned int x = 0; x < 4096; x++) {
+        char buf[18];
+        snprintf(buf, 18, "00:11:%02X:%02X:%02X:%02X", (x >> 8) & 0xFF, x & 0xFF,
+                (x * 7) & 0xFF, (x * 13) & 0xFF);
+        mac_strings.push_back(buf);
+        macs.push_back(mac_addr(buf));
+    }
+
+    microbench_run("mac_addr_parse", 2000000, 0, [&](uint64_t i) {
+            mac_addr m(mac_strings[i % 4096]);
+            microbench_sink += m.longmac;
+        });
+
+    microbench_run("mac_addr_format", 2000000, 0, [&](uint64_t i) {
+            microbench_sink += macs[i % 4096].Mac2String().length();
+        });
+
+    mac_addr oui_mask("00:11:22:00:00:00/FF:FF:FF:00:00:00");
+
+    microbench_run("mac_addr_compare_masked", 20000000, 0, [&](uint64_t i) {
+            microbench_sink += (macs[i % 4096] == oui_mask);
+        });
+
+    std::unordered_map<mac_addr, int, mac_addr_hash> mac_hash;
+    for (unsigned int x = 0; x < 4096; x += 2)
+        mac_hash[macs[x]] = x;
+
+    microbench_run("mac_addr_hash_find", 2000000, 0, [&](uint64_t i) {
+            microbench_sink += (mac_hash.find(macs[i % 4096]) != mac_hash.end());
+        });
+
+    // Mostly single addresses with a few masked ranges, like a filter list
+    macmap<int> mm;
+    for (unsigned int x = 0; x < 4096; x += 2)
+        mm.insert(macs[x], x);
+    for (unsigned int x = 0; x < 16; x++) {
+        char buf[40];
+        snprintf(buf, 40, "00:22:%02X:00:00:00/FF:FF:FF:00:00:00", x);
+        mm.insert(mac_addr(buf), x);
+    }
+
+    microbench_run("macmap_find", 2000000, 0, [&](uint64_t i) {
+            microbench_sink += (mm.find(macs[i % 4096]) != mm.end());
+        });
+
+    microbench_run("manuf_lookup_oui", 200000, 0, [&](uint64_t i) {
+            microbench_sink += globalreg->manufdb->LookupOUI(macs[i % 4096]).length();
+        });
+
+    // Buffers, moving data through in 1500 byte writes
+    uint8_t data[1500];
+    memset(data, 0x42, 1500);
+
+    RingbufV2 ringbuf(65536);
+
+    microbench_run("ringbuf2_write_read", 2000000, 1500, [&](uint64_t) {
+            unsigned char *peek;
+
+            ringbuf.write(data, 1500);
+            ssize_t r = ringbuf.peek(&peek, 1500);
+            microbench_sink += peek[0];
+            ringbuf.peek_free(peek);
+            ringbuf.consume(r);
+        });
+
+    Chainbuf chainbuf(4096, 16);
+
+    microbench_run("chainbuf_write_read", 2000000, 1500, [&](uint64_t) {
+            unsigned char *peek;
+
+            chainbuf.write(data, 1500);
+
+            while (chainbuf.used() > 0) {
+                ssize_t r = chainbuf.peek(&peek, chainbuf.used());
+                microbench_sink += peek[0];
+                chainbuf.peek_free(peek);
+                chainbuf.consume(r);
+            }
+        });
+
+    // Unconsumed, so the chain keeps growing as it does when a slow client
+    // falls behind
+    Chainbuf chainbuf_fill(4096, 16);
+
+    microbench_run("chainbuf_write", 200000, 1500, [&](uint64_t) {
+            chainbuf_fill.write(data, 1500);
+        });
+
+    chainbuf_fill.clear();
+
+    // Printable strings; mostly text with some binary mixed in, like the
+    // payload of an unencrypted data frame
+    uint8_t text[1500];
+    for (unsigned int x = 0; x < 1500; x++)
+        text[x] = (x % 37 < 30) ? 'a' + (x % 26) : (x & 0xFF);
+
+    microbench_run("munge_to_printable", 200000, 1500, [&](uint64_t) {
+            microbench_sink += MungeToPrintable((char *) text, 1500, 0).length();
+        });
+
+    char munged[1500 * 4 + 1];
+
+    microbench_run("munge_to_printable_buf", 200000, 1500, [&](uint64_t) {
+            microbench_sink += MungeToPrintable((char *) text, 1500, 0, munged,
+                    sizeof(munged));
+        });
+
+    vector<printable_run> runs;
+
+    microbench_run("find_printable_runs", 200000, 1500, [&](uint64_t) {
+            runs.clear();
+            FindPrintableRuns(text, 1500, 4, runs);
+            microbench_sink += runs.size();
+        });
+
+    // 802.11; dissect each beacon on its own, then run the corpus through the
+    // whole chain to build real devices to serialize
+    if (corpus.size() == 0) {
+        fprintf(stderr, "ERROR: No beacon corpus, skipping the 802.11 and device "
+                "serialization benchmarks; make benchmark_beacons.pcap\n");
+        return 0;
+    }
+
+    microbench_run("dot11_dissect_beacon", 200000, 0, [&](uint64_t i) {
+            kis_packet *pack = packetchain->GeneratePacket();
+            kis_datachunk *chunk = new kis_datachunk;
+            const string& frame = corpus[i % corpus.size()];
+
+            chunk->dlt = KDLT_IEEE802_11;
+            chunk->set_data((uint8_t *) frame.data(), frame.length(), false);
+            pack->insert(pack_comp_linkframe, chunk);
+
+            microbench_sink += dot11phy->PacketDot11dissector(pack);
+
+            packetchain->DestroyPacket(pack);
+        });
+
+    packetchain->StopPipeline();
+
+    for (auto frame : corpus) {
+        kis_packet *pack = packetchain->GeneratePacket();
+        kis_datachunk *chunk = new kis_datachunk;
+
+        gettimeofday(&(pack->ts), NULL);
+
+        chunk->dlt = KDLT_IEEE802_11;
+        chunk->copy_data((uint8_t *) frame.data(), frame.length());
+        pack->insert(pack_comp_linkframe, chunk);
+
+        packetchain->ProcessPacket(pack);
+    }
+
+    // The BSSID of the first beacon
+    shared_ptr<kis_tracked_device_base> device;
+
+    if (corpus[0].length() >= 22)
+        device = devicetracker->FetchDevice(
+                mac_addr((uint8_t *) corpus[0].data() + 16, 6), dot11_phyid);
+
+    if (device == NULL) {
+        fprintf(stderr, "ERROR: The corpus didn't create a device, skipping the "
+                "device serialization benchmarks\n");
+        return 0;
+    }
+
+    std::stringstream stream;
+
+    microbench_run("device_serialize_json", 20000, 0, [&](uint64_t) {
+            stream.str("");
+            JsonAdapter::Pack(globalreg, stream, device);
+            microbench_sink += stream.tellp();
+        });
+
+    microbench_run("device_serialize_msgpack", 20000, 0, [&](uint64_t) {
+            stream.str("");
+            MsgpackAdapter::Pack(globalreg, stream, device);
+            microbench_sink += stream.tellp();
+        });
+
+    XmlserializeAdapter xml(globalreg);
+    xml.RegisterField("kismet.device.base", "device");
+    xml.RegisterField("kismet.device.base.name", "name");
+    xml.RegisterField("kismet.device.base.phyname", "phyname");
+    xml.RegisterField("kismet.device.base.channel", "channel");
+    xml.RegisterField("kismet.device.base.frequency", "frequency");
+    xml.RegisterField("kismet.device.base.manuf", "manufacturer");
+    xml.RegisterField("kismet.device.base.key", "key");
+    xml.RegisterField("kismet.device.base.macaddr", "macaddress");
+    xml.RegisterField("kismet.device.base.type", "type");
+    xml.RegisterField("kismet.device.base.first_time", "firstseen");
+    xml.RegisterField("kismet.device.base.last_time", "lastseen");
+    xml.RegisterField("kismet.device.base.packets.total", "packetstotal");
+
+    microbench_run("device_serialize_xml", 20000, 0, [&](uint64_t) {
+            stream.str("");
+            xml.XmlSerialize(device, stream);
+            microbench_sink += stream.tellp();
+        });
+
+    return 0;
+}
+
@@ -35,9 +35,10 @@
 #include "devicetracker_component.h"
 #include "msgpack_adapter.h"
 
-void MsgpackAdapter::Packer(GlobalRegistry *globalreg, SharedTrackerElement v,
-        msgpack::packer<std::ostream> &o,
-        TrackerElementSerializer::rename_map *name_map) {
+void MsgpackAdapter::Packer(GlobalRegistry *globalreg, const SharedTrackerElement& v,
+        msgpack::packer<msgpack_writer> &o,
+        TrackerElementSerializer::rename_map *name_map,
+        TrackerElementSerializer::serial_cache_map *cache_map) {
 
     if (v == NULL) {
         o.pack_array(2);
@@ -46,19 +47,33 @@ void MsgpackAdapter::Packer(GlobalRegistry *globalreg, SharedTrackerElement v,
         return;
     }
 
+    // Unchanged elements which were already serialized are written as-is; the
+    // bin body writer appends raw bytes to the stream with no header
+    if (cache_map != NULL) {
+        TrackerElementSerializer::serial_cache_map::iterator ci = 
+            cache_map->find(v.get());
+        if (ci != cache_map->end()) {
+            o.pack_bin_body(ci->second->data(), ci->second->length());
+            return;
+        }
+    }
+
     // If we have a rename map, find out if we've got a pathed element that needs
-    // to be custom-serialized
+    // to be custom-serialized, and remember it so it can be released the same
+    // way after output
+    SharedElementSummary path_summary;
+
     if (name_map != NULL) {
         TrackerElementSerializer::rename_map::iterator nmi = name_map->find(v);
-        if (nmi != name_map->end()) {
-            TrackerElementSerializer::pre_serialize_path(nmi->second);
-        } else {
-            v->pre_serialize();
-        } 
-    } else {
-        v->pre_serialize();
+        if (nmi != name_map->end())
+            path_summary = nmi->second;
     }
 
+    if (path_summary != NULL)
+        TrackerElementSerializer::pre_serialize_path(path_summary);
+    else
+        v->pre_serialize();
+
     o.pack_array(2);
     o.pack((int) v->get_type());
 
@@ -80,6 +95,12 @@ void MsgpackAdapter::Packer(GlobalRegistry *globalreg, SharedTrackerElement v,
     TrackerElement::tracked_double_map *tdoublemap;
     TrackerElement::double_map_iterator double_map_iter;
 
+    TrackerElement::tracked_small_int_map *tsmallintmap;
+    TrackerElement::small_int_map_iterator small_int_map_iter;
+
+    TrackerElement::tracked_small_double_map *tsmalldoublemap;
+    TrackerElement::small_double_map_iterator small_double_map_iter;
+
     mac_addr mac;
 
     shared_ptr<uint8_t> bytes;
@@ -133,7 +154,7 @@ void MsgpackAdapter::Packer(GlobalRegistry *globalreg, SharedTrackerElement v,
 
             o.pack_array(v->size());
             for (x = 0; x < tvec->size(); x++) {
-                Packer(globalreg, (*tvec)[x], o, name_map);
+                Packer(globalreg, (*tvec)[x], o, name_map, cache_map);
             }
 
             break;
@@ -147,15 +168,19 @@ void MsgpackAdapter::Packer(GlobalRegistry *globalreg, SharedTrackerElement v,
                         nmi->second->rename.length() != 0) {
                     o.pack(nmi->second->rename);
                 } else {
-                    string tname;
                     if (map_iter->second != NULL &&
-                            (tname = map_iter->second->get_local_name()) != "")
-                        o.pack(tname);
-                    else
-                        o.pack(globalreg->entrytracker->GetFieldName(map_iter->first));
+                            map_iter->second->has_local_name()) {
+                        o.pack(map_iter->second->get_local_name());
+                    } else {
+                        // Registered names come pre-encoded; the bin body writer
+                        // appends them as-is
+                        const string& key =
+                            globalreg->entrytracker->GetFieldMsgpackKey(map_iter->first);
+                        o.pack_bin_body(key.data(), key.length());
+                    }
                 }
 
-                Packer(globalreg, map_iter->second, o, name_map);
+                Packer(globalreg, map_iter->second, o, name_map, cache_map);
             }
             break;
         case TrackerIntMap:
@@ -164,7 +189,7 @@ void MsgpackAdapter::Packer(GlobalRegistry *globalreg, SharedTrackerElement v,
             for (int_map_iter = tintmap->begin(); int_map_iter != tintmap->end(); 
                     ++int_map_iter) {
                 o.pack(int_map_iter->first);
-                Packer(globalreg, int_map_iter->second, o, name_map);
+                Packer(globalreg, int_map_iter->second, o, name_map, cache_map);
             }
             break;
         case TrackerMacMap:
@@ -175,7 +200,7 @@ void MsgpackAdapter::Packer(GlobalRegistry *globalreg, SharedTrackerElement v,
                     ++mac_map_iter) {
                 // macmaps sent as macaddr only
                 o.pack(mac_map_iter->first.Mac2String());
-                Packer(globalreg, mac_map_iter->second, o, name_map);
+                Packer(globalreg, mac_map_iter->second, o, name_map, cache_map);
             }
             break;
         case TrackerStringMap:
@@ -185,7 +210,7 @@ void MsgpackAdapter::Packer(GlobalRegistry *globalreg, SharedTrackerElement v,
                     string_map_iter != tstringmap->end();
                     ++string_map_iter) {
                 o.pack(string_map_iter->first);
-                Packer(globalreg, string_map_iter->second, o, name_map);
+                Packer(globalreg, string_map_iter->second, o, name_map, cache_map);
             }
             break;
         case TrackerDoubleMap:
@@ -195,7 +220,27 @@ void MsgpackAdapter::Packer(GlobalRegistry *globalreg, SharedTrackerElement v,
                     double_map_iter != tdoublemap->end();
                     ++double_map_iter) {
                 o.pack(double_map_iter->first);
-                Packer(globalreg, double_map_iter->second, o, name_map);
+                Packer(globalreg, double_map_iter->second, o, name_map, cache_map);
+            }
+            break;
+        case TrackerSmallIntMap:
+            tsmallintmap = v->get_smallintmap();
+            o.pack_map(tsmallintmap->size());
+            for (small_int_map_iter = tsmallintmap->begin(); 
+                    small_int_map_iter != tsmallintmap->end();
+                    ++small_int_map_iter) {
+                o.pack(small_int_map_iter->first);
+                Packer(globalreg, small_int_map_iter->second, o, name_map, cache_map);
+            }
+            break;
+        case TrackerSmallDoubleMap:
+            tsmalldoublemap = v->get_smalldoublemap();
+            o.pack_map(tsmalldoublemap->size());
+            for (small_double_map_iter = tsmalldoublemap->begin();
+                    small_double_map_iter != tsmalldoublemap->end();
+                    ++small_double_map_iter) {
+                o.pack(small_double_map_iter->first);
+                Packer(globalreg, small_double_map_iter->second, o, name_map, cache_map);
             }
             break;
         case TrackerByteArray:
@@ -210,12 +255,19 @@ void MsgpackAdapter::Packer(GlobalRegistry *globalreg, SharedTrackerElement v,
         default:
             break;
     }
+
+    if (path_summary != NULL)
+        TrackerElementSerializer::post_serialize_path(path_summary);
+    else
+        v->post_serialize();
 }
 
 void MsgpackAdapter::Pack(GlobalRegistry *globalreg, std::ostream &stream,
-        SharedTrackerElement e, TrackerElementSerializer::rename_map *name_map) {
-    msgpack::packer<std::ostream> packer(&stream);
-    Packer(globalreg, e, packer, name_map);
+        const SharedTrackerElement& e, TrackerElementSerializer::rename_map *name_map,
+        TrackerElementSerializer::serial_cache_map *cache_map) {
+    msgpack_writer writer(stream);
+    msgpack::packer<msgpack_writer> packer(writer);
+    Packer(globalreg, e, packer, name_map, cache_map);
 }
 
 void MsgpackAdapter::AsStringVector(msgpack::object &obj, 
@@ -22,6 +22,7 @@
 #include "config.h"
 
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 #include <list>
 #include <map>
@@ -38,13 +39,58 @@ namespace MsgpackAdapter {
 
 typedef map<string, msgpack::object> MsgpackStrMap;
 
-void Packer(GlobalRegistry *globalreg, SharedTrackerElement v, 
-        msgpack::packer<std::ostream> &packer,
-        TrackerElementSerializer::rename_map *name_map = NULL);
+// Buffer for the msgpack packer which collects the encoded output and hands it
+// to the stream in large blocks with write().  Packing straight into an
+// ostream makes a virtual sputn call for every header byte, key, and value;
+// this keeps those small writes to a memcpy.  Pending output is written when
+// the buffer fills and when the writer is destroyed.
+class msgpack_writer {
+public:
+    msgpack_writer(std::ostream& in_stream) :
+        stream(in_stream), len(0) { }
+
+    ~msgpack_writer() {
+        flush();
+    }
+
+    void flush() {
+        if (len != 0) {
+            stream.write(buf, len);
+            len = 0;
+        }
+    }
+
+    // Called by msgpack::packer
+    void write(const char *in_data, size_t in_len) {
+        if (in_len > sizeof(buf) - len) {
+            flush();
+
+            if (in_len > sizeof(buf)) {
+                stream.write(in_data, in_len);
+                return;
+            }
+        }
+
+        memcpy(buf + len, in_data, in_len);
+        len += in_len;
+    }
+
+protected:
+    std::ostream& stream;
+
+    char buf[8192];
+    size_t len;
+};
+
+void Packer(GlobalRegistry *globalreg, const SharedTrackerElement& v, 
+        msgpack::packer<msgpack_writer> &packer,
+        TrackerElementSerializer::rename_map *name_map = NULL,
+        TrackerElementSerializer::serial_cache_map *cache_map = NULL);
 
 void Pack(GlobalRegistry *globalreg, std::ostream &stream, 
-        SharedTrackerElement e, 
-        TrackerElementSerializer::rename_map *name_map = NULL);
+        const SharedTrackerElement& e, 
+        TrackerElementSerializer::rename_map *name_map = NULL,
+        TrackerElementSerializer::serial_cache_map *cache_map = NULL);
 
 class Serializer : public TrackerElementSerializer {
 public:
@@ -52,9 +98,9 @@ public:
         TrackerElementSerializer(in_globalreg) { }
 
     virtual void serialize(SharedTrackerElement in_elem, std::ostream &stream,
-            rename_map *name_map = NULL) {
+            rename_map *name_map = NULL, serial_cache_map *cache_map = NULL) {
         local_locker lock(&mutex);
-        Pack(globalreg, stream, in_elem, name_map);
+        Pack(globalreg, stream, in_elem, name_map, cache_map);
     }
 };
 
@@ -79,6 +125,14 @@ public:
         object = obj;
     }
 
+    // Take over an object from a streaming unpacker, along with the zone which
+    // holds it
+    StructuredMsgpack(msgpack::unpacked& in_result) {
+        result.set(in_result.get());
+        result.zone() = std::move(in_result.zone());
+        object = result.get();
+    }
+
     virtual ~StructuredMsgpack() {
 
     }
@@ -124,7 +124,7 @@ int mp_b_encode_map(msgpuck_buffer_t *buf, uint32_t size) {
     return 1;
 }
 
-int mp_b_encode_uint(msgpuck_buffer_t *buf, uint32_t size) {
+int mp_b_encode_uint(msgpuck_buffer_t *buf, uint64_t size) {
     if (mp_b_available_buffer(buf) < mp_sizeof_uint(size)) 
         if (mp_b_zoom_buffer(buf) < 0)
             return -1;
@@ -67,7 +67,7 @@ int mp_b_zoom_buffer(msgpuck_buffer_t *buf);
 /* Duplicates of the msgpuck encode functions, but with length checking */
 int mp_b_encode_array(msgpuck_buffer_t *buf, uint32_t size);
 int mp_b_encode_map(msgpuck_buffer_t *buf, uint32_t size);
-int mp_b_encode_uint(msgpuck_buffer_t *buf, uint32_t size);
+int mp_b_encode_uint(msgpuck_buffer_t *buf, uint64_t size);
 int mp_b_encode_int(msgpuck_buffer_t *buf, uint32_t size);
 int mp_b_encode_float(msgpuck_buffer_t *buf, uint32_t size);
 int mp_b_encode_double(msgpuck_buffer_t *buf, uint32_t size);
@@ -40,6 +40,10 @@ kis_packet::kis_packet(GlobalRegistry *in_globalreg) {
 
 	error = 0;
 	filtered = 0;
+    duplicate = 0;
+    truncated = 0;
+    backlogged = 0;
+    sample_weight = 1;
 
 	// Stock and init the content vector
 	content_vec.resize(MAX_PACKET_COMPONENTS, NULL);
@@ -50,6 +54,10 @@ kis_packet::kis_packet(GlobalRegistry *in_globalreg) {
 }
 
 kis_packet::~kis_packet() {
+    reset();
+}
+
+void kis_packet::reset() {
 	// Delete everything we contain when we die.  I hope whomever put
 	// it there expected this.
 	for (unsigned int y = 0; y < MAX_PACKET_COMPONENTS; y++) {
@@ -61,10 +69,19 @@ kis_packet::~kis_packet() {
 		// If it's marked for self-destruction, delete it.  Otherwise, 
 		// someone else is responsible for removing it.
 		if (pcm->self_destruct)
-			delete pcm;
+			pcm->release_component();
 
 		content_vec[y] = NULL;
 	}
+
+    error = 0;
+    filtered = 0;
+    duplicate = 0;
+    truncated = 0;
+    backlogged = 0;
+    sample_weight = 1;
+    ts.tv_sec = 0;
+    ts.tv_usec = 0;
 }
    
 void kis_packet::insert(const unsigned int index, packet_component *data) {
@@ -93,7 +110,7 @@ void kis_packet::erase(const unsigned int index) {
 	// to happen or it will be very unhappy
 	if (content_vec[index] != NULL) {
 		if (content_vec[index]->self_destruct)
-			delete content_vec[index];
+			content_vec[index]->release_component();
 
 		content_vec[index] = NULL;
 	}
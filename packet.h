@@ -32,6 +32,7 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <mutex>
 
 #include "globalregistry.h"
 #include "macaddr.h"
@@ -55,10 +56,73 @@ class packet_component {
 public:
     packet_component() { self_destruct = 1; };
 	virtual ~packet_component() { }
+
+    // Called by the packet to free a self-destructing component; components
+    // shared between packets drop a reference instead
+    virtual void release_component() { delete this; }
+
 	int self_destruct;
 };
 
 // Overall packet container that holds packet information
+// Freelist allocator for packet components which are created and destroyed
+// for nearly every packet.  Components inherit from pooled_packet_component<T>
+// to get class operator new/delete which recycle freed objects of that type
+// instead of going back to the heap, so creating components with new and
+// freeing them from the packet is unchanged.  Subclasses of a pooled type
+// which have a different size fall through to the normal allocator.
+#define PACKET_COMPONENT_POOL_MAX   1024
+
+template<class T>
+class pooled_packet_component {
+public:
+    static void *operator new(size_t sz) {
+        if (sz == sizeof(T)) {
+            std::lock_guard<std::mutex> lk(pool_mutex());
+
+            vector<void *> &fl = freelist();
+
+            if (fl.size() != 0) {
+                void *r = fl.back();
+                fl.pop_back();
+                return r;
+            }
+        }
+
+        return ::operator new(sz);
+    }
+
+    static void operator delete(void *p, size_t sz) {
+        if (p == NULL)
+            return;
+
+        if (sz == sizeof(T)) {
+            std::lock_guard<std::mutex> lk(pool_mutex());
+
+            vector<void *> &fl = freelist();
+
+            if (fl.size() < PACKET_COMPONENT_POOL_MAX) {
+                fl.push_back(p);
+                return;
+            }
+        }
+
+        ::operator delete(p);
+    }
+
+protected:
+    // Never destroyed, so components freed during shutdown are still safe
+    static std::mutex &pool_mutex() {
+        static std::mutex *m = new std::mutex();
+        return *m;
+    }
+
+    static vector<void *> &freelist() {
+        static vector<void *> *fl = new vector<void *>();
+        return *fl;
+    }
+};
+
 class kis_packet {
 public:
     // Time of packet creation
@@ -71,6 +135,22 @@ public:
 	// Have we been filtered for some reason?
 	int filtered;
 
+    // Are we a duplicate of a frame another source already captured?  Duplicates
+    // skip dissection and classification; see packet_dedup.h
+    int duplicate;
+
+    // Did the capture only carry the start of the frame?  Truncated frames have
+    // no FCS to check
+    int truncated;
+
+    // Was the source falling behind when it handed us the packet?  Backlogged
+    // packets may be sampled; see Packetchain::SampleOverload
+    int backlogged;
+
+    // Number of captured packets this packet stands for; above 1 when the
+    // packet was kept by overload sampling and the others were dropped
+    unsigned int sample_weight;
+
 	// Actual vector of bits in the packet
 	vector<packet_component *> content_vec;
    
@@ -81,6 +161,9 @@ public:
 
 	kis_packet(GlobalRegistry *in_globalreg);
     ~kis_packet();
+
+    // Free all components and clear the packet so it can be reused
+    void reset();
    
     void insert(const unsigned int index, packet_component *data);
     void *fetch(const unsigned int index) const;
@@ -166,7 +249,8 @@ protected:
 };
 
 // Arbitrary data chunk, decapsulated from the link headers
-class kis_datachunk : public packet_component {
+class kis_datachunk : public packet_component, 
+    public pooled_packet_component<kis_datachunk> {
 public:
     uint8_t *data;
     unsigned int length;
@@ -244,7 +328,8 @@ enum kis_packet_basictype {
 // Common info
 // Extracted by phy-specific dissectors, used by the common classifier
 // to build phy-neutral devices and tracking records.
-class kis_common_info : public packet_component {
+class kis_common_info : public packet_component, 
+    public pooled_packet_component<kis_common_info> {
 public:
 	kis_common_info() {
 		self_destruct = 1;
@@ -366,7 +451,8 @@ enum kis_layer1_packinfo_signal_type {
     kis_l1_signal_type_rssi
 };
 
-class kis_layer1_packinfo : public packet_component {
+class kis_layer1_packinfo : public packet_component, 
+    public pooled_packet_component<kis_layer1_packinfo> {
 public:
 	kis_layer1_packinfo() {
 		self_destruct = 1;  // Safe to delete us
@@ -379,6 +465,13 @@ public:
 		freq_khz = 0;
 		accuracy = 0;
 		channel = "0";
+        short_preamble = false;
+        mcs = -1;
+        mcs_nss = 0;
+        mcs_bandwidth = 0;
+        mcs_short_gi = false;
+        mcs_vht = false;
+        airtime_usec = 0;
 	}
 
 	// How "accurate" are we?  Higher == better.  Nothing uses this yet
@@ -405,6 +498,21 @@ public:
     // What data rate?
     double datarate;
 
+    // Legacy DSSS preamble length
+    bool short_preamble;
+
+    // HT or VHT rate, if the header had one:  MCS index (-1 if unknown), spatial
+    // streams, channel width in MHz, and guard interval
+    int mcs;
+    unsigned int mcs_nss;
+    unsigned int mcs_bandwidth;
+    bool mcs_short_gi;
+    bool mcs_vht;
+
+    // Time the frame took on the air, in microseconds, worked out from the rate
+    // and length by the phy; 0 if the rate isn't known
+    unsigned int airtime_usec;
+
 	// Checksum, if checksumming is enabled; Only of the non-header 
 	// data
 	uint32_t content_checkum;
@@ -0,0 +1,356 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <string.h>
+
+#include <chrono>
+
+#include "util.h"
+#include "configfile.h"
+#include "messagebus.h"
+#include "entrytracker.h"
+#include "packet_dedup.h"
+#include "kis_datasource.h"
+#include "devicetracker.h"
+
+// Length of the 802.11 header we hash; the sequence control field ends at 24
+#define DEDUP_HEADER_LEN    24
+
+static uint64_t dedup_now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+shared_ptr<PacketDedup> PacketDedup::create_packetdedup(GlobalRegistry *in_globalreg) {
+    if (!in_globalreg->kismet_config->FetchOptBoolean("packet_dedup", false))
+        return NULL;
+
+    shared_ptr<PacketDedup> mon(new PacketDedup(in_globalreg));
+    in_globalreg->RegisterLifetimeGlobal(mon);
+    in_globalreg->InsertGlobal("PACKET_DEDUP", mon);
+    return mon;
+}
+
+PacketDedup::PacketDedup(GlobalRegistry *in_globalreg) :
+    Kis_Net_Httpd_CPPStream_Handler(in_globalreg) {
+
+    Httpd_RegisterRoute("GET", "/packetchain/dedup");
+
+    globalreg = in_globalreg;
+
+    window_ms =
+        globalreg->kismet_config->FetchOptUInt("packet_dedup_window", 250);
+    max_entries =
+        globalreg->kismet_config->FetchOptUInt("packet_dedup_max", 65536);
+
+    if (max_entries < 1024)
+        max_entries = 1024;
+
+    stat_hashed = 0;
+    stat_duplicates = 0;
+    stat_merged = 0;
+    stat_held = 0;
+
+    pack_comp_dedup =
+        globalreg->packetchain->RegisterPacketComponent("DEDUP");
+    pack_comp_decap =
+        globalreg->packetchain->RegisterPacketComponent("DECAP");
+    pack_comp_linkframe =
+        globalreg->packetchain->RegisterPacketComponent("LINKFRAME");
+    pack_comp_checksum =
+        globalreg->packetchain->RegisterPacketComponent("CHECKSUM");
+    pack_comp_datasrc =
+        globalreg->packetchain->RegisterPacketComponent("KISDATASRC");
+    pack_comp_radiodata =
+        globalreg->packetchain->RegisterPacketComponent("RADIODATA");
+    pack_comp_gps =
+        globalreg->packetchain->RegisterPacketComponent("GPS");
+
+    // After the DLT handlers have decapsulated the frame and checked the FCS
+    hash_hook_id =
+        globalreg->packetchain->RegisterHandler([this](kis_packet *in_pack) -> int {
+                return HashPacket(in_pack);
+            }, CHAINPOS_POSTCAP, 100, "dedup");
+
+    // After the phys have updated the devices from the first copy
+    merge_hook_id =
+        globalreg->packetchain->RegisterHandler([this](kis_packet *in_pack) -> int {
+                return MergePacket(in_pack);
+            }, CHAINPOS_TRACKER, 1000, "dedup merge");
+
+    stats_id =
+        globalreg->entrytracker->RegisterField("kismet.dedup.stats", TrackerMap,
+                "packet deduplication statistics");
+    stats_hashed_id =
+        globalreg->entrytracker->RegisterField("kismet.dedup.hashed",
+                TrackerUInt64, "frames checked for duplicates");
+    stats_duplicates_id =
+        globalreg->entrytracker->RegisterField("kismet.dedup.duplicates",
+                TrackerUInt64, "frames which duplicated a frame from another source");
+    stats_merged_id =
+        globalreg->entrytracker->RegisterField("kismet.dedup.merged",
+                TrackerUInt64, "duplicates merged into the devices of the first copy");
+    stats_held_id =
+        globalreg->entrytracker->RegisterField("kismet.dedup.held",
+                TrackerUInt64, "duplicates held until the first copy was tracked");
+    stats_table_id =
+        globalreg->entrytracker->RegisterField("kismet.dedup.table_size",
+                TrackerUInt64, "recently seen frames in the dedup table");
+
+    _MSG("Merging duplicate frames captured by multiple sources within " +
+            UIntToString(window_ms) + "ms", MSGFLAG_INFO);
+}
+
+PacketDedup::~PacketDedup() {
+    globalreg->RemoveGlobal("PACKET_DEDUP");
+
+    if (globalreg->packetchain != NULL) {
+        globalreg->packetchain->RemoveHandler(hash_hook_id, CHAINPOS_POSTCAP);
+        globalreg->packetchain->RemoveHandler(merge_hook_id, CHAINPOS_TRACKER);
+    }
+}
+
+int PacketDedup::HashPacket(kis_packet *in_pack) {
+    if (in_pack->error || in_pack->filtered)
+        return 0;
+
+    packetchain_comp_datasource *pack_datasrc =
+        (packetchain_comp_datasource *) in_pack->fetch(pack_comp_datasrc);
+
+    if (pack_datasrc == NULL || pack_datasrc->ref_source == NULL)
+        return 0;
+
+    // Raw 802.11 sources have no decapsulated frame
+    kis_datachunk *chunk = (kis_datachunk *) in_pack->fetch(pack_comp_decap);
+
+    if (chunk == NULL) {
+        chunk = (kis_datachunk *) in_pack->fetch(pack_comp_linkframe);
+
+        if (chunk != NULL && chunk->dlt != KDLT_IEEE802_11)
+            chunk = NULL;
+    }
+
+    if (chunk == NULL || chunk->dlt != KDLT_IEEE802_11 ||
+            chunk->length < DEDUP_HEADER_LEN)
+        return 0;
+
+    // Control frames have no sequence number; two identical ACKs are simply two
+    // ACKs
+    if (((chunk->data[0] >> 2) & 0x03) == 1)
+        return 0;
+
+    kis_packet_checksum *fcs =
+        (kis_packet_checksum *) in_pack->fetch(pack_comp_checksum);
+
+    // Corrupt frames are left to the normal error handling
+    if (fcs != NULL && !fcs->checksum_valid)
+        return 0;
+
+    uint32_t frame_sum;
+
+    if (fcs != NULL && fcs->length >= 4) {
+        memcpy(&frame_sum, fcs->data, 4);
+    } else {
+        frame_sum = crc32_le_80211(globalreg->crc32_table, chunk->data, chunk->length);
+    }
+
+    uint64_t hash = ((uint64_t) frame_sum << 32) |
+        (Adler32Checksum((const char *) chunk->data, DEDUP_HEADER_LEN) ^ chunk->length);
+
+    stat_hashed++;
+
+    kis_packet_dedup *pack_dedup = new kis_packet_dedup;
+    in_pack->insert(pack_comp_dedup, pack_dedup);
+
+    uint64_t now = dedup_now_ms();
+
+    std::lock_guard<std::mutex> lk(table_mutex);
+
+    // Expire everything which has aged out of the window, and the oldest frames
+    // if the table is full
+    while (table_age.size() != 0 &&
+            (table_age.front().second + window_ms < now ||
+             table_age.size() >= max_entries)) {
+        auto ti = table.find(table_age.front().first);
+
+        if (ti != table.end() && ti->second.seen_ms == table_age.front().second)
+            table.erase(ti);
+
+        table_age.pop_front();
+    }
+
+    auto ti = table.find(hash);
+
+    if (ti != table.end()) {
+        // The same frame from the same source is a real retransmission
+        if (ti->second.source != pack_datasrc->ref_source) {
+            pack_dedup->record = ti->second.record;
+            pack_dedup->duplicate = true;
+            in_pack->duplicate = 1;
+            stat_duplicates++;
+            return 1;
+        }
+    }
+
+    pack_dedup->record = std::make_shared<kis_dedup_record>();
+
+    dedup_entry e;
+    e.record = pack_dedup->record;
+    e.source = pack_datasrc->ref_source;
+    e.seen_ms = now;
+
+    table[hash] = e;
+    table_age.push_back(std::make_pair(hash, now));
+
+    return 1;
+}
+
+int PacketDedup::MergePacket(kis_packet *in_pack) {
+    kis_packet_dedup *pack_dedup =
+        (kis_packet_dedup *) in_pack->fetch(pack_comp_dedup);
+
+    if (pack_dedup == NULL)
+        return 0;
+
+    // The tracker chain is run in packet order under the packetchain lock, so the
+    // record needs no locking of its own here
+    shared_ptr<kis_dedup_record> record = pack_dedup->record;
+
+    if (!pack_dedup->duplicate) {
+        record->tracked = true;
+
+        for (auto p = record->pending.begin(); p != record->pending.end(); ++p) {
+            ApplyMerge(record, p->source, p->ts,
+                    p->have_l1 ? &(p->l1) : NULL, p->have_gps ? &(p->gps) : NULL);
+        }
+
+        record->pending.clear();
+
+        return 1;
+    }
+
+    packetchain_comp_datasource *pack_datasrc =
+        (packetchain_comp_datasource *) in_pack->fetch(pack_comp_datasrc);
+    kis_layer1_packinfo *pack_l1info =
+        (kis_layer1_packinfo *) in_pack->fetch(pack_comp_radiodata);
+    kis_gps_packinfo *pack_gpsinfo =
+        (kis_gps_packinfo *) in_pack->fetch(pack_comp_gps);
+
+    if (pack_datasrc == NULL)
+        return 0;
+
+    if (record->tracked) {
+        ApplyMerge(record, pack_datasrc->ref_source, in_pack->ts.tv_sec,
+                pack_l1info, pack_gpsinfo);
+        return 1;
+    }
+
+    // The first copy is still in the dissectors; hold on to what we need
+    kis_dedup_record::pending_merge p;
+
+    p.source = pack_datasrc->ref_source;
+    p.ts = in_pack->ts.tv_sec;
+    p.have_l1 = pack_l1info != NULL;
+    p.have_gps = pack_gpsinfo != NULL;
+
+    if (pack_l1info != NULL)
+        p.l1 = *pack_l1info;
+
+    if (pack_gpsinfo != NULL)
+        p.gps = kis_gps_packinfo(pack_gpsinfo);
+
+    record->pending.push_back(p);
+
+    stat_held++;
+
+    return 1;
+}
+
+void PacketDedup::ApplyMerge(shared_ptr<kis_dedup_record> record,
+        KisDatasource *source, time_t ts, kis_layer1_packinfo *l1,
+        kis_gps_packinfo *gps) {
+
+    if (globalreg->devicetracker == NULL)
+        return;
+
+    for (auto d = record->devices.begin(); d != record->devices.end(); ++d)
+        globalreg->devicetracker->MergeDuplicateSeenby(*d, source, ts, l1, gps);
+
+    stat_merged++;
+}
+
+bool PacketDedup::Httpd_VerifyPath(const char *path, const char *method) {
+    if (strcmp(method, "GET") != 0)
+        return false;
+
+    if (!Httpd_CanSerialize(path))
+        return false;
+
+    if (Httpd_StripSuffix(path) == "/packetchain/dedup")
+        return true;
+
+    return false;
+}
+
+void PacketDedup::Httpd_CreateStreamResponse(
+        Kis_Net_Httpd *httpd __attribute__((unused)),
+        Kis_Net_Httpd_Connection *connection __attribute__((unused)),
+        const char *path, const char *method,
+        const char *upload_data __attribute__((unused)),
+        size_t *upload_data_size __attribute__((unused)),
+        std::stringstream &stream) {
+
+    if (strcmp(method, "GET") != 0)
+        return;
+
+    if (Httpd_StripSuffix(path) != "/packetchain/dedup")
+        return;
+
+    SharedTrackerElement stats(new TrackerElement(TrackerMap, stats_id));
+
+    SharedTrackerElement e;
+
+    e.reset(new TrackerElement(TrackerUInt64, stats_hashed_id));
+    e->set((uint64_t) stat_hashed);
+    stats->add_map(e);
+
+    e.reset(new TrackerElement(TrackerUInt64, stats_duplicates_id));
+    e->set((uint64_t) stat_duplicates);
+    stats->add_map(e);
+
+    e.reset(new TrackerElement(TrackerUInt64, stats_merged_id));
+    e->set((uint64_t) stat_merged);
+    stats->add_map(e);
+
+    e.reset(new TrackerElement(TrackerUInt64, stats_held_id));
+    e->set((uint64_t) stat_held);
+    stats->add_map(e);
+
+    {
+        std::lock_guard<std::mutex> lk(table_mutex);
+
+        e.reset(new TrackerElement(TrackerUInt64, stats_table_id));
+        e->set((uint64_t) table.size());
+        stats->add_map(e);
+    }
+
+    Httpd_Serialize(path, stream, stats);
+}
+
@@ -0,0 +1,158 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __PACKET_DEDUP_H__
+#define __PACKET_DEDUP_H__
+
+#include "config.h"
+
+#include <stdint.h>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "globalregistry.h"
+#include "packet.h"
+#include "packetchain.h"
+#include "gpstracker.h"
+#include "kis_net_microhttpd.h"
+
+class KisDatasource;
+class kis_tracked_device_base;
+
+// Multi-radio frame deduplication
+//
+// When several sources cover the same channel, each of them captures the same
+// transmissions.  With 'packet_dedup=true', every 802.11 frame is hashed (the
+// 802.11 header, which includes the sequence number, and the FCS, or a CRC of
+// the frame when the source doesn't supply one) into a table of recently seen
+// frames.  A frame which matches one seen by a *different* source within
+// 'packet_dedup_window' milliseconds is a duplicate:  it skips dissection and
+// classification entirely, and only its signal and seenby information are
+// merged into the devices the first copy updated.
+//
+// Control frames carry no sequence number and are never deduplicated.
+//
+// The first copy records the devices it updates (in Devicetracker's
+// UpdateCommonDevice) in the shared kis_dedup_record.  Merges are done in the
+// tracker chain, which runs in packet order; when the pipeline lets a duplicate
+// reach the tracker before its first copy, the merge is held in the record
+// until the first copy has been tracked.
+//
+// Counters are served at /packetchain/dedup
+
+class kis_dedup_record {
+public:
+    kis_dedup_record() {
+        tracked = false;
+    }
+
+    // A duplicate waiting for the first copy to be tracked
+    struct pending_merge {
+        KisDatasource *source;
+        time_t ts;
+        bool have_l1, have_gps;
+        kis_layer1_packinfo l1;
+        kis_gps_packinfo gps;
+    };
+
+    // Has the first copy been through the tracker yet?
+    bool tracked;
+
+    // Devices whose seenby records the first copy updated
+    std::vector<shared_ptr<kis_tracked_device_base> > devices;
+
+    std::vector<pending_merge> pending;
+};
+
+// Packet component linking a packet to its dedup record
+class kis_packet_dedup : public packet_component,
+    public pooled_packet_component<kis_packet_dedup> {
+public:
+    kis_packet_dedup() {
+        self_destruct = 1;
+        duplicate = false;
+    }
+
+    shared_ptr<kis_dedup_record> record;
+
+    // Is this the first copy, or a duplicate of it?
+    bool duplicate;
+};
+
+class PacketDedup : public LifetimeGlobal, public Kis_Net_Httpd_CPPStream_Handler {
+public:
+    // Returns NULL unless packet_dedup is enabled
+    static shared_ptr<PacketDedup> create_packetdedup(GlobalRegistry *in_globalreg);
+
+private:
+    PacketDedup(GlobalRegistry *in_globalreg);
+
+public:
+    virtual ~PacketDedup();
+
+    virtual bool Httpd_VerifyPath(const char *path, const char *method);
+
+    virtual void Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd,
+            Kis_Net_Httpd_Connection *connection,
+            const char *url, const char *method, const char *upload_data,
+            size_t *upload_data_size, std::stringstream &stream);
+
+protected:
+    GlobalRegistry *globalreg;
+
+    // Post-capture:  hash the frame and mark duplicates
+    int HashPacket(kis_packet *in_pack);
+
+    // Tracker:  merge duplicates into the devices of the first copy
+    int MergePacket(kis_packet *in_pack);
+
+    void ApplyMerge(shared_ptr<kis_dedup_record> record, KisDatasource *source,
+            time_t ts, kis_layer1_packinfo *l1, kis_gps_packinfo *gps);
+
+    struct dedup_entry {
+        shared_ptr<kis_dedup_record> record;
+        KisDatasource *source;
+        uint64_t seen_ms;
+    };
+
+    std::mutex table_mutex;
+    std::unordered_map<uint64_t, dedup_entry> table;
+
+    // Hashes in the order they were added, for expiring the table
+    std::deque<std::pair<uint64_t, uint64_t> > table_age;
+
+    unsigned int window_ms;
+    unsigned int max_entries;
+
+    int hash_hook_id, merge_hook_id;
+
+    int pack_comp_dedup, pack_comp_decap, pack_comp_linkframe, pack_comp_checksum,
+        pack_comp_datasrc, pack_comp_radiodata, pack_comp_gps;
+
+    std::atomic<uint64_t> stat_hashed, stat_duplicates, stat_merged, stat_held;
+
+    int stats_id, stats_hashed_id, stats_duplicates_id, stats_merged_id,
+        stats_held_id, stats_table_id;
+};
+
+#endif
+
@@ -0,0 +1,310 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <string.h>
+
+#include "util.h"
+#include "configfile.h"
+#include "messagebus.h"
+#include "timetracker.h"
+#include "packet_retention.h"
+#include "pcapng_stream_ringbuf.h"
+#include "kis_datasource.h"
+#include "devicetracker.h"
+#include "kis_clock.h"
+
+shared_ptr<PacketRetention> PacketRetention::create_packetretention(GlobalRegistry *in_globalreg) {
+    if (!in_globalreg->kismet_config->FetchOptBoolean("packet_retention", false))
+        return NULL;
+
+    shared_ptr<PacketRetention> mon(new PacketRetention(in_globalreg));
+    in_globalreg->RegisterLifetimeGlobal(mon);
+    in_globalreg->InsertGlobal("PACKET_RETENTION", mon);
+    return mon;
+}
+
+PacketRetention::PacketRetention(GlobalRegistry *in_globalreg) :
+    Kis_Net_Httpd_Chain_Stream_Handler(in_globalreg) {
+
+    Httpd_RegisterRoute("GET", "/devices/by-key/:key/pcap/retained/:file");
+    Httpd_RegisterRoute("GET", "/devices/by-key/:key/pcap/retained/seconds/:count/:file");
+    Httpd_RegisterRoute("GET", "/devices/by-key/:key/pcap/retained/packets/:count/:file");
+
+    globalreg = in_globalreg;
+
+    retained_bytes = 0;
+
+    max_packets =
+        globalreg->kismet_config->FetchOptUInt("packet_retention_packets", 256);
+    max_seconds =
+        globalreg->kismet_config->FetchOptUInt("packet_retention_seconds", 300);
+    max_bytes = (size_t)
+        globalreg->kismet_config->FetchOptUInt("packet_retention_mb", 64) * 1024 * 1024;
+
+    if (max_packets == 0)
+        max_packets = 1;
+    if (max_seconds == 0)
+        max_seconds = 1;
+    if (max_bytes == 0)
+        max_bytes = 1024 * 1024;
+
+    pack_comp_device =
+        globalreg->packetchain->RegisterPacketComponent("DEVICE");
+    pack_comp_linkframe =
+        globalreg->packetchain->RegisterPacketComponent("LINKFRAME");
+    pack_comp_datasrc =
+        globalreg->packetchain->RegisterPacketComponent("KISDATASRC");
+    pack_comp_epbcache =
+        globalreg->packetchain->RegisterPacketComponent("PCAPNG_EPB");
+
+    // Ahead of the pcapng streams, so the block we encode is the one they share
+    retain_hook_id =
+        globalreg->packetchain->RegisterHandler([this](kis_packet *in_pack) -> int {
+                return RetainPacket(in_pack);
+            }, CHAINPOS_LOGGING, -200, "packet retention");
+
+    // Devices which have gone quiet still age out
+    expire_timer_id =
+        globalreg->timetracker->RegisterTimer(SERVER_TIMESLICES_SEC * 10, NULL, 1,
+                [this](int) -> int {
+                    std::lock_guard<std::mutex> lk(retain_mutex);
+                    expire_packets(KisClock::CoarseWallSec());
+                    return 1;
+                });
+
+    _MSG("Retaining the last " + UIntToString(max_packets) + " packets (up to " +
+            UIntToString(max_seconds) + " seconds) of every device, using at most " +
+            UIntToString(max_bytes / 1024 / 1024) + "MB", MSGFLAG_INFO);
+}
+
+PacketRetention::~PacketRetention() {
+    globalreg->RemoveGlobal("PACKET_RETENTION");
+
+    if (globalreg->timetracker != NULL)
+        globalreg->timetracker->RemoveTimer(expire_timer_id);
+
+    if (globalreg->packetchain != NULL)
+        globalreg->packetchain->RemoveHandler(retain_hook_id, CHAINPOS_LOGGING);
+}
+
+void PacketRetention::release_packet(shared_ptr<retained_packet> in_packet) {
+    retained_bytes -= in_packet->block->size();
+
+    auto di = device_map.find(in_packet->device_key);
+
+    if (di != device_map.end()) {
+        di->second.erase(in_packet->device_pos);
+
+        if (di->second.size() == 0)
+            device_map.erase(di);
+    }
+
+    age_list.erase(in_packet->age_pos);
+}
+
+void PacketRetention::expire_packets(time_t in_now) {
+    while (age_list.size() != 0 &&
+            (retained_bytes > max_bytes ||
+             age_list.front()->ts.tv_sec + (time_t) max_seconds < in_now)) {
+        release_packet(age_list.front());
+    }
+}
+
+size_t PacketRetention::ReleaseAll() {
+    std::lock_guard<std::mutex> lk(retain_mutex);
+
+    size_t freed = retained_bytes;
+
+    age_list.clear();
+    device_map.clear();
+    retained_bytes = 0;
+
+    return freed;
+}
+
+int PacketRetention::RetainPacket(kis_packet *in_pack) {
+    if (in_pack->error)
+        return 0;
+
+    kis_tracked_device_info *devinfo =
+        (kis_tracked_device_info *) in_pack->fetch(pack_comp_device);
+
+    if (devinfo == NULL || devinfo->devref == NULL)
+        return 0;
+
+    packetchain_comp_datasource *datasrc =
+        (packetchain_comp_datasource *) in_pack->fetch(pack_comp_datasrc);
+
+    if (datasrc == NULL || datasrc->ref_source == NULL)
+        return 0;
+
+    kis_datachunk *chunk = (kis_datachunk *) in_pack->fetch(pack_comp_linkframe);
+
+    if (chunk == NULL || chunk->length == 0)
+        return 0;
+
+    shared_ptr<std::vector<uint8_t> > block =
+        Pcap_Stream_Ringbuf::pcapng_shared_epb(in_pack, chunk, pack_comp_epbcache);
+
+    uint64_t key = devinfo->devref->get_key();
+    unsigned int sourcenum = datasrc->ref_source->get_source_number();
+
+    std::lock_guard<std::mutex> lk(retain_mutex);
+
+    shared_ptr<retained_source> source;
+    auto si = source_map.find(sourcenum);
+
+    if (si == source_map.end()) {
+        source.reset(new retained_source());
+        source->number = sourcenum;
+        source->dlt = datasrc->ref_source->get_source_dlt();
+        Pcap_Stream_Ringbuf::pcapng_datasource_names(datasrc->ref_source,
+                &(source->interface), &(source->description));
+        source_map[sourcenum] = source;
+    } else {
+        source = si->second;
+    }
+
+    shared_ptr<retained_packet> rp(new retained_packet());
+    rp->ts = in_pack->ts;
+    rp->device_key = key;
+    rp->source = source;
+    rp->block = block;
+
+    retained_list& devlist = device_map[key];
+
+    rp->age_pos = age_list.insert(age_list.end(), rp);
+    rp->device_pos = devlist.insert(devlist.end(), rp);
+    retained_bytes += block->size();
+
+    if (devlist.size() > max_packets)
+        release_packet(devlist.front());
+
+    expire_packets(in_pack->ts.tv_sec);
+
+    return 1;
+}
+
+bool PacketRetention::Httpd_VerifyPath(const char *path, const char *method) {
+    if (strcmp(method, "GET") != 0)
+        return false;
+
+    // /devices/by-key/[key]/pcap/retained/[key].pcapng
+    // /devices/by-key/[key]/pcap/retained/[seconds|packets]/[n]/[key].pcapng
+    vector<string> tokenurl = StrTokenize(path, "/");
+
+    if (tokenurl.size() != 7 && tokenurl.size() != 9)
+        return false;
+
+    if (tokenurl[1] != "devices" || tokenurl[2] != "by-key" || 
+            tokenurl[4] != "pcap" || tokenurl[5] != "retained")
+        return false;
+
+    if (tokenurl.size() == 9) {
+        if (tokenurl[6] != "seconds" && tokenurl[6] != "packets")
+            return false;
+
+        unsigned int count;
+        if (sscanf(tokenurl[7].c_str(), "%u", &count) != 1)
+            return false;
+    }
+
+    if (tokenurl[tokenurl.size() - 1] != tokenurl[3] + ".pcapng")
+        return false;
+
+    return true;
+}
+
+int PacketRetention::Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd,
+        Kis_Net_Httpd_Connection *connection,
+        const char *url, const char *method, const char *upload_data,
+        size_t *upload_data_size) {
+
+    if (strcmp(method, "GET") != 0)
+        return MHD_YES;
+
+    if (!httpd->HasValidSession(connection)) {
+        connection->httpcode = 503;
+        return MHD_YES;
+    }
+
+    uint64_t key = 0;
+    std::stringstream ss(connection->url_params["key"]);
+    ss >> key;
+
+    // Limit to the last seconds or packets, if asked
+    vector<string> tokenurl = StrTokenize(url, "/");
+    unsigned int limit_seconds = 0, limit_packets = 0;
+
+    if (tokenurl.size() == 9) {
+        unsigned int count = 0;
+        sscanf(tokenurl[7].c_str(), "%u", &count);
+
+        if (tokenurl[6] == "seconds")
+            limit_seconds = count;
+        else
+            limit_packets = count;
+    }
+
+    // Take references to the packets and write them outside the lock; the memory
+    // is shared, so this only copies pointers
+    vector<shared_ptr<retained_packet> > packets;
+
+    {
+        std::lock_guard<std::mutex> lk(retain_mutex);
+
+        expire_packets(KisClock::CoarseWallSec());
+
+        auto di = device_map.find(key);
+
+        if (di != device_map.end()) {
+            time_t since = 0;
+
+            if (limit_seconds != 0 && di->second.size() != 0)
+                since = di->second.back()->ts.tv_sec - limit_seconds;
+
+            for (auto rp : di->second) {
+                if (rp->ts.tv_sec < since)
+                    continue;
+
+                packets.push_back(rp);
+            }
+        }
+    }
+
+    if (limit_packets != 0 && packets.size() > limit_packets)
+        packets.erase(packets.begin(), packets.end() - limit_packets);
+
+    Kis_Net_Httpd_Buffer_Stream_Aux *saux = 
+        (Kis_Net_Httpd_Buffer_Stream_Aux *) connection->custom_extension;
+
+    // Retained packets only, nothing from the live packet chain
+    Pcap_Stream_Ringbuf psrb(globalreg, saux->get_rbhandler(),
+            [](kis_packet *) -> bool { return false; }, NULL);
+
+    for (auto rp : packets) {
+        if (psrb.pcapng_write_block(rp->source->number, rp->source->interface,
+                    rp->source->description, rp->source->dlt, *(rp->block)) < 0)
+            break;
+    }
+
+    return MHD_YES;
+}
+
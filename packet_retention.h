@@ -0,0 +1,133 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __PACKET_RETENTION_H__
+#define __PACKET_RETENTION_H__
+
+#include "config.h"
+
+#include <stdint.h>
+#include <sys/time.h>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "globalregistry.h"
+#include "packet.h"
+#include "packetchain.h"
+#include "kis_net_microhttpd.h"
+
+// Retained packets per device, for pcapng extraction after the fact
+//
+// The pcapng stream of a device only starts with the packets which arrive after
+// it is opened.  With 'packet_retention=true', the last packets of every device
+// are kept in memory:  at most 'packet_retention_packets' for each device, none
+// older than 'packet_retention_seconds', and no more than 'packet_retention_mb'
+// of packet data in total, oldest first.
+//
+// Packets are kept as the enhanced packet block the pcapng streams log (see
+// pcapng_epb_cache), so a packet which is also being streamed is encoded once
+// and the retained copy shares its memory.
+//
+// Retained packets are served as pcapng at
+//  /devices/by-key/[key]/pcap/retained/[key].pcapng
+//  /devices/by-key/[key]/pcap/retained/seconds/[n]/[key].pcapng
+//  /devices/by-key/[key]/pcap/retained/packets/[n]/[key].pcapng
+class PacketRetention : public LifetimeGlobal, public Kis_Net_Httpd_Chain_Stream_Handler {
+public:
+    // Returns NULL unless packet_retention is enabled
+    static shared_ptr<PacketRetention> create_packetretention(GlobalRegistry *in_globalreg);
+
+private:
+    PacketRetention(GlobalRegistry *in_globalreg);
+
+public:
+    virtual ~PacketRetention();
+
+    virtual bool Httpd_VerifyPath(const char *path, const char *method);
+
+    virtual int Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd,
+            Kis_Net_Httpd_Connection *connection,
+            const char *url, const char *method, const char *upload_data,
+            size_t *upload_data_size);
+
+    virtual int Httpd_PostComplete(Kis_Net_Httpd_Connection *con __attribute__((unused))) {
+        return 0;
+    }
+
+    // Drop every retained packet, returning the bytes freed; used by the memory
+    // governor, which also pauses the 'packet retention' handler
+    size_t ReleaseAll();
+
+protected:
+    GlobalRegistry *globalreg;
+
+    // The interface a retained packet was captured on, as it goes in the pcapng
+    struct retained_source {
+        unsigned int number;
+        std::string interface;
+        std::string description;
+        int dlt;
+    };
+
+    struct retained_packet;
+    typedef std::list<shared_ptr<retained_packet> > retained_list;
+
+    struct retained_packet {
+        struct timeval ts;
+        uint64_t device_key;
+        shared_ptr<retained_source> source;
+        shared_ptr<std::vector<uint8_t> > block;
+
+        // Position in the list of every retained packet, oldest first, and in
+        // the list of its device
+        retained_list::iterator age_pos;
+        retained_list::iterator device_pos;
+    };
+
+    // Logging chain:  retain the packet under its device
+    int RetainPacket(kis_packet *in_pack);
+
+    // Drop a packet from both lists; must hold retain_mutex
+    void release_packet(shared_ptr<retained_packet> in_packet);
+
+    // Drop packets past the age or memory limits; must hold retain_mutex
+    void expire_packets(time_t in_now);
+
+    std::mutex retain_mutex;
+    retained_list age_list;
+    std::unordered_map<uint64_t, retained_list> device_map;
+    std::unordered_map<unsigned int, shared_ptr<retained_source> > source_map;
+
+    size_t retained_bytes;
+
+    unsigned int max_packets;
+    unsigned int max_seconds;
+    size_t max_bytes;
+
+    int retain_hook_id;
+    int expire_timer_id;
+
+    int pack_comp_device, pack_comp_linkframe, pack_comp_datasrc, pack_comp_epbcache;
+};
+
+#endif
+
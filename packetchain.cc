@@ -29,6 +29,10 @@
 #include "messagebus.h"
 #include "configfile.h"
 #include "packetchain.h"
+#include "entrytracker.h"
+#include "cpu_affinity.h"
+#include "kis_probes.h"
+#include "kis_clock.h"
 
 class SortLinkPriority {
 public:
@@ -45,7 +49,11 @@ Packetchain::Packetchain() {
 	exit(-1);
 }
 
-Packetchain::Packetchain(GlobalRegistry *in_globalreg) {
+Packetchain::Packetchain(GlobalRegistry *in_globalreg) :
+    Kis_Net_Httpd_CPPStream_Handler(in_globalreg) {
+
+    Httpd_RegisterRoute("GET", "/packetchain/stats");
+
     globalreg = in_globalreg;
     next_componentid = 1;
 	next_handlerid = 1;
@@ -57,10 +65,215 @@ Packetchain::Packetchain(GlobalRegistry *in_globalreg) {
     pthread_mutexattr_init(&mutexattr);
     pthread_mutexattr_settype(&mutexattr, PTHREAD_MUTEX_RECURSIVE);
 	pthread_mutex_init(&packetchain_mutex, &mutexattr);
+
+    LockProfiler::NameMutex(&packetchain_mutex, "packetchain_mutex");
+
+    pthread_rwlock_init(&chain_rwlock, NULL);
+
+    pack_comp_linkframe = RegisterPacketComponent("LINKFRAME");
+    pack_comp_decap = RegisterPacketComponent("DECAP");
+    pack_comp_common = RegisterPacketComponent("COMMON");
+
+    stage_timing = false;
+    for (unsigned int x = 0; x <= CHAINPOS_DESTROY; x++) {
+        stage_count[x] = 0;
+        stage_nsec[x] = 0;
+    }
+
+    pipeline_running = false;
+    dissectors_running = false;
+    ingress_seq = 0;
+    egress_seq = 0;
+    handoff_ring_sz = 0;
+
+    ingress_rr_pos = 0;
+    ingress_queued = 0;
+    next_ingress_id = 0;
+
+    packet_pool_max =
+        globalreg->kismet_config->FetchOptUInt("packet_pool_size", 1024);
+
+    handler_sample_rate =
+        globalreg->kismet_config->FetchOptUInt("packet_handler_sample_rate", 64);
+
+    dissector_batch =
+        globalreg->kismet_config->FetchOptUInt("packet_dissector_batch", 16);
+
+    if (dissector_batch == 0)
+        dissector_batch = 1;
+
+    overload_sampling =
+        globalreg->kismet_config->FetchOptBoolean("packet_overload_sampling", false);
+    overload_sample_rate =
+        globalreg->kismet_config->FetchOptUInt("packet_overload_sample_rate", 8);
+
+    if (overload_sample_rate < 2)
+        overload_sample_rate = 2;
+
+    // Without a pipeline only backlogged sources are sampled
+    overload_start_depth = 0;
+    overload_stop_depth = 0;
+    overloaded = false;
+    overload_sample_seq = 0;
+
+    // Chains which aren't exposed still get counters, so running a chain never
+    // has to check
+    for (unsigned int x = 0; x <= CHAINPOS_DESTROY; x++) {
+        metric_chain_runs[x].reset(new kis_metric_counter());
+        metric_chain_latency[x].reset(new kis_metric_histogram());
+    }
+
+    metric_packets.reset(new kis_metric_counter());
+    metric_sampled_out.reset(new kis_metric_counter());
+
+    shared_ptr<KisMetrics> metrics =
+        globalreg->FetchGlobalAs<KisMetrics>("METRICS");
+
+    if (metrics != NULL) {
+        static const struct {
+            int chainpos;
+            const char *name;
+        } metric_chains[] = {
+            { CHAINPOS_POSTCAP, "postcap" },
+            { CHAINPOS_LLCDISSECT, "llcdissect" },
+            { CHAINPOS_DECRYPT, "decrypt" },
+            { CHAINPOS_DATADISSECT, "datadissect" },
+            { CHAINPOS_CLASSIFIER, "classifier" },
+            { CHAINPOS_TRACKER, "tracker" },
+            { CHAINPOS_LOGGING, "logging" },
+        };
+
+        metric_packets =
+            metrics->register_counter("kismet_packetchain_packets",
+                    "packets injected into the packet chain");
+
+        metric_sampled_out =
+            metrics->register_counter("kismet_packetchain_sampled_out_packets",
+                    "data packets dropped by overload sampling after classification");
+
+        metrics->register_gauge("kismet_packetchain_overloaded",
+                "packet pipeline is backlogged past the overload sampling depth", "",
+                [this]() -> double {
+                    return overloaded ? 1 : 0;
+                });
+
+        for (auto c : metric_chains) {
+            string labels = "chain=" + KisMetrics::label_escape(c.name);
+
+            metric_chain_runs[c.chainpos] =
+                metrics->register_counter("kismet_packetchain_chain_runs",
+                        "packets run through a chain", labels);
+            metric_chain_latency[c.chainpos] =
+                metrics->register_histogram("kismet_packetchain_chain_seconds",
+                        "time spent in the handlers of a chain, in sampled runs "
+                        "(see packet_handler_sample_rate)", labels);
+        }
+    }
+
+    stats_id =
+        globalreg->entrytracker->RegisterField("kismet.packetchain.stats",
+                TrackerMap, "packetchain handler statistics");
+    stats_sample_rate_id =
+        globalreg->entrytracker->RegisterField("kismet.packetchain.sample_rate",
+                TrackerUInt32, "one in N chain runs are timed");
+    stats_handlers_id =
+        globalreg->entrytracker->RegisterField("kismet.packetchain.handlers",
+                TrackerVector, "packetchain handlers");
+    stats_handler_id =
+        globalreg->entrytracker->RegisterField("kismet.packetchain.handler",
+                TrackerMap, "packetchain handler");
+    stats_name_id =
+        globalreg->entrytracker->RegisterField("kismet.packetchain.handler.name",
+                TrackerString, "handler name");
+    stats_chain_id =
+        globalreg->entrytracker->RegisterField("kismet.packetchain.handler.chain",
+                TrackerString, "chain the handler is in");
+    stats_priority_id =
+        globalreg->entrytracker->RegisterField("kismet.packetchain.handler.priority",
+                TrackerInt32, "handler priority");
+    stats_paused_id =
+        globalreg->entrytracker->RegisterField("kismet.packetchain.handler.paused",
+                TrackerUInt8, "handler is paused");
+    stats_calls_id =
+        globalreg->entrytracker->RegisterField("kismet.packetchain.handler.calls",
+                TrackerUInt64, "number of calls");
+    stats_sampled_id =
+        globalreg->entrytracker->RegisterField("kismet.packetchain.handler.sampled",
+                TrackerUInt64, "number of timed calls");
+    stats_sampled_nsec_id =
+        globalreg->entrytracker->RegisterField("kismet.packetchain.handler.sampled_ns",
+                TrackerUInt64, "total nanoseconds in timed calls");
+    stats_mean_nsec_id =
+        globalreg->entrytracker->RegisterField("kismet.packetchain.handler.mean_ns",
+                TrackerUInt64, "mean nanoseconds per timed call");
+    stats_histogram_id =
+        globalreg->entrytracker->RegisterField("kismet.packetchain.handler.histogram",
+                TrackerVector, "log2 nanosecond latency histogram of timed calls");
+    stats_bucket_id =
+        globalreg->entrytracker->RegisterField("kismet.packetchain.handler.bucket",
+                TrackerUInt64, "timed calls in histogram bucket");
+
+    // Everything not injected through a queue of its own
+    RegisterIngress("packetchain", 1, 0, 0);
+
+    num_dissector_threads = 
+        globalreg->kismet_config->FetchOptUInt("packet_dissector_threads", 0);
+
+    if (num_dissector_threads == 0)
+        return;
+
+    handoff_ring_sz =
+        globalreg->kismet_config->FetchOptUInt("packet_pipeline_backlog", 4096);
+
+    if (handoff_ring_sz == 0)
+        handoff_ring_sz = 4096;
+
+    // Start sampling with the ring three quarters full and stop once it has
+    // drained to a quarter, so we don't flap at the edge
+    overload_start_depth = handoff_ring_sz * 3 / 4;
+    overload_stop_depth = handoff_ring_sz / 4;
+
+    handoff_ring.reset(new std::atomic<kis_packet *>[handoff_ring_sz]);
+    for (size_t x = 0; x < handoff_ring_sz; x++)
+        handoff_ring[x] = NULL;
+
+    pipeline_running = true;
+    dissectors_running = true;
+
+    for (unsigned int x = 0; x < num_dissector_threads; x++)
+        dissector_threads.push_back(std::thread([this]() { DissectorThread(); }));
+
+    ordered_thread = std::thread([this]() { OrderedThread(); });
+
+    // Keep the pipeline off the cores of the capture and http threads if asked
+    shared_ptr<CpuAffinity> affinity =
+        globalreg->FetchGlobalAs<CpuAffinity>("CPU_AFFINITY");
+    string pipeline_cpus = 
+        globalreg->kismet_config->FetchOpt("cpu_affinity_packetchain");
+
+    if (affinity != NULL && pipeline_cpus.length() != 0) {
+        for (auto& t : dissector_threads)
+            affinity->place_thread("packetchain", t.native_handle(), pipeline_cpus);
+        affinity->place_thread("packetchain", ordered_thread.native_handle(), 
+                pipeline_cpus);
+    }
+
+    _MSG("Packet processing pipeline enabled with " + 
+            UIntToString(num_dissector_threads) + " dissector threads and a backlog "
+            "of " + UIntToString(handoff_ring_sz) + " packets", MSGFLAG_INFO);
 }
 
 Packetchain::~Packetchain() {
     fprintf(stderr, "debug - ~packetchain\n");
+
+    StopPipeline();
+
+    shared_ptr<KisMetrics> metrics =
+        globalreg->FetchGlobalAs<KisMetrics>("METRICS");
+
+    if (metrics != NULL)
+        metrics->remove_metric("kismet_packetchain_overloaded");
+
     pthread_mutex_lock(&packetchain_mutex);
 
     globalreg->RemoveGlobal("PACKETCHAIN");
@@ -104,9 +317,46 @@ Packetchain::~Packetchain() {
         delete(*i);
     }
 
+    {
+        std::lock_guard<std::mutex> lk(packet_pool_mutex);
+
+        for (auto p : packet_pool)
+            delete p;
+        packet_pool.clear();
+    }
+
+    pthread_rwlock_destroy(&chain_rwlock);
+    LockProfiler::ForgetMutex(&packetchain_mutex);
     pthread_mutex_destroy(&packetchain_mutex);
 }
 
+void Packetchain::StopPipeline() {
+    if (!pipeline_running)
+        return;
+
+    // Stop taking new packets into the pipeline; anything injected from now on
+    // is processed synchronously
+    pipeline_running = false;
+
+    // Dissectors drain the queue before exiting
+    dissector_queue_cv.notify_all();
+
+    for (auto& t : dissector_threads) {
+        if (t.joinable())
+            t.join();
+    }
+
+    dissector_threads.clear();
+    dissectors_running = false;
+
+    // Wake the ordered thread; it exits once it has consumed everything which
+    // was injected
+    handoff_cv.notify_all();
+
+    if (ordered_thread.joinable())
+        ordered_thread.join();
+}
+
 int Packetchain::RegisterPacketComponent(string in_component) {
     local_locker lock(&packetchain_mutex);
 
@@ -158,9 +408,21 @@ string Packetchain::FetchPacketComponentName(int in_id) {
 
 kis_packet *Packetchain::GeneratePacket() {
     local_locker lock(&packetchain_mutex);
-    kis_packet *newpack = new kis_packet(globalreg);
+    kis_packet *newpack = NULL;
     pc_link *pcl;
 
+    {
+        std::lock_guard<std::mutex> lk(packet_pool_mutex);
+
+        if (packet_pool.size() != 0) {
+            newpack = packet_pool.back();
+            packet_pool.pop_back();
+        }
+    }
+
+    if (newpack == NULL)
+        newpack = new kis_packet(globalreg);
+
     // Run the frame through the genesis chain incase anything
     // needs to add something at the beginning
     for (unsigned int x = 0; x < genesis_chain.size(); x++) {
@@ -186,74 +448,473 @@ kis_packet *Packetchain::GeneratePacket() {
     return newpack;
 }
 
-int Packetchain::ProcessPacket(kis_packet *in_pack) {
-    {
-        local_locker lock(&packetchain_mutex);
-        // Run it through every chain vector, ignoring error codes
-        pc_link *pcl;
-
-        for (unsigned int x = 0; x < postcap_chain.size() && 
-                (pcl = postcap_chain[x]); x++) {
-            if (pcl->callback != NULL)
-                (*(pcl->callback))(globalreg, pcl->auxdata, in_pack);
-            else if (pcl->l_callback != NULL)
-                (pcl->l_callback)(in_pack);
+void Packetchain::RunChain(int in_chainpos, vector<Packetchain::pc_link *> &chain, 
+        kis_packet *in_pack) {
+    pc_link *pcl;
+
+    bool timed = stage_timing.load(std::memory_order_relaxed);
+    uint64_t start = 0, hstart = 0;
+
+    if (timed)
+        start = KisClock::PreciseNsec();
+
+    // Chains run on the dissector and ordered threads at once, so keep the
+    // sample counter per thread instead of contending on it
+    static thread_local unsigned int sample_counter = 0;
+    bool sampled = handler_sample_rate != 0 && 
+        (++sample_counter % handler_sample_rate) == 0;
+
+    uint64_t chain_ns = 0;
+
+    KIS_PROBE3(chain__entry, in_chainpos, in_pack, chain.size());
+
+    // Read when the first handler bound to a link type is reached
+    int pack_dlt = -2;
+
+    for (unsigned int x = 0; x < chain.size() && (pcl = chain[x]); x++) {
+        if (pcl->paused.load(std::memory_order_relaxed))
+            continue;
+
+        int h_dlt = pcl->dlt.load(std::memory_order_relaxed);
+
+        if (h_dlt >= 0) {
+            if (pack_dlt == -2)
+                pack_dlt = PacketDLT(in_pack);
+
+            if (h_dlt != pack_dlt)
+                continue;
         }
 
-        for (unsigned int x = 0; x < llcdissect_chain.size() && 
-                (pcl = llcdissect_chain[x]); x++) {
-            if (pcl->callback != NULL)
-                (*(pcl->callback))(globalreg, pcl->auxdata, in_pack);
-            else if (pcl->l_callback != NULL)
-                (pcl->l_callback)(in_pack);
+        int h_comp = pcl->component.load(std::memory_order_relaxed);
+
+        if (h_comp >= 0 && in_pack->fetch(h_comp) == NULL)
+            continue;
+
+        if (sampled)
+            hstart = KisClock::PreciseNsec();
+
+        if (pcl->callback != NULL)
+            (*(pcl->callback))(globalreg, pcl->auxdata, in_pack);
+        else if (pcl->l_callback != NULL)
+            (pcl->l_callback)(in_pack);
+
+        pcl->num_calls.fetch_add(1, std::memory_order_relaxed);
+
+        if (sampled) {
+            uint64_t ns = KisClock::PreciseNsec() - hstart;
+
+            unsigned int bucket = 0;
+            if (ns != 0)
+                bucket = 64 - __builtin_clzll(ns);
+            if (bucket >= PACKETCHAIN_HISTOGRAM_BUCKETS)
+                bucket = PACKETCHAIN_HISTOGRAM_BUCKETS - 1;
+
+            pcl->num_sampled.fetch_add(1, std::memory_order_relaxed);
+            pcl->sampled_nsec.fetch_add(ns, std::memory_order_relaxed);
+            pcl->histogram[bucket].fetch_add(1, std::memory_order_relaxed);
+
+            chain_ns += ns;
+        }
+    }
+
+    metric_chain_runs[in_chainpos]->inc();
+
+    KIS_PROBE3(chain__exit, in_chainpos, in_pack, chain_ns);
+
+    if (sampled)
+        metric_chain_latency[in_chainpos]->observe_nsec(chain_ns);
+
+    if (timed) {
+        stage_nsec[in_chainpos].fetch_add(KisClock::PreciseNsec() - start,
+                std::memory_order_relaxed);
+        stage_count[in_chainpos].fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+uint64_t Packetchain::FetchStageCount(int in_chainpos) {
+    if (in_chainpos < 0 || in_chainpos > CHAINPOS_DESTROY)
+        return 0;
+
+    return stage_count[in_chainpos];
+}
+
+uint64_t Packetchain::FetchStageNsec(int in_chainpos) {
+    if (in_chainpos < 0 || in_chainpos > CHAINPOS_DESTROY)
+        return 0;
+
+    return stage_nsec[in_chainpos];
+}
+
+void Packetchain::RunDissectorChains(kis_packet *in_pack) {
+    RunChain(CHAINPOS_POSTCAP, postcap_chain, in_pack);
+
+    // Duplicates of frames from other sources are only merged by the tracker
+    if (in_pack->duplicate)
+        return;
+
+    RunChain(CHAINPOS_LLCDISSECT, llcdissect_chain, in_pack);
+    RunChain(CHAINPOS_DECRYPT, decrypt_chain, in_pack);
+    RunChain(CHAINPOS_DATADISSECT, datadissect_chain, in_pack);
+}
+
+void Packetchain::RunBatchChain(kis_packet **in_packs, size_t in_num) {
+    if (batch_chain.size() == 0)
+        return;
+
+    // Duplicates never got past the post-capture chain, so leave them out; the
+    // batch is only copied when there are any
+    size_t x;
+
+    for (x = 0; x < in_num; x++) {
+        if (in_packs[x]->duplicate)
+            break;
+    }
+
+    if (x == in_num) {
+        for (auto& b : batch_chain)
+            b.callback(in_packs, in_num);
+        return;
+    }
+
+    vector<kis_packet *> packs;
+
+    for (x = 0; x < in_num; x++) {
+        if (!in_packs[x]->duplicate)
+            packs.push_back(in_packs[x]);
+    }
+
+    if (packs.size() == 0)
+        return;
+
+    for (auto& b : batch_chain)
+        b.callback(packs.data(), packs.size());
+}
+
+bool Packetchain::SampleOverload(kis_packet *in_pack) {
+    if (!overload_sampling)
+        return true;
+
+    if (overload_start_depth != 0) {
+        uint64_t depth = ingress_seq - egress_seq + ingress_queued;
+
+        if (!overloaded && depth >= overload_start_depth) {
+            overloaded = true;
+            _MSG("Packet pipeline is backlogged by " + UIntToString(depth) +
+                    " packets, sampling one in " + UIntToString(overload_sample_rate) +
+                    " data packets until it catches up", MSGFLAG_ERROR);
+        } else if (overloaded && depth < overload_stop_depth) {
+            overloaded = false;
+            _MSG("Packet pipeline has caught up, no longer sampling data packets",
+                    MSGFLAG_INFO);
         }
+    }
+
+    if (!overloaded && !in_pack->backlogged)
+        return true;
+
+    // Duplicates only add to the seen-by records of the original
+    if (in_pack->duplicate)
+        return true;
+
+    kis_common_info *common = (kis_common_info *) in_pack->fetch(pack_comp_common);
 
-        for (unsigned int x = 0; x < decrypt_chain.size() && 
-                (pcl = decrypt_chain[x]); x++) {
-            if (pcl->callback != NULL)
-                (*(pcl->callback))(globalreg, pcl->auxdata, in_pack);
-            else if (pcl->l_callback != NULL)
-                (pcl->l_callback)(in_pack);
+    // Management and control frames carry the device state, always keep them
+    if (common == NULL || common->type != packet_basic_data)
+        return true;
+
+    if (overload_sample_seq.fetch_add(1, std::memory_order_relaxed) % 
+            overload_sample_rate != 0) {
+        metric_sampled_out->inc();
+        return false;
+    }
+
+    in_pack->sample_weight = overload_sample_rate;
+
+    return true;
+}
+
+void Packetchain::RunOrderedChains(kis_packet *in_pack) {
+    if (!in_pack->duplicate)
+        RunChain(CHAINPOS_CLASSIFIER, classifier_chain, in_pack);
+
+    if (!SampleOverload(in_pack))
+        return;
+
+    RunChain(CHAINPOS_TRACKER, tracker_chain, in_pack);
+    RunChain(CHAINPOS_LOGGING, logging_chain, in_pack);
+}
+
+int Packetchain::RegisterIngress(string in_name, unsigned int in_weight, 
+        size_t in_depth, unsigned int in_rate) {
+    std::lock_guard<std::mutex> lk(dissector_queue_mutex);
+
+    std::shared_ptr<ingress_queue> q(new ingress_queue());
+
+    q->id = next_ingress_id++;
+    q->name = in_name;
+    q->weight = in_weight == 0 ? 1 : in_weight;
+    q->depth = in_depth;
+    q->rate = in_rate;
+    q->tokens = in_rate;
+    q->refill_usec = KisClock::MonoUsec();
+    q->credit = q->weight;
+    q->removed = false;
+    q->dropped = 0;
+
+    ingress_map[q->id] = q;
+    ingress_rr.push_back(q);
+
+    return q->id;
+}
+
+void Packetchain::RemoveIngress(int in_id) {
+    // The default queue stays
+    if (in_id == 0)
+        return;
+
+    std::lock_guard<std::mutex> lk(dissector_queue_mutex);
+
+    auto i = ingress_map.find(in_id);
+
+    if (i == ingress_map.end())
+        return;
+
+    i->second->removed = true;
+
+    // An empty queue can go now; one with packets is dropped by the dissectors
+    // once they've taken the last
+    if (i->second->queue.size() == 0) {
+        for (size_t x = 0; x < ingress_rr.size(); x++) {
+            if (ingress_rr[x] != i->second)
+                continue;
+
+            ingress_rr.erase(ingress_rr.begin() + x);
+
+            if (ingress_rr_pos > x)
+                ingress_rr_pos--;
+
+            break;
         }
+    }
+
+    ingress_map.erase(i);
+}
+
+size_t Packetchain::FetchIngressDepth(int in_id) {
+    std::lock_guard<std::mutex> lk(dissector_queue_mutex);
+
+    auto i = ingress_map.find(in_id);
+
+    if (i == ingress_map.end())
+        return 0;
+
+    return i->second->queue.size();
+}
+
+uint64_t Packetchain::FetchIngressDropped(int in_id) {
+    std::lock_guard<std::mutex> lk(dissector_queue_mutex);
+
+    auto i = ingress_map.find(in_id);
+
+    if (i == ingress_map.end())
+        return 0;
+
+    return i->second->dropped;
+}
+
+bool Packetchain::AdmitIngress(ingress_queue *in_queue) {
+    if (in_queue->rate == 0)
+        return true;
+
+    uint64_t now = KisClock::MonoUsec();
+
+    if (now > in_queue->refill_usec) {
+        in_queue->tokens += 
+            (double) (now - in_queue->refill_usec) * in_queue->rate / 1000000;
+
+        if (in_queue->tokens > in_queue->rate)
+            in_queue->tokens = in_queue->rate;
+
+        in_queue->refill_usec = now;
+    }
+
+    if (in_queue->tokens < 1) {
+        in_queue->dropped++;
+        return false;
+    }
+
+    in_queue->tokens -= 1;
+
+    return true;
+}
+
+kis_packet *Packetchain::ScheduleIngress() {
+    if (ingress_queued == 0)
+        return NULL;
 
-        for (unsigned int x = 0; x < datadissect_chain.size() && 
-                (pcl = datadissect_chain[x]); x++) {
-            if (pcl->callback != NULL)
-                (*(pcl->callback))(globalreg, pcl->auxdata, in_pack);
-            else if (pcl->l_callback != NULL)
-                (pcl->l_callback)(in_pack);
+    // Some queue has a packet, and every queue has its full credit again by the
+    // time we come back around to it, so this always finds one
+    while (1) {
+        if (ingress_rr_pos >= ingress_rr.size())
+            ingress_rr_pos = 0;
+
+        std::shared_ptr<ingress_queue> q = ingress_rr[ingress_rr_pos];
+
+        if (q->queue.size() != 0 && q->credit != 0) {
+            kis_packet *pack = q->queue.front();
+            q->queue.pop_front();
+            q->credit--;
+            ingress_queued--;
+            return pack;
         }
 
-        for (unsigned int x = 0; x < classifier_chain.size() && 
-                (pcl = classifier_chain[x]); x++) {
-            if (pcl->callback != NULL)
-                (*(pcl->callback))(globalreg, pcl->auxdata, in_pack);
-            else if (pcl->l_callback != NULL)
-                (pcl->l_callback)(in_pack);
+        q->credit = q->weight;
+
+        if (q->removed && q->queue.size() == 0) {
+            ingress_rr.erase(ingress_rr.begin() + ingress_rr_pos);
+            continue;
         }
 
-        for (unsigned int x = 0; x < tracker_chain.size() && 
-                (pcl = tracker_chain[x]); x++) {
-            if (pcl->callback != NULL)
-                (*(pcl->callback))(globalreg, pcl->auxdata, in_pack);
-            else if (pcl->l_callback != NULL)
-                (pcl->l_callback)(in_pack);
+        ingress_rr_pos++;
+    }
+}
+
+int Packetchain::ProcessPacket(kis_packet *in_pack, int in_ingress) {
+    metric_packets->inc();
+
+    {
+        std::unique_lock<std::mutex> lk(dissector_queue_mutex);
+
+        auto qi = ingress_map.find(in_ingress);
+
+        if (qi == ingress_map.end())
+            qi = ingress_map.find(0);
+
+        std::shared_ptr<ingress_queue> q = qi->second;
+
+        if (!AdmitIngress(q.get())) {
+            lk.unlock();
+            DestroyPacket(in_pack);
+            return 0;
         }
 
-        for (unsigned int x = 0; x < logging_chain.size() && 
-                (pcl = logging_chain[x]); x++) {
-            if (pcl->callback != NULL)
-                (*(pcl->callback))(globalreg, pcl->auxdata, in_pack);
-            else if (pcl->l_callback != NULL)
-                (pcl->l_callback)(in_pack);
+        if (pipeline_running) {
+            size_t depth = q->depth == 0 ? handoff_ring_sz : q->depth;
+
+            // Block the injector while its queue is full; the dissectors signal
+            // as they take packets, but re-check periodically so we can't miss
+            // a wakeup or a shutdown
+            while (pipeline_running && q->queue.size() >= depth)
+                backlog_cv.wait_for(lk, std::chrono::milliseconds(10));
+
+            if (pipeline_running) {
+                q->queue.push_back(in_pack);
+                ingress_queued++;
+                lk.unlock();
+                dissector_queue_cv.notify_one();
+                return 1;
+            }
         }
     }
 
+    {
+        local_locker lock(&packetchain_mutex);
+
+        // Run it through every chain vector, ignoring error codes
+        RunDissectorChains(in_pack);
+        RunBatchChain(&in_pack, 1);
+        RunOrderedChains(in_pack);
+    }
+
     DestroyPacket(in_pack);
 
     return 1;
 }
 
+void Packetchain::DissectorThread() {
+    uint64_t seq;
+    vector<kis_packet *> packs(dissector_batch);
+    size_t num;
+
+    while (1) {
+        {
+            std::unique_lock<std::mutex> lk(dissector_queue_mutex);
+
+            // Wait for a packet and for room in the ring; the ordered thread
+            // signals as it consumes packets, but re-check periodically
+            while (1) {
+                if (ingress_queued != 0 && ingress_seq - egress_seq < handoff_ring_sz)
+                    break;
+
+                // Drain everything queued before exiting
+                if (!pipeline_running && ingress_queued == 0)
+                    return;
+
+                dissector_queue_cv.wait_for(lk, std::chrono::milliseconds(10));
+            }
+
+            // Take whatever is waiting, up to a batch, as consecutive sequence
+            // numbers starting at seq
+            seq = ingress_seq;
+            num = 0;
+
+            while (num < dissector_batch && ingress_queued != 0 &&
+                    ingress_seq - egress_seq < handoff_ring_sz) {
+                packs[num++] = ScheduleIngress();
+                ingress_seq++;
+            }
+        }
+
+        backlog_cv.notify_all();
+
+        pthread_rwlock_rdlock(&chain_rwlock);
+        for (size_t x = 0; x < num; x++)
+            RunDissectorChains(packs[x]);
+        RunBatchChain(packs.data(), num);
+        pthread_rwlock_unlock(&chain_rwlock);
+
+        // Publish to our slots in the ring; we can never lap the ordered thread
+        // because no packet is taken while the ring is full
+        for (size_t x = 0; x < num; x++)
+            handoff_ring[(seq + x) % handoff_ring_sz].store(packs[x], 
+                    std::memory_order_release);
+
+        handoff_cv.notify_one();
+    }
+}
+
+void Packetchain::OrderedThread() {
+    while (1) {
+        uint64_t seq = egress_seq.load(std::memory_order_relaxed);
+        std::atomic<kis_packet *> *slot = &(handoff_ring[seq % handoff_ring_sz]);
+        kis_packet *pack = slot->load(std::memory_order_acquire);
+
+        if (pack == NULL) {
+            // Once the dissectors have been joined nothing else can arrive, so
+            // we're done once we've caught up with everything injected
+            if (!dissectors_running && seq == ingress_seq)
+                return;
+
+            // Dissectors notify without holding the lock, so only sleep briefly
+            std::unique_lock<std::mutex> lk(handoff_mutex);
+            handoff_cv.wait_for(lk, std::chrono::milliseconds(1));
+            continue;
+        }
+
+        slot->store(NULL, std::memory_order_relaxed);
+
+        {
+            local_locker lock(&packetchain_mutex);
+            RunOrderedChains(pack);
+        }
+
+        DestroyPacket(pack);
+
+        egress_seq.store(seq + 1, std::memory_order_release);
+        dissector_queue_cv.notify_one();
+    }
+}
+
 void Packetchain::DestroyPacket(kis_packet *in_pack) {
     local_locker lock(&packetchain_mutex);
 
@@ -267,12 +928,61 @@ void Packetchain::DestroyPacket(kis_packet *in_pack) {
         (*(pcl->callback))(globalreg, pcl->auxdata, in_pack);
     }
 
+    // Free the components and keep the packet itself for reuse
+    in_pack->reset();
+
+    {
+        std::lock_guard<std::mutex> lk(packet_pool_mutex);
+
+        if (packet_pool.size() < packet_pool_max) {
+            packet_pool.push_back(in_pack);
+            return;
+        }
+    }
+
 	delete in_pack;
 }
 
+int Packetchain::RegisterBatchHandler(pc_batch_callback in_cb, string in_name) {
+    local_locker lock(&packetchain_mutex);
+
+    pthread_rwlock_wrlock(&chain_rwlock);
+
+    pc_batch_link link;
+
+    link.id = next_handlerid++;
+    link.name = in_name;
+    link.callback = in_cb;
+
+    batch_chain.push_back(link);
+
+    pthread_rwlock_unlock(&chain_rwlock);
+
+    return link.id;
+}
+
+int Packetchain::RemoveBatchHandler(int in_id) {
+    local_locker lock(&packetchain_mutex);
+
+    pthread_rwlock_wrlock(&chain_rwlock);
+
+    for (auto i = batch_chain.begin(); i != batch_chain.end(); ++i) {
+        if (i->id == in_id) {
+            batch_chain.erase(i);
+            break;
+        }
+    }
+
+    pthread_rwlock_unlock(&chain_rwlock);
+
+    return 1;
+}
+
 int Packetchain::RegisterIntHandler(pc_callback in_cb, void *in_aux,
         function<int (kis_packet *)> in_l_cb, 
-        int in_chain, int in_prio) {
+        int in_chain, int in_prio, string in_name) {
+
+    local_locker lock(&packetchain_mutex);
 
     pc_link *link = NULL;
     
@@ -289,6 +999,23 @@ int Packetchain::RegisterIntHandler(pc_callback in_cb, void *in_aux,
     link->l_callback = in_l_cb;
     link->auxdata = in_aux;
 	link->id = next_handlerid++;
+
+    link->name = in_name;
+    if (link->name.length() == 0)
+        link->name = "handler " + IntToString(link->id);
+    link->chain = in_chain;
+
+    link->paused = false;
+    link->dlt = -1;
+    link->component = -1;
+    link->num_calls = 0;
+    link->num_sampled = 0;
+    link->sampled_nsec = 0;
+    for (unsigned int x = 0; x < PACKETCHAIN_HISTOGRAM_BUCKETS; x++)
+        link->histogram[x] = 0;
+
+    // Dissector threads don't hold the packetchain mutex
+    pthread_rwlock_wrlock(&chain_rwlock);
             
     switch (in_chain) {
         case CHAINPOS_GENESIS:
@@ -346,23 +1073,104 @@ int Packetchain::RegisterIntHandler(pc_callback in_cb, void *in_aux,
             break;
 
         default:
+            pthread_rwlock_unlock(&chain_rwlock);
             delete link;
             _MSG("Packetchain::RegisterHandler requested unknown chain", 
 				 MSGFLAG_ERROR);
             return -1;
     }
 
+    pthread_rwlock_unlock(&chain_rwlock);
+
     return link->id;
 }
 
 int Packetchain::RegisterHandler(pc_callback in_cb, void *in_aux, 
-        int in_chain, int in_prio) {
-    return RegisterIntHandler(in_cb, in_aux, NULL, in_chain, in_prio);
+        int in_chain, int in_prio, string in_name) {
+    return RegisterIntHandler(in_cb, in_aux, NULL, in_chain, in_prio, in_name);
 }
 
 int Packetchain::RegisterHandler(function<int (kis_packet *)> in_cb, int in_chain,
-        int in_prio) {
-    return RegisterIntHandler(NULL, NULL, in_cb, in_chain, in_prio);
+        int in_prio, string in_name) {
+    return RegisterIntHandler(NULL, NULL, in_cb, in_chain, in_prio, in_name);
+}
+
+int Packetchain::PauseHandler(string in_name, bool in_paused) {
+    local_locker lock(&packetchain_mutex);
+
+    vector<Packetchain::pc_link *> *chains[] = {
+        &genesis_chain, &postcap_chain, &llcdissect_chain, &decrypt_chain,
+        &datadissect_chain, &classifier_chain, &tracker_chain, &logging_chain,
+        &destruction_chain
+    };
+
+    int found = 0;
+
+    for (auto c : chains) {
+        for (auto pcl : *c) {
+            if (pcl->name == in_name) {
+                pcl->paused = in_paused;
+                found++;
+            }
+        }
+    }
+
+    return found;
+}
+
+Packetchain::pc_link *Packetchain::FindHandler(int in_id) {
+    vector<Packetchain::pc_link *> *chains[] = {
+        &genesis_chain, &postcap_chain, &llcdissect_chain, &decrypt_chain,
+        &datadissect_chain, &classifier_chain, &tracker_chain, &logging_chain,
+        &destruction_chain
+    };
+
+    for (auto c : chains) {
+        for (auto pcl : *c) {
+            if (pcl->id == in_id)
+                return pcl;
+        }
+    }
+
+    return NULL;
+}
+
+int Packetchain::SetHandlerDLT(int in_id, int in_dlt) {
+    local_locker lock(&packetchain_mutex);
+
+    pc_link *pcl = FindHandler(in_id);
+
+    if (pcl == NULL)
+        return 0;
+
+    pcl->dlt = in_dlt;
+
+    return 1;
+}
+
+int Packetchain::SetHandlerComponent(int in_id, int in_component) {
+    local_locker lock(&packetchain_mutex);
+
+    pc_link *pcl = FindHandler(in_id);
+
+    if (pcl == NULL)
+        return 0;
+
+    pcl->component = in_component;
+
+    return 1;
+}
+
+int Packetchain::PacketDLT(kis_packet *in_pack) {
+    kis_datachunk *chunk = (kis_datachunk *) in_pack->fetch(pack_comp_decap);
+
+    if (chunk == NULL)
+        chunk = (kis_datachunk *) in_pack->fetch(pack_comp_linkframe);
+
+    if (chunk == NULL)
+        return -1;
+
+    return chunk->dlt;
 }
 
 int Packetchain::RemoveHandler(int in_id, int in_chain) {
@@ -370,6 +1178,9 @@ int Packetchain::RemoveHandler(int in_id, int in_chain) {
 
     local_locker lock(&packetchain_mutex);
 
+    // Dissector threads don't hold the packetchain mutex
+    pthread_rwlock_wrlock(&chain_rwlock);
+
     switch (in_chain) {
         case CHAINPOS_GENESIS:
 			for (x = 0; x < genesis_chain.size(); x++) {
@@ -444,11 +1255,14 @@ int Packetchain::RemoveHandler(int in_id, int in_chain) {
             break;
 
         default:
+            pthread_rwlock_unlock(&chain_rwlock);
             _MSG("Packetchain::RemoveHandler requested unknown chain", 
 				 MSGFLAG_ERROR);
             return -1;
     }
 
+    pthread_rwlock_unlock(&chain_rwlock);
+
     return 1;
 }
 
@@ -457,6 +1271,9 @@ int Packetchain::RemoveHandler(pc_callback in_cb, int in_chain) {
 
     local_locker lock(&packetchain_mutex);
 
+    // Dissector threads don't hold the packetchain mutex
+    pthread_rwlock_wrlock(&chain_rwlock);
+
     switch (in_chain) {
         case CHAINPOS_GENESIS:
 			for (x = 0; x < genesis_chain.size(); x++) {
@@ -531,11 +1348,157 @@ int Packetchain::RemoveHandler(pc_callback in_cb, int in_chain) {
             break;
 
         default:
+            pthread_rwlock_unlock(&chain_rwlock);
             _MSG("Packetchain::RemoveHandler requested unknown chain", 
 				 MSGFLAG_ERROR);
             return -1;
     }
 
+    pthread_rwlock_unlock(&chain_rwlock);
+
     return 1;
 }
 
+
+bool Packetchain::Httpd_VerifyPath(const char *path, const char *method) {
+    if (strcmp(method, "GET") != 0)
+        return false;
+
+    if (!Httpd_CanSerialize(path))
+        return false;
+
+    if (Httpd_StripSuffix(path) == "/packetchain/stats")
+        return true;
+
+    return false;
+}
+
+void Packetchain::Httpd_CreateStreamResponse(
+        Kis_Net_Httpd *httpd __attribute__((unused)),
+        Kis_Net_Httpd_Connection *connection __attribute__((unused)),
+        const char *path, const char *method, 
+        const char *upload_data __attribute__((unused)),
+        size_t *upload_data_size __attribute__((unused)), 
+        std::stringstream &stream) {
+
+    if (strcmp(method, "GET") != 0)
+        return;
+
+    if (Httpd_StripSuffix(path) != "/packetchain/stats")
+        return;
+
+    static const struct {
+        int chainpos;
+        const char *name;
+    } chain_names[] = {
+        { CHAINPOS_POSTCAP, "postcap" },
+        { CHAINPOS_LLCDISSECT, "llcdissect" },
+        { CHAINPOS_DECRYPT, "decrypt" },
+        { CHAINPOS_DATADISSECT, "datadissect" },
+        { CHAINPOS_CLASSIFIER, "classifier" },
+        { CHAINPOS_TRACKER, "tracker" },
+        { CHAINPOS_LOGGING, "logging" },
+    };
+
+    SharedTrackerElement stats = 
+        globalreg->entrytracker->GetTrackedInstance(stats_id);
+
+    SharedTrackerElement rate =
+        globalreg->entrytracker->GetTrackedInstance(stats_sample_rate_id);
+    rate->set((uint32_t) handler_sample_rate);
+    stats->add_map(rate);
+
+    SharedTrackerElement handlers =
+        globalreg->entrytracker->GetTrackedInstance(stats_handlers_id);
+    stats->add_map(handlers);
+
+    {
+        local_locker lock(&packetchain_mutex);
+
+        for (auto c : chain_names) {
+            vector<Packetchain::pc_link *> *chain = NULL;
+
+            switch (c.chainpos) {
+                case CHAINPOS_POSTCAP:
+                    chain = &postcap_chain;
+                    break;
+                case CHAINPOS_LLCDISSECT:
+                    chain = &llcdissect_chain;
+                    break;
+                case CHAINPOS_DECRYPT:
+                    chain = &decrypt_chain;
+                    break;
+                case CHAINPOS_DATADISSECT:
+                    chain = &datadissect_chain;
+                    break;
+                case CHAINPOS_CLASSIFIER:
+                    chain = &classifier_chain;
+                    break;
+                case CHAINPOS_TRACKER:
+                    chain = &tracker_chain;
+                    break;
+                case CHAINPOS_LOGGING:
+                    chain = &logging_chain;
+                    break;
+            }
+
+            for (auto pcl : *chain) {
+                SharedTrackerElement h =
+                    globalreg->entrytracker->GetTrackedInstance(stats_handler_id);
+
+                SharedTrackerElement e;
+
+                e = globalreg->entrytracker->GetTrackedInstance(stats_name_id);
+                e->set(pcl->name);
+                h->add_map(e);
+
+                e = globalreg->entrytracker->GetTrackedInstance(stats_chain_id);
+                e->set(string(c.name));
+                h->add_map(e);
+
+                e = globalreg->entrytracker->GetTrackedInstance(stats_priority_id);
+                e->set((int32_t) pcl->priority);
+                h->add_map(e);
+
+                e = globalreg->entrytracker->GetTrackedInstance(stats_paused_id);
+                e->set((uint8_t) pcl->paused.load(std::memory_order_relaxed));
+                h->add_map(e);
+
+                uint64_t sampled = pcl->num_sampled.load(std::memory_order_relaxed);
+                uint64_t nsec = pcl->sampled_nsec.load(std::memory_order_relaxed);
+
+                e = globalreg->entrytracker->GetTrackedInstance(stats_calls_id);
+                e->set((uint64_t) pcl->num_calls.load(std::memory_order_relaxed));
+                h->add_map(e);
+
+                e = globalreg->entrytracker->GetTrackedInstance(stats_sampled_id);
+                e->set(sampled);
+                h->add_map(e);
+
+                e = globalreg->entrytracker->GetTrackedInstance(stats_sampled_nsec_id);
+                e->set(nsec);
+                h->add_map(e);
+
+                e = globalreg->entrytracker->GetTrackedInstance(stats_mean_nsec_id);
+                e->set((uint64_t) (sampled == 0 ? 0 : nsec / sampled));
+                h->add_map(e);
+
+                SharedTrackerElement hist =
+                    globalreg->entrytracker->GetTrackedInstance(stats_histogram_id);
+
+                for (unsigned int b = 0; b < PACKETCHAIN_HISTOGRAM_BUCKETS; b++) {
+                    e = globalreg->entrytracker->GetTrackedInstance(stats_bucket_id);
+                    e->set((uint64_t) pcl->histogram[b].load(std::memory_order_relaxed));
+                    hist->add_vector(e);
+                }
+
+                h->add_map(hist);
+
+                handlers->add_vector(h);
+            }
+        }
+    }
+
+    Httpd_Serialize(path, stream, stats);
+}
+
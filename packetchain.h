@@ -33,11 +33,19 @@
 #include <vector>
 #include <map>
 #include <functional>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
 
 #include <pthread.h>
 
 #include "globalregistry.h"
 #include "packet.h"
+#include "kis_net_microhttpd.h"
+#include "kis_metrics.h"
 
 // Packet chain progression
 // GENESIS
@@ -55,6 +63,10 @@
 //
 // CLASSIFIER
 //
+// (overload sampling: when enabled and the pipeline or a source is backlogged,
+// only one in N data frames continues, standing in for the others; see
+// SampleOverload)
+//
 // TRACKER
 //
 // LOGGING
@@ -72,13 +84,43 @@
 #define CHAINPOS_LOGGING        8
 #define CHAINPOS_DESTROY        9
 
+// Pipelined packet processing
+//
+// By default every packet is run through every chain, in order, in the thread
+// which injected it.  When 'packet_dissector_threads' is set, the chain is split:
+//
+//   POST-CAPTURE, DISSECT, DECRYPT, and DATA-DISSECT are run on a pool of
+//   dissector threads, in parallel; handlers in these chains must not
+//   depend on state modified by other packets.
+//
+//   CLASSIFIER, TRACKER, and LOGGING are run by a single ordered thread which
+//   consumes packets in the order they were injected.  Packets are handed
+//   from the dissector pool to the ordered thread via a lock-free ring indexed
+//   by the injection sequence number, so device and log ordering is preserved.
+//
+// Batch handlers (RegisterBatchHandler) are run at the end of DATA-DISSECT on
+// the packets a dissector thread has taken at once, up to
+// 'packet_dissector_batch' consecutive packets, so that per-call overhead can
+// be spread over the batch; without a pipeline they are run on every packet
+// as a batch of one.  Duplicates are not included.
+
+// Per-handler statistics
+//
+// Every call to a handler from POST-CAPTURE through LOGGING is counted.  One in
+// every 'packet_handler_sample_rate' runs of a chain (per thread) is also timed,
+// handler by handler, into a log2 latency histogram:  bucket 0 counts calls
+// which took under 1ns, and bucket N calls which took [2^(N-1), 2^N) ns, with
+// the last bucket catching everything slower.  The stats are served as
+// /packetchain/stats.json
+#define PACKETCHAIN_HISTOGRAM_BUCKETS   32
+
 #define CHAINCALL_PARMS GlobalRegistry *globalreg __attribute__ ((unused)), \
     void *auxdata __attribute__ ((unused)), \
     kis_packet *in_pack
 
 class kis_packet;
 
-class Packetchain : public LifetimeGlobal {
+class Packetchain : public LifetimeGlobal, public Kis_Net_Httpd_CPPStream_Handler {
 public:
     static shared_ptr<Packetchain> create_packetchain(GlobalRegistry *in_globalreg) {
         shared_ptr<Packetchain> mon(new Packetchain(in_globalreg));
@@ -102,10 +144,51 @@ public:
 
     // Generate a packet and hand it back
     kis_packet *GeneratePacket();
-    // Inject a packet into the chain
-    int ProcessPacket(kis_packet *in_pack);
+    // Inject a packet into the chain, through an ingress queue from
+    // RegisterIngress or the default queue; returns 0 if the queue's rate limit
+    // dropped the packet, which is then already destroyed
+    int ProcessPacket(kis_packet *in_pack, int in_ingress = 0);
     // Destroy a packet at the end of its life
     void DestroyPacket(kis_packet *in_pack);
+
+    // Ingress queues, one per capture source, so a busy source can't crowd the
+    // others out of the pipeline.  The dissector threads take packets from the
+    // queues in weighted round robin, up to in_weight packets from a queue per
+    // turn; an injector waits while its own queue holds in_depth packets (0 for
+    // the pipeline backlog), instead of on the shared backlog.  At most in_rate
+    // packets a second (0 for any) are admitted, in bursts of up to a second's
+    // worth; the rest are dropped.  Without a pipeline packets are processed as
+    // they arrive and only the rate applies.  Returns the queue id.
+    int RegisterIngress(string in_name, unsigned int in_weight, size_t in_depth,
+            unsigned int in_rate);
+    // Queued packets are still processed; the queue goes away once they are
+    void RemoveIngress(int in_id);
+
+    // Packets waiting in, and dropped by the rate limit of, an ingress queue
+    size_t FetchIngressDepth(int in_id);
+    uint64_t FetchIngressDropped(int in_id);
+
+    // Drain and stop the pipeline threads, if any; packets injected after the
+    // pipeline is stopped are processed synchronously
+    void StopPipeline();
+
+    // Are packets handed off to dissector threads?  When they are not, a packet
+    // is completely processed and destroyed before ProcessPacket returns, so
+    // packet data may reference buffers owned by the caller.
+    bool IsPipelined() {
+        return pipeline_running;
+    }
+
+    // Per-chain timing, for benchmarking; off by default since it reads the
+    // clock twice per chain per packet.  Times are only for the handlers
+    // themselves, not time spent waiting for the chain lock or in the queues.
+    void EnableStageTiming(bool in_enable) {
+        stage_timing = in_enable;
+    }
+
+    // Packets run through, and total nanoseconds spent in, a CHAINPOS_ chain
+    uint64_t FetchStageCount(int in_chainpos);
+    uint64_t FetchStageNsec(int in_chainpos);
  
     // Callback and information 
     typedef int (*pc_callback)(CHAINCALL_PARMS);
@@ -115,21 +198,70 @@ public:
         function<int (kis_packet *)> l_callback;
         void *auxdata;
 		int id;
+
+        // Name and chain, for the stats
+        string name;
+        int chain;
+
+        // Calls, and time spent in sampled calls
+        std::atomic<uint64_t> num_calls;
+        std::atomic<uint64_t> num_sampled;
+        std::atomic<uint64_t> sampled_nsec;
+        std::atomic<uint64_t> histogram[PACKETCHAIN_HISTOGRAM_BUCKETS];
+
+        // Skipped, ie by the memory governor
+        std::atomic<bool> paused;
+
+        // Only called for packets of this link type, or carrying this packet
+        // component; -1 for every packet
+        std::atomic<int> dlt;
+        std::atomic<int> component;
     } pc_link;
 
-    // Register a callback, aux data, a chain to put it in, and the priority 
-    int RegisterHandler(pc_callback in_cb, void *in_aux, int in_chain, int in_prio);
-    int RegisterHandler(function<int (kis_packet *)> in_cb, int in_chain, int in_prio);
+    // Register a callback, aux data, a chain to put it in, and the priority.
+    // The name identifies the handler in the packetchain stats.
+    int RegisterHandler(pc_callback in_cb, void *in_aux, int in_chain, int in_prio,
+            string in_name = "");
+    int RegisterHandler(function<int (kis_packet *)> in_cb, int in_chain, int in_prio,
+            string in_name = "");
     int RemoveHandler(pc_callback in_cb, int in_chain);
 	int RemoveHandler(int in_id, int in_chain);
 
+    // Skip, or stop skipping, every handler with this name; returns the number
+    // of handlers found.  Only for handlers nothing later in the chain depends on.
+    int PauseHandler(string in_name, bool in_paused);
+
+    // Batch handlers, run in the dissector threads after DATA-DISSECT; the same
+    // rules as the dissector chains apply.  The handler may be called from
+    // several threads at once.
+    typedef function<void (kis_packet **, size_t)> pc_batch_callback;
+    int RegisterBatchHandler(pc_batch_callback in_cb, string in_name = "");
+    int RemoveBatchHandler(int in_id);
+
+    // Only call a handler for the packets it applies to, instead of every
+    // handler checking and returning early:  packets whose link type is in_dlt
+    // (that of the decapsulated frame when there is one, otherwise of the link
+    // frame, as the packet enters the chain), or packets carrying the packet
+    // component in_component, such as the info a phy's dissector adds for its
+    // classifier and tracker.  -1 matches every packet; returns 0 if there is
+    // no handler with that id.
+    int SetHandlerDLT(int in_id, int in_dlt);
+    int SetHandlerComponent(int in_id, int in_component);
+
+    virtual bool Httpd_VerifyPath(const char *path, const char *method);
+
+    virtual void Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd,
+            Kis_Net_Httpd_Connection *connection,
+            const char *url, const char *method, const char *upload_data,
+            size_t *upload_data_size, std::stringstream &stream);
+
 protected:
     GlobalRegistry *globalreg;
 
     // Common function for both insertion methods
     int RegisterIntHandler(pc_callback in_cb, void *in_aux, 
             function<int (kis_packet *)> in_l_cb, 
-            int in_chain, int in_prio);
+            int in_chain, int in_prio, string in_name);
 
     int next_componentid, next_handlerid;
 
@@ -150,7 +282,146 @@ protected:
 	vector<Packetchain::pc_link *> tracker_chain;
     vector<Packetchain::pc_link *> logging_chain;
 
+    struct pc_batch_link {
+        int id;
+        string name;
+        pc_batch_callback callback;
+    };
+
+    vector<pc_batch_link> batch_chain;
+
+    // Run the non-duplicate packets of a batch through the batch handlers
+    void RunBatchChain(kis_packet **in_packs, size_t in_num);
+
 	pthread_mutex_t packetchain_mutex;
+
+    pc_link *FindHandler(int in_id);
+
+    // Link type of a packet, for handlers bound to one
+    int pack_comp_linkframe, pack_comp_decap, pack_comp_common;
+    int PacketDLT(kis_packet *in_pack);
+
+    // Run a packet through a single chain, ignoring error codes
+    void RunChain(int in_chainpos, vector<Packetchain::pc_link *> &chain, 
+            kis_packet *in_pack);
+
+    // Time one in every N runs of a chain; 0 only counts calls
+    unsigned int handler_sample_rate;
+
+    // Stats fields
+    int stats_id, stats_sample_rate_id, stats_handlers_id, stats_handler_id,
+        stats_name_id, stats_chain_id, stats_priority_id, stats_calls_id,
+        stats_sampled_id, stats_sampled_nsec_id, stats_mean_nsec_id,
+        stats_histogram_id, stats_bucket_id, stats_paused_id;
+
+    std::atomic<bool> stage_timing;
+    std::atomic<uint64_t> stage_count[CHAINPOS_DESTROY + 1];
+    std::atomic<uint64_t> stage_nsec[CHAINPOS_DESTROY + 1];
+
+    // Packets injected, chain runs, and sampled chain latency, for /metrics
+    shared_ptr<kis_metric_counter> metric_packets;
+    shared_ptr<kis_metric_counter> metric_chain_runs[CHAINPOS_DESTROY + 1];
+    shared_ptr<kis_metric_histogram> metric_chain_latency[CHAINPOS_DESTROY + 1];
+
+    // Parallel and ordered halves of the chain
+    void RunDissectorChains(kis_packet *in_pack);
+    void RunOrderedChains(kis_packet *in_pack);
+
+    // Decide if a classified packet continues to the tracker and logging chains
+    // while we're overloaded; kept data frames are weighted by the sample rate
+    // and management and control frames are always kept
+    bool SampleOverload(kis_packet *in_pack);
+
+    // Sample data frames under overload, keeping one in overload_sample_rate
+    bool overload_sampling;
+    unsigned int overload_sample_rate;
+
+    // Pipeline depths which start and stop sampling
+    uint64_t overload_start_depth, overload_stop_depth;
+
+    std::atomic<bool> overloaded;
+    std::atomic<uint64_t> overload_sample_seq;
+
+    shared_ptr<kis_metric_counter> metric_sampled_out;
+
+    // Pipeline thread bodies
+    void DissectorThread();
+    void OrderedThread();
+
+    // Protects the dissector chains from modification while dissector threads
+    // are running them; lock order is packetchain_mutex, then chain_rwlock
+    pthread_rwlock_t chain_rwlock;
+
+    // Number of dissector threads; 0 disables the pipeline
+    unsigned int num_dissector_threads;
+
+    // Most packets a dissector thread takes at once
+    unsigned int dissector_batch;
+
+    std::atomic<bool> pipeline_running, dissectors_running;
+
+    vector<std::thread> dissector_threads;
+    std::thread ordered_thread;
+
+    struct ingress_queue {
+        int id;
+        string name;
+
+        unsigned int weight;
+        size_t depth;
+
+        // Token bucket, in packets, refilled from the monotonic clock
+        unsigned int rate;
+        double tokens;
+        uint64_t refill_usec;
+
+        std::deque<kis_packet *> queue;
+
+        // Packets still to take this turn
+        unsigned int credit;
+
+        bool removed;
+
+        std::atomic<uint64_t> dropped;
+    };
+
+    // Take a packet by the rate limit of its queue; must hold
+    // dissector_queue_mutex
+    bool AdmitIngress(ingress_queue *in_queue);
+
+    // Next packet in round robin order, or NULL if every queue is empty; must
+    // hold dissector_queue_mutex
+    kis_packet *ScheduleIngress();
+
+    // Injected packets waiting for a dissector thread; a packet gets its
+    // sequence number, and so its place in the ordered chains, as a dissector
+    // takes it
+    std::mutex dissector_queue_mutex;
+    std::condition_variable dissector_queue_cv;
+    std::map<int, std::shared_ptr<ingress_queue> > ingress_map;
+    vector<std::shared_ptr<ingress_queue> > ingress_rr;
+    size_t ingress_rr_pos;
+    std::atomic<size_t> ingress_queued;
+    int next_ingress_id;
+
+    // Handoff ring to the ordered thread.  A slot is only ever written by the
+    // dissector which owns that sequence number and only ever cleared by the
+    // ordered thread; dissectors don't take a packet while the ring is full so
+    // a slot is never reused before it is consumed.
+    size_t handoff_ring_sz;
+    std::unique_ptr<std::atomic<kis_packet *>[]> handoff_ring;
+    std::atomic<uint64_t> ingress_seq, egress_seq;
+
+    // Wakeups for the ordered thread and for injectors waiting on a full ring
+    std::mutex handoff_mutex;
+    std::condition_variable handoff_cv;
+    std::condition_variable backlog_cv;
+
+    // Destroyed packets kept for reuse, so that the packet and its component
+    // vector aren't reallocated for every frame
+    std::mutex packet_pool_mutex;
+    vector<kis_packet *> packet_pool;
+    size_t packet_pool_max;
 };
 
 #endif
@@ -38,10 +38,11 @@ Pcap_Stream_Ringbuf::Pcap_Stream_Ringbuf(GlobalRegistry *in_globalreg,
     packethandler_id = packetchain->RegisterHandler([this](kis_packet *packet) {
             handle_chain_packet(packet);
             return 1;
-        }, CHAINPOS_LOGGING, -100);
+        }, CHAINPOS_LOGGING, -100, "pcapng stream");
 
     pack_comp_linkframe = packetchain->RegisterPacketComponent("LINKFRAME");
     pack_comp_datasrc = packetchain->RegisterPacketComponent("KISDATASRC");
+    pack_comp_epbcache = packetchain->RegisterPacketComponent("PCAPNG_EPB");
 
     // Write the initial headers
     if (pcapng_make_shb("", "", "Kismet") < 0)
@@ -59,17 +60,23 @@ void Pcap_Stream_Ringbuf::stop_stream(string in_reason) {
     handler->ProtocolError();
 }
 
-int Pcap_Stream_Ringbuf::pcapng_make_shb(string in_hw, string in_os, string in_app) {
-    uint8_t *buf = NULL;
+double Pcap_Stream_Ringbuf::get_buffer_fill() {
+    ssize_t sz = handler->GetWriteBufferSize();
+
+    if (sz <= 0)
+        return -1;
+
+    return (double) handler->GetWriteBufferUsed() / sz;
+}
+
+void Pcap_Stream_Ringbuf::pcapng_encode_shb(string in_hw, string in_os, string in_app,
+        vector<uint8_t>& ret_block) {
     pcapng_shb *shb;
 
     pcapng_option *opt;
     size_t opt_offt = 0;
 
     size_t buf_sz;
-    size_t write_sz;
-
-    uint32_t *end_sz = (uint32_t *) &buf_sz;
 
     buf_sz = sizeof(pcapng_shb);
     // Allocate an end-of-options entry
@@ -85,19 +92,10 @@ int Pcap_Stream_Ringbuf::pcapng_make_shb(string in_hw, string in_os, string in_a
     if (in_app.length() > 0) 
         buf_sz += sizeof(pcapng_option) + PAD_TO_32BIT(in_app.length());
 
-    if (handler->GetWriteBufferAvailable() < (ssize_t) buf_sz + 4) {
-        handler->ProtocolError();
-        return -1;
-    }
-
-    buf = new uint8_t[buf_sz];
+    // Zeroed, so the option padding is too
+    ret_block.assign(buf_sz + 4, 0);
 
-    if (buf == NULL) {
-        handler->ProtocolError();
-        return -1;
-    }
-
-    shb = (pcapng_shb *) buf;
+    shb = (pcapng_shb *) ret_block.data();
 
     // Host-endian data; fill in the default info
     shb->block_type = PCAPNG_SHB_TYPE_MAGIC;
@@ -144,70 +142,74 @@ int Pcap_Stream_Ringbuf::pcapng_make_shb(string in_hw, string in_os, string in_a
     opt->option_code = PCAPNG_OPT_ENDOFOPT;
     opt->option_length = 0;
 
-    write_sz = handler->PutWriteBufferData(buf, buf_sz, true);
+    // Put the trailing size
+    uint32_t end_sz = buf_sz + 4;
+    memcpy(ret_block.data() + buf_sz, &end_sz, 4);
+}
 
-    if (write_sz != buf_sz) {
+int Pcap_Stream_Ringbuf::pcapng_write_header_block(const vector<uint8_t>& in_block) {
+    if (handler->GetWriteBufferAvailable() < (ssize_t) in_block.size()) {
         handler->ProtocolError();
-        delete[] buf;
         return -1;
     }
 
-    log_size += write_sz;
+    // The block and its trailing size go in as one record
+    struct iovec vec;
+    vec.iov_base = (void *) in_block.data();
+    vec.iov_len = in_block.size();
 
-    // Put the trailing size
-    *end_sz += 4;
-    
-    write_sz = handler->PutWriteBufferData(end_sz, 4, true);
-
-    if (write_sz != 4) {
+    if (handler->PutWriteBufferDataVec(&vec, 1) != in_block.size()) {
         handler->ProtocolError();
-        delete[] buf;
         return -1;
     }
 
-    log_size += write_sz;
+    log_size += in_block.size();
 
     return 1;
 }
 
-int Pcap_Stream_Ringbuf::pcapng_make_idb(KisDatasource *in_datasource) {
-    string ifname;
+int Pcap_Stream_Ringbuf::pcapng_make_shb(string in_hw, string in_os, string in_app) {
+    vector<uint8_t> block;
+
+    pcapng_encode_shb(in_hw, in_os, in_app, block);
+
+    return pcapng_write_header_block(block);
+}
+
+void Pcap_Stream_Ringbuf::pcapng_datasource_names(KisDatasource *in_datasource,
+        string *ret_interface, string *ret_description) {
     if (in_datasource->get_source_cap_interface().length() > 0) {
-        ifname = in_datasource->get_source_cap_interface();
+        *ret_interface = in_datasource->get_source_cap_interface();
     } else {
-        ifname = in_datasource->get_source_interface();
+        *ret_interface = in_datasource->get_source_interface();
     }
 
-    string ifdesc;
+    ret_description->clear();
     if (in_datasource->get_source_cap_interface() !=
             in_datasource->get_source_interface()) {
-        ifdesc = "capture interface for " + in_datasource->get_source_interface();
+        *ret_description = "capture interface for " + 
+            in_datasource->get_source_interface();
     }
+}
+
+int Pcap_Stream_Ringbuf::pcapng_make_idb(KisDatasource *in_datasource) {
+    string ifname, ifdesc;
+
+    pcapng_datasource_names(in_datasource, &ifname, &ifdesc);
 
     return pcapng_make_idb(in_datasource->get_source_number(), ifname, ifdesc,
             in_datasource->get_source_dlt());
 }
 
-int Pcap_Stream_Ringbuf::pcapng_make_idb(unsigned int in_sourcenumber, string in_interface, 
-        string in_desc, int in_dlt) {
-    // Put it in the map of datasource IDs to local log IDs.  The sequential 
-    // position in the list of IDBs is the size of the map because we never
-    // remove from the number map
-    unsigned int logid = datasource_id_map.size();
-    datasource_id_map.emplace(in_sourcenumber, logid);
-
-    uint8_t *retbuf;
-
+void Pcap_Stream_Ringbuf::pcapng_encode_idb(string in_interface, string in_desc,
+        int in_dlt, vector<uint8_t>& ret_block) {
     pcapng_idb *idb;
 
     pcapng_option *opt;
     size_t opt_offt = 0;
 
     size_t buf_sz;
-    size_t write_sz;
 
-    uint32_t *end_sz = (uint32_t *) &buf_sz;
-    
     buf_sz = sizeof(pcapng_idb);
 
     // Allocate an end-of-options entry
@@ -221,19 +223,9 @@ int Pcap_Stream_Ringbuf::pcapng_make_idb(unsigned int in_sourcenumber, string in
         buf_sz += sizeof(pcapng_option_t) + PAD_TO_32BIT(in_desc.length());
     }
 
-    if (handler->GetWriteBufferAvailable() < (ssize_t) buf_sz + 4) {
-        handler->ProtocolError();
-        return -1;
-    }
+    ret_block.assign(buf_sz + 4, 0);
 
-    retbuf = new uint8_t[buf_sz];
-
-    if (retbuf == NULL) {
-        handler->ProtocolError();
-        return -1;
-    }
-
-    idb = (pcapng_idb *) retbuf;
+    idb = (pcapng_idb *) ret_block.data();
 
     idb->block_type = PCAPNG_IDB_BLOCK_TYPE;
     idb->block_length = buf_sz + 4;
@@ -263,79 +255,60 @@ int Pcap_Stream_Ringbuf::pcapng_make_idb(unsigned int in_sourcenumber, string in
     opt->option_code = PCAPNG_OPT_ENDOFOPT;
     opt->option_length = 0;
 
-    write_sz = handler->PutWriteBufferData(retbuf, buf_sz, true);
+    // Put the trailing size
+    uint32_t end_sz = buf_sz + 4;
+    memcpy(ret_block.data() + buf_sz, &end_sz, 4);
+}
 
-    if (write_sz != buf_sz) {
-        handler->ProtocolError();
-        delete[] retbuf;
-        return -1;
-    }
+int Pcap_Stream_Ringbuf::pcapng_make_idb(unsigned int in_sourcenumber, string in_interface, 
+        string in_desc, int in_dlt) {
+    // Put it in the map of datasource IDs to local log IDs.  The sequential 
+    // position in the list of IDBs is the size of the map because we never
+    // remove from the number map
+    unsigned int logid = datasource_id_map.size();
+    datasource_id_map.emplace(in_sourcenumber, logid);
 
-    log_size += write_sz;
+    // Every packet block for this interface starts from the same header
+    pcapng_epb epb_template;
+    memset(&epb_template, 0, sizeof(pcapng_epb));
+    epb_template.block_type = PCAPNG_EPB_BLOCK_TYPE;
+    epb_template.interface_id = logid;
+    epb_templates.push_back(epb_template);
 
-    // Put the trailing size
-    *end_sz += 4;
-    
-    write_sz = handler->PutWriteBufferData(end_sz, 4, true);
+    vector<uint8_t> block;
 
-    if (write_sz != 4) {
-        handler->ProtocolError();
-        delete[] retbuf;
-        return -1;
-    }
+    pcapng_encode_idb(in_interface, in_desc, in_dlt, block);
 
-    log_size += write_sz;
+    if (pcapng_write_header_block(block) < 0)
+        return -1;
 
     return logid;
 }
 
-int Pcap_Stream_Ringbuf::pcapng_write_packet(unsigned int in_sourcenumber, 
-        struct timeval *in_tv, vector<data_block> in_blocks) {
-    uint8_t *retbuf;
-
-    // Interface ID for multiple interfaces per file
-    int ng_interface_id = in_sourcenumber;
-
+void Pcap_Stream_Ringbuf::pcapng_encode_epb(struct timeval *in_tv, 
+        const vector<data_block>& in_blocks, vector<uint8_t>& ret_block) {
     pcapng_epb *epb;
-
     pcapng_option *opt;
 
-    // Buffer contains just the header
-    size_t buf_sz = sizeof(pcapng_epb);
-
-    // Data contains header + data + options
-    size_t data_sz = buf_sz;
-
-    // End reference size
-    uint32_t *end_sz = (uint32_t *) &data_sz;
-
-    size_t write_sz;
-
     size_t aggregate_block_sz = 0;
 
     for (auto db : in_blocks) {
         aggregate_block_sz += db.len;
     }
 
-    // Pad to 32
-    data_sz += PAD_TO_32BIT(aggregate_block_sz);
-
-    // Allocate an end-of-options entry
-    data_sz += sizeof(pcapng_option);
-
-    // Drop packet if we can't put it in the buffer
-    if (handler->GetWriteBufferAvailable() < (ssize_t) buf_sz + 4) {
-        fprintf(stderr, "WARNING - pcapng ringbuf stream dropping packets\n");
-        return 0;
-    }
+    // Header, data padded to 32, end-of-options, and the trailing length
+    size_t data_sz = sizeof(pcapng_epb) + PAD_TO_32BIT(aggregate_block_sz) +
+        sizeof(pcapng_option);
+    uint32_t end_sz = data_sz + 4;
 
-    handler->ReserveWriteBufferData((void **) &retbuf, buf_sz);
+    // Zero-fill so the padding is already in place
+    ret_block.assign(end_sz, 0);
 
-    epb = (pcapng_epb *) retbuf;
+    epb = (pcapng_epb *) ret_block.data();
 
     epb->block_type = PCAPNG_EPB_BLOCK_TYPE;
-    epb->block_length = data_sz + 4;
-    epb->interface_id = ng_interface_id;
+    epb->block_length = end_sz;
+    epb->interface_id = 0;
 
     // Convert timestamp to 10e6 usec precision
     uint64_t conv_ts;
@@ -349,86 +322,127 @@ int Pcap_Stream_Ringbuf::pcapng_write_packet(unsigned int in_sourcenumber,
     epb->captured_length = aggregate_block_sz;
     epb->original_length = aggregate_block_sz;
 
-    // Write the header to the ringbuf
-    write_sz = handler->CommitWriteBufferData(retbuf, buf_sz);
-
-    if (!write_sz) {
-        handler->ProtocolError();
-        return -1;
+    // Copy all the incoming blocks sequentially
+    size_t offt = 0;
+    for (auto db : in_blocks) {
+        memcpy(epb->data + offt, db.data, db.len);
+        offt += db.len;
     }
 
-    log_size += write_sz;
+    // Put the end-of-options
+    opt = (pcapng_option_t *) (epb->data + PAD_TO_32BIT(aggregate_block_sz));
+    opt->option_code = PCAPNG_OPT_ENDOFOPT;
+    opt->option_length = 0;
 
-    // Write all the incoming blocks sequentially
-    for (auto db : in_blocks) {
-        // Write the data to the ringbuf
-        write_sz = handler->PutWriteBufferData(db.data, db.len, true);
+    // Put the trailing size
+    memcpy(ret_block.data() + data_sz, &end_sz, 4);
+}
 
-        if (write_sz != db.len) {
-            handler->ProtocolError();
-            return -1;
-        }
+int Pcap_Stream_Ringbuf::pcapng_write_epb(unsigned int in_interface, 
+        const vector<uint8_t>& in_block) {
+    if (in_block.size() < sizeof(pcapng_epb))
+        return 0;
 
-        log_size += write_sz;
-    }
+    // The block was encoded for interface 0; only the header has to change
+    pcapng_epb epb;
+    memcpy(&epb, in_block.data(), sizeof(pcapng_epb));
+    epb.interface_id = in_interface;
+
+    struct iovec vec[2];
+    vec[0].iov_base = &epb;
+    vec[0].iov_len = sizeof(pcapng_epb);
+    vec[1].iov_base = (void *) (in_block.data() + sizeof(pcapng_epb));
+    vec[1].iov_len = in_block.size() - sizeof(pcapng_epb);
 
-    // Pad data to 32bit
-    uint32_t pad = 0;
-    size_t pad_sz = 0;
+    // Drop packet if we can't put it in the buffer
+    if (handler->PutWriteBufferDataVec(vec, 2) != in_block.size()) {
+        fprintf(stderr, "WARNING - pcapng ringbuf stream dropping packets\n");
+        return 0;
+    }
 
-    pad_sz = PAD_TO_32BIT(aggregate_block_sz) - aggregate_block_sz;
+    log_size += in_block.size();
 
-    if (pad_sz > 0) {
-        write_sz = handler->PutWriteBufferData(&pad, pad_sz, true);
+    return 1;
+}
 
-        if (write_sz != pad_sz) {
-            handler->ProtocolError();
-            return -1;
-        }
+int Pcap_Stream_Ringbuf::pcapng_write_epb(unsigned int in_interface, 
+        struct timeval *in_tv, const struct iovec *in_data, size_t in_cnt) {
+    struct iovec stack_vec[PCAPNG_EPB_STACK_VEC];
+    vector<struct iovec> heap_vec;
+    struct iovec *vec = stack_vec;
 
-        log_size += write_sz;
+    if (in_cnt + 2 > PCAPNG_EPB_STACK_VEC) {
+        heap_vec.resize(in_cnt + 2);
+        vec = heap_vec.data();
     }
 
-    // Allocate the options
-    retbuf = new uint8_t[sizeof(pcapng_option_t)];
+    size_t data_sz = 0;
 
-    if (retbuf == NULL) {
-        handler->ProtocolError();
-        return -1;
+    for (size_t x = 0; x < in_cnt; x++) {
+        vec[x + 1] = in_data[x];
+        data_sz += in_data[x].iov_len;
     }
 
-    // Put the end-of-options
-    opt = (pcapng_option_t *) retbuf;
-    opt->option_code = PCAPNG_OPT_ENDOFOPT;
-    opt->option_length = 0;
+    size_t pad_sz = PAD_TO_32BIT(data_sz) - data_sz;
+    uint32_t end_sz = sizeof(pcapng_epb) + PAD_TO_32BIT(data_sz) + 
+        sizeof(pcapng_option) + 4;
 
-    write_sz = handler->PutWriteBufferData(retbuf, sizeof(pcapng_option_t), true);
+    pcapng_epb epb;
 
-    if (write_sz != sizeof(pcapng_option_t)) {
-        handler->ProtocolError();
-        delete[] retbuf;
-        return -1;
+    if (in_interface < epb_templates.size()) {
+        epb = epb_templates[in_interface];
+    } else {
+        memset(&epb, 0, sizeof(pcapng_epb));
+        epb.block_type = PCAPNG_EPB_BLOCK_TYPE;
+        epb.interface_id = in_interface;
     }
 
-    log_size += write_sz;
+    epb.block_length = end_sz;
 
-    delete[] retbuf;
+    // Convert timestamp to 10e6 usec precision
+    uint64_t conv_ts;
+    conv_ts = (uint64_t) in_tv->tv_sec * 1000000L;
+    conv_ts += in_tv->tv_usec;
 
-    // Put the trailing size
-    *end_sz += 4;
-    
-    write_sz = handler->PutWriteBufferData(end_sz, 4, true);
+    epb.timestamp_high = (conv_ts >> 32);
+    epb.timestamp_low = conv_ts;
 
-    if (write_sz != 4) {
-        handler->ProtocolError();
-        return -1;
+    epb.captured_length = data_sz;
+    epb.original_length = data_sz;
+
+    // Padding to 32 bits, the end-of-options, and the trailing size
+    uint8_t trailer[3 + sizeof(pcapng_option) + 4];
+    memset(trailer, 0, pad_sz + sizeof(pcapng_option));
+    memcpy(trailer + pad_sz + sizeof(pcapng_option), &end_sz, 4);
+
+    vec[0].iov_base = &epb;
+    vec[0].iov_len = sizeof(pcapng_epb);
+    vec[in_cnt + 1].iov_base = trailer;
+    vec[in_cnt + 1].iov_len = pad_sz + sizeof(pcapng_option) + 4;
+
+    // Drop packet if we can't put it in the buffer
+    if (handler->PutWriteBufferDataVec(vec, in_cnt + 2) != end_sz) {
+        fprintf(stderr, "WARNING - pcapng ringbuf stream dropping packets\n");
+        return 0;
     }
 
-    log_size += write_sz;
+    log_size += end_sz;
 
     return 1;
 }
 
+int Pcap_Stream_Ringbuf::pcapng_write_packet(unsigned int in_sourcenumber, 
+        struct timeval *in_tv, vector<data_block> in_blocks) {
+    vector<struct iovec> vec(in_blocks.size());
+
+    for (size_t x = 0; x < in_blocks.size(); x++) {
+        vec[x].iov_base = in_blocks[x].data;
+        vec[x].iov_len = in_blocks[x].len;
+    }
+
+    return pcapng_write_epb(in_sourcenumber, in_tv, vec.data(), vec.size());
+}
+
 int Pcap_Stream_Ringbuf::pcapng_write_packet(kis_packet *in_packet, kis_datachunk *in_data) {
     SharedDatasource kis_datasource;
 
@@ -454,10 +468,85 @@ int Pcap_Stream_Ringbuf::pcapng_write_packet(kis_packet *in_packet, kis_datachun
         ng_interface_id = ds_id_rec->second;
     }
 
+    // A block someone already encoded for this chunk (the pcapng log, or
+    // packet retention) is copied as it is
+    shared_ptr<vector<uint8_t> > block =
+        pcapng_cached_epb(in_packet, in_data, pack_comp_epbcache);
+
+    if (block != NULL)
+        return pcapng_write_epb(ng_interface_id, *block);
+
+    // Otherwise the packet goes straight from its chunk into the buffer between
+    // the header and trailer
+    struct iovec vec;
+    vec.iov_base = in_data->data;
+    vec.iov_len = in_data->length;
+
+    return pcapng_write_epb(ng_interface_id, &(in_packet->ts), &vec, 1);
+}
+
+shared_ptr<vector<uint8_t> > Pcap_Stream_Ringbuf::pcapng_cached_epb(kis_packet *in_packet,
+        kis_datachunk *in_data, int in_pack_comp_epbcache) {
+    pcapng_epb_cache *epbcache = 
+        (pcapng_epb_cache *) in_packet->fetch(in_pack_comp_epbcache);
+
+    if (epbcache == NULL || epbcache->source != in_data)
+        return NULL;
+
+    return epbcache->block;
+}
+
+shared_ptr<vector<uint8_t> > Pcap_Stream_Ringbuf::pcapng_shared_epb(kis_packet *in_packet,
+        kis_datachunk *in_data, int in_pack_comp_epbcache) {
+    // Streams only run from the logging chain, one at a time, so the first one
+    // to see a packet encodes it for everyone else
+    pcapng_epb_cache *epbcache = 
+        (pcapng_epb_cache *) in_packet->fetch(in_pack_comp_epbcache);
+
+    if (epbcache == NULL) {
+        epbcache = new pcapng_epb_cache();
+        in_packet->insert(in_pack_comp_epbcache, epbcache);
+    } else if (epbcache->source == in_data) {
+        return epbcache->block;
+    }
+
     vector<data_block> blocks;
     blocks.push_back(data_block(in_data->data, in_data->length));
 
-    return pcapng_write_packet(ng_interface_id, &(in_packet->ts), blocks);
+    shared_ptr<vector<uint8_t> > block(new vector<uint8_t>());
+    pcapng_encode_epb(&(in_packet->ts), blocks, *block);
+
+    // A stream which selected different data from a packet someone else has
+    // already encoded gets its own copy; otherwise this becomes the shared one
+    if (epbcache->source == NULL) {
+        epbcache->block = block;
+        epbcache->source = in_data;
+    }
+
+    return block;
+}
+
+int Pcap_Stream_Ringbuf::pcapng_write_block(unsigned int in_sourcenumber, 
+        string in_interface, string in_description, int in_dlt, 
+        const vector<uint8_t>& in_block) {
+    int ng_interface_id;
+
+    auto ds_id_rec = datasource_id_map.find(in_sourcenumber);
+
+    if (ds_id_rec == datasource_id_map.end()) {
+        if ((ng_interface_id = pcapng_make_idb(in_sourcenumber, in_interface,
+                        in_description, in_dlt)) < 0)
+            return -1;
+    } else {
+        ng_interface_id = ds_id_rec->second;
+    }
+
+    if (pcapng_write_epb(ng_interface_id, in_block) <= 0)
+        return 0;
+
+    log_packets++;
+
+    return 1;
 }
 
 // Handle a packet from the chain; given the accept_cb and selector_cb we
@@ -474,10 +563,6 @@ void Pcap_Stream_Ringbuf::handle_chain_packet(kis_packet *in_packet) {
     if (accept_cb != NULL && accept_cb(in_packet) == false)
         return;
 
-    // If we're paused, ignore packets
-    if (get_stream_paused())
-        return;
-
     // If we have a selector filter, use it to get the data chunk, otherwise
     // use the linkframe
     if (selector_cb != NULL) {
@@ -491,6 +576,12 @@ void Pcap_Stream_Ringbuf::handle_chain_packet(kis_packet *in_packet) {
     if (target_datachunk == NULL)
         return;
 
+    // Ignore packets while we're paused, throttled, or over our share of the
+    // bandwidth; the block is the packet padded to 32 bits, the epb header, the
+    // end of options, and the trailing length
+    if (!stream_admit(sizeof(pcapng_epb) + PAD_TO_32BIT(target_datachunk->length) + 8))
+        return;
+
     pcapng_write_packet(in_packet, target_datachunk);
 
     log_packets++;
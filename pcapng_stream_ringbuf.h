@@ -115,6 +115,33 @@ struct pcapng_epb {
 typedef struct pcapng_epb pcapng_epb_t;
 #define PCAPNG_EPB_BLOCK_TYPE       6
 
+// Pieces (header, packet data, and trailer) a packet block can be written
+// from without allocating a vector for them
+#define PCAPNG_EPB_STACK_VEC        8
+
+/* Enhanced packet block encoded once per packet and shared by every pcapng
+ * writer logging the same data chunk.  Packet retention and the pcapng log 
+ * build the complete block and attach it to the packet; streams only filter on
+ * the packet metadata, then copy the finished block, if there is one, and fill
+ * in their own interface id.  The block is reference counted, so it can be kept after the
+ * packet is gone (see DevicePacketRetention).
+ */
+class pcapng_epb_cache : public packet_component {
+public:
+    pcapng_epb_cache() {
+        self_destruct = 1;
+        source = NULL;
+    }
+
+    virtual ~pcapng_epb_cache() { }
+
+    // Data chunk the block was encoded from
+    kis_datachunk *source;
+
+    // Complete block, including the trailing length, with interface id 0
+    shared_ptr<vector<uint8_t> > block;
+};
+
 /* Instantiate a stream that attaches to the packetchain, outputs packets 
  * of type dlt, and optionally, apply an accept filter function;
  *
@@ -136,6 +163,8 @@ public:
 
     virtual void stop_stream(string in_reason);
 
+    virtual double get_buffer_fill();
+
     struct data_block {
         data_block(uint8_t *in_d, size_t in_l) {
             data = in_d;
@@ -146,9 +175,39 @@ public:
         size_t len;
     };
 
+    // Write a block encoded by pcapng_shared_epb, creating the interface record
+    // for its source if this stream doesn't have one yet
+    int pcapng_write_block(unsigned int in_sourcenumber, string in_interface,
+            string in_description, int in_dlt, const vector<uint8_t>& in_block);
+
+    // The enhanced packet block of a packet's data chunk, encoded once and shared
+    // through the packet's PCAPNG_EPB component; data other than the chunk which
+    // was encoded first gets a block of its own
+    static shared_ptr<vector<uint8_t> > pcapng_shared_epb(kis_packet *in_packet,
+            kis_datachunk *in_data, int in_pack_comp_epbcache);
+
+    // The shared block of a packet's data chunk if someone has encoded it
+    // already, or NULL
+    static shared_ptr<vector<uint8_t> > pcapng_cached_epb(kis_packet *in_packet,
+            kis_datachunk *in_data, int in_pack_comp_epbcache);
+
+    // Encode complete section header and interface description blocks, 
+    // including the trailing length
+    static void pcapng_encode_shb(string in_hw, string in_os, string in_app,
+            vector<uint8_t>& ret_block);
+    static void pcapng_encode_idb(string in_interface, string in_description,
+            int in_dlt, vector<uint8_t>& ret_block);
+
+    // Interface name and description a datasource is logged under
+    static void pcapng_datasource_names(KisDatasource *in_datasource, 
+            string *ret_interface, string *ret_description);
+
 protected:
     virtual int pcapng_make_shb(string in_hw, string in_os, string in_app);
 
+    // Write an encoded section or interface block as one record
+    int pcapng_write_header_block(const vector<uint8_t>& in_block);
+
     // Create a new interface record from an existing datasource
     virtual int pcapng_make_idb(KisDatasource *in_datasource);
 
@@ -164,9 +223,23 @@ protected:
     virtual int pcapng_write_packet(unsigned int in_sourcenumber, struct timeval *in_tv,
             vector<data_block> in_blocks);
 
+    // Encode a complete enhanced packet block for interface 0 into ret_block
+    static void pcapng_encode_epb(struct timeval *in_tv, 
+            const vector<data_block>& in_blocks, vector<uint8_t>& ret_block);
+
+    // Write an encoded enhanced packet block as a single record for the given
+    // interface; the packet is dropped if the whole block doesn't fit
+    int pcapng_write_epb(unsigned int in_interface, const vector<uint8_t>& in_block);
+
+    // Write an enhanced packet block around the packet data in in_data without
+    // encoding it first; the header comes from the interface template and the
+    // whole block goes into the buffer as one vectored write, or not at all
+    int pcapng_write_epb(unsigned int in_interface, struct timeval *in_tv,
+            const struct iovec *in_data, size_t in_cnt);
+
     virtual void handle_chain_packet(kis_packet *in_packet);
 
-    size_t PAD_TO_32BIT(size_t in) {
+    static size_t PAD_TO_32BIT(size_t in) {
         while (in % 4) in++;
         return in;
     }
@@ -178,13 +251,17 @@ protected:
     shared_ptr<BufferHandlerGeneric> handler;
 
     int packethandler_id;
-    int pack_comp_linkframe, pack_comp_datasrc;
+    int pack_comp_linkframe, pack_comp_datasrc, pack_comp_epbcache;
 
     function<bool (kis_packet *)> accept_cb;
     function<kis_datachunk * (kis_packet *)> selector_cb;
 
     // Map kismet internal interface ID to log interface ID
     map<unsigned int, unsigned int> datasource_id_map;
+
+    // Enhanced packet block header of each log interface, by log interface ID,
+    // with everything but the time and lengths filled in
+    vector<pcapng_epb> epb_templates;
     
 };
 
@@ -20,6 +20,7 @@
 
 #include <stdio.h>
 #include <time.h>
+#include <math.h>
 #include <list>
 #include <map>
 #include <vector>
@@ -110,6 +111,183 @@ void dot11_tracked_eapol::reserve_fields(SharedTrackerElement e) {
     add_map(eapol_packet);
 }
 
+const tracker_field_desc<dot11_client> dot11_client::field_desc[] = {
+    __TrackerField(dot11_client, "dot11.client.bssid",
+            TrackerMac, "bssid", bssid),
+    __TrackerField(dot11_client, "dot11.client.bssid_key",
+            TrackerUInt64, "key of BSSID record", bssid_key),
+    __TrackerField(dot11_client, "dot11.client.first_time",
+            TrackerUInt64, "first time seen", first_time),
+    __TrackerField(dot11_client, "dot11.client.last_time",
+            TrackerUInt64, "last time seen", last_time),
+    __TrackerField(dot11_client, "dot11.client.type",
+            TrackerUInt32, "type of client", client_type),
+    __TrackerField(dot11_client, "dot11.client.dhcp_host",
+            TrackerString, "dhcp host", dhcp_host),
+    __TrackerField(dot11_client, "dot11.client.dhcp_vendor",
+            TrackerString, "dhcp vendor", dhcp_vendor),
+    __TrackerField(dot11_client, "dot11.client.tx_cryptset",
+            TrackerUInt64, "bitset of transmitted encryption", tx_cryptset),
+    __TrackerField(dot11_client, "dot11.client.rx_cryptset",
+            TrackerUInt64, "bitset of received enryption", rx_cryptset),
+    __TrackerField(dot11_client, "dot11.client.eap_identity",
+            TrackerString, "EAP identity", eap_identity),
+    __TrackerField(dot11_client, "dot11.client.cdp_device",
+            TrackerString, "CDP device", cdp_device),
+    __TrackerField(dot11_client, "dot11.client.cdp_port",
+            TrackerString, "CDP port", cdp_port),
+    __TrackerField(dot11_client, "dot11.client.decrypted",
+            TrackerUInt8, "client decrypted", decrypted),
+
+    __TrackerComplexField(dot11_client, kis_tracked_ip_data,
+            "dot11.client.ipdata", "IP", ipdata_id),
+
+    __TrackerField(dot11_client, "dot11.client.datasize",
+            TrackerUInt64, "data in bytes", datasize),
+    __TrackerField(dot11_client, "dot11.client.datasize_retry",
+            TrackerUInt64, "retry data in bytes", datasize_retry),
+    __TrackerField(dot11_client, "dot11.client.num_fragments",
+            TrackerUInt64, "number of fragmented packets", num_fragments),
+    __TrackerField(dot11_client, "dot11.client.num_retries",
+            TrackerUInt64, "number of retried packets", num_retries),
+
+    __TrackerComplexField(dot11_client, kis_tracked_location,
+            "client.location", "location", location_id),
+};
+
+tracker_field_table<dot11_client> dot11_client::field_table(dot11_client::field_desc);
+
+const tracker_field_desc<dot11_tracked_device> dot11_tracked_device::field_desc[] = {
+    __TrackerField(dot11_tracked_device, "dot11.device.typeset",
+            TrackerUInt64, "bitset of device type", type_set),
+
+    __TrackerField(dot11_tracked_device, "dot11.device.client_map",
+            TrackerMacMap, "client behavior", client_map),
+    __TrackerComplexField(dot11_tracked_device, dot11_client,
+            "dot11.device.client", "client record", client_map_entry_id),
+
+    __TrackerField(dot11_tracked_device, "dot11.device.advertised_ssid_map",
+            TrackerIntMap, "advertised SSIDs", advertised_ssid_map),
+    __TrackerComplexField(dot11_tracked_device, dot11_advertised_ssid,
+            "dot11.device.advertised_ssid", "advertised ssid", advertised_ssid_map_entry_id),
+
+    __TrackerField(dot11_tracked_device, "dot11.device.probed_ssid_map",
+            TrackerIntMap, "probed SSIDs", probed_ssid_map),
+    __TrackerComplexField(dot11_tracked_device, dot11_probed_ssid,
+            "dot11.device.probed_ssid", "probed ssid", probed_ssid_map_entry_id),
+
+    __TrackerField(dot11_tracked_device, "dot11.device.associated_client_map",
+            TrackerMacMap, "associated clients", associated_client_map),
+    // Key of associated device, indexed by mac address
+    __TrackerFieldId(dot11_tracked_device, "dot11.device.associated_client",
+            TrackerUInt64, "associated client", associated_client_map_entry_id),
+
+    __TrackerField(dot11_tracked_device, "dot11.device.client_disconnects",
+            TrackerUInt64, "client disconnects in last second", client_disconnects),
+    __TrackerField(dot11_tracked_device, "dot11.device.last_sequence",
+            TrackerUInt64, "last sequence number", last_sequence),
+    __TrackerField(dot11_tracked_device, "dot11.device.bss_timestamp",
+            TrackerUInt64, "last BSS timestamp", bss_timestamp),
+    __TrackerField(dot11_tracked_device, "dot11.device.num_fragments",
+            TrackerUInt64, "number of fragmented packets", num_fragments),
+    __TrackerField(dot11_tracked_device, "dot11.device.num_retries",
+            TrackerUInt64, "number of retried packets", num_retries),
+    __TrackerField(dot11_tracked_device, "dot11.device.datasize",
+            TrackerUInt64, "data in bytes", datasize),
+    __TrackerField(dot11_tracked_device, "dot11.device.datasize_retry",
+            TrackerUInt64, "retried data in bytes", datasize_retry),
+    __TrackerField(dot11_tracked_device, "dot11.device.last_probed_ssid",
+            TrackerString, "last probed ssid", last_probed_ssid),
+    __TrackerField(dot11_tracked_device, "dot11.device.last_probed_ssid_csum",
+            TrackerUInt32, "last probed ssid checksum", last_probed_ssid_csum),
+    __TrackerField(dot11_tracked_device, "dot11.device.last_beaconed_ssid",
+            TrackerString, "last beaconed ssid", last_beaconed_ssid),
+    __TrackerField(dot11_tracked_device, "dot11.device.last_beaconed_ssid_checksum",
+            TrackerUInt32, "last beaconed ssid checksum", last_beaconed_ssid_csum),
+    __TrackerField(dot11_tracked_device, "dot11.device.last_bssid",
+            TrackerMac, "last BSSID", last_bssid),
+    __TrackerField(dot11_tracked_device, "dot11.device.last_beacon_timestamp",
+            TrackerUInt64, "unix timestamp of last beacon frame", last_beacon_timestamp),
+    __TrackerField(dot11_tracked_device, "dot11.device.wps_m3_count",
+            TrackerUInt64, "WPS M3 message count", wps_m3_count),
+    __TrackerField(dot11_tracked_device, "dot11.device.wps_m3_last",
+            TrackerUInt64, "WPS M3 last message", wps_m3_last),
+    __TrackerField(dot11_tracked_device, "dot11.device.wpa_handshake_list",
+            TrackerVector, "WPA handshakes", wpa_key_vec),
+
+    __TrackerComplexField(dot11_tracked_device, dot11_tracked_eapol,
+            "dot11.eapol.key", "WPA handshake key", wpa_key_entry_id),
+
+    __TrackerField(dot11_tracked_device, "dot11.device.wpa_present_handshake",
+            TrackerUInt8, "handshake sequences seen (bitmask)", wpa_present_handshake),
+};
+
+tracker_field_table<dot11_tracked_device> 
+    dot11_tracked_device::field_table(dot11_tracked_device::field_desc);
+
+bool dot11_tracked_device::has_associated_client(const mac_addr& in_mac) {
+    auto i = std::lower_bound(associated_clients.begin(), associated_clients.end(),
+            in_mac, [](const associated_client& c, const mac_addr& m) {
+                return c.mac < m;
+            });
+
+    return i != associated_clients.end() && i->mac == in_mac;
+}
+
+void dot11_tracked_device::add_associated_client(const mac_addr& in_mac,
+        uint64_t in_key) {
+    auto i = std::lower_bound(associated_clients.begin(), associated_clients.end(),
+            in_mac, [](const associated_client& c, const mac_addr& m) {
+                return c.mac < m;
+            });
+
+    if (i != associated_clients.end() && i->mac == in_mac) {
+        i->key = in_key;
+        return;
+    }
+
+    associated_client c;
+    c.mac = in_mac;
+    c.key = in_key;
+
+    associated_clients.insert(i, c);
+}
+
+void dot11_tracked_device::pre_serialize() {
+    tracker_component::pre_serialize();
+
+    TrackerElementMacMap client_map(associated_client_map);
+
+    client_map.clear();
+
+    for (auto c : associated_clients) {
+        SharedTrackerElement k(new TrackerElement(TrackerUInt64,
+                    associated_client_map_entry_id));
+        k->set(c.key);
+        client_map.insert(TrackerElement::mac_map_pair(c.mac, k));
+    }
+}
+
+void dot11_tracked_device::post_serialize() {
+    tracker_component::post_serialize();
+
+    associated_client_map->clear_macmap();
+}
+
+void dot11_tracked_device::reserve_fields(SharedTrackerElement e) {
+    tracker_component::reserve_fields(e);
+
+    // A stored device has its clients in the map; move them to the table
+    if (e != NULL) {
+        TrackerElementMacMap client_map(associated_client_map);
+
+        for (auto i = client_map.begin(); i != client_map.end(); ++i)
+            add_associated_client(i->first, i->second->get_uint64());
+
+        client_map.clear();
+    }
+}
+
 int phydot11_packethook_wep(CHAINCALL_PARMS) {
 	return ((Kis_80211_Phy *) auxdata)->PacketWepDecryptor(in_pack);
 }
@@ -146,29 +324,109 @@ Kis_80211_Phy::Kis_80211_Phy(GlobalRegistry *in_globalreg,
         globalreg->entrytracker->RegisterField("dot11.device", dot11_builder, 
                 "IEEE802.11 device");
 
-	// Packet classifier - makes basic records plus dot11 data
-	packetchain->RegisterHandler(&CommonClassifierDot11, this,
-            CHAINPOS_CLASSIFIER, -100);
+    shared_ptr<dot11_probed_ssid_count> probecount_builder(new dot11_probed_ssid_count(globalreg, 0));
+    probed_ssid_count_id =
+        globalreg->entrytracker->RegisterField("dot11.probecount", probecount_builder,
+                "probed ssid frequency");
+
+    // Flags for the device flag index; types map straight onto the dot11 type
+    // bits, and encryption is whatever any advertised SSID offers
+    devicetracker->RegisterDeviceFlags({ "dot11.ap", "dot11.adhoc", "dot11.client",
+            "dot11.wired", "dot11.wds" },
+            [this](shared_ptr<kis_tracked_device_base> d) -> uint64_t {
+                shared_ptr<dot11_tracked_device> dot11dev =
+                    static_pointer_cast<dot11_tracked_device>(d->get_map_value(dot11_device_entry_id));
+
+                if (dot11dev == NULL)
+                    return 0;
+
+                return dot11dev->get_type_set();
+            });
+
+    devicetracker->RegisterDeviceFlags({ "dot11.crypt.open", "dot11.crypt.wep",
+            "dot11.crypt.wpa", "dot11.crypt.wpa2", "dot11.crypt.psk", 
+            "dot11.crypt.eap", "dot11.crypt.tkip", "dot11.crypt.ccmp", 
+            "dot11.wps", "dot11.wps.configured", "dot11.wps.locked" },
+            [this](shared_ptr<kis_tracked_device_base> d) -> uint64_t {
+                shared_ptr<dot11_tracked_device> dot11dev =
+                    static_pointer_cast<dot11_tracked_device>(d->get_map_value(dot11_device_entry_id));
+
+                if (dot11dev == NULL)
+                    return 0;
+
+                uint64_t flags = 0;
+
+                TrackerElementIntMap ssidmap(dot11dev->get_advertised_ssid_map());
+
+                for (TrackerElementIntMap::iterator si = ssidmap.begin();
+                        si != ssidmap.end(); ++si) {
+                    shared_ptr<dot11_advertised_ssid> ssid = 
+                        static_pointer_cast<dot11_advertised_ssid>(si->second);
+
+                    uint64_t crypt = ssid->get_crypt_set();
+                    uint32_t wps = ssid->get_wps_state();
+
+                    if (crypt == crypt_none)
+                        flags |= (1 << 0);
+                    if (crypt & (crypt_wep | crypt_wep40 | crypt_wep104))
+                        flags |= (1 << 1);
+                    if (crypt & crypt_version_wpa)
+                        flags |= (1 << 2);
+                    if (crypt & crypt_version_wpa2)
+                        flags |= (1 << 3);
+                    if (crypt & crypt_psk)
+                        flags |= (1 << 4);
+                    if (crypt & crypt_eap)
+                        flags |= (1 << 5);
+                    if (crypt & crypt_tkip)
+                        flags |= (1 << 6);
+                    if (crypt & crypt_aes_ccm)
+                        flags |= (1 << 7);
+                    if ((crypt & crypt_wps) || wps != DOT11_WPS_NO_WPS)
+                        flags |= (1 << 8);
+                    if (wps & DOT11_WPS_CONFIGURED)
+                        flags |= (1 << 9);
+                    if (wps & DOT11_WPS_LOCKED)
+                        flags |= (1 << 10);
+                }
+
+                return flags;
+            });
 
-	packetchain->RegisterHandler(&phydot11_packethook_wep, this,
-            CHAINPOS_DECRYPT, -100);
-	packetchain->RegisterHandler(&phydot11_packethook_dot11, this,
-            CHAINPOS_LLCDISSECT, -100);
+	// Packet classifier - makes basic records plus dot11 data
+	int classifier_id =
+        packetchain->RegisterHandler(&CommonClassifierDot11, this,
+                CHAINPOS_CLASSIFIER, -100, "dot11 classifier");
+
+	int wep_id =
+        packetchain->RegisterHandler(&phydot11_packethook_wep, this,
+                CHAINPOS_DECRYPT, -100, "dot11 wep");
+	int dissector_id =
+        packetchain->RegisterHandler(&phydot11_packethook_dot11, this,
+                CHAINPOS_LLCDISSECT, -100, "dot11 dissector");
 #if 0
 	packetchain->RegisterHandler(&phydot11_packethook_dot11data, this,
-            CHAINPOS_DATADISSECT, -100);
+            CHAINPOS_DATADISSECT, -100, "dot11 data dissector");
 	packetchain->RegisterHandler(&phydot11_packethook_dot11string, this,
-            CHAINPOS_DATADISSECT, -99);
+            CHAINPOS_DATADISSECT, -99, "dot11 strings");
 #endif
 
-	packetchain->RegisterHandler(&phydot11_packethook_dot11tracker, this,
-											CHAINPOS_TRACKER, 100);
+	int tracker_id =
+        packetchain->RegisterHandler(&phydot11_packethook_dot11tracker, this,
+                CHAINPOS_TRACKER, 100, "dot11 tracker");
 
 	// If we haven't registered packet components yet, do so.  We have to
 	// co-exist with the old tracker core for some time
 	pack_comp_80211 = _PCM(PACK_COMP_80211) =
 		packetchain->RegisterPacketComponent("PHY80211");
 
+    // Only 802.11 frames reach the dissector, and only frames it dissected the
+    // rest of the dot11 handlers
+    packetchain->SetHandlerDLT(dissector_id, KDLT_IEEE802_11);
+    packetchain->SetHandlerComponent(wep_id, pack_comp_80211);
+    packetchain->SetHandlerComponent(classifier_id, pack_comp_80211);
+    packetchain->SetHandlerComponent(tracker_id, pack_comp_80211);
+
 	pack_comp_basicdata = 
 		packetchain->RegisterPacketComponent("BASICDATA");
 
@@ -187,6 +445,9 @@ Kis_80211_Phy::Kis_80211_Phy(GlobalRegistry *in_globalreg,
 	pack_comp_common = 
 		packetchain->RegisterPacketComponent("COMMON");
 
+    pack_comp_l1info =
+        packetchain->RegisterPacketComponent("RADIODATA");
+
 	pack_comp_datapayload =
 		packetchain->RegisterPacketComponent("DATAPAYLOAD");
 
@@ -401,6 +662,25 @@ Kis_80211_Phy::Kis_80211_Phy(GlobalRegistry *in_globalreg,
         process_ctl_phy = false;
     }
 
+    // Do we skip dissecting the tags of beacons which haven't changed?
+    beacon_cache_enabled =
+        globalreg->kismet_config->FetchOptBoolean("dot11_beacon_cache", 1);
+
+    probed_ssid_max =
+        globalreg->kismet_config->FetchOptUInt("dot11_probed_ssid_max", 64);
+
+    // Do we hold randomized MACs which only probe out of the device list?
+    ephemeral_enabled =
+        globalreg->kismet_config->FetchOptBoolean("dot11_ephemeral_clients", true);
+    ephemeral_promote_sec =
+        globalreg->kismet_config->FetchOptUInt("dot11_ephemeral_promote", 60);
+    ephemeral_max =
+        globalreg->kismet_config->FetchOptUInt("dot11_ephemeral_max", 16384);
+
+    if (ephemeral_max == 0) {
+        ephemeral_enabled = false;
+    }
+
 	dissect_strings = 0;
 	dissect_all_strings = 0;
 
@@ -422,6 +702,8 @@ Kis_80211_Phy::Kis_80211_Phy(GlobalRegistry *in_globalreg,
 	for (unsigned int wi = 0; wi < 256; wi++)
 		wep_identity[wi] = wi;
 
+    wepkey_generation = 1;
+
 	string_filter = new FilterCore(globalreg);
 	vector<string> filterlines = 
 		globalreg->kismet_config->FetchOptVec("filter_string");
@@ -458,6 +740,7 @@ Kis_80211_Phy::Kis_80211_Phy(GlobalRegistry *in_globalreg,
 	globalreg->InsertGlobal("SSID_CONF_FILE", shared_ptr<ConfigFile>(ssid_conf));
 
     httpd_pcap.reset(new Phy_80211_Httpd_Pcap(globalreg));
+    handshake_store.reset(new Phy_80211_Handshake_Store(globalreg));
 
     // Register js module for UI
     shared_ptr<Kis_Httpd_Registry> httpregistry = 
@@ -553,6 +836,22 @@ int Kis_80211_Phy::CommonClassifierDot11(CHAINCALL_PARMS) {
     kis_packet_checksum *fcs =
         (kis_packet_checksum *) in_pack->fetch(d11phy->pack_comp_checksum);
 
+    // Frames with a bad FCS took up the channel all the same, so work out the
+    // airtime before throwing them out
+    kis_layer1_packinfo *l1info =
+        (kis_layer1_packinfo *) in_pack->fetch(d11phy->pack_comp_l1info);
+
+    if (l1info != NULL) {
+        kis_datachunk *chunk =
+            (kis_datachunk *) in_pack->fetch(d11phy->pack_comp_decap);
+
+        if (chunk == NULL)
+            chunk = (kis_datachunk *) in_pack->fetch(d11phy->pack_comp_linkframe);
+
+        if (chunk != NULL)
+            l1info->airtime_usec = FrameAirtime(l1info, chunk->length);
+    }
+
     // We don't do anything if the packet is invalid;  in the future we might want
     // to try to attach it to an existing network if we can understand that much
     // of the frame and then treat it as an error, but that artificially inflates 
@@ -657,6 +956,60 @@ int Kis_80211_Phy::CommonClassifierDot11(CHAINCALL_PARMS) {
 	return 1;
 }
 
+unsigned int Kis_80211_Phy::FrameAirtime(kis_layer1_packinfo *in_l1, 
+        unsigned int in_len) {
+    // Data rates of one 20MHz spatial stream with the long guard interval, in
+    // 100kbps like the layer1 rate; HT indexes repeat every 8 with another
+    // stream, VHT adds 256-QAM as 8 and 9
+    static const unsigned int stream_rates[10] = {
+        65, 130, 195, 260, 390, 520, 585, 650, 780, 867
+    };
+
+    // Service field and tail around the MPDU and its FCS
+    unsigned int bits = 16 + 6 + ((in_len + 4) * 8);
+
+    if (in_l1->mcs >= 0) {
+        unsigned int idx = in_l1->mcs_vht ? in_l1->mcs : (in_l1->mcs % 8);
+        unsigned int nss = in_l1->mcs_nss == 0 ? 1 : in_l1->mcs_nss;
+
+        if (idx >= 10)
+            return 0;
+
+        // Data subcarriers scale the rate by 108/52 at 40MHz, 234/52 at 80MHz,
+        // and twice that at 160MHz
+        double rate = (double) stream_rates[idx] * nss;
+
+        if (in_l1->mcs_bandwidth == 40)
+            rate = rate * 108 / 52;
+        else if (in_l1->mcs_bandwidth == 80)
+            rate = rate * 234 / 52;
+        else if (in_l1->mcs_bandwidth == 160)
+            rate = rate * 468 / 52;
+
+        // Symbols are 4us, or 3.6us with the short guard interval
+        double symbol = in_l1->mcs_short_gi ? 3.6 : 4.0;
+        double bits_per_symbol = rate / 10 * 4.0;
+
+        // Legacy and HT training fields
+        return 32 + (4 * nss) + 
+            (unsigned int) ceil(ceil(bits / bits_per_symbol) * symbol);
+    }
+
+    if (in_l1->datarate <= 0)
+        return 0;
+
+    // DSSS and CCK rates send the frame after a long or short PLCP preamble
+    if (in_l1->encoding == encoding_cck || in_l1->datarate <= 110) {
+        unsigned int preamble = in_l1->short_preamble ? 96 : 192;
+        return preamble + 
+            (unsigned int) ceil((double) ((in_len + 4) * 8) * 10 / in_l1->datarate);
+    }
+
+    // OFDM is a 20us preamble and 4us symbols
+    double bits_per_symbol = in_l1->datarate / 10 * 4.0;
+    return 20 + (4 * (unsigned int) ceil(bits / bits_per_symbol));
+}
+
 void Kis_80211_Phy::SetStringExtract(int in_extr) {
 	if (in_extr == 0 && dissect_strings == 2) {
 		_MSG("SetStringExtract(): String dissection cannot be disabled because "
@@ -688,10 +1041,12 @@ void Kis_80211_Phy::AddWepKey(mac_addr bssid, uint8_t *key, unsigned int len,
 	if (wepkeys.find(winfo->bssid) != wepkeys.end()) {
 		delete wepkeys[winfo->bssid];
 		wepkeys[winfo->bssid] = winfo;
-		return;
+	} else {
+		wepkeys.insert(winfo->bssid, winfo);
 	}
 
-	wepkeys.insert(winfo->bssid, winfo);
+    // Any BSSID may match the new key now
+    wepkey_generation++;
 }
 
 void Kis_80211_Phy::HandleSSID(shared_ptr<kis_tracked_device_base> basedev,
@@ -713,6 +1068,10 @@ void Kis_80211_Phy::HandleSSID(shared_ptr<kis_tracked_device_base> basedev,
 
     if (dot11info->subtype == packet_sub_beacon ||
             dot11info->subtype == packet_sub_probe_resp) {
+        // Cloaked SSIDs aren't indexed
+        if (dot11info->ssid_len != 0 && !dot11info->ssid_blank)
+            devicetracker->IndexDeviceSSID(basedev, dot11info->ssid);
+
         ssid_itr = adv_ssid_map->find((int32_t) dot11info->ssid_csum);
 
         if (ssid_itr == adv_ssid_map->end()) {
@@ -1048,6 +1407,89 @@ void Kis_80211_Phy::HandleSSID(shared_ptr<kis_tracked_device_base> basedev,
 
 }
 
+namespace {
+
+struct probe_table_entry {
+    probe_table_entry() : ssid(NULL), devices(0), probes(0), last_time(0) { }
+
+    kis_string_rec *ssid;
+    unsigned int devices;
+    uint64_t probes;
+    time_t last_time;
+};
+
+// Allocated on first use and never freed, so probed SSIDs destroyed during
+// static teardown can still count themselves out
+std::mutex& probe_table_mutex() {
+    static std::mutex *m = new std::mutex();
+    return *m;
+}
+
+kis_u64_flat_map<probe_table_entry>& probe_table() {
+    static kis_u64_flat_map<probe_table_entry> *t = 
+        new kis_u64_flat_map<probe_table_entry>();
+    return *t;
+}
+
+}
+
+void dot11_probe_ssid_table::add_device(uint32_t in_csum, const std::string& in_ssid) {
+    std::lock_guard<std::mutex> lock(probe_table_mutex());
+
+    probe_table_entry& e = probe_table()[in_csum];
+
+    if (e.ssid == NULL)
+        e.ssid = kis_string_intern::acquire(in_ssid);
+
+    e.devices++;
+}
+
+void dot11_probe_ssid_table::remove_device(uint32_t in_csum) {
+    std::lock_guard<std::mutex> lock(probe_table_mutex());
+
+    kis_u64_flat_map<probe_table_entry>& table = probe_table();
+    probe_table_entry *e = table.find(in_csum);
+
+    if (e == NULL || e->devices == 0)
+        return;
+
+    // Forget SSIDs no device probes for any more
+    if (--(e->devices) == 0) {
+        kis_string_intern::release(e->ssid);
+        table.erase(in_csum);
+    }
+}
+
+void dot11_probe_ssid_table::add_probe(uint32_t in_csum, time_t in_time) {
+    std::lock_guard<std::mutex> lock(probe_table_mutex());
+
+    probe_table_entry *e = probe_table().find(in_csum);
+
+    if (e == NULL)
+        return;
+
+    e->probes++;
+
+    if (e->last_time < in_time)
+        e->last_time = in_time;
+}
+
+void dot11_probe_ssid_table::snapshot(std::vector<probe_count> *ret_counts) {
+    std::lock_guard<std::mutex> lock(probe_table_mutex());
+
+    ret_counts->reserve(probe_table().size());
+
+    probe_table().for_each([ret_counts](uint64_t k, probe_table_entry& e) {
+            probe_count c;
+            c.csum = (uint32_t) k;
+            c.ssid = e.ssid->str;
+            c.devices = e.devices;
+            c.probes = e.probes;
+            c.last_time = e.last_time;
+            ret_counts->push_back(c);
+        });
+}
+
 void Kis_80211_Phy::HandleProbedSSID(shared_ptr<kis_tracked_device_base> basedev,
         shared_ptr<dot11_tracked_device> dot11dev,
         kis_packet *in_pack,
@@ -1060,9 +1502,31 @@ void Kis_80211_Phy::HandleProbedSSID(shared_ptr<kis_tracked_device_base> basedev
     TrackerElement::int_map_iterator ssid_itr;
 
     if (dot11info->subtype == packet_sub_probe_req) {
+        // Broadcast probes have no SSID and aren't indexed
+        devicetracker->IndexDeviceSSID(basedev, dot11info->ssid);
+
         ssid_itr = probemap.find(dot11info->ssid_csum);
 
         if (ssid_itr == probemap.end()) {
+            // Devices which probe for everything replace the SSID they probed
+            // for least recently
+            if (probed_ssid_max != 0 && probemap.size() >= probed_ssid_max) {
+                TrackerElement::int_map_iterator oldest = probemap.end();
+                time_t oldest_time = 0;
+
+                for (auto i = probemap.begin(); i != probemap.end(); ++i) {
+                    time_t t = static_pointer_cast<dot11_probed_ssid>(i->second)->get_last_time();
+
+                    if (oldest == probemap.end() || t < oldest_time) {
+                        oldest = i;
+                        oldest_time = t;
+                    }
+                }
+
+                if (oldest != probemap.end())
+                    probemap.erase(oldest);
+            }
+
             probessid = dot11dev->new_probed_ssid();
             TrackerElement::int_map_pair p(dot11info->ssid_csum, probessid);
             probemap.insert(p);
@@ -1070,12 +1534,20 @@ void Kis_80211_Phy::HandleProbedSSID(shared_ptr<kis_tracked_device_base> basedev
             probessid->set_ssid(dot11info->ssid);
             probessid->set_ssid_len(dot11info->ssid_len);
             probessid->set_first_time(in_pack->ts.tv_sec);
+        } else {
+            probessid = static_pointer_cast<dot11_probed_ssid>(ssid_itr->second);
         }
 
         if (probessid != NULL) {
+            // Records restored from a snapshot count themselves on their first
+            // probe
+            probessid->count_probe(dot11info->ssid_csum);
+
             if (probessid->get_last_time() < in_pack->ts.tv_sec)
                 probessid->set_last_time(in_pack->ts.tv_sec);
 
+            dot11_probe_ssid_table::add_probe(dot11info->ssid_csum, in_pack->ts.tv_sec);
+
             // Add the location data, if any
             if (pack_gpsinfo != NULL && pack_gpsinfo->fix > 1) {
                 probessid->get_location()->add_loc(pack_gpsinfo->lat, pack_gpsinfo->lon,
@@ -1216,13 +1688,79 @@ void Kis_80211_Phy::HandleClient(shared_ptr<kis_tracked_device_base> basedev,
             static_pointer_cast<dot11_tracked_device>(backdev->get_map_value(dot11_device_entry_id));
 
         if (backdot11 != NULL) {
-            if (backdot11->get_associated_client_map()->mac_find(basedev->get_macaddr()) ==
-                    backdot11->get_associated_client_map()->mac_end()) {
+            if (!backdot11->has_associated_client(basedev->get_macaddr()))
+                backdot11->add_associated_client(basedev->get_macaddr(),
+                        basedev->get_key());
+        }
+    }
+}
+
+bool Kis_80211_Phy::HandleEphemeralClient(kis_packet *in_pack, 
+        dot11_packinfo *dot11info, kis_common_info *commoninfo,
+        dot11_ephemeral_rec *ret_promoted) {
+
+    // Only randomized MACs are ever ephemeral
+    if (!commoninfo->device.LocallyAdministered())
+        return false;
+
+    bool probe = dot11info->type == packet_management &&
+        dot11info->subtype == packet_sub_probe_req &&
+        commoninfo->device == dot11info->source_mac;
+
+    uint64_t key = commoninfo->device.longmac;
+
+    std::lock_guard<std::mutex> lk(ephemeral_mutex);
 
-                backdot11->get_associated_client_map()->add_macmap(basedev->get_macaddr(), basedev->get_tracker_key());
+    dot11_ephemeral_rec *rec = ephemeral_clients.find(key);
+
+    // Anything but a probe makes it a device
+    if (!probe) {
+        if (rec != NULL) {
+            *ret_promoted = *rec;
+            ephemeral_clients.erase(key);
+        }
+
+        return false;
+    }
+
+    if (rec == NULL) {
+        // Clients which are already devices stay devices
+        if (devicetracker->FetchDevice(commoninfo->device, phyid) != NULL)
+            return false;
+
+        if (ephemeral_clients.size() >= ephemeral_max) {
+            // Forget the clients which have gone quiet, or everything if none
+            // have
+            std::vector<uint64_t> stale;
+
+            ephemeral_clients.for_each([&](uint64_t k, dot11_ephemeral_rec& r) {
+                    if (in_pack->ts.tv_sec - r.last_time > (time_t) ephemeral_promote_sec)
+                        stale.push_back(k);
+                });
+
+            if (stale.size() == 0) {
+                ephemeral_clients.clear();
+            } else {
+                for (auto k : stale)
+                    ephemeral_clients.erase(k);
             }
         }
+
+        rec = &(ephemeral_clients[key]);
+        rec->first_time = in_pack->ts.tv_sec;
+    }
+
+    rec->last_time = in_pack->ts.tv_sec;
+    rec->packets += in_pack->sample_weight;
+
+    // Clients which keep probing are worth a device
+    if (rec->last_time - rec->first_time >= (time_t) ephemeral_promote_sec) {
+        *ret_promoted = *rec;
+        ephemeral_clients.erase(key);
+        return false;
     }
+
+    return true;
 }
 
 static int packetnum = 0;
@@ -1272,6 +1810,12 @@ int Kis_80211_Phy::TrackerDot11(kis_packet *in_pack) {
     if (commoninfo->type == packet_basic_phy && !process_ctl_phy)
         return 0;
 
+    dot11_ephemeral_rec ephemeral;
+
+    if (ephemeral_enabled &&
+            HandleEphemeralClient(in_pack, dot11info, commoninfo, &ephemeral))
+        return 0;
+
     // Find & update the common attributes of our base record.
     // We want to update signal, frequency, location, packet counts, devices,
     // and encryption, because this is the core record for everything we do.
@@ -1304,6 +1848,14 @@ int Kis_80211_Phy::TrackerDot11(kis_packet *in_pack) {
         return 0;
     }
 
+    // A promoted ephemeral client was seen before it was a device
+    if (ephemeral.packets != 0) {
+        if ((time_t) basedev->get_first_time() > ephemeral.first_time)
+            basedev->set_first_time(ephemeral.first_time);
+
+        basedev->inc_packets(ephemeral.packets);
+    }
+
     shared_ptr<dot11_tracked_device> dot11dev =
         static_pointer_cast<dot11_tracked_device>(basedev->get_map_value(dot11_device_entry_id));
 
@@ -1312,10 +1864,13 @@ int Kis_80211_Phy::TrackerDot11(kis_packet *in_pack) {
         ss << "Detected new 802.11 Wi-Fi device " << commoninfo->device.Mac2String() << " packet " << packetnum;
         _MSG(ss.str(), MSGFLAG_INFO);
 
-        dot11dev.reset(new dot11_tracked_device(globalreg, dot11_device_entry_id));
+        dot11dev = std::make_shared<dot11_tracked_device>(globalreg, dot11_device_entry_id);
         dot11_tracked_device::attach_base_parent(dot11dev, basedev);
     }
 
+    // Groups of the 802.11 records this packet touched, for the device events
+    unsigned int phy_changes = DEVICE_EVENT_GROUP_PHY;
+
     // Update the last beacon timestamp
     if (dot11info->type == packet_management && dot11info->subtype == packet_sub_beacon) {
         dot11dev->set_last_beacon_timestamp(in_pack->ts.tv_sec);
@@ -1327,12 +1882,14 @@ int Kis_80211_Phy::TrackerDot11(kis_packet *in_pack) {
             (dot11info->subtype == packet_sub_beacon ||
              dot11info->subtype == packet_sub_probe_resp)) {
         HandleSSID(basedev, dot11dev, in_pack, dot11info, pack_gpsinfo);
+        phy_changes |= DEVICE_EVENT_GROUP_SSID;
     }
 
     // Handle probe reqs
     if (dot11info->type == packet_management &&
             dot11info->subtype == packet_sub_probe_req) {
         HandleProbedSSID(basedev, dot11dev, in_pack, dot11info, pack_gpsinfo);
+        phy_changes |= DEVICE_EVENT_GROUP_SSID;
     }
 
     // Increase data size for ourselves, if we're a data packet
@@ -1435,6 +1992,7 @@ int Kis_80211_Phy::TrackerDot11(kis_packet *in_pack) {
 
         HandleClient(basedev, dot11dev, in_pack, dot11info,
                 pack_gpsinfo, pack_datainfo);
+        phy_changes |= DEVICE_EVENT_GROUP_CLIENT;
     } else if (dot11info->bssid_mac != basedev->get_macaddr() &&
             dot11info->distrib == distrib_to) {
 
@@ -1451,6 +2009,7 @@ int Kis_80211_Phy::TrackerDot11(kis_packet *in_pack) {
 
         HandleClient(basedev, dot11dev, in_pack, dot11info,
                 pack_gpsinfo, pack_datainfo);
+        phy_changes |= DEVICE_EVENT_GROUP_CLIENT;
     }
 
     // Look for WPA handshakes
@@ -1459,6 +2018,15 @@ int Kis_80211_Phy::TrackerDot11(kis_packet *in_pack) {
             PacketDot11EapolHandshake(in_pack, dot11dev);
 
         if (eapol != NULL) {
+            // The client is whichever end isn't the access point
+            mac_addr eapolclient = dot11info->source_mac;
+
+            if (eapolclient == dot11info->bssid_mac)
+                eapolclient = dot11info->dest_mac;
+
+            handshake_store->AddMessage(in_pack, dot11info->bssid_mac, eapolclient,
+                    eapol->get_eapol_msg_num());
+
             shared_ptr<kis_tracked_device_base> eapolbase =
                 devicetracker->FetchDevice(dot11info->bssid_mac, phyid);
 
@@ -1508,6 +2076,9 @@ int Kis_80211_Phy::TrackerDot11(kis_packet *in_pack) {
                     }
 
                     eapoldot11->set_wpa_present_handshake(keymask);
+
+                    devicetracker->ReportDeviceChange(eapolbase,
+                            DEVICE_EVENT_GROUP_PHY | DEVICE_EVENT_GROUP_HANDSHAKE);
                 }
             }
         }
@@ -1582,6 +2153,8 @@ int Kis_80211_Phy::TrackerDot11(kis_packet *in_pack) {
         fprintf(stderr, "debug - unclassed device as of packet %d typeset %lu\n", packetnum, basedev->get_basic_type_set());
     }
 
+    devicetracker->ReportDeviceChange(basedev, phy_changes);
+
 
 #if 0
 
@@ -1783,6 +2356,10 @@ bool Kis_80211_Phy::Httpd_VerifyPath(const char *path, const char *method) {
     }
 
     if (strcmp(method, "GET") == 0) {
+        if (Httpd_CanSerialize(path) &&
+                Httpd_StripSuffix(path) == "/phy/phy80211/probed_ssids")
+            return true;
+
         vector<string> tokenurl = StrTokenize(path, "/");
 
         // we care about
@@ -1934,6 +2511,27 @@ void Kis_80211_Phy::Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd,
         return;
     }
 
+    if (Httpd_StripSuffix(url) == "/phy/phy80211/probed_ssids") {
+        std::vector<dot11_probe_ssid_table::probe_count> counts;
+        dot11_probe_ssid_table::snapshot(&counts);
+
+        SharedTrackerElement outvec(new TrackerElement(TrackerVector));
+
+        for (auto c : counts) {
+            shared_ptr<dot11_probed_ssid_count> pc(new dot11_probed_ssid_count(globalreg,
+                        probed_ssid_count_id));
+            pc->set_ssid(c.ssid);
+            pc->set_ssid_csum(c.csum);
+            pc->set_devices(c.devices);
+            pc->set_probes(c.probes);
+            pc->set_last_time(c.last_time);
+            outvec->add_vector(pc);
+        }
+
+        Httpd_Serialize(url, stream, outvec);
+        return;
+    }
+
     vector<string> tokenurl = StrTokenize(url, "/");
 
     // /phy/phy80211/by-bssid/[mac]/pcap/[mac]-handshake.pcap
@@ -2006,15 +2604,7 @@ int Kis_80211_Phy::Httpd_PostComplete(Kis_Net_Httpd_Connection *concls) {
 
     // Make sure we can extract the parameters
     try {
-        if (concls->variable_cache.find("msgpack") != concls->variable_cache.end()) {
-            structdata.reset(new StructuredMsgpack(Base64::decode(concls->variable_cache["msgpack"]->str())));
-        } else if (concls->variable_cache.find("json") != 
-                concls->variable_cache.end()) {
-            structdata.reset(new StructuredJson(concls->variable_cache["json"]->str()));
-        } else {
-            // fprintf(stderr, "debug - missing data\n");
-            throw StructuredDataException("Missing data");
-        }
+        structdata = concls->FetchStructuredPost();
 
         // Look for a vector named 'essid', we need it for the worker
         SharedStructured essid_list = structdata->getStructuredByKey("essid");
@@ -30,6 +30,8 @@
 #include <vector>
 #include <algorithm>
 #include <string>
+#include <mutex>
+#include <atomic>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -45,6 +47,8 @@
 #include "devicetracker_component.h"
 #include "kis_net_microhttpd.h"
 #include "phy_80211_httpd_pcap.h"
+#include "phy_80211_handshakes.h"
+#include "kis_flat_hash.h"
 
 /*
  * 802.11 PHY handlers
@@ -106,7 +110,8 @@ public:
 // Packet info decoded by the dot11 phy decoder
 // 
 // Injected into the packet chain and processed later into the device records
-class dot11_packinfo : public packet_component {
+class dot11_packinfo : public packet_component, 
+    public pooled_packet_component<dot11_packinfo> {
 public:
     dot11_packinfo() {
 		self_destruct = 1; // Our delete() handles this
@@ -229,6 +234,68 @@ public:
     // about it because it's almost always bogus.
 };
 
+// Most BSSIDs whose last beacon is remembered at once, and how long a BSSID
+// has to be quiet to be dropped when the cache is full
+#define DOT11_BEACON_CACHE_MAX      16384
+#define DOT11_BEACON_CACHE_AGE      300
+
+// Most BSSIDs whose WEP key lookup is remembered at once
+#define DOT11_WEP_CACHE_MAX         4096
+
+// The WEP key a BSSID resolved to, and the keystream of the last IV seen from
+// it.
+//
+// Finding the key is a masked search of the key table, and the RC4 key setup
+// and keystream depend only on the key and the 24 bit IV; retried frames, and
+// the IV reuse WEP is known for, repeat the IV and can reuse the keystream
+// instead of running RC4 again.  BSSIDs with no key are remembered too, so
+// encrypted traffic without a key costs one hash lookup.  Slots are resolved
+// against a generation of the key table and are refreshed when keys change.
+class dot11_wep_cache_slot {
+public:
+    dot11_wep_cache_slot() : key(NULL), generation(0), iv(0), iv_valid(false) { }
+
+    dot11_wep_key *key;
+    unsigned int generation;
+
+    uint32_t iv;
+    bool iv_valid;
+    vector<uint8_t> keystream;
+};
+
+// The tag fields of the last beacon fully dissected for a BSSID.
+//
+// Access points repeat the same beacon ten times a second; when a new one
+// carries the same capabilities and tags (other than the TIM, which counts
+// down to the DTIM beacon) the dissector copies the fields from here instead
+// of parsing the tags again.  Records are never modified once they're in the
+// cache, only replaced.
+class dot11_beacon_cache_rec {
+public:
+    // Crypt flags from the frame header and capabilities, before the tags
+    uint64_t pre_cryptset;
+
+    // The capabilities and every tag except the TIM, as they were in the frame
+    string tags;
+
+    string ssid;
+    int ssid_len;
+    int ssid_blank;
+    uint32_t ssid_csum;
+    uint32_t ietag_csum;
+    string beacon_info;
+    double maxrate;
+    string channel;
+    uint64_t cryptset;
+    string dot11d_country;
+    vector<dot11_packinfo_dot11d_entry> dot11d_vec;
+    uint8_t wps;
+    string wps_manuf;
+    string wps_device_name;
+    string wps_model_name;
+    string wps_model_number;
+};
+
 class dot11_tracked_eapol : public tracker_component {
 public:
     dot11_tracked_eapol(GlobalRegistry *in_globalreg, int in_id) :
@@ -309,10 +376,34 @@ protected:
     SharedTrackerElement txpower;
 };
 
+// Number of devices probing for each SSID, and the probes seen for it, by SSID
+// checksum.  A probed SSID record counts itself in when a device first probes
+// for the SSID and out when it is destroyed, with its device or when the device
+// replaces it, so the table is kept as it goes and never rebuilt.  Allocated on
+// first use and never freed, like the string intern table.
+class dot11_probe_ssid_table {
+public:
+    struct probe_count {
+        uint32_t csum;
+        std::string ssid;
+        unsigned int devices;
+        uint64_t probes;
+        time_t last_time;
+    };
+
+    static void add_device(uint32_t in_csum, const std::string& in_ssid);
+    static void remove_device(uint32_t in_csum);
+    static void add_probe(uint32_t in_csum, time_t in_time);
+
+    // Copy of every SSID still probed for by a device
+    static void snapshot(std::vector<probe_count> *ret_counts);
+};
+
 class dot11_probed_ssid : public tracker_component {
 public:
     dot11_probed_ssid(GlobalRegistry *in_globalreg, int in_id) : 
         tracker_component(in_globalreg, in_id) { 
+        probe_counted = false;
         register_fields();
         reserve_fields(NULL);
     } 
@@ -320,15 +411,31 @@ public:
     dot11_probed_ssid(GlobalRegistry *in_globalreg, int in_id, SharedTrackerElement e) : 
         tracker_component(in_globalreg, in_id) {
 
+        probe_counted = false;
         register_fields();
         reserve_fields(e);
     }
 
+    virtual ~dot11_probed_ssid() {
+        if (probe_counted)
+            dot11_probe_ssid_table::remove_device(probe_csum);
+    }
+
+    // Count this device in the probe table under in_csum, until destroyed
+    void count_probe(uint32_t in_csum) {
+        if (probe_counted)
+            return;
+
+        probe_csum = in_csum;
+        probe_counted = true;
+        dot11_probe_ssid_table::add_device(in_csum, get_ssid());
+    }
+
     virtual SharedTrackerElement clone_type() {
         return SharedTrackerElement(new dot11_probed_ssid(globalreg, get_id()));
     }
 
-    __Proxy(ssid, string, string, string, ssid);
+    __ProxyInterned(ssid, ssid);
     __Proxy(ssid_len, uint32_t, unsigned int, unsigned int, ssid_len);
     __Proxy(bssid, mac_addr, mac_addr, mac_addr, bssid);
     __Proxy(first_time, uint64_t, time_t, time_t, first_time);
@@ -372,6 +479,56 @@ protected:
 
     int location_id;
     shared_ptr<kis_tracked_location> location;
+
+    bool probe_counted;
+    uint32_t probe_csum;
+};
+
+// One SSID of the probe table, for serializing
+class dot11_probed_ssid_count : public tracker_component {
+public:
+    dot11_probed_ssid_count(GlobalRegistry *in_globalreg, int in_id) :
+        tracker_component(in_globalreg, in_id) {
+        register_fields();
+        reserve_fields(NULL);
+    }
+
+    dot11_probed_ssid_count(GlobalRegistry *in_globalreg, int in_id,
+            SharedTrackerElement e) :
+        tracker_component(in_globalreg, in_id) {
+        register_fields();
+        reserve_fields(e);
+    }
+
+    virtual SharedTrackerElement clone_type() {
+        return SharedTrackerElement(new dot11_probed_ssid_count(globalreg, get_id()));
+    }
+
+    __ProxyInterned(ssid, ssid);
+    __Proxy(ssid_csum, uint32_t, uint32_t, uint32_t, ssid_csum);
+    __Proxy(devices, uint32_t, unsigned int, unsigned int, devices);
+    __Proxy(probes, uint64_t, uint64_t, uint64_t, probes);
+    __Proxy(last_time, uint64_t, time_t, time_t, last_time);
+
+protected:
+    virtual void register_fields() {
+        RegisterField("dot11.probecount.ssid", TrackerString,
+                "probed ssid string (sanitized)", &ssid);
+        RegisterField("dot11.probecount.ssid_csum", TrackerUInt32,
+                "probed ssid checksum", &ssid_csum);
+        RegisterField("dot11.probecount.devices", TrackerUInt32,
+                "number of devices probing for this ssid", &devices);
+        RegisterField("dot11.probecount.probes", TrackerUInt64,
+                "number of probes seen for this ssid", &probes);
+        RegisterField("dot11.probecount.last_time", TrackerUInt64,
+                "last time probed", &last_time);
+    }
+
+    SharedTrackerElement ssid;
+    SharedTrackerElement ssid_csum;
+    SharedTrackerElement devices;
+    SharedTrackerElement probes;
+    SharedTrackerElement last_time;
 };
 
 /* Advertised SSID
@@ -398,13 +555,13 @@ public:
         return SharedTrackerElement(new dot11_advertised_ssid(globalreg, get_id()));
     }
 
-    __Proxy(ssid, string, string, string, ssid);
+    __ProxyInterned(ssid, ssid);
     __Proxy(ssid_len, uint32_t, unsigned int, unsigned int, ssid_len);
 
     __Proxy(ssid_beacon, uint8_t, bool, bool, ssid_beacon);
     __Proxy(ssid_probe_response, uint8_t, bool, bool, ssid_probe_response);
 
-    __Proxy(channel, string, string, string, channel);
+    __ProxyInterned(channel, channel);
 
     __Proxy(first_time, uint64_t, time_t, time_t, first_time);
     __Proxy(last_time, uint64_t, time_t, time_t, last_time);
@@ -443,7 +600,7 @@ public:
     }
 
     __Proxy(wps_state, uint32_t, uint32_t, uint32_t, wps_state);
-    __Proxy(wps_manuf, string, string, string, wps_manuf);
+    __ProxyInterned(wps_manuf, wps_manuf);
     __Proxy(wps_device_name, string, string, string, wps_device_name);
     __Proxy(wps_model_name, string, string, string, wps_model_name);
     __Proxy(wps_model_number, string, string, string, wps_model_number);
@@ -609,49 +766,7 @@ public:
 
 protected:
     virtual void register_fields() {
-        RegisterField("dot11.client.bssid", TrackerMac,
-                "bssid", &bssid);
-        RegisterField("dot11.client.bssid_key", TrackerUInt64,
-                "key of BSSID record", &bssid_key);
-        RegisterField("dot11.client.first_time", TrackerUInt64,
-                "first time seen", &first_time);
-        RegisterField("dot11.client.last_time", TrackerUInt64,
-                "last time seen", &last_time);
-        RegisterField("dot11.client.type", TrackerUInt32,
-                "type of client", &client_type);
-        RegisterField("dot11.client.dhcp_host", TrackerString,
-                "dhcp host", &dhcp_host);
-        RegisterField("dot11.client.dhcp_vendor", TrackerString,
-                "dhcp vendor", &dhcp_vendor);
-        RegisterField("dot11.client.tx_cryptset", TrackerUInt64,
-                "bitset of transmitted encryption",
-                &tx_cryptset);
-        RegisterField("dot11.client.rx_cryptset", TrackerUInt64,
-                "bitset of received enryption",
-                &rx_cryptset);
-        RegisterField("dot11.client.eap_identity", TrackerString,
-                "EAP identity", &eap_identity);
-        RegisterField("dot11.client.cdp_device", TrackerString,
-                "CDP device", &cdp_device);
-        RegisterField("dot11.client.cdp_port", TrackerString,
-                "CDP port", &cdp_port);
-        RegisterField("dot11.client.decrypted", TrackerUInt8,
-                "client decrypted", &decrypted);
-
-        __RegisterComplexField(kis_tracked_ip_data, ipdata_id, 
-                "dot11.client.ipdata", "IP");
-
-        RegisterField("dot11.client.datasize", TrackerUInt64,
-                "data in bytes", &datasize);
-        RegisterField("dot11.client.datasize_retry", TrackerUInt64,
-                "retry data in bytes", &datasize_retry);
-        RegisterField("dot11.client.num_fragments", TrackerUInt64,
-                "number of fragmented packets", &num_fragments);
-        RegisterField("dot11.client.num_retries", TrackerUInt64,
-                "number of retried packets", &num_retries);
-
-        __RegisterComplexField(kis_tracked_location, location_id, 
-                "client.location", "location");
+        register_table_fields(field_table);
     }
 
     virtual void reserve_fields(SharedTrackerElement e) {
@@ -668,6 +783,8 @@ protected:
         add_map(location_id, location);
     }
 
+    static const tracker_field_desc<dot11_client> field_desc[];
+    static tracker_field_table<dot11_client> field_table;
         
     SharedTrackerElement bssid;
     SharedTrackerElement bssid_key;
@@ -760,6 +877,16 @@ public:
         return shared_ptr<dot11_probed_ssid>(new dot11_probed_ssid(globalreg, probed_ssid_map_entry_id));
     }
 
+    // Clients of this device, by MAC address, with the key of their own device
+    // record.  A busy AP has thousands, so they're kept in a flat table sorted
+    // by MAC; associated_client_map is only filled in from the table while the
+    // device is being serialized.
+    bool has_associated_client(const mac_addr& in_mac);
+    void add_associated_client(const mac_addr& in_mac, uint64_t in_key);
+    size_t get_num_associated_clients() {
+        return associated_clients.size();
+    }
+
     __ProxyTrackable(associated_client_map, TrackerElement, associated_client_map);
 
     __Proxy(client_disconnects, uint64_t, uint64_t, uint64_t, client_disconnects);
@@ -782,11 +909,11 @@ public:
 
     __Proxy(last_bssid, mac_addr, mac_addr, mac_addr, last_bssid);
 
-    __Proxy(last_probed_ssid, string, string, string, last_probed_ssid);
+    __ProxyInterned(last_probed_ssid, last_probed_ssid);
     __Proxy(last_probed_ssid_csum, uint32_t, uint32_t, 
             uint32_t, last_probed_ssid_csum);
 
-    __Proxy(last_beaconed_ssid, string, string, string, last_beaconed_ssid);
+    __ProxyInterned(last_beaconed_ssid, last_beaconed_ssid);
     __Proxy(last_beaconed_ssid_csum, uint32_t, uint32_t, 
             uint32_t, last_beaconed_ssid_csum);
 
@@ -805,97 +932,19 @@ public:
 
     __Proxy(wpa_present_handshake, uint8_t, uint8_t, uint8_t, wpa_present_handshake);
 
-protected:
-    virtual void register_fields() {
-        RegisterField("dot11.device.typeset", TrackerUInt64,
-                "bitset of device type", &type_set);
-
-        RegisterField("dot11.device.client_map", TrackerMacMap,
-                "client behavior", &client_map);
-
-        shared_ptr<dot11_client> client_builder(new dot11_client(globalreg, 0));
-        client_map_entry_id =
-            RegisterComplexField("dot11.device.client", client_builder, "client record");
-
-        RegisterField("dot11.device.advertised_ssid_map", TrackerIntMap,
-                "advertised SSIDs", &advertised_ssid_map);
-
-        shared_ptr<dot11_advertised_ssid> adv_ssid_builder(new dot11_advertised_ssid(globalreg, 0));
-        advertised_ssid_map_entry_id =
-            RegisterComplexField("dot11.device.advertised_ssid",
-                    adv_ssid_builder, "advertised ssid");
-
-        RegisterField("dot11.device.probed_ssid_map", TrackerIntMap,
-                "probed SSIDs", &probed_ssid_map);
-
-        shared_ptr<dot11_probed_ssid> probe_ssid_builder(new dot11_probed_ssid(globalreg, 0));
-        probed_ssid_map_entry_id =
-            RegisterComplexField("dot11.device.probed_ssid",
-                    probe_ssid_builder, "probed ssid");
-
-        RegisterField("dot11.device.associated_client_map", TrackerMacMap,
-                "associated clients", &associated_client_map);
-
-        // Key of associated device, indexed by mac address
-        associated_client_map_entry_id =
-            RegisterField("dot11.device.associated_client", TrackerUInt64,
-                    "associated client");
-
-        RegisterField("dot11.device.client_disconnects", TrackerUInt64,
-                "client disconnects in last second", 
-                &client_disconnects);
-
-        RegisterField("dot11.device.last_sequence", TrackerUInt64,
-                "last sequence number", &last_sequence);
-
-        RegisterField("dot11.device.bss_timestamp", TrackerUInt64,
-                "last BSS timestamp", &bss_timestamp);
-
-        RegisterField("dot11.device.num_fragments", TrackerUInt64,
-                "number of fragmented packets", &num_fragments);
-        RegisterField("dot11.device.num_retries", TrackerUInt64,
-                "number of retried packets", &num_retries);
+    virtual void pre_serialize();
+    virtual void post_serialize();
 
-        RegisterField("dot11.device.datasize", TrackerUInt64,
-                "data in bytes", &datasize);
-
-        RegisterField("dot11.device.datasize_retry", TrackerUInt64,
-                "retried data in bytes", &datasize_retry);
-
-        RegisterField("dot11.device.last_probed_ssid", TrackerString,
-                "last probed ssid", &last_probed_ssid);
-
-        RegisterField("dot11.device.last_probed_ssid_csum", TrackerUInt32,
-                "last probed ssid checksum", &last_probed_ssid_csum);
-
-        RegisterField("dot11.device.last_beaconed_ssid", TrackerString,
-                "last beaconed ssid", &last_beaconed_ssid);
-
-        RegisterField("dot11.device.last_beaconed_ssid_checksum", TrackerUInt32,
-                "last beaconed ssid checksum", &last_beaconed_ssid_csum);
-
-        RegisterField("dot11.device.last_bssid", TrackerMac,
-                "last BSSID", &last_bssid);
-
-        RegisterField("dot11.device.last_beacon_timestamp", TrackerUInt64,
-                "unix timestamp of last beacon frame", 
-                &last_beacon_timestamp);
-
-        RegisterField("dot11.device.wps_m3_count", TrackerUInt64,
-                "WPS M3 message count", &wps_m3_count);
-        RegisterField("dot11.device.wps_m3_last", TrackerUInt64,
-                "WPS M3 last message", &wps_m3_last);
-
-        RegisterField("dot11.device.wpa_handshake_list", TrackerVector,
-                "WPA handshakes", &wpa_key_vec);
-
-        __RegisterComplexField(dot11_tracked_eapol, wpa_key_entry_id, 
-                "dot11.eapol.key", "WPA handshake key");
+protected:
+    virtual void reserve_fields(SharedTrackerElement e);
 
-        RegisterField("dot11.device.wpa_present_handshake", TrackerUInt8,
-                "handshake sequences seen (bitmask)", &wpa_present_handshake);
+    virtual void register_fields() {
+        register_table_fields(field_table);
     }
 
+    static const tracker_field_desc<dot11_tracked_device> field_desc[];
+    static tracker_field_table<dot11_tracked_device> field_table;
+
     SharedTrackerElement type_set;
 
     // Records of this device behaving as a client
@@ -914,6 +963,14 @@ protected:
     SharedTrackerElement associated_client_map;
     int associated_client_map_entry_id;
 
+    struct associated_client {
+        mac_addr mac;
+        uint64_t key;
+    };
+
+    // Sorted by mac
+    vector<associated_client> associated_clients;
+
     SharedTrackerElement client_disconnects;
     SharedTrackerElement last_sequence;
     SharedTrackerElement bss_timestamp;
@@ -1006,6 +1063,10 @@ public:
 	// 802.11 packet classifier to common for the devicetracker layer
 	static int CommonClassifierDot11(CHAINCALL_PARMS);
 
+    // Microseconds a frame of in_len bytes, without the FCS, took on the air at
+    // the rate in the layer1 record; 0 if the rate isn't known
+    static unsigned int FrameAirtime(kis_layer1_packinfo *in_l1, unsigned int in_len);
+
 	// Dot11 tracker for building phy-specific elements
 	int TrackerDot11(kis_packet *in_pack);
 
@@ -1036,6 +1097,8 @@ public:
 
     virtual int Httpd_PostComplete(Kis_Net_Httpd_Connection *concls);
 
+    virtual bool Httpd_StreamStructuredPost() { return true; }
+
     // Timetracker event handler
     virtual int timetracker_event(int eventid);
 
@@ -1056,6 +1119,20 @@ protected:
             dot11_packinfo *dot11info,
             kis_gps_packinfo *pack_gpsinfo);
 
+    class dot11_ephemeral_rec {
+    public:
+        dot11_ephemeral_rec() : first_time(0), last_time(0), packets(0) { }
+
+        time_t first_time, last_time;
+        uint64_t packets;
+    };
+
+    // Keep a probe request from a new randomized MAC as an ephemeral client
+    // instead of a device; returns true if it was kept.  When the client is
+    // promoted to a device, what it had is returned in ret_promoted.
+    bool HandleEphemeralClient(kis_packet *in_pack, dot11_packinfo *dot11info,
+            kis_common_info *commoninfo, dot11_ephemeral_rec *ret_promoted);
+
     void HandleClient(shared_ptr<kis_tracked_device_base> basedev, 
             shared_ptr<dot11_tracked_device> dot11dev,
             kis_packet *in_pack,
@@ -1071,7 +1148,6 @@ protected:
 
 	int LoadWepkeys();
 
-	map<mac_addr, string> bssid_cloak_map;
 
 	string ssid_cache_path, ip_cache_path;
 	int ssid_cache_track, ip_cache_track;
@@ -1083,7 +1159,7 @@ protected:
 	int pack_comp_80211, pack_comp_basicdata, pack_comp_mangleframe,
 		pack_comp_strings, pack_comp_checksum, pack_comp_linkframe,
 		pack_comp_decap, pack_comp_common, pack_comp_datapayload,
-        pack_comp_gps;
+        pack_comp_gps, pack_comp_l1info;
 
 	// Do we do any data dissection or do we hide it all (legal safety
 	// cutout)
@@ -1109,6 +1185,12 @@ protected:
 	// Generated WEP identity / base
 	unsigned char wep_identity[256];
 
+    // Key and keystream cache by BSSID, shared by the dissector threads;
+    // the generation changes every time a key is added
+    std::mutex wep_cache_mutex;
+    kis_u64_flat_map<dot11_wep_cache_slot> wep_cache;
+    std::atomic<unsigned int> wepkey_generation;
+
 	// Tracker alert references
 	int alert_chan_ref, alert_dhcpcon_ref, alert_bcastdcon_ref, alert_airjackssid_ref,
 		alert_wepflap_ref, alert_dhcpname_ref, alert_dhcpos_ref, alert_adhoc_ref,
@@ -1130,9 +1212,6 @@ protected:
 	ConfigFile *ssid_conf;
 	time_t conf_save;
 
-	// probe assoc to owning network
-	map<mac_addr, kis_tracked_device_base *> probe_assoc_map;
-
 	vector<dot11_ssid_alert *> apspoof_vec;
 
     // Do we time out components of devices?
@@ -1142,8 +1221,48 @@ protected:
     // Pcap handlers
     unique_ptr<Phy_80211_Httpd_Pcap> httpd_pcap;
 
+    // Best handshake of every BSSID and client
+    unique_ptr<Phy_80211_Handshake_Store> handshake_store;
+
     // Do we process control and phy frames?
     bool process_ctl_phy;
+
+    // Copy the tag fields of an unchanged beacon from the cache; returns false if
+    // the beacon has to be dissected
+    bool FetchCachedBeacon(kis_datachunk *chunk, dot11_packinfo *packinfo,
+            time_t in_ts);
+    // Remember the tag fields of a fully dissected beacon
+    void CacheBeacon(kis_datachunk *chunk, dot11_packinfo *packinfo,
+            uint64_t pre_cryptset, time_t in_ts);
+
+    // Beacon cache by BSSID, shared by the dissector threads
+    bool beacon_cache_enabled;
+
+    // Most SSIDs kept in the probe map of a device, 0 for no limit; the least
+    // recently probed is replaced
+    unsigned int probed_ssid_max;
+
+    int probed_ssid_count_id;
+    std::mutex beacon_cache_mutex;
+    class dot11_beacon_cache_slot {
+    public:
+        dot11_beacon_cache_slot() : last_time(0) { }
+
+        shared_ptr<dot11_beacon_cache_rec> rec;
+        time_t last_time;
+    };
+
+    kis_u64_flat_map<dot11_beacon_cache_slot> beacon_cache;
+
+    // Clients with randomized MACs which have only ever probed, by MAC, until
+    // they associate, send anything else, or keep probing for
+    // ephemeral_promote_sec
+    bool ephemeral_enabled;
+    unsigned int ephemeral_promote_sec;
+    unsigned int ephemeral_max;
+
+    std::mutex ephemeral_mutex;
+    kis_u64_flat_map<dot11_ephemeral_rec> ephemeral_clients;
 };
 
 #endif
@@ -87,62 +87,6 @@ const double mcs_table[][4] = {
 };
 const int MCS_MAX = 32;
 
-// CRC32 index for verifying WEP - cribbed from ethereal
-static const uint32_t dot11_wep_crc32_table[256] = {
-    0x00000000L, 0x77073096L, 0xee0e612cL, 0x990951baL, 0x076dc419L,
-    0x706af48fL, 0xe963a535L, 0x9e6495a3L, 0x0edb8832L, 0x79dcb8a4L,
-    0xe0d5e91eL, 0x97d2d988L, 0x09b64c2bL, 0x7eb17cbdL, 0xe7b82d07L,
-    0x90bf1d91L, 0x1db71064L, 0x6ab020f2L, 0xf3b97148L, 0x84be41deL,
-    0x1adad47dL, 0x6ddde4ebL, 0xf4d4b551L, 0x83d385c7L, 0x136c9856L,
-    0x646ba8c0L, 0xfd62f97aL, 0x8a65c9ecL, 0x14015c4fL, 0x63066cd9L,
-    0xfa0f3d63L, 0x8d080df5L, 0x3b6e20c8L, 0x4c69105eL, 0xd56041e4L,
-    0xa2677172L, 0x3c03e4d1L, 0x4b04d447L, 0xd20d85fdL, 0xa50ab56bL,
-    0x35b5a8faL, 0x42b2986cL, 0xdbbbc9d6L, 0xacbcf940L, 0x32d86ce3L,
-    0x45df5c75L, 0xdcd60dcfL, 0xabd13d59L, 0x26d930acL, 0x51de003aL,
-    0xc8d75180L, 0xbfd06116L, 0x21b4f4b5L, 0x56b3c423L, 0xcfba9599L,
-    0xb8bda50fL, 0x2802b89eL, 0x5f058808L, 0xc60cd9b2L, 0xb10be924L,
-    0x2f6f7c87L, 0x58684c11L, 0xc1611dabL, 0xb6662d3dL, 0x76dc4190L,
-    0x01db7106L, 0x98d220bcL, 0xefd5102aL, 0x71b18589L, 0x06b6b51fL,
-    0x9fbfe4a5L, 0xe8b8d433L, 0x7807c9a2L, 0x0f00f934L, 0x9609a88eL,
-    0xe10e9818L, 0x7f6a0dbbL, 0x086d3d2dL, 0x91646c97L, 0xe6635c01L,
-    0x6b6b51f4L, 0x1c6c6162L, 0x856530d8L, 0xf262004eL, 0x6c0695edL,
-    0x1b01a57bL, 0x8208f4c1L, 0xf50fc457L, 0x65b0d9c6L, 0x12b7e950L,
-    0x8bbeb8eaL, 0xfcb9887cL, 0x62dd1ddfL, 0x15da2d49L, 0x8cd37cf3L,
-    0xfbd44c65L, 0x4db26158L, 0x3ab551ceL, 0xa3bc0074L, 0xd4bb30e2L,
-    0x4adfa541L, 0x3dd895d7L, 0xa4d1c46dL, 0xd3d6f4fbL, 0x4369e96aL,
-    0x346ed9fcL, 0xad678846L, 0xda60b8d0L, 0x44042d73L, 0x33031de5L,
-    0xaa0a4c5fL, 0xdd0d7cc9L, 0x5005713cL, 0x270241aaL, 0xbe0b1010L,
-    0xc90c2086L, 0x5768b525L, 0x206f85b3L, 0xb966d409L, 0xce61e49fL,
-    0x5edef90eL, 0x29d9c998L, 0xb0d09822L, 0xc7d7a8b4L, 0x59b33d17L,
-    0x2eb40d81L, 0xb7bd5c3bL, 0xc0ba6cadL, 0xedb88320L, 0x9abfb3b6L,
-    0x03b6e20cL, 0x74b1d29aL, 0xead54739L, 0x9dd277afL, 0x04db2615L,
-    0x73dc1683L, 0xe3630b12L, 0x94643b84L, 0x0d6d6a3eL, 0x7a6a5aa8L,
-    0xe40ecf0bL, 0x9309ff9dL, 0x0a00ae27L, 0x7d079eb1L, 0xf00f9344L,
-    0x8708a3d2L, 0x1e01f268L, 0x6906c2feL, 0xf762575dL, 0x806567cbL,
-    0x196c3671L, 0x6e6b06e7L, 0xfed41b76L, 0x89d32be0L, 0x10da7a5aL,
-    0x67dd4accL, 0xf9b9df6fL, 0x8ebeeff9L, 0x17b7be43L, 0x60b08ed5L,
-    0xd6d6a3e8L, 0xa1d1937eL, 0x38d8c2c4L, 0x4fdff252L, 0xd1bb67f1L,
-    0xa6bc5767L, 0x3fb506ddL, 0x48b2364bL, 0xd80d2bdaL, 0xaf0a1b4cL,
-    0x36034af6L, 0x41047a60L, 0xdf60efc3L, 0xa867df55L, 0x316e8eefL,
-    0x4669be79L, 0xcb61b38cL, 0xbc66831aL, 0x256fd2a0L, 0x5268e236L,
-    0xcc0c7795L, 0xbb0b4703L, 0x220216b9L, 0x5505262fL, 0xc5ba3bbeL,
-    0xb2bd0b28L, 0x2bb45a92L, 0x5cb36a04L, 0xc2d7ffa7L, 0xb5d0cf31L,
-    0x2cd99e8bL, 0x5bdeae1dL, 0x9b64c2b0L, 0xec63f226L, 0x756aa39cL,
-    0x026d930aL, 0x9c0906a9L, 0xeb0e363fL, 0x72076785L, 0x05005713L,
-    0x95bf4a82L, 0xe2b87a14L, 0x7bb12baeL, 0x0cb61b38L, 0x92d28e9bL,
-    0xe5d5be0dL, 0x7cdcefb7L, 0x0bdbdf21L, 0x86d3d2d4L, 0xf1d4e242L,
-    0x68ddb3f8L, 0x1fda836eL, 0x81be16cdL, 0xf6b9265bL, 0x6fb077e1L,
-    0x18b74777L, 0x88085ae6L, 0xff0f6a70L, 0x66063bcaL, 0x11010b5cL,
-    0x8f659effL, 0xf862ae69L, 0x616bffd3L, 0x166ccf45L, 0xa00ae278L,
-    0xd70dd2eeL, 0x4e048354L, 0x3903b3c2L, 0xa7672661L, 0xd06016f7L,
-    0x4969474dL, 0x3e6e77dbL, 0xaed16a4aL, 0xd9d65adcL, 0x40df0b66L,
-    0x37d83bf0L, 0xa9bcae53L, 0xdebb9ec5L, 0x47b2cf7fL, 0x30b5ffe9L,
-    0xbdbdf21cL, 0xcabac28aL, 0x53b39330L, 0x24b4a3a6L, 0xbad03605L,
-    0xcdd70693L, 0x54de5729L, 0x23d967bfL, 0xb3667a2eL, 0xc4614ab8L,
-    0x5d681b02L, 0x2a6f2b94L, 0xb40bbe37L, 0xc30c8ea1L, 0x5a05df1bL,
-    0x2d02ef8dL
-};
-
 // Convert WPA cipher elements into crypt_set stuff
 int Kis_80211_Phy::WPACipherConv(uint8_t cipher_index) {
     int ret = crypt_wpa;
@@ -190,6 +134,151 @@ int Kis_80211_Phy::WPAKeyMgtConv(uint8_t mgt_index) {
     return ret;
 }
 
+// Hand the capabilities and tags of a beacon to fn as a series of byte ranges,
+// leaving out the TIM.  A tag which claims to run past the end of the frame ends
+// the walk, and the rest of the frame is passed as one range.
+template<typename F>
+static bool dot11_beacon_ranges(kis_datachunk *chunk, F fn) {
+    unsigned int start = 34;
+    unsigned int pos = 36;
+
+    while (pos + 2 <= chunk->length) {
+        unsigned int next = pos + 2 + chunk->data[pos + 1];
+
+        if (next > chunk->length)
+            break;
+
+        if (chunk->data[pos] == 5) {
+            if (!fn(chunk->data + start, pos - start))
+                return false;
+            start = next;
+        }
+
+        pos = next;
+    }
+
+    return fn(chunk->data + start, chunk->length - start);
+}
+
+bool Kis_80211_Phy::FetchCachedBeacon(kis_datachunk *chunk, dot11_packinfo *packinfo,
+        time_t in_ts) {
+    if (!beacon_cache_enabled)
+        return false;
+
+    shared_ptr<dot11_beacon_cache_rec> rec;
+
+    {
+        std::lock_guard<std::mutex> lock(beacon_cache_mutex);
+
+        dot11_beacon_cache_slot *slot =
+            beacon_cache.find(packinfo->bssid_mac.GetAsLong() & 0xFFFFFFFFFFFFULL);
+
+        if (slot == NULL)
+            return false;
+
+        rec = slot->rec;
+        slot->last_time = in_ts;
+    }
+
+    if (rec->pre_cryptset != packinfo->cryptset)
+        return false;
+
+    // Compare in place, so a beacon which matches doesn't copy anything
+    size_t cpos = 0;
+
+    bool match = dot11_beacon_ranges(chunk,
+            [&](const uint8_t *data, unsigned int len) -> bool {
+                if (cpos + len > rec->tags.length() ||
+                        memcmp(rec->tags.data() + cpos, data, len) != 0)
+                    return false;
+
+                cpos += len;
+                return true;
+            });
+
+    if (!match || cpos != rec->tags.length())
+        return false;
+
+    packinfo->ssid = rec->ssid;
+    packinfo->ssid_len = rec->ssid_len;
+    packinfo->ssid_blank = rec->ssid_blank;
+    packinfo->ssid_csum = rec->ssid_csum;
+    packinfo->ietag_csum = rec->ietag_csum;
+    packinfo->beacon_info = rec->beacon_info;
+    packinfo->maxrate = rec->maxrate;
+    packinfo->channel = rec->channel;
+    packinfo->cryptset = rec->cryptset;
+    packinfo->dot11d_country = rec->dot11d_country;
+    packinfo->dot11d_vec = rec->dot11d_vec;
+    packinfo->wps = rec->wps;
+    packinfo->wps_manuf = rec->wps_manuf;
+    packinfo->wps_device_name = rec->wps_device_name;
+    packinfo->wps_model_name = rec->wps_model_name;
+    packinfo->wps_model_number = rec->wps_model_number;
+
+    return true;
+}
+
+void Kis_80211_Phy::CacheBeacon(kis_datachunk *chunk, dot11_packinfo *packinfo,
+        uint64_t pre_cryptset, time_t in_ts) {
+    if (!beacon_cache_enabled)
+        return;
+
+    shared_ptr<dot11_beacon_cache_rec> rec(new dot11_beacon_cache_rec());
+
+    rec->pre_cryptset = pre_cryptset;
+
+    dot11_beacon_ranges(chunk,
+            [&](const uint8_t *data, unsigned int len) -> bool {
+                rec->tags.append((const char *) data, len);
+                return true;
+            });
+
+    rec->ssid = packinfo->ssid;
+    rec->ssid_len = packinfo->ssid_len;
+    rec->ssid_blank = packinfo->ssid_blank;
+    rec->ssid_csum = packinfo->ssid_csum;
+    rec->ietag_csum = packinfo->ietag_csum;
+    rec->beacon_info = packinfo->beacon_info;
+    rec->maxrate = packinfo->maxrate;
+    rec->channel = packinfo->channel;
+    rec->cryptset = packinfo->cryptset;
+    rec->dot11d_country = packinfo->dot11d_country;
+    rec->dot11d_vec = packinfo->dot11d_vec;
+    rec->wps = packinfo->wps;
+    rec->wps_manuf = packinfo->wps_manuf;
+    rec->wps_device_name = packinfo->wps_device_name;
+    rec->wps_model_name = packinfo->wps_model_name;
+    rec->wps_model_number = packinfo->wps_model_number;
+
+    uint64_t key = packinfo->bssid_mac.GetAsLong() & 0xFFFFFFFFFFFFULL;
+
+    std::lock_guard<std::mutex> lock(beacon_cache_mutex);
+
+    // Anything spraying beacons from random BSSIDs could otherwise grow this
+    // without limit; when it's full, drop the BSSIDs we haven't heard from in a
+    // while, and if that isn't enough, start over
+    if (beacon_cache.size() >= DOT11_BEACON_CACHE_MAX &&
+            beacon_cache.find(key) == NULL) {
+        vector<uint64_t> stale;
+
+        beacon_cache.for_each([&](uint64_t k, dot11_beacon_cache_slot& s) {
+                if (s.last_time + DOT11_BEACON_CACHE_AGE < in_ts)
+                    stale.push_back(k);
+                });
+
+        for (auto k : stale)
+            beacon_cache.erase(k);
+
+        if (beacon_cache.size() >= DOT11_BEACON_CACHE_MAX)
+            beacon_cache.clear();
+    }
+
+    dot11_beacon_cache_slot& slot = beacon_cache[key];
+    slot.rec = rec;
+    slot.last_time = in_ts;
+}
+
 // This needs to be optimized and it needs to not use casting to do its magic
 int Kis_80211_Phy::PacketDot11dissector(kis_packet *in_pack) {
     static int debugpcknum = 0;
@@ -629,10 +718,17 @@ int Kis_80211_Phy::PacketDot11dissector(kis_packet *in_pack) {
                        "driver attack");
         }
 
-        map<int, vector<int> > tag_cache_map;
-        map<int, vector<int> >::iterator tcitr;
+        kis_tag_index tag_index;
+
+        // Crypt flags from the header and capabilities, before any tags add to them
+        uint64_t pre_cryptset = packinfo->cryptset;
 
-        if (fc->subtype == packet_sub_beacon || 
+        if (fc->subtype == packet_sub_beacon &&
+                FetchCachedBeacon(chunk, packinfo, in_pack->ts.tv_sec)) {
+            // Same tags as the last beacon from this BSSID, which already filled
+            // in everything from them
+            packinfo->beacon_interval = kis_letoh16(fixparm->beacon);
+        } else if (fc->subtype == packet_sub_beacon || 
             fc->subtype == packet_sub_probe_req || 
             fc->subtype == packet_sub_probe_resp ||
             fc->subtype == packet_sub_association_resp) {
@@ -646,8 +742,7 @@ int Kis_80211_Phy::PacketDot11dissector(kis_packet *in_pack) {
 
             // This is guaranteed to only give us tags that fit within the packets,
             // so we don't have to do more error checking
-            if (GetLengthTagOffsets(packinfo->header_offset, chunk, 
-                                    &tag_cache_map) < 0) {
+            if (tag_index.Index(packinfo->header_offset, chunk) < 0) {
                 // The frame is corrupt, bail.  This is a good indication that it's
                 // corrupt but snuck past the FCS check, so we set the whole packet
                 // as a failure condition
@@ -658,8 +753,8 @@ int Kis_80211_Phy::PacketDot11dissector(kis_packet *in_pack) {
                 return 0;
             }
      
-            if ((tcitr = tag_cache_map.find(0)) != tag_cache_map.end()) {
-                tag_offset = tcitr->second[0];
+            if (tag_index.has(0)) {
+                tag_offset = tag_index.offset(0);
 
                 taglen = (chunk->data[tag_offset] & 0xFF);
                 packinfo->ssid_len = taglen;
@@ -706,8 +801,8 @@ int Kis_80211_Phy::PacketDot11dissector(kis_packet *in_pack) {
             }
 
             // Extract the CISCO beacon info
-            if ((tcitr = tag_cache_map.find(133)) != tag_cache_map.end()) {
-                tag_offset = tcitr->second[0];
+            if (tag_index.has(133)) {
+                tag_offset = tag_index.offset(133);
                 taglen = (chunk->data[tag_offset] & 0xFF);
 
                 // Copy and munge the beacon info if it falls w/in our
@@ -722,8 +817,8 @@ int Kis_80211_Phy::PacketDot11dissector(kis_packet *in_pack) {
             }
 
             // Extract the supported rates
-            if ((tcitr = tag_cache_map.find(1)) != tag_cache_map.end()) {
-                tag_offset = tcitr->second[0];
+            if (tag_index.has(1)) {
+                tag_offset = tag_index.offset(1);
                 taglen = (chunk->data[tag_offset] & 0xFF);
 
                 if (tag_offset + taglen > chunk->length) {
@@ -734,9 +829,10 @@ int Kis_80211_Phy::PacketDot11dissector(kis_packet *in_pack) {
                     return 0;
                 }
 
-                for (unsigned int t = 0; t < tcitr->second.size(); t++) {
-                    int moffset = tcitr->second[t];
+                unsigned int moffset;
 
+                for (unsigned int t = 0; 
+                        (moffset = tag_index.offset(1, t)) != 0; t++) {
                     if ((chunk->data[moffset] & 0xFF) == 75 &&
                         memcmp(&(chunk->data[moffset + 1]), "\xEB\x49", 2) == 0) {
 
@@ -760,8 +856,8 @@ int Kis_80211_Phy::PacketDot11dissector(kis_packet *in_pack) {
             }
 
             // And the extended supported rates
-            if ((tcitr = tag_cache_map.find(50)) != tag_cache_map.end()) {
-                tag_offset = tcitr->second[0];
+            if (tag_index.has(50)) {
+                tag_offset = tag_index.offset(50);
                 taglen = (chunk->data[tag_offset] & 0xFF);
 
                 if (tag_offset + taglen > chunk->length) {
@@ -789,8 +885,8 @@ int Kis_80211_Phy::PacketDot11dissector(kis_packet *in_pack) {
             */
 
             // Match HT 802.11n tag
-            if ((tcitr = tag_cache_map.find(45)) != tag_cache_map.end()) {
-                tag_offset = tcitr->second[0];
+            if (tag_index.has(45)) {
+                tag_offset = tag_index.offset(45);
                 // GetTagOffset returns us on the size byte
                 taglen = (chunk->data[tag_offset] & 0xFF);
                 if (tag_offset + taglen > chunk->length || taglen < 7) {
@@ -865,8 +961,8 @@ int Kis_80211_Phy::PacketDot11dissector(kis_packet *in_pack) {
             // Find the offset of flag 3 and get the channel.   802.11a doesn't have 
             // this tag so we use the hardware channel, assigned at the beginning of 
             // GetPacketInfo
-            if ((tcitr = tag_cache_map.find(3)) != tag_cache_map.end()) {
-                tag_offset = tcitr->second[0];
+            if (tag_index.has(3)) {
+                tag_offset = tag_index.offset(3);
                 // Extract the channel from the next byte (GetTagOffset returns
                 // us on the size byte)
                 taglen = (chunk->data[tag_offset] & 0xFF);
@@ -886,8 +982,8 @@ int Kis_80211_Phy::PacketDot11dissector(kis_packet *in_pack) {
             // Find the offset of flag 3 and get the channel.   802.11a doesn't have 
             // this tag so we use the hardware channel, assigned at the beginning of 
             // GetPacketInfo
-            if ((tcitr = tag_cache_map.find(3)) != tag_cache_map.end()) {
-                tag_offset = tcitr->second[0];
+            if (tag_index.has(3)) {
+                tag_offset = tag_index.offset(3);
                 // Extract the channel from the next byte (GetTagOffset returns
                 // us on the size byte)
                 taglen = (chunk->data[tag_offset] & 0xFF);
@@ -903,10 +999,10 @@ int Kis_80211_Phy::PacketDot11dissector(kis_packet *in_pack) {
             } // channel
 
             // Match sub-tags inside 221
-            if ((tcitr = tag_cache_map.find(221)) != tag_cache_map.end()) {
+            if (tag_index.has(221)) {
                 // For every copy of the 221 tag
-                for (unsigned int tagct = 0; tagct < tcitr->second.size(); tagct++) {
-                    tag_offset = tcitr->second[tagct];
+                for (unsigned int tagct = 0; 
+                        (tag_offset = tag_index.offset(221, tagct)) != 0; tagct++) {
                     unsigned int tag_orig = tag_offset + 1;
                     unsigned int taglen = (chunk->data[tag_offset] & 0xFF);
                     unsigned int offt = 0;
@@ -919,18 +1015,13 @@ int Kis_80211_Phy::PacketDot11dissector(kis_packet *in_pack) {
                     }
 
                     // Look for WMM/WME tags
-                    // Make an in-memory zero-copy stream instance to the packet contents after
-                    // the SNAP/LLC header
-                    membuf tag_221_membuf((char *) &(chunk->data[tag_offset]), 
-                            (char *) &(chunk->data[chunk->length]));
-                    std::istream eapol_stream(&tag_221_membuf);
-
                     try {
-                        // Make a kaitai parser and parse with our wpaeap handler
-                        kaitai::kstream ks(&eapol_stream);
+                        // Parse the tag in place with the kaitai ie221 parser
+                        kaitai::kstream ks((const char *) &(chunk->data[tag_offset]),
+                                chunk->length - tag_offset);
                         ie221_t ie221(&ks);
 
-                        if (ie221.vendor_oui() == string("\x00\x50\xf2", 3)) {
+                        if (ie221.vendor_oui() == kaitai::kbytes("\x00\x50\xf2", 3)) {
                             if (packinfo->subtype == packet_sub_association_resp &&
                                     ie221.vendor_type() == 2) {
                                 if (taglen != 24) {
@@ -1066,8 +1157,8 @@ int Kis_80211_Phy::PacketDot11dissector(kis_packet *in_pack) {
 
 
             // Parse 802.11d tags
-            if ((tcitr = tag_cache_map.find(7)) != tag_cache_map.end()) {
-                tag_offset = tcitr->second[0];
+            if (tag_index.has(7)) {
+                tag_offset = tag_index.offset(7);
 
                 taglen = (chunk->data[tag_offset] & 0xFF);
 
@@ -1104,10 +1195,9 @@ int Kis_80211_Phy::PacketDot11dissector(kis_packet *in_pack) {
             // WPA frame matching if we have the privacy bit set
             if ((packinfo->cryptset & crypt_wep)) {
                 // Liberally borrowed from Ethereal
-                if ((tcitr = tag_cache_map.find(221)) != tag_cache_map.end()) {
-                    for (unsigned int tagct = 0; tagct < tcitr->second.size(); 
-                         tagct++) {
-                        tag_offset = tcitr->second[tagct];
+                if (tag_index.has(221)) {
+                    for (unsigned int tagct = 0; 
+                            (tag_offset = tag_index.offset(221, tagct)) != 0; tagct++) {
                         unsigned int tag_orig = tag_offset + 1;
                         unsigned int taglen = (chunk->data[tag_offset] & 0xFF);
                         unsigned int offt = 0;
@@ -1180,10 +1270,9 @@ int Kis_80211_Phy::PacketDot11dissector(kis_packet *in_pack) {
                 } /* 221 */
 
                 // Match tag 48 RSN WPA2
-                if ((tcitr = tag_cache_map.find(48)) != tag_cache_map.end()) {
-                    for (unsigned int tagct = 0; tagct < tcitr->second.size(); 
-                         tagct++) {
-                        tag_offset = tcitr->second[tagct];
+                if (tag_index.has(48)) {
+                    for (unsigned int tagct = 0; 
+                            (tag_offset = tag_index.offset(48, tagct)) != 0; tagct++) {
                         unsigned int tag_orig = tag_offset + 1;
                         unsigned int taglen = (chunk->data[tag_offset] & 0xFF);
                         unsigned int offt = 0;
@@ -1246,6 +1335,9 @@ int Kis_80211_Phy::PacketDot11dissector(kis_packet *in_pack) {
                 } /* 48 */
             } /* protected frame */
 
+            if (fc->subtype == packet_sub_beacon && !packinfo->corrupt)
+                CacheBeacon(chunk, packinfo, pre_cryptset, in_pack->ts.tv_sec);
+
         } else if (fc->subtype == packet_sub_deauthentication) {
             if ((packinfo->mgt_reason_code >= 25 && packinfo->mgt_reason_code <= 31) ||
                 packinfo->mgt_reason_code > 45) {
@@ -1606,122 +1698,75 @@ eap_end:
     return 1;
 }
 
-kis_datachunk *Kis_80211_Phy::DecryptWEP(dot11_packinfo *in_packinfo,
-                                               kis_datachunk *in_chunk,
-                                               unsigned char *in_key, int in_key_len,
-                                               unsigned char *in_id) {
-    kis_datachunk *manglechunk = NULL;
-
-    // printf("debug - decryptwep\n");
-    if (in_packinfo->corrupt)
-        return NULL;
-
-    // printf("debug - decryptwep dlt %u want %u\n", in_chunk->dlt, KDLT_IEEE802_11);
-    // If we don't have a dot11 frame, throw it away
-    if (in_chunk->dlt != KDLT_IEEE802_11)
-        return NULL;
-
-    // printf("debug - decryptwep size len %u offt %u\n", in_chunk->length, in_packinfo->header_offset);
-    // Bail on size check
-    if (in_chunk->length < in_packinfo->header_offset ||
-        in_chunk->length - in_packinfo->header_offset <= 8)
-        return NULL;
-
-    // printf("debug - decryptwep data header offt %u test head %02x %02x %02x %02x offt %02x %02x %02x %02x\n", in_packinfo->header_offset, in_chunk->data[0], in_chunk->data[1], in_chunk->data[2], in_chunk->data[3], in_chunk->data[in_packinfo->header_offset], in_chunk->data[in_packinfo->header_offset+1], in_chunk->data[in_packinfo->header_offset+2], in_chunk->data[in_packinfo->header_offset+3]);
-
-    // printf("debug - password\n");
-    // Password field
-    char pwd[WEPKEY_MAX + 3];
-    memset(pwd, 0, WEPKEY_MAX + 3);
-
-    // Extract the IV and add it to the key
-    pwd[0] = in_chunk->data[in_packinfo->header_offset + 0] & 0xFF;
-    pwd[1] = in_chunk->data[in_packinfo->header_offset + 1] & 0xFF;
-    pwd[2] = in_chunk->data[in_packinfo->header_offset + 2] & 0xFF;
+// RC4 keystream for a WEP frame: key setup from the IV and key, starting from
+// the identity permutation in_id, then in_len bytes of output
+static void dot11_wep_keystream(const uint8_t *in_iv, const uint8_t *in_key,
+        unsigned int in_key_len, const unsigned char *in_id, uint8_t *out,
+        size_t in_len) {
+    uint8_t pwd[WEPKEY_MAX + 3];
+
+    // The IV followed by the key
+    pwd[0] = in_iv[0];
+    pwd[1] = in_iv[1];
+    pwd[2] = in_iv[2];
+    memcpy(pwd + 3, in_key, in_key_len);
+    unsigned int pwdlen = 3 + in_key_len;
+
+    uint8_t keyblock[256];
+    memcpy(keyblock, in_id, 256);
 
-    // Add the supplied password to the key
-    memcpy(pwd + 3, in_key, WEPKEY_MAX);
-    int pwdlen = 3 + in_key_len;
+    unsigned int kba, kbb = 0, kbp = 0;
+    for (kba = 0; kba < 256; kba++) {
+        kbb = (kbb + keyblock[kba] + pwd[kbp]) & 0xFF;
 
-    // printf("debug - wep stuff\n");
+        if (++kbp == pwdlen)
+            kbp = 0;
 
-    // Prepare the keyblock for the rc4 cipher
-    unsigned char keyblock[256];
-    memcpy(keyblock, in_id, 256);
-    int kba = 0, kbb = 0;
-    for (kba = 0; kba < 256; kba++) {
-        kbb = (kbb + keyblock[kba] + pwd[kba % pwdlen]) & 0xFF;
-        unsigned char oldkey = keyblock[kba];
+        uint8_t oldkey = keyblock[kba];
         keyblock[kba] = keyblock[kbb];
         keyblock[kbb] = oldkey;
     }
 
-    // Allocate the mangled chunk -- 4 byte IV/Key# gone, 4 byte ICV gone
-    manglechunk = new kis_datachunk;
-    manglechunk->dlt = KDLT_IEEE802_11;
-
-#if 0
-    manglechunk->length = in_chunk->length - 8;
-    manglechunk->data = new uint8_t[manglechunk->length];
-
-    // Copy the packet headers to the new chunk
-    memcpy(manglechunk->data, in_chunk->data, in_packinfo->header_offset);
-#endif
-    
-    // Copy because we're modifying
-    manglechunk->set_data(in_chunk->data, in_chunk->length - 8, true);
-
-    // Decrypt the data payload and check the CRC
     kba = kbb = 0;
-    uint32_t crc = ~0;
-    uint8_t c_crc[4];
-    uint8_t icv[4];
-
-    // Copy the ICV into the CRC buffer for checking
-    memcpy(icv, &(in_chunk->data[in_chunk->length - 4]), 4);
-    // printf("debug - icv %02x %02x %02x %02x\n", icv[0], icv[1], icv[2], icv[3]);
-
-    for (unsigned int dpos = in_packinfo->header_offset + 4; 
-         dpos < in_chunk->length - 4; dpos++) {
+    for (size_t x = 0; x < in_len; x++) {
         kba = (kba + 1) & 0xFF;
         kbb = (kbb + keyblock[kba]) & 0xFF;
 
-        unsigned char oldkey = keyblock[kba];
+        uint8_t oldkey = keyblock[kba];
         keyblock[kba] = keyblock[kbb];
         keyblock[kbb] = oldkey;
 
-        // Decode the packet into the mangle chunk
-        manglechunk->data[dpos - 4] = 
-            in_chunk->data[dpos] ^ keyblock[(keyblock[kba] + keyblock[kbb]) & 0xFF];
-
-        crc = dot11_wep_crc32_table[(crc ^ manglechunk->data[dpos - 4]) & 0xFF] ^ (crc >> 8);
+        out[x] = keyblock[(keyblock[kba] + keyblock[kbb]) & 0xFF];
     }
+}
 
-    // Check the CRC
-    crc = ~crc;
-    c_crc[0] = crc;
-    c_crc[1] = crc >> 8;
-    c_crc[2] = crc >> 16;
-    c_crc[3] = crc >> 24;
+// Decrypt a WEP frame with the keystream for its IV, which has to cover the
+// payload and ICV, and check the ICV
+static kis_datachunk *dot11_wep_decrypt(dot11_packinfo *in_packinfo,
+        kis_datachunk *in_chunk, const uint8_t *in_keystream) {
+    unsigned int payload_len = in_chunk->length - in_packinfo->header_offset - 8;
+    const uint8_t *crypt = in_chunk->data + in_packinfo->header_offset + 4;
 
-    int crcfailure = 0;
-    for (unsigned int crcpos = 0; crcpos < 4; crcpos++) {
-        kba = (kba + 1) & 0xFF;
-        kbb = (kbb + keyblock[kba]) & 0xFF;
+    // Allocate the mangled chunk -- 4 byte IV/Key# gone, 4 byte ICV gone;
+    // copy because we're modifying
+    kis_datachunk *manglechunk = new kis_datachunk;
+    manglechunk->dlt = KDLT_IEEE802_11;
+    manglechunk->set_data(in_chunk->data, in_chunk->length - 8, true);
 
-        unsigned char oldkey = keyblock[kba];
-        keyblock[kba] = keyblock[kbb];
-        keyblock[kbb] = oldkey;
+    uint8_t *plain = manglechunk->data + in_packinfo->header_offset;
 
-        if ((c_crc[crcpos] ^ keyblock[(keyblock[kba] + 
-                                       keyblock[kbb]) & 0xFF]) != icv[crcpos]) {
-            crcfailure = 1;
-            break;
-        }
-    }
+    for (unsigned int x = 0; x < payload_len; x++)
+        plain[x] = crypt[x] ^ in_keystream[x];
+
+    // The ICV is the little-endian CRC32 of the plaintext
+    uint32_t crc = crc32_le_80211(NULL, plain, payload_len);
+    const uint8_t *icv = crypt + payload_len;
+    const uint8_t *icv_ks = in_keystream + payload_len;
 
-    // If the CRC check failed, delete the moddata
-    if (crcfailure) {
+    if ((uint8_t) (icv[0] ^ icv_ks[0]) != (uint8_t) crc ||
+            (uint8_t) (icv[1] ^ icv_ks[1]) != (uint8_t) (crc >> 8) ||
+            (uint8_t) (icv[2] ^ icv_ks[2]) != (uint8_t) (crc >> 16) ||
+            (uint8_t) (icv[3] ^ icv_ks[3]) != (uint8_t) (crc >> 24)) {
         delete manglechunk;
         return NULL;
     }
@@ -1733,6 +1778,34 @@ kis_datachunk *Kis_80211_Phy::DecryptWEP(dot11_packinfo *in_packinfo,
     return manglechunk;
 }
 
+kis_datachunk *Kis_80211_Phy::DecryptWEP(dot11_packinfo *in_packinfo,
+                                               kis_datachunk *in_chunk,
+                                               unsigned char *in_key, int in_key_len,
+                                               unsigned char *in_id) {
+    if (in_packinfo->corrupt)
+        return NULL;
+
+    // If we don't have a dot11 frame, throw it away
+    if (in_chunk->dlt != KDLT_IEEE802_11)
+        return NULL;
+
+    // Bail on size check
+    if (in_chunk->length < in_packinfo->header_offset ||
+        in_chunk->length - in_packinfo->header_offset <= 8)
+        return NULL;
+
+    if (in_key_len < 0 || in_key_len > WEPKEY_MAX)
+        return NULL;
+
+    size_t ks_len = in_chunk->length - in_packinfo->header_offset - 4;
+    vector<uint8_t> keystream(ks_len);
+
+    dot11_wep_keystream(in_chunk->data + in_packinfo->header_offset, in_key,
+            in_key_len, in_id, keystream.data(), ks_len);
+
+    return dot11_wep_decrypt(in_packinfo, in_chunk, keystream.data());
+}
+
 int Kis_80211_Phy::PacketWepDecryptor(kis_packet *in_pack) {
     kis_datachunk *manglechunk = NULL;
 
@@ -1770,20 +1843,85 @@ int Kis_80211_Phy::PacketWepDecryptor(kis_packet *in_pack) {
     if (chunk->dlt != KDLT_IEEE802_11)
         return 0;
 
-    // Bail if we can't find a key match
-    macmap<dot11_wep_key *>::iterator bwmitr = wepkeys.find(packinfo->bssid_mac);
-    if (bwmitr == wepkeys.end())
+    // Bail if we can't find a key match; most of the time there are no keys
+    // at all, and there's no need to look
+    if (wepkeys.size() == 0)
         return 0;
 
-    manglechunk = DecryptWEP(packinfo, chunk, (*bwmitr->second)->key,
-                             (*bwmitr->second)->len, wep_identity);
+    // Too short to hold an IV, any data, and an ICV
+    if (chunk->length < packinfo->header_offset ||
+        chunk->length - packinfo->header_offset <= 8)
+        return 0;
+
+    uint64_t bssid_key = packinfo->bssid_mac.GetAsLong() & 0xFFFFFFFFFFFFULL;
+    const uint8_t *ivp = chunk->data + packinfo->header_offset;
+    uint32_t iv = (ivp[0] << 16) | (ivp[1] << 8) | ivp[2];
+    size_t ks_len = chunk->length - packinfo->header_offset - 4;
+
+    static thread_local vector<uint8_t> keystream;
+    dot11_wep_key *key;
+    bool cached_keystream = false;
+
+    {
+        std::lock_guard<std::mutex> lock(wep_cache_mutex);
+
+        // Anything spraying encrypted frames from random BSSIDs could otherwise
+        // grow this without limit
+        if (wep_cache.size() >= DOT11_WEP_CACHE_MAX && wep_cache.find(bssid_key) == NULL)
+            wep_cache.clear();
+
+        dot11_wep_cache_slot& slot = wep_cache[bssid_key];
+        unsigned int generation = wepkey_generation;
+
+        if (slot.generation != generation) {
+            macmap<dot11_wep_key *>::iterator bwmitr = wepkeys.find(packinfo->bssid_mac);
+
+            if (bwmitr == wepkeys.end())
+                slot.key = NULL;
+            else
+                slot.key = *(bwmitr->second);
+
+            slot.generation = generation;
+            slot.iv_valid = false;
+            slot.keystream.clear();
+        }
+
+        key = slot.key;
+
+        if (key == NULL)
+            return 0;
+
+        // Same IV as the last frame, so the same keystream
+        if (slot.iv_valid && slot.iv == iv && slot.keystream.size() >= ks_len) {
+            keystream.assign(slot.keystream.begin(), slot.keystream.begin() + ks_len);
+            cached_keystream = true;
+        }
+    }
+
+    if (!cached_keystream) {
+        keystream.resize(ks_len);
+        dot11_wep_keystream(ivp, key->key, key->len, wep_identity, keystream.data(),
+                ks_len);
+
+        std::lock_guard<std::mutex> lock(wep_cache_mutex);
+
+        dot11_wep_cache_slot *slot = wep_cache.find(bssid_key);
+
+        if (slot != NULL && slot->key == key) {
+            slot->iv = iv;
+            slot->iv_valid = true;
+            slot->keystream = keystream;
+        }
+    }
+
+    manglechunk = dot11_wep_decrypt(packinfo, chunk, keystream.data());
 
     if (manglechunk == NULL) {
-        (*bwmitr->second)->failed++;
+        key->failed++;
         return 0;
     }
 
-    (*bwmitr->second)->decrypted++;
+    key->decrypted++;
     // printf("debug - flagging packet as decrypted\n");
     packinfo->decrypted = 1;
 
@@ -1861,15 +1999,15 @@ int Kis_80211_Phy::PacketDot11WPSM3(kis_packet *in_pack) {
 
     pos += sizeof(eapol_llc);
 
-    // Make an in-memory zero-copy stream instance to the packet contents after
-    // the SNAP/LLC header
-    membuf eapol_membuf((char *) &(chunk->data[pos]), 
-            (char *) &(chunk->data[chunk->length]));
-    std::istream eapol_stream(&eapol_membuf);
+    // Everything the parser allocates comes from this arena and is released
+    // with it when we return
+    kaitai::arena eapol_arena;
+    kaitai::arena_scope eapol_arena_scope(&eapol_arena);
 
     try {
-        // Make a kaitai parser and parse with our wpaeap handler
-        kaitai::kstream ks(&eapol_stream);
+        // Make a kaitai parser reading the packet contents after the SNAP/LLC
+        // header in place, and parse with our wpaeap handler
+        kaitai::kstream ks((const char *) &(chunk->data[pos]), chunk->length - pos);
         wpaeap_t eap(&ks);
 
         // We only care about EAPOL packets for WPS decoding
@@ -1979,15 +2117,15 @@ shared_ptr<dot11_tracked_eapol>
 
     pos += sizeof(eapol_llc);
 
-    // Make an in-memory zero-copy stream instance to the packet contents after
-    // the SNAP/LLC header
-    membuf eapol_membuf((char *) &(chunk->data[pos]), 
-            (char *) &(chunk->data[chunk->length]));
-    std::istream eapol_stream(&eapol_membuf);
+    // Everything the parser allocates comes from this arena and is released
+    // with it when we return
+    kaitai::arena eapol_arena;
+    kaitai::arena_scope eapol_arena_scope(&eapol_arena);
 
     try {
-        // Make a kaitai parser and parse with our wpaeap handler
-        kaitai::kstream ks(&eapol_stream);
+        // Make a kaitai parser reading the packet contents after the SNAP/LLC
+        // header in place, and parse with our wpaeap handler
+        kaitai::kstream ks((const char *) &(chunk->data[pos]), chunk->length - pos);
         wpaeap_t eap(&ks);
 
         // We only care about RSN keys
@@ -0,0 +1,271 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <string.h>
+
+#include "util.h"
+#include "configfile.h"
+#include "phy_80211_handshakes.h"
+#include "pcapng_stream_ringbuf.h"
+#include "kis_datasource.h"
+#include "kis_flat_hash.h"
+
+unsigned int Phy_80211_Handshake_Store::handshake_set::count() const {
+    return ((mask >> 0) & 1) + ((mask >> 1) & 1) + ((mask >> 2) & 1) + ((mask >> 3) & 1);
+}
+
+size_t Phy_80211_Handshake_Store::pair_key_hash::operator()(const pair_key& k) const {
+    return (size_t) kis_u64_flat_map<int>::mix(k.bssid ^ kis_u64_flat_map<int>::mix(k.client));
+}
+
+Phy_80211_Handshake_Store::Phy_80211_Handshake_Store(GlobalRegistry *in_globalreg) :
+    Kis_Net_Httpd_Chain_Stream_Handler(in_globalreg) {
+
+    Httpd_RegisterRoute("GET", "/phy/phy80211/handshakes/:bssid/:file");
+    Httpd_RegisterRoute("GET", "/phy/phy80211/handshakes/:bssid/:client/:file");
+
+    globalreg = in_globalreg;
+
+    max_clients =
+        globalreg->kismet_config->FetchOptUInt("dot11_handshake_clients", 8);
+    max_pairs =
+        globalreg->kismet_config->FetchOptUInt("dot11_handshake_max", 4096);
+
+    if (max_clients == 0)
+        max_clients = 1;
+    if (max_pairs == 0)
+        max_pairs = 1;
+
+    pack_comp_linkframe =
+        globalreg->packetchain->RegisterPacketComponent("LINKFRAME");
+    pack_comp_datasrc =
+        globalreg->packetchain->RegisterPacketComponent("KISDATASRC");
+    pack_comp_epbcache =
+        globalreg->packetchain->RegisterPacketComponent("PCAPNG_EPB");
+}
+
+Phy_80211_Handshake_Store::~Phy_80211_Handshake_Store() {
+
+}
+
+void Phy_80211_Handshake_Store::release_pair(shared_ptr<handshake_pair> in_pair) {
+    auto bi = bssid_map.find(in_pair->bssid);
+
+    if (bi != bssid_map.end()) {
+        bi->second.erase(in_pair->bssid_pos);
+
+        if (bi->second.size() == 0)
+            bssid_map.erase(bi);
+    }
+
+    pair_key key;
+    key.bssid = in_pair->bssid;
+    key.client = in_pair->client;
+    pair_map.erase(key);
+
+    age_list.erase(in_pair->age_pos);
+}
+
+void Phy_80211_Handshake_Store::AddMessage(kis_packet *in_pack, mac_addr in_bssid,
+        mac_addr in_client, unsigned int in_msg_num) {
+
+    if (in_msg_num < 1 || in_msg_num > 4)
+        return;
+
+    packetchain_comp_datasource *datasrc =
+        (packetchain_comp_datasource *) in_pack->fetch(pack_comp_datasrc);
+
+    if (datasrc == NULL || datasrc->ref_source == NULL)
+        return;
+
+    kis_datachunk *chunk = (kis_datachunk *) in_pack->fetch(pack_comp_linkframe);
+
+    if (chunk == NULL || chunk->length == 0)
+        return;
+
+    shared_ptr<std::vector<uint8_t> > block =
+        Pcap_Stream_Ringbuf::pcapng_shared_epb(in_pack, chunk, pack_comp_epbcache);
+
+    unsigned int sourcenum = datasrc->ref_source->get_source_number();
+
+    pair_key key;
+    key.bssid = in_bssid.longmac;
+    key.client = in_client.longmac;
+
+    std::lock_guard<std::mutex> lk(store_mutex);
+
+    shared_ptr<handshake_source> source;
+    auto si = source_map.find(sourcenum);
+
+    if (si == source_map.end()) {
+        source.reset(new handshake_source());
+        source->number = sourcenum;
+        source->dlt = datasrc->ref_source->get_source_dlt();
+        Pcap_Stream_Ringbuf::pcapng_datasource_names(datasrc->ref_source,
+                &(source->interface), &(source->description));
+        source_map[sourcenum] = source;
+    } else {
+        source = si->second;
+    }
+
+    shared_ptr<handshake_pair> pair;
+    auto pi = pair_map.find(key);
+
+    if (pi == pair_map.end()) {
+        pair.reset(new handshake_pair());
+        pair->bssid = key.bssid;
+        pair->client = key.client;
+
+        pair_list& bssidlist = bssid_map[key.bssid];
+
+        // A BSSID with a full set of clients gives up the one heard from longest ago
+        if (bssidlist.size() >= max_clients)
+            release_pair(bssidlist.front());
+
+        if (pair_map.size() >= max_pairs)
+            release_pair(age_list.front());
+
+        // Releasing may have dropped the list of this BSSID
+        pair_list& hslist = bssid_map[key.bssid];
+
+        pair->age_pos = age_list.insert(age_list.end(), pair);
+        pair->bssid_pos = hslist.insert(hslist.end(), pair);
+        pair_map[key] = pair;
+    } else {
+        pair = pi->second;
+
+        age_list.splice(age_list.end(), age_list, pair->age_pos);
+
+        pair_list& hslist = bssid_map[key.bssid];
+        hslist.splice(hslist.end(), hslist, pair->bssid_pos);
+    }
+
+    unsigned int bit = 1 << (in_msg_num - 1);
+
+    // A message 1, or a message we already have, is a new exchange
+    if (in_msg_num == 1 || (pair->current.mask & bit))
+        pair->current = handshake_set();
+
+    handshake_message& msg = pair->current.msg[in_msg_num - 1];
+    msg.ts = in_pack->ts;
+    msg.source = source;
+    msg.block = block;
+    pair->current.mask |= bit;
+
+    // Keep the newest of the most complete exchanges
+    if (pair->current.count() >= pair->best.count())
+        pair->best = pair->current;
+}
+
+void Phy_80211_Handshake_Store::collect_messages(const pair_list& in_pairs,
+        uint64_t in_client, std::vector<handshake_message> *ret_messages) {
+
+    for (auto p : in_pairs) {
+        if (in_client != 0 && p->client != in_client)
+            continue;
+
+        if (!p->best.complete())
+            continue;
+
+        for (unsigned int m = 0; m < 4; m++)
+            ret_messages->push_back(p->best.msg[m]);
+    }
+}
+
+bool Phy_80211_Handshake_Store::Httpd_VerifyPath(const char *path, const char *method) {
+    if (strcmp(method, "GET") != 0)
+        return false;
+
+    // /phy/phy80211/handshakes/[bssid]/[bssid].pcapng
+    // /phy/phy80211/handshakes/[bssid]/[client]/[client].pcapng
+    vector<string> tokenurl = StrTokenize(path, "/");
+
+    if (tokenurl.size() != 6 && tokenurl.size() != 7)
+        return false;
+
+    if (tokenurl[1] != "phy" || tokenurl[2] != "phy80211" ||
+            tokenurl[3] != "handshakes")
+        return false;
+
+    mac_addr bssid(tokenurl[4]);
+
+    if (bssid.error)
+        return false;
+
+    if (tokenurl.size() == 7) {
+        mac_addr client(tokenurl[5]);
+
+        if (client.error)
+            return false;
+    }
+
+    if (tokenurl[tokenurl.size() - 1] != tokenurl[tokenurl.size() - 2] + ".pcapng")
+        return false;
+
+    return true;
+}
+
+int Phy_80211_Handshake_Store::Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd,
+        Kis_Net_Httpd_Connection *connection,
+        const char *url, const char *method, const char *upload_data,
+        size_t *upload_data_size) {
+
+    if (strcmp(method, "GET") != 0)
+        return MHD_YES;
+
+    if (!httpd->HasValidSession(connection)) {
+        connection->httpcode = 503;
+        return MHD_YES;
+    }
+
+    mac_addr bssid(connection->url_params["bssid"]);
+    uint64_t client = 0;
+
+    if (connection->url_params.find("client") != connection->url_params.end())
+        client = mac_addr(connection->url_params["client"]).longmac;
+
+    // Copy the references and write them outside the lock
+    std::vector<handshake_message> messages;
+
+    {
+        std::lock_guard<std::mutex> lk(store_mutex);
+
+        auto bi = bssid_map.find(bssid.longmac);
+
+        if (bi != bssid_map.end())
+            collect_messages(bi->second, client, &messages);
+    }
+
+    Kis_Net_Httpd_Buffer_Stream_Aux *saux =
+        (Kis_Net_Httpd_Buffer_Stream_Aux *) connection->custom_extension;
+
+    // Stored handshakes only, nothing from the live packet chain
+    Pcap_Stream_Ringbuf psrb(globalreg, saux->get_rbhandler(),
+            [](kis_packet *) -> bool { return false; }, NULL);
+
+    for (auto m : messages) {
+        if (psrb.pcapng_write_block(m.source->number, m.source->interface,
+                    m.source->description, m.source->dlt, *(m.block)) < 0)
+            break;
+    }
+
+    return MHD_YES;
+}
+
@@ -0,0 +1,149 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __PHY_80211_HANDSHAKES_H__
+#define __PHY_80211_HANDSHAKES_H__
+
+#include "config.h"
+
+#include <stdint.h>
+#include <sys/time.h>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "globalregistry.h"
+#include "macaddr.h"
+#include "packet.h"
+#include "kis_net_microhttpd.h"
+
+// WPA handshakes by BSSID and client
+//
+// The EAPOL records of a device are a list in arrival order, so finding a
+// complete handshake means walking the lists of every device.  The store keeps,
+// for every BSSID and client, the most complete set of messages 1-4 seen:  a
+// message 1 (or a repeat of a message the exchange already has) starts a new
+// exchange, and the exchange in progress replaces the kept one when it has at
+// least as many of the four messages.  At most 'dot11_handshake_clients'
+// clients are kept for each BSSID, and 'dot11_handshake_max' pairs in total;
+// the least recently updated go first.
+//
+// Messages are kept as the enhanced packet block of their link frame (see
+// pcapng_epb_cache), and complete handshakes are served as pcapng at
+//  /phy/phy80211/handshakes/[bssid]/[bssid].pcapng
+//  /phy/phy80211/handshakes/[bssid]/[client]/[client].pcapng
+class Phy_80211_Handshake_Store : public Kis_Net_Httpd_Chain_Stream_Handler {
+public:
+    Phy_80211_Handshake_Store(GlobalRegistry *in_globalreg);
+    virtual ~Phy_80211_Handshake_Store();
+
+    // Remember EAPOL key message in_msg_num (1-4) between in_bssid and in_client
+    void AddMessage(kis_packet *in_pack, mac_addr in_bssid, mac_addr in_client,
+            unsigned int in_msg_num);
+
+    virtual bool Httpd_VerifyPath(const char *path, const char *method);
+
+    virtual int Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd,
+            Kis_Net_Httpd_Connection *connection,
+            const char *url, const char *method, const char *upload_data,
+            size_t *upload_data_size);
+
+    virtual int Httpd_PostComplete(Kis_Net_Httpd_Connection *con __attribute__((unused))) {
+        return 0;
+    }
+
+protected:
+    GlobalRegistry *globalreg;
+
+    struct handshake_source {
+        unsigned int number;
+        std::string interface;
+        std::string description;
+        int dlt;
+    };
+
+    struct handshake_message {
+        struct timeval ts;
+        shared_ptr<handshake_source> source;
+        shared_ptr<std::vector<uint8_t> > block;
+    };
+
+    // Messages 1-4 of one exchange, and the bitmask of the ones present
+    struct handshake_set {
+        handshake_set() : mask(0) { }
+
+        handshake_message msg[4];
+        unsigned int mask;
+
+        unsigned int count() const;
+        bool complete() const { return mask == 0x0F; }
+    };
+
+    struct handshake_pair;
+    typedef std::list<shared_ptr<handshake_pair> > pair_list;
+
+    struct handshake_pair {
+        uint64_t bssid;
+        uint64_t client;
+
+        handshake_set best;
+        handshake_set current;
+
+        // Position in the list of every pair, least recently updated first, and
+        // in the list of its BSSID
+        pair_list::iterator age_pos;
+        pair_list::iterator bssid_pos;
+    };
+
+    struct pair_key {
+        uint64_t bssid;
+        uint64_t client;
+
+        bool operator==(const pair_key& k) const {
+            return bssid == k.bssid && client == k.client;
+        }
+    };
+
+    struct pair_key_hash {
+        size_t operator()(const pair_key& k) const;
+    };
+
+    // Drop a pair from the index and both lists; must hold store_mutex
+    void release_pair(shared_ptr<handshake_pair> in_pair);
+
+    // Complete handshakes to export, in order
+    void collect_messages(const pair_list& in_pairs, uint64_t in_client,
+            std::vector<handshake_message> *ret_messages);
+
+    std::mutex store_mutex;
+    pair_list age_list;
+    std::unordered_map<pair_key, shared_ptr<handshake_pair>, pair_key_hash> pair_map;
+    std::unordered_map<uint64_t, pair_list> bssid_map;
+    std::unordered_map<unsigned int, shared_ptr<handshake_source> > source_map;
+
+    unsigned int max_pairs;
+    unsigned int max_clients;
+
+    int pack_comp_linkframe, pack_comp_datasrc, pack_comp_epbcache;
+};
+
+#endif
+
@@ -18,16 +18,384 @@
 
 #include "config.h"
 
+#include <algorithm>
+#include <set>
+#include <sstream>
+
 #include "kis_net_microhttpd.h"
 #include "phy_80211_httpd_pcap.h"
 #include "pcapng_stream_ringbuf.h"
 #include "devicetracker.h"
+#include "kis_datasource.h"
 #include "phy_80211.h"
 
+// Which of the filters shared between streams accepted a packet, so each one
+// decides the packet once however many streams use it
+class dot11_pcap_filter_verdicts : public packet_component {
+public:
+    dot11_pcap_filter_verdicts() {
+        self_destruct = 1;
+    }
+
+    virtual ~dot11_pcap_filter_verdicts() { }
+
+    vector<std::pair<uint64_t, bool> > verdicts;
+};
+
+struct dot11_pcap_subtype_name {
+    const char *name;
+    int type;
+    int subtype;
+};
+
+static const dot11_pcap_subtype_name dot11_pcap_subtype_names[] = {
+    { "assocreq", packet_management, packet_sub_association_req },
+    { "assocresp", packet_management, packet_sub_association_resp },
+    { "reassocreq", packet_management, packet_sub_reassociation_req },
+    { "reassocresp", packet_management, packet_sub_reassociation_resp },
+    { "probereq", packet_management, packet_sub_probe_req },
+    { "proberesp", packet_management, packet_sub_probe_resp },
+    { "beacon", packet_management, packet_sub_beacon },
+    { "atim", packet_management, packet_sub_atim },
+    { "disassoc", packet_management, packet_sub_disassociation },
+    { "auth", packet_management, packet_sub_authentication },
+    { "deauth", packet_management, packet_sub_deauthentication },
+    { "action", packet_management, packet_sub_action },
+    { "actionnoack", packet_management, packet_sub_action_noack },
+
+    { "blockackreq", packet_phy, packet_sub_block_ack_req },
+    { "blockack", packet_phy, packet_sub_block_ack },
+    { "pspoll", packet_phy, packet_sub_pspoll },
+    { "rts", packet_phy, packet_sub_rts },
+    { "cts", packet_phy, packet_sub_cts },
+    { "ack", packet_phy, packet_sub_ack },
+    { "cfend", packet_phy, packet_sub_cf_end },
+    { "cfendack", packet_phy, packet_sub_cf_end_ack },
+
+    { "data", packet_data, packet_sub_data },
+    { "null", packet_data, packet_sub_data_null },
+    { "qosdata", packet_data, packet_sub_data_qos_data },
+    { "qosnull", packet_data, packet_sub_data_qos_null },
+
+    { NULL, 0, 0 }
+};
+
+// Parse a small unsigned number, all of the string or nothing
+static bool dot11_pcap_parse_num(const string& in_str, unsigned int in_max, 
+        int *ret_num) {
+    if (in_str.length() == 0 || in_str.length() > 2)
+        return false;
+
+    int n = 0;
+
+    for (auto c : in_str) {
+        if (c < '0' || c > '9')
+            return false;
+        n = (n * 10) + (c - '0');
+    }
+
+    if (n > (int) in_max)
+        return false;
+
+    *ret_num = n;
+    return true;
+}
+
+dot11_pcap_filter::dot11_pcap_filter() {
+    pack_comp_dot11 = pack_comp_l1info = pack_comp_common = pack_comp_datasrc = 
+        pack_comp_verdict = -1;
+    id = 0;
+    shared = false;
+}
+
+shared_ptr<dot11_pcap_filter> dot11_pcap_filter::compile(GlobalRegistry *in_globalreg,
+        const map<string, string>& in_args, const mac_addr *in_bssid, 
+        string *ret_error) {
+    shared_ptr<dot11_pcap_filter> filter(new dot11_pcap_filter());
+
+    shared_ptr<Packetchain> packetchain = 
+        static_pointer_cast<Packetchain>(in_globalreg->FetchGlobal("PACKETCHAIN"));
+    shared_ptr<Devicetracker> devicetracker =
+        static_pointer_cast<Devicetracker>(in_globalreg->FetchGlobal("DEVICE_TRACKER"));
+
+    filter->pack_comp_dot11 = packetchain->RegisterPacketComponent("PHY80211");
+    filter->pack_comp_l1info = packetchain->RegisterPacketComponent("RADIODATA");
+    filter->pack_comp_common = packetchain->RegisterPacketComponent("COMMON");
+    filter->pack_comp_datasrc = packetchain->RegisterPacketComponent("KISDATASRC");
+    filter->pack_comp_verdict = packetchain->RegisterPacketComponent("PCAPFILTER80211");
+
+    // Canonical values of each argument, sorted, so the same filter always
+    // comes out the same
+    map<string, std::set<string> > canon;
+
+    if (in_bssid != NULL) {
+        filter->bssids.push_back(*in_bssid);
+        canon["bssid"].insert(in_bssid->MacFull2String());
+    }
+
+    for (auto a : in_args) {
+        vector<string> values = StrTokenize(StrLower(a.second), ",");
+
+        for (auto v : values) {
+            if (v.length() == 0)
+                continue;
+
+            if (a.first == "bssid") {
+                if (in_bssid != NULL) {
+                    *ret_error = "The BSSID is already given by the path";
+                    return NULL;
+                }
+
+                mac_addr m(v);
+
+                if (m.error) {
+                    *ret_error = "Invalid BSSID '" + v + "'";
+                    return NULL;
+                }
+
+                filter->bssids.push_back(m);
+                canon["bssid"].insert(m.MacFull2String());
+            } else if (a.first == "device") {
+                uint64_t key = 0;
+                std::stringstream ss(v);
+
+                if (!(ss >> key) || !ss.eof()) {
+                    *ret_error = "Invalid device key '" + v + "'";
+                    return NULL;
+                }
+
+                shared_ptr<kis_tracked_device_base> dev =
+                    devicetracker->FetchDevice(key);
+
+                if (dev == NULL) {
+                    *ret_error = "No such device '" + v + "'";
+                    return NULL;
+                }
+
+                // Frames don't carry keys, so match the addresses of the device
+                filter->devices.push_back(dev->get_macaddr());
+                canon["device"].insert(dev->get_macaddr().MacFull2String());
+            } else if (a.first == "type") {
+                int t;
+
+                if (v == "management" || v == "mgmt")
+                    t = packet_management;
+                else if (v == "control" || v == "ctrl" || v == "phy")
+                    t = packet_phy;
+                else if (v == "data")
+                    t = packet_data;
+                else if (!dot11_pcap_parse_num(v, 2, &t)) {
+                    *ret_error = "Invalid frame type '" + v + "'";
+                    return NULL;
+                }
+
+                filter->types.push_back(t);
+                canon["type"].insert(IntToString(t));
+            } else if (a.first == "subtype") {
+                int t = -1, st = -1;
+
+                for (unsigned int n = 0; dot11_pcap_subtype_names[n].name != NULL; n++) {
+                    if (v == dot11_pcap_subtype_names[n].name) {
+                        t = dot11_pcap_subtype_names[n].type;
+                        st = dot11_pcap_subtype_names[n].subtype;
+                        break;
+                    }
+                }
+
+                if (st < 0 && !dot11_pcap_parse_num(v, 15, &st)) {
+                    *ret_error = "Invalid frame subtype '" + v + "'";
+                    return NULL;
+                }
+
+                filter->subtypes.push_back(std::make_pair(t, st));
+                canon["subtype"].insert(IntToString(t) + ":" + IntToString(st));
+            } else if (a.first == "channel") {
+                filter->channels.push_back(v);
+                canon["channel"].insert(v);
+            } else if (a.first == "source") {
+                uuid u(v);
+
+                if (u.error) {
+                    *ret_error = "Invalid datasource UUID '" + v + "'";
+                    return NULL;
+                }
+
+                filter->sources.push_back(u);
+                canon["source"].insert(u.UUID2String());
+            }
+        }
+    }
+
+    for (auto c : canon) {
+        if (filter->canonical.length() != 0)
+            filter->canonical += "&";
+
+        filter->canonical += c.first + "=";
+
+        bool first = true;
+        for (auto v : c.second) {
+            if (!first)
+                filter->canonical += ",";
+            first = false;
+            filter->canonical += v;
+        }
+    }
+
+    return filter;
+}
+
+bool dot11_pcap_filter::match(kis_packet *in_packet) const {
+    dot11_packinfo *dot11info = (dot11_packinfo *) in_packet->fetch(pack_comp_dot11);
+
+    if (dot11info == NULL)
+        return false;
+
+    // Cheapest first; every list given has to match something
+    if (types.size() != 0 &&
+            std::find(types.begin(), types.end(), (int) dot11info->type) == types.end())
+        return false;
+
+    if (subtypes.size() != 0) {
+        bool found = false;
+
+        for (auto st : subtypes) {
+            if ((st.first < 0 || st.first == dot11info->type) && 
+                    st.second == dot11info->subtype) {
+                found = true;
+                break;
+            }
+        }
+
+        if (!found)
+            return false;
+    }
+
+    if (bssids.size() != 0) {
+        bool found = false;
+
+        for (auto& b : bssids) {
+            if (b == dot11info->bssid_mac) {
+                found = true;
+                break;
+            }
+        }
+
+        if (!found)
+            return false;
+    }
+
+    if (devices.size() != 0) {
+        bool found = false;
+
+        for (auto& d : devices) {
+            if (d == dot11info->source_mac || d == dot11info->dest_mac ||
+                    d == dot11info->bssid_mac || d == dot11info->other_mac) {
+                found = true;
+                break;
+            }
+        }
+
+        if (!found)
+            return false;
+    }
+
+    if (channels.size() != 0) {
+        kis_layer1_packinfo *l1info = 
+            (kis_layer1_packinfo *) in_packet->fetch(pack_comp_l1info);
+        kis_common_info *common = 
+            (kis_common_info *) in_packet->fetch(pack_comp_common);
+
+        string channel;
+
+        if (l1info != NULL && l1info->channel != "0" && l1info->channel.length() != 0)
+            channel = l1info->channel;
+        else if (common != NULL)
+            channel = common->channel;
+
+        if (std::find(channels.begin(), channels.end(), StrLower(channel)) == 
+                channels.end())
+            return false;
+    }
+
+    if (sources.size() != 0) {
+        packetchain_comp_datasource *datasrc =
+            (packetchain_comp_datasource *) in_packet->fetch(pack_comp_datasrc);
+
+        if (datasrc == NULL || datasrc->ref_source == NULL)
+            return false;
+
+        if (std::find(sources.begin(), sources.end(), 
+                    datasrc->ref_source->get_source_uuid()) == sources.end())
+            return false;
+    }
+
+    return true;
+}
+
+bool dot11_pcap_filter::accept(kis_packet *in_packet) {
+    // Streams only run from the logging chain, one at a time, so the first
+    // stream of a shared filter to see the packet decides it for the others
+    if (!shared)
+        return match(in_packet);
+
+    dot11_pcap_filter_verdicts *verdicts =
+        (dot11_pcap_filter_verdicts *) in_packet->fetch(pack_comp_verdict);
+
+    if (verdicts == NULL) {
+        verdicts = new dot11_pcap_filter_verdicts();
+        in_packet->insert(pack_comp_verdict, verdicts);
+    } else {
+        for (auto& v : verdicts->verdicts) {
+            if (v.first == id)
+                return v.second;
+        }
+    }
+
+    bool r = match(in_packet);
+    verdicts->verdicts.push_back(std::make_pair(id, r));
+
+    return r;
+}
+
+shared_ptr<dot11_pcap_filter> Phy_80211_Httpd_Pcap::intern_filter(
+        shared_ptr<dot11_pcap_filter> in_filter) {
+    std::lock_guard<std::mutex> lock(filter_mutex);
+
+    // Forget filters no stream uses any more
+    for (auto i = filters.begin(); i != filters.end(); ) {
+        if (i->second.expired())
+            i = filters.erase(i);
+        else
+            ++i;
+    }
+
+    auto fi = filters.find(in_filter->get_canonical());
+
+    if (fi != filters.end()) {
+        shared_ptr<dot11_pcap_filter> existing = fi->second.lock();
+
+        if (existing != NULL) {
+            existing->shared = true;
+            return existing;
+        }
+    }
+
+    in_filter->id = next_filter_id++;
+    filters[in_filter->get_canonical()] = in_filter;
+
+    return in_filter;
+}
+
 bool Phy_80211_Httpd_Pcap::Httpd_VerifyPath(const char *path, const char *method) {
     if (strcmp(method, "GET") == 0) {
         vector<string> tokenurl = StrTokenize(path, "/");
 
+        // /phy/phy80211/pcap/[name].pcapng
+        if (tokenurl.size() == 5 && tokenurl[1] == "phy" && 
+                tokenurl[2] == "phy80211" && tokenurl[3] == "pcap" &&
+                Httpd_GetSuffix(tokenurl[4]) == "pcapng")
+            return true;
+
         // /phy/phy80211/by-bssid/[mac]/pcap/[mac].pcapng
         if (tokenurl.size() < 7)
             return false;
@@ -95,60 +463,98 @@ int Phy_80211_Httpd_Pcap::Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd,
 
     vector<string> tokenurl = StrTokenize(url, "/");
 
-    // /phy/phy80211/by-bssid/[mac]/pcap/[mac].pcapng
-    if (tokenurl.size() < 7)
-        return MHD_YES;
+    // The BSSID of the path, if it's a by-bssid stream
+    mac_addr dmac;
+    bool by_bssid = false;
 
-    if (tokenurl[1] != "phy")
-        return MHD_YES;
+    if (tokenurl.size() == 5) {
+        // /phy/phy80211/pcap/[name].pcapng
+        if (tokenurl[1] != "phy")
+            return MHD_YES;
 
-    if (tokenurl[2] != "phy80211")
-        return MHD_YES;
+        if (tokenurl[2] != "phy80211")
+            return MHD_YES;
 
-    if (tokenurl[3] != "by-bssid")
-        return MHD_YES;
+        if (tokenurl[3] != "pcap")
+            return MHD_YES;
 
-    mac_addr dmac(tokenurl[4]);
-    if (dmac.error)
-        return MHD_YES;
+        if (Httpd_GetSuffix(tokenurl[4]) != "pcapng")
+            return MHD_YES;
+    } else {
+        // /phy/phy80211/by-bssid/[mac]/pcap/[mac].pcapng
+        if (tokenurl.size() < 7)
+            return MHD_YES;
 
-    if (tokenurl[5] != "pcap")
-        return MHD_YES;
+        if (tokenurl[1] != "phy")
+            return MHD_YES;
 
-    // Valid requested file?
-    if (tokenurl[6] != tokenurl[4] + ".pcapng")
-        return MHD_YES;
+        if (tokenurl[2] != "phy80211")
+            return MHD_YES;
+
+        if (tokenurl[3] != "by-bssid")
+            return MHD_YES;
 
-    // Does it exist?
-    shared_ptr<kis_tracked_device_base> dev;
-    if ((dev = devicetracker->FetchDevice(dmac, dot11phy->FetchPhyId())) == NULL)
+        dmac = mac_addr(tokenurl[4]);
+        if (dmac.error)
+            return MHD_YES;
+
+        if (tokenurl[5] != "pcap")
+            return MHD_YES;
+
+        // Valid requested file?
+        if (tokenurl[6] != tokenurl[4] + ".pcapng")
+            return MHD_YES;
+
+        // Does it exist?
+        if (devicetracker->FetchDevice(dmac, dot11phy->FetchPhyId()) == NULL)
+            return MHD_YES;
+
+        by_bssid = true;
+    }
+
+    // Filter arguments of the request
+    map<string, string> args;
+    const char *filter_args[] = { "bssid", "device", "type", "subtype", "channel", 
+        "source", NULL };
+
+    for (unsigned int a = 0; filter_args[a] != NULL; a++) {
+        const char *v = 
+            MHD_lookup_connection_value(connection->connection, MHD_GET_ARGUMENT_KIND,
+                    filter_args[a]);
+
+        if (v != NULL)
+            args[filter_args[a]] = string(v);
+    }
+
+    string error;
+    shared_ptr<dot11_pcap_filter> filter = 
+        dot11_pcap_filter::compile(http_globalreg, args, by_bssid ? &dmac : NULL, &error);
+
+    if (filter == NULL) {
+        Kis_Net_Httpd_Buffer_Stream_Aux *saux = 
+            (Kis_Net_Httpd_Buffer_Stream_Aux *) connection->custom_extension;
+
+        error += "\n";
+        saux->get_rbhandler()->PutWriteBufferData((void *) error.data(), 
+                error.length(), true);
+
+        connection->httpcode = 400;
         return MHD_YES;
+    }
+
+    filter = intern_filter(filter);
 
     shared_ptr<StreamTracker> streamtracker =
         static_pointer_cast<StreamTracker>(http_globalreg->FetchGlobal("STREAMTRACKER"));
-    shared_ptr<Packetchain> packetchain = 
-        static_pointer_cast<Packetchain>(http_globalreg->FetchGlobal("PACKETCHAIN"));
-    int pack_comp_dot11 = packetchain->RegisterPacketComponent("PHY80211");
 
     Kis_Net_Httpd_Buffer_Stream_Aux *saux = 
         (Kis_Net_Httpd_Buffer_Stream_Aux *) connection->custom_extension;
       
-    // Filter based on the device key
+    // Filter on the packet metadata, before the stream encodes anything
     Pcap_Stream_Ringbuf *psrb = new Pcap_Stream_Ringbuf(http_globalreg,
             saux->get_rbhandler(), 
-            [dmac, pack_comp_dot11](kis_packet *packet) -> bool {
-                dot11_packinfo *dot11info =
-                    (dot11_packinfo *) packet->fetch(pack_comp_dot11);
-
-                if (dot11info == NULL) {
-                    return false;
-                }
-
-                if (dot11info->bssid_mac == dmac) {
-                    return true;
-                }
-
-                return false;
+            [filter](kis_packet *packet) -> bool {
+                return filter->accept(packet);
             }, NULL);
 
     saux->set_aux(psrb, 
@@ -159,10 +565,17 @@ int Phy_80211_Httpd_Pcap::Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd,
             }
         });
 
-    streamtracker->register_streamer(psrb, "phy80211-" + dmac.Mac2String() + " .pcapng",
-            "pcapng", "httpd", 
-            "pcapng of all packets on phy80211 BSSID " + dmac.Mac2String());
+    if (by_bssid) {
+        streamtracker->register_streamer(psrb, "phy80211-" + dmac.Mac2String() + ".pcapng",
+                "pcapng", "httpd", 
+                "pcapng of all packets on phy80211 BSSID " + dmac.Mac2String() +
+                (args.size() != 0 ? " matching " + filter->get_canonical() : ""));
+    } else {
+        streamtracker->register_streamer(psrb, "phy80211-" + tokenurl[4],
+                "pcapng", "httpd", 
+                filter->empty() ? string("pcapng of all phy80211 packets") :
+                "pcapng of phy80211 packets matching " + filter->get_canonical());
+    }
 
     return MHD_NO;
 }
-
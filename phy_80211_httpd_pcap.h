@@ -21,15 +21,93 @@
 
 #include "config.h"
 
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
 #include "kis_net_microhttpd.h"
+#include "packet.h"
+#include "macaddr.h"
+#include "uuid.h"
+
+/* Filters for 802.11 pcap-ng streams
+ *
+ * A stream request may narrow what it streams with query arguments:
+ *
+ *   bssid=      BSSIDs, optionally masked (AA:BB:CC:00:00:00/FF:FF:FF:00:00:00)
+ *   device=     device keys; frames to, from, or about the device's MAC
+ *   type=       frame types: management, control, data, or 0-2
+ *   subtype=    frame subtypes: names such as beacon or probereq, or 0-15
+ *   channel=    channels, as the datasource reported them
+ *   source=     datasource UUIDs
+ *
+ * Each argument takes a comma separated list and matches any of them; a frame
+ * is streamed when it matches every argument given.
+ *
+ * The filter runs on the packet's dissected metadata from the logging chain
+ * before anything is encoded, so frames nobody asked for cost nothing but the
+ * compare.  Streams asking for the same filter (however their arguments were
+ * ordered or spelled) share one compiled filter, which decides each packet
+ * once for all of them, and the pcapng block of a packet is encoded once for
+ * every stream it goes to.
+ */
+
+class dot11_pcap_filter {
+public:
+    // Compile a filter from the query arguments of the request; returns NULL
+    // and an explanation in ret_error if any of them is invalid
+    static shared_ptr<dot11_pcap_filter> compile(GlobalRegistry *in_globalreg,
+            const map<string, string>& in_args, const mac_addr *in_bssid, 
+            string *ret_error);
+
+    // Decide a packet; filters shared between streams remember the decision
+    // in the packet
+    bool accept(kis_packet *in_packet);
+
+    // Normalized form of the filter, the same for the same filter however it
+    // was asked for
+    const string& get_canonical() const { return canonical; }
+
+    bool empty() const { return canonical.length() == 0; }
+
+protected:
+    friend class Phy_80211_Httpd_Pcap;
+
+    dot11_pcap_filter();
+
+    bool match(kis_packet *in_packet) const;
+
+    int pack_comp_dot11, pack_comp_l1info, pack_comp_common, pack_comp_datasrc,
+        pack_comp_verdict;
+
+    // Set by the handler; filters more than one stream uses are shared
+    uint64_t id;
+    std::atomic<bool> shared;
+
+    vector<mac_addr> bssids;
+    vector<mac_addr> devices;
+    vector<int> types;
+    // Type, or -1 for any, and subtype
+    vector<std::pair<int, int> > subtypes;
+    vector<string> channels;
+    vector<uuid> sources;
+
+    string canonical;
+};
 
 /* An 802.11-aware pcap-ng streamer */
 
 class Phy_80211_Httpd_Pcap : public Kis_Net_Httpd_Ringbuf_Stream_Handler {
 public:
-    Phy_80211_Httpd_Pcap() : Kis_Net_Httpd_Ringbuf_Stream_Handler() { }
+    Phy_80211_Httpd_Pcap() : Kis_Net_Httpd_Ringbuf_Stream_Handler() { 
+        next_filter_id = 1;
+    }
     Phy_80211_Httpd_Pcap(GlobalRegistry *in_globalreg) : 
-        Kis_Net_Httpd_Ringbuf_Stream_Handler(in_globalreg) { }
+        Kis_Net_Httpd_Ringbuf_Stream_Handler(in_globalreg) { 
+        next_filter_id = 1;
+    }
 
     virtual ~Phy_80211_Httpd_Pcap() { };
 
@@ -48,9 +126,17 @@ public:
     virtual int Httpd_PostComplete(Kis_Net_Httpd_Connection *con __attribute__((unused))) {
         return 0;
     }
+
+protected:
+    // Filters in use by open streams, by their canonical form
+    std::mutex filter_mutex;
+    map<string, weak_ptr<dot11_pcap_filter> > filters;
+    uint64_t next_filter_id;
+
+    // The compiled filter streams asking for this one share
+    shared_ptr<dot11_pcap_filter> intern_filter(shared_ptr<dot11_pcap_filter> in_filter);
     
 };
 
 
 #endif
-
@@ -0,0 +1,217 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include "phy_ingest.h"
+#include "configfile.h"
+#include "devicetracker.h"
+#include "entrytracker.h"
+#include "kis_clock.h"
+
+Kis_Phy_Ingest::Kis_Phy_Ingest(GlobalRegistry *in_globalreg,
+        Devicetracker *in_tracker, ingest_cb in_cb) {
+    globalreg = in_globalreg;
+    devicetracker = in_tracker;
+    cb = in_cb;
+
+    max_queued = globalreg->kismet_config->FetchOptUInt("phy_ingest_queue", 4096);
+
+    if (max_queued == 0)
+        max_queued = 1;
+
+    stat_queued = 0;
+    stat_accepted = 0;
+    stat_rejected = 0;
+    stat_refused = 0;
+    stat_batches = 0;
+    stat_lag_usec = 0;
+    stat_max_lag_usec = 0;
+    stat_batch_usec = 0;
+
+    stats_id =
+        globalreg->entrytracker->RegisterField("kismet.phy.ingest", TrackerMap,
+                "posted record ingest statistics");
+    stats_depth_id =
+        globalreg->entrytracker->RegisterField("kismet.phy.ingest.depth",
+                TrackerUInt64, "records waiting to be processed");
+    stats_queued_id =
+        globalreg->entrytracker->RegisterField("kismet.phy.ingest.queued",
+                TrackerUInt64, "records queued");
+    stats_accepted_id =
+        globalreg->entrytracker->RegisterField("kismet.phy.ingest.accepted",
+                TrackerUInt64, "entries which updated a device");
+    stats_rejected_id =
+        globalreg->entrytracker->RegisterField("kismet.phy.ingest.rejected",
+                TrackerUInt64, "entries which could not be used");
+    stats_refused_id =
+        globalreg->entrytracker->RegisterField("kismet.phy.ingest.refused",
+                TrackerUInt64, "posts refused because the queue was full");
+    stats_batches_id =
+        globalreg->entrytracker->RegisterField("kismet.phy.ingest.batches",
+                TrackerUInt64, "batches processed under the device list lock");
+    stats_lag_id =
+        globalreg->entrytracker->RegisterField("kismet.phy.ingest.lag_usec",
+                TrackerUInt64, "age of the oldest record in the last batch (usec)");
+    stats_max_lag_id =
+        globalreg->entrytracker->RegisterField("kismet.phy.ingest.max_lag_usec",
+                TrackerUInt64, "greatest age of a record when processed (usec)");
+    stats_batch_usec_id =
+        globalreg->entrytracker->RegisterField("kismet.phy.ingest.batch_usec",
+                TrackerUInt64, "time taken by the last batch (usec)");
+
+    worker_stop = false;
+    worker_thread = std::thread([this]() { WorkerThread(); });
+}
+
+Kis_Phy_Ingest::~Kis_Phy_Ingest() {
+    Stop();
+}
+
+bool Kis_Phy_Ingest::Queue(int in_type, const std::string& in_data) {
+    std::lock_guard<std::mutex> lk(queue_mutex);
+
+    if (worker_stop || queue.size() >= max_queued) {
+        stat_refused++;
+        return false;
+    }
+
+    record r;
+    r.type = in_type;
+    r.data = in_data;
+    r.queued_usec = KisClock::MonoUsec();
+
+    queue.push_back(std::move(r));
+    stat_queued++;
+
+    worker_cv.notify_one();
+
+    return true;
+}
+
+void Kis_Phy_Ingest::Stop() {
+    if (!worker_thread.joinable())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lk(queue_mutex);
+        worker_stop = true;
+        worker_cv.notify_one();
+    }
+
+    worker_thread.join();
+}
+
+void Kis_Phy_Ingest::WorkerThread() {
+    std::deque<record> batch;
+
+    while (1) {
+        bool stopping;
+
+        {
+            std::unique_lock<std::mutex> lk(queue_mutex);
+
+            while (!worker_stop && queue.size() == 0)
+                worker_cv.wait(lk);
+
+            std::swap(batch, queue);
+            stopping = worker_stop;
+        }
+
+        if (batch.size() != 0) {
+            uint64_t start = KisClock::MonoUsec();
+            uint64_t lag = start - batch.front().queued_usec;
+
+            unsigned int accepted = 0, rejected = 0;
+
+            {
+                devicelist_scope_locker slocker(devicetracker);
+
+                for (auto& r : batch)
+                    cb(r, &accepted, &rejected);
+            }
+
+            stat_accepted += accepted;
+            stat_rejected += rejected;
+            stat_batches++;
+            stat_lag_usec = lag;
+            stat_batch_usec = KisClock::MonoUsec() - start;
+
+            if (lag > stat_max_lag_usec)
+                stat_max_lag_usec = lag;
+
+            batch.clear();
+        }
+
+        // Nothing is queued once we're stopped, so the last swap got all of it
+        if (stopping)
+            break;
+    }
+}
+
+SharedTrackerElement Kis_Phy_Ingest::FetchStats() {
+    uint64_t depth;
+
+    {
+        std::lock_guard<std::mutex> lk(queue_mutex);
+        depth = queue.size();
+    }
+
+    SharedTrackerElement stats(new TrackerElement(TrackerMap, stats_id));
+
+    SharedTrackerElement e;
+
+    e.reset(new TrackerElement(TrackerUInt64, stats_depth_id));
+    e->set(depth);
+    stats->add_map(e);
+
+    e.reset(new TrackerElement(TrackerUInt64, stats_queued_id));
+    e->set((uint64_t) stat_queued);
+    stats->add_map(e);
+
+    e.reset(new TrackerElement(TrackerUInt64, stats_accepted_id));
+    e->set((uint64_t) stat_accepted);
+    stats->add_map(e);
+
+    e.reset(new TrackerElement(TrackerUInt64, stats_rejected_id));
+    e->set((uint64_t) stat_rejected);
+    stats->add_map(e);
+
+    e.reset(new TrackerElement(TrackerUInt64, stats_refused_id));
+    e->set((uint64_t) stat_refused);
+    stats->add_map(e);
+
+    e.reset(new TrackerElement(TrackerUInt64, stats_batches_id));
+    e->set((uint64_t) stat_batches);
+    stats->add_map(e);
+
+    e.reset(new TrackerElement(TrackerUInt64, stats_lag_id));
+    e->set((uint64_t) stat_lag_usec);
+    stats->add_map(e);
+
+    e.reset(new TrackerElement(TrackerUInt64, stats_max_lag_id));
+    e->set((uint64_t) stat_max_lag_usec);
+    stats->add_map(e);
+
+    e.reset(new TrackerElement(TrackerUInt64, stats_batch_usec_id));
+    e->set((uint64_t) stat_batch_usec);
+    stats->add_map(e);
+
+    return stats;
+}
+
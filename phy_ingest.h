@@ -0,0 +1,102 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __PHY_INGEST_H__
+#define __PHY_INGEST_H__
+
+#include "config.h"
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "globalregistry.h"
+#include "trackedelement.h"
+
+class Devicetracker;
+
+// Ingest queue for a phy which is fed records over HTTP instead of packets
+//
+// The request thread only queues the posted record and answers; a worker
+// thread owned by the phy turns the records into devices, taking the device
+// list lock once for everything which queued up since its last pass.  A burst
+// of sensor posts waits in the queue instead of holding webserver threads and
+// the device list lock, and when the queue is full a post is refused with a
+// 503 so the sender can retry it.
+//
+// How far behind the worker is (the age of the oldest record it picked up)
+// is kept with the other counters, which the phy serves over REST.
+class Kis_Phy_Ingest {
+public:
+    struct record {
+        // Phy-defined kind of record, ie a single record or a batch
+        int type;
+        std::string data;
+        uint64_t queued_usec;
+    };
+
+    // Called by the worker, with the device list locked, for every record;
+    // counts the devices updated and the entries which couldn't be used
+    typedef std::function<void (const record& in_rec, unsigned int *ret_accepted,
+            unsigned int *ret_rejected)> ingest_cb;
+
+    Kis_Phy_Ingest(GlobalRegistry *in_globalreg, Devicetracker *in_tracker,
+            ingest_cb in_cb);
+    ~Kis_Phy_Ingest();
+
+    // Queue a record; false if the queue is full or the worker has stopped
+    bool Queue(int in_type, const std::string& in_data);
+
+    // Process whatever is queued and stop the worker; called before the
+    // device list is torn down
+    void Stop();
+
+    SharedTrackerElement FetchStats();
+
+protected:
+    void WorkerThread();
+
+    GlobalRegistry *globalreg;
+    Devicetracker *devicetracker;
+
+    ingest_cb cb;
+
+    unsigned int max_queued;
+
+    std::mutex queue_mutex;
+    std::deque<record> queue;
+
+    std::thread worker_thread;
+    std::condition_variable worker_cv;
+    bool worker_stop;
+
+    std::atomic<uint64_t> stat_queued, stat_accepted, stat_rejected, stat_refused,
+        stat_batches, stat_lag_usec, stat_max_lag_usec, stat_batch_usec;
+
+    int stats_id, stats_depth_id, stats_queued_id, stats_accepted_id,
+        stats_rejected_id, stats_refused_id, stats_batches_id, stats_lag_id,
+        stats_max_lag_id, stats_batch_usec_id;
+};
+
+#endif
+
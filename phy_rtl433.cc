@@ -66,16 +66,34 @@ Kis_RTL433_Phy::Kis_RTL433_Phy(GlobalRegistry *in_globalreg,
     httpregistry->register_js_module("kismet_ui_rtl433", 
             "/js/kismet.ui.rtl433.js");
 
+    ingest = new Kis_Phy_Ingest(globalreg, devicetracker,
+            [this](const Kis_Phy_Ingest::record& rec, unsigned int *accepted,
+                unsigned int *rejected) {
+                IngestRecord(rec, accepted, rejected);
+            });
 }
 
 Kis_RTL433_Phy::~Kis_RTL433_Phy() {
+    delete ingest;
+}
 
+void Kis_RTL433_Phy::Shutdown() {
+    if (ingest != NULL)
+        ingest->Stop();
 }
 
 bool Kis_RTL433_Phy::Httpd_VerifyPath(const char *path, const char *method) {
+    if (strcmp(method, "GET") == 0) {
+        if (Httpd_StripSuffix(path) == "/phy/phyRTL433/ingest")
+            return Httpd_CanSerialize(path);
+    }
+
     if (strcmp(method, "POST") == 0) {
         if (strcmp(path, "/phy/phyRTL433/post_sensor_json.cmd") == 0)
             return true;
+
+        if (strcmp(path, "/phy/phyRTL433/post_sensor_json_batch.cmd") == 0)
+            return true;
     }
 
     return false;
@@ -85,7 +103,7 @@ double Kis_RTL433_Phy::f_to_c(double f) {
     return (f - 32) / (double) 1.8f;
 }
 
-mac_addr Kis_RTL433_Phy::json_to_mac(struct JSON_value *json) {
+mac_addr Kis_RTL433_Phy::json_to_mac(const JSON_tape& tape, size_t obj) {
     // Derive a mac addr from the model and device id data
     //
     // We turn the model string into 4 bytes using the adler32 checksum,
@@ -99,16 +117,16 @@ mac_addr Kis_RTL433_Phy::json_to_mac(struct JSON_value *json) {
     uint16_t *model = (uint16_t *) bytes;
     uint32_t *checksum = (uint32_t *) (bytes + 2);
 
-    string smodel = JSON_dict_get_string(json, "model", err);
+    string smodel = tape.dict_get_string(obj, "model", err);
     *checksum = Adler32Checksum(smodel.c_str(), smodel.length());
 
     // See what we can scrape up...
-    if (JSON_dict_has_key(json, "id")) {
+    if (tape.has_key(obj, "id")) {
         *model = 
-            kis_hton16((uint16_t) JSON_dict_get_number(json, "id", err));
-    } else if (JSON_dict_has_key(json, "device")) {
+            kis_hton16((uint16_t) tape.dict_get_number(obj, "id", err));
+    } else if (tape.has_key(obj, "device")) {
         *model =
-            kis_hton16((uint16_t) JSON_dict_get_number(json, "device", err));
+            kis_hton16((uint16_t) tape.dict_get_number(obj, "device", err));
     } else {
         *model = 0x0000;
     }
@@ -119,18 +137,22 @@ mac_addr Kis_RTL433_Phy::json_to_mac(struct JSON_value *json) {
     return mac_addr(bytes, 6);
 }
 
-bool Kis_RTL433_Phy::json_to_rtl(struct JSON_value *json) {
+bool Kis_RTL433_Phy::json_to_rtl(const JSON_tape& tape, size_t obj) {
+    devicelist_scope_locker slocker(devicetracker);
+
+    return json_to_rtl_locked(tape, obj);
+}
+
+bool Kis_RTL433_Phy::json_to_rtl_locked(const JSON_tape& tape, size_t obj) {
     string err;
     string v;
     double d;
 
-    devicelist_scope_locker slocker(devicetracker);
-
-    if (json == NULL)
+    if (!tape.is_object(obj))
         return false;
 
     // synth a mac out of it
-    mac_addr rtlmac = json_to_mac(json);
+    mac_addr rtlmac = json_to_mac(tape, obj);
 
     if (rtlmac.error) {
         return false;
@@ -150,8 +172,8 @@ bool Kis_RTL433_Phy::json_to_rtl(struct JSON_value *json) {
     common->datasize = 0;
 
     // If this json record has a channel
-    if (JSON_dict_has_key(json, "channel")) {
-        int c = JSON_dict_get_number(json, "channel", err);
+    if (tape.has_key(obj, "channel")) {
+        int c = tape.dict_get_number(obj, "channel", err);
 
         if (err.length() == 0) {
             common->channel = IntToString(c);
@@ -174,9 +196,9 @@ bool Kis_RTL433_Phy::json_to_rtl(struct JSON_value *json) {
     delete(pack);
 
     string dn = "Sensor";
-    if (JSON_dict_has_key(json, "model")) {
+    if (tape.has_key(obj, "model")) {
         string mdn;
-        mdn = JSON_dict_get_string(json, "model", err);
+        mdn = tape.dict_get_string(obj, "model", err);
         if (err.length() == 0) {
             dn = MungeToPrintable(mdn);
         }
@@ -205,8 +227,8 @@ bool Kis_RTL433_Phy::json_to_rtl(struct JSON_value *json) {
             static_pointer_cast<rtl433_tracked_common>(entrytracker->GetTrackedInstance(rtl433_common_id));
         rtlholder->add_map(commondev);
 
-        if (JSON_dict_has_key(json, "model")) {
-            v = JSON_dict_get_string(json, "model", err);
+        if (tape.has_key(obj, "model")) {
+            v = tape.dict_get_string(obj, "model", err);
 
             if (err.length() == 0) {
                 commondev->set_model(v);
@@ -215,8 +237,8 @@ bool Kis_RTL433_Phy::json_to_rtl(struct JSON_value *json) {
             }
         }
 
-        if (JSON_dict_has_key(json, "id")) {
-            d = JSON_dict_get_number(json, "id", err);
+        if (tape.has_key(obj, "id")) {
+            d = tape.dict_get_number(obj, "id", err);
 
             if (err.length() == 0) {
                 commondev->set_rtlid((uint64_t) d);
@@ -224,8 +246,8 @@ bool Kis_RTL433_Phy::json_to_rtl(struct JSON_value *json) {
                 commondev->set_rtlid(0);
             }
 
-        } else if (JSON_dict_has_key(json, "device")) {
-            d = JSON_dict_get_number(json, "device", err);
+        } else if (tape.has_key(obj, "device")) {
+            d = tape.dict_get_number(obj, "device", err);
 
             if (err.length() == 0) {
                 commondev->set_rtlid((uint64_t) d);
@@ -240,25 +262,25 @@ bool Kis_RTL433_Phy::json_to_rtl(struct JSON_value *json) {
         commondev->set_rtlchannel("0");
     }
 
-    if (JSON_dict_has_key(json, "channel")) {
-        d = JSON_dict_get_number(json, "channel", err);
+    if (tape.has_key(obj, "channel")) {
+        d = tape.dict_get_number(obj, "channel", err);
 
         if (err.length() == 0) {
             commondev->set_rtlchannel(IntToString((int) d));
         }
     }
 
-    if (JSON_dict_has_key(json, "battery")) {
-        v = JSON_dict_get_string(json, "battery", err);
+    if (tape.has_key(obj, "battery")) {
+        v = tape.dict_get_string(obj, "battery", err);
 
         if (err.length() == 0) {
             commondev->set_battery(v);
         }
     }
 
-    if (JSON_dict_has_key(json, "humidity") || 
-            JSON_dict_has_key(json, "temperature_C") ||
-            JSON_dict_has_key(json, "temperature_F")) {
+    if (tape.has_key(obj, "humidity") || 
+            tape.has_key(obj, "temperature_C") ||
+            tape.has_key(obj, "temperature_F")) {
 
         shared_ptr<rtl433_tracked_thermometer> thermdev = 
             static_pointer_cast<rtl433_tracked_thermometer>(rtlholder->get_map_value(rtl433_thermometer_id));
@@ -269,21 +291,21 @@ bool Kis_RTL433_Phy::json_to_rtl(struct JSON_value *json) {
             rtlholder->add_map(thermdev);
         }
 
-        d = JSON_dict_get_number(json, "humidity", err);
+        d = tape.dict_get_number(obj, "humidity", err);
         if (err.length() == 0) {
             thermdev->set_humidity((int32_t) d);
             thermdev->get_humidity_rrd()->add_sample((int64_t) d,
                     globalreg->timestamp.tv_sec);
         }
 
-        d = JSON_dict_get_number(json, "temperature_F", err);
+        d = tape.dict_get_number(obj, "temperature_F", err);
         if (err.length() == 0) {
             thermdev->set_temperature(f_to_c(d));
             thermdev->get_temperature_rrd()->add_sample((int64_t) f_to_c(d),
                     globalreg->timestamp.tv_sec);
         }
 
-        d = JSON_dict_get_number(json, "temperature_C", err);
+        d = tape.dict_get_number(obj, "temperature_C", err);
         if (err.length() == 0) {
             thermdev->set_temperature(d);
             thermdev->get_temperature_rrd()->add_sample((int64_t) d,
@@ -292,12 +314,12 @@ bool Kis_RTL433_Phy::json_to_rtl(struct JSON_value *json) {
 
     }
 
-    if (JSON_dict_has_key(json, "direction_deg") || 
-            JSON_dict_has_key(json, "windstrength") ||
-            JSON_dict_has_key(json, "winddirection") ||
-            JSON_dict_has_key(json, "speed") ||
-            JSON_dict_has_key(json, "gust") ||
-            JSON_dict_has_key(json, "rain")) {
+    if (tape.has_key(obj, "direction_deg") || 
+            tape.has_key(obj, "windstrength") ||
+            tape.has_key(obj, "winddirection") ||
+            tape.has_key(obj, "speed") ||
+            tape.has_key(obj, "gust") ||
+            tape.has_key(obj, "rain")) {
 
         shared_ptr<rtl433_tracked_weatherstation> weatherdev = 
             static_pointer_cast<rtl433_tracked_weatherstation>(rtlholder->get_map_value(rtl433_weatherstation_id));
@@ -308,42 +330,42 @@ bool Kis_RTL433_Phy::json_to_rtl(struct JSON_value *json) {
             rtlholder->add_map(weatherdev);
         }
 
-        d = JSON_dict_get_number(json, "direction_deg", err);
+        d = tape.dict_get_number(obj, "direction_deg", err);
         if (err.length() == 0) {
             weatherdev->set_wind_dir((int32_t) d);
             weatherdev->get_wind_dir_rrd()->add_sample((int64_t) d,
                     globalreg->timestamp.tv_sec);
         }
 
-        d = JSON_dict_get_number(json, "winddirection", err);
+        d = tape.dict_get_number(obj, "winddirection", err);
         if (err.length() == 0) {
             weatherdev->set_wind_dir((int32_t) d);
             weatherdev->get_wind_dir_rrd()->add_sample((int64_t) d,
                     globalreg->timestamp.tv_sec);
         }
 
-        d = JSON_dict_get_number(json, "speed", err);
+        d = tape.dict_get_number(obj, "speed", err);
         if (err.length() == 0) {
             weatherdev->set_wind_speed((int32_t) d);
             weatherdev->get_wind_speed_rrd()->add_sample((int64_t) d,
                     globalreg->timestamp.tv_sec);
         }
 
-        d = JSON_dict_get_number(json, "windstrength", err);
+        d = tape.dict_get_number(obj, "windstrength", err);
         if (err.length() == 0) {
             weatherdev->set_wind_speed((int32_t) d);
             weatherdev->get_wind_speed_rrd()->add_sample((int64_t) d,
                     globalreg->timestamp.tv_sec);
         }
 
-        d = JSON_dict_get_number(json, "gust", err);
+        d = tape.dict_get_number(obj, "gust", err);
         if (err.length() == 0) {
             weatherdev->set_wind_gust((int32_t) d);
             weatherdev->get_wind_gust_rrd()->add_sample((int64_t) d,
                     globalreg->timestamp.tv_sec);
         }
 
-        d = JSON_dict_get_number(json, "rain", err);
+        d = tape.dict_get_number(obj, "rain", err);
         if (err.length() == 0) {
             weatherdev->set_rain((int32_t) d);
             weatherdev->get_rain_rrd()->add_sample((int64_t) d,
@@ -364,6 +386,8 @@ bool Kis_RTL433_Phy::json_to_rtl(struct JSON_value *json) {
         _MSG(info, MSGFLAG_INFO);
     }
 
+    devicetracker->ReportDeviceChange(basedev, DEVICE_EVENT_GROUP_PHY);
+
     return true;
 }
 
@@ -372,9 +396,12 @@ void Kis_RTL433_Phy::Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd,
         const char *url, const char *method, const char *upload_data,
         size_t *upload_data_size, std::stringstream &stream) {
 
-    return;
-}
+    if (strcmp(method, "GET") != 0)
+        return;
 
+    if (Httpd_StripSuffix(url) == "/phy/phyRTL433/ingest")
+        Httpd_Serialize(url, stream, ingest->FetchStats());
+}
 
 int Kis_RTL433_Phy::Httpd_PostComplete(Kis_Net_Httpd_Connection *concls) {
 
@@ -383,49 +410,96 @@ int Kis_RTL433_Phy::Httpd_PostComplete(Kis_Net_Httpd_Connection *concls) {
         return 1;
     }
 
-    bool handled = false;
+    int type;
 
-    if (concls->url != "/phy/phyRTL433/post_sensor_json.cmd")
+    if (concls->url == "/phy/phyRTL433/post_sensor_json.cmd")
+        type = ingest_single;
+    else if (concls->url == "/phy/phyRTL433/post_sensor_json_batch.cmd")
+        type = ingest_batch;
+    else
         return 1;
-   
-    if (concls->variable_cache.find("obj") != concls->variable_cache.end()) {
-        struct JSON_value *json;
-        string err;
 
-        json = JSON_parse(concls->variable_cache["obj"]->str(), err);
+    if (concls->variable_cache.find("obj") == concls->variable_cache.end()) {
+        concls->response_stream << "Invalid request";
+        concls->httpcode = 400;
+        return 1;
+    }
+
+    // Records are parsed and converted by the ingest worker; the sender
+    // only learns if it has to try again later
+    if (!ingest->Queue(type, concls->variable_cache["obj"]->str())) {
+        concls->response_stream << "Ingest queue full, try again later";
+        concls->httpcode = 503;
+        return 1;
+    }
+
+    concls->response_stream << "OK";
 
-        if (err.length() != 0 || json == NULL) {
-            concls->response_stream << "Invalid request: could not parse JSON";
-            concls->httpcode = 400;
+    return 1;
+}
+
+void Kis_RTL433_Phy::IngestRecord(const Kis_Phy_Ingest::record& rec,
+        unsigned int *accepted, unsigned int *rejected) {
+    // One tape re-used for every line of a batch
+    JSON_tape tape;
+    string err;
+
+    if (rec.type == ingest_single) {
+        if (tape.parse(rec.data.data(), rec.data.length(), err) &&
+                json_to_rtl_locked(tape, tape.root()))
+            (*accepted)++;
+        else
+            (*rejected)++;
+
+        return;
+    }
+
+    const string& obj = rec.data;
+    size_t pos = 0;
+
+    while (pos < obj.length()) {
+        size_t eol = obj.find('\n', pos);
+
+        if (eol == string::npos)
+            eol = obj.length();
+
+        const char *line = obj.data() + pos;
+        size_t line_len = eol - pos;
 
-            if (json != NULL)
-                JSON_delete(json);
+        pos = eol + 1;
 
-            return 1;
+        // Skip blank lines, including the trailing newline and any \r
+        // left by the sender
+        size_t p;
+        for (p = 0; p < line_len; p++) {
+            if (!isspace((unsigned char) line[p]))
+                break;
         }
 
-        // If we can't make sense of it, blow up
-        if (!json_to_rtl(json)) {
-            concls->response_stream << 
-                "Invalid request:  could not convert to RTL device";
-            concls->httpcode = 400;
-            handled = false;
-        } else {
-            handled = true;
+        if (p == line_len)
+            continue;
+
+        if (!tape.parse(line, line_len, err)) {
+            (*rejected)++;
+            continue;
         }
 
-        JSON_delete(json);
-    }
+        // A line may hold a single record or an array of them
+        if (tape.is_array(tape.root())) {
+            size_t root = tape.root();
 
-    // If we didn't handle it and got here, we don't know what it is, throw an
-    // error.
-    if (!handled) {
-        concls->response_stream << "Invalid request";
-        concls->httpcode = 400;
-    } else {
-        concls->response_stream << "OK";
+            for (size_t i = tape.first_child(root); i < tape.end(root);
+                    i = tape.next(i)) {
+                if (json_to_rtl_locked(tape, i))
+                    (*accepted)++;
+                else
+                    (*rejected)++;
+            }
+        } else if (json_to_rtl_locked(tape, tape.root())) {
+            (*accepted)++;
+        } else {
+            (*rejected)++;
+        }
     }
-
-    return 1;
 }
 
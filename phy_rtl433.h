@@ -26,6 +26,7 @@
 #include "trackedelement.h"
 #include "devicetracker_component.h"
 #include "phyhandler.h"
+#include "phy_ingest.h"
 #include "kismet_json.h"
 
 /* phy-rtl433
@@ -82,17 +83,13 @@ public:
     }
 
     // Simple average
-    static int64_t combine_vector(SharedTrackerElement e) {
-        TrackerElementVector v(e);
-
+    static int64_t combine_vector(const int64_t *v, size_t n) {
         int64_t avg = 0;
         int64_t avg_c = 0;
 
-        for (TrackerElementVector::iterator i = v.begin(); i != v.end(); ++i)  {
-            int64_t v = GetTrackerValue<int64_t>(*i);
-
-            if (v != default_val()) {
-                avg += GetTrackerValue<int64_t>(*i);
+        for (size_t i = 0; i < n; i++)  {
+            if (v[i] != default_val()) {
+                avg += v[i];
                 avg_c++;
             }
         }
@@ -391,12 +388,12 @@ protected:
 
 class Kis_RTL433_Phy : public Kis_Phy_Handler, public Kis_Net_Httpd_CPPStream_Handler {
 public:
-    Kis_RTL433_Phy() { }
+    Kis_RTL433_Phy() { ingest = NULL; }
 
     virtual ~Kis_RTL433_Phy();
 
     Kis_RTL433_Phy(GlobalRegistry *in_globalreg) :
-        Kis_Phy_Handler(in_globalreg) { };
+        Kis_Phy_Handler(in_globalreg) { ingest = NULL; };
 
 	// Build a strong version of ourselves
 	virtual Kis_Phy_Handler *CreatePhyHandler(GlobalRegistry *in_globalreg,
@@ -422,6 +419,8 @@ public:
 
     virtual int Httpd_PostComplete(Kis_Net_Httpd_Connection *concls);
 
+    virtual void Shutdown();
+
 protected:
     shared_ptr<Packetchain> packetchain;
     shared_ptr<EntryTracker> entrytracker;
@@ -431,12 +430,25 @@ protected:
 
     int pack_comp_common;
 
+    // Posted records are turned into devices by the ingest worker
+    enum ingest_type {
+        ingest_single, ingest_batch
+    };
+
+    Kis_Phy_Ingest *ingest;
+
+    void IngestRecord(const Kis_Phy_Ingest::record& in_rec,
+            unsigned int *ret_accepted, unsigned int *ret_rejected);
+
     // Convert a JSON record to a RTL-based device key
-    mac_addr json_to_mac(struct JSON_value *in_json);
+    mac_addr json_to_mac(const JSON_tape& in_tape, size_t in_obj);
 
     // convert to a device record & push into device tracker, return false
     // if we can't do anything with it
-    bool json_to_rtl(struct JSON_value *in_json);
+    bool json_to_rtl(const JSON_tape& in_tape, size_t in_obj);
+
+    // As json_to_rtl, with the device list already locked by the caller
+    bool json_to_rtl_locked(const JSON_tape& in_tape, size_t in_obj);
 
     double f_to_c(double f);
 
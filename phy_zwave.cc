@@ -51,13 +51,29 @@ Kis_Zwave_Phy::Kis_Zwave_Phy(GlobalRegistry *in_globalreg,
         globalreg->FetchGlobalAs<Kis_Httpd_Registry>("WEBREGISTRY");
     httpregistry->register_js_module("kismet_ui_zwave", 
             "/js/kismet.ui.zwave.js");
+
+    ingest = new Kis_Phy_Ingest(globalreg, devicetracker,
+            [this](const Kis_Phy_Ingest::record& rec, unsigned int *accepted,
+                unsigned int *rejected) {
+                IngestRecord(rec, accepted, rejected);
+            });
 }
 
 Kis_Zwave_Phy::~Kis_Zwave_Phy() {
+    delete ingest;
+}
 
+void Kis_Zwave_Phy::Shutdown() {
+    if (ingest != NULL)
+        ingest->Stop();
 }
 
 bool Kis_Zwave_Phy::Httpd_VerifyPath(const char *path, const char *method) {
+    if (strcmp(method, "GET") == 0) {
+        if (Httpd_StripSuffix(path) == "/phy/phyZwave/ingest")
+            return Httpd_CanSerialize(path);
+    }
+
     if (strcmp(method, "POST") == 0) {
         if (strcmp(path, "/phy/phyZwave/post_zwave_json.cmd") == 0)
             return true;
@@ -87,8 +103,6 @@ bool Kis_Zwave_Phy::json_to_record(struct JSON_value *json) {
     double dest_devid;
     double datasize;
 
-    devicelist_scope_locker slocker(devicetracker);
-
     // TODO parse the actual payload
    
     tempstr = JSON_dict_get_string(json, "home_id", err);
@@ -195,6 +209,8 @@ bool Kis_Zwave_Phy::json_to_record(struct JSON_value *json) {
                 MSGFLAG_INFO);
     }
 
+    devicetracker->ReportDeviceChange(basedev, DEVICE_EVENT_GROUP_PHY);
+
     return true;
 }
 
@@ -203,7 +219,11 @@ void Kis_Zwave_Phy::Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd,
         const char *url, const char *method, const char *upload_data,
         size_t *upload_data_size, std::stringstream &stream) {
 
-    return;
+    if (strcmp(method, "GET") != 0)
+        return;
+
+    if (Httpd_StripSuffix(url) == "/phy/phyZwave/ingest")
+        Httpd_Serialize(url, stream, ingest->FetchStats());
 }
 
 int Kis_Zwave_Phy::Httpd_PostComplete(Kis_Net_Httpd_Connection *concls) {
@@ -213,51 +233,48 @@ int Kis_Zwave_Phy::Httpd_PostComplete(Kis_Net_Httpd_Connection *concls) {
         return 1;
     }
 
-    bool handled = false;
-
     if (concls->url != "/phy/phyZwave/post_zwave_json.cmd")
         return 1;
    
-    if (concls->variable_cache.find("obj") != concls->variable_cache.end()) {
-        struct JSON_value *json;
-        string err;
+    if (concls->variable_cache.find("obj") == concls->variable_cache.end()) {
+        concls->response_stream << "Invalid request";
+        concls->httpcode = 400;
+        return 1;
+    }
 
-        json = JSON_parse(concls->variable_cache["obj"]->str(), err);
+    // Parsed and converted by the ingest worker
+    if (!ingest->Queue(0, concls->variable_cache["obj"]->str())) {
+        concls->response_stream << "Ingest queue full, try again later";
+        concls->httpcode = 503;
+        return 1;
+    }
 
-        if (err.length() != 0 || json == NULL) {
-            concls->response_stream << "Invalid request: could not parse JSON";
-            concls->httpcode = 400;
+    // Return a generic OK.  msgpack returns shouldn't get to here.
+    concls->response_stream << "OK";
 
-            if (json != NULL)
-                JSON_delete(json);
+    return 1;
+}
 
-            return 1;
-        }
+void Kis_Zwave_Phy::IngestRecord(const Kis_Phy_Ingest::record& rec,
+        unsigned int *accepted, unsigned int *rejected) {
+    struct JSON_value *json;
+    string err;
 
-        // If we can't make sense of it, blow up
-        if (!json_to_record(json)) {
-            concls->response_stream << 
-                "Invalid request:  could not convert to Z-Wave device";
-            concls->httpcode = 400;
-            handled = false;
-        } else {
-            handled = true;
-        }
+    json = JSON_parse(rec.data, err);
 
-        JSON_delete(json);
-    }
+    if (err.length() != 0 || json == NULL) {
+        (*rejected)++;
 
-    // If we didn't handle it and got here, we don't know what it is, throw an
-    // error.
-    if (!handled) {
-        concls->response_stream << "Invalid request";
-        concls->httpcode = 400;
-    } else {
-        // Return a generic OK.  msgpack returns shouldn't get to here.
-        concls->response_stream << "OK";
-    }
+        if (json != NULL)
+            JSON_delete(json);
 
-    return 1;
-}
+        return;
+    }
 
+    if (json_to_record(json))
+        (*accepted)++;
+    else
+        (*rejected)++;
 
+    JSON_delete(json);
+}
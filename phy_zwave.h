@@ -26,6 +26,7 @@
 #include "trackedelement.h"
 #include "devicetracker_component.h"
 #include "phyhandler.h"
+#include "phy_ingest.h"
 #include "kismet_json.h"
 
 /* phy-zwave
@@ -78,12 +79,12 @@ protected:
 
 class Kis_Zwave_Phy : public Kis_Phy_Handler, public Kis_Net_Httpd_CPPStream_Handler {
 public:
-    Kis_Zwave_Phy() { }
+    Kis_Zwave_Phy() { ingest = NULL; }
 
     virtual ~Kis_Zwave_Phy();
 
     Kis_Zwave_Phy(GlobalRegistry *in_globalreg) :
-        Kis_Phy_Handler(in_globalreg) { };
+        Kis_Phy_Handler(in_globalreg) { ingest = NULL; };
 
 	// Build a strong version of ourselves
 	virtual Kis_Phy_Handler *CreatePhyHandler(GlobalRegistry *in_globalreg,
@@ -109,6 +110,8 @@ public:
 
     virtual int Httpd_PostComplete(Kis_Net_Httpd_Connection *concls);
 
+    virtual void Shutdown();
+
 protected:
     shared_ptr<Packetchain> packetchain;
     shared_ptr<EntryTracker> entrytracker;
@@ -117,10 +120,17 @@ protected:
 
     int pack_comp_common;
 
+    // Posted records are turned into devices by the ingest worker
+    Kis_Phy_Ingest *ingest;
+
+    void IngestRecord(const Kis_Phy_Ingest::record& in_rec,
+            unsigned int *ret_accepted, unsigned int *ret_rejected);
+
     mac_addr id_to_mac(uint32_t in_homeid, uint8_t in_deviceid);
 
     // convert to a device record & push into device tracker, return false
-    // if we can't do anything with it
+    // if we can't do anything with it; the device list is locked by the
+    // caller
     bool json_to_record(struct JSON_value *in_json);
 
 };
@@ -117,6 +117,10 @@ public:
 	virtual void ExportLogRecord(kis_tracked_device_base *in_device, string in_logtype, 
 								 FILE *in_logfile, int in_lineindent) = 0;
 
+	// Stop anything the phy runs on threads of its own; called by the
+	// devicetracker before it locks the device list to shut down
+	virtual void Shutdown() { }
+
 
 protected:
 	GlobalRegistry *globalreg;
@@ -29,6 +29,7 @@
 #include "pipeclient.h"
 #include "messagebus.h"
 #include "pollabletracker.h"
+#include "ringbuf_shm.h"
 
 PipeClient::PipeClient(GlobalRegistry *in_globalreg, 
         shared_ptr<BufferHandlerGeneric> in_rbhandler) {
@@ -42,6 +43,11 @@ PipeClient::PipeClient(GlobalRegistry *in_globalreg,
 
     read_fd = -1;
     write_fd = -1;
+
+    shm_ring = NULL;
+    doorbell_fd = -1;
+
+    event_driven = false;
 }
 
 PipeClient::~PipeClient() {
@@ -79,9 +85,52 @@ int PipeClient::OpenPipes(int rpipe, int wpipe) {
         fcntl(write_fd, F_SETFL, fcntl(write_fd, F_GETFL, 0) | O_NONBLOCK);
     }
 
+    // Hand the pipes to the event backend if we can, otherwise stay in select()
+    shared_ptr<PollableTracker> pollabletracker =
+        static_pointer_cast<PollableTracker>(globalreg->FetchGlobal("POLLABLETRACKER"));
+
+    if (pollabletracker != NULL && pollabletracker->EventsAvailable()) {
+        event_driven = true;
+
+        if (read_fd > -1 && 
+                pollabletracker->AddEventFd(read_fd, this, true, false) < 0)
+            event_driven = false;
+
+        if (event_driven && write_fd > -1 &&
+                pollabletracker->AddEventFd(write_fd, this, false, true) < 0)
+            event_driven = false;
+
+        if (event_driven && doorbell_fd > -1 &&
+                pollabletracker->AddEventFd(doorbell_fd, this, true, false) < 0)
+            event_driven = false;
+
+        if (!event_driven) {
+            pollabletracker->RemoveEventFd(read_fd);
+            pollabletracker->RemoveEventFd(write_fd);
+        } else if (write_fd > -1) {
+            write_trigger.reset(new PollableWriteTrigger(pollabletracker,
+                        handler.get(), write_fd));
+        }
+    }
+
     return 0;
 }
 
+int PipeClient::OpenShmPipes(int rpipe, int wpipe, RingbufShm *in_ring) {
+    local_locker lock(&pipe_lock);
+
+    if (read_fd > -1 || write_fd > -1) {
+        _MSG("Pipe client asked to bind to pipes but already connected to a "
+                "pipe interface.", MSGFLAG_ERROR);
+        return -1;
+    }
+
+    shm_ring = in_ring;
+    doorbell_fd = in_ring->get_doorbell_fd();
+
+    return OpenPipes(rpipe, wpipe);
+}
+
 bool PipeClient::FetchConnected() {
     local_locker lock(&pipe_lock);
 
@@ -93,6 +142,9 @@ int PipeClient::MergeSet(int in_max_fd, fd_set *out_rset, fd_set *out_wset) {
 
     int max_fd = in_max_fd;
 
+    if (event_driven)
+        return max_fd;
+
     // If we have data waiting to be written, fill it in
     if (write_fd > -1 && handler->GetWriteBufferUsed()) {
         FD_SET(write_fd, out_wset);
@@ -100,6 +152,24 @@ int PipeClient::MergeSet(int in_max_fd, fd_set *out_rset, fd_set *out_wset) {
             max_fd = write_fd;
     }
 
+    // The data arrives in the shared ring; the pipe only has to be watched
+    // for closing
+    if (shm_ring != NULL) {
+        if (read_fd > -1) {
+            if (max_fd < read_fd)
+                max_fd = read_fd;
+            FD_SET(read_fd, out_rset);
+        }
+
+        if (doorbell_fd > -1) {
+            if (max_fd < doorbell_fd)
+                max_fd = doorbell_fd;
+            FD_SET(doorbell_fd, out_rset);
+        }
+
+        return max_fd;
+    }
+
     // If we have room to read set the readfd, otherwise skip it for now
     if (read_fd > -1) {
         if (handler->GetReadBufferAvailable() > 0) {
@@ -115,64 +185,161 @@ int PipeClient::MergeSet(int in_max_fd, fd_set *out_rset, fd_set *out_wset) {
 int PipeClient::Poll(fd_set& in_rset, fd_set& in_wset) {
     local_locker lock(&pipe_lock);
 
+    // fprintf(stderr, "debug - pipeclient - poll rfd %d wfd %d\n", read_fd, write_fd);
+
+    if (doorbell_fd > -1 && FD_ISSET(doorbell_fd, &in_rset))
+        ReadShm();
+
+    if (read_fd > -1 && FD_ISSET(read_fd, &in_rset)) {
+        if ((shm_ring != NULL ? ReadShmPipe() : ReadPipe()) < 0)
+            return 0;
+    }
+
+    if (write_fd > -1 && FD_ISSET(write_fd, &in_wset)) {
+        WritePipe(false);
+    }
+
+    return 0;
+}
+
+int PipeClient::PollEvent(int in_fd, bool in_read, bool in_write) {
+    local_locker lock(&pipe_lock);
+
+    int r = 0;
+
+    if (in_read && in_fd == doorbell_fd) {
+        ReadShm();
+        return 0;
+    }
+
+    if (in_read && in_fd == read_fd) {
+        if ((r = (shm_ring != NULL ? ReadShmPipe() : ReadPipe())) < 0)
+            return 0;
+    }
+
+    if (in_write && in_fd == write_fd) {
+        WritePipe(true);
+    }
+
+    return r;
+}
+
+int PipeClient::ReadPipe() {
+    local_locker lock(&pipe_lock);
+
     stringstream msg;
 
     uint8_t *buf;
     size_t len;
     ssize_t ret, iret;
 
-    // fprintf(stderr, "debug - pipeclient - poll rfd %d wfd %d\n", read_fd, write_fd);
+    // Allocate the biggest buffer we can fit in the ring, read as much
+    // as we can at once.
 
-    if (read_fd > -1 && FD_ISSET(read_fd, &in_rset)) {
-        // Allocate the biggest buffer we can fit in the ring, read as much
-        // as we can at once.
-       
-        while (handler->GetReadBufferAvailable()) {
-            len = handler->ZeroCopyReserveReadBufferData((void **) &buf,
-                    handler->GetReadBufferAvailable());
+    while (handler->GetReadBufferAvailable()) {
+        len = handler->ZeroCopyReserveReadBufferData((void **) &buf,
+                handler->GetReadBufferAvailable());
 
-            // fprintf(stderr, "debug - read buffer available reserved %lu\n", len);
+        // fprintf(stderr, "debug - read buffer available reserved %lu\n", len);
 
-            if ((ret = read(read_fd, buf, len)) <= 0) {
-                if (errno != EINTR && errno != EAGAIN) {
+        if ((ret = read(read_fd, buf, len)) <= 0) {
+            // A closed connection leaves errno untouched
+            if (ret == 0 || (errno != EINTR && errno != EAGAIN)) {
 
-                    if (ret == 0) {
-                        msg << "Pipe client closing - remote side closed pipe";
-                    } else {
-                        msg << "Pipe client error reading - " << kis_strerror_r(errno);
-                    }
+                if (ret == 0) {
+                    msg << "Pipe client closing - remote side closed pipe";
+                } else {
+                    msg << "Pipe client error reading - " << kis_strerror_r(errno);
+                }
 
-                    handler->CommitReadBufferData(buf, 0);
-                    handler->BufferError(msg.str());
+                handler->CommitReadBufferData(buf, 0);
+                handler->BufferError(msg.str());
 
-                    ClosePipes();
+                ClosePipes();
 
-                    // fprintf(stderr, "debug - pipeclient - returning from poll\n");
-                    return 0;
-                } else {
-                    // Jump out of read loop
-                    handler->CommitReadBufferData(buf, 0);
-                    break;
-                }
+                // fprintf(stderr, "debug - pipeclient - returning from poll\n");
+                return -1;
             } else {
-                // Insert into buffer
-                // fprintf(stderr, "debug - pipeclient committing %lu\n", ret);
-                iret = handler->CommitReadBufferData(buf, ret);
-
-                if (!iret) {
-                    // Die if we couldn't insert all our data, the error is already going
-                    // upstream.
-                    ClosePipes();
-                    return 0;
-                }
+                // Jump out of read loop
+                handler->CommitReadBufferData(buf, 0);
+                return 0;
             }
+        } else {
+            // Insert into buffer
+            // fprintf(stderr, "debug - pipeclient committing %lu\n", ret);
+            iret = handler->CommitReadBufferData(buf, ret);
 
-            // delete[] buf;
+            if (!iret) {
+                // Die if we couldn't insert all our data, the error is already going
+                // upstream.
+                ClosePipes();
+                return -1;
+            }
         }
+
+        // delete[] buf;
+    }
+
+    return 1;
+}
+
+void PipeClient::ReadShm() {
+    local_locker lock(&pipe_lock);
+
+    if (shm_ring == NULL)
+        return;
+
+    shm_ring->ack_doorbell();
+
+    // Ask for the next doorbell before looking, so nothing written after this
+    // look goes unannounced.  The capture binary doesn't ring again until then,
+    // however much it writes.
+    shm_ring->arm_doorbell();
+
+    size_t used = shm_ring->used();
+
+    if (used > 0)
+        handler->TriggerReadBufferAvailable(used);
+}
+
+int PipeClient::ReadShmPipe() {
+    local_locker lock(&pipe_lock);
+
+    stringstream msg;
+
+    uint8_t buf[64];
+    ssize_t ret;
+
+    if ((ret = read(read_fd, buf, sizeof(buf))) < 0) {
+        if (errno == EINTR || errno == EAGAIN)
+            return 0;
+
+        msg << "Pipe client error reading - " << kis_strerror_r(errno);
+    } else if (ret == 0) {
+        msg << "Pipe client closing - remote side closed pipe";
+    } else {
+        msg << "Pipe client got data on the pipe of a shared memory connection; the "
+            "capture binary may not support the shared memory transport, set "
+            "datasource_ipc_shm=false";
     }
 
-    if (write_fd > -1 && FD_ISSET(write_fd, &in_wset) && 
-            (len = handler->GetWriteBufferUsed()) > 0) {
+    handler->BufferError(msg.str());
+
+    ClosePipes();
+
+    return -1;
+}
+
+int PipeClient::WritePipe(bool in_drain) {
+    local_locker lock(&pipe_lock);
+
+    stringstream msg;
+
+    uint8_t *buf;
+    size_t len;
+    ssize_t ret, iret;
+
+    while (write_fd > -1 && (len = handler->GetWriteBufferUsed()) > 0) {
         // Peek the data into our buffer
         ret = handler->ZeroCopyPeekWriteBufferData((void **) &buf, len);
 
@@ -187,8 +354,13 @@ int PipeClient::Poll(fd_set& in_rset, fd_set& in_wset) {
                 ClosePipes();
                 // Push the error upstream
                 handler->BufferError(msg.str());
-                return 0;
+                return -1;
             }
+
+            handler->PeekFreeWriteBufferData(buf);
+
+            // Wait for the pipe to become writable again
+            break;
         } else {
             // Consume whatever we managed to write
             handler->PeekFreeWriteBufferData(buf);
@@ -196,6 +368,9 @@ int PipeClient::Poll(fd_set& in_rset, fd_set& in_wset) {
         }
 
         // delete[] buf;
+
+        if (!in_drain)
+            break;
     }
 
     return 0;
@@ -204,6 +379,26 @@ int PipeClient::Poll(fd_set& in_rset, fd_set& in_wset) {
 void PipeClient::ClosePipes() {
     local_locker lock(&pipe_lock);
 
+    if (event_driven) {
+        shared_ptr<PollableTracker> pollabletracker =
+            static_pointer_cast<PollableTracker>(globalreg->FetchGlobal("POLLABLETRACKER"));
+
+        write_trigger.reset();
+
+        if (pollabletracker != NULL) {
+            pollabletracker->RemoveEventFd(read_fd);
+            pollabletracker->RemoveEventFd(write_fd);
+            pollabletracker->RemoveEventFd(doorbell_fd);
+        }
+
+        event_driven = false;
+    }
+
+    // The doorbell belongs to the ring
+    shm_ring = NULL;
+    doorbell_fd = -1;
+
+
     if (read_fd > -1)
         close(read_fd);
 
@@ -30,6 +30,9 @@
 #include "buffer_handler.h"
 #include "pollable.h"
 
+class PollableWriteTrigger;
+class RingbufShm;
+
 // Pipe client code for communicating with another process
 //
 // Handles r/w against two pipe(2) pairs which should be provided by 
@@ -46,11 +49,18 @@ public:
 
     // Bind to a r/w pair of pipes
     int OpenPipes(int rpipe, int wpipe);
+
+    // Bind to a pair of pipes where the other side writes its data into a
+    // shared ring instead of the read pipe; in_ring must be the read buffer of
+    // the handler.  The read pipe is still watched so a closed connection is
+    // noticed.
+    int OpenShmPipes(int rpipe, int wpipe, RingbufShm *in_ring);
     void ClosePipes();
 
     // Pollable interface
     virtual int MergeSet(int in_max_fd, fd_set *out_rset, fd_set *out_wset);
     virtual int Poll(fd_set& in_rset, fd_set& in_wset);
+    virtual int PollEvent(int in_fd, bool in_read, bool in_write);
 
     bool FetchConnected();
 
@@ -61,6 +71,42 @@ protected:
     shared_ptr<BufferHandlerGeneric> handler;
 
     int read_fd, write_fd;
+
+    // Shared ring and its doorbell, owned by the handler
+    RingbufShm *shm_ring;
+    int doorbell_fd;
+
+    // Are we registered with the event backend instead of select()?
+    bool event_driven;
+    shared_ptr<PollableWriteTrigger> write_trigger;
+
+    // Read until the pipe would block or the buffer is full
+    //
+    // returns:
+    // 1    Buffer filled before the pipe was drained
+    // 0    Pipe drained
+    // -1   Error, pipes closed
+    int ReadPipe();
+
+    // Hand anything new in the shared ring to the handler and ask to be rung
+    // for more
+    void ReadShm();
+
+    // Watch the read pipe of a shared ring connection, which should only ever
+    // close
+    //
+    // returns:
+    // 0    Nothing to do
+    // -1   Error, pipes closed
+    int ReadShmPipe();
+
+    // Write pending data; if in_drain is set, keep writing until the buffer is
+    // empty or the pipe would block
+    //
+    // returns:
+    // 0    Success
+    // -1   Error, pipes closed
+    int WritePipe(bool in_drain);
 };
 
 #endif
@@ -36,6 +36,7 @@
 #include "plugintracker.h"
 #include "version.h"
 #include "kis_httpd_registry.h"
+#include "packetchain.h"
 
 Plugintracker::Plugintracker(GlobalRegistry *in_globalreg) :
     LifetimeGlobal(),
@@ -47,6 +48,15 @@ Plugintracker::Plugintracker(GlobalRegistry *in_globalreg) :
     pthread_mutexattr_settype(&mutexattr, PTHREAD_MUTEX_RECURSIVE);
     pthread_mutex_init(&plugin_lock, &mutexattr);
 
+    fastfilter_handler_id = -1;
+
+    pack_comp_fastfilter =
+        globalreg->packetchain->RegisterPacketComponent("FASTFILTER");
+    pack_comp_80211 = globalreg->packetchain->RegisterPacketComponent("PHY80211");
+    pack_comp_l1info = globalreg->packetchain->RegisterPacketComponent("RADIODATA");
+    pack_comp_linkframe = globalreg->packetchain->RegisterPacketComponent("LINKFRAME");
+    pack_comp_decap = globalreg->packetchain->RegisterPacketComponent("DECAP");
+
     int option_idx = 0;
     int cmdline_disable = 0;
     int config_disable = 0;
@@ -370,6 +380,8 @@ int Plugintracker::ActivatePlugins() {
                         "skipping.", MSGFLAG_ERROR);
                 continue;
             }
+
+            LoadFastFilter(x);
         }
 
         // If we have a JS module, load it
@@ -408,6 +420,8 @@ int Plugintracker::ActivatePlugins() {
 
     plugin_preload.clear();
 
+    StartFastFilters();
+
     return 1;
 }
 
@@ -442,6 +456,10 @@ int Plugintracker::ShutdownPlugins() {
 
     _MSG("Shutting down plugins...", MSGFLAG_INFO);
 
+    // The filters have to be out of the packetchain before their plugins are
+    // unloaded
+    StopFastFilters();
+
     plugin_registry_vec.clear();
     plugin_preload.clear();
 
@@ -75,6 +75,17 @@
 //
 // Plugins should return negative on failure, non-negative on success.
 //
+// Plugins which only need to look at frames and decide what happens to them
+// may instead, or as well, export a fast filter with the narrow, versioned C
+// ABI in kis_fastfilter.h:
+//
+// int kis_fastfilter_register(struct kis_fastfilter_registration *)
+//
+// which is called once the plugin has activated.  Fast filters are run in the
+// parallel dissector threads on batches of packets, without the packetchain
+// lock; their verdicts mark packets filtered, and their tags are attached to
+// the packet as a kis_fastfilter_tags component ("FASTFILTER").
+//
 //
 // Kismet plugins are first-order citizens in the ecosystem - a plugin
 // is passed the global registry and is able to look up and interact
@@ -99,8 +110,11 @@
 #include <sys/types.h>
 #include <dlfcn.h>
 #include <dirent.h>
+#include <atomic>
 
 #include "globalregistry.h"
+#include "packet.h"
+#include "kis_fastfilter.h"
 
 #include "trackedelement.h"
 #include "kis_net_microhttpd.h"
@@ -116,6 +130,9 @@ public:
         reserve_fields(NULL);
 
         dlfile = NULL;
+        fastfilter_frames = 0;
+        fastfilter_dropped = 0;
+        fastfilter_errors = 0;
     }
 
     PluginRegistrationData(GlobalRegistry *in_globalreg, int in_id,
@@ -126,6 +143,9 @@ public:
         reserve_fields(e);
 
         dlfile = NULL;
+        fastfilter_frames = 0;
+        fastfilter_dropped = 0;
+        fastfilter_errors = 0;
     }
 
     virtual ~PluginRegistrationData() {
@@ -156,7 +176,62 @@ public:
         return dlfile;
     }
 
+    __Proxy(plugin_fastfilter, string, string, string, plugin_fastfilter);
+
+    // Fast filter tags, in bit order
+    void set_fastfilter_tags(const kis_fastfilter_registration *in_reg) {
+        fastfilter_tag_names.clear();
+
+        for (uint32_t x = 0; x < in_reg->num_tags; x++)
+            fastfilter_tag_names.push_back(in_reg->tag_names[x]);
+
+        fastfilter_tag_counts.reset(new std::atomic<uint64_t>[in_reg->num_tags]);
+        for (uint32_t x = 0; x < in_reg->num_tags; x++)
+            fastfilter_tag_counts[x] = 0;
+    }
+
+    const vector<string>& get_fastfilter_tags() {
+        return fastfilter_tag_names;
+    }
+
+    // Counted from the dissector threads, copied into the record as it is
+    // serialized
+    void count_fastfilter(uint64_t in_frames, uint64_t in_dropped) {
+        fastfilter_frames.fetch_add(in_frames, std::memory_order_relaxed);
+        fastfilter_dropped.fetch_add(in_dropped, std::memory_order_relaxed);
+    }
+
+    void count_fastfilter_error() {
+        fastfilter_errors++;
+    }
+
+    void count_fastfilter_tag(unsigned int in_bit) {
+        fastfilter_tag_counts[in_bit].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    virtual void pre_serialize() {
+        tracker_component::pre_serialize();
+
+        set_int_plugin_fastfilter_frames(fastfilter_frames);
+        set_int_plugin_fastfilter_dropped(fastfilter_dropped);
+        set_int_plugin_fastfilter_errors(fastfilter_errors);
+
+        plugin_fastfilter_tags->clear_stringmap();
+
+        for (size_t x = 0; x < fastfilter_tag_names.size(); x++) {
+            SharedTrackerElement c(new TrackerElement(TrackerUInt64,
+                        plugin_fastfilter_tag_id));
+            c->set((uint64_t) fastfilter_tag_counts[x]);
+            plugin_fastfilter_tags->add_stringmap(fastfilter_tag_names[x], c);
+        }
+    }
+
 protected:
+    __ProxySet(int_plugin_fastfilter_frames, uint64_t, uint64_t, plugin_fastfilter_frames);
+    __ProxySet(int_plugin_fastfilter_dropped, uint64_t, uint64_t, 
+            plugin_fastfilter_dropped);
+    __ProxySet(int_plugin_fastfilter_errors, uint64_t, uint64_t, plugin_fastfilter_errors);
+
     virtual void register_fields() {
         tracker_component::register_fields();
 
@@ -176,6 +251,20 @@ protected:
                 "path to plugin content", &plugin_path);
         RegisterField("kismet.plugin.jsmodule", TrackerString,
                 "Plugin javascript module", &plugin_js);
+
+        RegisterField("kismet.plugin.fastfilter", TrackerString,
+                "name of the fast filter provided by the plugin", &plugin_fastfilter);
+        RegisterField("kismet.plugin.fastfilter.frames", TrackerUInt64,
+                "frames seen by the fast filter", &plugin_fastfilter_frames);
+        RegisterField("kismet.plugin.fastfilter.dropped", TrackerUInt64,
+                "frames filtered by the fast filter", &plugin_fastfilter_dropped);
+        RegisterField("kismet.plugin.fastfilter.errors", TrackerUInt64,
+                "batches the fast filter failed", &plugin_fastfilter_errors);
+        RegisterField("kismet.plugin.fastfilter.tags", TrackerStringMap,
+                "frames given each tag by the fast filter", &plugin_fastfilter_tags);
+        plugin_fastfilter_tag_id =
+            RegisterField("kismet.plugin.fastfilter.tag", TrackerUInt64,
+                    "frames given the tag");
     }
 
     SharedTrackerElement plugin_name;
@@ -189,8 +278,19 @@ protected:
 
     SharedTrackerElement plugin_js;
 
+    SharedTrackerElement plugin_fastfilter;
+    SharedTrackerElement plugin_fastfilter_frames;
+    SharedTrackerElement plugin_fastfilter_dropped;
+    SharedTrackerElement plugin_fastfilter_errors;
+    SharedTrackerElement plugin_fastfilter_tags;
+    int plugin_fastfilter_tag_id;
+
     void *dlfile;
 
+    std::atomic<uint64_t> fastfilter_frames, fastfilter_dropped, fastfilter_errors;
+    vector<string> fastfilter_tag_names;
+    std::unique_ptr<std::atomic<uint64_t>[]> fastfilter_tag_counts;
+
 };
 typedef shared_ptr<PluginRegistrationData> SharedPluginData;
 
@@ -225,6 +325,16 @@ struct plugin_server_info {
 // version mismatch, immediately return -1.
 typedef int (*plugin_version_check)(plugin_server_info *);
 
+// Tags given to a packet by the fast filters
+class kis_fastfilter_tags : public packet_component {
+public:
+    kis_fastfilter_tags() {
+        self_destruct = 1;
+    }
+
+    vector<string> tags;
+};
+
 // Plugin management class
 class Plugintracker : public LifetimeGlobal,
     public Kis_Net_Httpd_CPPStream_Handler {
@@ -278,6 +388,32 @@ protected:
 
     // List of plugins before they're loaded
     vector<SharedPluginData> plugin_preload;
+
+    // Fast filters of the activated plugins.  The list is complete before the
+    // batch handler is registered, and the handler is removed before the list
+    // changes, so the dissector threads read it without a lock.
+    struct fastfilter {
+        SharedPluginData plugin;
+        kis_fastfilter_registration reg;
+    };
+
+    vector<fastfilter> fastfilters;
+    int fastfilter_handler_id;
+
+    int pack_comp_fastfilter, pack_comp_80211, pack_comp_l1info, pack_comp_linkframe,
+        pack_comp_decap;
+
+    // Look for and register the fast filter of an activated plugin
+    void LoadFastFilter(SharedPluginData in_plugin);
+
+    // Start running the fast filters, once every plugin has been loaded, and
+    // stop before they are unloaded
+    void StartFastFilters();
+    void StopFastFilters();
+
+    // Packetchain batch handler
+    void RunFastFilters(kis_packet **in_packs, size_t in_num);
+    void FillFastFilterFrame(kis_packet *in_pack, kis_fastfilter_frame *ret_frame);
 };
 
 #endif
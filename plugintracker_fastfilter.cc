@@ -0,0 +1,265 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <dlfcn.h>
+#include <string.h>
+
+#include "globalregistry.h"
+#include "messagebus.h"
+#include "plugintracker.h"
+#include "packetchain.h"
+#include "phy_80211.h"
+
+/* Fast filters
+ *
+ * The filters of every plugin are run on each batch in the order the plugins
+ * were loaded.  The frame views of a batch are built once and shared by every
+ * filter; the verdicts and tags are reset between filters, so a filter only
+ * ever sees its own.
+ */
+
+void Plugintracker::LoadFastFilter(SharedPluginData in_plugin) {
+    kis_fastfilter_register_func reg_sym =
+        (kis_fastfilter_register_func) dlsym(in_plugin->get_plugin_dlfile(),
+                "kis_fastfilter_register");
+
+    if (reg_sym == NULL)
+        return;
+
+    fastfilter f;
+
+    memset(&(f.reg), 0, sizeof(kis_fastfilter_registration));
+    f.reg.api_version = KIS_FASTFILTER_API_VERSION;
+
+    if ((*reg_sym)(&(f.reg)) < 0) {
+        _MSG("Plugin '" + in_plugin->get_plugin_path() + "' could not register "
+                "its fast filter; ensure that the plugin has been recompiled for "
+                "the proper version of Kismet.", MSGFLAG_ERROR);
+        return;
+    }
+
+    if (f.reg.api_version != KIS_FASTFILTER_API_VERSION || f.reg.filter == NULL ||
+            f.reg.num_tags > KIS_FASTFILTER_MAX_TAGS ||
+            (f.reg.num_tags != 0 && f.reg.tag_names == NULL)) {
+        _MSG("Plugin '" + in_plugin->get_plugin_path() + "' registered an "
+                "invalid fast filter, skipping it.", MSGFLAG_ERROR);
+        return;
+    }
+
+    for (uint32_t x = 0; x < f.reg.num_tags; x++) {
+        if (f.reg.tag_names[x] == NULL) {
+            _MSG("Plugin '" + in_plugin->get_plugin_path() + "' registered an "
+                    "invalid fast filter tag, skipping the filter.", MSGFLAG_ERROR);
+            return;
+        }
+    }
+
+    f.plugin = in_plugin;
+
+    in_plugin->set_plugin_fastfilter(f.reg.name != NULL ?
+            string(f.reg.name) : in_plugin->get_plugin_name());
+    in_plugin->set_fastfilter_tags(&(f.reg));
+
+    fastfilters.push_back(f);
+
+    _MSG("Plugin '" + in_plugin->get_plugin_name() + "' registered fast filter '" +
+            in_plugin->get_plugin_fastfilter() + "'", MSGFLAG_INFO);
+}
+
+void Plugintracker::StartFastFilters() {
+    if (fastfilters.size() == 0 || fastfilter_handler_id >= 0)
+        return;
+
+    fastfilter_handler_id =
+        globalreg->packetchain->RegisterBatchHandler([this](kis_packet **in_packs,
+                    size_t in_num) {
+                RunFastFilters(in_packs, in_num);
+            }, "fastfilter");
+}
+
+void Plugintracker::StopFastFilters() {
+    if (fastfilter_handler_id >= 0) {
+        shared_ptr<Packetchain> packetchain =
+            globalreg->FetchGlobalAs<Packetchain>("PACKETCHAIN");
+
+        // Once removed, no dissector thread is still inside a filter
+        if (packetchain != NULL)
+            packetchain->RemoveBatchHandler(fastfilter_handler_id);
+
+        fastfilter_handler_id = -1;
+    }
+
+    for (auto f : fastfilters) {
+        if (f.reg.release != NULL)
+            (*(f.reg.release))(f.reg.ctx);
+    }
+
+    fastfilters.clear();
+}
+
+void Plugintracker::FillFastFilterFrame(kis_packet *in_pack,
+        kis_fastfilter_frame *ret_frame) {
+    memset(ret_frame, 0, sizeof(kis_fastfilter_frame));
+
+    ret_frame->ts_sec = in_pack->ts.tv_sec;
+    ret_frame->ts_usec = in_pack->ts.tv_usec;
+    ret_frame->mcs = -1;
+
+    if (in_pack->error)
+        ret_frame->flags |= KIS_FASTFILTER_FRAME_ERROR;
+
+    kis_datachunk *chunk = (kis_datachunk *) in_pack->fetch(pack_comp_decap);
+
+    if (chunk == NULL)
+        chunk = (kis_datachunk *) in_pack->fetch(pack_comp_linkframe);
+
+    if (chunk != NULL) {
+        ret_frame->dlt = chunk->dlt;
+        ret_frame->length = chunk->length;
+        ret_frame->data = chunk->data;
+    }
+
+    dot11_packinfo *dot11info = (dot11_packinfo *) in_pack->fetch(pack_comp_80211);
+
+    if (dot11info != NULL) {
+        ret_frame->flags |= KIS_FASTFILTER_FRAME_DOT11;
+
+        if (dot11info->corrupt)
+            ret_frame->flags |= KIS_FASTFILTER_FRAME_ERROR;
+
+        // Take the type and flags as they are in the frame, rather than our own
+        // enumeration of them
+        if (chunk != NULL && chunk->dlt == KDLT_IEEE802_11 && chunk->length >= 2) {
+            ret_frame->type = (chunk->data[0] >> 2) & 0x03;
+            ret_frame->subtype = (chunk->data[0] >> 4) & 0x0F;
+
+            if (chunk->data[1] & 0x04)
+                ret_frame->flags |= KIS_FASTFILTER_FRAME_FRAGMENT;
+            if (chunk->data[1] & 0x08)
+                ret_frame->flags |= KIS_FASTFILTER_FRAME_RETRY;
+            if (chunk->data[1] & 0x40)
+                ret_frame->flags |= KIS_FASTFILTER_FRAME_PROTECTED;
+        }
+
+        ret_frame->distrib = dot11info->distrib;
+        ret_frame->sequence = dot11info->sequence_number;
+        ret_frame->fragment = dot11info->frag_number;
+        ret_frame->header_len = dot11info->header_offset;
+
+        for (unsigned int x = 0; x < 6; x++) {
+            ret_frame->source[x] = dot11info->source_mac[x];
+            ret_frame->dest[x] = dot11info->dest_mac[x];
+            ret_frame->bssid[x] = dot11info->bssid_mac[x];
+            ret_frame->other[x] = dot11info->other_mac[x];
+        }
+    }
+
+    kis_layer1_packinfo *l1info =
+        (kis_layer1_packinfo *) in_pack->fetch(pack_comp_l1info);
+
+    if (l1info != NULL) {
+        ret_frame->flags |= KIS_FASTFILTER_FRAME_L1;
+
+        ret_frame->freq_khz = l1info->freq_khz;
+
+        if (l1info->signal_type == kis_l1_signal_type_dbm) {
+            ret_frame->flags |= KIS_FASTFILTER_FRAME_DBM;
+            ret_frame->signal = l1info->signal_dbm;
+            ret_frame->noise = l1info->noise_dbm;
+        } else {
+            ret_frame->signal = l1info->signal_rssi;
+            ret_frame->noise = l1info->noise_rssi;
+        }
+
+        ret_frame->datarate = l1info->datarate;
+        ret_frame->mcs = l1info->mcs;
+        ret_frame->airtime_usec = l1info->airtime_usec;
+    }
+}
+
+void Plugintracker::RunFastFilters(kis_packet **in_packs, size_t in_num) {
+    // Kept per thread, so a batch doesn't allocate once the thread warms up
+    static thread_local vector<kis_fastfilter_frame> frames;
+    static thread_local vector<uint8_t> verdicts;
+    static thread_local vector<uint32_t> tags;
+
+    if (frames.size() < in_num) {
+        frames.resize(in_num);
+        verdicts.resize(in_num);
+        tags.resize(in_num);
+    }
+
+    for (size_t x = 0; x < in_num; x++)
+        FillFastFilterFrame(in_packs[x], &(frames[x]));
+
+    kis_fastfilter_batch batch;
+
+    batch.count = in_num;
+    batch.frames = frames.data();
+    batch.verdicts = verdicts.data();
+    batch.tags = tags.data();
+
+    for (auto& f : fastfilters) {
+        memset(batch.verdicts, KIS_FASTFILTER_PASS, in_num);
+        memset(batch.tags, 0, sizeof(uint32_t) * in_num);
+
+        if ((*(f.reg.filter))(f.reg.ctx, &batch) < 0) {
+            f.plugin->count_fastfilter_error();
+            continue;
+        }
+
+        uint64_t dropped = 0;
+
+        for (size_t x = 0; x < in_num; x++) {
+            if (batch.verdicts[x] == KIS_FASTFILTER_DROP) {
+                in_packs[x]->filtered = 1;
+                dropped++;
+            }
+
+            // Tags past the ones the filter defined are ignored
+            uint32_t t = batch.tags[x];
+
+            if (f.reg.num_tags < 32)
+                t &= (1U << f.reg.num_tags) - 1;
+
+            if (t == 0)
+                continue;
+
+            kis_fastfilter_tags *ptags =
+                (kis_fastfilter_tags *) in_packs[x]->fetch(pack_comp_fastfilter);
+
+            if (ptags == NULL) {
+                ptags = new kis_fastfilter_tags();
+                in_packs[x]->insert(pack_comp_fastfilter, ptags);
+            }
+
+            for (unsigned int b = 0; b < f.reg.num_tags; b++) {
+                if ((t & (1U << b)) == 0)
+                    continue;
+
+                ptags->tags.push_back(f.plugin->get_fastfilter_tags()[b]);
+                f.plugin->count_fastfilter_tag(b);
+            }
+        }
+
+        f.plugin->count_fastfilter(in_num, dropped);
+    }
+}
+
@@ -33,6 +33,24 @@ class Pollable {
 public:
 	virtual int MergeSet(int in_max_fd, fd_set *out_rset, fd_set *out_wset) = 0;
 	virtual int Poll(fd_set& in_rset, fd_set& in_wset) = 0;
+
+    // Event-driven polling.  A pollable which registers its descriptors with
+    // PollableTracker::AddEventFd is no longer merged into select(); instead
+    // PollEvent is called for a descriptor when it becomes readable or writable.
+    //
+    // Events are edge-triggered, so PollEvent must read and write until the
+    // descriptor would block.  If it has to stop early (such as when the read
+    // buffer is full) it returns 1 to be called again on the next loop.
+    //
+    // returns:
+    // 1    Call again on the next loop
+    // 0    Handled
+    // -1   Error
+    virtual int PollEvent(int in_fd __attribute__((unused)), 
+            bool in_read __attribute__((unused)), 
+            bool in_write __attribute__((unused))) {
+        return 0;
+    }
 };
 
 #endif
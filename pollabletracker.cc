@@ -16,7 +16,19 @@
     Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 */
 
+#include "config.h"
+
+#include <fcntl.h>
+#include <errno.h>
+
+#if defined(HAVE_SYS_EPOLL_H)
+#include <sys/epoll.h>
+#elif defined(HAVE_SYS_EVENT_H)
+#include <sys/event.h>
+#endif
+
 #include "pollabletracker.h"
+#include "messagebus.h"
 
 PollableTracker::PollableTracker(GlobalRegistry *in_globalreg) {
     globalreg = in_globalreg;
@@ -25,11 +37,52 @@ PollableTracker::PollableTracker(GlobalRegistry *in_globalreg) {
     pthread_mutexattr_init(&mutexattr);
     pthread_mutexattr_settype(&mutexattr, PTHREAD_MUTEX_RECURSIVE);
 	pthread_mutex_init(&pollable_mutex, &mutexattr);
+	pthread_mutex_init(&event_mutex, &mutexattr);
+
+    LockProfiler::NameMutex(&pollable_mutex, "pollable_mutex");
+
+    select_dirty = true;
+
+    event_fd = -1;
+    wakeup_pipe[0] = -1;
+    wakeup_pipe[1] = -1;
+
+#if defined(HAVE_SYS_EPOLL_H)
+    event_fd = epoll_create1(EPOLL_CLOEXEC);
+#elif defined(HAVE_SYS_EVENT_H)
+    event_fd = kqueue();
+
+    if (event_fd >= 0)
+        fcntl(event_fd, F_SETFD, fcntl(event_fd, F_GETFD, 0) | FD_CLOEXEC);
+#endif
+
+    if (event_fd >= 0) {
+        if (pipe(wakeup_pipe) < 0) {
+            close(event_fd);
+            event_fd = -1;
+        } else {
+            for (unsigned int p = 0; p < 2; p++) {
+                fcntl(wakeup_pipe[p], F_SETFL, 
+                        fcntl(wakeup_pipe[p], F_GETFL, 0) | O_NONBLOCK);
+                fcntl(wakeup_pipe[p], F_SETFD, 
+                        fcntl(wakeup_pipe[p], F_GETFD, 0) | FD_CLOEXEC);
+            }
+        }
+    }
 }
 
 PollableTracker::~PollableTracker() {
     local_eol_locker lock(&pollable_mutex);
 
+    if (event_fd >= 0) {
+        close(event_fd);
+        close(wakeup_pipe[0]);
+        close(wakeup_pipe[1]);
+    }
+
+    LockProfiler::ForgetMutex(&pollable_mutex);
+
+    pthread_mutex_destroy(&event_mutex);
     pthread_mutex_destroy(&pollable_mutex);
 }
 
@@ -61,7 +114,29 @@ void PollableTracker::Maintenance() {
     for (auto i = add_vec.begin(); i != add_vec.end(); ++i) {
         pollable_vec.push_back(*i);
     }
+
+    local_locker elock(&event_mutex);
+
+    if (remove_vec.size() != 0 || add_vec.size() != 0)
+        select_dirty = true;
+
+    remove_vec.clear();
     add_vec.clear();
+
+    if (!select_dirty)
+        return;
+
+    select_vec.clear();
+    live_set.clear();
+
+    for (auto i = pollable_vec.begin(); i != pollable_vec.end(); ++i) {
+        live_set.insert(i->get());
+
+        if (event_owner_count.find(i->get()) == event_owner_count.end())
+            select_vec.push_back(*i);
+    }
+
+    select_dirty = false;
 }
 
 int PollableTracker::MergePollableFds(fd_set *rset, fd_set *wset) {
@@ -74,10 +149,20 @@ int PollableTracker::MergePollableFds(fd_set *rset, fd_set *wset) {
     FD_ZERO(rset);
     FD_ZERO(wset);
 
-    for (auto i = pollable_vec.begin(); i != pollable_vec.end(); ++i) {
+    for (auto i = select_vec.begin(); i != select_vec.end(); ++i) {
         max_fd = (*i)->MergeSet(max_fd, rset, wset);
     }
 
+    if (event_fd >= 0) {
+        FD_SET(event_fd, rset);
+        FD_SET(wakeup_pipe[0], rset);
+
+        if (max_fd < event_fd)
+            max_fd = event_fd;
+        if (max_fd < wakeup_pipe[0])
+            max_fd = wakeup_pipe[0];
+    }
+
     return max_fd;
 }
 
@@ -88,13 +173,241 @@ int PollableTracker::ProcessPollableSelect(fd_set rset, fd_set wset) {
 
     Maintenance();
 
-    for (auto i = pollable_vec.begin(); i != pollable_vec.end(); ++i) {
+    for (auto i = select_vec.begin(); i != select_vec.end(); ++i) {
         r = (*i)->Poll(rset, wset);
 
         if (r >= 0)
             num++;
     }
 
+    ProcessEvents(rset);
+
     return num;
 }
 
+bool PollableTracker::EventsAvailable() {
+    return event_fd >= 0;
+}
+
+int PollableTracker::AddEventFd(int in_fd, Pollable *in_pollable, 
+        bool in_read, bool in_write) {
+    local_locker lock(&event_mutex);
+
+    if (event_fd < 0)
+        return -1;
+
+#if defined(HAVE_SYS_EPOLL_H)
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(struct epoll_event));
+    ev.events = EPOLLET;
+    ev.data.fd = in_fd;
+
+    if (in_read)
+        ev.events |= EPOLLIN | EPOLLRDHUP;
+    if (in_write)
+        ev.events |= EPOLLOUT;
+
+    if (epoll_ctl(event_fd, EPOLL_CTL_ADD, in_fd, &ev) < 0) {
+        _MSG("Unable to add descriptor to epoll: " + kis_strerror_r(errno),
+                MSGFLAG_ERROR);
+        return -1;
+    }
+#elif defined(HAVE_SYS_EVENT_H)
+    struct kevent ev[2];
+    int nev = 0;
+
+    if (in_read)
+        EV_SET(&ev[nev++], in_fd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, NULL);
+    if (in_write)
+        EV_SET(&ev[nev++], in_fd, EVFILT_WRITE, EV_ADD | EV_CLEAR, 0, 0, NULL);
+
+    if (kevent(event_fd, ev, nev, NULL, 0, NULL) < 0) {
+        _MSG("Unable to add descriptor to kqueue: " + kis_strerror_r(errno),
+                MSGFLAG_ERROR);
+        return -1;
+    }
+#endif
+
+    event_rec rec;
+    rec.pollable = in_pollable;
+    rec.read = in_read;
+    rec.write = in_write;
+
+    event_fd_map[in_fd] = rec;
+    event_owner_count[in_pollable]++;
+
+    select_dirty = true;
+
+    // Anything which arrived before we registered won't generate an edge
+    trigger_map[in_fd] = make_pair(in_read, in_write);
+
+    return 0;
+}
+
+void PollableTracker::RemoveEventFd(int in_fd) {
+    local_locker lock(&event_mutex);
+
+    auto e = event_fd_map.find(in_fd);
+
+    if (e == event_fd_map.end())
+        return;
+
+#if defined(HAVE_SYS_EPOLL_H)
+    struct epoll_event ev;
+    epoll_ctl(event_fd, EPOLL_CTL_DEL, in_fd, &ev);
+#elif defined(HAVE_SYS_EVENT_H)
+    struct kevent ev[2];
+    int nev = 0;
+
+    if (e->second.read)
+        EV_SET(&ev[nev++], in_fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+    if (e->second.write)
+        EV_SET(&ev[nev++], in_fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+
+    kevent(event_fd, ev, nev, NULL, 0, NULL);
+#endif
+
+    auto c = event_owner_count.find(e->second.pollable);
+
+    if (c != event_owner_count.end()) {
+        if (c->second <= 1)
+            event_owner_count.erase(c);
+        else
+            c->second--;
+    }
+
+    event_fd_map.erase(e);
+    trigger_map.erase(in_fd);
+
+    select_dirty = true;
+}
+
+void PollableTracker::TriggerEventFd(int in_fd, bool in_read, bool in_write) {
+    local_locker lock(&event_mutex);
+
+    if (event_fd < 0)
+        return;
+
+    auto t = trigger_map.find(in_fd);
+
+    if (t == trigger_map.end()) {
+        trigger_map[in_fd] = make_pair(in_read, in_write);
+    } else {
+        t->second.first |= in_read;
+        t->second.second |= in_write;
+    }
+
+    // Wake up the main loop; if the pipe is already full it's already awake
+    char b = 0;
+    if (write(wakeup_pipe[1], &b, 1) < 0) { }
+}
+
+void PollableTracker::ProcessEvents(fd_set& in_rset) {
+    map<int, pair<bool, bool> > pending;
+
+    if (event_fd < 0)
+        return;
+
+    pending.swap(retry_map);
+
+    if (FD_ISSET(wakeup_pipe[0], &in_rset)) {
+        char buf[64];
+        while (read(wakeup_pipe[0], buf, 64) > 0) { }
+    }
+
+    {
+        local_locker lock(&event_mutex);
+
+        for (auto t : trigger_map) {
+            pending[t.first].first |= t.second.first;
+            pending[t.first].second |= t.second.second;
+        }
+
+        trigger_map.clear();
+    }
+
+    if (FD_ISSET(event_fd, &in_rset)) {
+#if defined(HAVE_SYS_EPOLL_H)
+        struct epoll_event evs[256];
+        int nev = epoll_wait(event_fd, evs, 256, 0);
+
+        for (int e = 0; e < nev; e++) {
+            auto& p = pending[evs[e].data.fd];
+
+            if (evs[e].events & (EPOLLIN | EPOLLRDHUP))
+                p.first = true;
+            if (evs[e].events & EPOLLOUT)
+                p.second = true;
+
+            // Errors and hangups are reported to whichever side we're watching,
+            // and the IO which follows will find the error
+            if (evs[e].events & (EPOLLERR | EPOLLHUP)) {
+                p.first = true;
+                p.second = true;
+            }
+        }
+#elif defined(HAVE_SYS_EVENT_H)
+        struct kevent evs[256];
+        struct timespec ts = { 0, 0 };
+        int nev = kevent(event_fd, NULL, 0, evs, 256, &ts);
+
+        for (int e = 0; e < nev; e++) {
+            auto& p = pending[(int) evs[e].ident];
+
+            if (evs[e].filter == EVFILT_READ)
+                p.first = true;
+            if (evs[e].filter == EVFILT_WRITE)
+                p.second = true;
+        }
+#endif
+    }
+
+    for (auto p : pending) {
+        event_rec rec;
+
+        {
+            local_locker lock(&event_mutex);
+
+            auto e = event_fd_map.find(p.first);
+
+            if (e == event_fd_map.end())
+                continue;
+
+            rec = e->second;
+        }
+
+        // Only dispatch to pollables we hold a reference to; a pollable may 
+        // register descriptors before it's added, so hold the event until then
+        if (live_set.find(rec.pollable) == live_set.end()) {
+            retry_map[p.first] = p.second;
+            continue;
+        }
+
+        int r = rec.pollable->PollEvent(p.first, 
+                p.second.first && rec.read, p.second.second && rec.write);
+
+        if (r > 0)
+            retry_map[p.first] = p.second;
+    }
+}
+
+PollableWriteTrigger::PollableWriteTrigger(shared_ptr<PollableTracker> in_tracker,
+        BufferHandlerGeneric *in_handler, int in_fd) {
+    tracker = in_tracker;
+    fd = in_fd;
+
+    buffer_handler = in_handler;
+    write_handler = true;
+
+    buffer_handler->SetWriteBufferInterface(this);
+}
+
+PollableWriteTrigger::~PollableWriteTrigger() {
+
+}
+
+void PollableWriteTrigger::BufferAvailable(size_t in_amt __attribute__((unused))) {
+    tracker->TriggerEventFd(fd, false, true);
+}
+
@@ -22,9 +22,12 @@
 #include "config.h"
 
 #include <vector>
+#include <map>
+#include <set>
 
 #include "pollable.h"
 #include "globalregistry.h"
+#include "buffer_handler.h"
 
 /* Pollable subsystem tracker
  *
@@ -34,6 +37,12 @@
  * Add/remove from the pollable vector is handled asynchronously to protect the
  * integrity of the pollable object itself and the internal pollable vectors;
  * adds and removes are synced at the next descriptor or poll event.
+ *
+ * When the platform supports it (epoll on Linux, kqueue on BSD and OSX), 
+ * pollables may instead register their descriptors once with AddEventFd; they
+ * are then skipped when building the select() sets, and are only called via
+ * PollEvent when the kernel reports a descriptor ready.  The epoll or kqueue
+ * descriptor is itself merged into the main select() loop.
  */
 
 class PollableTracker : public LifetimeGlobal {
@@ -74,6 +83,30 @@ public:
     // -1   Error
     int ProcessPollableSelect(fd_set rset, fd_set wset);
 
+    // Is an event backend available?
+    bool EventsAvailable();
+
+    // Register a descriptor on behalf of a pollable, which must also be registered
+    // with RegisterPollable.  Once any of its descriptors are registered the 
+    // pollable no longer takes part in select() and must handle all of its IO in
+    // PollEvent.  Descriptors must be removed before they are closed.
+    //
+    // Can be called from any thread.
+    //
+    // returns:
+    // 0    Success
+    // -1   Event backend unavailable or registration failed; the pollable should
+    //      keep using select()
+    int AddEventFd(int in_fd, Pollable *in_pollable, bool in_read, bool in_write);
+    void RemoveEventFd(int in_fd);
+
+    // Schedule PollEvent for a descriptor on the next loop, waking the main loop
+    // if it's waiting.  Used when data is queued for writing to a descriptor which
+    // is already writable and so won't generate a new edge.
+    //
+    // Can be called from any thread.
+    void TriggerEventFd(int in_fd, bool in_read, bool in_write);
+
 protected:
     GlobalRegistry *globalreg;
 
@@ -83,7 +116,54 @@ protected:
     vector<shared_ptr<Pollable> > add_vec;
     vector<shared_ptr<Pollable> > remove_vec;
 
+    // Pollables still driven by select(), rebuilt whenever pollables or event
+    // registrations change
+    vector<shared_ptr<Pollable> > select_vec;
+    bool select_dirty;
+
+    // Raw pointers of everything in pollable_vec, to make sure an event owner is
+    // still alive before dispatching to it
+    set<Pollable *> live_set;
+
     void Maintenance();
+
+    struct event_rec {
+        Pollable *pollable;
+        bool read;
+        bool write;
+    };
+
+    // epoll or kqueue descriptor, and a pipe for waking the main loop on triggers
+    int event_fd;
+    int wakeup_pipe[2];
+
+    // Event registrations and triggers are protected by their own lock; they're
+    // modified by pollables while holding their own locks, and must never wait on
+    // the pollable mutex
+    pthread_mutex_t event_mutex;
+    map<int, event_rec> event_fd_map;
+    map<Pollable *, unsigned int> event_owner_count;
+    map<int, pair<bool, bool> > trigger_map;
+
+    // Descriptors to call again on the next loop, only touched while processing
+    map<int, pair<bool, bool> > retry_map;
+
+    void ProcessEvents(fd_set& in_rset);
+};
+
+// Buffer interface which triggers an event-driven pollable when data is written
+// to the write buffer
+class PollableWriteTrigger : public BufferInterface {
+public:
+    PollableWriteTrigger(shared_ptr<PollableTracker> in_tracker, 
+            BufferHandlerGeneric *in_handler, int in_fd);
+    virtual ~PollableWriteTrigger();
+
+    virtual void BufferAvailable(size_t in_amt);
+
+protected:
+    shared_ptr<PollableTracker> tracker;
+    int fd;
 };
 
 #endif
@@ -385,6 +385,80 @@ class KismetConnector:
 
         return (r.status_code, r.content)
 
+    def __open_stream(self, url, postdata = None):
+        """
+        __open_stream(url, [postdata]) -> streamed response
+
+        Internal function to open a GET, or a POST of the JSON encoded postdata,
+        without reading the body.  The response must be read to the end or
+        closed for the connection to go back to the session and be reused.
+        """
+        try:
+            if postdata != None:
+                fd = {
+                    "json": json.dumps(postdata)
+                }
+
+                r = self.session.post("%s/%s" % (self.host_uri, url), data = fd, stream=True)
+            else:
+                r = self.session.get("%s/%s" % (self.host_uri, url), stream=True)
+        except Exception as e:
+            if self.debug:
+                print("Failed to open stream: {}".format(e))
+            raise KismetRequestException("Failed to open {}: {}".format(url, e), -1)
+
+        if not r.status_code == 200:
+            r.close()
+
+            if r.status_code == 401:
+                raise KismetLoginException("Login required for {}".format(url), r.status_code)
+
+            raise KismetRequestException("Request failed {} {}".format(url, r.status_code), r.status_code)
+
+        self.__update_session()
+
+        return r
+
+    def __iter_stream(self, r, fmt):
+        """
+        __iter_stream(response, format) -> generator
+
+        Internal generator yielding each object of a streamed response as it is
+        read: one per line of ekjson, or each member of the top-level list of a
+        msgpack or kbin response.  The response is closed when the generator
+        finishes or is discarded.
+        """
+        try:
+            if fmt == "ekjson":
+                for line in r.iter_lines():
+                    # filter out keep-alive new lines
+                    if line:
+                        yield json.loads(line.decode('utf-8'))
+            elif fmt == "msgpack":
+                import msgpack
+
+                r.raw.decode_content = True
+
+                try:
+                    unpacker = msgpack.Unpacker(r.raw, raw = False)
+                except TypeError:
+                    # Older msgpack-python
+                    unpacker = msgpack.Unpacker(r.raw, encoding = 'utf-8')
+
+                for x in range(unpacker.read_array_header()):
+                    yield unpacker.unpack()
+            elif fmt == "kbin":
+                from . import kbin
+
+                r.raw.decode_content = True
+
+                for obj in kbin.iter_decode(r.raw):
+                    yield obj
+            else:
+                raise KismetRequestException("Unknown stream format {}".format(fmt), -1)
+        finally:
+            r.close()
+
     def login(self):
         """
         login() -> Boolean
@@ -456,6 +530,22 @@ class KismetConnector:
 
         return devices
 
+    def event_stream(self, callback, cbargs = None):
+        """
+        event_stream(callback, [cbargs])
+
+        Subscribe to the server event stream.  The callback is invoked for every
+        event as it is sent by the server, with an object containing the event
+        type (kismet.eventstream.type - DEVICE, ALERT, MESSAGE, or TIMESTAMP),
+        the server time (kismet.eventstream.time), and the record itself 
+        (kismet.eventstream.event).
+
+        This call does not return until the connection is closed, and replaces
+        polling the device, alert, and message endpoints.
+        """
+
+        self.__get_json_url("eventstream/events.ekjson", callback, cbargs)
+
     def device_summary_since(self, ts = 0, fields = None, callback = None, cbargs = None):
         """
         device_summary_since(ts, [fields, callback, cbargs]) -> device summary list 
@@ -572,6 +662,153 @@ class KismetConnector:
         # Single-entity request, pop out vector
         return v[0]
 
+    def device_columns_raw(self, fields = None):
+        """
+        device_columns_raw(fields) -> kcol encoded data
+
+        Fetch every device as typed columns from the columnar export, without
+        decoding it; see device_columns and kcol.to_dataframe.  If a field
+        simplification set is passed in 'fields', only those fields are exported;
+        they must be single values (numbers, strings, or MAC addresses).
+        """
+        if fields == None:
+            return self.__get_string_url("devices/columns/devices.kcol")
+
+        cmd = {
+            "fields": fields
+        }
+
+        (r, v) = self.__post_string_url("devices/columns/devices.kcol", cmd)
+
+        return v
+
+    def device_columns(self, fields = None, as_numpy = False):
+        """
+        device_columns(fields) -> dictionary of column name to values
+
+        Fetch every device as typed columns, one value per device in each column.
+        """
+        from . import kcol
+
+        return kcol.KcolDecoder(self.device_columns_raw(fields)).decode(as_numpy)
+
+    def iter_devices(self, ts = 0, fields = None, regex = None, fmt = "ekjson"):
+        """
+        iter_devices([ts, fields, regex, fmt]) -> generator of devices
+
+        Streaming equivalent of smart_device_list: devices are yielded one at a
+        time as they are read from the server, so memory use does not grow with
+        the number of devices, and the connection is reused by the next request
+        once the generator is exhausted.
+
+        fmt selects the wire format, one of 'ekjson', 'msgpack', or 'kbin'.
+        msgpack and kbin are considerably cheaper to produce and to decode than
+        JSON.
+        """
+
+        cmd = None
+
+        if fields != None or regex != None:
+            cmd = { }
+
+            if not fields == None:
+                cmd["fields"] = fields
+
+            if not regex == None:
+                cmd["regex"] = regex
+
+        r = self.__open_stream("devices/last-time/{}/devices.{}".format(ts, fmt), cmd)
+
+        return self.__iter_stream(r, fmt)
+
+    def server_time(self):
+        """
+        server_time() -> integer
+
+        Return the current server timestamp, in seconds
+        """
+        (r, v) = self.__get_json_url("system/timestamp.json")
+
+        return v[0]["kismet.system.timestamp.sec"]
+
+    def poll_devices(self, interval = 5, fields = None, regex = None, fmt = "ekjson", ts = 0):
+        """
+        poll_devices([interval, fields, regex, fmt, ts]) -> generator of devices
+
+        Delta poll: yield every device which matches, then every interval
+        seconds only those devices which have changed since the previous poll.
+        Polls are timed by the server clock so no change is missed between
+        them, and a device is not repeated unless it has changed again.
+
+        The generator never finishes on its own; stop iterating to stop polling.
+        A field simplification set always has the device key and last time
+        added, as they are needed to tell which devices have changed.
+        """
+        import time
+
+        keyf = 'kismet.device.base.key'
+        timef = 'kismet.device.base.last_time'
+
+        if fields != None:
+            fields = list(fields)
+
+            for f in (keyf, timef):
+                if not f in fields:
+                    fields.append(f)
+
+        # Last time seen of every device reported in the previous window
+        seen = {}
+
+        while True:
+            now = self.server_time()
+
+            # last-time only returns devices changed *after* the timestamp,
+            # so overlap the previous second and drop repeats
+            since = ts - 1 if ts > 0 else ts
+
+            reported = {}
+
+            for d in self.iter_devices(ts = since, fields = fields, regex = regex, fmt = fmt):
+                k = d.get(keyf)
+                t = d.get(timef)
+
+                if k != None and k in seen and seen[k] == t:
+                    continue
+
+                if k != None and t != None and t >= now:
+                    reported[k] = t
+
+                yield d
+
+            seen = reported
+            ts = now
+
+            time.sleep(interval)
+
+    def iter_device_columns(self, fields = None):
+        """
+        iter_device_columns([fields]) -> generator of devices
+
+        Fetch every device from the columnar export and yield one dictionary of
+        field name to value per device.  The export is decoded as a whole, but is
+        far smaller than the equivalent JSON; see device_columns_raw for the
+        field restrictions.
+        """
+        from . import kcol
+
+        return kcol.iter_rows(self.device_columns_raw(fields))
+
+    def events(self):
+        """
+        events() -> generator of events
+
+        Generator equivalent of event_stream; yields each event from the server
+        event stream as it arrives, and closes the stream when iteration stops.
+        """
+        r = self.__open_stream("eventstream/events.ekjson")
+
+        return self.__iter_stream(r, "ekjson")
+
     def datasources(self):
         """
         datasources() -> Datasource list
@@ -0,0 +1,270 @@
+#!/usr/bin/env python
+
+"""
+Decoder for the Kismet 'kbin' binary serialization format, returned by any
+REST endpoint which is requested with a .kbin suffix, for example:
+
+    /devices/last-time/0/devices.kbin
+
+The decoded objects match what the same endpoint returns as JSON: maps become
+dictionaries keyed by field name, vectors become lists, and MAC addresses and
+UUIDs become strings.
+
+The layout is described in README.DEV.SERIALIZATION in the Kismet source.
+"""
+
+import struct
+
+KBIN_HEADER = 0xFF
+KBIN_FLAG_LITTLE_ENDIAN = 0x01
+
+KBIN_KEY_FIELD = 0x00
+KBIN_KEY_FIELD_DEFINE = 0x01
+KBIN_KEY_NAME = 0x02
+
+# TrackerType values from trackedelement.h
+T_STRING = 0
+T_INT8 = 1
+T_UINT8 = 2
+T_INT16 = 3
+T_UINT16 = 4
+T_INT32 = 5
+T_UINT32 = 6
+T_INT64 = 7
+T_UINT64 = 8
+T_FLOAT = 9
+T_DOUBLE = 10
+T_MAC = 11
+T_UUID = 12
+T_VECTOR = 13
+T_MAP = 14
+T_INTMAP = 15
+T_MACMAP = 16
+T_STRINGMAP = 17
+T_DOUBLEMAP = 18
+T_BYTEARRAY = 19
+
+_SCALARS = {
+    T_INT8: 'b',
+    T_UINT8: 'B',
+    T_INT16: 'h',
+    T_UINT16: 'H',
+    T_INT32: 'i',
+    T_UINT32: 'I',
+    T_INT64: 'q',
+    T_UINT64: 'Q',
+    T_FLOAT: 'f',
+    T_DOUBLE: 'd',
+}
+
+class KbinException(Exception):
+    pass
+
+class KbinDecoder(object):
+    """
+    Decode a complete kbin response.  Field names learned from the stream are
+    kept in self.fields, and are only valid for the server run which sent them.
+    """
+    def __init__(self, data):
+        self.data = data
+        self.pos = 0
+        self.order = '<'
+        self.fields = {}
+
+    def __take(self, fmt):
+        fmt = self.order + fmt
+        return struct.unpack(fmt, self._read(struct.calcsize(fmt)))
+
+    def __bytes(self, sz):
+        return self._read(sz)
+
+    def _read(self, sz):
+        if self.pos + sz > len(self.data):
+            raise KbinException("Truncated kbin data")
+
+        r = self.data[self.pos:self.pos + sz]
+        self.pos += sz
+
+        return r
+
+    def __string(self):
+        (sz,) = self.__take('I')
+        return self.__bytes(sz).decode('utf-8', 'replace')
+
+    def __name(self):
+        (sz,) = self.__take('H')
+        return self.__bytes(sz).decode('utf-8', 'replace')
+
+    def __mac(self):
+        (mac, mask) = self.__take('QQ')
+        return ":".join("%02X" % ((mac >> ((5 - x) * 8)) & 0xFF) for x in range(6))
+
+    def __header(self):
+        if self.__bytes(4) != b'KBIN':
+            raise KbinException("Invalid kbin header")
+
+        # Version and flags are single bytes so the order doesn't matter yet
+        (version, flags) = struct.unpack('BB', self.__bytes(2))
+
+        if version != 1:
+            raise KbinException("Unsupported kbin version {}".format(version))
+
+        if flags & KBIN_FLAG_LITTLE_ENDIAN:
+            self.order = '<'
+        else:
+            self.order = '>'
+
+    def __key(self):
+        (tag,) = self.__take('B')
+
+        if tag == KBIN_KEY_NAME:
+            return self.__name()
+
+        (fid,) = self.__take('i')
+
+        if tag == KBIN_KEY_FIELD_DEFINE:
+            self.fields[fid] = self.__name()
+        elif tag != KBIN_KEY_FIELD:
+            raise KbinException("Unknown kbin key tag {}".format(tag))
+
+        if not fid in self.fields:
+            raise KbinException("Undefined kbin field id {}".format(fid))
+
+        return self.fields[fid]
+
+    def __type(self):
+        (t,) = self.__take('B')
+
+        # A header may precede any element, such as the cached records of
+        # individual devices in a list
+        while t == KBIN_HEADER:
+            self.__header()
+            (t,) = self.__take('B')
+
+        return t
+
+    def element(self):
+        return self.__element(self.__type())
+
+    def elements(self):
+        """
+        elements() -> generator
+
+        Yield each member of a vector, such as a device list, as it is decoded;
+        anything else is yielded as a single element
+        """
+        t = self.__type()
+
+        if t != T_VECTOR:
+            yield self.__element(t)
+            return
+
+        (n,) = self.__take('I')
+        for x in range(n):
+            yield self.element()
+
+    def __element(self, t):
+        if t in _SCALARS:
+            return self.__take(_SCALARS[t])[0]
+
+        if t == T_STRING:
+            return self.__string()
+
+        if t == T_MAC:
+            return self.__mac()
+
+        if t == T_UUID:
+            (tl, tm, th, cs) = self.__take('IHHH')
+            node = self.__bytes(6)
+            return "%08x-%04x-%04x-%04x-%s" % (tl, tm, th, cs,
+                    "".join("%02x" % b for b in bytearray(node)))
+
+        if t == T_VECTOR:
+            (n,) = self.__take('I')
+            return [self.element() for x in range(n)]
+
+        if t == T_MAP:
+            (n,) = self.__take('I')
+            r = {}
+            for x in range(n):
+                k = self.__key()
+                r[k] = self.element()
+            return r
+
+        if t == T_INTMAP:
+            (n,) = self.__take('I')
+            r = {}
+            for x in range(n):
+                (k,) = self.__take('i')
+                r[k] = self.element()
+            return r
+
+        if t == T_MACMAP:
+            (n,) = self.__take('I')
+            r = {}
+            for x in range(n):
+                k = self.__mac()
+                r[k] = self.element()
+            return r
+
+        if t == T_STRINGMAP:
+            (n,) = self.__take('I')
+            r = {}
+            for x in range(n):
+                k = self.__string()
+                r[k] = self.element()
+            return r
+
+        if t == T_DOUBLEMAP:
+            (n,) = self.__take('I')
+            r = {}
+            for x in range(n):
+                (k,) = self.__take('d')
+                r[k] = self.element()
+            return r
+
+        if t == T_BYTEARRAY:
+            (n,) = self.__take('I')
+            return self.__bytes(n)
+
+        raise KbinException("Unknown kbin type {}".format(t))
+
+class KbinStreamDecoder(KbinDecoder):
+    """
+    Decode kbin as it is read from a file-like object, such as the raw body of
+    a streamed HTTP response, without holding the whole response
+    """
+    def __init__(self, fileobj):
+        KbinDecoder.__init__(self, b'')
+        self.fileobj = fileobj
+
+    def _read(self, sz):
+        parts = []
+        want = sz
+
+        while want > 0:
+            b = self.fileobj.read(want)
+
+            if not b:
+                raise KbinException("Truncated kbin data")
+
+            parts.append(b)
+            want -= len(b)
+
+        self.pos += sz
+
+        return b''.join(parts)
+
+def decode(data):
+    """
+    Decode a kbin response body into python objects
+    """
+    return KbinDecoder(data).element()
+
+def iter_decode(fileobj):
+    """
+    Decode a kbin stream from a file-like object, yielding each member of a
+    top-level vector as soon as it has been read
+    """
+    return KbinStreamDecoder(fileobj).elements()
+
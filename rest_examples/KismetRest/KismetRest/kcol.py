@@ -0,0 +1,218 @@
+#!/usr/bin/env python
+
+"""
+Decoder for the Kismet 'kcol' columnar device export, returned by:
+
+    /devices/columns/devices.kcol
+
+Each column is returned as a list (or, when numpy is available and
+as_numpy=True, a numpy array) with one entry per device.  String columns are
+dictionary encoded on the wire; decode() expands them to strings, while
+decode_raw() keeps the dictionary and the codes so they can be loaded into a
+categorical type without building every string.
+
+The layout is described in README.DEV.SERIALIZATION in the Kismet source.
+"""
+
+import array
+import struct
+import sys
+
+KCOL_FLAG_LITTLE_ENDIAN = 0x01
+
+# Column types are the TrackerType values from trackedelement.h
+T_STRING = 0
+T_INT64 = 7
+T_UINT64 = 8
+T_DOUBLE = 10
+T_MAC = 11
+
+_NUMERIC = {
+    T_INT64: 'q',
+    T_UINT64: 'Q',
+    T_DOUBLE: 'd',
+    T_MAC: 'Q',
+}
+
+class KcolException(Exception):
+    pass
+
+class KcolColumn(object):
+    """
+    One decoded column.  For string columns, dictionary holds the distinct
+    strings and codes the index of each row's string; for everything else
+    values holds the row values and dictionary is None.
+    """
+    def __init__(self, name, ctype):
+        self.name = name
+        self.type = ctype
+        self.values = None
+        self.dictionary = None
+        self.codes = None
+
+    def strings(self):
+        if self.dictionary is None:
+            return self.values
+
+        d = self.dictionary
+        return [d[c] for c in self.codes]
+
+def mac_to_string(m):
+    """
+    Format a mac column value as AA:BB:CC:DD:EE:FF
+    """
+    return ":".join("%02X" % ((m >> (8 * (5 - x))) & 0xFF) for x in range(6))
+
+class KcolDecoder(object):
+    def __init__(self, data):
+        self.data = data
+        self.pos = 0
+        self.order = '<'
+
+    def __take(self, fmt):
+        fmt = self.order + fmt
+        sz = struct.calcsize(fmt)
+
+        if self.pos + sz > len(self.data):
+            raise KcolException("Truncated kcol data")
+
+        v = struct.unpack_from(fmt, self.data, self.pos)
+        self.pos += sz
+
+        return v[0]
+
+    def __take_bytes(self, sz):
+        if self.pos + sz > len(self.data):
+            raise KcolException("Truncated kcol data")
+
+        v = self.data[self.pos:self.pos + sz]
+        self.pos += sz
+
+        return v
+
+    def __take_array(self, code, count, as_numpy):
+        sz = struct.calcsize(code) * count
+        raw = self.__take_bytes(sz)
+
+        swap = (self.order == '<') != (sys.byteorder == 'little')
+
+        if as_numpy:
+            import numpy
+            dt = numpy.dtype(self.order + code)
+            return numpy.frombuffer(raw, dtype=dt)
+
+        a = array.array(code)
+
+        if hasattr(a, "frombytes"):
+            a.frombytes(raw)
+        else:
+            a.fromstring(raw)
+
+        if swap:
+            a.byteswap()
+
+        return a
+
+    def decode_raw(self, as_numpy=False):
+        """
+        decode_raw() -> (rows, [KcolColumn, ...])
+        """
+        self.pos = 0
+
+        if self.__take_bytes(4) != b"KCOL":
+            raise KcolException("Not kcol data")
+
+        version = struct.unpack_from('B', self.data, self.pos)[0]
+        flags = struct.unpack_from('B', self.data, self.pos + 1)[0]
+        self.pos += 2
+
+        if version != 1:
+            raise KcolException("Unsupported kcol version {}".format(version))
+
+        if flags & KCOL_FLAG_LITTLE_ENDIAN:
+            self.order = '<'
+        else:
+            self.order = '>'
+
+        ncols = self.__take('I')
+        rows = self.__take('Q')
+
+        columns = []
+
+        for c in range(ncols):
+            namelen = self.__take('H')
+            name = self.__take_bytes(namelen).decode('utf-8', 'replace')
+            ctype = self.__take('B')
+
+            col = KcolColumn(name, ctype)
+
+            if ctype == T_STRING:
+                dictionary = []
+                for d in range(self.__take('I')):
+                    slen = self.__take('I')
+                    dictionary.append(self.__take_bytes(slen).decode('utf-8', 'replace'))
+
+                col.dictionary = dictionary
+                col.codes = self.__take_array('I', rows, as_numpy)
+            elif ctype in _NUMERIC:
+                col.values = self.__take_array(_NUMERIC[ctype], rows, as_numpy)
+            else:
+                raise KcolException("Unknown column type {}".format(ctype))
+
+            columns.append(col)
+
+        return (rows, columns)
+
+    def decode(self, as_numpy=False):
+        """
+        decode() -> {column name: values}
+
+        String columns are expanded to lists of strings
+        """
+        rows, columns = self.decode_raw(as_numpy)
+
+        ret = {}
+        for col in columns:
+            ret[col.name] = col.strings()
+
+        return ret
+
+def iter_rows(data):
+    """
+    Decode a kcol response and yield one dictionary of column name to value per
+    device.  Every column of every row has to arrive before the first row is
+    complete, so the response itself is decoded in one piece; only the rows
+    are built one at a time.
+    """
+    rows, columns = KcolDecoder(data).decode_raw()
+
+    for r in range(rows):
+        row = {}
+        for col in columns:
+            if col.dictionary is not None:
+                row[col.name] = col.dictionary[col.codes[r]]
+            else:
+                row[col.name] = col.values[r]
+        yield row
+
+def to_dataframe(data):
+    """
+    Decode a kcol response into a pandas DataFrame.  String columns become
+    categoricals built straight from the dictionary and codes.
+    """
+    import pandas
+
+    rows, columns = KcolDecoder(data).decode_raw(as_numpy=True)
+
+    frame = {}
+    order = []
+    for col in columns:
+        if col.dictionary is not None:
+            frame[col.name] = pandas.Categorical.from_codes(col.codes.astype('int64'),
+                    categories=col.dictionary)
+        else:
+            frame[col.name] = col.values
+        order.append(col.name)
+
+    return pandas.DataFrame(frame, columns=order)
+
@@ -9,7 +9,7 @@ config = {
     'url': 'https://www.kismetwireless.net',
     'download_url': 'https://www.kismetwireless.net',
     'author_email': 'dragorn@kismetwireless.net',
-    'version': '1.0',
+    'version': '1.1',
     'install_requires': ['msgpack-python', 'requests' ],
     'packages': ['KismetRest'],
     'scripts': [],
@@ -0,0 +1,82 @@
+#!/usr/bin/env python
+
+"""
+Use of the columnar device export in the Kismet Python library.
+
+The whole device list is fetched as typed columns, which is much cheaper for
+both Kismet and the script than decoding a JSON object per device.  With
+--csv the columns are written as CSV; with --pandas they are loaded into a
+DataFrame (requires pandas and numpy) and summarized.
+"""
+
+import sys
+import KismetRest
+import argparse
+
+from KismetRest import kcol
+
+uri = "http://localhost:2501"
+
+parser = argparse.ArgumentParser(description='Kismet columnar export example')
+
+parser.add_argument('--uri', action="store", dest="uri")
+parser.add_argument('--csv', action="store_true", dest="csv")
+parser.add_argument('--pandas', action="store_true", dest="pandas")
+
+results = parser.parse_args()
+
+if results.uri != None:
+    uri = results.uri
+
+kr = KismetRest.KismetConnector(uri)
+
+fields = [
+    ["kismet.device.base.macaddr", "mac"],
+    ["kismet.device.base.phyname", "phy"],
+    ["kismet.device.base.manuf", "manuf"],
+    ["kismet.device.base.channel", "channel"],
+    ["kismet.device.base.last_time", "last_time"],
+    ["kismet.device.base.packets.total", "packets"],
+    ["kismet.device.base.signal/kismet.common.signal.last_signal_dbm", "signal"],
+    ["dot11.device/dot11.device.last_beaconed_ssid", "ssid"],
+]
+
+if results.pandas:
+    import pandas
+
+    df = kcol.to_dataframe(kr.device_columns_raw(fields))
+    df['mac'] = df['mac'].map(kcol.mac_to_string)
+
+    print(df.describe(include='all'))
+    print(df.groupby('manuf').size().sort_values(ascending=False).head(20))
+    sys.exit(0)
+
+cols = kr.device_columns(fields)
+names = [f[1] for f in fields]
+
+if results.csv:
+    import csv
+
+    w = csv.writer(sys.stdout)
+    w.writerow(names)
+
+    for r in range(len(cols['mac'])):
+        row = []
+        for n in names:
+            v = cols[n][r]
+            if n == "mac":
+                v = kcol.mac_to_string(v)
+            row.append(v)
+        w.writerow(row)
+
+    sys.exit(0)
+
+print("{} devices".format(len(cols['mac'])))
+
+manufs = {}
+for m in cols['manuf']:
+    manufs[m] = manufs.get(m, 0) + 1
+
+for m in sorted(manufs, key=manufs.get, reverse=True)[:20]:
+    print("{:8} {}".format(manufs[m], m))
+
@@ -72,7 +72,7 @@ if results.macs != None:
         sys.exit(1)
 
 if results.rate != None:
-    rate = results.rate
+    rate = float(results.rate)
 
 kr = KismetRest.KismetConnector(uri)
 kr.set_debug(1)
@@ -107,23 +107,21 @@ fields = [
     'dot11.device/dot11.device.last_probed_ssid',
 ]
 
-while True:
-    # Scan for mac addresses individually
-    if results.macs != None:
+# Scan for mac addresses individually
+if results.macs != None:
+    while True:
         for m in results.macs:
             # device_by_mac returns a vector, turn that into calls of our 
             # device handling function
             for d in kr.device_by_mac(m, fields):
                 per_device(d)
-    else:
-        # Otherwise, look for devices which have changed, and which optionally match 
-        # any of our regexes, within our time range * 2
-
-        # Generate a negative timestamp which is our rate, 
-        ts = (rate * 2) * -1
 
-        kr.smart_device_list(callback = per_device, regex = regex, fields = fields, ts = ts)
+        time.sleep(rate)
 
-    time.sleep(rate)
+# Otherwise, stream the devices which have changed since the last poll, and
+# which optionally match any of our regexes; the devices are decoded one at a
+# time from msgpack, and every poll reuses the same connection
+for d in kr.poll_devices(interval = rate, regex = regex, fields = fields, fmt = "msgpack"):
+    per_device(d)
 
 
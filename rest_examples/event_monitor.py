@@ -0,0 +1,43 @@
+#!/usr/bin/env python
+
+"""
+Print devices, alerts, and messages as they happen, using the Kismet event
+stream instead of polling the REST endpoints.
+"""
+
+import sys
+import KismetRest
+import argparse
+import time
+
+def per_event(e):
+    etype = e['kismet.eventstream.type']
+    event = e['kismet.eventstream.event']
+
+    if etype == "DEVICE":
+        print "DEVICE  {} - {} - {}".format(
+                event['kismet.device.base.macaddr'],
+                time.ctime(event['kismet.device.base.last_time']),
+                event['kismet.device.base.type'])
+    elif etype == "ALERT":
+        print "ALERT   {} {}".format(
+                event['kismet.alert.header'],
+                event['kismet.alert.text'])
+    elif etype == "MESSAGE":
+        print "MESSAGE {}".format(event['kismet.messagebus.message_string'])
+
+uri = "http://localhost:2501"
+
+parser = argparse.ArgumentParser(description='Kismet event stream example')
+
+parser.add_argument('--uri', action="store", dest="uri")
+
+results = parser.parse_args()
+
+if results.uri != None:
+    uri = results.uri
+
+kr = KismetRest.KismetConnector(uri)
+
+kr.event_stream(per_event)
+
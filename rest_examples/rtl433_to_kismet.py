@@ -1,7 +1,7 @@
 #!/usr/bin/env python
 
 import sys, KismetRest, subprocess
-import argparse
+import argparse, select
 
 uri = "http://localhost:2501"
 user = "kismet"
@@ -30,11 +30,23 @@ rtl = subprocess.Popen(["rtl_433", "-F", "json"], stdout=subprocess.PIPE, stdin=
 if not kr.check_session():
     kr.login()
 
+# Gather whatever rtl_433 has reported in the last BATCH_WAIT seconds and
+# post it as one batch; a busy band is one request instead of one per record
+BATCH_WAIT = 0.25
+
 while True:
-    l = rtl.stdout.readline()
-    print "Got data: ", l
+    batch = [ rtl.stdout.readline() ]
+
+    while select.select([rtl.stdout], [], [], BATCH_WAIT)[0]:
+        l = rtl.stdout.readline()
+        if l == "":
+            break
+        batch.append(l)
+
+    print "Got {} records".format(len(batch))
     try:
-        print "Post:", kr.post_url("phy/phyRTL433/post_sensor_json.cmd", { "obj": l })
+        print "Post:", kr.post_url("phy/phyRTL433/post_sensor_json_batch.cmd",
+                { "obj": "".join(batch) })
     except Exception as e:
         print "Post failed: ", e
 
@@ -22,9 +22,15 @@
 
 #include "util.h"
 #include "ringbuf2.h"
+#include "kis_probes.h"
+#include "kis_hugepage.h"
 
 RingbufV2::RingbufV2(size_t in_sz) {
-    buffer = new unsigned char[in_sz];
+    // Large rings may be backed by huge pages
+    buffer = (unsigned char *) HugepageAlloc::alloc(in_sz);
+
+    if (buffer == NULL)
+        buffer = new unsigned char[in_sz];
 
     memset(buffer, 0xAA, in_sz);
 
@@ -48,7 +54,8 @@ RingbufV2::~RingbufV2() {
     profile();
 #endif
     
-    delete[] buffer;
+    if (!HugepageAlloc::release(buffer))
+        delete[] buffer;
 }
 
 #ifdef PROFILE_RINGBUFV2
@@ -259,6 +266,7 @@ ssize_t RingbufV2::write(unsigned char *data, size_t in_sz) {
         return 0;
 
     if (available() < (ssize_t) in_sz) {
+        KIS_PROBE3(ringbuf__full, this, in_sz, available());
         fprintf(stderr, "debug - ringbuf2 - insufficient space in buffer for %lu available %lu length %lu\n", in_sz, available(), length);
         return 0;
     }
@@ -307,6 +315,35 @@ ssize_t RingbufV2::write(unsigned char *data, size_t in_sz) {
     return 0;
 }
 
+ssize_t RingbufV2::write_vec(const struct iovec *in_vec, size_t in_cnt) {
+    // Held across every block; the writes below only re-enter it
+    local_locker lock(&buffer_locker);
+
+    if (write_reserved) {
+        throw std::runtime_error("ringbuf v2 write already locked");
+    }
+
+    size_t total = 0;
+
+    for (size_t x = 0; x < in_cnt; x++)
+        total += in_vec[x].iov_len;
+
+    if (total == 0)
+        return 0;
+
+    if (available() < (ssize_t) total) {
+        KIS_PROBE3(ringbuf__full, this, total, available());
+        return 0;
+    }
+
+    for (size_t x = 0; x < in_cnt; x++) {
+        if (in_vec[x].iov_len != 0)
+            write((unsigned char *) in_vec[x].iov_base, in_vec[x].iov_len);
+    }
+
+    return total;
+}
+
 ssize_t RingbufV2::reserve(unsigned char **data, size_t in_sz) {
     local_locker lock(&buffer_locker);
 
@@ -321,6 +358,7 @@ ssize_t RingbufV2::reserve(unsigned char **data, size_t in_sz) {
 
     if (available() < (ssize_t) in_sz) {
         // fprintf(stderr, "debug - ringbuf2 - insufficient space in buffer for %lu\n", in_sz);
+        KIS_PROBE3(ringbuf__full, this, in_sz, available());
         return 0;
     }
 
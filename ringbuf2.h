@@ -46,6 +46,7 @@ public:
     // Write data into a buffer
     // Return amount of data actually written
     virtual ssize_t write(unsigned char *in_data, size_t in_sz);
+    virtual ssize_t write_vec(const struct iovec *in_vec, size_t in_cnt);
 
     // Peek at data
     virtual ssize_t peek(unsigned char **in_data, size_t in_sz);
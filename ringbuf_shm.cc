@@ -0,0 +1,141 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <stdlib.h>
+
+#include "util.h"
+#include "ringbuf_shm.h"
+
+RingbufShm *RingbufShm::create(size_t in_sz) {
+    kis_shm_ring_t *r = kis_shm_ring_create(in_sz);
+
+    if (r == NULL)
+        return NULL;
+
+    return new RingbufShm(r);
+}
+
+RingbufShm::RingbufShm(kis_shm_ring_t *in_ring) {
+    ring = in_ring;
+    start_pos = 0;
+}
+
+RingbufShm::~RingbufShm() {
+    kis_shm_ring_free(ring);
+}
+
+void RingbufShm::close_ring_fd() {
+    kis_shm_ring_close_fd(ring);
+}
+
+void RingbufShm::arm_doorbell() {
+    kis_shm_ring_reader_wait(ring);
+}
+
+void RingbufShm::ack_doorbell() {
+    kis_shm_ring_ack(ring->doorbell_fd);
+}
+
+void RingbufShm::clear() {
+    if (peek_reserved) {
+        throw std::runtime_error("ringbuf shm clear while peeked data pending");
+    }
+
+    consume(used());
+}
+
+ssize_t RingbufShm::size() {
+    return ring->data_sz;
+}
+
+size_t RingbufShm::used() {
+    return __atomic_load_n(&(ring->hdr->length), __ATOMIC_ACQUIRE);
+}
+
+ssize_t RingbufShm::available() {
+    return ring->data_sz - used();
+}
+
+ssize_t RingbufShm::write(unsigned char *data __attribute__((unused)), 
+        size_t in_sz __attribute__((unused))) {
+    return 0;
+}
+
+ssize_t RingbufShm::reserve(unsigned char **data __attribute__((unused)), 
+        size_t in_sz __attribute__((unused))) {
+    return -1;
+}
+
+ssize_t RingbufShm::zero_copy_reserve(unsigned char **data __attribute__((unused)), 
+        size_t in_sz __attribute__((unused))) {
+    return -1;
+}
+
+bool RingbufShm::commit(unsigned char *data __attribute__((unused)), 
+        size_t in_sz __attribute__((unused))) {
+    return false;
+}
+
+ssize_t RingbufShm::peek(unsigned char **ptr, size_t in_sz) {
+    return zero_copy_peek(ptr, in_sz);
+}
+
+ssize_t RingbufShm::zero_copy_peek(unsigned char **ptr, size_t in_sz) {
+    if (peek_reserved) {
+        throw std::runtime_error("ringbuf shm peek already locked");
+    }
+
+    peek_reserved = true;
+
+    size_t opsize = min(in_sz, used());
+
+    if (opsize == 0)
+        return 0;
+
+    // Mirrored, so the whole span is always contiguous
+    *ptr = ring->data + start_pos;
+
+    return opsize;
+}
+
+void RingbufShm::peek_free(unsigned char *in_data __attribute__((unused))) {
+    if (!peek_reserved) {
+        throw std::runtime_error("ringbuf shm peek_free on unlocked buffer");
+    }
+
+    peek_reserved = false;
+}
+
+size_t RingbufShm::consume(size_t in_sz) {
+    if (peek_reserved) {
+        throw std::runtime_error("ringbuf shm consume while peeked data pending");
+    }
+
+    size_t opsize = min(in_sz, used());
+
+    if (opsize == 0)
+        return 0;
+
+    start_pos = (start_pos + opsize) % ring->data_sz;
+
+    // Hand the space back, and wake the capture binary if it ran out
+    __atomic_fetch_sub(&(ring->hdr->length), opsize, __ATOMIC_RELEASE);
+    kis_shm_ring_notify_writer(ring);
+
+    return opsize;
+}
@@ -0,0 +1,88 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __RINGBUF_SHM_H__
+#define __RINGBUF_SHM_H__
+
+#include <stdint.h>
+#include <unistd.h>
+#include "buffer_handler.h"
+#include "kis_shm_ring.h"
+
+// Read side of the shared memory ring a local capture binary writes its frames
+// into (see kis_shm_ring.h).  The binary is the producer, so from the server
+// this buffer can only be peeked and consumed; write, reserve, and commit
+// always fail.
+//
+// The data is mirrored memory, so every peek points straight into the ring and
+// a frame is parsed where the capture binary wrote it.
+class RingbufShm : public CommonBuffer {
+public:
+    // Returns NULL if the platform can't make a shared ring
+    static RingbufShm *create(size_t in_sz);
+
+    virtual ~RingbufShm();
+
+    virtual bool is_spsc() { return true; }
+
+    // Discards everything written so far
+    virtual void clear();
+
+    virtual ssize_t size();
+    virtual ssize_t available();
+    virtual size_t used();
+
+    // Not available; the capture binary is the only writer
+    virtual ssize_t write(unsigned char *in_data, size_t in_sz);
+
+    virtual ssize_t reserve(unsigned char **data, size_t in_sz);
+    virtual ssize_t zero_copy_reserve(unsigned char **data, size_t in_sz);
+    virtual bool commit(unsigned char *data, size_t in_sz);
+
+    virtual ssize_t peek(unsigned char **in_data, size_t in_sz);
+    virtual ssize_t zero_copy_peek(unsigned char **in_data, size_t in_sz);
+    virtual void peek_free(unsigned char *in_data);
+
+    virtual size_t consume(size_t in_sz);
+
+    // Descriptors handed to the capture binary
+    int get_ring_fd() { return ring->ring_fd; }
+    int get_doorbell_fd() { return ring->doorbell_fd; }
+    int get_drain_fd() { return ring->drain_fd; }
+
+    // Close the memory fd once the capture binary has it
+    void close_ring_fd();
+
+    // Ask to be woken by the doorbell for the next data; callers must check
+    // used() again afterwards
+    void arm_doorbell();
+
+    // Clear a doorbell which fired
+    void ack_doorbell();
+
+protected:
+    RingbufShm(kis_shm_ring_t *in_ring);
+
+    kis_shm_ring_t *ring;
+
+    // Where reads start; only the length is shared with the writer
+    size_t start_pos;
+};
+
+#endif
+
@@ -0,0 +1,282 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "ringbuf_spsc.h"
+#include "kis_mirror_mmap.h"
+
+RingbufSPSC::RingbufSPSC(size_t in_sz) {
+    // Prefer mirrored memory so no span ever has to be split at the wrap;
+    // fall back to a plain buffer and copy around it where we can't
+    buffer = (unsigned char *) kis_mirror_alloc(in_sz, &buffer_sz);
+
+    if (buffer != NULL) {
+        mirrored = true;
+    } else {
+        mirrored = false;
+        buffer = new unsigned char[in_sz];
+        buffer_sz = in_sz;
+    }
+
+    free_peek = false;
+    free_commit = false;
+
+    write_pos = 0;
+    read_pos = 0;
+}
+
+RingbufSPSC::~RingbufSPSC() {
+    if (mirrored)
+        kis_mirror_free(buffer, buffer_sz);
+    else
+        delete[] buffer;
+}
+
+void RingbufSPSC::clear() {
+    read_pos.store(write_pos.load(std::memory_order_acquire), std::memory_order_release);
+}
+
+ssize_t RingbufSPSC::size() {
+    return buffer_sz;
+}
+
+size_t RingbufSPSC::used() {
+    // Read the consumer position first; it can only grow towards the write
+    // position, so the difference is never negative
+    uint64_t r = read_pos.load(std::memory_order_acquire);
+    uint64_t w = write_pos.load(std::memory_order_acquire);
+
+    return w - r;
+}
+
+ssize_t RingbufSPSC::available() {
+    return buffer_sz - used();
+}
+
+void RingbufSPSC::copy_in(uint64_t in_pos, const unsigned char *in_data, size_t in_sz) {
+    size_t offt = in_pos % buffer_sz;
+
+    if (mirrored || offt + in_sz <= buffer_sz) {
+        memcpy(buffer + offt, in_data, in_sz);
+    } else {
+        size_t chunk_a = buffer_sz - offt;
+
+        memcpy(buffer + offt, in_data, chunk_a);
+        memcpy(buffer, in_data + chunk_a, in_sz - chunk_a);
+    }
+}
+
+ssize_t RingbufSPSC::write(unsigned char *data, size_t in_sz) {
+    if (write_reserved) {
+        throw std::runtime_error("ringbuf spsc write already locked");
+    }
+
+    if (in_sz == 0)
+        return 0;
+
+    uint64_t w = write_pos.load(std::memory_order_relaxed);
+    uint64_t r = read_pos.load(std::memory_order_acquire);
+
+    if (buffer_sz - (w - r) < in_sz)
+        return 0;
+
+    // A NULL write commits data already placed by a zero-copy reservation
+    if (data != NULL)
+        copy_in(w, data, in_sz);
+
+    write_pos.store(w + in_sz, std::memory_order_release);
+
+    return in_sz;
+}
+
+ssize_t RingbufSPSC::reserve(unsigned char **data, size_t in_sz) {
+    if (write_reserved) {
+        throw std::runtime_error("ringbuf spsc write already locked");
+    }
+
+    if (in_sz == 0)
+        return 0;
+
+    uint64_t w = write_pos.load(std::memory_order_relaxed);
+    uint64_t r = read_pos.load(std::memory_order_acquire);
+
+    if (buffer_sz - (w - r) < in_sz)
+        return 0;
+
+    write_reserved = true;
+
+    size_t offt = w % buffer_sz;
+
+    if (mirrored || offt + in_sz <= buffer_sz) {
+        free_commit = false;
+        *data = buffer + offt;
+    } else {
+        free_commit = true;
+        *data = new unsigned char[in_sz];
+    }
+
+    return in_sz;
+}
+
+ssize_t RingbufSPSC::zero_copy_reserve(unsigned char **data, size_t in_sz) {
+    if (write_reserved) {
+        throw std::runtime_error("ringbuf spsc write already locked");
+    }
+
+    write_reserved = true;
+    free_commit = false;
+
+    if (in_sz == 0)
+        return 0;
+
+    uint64_t w = write_pos.load(std::memory_order_relaxed);
+    uint64_t r = read_pos.load(std::memory_order_acquire);
+
+    size_t offt = w % buffer_sz;
+    size_t avail = buffer_sz - (w - r);
+
+    *data = buffer + offt;
+
+    // Only offer free space we can point at directly
+    if (in_sz > avail)
+        in_sz = avail;
+
+    if (!mirrored && offt + in_sz > buffer_sz)
+        in_sz = buffer_sz - offt;
+
+    return in_sz;
+}
+
+bool RingbufSPSC::commit(unsigned char *data, size_t in_sz) {
+    if (!write_reserved) {
+        throw std::runtime_error("ringbuf spsc no pending commit");
+    }
+
+    write_reserved = false;
+
+    if (free_commit) {
+        free_commit = false;
+
+        ssize_t written = 0;
+
+        if (in_sz != 0)
+            written = write(data, in_sz);
+
+        delete[] data;
+
+        return (size_t) written == in_sz;
+    }
+
+    if (in_sz == 0)
+        return true;
+
+    return (size_t) write(NULL, in_sz) == in_sz;
+}
+
+ssize_t RingbufSPSC::peek(unsigned char **ptr, size_t in_sz) {
+    if (peek_reserved) {
+        throw std::runtime_error("ringbuf spsc peek already locked");
+    }
+
+    uint64_t r = read_pos.load(std::memory_order_relaxed);
+    uint64_t w = write_pos.load(std::memory_order_acquire);
+
+    size_t opsize = min(in_sz, (size_t) (w - r));
+
+    // Always reserve first since we may blindly peek_free later
+    peek_reserved = true;
+    free_peek = false;
+
+    if (opsize == 0)
+        return 0;
+
+    size_t offt = r % buffer_sz;
+
+    if (mirrored || offt + opsize <= buffer_sz) {
+        *ptr = buffer + offt;
+        return opsize;
+    }
+
+    free_peek = true;
+    *ptr = new unsigned char[opsize];
+
+    size_t chunk_a = buffer_sz - offt;
+
+    memcpy(*ptr, buffer + offt, chunk_a);
+    memcpy(*ptr + chunk_a, buffer, opsize - chunk_a);
+
+    return opsize;
+}
+
+ssize_t RingbufSPSC::zero_copy_peek(unsigned char **ptr, size_t in_sz) {
+    if (peek_reserved) {
+        throw std::runtime_error("ringbuf spsc peek already locked");
+    }
+
+    peek_reserved = true;
+    free_peek = false;
+
+    uint64_t r = read_pos.load(std::memory_order_relaxed);
+    uint64_t w = write_pos.load(std::memory_order_acquire);
+
+    size_t opsize = min(in_sz, (size_t) (w - r));
+
+    if (opsize == 0)
+        return 0;
+
+    size_t offt = r % buffer_sz;
+
+    // Trim to only the part of the buffer we can point to directly
+    if (!mirrored && offt + opsize > buffer_sz)
+        opsize = buffer_sz - offt;
+
+    *ptr = buffer + offt;
+
+    return opsize;
+}
+
+void RingbufSPSC::peek_free(unsigned char *in_data) {
+    if (!peek_reserved) {
+        throw std::runtime_error("ringbuf spsc peek_free on unlocked buffer");
+    }
+
+    if (free_peek)
+        delete[] in_data;
+
+    peek_reserved = false;
+    free_peek = false;
+}
+
+size_t RingbufSPSC::consume(size_t in_sz) {
+    if (peek_reserved) {
+        throw std::runtime_error("ringbuf spsc consume while peeked data pending");
+    }
+
+    uint64_t r = read_pos.load(std::memory_order_relaxed);
+    uint64_t w = write_pos.load(std::memory_order_acquire);
+
+    size_t opsize = min(in_sz, (size_t) (w - r));
+
+    read_pos.store(r + opsize, std::memory_order_release);
+
+    return opsize;
+}
+
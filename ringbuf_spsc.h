@@ -0,0 +1,94 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __RINGBUF_SPSC_H__
+#define __RINGBUF_SPSC_H__
+
+#include <stdint.h>
+#include <unistd.h>
+#include <atomic>
+#include "buffer_handler.h"
+
+// Lock-free ringbuffer for exactly one producer thread (write, reserve, commit)
+// and one consumer thread (peek, peek_free, consume, clear).  Instead of taking
+// the buffer lock, the producer only publishes the write position and the
+// consumer only publishes the read position.  Each position sits on its own
+// cache line, so the two sides don't contend for it.
+//
+// A BufferHandler built on this buffer doesn't take its own lock around it
+// either.  It must only be used where the IO driver is the only writer and
+// the protocol handler is the only reader.
+//
+// Where the platform allows, the buffer is mirrored memory (see
+// kis_mirror_mmap.h) and rounded up to a whole number of pages, so peek and
+// reserve always point straight into the buffer and never allocate.
+class RingbufSPSC : public CommonBuffer {
+public:
+    RingbufSPSC(size_t in_sz);
+    virtual ~RingbufSPSC();
+
+    virtual bool is_spsc() { return true; }
+
+    // Consumer side; discards everything written so far
+    virtual void clear();
+
+    virtual ssize_t size();
+    virtual ssize_t available();
+    virtual size_t used();
+
+    // Producer side
+    virtual ssize_t write(unsigned char *in_data, size_t in_sz);
+
+    virtual ssize_t reserve(unsigned char **data, size_t in_sz);
+    virtual ssize_t zero_copy_reserve(unsigned char **data, size_t in_sz);
+    virtual bool commit(unsigned char *data, size_t in_sz);
+
+    // Consumer side
+    virtual ssize_t peek(unsigned char **in_data, size_t in_sz);
+    virtual ssize_t zero_copy_peek(unsigned char **in_data, size_t in_sz);
+    virtual void peek_free(unsigned char *in_data);
+
+    virtual size_t consume(size_t in_sz);
+
+protected:
+    // Copy into the ring at an absolute position, wrapping as needed
+    void copy_in(uint64_t in_pos, const unsigned char *in_data, size_t in_sz);
+
+    unsigned char *buffer;
+    size_t buffer_sz;
+
+    // Is buffer mapped twice back to back?
+    bool mirrored;
+
+    // Do we need to free our peeked or committed data?  Each is only touched
+    // by its own side.
+    bool free_peek, free_commit;
+
+    // Absolute positions; the offset in the buffer is pos % buffer_sz.  Padded
+    // out so the producer and consumer are never writing the same cache line;
+    // explicit padding instead of alignas since pre-C++17 new doesn't honor
+    // over-alignment.
+    char pad0[64];
+    std::atomic<uint64_t> write_pos;
+    char pad1[64 - sizeof(std::atomic<uint64_t>)];
+    std::atomic<uint64_t> read_pos;
+    char pad2[64 - sizeof(std::atomic<uint64_t>)];
+};
+
+#endif
+
@@ -0,0 +1,204 @@
+#!/usr/bin/env ruby
+
+# Decoder for the Kismet 'kbin' binary serialization format, returned by REST
+# endpoints requested with a .kbin suffix.  The layout is described in
+# README.DEV.SERIALIZATION.
+#
+#   require_relative 'kismet_kbin'
+#   devices = KismetKbin.decode(body)
+
+#   This file is part of Kismet
+#
+#   Kismet is free software; you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation; either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   Kismet is distributed in the hope that it will be useful,
+#     but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with Kismet; if not, write to the Free Software
+#   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+class KismetKbin
+	class KbinError < StandardError
+	end
+
+	HEADER = 0xFF
+	FLAG_LITTLE_ENDIAN = 0x01
+
+	KEY_FIELD = 0x00
+	KEY_FIELD_DEFINE = 0x01
+	KEY_NAME = 0x02
+
+	# TrackerType values from trackedelement.h, and their unpack directives
+	# without the byte order suffix
+	SCALARS = {
+		1 => [ 'c', 1 ], 2 => [ 'C', 1 ],
+		3 => [ 's', 2 ], 4 => [ 'S', 2 ],
+		5 => [ 'l', 4 ], 6 => [ 'L', 4 ],
+		7 => [ 'q', 8 ], 8 => [ 'Q', 8 ],
+	}
+
+	T_STRING = 0
+	T_FLOAT = 9
+	T_DOUBLE = 10
+	T_MAC = 11
+	T_UUID = 12
+	T_VECTOR = 13
+	T_MAP = 14
+	T_INTMAP = 15
+	T_MACMAP = 16
+	T_STRINGMAP = 17
+	T_DOUBLEMAP = 18
+	T_BYTEARRAY = 19
+
+	# Field names learned from the stream; only valid for the server run
+	# which sent them
+	attr_reader :fields
+
+	def self.decode(data)
+		KismetKbin.new(data).element()
+	end
+
+	def initialize(data)
+		@data = data.b
+		@pos = 0
+		@little = true
+		@fields = { }
+	end
+
+	def bytes(sz)
+		raise KbinError, "Truncated kbin data" if @pos + sz > @data.length
+
+		r = @data[@pos, sz]
+		@pos += sz
+		r
+	end
+
+	def take(dir, sz)
+		if dir == 'c' or dir == 'C'
+			return bytes(sz).unpack(dir)[0]
+		end
+
+		bytes(sz).unpack(dir + (@little ? '<' : '>'))[0]
+	end
+
+	def float()
+		bytes(4).unpack(@little ? 'e' : 'g')[0]
+	end
+
+	def double()
+		bytes(8).unpack(@little ? 'E' : 'G')[0]
+	end
+
+	def u32()
+		take('L', 4)
+	end
+
+	def string()
+		bytes(u32()).force_encoding('UTF-8')
+	end
+
+	def name()
+		bytes(take('S', 2)).force_encoding('UTF-8')
+	end
+
+	def mac()
+		m = take('Q', 8)
+		take('Q', 8)
+
+		(0..5).map { |x| "%02X" % ((m >> ((5 - x) * 8)) & 0xFF) }.join(":")
+	end
+
+	def header()
+		raise KbinError, "Invalid kbin header" if bytes(4) != "KBIN".b
+
+		version = take('C', 1)
+		flags = take('C', 1)
+
+		raise KbinError, "Unsupported kbin version #{version}" if version != 1
+
+		@little = (flags & FLAG_LITTLE_ENDIAN) != 0
+	end
+
+	def key()
+		tag = take('C', 1)
+
+		return name() if tag == KEY_NAME
+
+		fid = take('l', 4)
+
+		if tag == KEY_FIELD_DEFINE
+			@fields[fid] = name()
+		elsif tag != KEY_FIELD
+			raise KbinError, "Unknown kbin key tag #{tag}"
+		end
+
+		raise KbinError, "Undefined kbin field id #{fid}" unless @fields.has_key?(fid)
+
+		@fields[fid]
+	end
+
+	def element()
+		t = take('C', 1)
+
+		# A header may precede any element, such as the cached records of
+		# individual devices in a list
+		while t == HEADER
+			header()
+			t = take('C', 1)
+		end
+
+		if SCALARS.has_key?(t)
+			return take(SCALARS[t][0], SCALARS[t][1])
+		end
+
+		case t
+		when T_STRING
+			return string()
+		when T_FLOAT
+			return float()
+		when T_DOUBLE
+			return double()
+		when T_MAC
+			return mac()
+		when T_UUID
+			tl = take('L', 4)
+			tm = take('S', 2)
+			th = take('S', 2)
+			cs = take('S', 2)
+			node = bytes(6).unpack('C*').map { |b| "%02x" % b }.join()
+			return "%08x-%04x-%04x-%04x-%s" % [ tl, tm, th, cs, node ]
+		when T_VECTOR
+			return (1..u32()).map { element() }
+		when T_MAP
+			r = { }
+			u32().times { k = key(); r[k] = element() }
+			return r
+		when T_INTMAP
+			r = { }
+			u32().times { k = take('l', 4); r[k] = element() }
+			return r
+		when T_MACMAP
+			r = { }
+			u32().times { k = mac(); r[k] = element() }
+			return r
+		when T_STRINGMAP
+			r = { }
+			u32().times { k = string(); r[k] = element() }
+			return r
+		when T_DOUBLEMAP
+			r = { }
+			u32().times { k = double(); r[k] = element() }
+			return r
+		when T_BYTEARRAY
+			return bytes(u32())
+		end
+
+		raise KbinError, "Unknown kbin type #{t}"
+	end
+end
@@ -0,0 +1,440 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "util.h"
+#include "configfile.h"
+#include "messagebus.h"
+#include "entrytracker.h"
+#include "gpstracker.h"
+#include "signal_heatmap.h"
+
+#define KHMT_VERSION                1
+#define KHMT_FLAG_LITTLE_ENDIAN     0x01
+
+// Web mercator stops short of the poles
+#define HEATMAP_MAX_LAT             85.0511287798
+
+template<typename T> static inline void khmt_put(std::ostream &stream, T v) {
+    stream.write((const char *) &v, sizeof(T));
+}
+
+shared_ptr<SignalHeatmap> SignalHeatmap::create_signalheatmap(GlobalRegistry *in_globalreg) {
+    if (!in_globalreg->kismet_config->FetchOptBoolean("heatmap", false))
+        return NULL;
+
+    shared_ptr<SignalHeatmap> mon(new SignalHeatmap(in_globalreg));
+    in_globalreg->RegisterLifetimeGlobal(mon);
+    in_globalreg->InsertGlobal("SIGNAL_HEATMAP", mon);
+    return mon;
+}
+
+SignalHeatmap::SignalHeatmap(GlobalRegistry *in_globalreg) :
+    Kis_Net_Httpd_CPPStream_Handler(in_globalreg) {
+
+    Httpd_RegisterRoute("GET", "/heatmap/status");
+    Httpd_RegisterRoute("GET", "/heatmap/tiles/:zoom/:x/:y");
+
+    globalreg = in_globalreg;
+
+    min_zoom =
+        globalreg->kismet_config->FetchOptUInt("heatmap_minzoom", 10);
+    max_zoom =
+        globalreg->kismet_config->FetchOptUInt("heatmap_maxzoom", 17);
+    max_tiles =
+        globalreg->kismet_config->FetchOptUInt("heatmap_max_tiles", 16384);
+
+    if (max_zoom > 22)
+        max_zoom = 22;
+
+    if (min_zoom > max_zoom)
+        min_zoom = max_zoom;
+
+    // Cells per side are a power of two from 1 to 256
+    unsigned int cells =
+        globalreg->kismet_config->FetchOptUInt("heatmap_tile_cells", 64);
+
+    cell_bits = 0;
+    while (cell_bits < 8 && (2U << cell_bits) <= cells)
+        cell_bits++;
+
+    stat_packets = 0;
+    stat_dropped = 0;
+
+    pack_comp_radiodata =
+        globalreg->packetchain->RegisterPacketComponent("RADIODATA");
+    pack_comp_gps =
+        globalreg->packetchain->RegisterPacketComponent("GPS");
+
+    // After the DLT handlers have filled in the signal and the GPS has tagged
+    // the packet
+    bin_hook_id =
+        globalreg->packetchain->RegisterHandler([this](kis_packet *in_pack) -> int {
+                return BinPacket(in_pack);
+            }, CHAINPOS_POSTCAP, 200, "heatmap");
+
+    stats_id =
+        globalreg->entrytracker->RegisterField("kismet.heatmap.status", TrackerMap,
+                "signal heatmap status");
+    stats_packets_id =
+        globalreg->entrytracker->RegisterField("kismet.heatmap.packets",
+                TrackerUInt64, "packets binned into heatmap tiles");
+    stats_dropped_id =
+        globalreg->entrytracker->RegisterField("kismet.heatmap.dropped",
+                TrackerUInt64, "packets not binned at every zoom because the tile limit was reached");
+    stats_tiles_id =
+        globalreg->entrytracker->RegisterField("kismet.heatmap.tiles",
+                TrackerUInt64, "heatmap tiles held, over all zooms");
+    stats_minzoom_id =
+        globalreg->entrytracker->RegisterField("kismet.heatmap.min_zoom",
+                TrackerUInt8, "lowest zoom level kept");
+    stats_maxzoom_id =
+        globalreg->entrytracker->RegisterField("kismet.heatmap.max_zoom",
+                TrackerUInt8, "highest zoom level kept");
+    stats_cellsperside_id =
+        globalreg->entrytracker->RegisterField("kismet.heatmap.cells_per_side",
+                TrackerUInt16, "cells along each side of a tile");
+
+    tile_id =
+        globalreg->entrytracker->RegisterField("kismet.heatmap.tile", TrackerMap,
+                "signal heatmap tile");
+    tile_zoom_id =
+        globalreg->entrytracker->RegisterField("kismet.heatmap.tile.zoom",
+                TrackerUInt8, "tile zoom level");
+    tile_x_id =
+        globalreg->entrytracker->RegisterField("kismet.heatmap.tile.x",
+                TrackerUInt32, "tile column");
+    tile_y_id =
+        globalreg->entrytracker->RegisterField("kismet.heatmap.tile.y",
+                TrackerUInt32, "tile row");
+    tile_cellsperside_id =
+        globalreg->entrytracker->RegisterField("kismet.heatmap.tile.cells_per_side",
+                TrackerUInt16, "cells along each side of the tile");
+    tile_cells_id =
+        globalreg->entrytracker->RegisterField("kismet.heatmap.tile.cells",
+                TrackerVector, "cells which have seen packets, as "
+                "[column, row, packets, max signal, mean signal]");
+
+    _MSG("Binning packet signal into heatmap tiles for zoom " +
+            UIntToString(min_zoom) + " to " + UIntToString(max_zoom), MSGFLAG_INFO);
+}
+
+SignalHeatmap::~SignalHeatmap() {
+    globalreg->RemoveGlobal("SIGNAL_HEATMAP");
+
+    if (globalreg->packetchain != NULL)
+        globalreg->packetchain->RemoveHandler(bin_hook_id, CHAINPOS_POSTCAP);
+}
+
+int SignalHeatmap::BinPacket(kis_packet *in_pack) {
+    if (in_pack->error)
+        return 0;
+
+    kis_gps_packinfo *pack_gps =
+        (kis_gps_packinfo *) in_pack->fetch(pack_comp_gps);
+
+    if (pack_gps == NULL || pack_gps->fix < 2)
+        return 0;
+
+    kis_layer1_packinfo *pack_l1 =
+        (kis_layer1_packinfo *) in_pack->fetch(pack_comp_radiodata);
+
+    if (pack_l1 == NULL || pack_l1->signal_type != kis_l1_signal_type_dbm ||
+            pack_l1->signal_dbm == 0)
+        return 0;
+
+    double lat = pack_gps->lat;
+
+    if (lat > HEATMAP_MAX_LAT)
+        lat = HEATMAP_MAX_LAT;
+    else if (lat < -HEATMAP_MAX_LAT)
+        lat = -HEATMAP_MAX_LAT;
+
+    double lon = fmod(pack_gps->lon + 180, 360);
+
+    if (lon < 0)
+        lon += 360;
+
+    // Position across the whole map, 0 to 1
+    double lat_rad = lat * M_PI / 180;
+    double map_x = lon / 360;
+    double map_y = (1 - log(tan(lat_rad) + 1 / cos(lat_rad)) / M_PI) / 2;
+
+    uint32_t cell_mask = (1U << cell_bits) - 1;
+    bool dropped = false;
+
+    std::lock_guard<std::mutex> lk(tile_mutex);
+
+    for (unsigned int z = min_zoom; z <= max_zoom; z++) {
+        // Cells across the whole map at this zoom
+        uint64_t map_cells = 1ULL << (z + cell_bits);
+
+        uint64_t cx = (uint64_t) (map_x * map_cells);
+        uint64_t cy = (uint64_t) (map_y * map_cells);
+
+        if (cx >= map_cells)
+            cx = map_cells - 1;
+        if (cy >= map_cells)
+            cy = map_cells - 1;
+
+        uint64_t key = TileKey(z, cx >> cell_bits, cy >> cell_bits);
+
+        auto ti = tiles.find(key);
+
+        if (ti == tiles.end()) {
+            if (tiles.size() >= max_tiles) {
+                dropped = true;
+                continue;
+            }
+
+            ti = tiles.insert(std::make_pair(key, heatmap_tile())).first;
+        }
+
+        uint16_t ci = ((cy & cell_mask) << cell_bits) | (cx & cell_mask);
+
+        auto cell = ti->second.cells.find(ci);
+
+        if (cell == ti->second.cells.end()) {
+            heatmap_cell c;
+            c.count = 1;
+            c.max_signal = pack_l1->signal_dbm;
+            c.sum_signal = pack_l1->signal_dbm;
+            ti->second.cells.insert(std::make_pair(ci, c));
+            continue;
+        }
+
+        cell->second.count++;
+        cell->second.sum_signal += pack_l1->signal_dbm;
+
+        if (pack_l1->signal_dbm > cell->second.max_signal)
+            cell->second.max_signal = pack_l1->signal_dbm;
+    }
+
+    stat_packets++;
+
+    if (dropped)
+        stat_dropped++;
+
+    return 1;
+}
+
+bool SignalHeatmap::ParseTilePath(const char *path, unsigned int *zoom, uint32_t *x,
+        uint32_t *y, string *suffix) {
+    vector<string> tokenurl = StrTokenize(path, "/");
+
+    // "", heatmap, tiles, z, x, y.suffix
+    if (tokenurl.size() != 6 || tokenurl[1] != "heatmap" || tokenurl[2] != "tiles")
+        return false;
+
+    size_t dpos = tokenurl[5].find_last_of('.');
+
+    if (dpos == string::npos)
+        return false;
+
+    *suffix = tokenurl[5].substr(dpos + 1);
+
+    if (sscanf(tokenurl[3].c_str(), "%u", zoom) != 1 ||
+            sscanf(tokenurl[4].c_str(), "%u", x) != 1 ||
+            sscanf(tokenurl[5].substr(0, dpos).c_str(), "%u", y) != 1)
+        return false;
+
+    if (*zoom > 22 || *x >= (1U << *zoom) || *y >= (1U << *zoom))
+        return false;
+
+    return true;
+}
+
+bool SignalHeatmap::Httpd_VerifyPath(const char *path, const char *method) {
+    if (strcmp(method, "GET") != 0)
+        return false;
+
+    string stripped = Httpd_StripSuffix(path);
+
+    if (stripped == "/heatmap/status")
+        return Httpd_CanSerialize(path);
+
+    unsigned int zoom;
+    uint32_t x, y;
+    string suffix;
+
+    if (!ParseTilePath(path, &zoom, &x, &y, &suffix))
+        return false;
+
+    if (suffix == "khmt")
+        return true;
+
+    return Httpd_CanSerialize(path);
+}
+
+void SignalHeatmap::WriteBinaryTile(std::ostream& stream, unsigned int in_zoom,
+        uint32_t in_x, uint32_t in_y, heatmap_tile *in_tile) {
+    uint8_t flags = 0;
+    uint16_t probe = 1;
+
+    if (*((uint8_t *) &probe) == 1)
+        flags |= KHMT_FLAG_LITTLE_ENDIAN;
+
+    stream.write("KHMT", 4);
+    khmt_put<uint8_t>(stream, KHMT_VERSION);
+    khmt_put<uint8_t>(stream, flags);
+    khmt_put<uint8_t>(stream, in_zoom);
+    khmt_put<uint8_t>(stream, cell_bits);
+    khmt_put<uint32_t>(stream, in_x);
+    khmt_put<uint32_t>(stream, in_y);
+    khmt_put<uint32_t>(stream, in_tile == NULL ? 0 : in_tile->cells.size());
+
+    if (in_tile == NULL)
+        return;
+
+    for (auto c : in_tile->cells) {
+        khmt_put<uint16_t>(stream, c.first);
+        khmt_put<uint32_t>(stream, c.second.count);
+        khmt_put<int8_t>(stream, c.second.max_signal);
+        khmt_put<int8_t>(stream, c.second.sum_signal / (int64_t) c.second.count);
+    }
+}
+
+void SignalHeatmap::Httpd_CreateStreamResponse(
+        Kis_Net_Httpd *httpd __attribute__((unused)),
+        Kis_Net_Httpd_Connection *connection __attribute__((unused)),
+        const char *path, const char *method,
+        const char *upload_data __attribute__((unused)),
+        size_t *upload_data_size __attribute__((unused)),
+        std::stringstream &stream) {
+
+    if (strcmp(method, "GET") != 0)
+        return;
+
+    SharedTrackerElement e;
+
+    if (Httpd_StripSuffix(path) == "/heatmap/status") {
+        SharedTrackerElement stats(new TrackerElement(TrackerMap, stats_id));
+
+        e.reset(new TrackerElement(TrackerUInt64, stats_packets_id));
+        e->set((uint64_t) stat_packets);
+        stats->add_map(e);
+
+        e.reset(new TrackerElement(TrackerUInt64, stats_dropped_id));
+        e->set((uint64_t) stat_dropped);
+        stats->add_map(e);
+
+        {
+            std::lock_guard<std::mutex> lk(tile_mutex);
+
+            e.reset(new TrackerElement(TrackerUInt64, stats_tiles_id));
+            e->set((uint64_t) tiles.size());
+            stats->add_map(e);
+        }
+
+        e.reset(new TrackerElement(TrackerUInt8, stats_minzoom_id));
+        e->set((uint8_t) min_zoom);
+        stats->add_map(e);
+
+        e.reset(new TrackerElement(TrackerUInt8, stats_maxzoom_id));
+        e->set((uint8_t) max_zoom);
+        stats->add_map(e);
+
+        e.reset(new TrackerElement(TrackerUInt16, stats_cellsperside_id));
+        e->set((uint16_t) (1U << cell_bits));
+        stats->add_map(e);
+
+        Httpd_Serialize(path, stream, stats);
+        return;
+    }
+
+    unsigned int zoom;
+    uint32_t x, y;
+    string suffix;
+
+    if (!ParseTilePath(path, &zoom, &x, &y, &suffix))
+        return;
+
+    std::lock_guard<std::mutex> lk(tile_mutex);
+
+    // Tiles nothing has been seen in, or outside the kept zooms, are empty
+    heatmap_tile *tile = NULL;
+
+    auto ti = tiles.find(TileKey(zoom, x, y));
+
+    if (ti != tiles.end())
+        tile = &(ti->second);
+
+    if (suffix == "khmt") {
+        WriteBinaryTile(stream, zoom, x, y, tile);
+        return;
+    }
+
+    SharedTrackerElement t(new TrackerElement(TrackerMap, tile_id));
+
+    e.reset(new TrackerElement(TrackerUInt8, tile_zoom_id));
+    e->set((uint8_t) zoom);
+    t->add_map(e);
+
+    e.reset(new TrackerElement(TrackerUInt32, tile_x_id));
+    e->set((uint32_t) x);
+    t->add_map(e);
+
+    e.reset(new TrackerElement(TrackerUInt32, tile_y_id));
+    e->set((uint32_t) y);
+    t->add_map(e);
+
+    e.reset(new TrackerElement(TrackerUInt16, tile_cellsperside_id));
+    e->set((uint16_t) (1U << cell_bits));
+    t->add_map(e);
+
+    SharedTrackerElement cells(new TrackerElement(TrackerVector, tile_cells_id));
+    t->add_map(cells);
+
+    if (tile != NULL) {
+        uint32_t cell_mask = (1U << cell_bits) - 1;
+
+        for (auto c : tile->cells) {
+            SharedTrackerElement cv(new TrackerElement(TrackerVector));
+
+            e.reset(new TrackerElement(TrackerUInt16));
+            e->set((uint16_t) (c.first & cell_mask));
+            cv->add_vector(e);
+
+            e.reset(new TrackerElement(TrackerUInt16));
+            e->set((uint16_t) (c.first >> cell_bits));
+            cv->add_vector(e);
+
+            e.reset(new TrackerElement(TrackerUInt32));
+            e->set((uint32_t) c.second.count);
+            cv->add_vector(e);
+
+            e.reset(new TrackerElement(TrackerInt32));
+            e->set((int32_t) c.second.max_signal);
+            cv->add_vector(e);
+
+            e.reset(new TrackerElement(TrackerInt32));
+            e->set((int32_t) (c.second.sum_signal / (int64_t) c.second.count));
+            cv->add_vector(e);
+
+            cells->add_vector(cv);
+        }
+    }
+
+    Httpd_Serialize(path, stream, t);
+}
+
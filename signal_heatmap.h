@@ -0,0 +1,118 @@
+/*
+    This file is part of Kismet
+
+    Kismet is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    Kismet is distributed in the hope that it will be useful,
+      but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Kismet; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __SIGNAL_HEATMAP_H__
+#define __SIGNAL_HEATMAP_H__
+
+#include "config.h"
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include "globalregistry.h"
+#include "packet.h"
+#include "packetchain.h"
+#include "kis_net_microhttpd.h"
+
+// Signal heatmap tiles
+//
+// With 'heatmap=true', every packet with a GPS location and a signal in dBm
+// is binned into map tiles as it is captured, so a map can show where signal
+// was seen without downloading the location history of every device.
+//
+// Tiles follow the usual web map numbering (web mercator, zoom/x/y), and are
+// kept for every zoom from heatmap_minzoom to heatmap_maxzoom.  Each tile is
+// split into heatmap_tile_cells cells per side, and each cell keeps the number
+// of packets, and the strongest and mean signal, seen in it.  Only cells which
+// have seen a packet are stored.
+//
+// Tiles are served at /heatmap/tiles/Z/X/Y.khmt in a compact binary form (see
+// README.DEV.SERIALIZATION), or as json or msgpack; counters are served at
+// /heatmap/status
+class SignalHeatmap : public LifetimeGlobal, public Kis_Net_Httpd_CPPStream_Handler {
+public:
+    // Returns NULL unless heatmap is enabled
+    static shared_ptr<SignalHeatmap> create_signalheatmap(GlobalRegistry *in_globalreg);
+
+private:
+    SignalHeatmap(GlobalRegistry *in_globalreg);
+
+public:
+    virtual ~SignalHeatmap();
+
+    virtual bool Httpd_VerifyPath(const char *path, const char *method);
+
+    virtual void Httpd_CreateStreamResponse(Kis_Net_Httpd *httpd,
+            Kis_Net_Httpd_Connection *connection,
+            const char *url, const char *method, const char *upload_data,
+            size_t *upload_data_size, std::stringstream &stream);
+
+protected:
+    struct heatmap_cell {
+        uint32_t count;
+        int32_t max_signal;
+        int64_t sum_signal;
+    };
+
+    struct heatmap_tile {
+        // Cells keyed by row * cells per side + column
+        std::unordered_map<uint16_t, heatmap_cell> cells;
+    };
+
+    GlobalRegistry *globalreg;
+
+    // Post-capture:  bin the location and signal of the packet
+    int BinPacket(kis_packet *in_pack);
+
+    // Tile key for a zoom and tile position
+    static uint64_t TileKey(unsigned int in_zoom, uint32_t in_x, uint32_t in_y) {
+        return ((uint64_t) in_zoom << 58) | ((uint64_t) in_x << 29) | in_y;
+    }
+
+    // Parse /heatmap/tiles/Z/X/Y.suffix
+    bool ParseTilePath(const char *path, unsigned int *zoom, uint32_t *x,
+            uint32_t *y, string *suffix);
+
+    void WriteBinaryTile(std::ostream& stream, unsigned int in_zoom, uint32_t in_x,
+            uint32_t in_y, heatmap_tile *in_tile);
+
+    std::mutex tile_mutex;
+    std::unordered_map<uint64_t, heatmap_tile> tiles;
+
+    unsigned int min_zoom, max_zoom;
+    unsigned int cell_bits;
+    unsigned int max_tiles;
+
+    int bin_hook_id;
+
+    int pack_comp_radiodata, pack_comp_gps;
+
+    std::atomic<uint64_t> stat_packets, stat_dropped;
+
+    int stats_id, stats_packets_id, stats_dropped_id, stats_tiles_id,
+        stats_minzoom_id, stats_maxzoom_id, stats_cellsperside_id;
+
+    int tile_id, tile_zoom_id, tile_x_id, tile_y_id, tile_cellsperside_id,
+        tile_cells_id;
+};
+
+#endif
+
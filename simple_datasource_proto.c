@@ -22,33 +22,23 @@
 #include <arpa/inet.h>
 
 #include "simple_datasource_proto.h"
+#include "kis_adler32.h"
 
 // Use alternate simpler msgpack library, msgpuck
 #include "msgpuck.h"
 // And use our resizing buffer code
 #include "msgpuck_buffer.h"
 
-uint32_t adler32_partial_csum(uint8_t *in_buf, size_t in_len,
-        uint32_t *s1, uint32_t *s2) {
-	size_t i;
-	uint8_t *buf = in_buf;
-	int CHAR_OFFSET = 0;
-
-    if (in_len < 4)
-        return 0;
-
-    for (i = 0; i < (in_len - 4); i += 4) {
-        *s2 += 4 * (*s1 + buf[i]) + 3 * buf[i + 1] + 2 * buf[i+2] + buf[i + 3] + 
-            10 * CHAR_OFFSET;
-        *s1 += (buf[i + 0] + buf[i + 1] + buf[i + 2] + buf[i + 3] + 4 * CHAR_OFFSET); 
-	}
+/* Checksums are on unless a local server has asked us to turn them off */
+static int simple_cap_proto_checksum = 1;
 
-    for (; i < in_len; i++) {
-        *s1 += (buf[i] + CHAR_OFFSET); 
-        *s2 += *s1;
-	}
+void simple_cap_proto_set_checksum(int in_checksum) {
+    simple_cap_proto_checksum = in_checksum;
+}
 
-	return (*s1 & 0xffff) + (*s2 << 16);
+uint32_t adler32_partial_csum(uint8_t *in_buf, size_t in_len,
+        uint32_t *s1, uint32_t *s2) {
+    return kis_adler32_partial(in_buf, in_len, s1, s2);
 }
 
 uint32_t adler32_csum(uint8_t *in_buf, size_t in_len) {
@@ -110,10 +100,12 @@ simple_cap_proto_frame_t *encode_simple_cap_proto(const char *in_type, uint32_t
         offt += sizeof(simple_cap_proto_kv_t) + ntohl(kv->header.obj_sz);
     }
 
-    hcsum = adler32_csum((uint8_t *) cp, sizeof(simple_cap_proto_t));
-    dcsum = adler32_csum((uint8_t *) cp, sz);
-    cp->header.header_checksum = htonl(hcsum);
-    cp->header.data_checksum = htonl(dcsum);
+    if (simple_cap_proto_checksum) {
+        hcsum = adler32_csum((uint8_t *) cp, sizeof(simple_cap_proto_t));
+        dcsum = adler32_csum((uint8_t *) cp, sz);
+        cp->header.header_checksum = htonl(hcsum);
+        cp->header.data_checksum = htonl(dcsum);
+    }
 
     return cp;
 }
@@ -150,6 +142,11 @@ simple_cap_proto_t *encode_simple_cap_proto_hdr(size_t *ret_sz,
     cp->packet_sz = htonl((uint32_t) sz);
     cp->num_kv_pairs = htonl(in_kv_len);
 
+    *ret_sz = sz;
+
+    if (!simple_cap_proto_checksum)
+        return cp;
+
     /* calculate the incremental checksum; first we calc the header and save
      * it as the header-only cssum */
     hcsum = adler32_partial_csum((uint8_t *) cp, 
@@ -171,11 +168,86 @@ simple_cap_proto_t *encode_simple_cap_proto_hdr(size_t *ret_sz,
     cp->header_checksum = htonl(hcsum);
     cp->data_checksum = htonl(dcsum);
 
-    *ret_sz = sz;
-
     return cp;
 }
 
+size_t encode_simple_cap_proto_mux(uint8_t *ret_hdr, uint32_t in_muxid,
+        uint8_t *in_frame, size_t in_frame_sz) {
+    simple_cap_proto_t *cp = (simple_cap_proto_t *) ret_hdr;
+    simple_cap_proto_kv_t *id_kv = 
+        (simple_cap_proto_kv_t *) (ret_hdr + sizeof(simple_cap_proto_t));
+    simple_cap_proto_kv_t *frame_kv =
+        (simple_cap_proto_kv_t *) (ret_hdr + sizeof(simple_cap_proto_t) +
+                sizeof(simple_cap_proto_kv_t) + sizeof(uint32_t));
+    size_t sz = SIMPLE_CAP_PROTO_MUX_HDR_SZ + in_frame_sz;
+    uint32_t muxid = htonl(in_muxid);
+    uint32_t hcsum, dcsum;
+    uint32_t csum_s1 = 0;
+    uint32_t csum_s2 = 0;
+
+    cp->signature = htonl(KIS_CAP_SIMPLE_PROTO_SIG);
+    cp->header_checksum = 0;
+    cp->data_checksum = 0;
+    cp->sequence_number = 0;
+    snprintf(cp->type, 16, "%.16s", "MUX");
+    cp->packet_sz = htonl((uint32_t) sz);
+    cp->num_kv_pairs = htonl(2);
+
+    snprintf(id_kv->header.key, 16, "%.16s", "MUXID");
+    id_kv->header.obj_sz = htonl(sizeof(uint32_t));
+    memcpy(id_kv->object, &muxid, sizeof(uint32_t));
+
+    snprintf(frame_kv->header.key, 16, "%.16s", "FRAME");
+    frame_kv->header.obj_sz = htonl(in_frame_sz);
+
+    if (!simple_cap_proto_checksum)
+        return sz;
+
+    hcsum = adler32_partial_csum(ret_hdr, sizeof(simple_cap_proto_t), 
+            &csum_s1, &csum_s2);
+    adler32_partial_csum(ret_hdr + sizeof(simple_cap_proto_t), 
+            SIMPLE_CAP_PROTO_MUX_HDR_SZ - sizeof(simple_cap_proto_t),
+            &csum_s1, &csum_s2);
+    dcsum = adler32_partial_csum(in_frame, in_frame_sz, &csum_s1, &csum_s2);
+
+    cp->header_checksum = htonl(hcsum);
+    cp->data_checksum = htonl(dcsum);
+
+    return sz;
+}
+
+int decode_simple_cap_proto_mux(simple_cap_proto_frame_t *in_frame, 
+        uint32_t *ret_muxid, uint8_t **ret_frame, size_t *ret_frame_sz) {
+    simple_cap_proto_kv_t *kv;
+    uint32_t muxid;
+    int len;
+
+    if (find_simple_cap_proto_kv(in_frame, "MUXID", &kv) != sizeof(uint32_t))
+        return -1;
+
+    memcpy(&muxid, kv->object, sizeof(uint32_t));
+    *ret_muxid = ntohl(muxid);
+
+    *ret_frame = NULL;
+    *ret_frame_sz = 0;
+
+    if ((len = find_simple_cap_proto_kv(in_frame, "FRAME", &kv)) < 0)
+        return -1;
+
+    if (len == 0)
+        return 1;
+
+    /* A wrapped frame has to be a whole frame */
+    if ((size_t) len < sizeof(simple_cap_proto_t) || 
+            ntohl(((simple_cap_proto_t *) kv->object)->packet_sz) != (uint32_t) len)
+        return -1;
+
+    *ret_frame = kv->object;
+    *ret_frame_sz = len;
+
+    return 1;
+}
+
 simple_cap_proto_kv_t *encode_kv_success(unsigned int success, uint32_t sequence) {
     simple_cap_proto_kv_t *kv;
 
@@ -271,10 +343,16 @@ simple_cap_proto_kv_t *encode_kv_capif(const char *capif) {
 
 simple_cap_proto_kv_t *encode_kv_capdata(struct timeval in_ts, 
         uint32_t in_pack_sz, uint8_t *in_pack) {
+    return encode_kv_capdata_truncated(in_ts, in_pack_sz, in_pack_sz, in_pack);
+}
+
+simple_cap_proto_kv_t *encode_kv_capdata_truncated(struct timeval in_ts, 
+        uint32_t in_orig_sz, uint32_t in_pack_sz, uint8_t *in_pack) {
 
     const char *key_tv_sec = "tv_sec";
     const char *key_tv_usec = "tv_usec";
     const char *key_pack_sz = "size";
+    const char *key_orig_sz = "origlen";
     const char *key_packet = "packet";
 
     msgpuck_buffer_t *puckbuffer;
@@ -289,7 +367,8 @@ simple_cap_proto_kv_t *encode_kv_capdata(struct timeval in_ts,
         return NULL;
     }
 
-    mp_b_encode_map(puckbuffer, 4);
+    /* Only truncated packets carry their original length */
+    mp_b_encode_map(puckbuffer, in_orig_sz > in_pack_sz ? 5 : 4);
 
     mp_b_encode_str(puckbuffer, key_tv_sec, strlen(key_tv_sec));
     mp_b_encode_uint(puckbuffer, in_ts.tv_sec);
@@ -300,6 +379,11 @@ simple_cap_proto_kv_t *encode_kv_capdata(struct timeval in_ts,
     mp_b_encode_str(puckbuffer, key_pack_sz, strlen(key_pack_sz));
     mp_b_encode_uint(puckbuffer, in_pack_sz);
 
+    if (in_orig_sz > in_pack_sz) {
+        mp_b_encode_str(puckbuffer, key_orig_sz, strlen(key_orig_sz));
+        mp_b_encode_uint(puckbuffer, in_orig_sz);
+    }
+
     mp_b_encode_str(puckbuffer, key_packet, strlen(key_packet));
     mp_b_encode_bin(puckbuffer, (const char *) in_pack, in_pack_sz);
 
@@ -320,6 +404,29 @@ simple_cap_proto_kv_t *encode_kv_capdata(struct timeval in_ts,
     return kv;
 }
 
+simple_cap_proto_kv_t *encode_kv_metaframe(const simple_cap_proto_metaframe_t *in_meta) {
+    simple_cap_proto_kv_t *kv;
+    size_t content_sz;
+
+    if (in_meta->hdr_len > SIMPLE_CAP_METAFRAME_HDR_MAX)
+        return NULL;
+
+    /* Only the part of the header we have is sent */
+    content_sz = SIMPLE_CAP_METAFRAME_FIXED_SZ + in_meta->hdr_len;
+
+    kv = (simple_cap_proto_kv_t *) malloc(sizeof(simple_cap_proto_kv_t) + content_sz);
+
+    if (kv == NULL)
+        return NULL;
+
+    snprintf(kv->header.key, 16, "%.16s", "METAFRAME");
+    kv->header.obj_sz = htonl(content_sz);
+
+    memcpy(kv->object, in_meta, content_sz);
+
+    return kv;
+}
+
 simple_cap_proto_kv_t *encode_kv_gps(double in_lat, double in_lon, double in_alt,
         double in_speed, double in_heading,
         double in_precision, int in_fix, time_t in_time, 
@@ -878,6 +985,99 @@ simple_cap_proto_kv_t *encode_kv_specset(uint64_t start_mhz, uint64_t end_mhz,
 
 }
 
+simple_cap_proto_kv_t *encode_kv_drops(uint64_t kernel_drops, uint64_t helper_drops) {
+    const char *key_kernel = "kernel";
+    const char *key_helper = "helper";
+
+    simple_cap_proto_kv_t *kv;
+    size_t content_sz;
+
+    msgpuck_buffer_t *puckbuffer;
+
+    puckbuffer = mp_b_create_buffer(64);
+
+    if (puckbuffer == NULL) {
+        return NULL;
+    }
+
+    mp_b_encode_map(puckbuffer, 2);
+
+    mp_b_encode_str(puckbuffer, key_kernel, strlen(key_kernel));
+    mp_b_encode_uint(puckbuffer, kernel_drops);
+
+    mp_b_encode_str(puckbuffer, key_helper, strlen(key_helper));
+    mp_b_encode_uint(puckbuffer, helper_drops);
+
+    content_sz = mp_b_used_buffer(puckbuffer);
+
+    kv = (simple_cap_proto_kv_t *) malloc(sizeof(simple_cap_proto_kv_t) + content_sz);
+
+    if (kv == NULL) {
+        mp_b_free_buffer(puckbuffer);
+        return NULL;
+    }
+
+    snprintf(kv->header.key, 16, "%.16s", "DROPS");
+    kv->header.obj_sz = htonl(content_sz);
+
+    memcpy(kv->object, mp_b_get_buffer(puckbuffer), content_sz);
+
+    mp_b_free_buffer(puckbuffer);
+
+    return kv;
+}
+
+simple_cap_proto_kv_t *encode_kv_hopstats(uint64_t switches, uint64_t total_usec,
+        uint64_t max_usec, uint64_t late) {
+    const char *key_switches = "switches";
+    const char *key_total = "total_usec";
+    const char *key_max = "max_usec";
+    const char *key_late = "late";
+
+    simple_cap_proto_kv_t *kv;
+    size_t content_sz;
+
+    msgpuck_buffer_t *puckbuffer;
+
+    puckbuffer = mp_b_create_buffer(128);
+
+    if (puckbuffer == NULL) {
+        return NULL;
+    }
+
+    mp_b_encode_map(puckbuffer, 4);
+
+    mp_b_encode_str(puckbuffer, key_switches, strlen(key_switches));
+    mp_b_encode_uint(puckbuffer, switches);
+
+    mp_b_encode_str(puckbuffer, key_total, strlen(key_total));
+    mp_b_encode_uint(puckbuffer, total_usec);
+
+    mp_b_encode_str(puckbuffer, key_max, strlen(key_max));
+    mp_b_encode_uint(puckbuffer, max_usec);
+
+    mp_b_encode_str(puckbuffer, key_late, strlen(key_late));
+    mp_b_encode_uint(puckbuffer, late);
+
+    content_sz = mp_b_used_buffer(puckbuffer);
+
+    kv = (simple_cap_proto_kv_t *) malloc(sizeof(simple_cap_proto_kv_t) + content_sz);
+
+    if (kv == NULL) {
+        mp_b_free_buffer(puckbuffer);
+        return NULL;
+    }
+
+    snprintf(kv->header.key, 16, "%.16s", "HOPSTATS");
+    kv->header.obj_sz = htonl(content_sz);
+
+    memcpy(kv->object, mp_b_get_buffer(puckbuffer), content_sz);
+
+    mp_b_free_buffer(puckbuffer);
+
+    return kv;
+}
+
 simple_cap_proto_kv_t *encode_kv_message(const char *message, unsigned int flags) {
 
     const char *key_message = "msg";
@@ -927,6 +1127,9 @@ int validate_simple_cap_proto_header(simple_cap_proto_t *in_packet) {
     uint32_t original_dcsum = ntohl(in_packet->data_checksum);
     uint32_t calc_csum;
 
+    if (!simple_cap_proto_checksum)
+        return 1;
+
     /* Zero csum field in packet */
     in_packet->header_checksum = 0;
     in_packet->data_checksum = 0;
@@ -956,28 +1159,30 @@ int validate_simple_cap_proto(simple_cap_proto_t *in_packet) {
     size_t kv_pos;
     simple_cap_proto_kv_t *kv;
 
-    /* Zero csum field in packet */
-    in_packet->header_checksum = 0;
-    in_packet->data_checksum = 0;
+    if (simple_cap_proto_checksum) {
+        /* Zero csum field in packet */
+        in_packet->header_checksum = 0;
+        in_packet->data_checksum = 0;
 
-    /* Checksum the contents */
-    calc_csum = adler32_csum((uint8_t *) in_packet, sizeof(simple_cap_proto_t));
+        /* Checksum the contents */
+        calc_csum = adler32_csum((uint8_t *) in_packet, sizeof(simple_cap_proto_t));
 
-    if (original_hcsum != calc_csum) {
-        fprintf(stderr, "debug - hcsum didn't match\n");
-        return -1;
-    }
+        if (original_hcsum != calc_csum) {
+            fprintf(stderr, "debug - hcsum didn't match\n");
+            return -1;
+        }
 
-    calc_csum = adler32_csum((uint8_t *) in_packet, ntohl(in_packet->packet_sz));
+        calc_csum = adler32_csum((uint8_t *) in_packet, ntohl(in_packet->packet_sz));
 
-    if (original_dcsum != calc_csum) {
-        fprintf(stderr, "debug - dcsum didn't match\n");
-        return -1;
-    }
+        if (original_dcsum != calc_csum) {
+            fprintf(stderr, "debug - dcsum didn't match\n");
+            return -1;
+        }
 
-    /* Restore the contents */
-    in_packet->header_checksum = htonl(original_hcsum);
-    in_packet->data_checksum = htonl(original_dcsum);
+        /* Restore the contents */
+        in_packet->header_checksum = htonl(original_hcsum);
+        in_packet->data_checksum = htonl(original_dcsum);
+    }
 
     if (ntohl(frame->header.num_kv_pairs) != 0 && 
                 ntohl(frame->header.packet_sz) - sizeof(simple_cap_proto_t) <
@@ -1056,7 +1261,7 @@ int get_simple_cap_proto_next_kv(simple_cap_proto_frame_t *in_packet, char **key
     }
 
     /* If there is room, assign it */
-    kv = (simple_cap_proto_kv_t *) *last_kv + kv_offt;
+    kv = (simple_cap_proto_kv_t *) (in_packet->data + kv_offt);
 
     /* Get the new length */
     this_len = ntohl(kv->header.obj_sz);
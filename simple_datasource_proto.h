@@ -102,6 +102,114 @@ struct simple_cap_proto_success_value {
 } __attribute__((packed));
 typedef struct simple_cap_proto_success_value simple_cap_proto_success_t;
 
+/* Compressed batch of data, the value of the ZBATCH KV in a ZDATABATCH frame.
+ *
+ * The KVs a DATABATCH frame would carry are compressed, in order, with the
+ * method given.  For SIMPLE_CAP_ZBATCH_DEFLATE the connection carries one raw
+ * deflate (RFC1951) stream, starting from the SIMPLE_CAP_ZDICT dictionary, with
+ * a sync flush ending each batch; SIMPLE_CAP_ZBATCH_RESET marks the first batch
+ * of a new stream.
+ *
+ * Compression is only used when the server offers it with a COMPRESSION KV in
+ * OPENDEVICE. */
+#define SIMPLE_CAP_ZBATCH_DEFLATE   1
+
+#define SIMPLE_CAP_ZBATCH_RESET     0x01
+
+struct simple_cap_proto_zbatch {
+    /* Compression method */
+    uint8_t method;
+    /* Stream flags */
+    uint8_t flags;
+    uint16_t pad;
+    /* Number of KV pairs in the batch */
+    uint32_t num_kv_pairs;
+    /* Uncompressed size of the KV pairs */
+    uint32_t data_sz;
+    /* Compressed KV pairs */
+    uint8_t data[0];
+} __attribute__((packed));
+typedef struct simple_cap_proto_zbatch simple_cap_proto_zbatch_t;
+
+/* Preset deflate dictionary for compressed batches.  Built from what most
+ * batches repeat:  common 802.11 information elements and frame headers, and
+ * the KV headers and msgpack keys of the GPS, SIGNAL, and PACKET KVs.  Deflate
+ * finds recent strings most cheaply, so the most common come last.
+ *
+ * Changing the dictionary breaks compatibility with existing capture tools. */
+#define SIMPLE_CAP_ZDICT \
+    /* GPS KV */ \
+    "GPS" "\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00" \
+    "\x8a\xa3" "lat" "\xcb\xa3" "lon" "\xcb\xa3" "alt" "\xcb\xa5" "speed" "\xcb" \
+    "\xa7" "heading" "\xcb\xa9" "precision" "\xcb\xa3" "fix" "\xa4" "time" \
+    "\xa4" "type" "\xa4" "name" \
+    /* RSN, WMM, HT, and rate IEs */ \
+    "\x30\x14\x01\x00\x00\x0f\xac\x04\x01\x00\x00\x0f\xac\x04\x01\x00\x00\x0f\xac\x02" \
+    "\x0c\x00" \
+    "\xdd\x18\x00\x50\xf2\x02\x01\x01\x80\x00\x03\xa4\x00\x00\x27\xa4\x00\x00" \
+    "\x42\x43\x5e\x00\x62\x32\x2f\x00" \
+    "\x2d\x1a\xef\x19\x1b\xff\xff\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00" \
+    "\x3d\x16" \
+    "\x32\x04\x30\x48\x60\x6c\x2a\x01\x00\x05\x04\x00\x01\x00\x00" \
+    "\x03\x01\x01\x03\x01\x06\x03\x01\x0b" \
+    "\x01\x08\x82\x84\x8b\x96\x0c\x12\x18\x24" \
+    "\x01\x08\x8c\x12\x98\x24\xb0\x48\x60\x6c" \
+    /* Control, management, and data frame headers */ \
+    "\xd4\x00\x00\x00\xc4\x00\x00\x00\xb4\x00\x00\x00\x94\x00\x00\x00" \
+    "\x50\x00\x3a\x01\x40\x00\x00\x00\xff\xff\xff\xff\xff\xff" \
+    "\x08\x01\x2c\x00\x08\x02\x2c\x00\x88\x01\x2c\x00\x88\x02\x2c\x00\x88\x42" \
+    "\x80\x00\x00\x00\xff\xff\xff\xff\xff\xff" \
+    "\x64\x00\x11\x04\x00" \
+    /* SIGNAL KV */ \
+    "SIGNAL" "\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00" \
+    "\x87\xaa" "signal_dbm" "\xd0\xab" "signal_rssi" "\x00\xa9" "noise_dbm" "\x00" \
+    "\xaa" "noise_rssi" "\x00\xa8" "freq_khz" "\xcb\xa7" "channel" "\xa8" "datarate" \
+    "\xcb" \
+    /* PACKET KV */ \
+    "PACKET" "\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00" \
+    "\x84\xa6" "tv_sec" "\xce\xa7" "tv_usec" "\xce\xa4" "size" "\xcd\xa6" "packet" \
+    "\xc5"
+
+/* Metadata-only frame, the value of a METAFRAME KV, sent in place of the
+ * PACKET KV by a source opened with 'metadata=true'.
+ *
+ * The helper keeps the 802.11 header of the frame, without any payload, and
+ * what the capture header said about the radio; the server treats it as a
+ * truncated 802.11 frame with that layer1 data already decoded.  Only the
+ * first hdr_len bytes of hdr are sent.  Multi-byte fields are in network
+ * order. */
+#define SIMPLE_CAP_METAFRAME_HDR_MAX    36
+
+#define SIMPLE_CAP_METAFRAME_SIGNAL     0x01
+#define SIMPLE_CAP_METAFRAME_NOISE      0x02
+#define SIMPLE_CAP_METAFRAME_FREQ       0x04
+#define SIMPLE_CAP_METAFRAME_RATE       0x08
+
+struct simple_cap_proto_metaframe {
+    uint32_t tv_sec;
+    uint32_t tv_usec;
+    /* Length of the whole 802.11 frame */
+    uint32_t orig_len;
+    /* Frequency, in khz */
+    uint32_t freq_khz;
+    /* Data rate, in 100kbit/s */
+    uint16_t datarate;
+    /* Signal and noise in dBm */
+    int8_t signal_dbm;
+    int8_t noise_dbm;
+    /* Which of the above were present in the capture header */
+    uint8_t flags;
+    /* Bytes of 802.11 header */
+    uint8_t hdr_len;
+    uint16_t pad;
+    uint8_t hdr[SIMPLE_CAP_METAFRAME_HDR_MAX];
+} __attribute__((packed));
+typedef struct simple_cap_proto_metaframe simple_cap_proto_metaframe_t;
+
+#define SIMPLE_CAP_METAFRAME_FIXED_SZ \
+    (sizeof(simple_cap_proto_metaframe_t) - SIMPLE_CAP_METAFRAME_HDR_MAX)
+
+
 /* Adler32 checksum */
 uint32_t adler32_csum(uint8_t *in_buffer, size_t in_len);
 
@@ -112,6 +220,14 @@ uint32_t adler32_csum(uint8_t *in_buffer, size_t in_len);
 uint32_t adler32_partial_csum(uint8_t *in_buf, size_t in_len,
         uint32_t *s1, uint32_t *s2); 
 
+/* Turn frame checksums on or off for this process; checksums are on by default.
+ *
+ * With checksums off, encoded frames carry zero checksums and received frames
+ * are not checked.  Only used on local pipes to a Kismet server which asked for
+ * it with --disable-checksum.
+ */
+void simple_cap_proto_set_checksum(int in_checksum);
+
 /* Encode a KV list into a packet; DOES NOT free any supplied data, and performs a
  * memcpy of all the data into a single record.
  *
@@ -143,6 +259,37 @@ simple_cap_proto_t *encode_simple_cap_proto_hdr(size_t *ret_sz,
         const char *in_type, uint32_t in_seqno,
         simple_cap_proto_kv_t **in_kv_list, unsigned int in_kv_len);
 
+/* Multiplexed helpers wrap each frame of a channel in a MUX frame, holding a MUXID
+ * KV with the uint32 channel id and a FRAME KV with the complete wrapped frame.  A
+ * MUXCLOSE frame holds only the MUXID KV, and closes the channel. */
+#define SIMPLE_CAP_PROTO_MUX_HDR_SZ \
+    (sizeof(simple_cap_proto_t) + (sizeof(simple_cap_proto_kv_h_t) * 2) + \
+     sizeof(uint32_t))
+
+/* Encode the start of a MUX frame wrapping a complete encoded frame:  the frame
+ * header, the MUXID KV, and the header of the FRAME KV, which the wrapped frame
+ * follows directly.  The checksums cover the wrapped frame, but it is not
+ * copied.
+ *
+ * ret_hdr must hold SIMPLE_CAP_PROTO_MUX_HDR_SZ bytes.
+ *
+ * Returns:
+ * Total size of the MUX frame
+ */
+size_t encode_simple_cap_proto_mux(uint8_t *ret_hdr, uint32_t in_muxid,
+        uint8_t *in_frame, size_t in_frame_sz);
+
+/* Find the channel id and the wrapped frame of a validated MUX or MUXCLOSE
+ * frame.  ret_frame points into the MUX frame, and is NULL if there is no 
+ * wrapped frame.
+ *
+ * Returns:
+ * -1   Malformed frame
+ *  1   Success
+ */
+int decode_simple_cap_proto_mux(simple_cap_proto_frame_t *in_frame,
+        uint32_t *ret_muxid, uint8_t **ret_frame, size_t *ret_frame_sz);
+
 /* Encode raw data into a kv pair.  Copies provided data, and DOES NOT free or
  * modify the original buffers.
  *
@@ -219,6 +366,27 @@ simple_cap_proto_kv_t *encode_kv_capif(const char *capif);
 simple_cap_proto_kv_t *encode_kv_capdata(struct timeval in_ts, 
         uint32_t in_pack_sz, uint8_t *in_pack);
 
+/* Encode the first in_cap_sz bytes of a packet of in_orig_sz bytes into a 
+ * PACKET KV, with the original length in an 'origlen' field
+ *
+ * Returns:
+ * Pointer on success
+ * Null on failure
+ *
+ */
+simple_cap_proto_kv_t *encode_kv_capdata_truncated(struct timeval in_ts, 
+        uint32_t in_orig_sz, uint32_t in_cap_sz, uint8_t *in_pack);
+
+/* Encode a metadata-only frame into a METAFRAME KV; the record is already in
+ * network order
+ *
+ * Returns:
+ * Pointer on success
+ * Null on failure
+ *
+ */
+simple_cap_proto_kv_t *encode_kv_metaframe(const simple_cap_proto_metaframe_t *in_meta);
+
 /* Encode a GPS KV
  *
  * This should only be needed when the GPS data is not encoded in the DLT already.
@@ -349,6 +517,32 @@ simple_cap_proto_kv_t *encode_kv_specset(uint64_t start_mhz, uint64_t end_mhz,
  */
 simple_cap_proto_kv_t *encode_kv_message(const char *message, unsigned int flags);
 
+/* Encode a DROPS KV
+ *
+ * Totals since the source was opened:  frames lost before the helper saw them
+ * (by the kernel or driver), and frames the helper discarded itself
+ *
+ * Returns:
+ * Pointer on success
+ * Null on failure
+ *
+ */
+simple_cap_proto_kv_t *encode_kv_drops(uint64_t kernel_drops, uint64_t helper_drops);
+
+/* Encode a HOPSTATS KV
+ *
+ * Totals since the source was opened:  channel switches made while hopping, the 
+ * total and longest time a switch took in microseconds, and hops which started
+ * late because the previous hop overran the hop interval
+ *
+ * Returns:
+ * Pointer on success
+ * Null on failure
+ *
+ */
+simple_cap_proto_kv_t *encode_kv_hopstats(uint64_t switches, uint64_t total_usec,
+        uint64_t max_usec, uint64_t late);
+
 
 /* Validate if a header passes checksum
  *
@@ -25,6 +25,7 @@
 #include <string.h>
 
 #include "simple_ringbuf_c.h"
+#include "kis_mirror_mmap.h"
 
 /* Allocate a ring buffer
  *
@@ -38,14 +39,51 @@ kis_simple_ringbuf_t *kis_simple_ringbuf_create(size_t size) {
     if (rb == NULL)
         return NULL;
 
-    rb->buffer = (uint8_t *) malloc(size);
+    /* Prefer mirrored memory so reads and writes never split at the wrap */
+    rb->buffer = (uint8_t *) kis_mirror_alloc(size, &(rb->buffer_sz));
 
-    if (rb->buffer == NULL)
+    if (rb->buffer != NULL) {
+        rb->mirrored = 1;
+    } else {
+        rb->mirrored = 0;
+        rb->buffer = (uint8_t *) malloc(size);
+
+        if (rb->buffer == NULL) {
+            free(rb);
+            return NULL;
+        }
+
+        rb->buffer_sz = size;
+    }
+
+    rb->start_pos = 0;
+    rb->end_pos = 0;
+    rb->length = 0;
+    rb->lengthp = &(rb->length);
+    rb->shm = NULL;
+
+    return rb;
+}
+
+kis_simple_ringbuf_t *kis_simple_ringbuf_create_shm(kis_shm_ring_t *ring) {
+    kis_simple_ringbuf_t *rb;
+
+    rb = (kis_simple_ringbuf_t *) malloc(sizeof(kis_simple_ringbuf_t));
+
+    if (rb == NULL)
         return NULL;
 
-    rb->buffer_sz = size;
+    rb->buffer = ring->data;
+    rb->buffer_sz = ring->data_sz;
+    rb->mirrored = 1;
+
+    /* The server makes a new ring for every launch, so both sides start at
+     * the beginning */
     rb->start_pos = 0;
+    rb->end_pos = 0;
     rb->length = 0;
+    rb->lengthp = &(ring->hdr->length);
+    rb->shm = ring;
 
     return rb;
 }
@@ -53,7 +91,13 @@ kis_simple_ringbuf_t *kis_simple_ringbuf_create(size_t size) {
 /* Destroy a ring buffer
  */
 void kis_simple_ringbuf_free(kis_simple_ringbuf_t *ringbuf) {
-    free(ringbuf->buffer);
+    if (ringbuf->shm != NULL)
+        kis_shm_ring_free(ringbuf->shm);
+    else if (ringbuf->mirrored)
+        kis_mirror_free(ringbuf->buffer, ringbuf->buffer_sz);
+    else
+        free(ringbuf->buffer);
+
     free(ringbuf);
 }
 
@@ -61,19 +105,20 @@ void kis_simple_ringbuf_free(kis_simple_ringbuf_t *ringbuf) {
  */
 void kis_simple_ringbuf_clear(kis_simple_ringbuf_t *ringbuf) {
     ringbuf->start_pos = 0;
-    ringbuf->length = 0;
+    ringbuf->end_pos = 0;
+    __atomic_store_n(ringbuf->lengthp, 0, __ATOMIC_RELEASE);
 }
 
 /* Get available space
  */
 size_t kis_simple_ringbuf_available(kis_simple_ringbuf_t *ringbuf) {
-    return ringbuf->buffer_sz - ringbuf->length;
+    return ringbuf->buffer_sz - __atomic_load_n(ringbuf->lengthp, __ATOMIC_ACQUIRE);
 }
 
 /* Get used space
  */
 size_t kis_simple_ringbuf_used(kis_simple_ringbuf_t *ringbuf) {
-    return ringbuf->length;
+    return __atomic_load_n(ringbuf->lengthp, __ATOMIC_ACQUIRE);
 }
 
 /* Append data
@@ -82,35 +127,33 @@ size_t kis_simple_ringbuf_used(kis_simple_ringbuf_t *ringbuf) {
  */
 size_t kis_simple_ringbuf_write(kis_simple_ringbuf_t *ringbuf, 
         void *data, size_t length) {
-    size_t copy_start;
+    size_t copy_start = ringbuf->end_pos;
 
     if (kis_simple_ringbuf_available(ringbuf) < length)
         return 0;
 
     /* Does the write op fit w/out looping? */
-    copy_start = 
-        (ringbuf->start_pos + ringbuf->length) % ringbuf->buffer_sz;
-
-    if (copy_start + length < ringbuf->buffer_sz) {
+    if (ringbuf->mirrored || copy_start + length < ringbuf->buffer_sz) {
         memcpy(ringbuf->buffer + copy_start, data, length);
-        ringbuf->length += length;
-
-        return length;
+        ringbuf->end_pos = (copy_start + length) % ringbuf->buffer_sz;
     } else {
         /* We have to split up, figure out the length of the two chunks */
         size_t chunk_a = ringbuf->buffer_sz - copy_start;
         size_t chunk_b = length - chunk_a;
 
-        memcpy(ringbuf->buffer + ringbuf->start_pos + ringbuf->length, data, chunk_a);
+        memcpy(ringbuf->buffer + copy_start, data, chunk_a);
         memcpy(ringbuf->buffer, (uint8_t *) data + chunk_a, chunk_b);
 
-        /* Increase the length of the buffer */
-        ringbuf->length += length;
-
-        return length;
+        ringbuf->end_pos = chunk_b;
     }
 
-    return 0;
+    /* Publish the data to the reader only once it's in place */
+    __atomic_fetch_add(ringbuf->lengthp, length, __ATOMIC_RELEASE);
+
+    if (ringbuf->shm != NULL)
+        kis_shm_ring_notify_reader(ringbuf->shm);
+
+    return length;
 }
 
 /* Copies data into provided buffer.  Advances ringbuf, clearing consumed data.
@@ -133,12 +176,10 @@ size_t kis_simple_ringbuf_read(kis_simple_ringbuf_t *ringbuf, void *ptr,
         opsize = size;
 
     /* Simple contiguous read */
-    if (ringbuf->start_pos + opsize < ringbuf->buffer_sz) {
+    if (ringbuf->mirrored || ringbuf->start_pos + opsize < ringbuf->buffer_sz) {
         if (ptr != NULL)
             memcpy(ptr, ringbuf->buffer + ringbuf->start_pos, opsize);
-        ringbuf->start_pos += opsize;
-        ringbuf->length -= opsize;
-        return opsize;
+        ringbuf->start_pos = (ringbuf->start_pos + opsize) % ringbuf->buffer_sz;
     } else {
         /* First chunk, start to end of buffer */
         size_t chunk_a = ringbuf->buffer_sz - ringbuf->start_pos;
@@ -152,12 +193,12 @@ size_t kis_simple_ringbuf_read(kis_simple_ringbuf_t *ringbuf, void *ptr,
 
         /* Fastforward around the ring to where we finished reading */
         ringbuf->start_pos = chunk_b;
-        ringbuf->length -= opsize;
-
-        return opsize;
     }
 
-    return 0;
+    /* Hand the space back to the writer only once we're done with it */
+    __atomic_fetch_sub(ringbuf->lengthp, opsize, __ATOMIC_RELEASE);
+
+    return opsize;
 }
 
 /* Peeks at data by copying into provided buffer.  Does NOT advance ringbuf
@@ -182,7 +223,7 @@ size_t kis_simple_ringbuf_peek(kis_simple_ringbuf_t *ringbuf, void *ptr,
         opsize = size;
 
     /* Simple contiguous read */
-    if (ringbuf->start_pos + opsize < ringbuf->buffer_sz) {
+    if (ringbuf->mirrored || ringbuf->start_pos + opsize < ringbuf->buffer_sz) {
         memcpy(ptr, ringbuf->buffer + ringbuf->start_pos, opsize);
         return opsize;
     } else {
@@ -200,3 +241,29 @@ size_t kis_simple_ringbuf_peek(kis_simple_ringbuf_t *ringbuf, void *ptr,
     return 0;
 }
 
+/* Peeks at data without copying; sets ptr to the start of the readable data in
+ * the buffer itself.  Does NOT advance ringbuf or consume data.
+ *
+ * Only the contiguous data up to the end of the buffer is returned, unless the
+ * buffer is mirrored.
+ *
+ * Returns amount available at ptr
+ */
+size_t kis_simple_ringbuf_peek_zc(kis_simple_ringbuf_t *ringbuf, void **ptr,
+        size_t size) {
+    size_t opsize = kis_simple_ringbuf_used(ringbuf);
+
+    if (opsize == 0)
+        return 0;
+
+    if (opsize > size)
+        opsize = size;
+
+    if (!ringbuf->mirrored && ringbuf->start_pos + opsize > ringbuf->buffer_sz)
+        opsize = ringbuf->buffer_sz - ringbuf->start_pos;
+
+    *ptr = ringbuf->buffer + ringbuf->start_pos;
+
+    return opsize;
+}
+
@@ -17,7 +17,18 @@
 */
 
 /* An extremely basic ring buffer implemented in pure C; for use with datasource 
- * implementations in C */
+ * implementations in C
+ *
+ * One writer and one reader may use the buffer at the same time without a
+ * lock; the writer owns end_pos, the reader owns start_pos, and the length is
+ * only touched atomically.  Multiple writers still need to serialize among
+ * themselves, and clear() may only be called when nothing else is using the
+ * buffer.
+ *
+ * Where the platform allows the buffer is mirrored memory, rounded up to whole
+ * pages, so no read or write is split at the end of the buffer and the
+ * zero-copy peek always returns everything available.
+ */
 
 #ifndef __RINGBUF_C_H__
 #define __RINGBUF_C_H__
@@ -27,11 +38,17 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "kis_shm_ring.h"
+
 struct kis_simple_ringbuf {
     uint8_t *buffer;
     size_t buffer_sz;
-    size_t start_pos; /* Where reading starts from */
-    size_t length; /* Amount of data in the buffer */
+    size_t start_pos; /* Where reading starts from, owned by the reader */
+    size_t end_pos; /* Where writing starts from, owned by the writer */
+    size_t length; /* Amount of data in the buffer, accessed atomically */
+    size_t *lengthp; /* The length in use; &length, or the shared ring's */
+    int mirrored; /* Buffer is mapped twice back to back, see kis_mirror_mmap.h */
+    kis_shm_ring_t *shm; /* Shared ring we write for the server, if any */
 };
 typedef struct kis_simple_ringbuf kis_simple_ringbuf_t;
 
@@ -41,11 +58,18 @@ typedef struct kis_simple_ringbuf kis_simple_ringbuf_t;
  */
 kis_simple_ringbuf_t *kis_simple_ringbuf_create(size_t size);
 
+/* Write into a shared memory ring as its only writer; the server reads it,
+ * so this side may only write to it.  Takes ownership of the ring.
+ *
+ * Returns NULL if allocation failed
+ */
+kis_simple_ringbuf_t *kis_simple_ringbuf_create_shm(kis_shm_ring_t *ring);
+
 /* Destroy a ring buffer
  */
 void kis_simple_ringbuf_free(kis_simple_ringbuf_t *ringbuf);
 
-/* Clear ring buffer
+/* Clear ring buffer; not for a shared ring, which only the server reads
  */
 void kis_simple_ringbuf_clear(kis_simple_ringbuf_t *ringbuf);
 
@@ -82,5 +106,17 @@ size_t kis_simple_ringbuf_read(kis_simple_ringbuf_t *ringbuf, void *ptr, size_t
  */
 size_t kis_simple_ringbuf_peek(kis_simple_ringbuf_t *ringbuf, void *ptr, size_t size);
 
+/* Peeks at data without copying; sets ptr to the start of the readable data in
+ * the buffer itself.  Does NOT advance ringbuf or consume data; consume it with
+ * kis_simple_ringbuf_read(ringbuf, NULL, amount).
+ *
+ * Only the contiguous data up to the end of the buffer is returned; the
+ * remainder after a wrap is available after that is consumed.  Mirrored
+ * buffers never wrap.
+ *
+ * Returns amount available at ptr
+ */
+size_t kis_simple_ringbuf_peek_zc(kis_simple_ringbuf_t *ringbuf, void **ptr, size_t size);
+
 #endif
 
@@ -18,13 +18,20 @@
 
 #include "config.h"
 
+#include <algorithm>
+
 #include "streamtracker.h"
 #include "entrytracker.h"
+#include "configfile.h"
+#include "timetracker.h"
 
 StreamTracker::StreamTracker(GlobalRegistry *in_globalreg) :
     Kis_Net_Httpd_CPPStream_Handler(in_globalreg), 
     LifetimeGlobal() {
 
+    Httpd_RegisterRoute("GET", "/streams/all_streams");
+    Httpd_RegisterRoute("GET", "/streams/by-id/:id/:action");
+
     // Initialize as recursive to allow multiple locks in a single thread
     pthread_mutexattr_t mutexattr;
     pthread_mutexattr_init(&mutexattr);
@@ -44,9 +51,30 @@ StreamTracker::StreamTracker(GlobalRegistry *in_globalreg) :
     stream_map = TrackerElementDoubleMap(tracked_stream_map);
 
     next_stream_id = 1;
+
+    stream_max_rate =
+        globalreg->kismet_config->FetchOptUInt("stream_max_rate", 0) * 1024;
+    stream_aggregate_rate =
+        globalreg->kismet_config->FetchOptUInt("stream_aggregate_rate", 0) * 1024;
+    pause_watermark =
+        (double) globalreg->kismet_config->FetchOptUInt("stream_pause_watermark", 90) / 100;
+    resume_watermark =
+        (double) globalreg->kismet_config->FetchOptUInt("stream_resume_watermark", 50) / 100;
+
+    if (resume_watermark > pause_watermark)
+        resume_watermark = pause_watermark;
+
+    schedule_timer =
+        globalreg->timetracker->RegisterTimer(SERVER_TIMESLICES_SEC, NULL, 1,
+                [this](int) -> int {
+                    ScheduleStreams();
+                    return 1;
+                });
 }
 
 StreamTracker::~StreamTracker() {
+    globalreg->timetracker->RemoveTimer(schedule_timer);
+
     local_eol_locker lock(&mutex);
 
     pthread_mutex_destroy(&mutex);
@@ -181,6 +209,10 @@ void StreamTracker::register_streamer(streaming_agent *in_agent,
 
     streamrec->set_agent(in_agent);
     in_agent->set_stream_id(next_stream_id++);
+    in_agent->set_watermarks(pause_watermark, resume_watermark);
+
+    if (in_agent->get_max_rate() == 0)
+        in_agent->set_max_rate(stream_max_rate);
 
     streamrec->set_log_name(in_name);
     streamrec->set_log_type(in_type);
@@ -204,5 +236,98 @@ void StreamTracker::remove_streamer(double in_id) {
     a->get_agent()->stop_stream("stream removed");
 
     stream_map.erase(si);
+    usage_map.erase(in_id);
+}
+
+void StreamTracker::ScheduleStreams() {
+    local_locker lock(&mutex);
+
+    if (stream_map.size() == 0)
+        return;
+
+    vector<streaming_agent *> agents;
+    vector<uint64_t> demand;
+    vector<uint64_t> rates;
+    uint64_t total_demand = 0;
+
+    for (auto si = stream_map.begin(); si != stream_map.end(); ++si) {
+        streaming_agent *a = 
+            static_pointer_cast<streaming_info_record>(si->second)->get_agent();
+
+        if (a == NULL)
+            continue;
+
+        stream_usage& u = usage_map[si->first];
+
+        uint64_t sz = a->get_log_size();
+        rates.push_back(sz >= u.last_size ? sz - u.last_size : 0);
+        u.last_size = sz;
+
+        // What the stream asked for, capped by its own rate
+        uint64_t d = u.offered;
+        if (a->get_max_rate() != 0 && d > a->get_max_rate())
+            d = a->get_max_rate();
+
+        agents.push_back(a);
+        demand.push_back(d);
+        total_demand += d;
+    }
+
+    if (agents.size() == 0)
+        return;
+
+    // Without an aggregate rate each stream is only held to its own
+    uint64_t level = 0;
+    uint64_t slack = 0;
+
+    if (stream_aggregate_rate != 0) {
+        if (total_demand <= stream_aggregate_rate) {
+            // Everyone gets what they asked for, and an even share of the rest
+            // to grow into
+            slack = (stream_aggregate_rate - total_demand) / agents.size();
+        } else {
+            // Water-fill:  streams asking for less than an even share of what's
+            // left get it, and the rest split the remainder evenly
+            vector<uint64_t> sorted = demand;
+            std::sort(sorted.begin(), sorted.end());
+
+            uint64_t remaining = stream_aggregate_rate;
+            size_t n = sorted.size();
+
+            level = remaining / n;
+
+            for (size_t x = 0; x < sorted.size(); x++) {
+                if (sorted[x] > remaining / (n - x)) {
+                    level = remaining / (n - x);
+                    break;
+                }
+
+                remaining -= sorted[x];
+                level = sorted[x];
+            }
+        }
+    }
+
+    for (size_t x = 0; x < agents.size(); x++) {
+        streaming_agent *a = agents[x];
+        uint64_t allow = std::numeric_limits<uint64_t>::max();
+
+        if (stream_aggregate_rate != 0) {
+            if (level != 0)
+                allow = std::min(demand[x], level);
+            else
+                allow = demand[x] + slack;
+
+            // A stream which asked for nothing still gets an even share to
+            // start with
+            if (demand[x] == 0)
+                allow = stream_aggregate_rate / agents.size();
+        }
+
+        if (a->get_max_rate() != 0 && allow > a->get_max_rate())
+            allow = a->get_max_rate();
+
+        usage_map[a->get_stream_id()].offered = a->start_period(allow, rates[x]);
+    }
 }
 
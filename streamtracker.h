@@ -22,6 +22,8 @@
 #include "config.h"
 
 #include <memory>
+#include <atomic>
+#include <limits>
 
 #include "globalregistry.h"
 #include "trackedelement.h"
@@ -37,6 +39,16 @@ public:
         max_size = 0;
         max_packets = 0;
         stream_paused = false;
+
+        stream_throttled = false;
+        pause_watermark = 0;
+        resume_watermark = 0;
+        max_rate = 0;
+        allowance = std::numeric_limits<uint64_t>::max();
+        period_used = 0;
+        period_offered = 0;
+        dropped_packets = 0;
+        rate = 0;
     }
 
     virtual ~streaming_agent() { };
@@ -67,6 +79,64 @@ public:
     virtual void pause_stream() { stream_paused = true; }
     virtual void resume_stream() { stream_paused = false; }
 
+    // Fraction of the output buffer in use, for the pause and resume watermarks;
+    // negative for streams without a buffer of their own
+    virtual double get_buffer_fill() { return -1; }
+
+    // Ask the stream scheduler if in_bytes may be written now.  Streams which
+    // are paused, or throttled because their buffer passed the pause watermark
+    // and hasn't yet drained to the resume watermark, or which have used up
+    // their share of the bandwidth this second, drop the data instead.
+    bool stream_admit(size_t in_bytes) {
+        if (stream_paused)
+            return false;
+
+        double fill = get_buffer_fill();
+
+        if (fill >= 0 && pause_watermark > 0) {
+            if (!stream_throttled && fill >= pause_watermark)
+                stream_throttled = true;
+            else if (stream_throttled && fill <= resume_watermark)
+                stream_throttled = false;
+        }
+
+        period_offered += in_bytes;
+
+        if (stream_throttled || period_used + in_bytes > allowance) {
+            dropped_packets++;
+            return false;
+        }
+
+        period_used += in_bytes;
+
+        return true;
+    }
+
+    bool get_stream_throttled() { return stream_throttled; }
+    uint64_t get_dropped_packets() { return dropped_packets; }
+
+    // Bytes a second this stream may write, 0 for no limit of its own
+    void set_max_rate(uint64_t in_rate) { max_rate = in_rate; }
+    uint64_t get_max_rate() { return max_rate; }
+
+    // Bytes a second written over the last scheduling period
+    uint64_t get_rate() { return rate; }
+
+    // Set by the StreamTracker
+    void set_watermarks(double in_pause, double in_resume) {
+        pause_watermark = in_pause;
+        resume_watermark = in_resume;
+    }
+
+    // Start a new period with the allowance the scheduler gave us, reporting
+    // the bytes which were asked for in the last one
+    uint64_t start_period(uint64_t in_allowance, uint64_t in_rate) {
+        allowance = in_allowance;
+        rate = in_rate;
+        period_used = 0;
+        return period_offered.exchange(0);
+    }
+
 protected:
     double stream_id;
     uint64_t log_size;
@@ -76,6 +146,16 @@ protected:
     uint64_t max_packets;
 
     bool stream_paused;
+
+    // Scheduling state; admission runs on the thread writing the stream and
+    // new periods are started from the StreamTracker timer
+    std::atomic<bool> stream_throttled;
+    double pause_watermark, resume_watermark;
+    std::atomic<uint64_t> max_rate;
+    std::atomic<uint64_t> allowance;
+    std::atomic<uint64_t> period_used, period_offered;
+    std::atomic<uint64_t> dropped_packets;
+    std::atomic<uint64_t> rate;
 };
 
 class streaming_info_record : public tracker_component {
@@ -111,6 +191,11 @@ public:
 
     __Proxy(log_paused, uint8_t, bool, bool, log_paused);
 
+    __Proxy(log_rate, uint64_t, uint64_t, uint64_t, log_rate);
+    __Proxy(max_rate, uint64_t, uint64_t, uint64_t, max_rate);
+    __Proxy(log_throttled, uint8_t, bool, bool, log_throttled);
+    __Proxy(dropped_packets, uint64_t, uint64_t, uint64_t, dropped_packets);
+
     void set_agent(streaming_agent *in_agent) {
         agent = in_agent;
     }
@@ -130,6 +215,10 @@ public:
             set_max_packets(agent->get_max_packets());
             set_max_size(agent->get_max_size());
             set_log_paused(agent->get_stream_paused());
+            set_log_rate(agent->get_rate());
+            set_max_rate(agent->get_max_rate());
+            set_log_throttled(agent->get_stream_throttled());
+            set_dropped_packets(agent->get_dropped_packets());
         }
     }
 
@@ -167,6 +256,20 @@ protected:
 
         RegisterField("kismet.stream.paused", TrackerUInt8,
                 "Stream processing paused", &log_paused);
+
+        RegisterField("kismet.stream.rate", TrackerUInt64,
+                "Throughput over the last second (bytes per second)", &log_rate);
+
+        RegisterField("kismet.stream.max_rate", TrackerUInt64,
+                "Maximum throughput of this stream (bytes per second, 0 unlimited)",
+                &max_rate);
+
+        RegisterField("kismet.stream.throttled", TrackerUInt8,
+                "Stream paused until its buffer drains", &log_throttled);
+
+        RegisterField("kismet.stream.dropped_packets", TrackerUInt64,
+                "Packets dropped by the bandwidth limits or while paused",
+                &dropped_packets);
     }
 
     // Internal ID
@@ -196,6 +299,11 @@ protected:
 
     SharedTrackerElement log_paused;
 
+    SharedTrackerElement log_rate;
+    SharedTrackerElement max_rate;
+    SharedTrackerElement log_throttled;
+    SharedTrackerElement dropped_packets;
+
     streaming_agent *agent;
 };
 
@@ -238,6 +346,22 @@ protected:
     int info_builder_id;
 
     double next_stream_id;
+
+    // Stream scheduling:  every second each stream is given its share of the
+    // aggregate rate, split max-min fairly over what the streams asked for in
+    // the last second, and capped by its own rate
+    uint64_t stream_max_rate, stream_aggregate_rate;
+    double pause_watermark, resume_watermark;
+    int schedule_timer;
+
+    struct stream_usage {
+        uint64_t last_size;
+        uint64_t offered;
+    };
+
+    std::map<double, stream_usage> usage_map;
+
+    void ScheduleStreams();
 };
 
 #endif
@@ -22,6 +22,7 @@
 
 #include <fstream>
 #include <unistd.h>
+#include <dirent.h>
 
 #include "globalregistry.h"
 #include "util.h"
@@ -30,11 +31,19 @@
 #include "system_monitor.h"
 #include "msgpack_adapter.h"
 #include "json_adapter.h"
+#include "cpu_affinity.h"
+#include "kis_hugepage.h"
+#include "kis_startup.h"
 
 Systemmonitor::Systemmonitor(GlobalRegistry *in_globalreg) :
     tracker_component(in_globalreg, 0),
     Kis_Net_Httpd_CPPStream_Handler(in_globalreg) {
 
+    Httpd_RegisterRoute("GET", "/system/status");
+    Httpd_RegisterRoute("GET", "/system/timestamp");
+    Httpd_RegisterRoute("GET", "/system/lock_stats");
+    Httpd_RegisterRoute("GET", "/system/startup");
+
     // Initialize as recursive to allow multiple locks in a single thread
     pthread_mutexattr_t mutexattr;
     pthread_mutexattr_init(&mutexattr);
@@ -52,8 +61,31 @@ Systemmonitor::Systemmonitor(GlobalRegistry *in_globalreg) :
 #ifdef SYS_LINUX
     // Get the bytes per page
     mem_per_page = sysconf(_SC_PAGESIZE);
+    clock_ticks = sysconf(_SC_CLK_TCK);
 #endif
 
+    for (unsigned int x = 0; x < SYSMON_SAMPLE_RING; x++)
+        sample_ring[x].seq = 0;
+
+    sample_head = 0;
+    sample_consumed = 0;
+    last_cpu_ticks = 0;
+    last_cpu_usec = 0;
+    sampler_shutdown = false;
+
+    sample_ms = globalreg->kismet_config->FetchOptUInt("system_sample_ms", 1000);
+
+    if (sample_ms < 100)
+        sample_ms = 100;
+
+    // Take the first sample here so there is always one to serve, then leave
+    // the rest to the sampler
+    host_sample first;
+    TakeSample(&first);
+    PublishSample(first);
+
+    sampler_thread = std::thread([this]() { SamplerThread(); });
+
     struct timeval trigger_tm;
     trigger_tm.tv_sec = globalreg->timestamp.tv_sec + 1;
     trigger_tm.tv_usec = 0;
@@ -63,9 +95,105 @@ Systemmonitor::Systemmonitor(GlobalRegistry *in_globalreg) :
 
     // Link the RRD out of the devicetracker
     add_map(devicetracker->get_packets_rrd());
+
+    lock_report_sites =
+        globalreg->kismet_config->FetchOptUInt("lock_profiling_sites", 10);
+
+    locks_id =
+        globalreg->entrytracker->RegisterField("kismet.system.locks",
+                TrackerMap, "lock contention profile");
+    locks_enabled_id =
+        globalreg->entrytracker->RegisterField("kismet.system.locks.enabled",
+                TrackerUInt8, "lock profiling enabled");
+    locks_list_id =
+        globalreg->entrytracker->RegisterField("kismet.system.locks.lock_list",
+                TrackerVector, "profiled locks");
+    lock_id =
+        globalreg->entrytracker->RegisterField("kismet.system.locks.lock",
+                TrackerMap, "profile of a lock");
+    lock_name_id =
+        globalreg->entrytracker->RegisterField("kismet.system.locks.lock.name",
+                TrackerString, "lock name");
+    lock_acquires_id =
+        globalreg->entrytracker->RegisterField("kismet.system.locks.lock.acquires",
+                TrackerUInt64, "times the lock was taken");
+    lock_contended_id =
+        globalreg->entrytracker->RegisterField("kismet.system.locks.lock.contended",
+                TrackerUInt64, "times the lock was already held when taken");
+    lock_wait_ns_id =
+        globalreg->entrytracker->RegisterField("kismet.system.locks.lock.wait_ns",
+                TrackerUInt64, "total nanoseconds spent waiting for the lock");
+    lock_hold_ns_id =
+        globalreg->entrytracker->RegisterField("kismet.system.locks.lock.hold_ns",
+                TrackerUInt64, "total nanoseconds the lock was held");
+    lock_wait_histogram_id =
+        globalreg->entrytracker->RegisterField("kismet.system.locks.lock.wait_histogram",
+                TrackerVector, "log2 nanosecond histogram of waits for the lock");
+    lock_hold_histogram_id =
+        globalreg->entrytracker->RegisterField("kismet.system.locks.lock.hold_histogram",
+                TrackerVector, "log2 nanosecond histogram of holds of the lock");
+    lock_bucket_id =
+        globalreg->entrytracker->RegisterField("kismet.system.locks.lock.bucket",
+                TrackerUInt64, "count in histogram bucket");
+    lock_sites_id =
+        globalreg->entrytracker->RegisterField("kismet.system.locks.lock.sites",
+                TrackerVector, "call sites which held the lock longest");
+    lock_site_id =
+        globalreg->entrytracker->RegisterField("kismet.system.locks.lock.site",
+                TrackerMap, "call site");
+    lock_site_file_id =
+        globalreg->entrytracker->RegisterField("kismet.system.locks.lock.site.file",
+                TrackerString, "source file");
+    lock_site_line_id =
+        globalreg->entrytracker->RegisterField("kismet.system.locks.lock.site.line",
+                TrackerInt32, "source line");
+    lock_site_count_id =
+        globalreg->entrytracker->RegisterField("kismet.system.locks.lock.site.count",
+                TrackerUInt64, "times the site took the lock");
+    lock_site_hold_ns_id =
+        globalreg->entrytracker->RegisterField("kismet.system.locks.lock.site.hold_ns",
+                TrackerUInt64, "total nanoseconds the site held the lock");
+
+    startup_id =
+        globalreg->entrytracker->RegisterField("kismet.system.startup",
+                TrackerMap, "startup timeline");
+    startup_complete_id =
+        globalreg->entrytracker->RegisterField("kismet.system.startup.complete",
+                TrackerUInt8, "startup has completed");
+    startup_total_usec_id =
+        globalreg->entrytracker->RegisterField("kismet.system.startup.total_usec",
+                TrackerUInt64, "microseconds from process start until startup completed");
+    startup_steps_id =
+        globalreg->entrytracker->RegisterField("kismet.system.startup.step_list",
+                TrackerVector, "startup steps, in the order they started");
+    startup_step_id =
+        globalreg->entrytracker->RegisterField("kismet.system.startup.step",
+                TrackerMap, "startup step");
+    startup_step_name_id =
+        globalreg->entrytracker->RegisterField("kismet.system.startup.step.name",
+                TrackerString, "step name");
+    startup_step_start_usec_id =
+        globalreg->entrytracker->RegisterField("kismet.system.startup.step.start_usec",
+                TrackerUInt64, "microseconds from process start until the step started");
+    startup_step_duration_usec_id =
+        globalreg->entrytracker->RegisterField("kismet.system.startup.step.duration_usec",
+                TrackerUInt64, "microseconds the step took");
+    startup_step_parallel_id =
+        globalreg->entrytracker->RegisterField("kismet.system.startup.step.parallel",
+                TrackerUInt8, "step ran alongside the main thread");
 }
 
 Systemmonitor::~Systemmonitor() {
+    {
+        std::lock_guard<std::mutex> lk(sampler_mutex);
+        sampler_shutdown = true;
+    }
+
+    sampler_cv.notify_all();
+
+    if (sampler_thread.joinable())
+        sampler_thread.join();
+
     pthread_mutex_lock(&monitor_mutex);
     globalreg->RemoveGlobal("SYSTEM_MONITOR");
     globalreg->timetracker->RemoveTimer(timer_id);
@@ -97,10 +225,54 @@ void Systemmonitor::register_fields() {
         RegisterField("kismet.system.memory.rss", TrackerUInt64,
                 "memory RSS in kbytes", &memory);
 
+    hugepage_mode_id =
+        RegisterField("kismet.system.memory.hugepage_mode", TrackerString,
+                "huge page backing of large buffers (off, thp, hugetlb)", 
+                &hugepage_mode);
+    hugetlb_kb_id =
+        RegisterField("kismet.system.memory.hugetlb", TrackerUInt64,
+                "buffers mapped from the huge page pool in kbytes", &hugetlb_kb);
+    thp_advised_kb_id =
+        RegisterField("kismet.system.memory.thp_advised", TrackerUInt64,
+                "buffers advised for transparent huge pages in kbytes", 
+                &thp_advised_kb);
+    hugetlb_fallbacks_id =
+        RegisterField("kismet.system.memory.hugetlb_fallbacks", TrackerUInt64,
+                "buffers which could not be mapped from the huge page pool",
+                &hugetlb_fallbacks);
+    anon_hugepages_kb_id =
+        RegisterField("kismet.system.memory.anon_hugepages", TrackerUInt64,
+                "memory backed by transparent huge pages in kbytes", 
+                &anon_hugepages_kb);
+
     devices_id =
         RegisterField("kismet.system.devices.count", TrackerUInt64,
                 "number of devices in devicetracker", &devices);
 
+    cpu_percent_id =
+        RegisterField("kismet.system.cpu.percent", TrackerDouble,
+                "cpu use of the server as a percentage of one cpu", &cpu_percent);
+    threads_id =
+        RegisterField("kismet.system.threads", TrackerUInt32,
+                "number of threads of the server", &threads);
+    fds_id =
+        RegisterField("kismet.system.fds", TrackerUInt32,
+                "number of open file descriptors", &fds);
+    thermal_temp_id =
+        RegisterField("kismet.system.thermal.temp", TrackerDouble,
+                "temperature of the hottest thermal zone in degrees C, 0 if unknown",
+                &thermal_temp);
+    sample_time_id =
+        RegisterField("kismet.system.sample_time", TrackerUInt64,
+                "time the host was last sampled", &sample_time);
+
+    cpu_affinity_id =
+        RegisterField("kismet.system.cpu_affinity", TrackerStringMap,
+                "cpus of placed threads and capture binaries", &cpu_affinity);
+    cpu_affinity_cpus_id =
+        RegisterField("kismet.system.cpu_affinity.cpus", TrackerString,
+                "list of cpus");
+
     shared_ptr<kis_tracked_rrd<> > rrd_builder(new kis_tracked_rrd<>(globalreg, 0));
 
     mem_rrd_id =
@@ -110,6 +282,14 @@ void Systemmonitor::register_fields() {
     devices_rrd_id =
         RegisterComplexField("kismet.system.devices.rrd", rrd_builder, 
                 "device count RRD");
+
+    cpu_rrd_id =
+        RegisterComplexField("kismet.system.cpu.rrd", rrd_builder, 
+                "cpu percentage RRD");
+
+    thermal_rrd_id =
+        RegisterComplexField("kismet.system.thermal.rrd", rrd_builder, 
+                "thermal zone temperature RRD");
 }
 
 void Systemmonitor::reserve_fields(SharedTrackerElement e) {
@@ -120,26 +300,107 @@ void Systemmonitor::reserve_fields(SharedTrackerElement e) {
                     e->get_map_value(mem_rrd_id)));
         devices_rrd.reset(new kis_tracked_rrd<>(globalreg, devices_rrd_id,
                     e->get_map_value(devices_rrd_id)));
+        cpu_rrd.reset(new kis_tracked_rrd<>(globalreg, cpu_rrd_id,
+                    e->get_map_value(cpu_rrd_id)));
+        thermal_rrd.reset(new kis_tracked_rrd<>(globalreg, thermal_rrd_id,
+                    e->get_map_value(thermal_rrd_id)));
     } else {
         memory_rrd.reset(new kis_tracked_rrd<>(globalreg, mem_rrd_id));
         devices_rrd.reset(new kis_tracked_rrd<>(globalreg, devices_rrd_id));
+        cpu_rrd.reset(new kis_tracked_rrd<>(globalreg, cpu_rrd_id));
+        thermal_rrd.reset(new kis_tracked_rrd<>(globalreg, thermal_rrd_id));
     }
 
     add_map(memory_rrd);
     add_map(devices_rrd);
+    add_map(cpu_rrd);
+    add_map(thermal_rrd);
 }
 
-int Systemmonitor::timetracker_event(int eventid) {
-    local_locker lock(&monitor_mutex);
+bool Systemmonitor::FetchSample(uint64_t in_num, host_sample *ret_sample) {
+    host_sample_slot *slot = &(sample_ring[in_num % SYSMON_SAMPLE_RING]);
 
-    int num_devices = devicetracker->FetchNumDevices(KIS_PHY_ANY);
+    // Each write of a slot bumps its count twice, so sample number N is the
+    // (N / ring + 1)th write of its slot
+    uint64_t want = ((in_num / SYSMON_SAMPLE_RING) + 1) * 2;
 
-    // Grab the devices
-    set_devices(num_devices);
-    devices_rrd->add_sample(num_devices, globalreg->timestamp.tv_sec);
+    while (1) {
+        uint64_t s1 = slot->seq.load(std::memory_order_acquire);
+
+        if (s1 & 1)
+            continue;
+
+        if (s1 != want)
+            return false;
+
+        *ret_sample = slot->sample;
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        if (slot->seq.load(std::memory_order_relaxed) == s1)
+            return true;
+    }
+}
+
+bool Systemmonitor::FetchLatestSample(host_sample *ret_sample) {
+    while (1) {
+        uint64_t head = sample_head.load(std::memory_order_acquire);
+
+        if (head == 0)
+            return false;
+
+        // Only fails if the sampler lapped the whole ring while we were
+        // reading, so try the new latest
+        if (FetchSample(head - 1, ret_sample))
+            return true;
+    }
+}
+
+void Systemmonitor::PublishSample(const host_sample& in_sample) {
+    uint64_t head = sample_head.load(std::memory_order_relaxed);
+    host_sample_slot *slot = &(sample_ring[head % SYSMON_SAMPLE_RING]);
+
+    uint64_t seq = slot->seq.load(std::memory_order_relaxed);
+
+    slot->seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot->sample = in_sample;
+
+    slot->seq.store(seq + 2, std::memory_order_release);
+    sample_head.store(head + 1, std::memory_order_release);
+}
+
+void Systemmonitor::SamplerThread() {
+    std::unique_lock<std::mutex> lk(sampler_mutex);
+
+    while (!sampler_shutdown) {
+        sampler_cv.wait_for(lk, std::chrono::milliseconds(sample_ms));
+
+        if (sampler_shutdown)
+            break;
+
+        lk.unlock();
+
+        host_sample sample;
+        TakeSample(&sample);
+        PublishSample(sample);
+
+        lk.lock();
+    }
+}
+
+void Systemmonitor::TakeSample(host_sample *ret_sample) {
+    memset(ret_sample, 0, sizeof(host_sample));
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    ret_sample->ts_sec = now.tv_sec;
+
+    Fetch_Battery_Info(&(ret_sample->battery));
 
 #ifdef SYS_LINUX
-    // Grab the memory from /proc
     std::string procline;
     std::ifstream procfile;
 
@@ -149,31 +410,163 @@ int Systemmonitor::timetracker_event(int eventid) {
         std::getline(procfile, procline);
         procfile.close();
 
-        // Find the last paren because status is 'pid (name) stuff'.
-        // Memory is nominally field 24, so we find the last paren, add a 
-        // space, and split the rest
+        // Find the last paren because status is 'pid (name) stuff', then
+        // split the rest; field N of the line is then toks[N - 2]
         size_t paren = procline.find_last_of(")");
 
         if (paren != string::npos) {
             vector<string> toks = 
                 StrTokenize(procline.substr(paren + 1, procline.length()), " ");
 
-            if (toks.size() > 22) {
-                unsigned long int m;
+            unsigned long int m;
+            unsigned long long int ut, st;
+
+            // Memory is field 24, in pages
+            if (toks.size() > 22 && sscanf(toks[22].c_str(), "%lu", &m) == 1)
+                ret_sample->rss_kb = ((uint64_t) m * mem_per_page) / 1024;
+
+            // Threads are field 20
+            if (toks.size() > 18 && sscanf(toks[18].c_str(), "%lu", &m) == 1)
+                ret_sample->threads = m;
+
+            // User and system time are fields 14 and 15, in clock ticks
+            if (toks.size() > 13 && clock_ticks > 0 &&
+                    sscanf(toks[12].c_str(), "%llu", &ut) == 1 &&
+                    sscanf(toks[13].c_str(), "%llu", &st) == 1) {
+                uint64_t ticks = ut + st;
+                uint64_t usec = KisClock::MonoUsec();
+
+                if (last_cpu_usec != 0 && usec > last_cpu_usec && 
+                        ticks >= last_cpu_ticks) {
+                    ret_sample->cpu_percent = 
+                        ((double) (ticks - last_cpu_ticks) / clock_ticks) /
+                        ((double) (usec - last_cpu_usec) / 1000000) * 100;
+                }
 
-                if (sscanf(toks[22].c_str(), "%lu", &m) == 1) {
-                    m *= mem_per_page;
+                last_cpu_ticks = ticks;
+                last_cpu_usec = usec;
+            }
+        }
+    }
 
-                    m /= 1024;
+    // How much of that the kernel actually backs with transparent huge pages
+    procfile.open("/proc/self/smaps_rollup");
 
-                    set_memory(m);
-                    memory_rrd->add_sample(m, globalreg->timestamp.tv_sec);
-                }
+    if (procfile.good()) {
+        unsigned long int a;
+
+        while (std::getline(procfile, procline)) {
+            if (sscanf(procline.c_str(), "AnonHugePages: %lu kB", &a) == 1) {
+                ret_sample->anon_hugepages_kb = a;
+                break;
             }
         }
+
+        procfile.close();
+    }
+
+    DIR *dir;
+    struct dirent *de;
+
+    if ((dir = opendir("/proc/self/fd")) != NULL) {
+        while ((de = readdir(dir)) != NULL) {
+            if (de->d_name[0] != '.')
+                ret_sample->fds++;
+        }
+
+        closedir(dir);
+
+        // Don't count the descriptor of the directory itself
+        if (ret_sample->fds > 0)
+            ret_sample->fds--;
+    }
+
+    if ((dir = opendir("/sys/class/thermal")) != NULL) {
+        while ((de = readdir(dir)) != NULL) {
+            if (strncmp(de->d_name, "thermal_zone", 12) != 0)
+                continue;
+
+            procfile.open("/sys/class/thermal/" + string(de->d_name) + "/temp");
+
+            int t;
+
+            if (procfile.good() && std::getline(procfile, procline) &&
+                    sscanf(procline.c_str(), "%d", &t) == 1) {
+                if (!ret_sample->have_thermal || t > ret_sample->thermal_mc) 
+                    ret_sample->thermal_mc = t;
+
+                ret_sample->have_thermal = true;
+            }
+
+            procfile.close();
+            procfile.clear();
+        }
+
+        closedir(dir);
+    }
+#endif
+}
+
+void Systemmonitor::ApplySample(const host_sample& in_sample) {
+    set_sample_time(in_sample.ts_sec);
+
+    set_battery_perc(in_sample.battery.percentage);
+    if (in_sample.battery.ac && in_sample.battery.charging) {
+        set_battery_charging("charging");
+    } else if (in_sample.battery.ac && !in_sample.battery.charging) {
+        set_battery_charging("charged");
+    } else if (!in_sample.battery.ac) {
+        set_battery_charging("discharging");
     }
 
+    set_battery_ac(in_sample.battery.ac);
+    set_battery_remaining(in_sample.battery.remaining_sec);
+
+#ifdef SYS_LINUX
+    set_memory(in_sample.rss_kb);
+    set_anon_hugepages_kb(in_sample.anon_hugepages_kb);
+    set_cpu_percent(in_sample.cpu_percent);
+    set_threads(in_sample.threads);
+    set_fds(in_sample.fds);
+
+    if (in_sample.have_thermal)
+        set_thermal_temp((double) in_sample.thermal_mc / 1000);
 #endif
+}
+
+int Systemmonitor::timetracker_event(int eventid) {
+    local_locker lock(&monitor_mutex);
+
+    int num_devices = devicetracker->FetchNumDevices(KIS_PHY_ANY);
+
+    // Grab the devices
+    set_devices(num_devices);
+    devices_rrd->add_sample(num_devices, globalreg->timestamp.tv_sec);
+
+    // Catch the RRDs up on everything sampled since the last time, one sample
+    // per second; anything older than the ring is gone
+    uint64_t head = sample_head.load(std::memory_order_acquire);
+
+    if (head - sample_consumed > SYSMON_SAMPLE_RING)
+        sample_consumed = head - SYSMON_SAMPLE_RING;
+
+    host_sample sample;
+
+    for (; sample_consumed < head; sample_consumed++) {
+        if (!FetchSample(sample_consumed, &sample))
+            continue;
+
+        if ((time_t) sample.ts_sec <= memory_rrd->get_last_time())
+            continue;
+
+#ifdef SYS_LINUX
+        memory_rrd->add_sample(sample.rss_kb, sample.ts_sec);
+        cpu_rrd->add_sample((int64_t) sample.cpu_percent, sample.ts_sec);
+
+        if (sample.have_thermal)
+            thermal_rrd->add_sample(sample.thermal_mc / 1000, sample.ts_sec);
+#endif
+    }
 
     // Reschedule
     struct timeval trigger_tm;
@@ -187,26 +580,47 @@ int Systemmonitor::timetracker_event(int eventid) {
 }
 
 void Systemmonitor::pre_serialize() {
-    kis_battery_info batinfo;
-    Fetch_Battery_Info(&batinfo);
-
-    set_battery_perc(batinfo.percentage);
-    if (batinfo.ac && batinfo.charging) {
-        set_battery_charging("charging");
-    } else if (batinfo.ac && !batinfo.charging) {
-        set_battery_charging("charged");
-    } else if (!batinfo.ac) {
-        set_battery_charging("discharging");
-    }
+    // Served from the latest sample, never read from the host here
+    host_sample sample;
 
-    set_battery_ac(batinfo.ac);
-    set_battery_remaining(batinfo.remaining_sec);
+    if (FetchLatestSample(&sample))
+        ApplySample(sample);
 
     struct timeval now;
     gettimeofday(&now, NULL);
 
     set_timestamp_sec(now.tv_sec);
     set_timestamp_usec(now.tv_usec);
+
+    set_hugepage_mode(HugepageAlloc::mode_name(HugepageAlloc::get_mode()));
+    set_hugetlb_kb(HugepageAlloc::hugetlb_bytes() / 1024);
+    set_thp_advised_kb(HugepageAlloc::thp_bytes() / 1024);
+    set_hugetlb_fallbacks(HugepageAlloc::hugetlb_fallbacks());
+
+    shared_ptr<CpuAffinity> affinity =
+        globalreg->FetchGlobalAs<CpuAffinity>("CPU_AFFINITY");
+
+    cpu_affinity->clear_stringmap();
+
+    if (affinity != NULL) {
+        for (auto p : affinity->get_placements()) {
+            SharedTrackerElement cpus(new TrackerElement(TrackerString, 
+                    cpu_affinity_cpus_id));
+            cpus->set(p.second);
+            cpu_affinity->add_stringmap(p.first, cpus);
+        }
+    }
+}
+
+bool Systemmonitor::Httpd_CacheableResponse(const char *url, uint64_t *version) {
+    if (strcmp(url, "/system/status.msgpack") != 0 && 
+            strcmp(url, "/system/status.json") != 0)
+        return false;
+
+    // Nothing to tie it to besides the time; the status changes every second
+    *version = globalreg->timestamp.tv_sec;
+
+    return true;
 }
 
 bool Systemmonitor::Httpd_VerifyPath(const char *path, const char *method) {
@@ -221,10 +635,137 @@ bool Systemmonitor::Httpd_VerifyPath(const char *path, const char *method) {
         return true;
     if (strcmp(path, "/system/timestamp.json") == 0)
         return true;
+    if (Httpd_StripSuffix(path) == "/system/lock_stats")
+        return Httpd_CanSerialize(path);
+
+    if (Httpd_StripSuffix(path) == "/system/startup")
+        return Httpd_CanSerialize(path);
 
     return false;
 }
 
+SharedTrackerElement Systemmonitor::BuildLockStats() {
+    SharedTrackerElement locks(new TrackerElement(TrackerMap, locks_id));
+    SharedTrackerElement e;
+
+    e.reset(new TrackerElement(TrackerUInt8, locks_enabled_id));
+    e->set((uint8_t) LockProfiler::IsEnabled());
+    locks->add_map(e);
+
+    SharedTrackerElement locklist(new TrackerElement(TrackerVector, locks_list_id));
+    locks->add_map(locklist);
+
+    for (auto& ls : LockProfiler::FetchStats(lock_report_sites)) {
+        SharedTrackerElement lm(new TrackerElement(TrackerMap, lock_id));
+
+        e.reset(new TrackerElement(TrackerString, lock_name_id));
+        e->set(ls.name);
+        lm->add_map(e);
+
+        e.reset(new TrackerElement(TrackerUInt64, lock_acquires_id));
+        e->set((uint64_t) ls.acquires);
+        lm->add_map(e);
+
+        e.reset(new TrackerElement(TrackerUInt64, lock_contended_id));
+        e->set((uint64_t) ls.contended);
+        lm->add_map(e);
+
+        e.reset(new TrackerElement(TrackerUInt64, lock_wait_ns_id));
+        e->set((uint64_t) ls.wait_ns);
+        lm->add_map(e);
+
+        e.reset(new TrackerElement(TrackerUInt64, lock_hold_ns_id));
+        e->set((uint64_t) ls.hold_ns);
+        lm->add_map(e);
+
+        SharedTrackerElement waith(new TrackerElement(TrackerVector, lock_wait_histogram_id));
+        SharedTrackerElement holdh(new TrackerElement(TrackerVector, lock_hold_histogram_id));
+
+        for (unsigned int b = 0; b < LOCKPROF_BUCKETS; b++) {
+            e.reset(new TrackerElement(TrackerUInt64, lock_bucket_id));
+            e->set((uint64_t) ls.wait_histogram[b]);
+            waith->add_vector(e);
+
+            e.reset(new TrackerElement(TrackerUInt64, lock_bucket_id));
+            e->set((uint64_t) ls.hold_histogram[b]);
+            holdh->add_vector(e);
+        }
+
+        lm->add_map(waith);
+        lm->add_map(holdh);
+
+        SharedTrackerElement sites(new TrackerElement(TrackerVector, lock_sites_id));
+
+        for (auto& ss : ls.sites) {
+            SharedTrackerElement sm(new TrackerElement(TrackerMap, lock_site_id));
+
+            e.reset(new TrackerElement(TrackerString, lock_site_file_id));
+            e->set(ss.file);
+            sm->add_map(e);
+
+            e.reset(new TrackerElement(TrackerInt32, lock_site_line_id));
+            e->set((int32_t) ss.line);
+            sm->add_map(e);
+
+            e.reset(new TrackerElement(TrackerUInt64, lock_site_count_id));
+            e->set((uint64_t) ss.count);
+            sm->add_map(e);
+
+            e.reset(new TrackerElement(TrackerUInt64, lock_site_hold_ns_id));
+            e->set((uint64_t) ss.hold_ns);
+            sm->add_map(e);
+
+            sites->add_vector(sm);
+        }
+
+        lm->add_map(sites);
+
+        locklist->add_vector(lm);
+    }
+
+    return locks;
+}
+
+SharedTrackerElement Systemmonitor::BuildStartupTimeline() {
+    SharedTrackerElement startup(new TrackerElement(TrackerMap, startup_id));
+    SharedTrackerElement e;
+
+    e.reset(new TrackerElement(TrackerUInt8, startup_complete_id));
+    e->set((uint8_t) StartupProfiler::IsComplete());
+    startup->add_map(e);
+
+    e.reset(new TrackerElement(TrackerUInt64, startup_total_usec_id));
+    e->set((uint64_t) StartupProfiler::FetchTotalUsec());
+    startup->add_map(e);
+
+    SharedTrackerElement steplist(new TrackerElement(TrackerVector, startup_steps_id));
+    startup->add_map(steplist);
+
+    for (auto& s : StartupProfiler::FetchSteps()) {
+        SharedTrackerElement sm(new TrackerElement(TrackerMap, startup_step_id));
+
+        e.reset(new TrackerElement(TrackerString, startup_step_name_id));
+        e->set(s.name);
+        sm->add_map(e);
+
+        e.reset(new TrackerElement(TrackerUInt64, startup_step_start_usec_id));
+        e->set((uint64_t) s.start_usec);
+        sm->add_map(e);
+
+        e.reset(new TrackerElement(TrackerUInt64, startup_step_duration_usec_id));
+        e->set((uint64_t) s.duration_usec);
+        sm->add_map(e);
+
+        e.reset(new TrackerElement(TrackerUInt8, startup_step_parallel_id));
+        e->set((uint8_t) s.parallel);
+        sm->add_map(e);
+
+        steplist->add_vector(sm);
+    }
+
+    return startup;
+}
+
 void Systemmonitor::Httpd_CreateStreamResponse(
         Kis_Net_Httpd *httpd __attribute__((unused)),
         Kis_Net_Httpd_Connection *connection __attribute__((unused)),
@@ -239,6 +780,16 @@ void Systemmonitor::Httpd_CreateStreamResponse(
         return;
     }
 
+    if (Httpd_StripSuffix(path) == "/system/lock_stats") {
+        Httpd_Serialize(path, stream, BuildLockStats());
+        return;
+    }
+
+    if (Httpd_StripSuffix(path) == "/system/startup") {
+        Httpd_Serialize(path, stream, BuildStartupTimeline());
+        return;
+    }
+
     if (strcmp(path, "/system/status.msgpack") == 0) {
         MsgpackAdapter::Pack(globalreg, stream, 
             static_pointer_cast<Systemmonitor>(globalreg->FetchGlobal("SYSTEM_MONITOR")));
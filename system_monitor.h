@@ -22,6 +22,10 @@
 #include "config.h"
 
 #include <string>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 #include <pthread.h>
 
 #include "trackedelement.h"
@@ -29,6 +33,11 @@
 #include "devicetracker_component.h"
 #include "devicetracker.h"
 #include "kis_net_microhttpd.h"
+#include "battery.h"
+
+// Samples of the host kept for history; a reader only ever wants the latest,
+// but the history lets the RRDs catch up on every sample
+#define SYSMON_SAMPLE_RING      64
 
 class Systemmonitor : public tracker_component, public Kis_Net_Httpd_CPPStream_Handler,
     public LifetimeGlobal, public TimetrackerEvent {
@@ -53,6 +62,9 @@ public:
             const char *url, const char *method, const char *upload_data,
             size_t *upload_data_size, std::stringstream &stream);
 
+    // Status is shared by the clients polling it at the same time
+    virtual bool Httpd_CacheableResponse(const char *url, uint64_t *version);
+
     __Proxy(battery_perc, int32_t, int32_t, int32_t, battery_perc);
     __Proxy(battery_charging, string, string, string, battery_charging);
     __Proxy(battery_ac, uint8_t, bool, bool, battery_ac);
@@ -62,8 +74,19 @@ public:
     __Proxy(timestamp_usec, uint64_t, uint64_t, uint64_t, timestamp_usec);
 
     __Proxy(memory, uint64_t, uint64_t, uint64_t, memory);
+    __Proxy(hugepage_mode, string, string, string, hugepage_mode);
+    __Proxy(hugetlb_kb, uint64_t, uint64_t, uint64_t, hugetlb_kb);
+    __Proxy(thp_advised_kb, uint64_t, uint64_t, uint64_t, thp_advised_kb);
+    __Proxy(hugetlb_fallbacks, uint64_t, uint64_t, uint64_t, hugetlb_fallbacks);
+    __Proxy(anon_hugepages_kb, uint64_t, uint64_t, uint64_t, anon_hugepages_kb);
     __Proxy(devices, uint64_t, uint64_t, uint64_t, devices);
 
+    __Proxy(cpu_percent, double, double, double, cpu_percent);
+    __Proxy(threads, uint32_t, uint32_t, uint32_t, threads);
+    __Proxy(fds, uint32_t, uint32_t, uint32_t, fds);
+    __Proxy(thermal_temp, double, double, double, thermal_temp);
+    __Proxy(sample_time, uint64_t, uint64_t, uint64_t, sample_time);
+
     virtual void pre_serialize();
 
     // Timetracker callback
@@ -72,6 +95,62 @@ public:
 protected:
     pthread_mutex_t monitor_mutex;
 
+    // A sample of the host, taken by the sampler thread; /proc, the battery
+    // and the thermal zones are only ever read there, never by a request
+    struct host_sample {
+        uint64_t ts_sec;
+
+        double cpu_percent;
+        uint64_t rss_kb;
+        uint64_t anon_hugepages_kb;
+        uint32_t threads;
+        uint32_t fds;
+
+        kis_battery_info battery;
+
+        // Hottest thermal zone, in millidegrees C; valid if have_thermal
+        bool have_thermal;
+        int32_t thermal_mc;
+    };
+
+    // Ring of samples with a sequence count per slot; there is only ever the
+    // one writer, and readers copy a slot and retry if the count moved under
+    // them, so neither side ever blocks the other
+    struct host_sample_slot {
+        std::atomic<uint64_t> seq;
+        host_sample sample;
+    };
+
+    host_sample_slot sample_ring[SYSMON_SAMPLE_RING];
+
+    // Number of samples published so far
+    std::atomic<uint64_t> sample_head;
+
+    // Next sample the RRDs haven't seen
+    uint64_t sample_consumed;
+
+    // Copy sample number in_num, false if it has been overwritten since
+    bool FetchSample(uint64_t in_num, host_sample *ret_sample);
+    bool FetchLatestSample(host_sample *ret_sample);
+
+    void PublishSample(const host_sample& in_sample);
+
+    void SamplerThread();
+    void TakeSample(host_sample *ret_sample);
+
+    void ApplySample(const host_sample& in_sample);
+
+    std::thread sampler_thread;
+    std::mutex sampler_mutex;
+    std::condition_variable sampler_cv;
+    bool sampler_shutdown;
+
+    unsigned int sample_ms;
+
+    // Previous cpu ticks and when they were read, for the cpu percentage
+    uint64_t last_cpu_ticks, last_cpu_usec;
+    long clock_ticks;
+
     virtual void register_fields();
     virtual void reserve_fields(SharedTrackerElement e);
 
@@ -101,12 +180,75 @@ protected:
     int mem_rrd_id;
     shared_ptr<kis_tracked_rrd<> > memory_rrd;
 
+    // Huge page backed buffers, from HugepageAlloc, and how much of our memory
+    // the kernel backs with transparent huge pages
+    int hugepage_mode_id;
+    SharedTrackerElement hugepage_mode;
+
+    int hugetlb_kb_id;
+    SharedTrackerElement hugetlb_kb;
+
+    int thp_advised_kb_id;
+    SharedTrackerElement thp_advised_kb;
+
+    int hugetlb_fallbacks_id;
+    SharedTrackerElement hugetlb_fallbacks;
+
+    int anon_hugepages_kb_id;
+    SharedTrackerElement anon_hugepages_kb;
+
     int devices_id;
     SharedTrackerElement devices;
 
     int devices_rrd_id;
     shared_ptr<kis_tracked_rrd<> > devices_rrd;
 
+    int cpu_percent_id;
+    SharedTrackerElement cpu_percent;
+
+    int cpu_rrd_id;
+    shared_ptr<kis_tracked_rrd<> > cpu_rrd;
+
+    int threads_id;
+    SharedTrackerElement threads;
+
+    int fds_id;
+    SharedTrackerElement fds;
+
+    int thermal_temp_id;
+    SharedTrackerElement thermal_temp;
+
+    int thermal_rrd_id;
+    shared_ptr<kis_tracked_rrd<> > thermal_rrd;
+
+    int sample_time_id;
+    SharedTrackerElement sample_time;
+
+    // Cpus of each placed thread and capture binary, from CpuAffinity
+    int cpu_affinity_id;
+    SharedTrackerElement cpu_affinity;
+
+    int cpu_affinity_cpus_id;
+
+    // Lock profiling stats, from LockProfiler; not part of the status record
+    SharedTrackerElement BuildLockStats();
+
+    int locks_id, locks_enabled_id, locks_list_id, lock_id, lock_name_id,
+        lock_acquires_id, lock_contended_id, lock_wait_ns_id, lock_hold_ns_id,
+        lock_wait_histogram_id, lock_hold_histogram_id, lock_bucket_id,
+        lock_sites_id, lock_site_id, lock_site_file_id, lock_site_line_id,
+        lock_site_count_id, lock_site_hold_ns_id;
+
+    // Call sites reported for each lock
+    unsigned int lock_report_sites;
+
+    // Startup timeline, from StartupProfiler; not part of the status record
+    SharedTrackerElement BuildStartupTimeline();
+
+    int startup_id, startup_complete_id, startup_total_usec_id, startup_steps_id,
+        startup_step_id, startup_step_name_id, startup_step_start_usec_id,
+        startup_step_duration_usec_id, startup_step_parallel_id;
+
     long mem_per_page;
 };
 
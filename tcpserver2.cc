@@ -19,6 +19,7 @@
 #include "config.h"
 #include "tcpserver2.h"
 #include "ringbuf2.h"
+#include "pollabletracker.h"
 
 TcpServerV2::TcpServerV2(GlobalRegistry *in_globalreg) {
     globalreg = in_globalreg;
@@ -26,11 +27,107 @@ TcpServerV2::TcpServerV2(GlobalRegistry *in_globalreg) {
     
     server_fd = -1;
 
+    event_driven = false;
+
     ringbuf_size = 128 * 1024;
+
+    tls_ctx = NULL;
 }
 
 TcpServerV2::~TcpServerV2() {
     Shutdown();
+
+    kis_tls_ctx_free(tls_ctx);
+}
+
+int TcpServerV2::ConfigureTls(string in_cert, string in_key) {
+    char errstr[512];
+
+    kis_tls_ctx_t *ctx = kis_tls_server_ctx(in_cert.c_str(), in_key.c_str(),
+            errstr, sizeof(errstr));
+
+    if (ctx == NULL) {
+        _MSG("TCP server unable to set up TLS: " + string(errstr), MSGFLAG_ERROR);
+        return -1;
+    }
+
+    kis_tls_ctx_free(tls_ctx);
+    tls_ctx = ctx;
+
+    return 1;
+}
+
+ssize_t TcpServerV2::ConnRead(int in_fd, void *in_buf, size_t in_len,
+        tls_conn **ret_tls) {
+    auto t = tls_map.find(in_fd);
+
+    if (t == tls_map.end()) {
+        *ret_tls = NULL;
+        return read(in_fd, in_buf, in_len);
+    }
+
+    *ret_tls = &(t->second);
+
+    ssize_t r = kis_tls_read(t->second.conn, in_buf, in_len);
+
+    if (r > 0 && !t->second.established)
+        TlsEstablished(in_fd, &(t->second));
+
+    return r;
+}
+
+ssize_t TcpServerV2::ConnWrite(int in_fd, const void *in_buf, size_t in_len,
+        tls_conn **ret_tls) {
+    auto t = tls_map.find(in_fd);
+
+    if (t == tls_map.end()) {
+        *ret_tls = NULL;
+        return write(in_fd, in_buf, in_len);
+    }
+
+    *ret_tls = &(t->second);
+
+    // Nothing is written until the handshake is done, so anything queued
+    // before it waits for the client
+    if (!t->second.established) {
+        int r = kis_tls_handshake(t->second.conn);
+
+        if (r < 0) {
+            errno = EIO;
+            return -1;
+        }
+
+        if (r == 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+
+        TlsEstablished(in_fd, &(t->second));
+    }
+
+    return kis_tls_write(t->second.conn, in_buf, in_len);
+}
+
+string TcpServerV2::ConnError(tls_conn *in_tls) {
+    if (in_tls != NULL && errno == EIO)
+        return string(kis_tls_error(in_tls->conn));
+
+    return kis_strerror_r(errno);
+}
+
+void TcpServerV2::TlsEstablished(int in_fd, tls_conn *in_tls) {
+    in_tls->established = true;
+
+    stringstream msg;
+
+    msg << "TCP server TLS connection from client " << in_fd << " established";
+
+    if (kis_tls_resumed(in_tls->conn))
+        msg << " (resumed session)";
+
+    msg << ", kernel offload " << kis_tls_offload(in_tls->conn);
+
+    _MSG(msg.str(), MSGFLAG_INFO);
 }
 
 void TcpServerV2::SetBufferSize(unsigned int in_sz) {
@@ -115,6 +212,14 @@ int TcpServerV2::ConfigureServer(short int in_port, unsigned int in_maxcli,
     // Set it to nonblocking 
     fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL, 0) | O_NONBLOCK);
 
+    // Use the event backend for the server and all its clients when we can
+    shared_ptr<PollableTracker> pollabletracker =
+        static_pointer_cast<PollableTracker>(globalreg->FetchGlobal("POLLABLETRACKER"));
+
+    if (pollabletracker != NULL && 
+            pollabletracker->AddEventFd(server_fd, this, true, false) >= 0)
+        event_driven = true;
+
     valid = true;
 
     return 1;
@@ -126,6 +231,9 @@ int TcpServerV2::MergeSet(int in_max_fd, fd_set *out_rset, fd_set *out_wset) {
     if (!valid)
         return -1;
 
+    if (event_driven)
+        return maxfd;
+
     if (server_fd >= 0) {
         FD_SET(server_fd, out_rset);
         if (maxfd < server_fd)
@@ -151,156 +259,279 @@ int TcpServerV2::MergeSet(int in_max_fd, fd_set *out_rset, fd_set *out_wset) {
     return maxfd;
 }
 
-
 int TcpServerV2::Poll(fd_set& in_rset, fd_set& in_wset) {
-    stringstream msg;
-    int ret, iret;
-    size_t len;
-    unsigned char *buf;
-    ssize_t r_sz;
-
     if (!valid)
         return -1;
 
     // Reap any pending closures
-    for (auto i = kill_map.begin(); i != kill_map.end(); ++i) {
-        auto h = handler_map.find(i->first);
-        
-        if (h != kill_map.end()) {
-            close(h->first);
-            handler_map.erase(h);
-        }
-    }
-    kill_map.clear();
+    ReapConnections();
 
-    int accept_fd = 0;
     if (server_fd >= 0 && FD_ISSET(server_fd, &in_rset)) {
-        if ((accept_fd = AcceptConnection()) <= 0)
+        if (ProcessAccept() <= 0)
             return 0;
+    }
 
-        if (!AllowConnection(accept_fd)) {
-            KillConnection(accept_fd);
-            return 0;
+    for (auto i = handler_map.begin(); i != handler_map.end(); ++i) {
+        // Process incoming data
+        if (FD_ISSET(i->first, &in_rset)) {
+            if (ReadConnection(i->first, i->second) < 0)
+                return 0;
         }
 
-        shared_ptr<BufferHandlerGeneric> con_handler = AllocateConnection(accept_fd);
+        if (FD_ISSET(i->first, &in_wset)) {
+            if (WriteConnection(i->first, i->second, false) < 0)
+                return 0;
+        }
+    }
 
-        if (con_handler == NULL) {
-            KillConnection(accept_fd);
+    // Reap any pending closures
+    ReapConnections();
+
+    return 0;
+}
+
+int TcpServerV2::PollEvent(int in_fd, bool in_read, bool in_write) {
+    int r = 0;
+
+    if (!valid)
+        return 0;
+
+    ReapConnections();
+
+    if (in_fd == server_fd) {
+        // Accept everything pending; an accept error leaves connections waiting
+        // with no new edge, so try again next loop
+        while ((r = ProcessAccept()) > 0)
+            ;
+
+        ReapConnections();
+
+        return r < 0 ? 1 : 0;
+    }
+
+    auto i = handler_map.find(in_fd);
+
+    if (i == handler_map.end())
+        return 0;
+
+    shared_ptr<BufferHandlerGeneric> handler = i->second;
+
+    if (in_read) {
+        if ((r = ReadConnection(in_fd, handler)) < 0) {
+            ReapConnections();
             return 0;
         }
+    }
+
+    if (in_write) 
+        WriteConnection(in_fd, handler, true);
+
+    ReapConnections();
+
+    return r;
+}
 
-        handler_map.emplace(accept_fd, con_handler);
+int TcpServerV2::ProcessAccept() {
+    int accept_fd = 0;
+
+    if ((accept_fd = AcceptConnection()) <= 0)
+        return accept_fd;
 
-        NewConnection(con_handler);
+    if (!AllowConnection(accept_fd)) {
+        close(accept_fd);
+        return 1;
     }
 
-    for (auto i = handler_map.begin(); i != handler_map.end(); ++i) {
-        // Process incoming data
-        if (FD_ISSET(i->first, &in_rset)) {
+    shared_ptr<BufferHandlerGeneric> con_handler = AllocateConnection(accept_fd);
 
-            while (i->second->GetReadBufferAvailable() > 0) {
-                // Read only as much as we can get w/ a direct reference
-                r_sz = i->second->ZeroCopyReserveReadBufferData((void **) &buf, 
-                        i->second->GetReadBufferAvailable());
-
-                if (r_sz < 0) {
-                    msg << "TCP server closing connection from client " << i->first << 
-                        " unable to reserve space in buffer, something went wrong";
-                    i->second->CommitReadBufferData(buf, 0);
-                    i->second->BufferError(msg.str());
-                    KillConnection(i->first);
-                }
+    if (con_handler == NULL) {
+        close(accept_fd);
+        return 1;
+    }
 
-                if ((ret = read(i->first, buf, r_sz)) <= 0) {
-                    if (errno != EINTR && errno != EAGAIN) {
-                        // Push the error upstream if we failed to read here
-                        if (ret == 0) {
-                            msg << "TCP server closing connection from client " << i->first <<
-                                " - connection closed by remote side";
-                            _MSG(msg.str(), MSGFLAG_ERROR);
-                        } else {
-                            msg << "TCP server error reading from client " << i->first << 
-                                " - " << kis_strerror_r(errno);
-                            _MSG(msg.str(), MSGFLAG_ERROR);
-                        }
-
-                        // Dump the commit
-                        i->second->CommitReadBufferData(buf, 0);
-                        i->second->BufferError(msg.str());
-                        
-                        KillConnection(i->first);
-                        return 0;
-                    } else {
-                        // Drop out of while loop
-                        
-                        // Dump the commit
-                        i->second->CommitReadBufferData(buf, 0);
-
-                        break;
-                    }
-                } else {
-                    // Commit the data
-                    iret = i->second->CommitReadBufferData(buf, ret);
-
-                    if (!iret) {
-                        // Die if we somehow couldn't insert all our data once we
-                        // read it from the socket since we can't put it back on the
-                        // input queue.  This should never happen because we're the
-                        // only input source but we'll handle it
-                        msg << "Could not commit read data for client " << i->first;
-                        _MSG(msg.str(), MSGFLAG_ERROR);
-
-                        KillConnection(i->first);
-                        return 0;
-                    }
-                }
+    if (tls_ctx != NULL) {
+        tls_conn t;
 
-                // We never get here; delete 
-                // delete[] buf;
-            }
+        t.conn = kis_tls_conn_new(tls_ctx, accept_fd, 1, NULL);
+        t.established = false;
+
+        if (t.conn == NULL) {
+            _MSG("TCP server unable to start TLS for a new connection", MSGFLAG_ERROR);
+            close(accept_fd);
+            return 1;
         }
 
-        if (FD_ISSET(i->first, &in_wset)) {
-            len = i->second->GetWriteBufferUsed();
-
-            // Peek the data into our buffer as a zero-copy op whenever possible; we
-            // don't care how much we get
-            ret = i->second->ZeroCopyPeekWriteBufferData((void **) &buf, len);
-
-            if (ret > 0) {
-                if ((iret = write(i->first, buf, ret)) <= 0) {
-                    if (errno != EINTR && errno != EAGAIN) {
-                        // Push the error upstream
-                        msg << "TCP server error writing to client " << i->first <<
-                            " - " << kis_strerror_r(errno);
-                        _MSG(msg.str(), MSGFLAG_ERROR);
-
-                        i->second->PeekFreeWriteBufferData(buf);
-                        i->second->BufferError(msg.str());
-
-                        KillConnection(i->first);
-                        return 0;
-                    }
-                } else {
-                    // Consume whatever we managed to write
-                    i->second->PeekFreeWriteBufferData(buf);
-                    i->second->ConsumeWriteBufferData(iret);
-                }
-            }
+        tls_map[accept_fd] = t;
+    }
+
+    handler_map.emplace(accept_fd, con_handler);
+
+    if (event_driven) {
+        shared_ptr<PollableTracker> pollabletracker =
+            static_pointer_cast<PollableTracker>(globalreg->FetchGlobal("POLLABLETRACKER"));
+
+        if (pollabletracker->AddEventFd(accept_fd, this, true, true) < 0) {
+            KillConnection(accept_fd);
+            return 1;
         }
+
+        write_trigger_map[accept_fd] = shared_ptr<PollableWriteTrigger>(
+                new PollableWriteTrigger(pollabletracker, con_handler.get(), accept_fd));
     }
 
-    // Reap any pending closures
+    NewConnection(con_handler);
+
+    return 1;
+}
+
+void TcpServerV2::ReapConnections() {
+    if (kill_map.size() == 0)
+        return;
+
+    shared_ptr<PollableTracker> pollabletracker;
+
+    if (event_driven)
+        pollabletracker =
+            static_pointer_cast<PollableTracker>(globalreg->FetchGlobal("POLLABLETRACKER"));
+
     for (auto i = kill_map.begin(); i != kill_map.end(); ++i) {
         auto h = handler_map.find(i->first);
         
-        if (h != kill_map.end()) {
+        if (h != handler_map.end()) {
+            if (pollabletracker != NULL) {
+                write_trigger_map.erase(h->first);
+                pollabletracker->RemoveEventFd(h->first);
+            }
+
+            auto t = tls_map.find(h->first);
+
+            if (t != tls_map.end()) {
+                kis_tls_conn_free(t->second.conn);
+                tls_map.erase(t);
+            }
+
             close(h->first);
             handler_map.erase(h);
         }
     }
     kill_map.clear();
+}
+
+int TcpServerV2::ReadConnection(int in_fd, shared_ptr<BufferHandlerGeneric> in_handler) {
+    stringstream msg;
+    int ret, iret;
+    unsigned char *buf;
+    ssize_t r_sz;
+    tls_conn *tls;
+
+    while (in_handler->GetReadBufferAvailable() > 0) {
+        // Read only as much as we can get w/ a direct reference
+        r_sz = in_handler->ZeroCopyReserveReadBufferData((void **) &buf, 
+                in_handler->GetReadBufferAvailable());
+
+        if (r_sz < 0) {
+            msg << "TCP server closing connection from client " << in_fd << 
+                " unable to reserve space in buffer, something went wrong";
+            in_handler->CommitReadBufferData(buf, 0);
+            in_handler->BufferError(msg.str());
+            KillConnection(in_fd);
+            return -1;
+        }
+
+        if ((ret = ConnRead(in_fd, buf, r_sz, &tls)) <= 0) {
+            // A closed connection leaves errno untouched
+            if (ret == 0 || (errno != EINTR && errno != EAGAIN)) {
+                // Push the error upstream if we failed to read here
+                if (ret == 0) {
+                    msg << "TCP server closing connection from client " << in_fd <<
+                        " - connection closed by remote side";
+                    _MSG(msg.str(), MSGFLAG_ERROR);
+                } else {
+                    msg << "TCP server error reading from client " << in_fd << 
+                        " - " << ConnError(tls);
+                    _MSG(msg.str(), MSGFLAG_ERROR);
+                }
+
+                // Dump the commit
+                in_handler->CommitReadBufferData(buf, 0);
+                in_handler->BufferError(msg.str());
+
+                KillConnection(in_fd);
+                return -1;
+            } else {
+                // Drop out of while loop
+                
+                // Dump the commit
+                in_handler->CommitReadBufferData(buf, 0);
+
+                return 0;
+            }
+        } else {
+            // Commit the data
+            iret = in_handler->CommitReadBufferData(buf, ret);
+
+            if (!iret) {
+                // Die if we somehow couldn't insert all our data once we
+                // read it from the socket since we can't put it back on the
+                // input queue.  This should never happen because we're the
+                // only input source but we'll handle it
+                msg << "Could not commit read data for client " << in_fd;
+                _MSG(msg.str(), MSGFLAG_ERROR);
+
+                KillConnection(in_fd);
+                return -1;
+            }
+        }
+    }
+
+    // Buffer filled before we drained the socket
+    return 1;
+}
+
+int TcpServerV2::WriteConnection(int in_fd, shared_ptr<BufferHandlerGeneric> in_handler,
+        bool in_drain) {
+    stringstream msg;
+    int ret, iret;
+    size_t len;
+    unsigned char *buf;
+    tls_conn *tls;
+
+    while ((len = in_handler->GetWriteBufferUsed()) > 0) {
+        // Peek the data into our buffer as a zero-copy op whenever possible; we
+        // don't care how much we get
+        ret = in_handler->ZeroCopyPeekWriteBufferData((void **) &buf, len);
+
+        if (ret <= 0) {
+            in_handler->PeekFreeWriteBufferData(buf);
+            break;
+        }
+
+        if ((iret = ConnWrite(in_fd, buf, ret, &tls)) <= 0) {
+            in_handler->PeekFreeWriteBufferData(buf);
+
+            if (errno != EINTR && errno != EAGAIN) {
+                // Push the error upstream
+                msg << "TCP server error writing to client " << in_fd <<
+                    " - " << ConnError(tls);
+                _MSG(msg.str(), MSGFLAG_ERROR);
+
+                in_handler->BufferError(msg.str());
+
+                KillConnection(in_fd);
+                return -1;
+            }
+
+            // Wait for the socket to become writeable again
+            break;
+        } else {
+            // Consume whatever we managed to write
+            in_handler->PeekFreeWriteBufferData(buf);
+            in_handler->ConsumeWriteBufferData(iret);
+        }
+
+        if (!in_drain)
+            break;
+    }
 
     return 0;
 }
@@ -418,7 +649,24 @@ void TcpServerV2::Shutdown() {
         KillConnection(i->first);
     }
 
-    close(server_fd);
+    if (event_driven) {
+        // Nothing will poll us once we're invalid, so release the connections
+        // and the event registrations now
+        ReapConnections();
+
+        shared_ptr<PollableTracker> pollabletracker =
+            static_pointer_cast<PollableTracker>(globalreg->FetchGlobal("POLLABLETRACKER"));
+
+        if (pollabletracker != NULL)
+            pollabletracker->RemoveEventFd(server_fd);
+
+        event_driven = false;
+    }
+
+    if (server_fd >= 0)
+        close(server_fd);
+
+    server_fd = -1;
 
     valid = false;
 }
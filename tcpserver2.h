@@ -40,6 +40,9 @@
 #include "globalregistry.h"
 #include "buffer_handler.h"
 #include "pollable.h"
+#include "kis_tls.h"
+
+class PollableWriteTrigger;
 
 #ifndef MAXHOSTNAMELEN
 #define MAXHOSTNAMELEN 64
@@ -70,9 +73,14 @@ public:
 
     virtual void SetBufferSize(unsigned int in_sz);
 
+    // Require TLS on every connection accepted from now on, with a PEM
+    // certificate and key; see kis_tls.h
+    virtual int ConfigureTls(string in_cert, string in_key);
+
     // Pollable
     virtual int MergeSet(int in_max_fd, fd_set *out_rset, fd_set *out_wset);
     virtual int Poll(fd_set& in_rset, fd_set& in_wset);
+    virtual int PollEvent(int in_fd, bool in_read, bool in_write);
    
     // Must be filled in
     virtual void NewConnection(shared_ptr<BufferHandlerGeneric> conn_handler) = 0;
@@ -88,6 +96,26 @@ protected:
     // Allocate the connection
     virtual shared_ptr<BufferHandlerGeneric> AllocateConnection(int in_fd);
 
+    // Accept, filter, and allocate a pending connection
+    //
+    // returns:
+    // 1    Connection handled (accepted or rejected)
+    // 0    No connections pending
+    // -1   Error
+    int ProcessAccept();
+
+    // Close connections scheduled by KillConnection
+    void ReapConnections();
+
+    // Read from a client until it would block or the buffer is full; returns
+    // 1 if the buffer filled first, 0 if drained, -1 if the connection was killed
+    int ReadConnection(int in_fd, shared_ptr<BufferHandlerGeneric> in_handler);
+
+    // Write pending data to a client, until it would block if in_drain is set;
+    // returns -1 if the connection was killed
+    int WriteConnection(int in_fd, shared_ptr<BufferHandlerGeneric> in_handler, 
+            bool in_drain);
+
     bool valid;
 
     unsigned int ringbuf_size;
@@ -107,6 +135,31 @@ protected:
 
     map<int, shared_ptr<BufferHandlerGeneric> > kill_map;
 
+    // TLS server context, if the server requires TLS, and the TLS state of each
+    // connection
+    kis_tls_ctx_t *tls_ctx;
+
+    struct tls_conn {
+        kis_tls_conn_t *conn;
+        bool established;
+    };
+
+    map<int, tls_conn> tls_map;
+
+    // Read or write a client through TLS when it has it
+    ssize_t ConnRead(int in_fd, void *in_buf, size_t in_len, tls_conn **ret_tls);
+    ssize_t ConnWrite(int in_fd, const void *in_buf, size_t in_len, tls_conn **ret_tls);
+
+    // Message for a failed read or write
+    string ConnError(tls_conn *in_tls);
+
+    // Announce a TLS connection once its handshake is done
+    void TlsEstablished(int in_fd, tls_conn *in_tls);
+
+    // Are the server and its clients registered with the event backend?
+    bool event_driven;
+    map<int, shared_ptr<PollableWriteTrigger> > write_trigger_map;
+
 };
 
 #endif
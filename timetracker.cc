@@ -21,6 +21,7 @@
 #include <sys/time.h>
 
 #include "timetracker.h"
+#include "kis_clock.h"
 
 Timetracker::Timetracker(GlobalRegistry *in_globalreg) {
     globalreg = in_globalreg;
@@ -32,10 +33,16 @@ Timetracker::Timetracker(GlobalRegistry *in_globalreg) {
     pthread_mutexattr_settype(&mutexattr, PTHREAD_MUTEX_RECURSIVE);
 	pthread_mutex_init(&time_mutex, &mutexattr);
 
+    LockProfiler::NameMutex(&time_mutex, "time_mutex");
+
     next_timer_id = 0;
+    next_heap_seq = 1;
+    heap_stale = 0;
+
+    KisClock::Update();
 
 	globalreg->start_time = time(0);
-	gettimeofday(&(globalreg->timestamp), NULL);
+    globalreg->timestamp = KisClock::CoarseWall();
 }
 
 Timetracker::~Timetracker() {
@@ -45,35 +52,60 @@ Timetracker::~Timetracker() {
     globalreg->timetracker = NULL;
 
     // Free the events
-    for (map<int, timer_event *>::iterator x = timer_map.begin();
-         x != timer_map.end(); ++x)
-        delete x->second;
+    timer_map.for_each([](uint64_t, timer_event *e) {
+        delete e;
+    });
 
+    LockProfiler::ForgetMutex(&time_mutex);
     pthread_mutex_destroy(&time_mutex);
 }
 
 int Timetracker::Tick() {
-    vector<timer_event *> action_timers;
-
     local_locker lock(&time_mutex);
 
-    // Handle scheduled events
-    struct timeval cur_tm;
-    gettimeofday(&cur_tm, NULL);
+    // Every tick refreshes the central clock
+    KisClock::Update();
+
+    struct timeval cur_tm = KisClock::CoarseWall();
 	globalreg->timestamp.tv_sec = cur_tm.tv_sec;
 	globalreg->timestamp.tv_usec = cur_tm.tv_usec;
     timer_event *evt;
+    timer_event **evtp;
     int timerid;
 
-    for (unsigned int x = 0; x < sorted_timers.size(); x++) {
-        evt = sorted_timers[x];
-        timerid = evt->timer_id;
+    // Handle scheduled events
+    uint64_t now = KisClock::CoarseMonoUsec();
+
+    // Anything scheduled while we're running waits for the next tick, so a 
+    // zero-length recurring timer can't hold us here forever
+    uint64_t seq_limit = next_heap_seq;
+    vector<timer_heap_rec> deferred;
+
+    while (timer_heap.size() != 0) {
+        timer_heap_rec top = timer_heap.front();
 
-        if ((cur_tm.tv_sec < evt->trigger_tm.tv_sec) ||
-            ((cur_tm.tv_sec == evt->trigger_tm.tv_sec) && 
-			 (cur_tm.tv_usec < evt->trigger_tm.tv_usec))) {
-            return 1;
-		}
+        if (top.trigger_usec > now)
+            break;
+
+        pop_heap(timer_heap.begin(), timer_heap.end(), TimerHeapCompare());
+        timer_heap.pop_back();
+
+        evtp = timer_map.find(top.timer_id);
+
+        if (evtp == NULL || (*evtp)->heap_seq != top.seq) {
+            if (heap_stale > 0)
+                heap_stale--;
+            continue;
+        }
+
+        if (top.seq >= seq_limit) {
+            deferred.push_back(top);
+            continue;
+        }
+
+        evt = *evtp;
+        timerid = evt->timer_id;
+        evt->heap_seq = 0;
 
         // fprintf(stderr, "debug - triggering timer %d\n", timerid);
 
@@ -87,32 +119,94 @@ int Timetracker::Tick() {
             ret = evt->event_func(evt->timer_id);
         }
 
-        if (ret > 0 && evt->timeslices != -1 && evt->recurring) {
+        // The timer may have removed itself
+        if ((evtp = timer_map.find(timerid)) == NULL)
+            continue;
+
+        evt = *evtp;
+
+        if (ret > 0 && evt->interval_usec > 0 && evt->recurring) {
             evt->schedule_tm.tv_sec = cur_tm.tv_sec;
             evt->schedule_tm.tv_usec = cur_tm.tv_usec;
-            evt->trigger_tm.tv_sec = evt->schedule_tm.tv_sec + 
-                (evt->timeslices / SERVER_TIMESLICES_SEC);
-            evt->trigger_tm.tv_usec = evt->schedule_tm.tv_usec + 
-				((evt->timeslices % SERVER_TIMESLICES_SEC) *
-                 (1000000L / SERVER_TIMESLICES_SEC));
-
-            if (evt->trigger_tm.tv_usec >= 999999L) {
-                evt->trigger_tm.tv_sec++;
-                evt->trigger_tm.tv_usec %= 1000000L;
-            }
-
-            // Re-sort the list
-            stable_sort(sorted_timers.begin(), sorted_timers.end(), 
-						SortTimerEventsTrigger());
+
+            evt->trigger_mono_usec = now + evt->interval_usec;
+            evt->trigger_tm =
+                KisClock::UsecToTimeval(KisClock::MonoToWallUsec(evt->trigger_mono_usec));
+
+            PushTimer_nb(evt);
         } else {
             RemoveTimer_nb(timerid);
         }
+    }
 
+    for (auto d : deferred) {
+        timer_heap.push_back(d);
+        push_heap(timer_heap.begin(), timer_heap.end(), TimerHeapCompare());
     }
 
     return 1;
 }
 
+void Timetracker::ClampTimeout(struct timeval *in_tm) {
+    local_locker lock(&time_mutex);
+
+    if (timer_heap.size() == 0)
+        return;
+
+    uint64_t now = KisClock::MonoUsec();
+    uint64_t trigger = timer_heap.front().trigger_usec;
+    uint64_t wait = trigger > now ? trigger - now : 0;
+
+    if (wait < KisClock::TimevalToUsec(*in_tm)) {
+        in_tm->tv_sec = wait / 1000000ULL;
+        in_tm->tv_usec = wait % 1000000ULL;
+    }
+}
+
+void Timetracker::PushTimer_nb(timer_event *evt) {
+    timer_heap_rec rec;
+
+    rec.trigger_usec = evt->trigger_mono_usec;
+    rec.seq = next_heap_seq++;
+    rec.timer_id = evt->timer_id;
+
+    evt->heap_seq = rec.seq;
+
+    timer_heap.push_back(rec);
+    push_heap(timer_heap.begin(), timer_heap.end(), TimerHeapCompare());
+}
+
+int Timetracker::InsertTimer_nb(timer_event *evt, long in_interval_usec, 
+        struct timeval *in_trigger, int in_recurring) {
+    evt->timer_id = next_timer_id++;
+
+    uint64_t now = KisClock::MonoUsec();
+    evt->schedule_tm = KisClock::UsecToTimeval(KisClock::MonoToWallUsec(now));
+
+    if (in_trigger != NULL) {
+        evt->trigger_tm.tv_sec = in_trigger->tv_sec;
+        evt->trigger_tm.tv_usec = in_trigger->tv_usec;
+        evt->trigger_mono_usec = 
+            KisClock::WallToMonoUsec(KisClock::TimevalToUsec(*in_trigger));
+        evt->timeslices = -1;
+        evt->interval_usec = 0;
+    } else {
+        evt->interval_usec = in_interval_usec;
+        evt->timeslices = in_interval_usec / (1000000L / SERVER_TIMESLICES_SEC);
+
+        evt->trigger_mono_usec = now + evt->interval_usec;
+        evt->trigger_tm =
+            KisClock::UsecToTimeval(KisClock::MonoToWallUsec(evt->trigger_mono_usec));
+    }
+
+    evt->recurring = in_recurring;
+
+    timer_map.insert(evt->timer_id, evt);
+    PushTimer_nb(evt);
+
+    return evt->timer_id;
+}
+
 int Timetracker::RegisterTimer(int in_timeslices, struct timeval *in_trigger,
                                int in_recurring, 
                                int (*in_callback)(TIMEEVENT_PARMS),
@@ -128,31 +222,13 @@ int Timetracker::RegisterTimer_nb(int in_timeslices, struct timeval *in_trigger,
                                void *in_parm) {
     timer_event *evt = new timer_event;
 
-    evt->timer_id = next_timer_id++;
-    gettimeofday(&(evt->schedule_tm), NULL);
-
-    if (in_trigger != NULL) {
-        evt->trigger_tm.tv_sec = in_trigger->tv_sec;
-        evt->trigger_tm.tv_usec = in_trigger->tv_usec;
-        evt->timeslices = -1;
-    } else {
-        evt->trigger_tm.tv_sec = evt->schedule_tm.tv_sec + (in_timeslices / 10);
-        evt->trigger_tm.tv_usec = evt->schedule_tm.tv_usec + (in_timeslices % 10);
-        evt->timeslices = in_timeslices;
-    }
-
-    evt->recurring = in_recurring;
     evt->callback = in_callback;
     evt->callback_parm = in_parm;
     evt->event = NULL;
 
-    timer_map[evt->timer_id] = evt;
-    sorted_timers.push_back(evt);
-
-    // Resort the list
-    stable_sort(sorted_timers.begin(), sorted_timers.end(), SortTimerEventsTrigger());
-
-    return evt->timer_id;
+    return InsertTimer_nb(evt, 
+            in_timeslices * (1000000L / SERVER_TIMESLICES_SEC), 
+            in_trigger, in_recurring);
 }
 
 int Timetracker::RegisterTimer(int in_timeslices, struct timeval *in_trigger,
@@ -165,40 +241,13 @@ int Timetracker::RegisterTimer_nb(int in_timeslices, struct timeval *in_trigger,
         int in_recurring, TimetrackerEvent *in_event) {
     timer_event *evt = new timer_event;
 
-    evt->timer_id = next_timer_id++;
-    gettimeofday(&(evt->schedule_tm), NULL);
-
-    if (in_trigger != NULL) {
-        evt->trigger_tm.tv_sec = in_trigger->tv_sec;
-        evt->trigger_tm.tv_usec = in_trigger->tv_usec;
-        evt->timeslices = -1;
-    } else {
-        evt->trigger_tm.tv_sec = evt->schedule_tm.tv_sec + 
-            (in_timeslices / SERVER_TIMESLICES_SEC);
-        evt->trigger_tm.tv_usec = evt->schedule_tm.tv_usec + 
-            ((in_timeslices % SERVER_TIMESLICES_SEC) *
-             (1000000L / SERVER_TIMESLICES_SEC));
-
-        if (evt->trigger_tm.tv_usec >= 999999L) {
-            evt->trigger_tm.tv_sec++;
-            evt->trigger_tm.tv_usec %= 1000000L;
-        }
-            
-        evt->timeslices = in_timeslices;
-    }
-
-    evt->recurring = in_recurring;
     evt->callback = NULL;
     evt->callback_parm = NULL;
     evt->event = in_event;
 
-    timer_map[evt->timer_id] = evt;
-    sorted_timers.push_back(evt);
-
-    // Resort the list
-    stable_sort(sorted_timers.begin(), sorted_timers.end(), SortTimerEventsTrigger());
-
-    return evt->timer_id;
+    return InsertTimer_nb(evt, 
+            in_timeslices * (1000000L / SERVER_TIMESLICES_SEC), 
+            in_trigger, in_recurring);
 }
 
 int Timetracker::RegisterTimer(int in_timeslices, struct timeval *in_trigger,
@@ -211,70 +260,143 @@ int Timetracker::RegisterTimer_nb(int in_timeslices, struct timeval *in_trigger,
         int in_recurring, std::function<int (int)> in_event) {
     timer_event *evt = new timer_event;
 
-    evt->timer_id = next_timer_id++;
-    gettimeofday(&(evt->schedule_tm), NULL);
+    evt->callback = NULL;
+    evt->callback_parm = NULL;
+    evt->event = NULL;
+    
+    evt->event_func = in_event;
 
-    if (in_trigger != NULL) {
-        evt->trigger_tm.tv_sec = in_trigger->tv_sec;
-        evt->trigger_tm.tv_usec = in_trigger->tv_usec;
-        evt->timeslices = -1;
-    } else {
-        evt->trigger_tm.tv_sec = evt->schedule_tm.tv_sec + 
-            (in_timeslices / SERVER_TIMESLICES_SEC);
-        evt->trigger_tm.tv_usec = evt->schedule_tm.tv_usec + 
-            ((in_timeslices % SERVER_TIMESLICES_SEC) * 
-             (1000000L / SERVER_TIMESLICES_SEC));
-        evt->timeslices = in_timeslices;
-
-        if (evt->trigger_tm.tv_usec >= 999999L) {
-            evt->trigger_tm.tv_sec++;
-            evt->trigger_tm.tv_usec %= 1000000L;
-        }
-    }
+    return InsertTimer_nb(evt, 
+            in_timeslices * (1000000L / SERVER_TIMESLICES_SEC), 
+            in_trigger, in_recurring);
+}
+
+int Timetracker::RegisterTimerUsec(long in_interval_usec, int in_recurring,
+        std::function<int (int)> in_event) {
+    local_locker lock(&time_mutex);
+
+    timer_event *evt = new timer_event;
 
-    evt->recurring = in_recurring;
     evt->callback = NULL;
     evt->callback_parm = NULL;
     evt->event = NULL;
-    
     evt->event_func = in_event;
 
-    timer_map[evt->timer_id] = evt;
-    sorted_timers.push_back(evt);
+    return InsertTimer_nb(evt, in_interval_usec, NULL, in_recurring);
+}
 
-    // Resort the list
-    stable_sort(sorted_timers.begin(), sorted_timers.end(), SortTimerEventsTrigger());
+Timetracker::pool_timer_run::~pool_timer_run() {
+    std::lock_guard<std::mutex> lock(state->mutex);
+    state->running = false;
+    state->runner = std::thread::id();
+    state->cv.notify_all();
+}
 
-    return evt->timer_id;
+int Timetracker::RegisterPoolTimer(int in_timeslices, int in_recurring,
+        kis_task_lane in_lane, std::function<int (int)> in_event) {
+    local_locker lock(&time_mutex);
+
+    shared_ptr<pool_timer> state(new pool_timer());
+    state->running = false;
+    state->event = in_event;
+
+    int id = RegisterTimer_nb(in_timeslices, NULL, in_recurring,
+            [this, state, in_lane, in_recurring](int timer_id) -> int {
+                {
+                    std::lock_guard<std::mutex> slock(state->mutex);
+
+                    if (state->running)
+                        return 1;
+
+                    state->running = true;
+                }
+
+                shared_ptr<pool_timer_run> run(new pool_timer_run(state));
+
+                auto task = [this, run, timer_id, in_recurring]() {
+                    {
+                        std::lock_guard<std::mutex> slock(run->state->mutex);
+                        run->state->runner = std::this_thread::get_id();
+                    }
+
+                    if (run->state->event(timer_id) <= 0 && in_recurring)
+                        RemoveTimer(timer_id);
+                };
+
+                shared_ptr<KisTaskPool> pool =
+                    globalreg->FetchGlobalAs<KisTaskPool>("TASKPOOL");
+
+                if (pool == NULL)
+                    task();
+                else
+                    pool->submit(in_lane, task);
+
+                return 1;
+            });
+
+    if (id >= 0)
+        pool_timers[id] = state;
+
+    return id;
 }
 
 int Timetracker::RemoveTimer(int in_timerid) {
-    local_locker lock(&time_mutex);
-    return RemoveTimer_nb(in_timerid);
+    shared_ptr<pool_timer> state;
+    int ret;
+
+    {
+        local_locker lock(&time_mutex);
+
+        auto p = pool_timers.find(in_timerid);
+
+        if (p != pool_timers.end())
+            state = p->second;
+
+        ret = RemoveTimer_nb(in_timerid);
+    }
+
+    // Whatever the event touches may be going away once we return
+    if (state != NULL) {
+        std::unique_lock<std::mutex> slock(state->mutex);
+
+        if (state->runner != std::this_thread::get_id())
+            state->cv.wait(slock, [state]() { return !state->running; });
+    }
+
+    return ret;
 }
 
 int Timetracker::RemoveTimer_nb(int in_timerid) {
-    map<int, timer_event *>::iterator itr;
+    timer_event **evtp = timer_map.find(in_timerid);
 
-    itr = timer_map.find(in_timerid);
+    if (evtp == NULL)
+        return -1;
 
-    if (itr != timer_map.end()) {
-        for (unsigned int x = 0; x < sorted_timers.size(); x++) {
-            if (sorted_timers[x]->timer_id == in_timerid) {
-                sorted_timers.erase(sorted_timers.begin() + x);
-                break;
-            }
-        }
+    pool_timers.erase(in_timerid);
+
+    // Leave the heap entry behind; it's skipped when it comes up
+    if ((*evtp)->heap_seq != 0)
+        heap_stale++;
 
-        delete itr->second;
-        timer_map.erase(itr);
+    delete *evtp;
+    timer_map.erase(in_timerid);
 
-        // Resort the list
-        stable_sort(sorted_timers.begin(), sorted_timers.end(), SortTimerEventsTrigger());
+    // Compact the heap when it's mostly dead entries
+    if (heap_stale > 64 && heap_stale > timer_heap.size() / 2) {
+        vector<timer_heap_rec> live;
 
-        return 1;
+        for (auto h : timer_heap) {
+            timer_event **e = timer_map.find(h.timer_id);
+
+            if (e != NULL && (*e)->heap_seq == h.seq)
+                live.push_back(h);
+        }
+
+        timer_heap.swap(live);
+        make_heap(timer_heap.begin(), timer_heap.end(), TimerHeapCompare());
+        heap_stale = 0;
     }
 
-    return -1;
+    return 1;
 }
 
@@ -32,8 +32,13 @@
 #include <pthread.h>
 
 #include <functional>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 
 #include "globalregistry.h"
+#include "kis_taskpool.h"
+#include "kis_flat_hash.h"
 
 // For ubertooth and a few older plugins that compile against both svn and old
 #define KIS_NEW_TIMER_PARM	1
@@ -55,6 +60,19 @@ public:
         struct timeval trigger_tm;
         int timeslices;
 
+        // Trigger time on the monotonic clock, which is what timers run on, so
+        // stepping the wall clock neither fires them early nor stalls them;
+        // explicit wall clock triggers are mapped to it when they're set
+        uint64_t trigger_mono_usec;
+
+        // Interval between recurring triggers, in microseconds; 0 for timers
+        // with an explicit trigger time
+        long interval_usec;
+
+        // Sequence number of this timer's live entry in the timer heap, or 0 if
+        // it's not in the heap (such as while it's executing)
+        uint64_t heap_seq;
+
         // Event is rescheduled again once it expires, if it's a timesliced event
         int recurring;
 
@@ -112,9 +130,26 @@ public:
     int RegisterTimer(int timeslices, struct timeval *in_trigger,
             int in_recurring, std::function<int (int)> event);
 
-    // Remove a timer that's going to execute
+    // Register an optionally recurring timer with microsecond resolution, for
+    // events which need to run more often than one timeslice
+    int RegisterTimerUsec(long in_interval_usec, int in_recurring,
+            std::function<int (int)> event);
+
+    // Register a timer whose event runs on a lane of the task pool instead of
+    // in the timer loop, for events which take long enough to hold up the
+    // other timers.  A trigger which comes while the last run is still going
+    // is skipped.  Without a task pool the event runs in the timer loop.
+    int RegisterPoolTimer(int in_timeslices, int in_recurring, kis_task_lane in_lane,
+            std::function<int (int)> event);
+
+    // Remove a timer that's going to execute; a pool timer which is running is
+    // waited for, unless it's removing itself
     int RemoveTimer(int timer_id);
 
+    // Shorten a select() timeout so that the main loop wakes up in time for the
+    // next timer
+    void ClampTimeout(struct timeval *in_tm);
+
 protected:
     GlobalRegistry *globalreg;
 
@@ -131,9 +166,56 @@ protected:
             int in_recurring, std::function<int (int)> event);
     int RemoveTimer_nb(int timer_id);
 
+    // Common setup of a new timer; computes the trigger time and inserts it
+    int InsertTimer_nb(timer_event *evt, long in_interval_usec, 
+            struct timeval *in_trigger, int in_recurring);
+    // Push a timer into the heap for its current trigger time
+    void PushTimer_nb(timer_event *evt);
+
     int next_timer_id;
-    map<int, timer_event *> timer_map;
-    vector<timer_event *> sorted_timers;
+    kis_u64_flat_map<timer_event *> timer_map;
+
+    // Timers waiting to run are kept in a min-heap on trigger time; removed
+    // timers leave stale heap entries behind, which are skipped when they reach
+    // the top or compacted away when they outnumber live timers
+    struct timer_heap_rec {
+        // Monotonic
+        uint64_t trigger_usec;
+        uint64_t seq;
+        int timer_id;
+    };
+
+    class TimerHeapCompare {
+    public:
+        inline bool operator() (const timer_heap_rec& x, const timer_heap_rec& y) const {
+            if (x.trigger_usec != y.trigger_usec)
+                return x.trigger_usec > y.trigger_usec;
+            return x.seq > y.seq;
+        }
+    };
+
+    vector<timer_heap_rec> timer_heap;
+    uint64_t next_heap_seq;
+    size_t heap_stale;
+
+    // Run state of a pool timer, shared with the task running it
+    struct pool_timer {
+        std::mutex mutex;
+        std::condition_variable cv;
+        bool running;
+        std::thread::id runner;
+        std::function<int (int)> event;
+    };
+
+    // Marks a pool timer finished once the last copy of its task goes away,
+    // whether or not the task got to run
+    struct pool_timer_run {
+        pool_timer_run(shared_ptr<pool_timer> in_state) : state(in_state) { }
+        ~pool_timer_run();
+        shared_ptr<pool_timer> state;
+    };
+
+    map<int, shared_ptr<pool_timer> > pool_timers;
 };
 
 class TimetrackerEvent {
@@ -275,8 +275,51 @@ void kis_historic_location::register_fields() {
     RegisterField("kis.historic.location.lat", TrackerDouble, "latitude", &lat);
     RegisterField("kis.historic.location.lon", TrackerDouble, "longitude", &lon);
     RegisterField("kis.historic.location.alt", TrackerDouble, "altitude (m)", &alt);
+    RegisterField("kis.historic.location.heading", TrackerDouble, "heading", &heading);
     RegisterField("kis.historic.location.speed", TrackerDouble, "speed (kph)", &speed);
     RegisterField("kis.historic.location.signal", TrackerInt32, "signal", &signal);
+    RegisterField("kis.historic.location.time_sec", TrackerUInt64, "time (unix ts)", &time_sec);
+}
+
+kis_gps_sample_ring::kis_gps_sample_ring() {
+    start = 0;
+
+    sum_lat = sum_lon = sum_alt = sum_heading = sum_speed = sum_signal = 0;
+    sum_num = 0;
+}
+
+bool kis_gps_sample_ring::add(const kis_gps_sample& in_sample, kis_gps_sample *ret_avg) {
+    if (samples.size() < ring_size) {
+        samples.push_back(in_sample);
+    } else {
+        samples[start] = in_sample;
+        start = (start + 1) % ring_size;
+    }
+
+    sum_lat += in_sample.lat;
+    sum_lon += in_sample.lon;
+    sum_alt += in_sample.alt;
+    sum_heading += in_sample.heading;
+    sum_speed += in_sample.speed;
+    sum_signal += in_sample.signal;
+    sum_num++;
+
+    if (sum_num < ring_size)
+        return false;
+
+    // The samples since the last average are exactly the ring
+    ret_avg->lat = sum_lat / sum_num;
+    ret_avg->lon = sum_lon / sum_num;
+    ret_avg->alt = sum_alt / sum_num;
+    ret_avg->heading = sum_heading / sum_num;
+    ret_avg->speed = sum_speed / sum_num;
+    ret_avg->signal = sum_signal / sum_num;
+    ret_avg->time_sec = in_sample.time_sec;
+
+    sum_lat = sum_lon = sum_alt = sum_heading = sum_speed = sum_signal = 0;
+    sum_num = 0;
+
+    return true;
 }
 
 kis_gps_history::kis_gps_history(GlobalRegistry *in_globalreg, 
@@ -304,93 +347,79 @@ void kis_gps_history::register_fields() {
             "last 10,000 historic GPS records, as averages of 100", &samples_10k);
     RegisterField("kis.gps.rrd.sampkes_1m", TrackerVector,
             "last 1,000,000 historic GPS records, as averages of 10,000", &samples_1m);
+
+    __RegisterComplexField(kis_historic_location, sample_entry_id,
+            "kis.gps.rrd.sample", "historic GPS record");
 }
 
 void kis_gps_history::reserve_fields(SharedTrackerElement e) {
     tracker_component::reserve_fields(e);
-
-    samples_100_vec = TrackerElementVector(samples_100);
-    samples_10k_vec = TrackerElementVector(samples_10k);
-    samples_1m_vec = TrackerElementVector(samples_1m);
-
-    samples_100_cascade = 0;
-    samples_10k_cascade = 0;
 }
 
-void kis_gps_history::add_sample(shared_ptr<kis_historic_location> in_sample) {
-    samples_100_vec.push_back(in_sample);
-    if (samples_100_vec.size() > 100) 
-        samples_100_vec.erase(samples_100_vec.begin());
+void kis_gps_history::add_sample(const kis_gps_sample& in_sample) {
+    kis_gps_sample avg100, avg10k;
 
-    samples_100_cascade++;
+    // Every 100 samples cascade up to our next bucket, and every 100 of those
+    // up again
+    if (!ring_100.add(in_sample, &avg100))
+        return;
 
-    // We've gotten 100 samples, cascade up to our next bucket
-    if (samples_100_cascade >= 100) {
-        double lat, lon, alt, heading, speed, signal;
+    if (!ring_10k.add(avg100, &avg10k))
+        return;
 
-        lat = lon = alt = heading = speed = signal = 0;
-
-        for (auto g : samples_100_vec) {
-            shared_ptr<kis_historic_location> gl =
-                static_pointer_cast<kis_historic_location>(g);
-
-            lat += gl->get_lat();
-            lon += gl->get_lon();
-            alt += gl->get_alt();
-            heading += gl->get_heading();
-            speed += gl->get_speed();
-            signal += gl->get_signal();
-        }
+    kis_gps_sample unused;
+    ring_1m.add(avg10k, &unused);
+}
 
-        shared_ptr<kis_historic_location> aggloc(new kis_historic_location(globalreg, 0));
+void kis_gps_history::add_sample(shared_ptr<kis_historic_location> in_sample) {
+    kis_gps_sample s;
 
-        aggloc->set_lat(lat / samples_100_vec.size());
-        aggloc->set_lon(lon / samples_100_vec.size());
-        aggloc->set_alt(alt / samples_100_vec.size());
-        aggloc->set_heading(heading / samples_100_vec.size());
-        aggloc->set_speed(speed / samples_100_vec.size());
-        aggloc->set_signal(signal / samples_100_vec.size());
+    s.lat = in_sample->get_lat();
+    s.lon = in_sample->get_lon();
+    s.alt = in_sample->get_alt();
+    s.heading = in_sample->get_heading();
+    s.speed = in_sample->get_speed();
+    s.signal = in_sample->get_signal();
+    s.time_sec = in_sample->get_time_sec();
 
-        samples_100_cascade = 0;
+    add_sample(s);
+}
 
-        samples_10k_vec.push_back(aggloc);
-        if (samples_10k_vec.size() > 100)
-            samples_10k_vec.erase(samples_10k_vec.begin());
+void kis_gps_history::fill_vector(SharedTrackerElement vec, 
+        const kis_gps_sample_ring& ring) {
+    vec->clear_vector();
 
-        samples_10k_cascade++;
+    for (size_t i = 0; i < ring.size(); i++) {
+        const kis_gps_sample& s = ring.at(i);
 
-        if (samples_10k_cascade >= 100) {
-            // If we've gotten 100 samples in the 10k bucket, cascade up again
-            lat = lon = alt = heading = speed = signal = 0;
+        shared_ptr<kis_historic_location> 
+            gl(new kis_historic_location(globalreg, sample_entry_id));
 
-            for (auto g : samples_10k_vec) {
-                shared_ptr<kis_historic_location> gl =
-                    static_pointer_cast<kis_historic_location>(g);
+        gl->set_lat(s.lat);
+        gl->set_lon(s.lon);
+        gl->set_alt(s.alt);
+        gl->set_heading(s.heading);
+        gl->set_speed(s.speed);
+        gl->set_signal(s.signal);
+        gl->set_time_sec(s.time_sec);
 
-                lat += gl->get_lat();
-                lon += gl->get_lon();
-                alt += gl->get_alt();
-                heading += gl->get_heading();
-                speed += gl->get_speed();
-                signal += gl->get_signal();
-            }
+        vec->add_vector(gl);
+    }
+}
 
-            shared_ptr<kis_historic_location> 
-                aggloc10(new kis_historic_location(globalreg, 0));
+void kis_gps_history::pre_serialize() {
+    tracker_component::pre_serialize();
 
-            aggloc10->set_lat(lat / samples_10k_vec.size());
-            aggloc10->set_lon(lon / samples_10k_vec.size());
-            aggloc10->set_alt(alt / samples_10k_vec.size());
-            aggloc10->set_heading(heading / samples_10k_vec.size());
-            aggloc10->set_speed(speed / samples_10k_vec.size());
-            aggloc10->set_signal(signal / samples_10k_vec.size());
+    fill_vector(samples_100, ring_100);
+    fill_vector(samples_10k, ring_10k);
+    fill_vector(samples_1m, ring_1m);
+}
 
-            samples_10k_cascade = 0;
+void kis_gps_history::post_serialize() {
+    tracker_component::post_serialize();
 
-            samples_1m_vec.push_back(aggloc10);
-            if (samples_1m_vec.size() > 100)
-                samples_1m_vec.erase(samples_1m_vec.begin());
-        }
-    }
+    samples_100->clear_vector();
+    samples_10k->clear_vector();
+    samples_1m->clear_vector();
 }
 
@@ -89,9 +89,9 @@ public:
     shared_ptr<kis_tracked_location_triplet> get_max_loc() { return max_loc; }
     shared_ptr<kis_tracked_location_triplet> get_avg_loc() { return avg_loc; }
 
-    __Proxy(agg_lat, uint64_t, uint64_t, uint64_t, avg_lat);
-    __Proxy(agg_lon, uint64_t, uint64_t, uint64_t, avg_lon);
-    __Proxy(agg_alt, uint64_t, uint64_t, uint64_t, avg_alt);
+    __Proxy(agg_lat, int64_t, int64_t, int64_t, avg_lat);
+    __Proxy(agg_lon, int64_t, int64_t, int64_t, avg_lon);
+    __Proxy(agg_alt, int64_t, int64_t, int64_t, avg_alt);
     __Proxy(num_agg, int64_t, int64_t, int64_t, num_avg);
     __Proxy(num_alt_agg, int64_t, int64_t, int64_t, num_alt_avg);
 
@@ -129,6 +129,7 @@ public:
     __Proxy(alt, double, double, double, alt);
     __Proxy(speed, double, double, double, speed);
     __Proxy(signal, int32_t, int32_t, int32_t, signal);
+    __Proxy(time_sec, uint64_t, time_t, time_t, time_sec);
 
 protected:
     virtual void register_fields();
@@ -138,9 +139,45 @@ protected:
     SharedTrackerElement signal;
 };
 
+// One sample of a location history
+struct kis_gps_sample {
+    double lat, lon, alt, heading, speed;
+    int32_t signal;
+    time_t time_sec;
+};
+
+// The last 100 samples of one precision, oldest first once it wraps, and the
+// running sums of the samples added since the last average
+class kis_gps_sample_ring {
+public:
+    kis_gps_sample_ring();
+
+    // Add a sample, replacing the oldest if full; every 100th sample the average
+    // of the last 100 is returned in ret_avg for the next precision
+    bool add(const kis_gps_sample& in_sample, kis_gps_sample *ret_avg);
+
+    size_t size() const { return samples.size(); }
+
+    // Samples in order, oldest first
+    const kis_gps_sample& at(size_t i) const {
+        return samples[(start + i) % samples.size()];
+    }
+
+    static const unsigned int ring_size = 100;
+
+protected:
+    // Grows to ring_size and then wraps at start
+    std::vector<kis_gps_sample> samples;
+    unsigned int start;
+
+    double sum_lat, sum_lon, sum_alt, sum_heading, sum_speed, sum_signal;
+    unsigned int sum_num;
+};
+
 // RRD-style historic location cloud of cascading precision
 // Collects a historical record about a device and then averages them to the next level
-// of precision
+// of precision.  Samples are kept packed and only turned into tracked elements
+// while serializing
 class kis_gps_history : public tracker_component { 
 public:
     kis_gps_history(GlobalRegistry *in_globalreg, int in_id);
@@ -148,23 +185,27 @@ public:
 
     virtual SharedTrackerElement clone_type();
 
+    void add_sample(const kis_gps_sample& in_sample);
     void add_sample(shared_ptr<kis_historic_location> in_sample);
 
+    virtual void pre_serialize();
+    virtual void post_serialize();
+
 protected:
     virtual void register_fields();
     virtual void reserve_fields(SharedTrackerElement e);
 
+    void fill_vector(SharedTrackerElement vec, const kis_gps_sample_ring& ring);
+
     SharedTrackerElement samples_100;
     SharedTrackerElement samples_10k;
     SharedTrackerElement samples_1m;
 
-    unsigned int samples_100_cascade;
-    unsigned int samples_10k_cascade;
-
-    TrackerElementVector samples_100_vec;
-    TrackerElementVector samples_10k_vec;
-    TrackerElementVector samples_1m_vec;
+    int sample_entry_id;
 
+    kis_gps_sample_ring ring_100;
+    kis_gps_sample_ring ring_10k;
+    kis_gps_sample_ring ring_1m;
 };
 
 #endif
@@ -53,16 +53,14 @@ public:
         return a + b;
     }
 
-    // Combine a vector for a higher-level record (seconds to minutes, minutes to 
+    // Combine a bucket for a higher-level record (seconds to minutes, minutes to 
     // hours, and so on).
-    static int64_t combine_vector(shared_ptr<TrackerElement> e) {
-        TrackerElementVector v(e);
-
+    static int64_t combine_vector(const int64_t *v, size_t n) {
         int64_t avg = 0;
-        for (TrackerElementVector::iterator i = v.begin(); i != v.end(); ++i) 
-            avg += GetTrackerValue<int64_t>(*i);
+        for (size_t i = 0; i < n; i++) 
+            avg += v[i];
 
-        return avg / v.size();
+        return avg / (int64_t) n;
     }
 
     // Default 'empty' value
@@ -75,6 +73,13 @@ public:
     }
 };
 
+// RRD values are kept in plain arrays instead of a tracked element per slot;
+// the minute, hour, and day vectors are only filled in for the duration of
+// serialization.  A RRD which has only ever seen one sample doesn't allocate
+// the arrays at all, which is the common case for devices seen once.
+//
+// Values imported from a record (such as a saved device) are moved into the
+// arrays when the RRD is built.
 template <class Aggregator = kis_tracked_rrd_default_aggregator>
 class kis_tracked_rrd : public tracker_component {
 public:
@@ -114,14 +119,148 @@ public:
 
     // Add a sample.  Use combinator function 'c' to derive the new sample value
     void add_sample(int64_t in_s, time_t in_time) {
+        time_t ltime = get_last_time();
+
+        if (in_time < ltime) {
+            // printf("debug - rrd - timewarp to the past?  discard\n");
+            return;
+        }
+
+        if (values.size() == 0) {
+            // Hold on to the first sample, it's all a device seen once has
+            if (!have_sample) {
+                have_sample = true;
+                first_sample = in_s;
+                set_last_time(in_time);
+                return;
+            }
+
+            build_values(values);
+        }
+
+        apply_sample(&(values[0]), ltime, in_s, in_time);
+
+        set_last_time(in_time);
+    }
+
+    // Sum of the samples of the last in_sec seconds (at most a minute) up to 
+    // in_now, without fast-forwarding the record
+    int64_t get_recent_sum(time_t in_now, unsigned int in_sec) {
+        time_t ltime = get_last_time();
+        int64_t sum = 0;
+
+        if (!have_sample)
+            return 0;
+
+        if (in_sec > 60)
+            in_sec = 60;
+
+        for (time_t t = in_now - in_sec + 1; t <= in_now; t++) {
+            // Seconds after the last sample are empty, and the minute only holds
+            // the seconds of the last minute
+            if (t > ltime || ltime - t >= 60)
+                continue;
+
+            if (values.size() == 0) {
+                if (t == ltime)
+                    sum += first_sample;
+                continue;
+            }
+
+            sum += values[RRD_MINUTE + (t % 60)];
+        }
+
+        return sum;
+    }
+
+    virtual void pre_serialize() {
+        tracker_component::pre_serialize();
         Aggregator agg;
 
+        // printf("debug - rrd - preserialize\n");
+        // Update the averages
+        if (update_first) {
+            add_sample(agg.default_val(), globalreg->timestamp.tv_sec);
+        }
+
+        vector<int64_t> v;
+
+        if (values.size() != 0)
+            v = values;
+        else
+            build_values(v);
+
+        fill_vector(minute_vec, second_entry_id, &(v[RRD_MINUTE]), 60);
+        fill_vector(hour_vec, minute_entry_id, &(v[RRD_HOUR]), 60);
+        fill_vector(day_vec, hour_entry_id, &(v[RRD_DAY]), 24);
+    }
+
+    virtual void post_serialize() {
+        tracker_component::post_serialize();
+
+        minute_vec->clear_vector();
+        hour_vec->clear_vector();
+        day_vec->clear_vector();
+    }
+
+protected:
+    // Offsets of each period in the value array
+    enum {
+        RRD_MINUTE = 0,
+        RRD_HOUR = 60,
+        RRD_DAY = 120,
+        RRD_SIZE = 144
+    };
+
+    // Build the full value array for the samples seen so far
+    void build_values(vector<int64_t>& ret_values) {
+        if (!have_sample) {
+            ret_values.assign(RRD_SIZE, 0);
+            return;
+        }
+
+        Aggregator agg;
+        ret_values.assign(RRD_SIZE, agg.default_val());
+
+        // The first sample is always more than a day after the epoch, so this
+        // resets every period around it
+        apply_sample(&(ret_values[0]), 0, first_sample, get_last_time());
+    }
+
+    void fill_vector(SharedTrackerElement vec, int entry_id, const int64_t *v, 
+            size_t n) {
+        vec->clear_vector();
+
+        for (size_t x = 0; x < n; x++) {
+            SharedTrackerElement e(new TrackerElement(TrackerInt64, entry_id));
+            e->set(v[x]);
+            vec->add_vector(e);
+        }
+    }
+
+    static void fill_values(int64_t *v, size_t n, int skip, int64_t skip_val) {
+        Aggregator agg;
+
+        for (size_t x = 0; x < n; x++) {
+            if ((int) x == skip)
+                v[x] = skip_val;
+            else
+                v[x] = agg.default_val();
+        }
+    }
+
+    // Apply a sample to the value array, given the time of the last sample
+    void apply_sample(int64_t *v, time_t ltime, int64_t in_s, time_t in_time) {
+        Aggregator agg;
+
+        int64_t *minute = v + RRD_MINUTE;
+        int64_t *hour = v + RRD_HOUR;
+        int64_t *day = v + RRD_DAY;
+
         int sec_bucket = in_time % 60;
         int min_bucket = (in_time / 60) % 60;
         int hour_bucket = (in_time / 3600) % 24;
 
-        time_t ltime = get_last_time();
-
         // The second slot for the last time
         int last_sec_bucket = ltime % 60;
         // The minute of the hour the last known data would go in
@@ -129,49 +268,21 @@ public:
         // The hour of the day the last known data would go in
         int last_hour_bucket = (ltime / 3600) % 24;
 
-        if (in_time < ltime) {
-            // printf("debug - rrd - timewarp to the past?  discard\n");
-            return;
-        }
-        
-        shared_ptr<TrackerElement> e;
-
         // If we haven't seen data in a day, we reset everything because
         // none of it is valid.  This is the simplest case.
         if (in_time - ltime > (60 * 60 * 24)) {
             // Directly fill in this second, clear rest of the minute
-            TrackerElementVector mv(minute_vec);
-            for (TrackerElementVector::iterator i = mv.begin(); i != mv.end(); ++i) {
-                if (i - mv.begin() == sec_bucket)
-                    (*i)->set(in_s);
-                else
-                    (*i)->set((int64_t) agg.default_val());
-            }
+            fill_values(minute, 60, sec_bucket, in_s);
 
             // Reset the last hour, setting it to a single sample
             // Get the combined value for the minute
-            int64_t min_val = agg.combine_vector(minute_vec);
-            TrackerElementVector hv = TrackerElementVector(hour_vec);
-            for (TrackerElementVector::iterator i = hv.begin(); i != hv.end(); ++i) {
-                if (i - hv.begin() == min_bucket)
-                    (*i)->set(min_val);
-                else
-                    (*i)->set((int64_t) agg.default_val());
-            }
+            int64_t min_val = agg.combine_vector(minute, 60);
+            fill_values(hour, 60, min_bucket, min_val);
 
             // Reset the last day, setting it to a single sample
-            int64_t hr_val = agg.combine_vector(hour_vec);
-            TrackerElementVector dv = TrackerElementVector(day_vec);
-            for (TrackerElementVector::iterator i = dv.begin(); i != dv.end(); ++i) {
-                if (i - dv.begin() == hour_bucket)
-                    (*i)->set(hr_val);
-                else
-                    (*i)->set((int64_t) agg.default_val());
-            }
-
-            set_last_time(in_time);
+            int64_t hr_val = agg.combine_vector(hour, 60);
+            fill_values(day, 24, hour_bucket, hr_val);
 
-            return;
         } else if (in_time - ltime > (60*60)) {
             // printf("debug - rrd - been an hour since last value\n");
             // If we haven't seen data in an hour but we're still w/in the day:
@@ -184,36 +295,20 @@ public:
 
             // We only have this entry in the minute, so set it and get the 
             // combined value
-            
-            TrackerElementVector mv(minute_vec);
-            for (TrackerElementVector::iterator i = mv.begin(); i != mv.end(); ++i) {
-                if (i - mv.begin() == sec_bucket)
-                    (*i)->set(in_s);
-                else
-                    (*i)->set((int64_t) agg.default_val());
-            }
-            sec_avg = agg.combine_vector(minute_vec);
+            fill_values(minute, 60, sec_bucket, in_s);
+            sec_avg = agg.combine_vector(minute, 60);
 
             // We haven't seen anything in this hour, so clear it, set the minute
             // and get the aggregate
-            TrackerElementVector hv = TrackerElementVector(hour_vec);
-            for (TrackerElementVector::iterator i = hv.begin(); i != hv.end(); ++i) {
-                if (i - hv.begin() == min_bucket)
-                    (*i)->set(sec_avg);
-                else
-                    (*i)->set((int64_t) agg.default_val());
-            }
-            min_avg = agg.combine_vector(hour_vec);
+            fill_values(hour, 60, min_bucket, sec_avg);
+            min_avg = agg.combine_vector(hour, 60);
 
             // Fill the hours between the last time we saw data and now with
             // zeroes; fastforward time
-            for (int h = 0; h < hours_different(last_hour_bucket + 1, hour_bucket); h++) {
-                e = hour_vec->get_vector_value((last_hour_bucket + 1 + h) % 24);
-                e->set((int64_t) agg.default_val());
-            }
+            for (int h = 0; h < hours_different(last_hour_bucket + 1, hour_bucket); h++)
+                day[(last_hour_bucket + 1 + h) % 24] = agg.default_val();
 
-            e = day_vec->get_vector_value(hour_bucket);
-            e->set(min_avg);
+            day[hour_bucket] = min_avg;
 
         } else if (in_time - ltime > 60) {
             // - Calculate the average seconds
@@ -225,31 +320,21 @@ public:
 
             int64_t sec_avg = 0, min_avg = 0;
 
-            TrackerElementVector mv(minute_vec);
-            for (TrackerElementVector::iterator i = mv.begin(); i != mv.end(); ++i) {
-                if (i - mv.begin() == sec_bucket)
-                    (*i)->set(in_s);
-                else
-                    (*i)->set((int64_t) agg.default_val());
-            }
-            sec_avg = agg.combine_vector(minute_vec);
+            fill_values(minute, 60, sec_bucket, in_s);
+            sec_avg = agg.combine_vector(minute, 60);
 
             // Zero between last and current
             for (int m = 0; 
-                    m < minutes_different(last_min_bucket + 1, min_bucket); m++) {
-                e = hour_vec->get_vector_value((last_min_bucket + 1 + m) % 60);
-                e->set((int64_t) agg.default_val());
-            }
+                    m < minutes_different(last_min_bucket + 1, min_bucket); m++)
+                hour[(last_min_bucket + 1 + m) % 60] = agg.default_val();
 
             // Set the updated value
-            e = hour_vec->get_vector_value(min_bucket);
-            e->set((int64_t) sec_avg);
+            hour[min_bucket] = sec_avg;
 
-            min_avg = agg.combine_vector(hour_vec);
+            min_avg = agg.combine_vector(hour, 60);
 
             // Reset the hour
-            e = day_vec->get_vector_value(hour_bucket);
-            e->set(min_avg);
+            day[hour_bucket] = min_avg;
 
         } else {
             // printf("debug - rrd - w/in the last minute %d seconds\n", in_time - last_time);
@@ -259,50 +344,30 @@ public:
             // Otherwise, fast-forward seconds with zero data, then propagate the
             // changes up
             if (in_time == ltime) {
-                e = minute_vec->get_vector_value(sec_bucket);
-                e->set(agg.combine_element(GetTrackerValue<int64_t>(e), in_s));
+                minute[sec_bucket] = agg.combine_element(minute[sec_bucket], in_s);
             } else {
                 for (int s = 0; 
-                        s < minutes_different(last_sec_bucket + 1, sec_bucket); s++) {
-                    e = minute_vec->get_vector_value((last_sec_bucket + 1 + s) % 60);
-                    e->set((int64_t) agg.default_val());
-                }
+                        s < minutes_different(last_sec_bucket + 1, sec_bucket); s++)
+                    minute[(last_sec_bucket + 1 + s) % 60] = agg.default_val();
 
-                e = minute_vec->get_vector_value(sec_bucket);
-                e->set((int64_t) in_s);
+                minute[sec_bucket] = in_s;
             }
 
             // Update all the averages
             int64_t sec_avg = 0, min_avg = 0;
 
-            sec_avg = agg.combine_vector(minute_vec);
+            sec_avg = agg.combine_vector(minute, 60);
 
             // Set the minute
-            e = hour_vec->get_vector_value(min_bucket);
-            e->set(sec_avg);
+            hour[min_bucket] = sec_avg;
 
-            min_avg = agg.combine_vector(hour_vec);
+            min_avg = agg.combine_vector(hour, 60);
 
             // Set the hour
-            e = day_vec->get_vector_value(hour_bucket);
-            e->set(min_avg);
+            day[hour_bucket] = min_avg;
         }
-
-        set_last_time(in_time);
     }
 
-    virtual void pre_serialize() {
-        tracker_component::pre_serialize();
-        Aggregator agg;
-
-        // printf("debug - rrd - preserialize\n");
-        // Update the averages
-        if (update_first) {
-            add_sample(agg.default_val(), globalreg->timestamp.tv_sec);
-        }
-    }
-
-protected:
     inline int minutes_different(int m1, int m2) const {
         if (m1 == m2) {
             return 0;
@@ -366,31 +431,33 @@ protected:
     virtual void reserve_fields(shared_ptr<TrackerElement> e) {
         tracker_component::reserve_fields(e);
 
-        // Build slots for all the times
-        int x;
-        if ((x = minute_vec->get_vector()->size()) != 60) {
-            for ( ; x < 60; x++) {
-                SharedTrackerElement me(new TrackerElement(TrackerInt64, 
-                            second_entry_id));
-                minute_vec->add_vector(me);
-            }
-        }
+        have_sample = false;
+        first_sample = 0;
 
-        if ((x = hour_vec->get_vector()->size()) != 60) {
-            for ( ; x < 60; x++) {
-                SharedTrackerElement he(new TrackerElement(TrackerInt64, 
-                            minute_entry_id));
-                hour_vec->add_vector(he);
-            }
-        }
+        // Move imported values into the arrays
+        if (minute_vec->get_vector()->size() == 60 &&
+                hour_vec->get_vector()->size() == 60 &&
+                day_vec->get_vector()->size() == 24) {
+            values.resize(RRD_SIZE);
 
-        if ((x = day_vec->get_vector()->size()) != 24) {
-            for ( ; x < 24; x++) {
-                SharedTrackerElement he(new TrackerElement(TrackerInt64, hour_entry_id));
-                day_vec->add_vector(he);
+            for (int x = 0; x < 60; x++) {
+                values[RRD_MINUTE + x] = 
+                    GetTrackerValue<int64_t>(minute_vec->get_vector_value(x));
+                values[RRD_HOUR + x] = 
+                    GetTrackerValue<int64_t>(hour_vec->get_vector_value(x));
             }
+
+            for (int x = 0; x < 24; x++)
+                values[RRD_DAY + x] = 
+                    GetTrackerValue<int64_t>(day_vec->get_vector_value(x));
+
+            have_sample = true;
         }
 
+        minute_vec->clear_vector();
+        hour_vec->clear_vector();
+        day_vec->clear_vector();
+
         Aggregator agg;
         (*blank_val).set(agg.default_val());
         (*aggregator_name).set(agg.name());
@@ -409,12 +476,23 @@ protected:
     int hour_entry_id;
 
     bool update_first;
+
+    // Minute, hour, and day values; empty until the second sample
+    vector<int64_t> values;
+
+    // The only sample seen, until the values are built
+    bool have_sample;
+    int64_t first_sample;
 };
 
 // Easier to make this it's own class since for a single-minute RRD the logic is
 // far simpler.  In a perfect would this would be derived from the common
 // RRD (or the other way around) but until it becomes a problem that's a
 // task for another day.
+//
+// Like the full RRD, values are kept in a plain array which is only allocated
+// once there is more than one sample, and the minute vector is only filled in
+// for serialization.
 template <class Aggregator = kis_tracked_rrd_default_aggregator >
 class kis_tracked_minute_rrd : public tracker_component {
 public:
@@ -452,47 +530,24 @@ public:
     __Proxy(last_time, uint64_t, time_t, time_t, last_time);
 
     void add_sample(int64_t in_s, time_t in_time) {
-        Aggregator agg;
-
-        int sec_bucket = in_time % 60;
-
         time_t ltime = get_last_time();
 
-        // The second slot for the last time
-        int last_sec_bucket = ltime % 60;
-
         if (in_time < ltime) {
             return;
         }
-        
-        SharedTrackerElement e;
 
-        // If we haven't seen data in a minute, wipe
-        if (in_time - ltime > 60) {
-            for (int x = 0; x < 60; x++) {
-                e = minute_vec->get_vector_value(x);
-                e->set((int64_t) agg.default_val());
+        if (values.size() == 0) {
+            if (!have_sample) {
+                have_sample = true;
+                first_sample = in_s;
+                set_last_time(in_time);
+                return;
             }
-        } else {
-            // If in_time == last_time then we're updating an existing record, so
-            // add that in.
-            // Otherwise, fast-forward seconds with zero data, average the seconds,
-            // and propagate the averages up
-            if (in_time == ltime) {
-                e = minute_vec->get_vector_value(sec_bucket);
-                e->set(agg.combine_element(GetTrackerValue<int64_t>(e), in_s));
-            } else {
-                for (int s = 0; 
-                        s < minutes_different(last_sec_bucket + 1, sec_bucket); s++) {
-                    e = minute_vec->get_vector_value((last_sec_bucket + 1 + s) % 60);
-                    e->set((int64_t) agg.default_val());
-                }
 
-                e = minute_vec->get_vector_value(sec_bucket);
-                e->set((int64_t) in_s);
-            }
+            build_values(values);
         }
 
+        apply_sample(&(values[0]), ltime, in_s, in_time);
 
         set_last_time(in_time);
     }
@@ -504,9 +559,72 @@ public:
         if (update_first) {
             add_sample(agg.default_val(), globalreg->timestamp.tv_sec);
         }
+
+        vector<int64_t> v;
+
+        if (values.size() != 0)
+            v = values;
+        else
+            build_values(v);
+
+        minute_vec->clear_vector();
+
+        for (int x = 0; x < 60; x++) {
+            SharedTrackerElement e(new TrackerElement(TrackerInt64, second_entry_id));
+            e->set(v[x]);
+            minute_vec->add_vector(e);
+        }
+    }
+
+    virtual void post_serialize() {
+        tracker_component::post_serialize();
+
+        minute_vec->clear_vector();
     }
 
 protected:
+    // Build the value array for the samples seen so far
+    void build_values(vector<int64_t>& ret_values) {
+        ret_values.assign(60, 0);
+
+        if (!have_sample)
+            return;
+
+        // The first sample is always more than a minute after the epoch, so 
+        // this wipes the minute around it
+        apply_sample(&(ret_values[0]), 0, first_sample, get_last_time());
+    }
+
+    // Apply a sample to the value array, given the time of the last sample
+    void apply_sample(int64_t *v, time_t ltime, int64_t in_s, time_t in_time) {
+        Aggregator agg;
+
+        int sec_bucket = in_time % 60;
+
+        // The second slot for the last time
+        int last_sec_bucket = ltime % 60;
+
+        // If we haven't seen data in a minute, wipe
+        if (in_time - ltime > 60) {
+            for (int x = 0; x < 60; x++)
+                v[x] = agg.default_val();
+        } else {
+            // If in_time == last_time then we're updating an existing record, so
+            // add that in.
+            // Otherwise, fast-forward seconds with zero data, average the seconds,
+            // and propagate the averages up
+            if (in_time == ltime) {
+                v[sec_bucket] = agg.combine_element(v[sec_bucket], in_s);
+            } else {
+                for (int s = 0; 
+                        s < minutes_different(last_sec_bucket + 1, sec_bucket); s++)
+                    v[(last_sec_bucket + 1 + s) % 60] = agg.default_val();
+
+                v[sec_bucket] = in_s;
+            }
+        }
+    }
+
     inline int minutes_different(int m1, int m2) const {
         if (m1 == m2) {
             return 0;
@@ -541,16 +659,21 @@ protected:
 
         set_last_time(0);
 
-        // Build slots for all the times
-        int x;
-        if ((x = minute_vec->get_vector()->size()) != 60) {
-            for ( ; x < 60; x++) {
-                SharedTrackerElement me(new TrackerElement(TrackerInt64, 
-                            second_entry_id));
-                minute_vec->add_vector(me);
-            }
+        have_sample = false;
+        first_sample = 0;
+
+        // Move imported values into the array
+        if (minute_vec->get_vector()->size() == 60) {
+            values.resize(60);
+
+            for (int x = 0; x < 60; x++)
+                values[x] = GetTrackerValue<int64_t>(minute_vec->get_vector_value(x));
+
+            have_sample = true;
         }
 
+        minute_vec->clear_vector();
+
         Aggregator agg;
         (*blank_val).set(agg.default_val());
         (*aggregator_name).set(agg.name());
@@ -564,6 +687,13 @@ protected:
     int second_entry_id;
 
     bool update_first;
+
+    // Second values; empty until the second sample
+    vector<int64_t> values;
+
+    // The only sample seen, until the values are built
+    bool have_sample;
+    int64_t first_sample;
 };
 
 // Signal level RRD, peak selector on overlap, averages signal but ignores
@@ -577,20 +707,15 @@ public:
         return a;
     }
 
-    // Select the strongest signal of the bucket
-    static int64_t combine_vector(SharedTrackerElement e) {
-        TrackerElementVector v(e);
-
+    // Average the signals of the bucket, skipping empty slots.  Empty slots
+    // are 0 and add nothing to the sum, so only the count needs to skip them;
+    // with no branch in the loop the rollup vectorizes.
+    static int64_t combine_vector(const int64_t *v, size_t n) {
         int64_t avg = 0, avgc = 0;
 
-        for (TrackerElementVector::iterator i = v.begin(); i != v.end(); ++i) {
-            int64_t v = GetTrackerValue<int64_t>(*i);
-
-            if (v == 0)
-                continue;
-
-            avg += v;
-            avgc++;
+        for (size_t i = 0; i < n; i++) {
+            avg += v[i];
+            avgc += (v[i] != 0);
         }
 
         if (avgc == 0)
@@ -600,11 +725,9 @@ public:
 
 #if 0
         int64_t max = 0;
-        for (TrackerElementVector::iterator i = v.begin(); i != v.end(); ++i) {
-            int64_t v = GetTrackerValue<int64_t>(*i);
-
-            if (max == 0 || max < v)
-                max = v;
+        for (size_t i = 0; i < n; i++) {
+            if (max == 0 || max < v[i])
+                max = v[i];
         }
 
         return max;
@@ -626,38 +749,33 @@ public:
 // selects the lowest
 class kis_tracked_rrd_extreme_aggregator {
 public:
-    // Select the most extreme value
+    // Select the most extreme value; the largest when both are positive, the
+    // smallest otherwise, and an empty (0) value never wins.  Computed without
+    // branches, since every sample of a busy device goes through here.
     static int64_t combine_element(const int64_t a, const int64_t b) {
-        if (a < 0 && b < 0) {
-            if (a < b)
-                return a;
+        int64_t lo = a < b ? a : b;
+        int64_t hi = a < b ? b : a;
 
-            return b;
-        } else if (a > 0 && b > 0) {
-            if (a > b)
-                return a;
+        int64_t both_pos = -(int64_t) ((a > 0) & (b > 0));
+        int64_t pick = (hi & both_pos) | (lo & ~both_pos);
 
-            return b;
-        } else if (a == 0) {
-            return b;
-        } else if (b == 0) {
-            return a;
-        } else if (a < b) {
-            return a;
-        }
+        // One side empty takes the other
+        int64_t a_empty = -(int64_t) (a == 0);
+        int64_t b_empty = -(int64_t) (b == 0);
 
-        return b;
+        pick = (b & a_empty) | (pick & ~a_empty);
+        pick = (a & b_empty & ~a_empty) | (pick & ~(b_empty & ~a_empty));
+
+        return pick;
     }
 
     // Simple average
-    static int64_t combine_vector(SharedTrackerElement e) {
-        TrackerElementVector v(e);
-
+    static int64_t combine_vector(const int64_t *v, size_t n) {
         int64_t avg = 0;
-        for (TrackerElementVector::iterator i = v.begin(); i != v.end(); ++i) 
-            avg += GetTrackerValue<int64_t>(*i);
+        for (size_t i = 0; i < n; i++) 
+            avg += v[i];
 
-        return avg / v.size();
+        return avg / (int64_t) n;
     }
 
     // Default 'empty' value, no legit signal would be 0
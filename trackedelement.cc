@@ -29,11 +29,101 @@
 
 #include "alphanum.hpp"
 
+std::atomic<bool> TrackerElementAccounting::enabled(false);
+
+static std::atomic<int64_t> *accounting_counts = NULL;
+static std::atomic<int64_t> *accounting_bytes = NULL;
+
+void TrackerElementAccounting::Enable() {
+    if (enabled)
+        return;
+
+    accounting_counts = new std::atomic<int64_t>[TRACKER_ACCOUNTING_MAX_FIELDS];
+    accounting_bytes = new std::atomic<int64_t>[TRACKER_ACCOUNTING_MAX_FIELDS];
+
+    for (unsigned int x = 0; x < TRACKER_ACCOUNTING_MAX_FIELDS; x++) {
+        accounting_counts[x] = 0;
+        accounting_bytes[x] = 0;
+    }
+
+    enabled = true;
+}
+
+void TrackerElementAccounting::Account(int in_id, TrackerType in_type, int in_delta) {
+    if (in_id < 0)
+        return;
+
+    if (in_id >= TRACKER_ACCOUNTING_MAX_FIELDS)
+        in_id = 0;
+
+    // The element and a make_shared control block
+    int64_t sz = sizeof(TrackerElement) + 16;
+
+    switch (in_type) {
+        case TrackerString:
+            sz += sizeof(kis_string_rec);
+            break;
+        case TrackerMac:
+            sz += sizeof(mac_addr);
+            break;
+        case TrackerUuid:
+            sz += sizeof(uuid);
+            break;
+        case TrackerVector:
+            sz += sizeof(TrackerElement::tracked_vector);
+            break;
+        case TrackerMap:
+            sz += sizeof(TrackerElement::tracked_map);
+            break;
+        case TrackerIntMap:
+            sz += sizeof(TrackerElement::tracked_int_map);
+            break;
+        case TrackerMacMap:
+            sz += sizeof(TrackerElement::tracked_mac_map);
+            break;
+        case TrackerStringMap:
+            sz += sizeof(TrackerElement::tracked_string_map);
+            break;
+        case TrackerDoubleMap:
+            sz += sizeof(TrackerElement::tracked_double_map);
+            break;
+        case TrackerSmallIntMap:
+            sz += sizeof(TrackerElement::tracked_small_int_map);
+            break;
+        case TrackerSmallDoubleMap:
+            sz += sizeof(TrackerElement::tracked_small_double_map);
+            break;
+        case TrackerByteArray:
+            sz += sizeof(shared_ptr<uint8_t>);
+            break;
+        default:
+            break;
+    }
+
+    accounting_counts[in_id].fetch_add(in_delta, std::memory_order_relaxed);
+    accounting_bytes[in_id].fetch_add(in_delta * sz, std::memory_order_relaxed);
+}
+
+int64_t TrackerElementAccounting::FetchCount(int in_id) {
+    if (!enabled || in_id < 0 || in_id >= TRACKER_ACCOUNTING_MAX_FIELDS)
+        return 0;
+
+    return accounting_counts[in_id];
+}
+
+int64_t TrackerElementAccounting::FetchBytes(int in_id) {
+    if (!enabled || in_id < 0 || in_id >= TRACKER_ACCOUNTING_MAX_FIELDS)
+        return 0;
+
+    return accounting_bytes[in_id];
+}
+
 void TrackerElement::Initialize() {
     this->type = TrackerUnassigned;
-    reference_count = 0;
+    local_name = NULL;
+    bytearray_value_len = 0;
 
-    set_id(-1);
+    tracked_id = -1;
 
     // Redundant I guess
     dataunion.string_value = NULL;
@@ -57,6 +147,8 @@ void TrackerElement::Initialize() {
     dataunion.submacmap_value = NULL;
     dataunion.substringmap_value = NULL;
     dataunion.subdoublemap_value = NULL;
+    dataunion.subsmallintmap_value = NULL;
+    dataunion.subsmalldoublemap_value = NULL;
     dataunion.subvector_value = NULL;
     dataunion.custom_value = NULL;
     dataunion.bytearray_value = NULL;
@@ -76,6 +168,11 @@ TrackerElement::TrackerElement(TrackerType type, int id) {
 }
 
 TrackerElement::~TrackerElement() {
+    if (TrackerElementAccounting::IsEnabled())
+        TrackerElementAccounting::Account(tracked_id, type, -1);
+
+    delete local_name;
+
     // If we contain references to other things, unlink them.  This may cause them to
     // auto-delete themselves.
     if (type == TrackerVector) {
@@ -90,8 +187,12 @@ TrackerElement::~TrackerElement() {
         delete dataunion.substringmap_value;
     } else if (type == TrackerDoubleMap) {
         delete dataunion.subdoublemap_value;
+    } else if (type == TrackerSmallIntMap) {
+        delete dataunion.subsmallintmap_value;
+    } else if (type == TrackerSmallDoubleMap) {
+        delete dataunion.subsmalldoublemap_value;
     } else if (type == TrackerString) {
-        delete(dataunion.string_value);
+        kis_string_intern::release(dataunion.string_value);
     } else if (type == TrackerMac) {
         delete(dataunion.mac_value);
     } else if (type == TrackerUuid) {
@@ -124,6 +225,13 @@ void TrackerElement::set_type(TrackerType in_type) {
     } else if (type == TrackerDoubleMap && dataunion.subdoublemap_value != NULL) {
         delete(dataunion.subdoublemap_value);
         dataunion.subdoublemap_value = NULL;
+    } else if (type == TrackerSmallIntMap && dataunion.subsmallintmap_value != NULL) {
+        delete(dataunion.subsmallintmap_value);
+        dataunion.subsmallintmap_value = NULL;
+    } else if (type == TrackerSmallDoubleMap && 
+            dataunion.subsmalldoublemap_value != NULL) {
+        delete(dataunion.subsmalldoublemap_value);
+        dataunion.subsmalldoublemap_value = NULL;
     } else if (type == TrackerMac && dataunion.mac_value != NULL) {
         delete(dataunion.mac_value);
         dataunion.mac_value = NULL;
@@ -131,7 +239,7 @@ void TrackerElement::set_type(TrackerType in_type) {
         delete(dataunion.uuid_value);
         dataunion.uuid_value = NULL;
     } else if (type == TrackerString && dataunion.string_value != NULL) {
-        delete(dataunion.string_value);
+        kis_string_intern::release(dataunion.string_value);
         dataunion.string_value = NULL;
     } else if (type == TrackerByteArray && dataunion.bytearray_value != NULL) {
         delete(dataunion.bytearray_value);
@@ -139,6 +247,11 @@ void TrackerElement::set_type(TrackerType in_type) {
         bytearray_value_len = 0;
     }
 
+    if (TrackerElementAccounting::IsEnabled()) {
+        TrackerElementAccounting::Account(tracked_id, type, -1);
+        TrackerElementAccounting::Account(tracked_id, in_type, 1);
+    }
+
     this->type = in_type;
 
     if (type == TrackerVector) {
@@ -153,12 +266,16 @@ void TrackerElement::set_type(TrackerType in_type) {
         dataunion.substringmap_value = new tracked_string_map();
     } else if (type == TrackerDoubleMap) {
         dataunion.subdoublemap_value = new tracked_double_map();
+    } else if (type == TrackerSmallIntMap) {
+        dataunion.subsmallintmap_value = new tracked_small_int_map();
+    } else if (type == TrackerSmallDoubleMap) {
+        dataunion.subsmalldoublemap_value = new tracked_small_double_map();
     } else if (type == TrackerMac) {
         dataunion.mac_value = new mac_addr(0);
     } else if (type == TrackerUuid) {
         dataunion.uuid_value = new uuid();
     } else if (type == TrackerString) {
-        dataunion.string_value = new string();
+        dataunion.string_value = new kis_string_rec();
     } else if (type == TrackerByteArray) {
         dataunion.bytearray_value = new shared_ptr<uint8_t>();
         bytearray_value_len = 0;
@@ -709,7 +826,7 @@ TrackerElement::mac_map_iterator TrackerElement::mac_find(mac_addr k) {
 void TrackerElement::add_macmap(mac_addr i, shared_ptr<TrackerElement> s) {
     except_type_mismatch(TrackerMacMap);
 
-    (*dataunion.submacmap_value)[i] = s;
+    (*dataunion.submacmap_value)[i] = std::move(s);
 }
 
 void TrackerElement::del_macmap(mac_addr f) {
@@ -778,7 +895,7 @@ TrackerElement::string_map_iterator TrackerElement::string_find(string k) {
 void TrackerElement::add_stringmap(string i, shared_ptr<TrackerElement> s) {
     except_type_mismatch(TrackerStringMap);
 
-    (*dataunion.substringmap_value)[i] = s;
+    (*dataunion.substringmap_value)[i] = std::move(s);
 }
 
 void TrackerElement::del_stringmap(string f) {
@@ -847,7 +964,7 @@ TrackerElement::double_map_iterator TrackerElement::double_find(double k) {
 void TrackerElement::add_doublemap(double i, shared_ptr<TrackerElement> s) {
     except_type_mismatch(TrackerDoubleMap);
 
-    (*dataunion.subdoublemap_value)[i] = s;
+    (*dataunion.subdoublemap_value)[i] = std::move(s);
 }
 
 void TrackerElement::del_doublemap(double f) {
@@ -887,6 +1004,112 @@ size_t TrackerElement::size_doublemap() {
     return dataunion.subdoublemap_value->size();
 }
 
+shared_ptr<TrackerElement> TrackerElement::get_smallintmap_value(int idx) {
+    except_type_mismatch(TrackerSmallIntMap);
+
+    small_int_map_iterator i = dataunion.subsmallintmap_value->find(idx);
+
+    if (i == dataunion.subsmallintmap_value->end())
+        return NULL;
+
+    return i->second;
+}
+
+TrackerElement::small_int_map_iterator TrackerElement::smallint_begin() {
+    except_type_mismatch(TrackerSmallIntMap);
+
+    return dataunion.subsmallintmap_value->begin();
+}
+
+TrackerElement::small_int_map_iterator TrackerElement::smallint_end() {
+    except_type_mismatch(TrackerSmallIntMap);
+
+    return dataunion.subsmallintmap_value->end();
+}
+
+TrackerElement::small_int_map_iterator TrackerElement::smallint_find(int k) {
+    except_type_mismatch(TrackerSmallIntMap);
+
+    return dataunion.subsmallintmap_value->find(k);
+}
+
+void TrackerElement::add_smallintmap(int i, shared_ptr<TrackerElement> s) {
+    except_type_mismatch(TrackerSmallIntMap);
+
+    dataunion.subsmallintmap_value->set(i, std::move(s));
+}
+
+void TrackerElement::del_smallintmap(int i) {
+    except_type_mismatch(TrackerSmallIntMap);
+
+    dataunion.subsmallintmap_value->erase(i);
+}
+
+void TrackerElement::clear_smallintmap() {
+    except_type_mismatch(TrackerSmallIntMap);
+
+    dataunion.subsmallintmap_value->clear();
+}
+
+size_t TrackerElement::size_smallintmap() {
+    except_type_mismatch(TrackerSmallIntMap);
+
+    return dataunion.subsmallintmap_value->size();
+}
+
+shared_ptr<TrackerElement> TrackerElement::get_smalldoublemap_value(double idx) {
+    except_type_mismatch(TrackerSmallDoubleMap);
+
+    small_double_map_iterator i = dataunion.subsmalldoublemap_value->find(idx);
+
+    if (i == dataunion.subsmalldoublemap_value->end())
+        return NULL;
+
+    return i->second;
+}
+
+TrackerElement::small_double_map_iterator TrackerElement::smalldouble_begin() {
+    except_type_mismatch(TrackerSmallDoubleMap);
+
+    return dataunion.subsmalldoublemap_value->begin();
+}
+
+TrackerElement::small_double_map_iterator TrackerElement::smalldouble_end() {
+    except_type_mismatch(TrackerSmallDoubleMap);
+
+    return dataunion.subsmalldoublemap_value->end();
+}
+
+TrackerElement::small_double_map_iterator TrackerElement::smalldouble_find(double k) {
+    except_type_mismatch(TrackerSmallDoubleMap);
+
+    return dataunion.subsmalldoublemap_value->find(k);
+}
+
+void TrackerElement::add_smalldoublemap(double i, shared_ptr<TrackerElement> s) {
+    except_type_mismatch(TrackerSmallDoubleMap);
+
+    dataunion.subsmalldoublemap_value->set(i, std::move(s));
+}
+
+void TrackerElement::del_smalldoublemap(double i) {
+    except_type_mismatch(TrackerSmallDoubleMap);
+
+    dataunion.subsmalldoublemap_value->erase(i);
+}
+
+void TrackerElement::clear_smalldoublemap() {
+    except_type_mismatch(TrackerSmallDoubleMap);
+
+    dataunion.subsmalldoublemap_value->clear();
+}
+
+size_t TrackerElement::size_smalldoublemap() {
+    except_type_mismatch(TrackerSmallDoubleMap);
+
+    return dataunion.subsmalldoublemap_value->size();
+}
+
 string TrackerElement::type_to_string(TrackerType t) {
     switch (t) {
         case TrackerString:
@@ -927,6 +1150,10 @@ string TrackerElement::type_to_string(TrackerType t) {
             return "map[string, x]";
         case TrackerDoubleMap:
             return "map[double, x]";
+        case TrackerSmallIntMap:
+            return "smallmap[int, x]";
+        case TrackerSmallDoubleMap:
+            return "smallmap[double, x]";
         case TrackerByteArray:
             return "bytearray";
         default:
@@ -937,13 +1164,14 @@ string TrackerElement::type_to_string(TrackerType t) {
 void TrackerElement::add_map(int f, shared_ptr<TrackerElement> s) {
     except_type_mismatch(TrackerMap);
 
-    dataunion.submap_value->emplace(f, s);
+    dataunion.submap_value->emplace(f, std::move(s));
 }
 
 void TrackerElement::add_map(shared_ptr<TrackerElement> s) {
     except_type_mismatch(TrackerMap);
 
-    dataunion.submap_value->emplace(s->get_id(), s);
+    int id = s->get_id();
+    dataunion.submap_value->emplace(id, std::move(s));
 }
 
 void TrackerElement::del_map(int f) {
@@ -1033,7 +1261,7 @@ void TrackerElement::insert_intmap(int_map_pair p) {
 void TrackerElement::add_intmap(int i, shared_ptr<TrackerElement> s) {
     except_type_mismatch(TrackerIntMap);
 
-    (*dataunion.subintmap_value)[i] = s;
+    (*dataunion.subintmap_value)[i] = std::move(s);
 }
 
 void TrackerElement::del_intmap(int i) {
@@ -1054,7 +1282,7 @@ void TrackerElement::del_intmap(int_map_iterator i) {
 void TrackerElement::add_vector(shared_ptr<TrackerElement> s) {
     except_type_mismatch(TrackerVector);
 
-    dataunion.subvector_value->push_back(s);
+    dataunion.subvector_value->push_back(std::move(s));
 }
 
 void TrackerElement::del_vector(unsigned int p) {
@@ -1130,69 +1358,73 @@ size_t TrackerElement::size() {
             return dataunion.substringmap_value->size();
         case TrackerDoubleMap:
             return dataunion.subdoublemap_value->size();
+        case TrackerSmallIntMap:
+            return dataunion.subsmallintmap_value->size();
+        case TrackerSmallDoubleMap:
+            return dataunion.subsmalldoublemap_value->size();
         default:
             throw std::runtime_error(string("can't get size of a " + type_to_string(type)));
     }
 }
 
-template<> string GetTrackerValue(shared_ptr<TrackerElement> e) {
+template<> string GetTrackerValue(const shared_ptr<TrackerElement>& e) {
     return e->get_string();
 }
 
-template<> int8_t GetTrackerValue(shared_ptr<TrackerElement> e) {
+template<> int8_t GetTrackerValue(const shared_ptr<TrackerElement>& e) {
     return e->get_int8();
 }
 
-template<> uint8_t GetTrackerValue(shared_ptr<TrackerElement> e) {
+template<> uint8_t GetTrackerValue(const shared_ptr<TrackerElement>& e) {
     return e->get_uint8();
 }
 
-template<> int16_t GetTrackerValue(shared_ptr<TrackerElement> e) {
+template<> int16_t GetTrackerValue(const shared_ptr<TrackerElement>& e) {
     return e->get_int16();
 }
 
-template<> uint16_t GetTrackerValue(shared_ptr<TrackerElement> e) {
+template<> uint16_t GetTrackerValue(const shared_ptr<TrackerElement>& e) {
     return e->get_uint16();
 }
 
-template<> int32_t GetTrackerValue(shared_ptr<TrackerElement> e) {
+template<> int32_t GetTrackerValue(const shared_ptr<TrackerElement>& e) {
     return e->get_int32();
 }
 
-template<> uint32_t GetTrackerValue(shared_ptr<TrackerElement> e) {
+template<> uint32_t GetTrackerValue(const shared_ptr<TrackerElement>& e) {
     return e->get_uint32();
 }
 
-template<> int64_t GetTrackerValue(shared_ptr<TrackerElement> e) {
+template<> int64_t GetTrackerValue(const shared_ptr<TrackerElement>& e) {
     return e->get_int64();
 }
 
-template<> uint64_t GetTrackerValue(shared_ptr<TrackerElement> e) {
+template<> uint64_t GetTrackerValue(const shared_ptr<TrackerElement>& e) {
     return e->get_uint64();
 }
 
-template<> float GetTrackerValue(shared_ptr<TrackerElement> e) {
+template<> float GetTrackerValue(const shared_ptr<TrackerElement>& e) {
     return e->get_float();
 }
 
-template<> double GetTrackerValue(shared_ptr<TrackerElement> e) {
+template<> double GetTrackerValue(const shared_ptr<TrackerElement>& e) {
     return e->get_double();
 }
 
-template<> mac_addr GetTrackerValue(shared_ptr<TrackerElement> e) {
+template<> mac_addr GetTrackerValue(const shared_ptr<TrackerElement>& e) {
     return e->get_mac();
 }
 
-template<> TrackerElement::tracked_map *GetTrackerValue(shared_ptr<TrackerElement> e) {
+template<> TrackerElement::tracked_map *GetTrackerValue(const shared_ptr<TrackerElement>& e) {
     return e->get_map();
 }
 
 template<> TrackerElement::tracked_vector 
-    *GetTrackerValue(shared_ptr<TrackerElement> e) {
+    *GetTrackerValue(const shared_ptr<TrackerElement>& e) {
     return e->get_vector();
 }
 
-template<> uuid GetTrackerValue(shared_ptr<TrackerElement> e) {
+template<> uuid GetTrackerValue(const shared_ptr<TrackerElement>& e) {
     return e->get_uuid();
 }
 
@@ -1436,6 +1668,8 @@ tracker_component::tracker_component(GlobalRegistry *in_globalreg, int in_id) {
 
     set_type(TrackerMap);
     set_id(in_id);
+
+    mod_version = 0;
 }
 
 tracker_component::tracker_component(GlobalRegistry *in_globalreg, int in_id, 
@@ -1446,12 +1680,12 @@ tracker_component::tracker_component(GlobalRegistry *in_globalreg, int in_id,
 
     set_type(TrackerMap);
     set_id(in_id);
+
+    mod_version = 0;
 }
 
 tracker_component::~tracker_component() { 
-    for (unsigned int i = 0; i < registered_fields.size(); i++) {
-        delete registered_fields[i];
-    }
+
 }
 
 shared_ptr<TrackerElement> tracker_component::clone_type() {
@@ -1470,9 +1704,7 @@ int tracker_component::RegisterField(string in_name, TrackerType in_type,
         string in_desc, shared_ptr<TrackerElement> *in_dest) {
     int id = entrytracker->RegisterField(in_name, in_type, in_desc);
 
-    registered_field *rf = new registered_field(id, in_dest);
-
-    registered_fields.push_back(rf);
+    registered_fields.push_back(registered_field(id, in_dest));
 
     return id;
 }
@@ -1489,9 +1721,7 @@ int tracker_component::RegisterField(string in_name,
         string in_desc, shared_ptr<TrackerElement> *in_dest) {
     int id = entrytracker->RegisterField(in_name, in_builder, in_desc);
 
-    registered_field *rf = new registered_field(id, in_dest);
-
-    registered_fields.push_back(rf);
+    registered_fields.push_back(registered_field(id, in_dest));
 
     return id;
 } 
@@ -1504,15 +1734,111 @@ int tracker_component::RegisterComplexField(string in_name,
     return id;
 }
 
+void tracker_component::resolve_field_defs(const vector<tracker_field_def>& in_defs,
+        vector<int>& out_ids, vector<SharedTrackerElement>& out_builders) {
+    out_ids.clear();
+    out_builders.clear();
+
+    for (auto d : in_defs) {
+        if (d.builder == NULL) {
+            out_ids.push_back(entrytracker->RegisterField(d.name, d.type, 
+                        d.description));
+            out_builders.push_back(NULL);
+            continue;
+        }
+
+        SharedTrackerElement builder = (*(d.builder))(globalreg);
+        int id = entrytracker->RegisterField(d.name, builder, d.description);
+
+        builder->set_id(id);
+
+        out_ids.push_back(id);
+        out_builders.push_back(builder);
+    }
+}
+
+// Basic fields of a new record, allocated together; each field is an aliasing
+// pointer into the block, so the block lives as long as any of them
+class tracker_element_block {
+public:
+    tracker_element_block(size_t in_num) :
+        elements(new TrackerElement[in_num]) { }
+
+    unique_ptr<TrackerElement[]> elements;
+};
+
 void tracker_component::reserve_fields(shared_ptr<TrackerElement> e) {
+    // With nothing to import, every basic field of a resolved table is built in
+    // one allocation instead of one each
+    if (e == NULL) {
+        size_t num_basic = 0;
+
+        for (auto& rf : registered_fields) {
+            if (rf.assign != NULL && rf.resolved && rf.id >= 0 && rf.builder == NULL)
+                num_basic++;
+        }
+
+        if (num_basic > 1) {
+            shared_ptr<tracker_element_block> block = 
+                std::make_shared<tracker_element_block>(num_basic);
+            size_t b = 0;
+
+            for (auto& rf : registered_fields) {
+                if (rf.assign == NULL)
+                    continue;
+
+                if (rf.resolved && rf.id >= 0 && rf.builder == NULL) {
+                    TrackerElement *te = &(block->elements[b++]);
+
+                    te->set_id(rf.id);
+                    te->set_type(rf.type);
+
+                    *(rf.assign) = shared_ptr<TrackerElement>(block, te);
+                    add_map(*(rf.assign));
+                } else {
+                    *(rf.assign) = import_or_new(e, rf);
+                }
+            }
+
+            return;
+        }
+    }
+
     for (unsigned int i = 0; i < registered_fields.size(); i++) {
-        registered_field *rf = registered_fields[i];
+        registered_field *rf = &(registered_fields[i]);
 
         if (rf->assign != NULL) {
-            *(rf->assign) = import_or_new(e, rf->id);
-        } else {
+            *(rf->assign) = import_or_new(e, *rf);
+        }
+    }
+}
+
+shared_ptr<TrackerElement> 
+    tracker_component::import_or_new(shared_ptr<TrackerElement> e, 
+            const registered_field& rf) {
+
+    if (!rf.resolved || rf.id < 0)
+        return import_or_new(e, rf.id);
+
+    shared_ptr<TrackerElement> r;
+
+    if (e != NULL) {
+        r = e->get_map_value(rf.id);
+
+        if (r != NULL) {
+            add_map(r);
+            return r;
         }
     }
+
+    if (rf.builder != NULL)
+        r = rf.builder->clone_type(rf.id);
+    else
+        r = std::make_shared<TrackerElement>(rf.type, rf.id);
+
+    add_map(r);
+
+    return r;
 }
 
 shared_ptr<TrackerElement> 
@@ -1604,6 +1930,35 @@ void TrackerElementSerializer::pre_serialize_path(SharedElementSummary in_summar
     }
 }
 
+void TrackerElementSerializer::post_serialize_path(SharedElementSummary in_summary) {
+
+    // Walk the same path as pre_serialize_path, and release the objects from
+    // the innermost outwards
+
+    SharedTrackerElement inter = in_summary->parent_element;
+    vector<SharedTrackerElement> path;
+
+    if (inter == NULL)
+        return;
+
+    try {
+        for (vector<int>::iterator i = in_summary->resolved_path.begin();
+                i != in_summary->resolved_path.end(); ++i) {
+            inter = inter->get_map_value(*i);
+
+            if (inter == NULL)
+                break;
+
+            path.push_back(inter);
+        }
+    } catch (const std::runtime_error&) {
+        // Release whatever we got to
+    }
+
+    for (auto i = path.rbegin(); i != path.rend(); ++i)
+        (*i)->post_serialize();
+}
+
 TrackerElementSummary::TrackerElementSummary(SharedElementSummary in_c) {
     parent_element = in_c->parent_element;
     resolved_path = in_c->resolved_path;
@@ -1667,54 +2022,49 @@ void TrackerElementSummary::parse_path(vector<string> in_path, string in_rename,
     }
 }
 
-shared_ptr<TrackerElement> GetTrackerElementPath(string in_path, 
-        SharedTrackerElement elem,
+std::vector<int> CompileTrackerElementPath(string in_path,
         shared_ptr<EntryTracker> entrytracker) {
-    return GetTrackerElementPath(StrTokenize(in_path, "/"),
-            elem, entrytracker);
+    return CompileTrackerElementPath(StrTokenize(in_path, "/"), entrytracker);
 }
 
-shared_ptr<TrackerElement> GetTrackerElementPath(std::vector<string> in_path, 
-        SharedTrackerElement elem,
+std::vector<int> CompileTrackerElementPath(const std::vector<string>& in_path,
         shared_ptr<EntryTracker> entrytracker) {
+    std::vector<int> ret;
 
-    if (in_path.size() < 1)
-        return NULL;
-
-    shared_ptr<TrackerElement> next_elem = NULL;
-
-    for (unsigned int x = 0; x < in_path.size(); x++) {
+    for (auto p : in_path) {
         // Skip empty path element
-        if (in_path[x].length() == 0)
+        if (p.length() == 0)
             continue;
 
-        int id = entrytracker->GetFieldId(in_path[x]);
-
-        if (id < 0) {
-            return NULL;
-        }
+        // Unknown fields stay in the path as -1, which never matches
+        ret.push_back(entrytracker->GetFieldId(p));
+    }
 
-        if (next_elem == NULL)
-            next_elem = elem->get_map_value(id);
-        else
-            next_elem = 
-                next_elem->get_map_value(id);
+    return ret;
+}
 
-        if (next_elem == NULL) {
-            return NULL;
-        }
-    }
+shared_ptr<TrackerElement> GetTrackerElementPath(string in_path, 
+        SharedTrackerElement elem,
+        shared_ptr<EntryTracker> entrytracker) {
+    return GetTrackerElementPath(CompileTrackerElementPath(in_path, entrytracker), elem);
+}
 
-    return next_elem;
+shared_ptr<TrackerElement> GetTrackerElementPath(std::vector<string> in_path, 
+        SharedTrackerElement elem,
+        shared_ptr<EntryTracker> entrytracker) {
+    return GetTrackerElementPath(CompileTrackerElementPath(in_path, entrytracker), elem);
 }
 
-shared_ptr<TrackerElement> GetTrackerElementPath(std::vector<int> in_path, 
-        SharedTrackerElement elem) {
+shared_ptr<TrackerElement> GetTrackerElementPath(const std::vector<int>& in_path, 
+        const SharedTrackerElement& elem) {
 
     if (in_path.size() < 1)
         return NULL;
 
-    shared_ptr<TrackerElement> next_elem = NULL;
+    // Walk the maps without taking a reference to each step; only the element
+    // at the end of the path is copied out
+    TrackerElement *cur = elem.get();
+    const SharedTrackerElement *found = NULL;
 
     for (unsigned int x = 0; x < in_path.size(); x++) {
         int id = in_path[x];
@@ -1723,30 +2073,36 @@ shared_ptr<TrackerElement> GetTrackerElementPath(std::vector<int> in_path,
             return NULL;
         }
 
-        if (next_elem == NULL)
-            next_elem = elem->get_map_value(id);
-        else
-            next_elem = 
-                next_elem->get_map_value(id);
+        TrackerElement::tracked_map *m = cur->get_map();
+        TrackerElement::map_iterator i = m->find(id);
 
-        if (next_elem == NULL) {
+        if (i == m->end() || i->second == NULL) {
             return NULL;
         }
+
+        found = &(i->second);
+        cur = i->second.get();
     }
 
-    return next_elem;
+    return *found;
 }
 
 std::vector<SharedTrackerElement> GetTrackerElementMultiPath(string in_path, 
         SharedTrackerElement elem,
         shared_ptr<EntryTracker> entrytracker) {
-    return GetTrackerElementMultiPath(StrTokenize(in_path, "/"),
-            elem, entrytracker);
+    return GetTrackerElementMultiPath(CompileTrackerElementPath(in_path, entrytracker),
+            elem);
 }
 
 std::vector<SharedTrackerElement> GetTrackerElementMultiPath(std::vector<string> in_path, 
         SharedTrackerElement elem,
         shared_ptr<EntryTracker> entrytracker) {
+    return GetTrackerElementMultiPath(CompileTrackerElementPath(in_path, entrytracker),
+            elem);
+}
+
+std::vector<SharedTrackerElement> GetTrackerElementMultiPath(const std::vector<int>& in_path, 
+        SharedTrackerElement elem) {
 
     std::vector<SharedTrackerElement> ret;
 
@@ -1756,12 +2112,8 @@ std::vector<SharedTrackerElement> GetTrackerElementMultiPath(std::vector<string>
     shared_ptr<TrackerElement> next_elem = NULL;
 
     bool complex_fulfilled = false;
-    for (vector<string>::iterator x = in_path.begin(); x != in_path.end(); ++x) {
-        // Skip empty path element
-        if (x->length() == 0)
-            continue;
-
-        int id = entrytracker->GetFieldId(*x);
+    for (vector<int>::const_iterator x = in_path.begin(); x != in_path.end(); ++x) {
+        int id = *x;
 
         if (id < 0) {
             return ret;
@@ -1784,14 +2136,14 @@ std::vector<SharedTrackerElement> GetTrackerElementMultiPath(std::vector<string>
             int type = next_elem->get_type();
 
             if (type == TrackerVector) {
-                std::vector<string> sub_path(std::next(x, 1), in_path.end());
+                std::vector<int> sub_path(std::next(x, 1), in_path.end());
 
                 TrackerElementVector cn(next_elem);
 
                 for (TrackerElementVector::iterator i = cn.begin();
                         i != cn.end(); ++i) {
                     vector<SharedTrackerElement> subret =
-                        GetTrackerElementMultiPath(sub_path, *i, entrytracker);
+                        GetTrackerElementMultiPath(sub_path, *i);
 
                     ret.insert(ret.end(), subret.begin(), subret.end());
                 }
@@ -1799,14 +2151,14 @@ std::vector<SharedTrackerElement> GetTrackerElementMultiPath(std::vector<string>
                 complex_fulfilled = true;
                 break;
             } else if (type == TrackerIntMap) {
-                std::vector<string> sub_path(std::next(x, 1), in_path.end());
+                std::vector<int> sub_path(std::next(x, 1), in_path.end());
 
                 TrackerElementIntMap cn(next_elem);
 
                 for (TrackerElementIntMap::iterator i = cn.begin();
                         i != cn.end(); ++i) {
                     vector<SharedTrackerElement> subret =
-                        GetTrackerElementMultiPath(sub_path, i->second, entrytracker);
+                        GetTrackerElementMultiPath(sub_path, i->second);
 
                     ret.insert(ret.end(), subret.begin(), subret.end());
                 }
@@ -1814,14 +2166,14 @@ std::vector<SharedTrackerElement> GetTrackerElementMultiPath(std::vector<string>
                 complex_fulfilled = true;
                 break;
             } else if (type == TrackerStringMap) {
-                std::vector<string> sub_path(std::next(x, 1), in_path.end());
+                std::vector<int> sub_path(std::next(x, 1), in_path.end());
 
                 TrackerElementStringMap cn(next_elem);
 
                 for (TrackerElementStringMap::iterator i = cn.begin();
                         i != cn.end(); ++i) {
                     vector<SharedTrackerElement> subret =
-                        GetTrackerElementMultiPath(sub_path, i->second, entrytracker);
+                        GetTrackerElementMultiPath(sub_path, i->second);
 
                     ret.insert(ret.end(), subret.begin(), subret.end());
                 }
@@ -1829,14 +2181,14 @@ std::vector<SharedTrackerElement> GetTrackerElementMultiPath(std::vector<string>
                 complex_fulfilled = true;
                 break;
             } else if (type == TrackerMacMap) {
-                std::vector<string> sub_path(std::next(x, 1), in_path.end());
+                std::vector<int> sub_path(std::next(x, 1), in_path.end());
 
                 TrackerElementMacMap cn(next_elem);
 
                 for (TrackerElementMacMap::iterator i = cn.begin();
                         i != cn.end(); ++i) {
                     vector<SharedTrackerElement> subret =
-                        GetTrackerElementMultiPath(sub_path, i->second, entrytracker);
+                        GetTrackerElementMultiPath(sub_path, i->second);
 
                     ret.insert(ret.end(), subret.begin(), subret.end());
                 }
@@ -1844,101 +2196,12 @@ std::vector<SharedTrackerElement> GetTrackerElementMultiPath(std::vector<string>
                 complex_fulfilled = true;
                 break;
             } else if (type == TrackerDoubleMap) {
-                std::vector<string> sub_path(std::next(x, 1), in_path.end());
+                std::vector<int> sub_path(std::next(x, 1), in_path.end());
 
                 TrackerElementDoubleMap cn(next_elem);
 
                 for (TrackerElementDoubleMap::iterator i = cn.begin();
                         i != cn.end(); ++i) {
-                    vector<SharedTrackerElement> subret =
-                        GetTrackerElementMultiPath(sub_path, i->second, entrytracker);
-
-                    ret.insert(ret.end(), subret.begin(), subret.end());
-                }
-
-                complex_fulfilled = true;
-                break;
-            }
-        }
-    }
-
-    if (!complex_fulfilled)
-        ret.push_back(next_elem);
-
-    return ret;
-}
-
-std::vector<SharedTrackerElement> GetTrackerElementMultiPath(std::vector<int> in_path, 
-        SharedTrackerElement elem) {
-
-    std::vector<SharedTrackerElement> ret;
-
-    if (in_path.size() < 1)
-        return ret;
-
-    shared_ptr<TrackerElement> next_elem = NULL;
-
-    bool complex_fulfilled = false;
-    for (vector<int>::iterator x = in_path.begin(); x != in_path.end(); ++x) {
-        int id = *x;
-
-        if (id < 0) {
-            return ret;
-        }
-
-        if (next_elem == NULL)
-            next_elem = elem->get_map_value(id);
-        else
-            next_elem = 
-                next_elem->get_map_value(id);
-
-        if (next_elem == NULL) {
-            return ret;
-        }
-
-        // If we're at the termination of the path, we just return the
-        // object.  If we're in the middle of a path, we iterate over the 
-        // contents of the container, and find the rest of the path in it
-        if (x != std::next(in_path.end(), -1)) {
-            int type = next_elem->get_type();
-
-            if (type == TrackerVector) {
-                std::vector<int> sub_path(std::next(x, 1), in_path.end());
-
-                TrackerElementVector cn(next_elem);
-
-                for (TrackerElementVector::iterator i = cn.begin();
-                        i != cn.end(); ++i) {
-                    vector<SharedTrackerElement> subret =
-                        GetTrackerElementMultiPath(sub_path, *i);
-
-                    ret.insert(ret.end(), subret.begin(), subret.end());
-                }
-
-                complex_fulfilled = true;
-                break;
-            } else if (type == TrackerIntMap) {
-                std::vector<int> sub_path(std::next(x, 1), in_path.end());
-
-                TrackerElementIntMap cn(next_elem);
-
-                for (TrackerElementIntMap::iterator i = cn.begin();
-                        i != cn.end(); ++i) {
-                    vector<SharedTrackerElement> subret =
-                        GetTrackerElementMultiPath(sub_path, i->second);
-
-                    ret.insert(ret.end(), subret.begin(), subret.end());
-                }
-
-                complex_fulfilled = true;
-                break;
-            } else if (type == TrackerStringMap) {
-                std::vector<int> sub_path(std::next(x, 1), in_path.end());
-
-                TrackerElementStringMap cn(next_elem);
-
-                for (TrackerElementStringMap::iterator i = cn.begin();
-                        i != cn.end(); ++i) {
                     vector<SharedTrackerElement> subret =
                         GetTrackerElementMultiPath(sub_path, i->second);
 
@@ -1947,30 +2210,24 @@ std::vector<SharedTrackerElement> GetTrackerElementMultiPath(std::vector<int> in
 
                 complex_fulfilled = true;
                 break;
-            } else if (type == TrackerMacMap) {
+            } else if (type == TrackerSmallIntMap) {
                 std::vector<int> sub_path(std::next(x, 1), in_path.end());
 
-                TrackerElementMacMap cn(next_elem);
-
-                for (TrackerElementMacMap::iterator i = cn.begin();
-                        i != cn.end(); ++i) {
+                for (const auto& i : *(next_elem->get_smallintmap())) {
                     vector<SharedTrackerElement> subret =
-                        GetTrackerElementMultiPath(sub_path, i->second);
+                        GetTrackerElementMultiPath(sub_path, i.second);
 
                     ret.insert(ret.end(), subret.begin(), subret.end());
                 }
 
                 complex_fulfilled = true;
                 break;
-            } else if (type == TrackerDoubleMap) {
+            } else if (type == TrackerSmallDoubleMap) {
                 std::vector<int> sub_path(std::next(x, 1), in_path.end());
 
-                TrackerElementDoubleMap cn(next_elem);
-
-                for (TrackerElementDoubleMap::iterator i = cn.begin();
-                        i != cn.end(); ++i) {
+                for (const auto& i : *(next_elem->get_smalldoublemap())) {
                     vector<SharedTrackerElement> subret =
-                        GetTrackerElementMultiPath(sub_path, i->second);
+                        GetTrackerElementMultiPath(sub_path, i.second);
 
                     ret.insert(ret.end(), subret.begin(), subret.end());
                 }
@@ -1987,19 +2244,22 @@ std::vector<SharedTrackerElement> GetTrackerElementMultiPath(std::vector<int> in
     return ret;
 }
 
-void SummarizeTrackerElement(shared_ptr<EntryTracker> entrytracker,
-        SharedTrackerElement in, 
-        vector<SharedElementSummary> in_summarization, 
+void SummarizeTrackerElement(const shared_ptr<EntryTracker>& entrytracker,
+        const SharedTrackerElement& in, 
+        const vector<SharedElementSummary>& in_summarization, 
         SharedTrackerElement &ret_elem, 
         TrackerElementSerializer::rename_map &rename_map) {
 
     unsigned int fn = 0;
-    ret_elem.reset(new TrackerElement(TrackerMap));
 
-    if (in_summarization.size() == 0)
+    if (in_summarization.size() == 0) {
         ret_elem = in;
+        return;
+    }
 
-    for (vector<SharedElementSummary>::iterator si = in_summarization.begin();
+    ret_elem = std::make_shared<TrackerElement>(TrackerMap);
+
+    for (vector<SharedElementSummary>::const_iterator si = in_summarization.begin();
             si != in_summarization.end(); ++si) {
         fn++;
 
@@ -2010,10 +2270,7 @@ void SummarizeTrackerElement(shared_ptr<EntryTracker> entrytracker,
             GetTrackerElementPath((*si)->resolved_path, in);
 
         if (f == NULL) {
-            f = entrytracker->RegisterAndGetField("unknown" + IntToString(fn),
-                    TrackerInt8, "unallocated field");
-
-            f = SharedTrackerElement(new TrackerElement(TrackerUInt8));
+            f = std::make_shared<TrackerElement>(TrackerUInt8);
             f->set((uint8_t) 0);
         
             if ((*si)->rename.length() != 0) {
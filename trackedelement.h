@@ -31,9 +31,12 @@
 #include <map>
 
 #include <memory>
+#include <atomic>
+#include <mutex>
 
 #include "macaddr.h"
 #include "uuid.h"
+#include "kis_string_intern.h"
 
 // Type safety can be disabled by commenting out this definition.  This will no
 // longer validate that the type of element matches the use; if used improperly this
@@ -103,6 +106,106 @@ enum TrackerType {
 
     // Byte array
     TrackerByteArray = 19,
+
+    // Int and double keyed maps kept as a short sorted vector, for maps which
+    // almost always hold a handful of entries; serialized the same as
+    // TrackerIntMap and TrackerDoubleMap
+    TrackerSmallIntMap = 20,
+    TrackerSmallDoubleMap = 21,
+};
+
+// Map kept as a vector of key,element pairs sorted by key.  Lookups scan it
+// linearly, which for the few entries it's meant for beats walking a tree, and
+// the entries share one allocation instead of one node each.  Iterators are
+// invalidated by adding and removing entries.
+template<class K>
+class tracked_small_map {
+public:
+    typedef pair<K, shared_ptr<TrackerElement> > value_type;
+    typedef typename vector<value_type>::iterator iterator;
+    typedef typename vector<value_type>::const_iterator const_iterator;
+
+    iterator begin() { return entries.begin(); }
+    iterator end() { return entries.end(); }
+    const_iterator begin() const { return entries.begin(); }
+    const_iterator end() const { return entries.end(); }
+
+    size_t size() const { return entries.size(); }
+    bool empty() const { return entries.empty(); }
+    void clear() { entries.clear(); }
+
+    iterator find(const K& k) {
+        for (iterator i = entries.begin(); i != entries.end(); ++i) {
+            if (i->first == k)
+                return i;
+
+            if (k < i->first)
+                break;
+        }
+
+        return entries.end();
+    }
+
+    // Add an entry or replace the element of an existing one
+    void set(const K& k, shared_ptr<TrackerElement> v) {
+        if (entries.capacity() == 0)
+            entries.reserve(4);
+
+        iterator i = entries.begin();
+
+        while (i != entries.end() && i->first < k)
+            ++i;
+
+        if (i != entries.end() && i->first == k) {
+            i->second = std::move(v);
+            return;
+        }
+
+        entries.insert(i, value_type(k, std::move(v)));
+    }
+
+    void erase(iterator i) { entries.erase(i); }
+
+    void erase(const K& k) {
+        iterator i = find(k);
+
+        if (i != entries.end())
+            entries.erase(i);
+    }
+
+protected:
+    vector<value_type> entries;
+};
+
+// Optional accounting of live tracked elements by field id, enabled with
+// 'track_element_memory=true'.  For each field it counts the elements which
+// currently exist and estimates their memory:  the element, the fixed part of
+// its value (string, MAC, container, etc), and the shared_ptr control block.
+// Children of maps and vectors are counted under their own fields.  String
+// contents, container nodes, and extra members of tracker_component subclasses
+// aren't included, so the bytes are a lower bound.
+//
+// Ids past TRACKER_ACCOUNTING_MAX_FIELDS are counted together in slot 0.
+#define TRACKER_ACCOUNTING_MAX_FIELDS   8192
+
+class TrackerElementAccounting {
+public:
+    // Has to be enabled before any elements with ids exist
+    static void Enable();
+
+    static bool IsEnabled() {
+        return enabled.load(std::memory_order_relaxed);
+    }
+
+    // Add or remove an element of a type from a field
+    static void Account(int in_id, TrackerType in_type, int in_delta);
+
+    // Live elements of a field, and their estimated bytes
+    static int64_t FetchCount(int in_id);
+    static int64_t FetchBytes(int in_id);
+
+protected:
+    static std::atomic<bool> enabled;
 };
 
 class TrackerElement {
@@ -120,8 +223,7 @@ public:
 
     // Factory-style for easily making more of the same if we're subclassed
     virtual shared_ptr<TrackerElement> clone_type() {
-        shared_ptr<TrackerElement> dup1(new TrackerElement(get_type(), get_id()));
-        return dup1;
+        return std::make_shared<TrackerElement>(get_type(), get_id());
     }
 
     virtual shared_ptr<TrackerElement> clone_type(int in_id) {
@@ -134,20 +236,39 @@ public:
     // Called prior to serialization output
     virtual void pre_serialize() { }
 
+    // Called after serialization output, to release anything pre_serialize
+    // built only for the output
+    virtual void post_serialize() { }
+
     int get_id() {
         return tracked_id;
     }
 
     void set_id(int id) {
+        if (TrackerElementAccounting::IsEnabled()) {
+            TrackerElementAccounting::Account(tracked_id, type, -1);
+            TrackerElementAccounting::Account(id, type, 1);
+        }
+
         tracked_id = id;
     }
 
     void set_local_name(string in_name) {
-        local_name = in_name;
+        if (local_name == NULL)
+            local_name = new string(in_name);
+        else
+            *local_name = in_name;
+    }
+
+    bool has_local_name() {
+        return local_name != NULL && local_name->length() != 0;
     }
 
     string get_local_name() {
-        return local_name;
+        if (local_name == NULL)
+            return "";
+
+        return *local_name;
     }
 
     void set_type(TrackerType type);
@@ -183,10 +304,31 @@ public:
     typedef map<double, shared_ptr<TrackerElement> >::const_iterator double_map_const_iterator;
     typedef pair<double, shared_ptr<TrackerElement> > double_map_pair;
 
+    typedef tracked_small_map<int> tracked_small_int_map;
+    typedef tracked_small_map<int>::iterator small_int_map_iterator;
+    typedef tracked_small_map<int>::const_iterator small_int_map_const_iterator;
+
+    typedef tracked_small_map<double> tracked_small_double_map;
+    typedef tracked_small_map<double>::iterator small_double_map_iterator;
+    typedef tracked_small_map<double>::const_iterator small_double_map_const_iterator;
+
     // Getter per type, use templated GetTrackerValue() for easy fetch
     string get_string() {
         except_type_mismatch(TrackerString);
-        return *(dataunion.string_value);
+        return dataunion.string_value->str;
+    }
+
+    // Compare two string elements; interned values compare by pointer
+    bool string_equals(TrackerElement *in_elem) {
+        except_type_mismatch(TrackerString);
+
+        if (dataunion.string_value == in_elem->dataunion.string_value)
+            return true;
+
+        if (dataunion.string_value->pooled && in_elem->dataunion.string_value->pooled)
+            return false;
+
+        return dataunion.string_value->str == in_elem->dataunion.string_value->str;
     }
 
     uint8_t get_uint8() {
@@ -239,6 +381,10 @@ public:
         return dataunion.double_value;
     }
 
+    // Unchecked reference to the value of a scalar element, for callers which
+    // know the type statically; see TrackedScalar and tracker_fast_access
+    template<typename T> T& scalar_ref();
+
     mac_addr get_mac() {
         except_type_mismatch(TrackerMac);
         return (*(dataunion.mac_value));
@@ -292,6 +438,16 @@ public:
         return dataunion.subdoublemap_value;
     }
 
+    tracked_small_int_map *get_smallintmap() {
+        except_type_mismatch(TrackerSmallIntMap);
+        return dataunion.subsmallintmap_value;
+    }
+
+    tracked_small_double_map *get_smalldoublemap() {
+        except_type_mismatch(TrackerSmallDoubleMap);
+        return dataunion.subsmalldoublemap_value;
+    }
+
     uuid get_uuid() {
         except_type_mismatch(TrackerUuid);
         return *(dataunion.uuid_value);
@@ -300,7 +456,26 @@ public:
     // Overloaded set
     void set(string v) {
         except_type_mismatch(TrackerString);
-        *(dataunion.string_value) = v;
+
+        if (dataunion.string_value->pooled) {
+            kis_string_intern::release(dataunion.string_value);
+            dataunion.string_value = new kis_string_rec(v);
+        } else {
+            dataunion.string_value->str = v;
+        }
+    }
+
+    // Set a string value from the shared intern table, for values which many
+    // elements are expected to have in common (manufacturers, SSIDs, type names)
+    void set_interned(const string& v) {
+        except_type_mismatch(TrackerString);
+
+        if (dataunion.string_value->pooled && dataunion.string_value->str == v)
+            return;
+
+        kis_string_rec *rec = kis_string_intern::acquire(v);
+        kis_string_intern::release(dataunion.string_value);
+        dataunion.string_value = rec;
     }
 
     void set(uint8_t v) {
@@ -431,6 +606,26 @@ public:
     double_map_iterator double_end();
     double_map_iterator double_find(double k);
 
+    void add_smallintmap(int i, shared_ptr<TrackerElement> s);
+    void del_smallintmap(int i);
+    void clear_smallintmap();
+    size_t size_smallintmap();
+
+    shared_ptr<TrackerElement> get_smallintmap_value(int idx);
+    small_int_map_iterator smallint_begin();
+    small_int_map_iterator smallint_end();
+    small_int_map_iterator smallint_find(int k);
+
+    void add_smalldoublemap(double i, shared_ptr<TrackerElement> s);
+    void del_smalldoublemap(double i);
+    void clear_smalldoublemap();
+    size_t size_smalldoublemap();
+
+    shared_ptr<TrackerElement> get_smalldoublemap_value(double idx);
+    small_double_map_iterator smalldouble_begin();
+    small_double_map_iterator smalldouble_end();
+    small_double_map_iterator smalldouble_find(double k);
+
     void add_vector(shared_ptr<TrackerElement> s);
     void del_vector(unsigned int p);
     void del_vector(vector_iterator i);
@@ -561,21 +756,19 @@ protected:
     }
 #endif
 
-    // Garbage collection?  Say it ain't so...
-    int reference_count;
-
     TrackerType type;
     int tracked_id;
 
-    // Overridden name for this instance only
-    string local_name;
+    // Overridden name for this instance only; almost never set, so only
+    // allocated when used to keep every element small
+    string *local_name;
 
     size_t bytearray_value_len;
 
     // We could make these all one type, but then we'd have odd interactions
     // with incrementing and I'm not positive that's safe in all cases
     union du {
-        string *string_value;
+        kis_string_rec *string_value;
 
         uint8_t uint8_value;
         int8_t int8_value;
@@ -607,6 +800,10 @@ protected:
         // Index double,element keyed map
         map<double, shared_ptr<TrackerElement> > *subdoublemap_value;
 
+        // Small sorted vector maps
+        tracked_small_int_map *subsmallintmap_value;
+        tracked_small_double_map *subsmalldoublemap_value;
+
         vector<shared_ptr<TrackerElement> > *subvector_value;
 
         mac_addr *mac_value;
@@ -634,9 +831,8 @@ public:
         val = NULL;
     }
 
-    TrackerElementVector(shared_ptr<TrackerElement> t) {
-        val = t;
-    }
+    TrackerElementVector(const shared_ptr<TrackerElement>& t) :
+        val(t) { }
 
     virtual ~TrackerElementVector() { }
 
@@ -683,9 +879,8 @@ public:
         val = NULL;
     }
 
-    TrackerElementMap(shared_ptr<TrackerElement> t) {
-        val = t;
-    }
+    TrackerElementMap(const shared_ptr<TrackerElement>& t) :
+        val(t) { }
 
     virtual ~TrackerElementMap() { }
 
@@ -732,9 +927,8 @@ public:
         val = NULL;
     }
 
-    TrackerElementIntMap(shared_ptr<TrackerElement> t) {
-        val = t;
-    }
+    TrackerElementIntMap(const shared_ptr<TrackerElement>& t) :
+        val(t) { }
 
     virtual ~TrackerElementIntMap() { }
 
@@ -781,9 +975,8 @@ public:
         val = NULL;
     }
 
-    TrackerElementStringMap(shared_ptr<TrackerElement> t) {
-        val = t;
-    }
+    TrackerElementStringMap(const shared_ptr<TrackerElement>& t) :
+        val(t) { }
 
     virtual ~TrackerElementStringMap() { }
 
@@ -830,9 +1023,8 @@ public:
         val = NULL;
     }
 
-    TrackerElementMacMap(shared_ptr<TrackerElement> t) {
-        val = t;
-    }
+    TrackerElementMacMap(const shared_ptr<TrackerElement>& t) :
+        val(t) { }
 
     virtual ~TrackerElementMacMap() { }
 
@@ -879,9 +1071,8 @@ public:
         val = NULL;
     }
 
-    TrackerElementDoubleMap(shared_ptr<TrackerElement> t) {
-        val = t;
-    }
+    TrackerElementDoubleMap(const shared_ptr<TrackerElement>& t) :
+        val(t) { }
 
     virtual ~TrackerElementDoubleMap() { }
 
@@ -921,24 +1112,204 @@ public:
 
 // Templated access functions
 
-template<typename T> T GetTrackerValue(shared_ptr<TrackerElement>);
-
-template<> string GetTrackerValue(shared_ptr<TrackerElement> e);
-template<> int8_t GetTrackerValue(shared_ptr<TrackerElement> e);
-template<> uint8_t GetTrackerValue(shared_ptr<TrackerElement> e);
-template<> int16_t GetTrackerValue(shared_ptr<TrackerElement> e);
-template<> uint16_t GetTrackerValue(shared_ptr<TrackerElement> e);
-template<> int32_t GetTrackerValue(shared_ptr<TrackerElement> e);
-template<> uint32_t GetTrackerValue(shared_ptr<TrackerElement> e);
-template<> int64_t GetTrackerValue(shared_ptr<TrackerElement> e);
-template<> uint64_t GetTrackerValue(shared_ptr<TrackerElement> e);
-template<> float GetTrackerValue(shared_ptr<TrackerElement> e);
-template<> double GetTrackerValue(shared_ptr<TrackerElement> e);
-template<> mac_addr GetTrackerValue(shared_ptr<TrackerElement> e);
+template<typename T> T GetTrackerValue(const shared_ptr<TrackerElement>&);
+
+template<> string GetTrackerValue(const shared_ptr<TrackerElement>& e);
+template<> int8_t GetTrackerValue(const shared_ptr<TrackerElement>& e);
+template<> uint8_t GetTrackerValue(const shared_ptr<TrackerElement>& e);
+template<> int16_t GetTrackerValue(const shared_ptr<TrackerElement>& e);
+template<> uint16_t GetTrackerValue(const shared_ptr<TrackerElement>& e);
+template<> int32_t GetTrackerValue(const shared_ptr<TrackerElement>& e);
+template<> uint32_t GetTrackerValue(const shared_ptr<TrackerElement>& e);
+template<> int64_t GetTrackerValue(const shared_ptr<TrackerElement>& e);
+template<> uint64_t GetTrackerValue(const shared_ptr<TrackerElement>& e);
+template<> float GetTrackerValue(const shared_ptr<TrackerElement>& e);
+template<> double GetTrackerValue(const shared_ptr<TrackerElement>& e);
+template<> mac_addr GetTrackerValue(const shared_ptr<TrackerElement>& e);
 template<> map<int, shared_ptr<TrackerElement> > 
-    GetTrackerValue(shared_ptr<TrackerElement> e);
+    GetTrackerValue(const shared_ptr<TrackerElement>& e);
 template<> vector<shared_ptr<TrackerElement> > 
-    GetTrackerValue(shared_ptr<TrackerElement> e);
+    GetTrackerValue(const shared_ptr<TrackerElement>& e);
+
+// Statically typed access to scalar elements
+//
+// The getters and setters of TrackerElement check the element type on every
+// call.  Where the type is already known - the proxy functions of a component,
+// whose type is the one the field was registered with, or a TrackedScalar
+// which checked it once when bound - scalar values are a plain load or store
+// of the union member instead.  Defining TE_FAST_TYPE_SAFETY checks the proxy
+// path as well, to find a proxy whose type doesn't match its field.
+
+template<typename T> struct tracker_scalar_type {
+    static const bool scalar = false;
+};
+
+#define __TrackerScalarType(ctype, ttype, member) \
+    template<> struct tracker_scalar_type<ctype> { \
+        static const bool scalar = true; \
+        static const TrackerType type = ttype; \
+    }; \
+    template<> inline ctype& TrackerElement::scalar_ref<ctype>() { \
+        return dataunion.member; \
+    }
+
+__TrackerScalarType(int8_t, TrackerInt8, int8_value);
+__TrackerScalarType(uint8_t, TrackerUInt8, uint8_value);
+__TrackerScalarType(int16_t, TrackerInt16, int16_value);
+__TrackerScalarType(uint16_t, TrackerUInt16, uint16_value);
+__TrackerScalarType(int32_t, TrackerInt32, int32_value);
+__TrackerScalarType(uint32_t, TrackerUInt32, uint32_value);
+__TrackerScalarType(int64_t, TrackerInt64, int64_value);
+__TrackerScalarType(uint64_t, TrackerUInt64, uint64_value);
+__TrackerScalarType(float, TrackerFloat, float_value);
+__TrackerScalarType(double, TrackerDouble, double_value);
+
+template<typename T> inline void tracker_scalar_check(const shared_ptr<TrackerElement>& e) {
+    if (e->get_type() != tracker_scalar_type<T>::type) 
+        throw std::runtime_error("element type mismatch, is " + 
+                TrackerElement::type_to_string(e->get_type()) + " tried to use as " +
+                TrackerElement::type_to_string(tracker_scalar_type<T>::type));
+}
+
+// Non-scalar types use the checked functions
+template<typename T, bool S = tracker_scalar_type<T>::scalar> struct tracker_fast_access {
+    static T get(const shared_ptr<TrackerElement>& e) {
+        return GetTrackerValue<T>(e);
+    }
+
+    static void set(const shared_ptr<TrackerElement>& e, const T& v) {
+        e->set(v);
+    }
+};
+
+template<typename T> struct tracker_fast_access<T, true> {
+    static T& ref(const shared_ptr<TrackerElement>& e) {
+#ifdef TE_FAST_TYPE_SAFETY
+        tracker_scalar_check<T>(e);
+#endif
+        return e->scalar_ref<T>();
+    }
+
+    static T get(const shared_ptr<TrackerElement>& e) {
+        return ref(e);
+    }
+
+    static void set(const shared_ptr<TrackerElement>& e, const T& v) {
+        ref(e) = v;
+    }
+};
+
+// Typed handle to a scalar element; the type is checked when it's bound, after
+// which get and set are inline.  Holds a reference to the element.
+template<typename T> class TrackedScalar {
+public:
+    TrackedScalar() : value(NULL) { }
+
+    TrackedScalar(const shared_ptr<TrackerElement>& e) : value(NULL) {
+        bind(e);
+    }
+
+    // Throws std::runtime_error if the element is the wrong type
+    void bind(const shared_ptr<TrackerElement>& e) {
+        if (e != NULL) 
+            tracker_scalar_check<T>(e);
+
+        elem = e;
+        value = e == NULL ? NULL : &(e->scalar_ref<T>());
+    }
+
+    shared_ptr<TrackerElement> get_element() const { return elem; }
+    bool is_bound() const { return value != NULL; }
+
+    T get() const { return *value; }
+    void set(T v) { *value = v; }
+
+    TrackedScalar& operator+=(T v) { *value += v; return *this; }
+    TrackedScalar& operator-=(T v) { *value -= v; return *this; }
+    TrackedScalar& operator|=(T v) { *value |= v; return *this; }
+    TrackedScalar& operator&=(T v) { *value &= v; return *this; }
+
+protected:
+    shared_ptr<TrackerElement> elem;
+    T *value;
+};
+
+// Field descriptor tables
+//
+// Registering a field with the entrytracker is a locked lookup by name, and a
+// complex field also builds a throwaway instance of its type to use as the
+// builder; a component which registers its fields in every constructor pays
+// for all of it on every new record.  Components which are built often (devices,
+// clients, signal records) instead describe their fields once, in a static
+// table:
+//
+//  const tracker_field_desc<foo> foo::field_desc[] = {
+//      __TrackerField(foo, "foo.count", TrackerUInt64, "count", count),
+//      __TrackerFieldId(foo, "foo.entry", TrackerString, "entry", entry_id),
+//      __TrackerComplexField(foo, kis_tracked_location, "foo.location",
+//              "location", location_id),
+//  };
+//  tracker_field_table<foo> foo::field_table(foo::field_desc);
+//
+// and call register_table_fields(field_table) from register_fields().  The
+// table is resolved against the entrytracker the first time a record is built;
+// after that, building a record is only allocating its fields and wiring up the
+// pointers and ids.
+
+// Field as registered with the entrytracker
+struct tracker_field_def {
+    const char *name;
+    TrackerType type;
+    const char *description;
+    // Makes the builder of a complex field, or NULL for the basic types
+    SharedTrackerElement (*builder)(GlobalRegistry *);
+};
+
+template<class T>
+struct tracker_field_desc {
+    tracker_field_def def;
+    // Given a new or imported instance in reserve_fields, or NULL
+    SharedTrackerElement T::*dest;
+    // Given the field id, or NULL
+    int T::*id_dest;
+};
+
+template<class B>
+SharedTrackerElement tracker_field_builder(GlobalRegistry *in_globalreg) {
+    return SharedTrackerElement(new B(in_globalreg, 0));
+}
+
+// Field assigned during reserve_fields (class, name, type, description, class var)
+#define __TrackerField(cls, name, type, desc, cvar) \
+    { { name, type, desc, NULL }, &cls::cvar, NULL }
+
+// Field which is only registered, as RegisterField without a destination
+// (class, name, type, description, class id var)
+#define __TrackerFieldId(cls, name, type, desc, idvar) \
+    { { name, type, desc, NULL }, NULL, &cls::idvar }
+
+// Complex field built by the component itself, as RegisterComplexField
+// (class, builder type, name, description, class id var)
+#define __TrackerComplexField(cls, btype, name, desc, idvar) \
+    { { name, TrackerMap, desc, &tracker_field_builder< btype > }, NULL, &cls::idvar }
+
+// Descriptors of a component and their ids, once resolved
+template<class T>
+class tracker_field_table {
+public:
+    template<size_t N>
+    tracker_field_table(const tracker_field_desc<T> (&in_desc)[N]) :
+        desc(in_desc), num_desc(N) { }
+
+    const tracker_field_desc<T> *desc;
+    size_t num_desc;
+
+    std::once_flag resolve_once;
+
+    // Filled in on the first use, then read only
+    std::vector<int> ids;
+    std::vector<SharedTrackerElement> builders;
+};
 
 // Complex trackable unit based on trackertype dataunion.
 //
@@ -968,10 +1339,11 @@ class tracker_component : public TrackerElement {
         return (shared_ptr<TrackerElement>) cvar; \
     } \
     virtual rtype get_##name() const { \
-        return (rtype) GetTrackerValue<ptype>(cvar); \
+        return (rtype) tracker_fast_access<ptype>::get(cvar); \
     } \
     virtual void set_##name(itype in) { \
-        cvar->set((ptype) in); \
+        tracker_fast_access<ptype>::set(cvar, (ptype) in); \
+        mod_version++; \
     }
 
 // Ugly trackercomponent macro for proxying trackerelement values
@@ -988,26 +1360,42 @@ class tracker_component : public TrackerElement {
         return (shared_ptr<TrackerElement>) cvar; \
     } \
     virtual rtype get_##name() const { \
-        return (rtype) GetTrackerValue<ptype>(cvar); \
+        return (rtype) tracker_fast_access<ptype>::get(cvar); \
     } \
     virtual bool set_##name(itype in) { \
-        cvar->set((ptype) in); \
+        tracker_fast_access<ptype>::set(cvar, (ptype) in); \
+        mod_version++; \
         return lambda(in); \
     } \
     virtual void set_only_##name(itype in) { \
-        cvar->set((ptype) in); \
+        tracker_fast_access<ptype>::set(cvar, (ptype) in); \
+        mod_version++; \
+    }
+
+// Proxy a string trackerelement whose values are interned, as __Proxy
+#define __ProxyInterned(name, cvar) \
+    virtual shared_ptr<TrackerElement> get_tracker_##name() { \
+        return (shared_ptr<TrackerElement>) cvar; \
+    } \
+    virtual string get_##name() const { \
+        return GetTrackerValue<string>(cvar); \
+    } \
+    virtual void set_##name(string in) { \
+        cvar->set_interned(in); \
+        mod_version++; \
     }
 
 // Only proxy a Get function
 #define __ProxyGet(name, ptype, rtype, cvar) \
     virtual rtype get_##name() { \
-        return (rtype) GetTrackerValue<ptype>(cvar); \
+        return (rtype) tracker_fast_access<ptype>::get(cvar); \
     } 
 
 // Only proxy a Set function for overload
 #define __ProxySet(name, ptype, stype, cvar) \
     virtual void set_##name(stype in) { \
-        cvar->set((ptype) in); \
+        tracker_fast_access<ptype>::set(cvar, (ptype) in); \
+        mod_version++; \
     } 
 
 // Proxy a split public/private get/set function; This is even funkier than the 
@@ -1015,36 +1403,43 @@ class tracker_component : public TrackerElement {
 #define __ProxyPrivSplit(name, ptype, itype, rtype, cvar) \
     public: \
     virtual rtype get_##name() { \
-        return (rtype) GetTrackerValue<ptype>(cvar); \
+        return (rtype) tracker_fast_access<ptype>::get(cvar); \
     } \
     protected: \
     virtual void set_int_##name(itype in) { \
-        cvar->set((ptype) in); \
+        tracker_fast_access<ptype>::set(cvar, (ptype) in); \
+        mod_version++; \
     } \
     public:
 
 // Proxy increment and decrement functions
 #define __ProxyIncDec(name, ptype, rtype, cvar) \
     virtual void inc_##name() { \
-        (*cvar)++; \
+        tracker_fast_access<ptype>::ref(cvar)++; \
+        mod_version++; \
     } \
     virtual void inc_##name(rtype i) { \
-        (*cvar) += (ptype) i; \
+        tracker_fast_access<ptype>::ref(cvar) += (ptype) i; \
+        mod_version++; \
     } \
     virtual void dec_##name() { \
-        (*cvar)--; \
+        tracker_fast_access<ptype>::ref(cvar)--; \
+        mod_version++; \
     } \
     virtual void dec_##name(rtype i) { \
-        (*cvar) -= (ptype) i; \
+        tracker_fast_access<ptype>::ref(cvar) -= (ptype) i; \
+        mod_version++; \
     }
 
 // Proxy add/subtract
 #define __ProxyAddSub(name, ptype, itype, cvar) \
     virtual void add_##name(itype i) { \
-        (*cvar) += (ptype) i; \
+        tracker_fast_access<ptype>::ref(cvar) += (ptype) i; \
+        mod_version++; \
     } \
     virtual void sub_##name(itype i) { \
-        (*cvar) -= (ptype) i; \
+        tracker_fast_access<ptype>::ref(cvar) -= (ptype) i; \
+        mod_version++; \
     }
 
 // Proxy sub-trackable (name, trackable type, class variable)
@@ -1056,6 +1451,7 @@ class tracker_component : public TrackerElement {
         cvar = in; \
         if (cvar != NULL) \
             add_map(static_pointer_cast<TrackerElement>(cvar)); \
+        mod_version++; \
     }  \
     virtual shared_ptr<TrackerElement> get_tracker_##name() { \
         return static_pointer_cast<TrackerElement>(cvar); \
@@ -1073,6 +1469,7 @@ class tracker_component : public TrackerElement {
         cvar = in; \
         if (cvar != NULL) \
             add_map(static_pointer_cast<TrackerElement>(cvar)); \
+        mod_version++; \
         return lambda(in); \
     }  \
     virtual void set_only_##name(shared_ptr<ttype> in) { \
@@ -1100,6 +1497,7 @@ class tracker_component : public TrackerElement {
         cvar = in; \
         if (cvar != NULL) \
             add_map(static_pointer_cast<TrackerElement>(cvar)); \
+        mod_version++; \
     } \
     virtual shared_ptr<TrackerElement> get_tracker_##name() { \
         return static_pointer_cast<TrackerElement>(cvar); \
@@ -1108,13 +1506,15 @@ class tracker_component : public TrackerElement {
 // Proxy bitset functions (name, trackable type, data type, class var)
 #define __ProxyBitset(name, dtype, cvar) \
     virtual void bitset_##name(dtype bs) { \
-        (*cvar) |= bs; \
+        tracker_fast_access<dtype>::ref(cvar) |= bs; \
+        mod_version++; \
     } \
     virtual void bitclear_##name(dtype bs) { \
-        (*cvar) &= ~(bs); \
+        tracker_fast_access<dtype>::ref(cvar) &= ~(bs); \
+        mod_version++; \
     } \
     virtual dtype bitcheck_##name(dtype bs) { \
-        return (dtype) (GetTrackerValue<dtype>(cvar) & bs); \
+        return (dtype) (tracker_fast_access<dtype>::get(cvar) & bs); \
     }
 
 #define __RegisterComplexField(type, id, name, description) \
@@ -1146,6 +1546,19 @@ public:
     shared_ptr<TrackerElement> get_child_path(string in_path);
     shared_ptr<TrackerElement> get_child_path(std::vector<string> in_path);
 
+    // Modification counter, bumped by every proxied set on this component.  Only
+    // covers this component's own fields; a nested component keeps its own count,
+    // so owners which cache derived data (such as serialized output) must also
+    // bump it when they change nested records directly.  Only compare for
+    // equality; it is allowed to wrap.
+    uint32_t get_mod_version() const {
+        return mod_version;
+    }
+
+    void bump_mod_version() {
+        mod_version++;
+    }
+
 protected:
     // Reserve a field via the entrytracker, using standard entrytracker build methods.
     // This field will be automatically assigned or created during the reservefields 
@@ -1173,6 +1586,39 @@ protected:
     int RegisterComplexField(string in_name, shared_ptr<TrackerElement> in_builder, 
             string in_desc);
 
+    // Register the fields of a descriptor table, resolving it on the first use.
+    // Called from register_fields() in place of the individual registrations
+    template<class T>
+    void register_table_fields(tracker_field_table<T>& in_table) {
+        std::call_once(in_table.resolve_once, [this, &in_table]() {
+                std::vector<tracker_field_def> defs;
+
+                for (size_t i = 0; i < in_table.num_desc; i++)
+                    defs.push_back(in_table.desc[i].def);
+
+                resolve_field_defs(defs, in_table.ids, in_table.builders);
+            });
+
+        T *self = static_cast<T *>(this);
+
+        registered_fields.reserve(registered_fields.size() + in_table.num_desc);
+
+        for (size_t i = 0; i < in_table.num_desc; i++) {
+            const tracker_field_desc<T>& d = in_table.desc[i];
+
+            if (d.id_dest != NULL)
+                self->*(d.id_dest) = in_table.ids[i];
+
+            if (d.dest != NULL)
+                registered_fields.push_back(registered_field(in_table.ids[i], 
+                            &(self->*(d.dest)), d.def.type, in_table.builders[i].get()));
+        }
+    }
+
+    // Register table fields with the entrytracker, returning their ids and builders
+    void resolve_field_defs(const std::vector<tracker_field_def>& in_defs,
+            std::vector<int>& out_ids, std::vector<SharedTrackerElement>& out_builders);
+
     // Register field types and get a field ID.  Called during record creation, prior to 
     // assigning an existing trackerelement tree or creating a new one
     virtual void register_fields() { }
@@ -1195,16 +1641,41 @@ protected:
             registered_field(int id, shared_ptr<TrackerElement> *assign) { 
                 this->id = id; 
                 this->assign = assign;
+                this->resolved = false;
+                this->type = TrackerUnassigned;
+                this->builder = NULL;
+            }
+
+            // Field from a resolved table, built without the entrytracker
+            registered_field(int id, shared_ptr<TrackerElement> *assign, 
+                    TrackerType type, TrackerElement *builder) {
+                this->id = id;
+                this->assign = assign;
+                this->resolved = true;
+                this->type = type;
+                this->builder = builder;
             }
 
             int id;
             shared_ptr<TrackerElement> *assign;
+
+            bool resolved;
+            TrackerType type;
+            // Owned by the table
+            TrackerElement *builder;
     };
 
+    // As import_or_new, for a registered field
+    shared_ptr<TrackerElement> 
+        import_or_new(shared_ptr<TrackerElement> e, const registered_field& rf);
+
     GlobalRegistry *globalreg;
     shared_ptr<EntryTracker> entrytracker;
 
-    vector<registered_field *> registered_fields;
+    // Held by value; every component instance has one per field
+    vector<registered_field> registered_fields;
+
+    uint32_t mod_version;
 };
 
 class TrackerElementSummary;
@@ -1245,23 +1716,42 @@ public:
         globalreg = in_globalreg;
     }
 
-    typedef map<SharedTrackerElement, SharedElementSummary> rename_map;
+    // Keyed by the element itself; the value comparison operator< on
+    // SharedTrackerElement treats unrelated fields as the same key
+    typedef map<SharedTrackerElement, SharedElementSummary,
+            std::owner_less<SharedTrackerElement> > rename_map;
+
+    // Previously serialized output for elements which have not changed; a
+    // serializer which finds an element in the cache map writes the cached bytes
+    // verbatim instead of walking it.  The bytes must have been produced by the
+    // same serializer.
+    typedef map<TrackerElement *, shared_ptr<string> > serial_cache_map;
 
     virtual ~TrackerElementSerializer() {
         local_locker lock(&mutex);
     }
     virtual void serialize(shared_ptr<TrackerElement> in_elem, 
-            std::ostream &stream, rename_map *name_map = NULL) = 0;
+            std::ostream &stream, rename_map *name_map = NULL,
+            serial_cache_map *cache_map = NULL) = 0;
 
     // Fields extracted from a summary path need to preserialize their parent
     // paths or updates may not happen in the expected fashion, serializers should
     // call this when necessary
     static void pre_serialize_path(SharedElementSummary in_summary);
+    static void post_serialize_path(SharedElementSummary in_summary);
 protected:
     GlobalRegistry *globalreg;
     std::recursive_timed_mutex mutex;
 };
 
+// Resolve a path of field names to field ids once, so that it can be walked
+// for many elements without looking up the names each time.  An unknown
+// field resolves to -1, which matches nothing.
+std::vector<int> CompileTrackerElementPath(string in_path,
+        shared_ptr<EntryTracker> entrytracker);
+std::vector<int> CompileTrackerElementPath(const std::vector<string>& in_path,
+        shared_ptr<EntryTracker> entrytracker);
+
 // Get an element using path semantics
 // Full string path
 shared_ptr<TrackerElement> GetTrackerElementPath(string in_path, 
@@ -1272,8 +1762,8 @@ shared_ptr<TrackerElement> GetTrackerElementPath(std::vector<string> in_path,
         SharedTrackerElement elem,
         shared_ptr<EntryTracker> entrytracker);
 // Resolved field ID path
-shared_ptr<TrackerElement> GetTrackerElementPath(std::vector<int> in_path, 
-        SharedTrackerElement elem);
+shared_ptr<TrackerElement> GetTrackerElementPath(const std::vector<int>& in_path, 
+        const SharedTrackerElement& elem);
 
 // Get a list of elements from a complex path which may include vectors
 // or key maps.  Returns a vector of all elements within that map.
@@ -1289,15 +1779,15 @@ std::vector<SharedTrackerElement> GetTrackerElementMultiPath(std::vector<string>
         SharedTrackerElement elem,
         shared_ptr<EntryTracker> entrytracker);
 // Resolved field ID path
-std::vector<SharedTrackerElement> GetTrackerElementMultiPath(std::vector<int> in_path, 
+std::vector<SharedTrackerElement> GetTrackerElementMultiPath(const std::vector<int>& in_path, 
         SharedTrackerElement elem);
 
 // Summarize a complex record using a collection of summary elements.  The summarized
 // element is returned in ret_elem, and the rename mapping for serialization is
 // completed in rename.
-void SummarizeTrackerElement(shared_ptr<EntryTracker> entrytracker,
-        SharedTrackerElement in, 
-        vector<SharedElementSummary> in_summarization, 
+void SummarizeTrackerElement(const shared_ptr<EntryTracker>& entrytracker,
+        const SharedTrackerElement& in, 
+        const vector<SharedElementSummary>& in_summarization, 
         SharedTrackerElement &ret_elem, 
         TrackerElementSerializer::rename_map &rename_map);
 
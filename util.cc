@@ -27,6 +27,20 @@
 #include <math.h>
 #include <string.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#if defined(__aarch64__) && defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
 #ifdef HAVE_LIBUTIL_H
 # include <libutil.h>
 #endif /* HAVE_LIBUTIL_H */
@@ -64,28 +78,167 @@
 #include <stdexcept>
 
 #include "packet.h"
+#include "kis_adler32.h"
+
+// Length of the run of printable (32 to 126) bytes at the start of a buffer, or
+// with in_printable false the run of non-printable bytes.  Printable text is
+// tested 16 bytes at a time where the platform always has the vector unit
+// (SSE2 on x86-64, NEON on aarch64), and a byte at a time otherwise
+static size_t printable_span(const unsigned char *in_data, size_t in_len,
+        bool in_printable) {
+    size_t off = 0;
+
+#if defined(__SSE2__)
+    // Bias to signed so a single signed compare tests each end of the range
+    const __m128i bias = _mm_set1_epi8((char) 0x80);
+    const __m128i lo = _mm_set1_epi8((char) (31 ^ 0x80));
+    const __m128i hi = _mm_set1_epi8((char) (127 ^ 0x80));
+
+    while (off + 16 <= in_len) {
+        __m128i v =
+            _mm_xor_si128(_mm_loadu_si128((const __m128i *) (in_data + off)), bias);
+        __m128i p = _mm_and_si128(_mm_cmpgt_epi8(v, lo), _mm_cmplt_epi8(v, hi));
+
+        unsigned int mask = (unsigned int) _mm_movemask_epi8(p);
+
+        if (!in_printable)
+            mask = ~mask & 0xFFFF;
+
+        if (mask != 0xFFFF)
+            return off + __builtin_ctz(~mask);
+
+        off += 16;
+    }
+#elif defined(__aarch64__)
+    const uint8x16_t lo = vdupq_n_u8(32);
+    const uint8x16_t hi = vdupq_n_u8(126);
+
+    while (off + 16 <= in_len) {
+        uint8x16_t v = vld1q_u8(in_data + off);
+        uint8x16_t p = vandq_u8(vcgeq_u8(v, lo), vcleq_u8(v, hi));
+
+        if (!in_printable)
+            p = vmvnq_u8(p);
+
+        // Leave finding the byte which ends the run to the loop below
+        if (vminvq_u8(p) != 0xFF)
+            break;
+
+        off += 16;
+    }
+#endif
+
+    for (; off < in_len; off++) {
+        bool p = in_data[off] >= 32 && in_data[off] <= 126;
+
+        if (p != in_printable)
+            break;
+    }
+
+    return off;
+}
+
+void FindPrintableRuns(const uint8_t *in_data, size_t in_len, size_t in_min,
+        vector<printable_run>& ret_runs) {
+    size_t off = 0;
+
+    if (in_min == 0)
+        in_min = 1;
+
+    while (off < in_len) {
+        size_t run = printable_span(in_data + off, in_len - off, true);
+
+        if (run >= in_min)
+            ret_runs.push_back(printable_run(off, run));
+
+        off += run;
+
+        if (off >= in_len)
+            break;
+
+        off += printable_span(in_data + off, in_len - off, false);
+    }
+}
+
+// Escape a non-printable byte as \ooo into a buffer of at least 4
+static inline void munge_escape(unsigned char in_c, char *ret_buf) {
+    ret_buf[0] = '\\';
+    ret_buf[1] = ((in_c >> 6) & 0x03) + '0';
+    ret_buf[2] = ((in_c >> 3) & 0x07) + '0';
+    ret_buf[3] = ((in_c >> 0) & 0x07) + '0';
+}
 
 // Munge text down to printable characters only.  Simpler, cleaner munger than
 // before (and more blatant when munging)
 string MungeToPrintable(const char *in_data, unsigned int max, int nullterm) {
-	string ret;
-	unsigned int i;
-
-	for (i = 0; i < max; i++) {
-		if ((unsigned char) in_data[i] == 0 && nullterm == 1)
-			return ret;
-
-		if ((unsigned char) in_data[i] >= 32 && (unsigned char) in_data[i] <= 126) {
-			ret += in_data[i];
-		} else {
-			ret += '\\';
-			ret += ((in_data[i] >> 6) & 0x03) + '0';
-			ret += ((in_data[i] >> 3) & 0x07) + '0';
-			ret += ((in_data[i] >> 0) & 0x07) + '0';
-		}
-	}
+    const unsigned char *data = (const unsigned char *) in_data;
+    string ret;
+    unsigned int i = 0;
 
-	return ret;
+    ret.reserve(max);
+
+    while (i < max) {
+        // Printable text is copied a run at a time
+        size_t run = printable_span(data + i, max - i, true);
+
+        ret.append(in_data + i, run);
+        i += run;
+
+        if (i >= max)
+            break;
+
+        if (data[i] == 0 && nullterm == 1)
+            return ret;
+
+        char esc[4];
+        munge_escape(data[i], esc);
+        ret.append(esc, 4);
+        i++;
+    }
+
+    return ret;
+}
+
+size_t MungeToPrintable(const char *in_data, unsigned int max, int nullterm,
+        char *ret_buf, size_t in_buf_sz) {
+    const unsigned char *data = (const unsigned char *) in_data;
+    unsigned int i = 0;
+    size_t pos = 0;
+
+    if (in_buf_sz == 0)
+        return 0;
+
+    // Leave room for the terminator
+    size_t room = in_buf_sz - 1;
+
+    while (i < max && pos < room) {
+        size_t run = printable_span(data + i, max - i, true);
+
+        if (run > room - pos)
+            run = room - pos;
+
+        memcpy(ret_buf + pos, in_data + i, run);
+        pos += run;
+        i += run;
+
+        if (i >= max || pos >= room)
+            break;
+
+        if (data[i] == 0 && nullterm == 1)
+            break;
+
+        // Never write half an escape
+        if (room - pos < 4)
+            break;
+
+        munge_escape(data[i], ret_buf + pos);
+        pos += 4;
+        i++;
+    }
+
+    ret_buf[pos] = 0;
+
+    return pos;
 }
 
 string MungeToPrintable(string in_str) {
@@ -340,6 +493,26 @@ vector<string> StrTokenize(string in_str, string in_split, int return_partial) {
     return ret;
 }
 
+void StrTokenizeView(const kis_strview& in_str, char in_split, kis_strview_vec& ret_tokens,
+        int return_partial) {
+    size_t begin = 0;
+    size_t end = in_str.find(in_split);
+
+    ret_tokens.clear();
+
+    if (in_str.length() == 0)
+        return;
+
+    while (end != string::npos) {
+        ret_tokens.push_back(in_str.substr(begin, end - begin));
+        begin = end + 1;
+        end = in_str.find(in_split, begin);
+    }
+
+    if (return_partial && begin != in_str.size())
+        ret_tokens.push_back(in_str.substr(begin, in_str.size() - begin));
+}
+
 string StrJoin(vector<string> in_content, string in_delim, bool in_first) {
     ostringstream ostr;
 
@@ -415,7 +588,8 @@ int FetchOptBoolean(string in_key, vector<opt_pair> *in_vec, int dvalue) {
 }
 
 // Quick fetch of strings from a map of options
-string FetchOpt(string in_key, map<string, string> in_map, string dvalue) {
+string FetchOpt(const string& in_key, const map<string, string>& in_map,
+        const string& dvalue) {
     auto i = in_map.find(in_key);
 
     if (i == in_map.end())
@@ -424,7 +598,8 @@ string FetchOpt(string in_key, map<string, string> in_map, string dvalue) {
     return i->second;
 }
 
-int FetchOptBoolean(string in_key, map<string, string> in_map, int dvalue) {
+int FetchOptBoolean(const string& in_key, const map<string, string>& in_map,
+        int dvalue) {
     auto i = in_map.find(in_key);
 
     if (i == in_map.end())
@@ -658,27 +833,7 @@ int FetchSysLoadAvg(uint8_t *in_avgmaj, uint8_t *in_avgmin) {
 
 uint32_t Adler32IncrementalChecksum(const char *in_buf, size_t in_len,
         uint32_t *s1, uint32_t *s2) {
-    size_t i;
-    const uint8_t *buf = (const uint8_t *) in_buf;
-    int CHAR_OFFSET = 0;
-
-    if (in_len < 4)
-        return 0;
-
-    for (i = 0; i < (in_len - 4); i += 4) {
-        *s2 += 4 * (*s1 + buf[i]) + 3 * buf[i + 1] + 
-            2 * buf[i+2] + buf[i + 3] + 
-            10 * CHAR_OFFSET;
-        *s1 += (buf[i + 0] + buf[i + 1] + buf[i + 2] + 
-                buf[i + 3] + 4 * CHAR_OFFSET); 
-    }
-
-    for (; i < in_len; i++) {
-        *s1 += (buf[i] + CHAR_OFFSET); 
-        *s2 += *s1;
-    }
-
-    return (*s1 & 0xffff) + (*s2 << 16);
+    return kis_adler32_partial((const uint8_t *) in_buf, in_len, s1, s2);
 }
 
 uint32_t Adler32Checksum(const char *in_buf, size_t in_len) {
@@ -823,8 +978,8 @@ void crc32_init_table_80211(unsigned int *crc32_table) {
 	}
 }
 
-unsigned int crc32_le_80211(unsigned int *crc32_table, const unsigned char *buf, 
-							int len) {
+unsigned int crc32_le_80211_table(unsigned int *crc32_table, 
+        const unsigned char *buf, int len) {
 	int i;
 	unsigned int crc = 0xFFFFFFFF;
 
@@ -837,6 +992,212 @@ unsigned int crc32_le_80211(unsigned int *crc32_table, const unsigned char *buf,
 	return crc;
 }
 
+// Slice-by-8 tables; table[0] is the standard byte table and table[n] advances
+// a byte through n more bytes of zeros
+struct crc32_80211_slice_tables {
+    uint32_t t[8][256];
+
+    crc32_80211_slice_tables() {
+        crc32_init_table_80211(t[0]);
+
+        for (unsigned int i = 0; i < 256; i++) {
+            for (unsigned int s = 1; s < 8; s++) 
+                t[s][i] = (t[s - 1][i] >> 8) ^ t[0][t[s - 1][i] & 0xFF];
+        }
+    }
+};
+
+static const crc32_80211_slice_tables& crc32_80211_slices() {
+    static crc32_80211_slice_tables tables;
+    return tables;
+}
+
+// Raw CRC state update, without the initial and final inversion
+static uint32_t crc32_80211_slice8(uint32_t crc, const unsigned char *buf, size_t len) {
+    const crc32_80211_slice_tables& st = crc32_80211_slices();
+
+    while (len >= 8) {
+        // Assembled bytewise so the result doesn't depend on host endian
+        uint32_t one = crc ^ ((uint32_t) buf[0] | ((uint32_t) buf[1] << 8) |
+                ((uint32_t) buf[2] << 16) | ((uint32_t) buf[3] << 24));
+        uint32_t two = (uint32_t) buf[4] | ((uint32_t) buf[5] << 8) |
+                ((uint32_t) buf[6] << 16) | ((uint32_t) buf[7] << 24);
+
+        crc = st.t[7][one & 0xFF] ^ st.t[6][(one >> 8) & 0xFF] ^
+            st.t[5][(one >> 16) & 0xFF] ^ st.t[4][one >> 24] ^
+            st.t[3][two & 0xFF] ^ st.t[2][(two >> 8) & 0xFF] ^
+            st.t[1][(two >> 16) & 0xFF] ^ st.t[0][two >> 24];
+
+        buf += 8;
+        len -= 8;
+    }
+
+    while (len--) 
+        crc = (crc >> 8) ^ st.t[0][(crc ^ *buf++) & 0xFF];
+
+    return crc;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Carry-less multiply folding for the 802.3 polynomial, per the Intel paper
+// "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction".
+// Folds 64 bytes at a time, then 16, and leaves the tail to slice-by-8.
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_80211_pclmul(uint32_t crc, const unsigned char *buf, size_t len) {
+    if (len < 64)
+        return crc32_80211_slice8(crc, buf, len);
+
+    // Bit-reflected folding constants and the Barrett reduction constants
+    static const uint64_t __attribute__((aligned(16))) k1k2[] = { 0x0154442bd4, 0x01c6e41596 };
+    static const uint64_t __attribute__((aligned(16))) k3k4[] = { 0x01751997d0, 0x00ccaa009e };
+    static const uint64_t __attribute__((aligned(16))) k5k0[] = { 0x0163cd6124, 0x0000000000 };
+    static const uint64_t __attribute__((aligned(16))) poly[] = { 0x01db710641, 0x01f7011641 };
+
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    x1 = _mm_loadu_si128((const __m128i *) (buf + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *) (buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *) (buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *) (buf + 0x30));
+
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+
+    x0 = _mm_load_si128((const __m128i *) k1k2);
+
+    buf += 64;
+    len -= 64;
+
+    // Fold 4 lanes in parallel
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+        y5 = _mm_loadu_si128((const __m128i *) (buf + 0x00));
+        y6 = _mm_loadu_si128((const __m128i *) (buf + 0x10));
+        y7 = _mm_loadu_si128((const __m128i *) (buf + 0x20));
+        y8 = _mm_loadu_si128((const __m128i *) (buf + 0x30));
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+
+        buf += 64;
+        len -= 64;
+    }
+
+    // Fold the lanes into one
+    x0 = _mm_load_si128((const __m128i *) k3k4);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    // Remaining 16 byte blocks
+    while (len >= 16) {
+        x2 = _mm_loadu_si128((const __m128i *) buf);
+
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+        buf += 16;
+        len -= 16;
+    }
+
+    // 128 to 64 bits
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+
+    x0 = _mm_loadl_epi64((const __m128i *) k5k0);
+
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits
+    x0 = _mm_load_si128((const __m128i *) poly);
+
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    crc = (uint32_t) _mm_extract_epi32(x1, 1);
+
+    return crc32_80211_slice8(crc, buf, len);
+}
+#endif
+
+#if defined(__aarch64__) && defined(__linux__)
+// ARMv8 CRC32 instructions use the 802.3 polynomial directly
+static uint32_t crc32_80211_armv8(uint32_t crc, const unsigned char *buf, size_t len) {
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, buf, 8);
+        __asm__(".arch_extension crc\n\tcrc32x %w0, %w0, %x1" : "+r"(crc) : "r"(v));
+        buf += 8;
+        len -= 8;
+    }
+
+    while (len--) {
+        uint32_t v = *buf++;
+        __asm__(".arch_extension crc\n\tcrc32b %w0, %w0, %w1" : "+r"(crc) : "r"(v));
+    }
+
+    return crc;
+}
+#endif
+
+typedef uint32_t (*crc32_80211_fn)(uint32_t, const unsigned char *, size_t);
+
+// Pick the fastest implementation the CPU supports
+static crc32_80211_fn crc32_80211_select() {
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax, ebx, ecx, edx;
+
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_PCLMUL) && 
+            (ecx & bit_SSE4_1))
+        return crc32_80211_pclmul;
+#endif
+
+#if defined(__aarch64__) && defined(__linux__)
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32)
+        return crc32_80211_armv8;
+#endif
+
+    return crc32_80211_slice8;
+}
+
+unsigned int crc32_le_80211(unsigned int *crc32_table __attribute__((unused)), 
+        const unsigned char *buf, int len) {
+    static const crc32_80211_fn crc_fn = crc32_80211_select();
+
+    if (len <= 0)
+        return 0;
+
+    return crc_fn(0xFFFFFFFF, buf, len) ^ 0xFFFFFFFF;
+}
+
 void SubtractTimeval(struct timeval *in_tv1, struct timeval *in_tv2,
 					 struct timeval *out_tv) {
 	if (in_tv1->tv_sec < in_tv2->tv_sec ||
@@ -1028,6 +1389,41 @@ int GetLengthTagOffsets(unsigned int init_offset,
     return 0;
 }
 
+int kis_tag_index::Index(unsigned int init_offset, kis_datachunk *in_chunk) {
+    unsigned int cur_offset = init_offset;
+    uint8_t cur_tag;
+    uint8_t len;
+
+    memset(first, 0, sizeof(first));
+    num_overflow = 0;
+    overflow_dropped = false;
+
+    if (init_offset >= in_chunk->length)
+        return -1;
+
+    while (cur_offset + 2 < in_chunk->length) {
+        cur_tag = in_chunk->data[cur_offset];
+        len = in_chunk->data[cur_offset + 1];
+
+        if ((cur_offset + len + 2) > in_chunk->length)
+            return -1;
+
+        if (first[cur_tag] == 0) {
+            first[cur_tag] = cur_offset + 1;
+        } else if (num_overflow < KIS_TAG_INDEX_OVERFLOW) {
+            overflow[num_overflow].tag = cur_tag;
+            overflow[num_overflow].offset = cur_offset + 1;
+            num_overflow++;
+        } else {
+            overflow_dropped = true;
+        }
+
+        cur_offset += len + 2;
+    }
+
+    return 0;
+}
+
 std::string MultiReplaceAll(std::string in, std::string match, 
         std::string repl) {
     for (size_t pos = 0; (pos = in.find(match, pos)) != std::string::npos;
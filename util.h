@@ -55,6 +55,8 @@
 
 #include <pthread.h> 
 
+#include "kis_lockprof.h"
+
 // ieee float struct for a 64bit float for serialization
 typedef struct {
 	uint64_t mantissa:52 __attribute__ ((packed));
@@ -81,6 +83,26 @@ typedef struct {
 string MungeToPrintable(const char *in_data, unsigned int max, int nullterm);
 string MungeToPrintable(string in_str);
 
+// Munge without allocating, into a buffer of in_buf_sz bytes (4 * max + 1 always
+// fits the whole input); the output is always terminated, is cut short rather
+// than splitting an escape, and its length is returned
+size_t MungeToPrintable(const char *in_data, unsigned int max, int nullterm,
+        char *ret_buf, size_t in_buf_sz);
+
+// Find the runs of at least in_min printable characters in a buffer, the way
+// strings(1) does; runs are appended to ret_runs, which can be reused between
+// frames to avoid allocating
+struct printable_run {
+    printable_run(size_t in_offset, size_t in_length) :
+        offset(in_offset), length(in_length) { }
+
+    size_t offset;
+    size_t length;
+};
+
+void FindPrintableRuns(const uint8_t *in_data, size_t in_len, size_t in_min,
+        vector<printable_run>& ret_runs);
+
 string StrLower(string in_str);
 string StrUpper(string in_str);
 string StrStrip(string in_str);
@@ -136,8 +158,10 @@ int FetchOptBoolean(string in_key, vector<opt_pair> *in_vec, int dvalue);
 vector<string> FetchOptVec(string in_key, vector<opt_pair> *in_vec);
 
 // Quick fetch of strings from a map of options
-string FetchOpt(string in_key, map<string, string> in_map, string dvalue = "");
-int FetchOptBoolean(string in_key, map<string, string> in_map, int dvalue = 0);
+string FetchOpt(const string& in_key, const map<string, string>& in_map,
+        const string& dvalue = "");
+int FetchOptBoolean(const string& in_key, const map<string, string>& in_map,
+        int dvalue = 0);
 
 int StringToOpts(string in_line, string in_sep, vector<opt_pair> *in_vec);
 void AddOptToOpts(string opt, string val, vector<opt_pair> *in_vec);
@@ -157,6 +181,126 @@ int XtoI(char x);
 int Hex2UChar(unsigned char *in_hex, unsigned char *in_chr);
 
 vector<string> StrTokenize(string in_str, string in_split, int return_partial = 1);
+
+// A view of part of a string, which doesn't own or copy what it points to;
+// the string it was made from has to outlive it
+class kis_strview {
+public:
+    kis_strview() : ptr(""), len(0) { }
+    kis_strview(const char *in_str) : ptr(in_str), len(strlen(in_str)) { }
+    kis_strview(const char *in_str, size_t in_len) : ptr(in_str), len(in_len) { }
+    kis_strview(const string& in_str) : ptr(in_str.data()), len(in_str.length()) { }
+
+    const char *data() const { return ptr; }
+    size_t size() const { return len; }
+    size_t length() const { return len; }
+    bool empty() const { return len == 0; }
+
+    char operator[](size_t in_pos) const { return ptr[in_pos]; }
+
+    kis_strview substr(size_t in_pos, size_t in_len = string::npos) const {
+        if (in_pos > len)
+            in_pos = len;
+        if (in_len > len - in_pos)
+            in_len = len - in_pos;
+        return kis_strview(ptr + in_pos, in_len);
+    }
+
+    size_t find(char in_c, size_t in_pos = 0) const {
+        for (size_t i = in_pos; i < len; i++)
+            if (ptr[i] == in_c)
+                return i;
+        return string::npos;
+    }
+
+    size_t find_last_of(char in_c) const {
+        for (size_t i = len; i > 0; i--)
+            if (ptr[i - 1] == in_c)
+                return i - 1;
+        return string::npos;
+    }
+
+    int compare(const kis_strview& in_op) const {
+        int r = memcmp(ptr, in_op.ptr, len < in_op.len ? len : in_op.len);
+        if (r != 0)
+            return r;
+        return len < in_op.len ? -1 : (len > in_op.len ? 1 : 0);
+    }
+
+    bool operator==(const kis_strview& in_op) const {
+        return len == in_op.len && memcmp(ptr, in_op.ptr, len) == 0;
+    }
+    bool operator!=(const kis_strview& in_op) const { return !(*this == in_op); }
+    bool operator==(const char *in_op) const { return *this == kis_strview(in_op); }
+    bool operator!=(const char *in_op) const { return !(*this == in_op); }
+    bool operator==(const string& in_op) const { return *this == kis_strview(in_op); }
+    bool operator!=(const string& in_op) const { return !(*this == in_op); }
+    bool operator<(const kis_strview& in_op) const { return compare(in_op) < 0; }
+
+    // Copy out, when something really needs a string
+    string str() const { return string(ptr, len); }
+
+protected:
+    const char *ptr;
+    size_t len;
+};
+
+// Vector of views which keeps its first KIS_STRVIEW_VEC_INLINE entries inline,
+// so splitting a URL or a short option line doesn't allocate
+#define KIS_STRVIEW_VEC_INLINE      16
+
+class kis_strview_vec {
+public:
+    kis_strview_vec() : num(0) { }
+
+    size_t size() const { return num; }
+    bool empty() const { return num == 0; }
+
+    const kis_strview& operator[](size_t in_pos) const {
+        if (in_pos < KIS_STRVIEW_VEC_INLINE)
+            return inline_views[in_pos];
+        return overflow[in_pos - KIS_STRVIEW_VEC_INLINE];
+    }
+
+    void push_back(const kis_strview& in_view) {
+        if (num < KIS_STRVIEW_VEC_INLINE)
+            inline_views[num] = in_view;
+        else
+            overflow.push_back(in_view);
+        num++;
+    }
+
+    void pop_back() {
+        if (num == 0)
+            return;
+        if (num > KIS_STRVIEW_VEC_INLINE)
+            overflow.pop_back();
+        num--;
+    }
+
+    void clear() {
+        overflow.clear();
+        num = 0;
+    }
+
+    // Copy out a range as strings, for interfaces which still need them
+    vector<string> str_vec(size_t in_first = 0) const {
+        vector<string> ret;
+        for (size_t i = in_first; i < num; i++)
+            ret.push_back((*this)[i].str());
+        return ret;
+    }
+
+protected:
+    kis_strview inline_views[KIS_STRVIEW_VEC_INLINE];
+    vector<kis_strview> overflow;
+    size_t num;
+};
+
+// StrTokenize into views of the original string, split on a single character;
+// ret_tokens is cleared first
+void StrTokenizeView(const kis_strview& in_str, char in_split, kis_strview_vec& ret_tokens,
+        int return_partial = 1);
 string StrJoin(vector<string> in_content, string in_delim, bool in_first = false);
 
 // 'smart' tokenizeing with start/end positions
@@ -203,7 +347,7 @@ float Pair2Float(int16_t primary, int64_t mantissa);
 int FetchSysLoadAvg(uint8_t *in_avgmaj, uint8_t *in_avgmin);
 #endif
 
-// Adler-32 checksum, derived from rsync, adler-32
+// Adler-32 checksum, derived from rsync, adler-32; see kis_adler32.h
 uint32_t Adler32Checksum(const char *buf1, size_t len);
 
 // Adler-32 incremental checksum, performs a non-contiguous checksum over 
@@ -218,8 +362,14 @@ uint32_t Adler32IncrementalChecksum(const char *buf1, size_t len,
 unsigned int update_crc32_80211(unsigned int crc, const unsigned char *data,
 								int len, unsigned int poly);
 void crc32_init_table_80211(unsigned int *crc32_table);
+// Compute the FCS with the fastest method available on this CPU (PCLMULQDQ on
+// x86, the CRC32 instructions on ARMv8, otherwise slice-by-8); crc32_table is
+// no longer used, and is kept for existing callers
 unsigned int crc32_le_80211(unsigned int *crc32_table, const unsigned char *buf, 
 							int len);
+// Original byte-at-a-time table implementation
+unsigned int crc32_le_80211_table(unsigned int *crc32_table, 
+        const unsigned char *buf, int len);
 
 
 // Simple lexer for "advanced" filter stuff and other tools
@@ -268,44 +418,94 @@ int GetLengthTagOffsets(unsigned int init_offset,
 						kis_datachunk *in_chunk,
 						map<int, vector<int> > *tag_cache_map);
 
+// Index of the tags in a list of tag, length, value elements (such as 802.11
+// IE tags), built in one pass without allocating.  As with GetLengthTagOffsets,
+// offsets are of the length byte of each tag.
+//
+// The first instance of a tag is found directly; later instances of repeated
+// tags (such as the 221 vendor tags) go in a small overflow list, in order.
+// Repeats beyond the size of the list are not indexed.
+#define KIS_TAG_INDEX_OVERFLOW 128
+
+class kis_tag_index {
+public:
+    // Index the tags starting at init_offset.  Returns -1 if a tag runs past 
+    // the end of the data, like GetLengthTagOffsets
+    int Index(unsigned int init_offset, kis_datachunk *in_chunk);
+
+    bool has(uint8_t in_tag) const {
+        return first[in_tag] != 0;
+    }
+
+    // Offset of the nth instance of a tag, or 0 if there isn't one
+    unsigned int offset(uint8_t in_tag, unsigned int in_n = 0) const {
+        if (in_n == 0 || first[in_tag] == 0)
+            return first[in_tag];
+
+        for (unsigned int x = 0; x < num_overflow; x++) {
+            if (overflow[x].tag == in_tag && --in_n == 0)
+                return overflow[x].offset;
+        }
+
+        return 0;
+    }
+
+    // More repeated tags were seen than fit in the overflow list
+    bool overflowed() const {
+        return overflow_dropped;
+    }
+
+protected:
+    // Offset of the first instance of each tag; tag offsets are never 0
+    uint32_t first[256];
+
+    struct overflow_rec {
+        uint8_t tag;
+        uint32_t offset;
+    };
+
+    overflow_rec overflow[KIS_TAG_INDEX_OVERFLOW];
+    unsigned int num_overflow;
+    bool overflow_dropped;
+};
+
 // Act as a scoped locker on a mutex
 // If possible, use a timed lock and throw a system exception if we can't
 // acquire the mutex within 5 seconds, so that we crash instead of hanging
+//
+// With lock profiling enabled (see kis_lockprof.h) the wait and hold times are
+// recorded against the mutex and the file and line of the locker
 class local_locker {
 public:
-    local_locker(pthread_mutex_t *in) {
+    local_locker(pthread_mutex_t *in, const char *in_file = KIS_LOCK_SITE_FILE,
+            int in_line = KIS_LOCK_SITE_LINE) {
         cpplock = NULL;
         lock = in;
+        prof_rec = -1;
+        prof_file = in_file;
+        prof_line = in_line;
 
-#if defined(HAVE_PTHREAD_TIMELOCK) && !defined(DISABLE_MUTEX_TIMEOUT)
-        // Only use timeouts if a) they're supported and b) not disabled in configure
-        struct timespec t;
-
-        clock_gettime(CLOCK_REALTIME , &t); 
-        t.tv_sec += 5; 
+        // A NULL mutex makes this a no-op, for optionally locked objects
+        if (in == NULL)
+            return;
 
-        if (pthread_mutex_timedlock(in, &t) != 0) {
-            throw(std::runtime_error("deadlocked thread: mutex not available w/in 5 seconds"));
-        }
-#else
-        pthread_mutex_lock(in);
-#endif
+        acquire();
     }
 
-    local_locker(std::recursive_timed_mutex *in) {
+    local_locker(std::recursive_timed_mutex *in, const char *in_file = KIS_LOCK_SITE_FILE,
+            int in_line = KIS_LOCK_SITE_LINE) {
         lock = NULL;
         cpplock = in;
-       
-#ifdef DISABLE_MUTEX_TIMEOUT
-        cpplock->lock();
-#else
-        if (!cpplock->try_lock_for(std::chrono::seconds(5))) {
-            throw(std::runtime_error("deadlocked thread: mutex not available w/in 5 seconds"));
-        }
-#endif
+        prof_rec = -1;
+        prof_file = in_file;
+        prof_line = in_line;
+
+        acquire();
     }
 
     void unlock() {
+        release_profile();
+
         if (lock != NULL)
             pthread_mutex_unlock(lock);
         else if (cpplock != NULL)
@@ -313,6 +513,69 @@ public:
     }
 
     void relock() {
+        acquire();
+    }
+
+    ~local_locker() {
+        release_profile();
+
+        if (lock != NULL)
+            pthread_mutex_unlock(lock);
+        else if (cpplock != NULL)
+            cpplock->unlock();
+    }
+
+protected:
+    pthread_mutex_t *lock;
+    std::recursive_timed_mutex *cpplock;
+
+    // Profile record while the lock is held and profiled, otherwise -1
+    int prof_rec;
+    uint64_t prof_start;
+    const char *prof_file;
+    int prof_line;
+
+    void acquire() {
+        if (lock == NULL && cpplock == NULL)
+            return;
+
+        if (!LockProfiler::IsEnabled()) {
+            timed_lock();
+            return;
+        }
+
+        int rec = LockProfiler::FetchRecord(lock != NULL ? 
+                (const void *) lock : (const void *) cpplock);
+
+        uint64_t start = LockProfiler::Now();
+
+        bool contended;
+        
+        if (lock != NULL)
+            contended = pthread_mutex_trylock(lock) != 0;
+        else
+            contended = !cpplock->try_lock();
+
+        if (contended)
+            timed_lock();
+
+        prof_start = LockProfiler::Now();
+        prof_rec = rec;
+
+        LockProfiler::RecordAcquire(rec, contended, prof_start - start);
+    }
+
+    void release_profile() {
+        if (prof_rec < 0)
+            return;
+
+        LockProfiler::RecordRelease(prof_rec, prof_file, prof_line, 
+                LockProfiler::Now() - prof_start);
+
+        prof_rec = -1;
+    }
+
+    void timed_lock() {
         if (lock != NULL) {
 #if defined(HAVE_PTHREAD_TIMELOCK) && !defined(DISABLE_MUTEX_TIMEOUT)
             // Only use timeouts if a) they're supported and b) not disabled in configure
@@ -325,9 +588,8 @@ public:
                 throw(std::runtime_error("deadlocked thread: mutex not available w/in 5 seconds"));
             }
 #else
-            pthread_mutex_lock(in);
+            pthread_mutex_lock(lock);
 #endif
-
         } else if (cpplock != NULL) {
 #ifdef DISABLE_MUTEX_TIMEOUT
             cpplock->lock();
@@ -337,20 +599,8 @@ public:
             }
 #endif
         }
-
-    }
-
-    ~local_locker() {
-        if (lock != NULL)
-            pthread_mutex_unlock(lock);
-        else if (cpplock != NULL)
-            cpplock->unlock();
     }
 
-protected:
-    pthread_mutex_t *lock;
-    std::recursive_timed_mutex *cpplock;
-
 };
 
 // Act as a scoped locker on a mutex that never expires; used for performing
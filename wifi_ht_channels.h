@@ -45,6 +45,10 @@
 #define WIFI_OTHER_MASK     (0xFF000000)
 #define WIFI_OTHER_RESERVED (1 << 25)
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 typedef struct {
     unsigned int chan;
     double freq;
@@ -57,5 +61,9 @@ typedef struct {
 
 extern wifi_channel wifi_ht_channels[MAX_WIFI_HT_CHANNEL + 1];
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
 
@@ -25,6 +25,7 @@
 #include <vector>
 #include <algorithm>
 #include <string>
+#include <sstream>
 
 #include "util.h"
 #include "xmlserialize_adapter.h"
@@ -37,8 +38,89 @@ XmlserializeAdapter::~XmlserializeAdapter() {
     }
 }
 
-void XmlserializeAdapter::XmlSerialize(SharedTrackerElement v, 
+void XmlserializeAdapter::xml_writer::write_g(double v) {
+    char tmp[32];
+    int n = snprintf(tmp, sizeof(tmp), "%g", v);
+
+    if (n > 0)
+        write(tmp, n);
+}
+
+void XmlserializeAdapter::xml_writer::write_sanitized(const string& in_str,
+        bool in_attr) {
+    const char *s = in_str.data();
+    size_t l = in_str.length();
+
+    // Copy runs of characters which need no escaping in one go
+    size_t run = 0;
+
+    for (size_t i = 0; i < l; i++) {
+        char c = s[i];
+
+        if (c != '&' && c != '<' && c != '>' && (c != '"' || !in_attr))
+            continue;
+
+        write(s + run, i - run);
+        run = i + 1;
+
+        switch (c) {
+            case '&':
+                write("&amp;", 5);
+                break;
+            case '<':
+                write("&lt;", 4);
+                break;
+            case '>':
+                write("&gt;", 4);
+                break;
+            default:
+                write("&quot;", 6);
+                break;
+        }
+    }
+
+    write(s + run, l - run);
+}
+
+void XmlserializeAdapter::XmlSerialize(const SharedTrackerElement& v, 
         std::ostream &stream) {
+    xml_writer writer(stream);
+
+    XmlSerialize(v, writer);
+}
+
+XmlserializeAdapter::Xmladapter *XmlserializeAdapter::FetchAdapter(int in_id) {
+    if (in_id < 0)
+        return NULL;
+
+    if ((size_t) in_id >= id_resolved_vec.size()) {
+        id_adapter_vec.resize(in_id + 1, NULL);
+        id_resolved_vec.resize(in_id + 1, false);
+    }
+
+    if (id_resolved_vec[in_id])
+        return id_adapter_vec[in_id];
+
+    id_resolved_vec[in_id] = true;
+
+    string name = globalreg->entrytracker->GetFieldName(in_id);
+
+    map<string, Xmladapter *>::iterator mi = 
+        field_adapter_map.find(StrLower(name));
+
+    if (mi == field_adapter_map.end()) {
+        // Only reported the first time the field is seen
+        fprintf(stderr, "debug - xmlserialize no xml field for %s\n", name.c_str());
+        return NULL;
+    }
+
+    id_adapter_vec[in_id] = mi->second;
+
+    return mi->second;
+}
+
+void XmlserializeAdapter::XmlSerialize(const SharedTrackerElement& v, 
+        xml_writer &writer) {
 
     if (v == NULL)
         return;
@@ -60,70 +142,24 @@ void XmlserializeAdapter::XmlSerialize(SharedTrackerElement v,
     TrackerElement::tracked_double_map *tdoublemap;
     TrackerElement::double_map_iterator double_map_iter;
 
+    TrackerElement::tracked_small_int_map *tsmallintmap;
+    TrackerElement::small_int_map_iterator small_int_map_iter;
+
+    TrackerElement::tracked_small_double_map *tsmalldoublemap;
+    TrackerElement::small_double_map_iterator small_double_map_iter;
+
     TrackerElement::tracked_vector *tvec;
 
     unsigned int tvi;
 
-    string name = globalreg->entrytracker->GetFieldName(v->get_id());
-
-    map<string, Xmladapter *>::iterator mi = 
-        field_adapter_map.find(StrLower(name));
+    Xmladapter *adapter = FetchAdapter(v->get_id());
 
-    if (mi == field_adapter_map.end()) {
-        fprintf(stderr, "debug - xmlserialize no xml field for %s\n", name.c_str());
+    if (adapter == NULL) {
+        v->post_serialize();
         return;
     }
 
-    Xmladapter *adapter = mi->second;
-
-    string xsi;
-    string nstag;
-
-    if (adapter->local_namespace != "") {
-        nstag = adapter->local_namespace + string(":") + adapter->xml_entity;
-    } else {
-        nstag = adapter->xml_entity;
-    }
-
-    if (adapter->xml_xsi_type != "")
-        xsi += " xsi:type=\"" + adapter->xml_xsi_type + "\"";
-
-    stream << "<" << nstag << xsi;
-
-    if (adapter->namespace_location != "") {
-        stream << " xmlns:" << adapter->local_namespace << "=\"" 
-            << adapter->namespace_location << "\"";
-        // Automatically include the xsi definitions
-        stream << " xmlns:xs=\"http://www.w3.org/2001/XMLSchema\" "
-            << "xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\"";
-
-        stream << " xsi:schemaLocation=\"" << adapter->xsi_schema_location << "\"";
-    }
-    
-    stream << ">";
-
-    // Pack a schema tag if we need one
-    if (adapter->schema_import_vector.size() != 0) {
-        stream << "<xs:schema xmlns:xs=\"http://www.w3.org/2001/XMLSchema\""
-            << " xmlns=\"http://xmlns.myexample.com/version3\"";
-
-        for (unsigned int s = 0; s < adapter->schema_import_vector.size(); s++) {
-            Schemaimportlocation *sl = adapter->schema_import_vector[s];
-            stream << " xmlns:" 
-                << sl->ns << "=\"" << sl->nslocation << "\"";
-        }
-
-        stream << " targetNamespace=\"" << adapter->namespace_location << "\""
-            << " elementFormDefault=\"unqualified\""
-            << " attributeFromDefault=\"unqualified\">";
-        for (unsigned int s = 0; s < adapter->schema_import_vector.size(); s++) {
-            Schemaimportlocation *sl = adapter->schema_import_vector[s];
-
-            stream << "<xs:import namespace=\"" << sl->nslocation << "\"" <<
-                " schemaLocation=\"" << sl->url << "\" />";
-        }
-        stream << "</xs:schema>";
-    }
+    writer.write(adapter->open_tag);
 
     switch (v->get_type()) {
         case TrackerString:
@@ -139,19 +175,19 @@ void XmlserializeAdapter::XmlSerialize(SharedTrackerElement v,
         case TrackerDouble:
         case TrackerMac:
         case TrackerUuid:
-            StreamSimpleValue(v, stream);
+            WriteSimpleValue(v, writer, false);
             break;
         case TrackerVector:
             tvec = v->get_vector();
             for (tvi = 0; tvi < tvec->size(); tvi++) {
-                XmlSerialize((*tvec)[tvi], stream);
+                XmlSerialize((*tvec)[tvi], writer);
             }
             break;
         case TrackerMap:
             tmap = v->get_map();
             for (map_iter = tmap->begin(); map_iter != tmap->end(); 
                     ++map_iter) {
-                XmlSerialize(map_iter->second, stream);
+                XmlSerialize(map_iter->second, writer);
             }
             break;
         case TrackerIntMap:
@@ -162,12 +198,11 @@ void XmlserializeAdapter::XmlSerialize(SharedTrackerElement v,
                 // TODO be smarter
                 for (int_map_iter = tintmap->begin(); int_map_iter != tintmap->end(); 
                         ++int_map_iter) {
-                    stream << "<" << adapter->map_entry_element <<
-                        " " << adapter->map_key_attribute << "=\"" <<
-                        int_map_iter->first << "\" " <<
-                        adapter->map_value_attribute << "=\"";
-                    StreamSimpleValue(int_map_iter->second, stream);
-                    stream << "\" />";
+                    writer.write(adapter->map_entry_open);
+                    writer.write_int(int_map_iter->first);
+                    writer.write(adapter->map_entry_mid);
+                    WriteSimpleValue(int_map_iter->second, writer, true);
+                    writer.write(adapter->map_entry_close);
                 }
             }
             break;
@@ -178,12 +213,11 @@ void XmlserializeAdapter::XmlSerialize(SharedTrackerElement v,
                 // TODO be smarter
                 for (mac_map_iter = tmacmap->begin(); mac_map_iter != tmacmap->end(); 
                         ++mac_map_iter) {
-                    stream << "<" << adapter->map_entry_element <<
-                        " " << adapter->map_key_attribute << "=\"" <<
-                        mac_map_iter->first.MacFull2String() << "\" " <<
-                        adapter->map_value_attribute << "=\"";
-                    StreamSimpleValue(mac_map_iter->second, stream);
-                    stream << "\" />";
+                    writer.write(adapter->map_entry_open);
+                    writer.write(mac_map_iter->first.MacFull2String());
+                    writer.write(adapter->map_entry_mid);
+                    WriteSimpleValue(mac_map_iter->second, writer, true);
+                    writer.write(adapter->map_entry_close);
                 }
             }
             break;
@@ -195,12 +229,11 @@ void XmlserializeAdapter::XmlSerialize(SharedTrackerElement v,
                 for (string_map_iter = tstringmap->begin(); 
                         string_map_iter != tstringmap->end(); 
                         ++string_map_iter) {
-                    stream << "<" << adapter->map_entry_element <<
-                        " " << adapter->map_key_attribute << "=\"" <<
-                        string_map_iter->first << "\" " <<
-                        adapter->map_value_attribute << "=\"";
-                    StreamSimpleValue(string_map_iter->second, stream);
-                    stream << "\" />";
+                    writer.write(adapter->map_entry_open);
+                    writer.write_sanitized(string_map_iter->first, true);
+                    writer.write(adapter->map_entry_mid);
+                    WriteSimpleValue(string_map_iter->second, writer, true);
+                    writer.write(adapter->map_entry_close);
                 }
             }
             break;
@@ -212,12 +245,39 @@ void XmlserializeAdapter::XmlSerialize(SharedTrackerElement v,
                 for (double_map_iter = tdoublemap->begin(); 
                         double_map_iter != tdoublemap->end(); 
                         ++double_map_iter) {
-                    stream << "<" << adapter->map_entry_element <<
-                        " " << adapter->map_key_attribute << "=\"" <<
-                        double_map_iter->first << "\" " <<
-                        adapter->map_value_attribute << "=\"";
-                    StreamSimpleValue(double_map_iter->second, stream);
-                    stream << "\" />";
+                    writer.write(adapter->map_entry_open);
+                    writer.write_g(double_map_iter->first);
+                    writer.write(adapter->map_entry_mid);
+                    WriteSimpleValue(double_map_iter->second, writer, true);
+                    writer.write(adapter->map_entry_close);
+                }
+            }
+            break;
+        case TrackerSmallIntMap:
+            tsmallintmap = v->get_smallintmap();
+            if (adapter->map_entries) {
+                for (small_int_map_iter = tsmallintmap->begin(); 
+                        small_int_map_iter != tsmallintmap->end(); 
+                        ++small_int_map_iter) {
+                    writer.write(adapter->map_entry_open);
+                    writer.write_int(small_int_map_iter->first);
+                    writer.write(adapter->map_entry_mid);
+                    WriteSimpleValue(small_int_map_iter->second, writer, true);
+                    writer.write(adapter->map_entry_close);
+                }
+            }
+            break;
+        case TrackerSmallDoubleMap:
+            tsmalldoublemap = v->get_smalldoublemap();
+            if (adapter->map_entries) {
+                for (small_double_map_iter = tsmalldoublemap->begin(); 
+                        small_double_map_iter != tsmalldoublemap->end(); 
+                        ++small_double_map_iter) {
+                    writer.write(adapter->map_entry_open);
+                    writer.write_g(small_double_map_iter->first);
+                    writer.write(adapter->map_entry_mid);
+                    WriteSimpleValue(small_double_map_iter->second, writer, true);
+                    writer.write(adapter->map_entry_close);
                 }
             }
             break;
@@ -226,50 +286,52 @@ void XmlserializeAdapter::XmlSerialize(SharedTrackerElement v,
             break;
     }
 
-    stream << "</" << nstag << ">";
+    writer.write(adapter->close_tag);
 
+    v->post_serialize();
 }
 
-bool XmlserializeAdapter::StreamSimpleValue(SharedTrackerElement v, std::ostream &stream) {
+bool XmlserializeAdapter::WriteSimpleValue(const SharedTrackerElement& v, 
+        xml_writer &writer, bool in_attr) {
     switch (v->get_type()) {
         case TrackerString:
-            stream << SanitizeXML(GetTrackerValue<string>(v));
+            writer.write_sanitized(GetTrackerValue<string>(v), in_attr);
             break;
         case TrackerInt8:
-            stream << GetTrackerValue<int8_t>(v);
+            writer.write_int(GetTrackerValue<int8_t>(v));
             break;
         case TrackerUInt8:
-            stream << GetTrackerValue<uint8_t>(v);
+            writer.write_uint(GetTrackerValue<uint8_t>(v));
             break;
         case TrackerInt16:
-            stream << GetTrackerValue<int16_t>(v);
+            writer.write_int(GetTrackerValue<int16_t>(v));
             break;
         case TrackerUInt16:
-            stream << GetTrackerValue<uint16_t>(v);
+            writer.write_uint(GetTrackerValue<uint16_t>(v));
             break;
         case TrackerInt32:
-            stream << GetTrackerValue<int32_t>(v);
+            writer.write_int(GetTrackerValue<int32_t>(v));
             break;
         case TrackerUInt32:
-            stream << GetTrackerValue<uint32_t>(v);
+            writer.write_uint(GetTrackerValue<uint32_t>(v));
             break;
         case TrackerInt64:
-            stream << GetTrackerValue<int64_t>(v);
+            writer.write_int(GetTrackerValue<int64_t>(v));
             break;
         case TrackerUInt64:
-            stream << GetTrackerValue<uint64_t>(v);
+            writer.write_uint(GetTrackerValue<uint64_t>(v));
             break;
         case TrackerFloat:
-            stream << GetTrackerValue<float>(v);
+            writer.write_g(GetTrackerValue<float>(v));
             break;
         case TrackerDouble:
-            stream << GetTrackerValue<double>(v);
+            writer.write_g(GetTrackerValue<double>(v));
             break;
         case TrackerMac:
-            stream << GetTrackerValue<mac_addr>(v).MacFull2String();
+            writer.write(GetTrackerValue<mac_addr>(v).MacFull2String());
             break;
         case TrackerUuid:
-            stream << GetTrackerValue<uuid>(v).UUID2String();
+            writer.write(GetTrackerValue<uuid>(v).UUID2String());
             break;
         default:
             return false;
@@ -278,6 +340,70 @@ bool XmlserializeAdapter::StreamSimpleValue(SharedTrackerElement v, std::ostream
     return true;
 }
 
+void XmlserializeAdapter::CompileAdapter(Xmladapter *adapter) {
+    string nstag;
+
+    if (adapter->local_namespace != "") {
+        nstag = adapter->local_namespace + string(":") + adapter->xml_entity;
+    } else {
+        nstag = adapter->xml_entity;
+    }
+
+    std::stringstream stream;
+
+    stream << "<" << nstag;
+
+    if (adapter->xml_xsi_type != "")
+        stream << " xsi:type=\"" << adapter->xml_xsi_type << "\"";
+
+    if (adapter->namespace_location != "") {
+        stream << " xmlns:" << adapter->local_namespace << "=\"" 
+            << adapter->namespace_location << "\"";
+        // Automatically include the xsi definitions
+        stream << " xmlns:xs=\"http://www.w3.org/2001/XMLSchema\" "
+            << "xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\"";
+
+        stream << " xsi:schemaLocation=\"" << adapter->xsi_schema_location << "\"";
+    }
+    
+    stream << ">";
+
+    // Pack a schema tag if we need one
+    if (adapter->schema_import_vector.size() != 0) {
+        stream << "<xs:schema xmlns:xs=\"http://www.w3.org/2001/XMLSchema\""
+            << " xmlns=\"http://xmlns.myexample.com/version3\"";
+
+        for (unsigned int s = 0; s < adapter->schema_import_vector.size(); s++) {
+            Schemaimportlocation *sl = adapter->schema_import_vector[s];
+            stream << " xmlns:" 
+                << sl->ns << "=\"" << sl->nslocation << "\"";
+        }
+
+        stream << " targetNamespace=\"" << adapter->namespace_location << "\""
+            << " elementFormDefault=\"unqualified\""
+            << " attributeFromDefault=\"unqualified\">";
+        for (unsigned int s = 0; s < adapter->schema_import_vector.size(); s++) {
+            Schemaimportlocation *sl = adapter->schema_import_vector[s];
+
+            stream << "<xs:import namespace=\"" << sl->nslocation << "\"" <<
+                " schemaLocation=\"" << sl->url << "\" />";
+        }
+        stream << "</xs:schema>";
+    }
+
+    adapter->open_tag = stream.str();
+    adapter->close_tag = "</" + nstag + ">";
+
+    adapter->map_entry_open = "<" + adapter->map_entry_element + " " +
+        adapter->map_key_attribute + "=\"";
+    adapter->map_entry_mid = "\" " + adapter->map_value_attribute + "=\"";
+    adapter->map_entry_close = "\" />";
+
+    // Any field may now resolve differently
+    id_adapter_vec.clear();
+    id_resolved_vec.clear();
+}
+
 void XmlserializeAdapter::RegisterField(string in_field, string in_entity) {
     Xmladapter *adapter;
 
@@ -292,6 +418,8 @@ void XmlserializeAdapter::RegisterField(string in_field, string in_entity) {
 
     adapter->kis_field = in_field;
     adapter->xml_entity = in_entity;
+
+    CompileAdapter(adapter);
 }
 
 void XmlserializeAdapter::RegisterFieldAttr(string in_field, string in_path,
@@ -319,6 +447,8 @@ void XmlserializeAdapter::RegisterFieldXsitype(string in_field, string in_xsi) {
     adapter = mi->second;
 
     adapter->xml_xsi_type = in_xsi;
+
+    CompileAdapter(adapter);
 }
 
 void XmlserializeAdapter::RegisterMapField(string in_field, string in_entity, 
@@ -341,6 +471,8 @@ void XmlserializeAdapter::RegisterMapField(string in_field, string in_entity,
     adapter->map_entry_element = in_map_entity;
     adapter->map_key_attribute = in_map_key_attr;
     adapter->map_value_attribute = in_map_value_attr;
+
+    CompileAdapter(adapter);
 }
 
 void XmlserializeAdapter::RegisterFieldSchema(string in_field, string in_ns,
@@ -362,6 +494,8 @@ void XmlserializeAdapter::RegisterFieldSchema(string in_field, string in_ns,
     schema->url = in_url;
 
     adapter->schema_import_vector.push_back(schema);
+
+    CompileAdapter(adapter);
 }
 
 void XmlserializeAdapter::RegisterFieldNamespace(string in_field, string in_ns,
@@ -379,6 +513,8 @@ void XmlserializeAdapter::RegisterFieldNamespace(string in_field, string in_ns,
     adapter->local_namespace = in_ns;
     adapter->namespace_location = in_nsloc;
     adapter->xsi_schema_location = in_url;
+
+    CompileAdapter(adapter);
 }
 
 
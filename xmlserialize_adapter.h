@@ -34,6 +34,7 @@
 #include "trackedelement.h"
 #include "entrytracker.h"
 #include "devicetracker_component.h"
+#include "json_adapter.h"
 
 /* XML serialization
  *
@@ -54,6 +55,11 @@
  *  <frequency freq="1234" packets="5678"/>
  * </frequencies>
  *
+ * The tags of every field (the open tag with its attributes, namespaces, and
+ * schema block, the close tag, and the map entry fragments) are built once
+ * when the field is registered, and fields are matched to their records by
+ * id, so serializing a device only copies tags and values into the output.
+ *
  */
 
 class XmlserializeAdapter {
@@ -64,7 +70,7 @@ public:
 
     ~XmlserializeAdapter();
 
-    void XmlSerialize(SharedTrackerElement v, std::ostream &steam);
+    void XmlSerialize(const SharedTrackerElement& v, std::ostream &stream);
 
     void RegisterField(string in_field, string in_entity);
     void RegisterFieldAttr(string in_field, string in_path, string in_attr);
@@ -125,11 +131,44 @@ protected:
        
         // List of items to be included in the xs:schema tag
         vector<Schemaimportlocation *> schema_import_vector;
+
+        // Built by CompileAdapter whenever the record changes
+        string open_tag;
+        string close_tag;
+        string map_entry_open;
+        string map_entry_mid;
+        string map_entry_close;
     };
 
-    bool StreamSimpleValue(SharedTrackerElement v, std::ostream &stream);
+    // Buffered output with the XML value formats; text is escaped in a single
+    // pass as it is copied into the buffer
+    class xml_writer : public JsonAdapter::json_writer {
+    public:
+        xml_writer(std::ostream& in_stream) :
+            json_writer(in_stream) { }
+
+        // Same as the default ostream format of a double
+        void write_g(double v);
+
+        // Escape &, <, and >, and " as well when the text is an attribute
+        void write_sanitized(const string& in_str, bool in_attr);
+    };
+
+    void XmlSerialize(const SharedTrackerElement& v, xml_writer &writer);
+
+    bool WriteSimpleValue(const SharedTrackerElement& v, xml_writer &writer,
+            bool in_attr);
+
+    void CompileAdapter(Xmladapter *adapter);
+
+    // Record for a field id, resolved by name the first time the id is seen
+    Xmladapter *FetchAdapter(int in_id);
 
     map<string, Xmladapter *> field_adapter_map;
+
+    // Resolved records by field id; emptied whenever a field is registered
+    vector<Xmladapter *> id_adapter_vec;
+    vector<bool> id_resolved_vec;
 };
 
 #endif